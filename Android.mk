@@ -14,6 +14,11 @@
 
 LOCAL_PATH := $(call my-dir)
 
+# Set to true to build libkeymaster1 and libsoftkeymasterdevice with only the symmetric (AES, HMAC
+# and ChaCha20-Poly1305) key and operation factories, leaving out RSA, EC and Ed25519 keys,
+# attestation, the KEMs and the keymaster0/keymaster1 engines.  The tests need the full build.
+KEYMASTER_SYMMETRIC_ONLY ?= false
+
 ###
 # libkeymaster_messages contains just the code necessary to communicate with a
 # AndroidKeymaster implementation, e.g. one running in TrustZone.
@@ -23,6 +28,7 @@ LOCAL_MODULE:= libkeymaster_messages
 LOCAL_SRC_FILES:= \
 		android_keymaster_messages.cpp \
 		android_keymaster_utils.cpp \
+		async_logger.cpp \
 		authorization_set.cpp \
 		keymaster_tags.cpp \
 		logger.cpp \
@@ -30,6 +36,8 @@ LOCAL_SRC_FILES:= \
 LOCAL_C_INCLUDES := \
 	$(LOCAL_PATH)/include
 LOCAL_CFLAGS = -Wall -Werror -Wunused -DKEYMASTER_NAME_TAGS
+# Uncomment to count allocations for GetStatistics; see libkeymaster1.
+# LOCAL_CFLAGS += -DKEYMASTER_ALLOCATION_COUNTING
 LOCAL_CLANG := true
 # TODO(krasin): reenable coverage flags, when the new Clang toolchain is released.
 # Currently, if enabled, these flags will cause an internal error in Clang.
@@ -48,43 +56,86 @@ include $(BUILD_SHARED_LIBRARY)
 include $(CLEAR_VARS)
 LOCAL_MODULE:= libkeymaster1
 LOCAL_SRC_FILES:= \
+		access_count_log.cpp \
 		aes_key.cpp \
 		aes_operation.cpp \
 		android_keymaster.cpp \
 		android_keymaster_messages.cpp \
 		android_keymaster_utils.cpp \
-		asymmetric_key.cpp \
-		asymmetric_key_factory.cpp \
-		attestation_record.cpp \
+		async_keymaster.cpp \
+		attestation_signer.cpp \
 		auth_encrypted_key_blob.cpp \
-		ec_key.cpp \
-		ec_key_factory.cpp \
-		ecdsa_operation.cpp \
-		ecies_kem.cpp \
-		hkdf.cpp \
+		buffered_random.cpp \
+		chacha20_poly1305_key.cpp \
+		chacha20_poly1305_operation.cpp \
+		chunk_size_advisor.cpp \
 		hmac.cpp \
 		hmac_key.cpp \
 		hmac_operation.cpp \
+		imported_token_set.cpp \
 		integrity_assured_key_blob.cpp \
-		iso18033kdf.cpp \
-		kdf.cpp \
 		key.cpp \
+		key_policy.cpp \
+		key_warmer.cpp \
 		keymaster_enforcement.cpp \
-		nist_curve_key_exchange.cpp \
+		latency_statistics.cpp \
+		loaded_key_cache.cpp \
 		ocb.c \
 		ocb_utils.cpp \
 		openssl_err.cpp \
 		openssl_utils.cpp \
 		operation.cpp \
+		operation_pipeline.cpp \
+		operation_slab.cpp \
 		operation_table.cpp \
+		pinned_key_table.cpp \
+		request_scheduler.cpp \
+		secure_arena.cpp \
+		sha256_multibuffer.cpp \
+		symmetric_key.cpp \
+		tracer.cpp \
+		worker_pool.cpp
+ifneq ($(KEYMASTER_SYMMETRIC_ONLY),true)
+LOCAL_SRC_FILES += \
+		asymmetric_key.cpp \
+		asymmetric_key_factory.cpp \
+		attestation_bundle.cpp \
+		attestation_record.cpp \
+		compact_private_key.cpp \
+		digest_context_cache.cpp \
+		ec_key.cpp \
+		ec_key_factory.cpp \
+		ecdsa_operation.cpp \
+		ecies_kem.cpp \
+		ed25519_key.cpp \
+		ed25519_operation.cpp \
+		ephemeral_key_exchange_pool.cpp \
+		hkdf.cpp \
+		iso18033kdf.cpp \
+		kdf.cpp \
+		nist_curve_key_exchange.cpp \
+		precomputed_pair_queue.cpp \
+		pregenerated_key_pool.cpp \
 		rsa_key.cpp \
 		rsa_key_factory.cpp \
 		rsa_operation.cpp \
-		symmetric_key.cpp
+		verification_cache.cpp \
+		x25519_kem.cpp \
+		x25519_key_exchange.cpp
+endif
 LOCAL_C_INCLUDES := \
 	$(LOCAL_PATH)/include
 LOCAL_SHARED_LIBRARIES := libcrypto libkeymaster_messages
 LOCAL_CFLAGS = -Wall -Werror -Wunused
+# Uncomment to record per-command latency histograms, reported by GetStatistics.
+# LOCAL_CFLAGS += -DKEYMASTER_LATENCY_STATISTICS
+# Uncomment, here and in libkeymaster_messages, to add allocation counts to the histograms.
+# LOCAL_CFLAGS += -DKEYMASTER_ALLOCATION_COUNTING
+# Uncomment to count lock acquisitions and contention, reported by GetLockStatistics.
+# LOCAL_CFLAGS += -DKEYMASTER_LOCK_STATISTICS
+ifeq ($(KEYMASTER_SYMMETRIC_ONLY),true)
+LOCAL_CFLAGS += -DKEYMASTER_SYMMETRIC_ONLY
+endif
 LOCAL_CLANG := true
 LOCAL_CLANG_CFLAGS += -Wno-error=unused-const-variable -Wno-error=unused-private-field
 # TODO(krasin): reenable coverage flags, when the new Clang toolchain is released.
@@ -106,22 +157,36 @@ include $(BUILD_SHARED_LIBRARY)
 include $(CLEAR_VARS)
 LOCAL_MODULE := libsoftkeymasterdevice
 LOCAL_SRC_FILES := \
+	backend_cost_table.cpp \
+	keymaster_configuration.cpp \
+	request_trace.cpp \
+	shared_memory_transport.cpp \
+	soft_keymaster_context.cpp \
+	soft_keymaster_device.cpp \
+	soft_keymaster_logger.cpp \
+	soft_keymaster_tracer.cpp
+ifneq ($(KEYMASTER_SYMMETRIC_ONLY),true)
+LOCAL_SRC_FILES += \
 	ec_keymaster0_key.cpp \
 	ec_keymaster1_key.cpp \
 	ecdsa_keymaster1_operation.cpp \
+	hardware_public_key_cache.cpp \
 	keymaster0_engine.cpp \
 	keymaster1_engine.cpp \
-	keymaster_configuration.cpp \
+	keymaster1_request_queue.cpp \
 	rsa_keymaster0_key.cpp \
 	rsa_keymaster1_key.cpp \
-	rsa_keymaster1_operation.cpp \
-	soft_keymaster_context.cpp \
-	soft_keymaster_device.cpp \
-	soft_keymaster_logger.cpp
+	rsa_keymaster1_operation.cpp
+endif
 LOCAL_C_INCLUDES := \
 	system/security/keystore \
 	$(LOCAL_PATH)/include
 LOCAL_CFLAGS = -Wall -Werror -Wunused
+ifeq ($(KEYMASTER_SYMMETRIC_ONLY),true)
+# SoftKeymasterContext's layout depends on it, so users of the headers need it too.
+LOCAL_CFLAGS += -DKEYMASTER_SYMMETRIC_ONLY
+LOCAL_EXPORT_CFLAGS := -DKEYMASTER_SYMMETRIC_ONLY
+endif
 LOCAL_CLANG := true
 LOCAL_CLANG_CFLAGS += -Wno-error=unused-const-variable -Wno-error=unused-private-field
 # TODO(krasin): reenable coverage flags, when the new Clang toolchain is released.
@@ -149,18 +214,38 @@ include $(BUILD_STATIC_LIBRARY)
 include $(CLEAR_VARS)
 LOCAL_MODULE := keymaster_tests
 LOCAL_SRC_FILES := \
+	access_count_log_test.cpp \
 	android_keymaster_messages_test.cpp \
 	android_keymaster_test.cpp \
 	android_keymaster_test_utils.cpp \
+	async_keymaster_test.cpp \
+	async_logger_test.cpp \
+	attestation_bundle_test.cpp \
 	attestation_record_test.cpp \
 	authorization_set_test.cpp \
+	backend_cost_table_test.cpp \
+	buffered_random_test.cpp \
+	chunk_size_advisor_test.cpp \
+	compact_private_key_test.cpp \
 	hkdf_test.cpp \
 	hmac_test.cpp \
+	imported_token_set_test.cpp \
 	kdf1_test.cpp \
 	kdf2_test.cpp \
 	kdf_test.cpp \
 	key_blob_test.cpp \
-	keymaster_enforcement_test.cpp
+	keymaster_enforcement_test.cpp \
+	loaded_key_cache_test.cpp \
+	operation_pipeline_test.cpp \
+	operation_slab_test.cpp \
+	operation_table_test.cpp \
+	pinned_key_table_test.cpp \
+	pregenerated_key_pool_test.cpp \
+	request_scheduler_test.cpp \
+	request_trace_test.cpp \
+	secure_arena_test.cpp \
+	shared_memory_transport_test.cpp \
+	verification_cache_test.cpp
 
 LOCAL_C_INCLUDES := \
 	$(LOCAL_PATH)/include
@@ -179,3 +264,82 @@ LOCAL_SHARED_LIBRARIES := \
 	libsoftkeymaster
 LOCAL_ADDITIONAL_DEPENDENCIES := $(LOCAL_PATH)/Android.mk
 include $(BUILD_NATIVE_TEST)
+
+# Microbenchmarks for libkeymaster
+include $(CLEAR_VARS)
+LOCAL_MODULE := keymaster_benchmark
+LOCAL_SRC_FILES := \
+	kem_benchmark.cpp \
+	key_blob_benchmark.cpp \
+	keymaster_benchmark.cpp \
+	messages_benchmark.cpp
+LOCAL_C_INCLUDES := \
+	$(LOCAL_PATH)/include
+LOCAL_CFLAGS = -Wall -Werror -Wunused
+LOCAL_CLANG := true
+LOCAL_MODULE_TAGS := tests
+LOCAL_SHARED_LIBRARIES := \
+	libsoftkeymasterdevice \
+	libkeymaster_messages \
+	libkeymaster1 \
+	libcrypto \
+	libsoftkeymaster
+LOCAL_ADDITIONAL_DEPENDENCIES := $(LOCAL_PATH)/Android.mk
+include $(BUILD_NATIVE_BENCHMARK)
+
+# Reports the memory each kind of open operation holds
+include $(CLEAR_VARS)
+LOCAL_MODULE := keymaster_footprint
+LOCAL_SRC_FILES := \
+	keymaster_footprint.cpp
+LOCAL_C_INCLUDES := \
+	$(LOCAL_PATH)/include
+LOCAL_CFLAGS = -Wall -Werror -Wunused
+LOCAL_CLANG := true
+LOCAL_MODULE_TAGS := optional
+LOCAL_SHARED_LIBRARIES := \
+	libsoftkeymasterdevice \
+	libkeymaster_messages \
+	libkeymaster1 \
+	libcrypto \
+	libsoftkeymaster
+LOCAL_ADDITIONAL_DEPENDENCIES := $(LOCAL_PATH)/Android.mk
+include $(BUILD_EXECUTABLE)
+
+# Replays request traces recorded by RequestTraceWriter
+include $(CLEAR_VARS)
+LOCAL_MODULE := keymaster_replay
+LOCAL_SRC_FILES := \
+	keymaster_replay.cpp
+LOCAL_C_INCLUDES := \
+	$(LOCAL_PATH)/include
+LOCAL_CFLAGS = -Wall -Werror -Wunused
+LOCAL_CLANG := true
+LOCAL_MODULE_TAGS := optional
+LOCAL_SHARED_LIBRARIES := \
+	libsoftkeymasterdevice \
+	libkeymaster_messages \
+	libkeymaster1 \
+	libcrypto \
+	libsoftkeymaster
+LOCAL_ADDITIONAL_DEPENDENCIES := $(LOCAL_PATH)/Android.mk
+include $(BUILD_EXECUTABLE)
+
+# Multi-threaded stress test of SoftKeymasterDevice
+include $(CLEAR_VARS)
+LOCAL_MODULE := keymaster_stress
+LOCAL_SRC_FILES := \
+	keymaster_stress.cpp
+LOCAL_C_INCLUDES := \
+	$(LOCAL_PATH)/include
+LOCAL_CFLAGS = -Wall -Werror -Wunused
+LOCAL_CLANG := true
+LOCAL_MODULE_TAGS := optional
+LOCAL_SHARED_LIBRARIES := \
+	libsoftkeymasterdevice \
+	libkeymaster_messages \
+	libkeymaster1 \
+	libcrypto \
+	libsoftkeymaster
+LOCAL_ADDITIONAL_DEPENDENCIES := $(LOCAL_PATH)/Android.mk
+include $(BUILD_EXECUTABLE)
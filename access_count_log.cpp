@@ -0,0 +1,138 @@
+/*
+ * Copyright 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "access_count_log.h"
+
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <atomic>
+
+#include <keymaster/logger.h>
+
+namespace keymaster {
+
+static_assert(ATOMIC_INT_LOCK_FREE == 2, "record count must be lock-free to be shared");
+
+static const uint32_t kAccessCountLogMagic = 0x4b4d4143;  // "KMAC"
+static const uint32_t kAccessCountLogVersion = 1;
+
+const size_t AccessCountLog::kBootIdSize;
+
+struct AccessCountLog::Header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t capacity;
+    std::atomic<uint32_t> record_count;
+    char boot_id[kBootIdSize];
+};
+
+AccessCountLog::AccessCountLog(const char* path, uint32_t capacity, const char* boot_id)
+    : fd_(-1), capacity_(0), mapping_size_(0), header_(nullptr), records_(nullptr) {
+    if (capacity == 0 || strlen(boot_id) >= kBootIdSize)
+        return;
+
+    fd_ = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd_ < 0) {
+        LOG_E("Can't open access count log %s", path);
+        return;
+    }
+
+    size_t mapping_size = sizeof(Header) + static_cast<size_t>(capacity) * sizeof(Record);
+    struct stat st;
+    if (fstat(fd_, &st) != 0) {
+        LOG_E("Can't stat access count log %s", path);
+        return;
+    }
+    bool fresh = static_cast<size_t>(st.st_size) != mapping_size;
+    if (fresh && ftruncate(fd_, mapping_size) != 0) {
+        LOG_E("Can't size access count log %s", path);
+        return;
+    }
+
+    void* mapping = mmap(nullptr, mapping_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+    if (mapping == MAP_FAILED) {
+        LOG_E("Can't map access count log %s", path);
+        return;
+    }
+    mapping_size_ = mapping_size;
+    capacity_ = capacity;
+    header_ = static_cast<Header*>(mapping);
+    records_ = reinterpret_cast<Record*>(header_ + 1);
+
+    if (fresh || header_->magic != kAccessCountLogMagic ||
+        header_->version != kAccessCountLogVersion || header_->capacity != capacity ||
+        header_->record_count.load(std::memory_order_acquire) > capacity ||
+        strncmp(header_->boot_id, boot_id, kBootIdSize) != 0)
+        Reset(boot_id);
+}
+
+AccessCountLog::~AccessCountLog() {
+    if (header_)
+        munmap(header_, mapping_size_);
+    if (fd_ >= 0)
+        close(fd_);
+}
+
+void AccessCountLog::Reset(const char* boot_id) {
+    // Clear the magic first and set it last, so a crash part-way through leaves a header that the
+    // next open rejects and resets again.
+    header_->magic = 0;
+    std::atomic_thread_fence(std::memory_order_release);
+    header_->version = kAccessCountLogVersion;
+    header_->capacity = capacity_;
+    header_->record_count.store(0, std::memory_order_relaxed);
+    memset(header_->boot_id, 0, kBootIdSize);
+    strncpy(header_->boot_id, boot_id, kBootIdSize - 1);
+    std::atomic_thread_fence(std::memory_order_release);
+    header_->magic = kAccessCountLogMagic;
+}
+
+uint32_t AccessCountLog::size() const {
+    return header_ ? header_->record_count.load(std::memory_order_acquire) : 0;
+}
+
+AccessCountLog::Record* AccessCountLog::Append(uint64_t keyid, uint64_t count) {
+    if (!header_)
+        return nullptr;
+    uint32_t i = header_->record_count.load(std::memory_order_relaxed);
+    if (i >= capacity_)
+        return nullptr;
+    records_[i].keyid = keyid;
+    records_[i].count = count;
+    header_->record_count.store(i + 1, std::memory_order_release);
+    return &records_[i];
+}
+
+/* static */
+bool AccessCountLog::CurrentBootId(char* boot_id) {
+    int fd = open("/proc/sys/kernel/random/boot_id", O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+    ssize_t n = read(fd, boot_id, kBootIdSize - 1);
+    close(fd);
+    if (n <= 0)
+        return false;
+    while (n > 0 && (boot_id[n - 1] == '\n' || boot_id[n - 1] == '\0'))
+        --n;
+    boot_id[n] = '\0';
+    return n > 0;
+}
+
+}  // namespace keymaster
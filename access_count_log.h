@@ -0,0 +1,98 @@
+/*
+ * Copyright 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SYSTEM_KEYMASTER_ACCESS_COUNT_LOG_H_
+#define SYSTEM_KEYMASTER_ACCESS_COUNT_LOG_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace keymaster {
+
+/**
+ * A file-backed store for MAX_USES_PER_BOOT counts, so that a keymaster process that crashes or is
+ * restarted doesn't forget how often each key has been used this boot.
+ *
+ * The file is a header followed by a fixed array of capacity records, mapped MAP_SHARED.  Each key
+ * gets one record, appended the first time it's used; later uses update the record's count in
+ * place, so a use costs a single 8-byte store into the page cache and never a system call.  A
+ * record is published by bumping the header's record count only after it's filled in, so a crash
+ * part-way through an append loses that one use rather than corrupting the log.  Because the
+ * kernel owns the mapped pages, nothing written is lost when the process dies; only a kernel crash
+ * could lose writes, and that is a reboot, which resets the counts anyway.
+ *
+ * The header records the boot ID the log was written under.  Opening a log from an earlier boot,
+ * or one with a different capacity or a damaged header, starts it afresh.
+ *
+ * Not internally locked; the owner serializes access, as KeymasterEnforcement already does.
+ */
+class AccessCountLog {
+  public:
+    static const size_t kBootIdSize = 40;
+
+    struct Record {
+        uint64_t keyid;
+        uint64_t count;
+    };
+
+    /**
+     * Opens or creates the log at path, with room for capacity keys, for the boot identified by
+     * boot_id, a NUL-terminated string of fewer than kBootIdSize characters.  Check initialized()
+     * before use.
+     */
+    AccessCountLog(const char* path, uint32_t capacity, const char* boot_id);
+    ~AccessCountLog();
+
+    bool initialized() const { return header_ != nullptr; }
+    uint32_t capacity() const { return capacity_; }
+
+    /**
+     * Returns the number of records in the log.
+     */
+    uint32_t size() const;
+    Record* record(uint32_t i) { return &records_[i]; }
+
+    /**
+     * Appends a record for keyid with the given count and returns it, or returns null if the log
+     * is full.  Callers must not append a key that already has a record.
+     */
+    Record* Append(uint64_t keyid, uint64_t count);
+
+    /**
+     * Copies the kernel's boot ID into boot_id, which must hold kBootIdSize bytes.  Returns false
+     * if it can't be read.
+     */
+    static bool CurrentBootId(char* boot_id);
+
+  private:
+    struct Header;
+
+    void Reset(const char* boot_id);
+
+    int fd_;
+    uint32_t capacity_;
+    size_t mapping_size_;
+    Header* header_;
+    Record* records_;
+
+    // Disallow copying and assignment.
+    AccessCountLog(const AccessCountLog&);
+    void operator=(const AccessCountLog&);
+};
+
+}  // namespace keymaster
+
+#endif  // SYSTEM_KEYMASTER_ACCESS_COUNT_LOG_H_
@@ -0,0 +1,95 @@
+/*
+ * Copyright 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "access_count_log.h"
+
+#include <string.h>
+
+#include <gtest/gtest.h>
+
+#include "android_keymaster_test_utils.h"
+
+namespace keymaster {
+namespace test {
+
+class AccessCountLogTest : public testing::Test {
+  protected:
+    AccessCountLogTest() : file_("access_count_log_test") {}
+
+    TempFile file_;
+};
+
+TEST_F(AccessCountLogTest, AppendsUntilFull) {
+    AccessCountLog log(file_.path(), 2, "boot-a");
+    ASSERT_TRUE(log.initialized());
+    EXPECT_EQ(0U, log.size());
+
+    AccessCountLog::Record* record = log.Append(1, 1);
+    ASSERT_TRUE(record != nullptr);
+    EXPECT_EQ(1U, record->keyid);
+    EXPECT_EQ(1U, record->count);
+    ASSERT_TRUE(log.Append(2, 1) != nullptr);
+    EXPECT_EQ(2U, log.size());
+    EXPECT_TRUE(log.Append(3, 1) == nullptr);
+}
+
+TEST_F(AccessCountLogTest, PersistsAcrossReopen) {
+    {
+        AccessCountLog log(file_.path(), 4, "boot-a");
+        ASSERT_TRUE(log.initialized());
+        AccessCountLog::Record* record = log.Append(0x1234, 1);
+        ASSERT_TRUE(record != nullptr);
+        record->count = 7;
+        ASSERT_TRUE(log.Append(0x5678, 1) != nullptr);
+    }
+
+    AccessCountLog log(file_.path(), 4, "boot-a");
+    ASSERT_TRUE(log.initialized());
+    ASSERT_EQ(2U, log.size());
+    EXPECT_EQ(0x1234U, log.record(0)->keyid);
+    EXPECT_EQ(7U, log.record(0)->count);
+    EXPECT_EQ(0x5678U, log.record(1)->keyid);
+    EXPECT_EQ(1U, log.record(1)->count);
+}
+
+TEST_F(AccessCountLogTest, ResetsOnNewBootOrCapacity) {
+    {
+        AccessCountLog log(file_.path(), 4, "boot-a");
+        ASSERT_TRUE(log.initialized());
+        ASSERT_TRUE(log.Append(1, 3) != nullptr);
+    }
+    {
+        AccessCountLog log(file_.path(), 4, "boot-b");
+        ASSERT_TRUE(log.initialized());
+        EXPECT_EQ(0U, log.size());
+        ASSERT_TRUE(log.Append(1, 3) != nullptr);
+    }
+
+    AccessCountLog log(file_.path(), 8, "boot-b");
+    ASSERT_TRUE(log.initialized());
+    EXPECT_EQ(0U, log.size());
+}
+
+TEST(AccessCountLogBootIdTest, CurrentBootId) {
+    char boot_id[AccessCountLog::kBootIdSize];
+    if (!AccessCountLog::CurrentBootId(boot_id))
+        return;  // No /proc here.
+    EXPECT_GT(strlen(boot_id), 0U);
+    EXPECT_EQ(nullptr, strchr(boot_id, '\n'));
+}
+
+}  // namespace test
+}  // namespace keymaster
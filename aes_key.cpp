@@ -68,6 +68,21 @@ keymaster_error_t AesKeyFactory::LoadKey(const KeymasterKeyBlob& key_material,
     return error;
 }
 
+AesKey::AesKey(const KeymasterKeyBlob& key_material, const AuthorizationSet& hw_enforced,
+               const AuthorizationSet& sw_enforced, keymaster_error_t* error)
+    : SymmetricKey(key_material, hw_enforced, sw_enforced, error) {
+    if (*error != KM_ERROR_OK)
+        return;
+    context_pool_.reset(new (std::nothrow) AesCipherContextPool(key_data(), key_data_size()));
+    if (!context_pool_)
+        *error = KM_ERROR_MEMORY_ALLOCATION_FAILED;
+}
+
+size_t AesKey::material_bytes() const {
+    // The pool's idle cipher contexts come and go with operations, so only the pool is counted.
+    return SymmetricKey::material_bytes() + (context_pool_ ? sizeof(AesCipherContextPool) : 0);
+}
+
 keymaster_error_t AesKeyFactory::validate_algorithm_specific_new_key_params(
     const AuthorizationSet& key_description) const {
     if (key_description.Contains(TAG_BLOCK_MODE, KM_MODE_GCM)) {
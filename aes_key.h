@@ -17,12 +17,16 @@
 #ifndef SYSTEM_KEYMASTER_AES_KEY_H_
 #define SYSTEM_KEYMASTER_AES_KEY_H_
 
+#include <memory>
+
 #include <openssl/aes.h>
 
 #include "symmetric_key.h"
 
 namespace keymaster {
 
+class AesCipherContextPool;
+
 const size_t kMinGcmTagLength = 12 * 8;
 const size_t kMaxGcmTagLength = 16 * 8;
 
@@ -51,8 +55,20 @@ class AesKeyFactory : public SymmetricKeyFactory {
 class AesKey : public SymmetricKey {
   public:
     AesKey(const KeymasterKeyBlob& key_material, const AuthorizationSet& hw_enforced,
-           const AuthorizationSet& sw_enforced, keymaster_error_t* error)
-        : SymmetricKey(key_material, hw_enforced, sw_enforced, error) {}
+           const AuthorizationSet& sw_enforced, keymaster_error_t* error);
+
+    /**
+     * Cipher contexts already keyed with this key, shared with (and outliving, if need be) the
+     * key's operations.
+     */
+    const std::shared_ptr<AesCipherContextPool>& context_pool() const { return context_pool_; }
+
+  protected:
+    size_t object_size() const override { return sizeof(*this); }
+    size_t material_bytes() const override;
+
+  private:
+    std::shared_ptr<AesCipherContextPool> context_pool_;
 };
 
 }  // namespace keymaster
@@ -18,23 +18,34 @@
 
 #include <stdio.h>
 
+#include <atomic>
 #include <new>
 
 #include <UniquePtr.h>
 
 #include <openssl/aes.h>
 #include <openssl/err.h>
-#include <openssl/rand.h>
 
 #include <keymaster/logger.h>
 
 #include "aes_key.h"
+#include "buffered_random.h"
 #include "openssl_err.h"
+#include "worker_pool.h"
 
 namespace keymaster {
 
 static const size_t GCM_NONCE_SIZE = 12;
 
+WorkerPool* AesEvpOperation::parallel_pool_ = nullptr;
+size_t AesEvpOperation::min_parallel_length_ = 0;
+
+/* static */
+void AesEvpOperation::set_parallel_pool(WorkerPool* pool, size_t min_parallel_length) {
+    parallel_pool_ = pool;
+    min_parallel_length_ = min_parallel_length;
+}
+
 inline bool allows_padding(keymaster_block_mode_t block_mode) {
     switch (block_mode) {
     case KM_MODE_CTR:
@@ -79,9 +90,9 @@ Operation* AesOperationFactory::CreateOperation(const Key& key,
                                                 const AuthorizationSet& begin_params,
                                                 keymaster_error_t* error) {
     *error = KM_ERROR_OK;
-    const SymmetricKey* symmetric_key = static_cast<const SymmetricKey*>(&key);
+    const AesKey* aes_key = static_cast<const AesKey*>(&key);
 
-    switch (symmetric_key->key_data_size()) {
+    switch (aes_key->key_data_size()) {
     case 16:
     case 24:
     case 32:
@@ -129,14 +140,12 @@ Operation* AesOperationFactory::CreateOperation(const Key& key,
     Operation* op = nullptr;
     switch (purpose()) {
     case KM_PURPOSE_ENCRYPT:
-        op = new (std::nothrow)
-            AesEvpEncryptOperation(block_mode, padding, caller_nonce, tag_length,
-                                   symmetric_key->key_data(), symmetric_key->key_data_size());
+        op = new (std::nothrow) AesEvpEncryptOperation(block_mode, padding, caller_nonce,
+                                                       tag_length, aes_key->context_pool());
         break;
     case KM_PURPOSE_DECRYPT:
         op = new (std::nothrow)
-            AesEvpDecryptOperation(block_mode, padding, tag_length, symmetric_key->key_data(),
-                                   symmetric_key->key_data_size());
+            AesEvpDecryptOperation(block_mode, padding, tag_length, aes_key->context_pool());
         break;
     default:
         *error = KM_ERROR_UNSUPPORTED_PURPOSE;
@@ -164,29 +173,210 @@ AesOperationFactory::SupportedPaddingModes(size_t* padding_mode_count) const {
     return supported_padding_modes;
 }
 
-AesEvpOperation::AesEvpOperation(keymaster_purpose_t purpose, keymaster_block_mode_t block_mode,
-                                 keymaster_padding_t padding, bool caller_iv, size_t tag_length,
-                                 const uint8_t* key, size_t key_size)
-    : Operation(purpose), block_mode_(block_mode), caller_iv_(caller_iv), tag_length_(tag_length),
-      data_started_(false), key_size_(key_size), padding_(padding) {
+static keymaster_error_t GetAesCipher(keymaster_block_mode_t block_mode, size_t key_size,
+                                      const EVP_CIPHER** cipher) {
+    switch (block_mode) {
+    case KM_MODE_ECB:
+        switch (key_size) {
+        case 16:
+            *cipher = EVP_aes_128_ecb();
+            break;
+        case 24:
+            *cipher = EVP_aes_192_ecb();
+            break;
+        case 32:
+            *cipher = EVP_aes_256_ecb();
+            break;
+        default:
+            return KM_ERROR_UNSUPPORTED_KEY_SIZE;
+        }
+        break;
+    case KM_MODE_CBC:
+        switch (key_size) {
+        case 16:
+            *cipher = EVP_aes_128_cbc();
+            break;
+        case 24:
+            *cipher = EVP_aes_192_cbc();
+            break;
+        case 32:
+            *cipher = EVP_aes_256_cbc();
+            break;
+        default:
+            return KM_ERROR_UNSUPPORTED_KEY_SIZE;
+        }
+        break;
+    case KM_MODE_CTR:
+        switch (key_size) {
+        case 16:
+            *cipher = EVP_aes_128_ctr();
+            break;
+        case 24:
+            *cipher = EVP_aes_192_ctr();
+            break;
+        case 32:
+            *cipher = EVP_aes_256_ctr();
+            break;
+        default:
+            return KM_ERROR_UNSUPPORTED_KEY_SIZE;
+        }
+        break;
+    case KM_MODE_GCM:
+        switch (key_size) {
+        case 16:
+            *cipher = EVP_aes_128_gcm();
+            break;
+        case 24:
+            *cipher = EVP_aes_192_gcm();
+            break;
+        case 32:
+            *cipher = EVP_aes_256_gcm();
+            break;
+        default:
+            return KM_ERROR_UNSUPPORTED_KEY_SIZE;
+        }
+        break;
+    default:
+        return KM_ERROR_UNSUPPORTED_BLOCK_MODE;
+    }
+    return KM_ERROR_OK;
+}
+
+AesCipherContextPool::AesCipherContextPool(const uint8_t* key, size_t key_size)
+    : key_size_(key_size <= MAX_EVP_KEY_SIZE ? key_size : 0) {
     memcpy(key_, key, key_size_);
-    EVP_CIPHER_CTX_init(&ctx_);
+    for (size_t i = 0; i < kGcmTagLengthCount; ++i)
+        gcm_seal_initialized_[i] = false;
+}
+
+AesCipherContextPool::~AesCipherContextPool() {
+    for (auto& mode_contexts : idle_)
+        for (auto& contexts : mode_contexts)
+            for (EVP_CIPHER_CTX* ctx : contexts)
+                EVP_CIPHER_CTX_free(ctx);
+    for (size_t i = 0; i < kGcmTagLengthCount; ++i)
+        if (gcm_seal_initialized_[i])
+            EVP_AEAD_CTX_cleanup(&gcm_seal_[i]);
+    memset_s(key_, 0, sizeof(key_));
+}
+
+std::vector<EVP_CIPHER_CTX*>* AesCipherContextPool::IdleContexts(keymaster_block_mode_t block_mode,
+                                                                 bool encrypt) {
+    size_t mode_index;
+    switch (block_mode) {
+    case KM_MODE_ECB:
+        mode_index = 0;
+        break;
+    case KM_MODE_CBC:
+        mode_index = 1;
+        break;
+    case KM_MODE_CTR:
+        mode_index = 2;
+        break;
+    case KM_MODE_GCM:
+        mode_index = 3;
+        break;
+    default:
+        return nullptr;
+    }
+    return &idle_[mode_index][encrypt ? 1 : 0];
 }
 
+EVP_CIPHER_CTX* AesCipherContextPool::Take(keymaster_block_mode_t block_mode, bool encrypt,
+                                           keymaster_error_t* error) {
+    const EVP_CIPHER* cipher;
+    *error = GetAesCipher(block_mode, key_size_, &cipher);
+    if (*error != KM_ERROR_OK)
+        return nullptr;
+
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        std::vector<EVP_CIPHER_CTX*>* idle = IdleContexts(block_mode, encrypt);
+        if (!idle->empty()) {
+            EVP_CIPHER_CTX* ctx = idle->back();
+            idle->pop_back();
+            return ctx;
+        }
+    }
+
+    EVP_CIPHER_CTX* ctx = EVP_CIPHER_CTX_new();
+    if (!ctx) {
+        *error = KM_ERROR_MEMORY_ALLOCATION_FAILED;
+        return nullptr;
+    }
+    if (!EVP_CipherInit_ex(ctx, cipher, nullptr /* engine */, key_, nullptr /* iv */,
+                           encrypt ? 1 : 0)) {
+        EVP_CIPHER_CTX_free(ctx);
+        *error = TranslateLastOpenSslError();
+        return nullptr;
+    }
+    return ctx;
+}
+
+void AesCipherContextPool::Return(keymaster_block_mode_t block_mode, bool encrypt,
+                                  EVP_CIPHER_CTX* ctx) {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        std::vector<EVP_CIPHER_CTX*>* idle = IdleContexts(block_mode, encrypt);
+        if (idle && idle->size() < kMaxIdlePerMode) {
+            idle->push_back(ctx);
+            return;
+        }
+    }
+    EVP_CIPHER_CTX_free(ctx);
+}
+
+const EVP_AEAD_CTX* AesCipherContextPool::GcmSealContext(size_t tag_length) {
+    const EVP_AEAD* aead;
+    switch (key_size_) {
+    case 16:
+        aead = EVP_aead_aes_128_gcm();
+        break;
+    case 32:
+        aead = EVP_aead_aes_256_gcm();
+        break;
+    default:
+        // There's no 192-bit AES-GCM AEAD, so those keys always stream.
+        return nullptr;
+    }
+    if (tag_length < kMinGcmTagLength / 8 || tag_length > kMaxGcmTagLength / 8)
+        return nullptr;
+
+    size_t index = tag_length - kMinGcmTagLength / 8;
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!gcm_seal_initialized_[index]) {
+        if (!EVP_AEAD_CTX_init(&gcm_seal_[index], aead, key_, key_size_, tag_length,
+                               nullptr /* engine */))
+            return nullptr;
+        gcm_seal_initialized_[index] = true;
+    }
+    return &gcm_seal_[index];
+}
+
+size_t AesCipherContextPool::idle_count() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    size_t count = 0;
+    for (auto& mode_contexts : idle_)
+        for (auto& contexts : mode_contexts)
+            count += contexts.size();
+    return count;
+}
+
+AesEvpOperation::AesEvpOperation(keymaster_purpose_t purpose, keymaster_block_mode_t block_mode,
+                                 keymaster_padding_t padding, bool caller_iv, size_t tag_length,
+                                 const std::shared_ptr<AesCipherContextPool>& context_pool)
+    : Operation(purpose), block_mode_(block_mode), ctx_(nullptr), caller_iv_(caller_iv),
+      tag_length_(tag_length), aad_block_buf_length_(0), data_length_(0), data_started_(false),
+      padding_(padding), context_pool_(context_pool) {}
+
 AesEvpOperation::~AesEvpOperation() {
-    EVP_CIPHER_CTX_cleanup(&ctx_);
-    memset_s(aad_block_buf_.get(), AES_BLOCK_SIZE, 0);
+    if (ctx_)
+        context_pool_->Return(block_mode_, purpose() == KM_PURPOSE_ENCRYPT, ctx_);
+    memset_s(aad_block_buf_, AES_BLOCK_SIZE, 0);
 }
 
 keymaster_error_t AesEvpOperation::Begin(const AuthorizationSet& /* input_params */,
                                          AuthorizationSet* /* output_params */) {
-    if (block_mode_ == KM_MODE_GCM) {
-        aad_block_buf_length_ = 0;
-        aad_block_buf_.reset(new (std::nothrow) uint8_t[AES_BLOCK_SIZE]);
-        if (!aad_block_buf_.get())
-            return KM_ERROR_MEMORY_ALLOCATION_FAILED;
-    }
-
     return InitializeCipher();
 }
 
@@ -225,7 +415,7 @@ keymaster_error_t AesEvpOperation::Finish(const AuthorizationSet& additional_par
         return error;
 
     int output_written = -1;
-    if (!EVP_CipherFinal_ex(&ctx_, output->peek_write(), &output_written)) {
+    if (!EVP_CipherFinal_ex(ctx_, output->peek_write(), &output_written)) {
         if (tag_length_ > 0)
             return KM_ERROR_VERIFICATION_FAILED;
         LOG_E("Error encrypting final block: %s", ERR_error_string(ERR_peek_last_error(), NULL));
@@ -254,93 +444,33 @@ bool AesEvpOperation::need_iv() const {
 }
 
 keymaster_error_t AesEvpOperation::InitializeCipher() {
-    const EVP_CIPHER* cipher;
-    switch (block_mode_) {
-    case KM_MODE_ECB:
-        switch (key_size_) {
-        case 16:
-            cipher = EVP_aes_128_ecb();
-            break;
-        case 24:
-            cipher = EVP_aes_192_ecb();
-            break;
-        case 32:
-            cipher = EVP_aes_256_ecb();
-            break;
-        default:
-            return KM_ERROR_UNSUPPORTED_KEY_SIZE;
-        }
-        break;
-    case KM_MODE_CBC:
-        switch (key_size_) {
-        case 16:
-            cipher = EVP_aes_128_cbc();
-            break;
-        case 24:
-            cipher = EVP_aes_192_cbc();
-            break;
-        case 32:
-            cipher = EVP_aes_256_cbc();
-            break;
-        default:
-            return KM_ERROR_UNSUPPORTED_KEY_SIZE;
-        }
-        break;
-    case KM_MODE_CTR:
-        switch (key_size_) {
-        case 16:
-            cipher = EVP_aes_128_ctr();
-            break;
-        case 24:
-            cipher = EVP_aes_192_ctr();
-            break;
-        case 32:
-            cipher = EVP_aes_256_ctr();
-            break;
-        default:
-            return KM_ERROR_UNSUPPORTED_KEY_SIZE;
-        }
-        break;
-    case KM_MODE_GCM:
-        switch (key_size_) {
-        case 16:
-            cipher = EVP_aes_128_gcm();
-            break;
-        case 24:
-            cipher = EVP_aes_192_gcm();
-            break;
-        case 32:
-            cipher = EVP_aes_256_gcm();
-            break;
-        default:
-            return KM_ERROR_UNSUPPORTED_KEY_SIZE;
-        }
-        break;
-    default:
-        return KM_ERROR_UNSUPPORTED_BLOCK_MODE;
+    if (!ctx_) {
+        keymaster_error_t error;
+        ctx_ = context_pool_->Take(block_mode_, purpose() == KM_PURPOSE_ENCRYPT, &error);
+        if (!ctx_)
+            return error;
     }
 
-    if (!EVP_CipherInit_ex(&ctx_, cipher, NULL /* engine */, key_, iv_.get(), evp_encrypt_mode()))
+    // The context is already keyed; this sets the IV and clears anything left from its last use.
+    if (!EVP_CipherInit_ex(ctx_, nullptr /* cipher */, nullptr /* engine */, nullptr /* key */,
+                           need_iv() ? iv_ : nullptr, -1 /* keep direction */))
         return TranslateLastOpenSslError();
 
+    data_length_ = 0;
+
+    // Pooled contexts may have been used with other padding, so always set it.
     switch (padding_) {
     case KM_PAD_NONE:
-        EVP_CIPHER_CTX_set_padding(&ctx_, 0 /* disable padding */);
+        EVP_CIPHER_CTX_set_padding(ctx_, 0 /* disable padding */);
         break;
     case KM_PAD_PKCS7:
-        // This is the default for OpenSSL EVP cipher operations.
+        EVP_CIPHER_CTX_set_padding(ctx_, 1 /* enable padding */);
         break;
     default:
         return KM_ERROR_UNSUPPORTED_PADDING_MODE;
     }
 
-    if (block_mode_ == KM_MODE_GCM) {
-        aad_block_buf_length_ = 0;
-        aad_block_buf_.reset(new (std::nothrow) uint8_t[AES_BLOCK_SIZE]);
-        if (!aad_block_buf_.get())
-            return KM_ERROR_MEMORY_ALLOCATION_FAILED;
-    }
-
+    aad_block_buf_length_ = 0;
     return KM_ERROR_OK;
 }
 
@@ -360,9 +490,7 @@ keymaster_error_t AesEvpOperation::GetIv(const AuthorizationSet& input_params) {
               iv_blob.data_length);
         return KM_ERROR_INVALID_NONCE;
     }
-    iv_.reset(dup_array(iv_blob.data, iv_blob.data_length));
-    if (!iv_.get())
-        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    memcpy(iv_, iv_blob.data, iv_blob.data_length);
     iv_length_ = iv_blob.data_length;
     return KM_ERROR_OK;
 }
@@ -380,27 +508,8 @@ bool AesEvpOperation::HandleAad(const AuthorizationSet& input_params, const Buff
     assert(error);
 
     keymaster_blob_t aad;
-    if (input_params.GetTagValue(TAG_ASSOCIATED_DATA, &aad)) {
-        if (data_started_) {
-            *error = KM_ERROR_INVALID_TAG;
-            return false;
-        }
-
-        if (aad_block_buf_length_ > 0) {
-            FillBufferedAadBlock(&aad);
-            if (aad_block_buf_length_ == AES_BLOCK_SIZE && !ProcessBufferedAadBlock(error))
-                return false;
-        }
-
-        size_t blocks_to_process = aad.data_length / AES_BLOCK_SIZE;
-        if (blocks_to_process && !ProcessAadBlocks(aad.data, blocks_to_process, error))
-            return false;
-        aad.data += blocks_to_process * AES_BLOCK_SIZE;
-        aad.data_length -= blocks_to_process * AES_BLOCK_SIZE;
-
-        FillBufferedAadBlock(&aad);
-        assert(aad.data_length == 0);
-    }
+    if (input_params.GetTagValue(TAG_ASSOCIATED_DATA, &aad) && !ProcessAad(aad, error))
+        return false;
 
     if (input.available_read()) {
         data_started_ = true;
@@ -412,9 +521,42 @@ bool AesEvpOperation::HandleAad(const AuthorizationSet& input_params, const Buff
     return true;
 }
 
+bool AesEvpOperation::ProcessAad(keymaster_blob_t aad, keymaster_error_t* error) {
+    if (data_started_) {
+        *error = KM_ERROR_INVALID_TAG;
+        return false;
+    }
+
+    if (aad_block_buf_length_ > 0) {
+        FillBufferedAadBlock(&aad);
+        if (aad_block_buf_length_ == AES_BLOCK_SIZE && !ProcessBufferedAadBlock(error))
+            return false;
+    }
+
+    size_t blocks_to_process = aad.data_length / AES_BLOCK_SIZE;
+    if (blocks_to_process && !ProcessAadBlocks(aad.data, blocks_to_process, error))
+        return false;
+    aad.data += blocks_to_process * AES_BLOCK_SIZE;
+    aad.data_length -= blocks_to_process * AES_BLOCK_SIZE;
+
+    FillBufferedAadBlock(&aad);
+    assert(aad.data_length == 0);
+    return true;
+}
+
+keymaster_error_t AesEvpOperation::UpdateAad(const uint8_t* aad, size_t aad_length) {
+    if (block_mode_ != KM_MODE_GCM)
+        return KM_ERROR_INVALID_TAG;
+
+    // Only a trailing partial block is copied; whole blocks go straight from aad to the cipher.
+    keymaster_error_t error = KM_ERROR_OK;
+    ProcessAad({aad, aad_length}, &error);
+    return error;
+}
+
 bool AesEvpOperation::ProcessBufferedAadBlock(keymaster_error_t* error) {
     int output_written;
-    if (EVP_CipherUpdate(&ctx_, nullptr /* out */, &output_written, aad_block_buf_.get(),
+    if (EVP_CipherUpdate(ctx_, nullptr /* out */, &output_written, aad_block_buf_,
                          aad_block_buf_length_)) {
         aad_block_buf_length_ = 0;
         return true;
@@ -426,7 +568,7 @@ bool AesEvpOperation::ProcessBufferedAadBlock(keymaster_error_t* error) {
 bool AesEvpOperation::ProcessAadBlocks(const uint8_t* data, size_t blocks,
                                        keymaster_error_t* error) {
     int output_written;
-    if (EVP_CipherUpdate(&ctx_, nullptr /* out */, &output_written, data, blocks * AES_BLOCK_SIZE))
+    if (EVP_CipherUpdate(ctx_, nullptr /* out */, &output_written, data, blocks * AES_BLOCK_SIZE))
         return true;
     *error = TranslateLastOpenSslError();
     return false;
@@ -438,7 +580,7 @@ inline size_t min(size_t a, size_t b) {
 
 void AesEvpOperation::FillBufferedAadBlock(keymaster_blob_t* aad) {
     size_t to_buffer = min(AES_BLOCK_SIZE - aad_block_buf_length_, aad->data_length);
-    memcpy(aad_block_buf_.get() + aad_block_buf_length_, aad->data, to_buffer);
+    memcpy(aad_block_buf_ + aad_block_buf_length_, aad->data, to_buffer);
     aad->data += to_buffer;
     aad->data_length -= to_buffer;
     aad_block_buf_length_ += to_buffer;
@@ -457,14 +599,269 @@ bool AesEvpOperation::InternalUpdate(const uint8_t* input, size_t input_length,
         return false;
     }
 
+    size_t parallel_length = ParallelLength(input_length);
+    if (parallel_length > 0) {
+        size_t parallel_output_length;
+        if (!ParallelUpdate(input, parallel_length, output->peek_write(), &parallel_output_length,
+                            error))
+            return false;
+        RecordCiphertext(input, parallel_length, output->peek_write(), parallel_output_length);
+        output->advance_write(parallel_output_length);
+        data_length_ += parallel_length;
+        input += parallel_length;
+        input_length -= parallel_length;
+        if (!input_length)
+            return true;
+    }
+
     int output_written = -1;
-    if (!EVP_CipherUpdate(&ctx_, output->peek_write(), &output_written, input, input_length)) {
+    if (!EVP_CipherUpdate(ctx_, output->peek_write(), &output_written, input, input_length)) {
         *error = TranslateLastOpenSslError();
         return false;
     }
+    data_length_ += input_length;
+    RecordCiphertext(input, input_length, output->peek_write(), output_written);
     return output->advance_write(output_written);
 }
 
+bool AesEvpOperation::holds_back_final_block() const {
+    return purpose() == KM_PURPOSE_DECRYPT && padding_ == KM_PAD_PKCS7;
+}
+
+void AesEvpOperation::RecordCiphertext(const uint8_t* input, size_t input_length,
+                                       const uint8_t* output, size_t output_length) {
+    if (purpose() == KM_PURPOSE_ENCRYPT) {
+        if (block_mode_ != KM_MODE_CBC)
+            return;
+        input = output;
+        input_length = output_length;
+    }
+    const size_t kKept = sizeof(last_ciphertext_);
+    if (input_length >= kKept) {
+        memcpy(last_ciphertext_, input + input_length - kKept, kKept);
+        return;
+    }
+    memmove(last_ciphertext_, last_ciphertext_ + input_length, kKept - input_length);
+    memcpy(last_ciphertext_ + kKept - input_length, input, input_length);
+}
+
+size_t AesEvpOperation::preferred_chunk_size() const {
+    if (parallel_pool_ && min_parallel_length_ > kPreferredChunkSize)
+        return min_parallel_length_;
+    return kPreferredChunkSize;
+}
+
+size_t AesEvpOperation::ParallelLength(size_t input_length) const {
+    // Segments must start on block boundaries, with nothing left over in ctx_ from earlier data.
+    if (!parallel_pool_ || input_length < min_parallel_length_ ||
+        data_length_ % AES_BLOCK_SIZE != 0)
+        return 0;
+
+    switch (block_mode_) {
+    case KM_MODE_CTR:
+    case KM_MODE_ECB:
+        break;
+    case KM_MODE_CBC:
+        // Decrypting a CBC block needs only it and the ciphertext block before it, but encrypting
+        // one needs the output for the block before it.
+        if (purpose() == KM_PURPOSE_ENCRYPT)
+            return 0;
+        break;
+    default:
+        return 0;
+    }
+
+    size_t length = input_length - input_length % AES_BLOCK_SIZE;
+    // The last block is held back for Finish, so there must be another to process.
+    if (holds_back_final_block() && length < 2 * AES_BLOCK_SIZE)
+        return 0;
+    return length;
+}
+
+// Adds blocks to the big-endian 128-bit counter at ctr, as CTR mode increments it.
+static void AddToCounter(uint8_t* ctr, uint64_t blocks) {
+    for (int i = AES_BLOCK_SIZE - 1; i >= 0 && blocks; --i) {
+        uint64_t sum = ctr[i] + (blocks & 0xff);
+        ctr[i] = static_cast<uint8_t>(sum);
+        blocks = (blocks >> 8) + (sum >> 8);
+    }
+}
+
+const uint8_t* AesEvpOperation::ChainedIv(const uint8_t* input, size_t block,
+                                          uint8_t* counter) const {
+    switch (block_mode_) {
+    case KM_MODE_CTR:
+        memcpy(counter, iv_, AES_BLOCK_SIZE);
+        AddToCounter(counter, data_length_ / AES_BLOCK_SIZE + block);
+        return counter;
+    case KM_MODE_CBC:
+        if (block > 0)
+            return input + (block - 1) * AES_BLOCK_SIZE;
+        return data_length_ > 0 ? last_ciphertext_ + AES_BLOCK_SIZE : iv_;
+    default:
+        return nullptr;
+    }
+}
+
+bool AesEvpOperation::ParallelUpdate(const uint8_t* input, size_t input_length, uint8_t* output,
+                                     size_t* output_length, keymaster_error_t* error) {
+    const bool encrypt = purpose() == KM_PURPOSE_ENCRYPT;
+    const bool hold_back = holds_back_final_block();
+    // Decrypting with padding, ctx_ holds back the last block it has seen until it knows whether
+    // it's the final one.  That block is decrypted here instead, and the last block of input is
+    // held back in its place.
+    const bool held = hold_back && data_length_ > 0;
+    const size_t blocks = input_length / AES_BLOCK_SIZE - (hold_back ? 1 : 0);
+    *output_length = 0;
+
+    if (held) {
+        const uint8_t* held_block = last_ciphertext_ + AES_BLOCK_SIZE;
+        const uint8_t* held_iv = data_length_ > AES_BLOCK_SIZE ? last_ciphertext_ : iv_;
+        int output_written = -1;
+        if (!EVP_CipherInit_ex(ctx_, nullptr /* cipher */, nullptr /* engine */, nullptr /* key */,
+                               need_iv() ? held_iv : nullptr, -1 /* keep direction */) ||
+            !EVP_CIPHER_CTX_set_padding(ctx_, 0 /* disable padding */) ||
+            !EVP_CipherUpdate(ctx_, output, &output_written, held_block, AES_BLOCK_SIZE)) {
+            *error = TranslateLastOpenSslError();
+            return false;
+        }
+        output += output_written;
+        *output_length += output_written;
+    }
+
+    size_t segments = min(parallel_pool_->thread_count() + 1, blocks);
+    const size_t segment_blocks = (blocks + segments - 1) / segments;
+    segments = (blocks + segment_blocks - 1) / segment_blocks;
+    const size_t parallel_length = blocks * AES_BLOCK_SIZE;
+
+    std::atomic<int> failure(KM_ERROR_OK);
+    parallel_pool_->ParallelFor(segments, [&](size_t segment) {
+        const size_t start = segment * segment_blocks * AES_BLOCK_SIZE;
+        const size_t length = min(segment_blocks * AES_BLOCK_SIZE, parallel_length - start);
+
+        keymaster_error_t segment_error;
+        EVP_CIPHER_CTX* ctx = context_pool_->Take(block_mode_, encrypt, &segment_error);
+        if (!ctx) {
+            failure.store(segment_error);
+            return;
+        }
+        uint8_t counter[AES_BLOCK_SIZE];
+        int output_written = -1;
+        if (!EVP_CipherInit_ex(ctx, nullptr /* cipher */, nullptr /* engine */, nullptr /* key */,
+                               ChainedIv(input, start / AES_BLOCK_SIZE, counter),
+                               -1 /* keep direction */) ||
+            !EVP_CIPHER_CTX_set_padding(ctx, 0 /* disable padding */) ||
+            !EVP_CipherUpdate(ctx, output + start, &output_written, input + start, length))
+            failure.store(TranslateLastOpenSslError());
+        else if (static_cast<size_t>(output_written) != length)
+            failure.store(KM_ERROR_UNKNOWN_ERROR);
+        context_pool_->Return(block_mode_, encrypt, ctx);
+    });
+    if (failure.load() != KM_ERROR_OK) {
+        *error = static_cast<keymaster_error_t>(failure.load());
+        return false;
+    }
+    *output_length += parallel_length;
+
+    if (block_mode_ == KM_MODE_ECB && !hold_back)
+        return true;
+
+    // Leave ctx_ where it would be after the segments' blocks, and give it the held-back one.
+    uint8_t counter[AES_BLOCK_SIZE];
+    int output_written = -1;
+    if (!EVP_CipherInit_ex(ctx_, nullptr /* cipher */, nullptr /* engine */, nullptr /* key */,
+                           ChainedIv(input, blocks, counter), -1 /* keep direction */) ||
+        !EVP_CIPHER_CTX_set_padding(ctx_, padding_ == KM_PAD_PKCS7) ||
+        (hold_back && !EVP_CipherUpdate(ctx_, output + parallel_length, &output_written,
+                                        input + parallel_length, AES_BLOCK_SIZE))) {
+        *error = TranslateLastOpenSslError();
+        return false;
+    }
+    assert(!hold_back || output_written == 0);
+    return true;
+}
+
+keymaster_error_t AesEvpOperation::Checkpoint(AuthorizationSet* begin_params,
+                                              Buffer* state) const {
+    if (block_mode_ == KM_MODE_GCM)
+        return KM_ERROR_UNIMPLEMENTED;
+    // Only CTR, a stream cipher, can be picked up in the middle of a block; a partial ECB or CBC
+    // block is buffered in ctx_.
+    if (block_mode_ != KM_MODE_CTR && data_length_ % AES_BLOCK_SIZE != 0)
+        return KM_ERROR_INVALID_INPUT_LENGTH;
+
+    AuthorizationSet params;
+    if (!params.push_back(TAG_BLOCK_MODE, block_mode_) || !params.push_back(TAG_PADDING, padding_))
+        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+
+    static const uint8_t kNoIv[AES_BLOCK_SIZE] = {};
+    uint8_t serialized[kStateSize];
+    uint8_t* buf = serialized;
+    const uint8_t* end = serialized + sizeof(serialized);
+    buf = append_to_buf(buf, end, need_iv() ? iv_ : kNoIv, AES_BLOCK_SIZE);
+    buf = append_uint64_to_buf(buf, end, data_length_);
+    // last_ciphertext_ means nothing until there's data.
+    size_t ciphertext_length = data_length_ > 0 ? sizeof(last_ciphertext_) : 0;
+    buf = append_to_buf(buf, end, last_ciphertext_, ciphertext_length);
+    memset(buf, 0, end - buf);
+    bool ok = state->Reinitialize(serialized, sizeof(serialized));
+    memset_s(serialized, 0, sizeof(serialized));
+    if (!ok || !begin_params->push_back(params))
+        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    return KM_ERROR_OK;
+}
+
+keymaster_error_t AesEvpOperation::Restore(const Buffer& state) {
+    if (block_mode_ == KM_MODE_GCM)
+        return KM_ERROR_UNIMPLEMENTED;
+
+    const uint8_t* buf = state.peek_read();
+    const uint8_t* end = state.end();
+    uint64_t data_length;
+    if (state.available_read() != kStateSize || !copy_from_buf(&buf, end, iv_, AES_BLOCK_SIZE) ||
+        !copy_uint64_from_buf(&buf, end, &data_length) ||
+        (block_mode_ != KM_MODE_CTR && data_length % AES_BLOCK_SIZE != 0) ||
+        !copy_from_buf(&buf, end, last_ciphertext_, sizeof(last_ciphertext_)))
+        return KM_ERROR_INVALID_ARGUMENT;
+    iv_length_ = AES_BLOCK_SIZE;
+
+    keymaster_error_t error = InitializeCipher();
+    if (error != KM_ERROR_OK || data_length == 0)
+        return error;
+    data_length_ = data_length;
+
+    // Set ctx_ up as it was, as ParallelUpdate does after its segments: at the block the data
+    // reached, and holding the last block back if it would have.
+    uint8_t counter[AES_BLOCK_SIZE];
+    const bool hold_back = holds_back_final_block();
+    const uint8_t* iv;
+    if (hold_back)
+        iv = need_iv() ? (data_length_ > AES_BLOCK_SIZE ? last_ciphertext_ : iv_) : nullptr;
+    else
+        iv = ChainedIv(nullptr /* input */, 0 /* block */, counter);
+    if (!EVP_CipherInit_ex(ctx_, nullptr /* cipher */, nullptr /* engine */, nullptr /* key */,
+                           iv, -1 /* keep direction */) ||
+        !EVP_CIPHER_CTX_set_padding(ctx_, padding_ == KM_PAD_PKCS7))
+        return TranslateLastOpenSslError();
+
+    uint8_t scratch[AES_BLOCK_SIZE];
+    int output_written = -1;
+    size_t partial = data_length_ % AES_BLOCK_SIZE;
+    if (hold_back) {
+        // The held-back block produces no output until more data or Finish arrives.
+        if (!EVP_CipherUpdate(ctx_, scratch, &output_written, last_ciphertext_ + AES_BLOCK_SIZE,
+                              AES_BLOCK_SIZE))
+            return TranslateLastOpenSslError();
+    } else if (partial > 0) {
+        // Only CTR gets here.  Use up the keystream the data took from its last block.
+        memset(scratch, 0, sizeof(scratch));
+        if (!EVP_CipherUpdate(ctx_, scratch, &output_written, scratch, partial))
+            return TranslateLastOpenSslError();
+    }
+    memset_s(scratch, 0, sizeof(scratch));
+    return KM_ERROR_OK;
+}
+
 bool AesEvpOperation::UpdateForFinish(const AuthorizationSet& additional_params,
                                       const Buffer& input, AuthorizationSet* output_params,
                                       Buffer* output, keymaster_error_t* error) {
@@ -497,22 +894,82 @@ keymaster_error_t AesEvpEncryptOperation::Begin(const AuthorizationSet& input_pa
             error = KM_ERROR_CALLER_NONCE_PROHIBITED;
 
         if (error == KM_ERROR_OK)
-            output_params->push_back(TAG_NONCE, iv_.get(), iv_length_);
+            output_params->push_back(TAG_NONCE, iv_, iv_length_);
         else
             return error;
     }
 
+    if (block_mode_ == KM_MODE_GCM) {
+        cipher_deferred_ = true;
+        return KM_ERROR_OK;
+    }
     return AesEvpOperation::Begin(input_params, output_params);
 }
 
+keymaster_error_t AesEvpEncryptOperation::Update(const AuthorizationSet& additional_params,
+                                                 const Buffer& input,
+                                                 AuthorizationSet* output_params, Buffer* output,
+                                                 size_t* input_consumed) {
+    keymaster_error_t error = StartStreaming();
+    if (error != KM_ERROR_OK)
+        return error;
+    return AesEvpOperation::Update(additional_params, input, output_params, output,
+                                   input_consumed);
+}
+
+keymaster_error_t AesEvpEncryptOperation::UpdateAad(const uint8_t* aad, size_t aad_length) {
+    keymaster_error_t error = StartStreaming();
+    if (error != KM_ERROR_OK)
+        return error;
+    return AesEvpOperation::UpdateAad(aad, aad_length);
+}
+
+keymaster_error_t AesEvpEncryptOperation::StartStreaming() {
+    if (!cipher_deferred_)
+        return KM_ERROR_OK;
+    cipher_deferred_ = false;
+    return InitializeCipher();
+}
+
+bool AesEvpEncryptOperation::SealInOneCall(const AuthorizationSet& additional_params,
+                                           const Buffer& input, Buffer* output,
+                                           keymaster_error_t* error) {
+    const EVP_AEAD_CTX* aead = context_pool()->GcmSealContext(tag_length_);
+    if (!aead)
+        return false;
+
+    keymaster_blob_t aad = {nullptr, 0};
+    additional_params.GetTagValue(TAG_ASSOCIATED_DATA, &aad);
+
+    size_t output_written;
+    if (!EVP_AEAD_CTX_seal(aead, output->peek_write(), &output_written, output->available_write(),
+                           iv_, iv_length_, input.peek_read(), input.available_read(), aad.data,
+                           aad.data_length)) {
+        *error = TranslateLastOpenSslError();
+        return true;
+    }
+    *error = output->advance_write(output_written) ? KM_ERROR_OK : KM_ERROR_UNKNOWN_ERROR;
+    return true;
+}
+
 keymaster_error_t AesEvpEncryptOperation::Finish(const AuthorizationSet& additional_params,
                                                  const Buffer& input, const Buffer& signature,
                                                  AuthorizationSet* output_params, Buffer* output) {
     if (!output->reserve(input.available_read() + AES_BLOCK_SIZE + tag_length_))
         return KM_ERROR_MEMORY_ALLOCATION_FAILED;
 
-    keymaster_error_t error =
-        AesEvpOperation::Finish(additional_params, input, signature, output_params, output);
+    // A message given entirely to Finish -- the common case for small ones -- is sealed in one
+    // call against the key's precomputed AEAD context, without setting up streaming state.
+    keymaster_error_t error;
+    if (cipher_deferred_ && SealInOneCall(additional_params, input, output, &error)) {
+        cipher_deferred_ = false;
+        return error;
+    }
+    error = StartStreaming();
+    if (error != KM_ERROR_OK)
+        return error;
+
+    error = AesEvpOperation::Finish(additional_params, input, signature, output_params, output);
     if (error != KM_ERROR_OK)
         return error;
 
@@ -520,7 +977,7 @@ keymaster_error_t AesEvpEncryptOperation::Finish(const AuthorizationSet& additio
         if (!output->reserve(tag_length_))
             return KM_ERROR_MEMORY_ALLOCATION_FAILED;
 
-        if (!EVP_CIPHER_CTX_ctrl(&ctx_, EVP_CTRL_GCM_GET_TAG, tag_length_, output->peek_write()))
+        if (!EVP_CIPHER_CTX_ctrl(ctx_, EVP_CTRL_GCM_GET_TAG, tag_length_, output->peek_write()))
             return TranslateLastOpenSslError();
         if (!output->advance_write(tag_length_))
             return KM_ERROR_UNKNOWN_ERROR;
@@ -531,12 +988,7 @@ keymaster_error_t AesEvpEncryptOperation::Finish(const AuthorizationSet& additio
 
 keymaster_error_t AesEvpEncryptOperation::GenerateIv() {
     iv_length_ = (block_mode_ == KM_MODE_GCM) ? GCM_NONCE_SIZE : AES_BLOCK_SIZE;
-    iv_.reset(new (std::nothrow) uint8_t[iv_length_]);
-    if (!iv_.get())
-        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
-    if (RAND_bytes(iv_.get(), iv_length_) != 1)
-        return TranslateLastOpenSslError();
-    return KM_ERROR_OK;
+    return BufferedRandomBytes(iv_, iv_length_);
 }
 
 keymaster_error_t AesEvpDecryptOperation::Begin(const AuthorizationSet& input_params,
@@ -547,13 +999,6 @@ keymaster_error_t AesEvpDecryptOperation::Begin(const AuthorizationSet& input_pa
             return error;
     }
 
-    if (tag_length_ > 0) {
-        tag_buf_length_ = 0;
-        tag_buf_.reset(new (std::nothrow) uint8_t[tag_length_]);
-        if (!tag_buf_.get())
-            return KM_ERROR_MEMORY_ALLOCATION_FAILED;
-    }
-
     return AesEvpOperation::Begin(input_params, output_params);
 }
 
@@ -595,13 +1040,23 @@ keymaster_error_t AesEvpDecryptOperation::ProcessAllButTagLengthBytes(const Buff
     if (!output->reserve(to_process + AES_BLOCK_SIZE))
         return KM_ERROR_MEMORY_ALLOCATION_FAILED;
 
-    keymaster_error_t error;
-    if (!ProcessTagBufContentsAsData(to_process_from_tag_buf, output, &error))
-        return error;
-
-    if (!InternalUpdate(input.peek_read(), to_process_from_input, output, &error))
-        return error;
+    // Line the bytes held back from earlier updates up with the input in the output buffer and
+    // decrypt them there in one call, rather than in two calls that split a block between them.
+    uint8_t* data = output->peek_write();
+    memcpy(data, tag_buf_, to_process_from_tag_buf);
+    memcpy(data + to_process_from_tag_buf, input.peek_read(), to_process_from_input);
+    int output_written = -1;
+    if (!EVP_CipherUpdate(ctx_, data, &output_written, data, to_process))
+        return TranslateLastOpenSslError();
+    data_length_ += to_process;
+    if (!output->advance_write(output_written))
+        return KM_ERROR_UNKNOWN_ERROR;
 
+    // Only input shorter than the tag leaves some of the held-back bytes in tag_buf_.
+    if (to_process_from_tag_buf < tag_buf_length_)
+        memmove(tag_buf_, tag_buf_ + to_process_from_tag_buf,
+                tag_buf_length_ - to_process_from_tag_buf);
+    tag_buf_length_ -= to_process_from_tag_buf;
     BufferCandidateTagData(input.peek_read() + to_process_from_input,
                            input.available_read() - to_process_from_input);
     assert(tag_buf_unused() == 0);
@@ -609,20 +1064,9 @@ keymaster_error_t AesEvpDecryptOperation::ProcessAllButTagLengthBytes(const Buff
     return KM_ERROR_OK;
 }
 
-bool AesEvpDecryptOperation::ProcessTagBufContentsAsData(size_t to_process, Buffer* output,
-                                                         keymaster_error_t* error) {
-    assert(to_process <= tag_buf_length_);
-    if (!InternalUpdate(tag_buf_.get(), to_process, output, error))
-        return false;
-    if (to_process < tag_buf_length_)
-        memmove(tag_buf_.get(), tag_buf_.get() + to_process, tag_buf_length_ - to_process);
-    tag_buf_length_ -= to_process;
-    return true;
-}
-
 void AesEvpDecryptOperation::BufferCandidateTagData(const uint8_t* data, size_t data_length) {
     assert(data_length <= tag_length_ - tag_buf_length_);
-    memcpy(tag_buf_.get() + tag_buf_length_, data, data_length);
+    memcpy(tag_buf_ + tag_buf_length_, data, data_length);
     tag_buf_length_ += data_length;
 }
 
@@ -636,7 +1080,7 @@ keymaster_error_t AesEvpDecryptOperation::Finish(const AuthorizationSet& additio
     if (tag_buf_length_ < tag_length_)
         return KM_ERROR_INVALID_INPUT_LENGTH;
     else if (tag_length_ > 0 &&
-             !EVP_CIPHER_CTX_ctrl(&ctx_, EVP_CTRL_GCM_SET_TAG, tag_length_, tag_buf_.get()))
+             !EVP_CIPHER_CTX_ctrl(ctx_, EVP_CTRL_GCM_SET_TAG, tag_length_, tag_buf_))
         return TranslateLastOpenSslError();
 
     AuthorizationSet empty_params;
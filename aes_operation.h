@@ -17,13 +17,22 @@
 #ifndef SYSTEM_KEYMASTER_AES_OPERATION_H_
 #define SYSTEM_KEYMASTER_AES_OPERATION_H_
 
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include <openssl/aead.h>
+#include <openssl/aes.h>
 #include <openssl/evp.h>
 
+#include "aes_key.h"
 #include "ocb_utils.h"
 #include "operation.h"
 
 namespace keymaster {
 
+class WorkerPool;
+
 /**
  * Abstract base for AES operation factories.  This class does all of the work to create
  * AES operations.
@@ -56,11 +65,64 @@ class AesDecryptionOperationFactory : public AesOperationFactory {
 
 static const size_t MAX_EVP_KEY_SIZE = 32;
 
+/**
+ * AesCipherContextPool keeps idle EVP_CIPHER_CTXs already keyed with one AES key, for each block
+ * mode and direction, so that an operation's Begin only has to set its IV rather than expand the
+ * key schedule again.  It's shared by an AesKey and the operations created from it, which return
+ * their contexts when they're destroyed, even if the key is gone by then.  All methods are
+ * internally locked.
+ */
+class AesCipherContextPool {
+  public:
+    AesCipherContextPool(const uint8_t* key, size_t key_size);
+    ~AesCipherContextPool();
+
+    /**
+     * Returns a context keyed for block_mode in the specified direction, or null on failure with
+     * *error set.  The caller must reinitialize it with its IV, if any, before use, and eventually
+     * pass it to Return().
+     */
+    EVP_CIPHER_CTX* Take(keymaster_block_mode_t block_mode, bool encrypt, keymaster_error_t* error);
+
+    /**
+     * Puts back a context taken for the same block_mode and direction, or frees it if enough are
+     * already idle.
+     */
+    void Return(keymaster_block_mode_t block_mode, bool encrypt, EVP_CIPHER_CTX* ctx);
+
+    /**
+     * Returns an AEAD context for sealing whole AES-GCM messages with tag_length-byte tags in one
+     * call, or null if there's none for this key size.  Each tag length's context is set up, with
+     * its key schedule and GHASH table, the first time it's asked for, and kept until the pool is
+     * destroyed.  Sealing doesn't modify it, so it may be used on any number of threads at once.
+     */
+    const EVP_AEAD_CTX* GcmSealContext(size_t tag_length);
+
+    size_t idle_count() const;
+
+  private:
+    static const size_t kBlockModeCount = 4;
+    static const size_t kGcmTagLengthCount = (kMaxGcmTagLength - kMinGcmTagLength) / 8 + 1;
+    // Enough for a parallel update to find a context for each segment on an 8-core host.
+    static const size_t kMaxIdlePerMode = 8;
+
+    std::vector<EVP_CIPHER_CTX*>* IdleContexts(keymaster_block_mode_t block_mode, bool encrypt);
+
+    size_t key_size_;
+    uint8_t key_[MAX_EVP_KEY_SIZE];
+
+    mutable std::mutex mutex_;
+    std::vector<EVP_CIPHER_CTX*> idle_[kBlockModeCount][2];
+    // Indexed by tag length in bytes, less kMinGcmTagLength / 8.
+    EVP_AEAD_CTX gcm_seal_[kGcmTagLengthCount];
+    bool gcm_seal_initialized_[kGcmTagLengthCount];
+};
+
 class AesEvpOperation : public Operation {
   public:
     AesEvpOperation(keymaster_purpose_t purpose, keymaster_block_mode_t block_mode,
                     keymaster_padding_t padding, bool caller_iv, size_t tag_length,
-                    const uint8_t* key, size_t key_size);
+                    const std::shared_ptr<AesCipherContextPool>& context_pool);
     ~AesEvpOperation();
 
     keymaster_error_t Begin(const AuthorizationSet& input_params,
@@ -72,64 +134,132 @@ class AesEvpOperation : public Operation {
                              const Buffer& signature, AuthorizationSet* output_params,
                              Buffer* output) override;
     keymaster_error_t Abort() override;
+    keymaster_error_t UpdateAad(const uint8_t* aad, size_t aad_length) override;
+    // Supported for ECB and CBC between whole blocks, and for CTR anywhere; not for GCM.
+    keymaster_error_t Checkpoint(AuthorizationSet* begin_params, Buffer* state) const override;
+    keymaster_error_t Restore(const Buffer& state) override;
+    // Large enough that the cipher, rather than the call, dominates, and no smaller than the
+    // updates the parallel pool takes, if one is set.
+    size_t preferred_chunk_size() const override;
 
     virtual int evp_encrypt_mode() = 0;
 
+    /**
+     * Opts CTR and ECB updates, and CBC decryption updates, of at least min_parallel_length bytes
+     * into being split into segments of whole blocks that are processed on pool's threads, each
+     * with its own cipher context.  The default, a null pool, processes every update on the
+     * calling thread.  Like Buffer::set_default_pool() this is global, so it should be set before
+     * operations are in use, and pool must outlive them.
+     */
+    static void set_parallel_pool(WorkerPool* pool, size_t min_parallel_length);
+
   protected:
+    AesCipherContextPool* context_pool() const { return context_pool_.get(); }
     bool need_iv() const;
     keymaster_error_t InitializeCipher();
     keymaster_error_t GetIv(const AuthorizationSet& input_params);
     bool HandleAad(const AuthorizationSet& input_params, const Buffer& input,
                    keymaster_error_t* error);
+    bool ProcessAad(keymaster_blob_t aad, keymaster_error_t* error);
     bool ProcessAadBlocks(const uint8_t* data, size_t blocks, keymaster_error_t* error);
     void FillBufferedAadBlock(keymaster_blob_t* aad);
     bool ProcessBufferedAadBlock(keymaster_error_t* error);
     bool InternalUpdate(const uint8_t* input, size_t input_length, Buffer* output,
                         keymaster_error_t* error);
+    // Returns how much of input_length bytes of data ParallelUpdate should process, which may be 0.
+    size_t ParallelLength(size_t input_length) const;
+    // Processes input_length bytes, a multiple of the block size, on the parallel pool, and leaves
+    // ctx_ as if it had processed them itself.  Sets *output_length to the bytes written, which
+    // differs from input_length when decrypting with padding.
+    bool ParallelUpdate(const uint8_t* input, size_t input_length, uint8_t* output,
+                        size_t* output_length, keymaster_error_t* error);
+    // Returns the IV ctx_ would have on reaching block of input, an update starting after
+    // data_length_ bytes, using counter as storage if needed.  Null for ECB.
+    const uint8_t* ChainedIv(const uint8_t* input, size_t block, uint8_t* counter) const;
+    // Whether ctx_ keeps the last block it's given until it sees more, or Finish.
+    bool holds_back_final_block() const;
+    // Keeps the end of the ciphertext for ChainedIv, from input when decrypting or output when
+    // encrypting with CBC.
+    void RecordCiphertext(const uint8_t* input, size_t input_length, const uint8_t* output,
+                          size_t output_length);
     bool UpdateForFinish(const AuthorizationSet& additional_params, const Buffer& input,
                          AuthorizationSet* output_params, Buffer* output, keymaster_error_t* error);
 
     const keymaster_block_mode_t block_mode_;
-    EVP_CIPHER_CTX ctx_;
-    UniquePtr<uint8_t[]> iv_;
+    // Taken from context_pool_ by InitializeCipher.
+    EVP_CIPHER_CTX* ctx_;
+    uint8_t iv_[AES_BLOCK_SIZE];  // Large enough for a GCM nonce, too.
     size_t iv_length_;
     const bool caller_iv_;
     size_t tag_length_;
-    UniquePtr<uint8_t[]> aad_block_buf_;
+    // GCM associated data short of a whole block.
+    uint8_t aad_block_buf_[AES_BLOCK_SIZE];
     size_t aad_block_buf_length_;
+    // Bytes of data, as opposed to AAD, passed to ctx_ since it was initialized.
+    uint64_t data_length_;
+    // When decrypting, the last two blocks of those bytes, oldest first; when encrypting with CBC,
+    // the last two blocks of ciphertext.
+    uint8_t last_ciphertext_[2 * AES_BLOCK_SIZE];
 
   private:
+    static const size_t kPreferredChunkSize = 16384;
+
+    // IV, data length and last_ciphertext_.
+    static const size_t kStateSize = AES_BLOCK_SIZE + sizeof(uint64_t) + 2 * AES_BLOCK_SIZE;
+
+    static WorkerPool* parallel_pool_;
+    static size_t min_parallel_length_;
+
     bool data_started_;
-    const size_t key_size_;
     const keymaster_padding_t padding_;
-    uint8_t key_[MAX_EVP_KEY_SIZE];
+    const std::shared_ptr<AesCipherContextPool> context_pool_;
 };
 
 class AesEvpEncryptOperation : public AesEvpOperation {
   public:
     AesEvpEncryptOperation(keymaster_block_mode_t block_mode, keymaster_padding_t padding,
-                           bool caller_iv, size_t tag_length, const uint8_t* key, size_t key_size)
-        : AesEvpOperation(KM_PURPOSE_ENCRYPT, block_mode, padding, caller_iv, tag_length, key,
-                          key_size) {}
+                           bool caller_iv, size_t tag_length,
+                           const std::shared_ptr<AesCipherContextPool>& context_pool)
+        : AesEvpOperation(KM_PURPOSE_ENCRYPT, block_mode, padding, caller_iv, tag_length,
+                          context_pool),
+          cipher_deferred_(false) {}
 
     keymaster_error_t Begin(const AuthorizationSet& input_params,
                             AuthorizationSet* output_params) override;
+    keymaster_error_t Update(const AuthorizationSet& additional_params, const Buffer& input,
+                             AuthorizationSet* output_params, Buffer* output,
+                             size_t* input_consumed) override;
     keymaster_error_t Finish(const AuthorizationSet& additional_params, const Buffer& input,
                              const Buffer& signature, AuthorizationSet* output_params,
                              Buffer* output) override;
+    keymaster_error_t UpdateAad(const uint8_t* aad, size_t aad_length) override;
 
     int evp_encrypt_mode() override { return 1; }
 
   private:
+    size_t object_size() const override { return sizeof(*this); }
+
     keymaster_error_t GenerateIv();
+    // Initializes the cipher context, if Begin left it for Finish to seal the message in one call.
+    keymaster_error_t StartStreaming();
+    // Seals a GCM message given entirely to Finish.  Returns false, having done nothing, if the
+    // key has no one-shot context.
+    bool SealInOneCall(const AuthorizationSet& additional_params, const Buffer& input,
+                       Buffer* output, keymaster_error_t* error);
+
+    // GCM encryptions don't take a cipher context until they see an Update or UpdateAad, so that
+    // a message given entirely to Finish needs none.
+    bool cipher_deferred_;
 };
 
 class AesEvpDecryptOperation : public AesEvpOperation {
   public:
     AesEvpDecryptOperation(keymaster_block_mode_t block_mode, keymaster_padding_t padding,
-                           size_t tag_length, const uint8_t* key, size_t key_size)
+                           size_t tag_length,
+                           const std::shared_ptr<AesCipherContextPool>& context_pool)
         : AesEvpOperation(KM_PURPOSE_DECRYPT, block_mode, padding,
-                          false /* caller_iv -- don't care */, tag_length, key, key_size) {}
+                          false /* caller_iv -- don't care */, tag_length, context_pool),
+          tag_buf_length_(0) {}
 
     keymaster_error_t Begin(const AuthorizationSet& input_params,
                             AuthorizationSet* output_params) override;
@@ -143,13 +273,15 @@ class AesEvpDecryptOperation : public AesEvpOperation {
     int evp_encrypt_mode() override { return 0; }
 
   private:
+    size_t object_size() const override { return sizeof(*this); }
+
     size_t tag_buf_unused() { return tag_length_ - tag_buf_length_; }
 
     keymaster_error_t ProcessAllButTagLengthBytes(const Buffer& input, Buffer* output);
-    bool ProcessTagBufContentsAsData(size_t to_process, Buffer* output, keymaster_error_t* error);
     void BufferCandidateTagData(const uint8_t* data, size_t data_length);
 
-    UniquePtr<uint8_t[]> tag_buf_;
+    // Large enough for the longest GCM tag.
+    uint8_t tag_buf_[AES_BLOCK_SIZE];
     size_t tag_buf_length_;
 };
 
@@ -19,7 +19,11 @@
 #include <assert.h>
 #include <string.h>
 
+#include <algorithm>
+#include <atomic>
 #include <cstddef>
+#include <functional>
+#include <thread>
 
 #include <openssl/rand.h>
 #include <openssl/x509.h>
@@ -29,12 +33,21 @@
 #include <keymaster/android_keymaster_utils.h>
 #include <keymaster/key_factory.h>
 #include <keymaster/keymaster_context.h>
+#include <keymaster/tracer.h>
 
 #include "ae.h"
+#include "attestation_signer.h"
+#include "buffered_random.h"
+#include "chunk_size_advisor.h"
+#include "imported_token_set.h"
 #include "key.h"
+#include "key_warmer.h"
+#include "latency_statistics.h"
+#include "loaded_key_cache.h"
 #include "openssl_err.h"
 #include "operation.h"
 #include "operation_table.h"
+#include "pinned_key_table.h"
 
 namespace keymaster {
 
@@ -44,6 +57,22 @@ const uint8_t MAJOR_VER = 1;
 const uint8_t MINOR_VER = 1;
 const uint8_t SUBMINOR_VER = 0;
 
+// Bounds on the cache of loaded keys.  A software RSA-2048 blob and its authorizations come to a
+// little under 2 KiB, so the byte limit leaves room for the entry limit to be reached first with
+// typical keys.
+const size_t kKeyCacheEntries = 256;
+const size_t kKeyCacheBytes = 1024 * 1024;
+
+const size_t kMaxPinnedKeys = 64;
+
+// Leads the plaintext of operation state tokens, so that the layout can change.
+const uint32_t kOperationStateVersion = 3;
+
+const uint32_t kDefaultOperationTokenMaxAge = 5 * 60;
+
+// The number of imported operation tokens remembered, so that each is imported once.
+const size_t kMaxImportedTokens = 1024;
+
 keymaster_error_t CheckVersionInfo(const AuthorizationSet& tee_enforced,
                                    const AuthorizationSet& sw_enforced,
                                    const KeymasterContext& context) {
@@ -63,10 +92,80 @@ keymaster_error_t CheckVersionInfo(const AuthorizationSet& tee_enforced,
     return KM_ERROR_OK;
 }
 
+// Appends an operation's Finish output parameters to those from its Begin.
+keymaster_error_t AppendParams(const AuthorizationSet& params, AuthorizationSet* output_params) {
+    for (const keymaster_key_param_t& param : params)
+        if (!output_params->push_back(param))
+            return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    return KM_ERROR_OK;
+}
+
+// Runs item(i) for each i below item_count on up to thread_count threads, including this one.  Each
+// thread takes the next item not yet taken until there are none left, so items must be
+// independent.
+void RunItems(size_t item_count, size_t thread_count, const std::function<void(size_t)>& item) {
+    std::atomic<size_t> next_item(0);
+    auto run_items = [&]() {
+        for (size_t i = next_item++; i < item_count; i = next_item++)
+            item(i);
+    };
+
+    size_t worker_count = std::min(thread_count, item_count);
+    worker_count = worker_count > 0 ? worker_count - 1 : 0;
+    UniquePtr<std::thread[]> workers;
+    if (worker_count > 0) {
+        workers.reset(new (std::nothrow) std::thread[worker_count]);
+        if (!workers.get())
+            worker_count = 0;
+    }
+    for (size_t i = 0; i < worker_count; ++i)
+        workers[i] = std::thread(run_items);
+    run_items();
+    for (size_t i = 0; i < worker_count; ++i)
+        workers[i].join();
+}
+
 }  // anonymous namespace
 
 AndroidKeymaster::AndroidKeymaster(KeymasterContext* context, size_t operation_table_size)
-    : context_(context), operation_table_(new OperationTable(operation_table_size)) {}
+    : context_(context), key_cache_(new LoadedKeyCache(kKeyCacheEntries, kKeyCacheBytes)),
+      pinned_keys_(new PinnedKeyTable(kMaxPinnedKeys)),
+      operation_table_(new ShardedOperationTable(operation_table_size)),
+      chunk_size_advisor_(new ChunkSizeAdvisor),
+      imported_tokens_(new ImportedTokenSet(kMaxImportedTokens)), recorder_(nullptr),
+      upgrade_thread_count_(1),
+      generation_thread_count_(1), attestation_thread_count_(1), upgrade_keys_on_use_(false),
+      operation_memory_budget_(0), evict_to_fit_budget_(false), operation_migration_(false),
+      operation_token_max_age_(kDefaultOperationTokenMaxAge), chunk_size_hints_(false),
+      key_warmer_(new KeyWarmer(
+          [this](const KeymasterKeyBlob& key_blob, const AuthorizationSet& additional_params) {
+              WarmupKey(key_blob, additional_params);
+          },
+          kKeyCacheEntries)) {
+#ifdef KEYMASTER_LATENCY_STATISTICS
+    statistics_.reset(new (std::nothrow) LatencyStatistics);
+#endif
+}
+
+AndroidKeymaster::AndroidKeymaster(KeymasterContext* context,
+                                   ShardedOperationTable* operation_table)
+    : context_(context), key_cache_(new LoadedKeyCache(kKeyCacheEntries, kKeyCacheBytes)),
+      pinned_keys_(new PinnedKeyTable(kMaxPinnedKeys)), operation_table_(operation_table),
+      chunk_size_advisor_(new ChunkSizeAdvisor),
+      imported_tokens_(new ImportedTokenSet(kMaxImportedTokens)), recorder_(nullptr),
+      upgrade_thread_count_(1),
+      generation_thread_count_(1), attestation_thread_count_(1), upgrade_keys_on_use_(false),
+      operation_memory_budget_(0), evict_to_fit_budget_(false), operation_migration_(false),
+      operation_token_max_age_(kDefaultOperationTokenMaxAge), chunk_size_hints_(false),
+      key_warmer_(new KeyWarmer(
+          [this](const KeymasterKeyBlob& key_blob, const AuthorizationSet& additional_params) {
+              WarmupKey(key_blob, additional_params);
+          },
+          kKeyCacheEntries)) {
+#ifdef KEYMASTER_LATENCY_STATISTICS
+    statistics_.reset(new (std::nothrow) LatencyStatistics);
+#endif
+}
 
 AndroidKeymaster::~AndroidKeymaster() {}
 
@@ -179,6 +278,9 @@ void AndroidKeymaster::SupportedExportFormats(const SupportedExportFormatsReques
 
 void AndroidKeymaster::AddRngEntropy(const AddEntropyRequest& request,
                                      AddEntropyResponse* response) {
+    ScopedRequestRecord record(recorder_, ADD_RNG_ENTROPY, request, *response);
+    ScopedLatencyTimer timer(statistics_.get(), ADD_RNG_ENTROPY);
+    ScopedOpenSslErrorQueue openssl_errors;
     response->error = context_->AddRngEntropy(request.random_data.peek_read(),
                                               request.random_data.available_read());
 }
@@ -187,37 +289,137 @@ void AndroidKeymaster::GenerateKey(const GenerateKeyRequest& request,
                                    GenerateKeyResponse* response) {
     if (response == NULL)
         return;
+    ScopedRequestRecord record(recorder_, GENERATE_KEY, request, *response);
+    ScopedLatencyTimer timer(statistics_.get(), GENERATE_KEY);
+    ScopedOpenSslErrorQueue openssl_errors;
+    timer.set_key(request.key_description);
+
+    KeymasterKeyBlob key_blob;
+    response->error = GenerateKeyBlob(request.key_description, &key_blob, &response->enforced,
+                                      &response->unenforced);
+    if (response->error == KM_ERROR_OK)
+        response->key_blob = key_blob.release();
+}
+
+void AndroidKeymaster::GenerateKeys(const GenerateKeysRequest& request,
+                                    GenerateKeysResponse* response) {
+    if (!response)
+        return;
+    ScopedRequestRecord record(recorder_, GENERATE_KEYS, request, *response);
+    ScopedLatencyTimer timer(statistics_.get(), GENERATE_KEYS);
+    ScopedOpenSslErrorQueue openssl_errors;
+
+    response->error = KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    if (!response->SetItemCount(request.item_count))
+        return;
 
+    RunItems(request.item_count, generation_thread_count_, [&](size_t i) {
+        GenerateKeysResponse::Item* item = &response->items[i];
+        item->error = GenerateKeyBlob(request.items[i].key_description, &item->key_blob,
+                                      &item->enforced, &item->unenforced);
+    });
+    response->error = KM_ERROR_OK;
+}
+
+keymaster_error_t AndroidKeymaster::GenerateKeyBlob(const AuthorizationSet& key_description,
+                                                    KeymasterKeyBlob* key_blob,
+                                                    AuthorizationSet* enforced,
+                                                    AuthorizationSet* unenforced) const {
     keymaster_algorithm_t algorithm;
     KeyFactory* factory = 0;
-    UniquePtr<Key> key;
-    if (!request.key_description.GetTagValue(TAG_ALGORITHM, &algorithm) ||
+    if (!key_description.GetTagValue(TAG_ALGORITHM, &algorithm) ||
         !(factory = context_->GetKeyFactory(algorithm)))
-        response->error = KM_ERROR_UNSUPPORTED_ALGORITHM;
-    else {
-        KeymasterKeyBlob key_blob;
-        response->enforced.Clear();
-        response->unenforced.Clear();
-        response->error = factory->GenerateKey(request.key_description, &key_blob,
-                                               &response->enforced, &response->unenforced);
-        if (response->error == KM_ERROR_OK)
-            response->key_blob = key_blob.release();
-    }
+        return KM_ERROR_UNSUPPORTED_ALGORITHM;
+
+    enforced->Clear();
+    unenforced->Clear();
+    return factory->GenerateKey(key_description, key_blob, enforced, unenforced);
 }
 
 void AndroidKeymaster::GetKeyCharacteristics(const GetKeyCharacteristicsRequest& request,
                                              GetKeyCharacteristicsResponse* response) {
     if (response == NULL)
         return;
+    ScopedRequestRecord record(recorder_, GET_KEY_CHARACTERISTICS, request, *response);
+    ScopedLatencyTimer timer(statistics_.get(), GET_KEY_CHARACTERISTICS);
+    ScopedOpenSslErrorQueue openssl_errors;
+
+    // A key loaded with the same application ID and data has already been authenticated, and has
+    // the characteristics at hand.  Otherwise, parse just the characteristics, without loading the
+    // key or caching anything, since a client that asks for characteristics may never use the key.
+    KeyBlobFingerprint fingerprint;
+    LoadedKeyCache::ComputeLookup(request.key_blob, request.additional_params, &fingerprint);
+    std::shared_ptr<const LoadedKey> loaded_key = key_cache_->Find(fingerprint);
+    if (loaded_key) {
+        response->error = KM_ERROR_MEMORY_ALLOCATION_FAILED;
+        if (!response->enforced.Reinitialize(loaded_key->hw_enforced) ||
+            !response->unenforced.Reinitialize(loaded_key->sw_enforced))
+            return;
+    } else {
+        KeymasterKeyBlob key_blob(request.key_blob, KeymasterKeyBlob::BORROW);
+        response->error = context_->ParseKeyCharacteristics(key_blob, request.additional_params,
+                                                            &response->enforced,
+                                                            &response->unenforced);
+        if (response->error != KM_ERROR_OK)
+            return;
+    }
 
-    KeymasterKeyBlob key_material;
-    response->error =
-        context_->ParseKeyBlob(KeymasterKeyBlob(request.key_blob), request.additional_params,
-                               &key_material, &response->enforced, &response->unenforced);
-    if (response->error != KM_ERROR_OK)
+    timer.set_key(response->enforced);
+    timer.set_key(response->unenforced);
+    response->error = CheckVersionInfo(response->enforced, response->unenforced, *context_);
+}
+
+void AndroidKeymaster::BatchGetKeyCharacteristics(const BatchGetKeyCharacteristicsRequest& request,
+                                                  BatchGetKeyCharacteristicsResponse* response) {
+    if (!response)
         return;
+    ScopedRequestRecord record(recorder_, BATCH_GET_KEY_CHARACTERISTICS, request, *response);
+    ScopedLatencyTimer timer(statistics_.get(), BATCH_GET_KEY_CHARACTERISTICS);
+    ScopedOpenSslErrorQueue openssl_errors;
 
-    response->error = CheckVersionInfo(response->enforced, response->unenforced, *context_);
+    response->error = KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    if (!response->SetItemCount(request.item_count))
+        return;
+    UniquePtr<KeyCharacteristicsQuery[]> queries;
+    if (request.item_count) {
+        queries.reset(new (std::nothrow) KeyCharacteristicsQuery[request.item_count]);
+        if (!queries.get())
+            return;
+    }
+
+    // As in GetKeyCharacteristics, keys that have been loaded with the same parameters are
+    // answered from the cache.  The rest are parsed in one call, so the context can share its
+    // per-call setup among them.  Their items keep the unknown error until the results arrive.
+    size_t query_count = 0;
+    for (size_t i = 0; i < request.item_count; ++i) {
+        BatchGetKeyCharacteristicsResponse::Item* item = &response->items[i];
+        KeyBlobFingerprint fingerprint;
+        LoadedKeyCache::ComputeLookup(request.items[i].key_blob, request.additional_params,
+                                      &fingerprint);
+        std::shared_ptr<const LoadedKey> loaded_key = key_cache_->Find(fingerprint);
+        if (!loaded_key) {
+            KeyCharacteristicsQuery* query = &queries[query_count++];
+            query->blob = &request.items[i].key_blob;
+            query->hw_enforced = &item->enforced;
+            query->sw_enforced = &item->unenforced;
+            query->error = KM_ERROR_UNKNOWN_ERROR;
+        } else if (!item->enforced.Reinitialize(loaded_key->hw_enforced) ||
+                   !item->unenforced.Reinitialize(loaded_key->sw_enforced)) {
+            item->error = KM_ERROR_MEMORY_ALLOCATION_FAILED;
+        } else {
+            item->error = KM_ERROR_OK;
+        }
+    }
+    context_->ParseKeyCharacteristicsBatch(request.additional_params, queries.get(), query_count);
+
+    for (size_t i = 0, j = 0; i < request.item_count; ++i) {
+        BatchGetKeyCharacteristicsResponse::Item* item = &response->items[i];
+        if (item->error == KM_ERROR_UNKNOWN_ERROR)
+            item->error = queries[j++].error;
+        if (item->error == KM_ERROR_OK)
+            item->error = CheckVersionInfo(item->enforced, item->unenforced, *context_);
+    }
+    response->error = KM_ERROR_OK;
 }
 
 static KeyFactory* GetKeyFactory(const KeymasterContext& context,
@@ -234,55 +436,173 @@ static KeyFactory* GetKeyFactory(const KeymasterContext& context,
     return factory;
 }
 
+keymaster_error_t AndroidKeymaster::LoadOperationKey(uint64_t key_handle,
+                                                     const keymaster_key_blob_t& key_blob,
+                                                     const AuthorizationSet& additional_params,
+                                                     std::shared_ptr<const LoadedKey>* loaded_key,
+                                                     km_id_t* key_id,
+                                                     std::array<uint8_t, 32>* blob_digest,
+                                                     KeymasterKeyBlob* upgraded_key) {
+    *key_id = 0;
+    if (key_handle != 0) {
+        PinnedKeyTable::PinnedKey pinned_key;
+        if (!pinned_keys_->Find(key_handle, &pinned_key))
+            return KM_ERROR_INVALID_KEY_BLOB;
+        *loaded_key = pinned_key.loaded_key;
+        *key_id = pinned_key.key_id;
+        *blob_digest = pinned_key.blob_digest;
+        return CheckVersionInfo((*loaded_key)->hw_enforced, (*loaded_key)->sw_enforced, *context_);
+    }
+
+    KeyBlobFingerprint fingerprint;
+    LoadedKeyCache::ComputeLookup(key_blob, additional_params, &fingerprint);
+    keymaster_error_t error = LoadKey(key_blob, fingerprint, additional_params, loaded_key);
+    if (error == KM_ERROR_KEY_REQUIRES_UPGRADE && upgraded_key && upgrade_keys_on_use_) {
+        // Only the upgraded blob is loaded, and so cached; the old one fails again the next time
+        // it's used, but by then the caller should have replaced it.
+        TraceSpan span("UpgradeKeyBlob");
+        error = context_->UpgradeKeyBlob(KeymasterKeyBlob(key_blob, KeymasterKeyBlob::BORROW),
+                                         additional_params, upgraded_key);
+        if (error == KM_ERROR_OK) {
+            LoadedKeyCache::ComputeLookup(*upgraded_key, additional_params, &fingerprint);
+            error = LoadKey(*upgraded_key, fingerprint, additional_params, loaded_key);
+        }
+    }
+    *blob_digest = fingerprint.blob_digest;
+    if (error == KM_ERROR_OK && context_->enforcement_policy()) {
+        TraceSpan span("CreateKeyId");
+        KeymasterEnforcement::CreateKeyId(fingerprint.blob_digest.data(), key_id);
+    }
+    return error;
+}
+
+keymaster_error_t AndroidKeymaster::AddUpgradedKey(const KeymasterKeyBlob& upgraded_key,
+                                                   AuthorizationSet* output_params) const {
+    if (!upgraded_key.key_material)
+        return KM_ERROR_OK;
+    if (!output_params->push_back(TAG_UPGRADED_KEY_BLOB, upgraded_key.key_material,
+                                  upgraded_key.key_material_size))
+        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    return KM_ERROR_OK;
+}
+
+keymaster_error_t AndroidKeymaster::NewOperation(keymaster_purpose_t purpose,
+                                                 const LoadedKey& loaded_key, km_id_t key_id,
+                                                 const AuthorizationSet& additional_params,
+                                                 bool authorize, UniquePtr<Operation>* operation) {
+    const Key* key = loaded_key.key.get();
+    keymaster_algorithm_t key_algorithm;
+    if (!key->authorizations().GetTagValue(TAG_ALGORITHM, &key_algorithm))
+        return KM_ERROR_UNKNOWN_ERROR;
+
+    OperationFactory* factory = context_->GetOperationFactory(key_algorithm, purpose);
+    if (!factory)
+        return KM_ERROR_UNSUPPORTED_PURPOSE;
+
+    keymaster_error_t error;
+    TraceSpan create_span("OperationFactory::CreateOperation");
+    operation->reset(factory->CreateOperation(*key, additional_params, &error));
+    if (operation->get() == NULL)
+        return error;
+    create_span.End();
+
+    if (context_->enforcement_policy()) {
+        (*operation)->set_key_id(key_id);
+        if (authorize) {
+            TraceSpan span("AuthorizeOperation");
+            error = context_->enforcement_policy()->AuthorizeOperation(
+                purpose, key_id, loaded_key.policy, additional_params);
+            if (error != KM_ERROR_OK)
+                return error;
+            error = KeymasterEnforcement::CompileAuthorizations(
+                purpose, loaded_key.policy, (*operation)->mutable_compiled_authorizations());
+            if (error != KM_ERROR_OK)
+                return error;
+        }
+    }
+    return KM_ERROR_OK;
+}
+
+// The advisor keeps timings per algorithm and purpose.
+static ChunkSizeAdvisor::Key ChunkSizeKey(const Operation& operation) {
+    keymaster_algorithm_t algorithm = KM_ALGORITHM_RSA;
+    operation.authorizations().GetTagValue(TAG_ALGORITHM, &algorithm);
+    return ChunkSizeAdvisor::Key(algorithm, operation.purpose());
+}
+
+keymaster_error_t AndroidKeymaster::AddChunkSizeHints(const Operation& operation,
+                                                      AuthorizationSet* output_params) const {
+    size_t max_chunk_size = operation.max_chunk_size();
+    size_t preferred = chunk_size_advisor_->Advise(
+        ChunkSizeKey(operation), operation.preferred_chunk_size(), max_chunk_size);
+    if (!output_params->push_back(TAG_PREFERRED_CHUNK_SIZE, preferred))
+        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    if (max_chunk_size != 0 && !output_params->push_back(TAG_MAX_CHUNK_SIZE, max_chunk_size))
+        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    return KM_ERROR_OK;
+}
+
+keymaster_error_t AndroidKeymaster::CreateOperation(keymaster_purpose_t purpose,
+                                                    const LoadedKey& loaded_key, km_id_t key_id,
+                                                    const AuthorizationSet& additional_params,
+                                                    bool authorize, AuthorizationSet* output_params,
+                                                    UniquePtr<Operation>* operation) {
+    keymaster_error_t error =
+        NewOperation(purpose, loaded_key, key_id, additional_params, authorize, operation);
+    if (error != KM_ERROR_OK)
+        return error;
+
+    output_params->Clear();
+    TraceSpan span("Operation::Begin");
+    return (*operation)->Begin(additional_params, output_params);
+}
+
 void AndroidKeymaster::BeginOperation(const BeginOperationRequest& request,
                                       BeginOperationResponse* response) {
     if (response == NULL)
         return;
+    TraceSpan span("BeginOperation");
+    ScopedRequestRecord record(recorder_, BEGIN_OPERATION, request, *response);
+    ScopedLatencyTimer timer(statistics_.get(), BEGIN_OPERATION);
+    ScopedOpenSslErrorQueue openssl_errors;
+    timer.set_purpose(request.purpose);
     response->op_handle = 0;
+    ReapIdleOperations();
 
-    AuthorizationSet hw_enforced;
-    AuthorizationSet sw_enforced;
-    const KeyFactory* key_factory;
-    UniquePtr<Key> key;
-    response->error = LoadKey(request.key_blob, request.additional_params, &hw_enforced,
-                              &sw_enforced, &key_factory, &key);
+    std::shared_ptr<const LoadedKey> loaded_key;
+    km_id_t key_id;
+    LoadedKeyCache::Digest blob_digest;
+    KeymasterKeyBlob upgraded_key;
+    response->error = LoadOperationKey(request.key_handle, request.key_blob,
+                                       request.additional_params, &loaded_key, &key_id,
+                                       &blob_digest, &upgraded_key);
     if (response->error != KM_ERROR_OK)
         return;
+    timer.set_key(loaded_key->key->authorizations());
 
-    response->error = KM_ERROR_UNKNOWN_ERROR;
-    keymaster_algorithm_t key_algorithm;
-    if (!key->authorizations().GetTagValue(TAG_ALGORITHM, &key_algorithm))
-        return;
-
-    response->error = KM_ERROR_UNSUPPORTED_PURPOSE;
-    OperationFactory* factory = key_factory->GetOperationFactory(request.purpose);
-    if (!factory)
+    UniquePtr<Operation> operation;
+    response->error =
+        CreateOperation(request.purpose, *loaded_key, key_id, request.additional_params,
+                        true /* authorize */, &response->output_params, &operation);
+    if (response->error != KM_ERROR_OK)
         return;
 
-    UniquePtr<Operation> operation(
-        factory->CreateOperation(*key, request.additional_params, &response->error));
-    if (operation.get() == NULL)
+    response->error = AddUpgradedKey(upgraded_key, &response->output_params);
+    if (response->error != KM_ERROR_OK)
         return;
 
-    if (context_->enforcement_policy()) {
-        km_id_t key_id;
-        response->error = KM_ERROR_UNKNOWN_ERROR;
-        if (!context_->enforcement_policy()->CreateKeyId(request.key_blob, &key_id))
-            return;
-        operation->set_key_id(key_id);
-        response->error = context_->enforcement_policy()->AuthorizeOperation(
-            request.purpose, key_id, key->authorizations(), request.additional_params,
-            0 /* op_handle */, true /* is_begin_operation */);
+    operation->SetAuthorizations(loaded_key->key->authorizations());
+    operation->set_key_blob_digest(blob_digest);
+    if (chunk_size_hints_) {
+        response->error = AddChunkSizeHints(*operation, &response->output_params);
         if (response->error != KM_ERROR_OK)
             return;
     }
-
-    response->output_params.Clear();
-    response->error = operation->Begin(request.additional_params, &response->output_params);
+    response->error = FitOperationInBudget(*operation);
     if (response->error != KM_ERROR_OK)
         return;
 
-    operation->SetAuthorizations(key->authorizations());
+    TraceSpan add_span("OperationTable::Add");
     response->error = operation_table_->Add(operation.release(), &response->op_handle);
 }
 
@@ -290,16 +610,21 @@ void AndroidKeymaster::UpdateOperation(const UpdateOperationRequest& request,
                                        UpdateOperationResponse* response) {
     if (response == NULL)
         return;
+    ScopedRequestRecord record(recorder_, UPDATE_OPERATION, request, *response);
+    ScopedLatencyTimer timer(statistics_.get(), UPDATE_OPERATION);
+    ScopedOpenSslErrorQueue openssl_errors;
+    uint64_t start = chunk_size_hints_ ? ChunkSizeAdvisor::NowNanoseconds() : 0;
+    ReapIdleOperations();
 
-    response->error = KM_ERROR_INVALID_OPERATION_HANDLE;
-    Operation* operation = operation_table_->Find(request.op_handle);
+    Operation* operation = AcquireOperation(request.op_handle, &response->error);
     if (operation == NULL)
         return;
+    timer.set_key(operation->authorizations());
+    timer.set_purpose(operation->purpose());
 
     if (context_->enforcement_policy()) {
-        response->error = context_->enforcement_policy()->AuthorizeOperation(
-            operation->purpose(), operation->key_id(), operation->authorizations(),
-            request.additional_params, request.op_handle, false /* is_begin_operation */);
+        response->error = context_->enforcement_policy()->AuthorizeUpdate(
+            operation->compiled_authorizations(), request.additional_params, request.op_handle);
         if (response->error != KM_ERROR_OK) {
             operation_table_->Delete(request.op_handle);
             return;
@@ -312,77 +637,423 @@ void AndroidKeymaster::UpdateOperation(const UpdateOperationRequest& request,
     if (response->error != KM_ERROR_OK) {
         // Any error invalidates the operation.
         operation_table_->Delete(request.op_handle);
+        return;
     }
+    if (chunk_size_hints_ && response->input_consumed > 0)
+        chunk_size_advisor_->Record(ChunkSizeKey(*operation), response->input_consumed,
+                                    ChunkSizeAdvisor::NowNanoseconds() - start);
+    operation_table_->Release(request.op_handle);
+}
+
+void AndroidKeymaster::UpdateAad(const UpdateAadRequest& request, UpdateAadResponse* response) {
+    if (response == NULL)
+        return;
+    ScopedRequestRecord record(recorder_, UPDATE_AAD, request, *response);
+    ScopedLatencyTimer timer(statistics_.get(), UPDATE_AAD);
+    ScopedOpenSslErrorQueue openssl_errors;
+    ReapIdleOperations();
+
+    Operation* operation = AcquireOperation(request.op_handle, &response->error);
+    if (operation == NULL)
+        return;
+    timer.set_key(operation->authorizations());
+    timer.set_purpose(operation->purpose());
+
+    if (context_->enforcement_policy()) {
+        AuthorizationSet no_params;
+        response->error = context_->enforcement_policy()->AuthorizeUpdate(
+            operation->compiled_authorizations(), no_params, request.op_handle);
+        if (response->error != KM_ERROR_OK) {
+            operation_table_->Delete(request.op_handle);
+            return;
+        }
+    }
+
+    response->error = operation->UpdateAad(request.aad.peek_read(), request.aad.available_read());
+    if (response->error != KM_ERROR_OK) {
+        // As with UpdateOperation, any error invalidates the operation.
+        operation_table_->Delete(request.op_handle);
+        return;
+    }
+    operation_table_->Release(request.op_handle);
 }
 
 void AndroidKeymaster::FinishOperation(const FinishOperationRequest& request,
                                        FinishOperationResponse* response) {
     if (response == NULL)
         return;
+    TraceSpan span("FinishOperation");
+    ScopedRequestRecord record(recorder_, FINISH_OPERATION, request, *response);
+    ScopedLatencyTimer timer(statistics_.get(), FINISH_OPERATION);
+    ScopedOpenSslErrorQueue openssl_errors;
+    ReapIdleOperations();
 
-    response->error = KM_ERROR_INVALID_OPERATION_HANDLE;
-    Operation* operation = operation_table_->Find(request.op_handle);
+    Operation* operation = AcquireOperation(request.op_handle, &response->error);
     if (operation == NULL)
         return;
+    timer.set_key(operation->authorizations());
+    timer.set_purpose(operation->purpose());
 
     if (context_->enforcement_policy()) {
-        response->error = context_->enforcement_policy()->AuthorizeOperation(
-            operation->purpose(), operation->key_id(), operation->authorizations(),
-            request.additional_params, request.op_handle, false /* is_begin_operation */);
+        TraceSpan authorize_span("AuthorizeFinish");
+        response->error = context_->enforcement_policy()->AuthorizeFinish(
+            operation->compiled_authorizations(), request.additional_params, request.op_handle);
         if (response->error != KM_ERROR_OK) {
             operation_table_->Delete(request.op_handle);
             return;
         }
     }
 
+    TraceSpan finish_span("Operation::Finish");
     response->error = operation->Finish(request.additional_params, request.input, request.signature,
                                         &response->output_params, &response->output);
+    finish_span.End();
     operation_table_->Delete(request.op_handle);
 }
 
+void AndroidKeymaster::OneShotOperation(const OneShotOperationRequest& request,
+                                        OneShotOperationResponse* response) {
+    if (response == NULL)
+        return;
+    ScopedRequestRecord record(recorder_, ONE_SHOT_OPERATION, request, *response);
+    ScopedLatencyTimer timer(statistics_.get(), ONE_SHOT_OPERATION);
+    ScopedOpenSslErrorQueue openssl_errors;
+    timer.set_purpose(request.purpose);
+
+    std::shared_ptr<const LoadedKey> loaded_key;
+    km_id_t key_id;
+    LoadedKeyCache::Digest blob_digest;
+    KeymasterKeyBlob upgraded_key;
+    response->error = LoadOperationKey(request.key_handle, request.key_blob,
+                                       request.additional_params, &loaded_key, &key_id,
+                                       &blob_digest, &upgraded_key);
+    if (response->error != KM_ERROR_OK)
+        return;
+    timer.set_key(loaded_key->key->authorizations());
+
+    UniquePtr<Operation> operation;
+    response->error =
+        CreateOperation(request.purpose, *loaded_key, key_id, request.additional_params,
+                        true /* authorize */, &response->output_params, &operation);
+    if (response->error == KM_ERROR_OK)
+        response->error = CheckOneShotAuthorization(*operation);
+    if (response->error != KM_ERROR_OK)
+        return;
+
+    response->error = FinishOneShotOperation(operation.get(), request.additional_params,
+                                             request.input, request.signature,
+                                             &response->output_params, &response->output);
+    if (response->error == KM_ERROR_OK)
+        response->error = AddUpgradedKey(upgraded_key, &response->output_params);
+}
+
+void AndroidKeymaster::BatchOperation(const BatchOperationRequest& request,
+                                      BatchOperationResponse* response) {
+    if (response == NULL)
+        return;
+    ScopedRequestRecord record(recorder_, BATCH_OPERATION, request, *response);
+    ScopedLatencyTimer timer(statistics_.get(), BATCH_OPERATION);
+    ScopedOpenSslErrorQueue openssl_errors;
+    timer.set_purpose(request.purpose);
+
+    std::shared_ptr<const LoadedKey> loaded_key;
+    km_id_t key_id;
+    LoadedKeyCache::Digest blob_digest;
+    response->error = LoadOperationKey(request.key_handle, request.key_blob,
+                                       request.additional_params, &loaded_key, &key_id,
+                                       &blob_digest, nullptr /* upgraded_key */);
+    if (response->error != KM_ERROR_OK)
+        return;
+    timer.set_key(loaded_key->key->authorizations());
+
+    response->error = KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    if (!response->SetItemCount(request.item_count))
+        return;
+
+    // Authorization is checked once for the whole batch, unless the key limits how often it can
+    // be used, in which case each item counts as a use.
+    const AuthorizationSet& key_auths = loaded_key->key->authorizations();
+    bool authorize_each_item = key_auths.Contains(TAG_MIN_SECONDS_BETWEEN_OPS) ||
+                               key_auths.Contains(TAG_MAX_USES_PER_BOOT);
+
+    UniquePtr<UniquePtr<Operation>[]> operations(new (std::nothrow)
+                                                     UniquePtr<Operation>[request.item_count]);
+    UniquePtr<OperationBatchItem[]> batch(new (std::nothrow)
+                                              OperationBatchItem[request.item_count]);
+    if (!operations.get() || !batch.get())
+        return;
+
+    size_t batch_count = 0;
+    for (size_t i = 0; i < request.item_count; ++i) {
+        BatchOperationResponse::Item* item = &response->items[i];
+        item->error = CreateOperation(request.purpose, *loaded_key, key_id,
+                                      request.additional_params, i == 0 || authorize_each_item,
+                                      &item->output_params, &operations[i]);
+        if (i == 0) {
+            if (item->error == KM_ERROR_OK)
+                item->error = CheckOneShotAuthorization(*operations[i]);
+            // If the batch isn't authorized, none of it is.
+            if (item->error != KM_ERROR_OK) {
+                response->error = item->error;
+                response->SetItemCount(0);
+                return;
+            }
+        }
+        if (item->error != KM_ERROR_OK)
+            continue;
+        OperationBatchItem* batch_item = &batch[batch_count++];
+        batch_item->operation = operations[i].get();
+        batch_item->input = &request.items[i].input;
+        batch_item->signature = &request.items[i].signature;
+        batch_item->output = &item->output;
+    }
+
+    // The operations are all of one kind, so the first can finish them all, together if it knows
+    // how.
+    if (batch_count > 0)
+        batch[0].operation->FinishBatch(request.additional_params, batch.get(), batch_count);
+
+    const OperationBatchItem* batch_item = batch.get();
+    for (size_t i = 0; i < request.item_count; ++i) {
+        BatchOperationResponse::Item* item = &response->items[i];
+        if (item->error != KM_ERROR_OK)
+            continue;
+        item->error = batch_item->error;
+        if (item->error == KM_ERROR_OK)
+            item->error = AppendParams(batch_item->output_params, &item->output_params);
+        ++batch_item;
+    }
+    response->error = KM_ERROR_OK;
+}
+
+keymaster_error_t AndroidKeymaster::CheckOneShotAuthorization(const Operation& operation) const {
+    // Per-operation authentication binds the auth token to an operation handle, which one-shot
+    // operations don't have.  Everything else was authorized by CreateOperation.
+    if (!context_->enforcement_policy())
+        return KM_ERROR_OK;
+    const CompiledAuthorizations& compiled = operation.compiled_authorizations();
+    if (!(compiled.flags & CompiledAuthorizations::UPDATE_AND_FINISH_AUTHORIZED) &&
+        (compiled.flags & CompiledAuthorizations::AUTH_REQUIRED))
+        return KM_ERROR_KEY_USER_NOT_AUTHENTICATED;
+    return KM_ERROR_OK;
+}
+
+keymaster_error_t
+AndroidKeymaster::FinishOneShotOperation(Operation* operation,
+                                         const AuthorizationSet& additional_params,
+                                         const Buffer& input, const Buffer& signature,
+                                         AuthorizationSet* output_params, Buffer* output) {
+    AuthorizationSet finish_output_params;
+    keymaster_error_t error =
+        operation->Finish(additional_params, input, signature, &finish_output_params, output);
+    if (error != KM_ERROR_OK)
+        return error;
+    return AppendParams(finish_output_params, output_params);
+}
+
 void AndroidKeymaster::AbortOperation(const AbortOperationRequest& request,
                                       AbortOperationResponse* response) {
     if (!response)
         return;
+    ScopedRequestRecord record(recorder_, ABORT_OPERATION, request, *response);
+    ScopedLatencyTimer timer(statistics_.get(), ABORT_OPERATION);
+    ScopedOpenSslErrorQueue openssl_errors;
 
-    Operation* operation = operation_table_->Find(request.op_handle);
-    if (!operation) {
-        response->error = KM_ERROR_INVALID_OPERATION_HANDLE;
+    Operation* operation = AcquireOperation(request.op_handle, &response->error);
+    if (!operation)
         return;
-    }
+    timer.set_key(operation->authorizations());
+    timer.set_purpose(operation->purpose());
 
     response->error = operation->Abort();
     operation_table_->Delete(request.op_handle);
 }
 
-void AndroidKeymaster::ExportKey(const ExportKeyRequest& request, ExportKeyResponse* response) {
-    if (response == NULL)
+keymaster_error_t AndroidKeymaster::SealOperation(const Operation& operation,
+                                                  KeymasterKeyBlob* token) const {
+    AuthorizationSet begin_params;
+    Buffer state;
+    keymaster_error_t error = operation.Checkpoint(&begin_params, &state);
+    if (error != KM_ERROR_OK)
+        return error;
+
+    // The token ID identifies the token to ImportedTokenSet, so that it's imported once, the export
+    // time and maximum age bound how long it must be remembered, and the blob digest binds it to
+    // the key.
+    ImportedTokenSet::TokenId token_id;
+    error = BufferedRandomBytes(token_id.data(), token_id.size());
+    if (error != KM_ERROR_OK)
+        return error;
+    const std::array<uint8_t, 32>& blob_digest = operation.key_blob_digest();
+    KeymasterKeyBlob plaintext(3 * sizeof(uint32_t) + sizeof(uint64_t) + token_id.size() +
+                               blob_digest.size() + begin_params.SerializedSize() +
+                               state.SerializedSize());
+    if (!plaintext.key_material)
+        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    uint8_t* buf = plaintext.writable_data();
+    const uint8_t* end = plaintext.end();
+    buf = append_uint32_to_buf(buf, end, kOperationStateVersion);
+    buf = append_uint32_to_buf(buf, end, operation.purpose());
+    buf = append_to_buf(buf, end, token_id.data(), token_id.size());
+    buf = append_uint64_to_buf(buf, end, context_->GetWallClockSeconds());
+    buf = append_uint32_to_buf(buf, end, operation_token_max_age_);
+    buf = append_to_buf(buf, end, blob_digest.data(), blob_digest.size());
+    buf = begin_params.Serialize(buf, end);
+    buf = state.Serialize(buf, end);
+    if (buf != end)
+        return KM_ERROR_UNKNOWN_ERROR;
+    return context_->SealOperationState(plaintext, token);
+}
+
+void AndroidKeymaster::ExportOperation(const ExportOperationRequest& request,
+                                       ExportOperationResponse* response) {
+    if (!response)
+        return;
+    ScopedRequestRecord record(recorder_, EXPORT_OPERATION, request, *response);
+    ScopedLatencyTimer timer(statistics_.get(), EXPORT_OPERATION);
+    ScopedOpenSslErrorQueue openssl_errors;
+    if (!operation_migration_) {
+        response->error = KM_ERROR_UNIMPLEMENTED;
         return;
+    }
 
-    AuthorizationSet hw_enforced;
-    AuthorizationSet sw_enforced;
-    KeymasterKeyBlob key_material;
+    Operation* operation = AcquireOperation(request.op_handle, &response->error);
+    if (!operation)
+        return;
+    timer.set_key(operation->authorizations());
+    timer.set_purpose(operation->purpose());
+
+    // An auth token bound to this operation's handle wouldn't authorize the imported one.
+    KeymasterKeyBlob token;
+    response->error = CheckOneShotAuthorization(*operation);
+    if (response->error == KM_ERROR_OK)
+        response->error = SealOperation(*operation, &token);
+    if (response->error == KM_ERROR_OK &&
+        !response->token.Reinitialize(token.key_material, token.key_material_size))
+        response->error = KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    if (response->error != KM_ERROR_OK) {
+        // The operation carries on here.
+        operation_table_->Release(request.op_handle);
+        return;
+    }
+    operation_table_->Delete(request.op_handle);
+}
+
+void AndroidKeymaster::ShareImportedTokens(const AndroidKeymaster& other) {
+    imported_tokens_ = other.imported_tokens_;
+}
+
+void AndroidKeymaster::ImportOperation(const ImportOperationRequest& request,
+                                       ImportOperationResponse* response) {
+    if (!response)
+        return;
+    ScopedRequestRecord record(recorder_, IMPORT_OPERATION, request, *response);
+    ScopedLatencyTimer timer(statistics_.get(), IMPORT_OPERATION);
+    ScopedOpenSslErrorQueue openssl_errors;
+    response->op_handle = 0;
+    if (!operation_migration_) {
+        response->error = KM_ERROR_UNIMPLEMENTED;
+        return;
+    }
+    ReapIdleOperations();
+
+    keymaster_key_blob_t sealed = {request.token.peek_read(), request.token.available_read()};
+    KeymasterKeyBlob plaintext;
+    response->error = context_->UnsealOperationState(
+        KeymasterKeyBlob(sealed, KeymasterKeyBlob::BORROW), &plaintext);
+    if (response->error != KM_ERROR_OK)
+        return;
+
+    uint32_t version, purpose, max_age;
+    uint64_t export_time;
+    ImportedTokenSet::TokenId token_id;
+    LoadedKeyCache::Digest token_blob_digest;
+    AuthorizationSet begin_params;
+    Buffer state;
+    const uint8_t* buf = plaintext.key_material;
+    const uint8_t* end = plaintext.end();
+    if (!copy_uint32_from_buf(&buf, end, &version) || version != kOperationStateVersion ||
+        !copy_uint32_from_buf(&buf, end, &purpose) ||
+        !copy_from_buf(&buf, end, token_id.data(), token_id.size()) ||
+        !copy_uint64_from_buf(&buf, end, &export_time) ||
+        !copy_uint32_from_buf(&buf, end, &max_age) ||
+        !copy_from_buf(&buf, end, token_blob_digest.data(), token_blob_digest.size()) ||
+        !begin_params.Deserialize(&buf, end) || !state.Deserialize(&buf, end) || buf != end) {
+        response->error = KM_ERROR_INVALID_ARGUMENT;
+        return;
+    }
+    timer.set_purpose(static_cast<keymaster_purpose_t>(purpose));
+
+    // The token is remembered for as long as this check would pass, measured from now on the
+    // monotonic clock so that it doesn't depend on the wall clock staying put.
+    uint64_t now = context_->GetWallClockSeconds();
+    if ((now > export_time && now - export_time > max_age) ||
+        (export_time > now && export_time - now > max_age)) {
+        LOG_W("Operation token exported at %llu can't be imported at %llu", export_time, now);
+        response->error = KM_ERROR_INVALID_ARGUMENT;
+        return;
+    }
+    uint32_t lifetime = static_cast<uint32_t>(export_time + max_age - now);
+
+    std::shared_ptr<const LoadedKey> loaded_key;
+    km_id_t key_id;
+    LoadedKeyCache::Digest blob_digest;
+    response->error = LoadOperationKey(0 /* key_handle */, request.key_blob,
+                                       request.additional_params, &loaded_key, &key_id,
+                                       &blob_digest, nullptr /* upgraded_key */);
+    if (response->error != KM_ERROR_OK)
+        return;
+    timer.set_key(loaded_key->key->authorizations());
+    if (blob_digest != token_blob_digest) {
+        response->error = KM_ERROR_INVALID_KEY_BLOB;
+        return;
+    }
+
+    // The token's parameters come first, so that they're the ones the factory finds.
+    if (!begin_params.push_back(request.additional_params)) {
+        response->error = KM_ERROR_MEMORY_ALLOCATION_FAILED;
+        return;
+    }
+    UniquePtr<Operation> operation;
+    response->error = NewOperation(static_cast<keymaster_purpose_t>(purpose), *loaded_key, key_id,
+                                   begin_params, true /* authorize */, &operation);
+    if (response->error != KM_ERROR_OK)
+        return;
+    response->error = operation->Restore(state);
+    if (response->error != KM_ERROR_OK)
+        return;
+
+    operation->SetAuthorizations(loaded_key->key->authorizations());
+    operation->set_key_blob_digest(blob_digest);
+    response->error = FitOperationInBudget(*operation);
+    if (response->error != KM_ERROR_OK)
+        return;
     response->error =
-        context_->ParseKeyBlob(KeymasterKeyBlob(request.key_blob), request.additional_params,
-                               &key_material, &hw_enforced, &sw_enforced);
+        imported_tokens_->Insert(token_id, context_->GetMonotonicSeconds(), lifetime);
     if (response->error != KM_ERROR_OK)
         return;
+    response->error = operation_table_->Add(operation.release(), &response->op_handle);
+}
 
-    keymaster_algorithm_t algorithm;
-    KeyFactory* key_factory =
-        GetKeyFactory(*context_, hw_enforced, sw_enforced, &algorithm, &response->error);
-    if (!key_factory)
+void AndroidKeymaster::ExportKey(const ExportKeyRequest& request, ExportKeyResponse* response) {
+    if (response == NULL)
         return;
+    ScopedRequestRecord record(recorder_, EXPORT_KEY, request, *response);
+    ScopedLatencyTimer timer(statistics_.get(), EXPORT_KEY);
+    ScopedOpenSslErrorQueue openssl_errors;
 
-    UniquePtr<Key> key;
-    response->error = key_factory->LoadKey(key_material, request.additional_params, hw_enforced,
-                                           sw_enforced, &key);
+    KeyBlobFingerprint fingerprint;
+    LoadedKeyCache::ComputeLookup(request.key_blob, request.additional_params, &fingerprint);
+    std::shared_ptr<const LoadedKey> loaded_key;
+    response->error =
+        LoadKey(request.key_blob, fingerprint, request.additional_params, &loaded_key);
     if (response->error != KM_ERROR_OK)
         return;
+    timer.set_key(loaded_key->key->authorizations());
 
     UniquePtr<uint8_t[]> out_key;
     size_t size;
-    response->error = key->formatted_key_material(request.key_format, &out_key, &size);
+    response->error = loaded_key->key->formatted_key_material(request.key_format, &out_key, &size);
     if (response->error == KM_ERROR_OK) {
         response->key_data = out_key.release();
         response->key_data_length = size;
@@ -392,35 +1063,158 @@ void AndroidKeymaster::ExportKey(const ExportKeyRequest& request, ExportKeyRespo
 void AndroidKeymaster::AttestKey(const AttestKeyRequest& request, AttestKeyResponse* response) {
     if (!response)
         return;
-
-    AuthorizationSet tee_enforced;
-    AuthorizationSet sw_enforced;
-    const KeyFactory* key_factory;
-    UniquePtr<Key> key;
-    response->error = LoadKey(request.key_blob, request.attest_params, &tee_enforced, &sw_enforced,
-                              &key_factory, &key);
+    ScopedRequestRecord record(recorder_, ATTEST_KEY, request, *response);
+    ScopedLatencyTimer timer(statistics_.get(), ATTEST_KEY);
+    ScopedOpenSslErrorQueue openssl_errors;
+
+    KeyBlobFingerprint fingerprint;
+    LoadedKeyCache::ComputeLookup(request.key_blob, request.attest_params, &fingerprint);
+    std::shared_ptr<const LoadedKey> loaded_key;
+    response->error = LoadKey(request.key_blob, fingerprint, request.attest_params, &loaded_key);
     if (response->error != KM_ERROR_OK)
         return;
+    timer.set_key(loaded_key->key->authorizations());
+
+    response->error = loaded_key->key->GenerateAttestation(
+        *context_, request.attest_params, loaded_key->hw_enforced, loaded_key->sw_enforced,
+        &response->certificate_chain);
+}
+
+void AndroidKeymaster::BatchAttestKey(const BatchAttestKeyRequest& request,
+                                      BatchAttestKeyResponse* response) {
+    if (!response)
+        return;
+    ScopedRequestRecord record(recorder_, BATCH_ATTEST_KEY, request, *response);
+    ScopedLatencyTimer timer(statistics_.get(), BATCH_ATTEST_KEY);
+    ScopedOpenSslErrorQueue openssl_errors;
 
-    response->error = key->GenerateAttestation(*context_, request.attest_params, tee_enforced,
-                                               sw_enforced, &response->certificate_chain);
+    response->error = KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    if (!response->SetItemCount(request.item_count))
+        return;
+    UniquePtr<std::shared_ptr<const LoadedKey>[]> loaded_keys;
+    UniquePtr<size_t[]> item_signers;
+    if (request.item_count) {
+        loaded_keys.reset(new (std::nothrow) std::shared_ptr<const LoadedKey>[request.item_count]);
+        item_signers.reset(new (std::nothrow) size_t[request.item_count]);
+        if (!loaded_keys.get() || !item_signers.get())
+            return;
+    }
+
+    // Keys of the same algorithm are attested by the same signer, which is set up the first time
+    // a key needs it.  Each signer that's used contributes one issuer chain to the response.
+    const keymaster_algorithm_t kSignAlgorithms[] = {KM_ALGORITHM_RSA, KM_ALGORITHM_EC};
+    const size_t kSignerCount = array_length(kSignAlgorithms);
+    AttestationSigner signers[kSignerCount];
+    bool signer_tried[kSignerCount] = {};
+    keymaster_error_t signer_errors[kSignerCount] = {};
+    uint32_t issuer_chains[kSignerCount] = {};
+    size_t issuer_chain_count = 0;
+
+    for (size_t i = 0; i < request.item_count; ++i) {
+        BatchAttestKeyResponse::Item* item = &response->items[i];
+        KeyBlobFingerprint fingerprint;
+        LoadedKeyCache::ComputeLookup(request.items[i].key_blob, request.attest_params,
+                                      &fingerprint);
+        item->error = LoadKey(request.items[i].key_blob, fingerprint, request.attest_params,
+                              &loaded_keys[i]);
+        if (item->error != KM_ERROR_OK)
+            continue;
+
+        keymaster_algorithm_t sign_algorithm;
+        item->error = AttestationSigner::SignAlgorithm(
+            loaded_keys[i]->hw_enforced, loaded_keys[i]->sw_enforced, &sign_algorithm);
+        if (item->error != KM_ERROR_OK)
+            continue;
+        size_t s = 0;
+        while (kSignAlgorithms[s] != sign_algorithm)
+            ++s;
+        if (!signer_tried[s]) {
+            signer_tried[s] = true;
+            signer_errors[s] = signers[s].Init(*context_, sign_algorithm);
+            if (signer_errors[s] == KM_ERROR_OK)
+                issuer_chains[s] = issuer_chain_count++;
+        }
+        item->error = signer_errors[s];
+        item_signers[i] = s;
+    }
+
+    if (!response->SetIssuerChainCount(issuer_chain_count))
+        return;
+    for (size_t s = 0; s < kSignerCount; ++s)
+        if (signer_tried[s] && signer_errors[s] == KM_ERROR_OK &&
+            !response->SetIssuerChain(issuer_chains[s], signers[s].issuer_chain()))
+            return;
+
+    RunItems(request.item_count, attestation_thread_count_, [&](size_t i) {
+        BatchAttestKeyResponse::Item* item = &response->items[i];
+        if (item->error != KM_ERROR_OK)
+            return;
+        const LoadedKey& loaded_key = *loaded_keys[i];
+        item->error = loaded_key.key->GenerateAttestationCertificate(
+            *context_, signers[item_signers[i]], request.attest_params, loaded_key.hw_enforced,
+            loaded_key.sw_enforced, &item->certificate);
+        item->issuer_chain = issuer_chains[item_signers[i]];
+    });
+    response->error = KM_ERROR_OK;
 }
 
 void AndroidKeymaster::UpgradeKey(const UpgradeKeyRequest& request, UpgradeKeyResponse* response) {
     if (!response)
         return;
+    ScopedRequestRecord record(recorder_, UPGRADE_KEY, request, *response);
+    ScopedLatencyTimer timer(statistics_.get(), UPGRADE_KEY);
+    ScopedOpenSslErrorQueue openssl_errors;
 
+    KeymasterKeyBlob key_blob(request.key_blob, KeymasterKeyBlob::BORROW);
     KeymasterKeyBlob upgraded_key;
-    response->error = context_->UpgradeKeyBlob(KeymasterKeyBlob(request.key_blob),
-                                               request.upgrade_params, &upgraded_key);
+    response->error = context_->UpgradeKeyBlob(key_blob, request.upgrade_params, &upgraded_key);
     if (response->error != KM_ERROR_OK)
         return;
     response->upgraded_key = upgraded_key.release();
 }
 
+void AndroidKeymaster::BatchUpgradeKey(const BatchUpgradeKeyRequest& request,
+                                       BatchUpgradeKeyResponse* response) {
+    if (!response)
+        return;
+    ScopedRequestRecord record(recorder_, BATCH_UPGRADE_KEY, request, *response);
+    ScopedLatencyTimer timer(statistics_.get(), BATCH_UPGRADE_KEY);
+    ScopedOpenSslErrorQueue openssl_errors;
+
+    response->error = KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    if (!response->SetItemCount(request.item_count))
+        return;
+
+    RunItems(request.item_count, upgrade_thread_count_, [&](size_t i) {
+        BatchUpgradeKeyResponse::Item* item = &response->items[i];
+        item->error = context_->UpgradeKeyBlob(request.items[i].key_blob, request.upgrade_params,
+                                               &item->upgraded_key);
+    });
+    response->error = KM_ERROR_OK;
+}
+
+void AndroidKeymaster::MigrateKey(const MigrateKeyRequest& request, MigrateKeyResponse* response) {
+    if (!response)
+        return;
+    ScopedRequestRecord record(recorder_, MIGRATE_KEY, request, *response);
+    ScopedLatencyTimer timer(statistics_.get(), MIGRATE_KEY);
+    ScopedOpenSslErrorQueue openssl_errors;
+
+    KeymasterKeyBlob key_blob(request.key_blob, KeymasterKeyBlob::BORROW);
+    KeymasterKeyBlob migrated_key;
+    response->error = context_->MigrateKeyBlob(key_blob, request.additional_params, &migrated_key);
+    if (response->error != KM_ERROR_OK)
+        return;
+    response->migrated_key = migrated_key.release();
+}
+
 void AndroidKeymaster::ImportKey(const ImportKeyRequest& request, ImportKeyResponse* response) {
     if (response == NULL)
         return;
+    ScopedRequestRecord record(recorder_, IMPORT_KEY, request, *response);
+    ScopedLatencyTimer timer(statistics_.get(), IMPORT_KEY);
+    ScopedOpenSslErrorQueue openssl_errors;
+    timer.set_key(request.key_description);
 
     keymaster_algorithm_t algorithm;
     KeyFactory* factory = 0;
@@ -429,11 +1223,12 @@ void AndroidKeymaster::ImportKey(const ImportKeyRequest& request, ImportKeyRespo
         !(factory = context_->GetKeyFactory(algorithm)))
         response->error = KM_ERROR_UNSUPPORTED_ALGORITHM;
     else {
-        keymaster_key_blob_t key_material = {request.key_data, request.key_data_length};
+        keymaster_key_blob_t key_data = {request.key_data, request.key_data_length};
+        KeymasterKeyBlob key_material(key_data, KeymasterKeyBlob::BORROW);
         KeymasterKeyBlob key_blob;
         response->error = factory->ImportKey(request.key_description, request.key_format,
-                                             KeymasterKeyBlob(key_material), &key_blob,
-                                             &response->enforced, &response->unenforced);
+                                             key_material, &key_blob, &response->enforced,
+                                             &response->unenforced);
         if (response->error == KM_ERROR_OK)
             response->key_blob = key_blob.release();
     }
@@ -442,40 +1237,257 @@ void AndroidKeymaster::ImportKey(const ImportKeyRequest& request, ImportKeyRespo
 void AndroidKeymaster::DeleteKey(const DeleteKeyRequest& request, DeleteKeyResponse* response) {
     if (!response)
         return;
-    response->error = context_->DeleteKey(KeymasterKeyBlob(request.key_blob));
+    ScopedRequestRecord record(recorder_, DELETE_KEY, request, *response);
+    ScopedLatencyTimer timer(statistics_.get(), DELETE_KEY);
+    ScopedOpenSslErrorQueue openssl_errors;
+    LoadedKeyCache::Lookup lookup;
+    LoadedKeyCache::ComputeLookup(request.key_blob, AuthorizationSet(), &lookup);
+    key_warmer_->Cancel(request.key_blob);
+    key_cache_->Invalidate(lookup.blob_digest);
+    pinned_keys_->DeleteBlob(lookup.blob_digest);
+    response->error = context_->DeleteKey(
+        KeymasterKeyBlob(request.key_blob, KeymasterKeyBlob::BORROW));
 }
 
-void AndroidKeymaster::DeleteAllKeys(const DeleteAllKeysRequest&, DeleteAllKeysResponse* response) {
+void AndroidKeymaster::BatchDeleteKey(const BatchDeleteKeyRequest& request,
+                                      BatchDeleteKeyResponse* response) {
     if (!response)
         return;
+    ScopedRequestRecord record(recorder_, BATCH_DELETE_KEY, request, *response);
+    ScopedLatencyTimer timer(statistics_.get(), BATCH_DELETE_KEY);
+    ScopedOpenSslErrorQueue openssl_errors;
+
+    response->error = KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    if (!response->SetItemCount(request.item_count))
+        return;
+    UniquePtr<const KeymasterKeyBlob*[]> blobs;
+    UniquePtr<keymaster_error_t[]> errors;
+    if (request.item_count) {
+        blobs.reset(new (std::nothrow) const KeymasterKeyBlob*[request.item_count]);
+        errors.reset(new (std::nothrow) keymaster_error_t[request.item_count]);
+        if (!blobs.get() || !errors.get())
+            return;
+    }
+
+    for (size_t i = 0; i < request.item_count; ++i) {
+        LoadedKeyCache::Lookup lookup;
+        LoadedKeyCache::ComputeLookup(request.items[i].key_blob, AuthorizationSet(), &lookup);
+        key_warmer_->Cancel(request.items[i].key_blob);
+        key_cache_->Invalidate(lookup.blob_digest);
+        pinned_keys_->DeleteBlob(lookup.blob_digest);
+        blobs[i] = &request.items[i].key_blob;
+    }
+    context_->DeleteKeys(blobs.get(), request.item_count, errors.get());
+    for (size_t i = 0; i < request.item_count; ++i)
+        response->items[i].error = errors[i];
+    response->error = KM_ERROR_OK;
+}
+
+void AndroidKeymaster::DeleteAllKeys(const DeleteAllKeysRequest& request,
+                                     DeleteAllKeysResponse* response) {
+    if (!response)
+        return;
+    ScopedRequestRecord record(recorder_, DELETE_ALL_KEYS, request, *response);
+    ScopedLatencyTimer timer(statistics_.get(), DELETE_ALL_KEYS);
+    key_warmer_->Clear();
+    key_cache_->Clear();
+    pinned_keys_->Clear();
     response->error = context_->DeleteAllKeys();
 }
 
+void AndroidKeymaster::PinKey(const PinKeyRequest& request, PinKeyResponse* response) {
+    if (!response)
+        return;
+    ScopedRequestRecord record(recorder_, PIN_KEY, request, *response);
+    ScopedLatencyTimer timer(statistics_.get(), PIN_KEY);
+    ScopedOpenSslErrorQueue openssl_errors;
+    response->key_handle = 0;
+
+    KeyBlobFingerprint fingerprint;
+    LoadedKeyCache::ComputeLookup(request.key_blob, request.additional_params, &fingerprint);
+    std::shared_ptr<const LoadedKey> loaded_key;
+    response->error =
+        LoadKey(request.key_blob, fingerprint, request.additional_params, &loaded_key);
+    if (response->error != KM_ERROR_OK)
+        return;
+    timer.set_key(loaded_key->key->authorizations());
+
+    // A pinned key backs every operation begun with its handle, so it must be shareable.
+    response->error = KM_ERROR_UNIMPLEMENTED;
+    if (!loaded_key->key->shareable())
+        return;
+
+    PinnedKeyTable::PinnedKey pinned_key;
+    pinned_key.loaded_key = loaded_key;
+    pinned_key.key_id = 0;
+    if (context_->enforcement_policy())
+        KeymasterEnforcement::CreateKeyId(fingerprint.blob_digest.data(), &pinned_key.key_id);
+    pinned_key.blob_digest = fingerprint.blob_digest;
+    response->error = pinned_keys_->Add(pinned_key, &response->key_handle);
+}
+
+void AndroidKeymaster::UnpinKey(const UnpinKeyRequest& request, UnpinKeyResponse* response) {
+    if (!response)
+        return;
+    ScopedRequestRecord record(recorder_, UNPIN_KEY, request, *response);
+    ScopedLatencyTimer timer(statistics_.get(), UNPIN_KEY);
+    ScopedOpenSslErrorQueue openssl_errors;
+    response->error = KM_ERROR_INVALID_ARGUMENT;
+    if (pinned_keys_->Delete(request.key_handle))
+        response->error = KM_ERROR_OK;
+}
+
+void AndroidKeymaster::WarmupKeys(const WarmupKeysRequest& request,
+                                  WarmupKeysResponse* response) {
+    if (!response)
+        return;
+    ScopedRequestRecord record(recorder_, WARMUP_KEYS, request, *response);
+    ScopedLatencyTimer timer(statistics_.get(), WARMUP_KEYS);
+    response->error = key_warmer_->Schedule(request);
+}
+
+void AndroidKeymaster::WaitForKeyWarmup() {
+    key_warmer_->WaitUntilIdle();
+}
+
+void AndroidKeymaster::GetStatistics(const GetStatisticsRequest&,
+                                     GetStatisticsResponse* response) {
+    if (!response)
+        return;
+    response->error = KM_ERROR_UNIMPLEMENTED;
+    if (statistics_.get())
+        statistics_->Snapshot(response);
+}
+
+void AndroidKeymaster::GetLockStatistics(LockStatistics* operation_table,
+                                         LockStatistics* key_cache,
+                                         LockStatistics* pinned_keys) const {
+    if (operation_table)
+        *operation_table = operation_table_->lock_statistics();
+    if (key_cache)
+        *key_cache = key_cache_->lock_statistics();
+    if (pinned_keys)
+        *pinned_keys = pinned_keys_->lock_statistics();
+}
+
+void AndroidKeymaster::ReapIdleOperations() {
+    operation_table_->AdvanceTime(context_->GetMonotonicSeconds());
+}
+
+keymaster_error_t AndroidKeymaster::FitOperationInBudget(const Operation& operation) {
+    if (operation_memory_budget_ == 0)
+        return KM_ERROR_OK;
+
+    size_t bytes = operation.memory_footprint();
+    if (bytes > operation_memory_budget_) {
+        LOG_W("%d-byte operation exceeds the operation memory budget", bytes);
+        return KM_ERROR_TOO_MANY_OPERATIONS;
+    }
+    while (operation_table_->bytes() + bytes > operation_memory_budget_) {
+        if (!evict_to_fit_budget_ || !operation_table_->EvictLeastRecentlyUsed())
+            return KM_ERROR_TOO_MANY_OPERATIONS;
+        LOG_I("Evicted an operation to stay within the operation memory budget", 0);
+    }
+    return KM_ERROR_OK;
+}
+
+Operation* AndroidKeymaster::AcquireOperation(keymaster_operation_handle_t op_handle,
+                                              keymaster_error_t* error) {
+    Operation* operation = operation_table_->Acquire(op_handle);
+    if (operation)
+        return operation;
+    // Acquire fails the same way for an operation in use as for a missing one.
+    if (operation_table_->Find(op_handle))
+        *error = KM_ERROR_CONCURRENT_ACCESS_CONFLICT;
+    else
+        *error = KM_ERROR_INVALID_OPERATION_HANDLE;
+    return NULL;
+}
+
+size_t AndroidKeymaster::operation_memory() const {
+    return operation_table_->bytes();
+}
+
+void AndroidKeymaster::set_operation_idle_timeout(uint32_t seconds) {
+    operation_table_->set_idle_timeout(seconds);
+}
+
+void AndroidKeymaster::set_operation_cpu_affinity(bool enabled) {
+    operation_table_->set_cpu_affinity(enabled);
+}
+
 bool AndroidKeymaster::has_operation(keymaster_operation_handle_t op_handle) const {
     return operation_table_->Find(op_handle) != nullptr;
 }
 
 keymaster_error_t AndroidKeymaster::LoadKey(const keymaster_key_blob_t& key_blob,
+                                            const KeyBlobFingerprint& fingerprint,
                                             const AuthorizationSet& additional_params,
-                                            AuthorizationSet* hw_enforced,
-                                            AuthorizationSet* sw_enforced,
-                                            const KeyFactory** factory, UniquePtr<Key>* key) {
+                                            std::shared_ptr<const LoadedKey>* loaded_key) {
+    TraceSpan span("LoadKey");
+    *loaded_key = key_cache_->Find(fingerprint);
+    if (*loaded_key)
+        // The blob was authenticated when it was cached, but the system version may have moved on
+        // since.
+        return CheckVersionInfo((*loaded_key)->hw_enforced, (*loaded_key)->sw_enforced, *context_);
+
+    std::shared_ptr<LoadedKey> new_key(new (std::nothrow) LoadedKey);
+    if (!new_key)
+        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+
     KeymasterKeyBlob key_material;
-    keymaster_error_t error = context_->ParseKeyBlob(KeymasterKeyBlob(key_blob), additional_params,
-                                                     &key_material, hw_enforced, sw_enforced);
+    TraceSpan parse_span("ParseKeyBlob");
+    // The blob is parsed where the caller's request holds it; only the key material is copied.
+    KeymasterKeyBlob borrowed_blob(key_blob, KeymasterKeyBlob::BORROW);
+    keymaster_error_t error;
+    if (context_->enforcement_policy())
+        error = context_->ParseKeyBlobWithPolicy(borrowed_blob, additional_params, &key_material,
+                                                 &new_key->hw_enforced, &new_key->sw_enforced,
+                                                 &new_key->policy);
+    else
+        error = context_->ParseKeyBlob(borrowed_blob, additional_params, &key_material,
+                                       &new_key->hw_enforced, &new_key->sw_enforced);
     if (error != KM_ERROR_OK)
         return error;
+    parse_span.End();
 
-    error = CheckVersionInfo(*hw_enforced, *sw_enforced, *context_);
+    error = CheckVersionInfo(new_key->hw_enforced, new_key->sw_enforced, *context_);
     if (error != KM_ERROR_OK)
         return error;
 
     keymaster_algorithm_t algorithm;
-    *factory = GetKeyFactory(*context_, *hw_enforced, *sw_enforced, &algorithm, &error);
+    new_key->factory =
+        GetKeyFactory(*context_, new_key->hw_enforced, new_key->sw_enforced, &algorithm, &error);
     if (error != KM_ERROR_OK)
         return error;
 
-    return (*factory)->LoadKey(key_material, additional_params, *hw_enforced, *sw_enforced, key);
+    TraceSpan load_span("KeyFactory::LoadKey");
+    error = new_key->factory->LoadKey(key_material, additional_params, new_key->hw_enforced,
+                                      new_key->sw_enforced, &new_key->key);
+    if (error != KM_ERROR_OK)
+        return error;
+    load_span.End();
+
+    key_cache_->Insert(fingerprint, key_blob.key_material_size, new_key);
+    *loaded_key = new_key;
+    return KM_ERROR_OK;
+}
+
+void AndroidKeymaster::WarmupKey(const KeymasterKeyBlob& key_blob,
+                                 const AuthorizationSet& additional_params) {
+    ScopedOpenSslErrorQueue openssl_errors;
+    KeyBlobFingerprint fingerprint;
+    LoadedKeyCache::ComputeLookup(key_blob, additional_params, &fingerprint);
+    // A cached key has already been warmed, or used.
+    if (key_cache_->Find(fingerprint))
+        return;
+    std::shared_ptr<const LoadedKey> loaded_key;
+    keymaster_error_t error = LoadKey(key_blob, fingerprint, additional_params, &loaded_key);
+    // Keys that can't be shared aren't cached, so there's nothing to gain from warming them.
+    if (error == KM_ERROR_OK && loaded_key->key->shareable())
+        error = loaded_key->key->Warmup();
+    if (error != KM_ERROR_OK)
+        LOG_W("Failed to warm up a key: %d", error);
 }
 
 }  // namespace keymaster
@@ -15,6 +15,8 @@
  */
 
 #include <keymaster/android_keymaster_messages.h>
+
+#include <keymaster/allocation_counter.h>
 #include <keymaster/android_keymaster_utils.h>
 
 namespace keymaster {
@@ -29,180 +31,348 @@ static void set_key_blob(keymaster_key_blob_t* key_blob, const void* key_materia
     key_blob->key_material_size = length;
 }
 
-static size_t key_blob_size(const keymaster_key_blob_t& key_blob) {
-    return sizeof(uint32_t) /* key size */ + key_blob.key_material_size;
+static void set_key_blob(keymaster_key_blob_t* key_blob, KeyBlobOwnership* ownership,
+                         const void* key_material, size_t length) {
+    if (*ownership == BORROWED_KEY_BLOB)
+        key_blob->key_material = nullptr;
+    *ownership = OWNED_KEY_BLOB;
+    set_key_blob(key_blob, key_material, length);
+}
+
+static void delete_key_blob(keymaster_key_blob_t* key_blob, KeyBlobOwnership ownership) {
+    if (ownership == OWNED_KEY_BLOB)
+        delete[] key_blob->key_material;
+}
+
+static size_t key_blob_size(const keymaster_key_blob_t& key_blob, SerializationFormat format) {
+    return size_and_data_serialized_size(key_blob.key_material_size, format);
 }
 
 static uint8_t* serialize_key_blob(const keymaster_key_blob_t& key_blob, uint8_t* buf,
-                                   const uint8_t* end) {
-    return append_size_and_data_to_buf(buf, end, key_blob.key_material, key_blob.key_material_size);
+                                   const uint8_t* end, SerializationFormat format) {
+    return append_size_and_data_to_buf(buf, end, key_blob.key_material, key_blob.key_material_size,
+                                       format);
 }
 
 static bool deserialize_key_blob(keymaster_key_blob_t* key_blob, const uint8_t** buf_ptr,
-                                 const uint8_t* end) {
+                                 const uint8_t* end, SerializationFormat format) {
     delete[] key_blob->key_material;
     key_blob->key_material = 0;
     UniquePtr<uint8_t[]> deserialized_key_material;
     if (!copy_size_and_data_from_buf(buf_ptr, end, &key_blob->key_material_size,
-                                     &deserialized_key_material))
+                                     &deserialized_key_material, format))
         return false;
     key_blob->key_material = deserialized_key_material.release();
     return true;
 }
 
+// Like deserialize_key_blob(), but if *ownership is BORROWED_KEY_BLOB leaves key_blob pointing into
+// the buffer.
+static bool deserialize_key_blob(keymaster_key_blob_t* key_blob, KeyBlobOwnership* ownership,
+                                 const uint8_t** buf_ptr, const uint8_t* end,
+                                 SerializationFormat format) {
+    if (*ownership == OWNED_KEY_BLOB)
+        return deserialize_key_blob(key_blob, buf_ptr, end, format);
+
+    key_blob->key_material = nullptr;
+    key_blob->key_material_size = 0;
+    size_t size;
+    if (!skip_size_and_data_in_buf(buf_ptr, end, &size, format))
+        return false;
+    if (size) {
+        key_blob->key_material = *buf_ptr - size;
+        key_blob->key_material_size = size;
+    }
+    return true;
+}
+
+static bool key_blob_to_segments(const keymaster_key_blob_t& key_blob,
+                                 SerializationSegments* segments, SerializationFormat format) {
+    return append_size_and_data_to_segments(segments, key_blob.key_material,
+                                            key_blob.key_material_size, format);
+}
+
+// Authorization sets are copied; their data is small and not laid out as serialized.
+static bool set_to_segments(const AuthorizationSet& set, SerializationSegments* segments,
+                            SerializationFormat format) {
+    size_t size = set.SerializedSize(format);
+    uint8_t* buf = segments->Reserve(size);
+    return buf && set.Serialize(buf, buf + size, format) == buf + size;
+}
+
+/*
+ * Error codes are negative, so the compact format zigzag-encodes them, mapping small magnitudes of
+ * either sign to small varints.
+ */
+
+static uint32_t zigzag_error(keymaster_error_t error) {
+    int32_t value = static_cast<int32_t>(error);
+    return (static_cast<uint32_t>(value) << 1) ^ static_cast<uint32_t>(value >> 31);
+}
+
+static size_t error_size(keymaster_error_t error, SerializationFormat format) {
+    return format == COMPACT_FORMAT ? varint_size(zigzag_error(error)) : sizeof(int32_t);
+}
+
+static uint8_t* append_error_to_buf(uint8_t* buf, const uint8_t* end, keymaster_error_t error,
+                                    SerializationFormat format) {
+    if (format == COMPACT_FORMAT)
+        return append_varint_to_buf(buf, end, zigzag_error(error));
+    return append_uint32_to_buf(buf, end, static_cast<uint32_t>(error));
+}
+
+static bool copy_error_from_buf(const uint8_t** buf_ptr, const uint8_t* end,
+                                keymaster_error_t* error, SerializationFormat format) {
+    uint32_t value;
+    if (!copy_uint32_from_buf(buf_ptr, end, &value, format))
+        return false;
+    if (format == COMPACT_FORMAT)
+        value = (value >> 1) ^ (0 - (value & 1));
+    *error = static_cast<keymaster_error_t>(static_cast<int32_t>(value));
+    return true;
+}
+
 size_t KeymasterResponse::SerializedSize() const {
     if (error != KM_ERROR_OK)
-        return sizeof(int32_t);
+        return error_size(error, format());
     else
-        return sizeof(int32_t) + NonErrorSerializedSize();
+        return error_size(error, format()) + NonErrorSerializedSize();
 }
 
 uint8_t* KeymasterResponse::Serialize(uint8_t* buf, const uint8_t* end) const {
-    buf = append_uint32_to_buf(buf, end, static_cast<uint32_t>(error));
+    buf = append_error_to_buf(buf, end, error, format());
     if (error == KM_ERROR_OK)
         buf = NonErrorSerialize(buf, end);
     return buf;
 }
 
 bool KeymasterResponse::Deserialize(const uint8_t** buf_ptr, const uint8_t* end) {
-    if (!copy_uint32_from_buf(buf_ptr, end, &error))
+    if (!copy_error_from_buf(buf_ptr, end, &error, format()))
         return false;
     if (error != KM_ERROR_OK)
         return true;
     return NonErrorDeserialize(buf_ptr, end);
 }
 
+bool KeymasterResponse::SerializeToSegments(SerializationSegments* segments) const {
+    size_t size = error_size(error, format());
+    uint8_t* buf = segments->Reserve(size);
+    if (!buf)
+        return false;
+    append_error_to_buf(buf, buf + size, error, format());
+    return error != KM_ERROR_OK || NonErrorSerializeToSegments(segments);
+}
+
+bool KeymasterResponse::NonErrorSerializeToSegments(SerializationSegments* segments) const {
+    size_t size = NonErrorSerializedSize();
+    uint8_t* buf = segments->Reserve(size);
+    return buf && NonErrorSerialize(buf, buf + size) == buf + size;
+}
+
 GenerateKeyResponse::~GenerateKeyResponse() {
     delete[] key_blob.key_material;
 }
 
 size_t GenerateKeyResponse::NonErrorSerializedSize() const {
-    return key_blob_size(key_blob) + enforced.SerializedSize() + unenforced.SerializedSize();
+    return key_blob_size(key_blob, format()) + enforced.SerializedSize(format()) +
+           unenforced.SerializedSize(format());
 }
 
 uint8_t* GenerateKeyResponse::NonErrorSerialize(uint8_t* buf, const uint8_t* end) const {
-    buf = serialize_key_blob(key_blob, buf, end);
-    buf = enforced.Serialize(buf, end);
-    return unenforced.Serialize(buf, end);
+    buf = serialize_key_blob(key_blob, buf, end, format());
+    buf = enforced.Serialize(buf, end, format());
+    return unenforced.Serialize(buf, end, format());
+}
+
+bool GenerateKeyResponse::NonErrorSerializeToSegments(SerializationSegments* segments) const {
+    return key_blob_to_segments(key_blob, segments, format()) &&
+           set_to_segments(enforced, segments, format()) &&
+           set_to_segments(unenforced, segments, format());
 }
 
 bool GenerateKeyResponse::NonErrorDeserialize(const uint8_t** buf_ptr, const uint8_t* end) {
-    return deserialize_key_blob(&key_blob, buf_ptr, end) && enforced.Deserialize(buf_ptr, end) &&
-           unenforced.Deserialize(buf_ptr, end);
+    return deserialize_key_blob(&key_blob, buf_ptr, end, format()) &&
+           enforced.Deserialize(buf_ptr, end, format()) &&
+           unenforced.Deserialize(buf_ptr, end, format());
 }
 
 GetKeyCharacteristicsRequest::~GetKeyCharacteristicsRequest() {
-    delete[] key_blob.key_material;
+    delete_key_blob(&key_blob, key_blob_ownership);
 }
 
 void GetKeyCharacteristicsRequest::SetKeyMaterial(const void* key_material, size_t length) {
-    set_key_blob(&key_blob, key_material, length);
+    set_key_blob(&key_blob, &key_blob_ownership, key_material, length);
 }
 
 size_t GetKeyCharacteristicsRequest::SerializedSize() const {
-    return key_blob_size(key_blob) + additional_params.SerializedSize();
+    return key_blob_size(key_blob, format()) + additional_params.SerializedSize(format());
 }
 
 uint8_t* GetKeyCharacteristicsRequest::Serialize(uint8_t* buf, const uint8_t* end) const {
-    buf = serialize_key_blob(key_blob, buf, end);
-    return additional_params.Serialize(buf, end);
+    buf = serialize_key_blob(key_blob, buf, end, format());
+    return additional_params.Serialize(buf, end, format());
+}
+
+bool GetKeyCharacteristicsRequest::SerializeToSegments(SerializationSegments* segments) const {
+    return key_blob_to_segments(key_blob, segments, format()) &&
+           set_to_segments(additional_params, segments, format());
 }
 
 bool GetKeyCharacteristicsRequest::Deserialize(const uint8_t** buf_ptr, const uint8_t* end) {
-    return deserialize_key_blob(&key_blob, buf_ptr, end) &&
-           additional_params.Deserialize(buf_ptr, end);
+    return deserialize_key_blob(&key_blob, &key_blob_ownership, buf_ptr, end, format()) &&
+           additional_params.Deserialize(buf_ptr, end, format());
 }
 
 size_t GetKeyCharacteristicsResponse::NonErrorSerializedSize() const {
-    return enforced.SerializedSize() + unenforced.SerializedSize();
+    return enforced.SerializedSize(format()) + unenforced.SerializedSize(format());
 }
 
 uint8_t* GetKeyCharacteristicsResponse::NonErrorSerialize(uint8_t* buf, const uint8_t* end) const {
-    buf = enforced.Serialize(buf, end);
-    return unenforced.Serialize(buf, end);
+    buf = enforced.Serialize(buf, end, format());
+    return unenforced.Serialize(buf, end, format());
 }
 
 bool GetKeyCharacteristicsResponse::NonErrorDeserialize(const uint8_t** buf_ptr,
                                                         const uint8_t* end) {
-    return enforced.Deserialize(buf_ptr, end) && unenforced.Deserialize(buf_ptr, end);
+    return enforced.Deserialize(buf_ptr, end, format()) &&
+           unenforced.Deserialize(buf_ptr, end, format());
+}
+
+BeginOperationRequest::~BeginOperationRequest() {
+    delete_key_blob(&key_blob, key_blob_ownership);
 }
 
 void BeginOperationRequest::SetKeyMaterial(const void* key_material, size_t length) {
-    set_key_blob(&key_blob, key_material, length);
+    set_key_blob(&key_blob, &key_blob_ownership, key_material, length);
 }
 
 size_t BeginOperationRequest::SerializedSize() const {
-    return sizeof(uint32_t) /* purpose */ + key_blob_size(key_blob) +
-           additional_params.SerializedSize();
+    size_t size = uint32_serialized_size(purpose, format()) + key_blob_size(key_blob, format()) +
+                  additional_params.SerializedSize(format());
+    if (message_version > 3)
+        size += sizeof(key_handle);
+    return size;
 }
 
 uint8_t* BeginOperationRequest::Serialize(uint8_t* buf, const uint8_t* end) const {
-    buf = append_uint32_to_buf(buf, end, purpose);
-    buf = serialize_key_blob(key_blob, buf, end);
-    return additional_params.Serialize(buf, end);
+    buf = append_uint32_to_buf(buf, end, purpose, format());
+    buf = serialize_key_blob(key_blob, buf, end, format());
+    buf = additional_params.Serialize(buf, end, format());
+    if (message_version > 3)
+        buf = append_uint64_to_buf(buf, end, key_handle);
+    return buf;
+}
+
+bool BeginOperationRequest::SerializeToSegments(SerializationSegments* segments) const {
+    bool retval = append_uint32_to_segments(segments, purpose, format()) &&
+                  key_blob_to_segments(key_blob, segments, format()) &&
+                  set_to_segments(additional_params, segments, format());
+    if (retval && message_version > 3)
+        retval = append_uint64_to_segments(segments, key_handle);
+    return retval;
 }
 
 bool BeginOperationRequest::Deserialize(const uint8_t** buf_ptr, const uint8_t* end) {
-    return copy_uint32_from_buf(buf_ptr, end, &purpose) &&
-           deserialize_key_blob(&key_blob, buf_ptr, end) &&
-           additional_params.Deserialize(buf_ptr, end);
+    bool retval = copy_uint32_from_buf(buf_ptr, end, &purpose, format()) &&
+                  deserialize_key_blob(&key_blob, &key_blob_ownership, buf_ptr, end, format()) &&
+                  additional_params.Deserialize(buf_ptr, end, format());
+    if (retval && message_version > 3)
+        retval = copy_uint64_from_buf(buf_ptr, end, &key_handle);
+    return retval;
 }
 
 size_t BeginOperationResponse::NonErrorSerializedSize() const {
     if (message_version == 0)
         return sizeof(op_handle);
     else
-        return sizeof(op_handle) + output_params.SerializedSize();
+        return sizeof(op_handle) + output_params.SerializedSize(format());
 }
 
 uint8_t* BeginOperationResponse::NonErrorSerialize(uint8_t* buf, const uint8_t* end) const {
     buf = append_uint64_to_buf(buf, end, op_handle);
     if (message_version > 0)
-        buf = output_params.Serialize(buf, end);
+        buf = output_params.Serialize(buf, end, format());
     return buf;
 }
 
 bool BeginOperationResponse::NonErrorDeserialize(const uint8_t** buf_ptr, const uint8_t* end) {
     bool retval = copy_uint64_from_buf(buf_ptr, end, &op_handle);
     if (retval && message_version > 0)
-        retval = output_params.Deserialize(buf_ptr, end);
+        retval = output_params.Deserialize(buf_ptr, end, format());
     return retval;
 }
 
 size_t UpdateOperationRequest::SerializedSize() const {
     if (message_version == 0)
-        return sizeof(op_handle) + input.SerializedSize();
+        return sizeof(op_handle) + input.SerializedSize(format());
     else
-        return sizeof(op_handle) + input.SerializedSize() + additional_params.SerializedSize();
+        return sizeof(op_handle) + input.SerializedSize(format()) +
+               additional_params.SerializedSize(format());
 }
 
 uint8_t* UpdateOperationRequest::Serialize(uint8_t* buf, const uint8_t* end) const {
     buf = append_uint64_to_buf(buf, end, op_handle);
-    buf = input.Serialize(buf, end);
+    buf = input.Serialize(buf, end, format());
     if (message_version > 0)
-        buf = additional_params.Serialize(buf, end);
+        buf = additional_params.Serialize(buf, end, format());
     return buf;
 }
 
+bool UpdateOperationRequest::SerializeToSegments(SerializationSegments* segments) const {
+    bool retval = append_uint64_to_segments(segments, op_handle) &&
+                  input.SerializeToSegments(segments, format());
+    if (retval && message_version > 0)
+        retval = set_to_segments(additional_params, segments, format());
+    return retval;
+}
+
+static bool DeserializeBuffer(Buffer* buffer, bool borrow, const uint8_t** buf_ptr,
+                              const uint8_t* end, SerializationFormat format) {
+    return borrow ? buffer->DeserializeBorrowed(buf_ptr, end, format)
+                  : buffer->Deserialize(buf_ptr, end, format);
+}
+
 bool UpdateOperationRequest::Deserialize(const uint8_t** buf_ptr, const uint8_t* end) {
-    bool retval = copy_uint64_from_buf(buf_ptr, end, &op_handle) && input.Deserialize(buf_ptr, end);
+    bool retval = copy_uint64_from_buf(buf_ptr, end, &op_handle) &&
+                  DeserializeBuffer(&input, borrow_buffers_, buf_ptr, end, format());
     if (retval && message_version > 0)
-        retval = additional_params.Deserialize(buf_ptr, end);
+        retval = additional_params.Deserialize(buf_ptr, end, format());
     return retval;
 }
 
+size_t UpdateAadRequest::SerializedSize() const {
+    return sizeof(op_handle) + aad.SerializedSize(format());
+}
+
+uint8_t* UpdateAadRequest::Serialize(uint8_t* buf, const uint8_t* end) const {
+    buf = append_uint64_to_buf(buf, end, op_handle);
+    return aad.Serialize(buf, end, format());
+}
+
+bool UpdateAadRequest::SerializeToSegments(SerializationSegments* segments) const {
+    return append_uint64_to_segments(segments, op_handle) &&
+           aad.SerializeToSegments(segments, format());
+}
+
+bool UpdateAadRequest::Deserialize(const uint8_t** buf_ptr, const uint8_t* end) {
+    return copy_uint64_from_buf(buf_ptr, end, &op_handle) &&
+           DeserializeBuffer(&aad, borrow_buffers_, buf_ptr, end, format());
+}
+
 size_t UpdateOperationResponse::NonErrorSerializedSize() const {
     size_t size = 0;
     switch (message_version) {
+    case 5:
+    case 4:
     case 3:
     case 2:
-        size += output_params.SerializedSize();
+        size += output_params.SerializedSize(format());
         ; /* falls through */
     case 1:
-        size += sizeof(uint32_t);
+        size += uint32_serialized_size(input_consumed, format());
         ; /* falls through */
     case 0:
-        size += output.SerializedSize();
+        size += output.SerializedSize(format());
         break;
 
     default:
@@ -213,35 +383,46 @@ size_t UpdateOperationResponse::NonErrorSerializedSize() const {
 }
 
 uint8_t* UpdateOperationResponse::NonErrorSerialize(uint8_t* buf, const uint8_t* end) const {
-    buf = output.Serialize(buf, end);
+    buf = output.Serialize(buf, end, format());
     if (message_version > 0)
-        buf = append_uint32_to_buf(buf, end, input_consumed);
+        buf = append_uint32_to_buf(buf, end, input_consumed, format());
     if (message_version > 1)
-        buf = output_params.Serialize(buf, end);
+        buf = output_params.Serialize(buf, end, format());
     return buf;
 }
 
+bool UpdateOperationResponse::NonErrorSerializeToSegments(SerializationSegments* segments) const {
+    bool retval = output.SerializeToSegments(segments, format());
+    if (retval && message_version > 0)
+        retval = append_uint32_to_segments(segments, input_consumed, format());
+    if (retval && message_version > 1)
+        retval = set_to_segments(output_params, segments, format());
+    return retval;
+}
+
 bool UpdateOperationResponse::NonErrorDeserialize(const uint8_t** buf_ptr, const uint8_t* end) {
-    bool retval = output.Deserialize(buf_ptr, end);
+    bool retval = output.Deserialize(buf_ptr, end, format());
     if (retval && message_version > 0)
-        retval = copy_uint32_from_buf(buf_ptr, end, &input_consumed);
+        retval = copy_uint32_from_buf(buf_ptr, end, &input_consumed, format());
     if (retval && message_version > 1)
-        retval = output_params.Deserialize(buf_ptr, end);
+        retval = output_params.Deserialize(buf_ptr, end, format());
     return retval;
 }
 
 size_t FinishOperationRequest::SerializedSize() const {
     size_t size = 0;
     switch (message_version) {
+    case 5:
+    case 4:
     case 3:
-        size += input.SerializedSize();
+        size += input.SerializedSize(format());
         ; /* falls through */
     case 2:
     case 1:
-        size += additional_params.SerializedSize();
+        size += additional_params.SerializedSize(format());
         ; /* falls through */
     case 0:
-        size += sizeof(op_handle) + signature.SerializedSize();
+        size += sizeof(op_handle) + signature.SerializedSize(format());
         break;
 
     default:
@@ -253,55 +434,72 @@ size_t FinishOperationRequest::SerializedSize() const {
 
 uint8_t* FinishOperationRequest::Serialize(uint8_t* buf, const uint8_t* end) const {
     buf = append_uint64_to_buf(buf, end, op_handle);
-    buf = signature.Serialize(buf, end);
+    buf = signature.Serialize(buf, end, format());
     if (message_version > 0)
-        buf = additional_params.Serialize(buf, end);
+        buf = additional_params.Serialize(buf, end, format());
     if (message_version > 2)
-        buf = input.Serialize(buf, end);
+        buf = input.Serialize(buf, end, format());
     return buf;
 }
 
+bool FinishOperationRequest::SerializeToSegments(SerializationSegments* segments) const {
+    bool retval = append_uint64_to_segments(segments, op_handle) &&
+                  signature.SerializeToSegments(segments, format());
+    if (retval && message_version > 0)
+        retval = set_to_segments(additional_params, segments, format());
+    if (retval && message_version > 2)
+        retval = input.SerializeToSegments(segments, format());
+    return retval;
+}
+
 bool FinishOperationRequest::Deserialize(const uint8_t** buf_ptr, const uint8_t* end) {
-    bool retval =
-        copy_uint64_from_buf(buf_ptr, end, &op_handle) && signature.Deserialize(buf_ptr, end);
+    bool retval = copy_uint64_from_buf(buf_ptr, end, &op_handle) &&
+                  DeserializeBuffer(&signature, borrow_buffers_, buf_ptr, end, format());
     if (retval && message_version > 0)
-        retval = additional_params.Deserialize(buf_ptr, end);
+        retval = additional_params.Deserialize(buf_ptr, end, format());
     if (retval && message_version > 2)
-        retval = input.Deserialize(buf_ptr, end);
+        retval = DeserializeBuffer(&input, borrow_buffers_, buf_ptr, end, format());
     return retval;
 }
 
 size_t FinishOperationResponse::NonErrorSerializedSize() const {
     if (message_version < 2)
-        return output.SerializedSize();
+        return output.SerializedSize(format());
     else
-        return output.SerializedSize() + output_params.SerializedSize();
+        return output.SerializedSize(format()) + output_params.SerializedSize(format());
 }
 
 uint8_t* FinishOperationResponse::NonErrorSerialize(uint8_t* buf, const uint8_t* end) const {
-    buf = output.Serialize(buf, end);
+    buf = output.Serialize(buf, end, format());
     if (message_version > 1)
-        buf = output_params.Serialize(buf, end);
+        buf = output_params.Serialize(buf, end, format());
     return buf;
 }
 
+bool FinishOperationResponse::NonErrorSerializeToSegments(SerializationSegments* segments) const {
+    bool retval = output.SerializeToSegments(segments, format());
+    if (retval && message_version > 1)
+        retval = set_to_segments(output_params, segments, format());
+    return retval;
+}
+
 bool FinishOperationResponse::NonErrorDeserialize(const uint8_t** buf_ptr, const uint8_t* end) {
-    bool retval = output.Deserialize(buf_ptr, end);
+    bool retval = output.Deserialize(buf_ptr, end, format());
     if (retval && message_version > 1)
-        retval = output_params.Deserialize(buf_ptr, end);
+        retval = output_params.Deserialize(buf_ptr, end, format());
     return retval;
 }
 
 size_t AddEntropyRequest::SerializedSize() const {
-    return random_data.SerializedSize();
+    return random_data.SerializedSize(format());
 }
 
 uint8_t* AddEntropyRequest::Serialize(uint8_t* buf, const uint8_t* end) const {
-    return random_data.Serialize(buf, end);
+    return random_data.Serialize(buf, end, format());
 }
 
 bool AddEntropyRequest::Deserialize(const uint8_t** buf_ptr, const uint8_t* end) {
-    return random_data.Deserialize(buf_ptr, end);
+    return random_data.Deserialize(buf_ptr, end, format());
 }
 
 void ImportKeyRequest::SetKeyMaterial(const void* key_material, size_t length) {
@@ -311,23 +509,24 @@ void ImportKeyRequest::SetKeyMaterial(const void* key_material, size_t length) {
 }
 
 size_t ImportKeyRequest::SerializedSize() const {
-    return key_description.SerializedSize() + sizeof(uint32_t) /* key_format */ +
-           sizeof(uint32_t) /* key_data_length */ + key_data_length;
+    return key_description.SerializedSize(format()) + uint32_serialized_size(key_format, format()) +
+           size_and_data_serialized_size(key_data_length, format());
 }
 
 uint8_t* ImportKeyRequest::Serialize(uint8_t* buf, const uint8_t* end) const {
-    buf = key_description.Serialize(buf, end);
-    buf = append_uint32_to_buf(buf, end, key_format);
-    return append_size_and_data_to_buf(buf, end, key_data, key_data_length);
+    buf = key_description.Serialize(buf, end, format());
+    buf = append_uint32_to_buf(buf, end, key_format, format());
+    return append_size_and_data_to_buf(buf, end, key_data, key_data_length, format());
 }
 
 bool ImportKeyRequest::Deserialize(const uint8_t** buf_ptr, const uint8_t* end) {
     delete[] key_data;
     key_data = NULL;
     UniquePtr<uint8_t[]> deserialized_key_material;
-    if (!key_description.Deserialize(buf_ptr, end) ||
-        !copy_uint32_from_buf(buf_ptr, end, &key_format) ||
-        !copy_size_and_data_from_buf(buf_ptr, end, &key_data_length, &deserialized_key_material))
+    if (!key_description.Deserialize(buf_ptr, end, format()) ||
+        !copy_uint32_from_buf(buf_ptr, end, &key_format, format()) ||
+        !copy_size_and_data_from_buf(buf_ptr, end, &key_data_length, &deserialized_key_material,
+                                     format()))
         return false;
     key_data = deserialized_key_material.release();
     return true;
@@ -338,39 +537,57 @@ void ImportKeyResponse::SetKeyMaterial(const void* key_material, size_t length)
 }
 
 size_t ImportKeyResponse::NonErrorSerializedSize() const {
-    return key_blob_size(key_blob) + enforced.SerializedSize() + unenforced.SerializedSize();
+    return key_blob_size(key_blob, format()) + enforced.SerializedSize(format()) +
+           unenforced.SerializedSize(format());
 }
 
 uint8_t* ImportKeyResponse::NonErrorSerialize(uint8_t* buf, const uint8_t* end) const {
-    buf = serialize_key_blob(key_blob, buf, end);
-    buf = enforced.Serialize(buf, end);
-    return unenforced.Serialize(buf, end);
+    buf = serialize_key_blob(key_blob, buf, end, format());
+    buf = enforced.Serialize(buf, end, format());
+    return unenforced.Serialize(buf, end, format());
+}
+
+bool ImportKeyResponse::NonErrorSerializeToSegments(SerializationSegments* segments) const {
+    return key_blob_to_segments(key_blob, segments, format()) &&
+           set_to_segments(enforced, segments, format()) &&
+           set_to_segments(unenforced, segments, format());
 }
 
 bool ImportKeyResponse::NonErrorDeserialize(const uint8_t** buf_ptr, const uint8_t* end) {
-    return deserialize_key_blob(&key_blob, buf_ptr, end) && enforced.Deserialize(buf_ptr, end) &&
-           unenforced.Deserialize(buf_ptr, end);
+    return deserialize_key_blob(&key_blob, buf_ptr, end, format()) &&
+           enforced.Deserialize(buf_ptr, end, format()) &&
+           unenforced.Deserialize(buf_ptr, end, format());
+}
+
+ExportKeyRequest::~ExportKeyRequest() {
+    delete_key_blob(&key_blob, key_blob_ownership);
 }
 
 void ExportKeyRequest::SetKeyMaterial(const void* key_material, size_t length) {
-    set_key_blob(&key_blob, key_material, length);
+    set_key_blob(&key_blob, &key_blob_ownership, key_material, length);
 }
 
 size_t ExportKeyRequest::SerializedSize() const {
-    return additional_params.SerializedSize() + sizeof(uint32_t) /* key_format */ +
-           key_blob_size(key_blob);
+    return additional_params.SerializedSize(format()) +
+           uint32_serialized_size(key_format, format()) + key_blob_size(key_blob, format());
 }
 
 uint8_t* ExportKeyRequest::Serialize(uint8_t* buf, const uint8_t* end) const {
-    buf = additional_params.Serialize(buf, end);
-    buf = append_uint32_to_buf(buf, end, key_format);
-    return serialize_key_blob(key_blob, buf, end);
+    buf = additional_params.Serialize(buf, end, format());
+    buf = append_uint32_to_buf(buf, end, key_format, format());
+    return serialize_key_blob(key_blob, buf, end, format());
+}
+
+bool ExportKeyRequest::SerializeToSegments(SerializationSegments* segments) const {
+    return set_to_segments(additional_params, segments, format()) &&
+           append_uint32_to_segments(segments, key_format, format()) &&
+           key_blob_to_segments(key_blob, segments, format());
 }
 
 bool ExportKeyRequest::Deserialize(const uint8_t** buf_ptr, const uint8_t* end) {
-    return additional_params.Deserialize(buf_ptr, end) &&
-           copy_uint32_from_buf(buf_ptr, end, &key_format) &&
-           deserialize_key_blob(&key_blob, buf_ptr, end);
+    return additional_params.Deserialize(buf_ptr, end, format()) &&
+           copy_uint32_from_buf(buf_ptr, end, &key_format, format()) &&
+           deserialize_key_blob(&key_blob, &key_blob_ownership, buf_ptr, end, format());
 }
 
 void ExportKeyResponse::SetKeyMaterial(const void* key_material, size_t length) {
@@ -380,18 +597,23 @@ void ExportKeyResponse::SetKeyMaterial(const void* key_material, size_t length)
 }
 
 size_t ExportKeyResponse::NonErrorSerializedSize() const {
-    return sizeof(uint32_t) /* key_data_length */ + key_data_length;
+    return size_and_data_serialized_size(key_data_length, format());
 }
 
 uint8_t* ExportKeyResponse::NonErrorSerialize(uint8_t* buf, const uint8_t* end) const {
-    return append_size_and_data_to_buf(buf, end, key_data, key_data_length);
+    return append_size_and_data_to_buf(buf, end, key_data, key_data_length, format());
+}
+
+bool ExportKeyResponse::NonErrorSerializeToSegments(SerializationSegments* segments) const {
+    return append_size_and_data_to_segments(segments, key_data, key_data_length, format());
 }
 
 bool ExportKeyResponse::NonErrorDeserialize(const uint8_t** buf_ptr, const uint8_t* end) {
     delete[] key_data;
     key_data = NULL;
     UniquePtr<uint8_t[]> deserialized_key_material;
-    if (!copy_size_and_data_from_buf(buf_ptr, end, &key_data_length, &deserialized_key_material))
+    if (!copy_size_and_data_from_buf(buf_ptr, end, &key_data_length, &deserialized_key_material,
+                                     format()))
         return false;
     key_data = deserialized_key_material.release();
     return true;
@@ -402,15 +624,15 @@ void DeleteKeyRequest::SetKeyMaterial(const void* key_material, size_t length) {
 }
 
 size_t DeleteKeyRequest::SerializedSize() const {
-    return key_blob_size(key_blob);
+    return key_blob_size(key_blob, format());
 }
 
 uint8_t* DeleteKeyRequest::Serialize(uint8_t* buf, const uint8_t* end) const {
-    return serialize_key_blob(key_blob, buf, end);
+    return serialize_key_blob(key_blob, buf, end, format());
 }
 
 bool DeleteKeyRequest::Deserialize(const uint8_t** buf_ptr, const uint8_t* end) {
-    return deserialize_key_blob(&key_blob, buf_ptr, end);
+    return deserialize_key_blob(&key_blob, buf_ptr, end, format());
 }
 
 size_t GetVersionResponse::NonErrorSerializedSize() const {
@@ -440,89 +662,108 @@ bool GetVersionResponse::NonErrorDeserialize(const uint8_t** buf_ptr, const uint
 }
 
 AttestKeyRequest::~AttestKeyRequest() {
-    delete[] key_blob.key_material;
+    delete_key_blob(&key_blob, key_blob_ownership);
 }
 
 void AttestKeyRequest::SetKeyMaterial(const void* key_material, size_t length) {
-    set_key_blob(&key_blob, key_material, length);
+    set_key_blob(&key_blob, &key_blob_ownership, key_material, length);
 }
 
 size_t AttestKeyRequest::SerializedSize() const {
-    return key_blob_size(key_blob) + attest_params.SerializedSize();
+    return key_blob_size(key_blob, format()) + attest_params.SerializedSize(format());
 }
 
 uint8_t* AttestKeyRequest::Serialize(uint8_t* buf, const uint8_t* end) const {
-    buf = serialize_key_blob(key_blob, buf, end);
-    return attest_params.Serialize(buf, end);
+    buf = serialize_key_blob(key_blob, buf, end, format());
+    return attest_params.Serialize(buf, end, format());
 }
 
 bool AttestKeyRequest::Deserialize(const uint8_t** buf_ptr, const uint8_t* end) {
-    return deserialize_key_blob(&key_blob, buf_ptr, end) && attest_params.Deserialize(buf_ptr, end);
+    return deserialize_key_blob(&key_blob, &key_blob_ownership, buf_ptr, end, format()) &&
+           attest_params.Deserialize(buf_ptr, end, format());
 }
 
-AttestKeyResponse::~AttestKeyResponse() {
-    for (size_t i = 0; i < certificate_chain.entry_count; ++i)
-        delete[] certificate_chain.entries[i].data;
-    delete[] certificate_chain.entries;
+static void clear_cert_chain(keymaster_cert_chain_t* chain) {
+    if (chain->entries) {
+        for (size_t i = 0; i < chain->entry_count; ++i)
+            delete[] chain->entries[i].data;
+        delete[] chain->entries;
+    }
+    chain->entries = nullptr;
+    chain->entry_count = 0;
 }
 
 const size_t kMaxChainEntryCount = 10;
-bool AttestKeyResponse::AllocateChain(size_t entry_count) {
+static bool allocate_cert_chain(size_t entry_count, keymaster_cert_chain_t* chain) {
     if (entry_count > kMaxChainEntryCount)
         return false;
 
-    if (certificate_chain.entries) {
-        for (size_t i = 0; i < certificate_chain.entry_count; ++i)
-            delete[] certificate_chain.entries[i].data;
-        delete[] certificate_chain.entries;
-    }
-
-    certificate_chain.entry_count = entry_count;
-    certificate_chain.entries = new keymaster_blob_t[entry_count];
-    if (!certificate_chain.entries) {
-        certificate_chain.entry_count = 0;
+    clear_cert_chain(chain);
+    chain->entries = new (std::nothrow) keymaster_blob_t[entry_count];
+    if (!chain->entries)
         return false;
-    }
 
-    memset(certificate_chain.entries, 0, sizeof(certificate_chain.entries[0]) * entry_count);
+    chain->entry_count = entry_count;
+    memset(chain->entries, 0, sizeof(chain->entries[0]) * entry_count);
     return true;
 }
 
-size_t AttestKeyResponse::NonErrorSerializedSize() const {
-    size_t result = sizeof(uint32_t); /* certificate_chain.entry_count */
-    for (size_t i = 0; i < certificate_chain.entry_count; ++i) {
-        result += sizeof(uint32_t); /* certificate_chain.entries[i].data_length */
-        result += certificate_chain.entries[i].data_length;
-    }
+static size_t cert_chain_size(const keymaster_cert_chain_t& chain, SerializationFormat format) {
+    size_t result = uint32_serialized_size(chain.entry_count, format);
+    for (size_t i = 0; i < chain.entry_count; ++i)
+        result += size_and_data_serialized_size(chain.entries[i].data_length, format);
     return result;
 }
 
-uint8_t* AttestKeyResponse::NonErrorSerialize(uint8_t* buf, const uint8_t* end) const {
-    buf = append_uint32_to_buf(buf, end, certificate_chain.entry_count);
-    for (size_t i = 0; i < certificate_chain.entry_count; ++i) {
-        buf = append_size_and_data_to_buf(buf, end, certificate_chain.entries[i].data,
-                                          certificate_chain.entries[i].data_length);
+static uint8_t* serialize_cert_chain(const keymaster_cert_chain_t& chain, uint8_t* buf,
+                                     const uint8_t* end, SerializationFormat format) {
+    buf = append_uint32_to_buf(buf, end, chain.entry_count, format);
+    for (size_t i = 0; i < chain.entry_count; ++i) {
+        buf = append_size_and_data_to_buf(buf, end, chain.entries[i].data,
+                                          chain.entries[i].data_length, format);
     }
     return buf;
 }
 
-bool AttestKeyResponse::NonErrorDeserialize(const uint8_t** buf_ptr, const uint8_t* end) {
+static bool deserialize_cert_chain(keymaster_cert_chain_t* chain, const uint8_t** buf_ptr,
+                                   const uint8_t* end, SerializationFormat format) {
     size_t entry_count;
-    if (!copy_uint32_from_buf(buf_ptr, end, &entry_count) || !AllocateChain(entry_count))
+    if (!copy_uint32_from_buf(buf_ptr, end, &entry_count, format) ||
+        !allocate_cert_chain(entry_count, chain))
         return false;
 
-    for (size_t i = 0; i < certificate_chain.entry_count; ++i) {
+    for (size_t i = 0; i < chain->entry_count; ++i) {
         UniquePtr<uint8_t[]> data;
         size_t data_length;
-        if (!copy_size_and_data_from_buf(buf_ptr, end, &data_length, &data))
+        if (!copy_size_and_data_from_buf(buf_ptr, end, &data_length, &data, format))
             return false;
-        certificate_chain.entries[i].data = data.release();
-        certificate_chain.entries[i].data_length = data_length;
+        chain->entries[i].data = data.release();
+        chain->entries[i].data_length = data_length;
     }
 
     return true;
 }
 
+AttestKeyResponse::~AttestKeyResponse() {
+    clear_cert_chain(&certificate_chain);
+}
+
+bool AttestKeyResponse::AllocateChain(size_t entry_count) {
+    return allocate_cert_chain(entry_count, &certificate_chain);
+}
+
+size_t AttestKeyResponse::NonErrorSerializedSize() const {
+    return cert_chain_size(certificate_chain, format());
+}
+
+uint8_t* AttestKeyResponse::NonErrorSerialize(uint8_t* buf, const uint8_t* end) const {
+    return serialize_cert_chain(certificate_chain, buf, end, format());
+}
+
+bool AttestKeyResponse::NonErrorDeserialize(const uint8_t** buf_ptr, const uint8_t* end) {
+    return deserialize_cert_chain(&certificate_chain, buf_ptr, end, format());
+}
+
 UpgradeKeyRequest::~UpgradeKeyRequest() {
     delete[] key_blob.key_material;
 }
@@ -532,17 +773,17 @@ void UpgradeKeyRequest::SetKeyMaterial(const void* key_material, size_t length)
 }
 
 size_t UpgradeKeyRequest::SerializedSize() const {
-    return key_blob_size(key_blob) + upgrade_params.SerializedSize();
+    return key_blob_size(key_blob, format()) + upgrade_params.SerializedSize(format());
 }
 
 uint8_t* UpgradeKeyRequest::Serialize(uint8_t* buf, const uint8_t* end) const {
-    buf = serialize_key_blob(key_blob, buf, end);
-    return upgrade_params.Serialize(buf, end);
+    buf = serialize_key_blob(key_blob, buf, end, format());
+    return upgrade_params.Serialize(buf, end, format());
 }
 
 bool UpgradeKeyRequest::Deserialize(const uint8_t** buf_ptr, const uint8_t* end) {
-    return deserialize_key_blob(&key_blob, buf_ptr, end) &&
-           upgrade_params.Deserialize(buf_ptr, end);
+    return deserialize_key_blob(&key_blob, buf_ptr, end, format()) &&
+           upgrade_params.Deserialize(buf_ptr, end, format());
 }
 
 UpgradeKeyResponse::~UpgradeKeyResponse() {
@@ -550,15 +791,885 @@ UpgradeKeyResponse::~UpgradeKeyResponse() {
 }
 
 size_t UpgradeKeyResponse::NonErrorSerializedSize() const {
-    return key_blob_size(upgraded_key);
+    return key_blob_size(upgraded_key, format());
 }
 
 uint8_t* UpgradeKeyResponse::NonErrorSerialize(uint8_t* buf, const uint8_t* end) const {
-    return serialize_key_blob(upgraded_key, buf, end);
+    return serialize_key_blob(upgraded_key, buf, end, format());
 }
 
 bool UpgradeKeyResponse::NonErrorDeserialize(const uint8_t** buf_ptr, const uint8_t* end) {
-    return deserialize_key_blob(&upgraded_key, buf_ptr, end);
+    return deserialize_key_blob(&upgraded_key, buf_ptr, end, format());
+}
+
+MigrateKeyRequest::~MigrateKeyRequest() {
+    delete[] key_blob.key_material;
+}
+
+void MigrateKeyRequest::SetKeyMaterial(const void* key_material, size_t length) {
+    set_key_blob(&key_blob, key_material, length);
+}
+
+size_t MigrateKeyRequest::SerializedSize() const {
+    return key_blob_size(key_blob, format()) + additional_params.SerializedSize(format());
+}
+
+uint8_t* MigrateKeyRequest::Serialize(uint8_t* buf, const uint8_t* end) const {
+    buf = serialize_key_blob(key_blob, buf, end, format());
+    return additional_params.Serialize(buf, end, format());
+}
+
+bool MigrateKeyRequest::Deserialize(const uint8_t** buf_ptr, const uint8_t* end) {
+    return deserialize_key_blob(&key_blob, buf_ptr, end, format()) &&
+           additional_params.Deserialize(buf_ptr, end, format());
+}
+
+MigrateKeyResponse::~MigrateKeyResponse() {
+    delete[] migrated_key.key_material;
+}
+
+size_t MigrateKeyResponse::NonErrorSerializedSize() const {
+    return key_blob_size(migrated_key, format());
+}
+
+uint8_t* MigrateKeyResponse::NonErrorSerialize(uint8_t* buf, const uint8_t* end) const {
+    return serialize_key_blob(migrated_key, buf, end, format());
+}
+
+bool MigrateKeyResponse::NonErrorDeserialize(const uint8_t** buf_ptr, const uint8_t* end) {
+    return deserialize_key_blob(&migrated_key, buf_ptr, end, format());
+}
+
+PinKeyRequest::~PinKeyRequest() {
+    delete[] key_blob.key_material;
+}
+
+void PinKeyRequest::SetKeyMaterial(const void* key_material, size_t length) {
+    set_key_blob(&key_blob, key_material, length);
+}
+
+size_t PinKeyRequest::SerializedSize() const {
+    return key_blob_size(key_blob, format()) + additional_params.SerializedSize(format());
+}
+
+uint8_t* PinKeyRequest::Serialize(uint8_t* buf, const uint8_t* end) const {
+    buf = serialize_key_blob(key_blob, buf, end, format());
+    return additional_params.Serialize(buf, end, format());
+}
+
+bool PinKeyRequest::Deserialize(const uint8_t** buf_ptr, const uint8_t* end) {
+    return deserialize_key_blob(&key_blob, buf_ptr, end, format()) &&
+           additional_params.Deserialize(buf_ptr, end, format());
+}
+
+OneShotOperationRequest::~OneShotOperationRequest() {
+    delete[] key_blob.key_material;
+}
+
+void OneShotOperationRequest::SetKeyMaterial(const void* key_material, size_t length) {
+    set_key_blob(&key_blob, key_material, length);
+}
+
+size_t OneShotOperationRequest::SerializedSize() const {
+    return uint32_serialized_size(purpose, format()) + key_blob_size(key_blob, format()) +
+           additional_params.SerializedSize(format()) + input.SerializedSize(format()) +
+           signature.SerializedSize(format()) + sizeof(key_handle);
+}
+
+uint8_t* OneShotOperationRequest::Serialize(uint8_t* buf, const uint8_t* end) const {
+    buf = append_uint32_to_buf(buf, end, purpose, format());
+    buf = serialize_key_blob(key_blob, buf, end, format());
+    buf = additional_params.Serialize(buf, end, format());
+    buf = input.Serialize(buf, end, format());
+    buf = signature.Serialize(buf, end, format());
+    return append_uint64_to_buf(buf, end, key_handle);
+}
+
+bool OneShotOperationRequest::SerializeToSegments(SerializationSegments* segments) const {
+    return append_uint32_to_segments(segments, purpose, format()) &&
+           key_blob_to_segments(key_blob, segments, format()) &&
+           set_to_segments(additional_params, segments, format()) &&
+           input.SerializeToSegments(segments, format()) &&
+           signature.SerializeToSegments(segments, format()) &&
+           append_uint64_to_segments(segments, key_handle);
+}
+
+bool OneShotOperationRequest::Deserialize(const uint8_t** buf_ptr, const uint8_t* end) {
+    return copy_uint32_from_buf(buf_ptr, end, &purpose, format()) &&
+           deserialize_key_blob(&key_blob, buf_ptr, end, format()) &&
+           additional_params.Deserialize(buf_ptr, end, format()) &&
+           input.Deserialize(buf_ptr, end, format()) &&
+           signature.Deserialize(buf_ptr, end, format()) &&
+           copy_uint64_from_buf(buf_ptr, end, &key_handle);
+}
+
+size_t OneShotOperationResponse::NonErrorSerializedSize() const {
+    return output_params.SerializedSize(format()) + output.SerializedSize(format());
+}
+
+uint8_t* OneShotOperationResponse::NonErrorSerialize(uint8_t* buf, const uint8_t* end) const {
+    buf = output_params.Serialize(buf, end, format());
+    return output.Serialize(buf, end, format());
+}
+
+bool OneShotOperationResponse::NonErrorSerializeToSegments(SerializationSegments* segments) const {
+    return set_to_segments(output_params, segments, format()) &&
+           output.SerializeToSegments(segments, format());
+}
+
+bool OneShotOperationResponse::NonErrorDeserialize(const uint8_t** buf_ptr, const uint8_t* end) {
+    return output_params.Deserialize(buf_ptr, end, format()) &&
+           output.Deserialize(buf_ptr, end, format());
+}
+
+// The fewest bytes a length, count or error code can take in format.
+static size_t min_uint32_size(SerializationFormat format) {
+    return format == COMPACT_FORMAT ? 1 : sizeof(uint32_t);
+}
+
+// Allocates count items, after checking that count items of at least min_item_size bytes each
+// could fit in the remaining serialized data, when there is some.
+template <typename Item>
+static bool AllocateItems(size_t count, UniquePtr<Item[]>* items, size_t* item_count,
+                          size_t min_item_size = 0, size_t available = 0) {
+    items->reset();
+    *item_count = 0;
+    if (min_item_size && count > available / min_item_size)
+        return false;
+    if (count) {
+        items->reset(new (std::nothrow) Item[count]);
+        if (!items->get())
+            return false;
+        AllocationCounter::Count(sizeof(Item) * count);
+    }
+    *item_count = count;
+    return true;
+}
+
+bool WarmupKeysRequest::SetItemCount(size_t count) {
+    return AllocateItems(count, &items, &item_count);
+}
+
+size_t WarmupKeysRequest::SerializedSize() const {
+    size_t size = uint32_serialized_size(item_count, format());
+    for (size_t i = 0; i < item_count; ++i)
+        size += key_blob_size(items[i].key_blob, format()) +
+                items[i].additional_params.SerializedSize(format());
+    return size;
+}
+
+uint8_t* WarmupKeysRequest::Serialize(uint8_t* buf, const uint8_t* end) const {
+    buf = append_uint32_to_buf(buf, end, item_count, format());
+    for (size_t i = 0; i < item_count; ++i) {
+        buf = serialize_key_blob(items[i].key_blob, buf, end, format());
+        buf = items[i].additional_params.Serialize(buf, end, format());
+    }
+    return buf;
+}
+
+bool WarmupKeysRequest::Deserialize(const uint8_t** buf_ptr, const uint8_t* end) {
+    uint32_t count;
+    if (!copy_uint32_from_buf(buf_ptr, end, &count, format()) ||
+        !AllocateItems(count, &items, &item_count, 2 * min_uint32_size(format()),
+                       end - *buf_ptr))
+        return false;
+
+    for (size_t i = 0; i < item_count; ++i)
+        if (!deserialize_key_blob(&items[i].key_blob, buf_ptr, end, format()) ||
+            !items[i].additional_params.Deserialize(buf_ptr, end, format()))
+            return false;
+    return true;
+}
+
+BatchOperationRequest::~BatchOperationRequest() {
+    delete[] key_blob.key_material;
+}
+
+void BatchOperationRequest::SetKeyMaterial(const void* key_material, size_t length) {
+    set_key_blob(&key_blob, key_material, length);
+}
+
+bool BatchOperationRequest::SetItemCount(size_t count) {
+    return AllocateItems(count, &items, &item_count);
+}
+
+size_t BatchOperationRequest::SerializedSize() const {
+    size_t size = uint32_serialized_size(purpose, format()) + key_blob_size(key_blob, format()) +
+                  additional_params.SerializedSize(format()) + sizeof(key_handle) +
+                  uint32_serialized_size(item_count, format());
+    for (size_t i = 0; i < item_count; ++i)
+        size += items[i].input.SerializedSize(format()) +
+                items[i].signature.SerializedSize(format());
+    return size;
+}
+
+uint8_t* BatchOperationRequest::Serialize(uint8_t* buf, const uint8_t* end) const {
+    buf = append_uint32_to_buf(buf, end, purpose, format());
+    buf = serialize_key_blob(key_blob, buf, end, format());
+    buf = additional_params.Serialize(buf, end, format());
+    buf = append_uint64_to_buf(buf, end, key_handle);
+    buf = append_uint32_to_buf(buf, end, item_count, format());
+    for (size_t i = 0; i < item_count; ++i) {
+        buf = items[i].input.Serialize(buf, end, format());
+        buf = items[i].signature.Serialize(buf, end, format());
+    }
+    return buf;
+}
+
+bool BatchOperationRequest::Deserialize(const uint8_t** buf_ptr, const uint8_t* end) {
+    uint32_t count;
+    if (!copy_uint32_from_buf(buf_ptr, end, &purpose, format()) ||
+        !deserialize_key_blob(&key_blob, buf_ptr, end, format()) ||
+        !additional_params.Deserialize(buf_ptr, end, format()) ||
+        !copy_uint64_from_buf(buf_ptr, end, &key_handle) ||
+        !copy_uint32_from_buf(buf_ptr, end, &count, format()) ||
+        !AllocateItems(count, &items, &item_count, 2 * min_uint32_size(format()), end - *buf_ptr))
+        return false;
+
+    for (size_t i = 0; i < item_count; ++i)
+        if (!items[i].input.Deserialize(buf_ptr, end, format()) ||
+            !items[i].signature.Deserialize(buf_ptr, end, format()))
+            return false;
+    return true;
+}
+
+bool BatchOperationResponse::SetItemCount(size_t count) {
+    return AllocateItems(count, &items, &item_count);
+}
+
+size_t BatchOperationResponse::NonErrorSerializedSize() const {
+    size_t size = uint32_serialized_size(item_count, format());
+    for (size_t i = 0; i < item_count; ++i)
+        size += error_size(items[i].error, format()) +
+                items[i].output_params.SerializedSize(format()) +
+                items[i].output.SerializedSize(format());
+    return size;
+}
+
+uint8_t* BatchOperationResponse::NonErrorSerialize(uint8_t* buf, const uint8_t* end) const {
+    buf = append_uint32_to_buf(buf, end, item_count, format());
+    for (size_t i = 0; i < item_count; ++i) {
+        buf = append_error_to_buf(buf, end, items[i].error, format());
+        buf = items[i].output_params.Serialize(buf, end, format());
+        buf = items[i].output.Serialize(buf, end, format());
+    }
+    return buf;
+}
+
+bool BatchOperationResponse::NonErrorDeserialize(const uint8_t** buf_ptr, const uint8_t* end) {
+    uint32_t count;
+    // Even an empty item has an error code, a parameter set header (three words, or one count if
+    // compact) and a buffer length.
+    size_t min_item_size = format() == COMPACT_FORMAT ? 3 : 5 * sizeof(uint32_t);
+    if (!copy_uint32_from_buf(buf_ptr, end, &count, format()) ||
+        !AllocateItems(count, &items, &item_count, min_item_size, end - *buf_ptr))
+        return false;
+
+    for (size_t i = 0; i < item_count; ++i) {
+        if (!copy_error_from_buf(buf_ptr, end, &items[i].error, format()) ||
+            !items[i].output_params.Deserialize(buf_ptr, end, format()) ||
+            !items[i].output.Deserialize(buf_ptr, end, format()))
+            return false;
+    }
+    return true;
+}
+
+bool BatchUpgradeKeyRequest::SetItemCount(size_t count) {
+    return AllocateItems(count, &items, &item_count);
+}
+
+size_t BatchUpgradeKeyRequest::SerializedSize() const {
+    size_t size = upgrade_params.SerializedSize(format()) +
+                  uint32_serialized_size(item_count, format());
+    for (size_t i = 0; i < item_count; ++i)
+        size += key_blob_size(items[i].key_blob, format());
+    return size;
+}
+
+uint8_t* BatchUpgradeKeyRequest::Serialize(uint8_t* buf, const uint8_t* end) const {
+    buf = upgrade_params.Serialize(buf, end, format());
+    buf = append_uint32_to_buf(buf, end, item_count, format());
+    for (size_t i = 0; i < item_count; ++i)
+        buf = serialize_key_blob(items[i].key_blob, buf, end, format());
+    return buf;
+}
+
+bool BatchUpgradeKeyRequest::Deserialize(const uint8_t** buf_ptr, const uint8_t* end) {
+    uint32_t count;
+    if (!upgrade_params.Deserialize(buf_ptr, end, format()) ||
+        !copy_uint32_from_buf(buf_ptr, end, &count, format()) ||
+        !AllocateItems(count, &items, &item_count, min_uint32_size(format()), end - *buf_ptr))
+        return false;
+
+    for (size_t i = 0; i < item_count; ++i)
+        if (!deserialize_key_blob(&items[i].key_blob, buf_ptr, end, format()))
+            return false;
+    return true;
+}
+
+bool BatchUpgradeKeyResponse::SetItemCount(size_t count) {
+    return AllocateItems(count, &items, &item_count);
+}
+
+size_t BatchUpgradeKeyResponse::NonErrorSerializedSize() const {
+    size_t size = uint32_serialized_size(item_count, format());
+    for (size_t i = 0; i < item_count; ++i)
+        size +=
+            error_size(items[i].error, format()) + key_blob_size(items[i].upgraded_key, format());
+    return size;
+}
+
+uint8_t* BatchUpgradeKeyResponse::NonErrorSerialize(uint8_t* buf, const uint8_t* end) const {
+    buf = append_uint32_to_buf(buf, end, item_count, format());
+    for (size_t i = 0; i < item_count; ++i) {
+        buf = append_error_to_buf(buf, end, items[i].error, format());
+        buf = serialize_key_blob(items[i].upgraded_key, buf, end, format());
+    }
+    return buf;
+}
+
+bool BatchUpgradeKeyResponse::NonErrorDeserialize(const uint8_t** buf_ptr, const uint8_t* end) {
+    uint32_t count;
+    // Even an empty item has an error code and a blob length.
+    if (!copy_uint32_from_buf(buf_ptr, end, &count, format()) ||
+        !AllocateItems(count, &items, &item_count, 2 * min_uint32_size(format()), end - *buf_ptr))
+        return false;
+
+    for (size_t i = 0; i < item_count; ++i)
+        if (!copy_error_from_buf(buf_ptr, end, &items[i].error, format()) ||
+            !deserialize_key_blob(&items[i].upgraded_key, buf_ptr, end, format()))
+            return false;
+    return true;
+}
+
+bool GenerateKeysRequest::SetItemCount(size_t count) {
+    return AllocateItems(count, &items, &item_count);
+}
+
+size_t GenerateKeysRequest::SerializedSize() const {
+    size_t size = uint32_serialized_size(item_count, format());
+    for (size_t i = 0; i < item_count; ++i)
+        size += items[i].key_description.SerializedSize(format());
+    return size;
+}
+
+uint8_t* GenerateKeysRequest::Serialize(uint8_t* buf, const uint8_t* end) const {
+    buf = append_uint32_to_buf(buf, end, item_count, format());
+    for (size_t i = 0; i < item_count; ++i)
+        buf = items[i].key_description.Serialize(buf, end, format());
+    return buf;
+}
+
+bool GenerateKeysRequest::Deserialize(const uint8_t** buf_ptr, const uint8_t* end) {
+    uint32_t count;
+    if (!copy_uint32_from_buf(buf_ptr, end, &count, format()) ||
+        !AllocateItems(count, &items, &item_count, min_uint32_size(format()), end - *buf_ptr))
+        return false;
+
+    for (size_t i = 0; i < item_count; ++i)
+        if (!items[i].key_description.Deserialize(buf_ptr, end, format()))
+            return false;
+    return true;
+}
+
+bool GenerateKeysResponse::SetItemCount(size_t count) {
+    return AllocateItems(count, &items, &item_count);
+}
+
+size_t GenerateKeysResponse::NonErrorSerializedSize() const {
+    size_t size = uint32_serialized_size(item_count, format());
+    for (size_t i = 0; i < item_count; ++i)
+        size += error_size(items[i].error, format()) + key_blob_size(items[i].key_blob, format()) +
+                items[i].enforced.SerializedSize(format()) +
+                items[i].unenforced.SerializedSize(format());
+    return size;
+}
+
+uint8_t* GenerateKeysResponse::NonErrorSerialize(uint8_t* buf, const uint8_t* end) const {
+    buf = append_uint32_to_buf(buf, end, item_count, format());
+    for (size_t i = 0; i < item_count; ++i) {
+        buf = append_error_to_buf(buf, end, items[i].error, format());
+        buf = serialize_key_blob(items[i].key_blob, buf, end, format());
+        buf = items[i].enforced.Serialize(buf, end, format());
+        buf = items[i].unenforced.Serialize(buf, end, format());
+    }
+    return buf;
+}
+
+bool GenerateKeysResponse::NonErrorDeserialize(const uint8_t** buf_ptr, const uint8_t* end) {
+    uint32_t count;
+    // Even an empty item has an error code, a blob length and two sets.
+    if (!copy_uint32_from_buf(buf_ptr, end, &count, format()) ||
+        !AllocateItems(count, &items, &item_count, 4 * min_uint32_size(format()), end - *buf_ptr))
+        return false;
+
+    for (size_t i = 0; i < item_count; ++i)
+        if (!copy_error_from_buf(buf_ptr, end, &items[i].error, format()) ||
+            !deserialize_key_blob(&items[i].key_blob, buf_ptr, end, format()) ||
+            !items[i].enforced.Deserialize(buf_ptr, end, format()) ||
+            !items[i].unenforced.Deserialize(buf_ptr, end, format()))
+            return false;
+    return true;
+}
+
+bool BatchGetKeyCharacteristicsRequest::SetItemCount(size_t count) {
+    return AllocateItems(count, &items, &item_count);
+}
+
+size_t BatchGetKeyCharacteristicsRequest::SerializedSize() const {
+    size_t size = additional_params.SerializedSize(format()) +
+                  uint32_serialized_size(item_count, format());
+    for (size_t i = 0; i < item_count; ++i)
+        size += key_blob_size(items[i].key_blob, format());
+    return size;
+}
+
+uint8_t* BatchGetKeyCharacteristicsRequest::Serialize(uint8_t* buf, const uint8_t* end) const {
+    buf = additional_params.Serialize(buf, end, format());
+    buf = append_uint32_to_buf(buf, end, item_count, format());
+    for (size_t i = 0; i < item_count; ++i)
+        buf = serialize_key_blob(items[i].key_blob, buf, end, format());
+    return buf;
+}
+
+bool BatchGetKeyCharacteristicsRequest::Deserialize(const uint8_t** buf_ptr, const uint8_t* end) {
+    uint32_t count;
+    if (!additional_params.Deserialize(buf_ptr, end, format()) ||
+        !copy_uint32_from_buf(buf_ptr, end, &count, format()) ||
+        !AllocateItems(count, &items, &item_count, min_uint32_size(format()), end - *buf_ptr))
+        return false;
+
+    for (size_t i = 0; i < item_count; ++i)
+        if (!deserialize_key_blob(&items[i].key_blob, buf_ptr, end, format()))
+            return false;
+    return true;
+}
+
+bool BatchGetKeyCharacteristicsResponse::SetItemCount(size_t count) {
+    return AllocateItems(count, &items, &item_count);
+}
+
+size_t BatchGetKeyCharacteristicsResponse::NonErrorSerializedSize() const {
+    size_t size = uint32_serialized_size(item_count, format());
+    for (size_t i = 0; i < item_count; ++i)
+        size += error_size(items[i].error, format()) + items[i].enforced.SerializedSize(format()) +
+                items[i].unenforced.SerializedSize(format());
+    return size;
+}
+
+uint8_t* BatchGetKeyCharacteristicsResponse::NonErrorSerialize(uint8_t* buf,
+                                                               const uint8_t* end) const {
+    buf = append_uint32_to_buf(buf, end, item_count, format());
+    for (size_t i = 0; i < item_count; ++i) {
+        buf = append_error_to_buf(buf, end, items[i].error, format());
+        buf = items[i].enforced.Serialize(buf, end, format());
+        buf = items[i].unenforced.Serialize(buf, end, format());
+    }
+    return buf;
+}
+
+bool BatchGetKeyCharacteristicsResponse::NonErrorDeserialize(const uint8_t** buf_ptr,
+                                                             const uint8_t* end) {
+    uint32_t count;
+    // Even an empty item has an error code and two sets.
+    if (!copy_uint32_from_buf(buf_ptr, end, &count, format()) ||
+        !AllocateItems(count, &items, &item_count, 3 * min_uint32_size(format()), end - *buf_ptr))
+        return false;
+
+    for (size_t i = 0; i < item_count; ++i)
+        if (!copy_error_from_buf(buf_ptr, end, &items[i].error, format()) ||
+            !items[i].enforced.Deserialize(buf_ptr, end, format()) ||
+            !items[i].unenforced.Deserialize(buf_ptr, end, format()))
+            return false;
+    return true;
+}
+
+bool BatchDeleteKeyRequest::SetItemCount(size_t count) {
+    return AllocateItems(count, &items, &item_count);
+}
+
+size_t BatchDeleteKeyRequest::SerializedSize() const {
+    size_t size = uint32_serialized_size(item_count, format());
+    for (size_t i = 0; i < item_count; ++i)
+        size += key_blob_size(items[i].key_blob, format());
+    return size;
+}
+
+uint8_t* BatchDeleteKeyRequest::Serialize(uint8_t* buf, const uint8_t* end) const {
+    buf = append_uint32_to_buf(buf, end, item_count, format());
+    for (size_t i = 0; i < item_count; ++i)
+        buf = serialize_key_blob(items[i].key_blob, buf, end, format());
+    return buf;
+}
+
+bool BatchDeleteKeyRequest::Deserialize(const uint8_t** buf_ptr, const uint8_t* end) {
+    uint32_t count;
+    if (!copy_uint32_from_buf(buf_ptr, end, &count, format()) ||
+        !AllocateItems(count, &items, &item_count, min_uint32_size(format()), end - *buf_ptr))
+        return false;
+
+    for (size_t i = 0; i < item_count; ++i)
+        if (!deserialize_key_blob(&items[i].key_blob, buf_ptr, end, format()))
+            return false;
+    return true;
+}
+
+bool BatchDeleteKeyResponse::SetItemCount(size_t count) {
+    return AllocateItems(count, &items, &item_count);
+}
+
+size_t BatchDeleteKeyResponse::NonErrorSerializedSize() const {
+    size_t size = uint32_serialized_size(item_count, format());
+    for (size_t i = 0; i < item_count; ++i)
+        size += error_size(items[i].error, format());
+    return size;
+}
+
+uint8_t* BatchDeleteKeyResponse::NonErrorSerialize(uint8_t* buf, const uint8_t* end) const {
+    buf = append_uint32_to_buf(buf, end, item_count, format());
+    for (size_t i = 0; i < item_count; ++i)
+        buf = append_error_to_buf(buf, end, items[i].error, format());
+    return buf;
+}
+
+bool BatchDeleteKeyResponse::NonErrorDeserialize(const uint8_t** buf_ptr, const uint8_t* end) {
+    uint32_t count;
+    if (!copy_uint32_from_buf(buf_ptr, end, &count, format()) ||
+        !AllocateItems(count, &items, &item_count, min_uint32_size(format()), end - *buf_ptr))
+        return false;
+
+    for (size_t i = 0; i < item_count; ++i)
+        if (!copy_error_from_buf(buf_ptr, end, &items[i].error, format()))
+            return false;
+    return true;
+}
+
+bool BatchAttestKeyRequest::SetItemCount(size_t count) {
+    return AllocateItems(count, &items, &item_count);
+}
+
+size_t BatchAttestKeyRequest::SerializedSize() const {
+    size_t size =
+        attest_params.SerializedSize(format()) + uint32_serialized_size(item_count, format());
+    for (size_t i = 0; i < item_count; ++i)
+        size += key_blob_size(items[i].key_blob, format());
+    return size;
+}
+
+uint8_t* BatchAttestKeyRequest::Serialize(uint8_t* buf, const uint8_t* end) const {
+    buf = attest_params.Serialize(buf, end, format());
+    buf = append_uint32_to_buf(buf, end, item_count, format());
+    for (size_t i = 0; i < item_count; ++i)
+        buf = serialize_key_blob(items[i].key_blob, buf, end, format());
+    return buf;
+}
+
+bool BatchAttestKeyRequest::Deserialize(const uint8_t** buf_ptr, const uint8_t* end) {
+    uint32_t count;
+    if (!attest_params.Deserialize(buf_ptr, end, format()) ||
+        !copy_uint32_from_buf(buf_ptr, end, &count, format()) ||
+        !AllocateItems(count, &items, &item_count, min_uint32_size(format()), end - *buf_ptr))
+        return false;
+
+    for (size_t i = 0; i < item_count; ++i)
+        if (!deserialize_key_blob(&items[i].key_blob, buf_ptr, end, format()))
+            return false;
+    return true;
+}
+
+BatchAttestKeyResponse::~BatchAttestKeyResponse() {
+    for (size_t i = 0; i < issuer_chain_count; ++i)
+        clear_cert_chain(&issuer_chains[i]);
+}
+
+bool BatchAttestKeyResponse::SetItemCount(size_t count) {
+    return AllocateItems(count, &items, &item_count);
+}
+
+bool BatchAttestKeyResponse::SetIssuerChainCount(size_t count) {
+    for (size_t i = 0; i < issuer_chain_count; ++i)
+        clear_cert_chain(&issuer_chains[i]);
+    if (!AllocateItems(count, &issuer_chains, &issuer_chain_count))
+        return false;
+    for (size_t i = 0; i < issuer_chain_count; ++i)
+        issuer_chains[i] = {nullptr, 0};
+    return true;
+}
+
+bool BatchAttestKeyResponse::SetIssuerChain(size_t index, const keymaster_cert_chain_t& chain) {
+    if (index >= issuer_chain_count ||
+        !allocate_cert_chain(chain.entry_count, &issuer_chains[index]))
+        return false;
+
+    for (size_t i = 0; i < chain.entry_count; ++i) {
+        keymaster_blob_t* entry = &issuer_chains[index].entries[i];
+        entry->data = dup_buffer(chain.entries[i].data, chain.entries[i].data_length);
+        if (!entry->data)
+            return false;
+        entry->data_length = chain.entries[i].data_length;
+    }
+    return true;
+}
+
+bool BatchAttestKeyResponse::CopyCertificateChain(size_t index,
+                                                  keymaster_cert_chain_t* chain) const {
+    chain->entries = nullptr;
+    chain->entry_count = 0;
+    if (index >= item_count || items[index].error != KM_ERROR_OK ||
+        items[index].issuer_chain >= issuer_chain_count)
+        return false;
+
+    const keymaster_cert_chain_t& issuer_chain = issuer_chains[items[index].issuer_chain];
+    size_t entry_count = issuer_chain.entry_count + 1;
+    chain->entries =
+        reinterpret_cast<keymaster_blob_t*>(malloc(entry_count * sizeof(*chain->entries)));
+    if (!chain->entries)
+        return false;
+
+    for (size_t i = 0; i < entry_count; ++i) {
+        const keymaster_blob_t& entry =
+            i == 0 ? items[index].certificate : issuer_chain.entries[i - 1];
+        uint8_t* data = reinterpret_cast<uint8_t*>(malloc(entry.data_length));
+        if (!data) {
+            keymaster_free_cert_chain(chain);
+            return false;
+        }
+        memcpy(data, entry.data, entry.data_length);
+        chain->entries[i].data = data;
+        chain->entries[i].data_length = entry.data_length;
+        chain->entry_count = i + 1;
+    }
+    return true;
+}
+
+size_t BatchAttestKeyResponse::NonErrorSerializedSize() const {
+    size_t size = uint32_serialized_size(issuer_chain_count, format());
+    for (size_t i = 0; i < issuer_chain_count; ++i)
+        size += cert_chain_size(issuer_chains[i], format());
+    size += uint32_serialized_size(item_count, format());
+    for (size_t i = 0; i < item_count; ++i)
+        size += error_size(items[i].error, format()) +
+                uint32_serialized_size(items[i].issuer_chain, format()) +
+                size_and_data_serialized_size(items[i].certificate.data_length, format());
+    return size;
+}
+
+uint8_t* BatchAttestKeyResponse::NonErrorSerialize(uint8_t* buf, const uint8_t* end) const {
+    buf = append_uint32_to_buf(buf, end, issuer_chain_count, format());
+    for (size_t i = 0; i < issuer_chain_count; ++i)
+        buf = serialize_cert_chain(issuer_chains[i], buf, end, format());
+    buf = append_uint32_to_buf(buf, end, item_count, format());
+    for (size_t i = 0; i < item_count; ++i) {
+        buf = append_error_to_buf(buf, end, items[i].error, format());
+        buf = append_uint32_to_buf(buf, end, items[i].issuer_chain, format());
+        buf = append_size_and_data_to_buf(buf, end, items[i].certificate.data,
+                                          items[i].certificate.data_length, format());
+    }
+    return buf;
+}
+
+bool BatchAttestKeyResponse::NonErrorDeserialize(const uint8_t** buf_ptr, const uint8_t* end) {
+    uint32_t count;
+    // Even an empty chain has an entry count.
+    if (!copy_uint32_from_buf(buf_ptr, end, &count, format()) || !SetIssuerChainCount(0) ||
+        !AllocateItems(count, &issuer_chains, &issuer_chain_count, min_uint32_size(format()),
+                       end - *buf_ptr))
+        return false;
+    for (size_t i = 0; i < issuer_chain_count; ++i)
+        issuer_chains[i] = {nullptr, 0};
+    for (size_t i = 0; i < issuer_chain_count; ++i)
+        if (!deserialize_cert_chain(&issuer_chains[i], buf_ptr, end, format()))
+            return false;
+
+    // Even an empty item has an error code, a chain index and a certificate length.
+    if (!copy_uint32_from_buf(buf_ptr, end, &count, format()) ||
+        !AllocateItems(count, &items, &item_count, 3 * min_uint32_size(format()), end - *buf_ptr))
+        return false;
+
+    for (size_t i = 0; i < item_count; ++i) {
+        Item* item = &items[i];
+        UniquePtr<uint8_t[]> data;
+        size_t data_length;
+        if (!copy_error_from_buf(buf_ptr, end, &item->error, format()) ||
+            !copy_uint32_from_buf(buf_ptr, end, &item->issuer_chain, format()) ||
+            !copy_size_and_data_from_buf(buf_ptr, end, &data_length, &data, format()))
+            return false;
+        if (item->error == KM_ERROR_OK && item->issuer_chain >= issuer_chain_count)
+            return false;
+        item->certificate.data = data.release();
+        item->certificate.data_length = data_length;
+    }
+    return true;
+}
+
+size_t ExportOperationResponse::NonErrorSerializedSize() const {
+    return token.SerializedSize(format());
+}
+
+uint8_t* ExportOperationResponse::NonErrorSerialize(uint8_t* buf, const uint8_t* end) const {
+    return token.Serialize(buf, end, format());
+}
+
+bool ExportOperationResponse::NonErrorDeserialize(const uint8_t** buf_ptr, const uint8_t* end) {
+    return token.Deserialize(buf_ptr, end, format());
+}
+
+size_t ImportOperationRequest::SerializedSize() const {
+    return key_blob_size(key_blob, format()) + additional_params.SerializedSize(format()) +
+           token.SerializedSize(format());
+}
+
+uint8_t* ImportOperationRequest::Serialize(uint8_t* buf, const uint8_t* end) const {
+    buf = serialize_key_blob(key_blob, buf, end, format());
+    buf = additional_params.Serialize(buf, end, format());
+    return token.Serialize(buf, end, format());
+}
+
+bool ImportOperationRequest::Deserialize(const uint8_t** buf_ptr, const uint8_t* end) {
+    return deserialize_key_blob(&key_blob, buf_ptr, end, format()) &&
+           additional_params.Deserialize(buf_ptr, end, format()) &&
+           token.Deserialize(buf_ptr, end, format());
+}
+
+// Each power-of-two range of latencies is split into 1 << kSubBucketBits buckets.
+static const size_t kSubBucketBits = 2;
+static const uint64_t kSubBuckets = 1 << kSubBucketBits;
+
+size_t GetStatisticsResponse::BucketIndex(uint64_t microseconds) {
+    const uint64_t kMaxMicroseconds = BucketLowerBound(kBucketCount) - 1;
+    if (microseconds > kMaxMicroseconds)
+        microseconds = kMaxMicroseconds;
+    if (microseconds < kSubBuckets)
+        return microseconds;
+
+    size_t shift = 63 - __builtin_clzll(microseconds) - kSubBucketBits;
+    return (shift + 1) * kSubBuckets + ((microseconds >> shift) - kSubBuckets);
+}
+
+uint64_t GetStatisticsResponse::BucketLowerBound(size_t bucket) {
+    if (bucket < kSubBuckets)
+        return bucket;
+    size_t shift = bucket / kSubBuckets - 1;
+    return (kSubBuckets + bucket % kSubBuckets) << shift;
+}
+
+GetStatisticsResponse::Histogram::Histogram()
+    : command(0), algorithm(kNoAlgorithm), purpose(kNoPurpose), count(0), total_microseconds(0),
+      allocations(0), allocated_bytes(0) {
+    memset(buckets, 0, sizeof(buckets));
+}
+
+bool GetStatisticsResponse::SetHistogramCount(size_t count) {
+    return AllocateItems(count, &histograms, &histogram_count);
+}
+
+// Only nonempty buckets are sent, as (index, count) pairs.
+static size_t nonempty_bucket_count(const GetStatisticsResponse::Histogram& histogram) {
+    size_t nonempty = 0;
+    for (size_t i = 0; i < GetStatisticsResponse::kBucketCount; ++i)
+        if (histogram.buckets[i])
+            ++nonempty;
+    return nonempty;
+}
+
+// The 64-bit counters are varints too in the compact format; handles, which are random, aren't.
+static size_t counter_size(uint64_t value, SerializationFormat format) {
+    return format == COMPACT_FORMAT ? varint_size(value) : sizeof(uint64_t);
+}
+
+static uint8_t* append_counter_to_buf(uint8_t* buf, const uint8_t* end, uint64_t value,
+                                      SerializationFormat format) {
+    if (format == COMPACT_FORMAT)
+        return append_varint_to_buf(buf, end, value);
+    return append_uint64_to_buf(buf, end, value);
+}
+
+static bool copy_counter_from_buf(const uint8_t** buf_ptr, const uint8_t* end, uint64_t* value,
+                                  SerializationFormat format) {
+    if (format == COMPACT_FORMAT)
+        return copy_varint_from_buf(buf_ptr, end, value);
+    return copy_uint64_from_buf(buf_ptr, end, value);
+}
+
+// The fewest bytes a histogram can take: command, algorithm, purpose, count, totals and the
+// nonempty bucket count.
+static size_t min_histogram_size(SerializationFormat format) {
+    return format == COMPACT_FORMAT ? 8 : 3 * sizeof(uint32_t) + 4 * sizeof(uint64_t) +
+                                              sizeof(uint32_t);
+}
+
+size_t GetStatisticsResponse::NonErrorSerializedSize() const {
+    size_t size = uint32_serialized_size(histogram_count, format());
+    for (size_t i = 0; i < histogram_count; ++i) {
+        const Histogram& histogram = histograms[i];
+        size += uint32_serialized_size(histogram.command, format()) +
+                uint32_serialized_size(histogram.algorithm, format()) +
+                uint32_serialized_size(histogram.purpose, format()) +
+                counter_size(histogram.count, format()) +
+                counter_size(histogram.total_microseconds, format()) +
+                counter_size(histogram.allocations, format()) +
+                counter_size(histogram.allocated_bytes, format()) +
+                uint32_serialized_size(nonempty_bucket_count(histogram), format());
+        for (size_t j = 0; j < kBucketCount; ++j)
+            if (histogram.buckets[j])
+                size += uint32_serialized_size(j, format()) +
+                        counter_size(histogram.buckets[j], format());
+    }
+    return size;
+}
+
+uint8_t* GetStatisticsResponse::NonErrorSerialize(uint8_t* buf, const uint8_t* end) const {
+    buf = append_uint32_to_buf(buf, end, histogram_count, format());
+    for (size_t i = 0; i < histogram_count; ++i) {
+        const Histogram& histogram = histograms[i];
+        buf = append_uint32_to_buf(buf, end, histogram.command, format());
+        buf = append_uint32_to_buf(buf, end, histogram.algorithm, format());
+        buf = append_uint32_to_buf(buf, end, histogram.purpose, format());
+        buf = append_counter_to_buf(buf, end, histogram.count, format());
+        buf = append_counter_to_buf(buf, end, histogram.total_microseconds, format());
+        buf = append_counter_to_buf(buf, end, histogram.allocations, format());
+        buf = append_counter_to_buf(buf, end, histogram.allocated_bytes, format());
+        buf = append_uint32_to_buf(buf, end, nonempty_bucket_count(histogram), format());
+        for (size_t j = 0; j < kBucketCount; ++j) {
+            if (!histogram.buckets[j])
+                continue;
+            buf = append_uint32_to_buf(buf, end, j, format());
+            buf = append_counter_to_buf(buf, end, histogram.buckets[j], format());
+        }
+    }
+    return buf;
+}
+
+bool GetStatisticsResponse::NonErrorDeserialize(const uint8_t** buf_ptr, const uint8_t* end) {
+    uint32_t count;
+    if (!copy_uint32_from_buf(buf_ptr, end, &count, format()) ||
+        !AllocateItems(count, &histograms, &histogram_count, min_histogram_size(format()),
+                       end - *buf_ptr))
+        return false;
+
+    for (size_t i = 0; i < histogram_count; ++i) {
+        Histogram& histogram = histograms[i];
+        uint32_t nonempty;
+        if (!copy_uint32_from_buf(buf_ptr, end, &histogram.command, format()) ||
+            !copy_uint32_from_buf(buf_ptr, end, &histogram.algorithm, format()) ||
+            !copy_uint32_from_buf(buf_ptr, end, &histogram.purpose, format()) ||
+            !copy_counter_from_buf(buf_ptr, end, &histogram.count, format()) ||
+            !copy_counter_from_buf(buf_ptr, end, &histogram.total_microseconds, format()) ||
+            !copy_counter_from_buf(buf_ptr, end, &histogram.allocations, format()) ||
+            !copy_counter_from_buf(buf_ptr, end, &histogram.allocated_bytes, format()) ||
+            !copy_uint32_from_buf(buf_ptr, end, &nonempty, format()) || nonempty > kBucketCount)
+            return false;
+
+        for (size_t j = 0; j < nonempty; ++j) {
+            uint32_t bucket;
+            uint64_t bucket_count;
+            if (!copy_uint32_from_buf(buf_ptr, end, &bucket, format()) || bucket >= kBucketCount ||
+                !copy_counter_from_buf(buf_ptr, end, &bucket_count, format()))
+                return false;
+            histogram.buckets[bucket] = bucket_count;
+        }
+    }
+    return true;
 }
 
 }  // namespace keymaster
@@ -14,6 +14,8 @@
  * limitations under the License.
  */
 
+#include <vector>
+
 #include <UniquePtr.h>
 
 #include <gtest/gtest.h>
@@ -28,12 +30,14 @@ namespace keymaster {
 namespace test {
 
 /**
- * Serialize and deserialize a message.
+ * Serialize and deserialize a message.  \p expected_size is the size in FIXED_WIDTH_FORMAT; the
+ * sizes of compact messages depend on their values, so are only checked for consistency.
  */
 template <typename Message>
 Message* round_trip(int32_t ver, const Message& message, size_t expected_size) {
     size_t size = message.SerializedSize();
-    EXPECT_EQ(expected_size, size);
+    if (message.format() == FIXED_WIDTH_FORMAT)
+        EXPECT_EQ(expected_size, size);
     if (size == 0)
         return NULL;
 
@@ -200,11 +204,74 @@ TEST(RoundTrip, BeginOperationRequest) {
         msg.SetKeyMaterial("foo", 3);
         msg.additional_params.Reinitialize(params, array_length(params));
 
-        UniquePtr<BeginOperationRequest> deserialized(round_trip(ver, msg, 89));
+        msg.key_handle = 0xDEADBEEF;
+
+        UniquePtr<BeginOperationRequest> deserialized(
+            round_trip(ver, msg, ver < 4 ? 89 : 97));
         EXPECT_EQ(KM_PURPOSE_SIGN, deserialized->purpose);
         EXPECT_EQ(3U, deserialized->key_blob.key_material_size);
         EXPECT_EQ(0, memcmp(deserialized->key_blob.key_material, "foo", 3));
         EXPECT_EQ(msg.additional_params, deserialized->additional_params);
+        EXPECT_EQ(ver < 4 ? 0U : 0xDEADBEEF, deserialized->key_handle);
+    }
+}
+
+// Deserializes message into a request that borrows its key blob from the serialized buffer, and
+// checks that the blob points into the buffer.
+template <typename Message>
+void expect_borrowed_key_blob(int32_t ver, const Message& message) {
+    size_t size = message.SerializedSize();
+    UniquePtr<uint8_t[]> buf(new uint8_t[size]);
+    EXPECT_EQ(buf.get() + size, message.Serialize(buf.get(), buf.get() + size));
+
+    {
+        Message deserialized(ver);
+        deserialized.key_blob_ownership = BORROWED_KEY_BLOB;
+        const uint8_t* p = buf.get();
+        EXPECT_TRUE(deserialized.Deserialize(&p, p + size));
+        EXPECT_EQ(buf.get() + size, p);
+        EXPECT_EQ(BORROWED_KEY_BLOB, deserialized.key_blob_ownership);
+        ASSERT_EQ(message.key_blob.key_material_size, deserialized.key_blob.key_material_size);
+        EXPECT_GE(deserialized.key_blob.key_material, buf.get());
+        EXPECT_LT(deserialized.key_blob.key_material, buf.get() + size);
+        EXPECT_EQ(0, memcmp(message.key_blob.key_material, deserialized.key_blob.key_material,
+                            message.key_blob.key_material_size));
+
+        // Setting the key material takes ownership of a copy.
+        deserialized.SetKeyMaterial("bar", 3);
+        EXPECT_EQ(OWNED_KEY_BLOB, deserialized.key_blob_ownership);
+    }
+
+    // Truncated buffers are still rejected.
+    Message deserialized(ver);
+    deserialized.key_blob_ownership = BORROWED_KEY_BLOB;
+    const uint8_t* p = buf.get();
+    EXPECT_FALSE(deserialized.Deserialize(&p, p + message.key_blob.key_material_size));
+}
+
+TEST(RoundTrip, BorrowedKeyBlobs) {
+    for (int ver = 0; ver <= MAX_MESSAGE_VERSION; ++ver) {
+        GetKeyCharacteristicsRequest characteristics(ver);
+        characteristics.SetKeyMaterial("foobar", 6);
+        characteristics.additional_params.Reinitialize(params, array_length(params));
+        expect_borrowed_key_blob(ver, characteristics);
+
+        BeginOperationRequest begin(ver);
+        begin.purpose = KM_PURPOSE_SIGN;
+        begin.SetKeyMaterial("foobar", 6);
+        begin.additional_params.Reinitialize(params, array_length(params));
+        expect_borrowed_key_blob(ver, begin);
+
+        ExportKeyRequest export_key(ver);
+        export_key.additional_params.Reinitialize(params, array_length(params));
+        export_key.key_format = KM_KEY_FORMAT_X509;
+        export_key.SetKeyMaterial("foobar", 6);
+        expect_borrowed_key_blob(ver, export_key);
+
+        AttestKeyRequest attest(ver);
+        attest.SetKeyMaterial("foobar", 6);
+        attest.attest_params.Reinitialize(params, array_length(params));
+        expect_borrowed_key_blob(ver, attest);
     }
 }
 
@@ -223,6 +290,8 @@ TEST(RoundTrip, BeginOperationResponse) {
         case 1:
         case 2:
         case 3:
+        case 4:
+        case 5:
             deserialized.reset(round_trip(ver, msg, 39));
             break;
         default:
@@ -239,6 +308,8 @@ TEST(RoundTrip, BeginOperationResponse) {
         case 1:
         case 2:
         case 3:
+        case 4:
+        case 5:
             EXPECT_EQ(msg.output_params, deserialized->output_params);
             break;
         default:
@@ -272,6 +343,8 @@ TEST(RoundTrip, UpdateOperationRequest) {
         case 1:
         case 2:
         case 3:
+        case 4:
+        case 5:
             deserialized.reset(round_trip(ver, msg, 27));
             break;
         default:
@@ -300,6 +373,8 @@ TEST(RoundTrip, UpdateOperationResponse) {
             break;
         case 2:
         case 3:
+        case 4:
+        case 5:
             deserialized.reset(round_trip(ver, msg, 42));
             break;
         default:
@@ -318,6 +393,8 @@ TEST(RoundTrip, UpdateOperationResponse) {
             break;
         case 2:
         case 3:
+        case 4:
+        case 5:
             EXPECT_EQ(99U, deserialized->input_consumed);
             EXPECT_EQ(1U, deserialized->output_params.size());
             break;
@@ -344,6 +421,8 @@ TEST(RoundTrip, FinishOperationRequest) {
             deserialized.reset(round_trip(ver, msg, 27));
             break;
         case 3:
+        case 4:
+        case 5:
             deserialized.reset(round_trip(ver, msg, 34));
             break;
         default:
@@ -369,6 +448,8 @@ TEST(Round_Trip, FinishOperationResponse) {
             break;
         case 2:
         case 3:
+        case 4:
+        case 5:
             deserialized.reset(round_trip(ver, msg, 23));
             break;
         default:
@@ -381,6 +462,230 @@ TEST(Round_Trip, FinishOperationResponse) {
     }
 }
 
+TEST(Arena, FinishOperationMessages) {
+    FinishOperationRequest msg;
+    msg.op_handle = 0xDEADBEEF;
+    msg.signature.Reinitialize("bar", 3);
+    msg.input.Reinitialize("baz", 3);
+    size_t size = msg.SerializedSize();
+    UniquePtr<uint8_t[]> buf(new uint8_t[size]);
+    EXPECT_EQ(buf.get() + size, msg.Serialize(buf.get(), buf.get() + size));
+
+    SerializationArena arena(64);
+    {
+        FinishOperationRequest request;
+        FinishOperationResponse response;
+        request.set_arena(&arena);
+        response.set_arena(&arena);
+
+        const uint8_t* p = buf.get();
+        ASSERT_TRUE(request.Deserialize(&p, p + size));
+        EXPECT_EQ(0xDEADBEEF, request.op_handle);
+        EXPECT_EQ(3U, request.signature.available_read());
+        EXPECT_EQ(0, memcmp(request.signature.peek_read(), "bar", 3));
+        EXPECT_EQ(0, memcmp(request.input.peek_read(), "baz", 3));
+        EXPECT_EQ(16U, arena.bytes_used());
+
+        // Growing a buffer beyond the block size takes a new block.
+        ASSERT_TRUE(response.output.reserve(100));
+        EXPECT_TRUE(response.output.write(reinterpret_cast<const uint8_t*>("foo"), 3));
+        ASSERT_TRUE(response.output.reserve(200));
+        EXPECT_EQ(0, memcmp(response.output.peek_read(), "foo", 3));
+        EXPECT_EQ(16U + 104 + 208, arena.bytes_used());
+    }
+    arena.Reset();
+    EXPECT_EQ(0U, arena.bytes_used());
+
+    // The arena is reusable after Reset().
+    UpdateOperationRequest request;
+    request.set_arena(&arena);
+    EXPECT_TRUE(request.input.Reinitialize("foo", 3));
+    EXPECT_EQ(8U, arena.bytes_used());
+    EXPECT_EQ(0, memcmp(request.input.peek_read(), "foo", 3));
+    request.set_arena(nullptr);
+}
+
+TEST(BufferPool, ReusesBlocks) {
+    BufferPool pool;
+    Buffer::set_default_pool(&pool);
+    {
+        Buffer buf;
+        ASSERT_TRUE(buf.Reinitialize("foo", 3));
+        EXPECT_EQ(0U, pool.free_block_count(3));
+
+        // Growing within the pool's size classes returns the old block to the pool.
+        ASSERT_TRUE(buf.reserve(1000));
+        EXPECT_EQ(1U, pool.free_block_count(3));
+        EXPECT_EQ(0, memcmp(buf.peek_read(), "foo", 3));
+
+        // Allocating from the same class takes the freed block.
+        Buffer other(50);
+        EXPECT_EQ(0U, pool.free_block_count(3));
+
+        // Storage too large for any class comes from the heap.
+        ASSERT_TRUE(buf.reserve(20000));
+        EXPECT_EQ(1U, pool.free_block_count(1000));
+        EXPECT_EQ(0, memcmp(buf.peek_read(), "foo", 3));
+    }
+    EXPECT_EQ(1U, pool.free_block_count(64));
+    EXPECT_EQ(1U, pool.free_block_count(1000));
+
+    // Buffers allocated from the pool can still be freed after it stops being the default.
+    Buffer buf(100);
+    Buffer::set_default_pool(nullptr);
+    EXPECT_EQ(0U, pool.free_block_count(100));
+    buf.Clear();
+    EXPECT_EQ(1U, pool.free_block_count(100));
+}
+
+TEST(BufferPool, FreeListsAreBounded) {
+    BufferPool pool;
+    Buffer::set_default_pool(&pool);
+    {
+        Buffer bufs[BufferPool::MAX_FREE_BLOCKS_PER_CLASS + 2];
+        for (auto& buf : bufs)
+            ASSERT_TRUE(buf.Reinitialize(4096));
+    }
+    Buffer::set_default_pool(nullptr);
+    EXPECT_EQ(BufferPool::MAX_FREE_BLOCKS_PER_CLASS, pool.free_block_count(4096));
+}
+
+TEST(Recycle, KeepsStorage) {
+    Buffer buf;
+    ASSERT_TRUE(buf.reserve(1000));
+    const uint8_t* storage = buf.peek_read();
+    ASSERT_TRUE(buf.write(reinterpret_cast<const uint8_t*>("foobar"), 6));
+    EXPECT_TRUE(buf.advance_read(3));
+
+    ASSERT_TRUE(buf.Recycle());
+    EXPECT_EQ(0U, buf.available_read());
+    EXPECT_EQ(1000U, buf.available_write());
+    EXPECT_EQ(storage, buf.peek_read());
+    // What was written has been wiped.
+    for (size_t i = 0; i < 6; ++i)
+        EXPECT_EQ(0, storage[i]);
+
+    // Without a trim policy, storage is kept however little is used.
+    for (size_t i = 0; i < 100; ++i)
+        ASSERT_TRUE(buf.Recycle());
+    EXPECT_EQ(1000U, buf.buffer_size());
+
+    const uint8_t data[] = "foo";
+    ASSERT_TRUE(buf.Borrow(data, 3));
+    ASSERT_TRUE(buf.Recycle());
+    EXPECT_FALSE(buf.is_borrowed());
+    EXPECT_EQ(0U, buf.buffer_size());
+}
+
+TEST(Recycle, TrimsAfterSmallUses) {
+    Buffer::set_trim_policy(3);
+    Buffer buf;
+    ASSERT_TRUE(buf.reserve(20000));
+    const uint8_t data[300] = {};
+
+    // A large use in between starts the count again.
+    for (size_t use = 0; use < 2; ++use) {
+        ASSERT_TRUE(buf.write(data, 300));
+        ASSERT_TRUE(buf.Recycle());
+    }
+    UniquePtr<uint8_t[]> large(new uint8_t[5000]());
+    ASSERT_TRUE(buf.write(large.get(), 5000));
+    ASSERT_TRUE(buf.Recycle());
+    EXPECT_EQ(20000U, buf.buffer_size());
+
+    // Three small uses in a row shrink the storage to the class holding the largest.
+    ASSERT_TRUE(buf.write(data, 100));
+    ASSERT_TRUE(buf.Recycle());
+    ASSERT_TRUE(buf.write(data, 300));
+    ASSERT_TRUE(buf.Recycle());
+    EXPECT_EQ(20000U, buf.buffer_size());
+    ASSERT_TRUE(buf.Recycle());
+    EXPECT_EQ(1024U, buf.buffer_size());
+
+    // Uses that need a quarter of the storage or more keep it.
+    for (size_t use = 0; use < 10; ++use) {
+        ASSERT_TRUE(buf.write(data, 257));
+        ASSERT_TRUE(buf.Recycle());
+    }
+    EXPECT_EQ(1024U, buf.buffer_size());
+
+    // Storage that's never written to goes altogether.
+    for (size_t use = 0; use < 3; ++use)
+        ASSERT_TRUE(buf.Recycle());
+    EXPECT_EQ(0U, buf.buffer_size());
+    Buffer::set_trim_policy(0);
+}
+
+TEST(Recycle, UpdateOperationResponse) {
+    UpdateOperationResponse rsp;
+    rsp.error = KM_ERROR_OK;
+    rsp.input_consumed = 7;
+    rsp.output.Reinitialize("foo", 3);
+    rsp.output_params.push_back(TAG_NONCE, "bar", 3);
+
+    ASSERT_TRUE(rsp.Recycle());
+    EXPECT_EQ(KM_ERROR_UNKNOWN_ERROR, rsp.error);
+    EXPECT_EQ(0U, rsp.input_consumed);
+    EXPECT_EQ(0U, rsp.output.available_read());
+    EXPECT_EQ(3U, rsp.output.available_write());
+    EXPECT_EQ(0U, rsp.output_params.size());
+}
+
+TEST(Borrow, Buffer) {
+    const uint8_t data[] = "foobar";
+    Buffer buf;
+    ASSERT_TRUE(buf.Borrow(data, 6));
+    EXPECT_TRUE(buf.is_borrowed());
+    EXPECT_EQ(data, buf.peek_read());
+    EXPECT_EQ(6U, buf.available_read());
+    EXPECT_EQ(0U, buf.available_write());
+    EXPECT_FALSE(buf.write(data, 1));
+
+    uint8_t out[3];
+    EXPECT_TRUE(buf.read(out, 3));
+    EXPECT_EQ(0, memcmp(out, "foo", 3));
+
+    // Growing moves the unread data into owned storage.
+    ASSERT_TRUE(buf.reserve(10));
+    EXPECT_FALSE(buf.is_borrowed());
+    EXPECT_EQ(3U, buf.available_read());
+    EXPECT_EQ(0, memcmp(buf.peek_read(), "bar", 3));
+    EXPECT_TRUE(buf.write(data, 3));
+
+    ASSERT_TRUE(buf.Borrow(data, 6));
+    buf.Clear();
+    EXPECT_FALSE(buf.is_borrowed());
+    EXPECT_EQ(0, memcmp(data, "foobar", 6));
+}
+
+TEST(Borrow, FinishOperationRequest) {
+    FinishOperationRequest msg;
+    msg.op_handle = 0xDEADBEEF;
+    msg.signature.Reinitialize("bar", 3);
+    msg.input.Reinitialize("baz", 3);
+    size_t size = msg.SerializedSize();
+    UniquePtr<uint8_t[]> buf(new uint8_t[size]);
+    EXPECT_EQ(buf.get() + size, msg.Serialize(buf.get(), buf.get() + size));
+
+    FinishOperationRequest request;
+    request.set_borrow_buffers(true);
+    const uint8_t* p = buf.get();
+    ASSERT_TRUE(request.Deserialize(&p, p + size));
+    EXPECT_EQ(buf.get() + size, p);
+    EXPECT_TRUE(request.signature.is_borrowed());
+    EXPECT_TRUE(request.input.is_borrowed());
+    EXPECT_TRUE(request.input.peek_read() > buf.get() &&
+                request.input.peek_read() < buf.get() + size);
+    EXPECT_EQ(0, memcmp(request.signature.peek_read(), "bar", 3));
+    EXPECT_EQ(0, memcmp(request.input.peek_read(), "baz", 3));
+
+    // Truncated input fails as with copying deserialization.
+    for (size_t i = 0; i < size; ++i) {
+        p = buf.get();
+        EXPECT_FALSE(request.Deserialize(&p, p + i));
+    }
+}
+
 TEST(RoundTrip, ImportKeyRequest) {
     for (int ver = 0; ver <= MAX_MESSAGE_VERSION; ++ver) {
         ImportKeyRequest msg(ver);
@@ -606,6 +911,704 @@ TEST(RoundTrip, UpgradeKeyResponse) {
     }
 }
 
+TEST(RoundTrip, MigrateKeyRequest) {
+    for (int ver = 0; ver <= MAX_MESSAGE_VERSION; ++ver) {
+        MigrateKeyRequest msg(ver);
+        msg.SetKeyMaterial("foo", 3);
+        msg.additional_params.Reinitialize(params, array_length(params));
+
+        UniquePtr<MigrateKeyRequest> deserialized(round_trip(ver, msg, 85));
+        EXPECT_EQ(3U, deserialized->key_blob.key_material_size);
+        EXPECT_EQ(0, memcmp("foo", deserialized->key_blob.key_material, 3));
+        EXPECT_EQ(msg.additional_params, deserialized->additional_params);
+    }
+}
+
+TEST(RoundTrip, MigrateKeyResponse) {
+    for (int ver = 0; ver <= MAX_MESSAGE_VERSION; ++ver) {
+        MigrateKeyResponse rsp(ver);
+        rsp.error = KM_ERROR_OK;
+        rsp.migrated_key.key_material = dup_array(TEST_DATA);
+        rsp.migrated_key.key_material_size = array_length(TEST_DATA);
+
+        UniquePtr<MigrateKeyResponse> deserialized(round_trip(ver, rsp, 19));
+        EXPECT_EQ(KM_ERROR_OK, deserialized->error);
+        EXPECT_EQ(rsp.migrated_key.key_material_size, deserialized->migrated_key.key_material_size);
+        EXPECT_EQ(0, memcmp(rsp.migrated_key.key_material, deserialized->migrated_key.key_material,
+                            rsp.migrated_key.key_material_size));
+    }
+}
+
+TEST(RoundTrip, PinKeyRequest) {
+    for (int ver = 0; ver <= MAX_MESSAGE_VERSION; ++ver) {
+        PinKeyRequest msg(ver);
+        msg.SetKeyMaterial("foo", 3);
+        msg.additional_params.Reinitialize(params, array_length(params));
+
+        UniquePtr<PinKeyRequest> deserialized(round_trip(ver, msg, 85));
+        EXPECT_EQ(3U, deserialized->key_blob.key_material_size);
+        EXPECT_EQ(0, memcmp("foo", deserialized->key_blob.key_material, 3));
+        EXPECT_EQ(msg.additional_params, deserialized->additional_params);
+    }
+}
+
+TEST(RoundTrip, PinKeyResponse) {
+    for (int ver = 0; ver <= MAX_MESSAGE_VERSION; ++ver) {
+        PinKeyResponse msg(ver);
+        msg.error = KM_ERROR_OK;
+        msg.key_handle = 0xDEADBEEF;
+
+        UniquePtr<PinKeyResponse> deserialized(round_trip(ver, msg, 12));
+        EXPECT_EQ(KM_ERROR_OK, deserialized->error);
+        EXPECT_EQ(0xDEADBEEF, deserialized->key_handle);
+    }
+}
+
+TEST(RoundTrip, OneShotOperationRequest) {
+    for (int ver = 0; ver <= MAX_MESSAGE_VERSION; ++ver) {
+        OneShotOperationRequest msg(ver);
+        msg.purpose = KM_PURPOSE_VERIFY;
+        msg.SetKeyMaterial("foo", 3);
+        msg.additional_params.Reinitialize(params, array_length(params));
+        msg.input.Reinitialize("bar", 3);
+        msg.signature.Reinitialize("baz", 3);
+        msg.key_handle = 0xDEADBEEF;
+
+        UniquePtr<OneShotOperationRequest> deserialized(round_trip(ver, msg, 111));
+        EXPECT_EQ(KM_PURPOSE_VERIFY, deserialized->purpose);
+        EXPECT_EQ(3U, deserialized->key_blob.key_material_size);
+        EXPECT_EQ(0, memcmp("foo", deserialized->key_blob.key_material, 3));
+        EXPECT_EQ(msg.additional_params, deserialized->additional_params);
+        EXPECT_EQ(3U, deserialized->input.available_read());
+        EXPECT_EQ(0, memcmp("bar", deserialized->input.peek_read(), 3));
+        EXPECT_EQ(3U, deserialized->signature.available_read());
+        EXPECT_EQ(0, memcmp("baz", deserialized->signature.peek_read(), 3));
+        EXPECT_EQ(0xDEADBEEF, deserialized->key_handle);
+    }
+}
+
+TEST(RoundTrip, OneShotOperationResponse) {
+    for (int ver = 0; ver <= MAX_MESSAGE_VERSION; ++ver) {
+        OneShotOperationResponse msg(ver);
+        msg.error = KM_ERROR_OK;
+        msg.output_params.Reinitialize(params, array_length(params));
+        msg.output.Reinitialize("foo", 3);
+
+        UniquePtr<OneShotOperationResponse> deserialized(round_trip(ver, msg, 89));
+        EXPECT_EQ(KM_ERROR_OK, deserialized->error);
+        EXPECT_EQ(msg.output_params, deserialized->output_params);
+        EXPECT_EQ(3U, deserialized->output.available_read());
+        EXPECT_EQ(0, memcmp("foo", deserialized->output.peek_read(), 3));
+    }
+}
+
+TEST(RoundTrip, BatchOperationRequest) {
+    for (int ver = 0; ver <= MAX_MESSAGE_VERSION; ++ver) {
+        BatchOperationRequest msg(ver);
+        msg.purpose = KM_PURPOSE_SIGN;
+        msg.SetKeyMaterial("foo", 3);
+        msg.additional_params.Reinitialize(params, array_length(params));
+        msg.key_handle = 0xDEADBEEF;
+        ASSERT_TRUE(msg.SetItemCount(2));
+        msg.items[0].input.Reinitialize("bar", 3);
+        msg.items[1].input.Reinitialize("bazz", 4);
+        msg.items[1].signature.Reinitialize("sig", 3);
+
+        UniquePtr<BatchOperationRequest> deserialized(round_trip(ver, msg, 127));
+        EXPECT_EQ(KM_PURPOSE_SIGN, deserialized->purpose);
+        EXPECT_EQ(0, memcmp("foo", deserialized->key_blob.key_material, 3));
+        EXPECT_EQ(msg.additional_params, deserialized->additional_params);
+        EXPECT_EQ(0xDEADBEEF, deserialized->key_handle);
+        ASSERT_EQ(2U, deserialized->item_count);
+        EXPECT_EQ(0, memcmp("bar", deserialized->items[0].input.peek_read(), 3));
+        EXPECT_EQ(0U, deserialized->items[0].signature.available_read());
+        EXPECT_EQ(4U, deserialized->items[1].input.available_read());
+        EXPECT_EQ(0, memcmp("sig", deserialized->items[1].signature.peek_read(), 3));
+    }
+}
+
+TEST(RoundTrip, BatchOperationResponse) {
+    for (int ver = 0; ver <= MAX_MESSAGE_VERSION; ++ver) {
+        BatchOperationResponse msg(ver);
+        msg.error = KM_ERROR_OK;
+        ASSERT_TRUE(msg.SetItemCount(2));
+        msg.items[0].error = KM_ERROR_OK;
+        msg.items[0].output_params.Reinitialize(params, array_length(params));
+        msg.items[0].output.Reinitialize("foo", 3);
+        msg.items[1].error = KM_ERROR_VERIFICATION_FAILED;
+
+        UniquePtr<BatchOperationResponse> deserialized(round_trip(ver, msg, 117));
+        EXPECT_EQ(KM_ERROR_OK, deserialized->error);
+        ASSERT_EQ(2U, deserialized->item_count);
+        EXPECT_EQ(KM_ERROR_OK, deserialized->items[0].error);
+        EXPECT_EQ(msg.items[0].output_params, deserialized->items[0].output_params);
+        EXPECT_EQ(0, memcmp("foo", deserialized->items[0].output.peek_read(), 3));
+        EXPECT_EQ(KM_ERROR_VERIFICATION_FAILED, deserialized->items[1].error);
+        EXPECT_EQ(0U, deserialized->items[1].output.available_read());
+    }
+}
+
+TEST(RoundTrip, BatchUpgradeKeyRequest) {
+    for (int ver = 0; ver <= MAX_MESSAGE_VERSION; ++ver) {
+        BatchUpgradeKeyRequest msg(ver);
+        msg.upgrade_params.Reinitialize(params, array_length(params));
+        ASSERT_TRUE(msg.SetItemCount(2));
+        ASSERT_TRUE(msg.items[0].key_blob.Reset(3));
+        memcpy(msg.items[0].key_blob.writable_data(), "foo", 3);
+        ASSERT_TRUE(msg.items[1].key_blob.Reset(6));
+        memcpy(msg.items[1].key_blob.writable_data(), "barbaz", 6);
+
+        UniquePtr<BatchUpgradeKeyRequest> deserialized(round_trip(ver, msg, 99));
+        EXPECT_EQ(msg.upgrade_params, deserialized->upgrade_params);
+        ASSERT_EQ(2U, deserialized->item_count);
+        ASSERT_EQ(3U, deserialized->items[0].key_blob.key_material_size);
+        EXPECT_EQ(0, memcmp("foo", deserialized->items[0].key_blob.key_material, 3));
+        ASSERT_EQ(6U, deserialized->items[1].key_blob.key_material_size);
+        EXPECT_EQ(0, memcmp("barbaz", deserialized->items[1].key_blob.key_material, 6));
+    }
+}
+
+TEST(RoundTrip, BatchUpgradeKeyResponse) {
+    for (int ver = 0; ver <= MAX_MESSAGE_VERSION; ++ver) {
+        BatchUpgradeKeyResponse msg(ver);
+        msg.error = KM_ERROR_OK;
+        ASSERT_TRUE(msg.SetItemCount(2));
+        msg.items[0].error = KM_ERROR_OK;
+        ASSERT_TRUE(msg.items[0].upgraded_key.Reset(3));
+        memcpy(msg.items[0].upgraded_key.writable_data(), "foo", 3);
+        msg.items[1].error = KM_ERROR_INVALID_KEY_BLOB;
+
+        UniquePtr<BatchUpgradeKeyResponse> deserialized(round_trip(ver, msg, 27));
+        EXPECT_EQ(KM_ERROR_OK, deserialized->error);
+        ASSERT_EQ(2U, deserialized->item_count);
+        EXPECT_EQ(KM_ERROR_OK, deserialized->items[0].error);
+        ASSERT_EQ(3U, deserialized->items[0].upgraded_key.key_material_size);
+        EXPECT_EQ(0, memcmp("foo", deserialized->items[0].upgraded_key.key_material, 3));
+        EXPECT_EQ(KM_ERROR_INVALID_KEY_BLOB, deserialized->items[1].error);
+        EXPECT_EQ(0U, deserialized->items[1].upgraded_key.key_material_size);
+    }
+}
+
+/**
+ * Checks that the segments a message serializes to hold the same bytes as Serialize() writes.
+ */
+static void expect_segments_match(const Serializable& message) {
+    size_t size = message.SerializedSize();
+    UniquePtr<uint8_t[]> buf(new uint8_t[size]);
+    message.Serialize(buf.get(), buf.get() + size);
+
+    SerializationSegments segments;
+    ASSERT_TRUE(message.SerializeToSegments(&segments));
+    EXPECT_EQ(size, segments.total_length());
+    std::string gathered;
+    for (size_t i = 0; i < segments.segment_count(); ++i)
+        gathered.append(reinterpret_cast<const char*>(segments.segments()[i].data),
+                        segments.segments()[i].length);
+    EXPECT_EQ(std::string(reinterpret_cast<char*>(buf.get()), size), gathered);
+}
+
+TEST(Segments, MatchSerialize) {
+    std::string large(SerializationSegments::MIN_REFERENCED_LENGTH * 4, 'x');
+    for (int ver = 0; ver <= MAX_MESSAGE_VERSION; ++ver) {
+        BeginOperationRequest begin(ver);
+        begin.purpose = KM_PURPOSE_SIGN;
+        begin.SetKeyMaterial(large.data(), large.size());
+        begin.additional_params.Reinitialize(params, array_length(params));
+        begin.key_handle = 0xDEADBEEF;
+        expect_segments_match(begin);
+
+        UpdateOperationRequest update(ver);
+        update.op_handle = 0xDEADBEEF;
+        update.input.Reinitialize(large.data(), large.size());
+        update.additional_params.Reinitialize(params, array_length(params));
+        expect_segments_match(update);
+
+        UpdateOperationResponse update_response(ver);
+        update_response.error = KM_ERROR_OK;
+        update_response.output.Reinitialize(large.data(), large.size());
+        update_response.input_consumed = 99;
+        expect_segments_match(update_response);
+
+        FinishOperationRequest finish(ver);
+        finish.op_handle = 0xDEADBEEF;
+        finish.signature.Reinitialize("bar", 3);
+        finish.input.Reinitialize(large.data(), large.size());
+        expect_segments_match(finish);
+
+        OneShotOperationRequest one_shot(ver);
+        one_shot.purpose = KM_PURPOSE_ENCRYPT;
+        one_shot.SetKeyMaterial("foo", 3);
+        one_shot.input.Reinitialize(large.data(), large.size());
+        expect_segments_match(one_shot);
+
+        GenerateKeyResponse generate(ver);
+        generate.error = KM_ERROR_OK;
+        generate.key_blob.key_material = dup_buffer(large.data(), large.size());
+        generate.key_blob.key_material_size = large.size();
+        generate.enforced.Reinitialize(params, array_length(params));
+        expect_segments_match(generate);
+
+        // Errors, and messages that don't override SerializeToSegments(), work too.
+        generate.error = KM_ERROR_INVALID_KEY_BLOB;
+        expect_segments_match(generate);
+        GenerateKeyRequest generate_request(ver);
+        generate_request.key_description.Reinitialize(params, array_length(params));
+        expect_segments_match(generate_request);
+    }
+}
+
+TEST(Segments, ReferenceLargePayloads) {
+    std::string large(SerializationSegments::MIN_REFERENCED_LENGTH, 'x');
+    UpdateOperationRequest msg;
+    msg.op_handle = 0xDEADBEEF;
+    msg.input.Reinitialize(large.data(), large.size());
+    msg.additional_params.push_back(TAG_NONCE, "nonce", 5);
+
+    // The handle and length share a segment, the input is referenced, and the parameters follow.
+    SerializationSegments segments;
+    ASSERT_TRUE(msg.SerializeToSegments(&segments));
+    ASSERT_EQ(3U, segments.segment_count());
+    EXPECT_EQ(msg.input.peek_read(), segments.segments()[1].data);
+    EXPECT_EQ(large.size(), segments.segments()[1].length);
+
+    // Small payloads are copied.
+    segments.Clear();
+    EXPECT_EQ(0U, segments.total_length());
+    msg.input.Reinitialize("foo", 3);
+    ASSERT_TRUE(msg.SerializeToSegments(&segments));
+    EXPECT_EQ(1U, segments.segment_count());
+    EXPECT_EQ(msg.SerializedSize(), segments.total_length());
+}
+
+TEST(RoundTrip, GenerateKeysRequest) {
+    for (int ver = 0; ver <= MAX_MESSAGE_VERSION; ++ver) {
+        GenerateKeysRequest msg(ver);
+        ASSERT_TRUE(msg.SetItemCount(2));
+        msg.items[0].key_description.Reinitialize(params, array_length(params));
+        msg.items[1].key_description.push_back(TAG_ALGORITHM, KM_ALGORITHM_EC);
+
+        UniquePtr<GenerateKeysRequest> deserialized(round_trip(ver, msg, 102));
+        ASSERT_EQ(2U, deserialized->item_count);
+        EXPECT_EQ(msg.items[0].key_description, deserialized->items[0].key_description);
+        EXPECT_EQ(msg.items[1].key_description, deserialized->items[1].key_description);
+    }
+}
+
+TEST(RoundTrip, GenerateKeysResponse) {
+    for (int ver = 0; ver <= MAX_MESSAGE_VERSION; ++ver) {
+        GenerateKeysResponse msg(ver);
+        msg.error = KM_ERROR_OK;
+        ASSERT_TRUE(msg.SetItemCount(2));
+        msg.items[0].error = KM_ERROR_OK;
+        ASSERT_TRUE(msg.items[0].key_blob.Reset(3));
+        memcpy(msg.items[0].key_blob.writable_data(), "foo", 3);
+        msg.items[0].enforced.Reinitialize(params, array_length(params));
+        msg.items[0].unenforced.push_back(TAG_ALGORITHM, KM_ALGORITHM_EC);
+        msg.items[1].error = KM_ERROR_UNSUPPORTED_ALGORITHM;
+
+        UniquePtr<GenerateKeysResponse> deserialized(round_trip(ver, msg, 149));
+        EXPECT_EQ(KM_ERROR_OK, deserialized->error);
+        ASSERT_EQ(2U, deserialized->item_count);
+        EXPECT_EQ(KM_ERROR_OK, deserialized->items[0].error);
+        ASSERT_EQ(3U, deserialized->items[0].key_blob.key_material_size);
+        EXPECT_EQ(0, memcmp("foo", deserialized->items[0].key_blob.key_material, 3));
+        EXPECT_EQ(msg.items[0].enforced, deserialized->items[0].enforced);
+        EXPECT_EQ(msg.items[0].unenforced, deserialized->items[0].unenforced);
+        EXPECT_EQ(KM_ERROR_UNSUPPORTED_ALGORITHM, deserialized->items[1].error);
+        EXPECT_EQ(0U, deserialized->items[1].key_blob.key_material_size);
+    }
+}
+
+TEST(RoundTrip, BatchGetKeyCharacteristicsRequest) {
+    for (int ver = 0; ver <= MAX_MESSAGE_VERSION; ++ver) {
+        BatchGetKeyCharacteristicsRequest msg(ver);
+        msg.additional_params.Reinitialize(params, array_length(params));
+        ASSERT_TRUE(msg.SetItemCount(2));
+        msg.items[0].key_blob = KeymasterKeyBlob(reinterpret_cast<const uint8_t*>("foo"), 3);
+
+        UniquePtr<BatchGetKeyCharacteristicsRequest> deserialized(round_trip(ver, msg, 93));
+        EXPECT_EQ(msg.additional_params, deserialized->additional_params);
+        ASSERT_EQ(2U, deserialized->item_count);
+        ASSERT_EQ(3U, deserialized->items[0].key_blob.key_material_size);
+        EXPECT_EQ(0, memcmp("foo", deserialized->items[0].key_blob.key_material, 3));
+        EXPECT_EQ(0U, deserialized->items[1].key_blob.key_material_size);
+    }
+}
+
+TEST(RoundTrip, BatchGetKeyCharacteristicsResponse) {
+    for (int ver = 0; ver <= MAX_MESSAGE_VERSION; ++ver) {
+        BatchGetKeyCharacteristicsResponse msg(ver);
+        msg.error = KM_ERROR_OK;
+        ASSERT_TRUE(msg.SetItemCount(2));
+        msg.items[0].error = KM_ERROR_OK;
+        msg.items[0].enforced.Reinitialize(params, array_length(params));
+        msg.items[0].unenforced.push_back(TAG_ALGORITHM, KM_ALGORITHM_EC);
+        msg.items[1].error = KM_ERROR_INVALID_KEY_BLOB;
+
+        UniquePtr<BatchGetKeyCharacteristicsResponse> deserialized(round_trip(ver, msg, 138));
+        EXPECT_EQ(KM_ERROR_OK, deserialized->error);
+        ASSERT_EQ(2U, deserialized->item_count);
+        EXPECT_EQ(KM_ERROR_OK, deserialized->items[0].error);
+        EXPECT_EQ(msg.items[0].enforced, deserialized->items[0].enforced);
+        EXPECT_EQ(msg.items[0].unenforced, deserialized->items[0].unenforced);
+        EXPECT_EQ(KM_ERROR_INVALID_KEY_BLOB, deserialized->items[1].error);
+        EXPECT_EQ(0U, deserialized->items[1].enforced.size());
+    }
+}
+
+TEST(RoundTrip, BatchDeleteKeyRequest) {
+    for (int ver = 0; ver <= MAX_MESSAGE_VERSION; ++ver) {
+        BatchDeleteKeyRequest msg(ver);
+        ASSERT_TRUE(msg.SetItemCount(2));
+        msg.items[0].key_blob = KeymasterKeyBlob(reinterpret_cast<const uint8_t*>("foo"), 3);
+        msg.items[1].key_blob = KeymasterKeyBlob(reinterpret_cast<const uint8_t*>("barbaz"), 6);
+
+        UniquePtr<BatchDeleteKeyRequest> deserialized(round_trip(ver, msg, 21));
+        ASSERT_EQ(2U, deserialized->item_count);
+        ASSERT_EQ(3U, deserialized->items[0].key_blob.key_material_size);
+        EXPECT_EQ(0, memcmp("foo", deserialized->items[0].key_blob.key_material, 3));
+        ASSERT_EQ(6U, deserialized->items[1].key_blob.key_material_size);
+        EXPECT_EQ(0, memcmp("barbaz", deserialized->items[1].key_blob.key_material, 6));
+    }
+}
+
+TEST(RoundTrip, BatchDeleteKeyResponse) {
+    for (int ver = 0; ver <= MAX_MESSAGE_VERSION; ++ver) {
+        BatchDeleteKeyResponse msg(ver);
+        msg.error = KM_ERROR_OK;
+        ASSERT_TRUE(msg.SetItemCount(2));
+        msg.items[0].error = KM_ERROR_OK;
+        msg.items[1].error = KM_ERROR_UNKNOWN_ERROR;
+
+        UniquePtr<BatchDeleteKeyResponse> deserialized(round_trip(ver, msg, 16));
+        EXPECT_EQ(KM_ERROR_OK, deserialized->error);
+        ASSERT_EQ(2U, deserialized->item_count);
+        EXPECT_EQ(KM_ERROR_OK, deserialized->items[0].error);
+        EXPECT_EQ(KM_ERROR_UNKNOWN_ERROR, deserialized->items[1].error);
+    }
+}
+
+TEST(RoundTrip, BatchAttestKeyRequest) {
+    for (int ver = 0; ver <= MAX_MESSAGE_VERSION; ++ver) {
+        BatchAttestKeyRequest msg(ver);
+        msg.attest_params.Reinitialize(params, array_length(params));
+        ASSERT_TRUE(msg.SetItemCount(2));
+        msg.items[0].key_blob = KeymasterKeyBlob(reinterpret_cast<const uint8_t*>("foo"), 3);
+
+        UniquePtr<BatchAttestKeyRequest> deserialized(round_trip(ver, msg, 93));
+        EXPECT_EQ(msg.attest_params, deserialized->attest_params);
+        ASSERT_EQ(2U, deserialized->item_count);
+        ASSERT_EQ(3U, deserialized->items[0].key_blob.key_material_size);
+        EXPECT_EQ(0, memcmp("foo", deserialized->items[0].key_blob.key_material, 3));
+        EXPECT_EQ(0U, deserialized->items[1].key_blob.key_material_size);
+    }
+}
+
+TEST(RoundTrip, BatchAttestKeyResponse) {
+    for (int ver = 0; ver <= MAX_MESSAGE_VERSION; ++ver) {
+        BatchAttestKeyResponse msg(ver);
+        msg.error = KM_ERROR_OK;
+        keymaster_blob_t issuers[] = {{reinterpret_cast<const uint8_t*>("bar"), 3},
+                                      {reinterpret_cast<const uint8_t*>("baz"), 3}};
+        ASSERT_TRUE(msg.SetIssuerChainCount(1));
+        ASSERT_TRUE(msg.SetIssuerChain(0, {issuers, array_length(issuers)}));
+        ASSERT_TRUE(msg.SetItemCount(2));
+        msg.items[0].error = KM_ERROR_OK;
+        msg.items[0].certificate = {dup_buffer("foo", 3), 3};
+        msg.items[1].error = KM_ERROR_INCOMPATIBLE_ALGORITHM;
+
+        UniquePtr<BatchAttestKeyResponse> deserialized(round_trip(ver, msg, 57));
+        EXPECT_EQ(KM_ERROR_OK, deserialized->error);
+        ASSERT_EQ(1U, deserialized->issuer_chain_count);
+        ASSERT_EQ(2U, deserialized->item_count);
+        EXPECT_EQ(KM_ERROR_INCOMPATIBLE_ALGORITHM, deserialized->items[1].error);
+
+        // The first item's full chain is its own certificate followed by the issuers'.
+        keymaster_cert_chain_t chain;
+        ASSERT_TRUE(deserialized->CopyCertificateChain(0, &chain));
+        ASSERT_EQ(3U, chain.entry_count);
+        EXPECT_EQ(3U, chain.entries[0].data_length);
+        EXPECT_EQ(0, memcmp("foo", chain.entries[0].data, 3));
+        EXPECT_EQ(3U, chain.entries[1].data_length);
+        EXPECT_EQ(0, memcmp("bar", chain.entries[1].data, 3));
+        EXPECT_EQ(3U, chain.entries[2].data_length);
+        EXPECT_EQ(0, memcmp("baz", chain.entries[2].data, 3));
+        keymaster_free_cert_chain(&chain);
+        EXPECT_FALSE(deserialized->CopyCertificateChain(1, &chain));
+    }
+}
+
+TEST(RoundTrip, ExportOperationRequest) {
+    for (int ver = 0; ver <= MAX_MESSAGE_VERSION; ++ver) {
+        ExportOperationRequest msg(ver);
+        msg.op_handle = 0xDEADBEEF;
+        UniquePtr<ExportOperationRequest> deserialized(round_trip(ver, msg, 8));
+        EXPECT_EQ(0xDEADBEEFU, deserialized->op_handle);
+    }
+}
+
+TEST(RoundTrip, ExportOperationResponse) {
+    for (int ver = 0; ver <= MAX_MESSAGE_VERSION; ++ver) {
+        ExportOperationResponse msg(ver);
+        msg.error = KM_ERROR_OK;
+        msg.token.Reinitialize("foo", 3);
+
+        UniquePtr<ExportOperationResponse> deserialized(round_trip(ver, msg, 11));
+        EXPECT_EQ(KM_ERROR_OK, deserialized->error);
+        ASSERT_EQ(3U, deserialized->token.available_read());
+        EXPECT_EQ(0, memcmp("foo", deserialized->token.peek_read(), 3));
+    }
+}
+
+TEST(RoundTrip, ImportOperationRequest) {
+    for (int ver = 0; ver <= MAX_MESSAGE_VERSION; ++ver) {
+        ImportOperationRequest msg(ver);
+        msg.key_blob = KeymasterKeyBlob(reinterpret_cast<const uint8_t*>("foo"), 3);
+        msg.additional_params.Reinitialize(params, array_length(params));
+        msg.token.Reinitialize("bar", 3);
+
+        UniquePtr<ImportOperationRequest> deserialized(round_trip(ver, msg, 92));
+        ASSERT_EQ(3U, deserialized->key_blob.key_material_size);
+        EXPECT_EQ(0, memcmp("foo", deserialized->key_blob.key_material, 3));
+        EXPECT_EQ(msg.additional_params, deserialized->additional_params);
+        ASSERT_EQ(3U, deserialized->token.available_read());
+        EXPECT_EQ(0, memcmp("bar", deserialized->token.peek_read(), 3));
+    }
+}
+
+TEST(RoundTrip, ImportOperationResponse) {
+    for (int ver = 0; ver <= MAX_MESSAGE_VERSION; ++ver) {
+        ImportOperationResponse msg(ver);
+        msg.error = KM_ERROR_OK;
+        msg.op_handle = 0xDEADBEEF;
+
+        UniquePtr<ImportOperationResponse> deserialized(round_trip(ver, msg, 12));
+        EXPECT_EQ(KM_ERROR_OK, deserialized->error);
+        EXPECT_EQ(0xDEADBEEFU, deserialized->op_handle);
+    }
+}
+
+TEST(Deserialization, BatchItemCountIsBounded) {
+    BatchOperationResponse msg(4);
+    msg.error = KM_ERROR_OK;
+    ASSERT_TRUE(msg.SetItemCount(1));
+    size_t size = msg.SerializedSize();
+    UniquePtr<uint8_t[]> buf(new uint8_t[size]);
+    msg.Serialize(buf.get(), buf.get() + size);
+
+    // Claim far more items than the data could hold.
+    uint8_t* count = buf.get() + sizeof(uint32_t);
+    memset(count, 0xFF, sizeof(uint32_t));
+    BatchOperationResponse deserialized(4);
+    const uint8_t* p = buf.get();
+    EXPECT_FALSE(deserialized.Deserialize(&p, p + size));
+    EXPECT_EQ(0U, deserialized.item_count);
+
+    // And likewise in the compact format: KM_ERROR_OK, then a count of 2^28 - 1.
+    const uint8_t compact[] = {0x00, 0xFF, 0xFF, 0xFF, 0x7F, 0x00, 0x00, 0x00};
+    BatchOperationResponse compact_deserialized(5);
+    p = compact;
+    EXPECT_FALSE(compact_deserialized.Deserialize(&p, compact + sizeof(compact)));
+    EXPECT_EQ(0U, compact_deserialized.item_count);
+}
+
+TEST(RoundTrip, UnpinKeyRequest) {
+    for (int ver = 0; ver <= MAX_MESSAGE_VERSION; ++ver) {
+        UnpinKeyRequest msg(ver);
+        msg.key_handle = 0xDEADBEEF;
+
+        UniquePtr<UnpinKeyRequest> deserialized(round_trip(ver, msg, 8));
+        EXPECT_EQ(0xDEADBEEF, deserialized->key_handle);
+    }
+}
+
+TEST(RoundTrip, UnpinKeyResponse) {
+    for (int ver = 0; ver <= MAX_MESSAGE_VERSION; ++ver) {
+        UnpinKeyResponse msg(ver);
+        msg.error = KM_ERROR_OK;
+        UniquePtr<UnpinKeyResponse> deserialized(round_trip(ver, msg, 4));
+        EXPECT_EQ(KM_ERROR_OK, deserialized->error);
+    }
+}
+
+TEST(RoundTrip, WarmupKeysRequest) {
+    for (int ver = 0; ver <= MAX_MESSAGE_VERSION; ++ver) {
+        WarmupKeysRequest msg(ver);
+        ASSERT_TRUE(msg.SetItemCount(2));
+        msg.items[0].key_blob = KeymasterKeyBlob(reinterpret_cast<const uint8_t*>("foo"), 3);
+        msg.items[0].additional_params.Reinitialize(params, array_length(params));
+        msg.items[1].key_blob = KeymasterKeyBlob(reinterpret_cast<const uint8_t*>("barbaz"), 6);
+
+        UniquePtr<WarmupKeysRequest> deserialized(round_trip(ver, msg, 111));
+        ASSERT_EQ(2U, deserialized->item_count);
+        ASSERT_EQ(3U, deserialized->items[0].key_blob.key_material_size);
+        EXPECT_EQ(0, memcmp("foo", deserialized->items[0].key_blob.key_material, 3));
+        EXPECT_EQ(msg.items[0].additional_params, deserialized->items[0].additional_params);
+        ASSERT_EQ(6U, deserialized->items[1].key_blob.key_material_size);
+        EXPECT_EQ(0, memcmp("barbaz", deserialized->items[1].key_blob.key_material, 6));
+        EXPECT_EQ(0U, deserialized->items[1].additional_params.size());
+    }
+}
+
+TEST(RoundTrip, WarmupKeysResponse) {
+    for (int ver = 0; ver <= MAX_MESSAGE_VERSION; ++ver) {
+        WarmupKeysResponse msg(ver);
+        msg.error = KM_ERROR_OK;
+        UniquePtr<WarmupKeysResponse> deserialized(round_trip(ver, msg, 4));
+        EXPECT_EQ(KM_ERROR_OK, deserialized->error);
+    }
+}
+
+TEST(RoundTrip, UpdateAadRequest) {
+    for (int ver = 0; ver <= MAX_MESSAGE_VERSION; ++ver) {
+        UpdateAadRequest msg(ver);
+        msg.op_handle = 0xDEADBEEF;
+        msg.aad.Reinitialize("foo", 3);
+
+        UniquePtr<UpdateAadRequest> deserialized(round_trip(ver, msg, 15));
+        EXPECT_EQ(0xDEADBEEF, deserialized->op_handle);
+        EXPECT_EQ(3U, deserialized->aad.available_read());
+        EXPECT_EQ(0, memcmp(deserialized->aad.peek_read(), "foo", 3));
+    }
+}
+
+TEST(RoundTrip, UpdateAadResponse) {
+    for (int ver = 0; ver <= MAX_MESSAGE_VERSION; ++ver) {
+        UpdateAadResponse msg(ver);
+        msg.error = KM_ERROR_OK;
+        UniquePtr<UpdateAadResponse> deserialized(round_trip(ver, msg, 4));
+        EXPECT_EQ(KM_ERROR_OK, deserialized->error);
+    }
+}
+
+TEST(RoundTrip, GetStatisticsRequest) {
+    for (int ver = 0; ver <= MAX_MESSAGE_VERSION; ++ver) {
+        GetStatisticsRequest msg(ver);
+        UniquePtr<GetStatisticsRequest> deserialized(round_trip(ver, msg, 0));
+    }
+}
+
+TEST(RoundTrip, GetStatisticsResponse) {
+    for (int ver = 0; ver <= MAX_MESSAGE_VERSION; ++ver) {
+        GetStatisticsResponse msg(ver);
+        msg.error = KM_ERROR_OK;
+        ASSERT_TRUE(msg.SetHistogramCount(1));
+        msg.histograms[0].command = BEGIN_OPERATION;
+        msg.histograms[0].algorithm = KM_ALGORITHM_EC;
+        msg.histograms[0].purpose = KM_PURPOSE_SIGN;
+        msg.histograms[0].count = 3;
+        msg.histograms[0].total_microseconds = 2001;
+        msg.histograms[0].allocations = 12;
+        msg.histograms[0].allocated_bytes = 4096;
+        msg.histograms[0].buckets[1] = 1;
+        msg.histograms[0].buckets[GetStatisticsResponse::kBucketCount - 1] = 2;
+
+        // Only the two nonempty buckets are sent.
+        UniquePtr<GetStatisticsResponse> deserialized(round_trip(ver, msg, 80));
+        EXPECT_EQ(KM_ERROR_OK, deserialized->error);
+        ASSERT_EQ(1U, deserialized->histogram_count);
+        const GetStatisticsResponse::Histogram& histogram = deserialized->histograms[0];
+        EXPECT_EQ(static_cast<uint32_t>(BEGIN_OPERATION), histogram.command);
+        EXPECT_EQ(static_cast<uint32_t>(KM_ALGORITHM_EC), histogram.algorithm);
+        EXPECT_EQ(static_cast<uint32_t>(KM_PURPOSE_SIGN), histogram.purpose);
+        EXPECT_EQ(3U, histogram.count);
+        EXPECT_EQ(2001U, histogram.total_microseconds);
+        EXPECT_EQ(12U, histogram.allocations);
+        EXPECT_EQ(4096U, histogram.allocated_bytes);
+        EXPECT_EQ(0, memcmp(msg.histograms[0].buckets, histogram.buckets,
+                            sizeof(histogram.buckets)));
+    }
+}
+
+TEST(GetStatisticsResponse, Buckets) {
+    for (uint64_t i = 0; i < 4; ++i)
+        EXPECT_EQ(i, GetStatisticsResponse::BucketIndex(i));
+    EXPECT_EQ(4U, GetStatisticsResponse::BucketIndex(4));
+    EXPECT_EQ(8U, GetStatisticsResponse::BucketIndex(8));
+    EXPECT_EQ(8U, GetStatisticsResponse::BucketIndex(9));
+    EXPECT_EQ(9U, GetStatisticsResponse::BucketIndex(10));
+    EXPECT_EQ(11U, GetStatisticsResponse::BucketIndex(15));
+    EXPECT_EQ(12U, GetStatisticsResponse::BucketIndex(16));
+
+    // Each bucket starts where the one before it ends.
+    for (size_t b = 0; b < GetStatisticsResponse::kBucketCount; ++b) {
+        uint64_t lower = GetStatisticsResponse::BucketLowerBound(b);
+        uint64_t upper = GetStatisticsResponse::BucketLowerBound(b + 1);
+        ASSERT_LT(lower, upper);
+        EXPECT_EQ(b, GetStatisticsResponse::BucketIndex(lower));
+        EXPECT_EQ(b, GetStatisticsResponse::BucketIndex(upper - 1));
+    }
+
+    // Latencies beyond the last bucket are counted in it.
+    EXPECT_EQ(GetStatisticsResponse::kBucketCount - 1,
+              GetStatisticsResponse::BucketIndex(UINT64_MAX));
+}
+
+TEST(CompactFormat, Varints) {
+    const uint64_t values[] = {0, 1, 127, 128, 16383, 16384, UINT32_MAX, UINT64_MAX};
+    const size_t sizes[] = {1, 1, 1, 2, 2, 3, 5, MAX_VARINT_SIZE};
+    for (size_t i = 0; i < array_length(values); ++i) {
+        uint8_t buf[MAX_VARINT_SIZE];
+        EXPECT_EQ(sizes[i], varint_size(values[i]));
+        EXPECT_EQ(buf + sizes[i], append_varint_to_buf(buf, buf + sizeof(buf), values[i]));
+
+        uint64_t value;
+        const uint8_t* p = buf;
+        EXPECT_TRUE(copy_varint_from_buf(&p, buf + sizes[i], &value));
+        EXPECT_EQ(values[i], value);
+        EXPECT_EQ(buf + sizes[i], p);
+
+        p = buf;
+        EXPECT_FALSE(copy_varint_from_buf(&p, buf + sizes[i] - 1, &value));
+    }
+
+    // More than 64 bits.
+    const uint8_t too_long[] = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0x02};
+    uint64_t value;
+    const uint8_t* p = too_long;
+    EXPECT_FALSE(copy_varint_from_buf(&p, too_long + sizeof(too_long), &value));
+
+    // More than 32 bits, where 32 are expected.
+    uint8_t buf[MAX_VARINT_SIZE];
+    append_varint_to_buf(buf, buf + sizeof(buf), 1ULL << 32);
+    uint32_t value32;
+    p = buf;
+    EXPECT_FALSE(copy_uint32_from_buf(&p, buf + sizeof(buf), &value32, COMPACT_FORMAT));
+}
+
+TEST(CompactFormat, BeginOperationRequest) {
+    BeginOperationRequest msg(5);
+    EXPECT_EQ(COMPACT_FORMAT, msg.format());
+    msg.purpose = KM_PURPOSE_SIGN;
+    msg.SetKeyMaterial("foo", 3);
+    msg.additional_params.push_back(TAG_PURPOSE, KM_PURPOSE_SIGN);
+    msg.additional_params.push_back(TAG_APPLICATION_ID, "app_id", 6);
+    msg.key_handle = 0xDEADBEEF;
+
+    // One byte each for the purpose, the key blob length and the parameter count and purpose, two
+    // for the application ID tag, one for its length, and eight for the key handle.
+    UniquePtr<BeginOperationRequest> deserialized(round_trip(5, msg, 0));
+    EXPECT_EQ(25U, msg.SerializedSize());
+    EXPECT_EQ(KM_PURPOSE_SIGN, deserialized->purpose);
+    EXPECT_EQ(0, memcmp(deserialized->key_blob.key_material, "foo", 3));
+    EXPECT_EQ(msg.additional_params, deserialized->additional_params);
+    EXPECT_EQ(0xDEADBEEF, deserialized->key_handle);
+
+    BeginOperationRequest fixed(4);
+    fixed.purpose = msg.purpose;
+    fixed.SetKeyMaterial("foo", 3);
+    fixed.additional_params.Reinitialize(msg.additional_params);
+    EXPECT_LT(msg.SerializedSize(), fixed.SerializedSize());
+}
+
+TEST(CompactFormat, ErrorResponse) {
+    BeginOperationResponse msg(5);
+    msg.error = KM_ERROR_INVALID_OPERATION_HANDLE;
+    UniquePtr<BeginOperationResponse> deserialized(round_trip(5, msg, 0));
+    EXPECT_EQ(1U, msg.SerializedSize());
+    EXPECT_EQ(KM_ERROR_INVALID_OPERATION_HANDLE, deserialized->error);
+}
+
 uint8_t msgbuf[] = {
     220, 88,  183, 255, 71,  1,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
     0,   173, 0,   0,   0,   228, 174, 98,  187, 191, 135, 253, 200, 51,  230, 114, 247, 151, 109,
@@ -639,6 +1642,41 @@ uint8_t msgbuf[] = {
  * the result will be a crash.  This is especially informative when run under Valgrind memcheck.
  */
 
+TEST(MemcmpS, FindsDifferenceAnywhere) {
+    // Lengths either side of the word size, and long enough to exercise the word loop.
+    for (size_t length : {1, 7, 8, 9, 31, 64, 1000}) {
+        std::vector<uint8_t> a(length), b(length);
+        for (size_t i = 0; i < length; ++i)
+            a[i] = b[i] = static_cast<uint8_t>(i * 7);
+        EXPECT_EQ(0, memcmp_s(a.data(), b.data(), length));
+        for (size_t i = 0; i < length; ++i) {
+            b[i] ^= 0x80;
+            EXPECT_NE(0, memcmp_s(a.data(), b.data(), length)) << length << " bytes, at " << i;
+            b[i] ^= 0x80;
+        }
+    }
+    EXPECT_EQ(0, memcmp_s(nullptr, nullptr, 0));
+}
+
+TEST(MemcmpS, Unaligned) {
+    uint8_t a[40], b[40];
+    for (size_t i = 0; i < sizeof(a); ++i)
+        a[i] = b[i] = static_cast<uint8_t>(i);
+    EXPECT_EQ(0, memcmp_s(a + 1, b + 1, 35));
+    EXPECT_NE(0, memcmp_s(a + 1, b + 3, 35));
+}
+
+TEST(MemsetS, Clears) {
+    uint8_t buf[100];
+    memset(buf, 0xa5, sizeof(buf));
+    EXPECT_EQ(buf + 3, memset_s(buf + 3, 0, 90));
+    EXPECT_EQ(0xa5, buf[2]);
+    for (size_t i = 3; i < 93; ++i)
+        EXPECT_EQ(0, buf[i]);
+    EXPECT_EQ(0xa5, buf[93]);
+    EXPECT_EQ(nullptr, memset_s(nullptr, 0, 10));
+}
+
 template <typename Message> void parse_garbage() {
     for (int32_t ver = 0; ver <= MAX_MESSAGE_VERSION; ++ver) {
         Message msg(ver);
@@ -698,10 +1736,40 @@ GARBAGE_TEST(SupportedByAlgorithmAndPurposeRequest)
 GARBAGE_TEST(SupportedByAlgorithmRequest)
 GARBAGE_TEST(UpdateOperationRequest);
 GARBAGE_TEST(UpdateOperationResponse);
+GARBAGE_TEST(UpdateAadRequest);
+GARBAGE_TEST(UpdateAadResponse);
 GARBAGE_TEST(AttestKeyRequest);
 GARBAGE_TEST(AttestKeyResponse);
 GARBAGE_TEST(UpgradeKeyRequest);
 GARBAGE_TEST(UpgradeKeyResponse);
+GARBAGE_TEST(MigrateKeyRequest);
+GARBAGE_TEST(MigrateKeyResponse);
+GARBAGE_TEST(PinKeyRequest);
+GARBAGE_TEST(PinKeyResponse);
+GARBAGE_TEST(UnpinKeyRequest);
+GARBAGE_TEST(UnpinKeyResponse);
+GARBAGE_TEST(WarmupKeysRequest);
+GARBAGE_TEST(WarmupKeysResponse);
+GARBAGE_TEST(OneShotOperationRequest);
+GARBAGE_TEST(OneShotOperationResponse);
+GARBAGE_TEST(BatchOperationRequest);
+GARBAGE_TEST(BatchOperationResponse);
+GARBAGE_TEST(BatchUpgradeKeyRequest);
+GARBAGE_TEST(BatchUpgradeKeyResponse);
+GARBAGE_TEST(GenerateKeysRequest);
+GARBAGE_TEST(GenerateKeysResponse);
+GARBAGE_TEST(BatchGetKeyCharacteristicsRequest);
+GARBAGE_TEST(BatchGetKeyCharacteristicsResponse);
+GARBAGE_TEST(BatchDeleteKeyRequest);
+GARBAGE_TEST(BatchDeleteKeyResponse);
+GARBAGE_TEST(BatchAttestKeyRequest);
+GARBAGE_TEST(BatchAttestKeyResponse);
+GARBAGE_TEST(ExportOperationRequest);
+GARBAGE_TEST(ExportOperationResponse);
+GARBAGE_TEST(ImportOperationRequest);
+GARBAGE_TEST(ImportOperationResponse);
+GARBAGE_TEST(GetStatisticsRequest);
+GARBAGE_TEST(GetStatisticsResponse);
 
 // The macro doesn't work on this one.
 TEST(GarbageTest, SupportedResponse) {
@@ -14,10 +14,20 @@
  * limitations under the License.
  */
 
+#include <sched.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <fstream>
+#include <map>
+#include <mutex>
 #include <string>
+#include <thread>
 #include <vector>
 
+#include <openssl/ecdsa.h>
+#include <openssl/err.h>
 #include <openssl/evp.h>
 #include <openssl/x509.h>
 
@@ -26,11 +36,24 @@
 #include <keymaster/soft_keymaster_context.h>
 #include <keymaster/soft_keymaster_device.h>
 #include <keymaster/softkeymaster.h>
+#include <keymaster/tracer.h>
 
 #include "android_keymaster_test_utils.h"
+#include "aes_operation.h"
+#include "attestation_bundle.h"
 #include "attestation_record.h"
+#include "backend_cost_table.h"
+#include "chunk_size_advisor.h"
+#include "digest_context_cache.h"
+#include "ecdsa_operation.h"
+#include "hardware_public_key_cache.h"
 #include "keymaster0_engine.h"
+#include "keymaster1_request_queue.h"
+#include "openssl_err.h"
 #include "openssl_utils.h"
+#include "rsa_operation.h"
+#include "verification_cache.h"
+#include "worker_pool.h"
 
 using std::ifstream;
 using std::istreambuf_iterator;
@@ -1163,7 +1186,7 @@ TEST_P(VerificationOperationsTest, RsaSuccess) {
     VerifyMessage(message, signature, KM_DIGEST_NONE, KM_PAD_NONE);
 
     if (GetParam()->algorithm_in_km0_hardware(KM_ALGORITHM_RSA))
-        EXPECT_EQ(4, GetParam()->keymaster0_calls());
+        EXPECT_EQ(3, GetParam()->keymaster0_calls());
 }
 
 TEST_P(VerificationOperationsTest, RsaPssSha256Success) {
@@ -1178,7 +1201,7 @@ TEST_P(VerificationOperationsTest, RsaPssSha256Success) {
     VerifyMessage(message, signature, KM_DIGEST_SHA_2_256, KM_PAD_RSA_PSS);
 
     if (GetParam()->algorithm_in_km0_hardware(KM_ALGORITHM_RSA))
-        EXPECT_EQ(4, GetParam()->keymaster0_calls());
+        EXPECT_EQ(3, GetParam()->keymaster0_calls());
 }
 
 TEST_P(VerificationOperationsTest, RsaPssSha224Success) {
@@ -1193,7 +1216,7 @@ TEST_P(VerificationOperationsTest, RsaPssSha224Success) {
     VerifyMessage(message, signature, KM_DIGEST_SHA_2_224, KM_PAD_RSA_PSS);
 
     if (GetParam()->algorithm_in_km0_hardware(KM_ALGORITHM_RSA))
-        EXPECT_EQ(4, GetParam()->keymaster0_calls());
+        EXPECT_EQ(3, GetParam()->keymaster0_calls());
 
     // Verify with OpenSSL.
     string pubkey;
@@ -1239,7 +1262,7 @@ TEST_P(VerificationOperationsTest, RsaPssSha256CorruptSignature) {
     EXPECT_EQ(KM_ERROR_VERIFICATION_FAILED, FinishOperation(signature, &result));
 
     if (GetParam()->algorithm_in_km0_hardware(KM_ALGORITHM_RSA))
-        EXPECT_EQ(4, GetParam()->keymaster0_calls());
+        EXPECT_EQ(3, GetParam()->keymaster0_calls());
 }
 
 TEST_P(VerificationOperationsTest, RsaPssSha256CorruptInput) {
@@ -1265,7 +1288,7 @@ TEST_P(VerificationOperationsTest, RsaPssSha256CorruptInput) {
     EXPECT_EQ(KM_ERROR_VERIFICATION_FAILED, FinishOperation(signature, &result));
 
     if (GetParam()->algorithm_in_km0_hardware(KM_ALGORITHM_RSA))
-        EXPECT_EQ(4, GetParam()->keymaster0_calls());
+        EXPECT_EQ(3, GetParam()->keymaster0_calls());
 }
 
 TEST_P(VerificationOperationsTest, RsaPkcs1Sha256Success) {
@@ -1279,7 +1302,7 @@ TEST_P(VerificationOperationsTest, RsaPkcs1Sha256Success) {
     VerifyMessage(message, signature, KM_DIGEST_SHA_2_256, KM_PAD_RSA_PKCS1_1_5_SIGN);
 
     if (GetParam()->algorithm_in_km0_hardware(KM_ALGORITHM_RSA))
-        EXPECT_EQ(4, GetParam()->keymaster0_calls());
+        EXPECT_EQ(3, GetParam()->keymaster0_calls());
 }
 
 TEST_P(VerificationOperationsTest, RsaPks1Sha224Success) {
@@ -1294,7 +1317,7 @@ TEST_P(VerificationOperationsTest, RsaPks1Sha224Success) {
     VerifyMessage(message, signature, KM_DIGEST_SHA_2_224, KM_PAD_RSA_PKCS1_1_5_SIGN);
 
     if (GetParam()->algorithm_in_km0_hardware(KM_ALGORITHM_RSA))
-        EXPECT_EQ(4, GetParam()->keymaster0_calls());
+        EXPECT_EQ(3, GetParam()->keymaster0_calls());
 
     // Verify with OpenSSL.
     string pubkey;
@@ -1339,7 +1362,7 @@ TEST_P(VerificationOperationsTest, RsaPkcs1Sha256CorruptSignature) {
     EXPECT_EQ(KM_ERROR_VERIFICATION_FAILED, FinishOperation(signature, &result));
 
     if (GetParam()->algorithm_in_km0_hardware(KM_ALGORITHM_RSA))
-        EXPECT_EQ(4, GetParam()->keymaster0_calls());
+        EXPECT_EQ(3, GetParam()->keymaster0_calls());
 }
 
 TEST_P(VerificationOperationsTest, RsaPkcs1Sha256CorruptInput) {
@@ -1365,7 +1388,7 @@ TEST_P(VerificationOperationsTest, RsaPkcs1Sha256CorruptInput) {
     EXPECT_EQ(KM_ERROR_VERIFICATION_FAILED, FinishOperation(signature, &result));
 
     if (GetParam()->algorithm_in_km0_hardware(KM_ALGORITHM_RSA))
-        EXPECT_EQ(4, GetParam()->keymaster0_calls());
+        EXPECT_EQ(3, GetParam()->keymaster0_calls());
 }
 
 TEST_P(VerificationOperationsTest, RsaAllDigestAndPadCombinations) {
@@ -1457,7 +1480,7 @@ TEST_P(VerificationOperationsTest, RsaAllDigestAndPadCombinations) {
     }
 
     if (GetParam()->algorithm_in_km0_hardware(KM_ALGORITHM_RSA))
-        EXPECT_EQ(trial_count * 4, GetParam()->keymaster0_calls());
+        EXPECT_EQ(trial_count * 3, GetParam()->keymaster0_calls());
 }
 
 TEST_P(VerificationOperationsTest, EcdsaSuccess) {
@@ -1469,7 +1492,7 @@ TEST_P(VerificationOperationsTest, EcdsaSuccess) {
     VerifyMessage(message, signature, KM_DIGEST_NONE);
 
     if (GetParam()->algorithm_in_km0_hardware(KM_ALGORITHM_EC))
-        EXPECT_EQ(4, GetParam()->keymaster0_calls());
+        EXPECT_EQ(3, GetParam()->keymaster0_calls());
 }
 
 TEST_P(VerificationOperationsTest, EcdsaTooShort) {
@@ -1481,7 +1504,7 @@ TEST_P(VerificationOperationsTest, EcdsaTooShort) {
     VerifyMessage(message, signature, KM_DIGEST_NONE);
 
     if (GetParam()->algorithm_in_km0_hardware(KM_ALGORITHM_EC))
-        EXPECT_EQ(4, GetParam()->keymaster0_calls());
+        EXPECT_EQ(3, GetParam()->keymaster0_calls());
 }
 
 TEST_P(VerificationOperationsTest, EcdsaSlightlyTooLong) {
@@ -1498,7 +1521,7 @@ TEST_P(VerificationOperationsTest, EcdsaSlightlyTooLong) {
     VerifyMessage(message, signature, KM_DIGEST_NONE);
 
     if (GetParam()->algorithm_in_km0_hardware(KM_ALGORITHM_EC))
-        EXPECT_EQ(5, GetParam()->keymaster0_calls());
+        EXPECT_EQ(3, GetParam()->keymaster0_calls());
 }
 
 TEST_P(VerificationOperationsTest, EcdsaSha256Success) {
@@ -1512,7 +1535,7 @@ TEST_P(VerificationOperationsTest, EcdsaSha256Success) {
     VerifyMessage(message, signature, KM_DIGEST_SHA_2_256);
 
     if (GetParam()->algorithm_in_km0_hardware(KM_ALGORITHM_EC))
-        EXPECT_EQ(4, GetParam()->keymaster0_calls());
+        EXPECT_EQ(3, GetParam()->keymaster0_calls());
 
     // Just for giggles, try verifying with the wrong digest.
     AuthorizationSet begin_params(client_params());
@@ -1536,7 +1559,7 @@ TEST_P(VerificationOperationsTest, EcdsaSha224Success) {
     VerifyMessage(message, signature, KM_DIGEST_SHA_2_224);
 
     if (GetParam()->algorithm_in_km0_hardware(KM_ALGORITHM_EC))
-        EXPECT_EQ(4, GetParam()->keymaster0_calls());
+        EXPECT_EQ(3, GetParam()->keymaster0_calls());
 
     // Just for giggles, try verifying with the wrong digest.
     AuthorizationSet begin_params(client_params());
@@ -1574,7 +1597,7 @@ TEST_P(VerificationOperationsTest, EcdsaAllDigestsAndKeySizes) {
     }
 
     if (GetParam()->algorithm_in_km0_hardware(KM_ALGORITHM_EC))
-        EXPECT_EQ(static_cast<int>(array_length(key_sizes) * (1 + 3 * array_length(digests))),
+        EXPECT_EQ(static_cast<int>(array_length(key_sizes) * (2 + array_length(digests))),
                   GetParam()->keymaster0_calls());
 }
 
@@ -1716,6 +1739,60 @@ TEST_P(ExportKeyTest, EcdsaSuccess) {
         EXPECT_EQ(2, GetParam()->keymaster0_calls());
 }
 
+TEST_P(ExportKeyTest, EcdsaRepeatedExport) {
+    ASSERT_EQ(KM_ERROR_OK,
+              GenerateKey(AuthorizationSetBuilder().EcdsaSigningKey(256).Digest(KM_DIGEST_NONE)));
+    string export_data;
+    ASSERT_EQ(KM_ERROR_OK, ExportKey(KM_KEY_FORMAT_X509, &export_data));
+    const uint8_t* p = reinterpret_cast<const uint8_t*>(export_data.data());
+    EVP_PKEY_Ptr pkey(d2i_PUBKEY(nullptr /* key */, &p, export_data.size()));
+    ASSERT_TRUE(pkey.get() != nullptr);
+    EXPECT_EQ(EVP_PKEY_EC, EVP_PKEY_id(pkey.get()));
+
+    // Later exports of the same key give the same encoding.
+    for (int i = 0; i < 2; ++i) {
+        string repeated_export_data;
+        ASSERT_EQ(KM_ERROR_OK, ExportKey(KM_KEY_FORMAT_X509, &repeated_export_data));
+        EXPECT_EQ(export_data, repeated_export_data);
+    }
+}
+
+TEST_P(ExportKeyTest, EcdsaCompressedPublicKey) {
+    if (GetParam()->is_keymaster1_hw())
+        // Exports go to the keymaster1 hardware, which only has the HAL formats.
+        return;
+
+    ASSERT_EQ(KM_ERROR_OK,
+              GenerateKey(AuthorizationSetBuilder().EcdsaSigningKey(256).Digest(KM_DIGEST_NONE)));
+    string export_data;
+    ASSERT_EQ(KM_ERROR_OK, ExportKey(KM_KEY_FORMAT_X509, &export_data));
+    string compressed_export_data;
+    ASSERT_EQ(KM_ERROR_OK, ExportKey(KM_KEY_FORMAT_X509_COMPRESSED, &compressed_export_data));
+    // The point loses its 32-byte y coordinate.
+    EXPECT_EQ(export_data.size() - 32, compressed_export_data.size());
+
+    const uint8_t* p = reinterpret_cast<const uint8_t*>(export_data.data());
+    EVP_PKEY_Ptr pkey(d2i_PUBKEY(nullptr /* key */, &p, export_data.size()));
+    ASSERT_TRUE(pkey.get() != nullptr);
+    p = reinterpret_cast<const uint8_t*>(compressed_export_data.data());
+    EVP_PKEY_Ptr compressed_pkey(d2i_PUBKEY(nullptr /* key */, &p, compressed_export_data.size()));
+    ASSERT_TRUE(compressed_pkey.get() != nullptr);
+    EXPECT_EQ(1, EVP_PKEY_cmp(pkey.get(), compressed_pkey.get()));
+
+    // Later exports give the same encoding.
+    string repeated_export_data;
+    ASSERT_EQ(KM_ERROR_OK, ExportKey(KM_KEY_FORMAT_X509_COMPRESSED, &repeated_export_data));
+    EXPECT_EQ(compressed_export_data, repeated_export_data);
+
+    // The format is for EC keys only.
+    ASSERT_EQ(KM_ERROR_OK, GenerateKey(AuthorizationSetBuilder()
+                                           .RsaSigningKey(1024, 65537)
+                                           .Digest(KM_DIGEST_NONE)
+                                           .Padding(KM_PAD_NONE)));
+    EXPECT_EQ(KM_ERROR_UNSUPPORTED_KEY_FORMAT,
+              ExportKey(KM_KEY_FORMAT_X509_COMPRESSED, &export_data));
+}
+
 TEST_P(ExportKeyTest, RsaUnsupportedKeyFormat) {
     ASSERT_EQ(KM_ERROR_OK, GenerateKey(AuthorizationSetBuilder()
                                            .RsaSigningKey(256, 3)
@@ -1796,7 +1873,7 @@ TEST_P(ImportKeyTest, RsaSuccess) {
     VerifyMessage(message, signature, KM_DIGEST_NONE, KM_PAD_NONE);
 
     if (GetParam()->algorithm_in_km0_hardware(KM_ALGORITHM_RSA))
-        EXPECT_EQ(4, GetParam()->keymaster0_calls());
+        EXPECT_EQ(3, GetParam()->keymaster0_calls());
 }
 
 TEST_P(ImportKeyTest, RsaKeySizeMismatch) {
@@ -1854,7 +1931,7 @@ TEST_P(ImportKeyTest, EcdsaSuccess) {
     VerifyMessage(message, signature, KM_DIGEST_NONE);
 
     if (GetParam()->algorithm_in_km0_hardware(KM_ALGORITHM_EC))
-        EXPECT_EQ(4, GetParam()->keymaster0_calls());
+        EXPECT_EQ(3, GetParam()->keymaster0_calls());
 }
 
 TEST_P(ImportKeyTest, EcdsaSizeSpecified) {
@@ -1886,7 +1963,7 @@ TEST_P(ImportKeyTest, EcdsaSizeSpecified) {
     VerifyMessage(message, signature, KM_DIGEST_NONE);
 
     if (GetParam()->algorithm_in_km0_hardware(KM_ALGORITHM_EC))
-        EXPECT_EQ(4, GetParam()->keymaster0_calls());
+        EXPECT_EQ(3, GetParam()->keymaster0_calls());
 }
 
 TEST_P(ImportKeyTest, EcdsaSizeMismatch) {
@@ -1958,7 +2035,7 @@ TEST_P(EncryptionOperationsTest, RsaNoPaddingSuccess) {
     EXPECT_EQ(ciphertext1, ciphertext2);
 
     if (GetParam()->algorithm_in_km0_hardware(KM_ALGORITHM_RSA))
-        EXPECT_EQ(3, GetParam()->keymaster0_calls());
+        EXPECT_EQ(2, GetParam()->keymaster0_calls());
 }
 
 TEST_P(EncryptionOperationsTest, RsaNoPaddingTooShort) {
@@ -1976,7 +2053,7 @@ TEST_P(EncryptionOperationsTest, RsaNoPaddingTooShort) {
     EXPECT_EQ(expected_plaintext, plaintext);
 
     if (GetParam()->algorithm_in_km0_hardware(KM_ALGORITHM_RSA))
-        EXPECT_EQ(4, GetParam()->keymaster0_calls());
+        EXPECT_EQ(3, GetParam()->keymaster0_calls());
 }
 
 TEST_P(EncryptionOperationsTest, RsaNoPaddingTooLong) {
@@ -2037,7 +2114,7 @@ TEST_P(EncryptionOperationsTest, RsaNoPaddingLargerThanModulus) {
     EXPECT_EQ(KM_ERROR_OK, FinishOperation(&result));
 
     if (GetParam()->algorithm_in_km0_hardware(KM_ALGORITHM_RSA))
-        EXPECT_EQ(4, GetParam()->keymaster0_calls());
+        EXPECT_EQ(2, GetParam()->keymaster0_calls());
 }
 
 TEST_P(EncryptionOperationsTest, RsaOaepSuccess) {
@@ -2058,7 +2135,7 @@ TEST_P(EncryptionOperationsTest, RsaOaepSuccess) {
     EXPECT_NE(ciphertext1, ciphertext2);
 
     if (GetParam()->algorithm_in_km0_hardware(KM_ALGORITHM_RSA))
-        EXPECT_EQ(3, GetParam()->keymaster0_calls());
+        EXPECT_EQ(2, GetParam()->keymaster0_calls());
 }
 
 TEST_P(EncryptionOperationsTest, RsaOaepSha224Success) {
@@ -2079,7 +2156,7 @@ TEST_P(EncryptionOperationsTest, RsaOaepSha224Success) {
     EXPECT_NE(ciphertext1, ciphertext2);
 
     if (GetParam()->algorithm_in_km0_hardware(KM_ALGORITHM_RSA))
-        EXPECT_EQ(3, GetParam()->keymaster0_calls());
+        EXPECT_EQ(2, GetParam()->keymaster0_calls());
 }
 
 TEST_P(EncryptionOperationsTest, RsaOaepRoundTrip) {
@@ -2096,7 +2173,7 @@ TEST_P(EncryptionOperationsTest, RsaOaepRoundTrip) {
     EXPECT_EQ(message, plaintext);
 
     if (GetParam()->algorithm_in_km0_hardware(KM_ALGORITHM_RSA))
-        EXPECT_EQ(4, GetParam()->keymaster0_calls());
+        EXPECT_EQ(3, GetParam()->keymaster0_calls());
 }
 
 TEST_P(EncryptionOperationsTest, RsaOaepSha224RoundTrip) {
@@ -2113,7 +2190,7 @@ TEST_P(EncryptionOperationsTest, RsaOaepSha224RoundTrip) {
     EXPECT_EQ(message, plaintext);
 
     if (GetParam()->algorithm_in_km0_hardware(KM_ALGORITHM_RSA))
-        EXPECT_EQ(4, GetParam()->keymaster0_calls());
+        EXPECT_EQ(3, GetParam()->keymaster0_calls());
 }
 
 TEST_P(EncryptionOperationsTest, RsaOaepInvalidDigest) {
@@ -2151,7 +2228,7 @@ TEST_P(EncryptionOperationsTest, RsaOaepUnauthorizedDigest) {
     EXPECT_EQ(KM_ERROR_INCOMPATIBLE_DIGEST, BeginOperation(KM_PURPOSE_DECRYPT, begin_params));
 
     if (GetParam()->algorithm_in_km0_hardware(KM_ALGORITHM_RSA))
-        EXPECT_EQ(3, GetParam()->keymaster0_calls());
+        EXPECT_EQ(2, GetParam()->keymaster0_calls());
 }
 
 TEST_P(EncryptionOperationsTest, RsaOaepDecryptWithWrongDigest) {
@@ -2179,7 +2256,7 @@ TEST_P(EncryptionOperationsTest, RsaOaepDecryptWithWrongDigest) {
     EXPECT_EQ(0U, result.size());
 
     if (GetParam()->algorithm_in_km0_hardware(KM_ALGORITHM_RSA))
-        EXPECT_EQ(4, GetParam()->keymaster0_calls());
+        EXPECT_EQ(3, GetParam()->keymaster0_calls());
 }
 
 TEST_P(EncryptionOperationsTest, RsaOaepTooLarge) {
@@ -2227,7 +2304,7 @@ TEST_P(EncryptionOperationsTest, RsaOaepCorruptedDecrypt) {
     EXPECT_EQ(0U, result.size());
 
     if (GetParam()->algorithm_in_km0_hardware(KM_ALGORITHM_RSA))
-        EXPECT_EQ(4, GetParam()->keymaster0_calls());
+        EXPECT_EQ(3, GetParam()->keymaster0_calls());
 }
 
 TEST_P(EncryptionOperationsTest, RsaPkcs1Success) {
@@ -2244,7 +2321,7 @@ TEST_P(EncryptionOperationsTest, RsaPkcs1Success) {
     EXPECT_NE(ciphertext1, ciphertext2);
 
     if (GetParam()->algorithm_in_km0_hardware(KM_ALGORITHM_RSA))
-        EXPECT_EQ(3, GetParam()->keymaster0_calls());
+        EXPECT_EQ(2, GetParam()->keymaster0_calls());
 }
 
 TEST_P(EncryptionOperationsTest, RsaPkcs1RoundTrip) {
@@ -2258,7 +2335,7 @@ TEST_P(EncryptionOperationsTest, RsaPkcs1RoundTrip) {
     EXPECT_EQ(message, plaintext);
 
     if (GetParam()->algorithm_in_km0_hardware(KM_ALGORITHM_RSA))
-        EXPECT_EQ(4, GetParam()->keymaster0_calls());
+        EXPECT_EQ(3, GetParam()->keymaster0_calls());
 }
 
 TEST_P(EncryptionOperationsTest, RsaRoundTripAllCombinations) {
@@ -2297,7 +2374,7 @@ TEST_P(EncryptionOperationsTest, RsaRoundTripAllCombinations) {
         }
 
     if (GetParam()->algorithm_in_km0_hardware(KM_ALGORITHM_RSA))
-        EXPECT_EQ(40, GetParam()->keymaster0_calls());
+        EXPECT_EQ(15, GetParam()->keymaster0_calls());
 }
 
 TEST_P(EncryptionOperationsTest, RsaPkcs1TooLarge) {
@@ -2338,7 +2415,7 @@ TEST_P(EncryptionOperationsTest, RsaPkcs1CorruptedDecrypt) {
     EXPECT_EQ(0U, result.size());
 
     if (GetParam()->algorithm_in_km0_hardware(KM_ALGORITHM_RSA))
-        EXPECT_EQ(4, GetParam()->keymaster0_calls());
+        EXPECT_EQ(3, GetParam()->keymaster0_calls());
 }
 
 TEST_P(EncryptionOperationsTest, RsaEncryptWithSigningKey) {
@@ -2360,7 +2437,7 @@ TEST_P(EncryptionOperationsTest, EcdsaEncrypt) {
     ASSERT_EQ(KM_ERROR_UNSUPPORTED_PURPOSE, BeginOperation(KM_PURPOSE_DECRYPT));
 
     if (GetParam()->algorithm_in_km0_hardware(KM_ALGORITHM_EC))
-        EXPECT_EQ(3, GetParam()->keymaster0_calls());
+        EXPECT_EQ(2, GetParam()->keymaster0_calls());
 }
 
 TEST_P(EncryptionOperationsTest, HmacEncrypt) {
@@ -2451,6 +2528,28 @@ TEST_P(EncryptionOperationsTest, AesEcbPkcs7Padding) {
     EXPECT_EQ(0, GetParam()->keymaster0_calls());
 }
 
+TEST_P(EncryptionOperationsTest, AesEcbAlternatingPadding) {
+    ASSERT_EQ(KM_ERROR_OK, GenerateKey(AuthorizationSetBuilder()
+                                           .AesEncryptionKey(128)
+                                           .Authorization(TAG_BLOCK_MODE, KM_MODE_ECB)
+                                           .Padding(KM_PAD_NONE)
+                                           .Padding(KM_PAD_PKCS7)));
+
+    // Operations on one key share cipher contexts; padding mustn't carry over between them.
+    string message(16, 'a');
+    for (size_t i = 0; i < 3; ++i) {
+        string ciphertext = EncryptMessage(message, KM_MODE_ECB, KM_PAD_PKCS7);
+        EXPECT_EQ(32U, ciphertext.size());
+        EXPECT_EQ(message, DecryptMessage(ciphertext, KM_MODE_ECB, KM_PAD_PKCS7));
+
+        ciphertext = EncryptMessage(message, KM_MODE_ECB, KM_PAD_NONE);
+        EXPECT_EQ(16U, ciphertext.size());
+        EXPECT_EQ(message, DecryptMessage(ciphertext, KM_MODE_ECB, KM_PAD_NONE));
+    }
+
+    EXPECT_EQ(0, GetParam()->keymaster0_calls());
+}
+
 TEST_P(EncryptionOperationsTest, AesEcbNoPaddingKeyWithPkcs7Padding) {
     ASSERT_EQ(KM_ERROR_OK, GenerateKey(AuthorizationSetBuilder()
                                            .AesEncryptionKey(128)
@@ -2561,6 +2660,135 @@ TEST_P(EncryptionOperationsTest, AesCtrIncremental) {
     EXPECT_EQ(0, GetParam()->keymaster0_calls());
 }
 
+// Turns on parallel AES updates, for inputs of at least min_parallel_length bytes, while in scope.
+class ScopedParallelAes {
+  public:
+    explicit ScopedParallelAes(size_t min_parallel_length) : pool_(3 /* thread_count */) {
+        AesEvpOperation::set_parallel_pool(&pool_, min_parallel_length);
+    }
+    ~ScopedParallelAes() { AesEvpOperation::set_parallel_pool(nullptr, 0); }
+
+  private:
+    WorkerPool pool_;
+};
+
+static string PatternMessage(size_t length) {
+    string message(length, '\0');
+    for (size_t i = 0; i < length; ++i)
+        message[i] = static_cast<char>(i * 31 + i / 256);
+    return message;
+}
+
+TEST_P(EncryptionOperationsTest, AesCtrParallel) {
+    ASSERT_EQ(KM_ERROR_OK, GenerateKey(AuthorizationSetBuilder()
+                                           .AesEncryptionKey(128)
+                                           .Authorization(TAG_BLOCK_MODE, KM_MODE_CTR)
+                                           .Padding(KM_PAD_NONE)));
+    string message = PatternMessage(5000);
+    string iv;
+    string ciphertext = EncryptMessage(message, KM_MODE_CTR, KM_PAD_NONE, &iv);
+    // A nonce whose low 64 bits are about to wrap, so segments' counters carry.
+    string wrapping_iv = string(8, '\x12') + string(7, '\xff') + "\xf0";
+    string serial = DecryptMessage(message, KM_MODE_CTR, KM_PAD_NONE, wrapping_iv);
+
+    ScopedParallelAes parallel(256 /* min_parallel_length */);
+    EXPECT_EQ(message, DecryptMessage(ciphertext, KM_MODE_CTR, KM_PAD_NONE, iv));
+    EXPECT_EQ(serial, DecryptMessage(message, KM_MODE_CTR, KM_PAD_NONE, wrapping_iv));
+
+    // Updates that leave the stream off a block boundary are processed serially until it's back
+    // on one.
+    AuthorizationSet input_params(client_params());
+    input_params.push_back(TAG_BLOCK_MODE, KM_MODE_CTR);
+    input_params.push_back(TAG_PADDING, KM_PAD_NONE);
+    input_params.push_back(TAG_NONCE, iv.data(), iv.size());
+    EXPECT_EQ(KM_ERROR_OK, BeginOperation(KM_PURPOSE_DECRYPT, input_params));
+    const size_t kChunks[] = {7, 9, 2000, 1000, 333, 1500, 151};
+    string plaintext;
+    size_t input_consumed;
+    size_t offset = 0;
+    for (size_t chunk : kChunks) {
+        EXPECT_EQ(KM_ERROR_OK, UpdateOperation(ciphertext.substr(offset, chunk), &plaintext,
+                                               &input_consumed));
+        offset += chunk;
+    }
+    EXPECT_EQ(ciphertext.size(), offset);
+    EXPECT_EQ(KM_ERROR_OK, FinishOperation(&plaintext));
+    EXPECT_EQ(message, plaintext);
+
+    EXPECT_EQ(0, GetParam()->keymaster0_calls());
+}
+
+TEST_P(EncryptionOperationsTest, AesEcbParallel) {
+    ASSERT_EQ(KM_ERROR_OK, GenerateKey(AuthorizationSetBuilder()
+                                           .AesEncryptionKey(256)
+                                           .Authorization(TAG_BLOCK_MODE, KM_MODE_ECB)
+                                           .Padding(KM_PAD_NONE)
+                                           .Padding(KM_PAD_PKCS7)));
+    string message = PatternMessage(4096);
+    string serial = EncryptMessage(message, KM_MODE_ECB, KM_PAD_NONE);
+    string serial_padded = EncryptMessage(message + "abc", KM_MODE_ECB, KM_PAD_PKCS7);
+
+    ScopedParallelAes parallel(256 /* min_parallel_length */);
+    EXPECT_EQ(serial, EncryptMessage(message, KM_MODE_ECB, KM_PAD_NONE));
+    EXPECT_EQ(message, DecryptMessage(serial, KM_MODE_ECB, KM_PAD_NONE));
+    EXPECT_EQ(serial_padded, EncryptMessage(message + "abc", KM_MODE_ECB, KM_PAD_PKCS7));
+    EXPECT_EQ(message + "abc", DecryptMessage(serial_padded, KM_MODE_ECB, KM_PAD_PKCS7));
+
+    EXPECT_EQ(0, GetParam()->keymaster0_calls());
+}
+
+TEST_P(EncryptionOperationsTest, AesCbcParallel) {
+    ASSERT_EQ(KM_ERROR_OK, GenerateKey(AuthorizationSetBuilder()
+                                           .AesEncryptionKey(128)
+                                           .Authorization(TAG_BLOCK_MODE, KM_MODE_CBC)
+                                           .Padding(KM_PAD_NONE)
+                                           .Padding(KM_PAD_PKCS7)));
+    string message = PatternMessage(5000);
+    string iv;
+    string ciphertext = EncryptMessage(message.substr(0, 4992), KM_MODE_CBC, KM_PAD_NONE, &iv);
+    string padded_iv;
+    string padded = EncryptMessage(message, KM_MODE_CBC, KM_PAD_PKCS7, &padded_iv);
+    string corrupted = padded;
+    ++corrupted[corrupted.size() - 1];
+    AuthorizationSet begin_params(client_params());
+    begin_params.push_back(TAG_BLOCK_MODE, KM_MODE_CBC);
+    begin_params.push_back(TAG_PADDING, KM_PAD_PKCS7);
+    begin_params.push_back(TAG_NONCE, padded_iv.data(), padded_iv.size());
+    string plaintext;
+    size_t input_consumed;
+    EXPECT_EQ(KM_ERROR_OK, BeginOperation(KM_PURPOSE_DECRYPT, begin_params));
+    EXPECT_EQ(KM_ERROR_OK, UpdateOperation(corrupted, &plaintext, &input_consumed));
+    keymaster_error_t serial_corrupted_error = FinishOperation(&plaintext);
+    EXPECT_NE(KM_ERROR_OK, serial_corrupted_error);
+
+    ScopedParallelAes parallel(256 /* min_parallel_length */);
+    EXPECT_EQ(message.substr(0, 4992), DecryptMessage(ciphertext, KM_MODE_CBC, KM_PAD_NONE, iv));
+    EXPECT_EQ(message, DecryptMessage(padded, KM_MODE_CBC, KM_PAD_PKCS7, padded_iv));
+
+    // Padding is still checked in Finish.
+    plaintext.clear();
+    EXPECT_EQ(KM_ERROR_OK, BeginOperation(KM_PURPOSE_DECRYPT, begin_params));
+    EXPECT_EQ(KM_ERROR_OK, UpdateOperation(corrupted, &plaintext, &input_consumed));
+    EXPECT_EQ(serial_corrupted_error, FinishOperation(&plaintext));
+
+    // Aligned chunks each take over the block the previous one held back; unaligned ones are
+    // processed serially until the stream is back on a block boundary.
+    const size_t kChunks[] = {1024, 1024, 7, 9, 1000, 32, 333, 1579};
+    plaintext.clear();
+    EXPECT_EQ(KM_ERROR_OK, BeginOperation(KM_PURPOSE_DECRYPT, begin_params));
+    size_t offset = 0;
+    for (size_t chunk : kChunks) {
+        EXPECT_EQ(KM_ERROR_OK,
+                  UpdateOperation(padded.substr(offset, chunk), &plaintext, &input_consumed));
+        offset += chunk;
+    }
+    EXPECT_EQ(padded.size(), offset);
+    EXPECT_EQ(KM_ERROR_OK, FinishOperation(&plaintext));
+    EXPECT_EQ(message, plaintext);
+
+    EXPECT_EQ(0, GetParam()->keymaster0_calls());
+}
+
 struct AesCtrSp80038aTestVector {
     const char* key;
     const char* nonce;
@@ -3076,6 +3304,46 @@ TEST_P(EncryptionOperationsTest, AesGcmIncremental) {
     EXPECT_EQ(0, GetParam()->keymaster0_calls());
 }
 
+TEST_P(EncryptionOperationsTest, AesGcmDecryptMixedChunks) {
+    ASSERT_EQ(KM_ERROR_OK, GenerateKey(AuthorizationSetBuilder()
+                                           .AesEncryptionKey(128)
+                                           .Authorization(TAG_BLOCK_MODE, KM_MODE_GCM)
+                                           .Authorization(TAG_PADDING, KM_PAD_NONE)
+                                           .Authorization(TAG_MIN_MAC_LENGTH, 128)));
+    AuthorizationSet begin_params(client_params());
+    begin_params.push_back(TAG_BLOCK_MODE, KM_MODE_GCM);
+    begin_params.push_back(TAG_PADDING, KM_PAD_NONE);
+    begin_params.push_back(TAG_MAC_LENGTH, 128);
+
+    string message(10000, 'x');
+    for (size_t i = 0; i < message.size(); ++i)
+        message[i] = static_cast<char>(i * 7);
+    AuthorizationSet begin_out_params;
+    string ciphertext = EncryptMessageWithParams(message, begin_params, AuthorizationSet(),
+                                                 &begin_out_params);
+    EXPECT_EQ(message.size() + 16, ciphertext.size());
+    begin_params.push_back(begin_out_params);
+
+    // Chunks larger and smaller than the tag, so the held-back tail is sometimes all consumed and
+    // sometimes only partly.
+    const size_t kChunks[] = {4096, 5, 20, 3, 4096, 1, 15, 16, 17, 1747};
+    EXPECT_EQ(KM_ERROR_OK, BeginOperation(KM_PURPOSE_DECRYPT, begin_params));
+    string plaintext;
+    size_t input_consumed;
+    size_t offset = 0;
+    for (size_t chunk : kChunks) {
+        EXPECT_EQ(KM_ERROR_OK,
+                  UpdateOperation(ciphertext.substr(offset, chunk), &plaintext, &input_consumed));
+        EXPECT_EQ(chunk, input_consumed);
+        offset += chunk;
+    }
+    EXPECT_EQ(ciphertext.size(), offset);
+    EXPECT_EQ(KM_ERROR_OK, FinishOperation(&plaintext));
+    EXPECT_EQ(message, plaintext);
+
+    EXPECT_EQ(0, GetParam()->keymaster0_calls());
+}
+
 TEST_P(EncryptionOperationsTest, AesGcmMultiPartAad) {
     ASSERT_EQ(KM_ERROR_OK, GenerateKey(AuthorizationSetBuilder()
                                            .AesEncryptionKey(128)
@@ -3438,7 +3706,7 @@ TEST_P(Keymaster0AdapterTest, OldHwKeymaster0RsaBlob) {
     SignMessage(message, &signature, KM_DIGEST_NONE, KM_PAD_NONE);
     VerifyMessage(message, signature, KM_DIGEST_NONE, KM_PAD_NONE);
 
-    EXPECT_EQ(5, GetParam()->keymaster0_calls());
+    EXPECT_EQ(3, GetParam()->keymaster0_calls());
 }
 
 TEST_P(Keymaster0AdapterTest, OldHwKeymaster0RsaBlobGetCharacteristics) {
@@ -3756,7 +4024,7 @@ TEST_P(KeyUpgradeTest, RsaVersionUpgrade) {
     EXPECT_EQ(KM_ERROR_INVALID_ARGUMENT, UpgradeKey(client_params()));
 
     if (GetParam()->algorithm_in_km0_hardware(KM_ALGORITHM_RSA))
-        EXPECT_EQ(7, GetParam()->keymaster0_calls());
+        EXPECT_EQ(5, GetParam()->keymaster0_calls());
 }
 
 TEST_P(KeyUpgradeTest, EcVersionUpgrade) {
@@ -3803,7 +4071,7 @@ TEST_P(KeyUpgradeTest, EcVersionUpgrade) {
     EXPECT_EQ(KM_ERROR_INVALID_ARGUMENT, UpgradeKey(client_params()));
 
     if (GetParam()->algorithm_in_km0_hardware(KM_ALGORITHM_EC))
-        EXPECT_EQ(7, GetParam()->keymaster0_calls());
+        EXPECT_EQ(5, GetParam()->keymaster0_calls());
 }
 
 TEST(SoftKeymasterWrapperTest, CheckKeymaster2Device) {
@@ -3833,5 +4101,3290 @@ TEST(SoftKeymasterWrapperTest, CheckKeymaster2Device) {
         sha256_only_fake_wrapper->hw_device());
 }
 
+static int get_key_characteristics_calls;
+static decltype(keymaster1_device_t::get_key_characteristics) real_get_key_characteristics;
+
+static keymaster_error_t CountingGetKeyCharacteristics(
+    const keymaster1_device_t* dev, const keymaster_key_blob_t* key_blob,
+    const keymaster_blob_t* client_id, const keymaster_blob_t* app_data,
+    keymaster_key_characteristics_t** characteristics) {
+    ++get_key_characteristics_calls;
+    return real_get_key_characteristics(dev, key_blob, client_id, app_data, characteristics);
+}
+
+TEST(SoftKeymasterDeviceTest, WrappedKeyAlgorithmIsCached) {
+    keymaster1_device_t* hw_device =
+        (new SoftKeymasterDevice(new TestKeymasterContext))->keymaster_device();
+    real_get_key_characteristics = hw_device->get_key_characteristics;
+    hw_device->get_key_characteristics = CountingGetKeyCharacteristics;
+    get_key_characteristics_calls = 0;
+
+    SoftKeymasterDevice* device(new SoftKeymasterDevice(new TestKeymasterContext));
+    ASSERT_EQ(KM_ERROR_OK, device->SetHardwareDevice(hw_device));
+    keymaster1_device_t* km1_device = device->keymaster_device();
+
+    AuthorizationSet key_params(AuthorizationSetBuilder()
+                                    .AesEncryptionKey(128)
+                                    .EcbMode()
+                                    .Padding(KM_PAD_NONE)
+                                    .Authorization(TAG_NO_AUTH_REQUIRED));
+    keymaster_key_blob_t blob;
+    ASSERT_EQ(KM_ERROR_OK, km1_device->generate_key(km1_device, &key_params, &blob, nullptr));
+
+    AuthorizationSet begin_params(AuthorizationSetBuilder().EcbMode().Padding(KM_PAD_NONE));
+    keymaster_operation_handle_t op_handle;
+    for (int i = 0; i < 3; ++i) {
+        ASSERT_EQ(KM_ERROR_OK, km1_device->begin(km1_device, KM_PURPOSE_ENCRYPT, &blob,
+                                                 &begin_params, nullptr, &op_handle));
+        EXPECT_EQ(KM_ERROR_OK, km1_device->abort(km1_device, op_handle));
+    }
+    EXPECT_EQ(1, get_key_characteristics_calls);
+
+    // Deleting the key forgets its algorithm.
+    EXPECT_EQ(KM_ERROR_OK, km1_device->delete_key(km1_device, &blob));
+    if (km1_device->begin(km1_device, KM_PURPOSE_ENCRYPT, &blob, &begin_params, nullptr,
+                          &op_handle) == KM_ERROR_OK)
+        km1_device->abort(km1_device, op_handle);
+    EXPECT_EQ(2, get_key_characteristics_calls);
+
+    free(const_cast<uint8_t*>(blob.key_material));
+    km1_device->common.close(device->hw_device());
+}
+
+static int get_supported_digests_calls;
+static decltype(keymaster1_device_t::get_supported_digests) real_get_supported_digests;
+
+static keymaster_error_t CountingGetSupportedDigests(const keymaster1_device_t* dev,
+                                                     keymaster_algorithm_t algorithm,
+                                                     keymaster_purpose_t purpose,
+                                                     keymaster_digest_t** digests,
+                                                     size_t* digests_length) {
+    ++get_supported_digests_calls;
+    return real_get_supported_digests(dev, algorithm, purpose, digests, digests_length);
+}
+
+TEST(SoftKeymasterDeviceTest, WrappedDigestsProbedOnFirstUse) {
+    keymaster1_device_t* hw_device =
+        (new SoftKeymasterDevice(new TestKeymasterContext))->keymaster_device();
+    real_get_supported_digests = hw_device->get_supported_digests;
+    hw_device->get_supported_digests = CountingGetSupportedDigests;
+    get_supported_digests_calls = 0;
+
+    SoftKeymasterDevice* device(new SoftKeymasterDevice(new TestKeymasterContext));
+    ASSERT_EQ(KM_ERROR_OK, device->SetHardwareDevice(hw_device));
+    keymaster1_device_t* km1_device = device->keymaster_device();
+
+    // AES keys don't need the device's digests.
+    AuthorizationSet key_params(AuthorizationSetBuilder()
+                                    .AesEncryptionKey(128)
+                                    .EcbMode()
+                                    .Padding(KM_PAD_NONE)
+                                    .Authorization(TAG_NO_AUTH_REQUIRED));
+    keymaster_key_blob_t blob;
+    ASSERT_EQ(KM_ERROR_OK, km1_device->generate_key(km1_device, &key_params, &blob, nullptr));
+    free(const_cast<uint8_t*>(blob.key_material));
+    EXPECT_EQ(0, get_supported_digests_calls);
+
+    // The first check probes them, once: RSA and EC signing and verification, and RSA encryption
+    // and decryption.
+    EXPECT_TRUE(device->Keymaster1DeviceIsGood());
+    EXPECT_EQ(6, get_supported_digests_calls);
+    EXPECT_TRUE(device->Keymaster1DeviceIsGood());
+    EXPECT_EQ(6, get_supported_digests_calls);
+
+    km1_device->common.close(device->hw_device());
+}
+
+static int get_supported_padding_modes_calls;
+static decltype(keymaster1_device_t::get_supported_padding_modes) real_get_supported_padding_modes;
+
+static keymaster_error_t CountingGetSupportedPaddingModes(const keymaster1_device_t* dev,
+                                                          keymaster_algorithm_t algorithm,
+                                                          keymaster_purpose_t purpose,
+                                                          keymaster_padding_t** modes,
+                                                          size_t* modes_length) {
+    ++get_supported_padding_modes_calls;
+    return real_get_supported_padding_modes(dev, algorithm, purpose, modes, modes_length);
+}
+
+static int begin_calls;
+static decltype(keymaster1_device_t::begin) real_begin;
+
+static keymaster_error_t CountingBegin(const keymaster1_device_t* dev, keymaster_purpose_t purpose,
+                                       const keymaster_key_blob_t* key,
+                                       const keymaster_key_param_set_t* in_params,
+                                       keymaster_key_param_set_t* out_params,
+                                       keymaster_operation_handle_t* operation_handle) {
+    ++begin_calls;
+    return real_begin(dev, purpose, key, in_params, out_params, operation_handle);
+}
+
+TEST(SoftKeymasterDeviceTest, SoftwarePublicKeyOperations) {
+    keymaster1_device_t* hw_device =
+        (new SoftKeymasterDevice(new TestKeymasterContext("PseudoHW")))->keymaster_device();
+    real_begin = hw_device->begin;
+    hw_device->begin = CountingBegin;
+    begin_calls = 0;
+
+    SoftKeymasterDevice* device(new SoftKeymasterDevice(new TestKeymasterContext));
+    ASSERT_EQ(KM_ERROR_OK, device->SetHardwareDevice(hw_device));
+    device->set_software_public_key_operations(true);
+    keymaster1_device_t* km1_device = device->keymaster_device();
+
+    AuthorizationSet key_params(AuthorizationSetBuilder()
+                                    .EcdsaSigningKey(256)
+                                    .Digest(KM_DIGEST_NONE)
+                                    .Authorization(TAG_NO_AUTH_REQUIRED));
+    keymaster_key_blob_t blob;
+    ASSERT_EQ(KM_ERROR_OK, km1_device->generate_key(km1_device, &key_params, &blob, nullptr));
+
+    AuthorizationSet begin_params(AuthorizationSetBuilder().Digest(KM_DIGEST_NONE));
+    string message(32, 'a');
+    keymaster_blob_t input = {reinterpret_cast<const uint8_t*>(message.data()), message.size()};
+    size_t input_consumed;
+
+    // Signing needs the private key, so it still goes to the hardware.
+    keymaster_operation_handle_t op_handle;
+    ASSERT_EQ(KM_ERROR_OK, km1_device->begin(km1_device, KM_PURPOSE_SIGN, &blob, &begin_params,
+                                             nullptr, &op_handle));
+    EXPECT_EQ(1, begin_calls);
+    ASSERT_EQ(KM_ERROR_OK, km1_device->update(km1_device, op_handle, &begin_params, &input,
+                                              &input_consumed, nullptr, nullptr));
+    keymaster_blob_t signature = {nullptr, 0};
+    ASSERT_EQ(KM_ERROR_OK, km1_device->finish(km1_device, op_handle, &begin_params, nullptr,
+                                              nullptr, &signature));
+
+    // Verification doesn't.
+    ASSERT_EQ(KM_ERROR_OK, km1_device->begin(km1_device, KM_PURPOSE_VERIFY, &blob, &begin_params,
+                                             nullptr, &op_handle));
+    EXPECT_EQ(1, begin_calls);
+    ASSERT_EQ(KM_ERROR_OK, km1_device->update(km1_device, op_handle, &begin_params, &input,
+                                              &input_consumed, nullptr, nullptr));
+    EXPECT_EQ(KM_ERROR_OK, km1_device->finish(km1_device, op_handle, &begin_params, &signature,
+                                              nullptr, nullptr));
+
+    free(const_cast<uint8_t*>(signature.data));
+    free(const_cast<uint8_t*>(blob.key_material));
+    km1_device->common.close(device->hw_device());
+}
+
+TEST(SoftKeymasterDeviceTest, AdaptiveRouting) {
+    keymaster1_device_t* hw_device =
+        (new SoftKeymasterDevice(new TestKeymasterContext("PseudoHW")))->keymaster_device();
+    real_begin = hw_device->begin;
+    hw_device->begin = CountingBegin;
+    begin_calls = 0;
+
+    SoftKeymasterDevice* device(new SoftKeymasterDevice(new TestKeymasterContext));
+    ASSERT_EQ(KM_ERROR_OK, device->SetHardwareDevice(hw_device));
+    device->set_adaptive_routing(true);
+    keymaster1_device_t* km1_device = device->keymaster_device();
+
+    AuthorizationSet key_params(AuthorizationSetBuilder()
+                                    .EcdsaSigningKey(256)
+                                    .Digest(KM_DIGEST_NONE)
+                                    .Authorization(TAG_NO_AUTH_REQUIRED));
+    keymaster_key_blob_t blob;
+    ASSERT_EQ(KM_ERROR_OK, km1_device->generate_key(km1_device, &key_params, &blob, nullptr));
+
+    AuthorizationSet begin_params(AuthorizationSetBuilder().Digest(KM_DIGEST_NONE));
+    string message(32, 'a');
+    keymaster_blob_t input = {reinterpret_cast<const uint8_t*>(message.data()), message.size()};
+    size_t input_consumed;
+    keymaster_operation_handle_t op_handle;
+    ASSERT_EQ(KM_ERROR_OK, km1_device->begin(km1_device, KM_PURPOSE_SIGN, &blob, &begin_params,
+                                             nullptr, &op_handle));
+    ASSERT_EQ(KM_ERROR_OK, km1_device->update(km1_device, op_handle, &begin_params, &input,
+                                              &input_consumed, nullptr, nullptr));
+    keymaster_blob_t signature = {nullptr, 0};
+    ASSERT_EQ(KM_ERROR_OK, km1_device->finish(km1_device, op_handle, &begin_params, nullptr,
+                                              nullptr, &signature));
+    EXPECT_EQ(1, begin_calls);
+
+    // Signing isn't sampled, since only the hardware can do it.  Verification is tried on both
+    // backends before their costs are compared.
+    BackendCostTable::Key verify_key(KM_ALGORITHM_EC, KM_PURPOSE_VERIFY, 256);
+    uint64_t cost;
+    EXPECT_FALSE(device->backend_costs()->GetCost(
+        BackendCostTable::Key(KM_ALGORITHM_EC, KM_PURPOSE_SIGN, 256), BackendCostTable::HARDWARE,
+        &cost));
+    for (size_t i = 0; i < 2 * BackendCostTable::kMinSamples; ++i) {
+        ASSERT_EQ(KM_ERROR_OK, km1_device->begin(km1_device, KM_PURPOSE_VERIFY, &blob,
+                                                 &begin_params, nullptr, &op_handle));
+        ASSERT_EQ(KM_ERROR_OK, km1_device->update(km1_device, op_handle, &begin_params, &input,
+                                                  &input_consumed, nullptr, nullptr));
+        EXPECT_EQ(KM_ERROR_OK, km1_device->finish(km1_device, op_handle, &begin_params,
+                                                  &signature, nullptr, nullptr));
+    }
+    EXPECT_EQ(1 + static_cast<int>(BackendCostTable::kMinSamples), begin_calls);
+    EXPECT_TRUE(device->backend_costs()->GetCost(verify_key, BackendCostTable::HARDWARE, &cost));
+    EXPECT_TRUE(device->backend_costs()->GetCost(verify_key, BackendCostTable::SOFTWARE, &cost));
+
+    free(const_cast<uint8_t*>(signature.data));
+    free(const_cast<uint8_t*>(blob.key_material));
+    km1_device->common.close(device->hw_device());
+}
+
+TEST(SoftKeymasterDeviceTest, CapabilitiesAreCached) {
+    keymaster1_device_t* hw_device =
+        (new SoftKeymasterDevice(new TestKeymasterContext))->keymaster_device();
+    real_get_supported_padding_modes = hw_device->get_supported_padding_modes;
+    hw_device->get_supported_padding_modes = CountingGetSupportedPaddingModes;
+    get_supported_padding_modes_calls = 0;
+
+    SoftKeymasterDevice* device(new SoftKeymasterDevice(new TestKeymasterContext));
+    keymaster1_device_t* km1_device = device->keymaster_device();
+    keymaster_padding_t* software_modes;
+    size_t software_modes_length;
+    ASSERT_EQ(KM_ERROR_OK,
+              km1_device->get_supported_padding_modes(km1_device, KM_ALGORITHM_RSA,
+                                                      KM_PURPOSE_SIGN, &software_modes,
+                                                      &software_modes_length));
+
+    // Setting a hardware device replaces the software answers.
+    ASSERT_EQ(KM_ERROR_OK, device->SetHardwareDevice(hw_device));
+    for (int i = 0; i < 3; ++i) {
+        keymaster_padding_t* modes;
+        size_t modes_length;
+        ASSERT_EQ(KM_ERROR_OK,
+                  km1_device->get_supported_padding_modes(km1_device, KM_ALGORITHM_RSA,
+                                                          KM_PURPOSE_SIGN, &modes, &modes_length));
+        EXPECT_EQ(vector<keymaster_padding_t>(software_modes,
+                                              software_modes + software_modes_length),
+                  vector<keymaster_padding_t>(modes, modes + modes_length));
+        free(modes);
+    }
+    EXPECT_EQ(1, get_supported_padding_modes_calls);
+
+    // Unsupported queries are answered, but not cached.
+    keymaster_padding_t* modes;
+    size_t modes_length;
+    EXPECT_EQ(KM_ERROR_UNSUPPORTED_PURPOSE,
+              km1_device->get_supported_padding_modes(km1_device, KM_ALGORITHM_EC,
+                                                      KM_PURPOSE_ENCRYPT, &modes, &modes_length));
+    EXPECT_EQ(2, get_supported_padding_modes_calls);
+
+    free(software_modes);
+    km1_device->common.close(device->hw_device());
+}
+
+TEST(SoftKeymasterDeviceTest, UpdateAndFinishInto) {
+    SoftKeymasterDevice* device(new SoftKeymasterDevice(new TestKeymasterContext));
+    keymaster2_device_t* km2_device = device->keymaster2_device();
+    AuthorizationSet version_info(AuthorizationSetBuilder()
+                                      .Authorization(TAG_OS_VERSION, kOsVersion)
+                                      .Authorization(TAG_OS_PATCHLEVEL, kOsPatchLevel));
+    ASSERT_EQ(KM_ERROR_OK, km2_device->configure(km2_device, &version_info));
+
+    AuthorizationSet key_params(AuthorizationSetBuilder()
+                                    .AesEncryptionKey(128)
+                                    .EcbMode()
+                                    .Padding(KM_PAD_NONE)
+                                    .Authorization(TAG_NO_AUTH_REQUIRED));
+    keymaster_key_blob_t blob;
+    ASSERT_EQ(KM_ERROR_OK, km2_device->generate_key(km2_device, &key_params, &blob, nullptr));
+
+    AuthorizationSet begin_params(AuthorizationSetBuilder().EcbMode().Padding(KM_PAD_NONE));
+    string message(32, 'a');
+    keymaster_blob_t input = {reinterpret_cast<const uint8_t*>(message.data()), message.size()};
+    uint8_t ciphertext[48];
+    size_t input_consumed, output_length;
+
+    keymaster_operation_handle_t op_handle;
+    ASSERT_EQ(KM_ERROR_OK, km2_device->begin(km2_device, KM_PURPOSE_ENCRYPT, &blob, &begin_params,
+                                             nullptr, &op_handle));
+    ASSERT_EQ(KM_ERROR_OK,
+              device->UpdateInto(op_handle, nullptr, &input, &input_consumed, nullptr, ciphertext,
+                                 sizeof(ciphertext), &output_length));
+    EXPECT_EQ(message.size(), input_consumed);
+    EXPECT_EQ(message.size(), output_length);
+    size_t finish_length;
+    ASSERT_EQ(KM_ERROR_OK, device->FinishInto(op_handle, &begin_params, nullptr, nullptr,
+                                              ciphertext + output_length,
+                                              sizeof(ciphertext) - output_length, &finish_length));
+    EXPECT_EQ(0U, finish_length);
+
+    // Round trip through the regular entry points.
+    ASSERT_EQ(KM_ERROR_OK, km2_device->begin(km2_device, KM_PURPOSE_DECRYPT, &blob, &begin_params,
+                                             nullptr, &op_handle));
+    keymaster_blob_t ciphertext_blob = {ciphertext, output_length};
+    keymaster_blob_t plaintext = {nullptr, 0};
+    ASSERT_EQ(KM_ERROR_OK, km2_device->update(km2_device, op_handle, nullptr, &ciphertext_blob,
+                                              &input_consumed, nullptr, &plaintext));
+    EXPECT_EQ(message, string(reinterpret_cast<const char*>(plaintext.data), plaintext.data_length));
+    free(const_cast<uint8_t*>(plaintext.data));
+    keymaster_blob_t finish_output = {nullptr, 0};
+    ASSERT_EQ(KM_ERROR_OK, km2_device->finish(km2_device, op_handle, &begin_params, nullptr,
+                                              nullptr, nullptr, &finish_output));
+    free(const_cast<uint8_t*>(finish_output.data));
+
+    // Output that doesn't fit aborts the operation.
+    ASSERT_EQ(KM_ERROR_OK, km2_device->begin(km2_device, KM_PURPOSE_ENCRYPT, &blob, &begin_params,
+                                             nullptr, &op_handle));
+    EXPECT_EQ(KM_ERROR_INSUFFICIENT_BUFFER_SPACE,
+              device->UpdateInto(op_handle, nullptr, &input, &input_consumed, nullptr, ciphertext,
+                                 16, &output_length));
+    EXPECT_EQ(KM_ERROR_INVALID_OPERATION_HANDLE, km2_device->abort(km2_device, op_handle));
+
+    free(const_cast<uint8_t*>(blob.key_material));
+    km2_device->common.close(device->hw_device());
+}
+
+TEST(SoftKeymasterDeviceTest, ConcurrentOperations) {
+    SoftKeymasterDevice* device(new SoftKeymasterDevice(new TestKeymasterContext));
+    keymaster2_device_t* km2_device = device->keymaster2_device();
+    AuthorizationSet version_info(AuthorizationSetBuilder()
+                                      .Authorization(TAG_OS_VERSION, kOsVersion)
+                                      .Authorization(TAG_OS_PATCHLEVEL, kOsPatchLevel));
+    ASSERT_EQ(KM_ERROR_OK, km2_device->configure(km2_device, &version_info));
+
+    AuthorizationSet key_params(AuthorizationSetBuilder()
+                                    .HmacKey(128)
+                                    .Digest(KM_DIGEST_SHA_2_256)
+                                    .Authorization(TAG_MIN_MAC_LENGTH, 256)
+                                    .Authorization(TAG_NO_AUTH_REQUIRED));
+    keymaster_key_blob_t blob;
+    ASSERT_EQ(KM_ERROR_OK, km2_device->generate_key(km2_device, &key_params, &blob, nullptr));
+
+    // Each thread signs its own message repeatedly; every MAC a thread computes must match the
+    // first, whatever the other threads are doing.
+    const size_t kThreadCount = 4;
+    const size_t kRounds = 25;
+    std::atomic<size_t> failures(0);
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < kThreadCount; ++t) {
+        threads.push_back(std::thread([&, t] {
+            AuthorizationSet begin_params(AuthorizationSetBuilder()
+                                              .Digest(KM_DIGEST_SHA_2_256)
+                                              .Authorization(TAG_MAC_LENGTH, 256));
+            string message(100, 'a' + t);
+            string first_mac;
+            for (size_t i = 0; i < kRounds; ++i) {
+                keymaster_operation_handle_t op_handle;
+                keymaster_blob_t input = {reinterpret_cast<const uint8_t*>(message.data()),
+                                          message.size()};
+                size_t input_consumed;
+                keymaster_blob_t mac = {nullptr, 0};
+                if (km2_device->begin(km2_device, KM_PURPOSE_SIGN, &blob, &begin_params, nullptr,
+                                      &op_handle) != KM_ERROR_OK ||
+                    km2_device->update(km2_device, op_handle, &begin_params, &input,
+                                       &input_consumed, nullptr, nullptr) != KM_ERROR_OK ||
+                    km2_device->finish(km2_device, op_handle, &begin_params, nullptr, nullptr,
+                                       nullptr, &mac) != KM_ERROR_OK) {
+                    ++failures;
+                    continue;
+                }
+                string mac_string(reinterpret_cast<const char*>(mac.data), mac.data_length);
+                free(const_cast<uint8_t*>(mac.data));
+                if (i == 0)
+                    first_mac = mac_string;
+                else if (mac_string != first_mac)
+                    ++failures;
+            }
+        }));
+    }
+    for (auto& thread : threads)
+        thread.join();
+    EXPECT_EQ(0U, failures.load());
+
+    free(const_cast<uint8_t*>(blob.key_material));
+    km2_device->common.close(device->hw_device());
+}
+
+// Signs message with blob on km1_device and verifies the signature, returning false if either
+// fails.
+static bool SignAndVerifyWithKeymaster1(keymaster1_device_t* km1_device,
+                                        const keymaster_key_blob_t& blob, const string& message) {
+    AuthorizationSet params(AuthorizationSetBuilder().Digest(KM_DIGEST_NONE));
+    keymaster_blob_t input = {reinterpret_cast<const uint8_t*>(message.data()), message.size()};
+    size_t input_consumed;
+    keymaster_operation_handle_t op_handle;
+    keymaster_blob_t signature = {nullptr, 0};
+    if (km1_device->begin(km1_device, KM_PURPOSE_SIGN, &blob, &params, nullptr, &op_handle) !=
+            KM_ERROR_OK ||
+        km1_device->update(km1_device, op_handle, &params, &input, &input_consumed, nullptr,
+                           nullptr) != KM_ERROR_OK ||
+        km1_device->finish(km1_device, op_handle, &params, nullptr, nullptr, &signature) !=
+            KM_ERROR_OK)
+        return false;
+    std::unique_ptr<uint8_t, Malloc_Delete> signature_deleter(
+        const_cast<uint8_t*>(signature.data));
+
+    return km1_device->begin(km1_device, KM_PURPOSE_VERIFY, &blob, &params, nullptr,
+                             &op_handle) == KM_ERROR_OK &&
+           km1_device->update(km1_device, op_handle, &params, &input, &input_consumed, nullptr,
+                              nullptr) == KM_ERROR_OK &&
+           km1_device->finish(km1_device, op_handle, &params, &signature, nullptr, nullptr) ==
+               KM_ERROR_OK;
+}
+
+TEST(SoftKeymasterDeviceTest, SeveralHardwareDevicesConcurrently) {
+    // Each wrapper has its own keymaster0 or keymaster1 engine; all of them, and their keys, are
+    // live at once.
+    const size_t kDeviceCount = 4;
+    SoftKeymasterDevice* devices[kDeviceCount];
+    keymaster_key_blob_t blobs[kDeviceCount];
+    AuthorizationSet key_params(AuthorizationSetBuilder()
+                                    .EcdsaSigningKey(256)
+                                    .Digest(KM_DIGEST_NONE)
+                                    .Authorization(TAG_NO_AUTH_REQUIRED));
+    for (size_t i = 0; i < kDeviceCount; ++i) {
+        devices[i] = new SoftKeymasterDevice(new TestKeymasterContext);
+        if (i % 2 == 0) {
+            keymaster1_device_t* hw_device =
+                (new SoftKeymasterDevice(new TestKeymasterContext))->keymaster_device();
+            ASSERT_EQ(KM_ERROR_OK, devices[i]->SetHardwareDevice(hw_device));
+        } else {
+            hw_device_t* softkeymaster_device;
+            ASSERT_EQ(0, openssl_open(&softkeymaster_module.common, KEYSTORE_KEYMASTER,
+                                      &softkeymaster_device));
+            keymaster0_device_t* hw_device =
+                reinterpret_cast<keymaster0_device_t*>(softkeymaster_device);
+            hw_device->flags &= ~KEYMASTER_SOFTWARE_ONLY;
+            ASSERT_EQ(KM_ERROR_OK, devices[i]->SetHardwareDevice(hw_device));
+        }
+        keymaster1_device_t* km1_device = devices[i]->keymaster_device();
+        ASSERT_EQ(KM_ERROR_OK,
+                  km1_device->generate_key(km1_device, &key_params, &blobs[i], nullptr));
+    }
+
+    // Two threads per device sign with its one key at the same time, so the engine callbacks run
+    // concurrently on each engine and on the same key.
+    const size_t kThreadsPerDevice = 2;
+    const size_t kRounds = 20;
+    std::atomic<size_t> failures(0);
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < kDeviceCount * kThreadsPerDevice; ++t) {
+        threads.push_back(std::thread([&, t] {
+            size_t i = t % kDeviceCount;
+            string message(32, 'a' + t);
+            for (size_t round = 0; round < kRounds; ++round) {
+                if (!SignAndVerifyWithKeymaster1(devices[i]->keymaster_device(), blobs[i],
+                                                 message))
+                    ++failures;
+            }
+        }));
+    }
+    for (auto& thread : threads)
+        thread.join();
+    EXPECT_EQ(0U, failures.load());
+
+    for (size_t i = 0; i < kDeviceCount; ++i) {
+        free(const_cast<uint8_t*>(blobs[i].key_material));
+        devices[i]->keymaster_device()->common.close(devices[i]->hw_device());
+    }
+}
+
+TEST(SoftKeymasterDeviceTest, PackedParamSets) {
+    SoftKeymasterDevice* device(new SoftKeymasterDevice(new TestKeymasterContext));
+    device->set_packed_param_sets(true);
+    keymaster2_device_t* km2_device = device->keymaster2_device();
+    AuthorizationSet version_info(AuthorizationSetBuilder()
+                                      .Authorization(TAG_OS_VERSION, kOsVersion)
+                                      .Authorization(TAG_OS_PATCHLEVEL, kOsPatchLevel));
+    ASSERT_EQ(KM_ERROR_OK, km2_device->configure(km2_device, &version_info));
+
+    AuthorizationSet key_params(AuthorizationSetBuilder()
+                                    .AesEncryptionKey(128)
+                                    .Authorization(TAG_BLOCK_MODE, KM_MODE_GCM)
+                                    .Padding(KM_PAD_NONE)
+                                    .Authorization(TAG_MIN_MAC_LENGTH, 128)
+                                    .Authorization(TAG_APPLICATION_DATA, "data", 4)
+                                    .Authorization(TAG_NO_AUTH_REQUIRED));
+    keymaster_key_blob_t blob;
+    keymaster_key_characteristics_t characteristics;
+    ASSERT_EQ(KM_ERROR_OK,
+              km2_device->generate_key(km2_device, &key_params, &blob, &characteristics));
+    EXPECT_TRUE(AuthorizationSet(characteristics.sw_enforced).Contains(TAG_ALGORITHM,
+                                                                       KM_ALGORITHM_AES));
+    free(characteristics.hw_enforced.params);
+    free(characteristics.sw_enforced.params);
+
+    // The nonce begin returns lives in the same allocation as the params array.
+    AuthorizationSet begin_params(AuthorizationSetBuilder()
+                                      .Authorization(TAG_BLOCK_MODE, KM_MODE_GCM)
+                                      .Padding(KM_PAD_NONE)
+                                      .Authorization(TAG_MAC_LENGTH, 128)
+                                      .Authorization(TAG_APPLICATION_DATA, "data", 4));
+    keymaster_key_param_set_t out_params;
+    keymaster_operation_handle_t op_handle;
+    ASSERT_EQ(KM_ERROR_OK, km2_device->begin(km2_device, KM_PURPOSE_ENCRYPT, &blob, &begin_params,
+                                             &out_params, &op_handle));
+    ASSERT_EQ(1U, out_params.length);
+    EXPECT_EQ(KM_TAG_NONCE, out_params.params[0].tag);
+    EXPECT_EQ(reinterpret_cast<const uint8_t*>(out_params.params + 1),
+              out_params.params[0].blob.data);
+    free(out_params.params);
+    EXPECT_EQ(KM_ERROR_OK, km2_device->abort(km2_device, op_handle));
+
+    free(const_cast<uint8_t*>(blob.key_material));
+    km2_device->common.close(device->hw_device());
+}
+
+TEST(SoftKeymasterDeviceTest, Keymaster2FinishWithInput) {
+    SoftKeymasterDevice* device(new SoftKeymasterDevice(new TestKeymasterContext));
+    keymaster2_device_t* km2_device = device->keymaster2_device();
+    AuthorizationSet version_info(AuthorizationSetBuilder()
+                                      .Authorization(TAG_OS_VERSION, kOsVersion)
+                                      .Authorization(TAG_OS_PATCHLEVEL, kOsPatchLevel));
+    ASSERT_EQ(KM_ERROR_OK, km2_device->configure(km2_device, &version_info));
+
+    AuthorizationSet key_params(AuthorizationSetBuilder()
+                                    .AesEncryptionKey(128)
+                                    .Authorization(TAG_BLOCK_MODE, KM_MODE_ECB)
+                                    .Padding(KM_PAD_PKCS7)
+                                    .Authorization(TAG_NO_AUTH_REQUIRED));
+    keymaster_key_blob_t blob;
+    ASSERT_EQ(KM_ERROR_OK, km2_device->generate_key(km2_device, &key_params, &blob, nullptr));
+
+    // Without a wrapped keymaster1 device, finish takes the last of the input itself.
+    AuthorizationSet begin_params(AuthorizationSetBuilder()
+                                      .Authorization(TAG_BLOCK_MODE, KM_MODE_ECB)
+                                      .Padding(KM_PAD_PKCS7));
+    string message = "Hello World!";
+    keymaster_blob_t ciphertext;
+    keymaster_operation_handle_t op_handle;
+    ASSERT_EQ(KM_ERROR_OK, km2_device->begin(km2_device, KM_PURPOSE_ENCRYPT, &blob, &begin_params,
+                                             nullptr, &op_handle));
+    keymaster_blob_t input = {reinterpret_cast<const uint8_t*>(message.data()), message.size()};
+    ASSERT_EQ(KM_ERROR_OK, km2_device->finish(km2_device, op_handle, &begin_params, &input,
+                                              nullptr, nullptr, &ciphertext));
+    EXPECT_EQ(16U, ciphertext.data_length);
+
+    keymaster_blob_t plaintext;
+    ASSERT_EQ(KM_ERROR_OK, km2_device->begin(km2_device, KM_PURPOSE_DECRYPT, &blob, &begin_params,
+                                             nullptr, &op_handle));
+    ASSERT_EQ(KM_ERROR_OK, km2_device->finish(km2_device, op_handle, &begin_params, &ciphertext,
+                                              nullptr, nullptr, &plaintext));
+    EXPECT_EQ(message, string(reinterpret_cast<const char*>(plaintext.data),
+                              plaintext.data_length));
+    free(const_cast<uint8_t*>(ciphertext.data));
+    free(const_cast<uint8_t*>(plaintext.data));
+
+    free(const_cast<uint8_t*>(blob.key_material));
+    km2_device->common.close(device->hw_device());
+}
+
+static string BufferString(const Buffer& buffer) {
+    return string(reinterpret_cast<const char*>(buffer.peek_read()), buffer.available_read());
+}
+
+static void GenerateOneShotKey(AndroidKeymaster* keymaster, AuthorizationSetBuilder description,
+                               GenerateKeyResponse* response) {
+    GenerateKeyRequest request;
+    request.key_description.Reinitialize(AuthorizationSet(description));
+    keymaster->GenerateKey(request, response);
+    ASSERT_EQ(KM_ERROR_OK, response->error);
+}
+
+TEST(AndroidKeymasterOneShotTest, HmacSignAndVerify) {
+    AndroidKeymaster keymaster(new TestKeymasterContext, 16);
+    GenerateKeyResponse key;
+    GenerateOneShotKey(&keymaster, AuthorizationSetBuilder()
+                                       .HmacKey(128)
+                                       .Digest(KM_DIGEST_SHA_2_256)
+                                       .Authorization(TAG_MIN_MAC_LENGTH, 128)
+                                       .Authorization(TAG_NO_AUTH_REQUIRED),
+                       &key);
+
+    OneShotOperationRequest sign_request;
+    sign_request.purpose = KM_PURPOSE_SIGN;
+    sign_request.SetKeyMaterial(key.key_blob);
+    AuthorizationSet sign_params(
+        AuthorizationSetBuilder().Digest(KM_DIGEST_SHA_2_256).Authorization(TAG_MAC_LENGTH, 256));
+    sign_request.additional_params.Reinitialize(sign_params);
+    sign_request.input.Reinitialize("hello", 5);
+    OneShotOperationResponse sign_response;
+    keymaster.OneShotOperation(sign_request, &sign_response);
+    ASSERT_EQ(KM_ERROR_OK, sign_response.error);
+    EXPECT_EQ(32U, sign_response.output.available_read());
+
+    // The same operation through Begin/Update/Finish gives the same MAC.
+    BeginOperationRequest begin_request;
+    begin_request.purpose = KM_PURPOSE_SIGN;
+    begin_request.SetKeyMaterial(key.key_blob);
+    begin_request.additional_params.Reinitialize(sign_request.additional_params);
+    BeginOperationResponse begin_response;
+    keymaster.BeginOperation(begin_request, &begin_response);
+    ASSERT_EQ(KM_ERROR_OK, begin_response.error);
+    FinishOperationRequest finish_request;
+    finish_request.op_handle = begin_response.op_handle;
+    finish_request.input.Reinitialize("hello", 5);
+    FinishOperationResponse finish_response;
+    keymaster.FinishOperation(finish_request, &finish_response);
+    ASSERT_EQ(KM_ERROR_OK, finish_response.error);
+    ASSERT_EQ(32U, finish_response.output.available_read());
+    EXPECT_EQ(0, memcmp(finish_response.output.peek_read(), sign_response.output.peek_read(), 32));
+
+    OneShotOperationRequest verify_request;
+    verify_request.purpose = KM_PURPOSE_VERIFY;
+    verify_request.SetKeyMaterial(key.key_blob);
+    AuthorizationSet verify_params(AuthorizationSetBuilder().Digest(KM_DIGEST_SHA_2_256));
+    verify_request.additional_params.Reinitialize(verify_params);
+    verify_request.input.Reinitialize("hello", 5);
+    verify_request.signature.Reinitialize(sign_response.output);
+    OneShotOperationResponse verify_response;
+    keymaster.OneShotOperation(verify_request, &verify_response);
+    EXPECT_EQ(KM_ERROR_OK, verify_response.error);
+
+    verify_request.input.Reinitialize("hellO", 5);
+    keymaster.OneShotOperation(verify_request, &verify_response);
+    EXPECT_EQ(KM_ERROR_VERIFICATION_FAILED, verify_response.error);
+}
+
+TEST(AndroidKeymasterOneShotTest, PerOperationAuthRejected) {
+    AndroidKeymaster keymaster(new TestKeymasterContext, 16);
+    GenerateKeyResponse key;
+    GenerateOneShotKey(&keymaster, AuthorizationSetBuilder()
+                                       .HmacKey(128)
+                                       .Digest(KM_DIGEST_SHA_2_256)
+                                       .Authorization(TAG_MIN_MAC_LENGTH, 128)
+                                       .Authorization(TAG_USER_SECURE_ID, 1)
+                                       .Authorization(TAG_USER_AUTH_TYPE, HW_AUTH_PASSWORD),
+                       &key);
+
+    OneShotOperationRequest request;
+    request.purpose = KM_PURPOSE_SIGN;
+    request.SetKeyMaterial(key.key_blob);
+    AuthorizationSet sign_params(
+        AuthorizationSetBuilder().Digest(KM_DIGEST_SHA_2_256).Authorization(TAG_MAC_LENGTH, 256));
+    request.additional_params.Reinitialize(sign_params);
+    request.input.Reinitialize("hello", 5);
+    OneShotOperationResponse response;
+    keymaster.OneShotOperation(request, &response);
+    EXPECT_EQ(KM_ERROR_KEY_USER_NOT_AUTHENTICATED, response.error);
+}
+
+TEST(AndroidKeymasterOneShotTest, AesGcmEncryptMatchesStreamed) {
+    // One-shot GCM encryptions are sealed in a single call, where the key size allows it, and must
+    // match streamed encryptions under the same nonce.
+    AndroidKeymaster keymaster(new TestKeymasterContext, 16);
+    string aad = "foobar";
+    string message = "123456789012345678901234567890123456";
+    string nonce = "123456789012";
+    for (uint32_t key_size : {128, 192, 256}) {
+        for (uint32_t mac_length : {96, 128}) {
+            GenerateKeyResponse key;
+            GenerateOneShotKey(&keymaster, AuthorizationSetBuilder()
+                                               .AesEncryptionKey(key_size)
+                                               .Authorization(TAG_BLOCK_MODE, KM_MODE_GCM)
+                                               .Authorization(TAG_PADDING, KM_PAD_NONE)
+                                               .Authorization(TAG_MIN_MAC_LENGTH, 96)
+                                               .Authorization(TAG_CALLER_NONCE)
+                                               .Authorization(TAG_NO_AUTH_REQUIRED),
+                               &key);
+            AuthorizationSet params(AuthorizationSetBuilder()
+                                        .Authorization(TAG_BLOCK_MODE, KM_MODE_GCM)
+                                        .Authorization(TAG_PADDING, KM_PAD_NONE)
+                                        .Authorization(TAG_MAC_LENGTH, mac_length)
+                                        .Authorization(TAG_NONCE, nonce.data(), nonce.size())
+                                        .Authorization(TAG_ASSOCIATED_DATA, aad.data(),
+                                                       aad.size()));
+
+            OneShotOperationRequest encrypt_request;
+            encrypt_request.purpose = KM_PURPOSE_ENCRYPT;
+            encrypt_request.SetKeyMaterial(key.key_blob);
+            encrypt_request.additional_params.Reinitialize(params);
+            encrypt_request.input.Reinitialize(message.data(), message.size());
+            OneShotOperationResponse encrypt_response;
+            keymaster.OneShotOperation(encrypt_request, &encrypt_response);
+            ASSERT_EQ(KM_ERROR_OK, encrypt_response.error);
+            EXPECT_EQ(message.size() + mac_length / 8, encrypt_response.output.available_read());
+
+            BeginOperationRequest begin_request;
+            begin_request.purpose = KM_PURPOSE_ENCRYPT;
+            begin_request.SetKeyMaterial(key.key_blob);
+            begin_request.additional_params.Reinitialize(params);
+            BeginOperationResponse begin_response;
+            keymaster.BeginOperation(begin_request, &begin_response);
+            ASSERT_EQ(KM_ERROR_OK, begin_response.error);
+            UpdateOperationRequest update_request;
+            update_request.op_handle = begin_response.op_handle;
+            update_request.additional_params.push_back(TAG_ASSOCIATED_DATA, aad.data(),
+                                                       aad.size());
+            update_request.input.Reinitialize(message.data(), message.size());
+            UpdateOperationResponse update_response;
+            keymaster.UpdateOperation(update_request, &update_response);
+            ASSERT_EQ(KM_ERROR_OK, update_response.error);
+            FinishOperationRequest finish_request;
+            finish_request.op_handle = begin_response.op_handle;
+            FinishOperationResponse finish_response;
+            keymaster.FinishOperation(finish_request, &finish_response);
+            ASSERT_EQ(KM_ERROR_OK, finish_response.error);
+            EXPECT_EQ(BufferString(encrypt_response.output),
+                      BufferString(update_response.output) + BufferString(finish_response.output));
+
+            OneShotOperationRequest decrypt_request;
+            decrypt_request.purpose = KM_PURPOSE_DECRYPT;
+            decrypt_request.SetKeyMaterial(key.key_blob);
+            decrypt_request.additional_params.Reinitialize(params);
+            decrypt_request.input.Reinitialize(encrypt_response.output);
+            OneShotOperationResponse decrypt_response;
+            keymaster.OneShotOperation(decrypt_request, &decrypt_response);
+            ASSERT_EQ(KM_ERROR_OK, decrypt_response.error);
+            EXPECT_EQ(message, BufferString(decrypt_response.output));
+        }
+    }
+}
+
+static keymaster_operation_handle_t BeginGcm(AndroidKeymaster* keymaster,
+                                             const keymaster_key_blob_t& key_blob,
+                                             keymaster_purpose_t purpose, const Buffer& nonce,
+                                             Buffer* generated_nonce) {
+    BeginOperationRequest request;
+    request.purpose = purpose;
+    request.SetKeyMaterial(key_blob);
+    AuthorizationSetBuilder params;
+    params.Authorization(TAG_BLOCK_MODE, KM_MODE_GCM)
+        .Padding(KM_PAD_NONE)
+        .Authorization(TAG_MAC_LENGTH, 128);
+    if (nonce.available_read())
+        params.Authorization(TAG_NONCE, nonce.peek_read(), nonce.available_read());
+    request.additional_params.Reinitialize(AuthorizationSet(params));
+    BeginOperationResponse response;
+    keymaster->BeginOperation(request, &response);
+    EXPECT_EQ(KM_ERROR_OK, response.error);
+    keymaster_blob_t nonce_blob;
+    if (generated_nonce && response.output_params.GetTagValue(TAG_NONCE, &nonce_blob))
+        generated_nonce->Reinitialize(nonce_blob.data, nonce_blob.data_length);
+    return response.op_handle;
+}
+
+TEST(AndroidKeymasterUpdateAadTest, MatchesAssociatedDataTag) {
+    AndroidKeymaster keymaster(new TestKeymasterContext, 16);
+    GenerateKeyResponse key;
+    GenerateOneShotKey(&keymaster, AuthorizationSetBuilder()
+                                       .AesEncryptionKey(128)
+                                       .Authorization(TAG_BLOCK_MODE, KM_MODE_GCM)
+                                       .Padding(KM_PAD_NONE)
+                                       .Authorization(TAG_MIN_MAC_LENGTH, 128)
+                                       .Authorization(TAG_NO_AUTH_REQUIRED),
+                       &key);
+
+    string aad(37 * 500, 'a');
+    for (size_t i = 0; i < aad.size(); ++i)
+        aad[i] = static_cast<char>(i * 13);
+
+    // Encrypt, sending the AAD in pieces that leave blocks partly filled between calls.
+    Buffer nonce;
+    UpdateAadRequest aad_request;
+    aad_request.op_handle =
+        BeginGcm(&keymaster, key.key_blob, KM_PURPOSE_ENCRYPT, Buffer(), &nonce);
+    UpdateAadResponse aad_response;
+    for (size_t offset = 0; offset < aad.size(); offset += 37) {
+        aad_request.aad.Reinitialize(aad.data() + offset, 37);
+        keymaster.UpdateAad(aad_request, &aad_response);
+        ASSERT_EQ(KM_ERROR_OK, aad_response.error);
+    }
+    FinishOperationRequest finish_request;
+    finish_request.op_handle = aad_request.op_handle;
+    finish_request.input.Reinitialize("hello world", 11);
+    FinishOperationResponse finish_response;
+    keymaster.FinishOperation(finish_request, &finish_response);
+    ASSERT_EQ(KM_ERROR_OK, finish_response.error);
+
+    // Decrypting with the AAD in TAG_ASSOCIATED_DATA verifies the tag.
+    UpdateOperationRequest update_request;
+    update_request.op_handle =
+        BeginGcm(&keymaster, key.key_blob, KM_PURPOSE_DECRYPT, nonce, nullptr /* nonce */);
+    update_request.additional_params.Reinitialize(AuthorizationSet(
+        AuthorizationSetBuilder().Authorization(TAG_ASSOCIATED_DATA, aad.data(), aad.size())));
+    UpdateOperationResponse update_response;
+    keymaster.UpdateOperation(update_request, &update_response);
+    ASSERT_EQ(KM_ERROR_OK, update_response.error);
+    finish_request.op_handle = update_request.op_handle;
+    finish_request.input.Reinitialize(finish_response.output);
+    FinishOperationResponse decrypt_response;
+    keymaster.FinishOperation(finish_request, &decrypt_response);
+    ASSERT_EQ(KM_ERROR_OK, decrypt_response.error);
+    EXPECT_EQ(string("hello world"),
+              string(reinterpret_cast<const char*>(decrypt_response.output.peek_read()),
+                     decrypt_response.output.available_read()));
+}
+
+TEST(AndroidKeymasterUpdateAadTest, RejectsAadAfterDataAndNonAead) {
+    AndroidKeymaster keymaster(new TestKeymasterContext, 16);
+    GenerateKeyResponse key;
+    GenerateOneShotKey(&keymaster, AuthorizationSetBuilder()
+                                       .AesEncryptionKey(128)
+                                       .Authorization(TAG_BLOCK_MODE, KM_MODE_GCM)
+                                       .Padding(KM_PAD_NONE)
+                                       .Authorization(TAG_MIN_MAC_LENGTH, 128)
+                                       .Authorization(TAG_NO_AUTH_REQUIRED),
+                       &key);
+    UpdateOperationRequest update_request;
+    update_request.op_handle =
+        BeginGcm(&keymaster, key.key_blob, KM_PURPOSE_ENCRYPT, Buffer(), nullptr /* nonce */);
+    update_request.input.Reinitialize("data", 4);
+    UpdateOperationResponse update_response;
+    keymaster.UpdateOperation(update_request, &update_response);
+    ASSERT_EQ(KM_ERROR_OK, update_response.error);
+
+    UpdateAadRequest aad_request;
+    aad_request.op_handle = update_request.op_handle;
+    aad_request.aad.Reinitialize("aad", 3);
+    UpdateAadResponse aad_response;
+    keymaster.UpdateAad(aad_request, &aad_response);
+    EXPECT_EQ(KM_ERROR_INVALID_TAG, aad_response.error);
+    // The error ended the operation.
+    keymaster.UpdateOperation(update_request, &update_response);
+    EXPECT_EQ(KM_ERROR_INVALID_OPERATION_HANDLE, update_response.error);
+
+    GenerateKeyResponse hmac_key;
+    GenerateOneShotKey(&keymaster, AuthorizationSetBuilder()
+                                       .HmacKey(128)
+                                       .Digest(KM_DIGEST_SHA_2_256)
+                                       .Authorization(TAG_MIN_MAC_LENGTH, 128)
+                                       .Authorization(TAG_NO_AUTH_REQUIRED),
+                       &hmac_key);
+    BeginOperationRequest begin_request;
+    begin_request.purpose = KM_PURPOSE_SIGN;
+    begin_request.SetKeyMaterial(hmac_key.key_blob);
+    begin_request.additional_params.Reinitialize(AuthorizationSet(
+        AuthorizationSetBuilder().Digest(KM_DIGEST_SHA_2_256).Authorization(TAG_MAC_LENGTH, 256)));
+    BeginOperationResponse begin_response;
+    keymaster.BeginOperation(begin_request, &begin_response);
+    ASSERT_EQ(KM_ERROR_OK, begin_response.error);
+    aad_request.op_handle = begin_response.op_handle;
+    keymaster.UpdateAad(aad_request, &aad_response);
+    EXPECT_EQ(KM_ERROR_INVALID_TAG, aad_response.error);
+}
+
+static keymaster_operation_handle_t BeginChaCha20Poly1305(AndroidKeymaster* keymaster,
+                                                          const keymaster_key_blob_t& key_blob,
+                                                          keymaster_purpose_t purpose,
+                                                          const Buffer& nonce,
+                                                          keymaster_error_t expected_error) {
+    BeginOperationRequest request;
+    request.purpose = purpose;
+    request.SetKeyMaterial(key_blob);
+    AuthorizationSetBuilder params;
+    params.Authorization(TAG_MAC_LENGTH, 128);
+    if (nonce.available_read())
+        params.Authorization(TAG_NONCE, nonce.peek_read(), nonce.available_read());
+    request.additional_params.Reinitialize(AuthorizationSet(params));
+    BeginOperationResponse response;
+    keymaster->BeginOperation(request, &response);
+    EXPECT_EQ(expected_error, response.error);
+    return response.op_handle;
+}
+
+TEST(AndroidKeymasterChaCha20Poly1305Test, Rfc7539TestVector) {
+    // RFC 7539 section 2.8.2.
+    uint8_t key_data[32];
+    for (size_t i = 0; i < sizeof(key_data); ++i)
+        key_data[i] = 0x80 + i;
+    const uint8_t nonce_data[] = {0x07, 0x00, 0x00, 0x00, 0x40, 0x41,
+                                  0x42, 0x43, 0x44, 0x45, 0x46, 0x47};
+    const uint8_t aad[] = {0x50, 0x51, 0x52, 0x53, 0xc0, 0xc1, 0xc2, 0xc3, 0xc4, 0xc5, 0xc6, 0xc7};
+    string message = "Ladies and Gentlemen of the class of '99: If I could offer you only one tip "
+                     "for the future, sunscreen would be it.";
+    const uint8_t expected[] = {
+        0xd3, 0x1a, 0x8d, 0x34, 0x64, 0x8e, 0x60, 0xdb, 0x7b, 0x86, 0xaf, 0xbc, 0x53, 0xef, 0x7e,
+        0xc2, 0xa4, 0xad, 0xed, 0x51, 0x29, 0x6e, 0x08, 0xfe, 0xa9, 0xe2, 0xb5, 0xa7, 0x36, 0xee,
+        0x62, 0xd6, 0x3d, 0xbe, 0xa4, 0x5e, 0x8c, 0xa9, 0x67, 0x12, 0x82, 0xfa, 0xfb, 0x69, 0xda,
+        0x92, 0x72, 0x8b, 0x1a, 0x71, 0xde, 0x0a, 0x9e, 0x06, 0x0b, 0x29, 0x05, 0xd6, 0xa5, 0xb6,
+        0x7e, 0xcd, 0x3b, 0x36, 0x92, 0xdd, 0xbd, 0x7f, 0x2d, 0x77, 0x8b, 0x8c, 0x98, 0x03, 0xae,
+        0xe3, 0x28, 0x09, 0x1b, 0x58, 0xfa, 0xb3, 0x24, 0xe4, 0xfa, 0xd6, 0x75, 0x94, 0x55, 0x85,
+        0x80, 0x8b, 0x48, 0x31, 0xd7, 0xbc, 0x3f, 0xf4, 0xde, 0xf0, 0x8e, 0x4b, 0x7a, 0x9d, 0xe5,
+        0x76, 0xd2, 0x65, 0x86, 0xce, 0xc6, 0x4b, 0x61, 0x16,
+        // Tag
+        0x1a, 0xe1, 0x0b, 0x59, 0x4f, 0x09, 0xe2, 0x6a, 0x7e, 0x90, 0x2e, 0xcb, 0xd0, 0x60, 0x06,
+        0x91,
+    };
+
+    AndroidKeymaster keymaster(new TestKeymasterContext, 16);
+    ImportKeyRequest import_request;
+    import_request.key_description.Reinitialize(
+        AuthorizationSet(AuthorizationSetBuilder()
+                             .ChaCha20Poly1305Key()
+                             .Authorization(TAG_CALLER_NONCE)
+                             .Authorization(TAG_NO_AUTH_REQUIRED)));
+    import_request.key_format = KM_KEY_FORMAT_RAW;
+    import_request.SetKeyMaterial(key_data, sizeof(key_data));
+    ImportKeyResponse key;
+    keymaster.ImportKey(import_request, &key);
+    ASSERT_EQ(KM_ERROR_OK, key.error);
+    Buffer nonce(nonce_data, sizeof(nonce_data));
+
+    // Encrypt, with the AAD from UpdateAad and the data split across a keystream block.
+    UpdateAadRequest aad_request;
+    aad_request.op_handle =
+        BeginChaCha20Poly1305(&keymaster, key.key_blob, KM_PURPOSE_ENCRYPT, nonce, KM_ERROR_OK);
+    aad_request.aad.Reinitialize(aad, sizeof(aad));
+    UpdateAadResponse aad_response;
+    keymaster.UpdateAad(aad_request, &aad_response);
+    ASSERT_EQ(KM_ERROR_OK, aad_response.error);
+    UpdateOperationRequest update_request;
+    update_request.op_handle = aad_request.op_handle;
+    update_request.input.Reinitialize(message.data(), 50);
+    UpdateOperationResponse update_response;
+    keymaster.UpdateOperation(update_request, &update_response);
+    ASSERT_EQ(KM_ERROR_OK, update_response.error);
+    FinishOperationRequest finish_request;
+    finish_request.op_handle = update_request.op_handle;
+    finish_request.input.Reinitialize(message.data() + 50, message.size() - 50);
+    FinishOperationResponse finish_response;
+    keymaster.FinishOperation(finish_request, &finish_response);
+    ASSERT_EQ(KM_ERROR_OK, finish_response.error);
+    string ciphertext = BufferString(update_response.output) + BufferString(finish_response.output);
+    EXPECT_EQ(make_string(expected), ciphertext);
+
+    // Decrypt in chunks that split the tag, with the AAD in TAG_ASSOCIATED_DATA.
+    update_request.op_handle =
+        BeginChaCha20Poly1305(&keymaster, key.key_blob, KM_PURPOSE_DECRYPT, nonce, KM_ERROR_OK);
+    update_request.additional_params.Reinitialize(AuthorizationSet(
+        AuthorizationSetBuilder().Authorization(TAG_ASSOCIATED_DATA, aad, sizeof(aad))));
+    string plaintext;
+    size_t chunks[] = {1, 7, 64, 45};
+    size_t offset = 0;
+    for (size_t chunk : chunks) {
+        update_request.input.Reinitialize(ciphertext.data() + offset, chunk);
+        UpdateOperationResponse decrypt_update_response;
+        keymaster.UpdateOperation(update_request, &decrypt_update_response);
+        ASSERT_EQ(KM_ERROR_OK, decrypt_update_response.error);
+        plaintext += BufferString(decrypt_update_response.output);
+        update_request.additional_params.Clear();
+        offset += chunk;
+    }
+    finish_request.op_handle = update_request.op_handle;
+    finish_request.input.Reinitialize(ciphertext.data() + offset, ciphertext.size() - offset);
+    FinishOperationResponse decrypt_response;
+    keymaster.FinishOperation(finish_request, &decrypt_response);
+    ASSERT_EQ(KM_ERROR_OK, decrypt_response.error);
+    plaintext += BufferString(decrypt_response.output);
+    EXPECT_EQ(message, plaintext);
+}
+
+TEST(AndroidKeymasterChaCha20Poly1305Test, Errors) {
+    AndroidKeymaster keymaster(new TestKeymasterContext, 16);
+    GenerateKeyResponse key;
+    GenerateOneShotKey(&keymaster, AuthorizationSetBuilder().ChaCha20Poly1305Key().Authorization(
+                                       TAG_NO_AUTH_REQUIRED),
+                       &key);
+
+    // Without TAG_CALLER_NONCE the key picks its own nonces.
+    Buffer nonce(string(12, 'n').data(), 12);
+    BeginChaCha20Poly1305(&keymaster, key.key_blob, KM_PURPOSE_ENCRYPT, nonce,
+                          KM_ERROR_CALLER_NONCE_PROHIBITED);
+
+    BeginOperationRequest begin_request;
+    begin_request.purpose = KM_PURPOSE_ENCRYPT;
+    begin_request.SetKeyMaterial(key.key_blob);
+    begin_request.additional_params.Reinitialize(
+        AuthorizationSet(AuthorizationSetBuilder().Authorization(TAG_MAC_LENGTH, 96)));
+    BeginOperationResponse begin_response;
+    keymaster.BeginOperation(begin_request, &begin_response);
+    EXPECT_EQ(KM_ERROR_UNSUPPORTED_MAC_LENGTH, begin_response.error);
+    begin_request.additional_params.Clear();
+    keymaster.BeginOperation(begin_request, &begin_response);
+    ASSERT_EQ(KM_ERROR_OK, begin_response.error);
+    keymaster_blob_t nonce_blob;
+    ASSERT_TRUE(begin_response.output_params.GetTagValue(TAG_NONCE, &nonce_blob));
+    EXPECT_EQ(12U, nonce_blob.data_length);
+
+    // AAD can't follow data.
+    UpdateOperationRequest update_request;
+    update_request.op_handle = begin_response.op_handle;
+    update_request.input.Reinitialize("data", 4);
+    UpdateOperationResponse update_response;
+    keymaster.UpdateOperation(update_request, &update_response);
+    ASSERT_EQ(KM_ERROR_OK, update_response.error);
+    update_request.additional_params.Reinitialize(
+        AuthorizationSet(AuthorizationSetBuilder().Authorization(TAG_ASSOCIATED_DATA, "aad", 3)));
+    update_request.input.Clear();
+    keymaster.UpdateOperation(update_request, &update_response);
+    EXPECT_EQ(KM_ERROR_INVALID_TAG, update_response.error);
+
+    keymaster.BeginOperation(begin_request, &begin_response);
+    ASSERT_EQ(KM_ERROR_OK, begin_response.error);
+    ASSERT_TRUE(begin_response.output_params.GetTagValue(TAG_NONCE, &nonce_blob));
+    nonce.Reinitialize(nonce_blob.data, nonce_blob.data_length);
+    FinishOperationRequest finish_request;
+    finish_request.op_handle = begin_response.op_handle;
+    finish_request.input.Reinitialize("hello world", 11);
+    FinishOperationResponse finish_response;
+    keymaster.FinishOperation(finish_request, &finish_response);
+    ASSERT_EQ(KM_ERROR_OK, finish_response.error);
+    EXPECT_EQ(11U + 16, finish_response.output.available_read());
+
+    // A corrupted tag fails verification, as does input too short to hold a tag.
+    string ciphertext = BufferString(finish_response.output);
+    (*ciphertext.rbegin())++;
+    finish_request.op_handle =
+        BeginChaCha20Poly1305(&keymaster, key.key_blob, KM_PURPOSE_DECRYPT, nonce, KM_ERROR_OK);
+    finish_request.input.Reinitialize(ciphertext.data(), ciphertext.size());
+    FinishOperationResponse decrypt_response;
+    keymaster.FinishOperation(finish_request, &decrypt_response);
+    EXPECT_EQ(KM_ERROR_VERIFICATION_FAILED, decrypt_response.error);
+    finish_request.op_handle =
+        BeginChaCha20Poly1305(&keymaster, key.key_blob, KM_PURPOSE_DECRYPT, nonce, KM_ERROR_OK);
+    finish_request.input.Reinitialize(ciphertext.data(), 15);
+    FinishOperationResponse short_response;
+    keymaster.FinishOperation(finish_request, &short_response);
+    EXPECT_EQ(KM_ERROR_INVALID_INPUT_LENGTH, short_response.error);
+}
+
+static keymaster_error_t RunEd25519Operation(AndroidKeymaster* keymaster,
+                                             const keymaster_key_blob_t& key_blob,
+                                             keymaster_purpose_t purpose, const string& message,
+                                             const string& signature, string* output) {
+    BeginOperationRequest begin_request;
+    begin_request.purpose = purpose;
+    begin_request.SetKeyMaterial(key_blob);
+    begin_request.additional_params.Reinitialize(
+        AuthorizationSet(AuthorizationSetBuilder().Digest(KM_DIGEST_NONE)));
+    BeginOperationResponse begin_response;
+    keymaster->BeginOperation(begin_request, &begin_response);
+    if (begin_response.error != KM_ERROR_OK)
+        return begin_response.error;
+
+    // Send all but the last byte as an update, so Finish has to join the message up.
+    UpdateOperationRequest update_request;
+    update_request.op_handle = begin_response.op_handle;
+    size_t update_length = message.empty() ? 0 : message.size() - 1;
+    update_request.input.Reinitialize(message.data(), update_length);
+    UpdateOperationResponse update_response;
+    keymaster->UpdateOperation(update_request, &update_response);
+    if (update_response.error != KM_ERROR_OK)
+        return update_response.error;
+
+    FinishOperationRequest finish_request;
+    finish_request.op_handle = begin_response.op_handle;
+    finish_request.input.Reinitialize(message.data() + update_length,
+                                      message.size() - update_length);
+    finish_request.signature.Reinitialize(signature.data(), signature.size());
+    FinishOperationResponse finish_response;
+    keymaster->FinishOperation(finish_request, &finish_response);
+    if (output)
+        *output = BufferString(finish_response.output);
+    return finish_response.error;
+}
+
+TEST(AndroidKeymasterEd25519Test, Rfc8032TestVector) {
+    // RFC 8032 section 7.1, test 2.  BoringSSL's private keys are the seed and then the public key.
+    const uint8_t private_key[] = {
+        0x4c, 0xcd, 0x08, 0x9b, 0x28, 0xff, 0x96, 0xda, 0x9d, 0xb6, 0xc3, 0x46, 0xec,
+        0x11, 0x4e, 0x0f, 0x5b, 0x8a, 0x31, 0x9f, 0x35, 0xab, 0xa6, 0x24, 0xda, 0x8c,
+        0xf6, 0xed, 0x4f, 0xb8, 0xa6, 0xfb, 0x3d, 0x40, 0x17, 0xc3, 0xe8, 0x43, 0x89,
+        0x5a, 0x92, 0xb7, 0x0a, 0xa7, 0x4d, 0x1b, 0x7e, 0xbc, 0x9c, 0x98, 0x2c, 0xcf,
+        0x2e, 0xc4, 0x96, 0x8c, 0xc0, 0xcd, 0x55, 0xf1, 0x2a, 0xf4, 0x66, 0x0c,
+    };
+    const uint8_t expected_signature[] = {
+        0x92, 0xa0, 0x09, 0xa9, 0xf0, 0xd4, 0xca, 0xb8, 0x72, 0x0e, 0x82, 0x0b, 0x5f,
+        0x64, 0x25, 0x40, 0xa2, 0xb2, 0x7b, 0x54, 0x16, 0x50, 0x3f, 0x8f, 0xb3, 0x76,
+        0x22, 0x23, 0xeb, 0xdb, 0x69, 0xda, 0x08, 0x5a, 0xc1, 0xe4, 0x3e, 0x15, 0x99,
+        0x6e, 0x45, 0x8f, 0x36, 0x13, 0xd0, 0xf1, 0x1d, 0x8c, 0x38, 0x7b, 0x2e, 0xae,
+        0xb4, 0x30, 0x2a, 0xee, 0xb0, 0x0d, 0x29, 0x16, 0x12, 0xbb, 0x0c, 0x00,
+    };
+
+    AndroidKeymaster keymaster(new TestKeymasterContext, 16);
+    ImportKeyRequest import_request;
+    import_request.key_description.Reinitialize(AuthorizationSet(
+        AuthorizationSetBuilder().Ed25519SigningKey().Authorization(TAG_NO_AUTH_REQUIRED)));
+    import_request.key_format = KM_KEY_FORMAT_RAW;
+    import_request.SetKeyMaterial(private_key, sizeof(private_key));
+    ImportKeyResponse key;
+    keymaster.ImportKey(import_request, &key);
+    ASSERT_EQ(KM_ERROR_OK, key.error);
+
+    string signature;
+    EXPECT_EQ(KM_ERROR_OK,
+              RunEd25519Operation(&keymaster, key.key_blob, KM_PURPOSE_SIGN, "\x72",
+                                  "" /* signature */, &signature));
+    EXPECT_EQ(make_string(expected_signature), signature);
+    EXPECT_EQ(KM_ERROR_OK,
+              RunEd25519Operation(&keymaster, key.key_blob, KM_PURPOSE_VERIFY, "\x72",
+                                  signature, nullptr /* output */));
+
+    // The exported public key is an RFC 8410 SubjectPublicKeyInfo.
+    ExportKeyRequest export_request;
+    export_request.SetKeyMaterial(key.key_blob);
+    export_request.key_format = KM_KEY_FORMAT_X509;
+    ExportKeyResponse export_response;
+    keymaster.ExportKey(export_request, &export_response);
+    ASSERT_EQ(KM_ERROR_OK, export_response.error);
+    const uint8_t spki_prefix[] = {0x30, 0x2a, 0x30, 0x05, 0x06, 0x03,
+                                   0x2b, 0x65, 0x70, 0x03, 0x21, 0x00};
+    string public_key(reinterpret_cast<const char*>(private_key) + 32, 32);
+    EXPECT_EQ(make_string(spki_prefix) + public_key,
+              string(reinterpret_cast<const char*>(export_response.key_data),
+                     export_response.key_data_length));
+
+    // A private key whose halves don't match is refused.
+    uint8_t mismatched_key[sizeof(private_key)];
+    memcpy(mismatched_key, private_key, sizeof(private_key));
+    mismatched_key[sizeof(mismatched_key) - 1] ^= 1;
+    import_request.SetKeyMaterial(mismatched_key, sizeof(mismatched_key));
+    ImportKeyResponse mismatched;
+    keymaster.ImportKey(import_request, &mismatched);
+    EXPECT_EQ(KM_ERROR_INVALID_KEY_BLOB, mismatched.error);
+}
+
+TEST(AndroidKeymasterEd25519Test, SignAndVerify) {
+    AndroidKeymaster keymaster(new TestKeymasterContext, 16);
+    GenerateKeyResponse key;
+    GenerateOneShotKey(&keymaster, AuthorizationSetBuilder().Ed25519SigningKey().Authorization(
+                                       TAG_NO_AUTH_REQUIRED),
+                       &key);
+
+    string message = PatternMessage(1000);
+    string signature;
+    ASSERT_EQ(KM_ERROR_OK,
+              RunEd25519Operation(&keymaster, key.key_blob, KM_PURPOSE_SIGN, message,
+                                  "" /* signature */, &signature));
+    EXPECT_EQ(64U, signature.size());
+    EXPECT_EQ(KM_ERROR_OK,
+              RunEd25519Operation(&keymaster, key.key_blob, KM_PURPOSE_VERIFY, message,
+                                  signature, nullptr /* output */));
+
+    // Ed25519 signatures are deterministic.
+    string second_signature;
+    ASSERT_EQ(KM_ERROR_OK,
+              RunEd25519Operation(&keymaster, key.key_blob, KM_PURPOSE_SIGN, message,
+                                  "" /* signature */, &second_signature));
+    EXPECT_EQ(signature, second_signature);
+
+    string corrupt_signature = signature;
+    corrupt_signature[10] ^= 1;
+    EXPECT_EQ(KM_ERROR_VERIFICATION_FAILED,
+              RunEd25519Operation(&keymaster, key.key_blob, KM_PURPOSE_VERIFY, message,
+                                  corrupt_signature, nullptr /* output */));
+    EXPECT_EQ(KM_ERROR_VERIFICATION_FAILED,
+              RunEd25519Operation(&keymaster, key.key_blob, KM_PURPOSE_VERIFY, message,
+                                  signature.substr(0, 63), nullptr /* output */));
+    EXPECT_EQ(KM_ERROR_VERIFICATION_FAILED,
+              RunEd25519Operation(&keymaster, key.key_blob, KM_PURPOSE_VERIFY, message + "x",
+                                  signature, nullptr /* output */));
+
+    // Ed25519 does its own hashing.
+    BeginOperationRequest begin_request;
+    begin_request.purpose = KM_PURPOSE_SIGN;
+    begin_request.SetKeyMaterial(key.key_blob);
+    begin_request.additional_params.Reinitialize(
+        AuthorizationSet(AuthorizationSetBuilder().Digest(KM_DIGEST_SHA_2_256)));
+    BeginOperationResponse begin_response;
+    keymaster.BeginOperation(begin_request, &begin_response);
+    EXPECT_EQ(KM_ERROR_UNSUPPORTED_DIGEST, begin_response.error);
+
+    GenerateKeyRequest generate_request;
+    generate_request.key_description.Reinitialize(
+        AuthorizationSet(AuthorizationSetBuilder()
+                             .Authorization(TAG_ALGORITHM, KM_ALGORITHM_ED25519)
+                             .Authorization(TAG_KEY_SIZE, 255)
+                             .SigningKey()));
+    GenerateKeyResponse bad_size;
+    keymaster.GenerateKey(generate_request, &bad_size);
+    EXPECT_EQ(KM_ERROR_UNSUPPORTED_KEY_SIZE, bad_size.error);
+}
+
+TEST(AndroidKeymasterBatchTest, HmacSignAndVerify) {
+    AndroidKeymaster keymaster(new TestKeymasterContext, 16);
+    GenerateKeyResponse key;
+    GenerateOneShotKey(&keymaster, AuthorizationSetBuilder()
+                                       .HmacKey(128)
+                                       .Digest(KM_DIGEST_SHA_2_256)
+                                       .Authorization(TAG_MIN_MAC_LENGTH, 128)
+                                       .Authorization(TAG_NO_AUTH_REQUIRED),
+                       &key);
+
+    const char* messages[] = {"one", "two", "three"};
+    BatchOperationRequest sign_request;
+    sign_request.purpose = KM_PURPOSE_SIGN;
+    sign_request.SetKeyMaterial(key.key_blob);
+    AuthorizationSet sign_params(
+        AuthorizationSetBuilder().Digest(KM_DIGEST_SHA_2_256).Authorization(TAG_MAC_LENGTH, 256));
+    sign_request.additional_params.Reinitialize(sign_params);
+    ASSERT_TRUE(sign_request.SetItemCount(array_length(messages)));
+    for (size_t i = 0; i < array_length(messages); ++i)
+        sign_request.items[i].input.Reinitialize(messages[i], strlen(messages[i]));
+    BatchOperationResponse sign_response;
+    keymaster.BatchOperation(sign_request, &sign_response);
+    ASSERT_EQ(KM_ERROR_OK, sign_response.error);
+    ASSERT_EQ(array_length(messages), sign_response.item_count);
+
+    BatchOperationRequest verify_request;
+    verify_request.purpose = KM_PURPOSE_VERIFY;
+    verify_request.SetKeyMaterial(key.key_blob);
+    AuthorizationSet verify_params(AuthorizationSetBuilder().Digest(KM_DIGEST_SHA_2_256));
+    verify_request.additional_params.Reinitialize(verify_params);
+    ASSERT_TRUE(verify_request.SetItemCount(array_length(messages)));
+    for (size_t i = 0; i < array_length(messages); ++i) {
+        EXPECT_EQ(KM_ERROR_OK, sign_response.items[i].error);
+        EXPECT_EQ(32U, sign_response.items[i].output.available_read());
+        verify_request.items[i].input.Reinitialize(messages[i], strlen(messages[i]));
+        verify_request.items[i].signature.Reinitialize(sign_response.items[i].output);
+    }
+    // Each item succeeds or fails by itself.
+    verify_request.items[1].signature.Reinitialize(sign_response.items[0].output);
+    BatchOperationResponse verify_response;
+    keymaster.BatchOperation(verify_request, &verify_response);
+    ASSERT_EQ(KM_ERROR_OK, verify_response.error);
+    ASSERT_EQ(array_length(messages), verify_response.item_count);
+    EXPECT_EQ(KM_ERROR_OK, verify_response.items[0].error);
+    EXPECT_EQ(KM_ERROR_VERIFICATION_FAILED, verify_response.items[1].error);
+    EXPECT_EQ(KM_ERROR_OK, verify_response.items[2].error);
+}
+
+TEST(AndroidKeymasterBatchTest, EcdsaVerify) {
+    AndroidKeymaster keymaster(new TestKeymasterContext, 16);
+    GenerateKeyResponse key;
+    GenerateOneShotKey(&keymaster, AuthorizationSetBuilder()
+                                       .EcdsaSigningKey(256)
+                                       .Digest(KM_DIGEST_NONE)
+                                       .Authorization(TAG_NO_AUTH_REQUIRED),
+                       &key);
+
+    const char* messages[] = {"one", "two", "three", "four"};
+    AuthorizationSet params(AuthorizationSetBuilder().Digest(KM_DIGEST_NONE));
+    BatchOperationRequest sign_request;
+    sign_request.purpose = KM_PURPOSE_SIGN;
+    sign_request.SetKeyMaterial(key.key_blob);
+    sign_request.additional_params.Reinitialize(params);
+    ASSERT_TRUE(sign_request.SetItemCount(array_length(messages)));
+    for (size_t i = 0; i < array_length(messages); ++i)
+        sign_request.items[i].input.Reinitialize(messages[i], strlen(messages[i]));
+    BatchOperationResponse sign_response;
+    keymaster.BatchOperation(sign_request, &sign_response);
+    ASSERT_EQ(KM_ERROR_OK, sign_response.error);
+    ASSERT_EQ(array_length(messages), sign_response.item_count);
+
+    // Every item verifies against the same cached verification key, but succeeds or fails by
+    // itself.
+    BatchOperationRequest verify_request;
+    verify_request.purpose = KM_PURPOSE_VERIFY;
+    verify_request.SetKeyMaterial(key.key_blob);
+    verify_request.additional_params.Reinitialize(params);
+    ASSERT_TRUE(verify_request.SetItemCount(array_length(messages)));
+    for (size_t i = 0; i < array_length(messages); ++i) {
+        EXPECT_EQ(KM_ERROR_OK, sign_response.items[i].error);
+        verify_request.items[i].input.Reinitialize(messages[i], strlen(messages[i]));
+        verify_request.items[i].signature.Reinitialize(sign_response.items[i].output);
+    }
+    verify_request.items[2].signature.Reinitialize(sign_response.items[3].output);
+    BatchOperationResponse verify_response;
+    keymaster.BatchOperation(verify_request, &verify_response);
+    ASSERT_EQ(KM_ERROR_OK, verify_response.error);
+    ASSERT_EQ(array_length(messages), verify_response.item_count);
+    EXPECT_EQ(KM_ERROR_OK, verify_response.items[0].error);
+    EXPECT_EQ(KM_ERROR_OK, verify_response.items[1].error);
+    EXPECT_EQ(KM_ERROR_VERIFICATION_FAILED, verify_response.items[2].error);
+    EXPECT_EQ(KM_ERROR_OK, verify_response.items[3].error);
+}
+
+TEST(AndroidKeymasterBatchTest, HmacBatchMatchesOneShot) {
+    AndroidKeymaster keymaster(new TestKeymasterContext, 16);
+    GenerateKeyResponse key;
+    GenerateOneShotKey(&keymaster, AuthorizationSetBuilder()
+                                       .HmacKey(128)
+                                       .Digest(KM_DIGEST_SHA_2_256)
+                                       .Authorization(TAG_MIN_MAC_LENGTH, 128)
+                                       .Authorization(TAG_NO_AUTH_REQUIRED),
+                       &key);
+
+    // More messages than fit in one group of SIMD lanes, of assorted lengths.
+    string messages[6];
+    for (size_t i = 0; i < array_length(messages); ++i)
+        messages[i] = string(i * 37, static_cast<char>('a' + i));
+
+    BatchOperationRequest batch_request;
+    batch_request.purpose = KM_PURPOSE_SIGN;
+    batch_request.SetKeyMaterial(key.key_blob);
+    AuthorizationSet sign_params(
+        AuthorizationSetBuilder().Digest(KM_DIGEST_SHA_2_256).Authorization(TAG_MAC_LENGTH, 128));
+    batch_request.additional_params.Reinitialize(sign_params);
+    ASSERT_TRUE(batch_request.SetItemCount(array_length(messages)));
+    for (size_t i = 0; i < array_length(messages); ++i)
+        batch_request.items[i].input.Reinitialize(messages[i].data(), messages[i].size());
+    BatchOperationResponse batch_response;
+    keymaster.BatchOperation(batch_request, &batch_response);
+    ASSERT_EQ(KM_ERROR_OK, batch_response.error);
+    ASSERT_EQ(array_length(messages), batch_response.item_count);
+
+    for (size_t i = 0; i < array_length(messages); ++i) {
+        OneShotOperationRequest request;
+        request.purpose = KM_PURPOSE_SIGN;
+        request.SetKeyMaterial(key.key_blob);
+        request.additional_params.Reinitialize(sign_params);
+        request.input.Reinitialize(messages[i].data(), messages[i].size());
+        OneShotOperationResponse response;
+        keymaster.OneShotOperation(request, &response);
+        ASSERT_EQ(KM_ERROR_OK, response.error);
+
+        EXPECT_EQ(KM_ERROR_OK, batch_response.items[i].error);
+        ASSERT_EQ(16U, batch_response.items[i].output.available_read());
+        EXPECT_EQ(0, memcmp(response.output.peek_read(), batch_response.items[i].output.peek_read(),
+                            16))
+            << "message " << i;
+    }
+}
+
+TEST(AndroidKeymasterBatchTest, UnauthorizedBatchFails) {
+    AndroidKeymaster keymaster(new TestKeymasterContext, 16);
+    GenerateKeyResponse key;
+    GenerateOneShotKey(&keymaster, AuthorizationSetBuilder()
+                                       .HmacKey(128)
+                                       .Digest(KM_DIGEST_SHA_2_256)
+                                       .Authorization(TAG_MIN_MAC_LENGTH, 128)
+                                       .Authorization(TAG_NO_AUTH_REQUIRED),
+                       &key);
+
+    BatchOperationRequest request;
+    request.purpose = KM_PURPOSE_ENCRYPT;
+    request.SetKeyMaterial(key.key_blob);
+    ASSERT_TRUE(request.SetItemCount(2));
+    BatchOperationResponse response;
+    keymaster.BatchOperation(request, &response);
+    EXPECT_EQ(KM_ERROR_UNSUPPORTED_PURPOSE, response.error);
+    EXPECT_EQ(0U, response.item_count);
+}
+
+static const GetStatisticsResponse::Histogram* FindHistogram(const GetStatisticsResponse& response,
+                                                            AndroidKeymasterCommand command,
+                                                            uint32_t algorithm, uint32_t purpose) {
+    for (size_t i = 0; i < response.histogram_count; ++i) {
+        const GetStatisticsResponse::Histogram& histogram = response.histograms[i];
+        if (histogram.command == static_cast<uint32_t>(command) &&
+            histogram.algorithm == algorithm && histogram.purpose == purpose)
+            return &histogram;
+    }
+    return nullptr;
+}
+
+static keymaster_error_t BeginHmacSign(AndroidKeymaster* keymaster,
+                                       const keymaster_key_blob_t& key,
+                                       keymaster_operation_handle_t* op_handle) {
+    BeginOperationRequest request;
+    request.purpose = KM_PURPOSE_SIGN;
+    request.SetKeyMaterial(key);
+    request.additional_params.Reinitialize(
+        AuthorizationSet(AuthorizationSetBuilder()
+                             .Digest(KM_DIGEST_SHA_2_256)
+                             .Authorization(TAG_MAC_LENGTH, 256)));
+    BeginOperationResponse response;
+    keymaster->BeginOperation(request, &response);
+    *op_handle = response.op_handle;
+    return response.error;
+}
+
+TEST(AndroidKeymasterMemoryBudgetTest, RejectsAndEvicts) {
+    // A single shard, so eviction follows the order the operations were used in.
+    AndroidKeymaster keymaster(new TestKeymasterContext, 4);
+    GenerateKeyResponse key;
+    GenerateOneShotKey(&keymaster, AuthorizationSetBuilder()
+                                       .HmacKey(128)
+                                       .Digest(KM_DIGEST_SHA_2_256)
+                                       .Authorization(TAG_MIN_MAC_LENGTH, 128)
+                                       .Authorization(TAG_NO_AUTH_REQUIRED),
+                       &key);
+
+    keymaster_operation_handle_t handles[3];
+    ASSERT_EQ(KM_ERROR_OK, BeginHmacSign(&keymaster, key.key_blob, &handles[0]));
+    size_t footprint = keymaster.operation_memory();
+    EXPECT_GT(footprint, 0U);
+
+    // Room for two operations.
+    keymaster.set_operation_memory_budget(2 * footprint, false /* evict_to_fit */);
+    ASSERT_EQ(KM_ERROR_OK, BeginHmacSign(&keymaster, key.key_blob, &handles[1]));
+    EXPECT_EQ(2 * footprint, keymaster.operation_memory());
+    EXPECT_EQ(KM_ERROR_TOO_MANY_OPERATIONS,
+              BeginHmacSign(&keymaster, key.key_blob, &handles[2]));
+    EXPECT_EQ(2 * footprint, keymaster.operation_memory());
+
+    // Evicting makes room by discarding the coldest operation.
+    keymaster.set_operation_memory_budget(2 * footprint, true /* evict_to_fit */);
+    ASSERT_EQ(KM_ERROR_OK, BeginHmacSign(&keymaster, key.key_blob, &handles[2]));
+    EXPECT_FALSE(keymaster.has_operation(handles[0]));
+    EXPECT_TRUE(keymaster.has_operation(handles[1]));
+    EXPECT_TRUE(keymaster.has_operation(handles[2]));
+    EXPECT_EQ(2 * footprint, keymaster.operation_memory());
+
+    // An operation larger than the whole budget is rejected without evicting anything.
+    keymaster.set_operation_memory_budget(footprint - 1, true /* evict_to_fit */);
+    keymaster_operation_handle_t handle;
+    EXPECT_EQ(KM_ERROR_TOO_MANY_OPERATIONS, BeginHmacSign(&keymaster, key.key_blob, &handle));
+    EXPECT_TRUE(keymaster.has_operation(handles[1]));
+    EXPECT_TRUE(keymaster.has_operation(handles[2]));
+}
+
+TEST(AndroidKeymasterIdleTimeoutTest, ReapsIdleOperations) {
+    // SoftKeymasterContext has no enforcement policy, so this runs on CLOCK_MONOTONIC.
+    AndroidKeymaster keymaster(new SoftKeymasterContext, 16);
+    keymaster.set_operation_idle_timeout(1);
+    GenerateKeyResponse key;
+    GenerateOneShotKey(&keymaster, AuthorizationSetBuilder()
+                                       .HmacKey(128)
+                                       .Digest(KM_DIGEST_SHA_2_256)
+                                       .Authorization(TAG_MIN_MAC_LENGTH, 128)
+                                       .Authorization(TAG_NO_AUTH_REQUIRED),
+                       &key);
+
+    keymaster_operation_handle_t idle, fresh;
+    ASSERT_EQ(KM_ERROR_OK, BeginHmacSign(&keymaster, key.key_blob, &idle));
+    std::this_thread::sleep_for(std::chrono::milliseconds(2100));
+    // The next command reaps the operation left idle past the timeout.
+    ASSERT_EQ(KM_ERROR_OK, BeginHmacSign(&keymaster, key.key_blob, &fresh));
+    EXPECT_FALSE(keymaster.has_operation(idle));
+    EXPECT_TRUE(keymaster.has_operation(fresh));
+
+    UpdateOperationRequest update_request;
+    update_request.op_handle = idle;
+    UpdateOperationResponse update_response;
+    keymaster.UpdateOperation(update_request, &update_response);
+    EXPECT_EQ(KM_ERROR_INVALID_OPERATION_HANDLE, update_response.error);
+}
+
+TEST(AndroidKeymasterCpuAffinityTest, OperationsUseTheCallingCpusShard) {
+    // Pin this thread to the CPU it's on, so it can't migrate between begins.
+    int cpu = sched_getcpu();
+    cpu_set_t old_cpus, cpus;
+    if (cpu < 0 || sched_getaffinity(0, sizeof(old_cpus), &old_cpus) != 0)
+        return;
+    CPU_ZERO(&cpus);
+    CPU_SET(cpu, &cpus);
+    if (sched_setaffinity(0, sizeof(cpus), &cpus) != 0)
+        return;
+
+    // 128 operations make 16 shards, and the shard is in the top byte of each handle.
+    AndroidKeymaster keymaster(new TestKeymasterContext, 128);
+    keymaster.set_operation_cpu_affinity(true);
+    GenerateKeyResponse key;
+    GenerateOneShotKey(&keymaster, AuthorizationSetBuilder()
+                                       .HmacKey(128)
+                                       .Digest(KM_DIGEST_SHA_2_256)
+                                       .Authorization(TAG_MIN_MAC_LENGTH, 128)
+                                       .Authorization(TAG_NO_AUTH_REQUIRED),
+                       &key);
+    for (int i = 0; i < 3; ++i) {
+        keymaster_operation_handle_t handle;
+        ASSERT_EQ(KM_ERROR_OK, BeginHmacSign(&keymaster, key.key_blob, &handle));
+        EXPECT_EQ(static_cast<uint64_t>(cpu % 16), handle >> 56);
+    }
+    sched_setaffinity(0, sizeof(old_cpus), &old_cpus);
+}
+
+TEST(AndroidKeymasterStatisticsTest, RecordsCommandLatencies) {
+    AndroidKeymaster keymaster(new TestKeymasterContext, 16);
+    GenerateKeyResponse key;
+    GenerateOneShotKey(&keymaster, AuthorizationSetBuilder()
+                                       .HmacKey(128)
+                                       .Digest(KM_DIGEST_SHA_2_256)
+                                       .Authorization(TAG_MIN_MAC_LENGTH, 128)
+                                       .Authorization(TAG_NO_AUTH_REQUIRED),
+                       &key);
+
+    BeginOperationRequest begin_request;
+    begin_request.purpose = KM_PURPOSE_SIGN;
+    begin_request.SetKeyMaterial(key.key_blob);
+    begin_request.additional_params.Reinitialize(
+        AuthorizationSet(AuthorizationSetBuilder()
+                             .Digest(KM_DIGEST_SHA_2_256)
+                             .Authorization(TAG_MAC_LENGTH, 256)));
+    BeginOperationResponse begin_response;
+    keymaster.BeginOperation(begin_request, &begin_response);
+    ASSERT_EQ(KM_ERROR_OK, begin_response.error);
+    FinishOperationRequest finish_request;
+    finish_request.op_handle = begin_response.op_handle;
+    finish_request.input.Reinitialize("hello", 5);
+    FinishOperationResponse finish_response;
+    keymaster.FinishOperation(finish_request, &finish_response);
+    ASSERT_EQ(KM_ERROR_OK, finish_response.error);
+
+    GetStatisticsResponse response;
+    keymaster.GetStatistics(GetStatisticsRequest(), &response);
+#ifdef KEYMASTER_LATENCY_STATISTICS
+    ASSERT_EQ(KM_ERROR_OK, response.error);
+    EXPECT_EQ(3U, response.histogram_count);
+
+    const GetStatisticsResponse::Histogram* generate =
+        FindHistogram(response, GENERATE_KEY, KM_ALGORITHM_HMAC, GetStatisticsResponse::kNoPurpose);
+    ASSERT_TRUE(generate != nullptr);
+    EXPECT_EQ(1U, generate->count);
+#ifdef KEYMASTER_ALLOCATION_COUNTING
+    // At least the key blob is allocated.
+    EXPECT_GT(generate->allocations, 0U);
+    EXPECT_GT(generate->allocated_bytes, 0U);
+#endif
+    const GetStatisticsResponse::Histogram* begin =
+        FindHistogram(response, BEGIN_OPERATION, KM_ALGORITHM_HMAC, KM_PURPOSE_SIGN);
+    ASSERT_TRUE(begin != nullptr);
+    EXPECT_EQ(1U, begin->count);
+    const GetStatisticsResponse::Histogram* finish =
+        FindHistogram(response, FINISH_OPERATION, KM_ALGORITHM_HMAC, KM_PURPOSE_SIGN);
+    ASSERT_TRUE(finish != nullptr);
+    EXPECT_EQ(1U, finish->count);
+
+    uint64_t bucketed = 0;
+    for (size_t i = 0; i < GetStatisticsResponse::kBucketCount; ++i)
+        bucketed += finish->buckets[i];
+    EXPECT_EQ(finish->count, bucketed);
+#else
+    EXPECT_EQ(KM_ERROR_UNIMPLEMENTED, response.error);
+#endif
+}
+
+TEST(AndroidKeymasterStatisticsTest, RecordsDeletions) {
+    AndroidKeymaster keymaster(new TestKeymasterContext, 16);
+    GenerateKeyResponse key;
+    GenerateOneShotKey(&keymaster, AuthorizationSetBuilder()
+                                       .HmacKey(128)
+                                       .Digest(KM_DIGEST_SHA_2_256)
+                                       .Authorization(TAG_MIN_MAC_LENGTH, 128)
+                                       .Authorization(TAG_NO_AUTH_REQUIRED),
+                       &key);
+
+    DeleteKeyRequest delete_request;
+    delete_request.SetKeyMaterial(key.key_blob);
+    DeleteKeyResponse delete_response;
+    keymaster.DeleteKey(delete_request, &delete_response);
+    DeleteAllKeysResponse delete_all_response;
+    keymaster.DeleteAllKeys(DeleteAllKeysRequest(), &delete_all_response);
+
+    GetStatisticsResponse response;
+    keymaster.GetStatistics(GetStatisticsRequest(), &response);
+#ifdef KEYMASTER_LATENCY_STATISTICS
+    ASSERT_EQ(KM_ERROR_OK, response.error);
+    const GetStatisticsResponse::Histogram* deletion =
+        FindHistogram(response, DELETE_KEY, GetStatisticsResponse::kNoAlgorithm,
+                      GetStatisticsResponse::kNoPurpose);
+    ASSERT_TRUE(deletion != nullptr);
+    EXPECT_EQ(1U, deletion->count);
+    const GetStatisticsResponse::Histogram* delete_all =
+        FindHistogram(response, DELETE_ALL_KEYS, GetStatisticsResponse::kNoAlgorithm,
+                      GetStatisticsResponse::kNoPurpose);
+    ASSERT_TRUE(delete_all != nullptr);
+    EXPECT_EQ(1U, delete_all->count);
+#else
+    EXPECT_EQ(KM_ERROR_UNIMPLEMENTED, response.error);
+#endif
+}
+
+// Records each span's begin as "+name" and its end as "-".
+class RecordingTracer : public Tracer {
+  public:
+    RecordingTracer() { set_instance(this); }
+    ~RecordingTracer() { set_instance(nullptr); }
+
+    void begin_span(const char* name) const override { events.push_back(string("+") + name); }
+    void end_span() const override { events.push_back("-"); }
+
+    mutable vector<string> events;
+};
+
+TEST(AndroidKeymasterTracingTest, BeginAndFinishPhases) {
+    AndroidKeymaster keymaster(new TestKeymasterContext, 16);
+    GenerateKeyResponse key;
+    GenerateOneShotKey(&keymaster, AuthorizationSetBuilder()
+                                       .HmacKey(128)
+                                       .Digest(KM_DIGEST_SHA_2_256)
+                                       .Authorization(TAG_MIN_MAC_LENGTH, 128)
+                                       .Authorization(TAG_NO_AUTH_REQUIRED),
+                       &key);
+
+    RecordingTracer tracer;
+    BeginOperationRequest begin_request;
+    begin_request.purpose = KM_PURPOSE_SIGN;
+    begin_request.SetKeyMaterial(key.key_blob);
+    begin_request.additional_params.Reinitialize(
+        AuthorizationSet(AuthorizationSetBuilder()
+                             .Digest(KM_DIGEST_SHA_2_256)
+                             .Authorization(TAG_MAC_LENGTH, 256)));
+    BeginOperationResponse begin_response;
+    keymaster.BeginOperation(begin_request, &begin_response);
+    ASSERT_EQ(KM_ERROR_OK, begin_response.error);
+    FinishOperationRequest finish_request;
+    finish_request.op_handle = begin_response.op_handle;
+    FinishOperationResponse finish_response;
+    keymaster.FinishOperation(finish_request, &finish_response);
+    ASSERT_EQ(KM_ERROR_OK, finish_response.error);
+
+    const char* expected[] = {
+        "+BeginOperation",
+        "+LoadKey",
+        "+ParseKeyBlob",
+        "-",
+        "+KeyFactory::LoadKey",
+        "-",
+        "-",
+        "+CreateKeyId",
+        "-",
+        "+OperationFactory::CreateOperation",
+        "-",
+        "+AuthorizeOperation",
+        "-",
+        "+Operation::Begin",
+        "-",
+        "+OperationTable::Add",
+        "-",
+        "-",
+        "+FinishOperation",
+        "+AuthorizeFinish",
+        "-",
+        "+Operation::Finish",
+        "-",
+        "-",
+    };
+    EXPECT_EQ(vector<string>(expected, expected + array_length(expected)), tracer.events);
+}
+
+TEST(AndroidKeymasterWarmupTest, LoadsKeysInTheBackground) {
+    AndroidKeymaster keymaster(new TestKeymasterContext, 16);
+    AuthorizationSet app_params(AuthorizationSetBuilder().Authorization(TAG_APPLICATION_ID,
+                                                                        "app_id", 6));
+    GenerateKeyResponse ec_key;
+    GenerateOneShotKey(&keymaster, AuthorizationSetBuilder()
+                                       .EcdsaSigningKey(256)
+                                       .Digest(KM_DIGEST_NONE)
+                                       .Authorization(TAG_APPLICATION_ID, "app_id", 6)
+                                       .Authorization(TAG_NO_AUTH_REQUIRED),
+                       &ec_key);
+    GenerateKeyResponse hmac_key;
+    GenerateOneShotKey(&keymaster, AuthorizationSetBuilder()
+                                       .HmacKey(128)
+                                       .Digest(KM_DIGEST_SHA_2_256)
+                                       .Authorization(TAG_MIN_MAC_LENGTH, 128)
+                                       .Authorization(TAG_NO_AUTH_REQUIRED),
+                       &hmac_key);
+
+    // Each key with its own parameters, and a blob that won't load, which is skipped.
+    WarmupKeysRequest request;
+    ASSERT_TRUE(request.SetItemCount(3));
+    request.items[0].key_blob = KeymasterKeyBlob(ec_key.key_blob);
+    request.items[0].additional_params.Reinitialize(app_params);
+    request.items[1].key_blob = KeymasterKeyBlob(reinterpret_cast<const uint8_t*>("garbage"), 7);
+    request.items[2].key_blob = KeymasterKeyBlob(hmac_key.key_blob);
+    WarmupKeysResponse response;
+    keymaster.WarmupKeys(request, &response);
+    ASSERT_EQ(KM_ERROR_OK, response.error);
+    keymaster.WaitForKeyWarmup();
+
+    // Both keys are found in the cache on first use.
+    RecordingTracer tracer;
+    BeginOperationRequest ec_begin;
+    ec_begin.purpose = KM_PURPOSE_SIGN;
+    ec_begin.SetKeyMaterial(ec_key.key_blob);
+    ec_begin.additional_params.Reinitialize(
+        AuthorizationSet(AuthorizationSetBuilder()
+                             .Digest(KM_DIGEST_NONE)
+                             .Authorization(TAG_APPLICATION_ID, "app_id", 6)));
+    BeginOperationResponse ec_response;
+    keymaster.BeginOperation(ec_begin, &ec_response);
+    ASSERT_EQ(KM_ERROR_OK, ec_response.error);
+
+    BeginOperationRequest hmac_begin;
+    hmac_begin.purpose = KM_PURPOSE_SIGN;
+    hmac_begin.SetKeyMaterial(hmac_key.key_blob);
+    hmac_begin.additional_params.Reinitialize(
+        AuthorizationSet(AuthorizationSetBuilder()
+                             .Digest(KM_DIGEST_SHA_2_256)
+                             .Authorization(TAG_MAC_LENGTH, 256)));
+    BeginOperationResponse hmac_response;
+    keymaster.BeginOperation(hmac_begin, &hmac_response);
+    ASSERT_EQ(KM_ERROR_OK, hmac_response.error);
+
+    EXPECT_EQ(2, std::count(tracer.events.begin(), tracer.events.end(), "+LoadKey"));
+    EXPECT_EQ(0, std::count(tracer.events.begin(), tracer.events.end(), "+ParseKeyBlob"));
+
+    // Deleting a key discards its warmed copy.
+    DeleteKeyRequest delete_request;
+    delete_request.SetKeyMaterial(hmac_key.key_blob);
+    DeleteKeyResponse delete_response;
+    keymaster.DeleteKey(delete_request, &delete_response);
+    ASSERT_EQ(KM_ERROR_OK, delete_response.error);
+    tracer.events.clear();
+    BeginOperationResponse second_hmac_response;
+    keymaster.BeginOperation(hmac_begin, &second_hmac_response);
+    ASSERT_EQ(KM_ERROR_OK, second_hmac_response.error);
+    EXPECT_EQ(1, std::count(tracer.events.begin(), tracer.events.end(), "+ParseKeyBlob"));
+}
+
+TEST(SoftKeymasterContextTest, PregeneratedEcKeys) {
+    SoftKeymasterContext* context = new SoftKeymasterContext;
+    keymaster_ec_curve_t curve = KM_EC_CURVE_P_256;
+    ASSERT_EQ(KM_ERROR_OK, context->EnableEcKeyPregeneration(&curve, 1, 2 /* pool_size */,
+                                                             1 /* low_water_mark */));
+    AndroidKeymaster keymaster(context, 16);
+
+    // Draw more keys than the pool holds, so some may be generated inline.
+    string public_keys[4];
+    for (size_t i = 0; i < array_length(public_keys); ++i) {
+        GenerateKeyResponse key;
+        GenerateOneShotKey(&keymaster, AuthorizationSetBuilder()
+                                           .EcdsaSigningKey(256)
+                                           .Digest(KM_DIGEST_NONE)
+                                           .Authorization(TAG_NO_AUTH_REQUIRED),
+                           &key);
+
+        ExportKeyRequest export_request;
+        export_request.key_format = KM_KEY_FORMAT_X509;
+        export_request.SetKeyMaterial(key.key_blob);
+        ExportKeyResponse export_response;
+        keymaster.ExportKey(export_request, &export_response);
+        ASSERT_EQ(KM_ERROR_OK, export_response.error);
+        public_keys[i].assign(reinterpret_cast<const char*>(export_response.key_data),
+                              export_response.key_data_length);
+        for (size_t j = 0; j < i; ++j)
+            EXPECT_NE(public_keys[j], public_keys[i]);
+
+        OneShotOperationRequest sign_request;
+        sign_request.purpose = KM_PURPOSE_SIGN;
+        sign_request.SetKeyMaterial(key.key_blob);
+        AuthorizationSet sign_params(AuthorizationSetBuilder().Digest(KM_DIGEST_NONE));
+        sign_request.additional_params.Reinitialize(sign_params);
+        sign_request.input.Reinitialize("hello", 5);
+        OneShotOperationResponse sign_response;
+        keymaster.OneShotOperation(sign_request, &sign_response);
+        ASSERT_EQ(KM_ERROR_OK, sign_response.error);
+
+        OneShotOperationRequest verify_request;
+        verify_request.purpose = KM_PURPOSE_VERIFY;
+        verify_request.SetKeyMaterial(key.key_blob);
+        verify_request.additional_params.Reinitialize(sign_params);
+        verify_request.input.Reinitialize("hello", 5);
+        verify_request.signature.Reinitialize(sign_response.output);
+        OneShotOperationResponse verify_response;
+        keymaster.OneShotOperation(verify_request, &verify_response);
+        EXPECT_EQ(KM_ERROR_OK, verify_response.error);
+    }
+}
+
+TEST(SoftKeymasterContextTest, PrecomputedEcdsaSignSetups) {
+    SoftKeymasterContext* context = new SoftKeymasterContext;
+    ASSERT_EQ(KM_ERROR_OK, context->EnableEcdsaSignSetupPrecomputation(4 /* queue_size */));
+    AndroidKeymaster keymaster(context, 16);
+
+    GenerateKeyResponse key;
+    GenerateOneShotKey(&keymaster, AuthorizationSetBuilder()
+                                       .EcdsaSigningKey(256)
+                                       .Digest(KM_DIGEST_NONE)
+                                       .Digest(KM_DIGEST_SHA_2_256)
+                                       .Authorization(TAG_NO_AUTH_REQUIRED),
+                       &key);
+
+    // Sign more times than the queue holds, so some signatures may use inline setups.
+    keymaster_digest_t digests[] = {KM_DIGEST_NONE, KM_DIGEST_SHA_2_256};
+    for (keymaster_digest_t digest : digests) {
+        AuthorizationSet sign_params(AuthorizationSetBuilder().Digest(digest));
+        string signatures[6];
+        for (size_t i = 0; i < array_length(signatures); ++i) {
+            OneShotOperationRequest sign_request;
+            sign_request.purpose = KM_PURPOSE_SIGN;
+            sign_request.SetKeyMaterial(key.key_blob);
+            sign_request.additional_params.Reinitialize(sign_params);
+            sign_request.input.Reinitialize("hello", 5);
+            OneShotOperationResponse sign_response;
+            keymaster.OneShotOperation(sign_request, &sign_response);
+            ASSERT_EQ(KM_ERROR_OK, sign_response.error);
+            signatures[i].assign(reinterpret_cast<const char*>(sign_response.output.peek_read()),
+                                 sign_response.output.available_read());
+            for (size_t j = 0; j < i; ++j)
+                EXPECT_NE(signatures[j], signatures[i]);
+
+            OneShotOperationRequest verify_request;
+            verify_request.purpose = KM_PURPOSE_VERIFY;
+            verify_request.SetKeyMaterial(key.key_blob);
+            verify_request.additional_params.Reinitialize(sign_params);
+            verify_request.input.Reinitialize("hello", 5);
+            verify_request.signature.Reinitialize(sign_response.output);
+            OneShotOperationResponse verify_response;
+            keymaster.OneShotOperation(verify_request, &verify_response);
+            EXPECT_EQ(KM_ERROR_OK, verify_response.error);
+        }
+    }
+}
+
+// Signs "hello" with key and params, then verifies the result, and with a tampered copy,
+// returning the errors.
+static void SignAndVerifyTwice(AndroidKeymaster* keymaster, const GenerateKeyResponse& key,
+                               const AuthorizationSet& params, keymaster_error_t errors[3]) {
+    OneShotOperationRequest sign_request;
+    sign_request.purpose = KM_PURPOSE_SIGN;
+    sign_request.SetKeyMaterial(key.key_blob);
+    sign_request.additional_params.Reinitialize(params);
+    sign_request.input.Reinitialize("hello", 5);
+    OneShotOperationResponse sign_response;
+    keymaster->OneShotOperation(sign_request, &sign_response);
+    ASSERT_EQ(KM_ERROR_OK, sign_response.error);
+
+    string signature(reinterpret_cast<const char*>(sign_response.output.peek_read()),
+                     sign_response.output.available_read());
+    string tampered = signature;
+    tampered[tampered.size() - 1] ^= 1;
+    const string* signatures[] = {&signature, &signature, &tampered};
+    for (size_t i = 0; i < array_length(signatures); ++i) {
+        OneShotOperationRequest verify_request;
+        verify_request.purpose = KM_PURPOSE_VERIFY;
+        verify_request.SetKeyMaterial(key.key_blob);
+        verify_request.additional_params.Reinitialize(params);
+        verify_request.input.Reinitialize("hello", 5);
+        verify_request.signature.Reinitialize(signatures[i]->data(), signatures[i]->size());
+        OneShotOperationResponse verify_response;
+        keymaster->OneShotOperation(verify_request, &verify_response);
+        errors[i] = verify_response.error;
+    }
+}
+
+TEST(SoftKeymasterContextTest, VerificationCache) {
+    SoftKeymasterContext* context = new SoftKeymasterContext;
+    ASSERT_EQ(KM_ERROR_OK, context->EnableVerificationCache(16 /* max_entries */));
+    AndroidKeymaster keymaster(context, 16);
+    const VerificationCache* cache = context->verification_cache();
+    ASSERT_TRUE(cache != nullptr);
+
+    GenerateKeyResponse ec_key;
+    GenerateOneShotKey(&keymaster, AuthorizationSetBuilder()
+                                       .EcdsaSigningKey(256)
+                                       .Digest(KM_DIGEST_NONE)
+                                       .Digest(KM_DIGEST_SHA_2_256)
+                                       .Authorization(TAG_NO_AUTH_REQUIRED),
+                       &ec_key);
+    GenerateKeyResponse rsa_key;
+    GenerateOneShotKey(&keymaster, AuthorizationSetBuilder()
+                                       .RsaSigningKey(1024, 65537)
+                                       .Digest(KM_DIGEST_SHA_2_256)
+                                       .Padding(KM_PAD_RSA_PKCS1_1_5_SIGN)
+                                       .Authorization(TAG_NO_AUTH_REQUIRED),
+                       &rsa_key);
+
+    struct {
+        const GenerateKeyResponse* key;
+        AuthorizationSet params;
+    } cases[] = {
+        {&ec_key, AuthorizationSetBuilder().Digest(KM_DIGEST_NONE).build()},
+        {&ec_key, AuthorizationSetBuilder().Digest(KM_DIGEST_SHA_2_256).build()},
+        {&rsa_key, AuthorizationSetBuilder()
+                       .Digest(KM_DIGEST_SHA_2_256)
+                       .Padding(KM_PAD_RSA_PKCS1_1_5_SIGN)
+                       .build()},
+    };
+    for (size_t i = 0; i < array_length(cases); ++i) {
+        keymaster_error_t errors[3];
+        SignAndVerifyTwice(&keymaster, *cases[i].key, cases[i].params, errors);
+        // The second verification is a hit; the tampered signature is verified and rejected.
+        EXPECT_EQ(KM_ERROR_OK, errors[0]);
+        EXPECT_EQ(KM_ERROR_OK, errors[1]);
+        EXPECT_EQ(KM_ERROR_VERIFICATION_FAILED, errors[2]);
+        EXPECT_EQ(i + 1, cache->hits());
+        EXPECT_EQ(i + 1, cache->entry_count());
+    }
+}
+
+TEST(PrecomputedPairQueueTest, EcdsaSignSetupsUsedOnce) {
+    UniquePtr<EC_KEY, EC_KEY_Delete> ec_key(EC_KEY_new_by_curve_name(NID_X9_62_prime256v1));
+    ASSERT_TRUE(ec_key.get() != nullptr);
+    ASSERT_EQ(1, EC_KEY_generate_key(ec_key.get()));
+
+    std::shared_ptr<PrecomputationFiller> filler(new PrecomputationFiller);
+    std::shared_ptr<PrecomputedPairQueue> queue(new PrecomputedPairQueue(
+        EcdsaSignSetupGenerator(ec_key.get()), 4 /* capacity */, filler));
+    filler->Schedule(queue);
+    for (int i = 0; i < 500 && queue->available() < 4; ++i)
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    ASSERT_EQ(4U, queue->available());
+
+    // Taking one pair leaves the queue more than half full, so it isn't refilled.
+    uint8_t digest[32] = {1, 2, 3};
+    BIGNUM_ClearPtr kinv, r;
+    ASSERT_TRUE(queue->Take(&kinv, &r));
+    EXPECT_EQ(3U, queue->available());
+
+    uint8_t signature[128];
+    unsigned int signature_len;
+    ASSERT_EQ(1, ECDSA_sign_ex(0 /* type */, digest, sizeof(digest), signature, &signature_len,
+                               kinv.get(), r.get(), ec_key.get()));
+    EXPECT_EQ(1, ECDSA_verify(0 /* type */, digest, sizeof(digest), signature, signature_len,
+                              ec_key.get()));
+
+    // The next pair is a different one.
+    BIGNUM_ClearPtr next_kinv, next_r;
+    ASSERT_TRUE(queue->Take(&next_kinv, &next_r));
+    EXPECT_NE(0, BN_cmp(r.get(), next_r.get()));
+}
+
+TEST(PrecomputedPairQueueTest, RsaBlindingPairsMatch) {
+    UniquePtr<BIGNUM, BIGNUM_Delete> exponent(BN_new());
+    UniquePtr<RSA, RSA_Delete> rsa(RSA_new());
+    ASSERT_TRUE(exponent.get() != nullptr && rsa.get() != nullptr);
+    ASSERT_EQ(1, BN_set_word(exponent.get(), 65537));
+    ASSERT_EQ(1, RSA_generate_key_ex(rsa.get(), 1024, exponent.get(), nullptr /* callback */));
+
+    std::shared_ptr<PrecomputationFiller> filler(new PrecomputationFiller);
+    std::shared_ptr<PrecomputedPairQueue> queue(
+        new PrecomputedPairQueue(RsaBlindingGenerator(rsa.get()), 4 /* capacity */, filler));
+    filler->Schedule(queue);
+    for (int i = 0; i < 500 && queue->available() < 4; ++i)
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    ASSERT_EQ(4U, queue->available());
+
+    // Each pair is (r^e, r^-1), so r^e * (r^-1)^e = 1 mod n.
+    UniquePtr<BN_CTX, BN_CTX_Delete> ctx(BN_CTX_new());
+    UniquePtr<BIGNUM, BIGNUM_Delete> product(BN_new());
+    BIGNUM_ClearPtr blind, unblind;
+    ASSERT_TRUE(queue->Take(&blind, &unblind));
+    ASSERT_EQ(1, BN_mod_exp(product.get(), unblind.get(), rsa->e, rsa->n, ctx.get()));
+    ASSERT_EQ(1, BN_mod_mul(product.get(), product.get(), blind.get(), rsa->n, ctx.get()));
+    EXPECT_TRUE(BN_is_one(product.get()));
+
+    BIGNUM_ClearPtr next_blind, next_unblind;
+    ASSERT_TRUE(queue->Take(&next_blind, &next_unblind));
+    EXPECT_NE(0, BN_cmp(blind.get(), next_blind.get()));
+}
+
+TEST(RsaPkeyContextCacheTest, DuplicatesConfiguredTemplates) {
+    UniquePtr<BIGNUM, BIGNUM_Delete> exponent(BN_new());
+    UniquePtr<RSA, RSA_Delete> rsa(RSA_new());
+    EVP_PKEY_Ptr pkey(EVP_PKEY_new());
+    ASSERT_TRUE(exponent.get() && rsa.get() && pkey.get());
+    ASSERT_EQ(1, BN_set_word(exponent.get(), 65537));
+    ASSERT_EQ(1, RSA_generate_key_ex(rsa.get(), 1024, exponent.get(), nullptr /* callback */));
+    ASSERT_EQ(1, EVP_PKEY_set1_RSA(pkey.get(), rsa.get()));
+
+    RsaPkeyContextCache cache;
+    EXPECT_TRUE(cache.Duplicate(KM_PURPOSE_DECRYPT, KM_PAD_RSA_OAEP, KM_DIGEST_SHA_2_256) ==
+                nullptr);
+
+    EVP_PKEY_CTX_Ptr encrypt_ctx(EVP_PKEY_CTX_new(pkey.get(), nullptr /* engine */));
+    EVP_PKEY_CTX_Ptr decrypt_ctx(EVP_PKEY_CTX_new(pkey.get(), nullptr /* engine */));
+    ASSERT_TRUE(encrypt_ctx.get() && decrypt_ctx.get());
+    ASSERT_EQ(1, EVP_PKEY_encrypt_init(encrypt_ctx.get()));
+    ASSERT_EQ(1, EVP_PKEY_decrypt_init(decrypt_ctx.get()));
+    for (EVP_PKEY_CTX* ctx : {encrypt_ctx.get(), decrypt_ctx.get()}) {
+        ASSERT_LT(0, EVP_PKEY_CTX_set_rsa_padding(ctx, RSA_PKCS1_OAEP_PADDING));
+        ASSERT_LT(0, EVP_PKEY_CTX_set_rsa_oaep_md(ctx, EVP_sha256()));
+    }
+    cache.Store(KM_PURPOSE_DECRYPT, KM_PAD_RSA_OAEP, KM_DIGEST_SHA_2_256, decrypt_ctx.get());
+    cache.Store(KM_PURPOSE_DECRYPT, KM_PAD_RSA_OAEP, KM_DIGEST_SHA_2_256, decrypt_ctx.get());
+    EXPECT_EQ(1U, cache.template_count());
+
+    uint8_t ciphertext[128];
+    size_t ciphertext_len = sizeof(ciphertext);
+    ASSERT_EQ(1, EVP_PKEY_encrypt(encrypt_ctx.get(), ciphertext, &ciphertext_len,
+                                  reinterpret_cast<const uint8_t*>("hello"), 5));
+
+    // Each duplicate decrypts with the template's padding and digest.
+    for (int i = 0; i < 2; ++i) {
+        EVP_PKEY_CTX_Ptr ctx(
+            cache.Duplicate(KM_PURPOSE_DECRYPT, KM_PAD_RSA_OAEP, KM_DIGEST_SHA_2_256));
+        ASSERT_TRUE(ctx.get() != nullptr);
+        uint8_t plaintext[128];
+        size_t plaintext_len = sizeof(plaintext);
+        ASSERT_EQ(1, EVP_PKEY_decrypt(ctx.get(), plaintext, &plaintext_len, ciphertext,
+                                      ciphertext_len));
+        EXPECT_EQ("hello", string(reinterpret_cast<char*>(plaintext), plaintext_len));
+    }
+    EXPECT_TRUE(cache.Duplicate(KM_PURPOSE_DECRYPT, KM_PAD_RSA_OAEP, KM_DIGEST_SHA1) == nullptr);
+}
+
+TEST(DigestContextCacheTest, CopiesInitializedTemplates) {
+    UniquePtr<EC_KEY, EC_KEY_Delete> ec_key(EC_KEY_new_by_curve_name(NID_X9_62_prime256v1));
+    EVP_PKEY_Ptr pkey(EVP_PKEY_new());
+    ASSERT_TRUE(ec_key.get() && pkey.get());
+    ASSERT_EQ(1, EC_KEY_generate_key(ec_key.get()));
+    ASSERT_EQ(1, EVP_PKEY_set1_EC_KEY(pkey.get(), ec_key.get()));
+
+    const string message = "hello";
+    uint8_t digest[SHA256_DIGEST_LENGTH];
+    SHA256(reinterpret_cast<const uint8_t*>(message.data()), message.size(), digest);
+    uint8_t signature[256];
+    unsigned int signature_len;
+    ASSERT_EQ(1, ECDSA_sign(0 /* type */, digest, sizeof(digest), signature, &signature_len,
+                            ec_key.get()));
+
+    DigestContextCache cache;
+    EVP_MD_CTX ctx;
+    EVP_MD_CTX_init(&ctx);
+    EXPECT_FALSE(cache.CopyTo(KM_PURPOSE_VERIFY, KM_DIGEST_SHA_2_256, KM_PAD_NONE, &ctx));
+
+    EVP_PKEY_CTX* pkey_ctx;
+    ASSERT_EQ(1, EVP_DigestVerifyInit(&ctx, &pkey_ctx, EVP_sha256(), nullptr /* engine */,
+                                      pkey.get()));
+    cache.Store(KM_PURPOSE_VERIFY, KM_DIGEST_SHA_2_256, KM_PAD_NONE, &ctx);
+    cache.Store(KM_PURPOSE_VERIFY, KM_DIGEST_SHA_2_256, KM_PAD_NONE, &ctx);
+    EXPECT_EQ(1U, cache.template_count());
+    EVP_MD_CTX_cleanup(&ctx);
+
+    // Each copy verifies with the template's key and digest, unaffected by earlier copies.
+    for (int i = 0; i < 2; ++i) {
+        EVP_MD_CTX copy;
+        EVP_MD_CTX_init(&copy);
+        ASSERT_TRUE(cache.CopyTo(KM_PURPOSE_VERIFY, KM_DIGEST_SHA_2_256, KM_PAD_NONE, &copy));
+        EXPECT_EQ(1, EVP_DigestVerifyUpdate(&copy, message.data(), message.size()));
+        EXPECT_EQ(1, EVP_DigestVerifyFinal(&copy, signature, signature_len));
+        EVP_MD_CTX_cleanup(&copy);
+    }
+    EVP_MD_CTX other;
+    EVP_MD_CTX_init(&other);
+    EXPECT_FALSE(cache.CopyTo(KM_PURPOSE_VERIFY, KM_DIGEST_SHA1, KM_PAD_NONE, &other));
+    EXPECT_FALSE(cache.CopyTo(KM_PURPOSE_SIGN, KM_DIGEST_SHA_2_256, KM_PAD_NONE, &other));
+    EVP_MD_CTX_cleanup(&other);
+}
+
+// Runs a one-shot RSA operation with no digest and the given padding.
+static keymaster_error_t RsaOneShot(AndroidKeymaster* keymaster,
+                                    const keymaster_key_blob_t& key_blob,
+                                    keymaster_purpose_t purpose, keymaster_padding_t padding,
+                                    const string& input, string* output) {
+    OneShotOperationRequest request;
+    request.purpose = purpose;
+    request.SetKeyMaterial(key_blob);
+    request.additional_params.Reinitialize(
+        AuthorizationSet(AuthorizationSetBuilder().Digest(KM_DIGEST_NONE).Padding(padding)));
+    request.input.Reinitialize(input.data(), input.size());
+    OneShotOperationResponse response;
+    keymaster->OneShotOperation(request, &response);
+    output->assign(reinterpret_cast<const char*>(response.output.peek_read()),
+                   response.output.available_read());
+    return response.error;
+}
+
+TEST(SoftKeymasterContextTest, PrecomputedRsaBlinding) {
+    SoftKeymasterContext* context = new SoftKeymasterContext;
+    ASSERT_EQ(KM_ERROR_OK, context->EnableRsaBlindingPrecomputation(4 /* queue_size */));
+    AndroidKeymaster keymaster(context, 16);
+    AndroidKeymaster reference(new SoftKeymasterContext, 16);
+
+    GenerateKeyResponse signing_key;
+    GenerateOneShotKey(&keymaster, AuthorizationSetBuilder()
+                                       .RsaSigningKey(1024, 65537)
+                                       .Digest(KM_DIGEST_NONE)
+                                       .Padding(KM_PAD_NONE)
+                                       .Padding(KM_PAD_RSA_PKCS1_1_5_SIGN)
+                                       .Authorization(TAG_NO_AUTH_REQUIRED),
+                       &signing_key);
+    GenerateKeyResponse crypting_key;
+    GenerateOneShotKey(&keymaster, AuthorizationSetBuilder()
+                                       .RsaEncryptionKey(1024, 65537)
+                                       .Padding(KM_PAD_NONE)
+                                       .Authorization(TAG_NO_AUTH_REQUIRED),
+                       &crypting_key);
+
+    // RSA signatures and raw decryptions are deterministic, so blinded results must match the
+    // unblinded ones.  Run more operations than the queues hold, so some may fall back.
+    string message = "hello";
+    keymaster_padding_t paddings[] = {KM_PAD_NONE, KM_PAD_RSA_PKCS1_1_5_SIGN};
+    for (keymaster_padding_t padding : paddings) {
+        string expected;
+        ASSERT_EQ(KM_ERROR_OK, RsaOneShot(&reference, signing_key.key_blob, KM_PURPOSE_SIGN,
+                                          padding, message, &expected));
+        for (int i = 0; i < 6; ++i) {
+            string signature;
+            ASSERT_EQ(KM_ERROR_OK, RsaOneShot(&keymaster, signing_key.key_blob, KM_PURPOSE_SIGN,
+                                              padding, message, &signature));
+            EXPECT_EQ(expected, signature);
+        }
+    }
+
+    string ciphertext, expected;
+    ASSERT_EQ(KM_ERROR_OK, RsaOneShot(&keymaster, crypting_key.key_blob, KM_PURPOSE_ENCRYPT,
+                                      KM_PAD_NONE, message, &ciphertext));
+    ASSERT_EQ(KM_ERROR_OK, RsaOneShot(&reference, crypting_key.key_blob, KM_PURPOSE_DECRYPT,
+                                      KM_PAD_NONE, ciphertext, &expected));
+    EXPECT_EQ(message, expected.substr(expected.size() - message.size()));
+    for (int i = 0; i < 6; ++i) {
+        string plaintext;
+        ASSERT_EQ(KM_ERROR_OK, RsaOneShot(&keymaster, crypting_key.key_blob, KM_PURPOSE_DECRYPT,
+                                          KM_PAD_NONE, ciphertext, &plaintext));
+        EXPECT_EQ(expected, plaintext);
+    }
+}
+
+TEST(SoftKeymasterContextTest, MultiPrimeRsaKeys) {
+    SoftKeymasterContext* context = new SoftKeymasterContext;
+    ASSERT_EQ(KM_ERROR_OK, context->EnableMultiPrimeRsaKeys(1024 /* min_key_size */, 3));
+    AndroidKeymaster keymaster(context, 16);
+    AndroidKeymaster reference(new SoftKeymasterContext, 16);
+
+    GenerateKeyResponse key;
+    GenerateOneShotKey(&keymaster, AuthorizationSetBuilder()
+                                       .RsaSigningKey(1024, 65537)
+                                       .Digest(KM_DIGEST_NONE)
+                                       .Padding(KM_PAD_NONE)
+                                       .Authorization(TAG_NO_AUTH_REQUIRED),
+                       &key);
+
+    // The blob keeps all three primes.
+    KeymasterKeyBlob key_material;
+    AuthorizationSet hw_enforced, sw_enforced;
+    ASSERT_EQ(KM_ERROR_OK, context->ParseKeyBlob(KeymasterKeyBlob(key.key_blob), AuthorizationSet(),
+                                                 &key_material, &hw_enforced, &sw_enforced));
+    const uint8_t* material = key_material.key_material;
+    UniquePtr<RSA, RSA_Delete> rsa(
+        d2i_RSAPrivateKey(nullptr /* rsa */, &material, key_material.key_material_size));
+    ASSERT_TRUE(rsa.get() != nullptr);
+    EXPECT_EQ(3U, rsa_prime_count(rsa.get()));
+
+    // CRT signing over three primes gives the same signature with or without the policy.
+    string signature, reference_signature;
+    ASSERT_EQ(KM_ERROR_OK, RsaOneShot(&keymaster, key.key_blob, KM_PURPOSE_SIGN, KM_PAD_NONE,
+                                      "hello", &signature));
+    ASSERT_EQ(KM_ERROR_OK, RsaOneShot(&reference, key.key_blob, KM_PURPOSE_SIGN, KM_PAD_NONE,
+                                      "hello", &reference_signature));
+    EXPECT_EQ(reference_signature, signature);
+
+    // Importing a multi-prime key requires the policy.
+    UniquePtr<BIGNUM, BIGNUM_Delete> exponent(BN_new());
+    rsa.reset(RSA_new());
+    EVP_PKEY_Ptr pkey(EVP_PKEY_new());
+    ASSERT_TRUE(exponent.get() && rsa.get() && pkey.get());
+    ASSERT_EQ(1, BN_set_word(exponent.get(), 65537));
+    ASSERT_EQ(1, RSA_generate_multi_prime_key(rsa.get(), 1024, 3, exponent.get(),
+                                              nullptr /* callback */));
+    ASSERT_EQ(1, EVP_PKEY_set1_RSA(pkey.get(), rsa.get()));
+    PKCS8_PRIV_KEY_INFO_Ptr pkcs8(EVP_PKEY2PKCS8(pkey.get()));
+    ASSERT_TRUE(pkcs8.get() != nullptr);
+    int der_len = i2d_PKCS8_PRIV_KEY_INFO(pkcs8.get(), nullptr /* out */);
+    ASSERT_GT(der_len, 0);
+    UniquePtr<uint8_t[]> der(new uint8_t[der_len]);
+    uint8_t* der_end = der.get();
+    i2d_PKCS8_PRIV_KEY_INFO(pkcs8.get(), &der_end);
+
+    ImportKeyRequest import_request;
+    import_request.key_description.Reinitialize(AuthorizationSet(AuthorizationSetBuilder()
+                                                                     .RsaSigningKey(1024, 65537)
+                                                                     .Digest(KM_DIGEST_NONE)
+                                                                     .Padding(KM_PAD_NONE)));
+    import_request.key_format = KM_KEY_FORMAT_PKCS8;
+    import_request.SetKeyMaterial(der.get(), der_len);
+    ImportKeyResponse import_response;
+    reference.ImportKey(import_request, &import_response);
+    EXPECT_EQ(KM_ERROR_UNSUPPORTED_KEY_SIZE, import_response.error);
+    keymaster.ImportKey(import_request, &import_response);
+    EXPECT_EQ(KM_ERROR_OK, import_response.error);
+}
+
+TEST(SoftKeymasterContextTest, ParallelRsaPrimeSearch) {
+    SoftKeymasterContext* context = new SoftKeymasterContext;
+    ASSERT_EQ(KM_ERROR_OK, context->EnableParallelRsaPrimeSearch(1024 /* min_key_size */));
+    EXPECT_EQ(KM_ERROR_UNKNOWN_ERROR, context->EnableParallelRsaPrimeSearch(2048));
+    AndroidKeymaster keymaster(context, 16);
+    AndroidKeymaster reference(new SoftKeymasterContext, 16);
+
+    for (int i = 0; i < 4; ++i) {
+        GenerateKeyResponse key;
+        GenerateOneShotKey(&keymaster, AuthorizationSetBuilder()
+                                           .RsaSigningKey(1024, 65537)
+                                           .Digest(KM_DIGEST_NONE)
+                                           .Padding(KM_PAD_NONE)
+                                           .Authorization(TAG_NO_AUTH_REQUIRED),
+                           &key);
+
+        // The assembled key is a consistent two-prime key of the requested size.
+        KeymasterKeyBlob key_material;
+        AuthorizationSet hw_enforced, sw_enforced;
+        ASSERT_EQ(KM_ERROR_OK,
+                  context->ParseKeyBlob(KeymasterKeyBlob(key.key_blob), AuthorizationSet(),
+                                        &key_material, &hw_enforced, &sw_enforced));
+        const uint8_t* material = key_material.key_material;
+        UniquePtr<RSA, RSA_Delete> rsa(
+            d2i_RSAPrivateKey(nullptr /* rsa */, &material, key_material.key_material_size));
+        ASSERT_TRUE(rsa.get() != nullptr);
+        EXPECT_EQ(1, RSA_check_key(rsa.get()));
+        EXPECT_EQ(1024, BN_num_bits(rsa->n));
+        EXPECT_EQ(2U, rsa_prime_count(rsa.get()));
+
+        string signature, reference_signature;
+        ASSERT_EQ(KM_ERROR_OK, RsaOneShot(&keymaster, key.key_blob, KM_PURPOSE_SIGN, KM_PAD_NONE,
+                                          "hello", &signature));
+        ASSERT_EQ(KM_ERROR_OK, RsaOneShot(&reference, key.key_blob, KM_PURPOSE_SIGN, KM_PAD_NONE,
+                                          "hello", &reference_signature));
+        EXPECT_EQ(reference_signature, signature);
+    }
+
+    // All four came from the parallel search, not RSA_generate_key_ex.
+    const RsaKeyFactory* factory =
+        static_cast<const RsaKeyFactory*>(context->GetKeyFactory(KM_ALGORITHM_RSA));
+    EXPECT_EQ(4U, factory->parallel_prime_search_count());
+}
+
+TEST(SoftKeymasterContextTest, ParseKeyCharacteristics) {
+    SoftKeymasterContext* context = new SoftKeymasterContext;
+    AndroidKeymaster keymaster(context, 16);
+    GenerateKeyResponse key;
+    GenerateOneShotKey(&keymaster, AuthorizationSetBuilder()
+                                       .HmacKey(128)
+                                       .Digest(KM_DIGEST_SHA_2_256)
+                                       .Authorization(TAG_MIN_MAC_LENGTH, 128)
+                                       .Authorization(TAG_APPLICATION_ID, "app", 3)
+                                       .Authorization(TAG_NO_AUTH_REQUIRED),
+                       &key);
+    AuthorizationSet app_params(AuthorizationSetBuilder().Authorization(TAG_APPLICATION_ID, "app",
+                                                                        3));
+
+    // The characteristics are those ParseKeyBlob finds, and the blob is still authenticated.
+    KeymasterKeyBlob key_material;
+    AuthorizationSet hw_enforced, sw_enforced;
+    ASSERT_EQ(KM_ERROR_OK, context->ParseKeyBlob(KeymasterKeyBlob(key.key_blob), app_params,
+                                                 &key_material, &hw_enforced, &sw_enforced));
+    AuthorizationSet parsed_hw_enforced, parsed_sw_enforced;
+    ASSERT_EQ(KM_ERROR_OK, context->ParseKeyCharacteristics(KeymasterKeyBlob(key.key_blob),
+                                                            app_params, &parsed_hw_enforced,
+                                                            &parsed_sw_enforced));
+    EXPECT_EQ(hw_enforced, parsed_hw_enforced);
+    EXPECT_EQ(sw_enforced, parsed_sw_enforced);
+    EXPECT_EQ(KM_ERROR_INVALID_KEY_BLOB,
+              context->ParseKeyCharacteristics(KeymasterKeyBlob(key.key_blob), AuthorizationSet(),
+                                               &parsed_hw_enforced, &parsed_sw_enforced));
+    KeymasterKeyBlob corrupt(key.key_blob);
+    corrupt.writable_data()[corrupt.key_material_size / 2] ^= 1;
+    EXPECT_EQ(KM_ERROR_INVALID_KEY_BLOB,
+              context->ParseKeyCharacteristics(corrupt, app_params, &parsed_hw_enforced,
+                                               &parsed_sw_enforced));
+
+    // GetKeyCharacteristics gives the same answers before the key is loaded and, from the key
+    // cache, after.
+    for (int loaded = 0; loaded < 2; ++loaded) {
+        GetKeyCharacteristicsRequest request;
+        request.SetKeyMaterial(key.key_blob);
+        request.additional_params.Reinitialize(app_params);
+        GetKeyCharacteristicsResponse response;
+        keymaster.GetKeyCharacteristics(request, &response);
+        ASSERT_EQ(KM_ERROR_OK, response.error) << loaded;
+        EXPECT_EQ(hw_enforced, response.enforced) << loaded;
+        EXPECT_EQ(sw_enforced, response.unenforced) << loaded;
+
+        request.additional_params.Clear();
+        keymaster.GetKeyCharacteristics(request, &response);
+        EXPECT_EQ(KM_ERROR_INVALID_KEY_BLOB, response.error) << loaded;
+
+        OneShotOperationRequest sign_request;
+        sign_request.purpose = KM_PURPOSE_SIGN;
+        sign_request.SetKeyMaterial(key.key_blob);
+        sign_request.additional_params.Reinitialize(app_params);
+        sign_request.additional_params.push_back(TAG_DIGEST, KM_DIGEST_SHA_2_256);
+        sign_request.additional_params.push_back(TAG_MAC_LENGTH, 256);
+        sign_request.input.Reinitialize("hello", 5);
+        OneShotOperationResponse sign_response;
+        keymaster.OneShotOperation(sign_request, &sign_response);
+        ASSERT_EQ(KM_ERROR_OK, sign_response.error);
+    }
+}
+
+TEST(AndroidKeymasterBatchUpgradeTest, UpgradesEachBlob) {
+    SoftKeymasterContext* context = new SoftKeymasterContext;
+    AndroidKeymaster keymaster(context, 16);
+    keymaster.set_upgrade_thread_count(3);
+    context->SetSystemVersion(1, 1);
+
+    const size_t kKeyCount = 5;
+    GenerateKeyResponse keys[kKeyCount];
+    for (size_t i = 0; i < kKeyCount; ++i)
+        GenerateOneShotKey(&keymaster, AuthorizationSetBuilder()
+                                           .AesEncryptionKey(128)
+                                           .EcbMode()
+                                           .Padding(KM_PAD_NONE)
+                                           .Authorization(TAG_NO_AUTH_REQUIRED),
+                           &keys[i]);
+    context->SetSystemVersion(1, 2);
+
+    // One blob in the middle of the batch is corrupt, which fails only its own item.
+    BatchUpgradeKeyRequest request;
+    ASSERT_TRUE(request.SetItemCount(kKeyCount + 1));
+    for (size_t i = 0; i < kKeyCount; ++i)
+        request.items[i < 2 ? i : i + 1].key_blob = KeymasterKeyBlob(keys[i].key_blob);
+    ASSERT_TRUE(request.items[2].key_blob.Reset(16));
+    memset(request.items[2].key_blob.writable_data(), 0x5A, 16);
+
+    BatchUpgradeKeyResponse response;
+    keymaster.BatchUpgradeKey(request, &response);
+    ASSERT_EQ(KM_ERROR_OK, response.error);
+    ASSERT_EQ(kKeyCount + 1, response.item_count);
+    EXPECT_EQ(KM_ERROR_INVALID_KEY_BLOB, response.items[2].error);
+    for (size_t i = 0; i < response.item_count; ++i) {
+        if (i == 2)
+            continue;
+        ASSERT_EQ(KM_ERROR_OK, response.items[i].error) << i;
+
+        // The old blob needs upgrading, and the new one doesn't.
+        GetKeyCharacteristicsRequest characteristics_request;
+        characteristics_request.SetKeyMaterial(request.items[i].key_blob);
+        GetKeyCharacteristicsResponse characteristics;
+        keymaster.GetKeyCharacteristics(characteristics_request, &characteristics);
+        EXPECT_EQ(KM_ERROR_KEY_REQUIRES_UPGRADE, characteristics.error) << i;
+        characteristics_request.SetKeyMaterial(response.items[i].upgraded_key);
+        keymaster.GetKeyCharacteristics(characteristics_request, &characteristics);
+        ASSERT_EQ(KM_ERROR_OK, characteristics.error) << i;
+        uint32_t patchlevel;
+        EXPECT_TRUE(characteristics.unenforced.GetTagValue(TAG_OS_PATCHLEVEL, &patchlevel));
+        EXPECT_EQ(2U, patchlevel);
+    }
+}
+
+TEST(AndroidKeymasterMigrateKeyTest, MigratesLegacyBlobs) {
+    SoftKeymasterContext* context = new SoftKeymasterContext;
+    AndroidKeymaster keymaster(context, 16);
+    AuthorizationSet app_params(AuthorizationSetBuilder().Authorization(TAG_APPLICATION_ID,
+                                                                        "app_id", 6));
+
+    // An OCB-encrypted keymaster1 software blob and an old softkeymaster blob.
+    for (const char* file_name : {"km1_sw_ecdsa_256.blob", "km0_sw_rsa_512.blob"}) {
+        string legacy_data = read_file(file_name);
+        ASSERT_FALSE(legacy_data.empty()) << file_name;
+        KeymasterKeyBlob legacy_blob(reinterpret_cast<const uint8_t*>(legacy_data.data()),
+                                     legacy_data.size());
+        KeymasterKeyBlob key_material;
+        AuthorizationSet hw_enforced, sw_enforced;
+        bool legacy = false;
+        ASSERT_EQ(KM_ERROR_OK,
+                  context->ParseKeyBlobWithLegacyStatus(legacy_blob, app_params, &key_material,
+                                                        &hw_enforced, &sw_enforced, &legacy))
+            << file_name;
+        EXPECT_TRUE(legacy) << file_name;
+
+        MigrateKeyRequest request;
+        request.SetKeyMaterial(legacy_blob);
+        request.additional_params.Reinitialize(app_params);
+        MigrateKeyResponse response;
+        keymaster.MigrateKey(request, &response);
+        ASSERT_EQ(KM_ERROR_OK, response.error) << file_name;
+        ASSERT_TRUE(response.migrated_key.key_material != nullptr) << file_name;
+
+        // The new blob is current and reads back as the old one did.
+        KeymasterKeyBlob migrated_blob(response.migrated_key);
+        KeymasterKeyBlob migrated_key_material;
+        AuthorizationSet migrated_hw_enforced, migrated_sw_enforced;
+        ASSERT_EQ(KM_ERROR_OK, context->ParseKeyBlobWithLegacyStatus(
+                                   migrated_blob, app_params, &migrated_key_material,
+                                   &migrated_hw_enforced, &migrated_sw_enforced, &legacy))
+            << file_name;
+        EXPECT_FALSE(legacy) << file_name;
+        EXPECT_EQ(hw_enforced, migrated_hw_enforced) << file_name;
+        EXPECT_EQ(sw_enforced, migrated_sw_enforced) << file_name;
+        ASSERT_EQ(key_material.key_material_size, migrated_key_material.key_material_size);
+        EXPECT_EQ(0, memcmp(key_material.key_material, migrated_key_material.key_material,
+                            key_material.key_material_size))
+            << file_name;
+
+        // It's bound to the same application ID.
+        AuthorizationSet discarded_hw_enforced, discarded_sw_enforced;
+        EXPECT_EQ(KM_ERROR_INVALID_KEY_BLOB,
+                  context->ParseKeyCharacteristics(migrated_blob, AuthorizationSet(),
+                                                   &discarded_hw_enforced, &discarded_sw_enforced))
+            << file_name;
+
+        // A current blob is left alone.
+        request.SetKeyMaterial(migrated_blob);
+        MigrateKeyResponse current_response;
+        keymaster.MigrateKey(request, &current_response);
+        ASSERT_EQ(KM_ERROR_OK, current_response.error) << file_name;
+        EXPECT_TRUE(current_response.migrated_key.key_material == nullptr) << file_name;
+    }
+
+    // The migrated EC key still signs.
+    MigrateKeyRequest request;
+    string ec_data = read_file("km1_sw_ecdsa_256.blob");
+    request.SetKeyMaterial(ec_data.data(), ec_data.size());
+    request.additional_params.Reinitialize(app_params);
+    MigrateKeyResponse response;
+    keymaster.MigrateKey(request, &response);
+    ASSERT_EQ(KM_ERROR_OK, response.error);
+    OneShotOperationRequest sign_request;
+    sign_request.purpose = KM_PURPOSE_SIGN;
+    sign_request.SetKeyMaterial(response.migrated_key);
+    sign_request.additional_params.Reinitialize(app_params);
+    sign_request.additional_params.push_back(TAG_DIGEST, KM_DIGEST_NONE);
+    sign_request.input.Reinitialize(string(32, 'a').data(), 32);
+    OneShotOperationResponse sign_response;
+    keymaster.OneShotOperation(sign_request, &sign_response);
+    EXPECT_EQ(KM_ERROR_OK, sign_response.error);
+
+    // Blobs that parse as nothing are reported as such.
+    MigrateKeyRequest garbage_request;
+    garbage_request.SetKeyMaterial("garbage blob", 12);
+    MigrateKeyResponse garbage_response;
+    keymaster.MigrateKey(garbage_request, &garbage_response);
+    EXPECT_EQ(KM_ERROR_INVALID_KEY_BLOB, garbage_response.error);
+}
+
+TEST(AndroidKeymasterBatchCharacteristicsTest, MatchesSingleCalls) {
+    AndroidKeymaster keymaster(new SoftKeymasterContext, 16);
+    const size_t kKeyCount = 3;
+    GenerateKeyResponse keys[kKeyCount];
+    for (size_t i = 0; i < kKeyCount; ++i)
+        GenerateOneShotKey(&keymaster, AuthorizationSetBuilder()
+                                           .HmacKey(128 + 64 * i)
+                                           .Digest(KM_DIGEST_SHA_2_256)
+                                           .Authorization(TAG_MIN_MAC_LENGTH, 128)
+                                           .Authorization(TAG_NO_AUTH_REQUIRED),
+                           &keys[i]);
+
+    // Using the first key caches it, so the batch answers it from the cache and parses the rest.
+    OneShotOperationRequest sign_request;
+    sign_request.purpose = KM_PURPOSE_SIGN;
+    sign_request.SetKeyMaterial(keys[0].key_blob);
+    sign_request.additional_params.push_back(TAG_DIGEST, KM_DIGEST_SHA_2_256);
+    sign_request.additional_params.push_back(TAG_MAC_LENGTH, 256);
+    sign_request.input.Reinitialize("hello", 5);
+    OneShotOperationResponse sign_response;
+    keymaster.OneShotOperation(sign_request, &sign_response);
+    ASSERT_EQ(KM_ERROR_OK, sign_response.error);
+
+    // A corrupt blob fails only its own item.
+    BatchGetKeyCharacteristicsRequest request;
+    ASSERT_TRUE(request.SetItemCount(kKeyCount + 1));
+    for (size_t i = 0; i < kKeyCount; ++i)
+        request.items[i < 1 ? i : i + 1].key_blob = KeymasterKeyBlob(keys[i].key_blob);
+    ASSERT_TRUE(request.items[1].key_blob.Reset(16));
+    memset(request.items[1].key_blob.writable_data(), 0x5A, 16);
+
+    BatchGetKeyCharacteristicsResponse response;
+    keymaster.BatchGetKeyCharacteristics(request, &response);
+    ASSERT_EQ(KM_ERROR_OK, response.error);
+    ASSERT_EQ(kKeyCount + 1, response.item_count);
+    EXPECT_EQ(KM_ERROR_INVALID_KEY_BLOB, response.items[1].error);
+    for (size_t i = 0; i < response.item_count; ++i) {
+        if (i == 1)
+            continue;
+        ASSERT_EQ(KM_ERROR_OK, response.items[i].error) << i;
+
+        GetKeyCharacteristicsRequest single_request;
+        single_request.SetKeyMaterial(request.items[i].key_blob);
+        GetKeyCharacteristicsResponse single;
+        keymaster.GetKeyCharacteristics(single_request, &single);
+        ASSERT_EQ(KM_ERROR_OK, single.error) << i;
+        EXPECT_EQ(single.enforced, response.items[i].enforced) << i;
+        EXPECT_EQ(single.unenforced, response.items[i].unenforced) << i;
+    }
+}
+
+TEST(AndroidKeymasterBatchDeleteTest, DeletesEachBlob) {
+    AndroidKeymaster keymaster(new SoftKeymasterContext, 16);
+    const size_t kKeyCount = 3;
+    GenerateKeyResponse keys[kKeyCount];
+    BatchDeleteKeyRequest request;
+    ASSERT_TRUE(request.SetItemCount(kKeyCount));
+    for (size_t i = 0; i < kKeyCount; ++i) {
+        GenerateOneShotKey(&keymaster, AuthorizationSetBuilder()
+                                           .AesEncryptionKey(128)
+                                           .EcbMode()
+                                           .Padding(KM_PAD_NONE)
+                                           .Authorization(TAG_NO_AUTH_REQUIRED),
+                           &keys[i]);
+        request.items[i].key_blob = KeymasterKeyBlob(keys[i].key_blob);
+    }
+
+    // Software keys have nothing to delete, so each item succeeds.
+    BatchDeleteKeyResponse response;
+    keymaster.BatchDeleteKey(request, &response);
+    ASSERT_EQ(KM_ERROR_OK, response.error);
+    ASSERT_EQ(kKeyCount, response.item_count);
+    for (size_t i = 0; i < response.item_count; ++i)
+        EXPECT_EQ(KM_ERROR_OK, response.items[i].error) << i;
+
+    BatchDeleteKeyRequest empty_request;
+    keymaster.BatchDeleteKey(empty_request, &response);
+    EXPECT_EQ(KM_ERROR_OK, response.error);
+    EXPECT_EQ(0U, response.item_count);
+}
+
+TEST(AndroidKeymasterBatchAttestTest, MatchesSingleCalls) {
+    AndroidKeymaster keymaster(new SoftKeymasterContext, 16);
+    keymaster.set_attestation_thread_count(2);
+    const size_t kKeyCount = 3;
+    GenerateKeyResponse keys[kKeyCount];
+    for (size_t i = 0; i < kKeyCount; ++i)
+        GenerateOneShotKey(&keymaster, AuthorizationSetBuilder()
+                                           .RsaSigningKey(512 + 256 * i, 3)
+                                           .Digest(KM_DIGEST_NONE)
+                                           .Padding(KM_PAD_NONE)
+                                           .Authorization(TAG_NO_AUTH_REQUIRED),
+                           &keys[i]);
+    GenerateKeyResponse aes_key;
+    GenerateOneShotKey(&keymaster, AuthorizationSetBuilder()
+                                       .AesEncryptionKey(128)
+                                       .EcbMode()
+                                       .Padding(KM_PAD_NONE)
+                                       .Authorization(TAG_NO_AUTH_REQUIRED),
+                       &aes_key);
+
+    // A symmetric key and a corrupt blob fail only their own items.
+    BatchAttestKeyRequest request;
+    request.attest_params.push_back(TAG_ATTESTATION_CHALLENGE, "challenge", 9);
+    ASSERT_TRUE(request.SetItemCount(kKeyCount + 2));
+    for (size_t i = 0; i < kKeyCount; ++i)
+        request.items[i < 1 ? i : i + 2].key_blob = KeymasterKeyBlob(keys[i].key_blob);
+    request.items[1].key_blob = KeymasterKeyBlob(aes_key.key_blob);
+    ASSERT_TRUE(request.items[2].key_blob.Reset(16));
+    memset(request.items[2].key_blob.writable_data(), 0x5A, 16);
+
+    BatchAttestKeyResponse response;
+    keymaster.BatchAttestKey(request, &response);
+    ASSERT_EQ(KM_ERROR_OK, response.error);
+    ASSERT_EQ(kKeyCount + 2, response.item_count);
+    EXPECT_EQ(KM_ERROR_INCOMPATIBLE_ALGORITHM, response.items[1].error);
+    EXPECT_EQ(KM_ERROR_INVALID_KEY_BLOB, response.items[2].error);
+    // All the keys are RSA keys, so they share one issuer chain.
+    EXPECT_EQ(1U, response.issuer_chain_count);
+    for (size_t i = 0; i < response.item_count; ++i) {
+        if (i == 1 || i == 2)
+            continue;
+        ASSERT_EQ(KM_ERROR_OK, response.items[i].error) << i;
+
+        AttestKeyRequest single_request;
+        single_request.SetKeyMaterial(request.items[i].key_blob);
+        single_request.attest_params.Reinitialize(request.attest_params);
+        AttestKeyResponse single;
+        keymaster.AttestKey(single_request, &single);
+        ASSERT_EQ(KM_ERROR_OK, single.error) << i;
+
+        keymaster_cert_chain_t chain;
+        ASSERT_TRUE(response.CopyCertificateChain(i, &chain)) << i;
+        ASSERT_EQ(single.certificate_chain.entry_count, chain.entry_count) << i;
+        for (size_t j = 0; j < chain.entry_count; ++j) {
+            ASSERT_EQ(single.certificate_chain.entries[j].data_length,
+                      chain.entries[j].data_length);
+            EXPECT_EQ(0, memcmp(single.certificate_chain.entries[j].data, chain.entries[j].data,
+                                chain.entries[j].data_length))
+                << i << ", " << j;
+        }
+        keymaster_free_cert_chain(&chain);
+    }
+}
+
+TEST(AndroidKeymasterOpenSslErrorTest, FailedRequestsLeaveNoErrors) {
+    AndroidKeymaster keymaster(new SoftKeymasterContext, 16);
+    OpenSslErrorCounts before;
+    GetOpenSslErrorCounts(&before);
+
+    // A DER sequence that isn't a PKCS#8 key fails in OpenSSL.
+    const uint8_t not_a_key[] = {0x30, 0x03, 0x02, 0x01, 0x00};
+    ImportKeyRequest request;
+    request.key_description.Reinitialize(AuthorizationSetBuilder()
+                                             .RsaSigningKey(512, 3)
+                                             .Digest(KM_DIGEST_NONE)
+                                             .Padding(KM_PAD_NONE)
+                                             .build());
+    request.key_format = KM_KEY_FORMAT_PKCS8;
+    request.SetKeyMaterial(not_a_key, sizeof(not_a_key));
+    for (int i = 0; i < 3; ++i) {
+        ImportKeyResponse response;
+        keymaster.ImportKey(request, &response);
+        EXPECT_NE(KM_ERROR_OK, response.error);
+        EXPECT_EQ(0U, ERR_peek_error());
+    }
+
+    OpenSslErrorCounts after;
+    GetOpenSslErrorCounts(&after);
+    EXPECT_LE(before.translated + 3, after.translated);
+    EXPECT_LE(before.discarded + 3, after.discarded);
+}
+
+TEST(AndroidKeymasterOpenSslErrorTest, TrialParsesLeaveNoErrors) {
+    SoftKeymasterContext context;
+    // Old-style software blobs, with the magic, an RSA type, no public key and four bytes of
+    // private key: one that's plainly not DER, and one that's a DER sequence but not a key.
+    const uint8_t blobs[][20] = {
+        {'P', 'K', '#', '8', 0, 0, 0, 6, 0, 0, 0, 0, 0, 0, 0, 4, 'j', 'u', 'n', 'k'},
+        {'P', 'K', '#', '8', 0, 0, 0, 6, 0, 0, 0, 0, 0, 0, 0, 4, 0x30, 0x02, 0x05, 0x00},
+    };
+    for (const auto& bytes : blobs) {
+        KeymasterKeyBlob blob(bytes, sizeof(bytes));
+        KeymasterKeyBlob key_material;
+        AuthorizationSet hw_enforced, sw_enforced;
+        EXPECT_EQ(KM_ERROR_INVALID_KEY_BLOB,
+                  context.ParseKeyBlob(blob, AuthorizationSet(), &key_material, &hw_enforced,
+                                       &sw_enforced));
+        EXPECT_EQ(0U, ERR_peek_error());
+    }
+}
+
+static keymaster_operation_handle_t BeginAes(AndroidKeymaster* keymaster,
+                                             const keymaster_key_blob_t& key_blob,
+                                             keymaster_purpose_t purpose,
+                                             keymaster_block_mode_t block_mode,
+                                             keymaster_padding_t padding, Buffer* nonce) {
+    BeginOperationRequest request;
+    request.purpose = purpose;
+    request.SetKeyMaterial(key_blob);
+    AuthorizationSetBuilder params;
+    params.Authorization(TAG_BLOCK_MODE, block_mode).Padding(padding);
+    if (purpose == KM_PURPOSE_DECRYPT && block_mode != KM_MODE_ECB)
+        params.Authorization(TAG_NONCE, nonce->peek_read(), nonce->available_read());
+    request.additional_params.Reinitialize(AuthorizationSet(params));
+    BeginOperationResponse response;
+    keymaster->BeginOperation(request, &response);
+    EXPECT_EQ(KM_ERROR_OK, response.error);
+    keymaster_blob_t iv;
+    if (purpose == KM_PURPOSE_ENCRYPT && response.output_params.GetTagValue(TAG_NONCE, &iv))
+        nonce->Reinitialize(iv.data, iv.data_length);
+    return response.op_handle;
+}
+
+static keymaster_error_t UpdateAes(AndroidKeymaster* keymaster,
+                                   keymaster_operation_handle_t op_handle, const string& input,
+                                   string* output) {
+    UpdateOperationRequest request;
+    request.op_handle = op_handle;
+    request.input.Reinitialize(input.data(), input.size());
+    UpdateOperationResponse response;
+    keymaster->UpdateOperation(request, &response);
+    output->append(reinterpret_cast<const char*>(response.output.peek_read()),
+                   response.output.available_read());
+    return response.error;
+}
+
+static keymaster_error_t FinishAes(AndroidKeymaster* keymaster,
+                                   keymaster_operation_handle_t op_handle, const string& input,
+                                   string* output) {
+    FinishOperationRequest request;
+    request.op_handle = op_handle;
+    request.input.Reinitialize(input.data(), input.size());
+    FinishOperationResponse response;
+    keymaster->FinishOperation(request, &response);
+    output->append(reinterpret_cast<const char*>(response.output.peek_read()),
+                   response.output.available_read());
+    return response.error;
+}
+
+static keymaster_error_t ExportAes(AndroidKeymaster* keymaster,
+                                   keymaster_operation_handle_t op_handle, Buffer* token) {
+    ExportOperationRequest request;
+    request.op_handle = op_handle;
+    ExportOperationResponse response;
+    keymaster->ExportOperation(request, &response);
+    token->Reinitialize(response.token);
+    return response.error;
+}
+
+static keymaster_error_t ImportAes(AndroidKeymaster* keymaster,
+                                   const keymaster_key_blob_t& key_blob, const Buffer& token,
+                                   keymaster_operation_handle_t* op_handle) {
+    ImportOperationRequest request;
+    request.key_blob = KeymasterKeyBlob(key_blob);
+    request.token.Reinitialize(token);
+    ImportOperationResponse response;
+    keymaster->ImportOperation(request, &response);
+    *op_handle = response.op_handle;
+    return response.error;
+}
+
+static void GenerateMigrationKey(AndroidKeymaster* keymaster, GenerateKeyResponse* key) {
+    GenerateOneShotKey(keymaster, AuthorizationSetBuilder()
+                                      .AesEncryptionKey(128)
+                                      .Authorization(TAG_BLOCK_MODE, KM_MODE_ECB)
+                                      .Authorization(TAG_BLOCK_MODE, KM_MODE_CBC)
+                                      .Authorization(TAG_BLOCK_MODE, KM_MODE_CTR)
+                                      .Padding(KM_PAD_NONE)
+                                      .Padding(KM_PAD_PKCS7)
+                                      .Authorization(TAG_NO_AUTH_REQUIRED),
+                       key);
+}
+
+TEST(AndroidKeymasterOperationMigrationTest, AesCarriesOnElsewhere) {
+    // Two keymasters with the same master key, as shards of one service would have.
+    AndroidKeymaster source(new TestKeymasterContext, 16);
+    AndroidKeymaster destination(new TestKeymasterContext, 16);
+    source.set_operation_migration(true);
+    destination.set_operation_migration(true);
+    GenerateKeyResponse key;
+    GenerateMigrationKey(&source, &key);
+
+    struct {
+        keymaster_block_mode_t block_mode;
+        keymaster_padding_t padding;
+        size_t length;
+        size_t split;
+    } cases[] = {
+        {KM_MODE_CTR, KM_PAD_NONE, 100, 37}, {KM_MODE_CTR, KM_PAD_NONE, 100, 0},
+        {KM_MODE_CBC, KM_PAD_PKCS7, 100, 32}, {KM_MODE_CBC, KM_PAD_PKCS7, 100, 16},
+        {KM_MODE_CBC, KM_PAD_NONE, 64, 16},   {KM_MODE_ECB, KM_PAD_PKCS7, 70, 48},
+        {KM_MODE_ECB, KM_PAD_NONE, 64, 48},
+    };
+    string message(100, 'x');
+    for (size_t i = 0; i < message.size(); ++i)
+        message[i] = static_cast<char>(i * 7);
+
+    for (auto& c : cases) {
+        SCOPED_TRACE(c.block_mode);
+        SCOPED_TRACE(c.split);
+        string plaintext = message.substr(0, c.length);
+
+        // Encrypt the first part on the source and the rest on the destination...
+        Buffer nonce, token;
+        string ciphertext;
+        keymaster_operation_handle_t op_handle =
+            BeginAes(&source, key.key_blob, KM_PURPOSE_ENCRYPT, c.block_mode, c.padding, &nonce);
+        ASSERT_EQ(KM_ERROR_OK,
+                  UpdateAes(&source, op_handle, plaintext.substr(0, c.split), &ciphertext));
+        ASSERT_EQ(KM_ERROR_OK, ExportAes(&source, op_handle, &token));
+        EXPECT_FALSE(source.has_operation(op_handle));
+        ASSERT_EQ(KM_ERROR_OK, ImportAes(&destination, key.key_blob, token, &op_handle));
+        ASSERT_EQ(KM_ERROR_OK,
+                  FinishAes(&destination, op_handle, plaintext.substr(c.split), &ciphertext));
+
+        // ...and decrypt the same way, which gives back the plaintext only if both halves were
+        // right.
+        string decrypted;
+        op_handle =
+            BeginAes(&source, key.key_blob, KM_PURPOSE_DECRYPT, c.block_mode, c.padding, &nonce);
+        ASSERT_EQ(KM_ERROR_OK,
+                  UpdateAes(&source, op_handle, ciphertext.substr(0, c.split), &decrypted));
+        ASSERT_EQ(KM_ERROR_OK, ExportAes(&source, op_handle, &token));
+        ASSERT_EQ(KM_ERROR_OK, ImportAes(&destination, key.key_blob, token, &op_handle));
+        ASSERT_EQ(KM_ERROR_OK,
+                  FinishAes(&destination, op_handle, ciphertext.substr(c.split), &decrypted));
+        EXPECT_EQ(plaintext, decrypted);
+    }
+}
+
+TEST(AndroidKeymasterOperationMigrationTest, RefusesWhatItCantCarry) {
+    AndroidKeymaster keymaster(new TestKeymasterContext, 16);
+    GenerateKeyResponse key;
+    GenerateMigrationKey(&keymaster, &key);
+
+    // Disabled by default.
+    Buffer nonce, token;
+    string output;
+    keymaster_operation_handle_t op_handle =
+        BeginAes(&keymaster, key.key_blob, KM_PURPOSE_ENCRYPT, KM_MODE_CTR, KM_PAD_NONE, &nonce);
+    EXPECT_EQ(KM_ERROR_UNIMPLEMENTED, ExportAes(&keymaster, op_handle, &token));
+    EXPECT_TRUE(keymaster.has_operation(op_handle));
+    keymaster.set_operation_migration(true);
+
+    // A CBC operation part way through a block stays where it is, and carries on.
+    op_handle =
+        BeginAes(&keymaster, key.key_blob, KM_PURPOSE_ENCRYPT, KM_MODE_CBC, KM_PAD_PKCS7, &nonce);
+    ASSERT_EQ(KM_ERROR_OK, UpdateAes(&keymaster, op_handle, "12345", &output));
+    EXPECT_EQ(KM_ERROR_INVALID_INPUT_LENGTH, ExportAes(&keymaster, op_handle, &token));
+    EXPECT_EQ(KM_ERROR_OK, UpdateAes(&keymaster, op_handle, "67890123456", &output));
+    EXPECT_EQ(KM_ERROR_OK, ExportAes(&keymaster, op_handle, &token));
+
+    // Tokens are authenticated, and bound to their key.
+    ASSERT_GT(token.available_read(), 0U);
+    Buffer tampered;
+    tampered.Reinitialize(token);
+    tampered.peek_write()[-1] ^= 1;
+    EXPECT_EQ(KM_ERROR_INVALID_ARGUMENT, ImportAes(&keymaster, key.key_blob, tampered, &op_handle));
+    GenerateKeyResponse other_key;
+    GenerateMigrationKey(&keymaster, &other_key);
+    EXPECT_EQ(KM_ERROR_INVALID_KEY_BLOB,
+              ImportAes(&keymaster, other_key.key_blob, token, &op_handle));
+    EXPECT_EQ(KM_ERROR_OK, ImportAes(&keymaster, key.key_blob, token, &op_handle));
+
+    // HMAC state can't be captured, so the operation stays usable.
+    GenerateKeyResponse hmac_key;
+    GenerateOneShotKey(&keymaster, AuthorizationSetBuilder()
+                                       .HmacKey(128)
+                                       .Digest(KM_DIGEST_SHA_2_256)
+                                       .Authorization(TAG_MIN_MAC_LENGTH, 128)
+                                       .Authorization(TAG_NO_AUTH_REQUIRED),
+                       &hmac_key);
+    ASSERT_EQ(KM_ERROR_OK, BeginHmacSign(&keymaster, hmac_key.key_blob, &op_handle));
+    EXPECT_EQ(KM_ERROR_UNIMPLEMENTED, ExportAes(&keymaster, op_handle, &token));
+    EXPECT_EQ(KM_ERROR_OK, UpdateAes(&keymaster, op_handle, "data", &output));
+}
+
+TEST(AndroidKeymasterOperationMigrationTest, TokensAreSingleUseAndBoundToTheirKey) {
+    // SoftKeymasterContext has no enforcement policy, and so no key IDs, but tokens are bound to
+    // their keys all the same.
+    KeymasterContext* contexts[] = {new TestKeymasterContext, new SoftKeymasterContext};
+    for (KeymasterContext* context : contexts) {
+        AndroidKeymaster keymaster(context, 16);
+        keymaster.set_operation_migration(true);
+        GenerateKeyResponse key, other_key;
+        GenerateMigrationKey(&keymaster, &key);
+        GenerateMigrationKey(&keymaster, &other_key);
+
+        Buffer nonce, token;
+        string ciphertext;
+        keymaster_operation_handle_t op_handle = BeginAes(
+            &keymaster, key.key_blob, KM_PURPOSE_ENCRYPT, KM_MODE_CTR, KM_PAD_NONE, &nonce);
+        ASSERT_EQ(KM_ERROR_OK, UpdateAes(&keymaster, op_handle, "12345", &ciphertext));
+        ASSERT_EQ(KM_ERROR_OK, ExportAes(&keymaster, op_handle, &token));
+        EXPECT_FALSE(keymaster.has_operation(op_handle));
+        EXPECT_EQ(KM_ERROR_INVALID_OPERATION_HANDLE,
+                  UpdateAes(&keymaster, op_handle, "67890", &ciphertext));
+
+        EXPECT_EQ(KM_ERROR_INVALID_KEY_BLOB,
+                  ImportAes(&keymaster, other_key.key_blob, token, &op_handle));
+        ASSERT_EQ(KM_ERROR_OK, ImportAes(&keymaster, key.key_blob, token, &op_handle));
+        keymaster_operation_handle_t replayed;
+        EXPECT_EQ(KM_ERROR_INVALID_ARGUMENT,
+                  ImportAes(&keymaster, key.key_blob, token, &replayed));
+        ASSERT_EQ(KM_ERROR_OK, FinishAes(&keymaster, op_handle, "67890", &ciphertext));
+
+        // Another export of the imported operation gives a token of its own.
+        op_handle = BeginAes(&keymaster, key.key_blob, KM_PURPOSE_ENCRYPT, KM_MODE_CTR, KM_PAD_NONE,
+                             &nonce);
+        ASSERT_EQ(KM_ERROR_OK, ExportAes(&keymaster, op_handle, &token));
+        ASSERT_EQ(KM_ERROR_OK, ImportAes(&keymaster, key.key_blob, token, &op_handle));
+        ASSERT_EQ(KM_ERROR_OK, ExportAes(&keymaster, op_handle, &token));
+        ASSERT_EQ(KM_ERROR_OK, ImportAes(&keymaster, key.key_blob, token, &op_handle));
+        EXPECT_EQ(KM_ERROR_INVALID_ARGUMENT,
+                  ImportAes(&keymaster, key.key_blob, token, &replayed));
+    }
+}
+
+TEST(AndroidKeymasterOperationMigrationTest, TokensAreSingleUsePerSealingDomain) {
+    AndroidKeymaster source(new TestKeymasterContext, 16);
+    AndroidKeymaster destination(new TestKeymasterContext, 16);
+    AndroidKeymaster sibling(new TestKeymasterContext, 16);
+    AndroidKeymaster outsider(new TestKeymasterContext, 16);
+    for (AndroidKeymaster* keymaster : {&source, &destination, &sibling, &outsider})
+        keymaster->set_operation_migration(true);
+    sibling.ShareImportedTokens(destination);
+    GenerateKeyResponse key;
+    GenerateMigrationKey(&source, &key);
+
+    Buffer nonce, token;
+    keymaster_operation_handle_t op_handle =
+        BeginAes(&source, key.key_blob, KM_PURPOSE_ENCRYPT, KM_MODE_CTR, KM_PAD_NONE, &nonce);
+    ASSERT_EQ(KM_ERROR_OK, ExportAes(&source, op_handle, &token));
+    ASSERT_EQ(KM_ERROR_OK, ImportAes(&destination, key.key_blob, token, &op_handle));
+    EXPECT_EQ(KM_ERROR_INVALID_ARGUMENT, ImportAes(&sibling, key.key_blob, token, &op_handle));
+
+    // A keymaster outside the domain keeps its own record.
+    EXPECT_EQ(KM_ERROR_OK, ImportAes(&outsider, key.key_blob, token, &op_handle));
+}
+
+/**
+ * Variant of TestKeymasterContext whose wall clock reads *now.
+ */
+class WallClockKeymasterContext : public TestKeymasterContext {
+  public:
+    explicit WallClockKeymasterContext(const uint64_t* now) : now_(now) {}
+
+    uint64_t GetWallClockSeconds() override { return *now_; }
+
+  private:
+    const uint64_t* now_;
+};
+
+TEST(AndroidKeymasterOperationMigrationTest, TokensExpire) {
+    uint64_t now = 1000;
+    AndroidKeymaster source(new WallClockKeymasterContext(&now), 16);
+    AndroidKeymaster destination(new WallClockKeymasterContext(&now), 16);
+    source.set_operation_migration(true);
+    destination.set_operation_migration(true);
+    source.set_operation_token_max_age(60);
+    GenerateKeyResponse key;
+    GenerateMigrationKey(&source, &key);
+
+    Buffer nonce, fresh, stale, early;
+    keymaster_operation_handle_t op_handle;
+    for (Buffer* token : {&fresh, &stale}) {
+        op_handle =
+            BeginAes(&source, key.key_blob, KM_PURPOSE_ENCRYPT, KM_MODE_CTR, KM_PAD_NONE, &nonce);
+        ASSERT_EQ(KM_ERROR_OK, ExportAes(&source, op_handle, token));
+    }
+    now = 1200;
+    op_handle =
+        BeginAes(&source, key.key_blob, KM_PURPOSE_ENCRYPT, KM_MODE_CTR, KM_PAD_NONE, &nonce);
+    ASSERT_EQ(KM_ERROR_OK, ExportAes(&source, op_handle, &early));
+
+    // The age is checked against the importer's clock, in both directions.
+    now = 1060;
+    EXPECT_EQ(KM_ERROR_OK, ImportAes(&destination, key.key_blob, fresh, &op_handle));
+    EXPECT_EQ(KM_ERROR_INVALID_ARGUMENT, ImportAes(&destination, key.key_blob, early, &op_handle));
+    now = 1061;
+    EXPECT_EQ(KM_ERROR_INVALID_ARGUMENT, ImportAes(&destination, key.key_blob, stale, &op_handle));
+}
+
+TEST(AndroidKeymasterChunkSizeTest, BeginSuggestsChunkSizes) {
+    AndroidKeymaster keymaster(new TestKeymasterContext, 16);
+    GenerateKeyResponse aes_key;
+    GenerateMigrationKey(&keymaster, &aes_key);
+    GenerateKeyResponse rsa_key;
+    GenerateOneShotKey(&keymaster, AuthorizationSetBuilder()
+                                       .RsaEncryptionKey(512, 65537)
+                                       .Padding(KM_PAD_NONE)
+                                       .Authorization(TAG_NO_AUTH_REQUIRED),
+                       &rsa_key);
+
+    BeginOperationRequest aes_begin;
+    aes_begin.purpose = KM_PURPOSE_ENCRYPT;
+    aes_begin.SetKeyMaterial(aes_key.key_blob);
+    aes_begin.additional_params.Reinitialize(AuthorizationSet(
+        AuthorizationSetBuilder().Authorization(TAG_BLOCK_MODE, KM_MODE_CTR).Padding(KM_PAD_NONE)));
+    BeginOperationRequest rsa_begin;
+    rsa_begin.purpose = KM_PURPOSE_ENCRYPT;
+    rsa_begin.SetKeyMaterial(rsa_key.key_blob);
+    rsa_begin.additional_params.Reinitialize(
+        AuthorizationSet(AuthorizationSetBuilder().Padding(KM_PAD_NONE)));
+
+    // Disabled, Begin says nothing.
+    BeginOperationResponse response;
+    keymaster.BeginOperation(aes_begin, &response);
+    ASSERT_EQ(KM_ERROR_OK, response.error);
+    EXPECT_EQ(-1, response.output_params.find(TAG_PREFERRED_CHUNK_SIZE));
+
+    keymaster.set_chunk_size_hints(true);
+    uint32_t preferred, max_chunk_size;
+    keymaster.BeginOperation(aes_begin, &response);
+    ASSERT_EQ(KM_ERROR_OK, response.error);
+    ASSERT_TRUE(response.output_params.GetTagValue(TAG_PREFERRED_CHUNK_SIZE, &preferred));
+    EXPECT_EQ(16384U, preferred);
+    EXPECT_FALSE(response.output_params.GetTagValue(TAG_MAX_CHUNK_SIZE, &max_chunk_size));
+
+    // RSA takes at most one modulus.
+    BeginOperationResponse rsa_response;
+    keymaster.BeginOperation(rsa_begin, &rsa_response);
+    ASSERT_EQ(KM_ERROR_OK, rsa_response.error);
+    ASSERT_TRUE(rsa_response.output_params.GetTagValue(TAG_PREFERRED_CHUNK_SIZE, &preferred));
+    EXPECT_EQ(64U, preferred);
+    ASSERT_TRUE(rsa_response.output_params.GetTagValue(TAG_MAX_CHUNK_SIZE, &max_chunk_size));
+    EXPECT_EQ(64U, max_chunk_size);
+
+    // Once updates have been timed the advice comes from their costs, whatever they were.
+    string ciphertext;
+    for (size_t i = 0; i < 4 * ChunkSizeAdvisor::kMinSamples; ++i)
+        ASSERT_EQ(KM_ERROR_OK, UpdateAes(&keymaster, response.op_handle,
+                                         string(1024 * (i % 8 + 1), 'x'), &ciphertext));
+    keymaster.BeginOperation(aes_begin, &response);
+    ASSERT_EQ(KM_ERROR_OK, response.error);
+    ASSERT_TRUE(response.output_params.GetTagValue(TAG_PREFERRED_CHUNK_SIZE, &preferred));
+    EXPECT_LE(ChunkSizeAdvisor::kMinChunkSize, preferred);
+    EXPECT_GE(ChunkSizeAdvisor::kMaxChunkSize, preferred);
+    EXPECT_EQ(0U, preferred & (preferred - 1));
+}
+
+TEST(AndroidKeymasterBatchGenerateTest, GeneratesEachKey) {
+    AndroidKeymaster keymaster(new SoftKeymasterContext, 16);
+    keymaster.set_generation_thread_count(3);
+
+    // Mixed algorithms, with one bad description in the middle that fails only its own item.
+    AuthorizationSet descriptions[] = {
+        AuthorizationSetBuilder()
+            .EcdsaSigningKey(256)
+            .Digest(KM_DIGEST_NONE)
+            .Authorization(TAG_NO_AUTH_REQUIRED)
+            .build(),
+        AuthorizationSetBuilder()
+            .RsaSigningKey(512, 3)
+            .Digest(KM_DIGEST_NONE)
+            .Padding(KM_PAD_NONE)
+            .Authorization(TAG_NO_AUTH_REQUIRED)
+            .build(),
+        AuthorizationSetBuilder().Authorization(TAG_KEY_SIZE, 128).build(),
+        AuthorizationSetBuilder()
+            .AesEncryptionKey(128)
+            .EcbMode()
+            .Padding(KM_PAD_NONE)
+            .Authorization(TAG_NO_AUTH_REQUIRED)
+            .build(),
+        AuthorizationSetBuilder()
+            .EcdsaSigningKey(256)
+            .Digest(KM_DIGEST_NONE)
+            .Authorization(TAG_NO_AUTH_REQUIRED)
+            .build(),
+    };
+    GenerateKeysRequest request;
+    ASSERT_TRUE(request.SetItemCount(array_length(descriptions)));
+    for (size_t i = 0; i < request.item_count; ++i)
+        request.items[i].key_description = descriptions[i];
+
+    GenerateKeysResponse response;
+    keymaster.GenerateKeys(request, &response);
+    ASSERT_EQ(KM_ERROR_OK, response.error);
+    ASSERT_EQ(5U, response.item_count);
+    EXPECT_EQ(KM_ERROR_UNSUPPORTED_ALGORITHM, response.items[2].error);
+    for (size_t i = 0; i < response.item_count; ++i) {
+        if (i == 2)
+            continue;
+        ASSERT_EQ(KM_ERROR_OK, response.items[i].error) << i;
+
+        GetKeyCharacteristicsRequest characteristics_request;
+        characteristics_request.SetKeyMaterial(response.items[i].key_blob);
+        GetKeyCharacteristicsResponse characteristics;
+        keymaster.GetKeyCharacteristics(characteristics_request, &characteristics);
+        ASSERT_EQ(KM_ERROR_OK, characteristics.error) << i;
+        EXPECT_EQ(response.items[i].unenforced, characteristics.unenforced) << i;
+    }
+    // The two EC keys are distinct.
+    EXPECT_FALSE(response.items[0].key_blob.key_material_size ==
+                     response.items[4].key_blob.key_material_size &&
+                 memcmp(response.items[0].key_blob.key_material,
+                        response.items[4].key_blob.key_material,
+                        response.items[0].key_blob.key_material_size) == 0);
+}
+
+TEST(AndroidKeymasterUpgradeOnUseTest, UpgradesStaleBlobs) {
+    SoftKeymasterContext* context = new SoftKeymasterContext;
+    AndroidKeymaster keymaster(context, 16);
+    context->SetSystemVersion(1, 1);
+    GenerateKeyResponse key;
+    GenerateOneShotKey(&keymaster, AuthorizationSetBuilder()
+                                       .HmacKey(128)
+                                       .Digest(KM_DIGEST_SHA_2_256)
+                                       .Authorization(TAG_MIN_MAC_LENGTH, 128)
+                                       .Authorization(TAG_NO_AUTH_REQUIRED),
+                       &key);
+    context->SetSystemVersion(1, 2);
+
+    OneShotOperationRequest sign_request;
+    sign_request.purpose = KM_PURPOSE_SIGN;
+    sign_request.SetKeyMaterial(key.key_blob);
+    sign_request.additional_params.Reinitialize(AuthorizationSet(
+        AuthorizationSetBuilder().Digest(KM_DIGEST_SHA_2_256).Authorization(TAG_MAC_LENGTH, 256)));
+    sign_request.input.Reinitialize("hello", 5);
+    OneShotOperationResponse sign_response;
+    keymaster.OneShotOperation(sign_request, &sign_response);
+    EXPECT_EQ(KM_ERROR_KEY_REQUIRES_UPGRADE, sign_response.error);
+
+    keymaster.set_upgrade_keys_on_use(true);
+    keymaster.OneShotOperation(sign_request, &sign_response);
+    ASSERT_EQ(KM_ERROR_OK, sign_response.error);
+    EXPECT_EQ(32U, sign_response.output.available_read());
+    keymaster_blob_t upgraded;
+    ASSERT_TRUE(sign_response.output_params.GetTagValue(TAG_UPGRADED_KEY_BLOB, &upgraded));
+
+    GetKeyCharacteristicsRequest characteristics_request;
+    characteristics_request.SetKeyMaterial(upgraded.data, upgraded.data_length);
+    GetKeyCharacteristicsResponse characteristics;
+    keymaster.GetKeyCharacteristics(characteristics_request, &characteristics);
+    ASSERT_EQ(KM_ERROR_OK, characteristics.error);
+    uint32_t patchlevel;
+    EXPECT_TRUE(characteristics.unenforced.GetTagValue(TAG_OS_PATCHLEVEL, &patchlevel));
+    EXPECT_EQ(2U, patchlevel);
+
+    // Begin upgrades the old blob too, and the upgraded one is used as it is.
+    BeginOperationRequest begin_request;
+    begin_request.purpose = KM_PURPOSE_SIGN;
+    begin_request.SetKeyMaterial(key.key_blob);
+    begin_request.additional_params.Reinitialize(sign_request.additional_params);
+    BeginOperationResponse begin_response;
+    keymaster.BeginOperation(begin_request, &begin_response);
+    ASSERT_EQ(KM_ERROR_OK, begin_response.error);
+    EXPECT_TRUE(begin_response.output_params.Contains(TAG_UPGRADED_KEY_BLOB));
+
+    begin_request.SetKeyMaterial(upgraded.data, upgraded.data_length);
+    keymaster.BeginOperation(begin_request, &begin_response);
+    ASSERT_EQ(KM_ERROR_OK, begin_response.error);
+    EXPECT_FALSE(begin_response.output_params.Contains(TAG_UPGRADED_KEY_BLOB));
+}
+
+// Records the input of each fake operation, and finishes it by returning the input reversed.
+static std::mutex fake_device_mutex;
+static std::map<keymaster_operation_handle_t, string> fake_device_inputs;
+static vector<keymaster_operation_handle_t> fake_device_finished;
+
+static keymaster_error_t FakeUpdate(const keymaster1_device_t* /* dev */,
+                                    keymaster_operation_handle_t handle,
+                                    const keymaster_key_param_set_t* /* in_params */,
+                                    const keymaster_blob_t* input, size_t* input_consumed,
+                                    keymaster_key_param_set_t* /* out_params */,
+                                    keymaster_blob_t* /* output */) {
+    std::lock_guard<std::mutex> lock(fake_device_mutex);
+    fake_device_inputs[handle].assign(reinterpret_cast<const char*>(input->data),
+                                      input->data_length);
+    *input_consumed = input->data_length;
+    return KM_ERROR_OK;
+}
+
+static keymaster_error_t FakeFinish(const keymaster1_device_t* /* dev */,
+                                    keymaster_operation_handle_t handle,
+                                    const keymaster_key_param_set_t* /* in_params */,
+                                    const keymaster_blob_t* /* signature */,
+                                    keymaster_key_param_set_t* /* out_params */,
+                                    keymaster_blob_t* output) {
+    std::lock_guard<std::mutex> lock(fake_device_mutex);
+    const string& input = fake_device_inputs[handle];
+    uint8_t* data = reinterpret_cast<uint8_t*>(malloc(input.size()));
+    std::reverse_copy(input.begin(), input.end(), data);
+    output->data = data;
+    output->data_length = input.size();
+    fake_device_finished.push_back(handle);
+    return KM_ERROR_OK;
+}
+
+TEST(Keymaster1RequestQueueTest, CompletesInSubmissionOrder) {
+    keymaster1_device_t device;
+    memset(&device, 0, sizeof(device));
+    device.update = FakeUpdate;
+    device.finish = FakeFinish;
+    fake_device_inputs.clear();
+    fake_device_finished.clear();
+
+    AuthorizationSet finish_params;
+    vector<string> inputs;
+    for (int i = 0; i < 8; ++i)
+        inputs.push_back(string("request ") + static_cast<char>('0' + i));
+    std::mutex results_mutex;
+    vector<string> results;
+    {
+        Keymaster1RequestQueue queue(&device);
+        for (size_t i = 0; i < inputs.size(); ++i) {
+            keymaster_blob_t input = {reinterpret_cast<const uint8_t*>(inputs[i].data()),
+                                      inputs[i].size()};
+            queue.Submit(i + 1, &finish_params, input,
+                         [&](keymaster_error_t error, const keymaster_blob_t& output) {
+                             EXPECT_EQ(KM_ERROR_OK, error);
+                             std::lock_guard<std::mutex> lock(results_mutex);
+                             results.push_back(
+                                 string(reinterpret_cast<const char*>(output.data),
+                                        output.data_length));
+                             free(const_cast<uint8_t*>(output.data));
+                         });
+        }
+
+        // A waiting caller is queued behind the requests already submitted.
+        keymaster_blob_t input = {reinterpret_cast<const uint8_t*>("abc"), 3};
+        keymaster_blob_t output;
+        ASSERT_EQ(KM_ERROR_OK, queue.Finish(100, &finish_params, input, &output));
+        EXPECT_EQ("cba", string(reinterpret_cast<const char*>(output.data), output.data_length));
+        free(const_cast<uint8_t*>(output.data));
+        EXPECT_EQ(0U, queue.pending());
+
+        // Requests without an operation never reach the device.
+        EXPECT_EQ(KM_ERROR_UNKNOWN_ERROR, queue.Finish(0, &finish_params, input, &output));
+    }
+
+    ASSERT_EQ(inputs.size(), results.size());
+    for (size_t i = 0; i < inputs.size(); ++i) {
+        EXPECT_EQ(string(inputs[i].rbegin(), inputs[i].rend()), results[i]);
+        EXPECT_EQ(i + 1, fake_device_finished[i]);
+    }
+    EXPECT_EQ(inputs.size() + 1, fake_device_finished.size());
+
+    // Without a keymaster1 device there's nothing to queue.
+    SoftKeymasterContext context;
+    EXPECT_EQ(KM_ERROR_UNIMPLEMENTED, context.EnableKeymaster1RequestQueue());
+}
+
+TEST(HardwarePublicKeyCacheTest, FindInsertInvalidate) {
+    HardwarePublicKeyCache cache(2 /* max_entries */);
+    uint8_t blob_bytes[3][4] = {{1, 2, 3, 4}, {5, 6, 7, 8}, {9, 10, 11, 12}};
+    HardwarePublicKeyCache::Lookup lookups[3];
+    for (int i = 0; i < 3; ++i) {
+        keymaster_key_blob_t blob = {blob_bytes[i], sizeof(blob_bytes[i])};
+        LoadedKeyCache::ComputeLookup(blob, AuthorizationSet(), &lookups[i]);
+    }
+    HardwarePublicKeyCache::Lookup with_app_id;
+    keymaster_key_blob_t blob = {blob_bytes[0], sizeof(blob_bytes[0])};
+    LoadedKeyCache::ComputeLookup(blob, AuthorizationSet(AuthorizationSetBuilder().Authorization(
+                                            TAG_APPLICATION_ID, "app", 3)),
+                                  &with_app_id);
+
+    EVP_PKEY_Ptr keys[3];
+    for (auto& key : keys) {
+        key.reset(EVP_PKEY_new());
+        ASSERT_TRUE(key.get() != nullptr);
+    }
+    EXPECT_TRUE(cache.Find(lookups[0]) == nullptr);
+    cache.Insert(lookups[0], keys[0].get());
+    cache.Insert(lookups[1], keys[1].get());
+    EVP_PKEY_Ptr found(cache.Find(lookups[0]));
+    EXPECT_EQ(keys[0].get(), found.get());
+    EXPECT_TRUE(cache.Find(with_app_id) == nullptr);
+
+    // The least recently used entry goes first.
+    cache.Insert(lookups[2], keys[2].get());
+    EXPECT_EQ(2U, cache.entry_count());
+    EXPECT_TRUE(cache.Find(lookups[1]) == nullptr);
+    found.reset(cache.Find(lookups[2]));
+    EXPECT_EQ(keys[2].get(), found.get());
+
+    // Invalidation drops every entry for the blob, whatever its parameters.
+    cache.Insert(with_app_id, keys[0].get());
+    cache.Invalidate(lookups[0].blob_digest);
+    EXPECT_TRUE(cache.Find(lookups[0]) == nullptr);
+    EXPECT_TRUE(cache.Find(with_app_id) == nullptr);
+    EXPECT_EQ(1U, cache.entry_count());
+    cache.Clear();
+    EXPECT_EQ(0U, cache.entry_count());
+}
+
+TEST(SoftKeymasterContextTest, AttestationMaterialIsShared) {
+    SoftKeymasterContext context;
+    keymaster_algorithm_t algorithms[] = {KM_ALGORITHM_RSA, KM_ALGORITHM_EC};
+    for (keymaster_algorithm_t algorithm : algorithms) {
+        keymaster_error_t error;
+        EVP_PKEY_Ptr key(context.AttestationKey(algorithm, &error));
+        ASSERT_TRUE(key.get() != nullptr);
+        EVP_PKEY_Ptr key_again(context.AttestationKey(algorithm, &error));
+        EXPECT_EQ(key.get(), key_again.get());
+
+        X509_Ptr cert(context.AttestationSigningCertificate(algorithm, &error));
+        ASSERT_EQ(KM_ERROR_OK, error);
+        X509_Ptr cert_again(context.AttestationSigningCertificate(algorithm, &error));
+        EXPECT_EQ(cert.get(), cert_again.get());
+
+        // The cached certificate is the first one in the chain, and certifies the cached key.
+        UniquePtr<keymaster_cert_chain_t, CertificateChainDelete> chain(
+            context.AttestationChain(algorithm, &error));
+        ASSERT_TRUE(chain.get() != nullptr);
+        X509_Ptr chain_cert(parse_cert_blob(chain->entries[0]));
+        ASSERT_TRUE(chain_cert.get() != nullptr);
+        EXPECT_EQ(0, X509_cmp(cert.get(), chain_cert.get()));
+        EVP_PKEY_Ptr cert_key(X509_get_pubkey(cert.get()));
+        EXPECT_EQ(1, EVP_PKEY_cmp(cert_key.get(), key.get()));
+    }
+
+    keymaster_error_t error;
+    EXPECT_TRUE(context.AttestationSigningCertificate(KM_ALGORITHM_AES, &error) == nullptr);
+    EXPECT_EQ(KM_ERROR_UNSUPPORTED_ALGORITHM, error);
+}
+
+TEST(SoftKeymasterContextTest, ProvisionedAttestationBundle) {
+    TempFile file("attestation_bundle");
+    ASSERT_TRUE(file.created());
+
+    // Provision the compiled-in RSA key with a chain of just its root certificate.
+    SoftKeymasterContext built_in_context;
+    keymaster_error_t error;
+    EVP_PKEY_Ptr rsa_key(built_in_context.AttestationKey(KM_ALGORITHM_RSA, &error));
+    ASSERT_TRUE(rsa_key.get() != nullptr);
+    UniquePtr<keymaster_cert_chain_t, CertificateChainDelete> built_in_chain(
+        built_in_context.AttestationChain(KM_ALGORITHM_RSA, &error));
+    ASSERT_TRUE(built_in_chain.get() != nullptr);
+    ASSERT_EQ(2U, built_in_chain->entry_count);
+    const keymaster_blob_t& root_cert = built_in_chain->entries[1];
+    int key_length = i2d_PrivateKey(rsa_key.get(), nullptr);
+    ASSERT_GT(key_length, 0);
+    UniquePtr<uint8_t[]> key_der(new uint8_t[key_length]);
+    uint8_t* p = key_der.get();
+    ASSERT_EQ(key_length, i2d_PrivateKey(rsa_key.get(), &p));
+    AttestationBundle::Entry entries[] = {
+        {KM_ALGORITHM_RSA, AttestationBundle::kKey, {key_der.get(), size_t(key_length)}},
+        {KM_ALGORITHM_RSA, AttestationBundle::kCertificate, root_cert},
+    };
+    ASSERT_EQ(KM_ERROR_OK, AttestationBundle::Write(file.path(), entries, array_length(entries)));
+
+    SoftKeymasterContext context;
+    EXPECT_EQ(KM_ERROR_UNKNOWN_ERROR, context.SetAttestationBundle("/nonexistent/bundle"));
+    ASSERT_EQ(KM_ERROR_OK, context.SetAttestationBundle(file.path()));
+
+    UniquePtr<keymaster_cert_chain_t, CertificateChainDelete> chain(
+        context.AttestationChain(KM_ALGORITHM_RSA, &error));
+    ASSERT_TRUE(chain.get() != nullptr);
+    ASSERT_EQ(1U, chain->entry_count);
+    ASSERT_EQ(root_cert.data_length, chain->entries[0].data_length);
+    EXPECT_EQ(0, memcmp(root_cert.data, chain->entries[0].data, root_cert.data_length));
+    EVP_PKEY_Ptr key(context.AttestationKey(KM_ALGORITHM_RSA, &error));
+    ASSERT_TRUE(key.get() != nullptr);
+    EXPECT_EQ(1, EVP_PKEY_cmp(rsa_key.get(), key.get()));
+    X509_Ptr cert(context.AttestationSigningCertificate(KM_ALGORITHM_RSA, &error));
+    ASSERT_EQ(KM_ERROR_OK, error);
+    X509_Ptr expected_cert(parse_cert_blob(root_cert));
+    EXPECT_EQ(0, X509_cmp(expected_cert.get(), cert.get()));
+
+    // The bundle has nothing for EC, which falls back to the compiled-in chain.
+    chain.reset(context.AttestationChain(KM_ALGORITHM_EC, &error));
+    ASSERT_TRUE(chain.get() != nullptr);
+    EXPECT_EQ(2U, chain->entry_count);
+}
+
+TEST(SoftKeymasterContextTest, OperationFactoryTable) {
+    SoftKeymasterContext context;
+    keymaster_algorithm_t algorithms[] = {
+        KM_ALGORITHM_RSA, KM_ALGORITHM_EC, KM_ALGORITHM_AES, KM_ALGORITHM_HMAC,
+        KM_ALGORITHM_CHACHA20_POLY1305, KM_ALGORITHM_ED25519};
+    keymaster_purpose_t purposes[] = {KM_PURPOSE_ENCRYPT, KM_PURPOSE_DECRYPT, KM_PURPOSE_SIGN,
+                                      KM_PURPOSE_VERIFY, KM_PURPOSE_DERIVE_KEY};
+    for (keymaster_algorithm_t algorithm : algorithms) {
+        KeyFactory* key_factory = context.GetKeyFactory(algorithm);
+        ASSERT_TRUE(key_factory != nullptr);
+        for (keymaster_purpose_t purpose : purposes)
+            EXPECT_EQ(key_factory->GetOperationFactory(purpose),
+                      context.GetOperationFactory(algorithm, purpose));
+    }
+
+    EXPECT_TRUE(context.GetOperationFactory(KM_ALGORITHM_AES, KM_PURPOSE_ENCRYPT) != nullptr);
+    EXPECT_TRUE(context.GetOperationFactory(KM_ALGORITHM_AES, KM_PURPOSE_SIGN) == nullptr);
+    EXPECT_TRUE(context.GetOperationFactory(static_cast<keymaster_algorithm_t>(2),
+                                            KM_PURPOSE_SIGN) == nullptr);
+    EXPECT_TRUE(context.GetOperationFactory(KM_ALGORITHM_AES,
+                                            static_cast<keymaster_purpose_t>(100)) == nullptr);
+}
+
 }  // namespace test
 }  // namespace keymaster
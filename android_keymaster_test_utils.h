@@ -22,6 +22,9 @@
  */
 
 #include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
 
 #include <algorithm>
 #include <memory>
@@ -112,6 +115,40 @@ inline bool contains(const AuthorizationSet& set, keymaster_tag_t tag) {
     return set.find(tag) != -1;
 }
 
+/**
+ * An empty, uniquely named file in the device's or host's scratch directory, removed when the
+ * TempFile is destroyed.
+ */
+class TempFile {
+  public:
+    explicit TempFile(const char* prefix) {
+#ifdef __ANDROID__
+        snprintf(path_, sizeof(path_), "/data/local/tmp/%s.XXXXXX", prefix);
+#else
+        snprintf(path_, sizeof(path_), "/tmp/%s.XXXXXX", prefix);
+#endif
+        int fd = mkstemp(path_);
+        created_ = fd >= 0;
+        if (created_)
+            close(fd);
+    }
+    ~TempFile() {
+        if (created_)
+            unlink(path_);
+    }
+
+    bool created() const { return created_; }
+    const char* path() const { return path_; }
+
+  private:
+    char path_[128];
+    bool created_;
+
+    // Disallow copying and assignment.
+    TempFile(const TempFile&);
+    void operator=(const TempFile&);
+};
+
 class StdoutLogger : public Logger {
   public:
     StdoutLogger() { set_instance(this); }
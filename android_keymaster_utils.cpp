@@ -28,17 +28,31 @@ uint8_t* dup_buffer(const void* buf, size_t size) {
     if (size >= kMaxDupBufferSize)
         return nullptr;
     uint8_t* retval = new (std::nothrow) uint8_t[size];
-    if (retval)
+    if (retval) {
+        AllocationCounter::Count(size);
         memcpy(retval, buf, size);
+    }
     return retval;
 }
 
 int memcmp_s(const void* p1, const void* p2, size_t length) {
     const uint8_t* s1 = static_cast<const uint8_t*>(p1);
     const uint8_t* s2 = static_cast<const uint8_t*>(p2);
-    uint8_t result = 0;
+    // Differences are accumulated, never tested, until the end.  memcpy makes the word loads safe
+    // at any alignment and compiles to plain (or vector) loads.
+    uint64_t result = 0;
+    for (; length >= sizeof(uint64_t); length -= sizeof(uint64_t)) {
+        uint64_t w1, w2;
+        memcpy(&w1, s1, sizeof(w1));
+        memcpy(&w2, s2, sizeof(w2));
+        result |= w1 ^ w2;
+        s1 += sizeof(uint64_t);
+        s2 += sizeof(uint64_t);
+    }
     while (length-- > 0)
         result |= *s1++ ^ *s2++;
+    // Keep the compiler from turning the accumulation into an early exit.
+    __asm__ __volatile__("" : "+r"(result));
     return result == 0 ? 0 : 1;
 }
 
@@ -16,6 +16,9 @@
 
 #include "asymmetric_key.h"
 
+#include <string.h>
+
+#include <mutex>
 #include <new>
 
 #include <openssl/asn1.h>
@@ -24,6 +27,7 @@
 #include <openssl/x509v3.h>
 
 #include "attestation_record.h"
+#include "attestation_signer.h"
 #include "openssl_err.h"
 #include "openssl_utils.h"
 
@@ -111,6 +115,43 @@ static keymaster_error_t add_key_usage_extension(const AuthorizationSet& tee_enf
 
 }  // anonymous namespace
 
+EVP_PKEY* AsymmetricKey::GetEvpKey() const {
+    std::lock_guard<std::mutex> lock(evp_key_mutex_);
+    if (!evp_key_.get()) {
+        EVP_PKEY_Ptr pkey(EVP_PKEY_new());
+        if (!pkey.get() || !InternalToEvp(pkey.get()))
+            return nullptr;
+        evp_key_.reset(pkey.release());
+    }
+    if (EVP_PKEY_up_ref(evp_key_.get()) != 1)
+        return nullptr;
+    return evp_key_.get();
+}
+
+keymaster_error_t AsymmetricKey::Warmup() const {
+    EVP_PKEY_Ptr pkey(GetEvpKey());
+    if (!pkey.get())
+        return TranslateLastOpenSslError();
+    return KM_ERROR_OK;
+}
+
+size_t AsymmetricKey::material_bytes() const {
+    std::lock_guard<std::mutex> lock(public_key_mutex_);
+    return public_key_der_length_;
+}
+
+keymaster_error_t
+AsymmetricKey::EnableVerificationCache(const std::shared_ptr<VerificationCache>& cache) {
+    UniquePtr<uint8_t[]> der;
+    size_t der_length;
+    keymaster_error_t error = formatted_key_material(KM_KEY_FORMAT_X509, &der, &der_length);
+    if (error != KM_ERROR_OK)
+        return error;
+    SHA256(der.get(), der_length, public_key_digest_.data());
+    verification_cache_ = cache;
+    return KM_ERROR_OK;
+}
+
 keymaster_error_t AsymmetricKey::formatted_key_material(keymaster_key_format_t format,
                                                         UniquePtr<uint8_t[]>* material,
                                                         size_t* size) const {
@@ -120,25 +161,33 @@ keymaster_error_t AsymmetricKey::formatted_key_material(keymaster_key_format_t f
     if (material == NULL || size == NULL)
         return KM_ERROR_OUTPUT_PARAMETER_NULL;
 
-    EVP_PKEY_Ptr pkey(EVP_PKEY_new());
-    if (!InternalToEvp(pkey.get()))
-        return TranslateLastOpenSslError();
+    std::lock_guard<std::mutex> lock(public_key_mutex_);
+    if (!public_key_der_.get()) {
+        EVP_PKEY_Ptr pkey(GetEvpKey());
+        if (!pkey.get())
+            return TranslateLastOpenSslError();
 
-    int key_data_length = i2d_PUBKEY(pkey.get(), NULL);
-    if (key_data_length <= 0)
-        return TranslateLastOpenSslError();
+        int key_data_length = i2d_PUBKEY(pkey.get(), NULL);
+        if (key_data_length <= 0)
+            return TranslateLastOpenSslError();
 
-    material->reset(new (std::nothrow) uint8_t[key_data_length]);
-    if (material->get() == NULL)
-        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+        UniquePtr<uint8_t[]> der(new (std::nothrow) uint8_t[key_data_length]);
+        if (der.get() == NULL)
+            return KM_ERROR_MEMORY_ALLOCATION_FAILED;
 
-    uint8_t* tmp = material->get();
-    if (i2d_PUBKEY(pkey.get(), &tmp) != key_data_length) {
-        material->reset();
-        return TranslateLastOpenSslError();
+        uint8_t* tmp = der.get();
+        if (i2d_PUBKEY(pkey.get(), &tmp) != key_data_length)
+            return TranslateLastOpenSslError();
+
+        public_key_der_.reset(der.release());
+        public_key_der_length_ = key_data_length;
     }
 
-    *size = key_data_length;
+    material->reset(new (std::nothrow) uint8_t[public_key_der_length_]);
+    if (material->get() == NULL)
+        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    memcpy(material->get(), public_key_der_.get(), public_key_der_length_);
+    *size = public_key_der_length_;
     return KM_ERROR_OK;
 }
 
@@ -218,64 +267,38 @@ static keymaster_error_t get_certificate_blob(X509* certificate, keymaster_blob_
     return KM_ERROR_OK;
 }
 
-static bool allocate_cert_chain(size_t entry_count, keymaster_cert_chain_t* chain,
-                                keymaster_error_t* error) {
-    if (chain->entries) {
-        for (size_t i = 0; i < chain->entry_count; ++i)
-            delete[] chain->entries[i].data;
-        delete[] chain->entries;
-    }
-
-    chain->entry_count = entry_count;
-    chain->entries = new keymaster_blob_t[entry_count];
-    if (!chain->entries) {
-        *error = KM_ERROR_MEMORY_ALLOCATION_FAILED;
-        return false;
-    }
-    return true;
-}
-
-// Copies the intermediate and root certificates into chain, leaving the first slot for the leaf
-// certificate.
-static bool copy_attestation_chain(const KeymasterContext& context,
-                                   keymaster_algorithm_t sign_algorithm,
-                                   keymaster_cert_chain_t* chain, keymaster_error_t* error) {
-
-    UniquePtr<keymaster_cert_chain_t, CertificateChainDelete> attest_key_chain(
-        context.AttestationChain(sign_algorithm, error));
-    if (!attest_key_chain.get())
-        return false;
-
-    if (!allocate_cert_chain(attest_key_chain->entry_count + 1, chain, error))
-        return false;
-
-    chain->entries[0].data = nullptr;  // Leave empty for the leaf certificate.
-    chain->entries[1].data_length = 0;
-
-    for (size_t i = 0; i < attest_key_chain->entry_count; ++i) {
-        chain->entries[i + 1] = attest_key_chain->entries[i];
-        attest_key_chain->entries[i].data = nullptr;
-    }
-
-    return true;
-}
-
 keymaster_error_t AsymmetricKey::GenerateAttestation(const KeymasterContext& context,
                                                      const AuthorizationSet& attest_params,
                                                      const AuthorizationSet& tee_enforced,
                                                      const AuthorizationSet& sw_enforced,
                                                      keymaster_cert_chain_t* cert_chain) const {
-
     keymaster_algorithm_t sign_algorithm;
-    if ((!sw_enforced.GetTagValue(TAG_ALGORITHM, &sign_algorithm) &&
-         !tee_enforced.GetTagValue(TAG_ALGORITHM, &sign_algorithm)))
-        return KM_ERROR_UNKNOWN_ERROR;
+    keymaster_error_t error =
+        AttestationSigner::SignAlgorithm(tee_enforced, sw_enforced, &sign_algorithm);
+    if (error != KM_ERROR_OK)
+        return error;
 
-    if ((sign_algorithm != KM_ALGORITHM_RSA && sign_algorithm != KM_ALGORITHM_EC))
-        return KM_ERROR_INCOMPATIBLE_ALGORITHM;
+    AttestationSigner signer;
+    error = signer.Init(context, sign_algorithm);
+    if (error != KM_ERROR_OK)
+        return error;
+
+    keymaster_blob_t certificate = {nullptr, 0};
+    error = GenerateAttestationCertificate(context, signer, attest_params, tee_enforced,
+                                           sw_enforced, &certificate);
+    if (error != KM_ERROR_OK)
+        return error;
 
-    EVP_PKEY_Ptr pkey(EVP_PKEY_new());
-    if (!InternalToEvp(pkey.get()))
+    return signer.BuildCertificateChain(&certificate, cert_chain);
+}
+
+keymaster_error_t AsymmetricKey::GenerateAttestationCertificate(
+    const KeymasterContext& context, const AttestationSigner& signer,
+    const AuthorizationSet& attest_params, const AuthorizationSet& tee_enforced,
+    const AuthorizationSet& sw_enforced, keymaster_blob_t* certificate_blob) const {
+
+    EVP_PKEY_Ptr pkey(GetEvpKey());
+    if (!pkey.get())
         return TranslateLastOpenSslError();
 
     X509_Ptr certificate(X509_new());
@@ -290,22 +313,9 @@ keymaster_error_t AsymmetricKey::GenerateAttestation(const KeymasterContext& con
         !X509_set_serialNumber(certificate.get(), serialNumber.get() /* Don't release; copied */))
         return TranslateLastOpenSslError();
 
-    // TODO(swillden): Find useful values (if possible) for issuerName and subjectName.
-    X509_NAME_Ptr issuerName(X509_NAME_new());
-    if (!issuerName.get() ||
-        !X509_NAME_add_entry_by_txt(issuerName.get(), "CN", MBSTRING_ASC,
-                                    reinterpret_cast<const uint8_t*>("Android Keymaster"),
-                                    -1 /* len */, -1 /* loc */, 0 /* set */) ||
-        !X509_set_issuer_name(certificate.get(), issuerName.get() /* Don't release; copied  */))
-        return TranslateLastOpenSslError();
-
-    X509_NAME_Ptr subjectName(X509_NAME_new());
-    if (!subjectName.get() ||
-        !X509_NAME_add_entry_by_txt(subjectName.get(), "CN", MBSTRING_ASC,
-                                    reinterpret_cast<const uint8_t*>("A Keymaster Key"),
-                                    -1 /* len */, -1 /* loc */, 0 /* set */) ||
-        !X509_set_subject_name(certificate.get(), subjectName.get() /* Don't release; copied */))
-        return TranslateLastOpenSslError();
+    keymaster_error_t error = signer.SetNames(certificate.get());
+    if (error != KM_ERROR_OK)
+        return error;
 
     ASN1_TIME_Ptr notBefore(ASN1_TIME_new());
     uint64_t activeDateTime = 0;
@@ -325,53 +335,21 @@ keymaster_error_t AsymmetricKey::GenerateAttestation(const KeymasterContext& con
         !X509_set_notAfter(certificate.get(), notAfter.get() /* Don't release; copied */))
         return TranslateLastOpenSslError();
 
-    keymaster_error_t error = add_key_usage_extension(tee_enforced, sw_enforced, certificate.get());
+    error = add_key_usage_extension(tee_enforced, sw_enforced, certificate.get());
     if (error != KM_ERROR_OK) {
         return error;
     }
 
-    EVP_PKEY_Ptr sign_key(context.AttestationKey(sign_algorithm, &error));
-
-    if (!sign_key.get() ||  //
-        !add_public_key(pkey.get(), certificate.get(), &error) ||
+    if (!add_public_key(pkey.get(), certificate.get(), &error) ||
         !add_attestation_extension(attest_params, tee_enforced, sw_enforced, context,
                                    certificate.get(), &error))
         return error;
 
-    if (!copy_attestation_chain(context, sign_algorithm, cert_chain, &error))
+    error = signer.Sign(certificate.get());
+    if (error != KM_ERROR_OK)
         return error;
 
-    // Copy subject key identifier from cert_chain->entries[1] as authority key_id.
-    if (cert_chain->entry_count < 2) {
-        // cert_chain must have at least two entries, one for the cert we're trying to create and
-        // one for the cert for the key that signs the new cert.
-        return KM_ERROR_UNKNOWN_ERROR;
-    }
-
-    const uint8_t* p = cert_chain->entries[1].data;
-    X509_Ptr signing_cert(d2i_X509(nullptr, &p, cert_chain->entries[1].data_length));
-    if (!signing_cert.get()) {
-        return TranslateLastOpenSslError();
-    }
-
-    UniquePtr<X509V3_CTX> x509v3_ctx(new X509V3_CTX);
-    *x509v3_ctx = {};
-    X509V3_set_ctx(x509v3_ctx.get(), signing_cert.get(), certificate.get(), nullptr /* req */,
-                   nullptr /* crl */, 0 /* flags */);
-
-    X509_EXTENSION_Ptr auth_key_id(X509V3_EXT_nconf_nid(nullptr /* conf */, x509v3_ctx.get(),
-                                                        NID_authority_key_identifier,
-                                                        const_cast<char*>("keyid:always")));
-    if (!auth_key_id.get() ||
-        !X509_add_ext(certificate.get(), auth_key_id.get() /* Don't release; copied */,
-                      -1 /* insert at end */)) {
-        return TranslateLastOpenSslError();
-    }
-
-    if (!X509_sign(certificate.get(), sign_key.get(), EVP_sha256()))
-        return TranslateLastOpenSslError();
-
-    return get_certificate_blob(certificate.get(), &cert_chain->entries[0]);
+    return get_certificate_blob(certificate.get(), certificate_blob);
 }
 
 }  // namespace keymaster
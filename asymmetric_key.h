@@ -17,9 +17,15 @@
 #ifndef SYSTEM_KEYMASTER_ASYMMETRIC_KEY_H
 #define SYSTEM_KEYMASTER_ASYMMETRIC_KEY_H
 
+#include <memory>
+#include <mutex>
+
 #include <openssl/evp.h>
 
+#include "digest_context_cache.h"
 #include "key.h"
+#include "openssl_utils.h"
+#include "verification_cache.h"
 
 namespace keymaster {
 
@@ -27,7 +33,8 @@ class AsymmetricKey : public Key {
   public:
     AsymmetricKey(const AuthorizationSet& hw_enforced, const AuthorizationSet& sw_enforced,
                   keymaster_error_t* error)
-        : Key(hw_enforced, sw_enforced, error) {}
+        : Key(hw_enforced, sw_enforced, error), public_key_der_length_(0),
+          digest_context_cache_(new (std::nothrow) DigestContextCache) {}
 
     keymaster_error_t formatted_key_material(keymaster_key_format_t format,
                                              UniquePtr<uint8_t[]>* material,
@@ -38,9 +45,63 @@ class AsymmetricKey : public Key {
                                           const AuthorizationSet& tee_enforced,
                                           const AuthorizationSet& sw_enforced,
                                           keymaster_cert_chain_t* certificate_chain) const override;
+    keymaster_error_t GenerateAttestationCertificate(
+        const KeymasterContext& context, const AttestationSigner& signer,
+        const AuthorizationSet& attest_params, const AuthorizationSet& tee_enforced,
+        const AuthorizationSet& sw_enforced, keymaster_blob_t* certificate) const override;
 
     virtual bool InternalToEvp(EVP_PKEY* pkey) const = 0;
     virtual bool EvpToInternal(const EVP_PKEY* pkey) = 0;
+
+    /**
+     * Returns a new reference to an EVP_PKEY wrapping this key, which the caller must free, or
+     * null on failure.  The EVP_PKEY is built on first use and kept with the key, so any state
+     * OpenSSL caches on it (Montgomery contexts, blinding) is set up once per loaded key rather
+     * than once per operation.  Must not be called until the key material is fully loaded.
+     */
+    EVP_PKEY* GetEvpKey() const;
+
+    // Builds the EVP_PKEY.
+    keymaster_error_t Warmup() const override;
+
+    /**
+     * Makes verify operations with the key look signatures up in cache before verifying them, and
+     * add those that verify.  Must be called after the key material is loaded.
+     */
+    keymaster_error_t EnableVerificationCache(const std::shared_ptr<VerificationCache>& cache);
+
+    // Null unless EnableVerificationCache has been called.
+    const std::shared_ptr<VerificationCache>& verification_cache() const {
+        return verification_cache_;
+    }
+    // The SHA-256 digest of the key's X.509 SubjectPublicKeyInfo, once EnableVerificationCache
+    // has been called.
+    const VerificationCache::Digest& public_key_digest() const { return public_key_digest_; }
+
+    // EVP_MD_CTX templates for signing and verification with the key.  Null only if allocation
+    // failed.
+    const std::shared_ptr<DigestContextCache>& digest_context_cache() const {
+        return digest_context_cache_;
+    }
+
+  protected:
+    // The cached public key encoding.  The digest context templates are built as the key is
+    // used, and the verification cache is shared, so neither is counted.
+    size_t material_bytes() const override;
+
+  private:
+    mutable std::mutex evp_key_mutex_;
+    mutable EVP_PKEY_Ptr evp_key_;
+
+    // The X.509 SubjectPublicKeyInfo encoding of the public key, built on the first export, since
+    // clients tend to export the same public key repeatedly.
+    mutable std::mutex public_key_mutex_;
+    mutable UniquePtr<uint8_t[]> public_key_der_;
+    mutable size_t public_key_der_length_;
+
+    std::shared_ptr<VerificationCache> verification_cache_;
+    VerificationCache::Digest public_key_digest_;
+    std::shared_ptr<DigestContextCache> digest_context_cache_;
 };
 
 }  // namespace keymaster
@@ -19,6 +19,7 @@
 #include <keymaster/android_keymaster_utils.h>
 
 #include "asymmetric_key.h"
+#include "compact_private_key.h"
 #include "openssl_err.h"
 #include "openssl_utils.h"
 
@@ -48,14 +49,21 @@ keymaster_error_t AsymmetricKeyFactory::LoadKey(const KeymasterKeyBlob& key_mate
     if (error != KM_ERROR_OK)
         return error;
 
-    const uint8_t* tmp = key_material.key_material;
-    EVP_PKEY* pkey =
-        d2i_PrivateKey(evp_key_type(), NULL /* pkey */, &tmp, key_material.key_material_size);
-    if (!pkey)
-        return TranslateLastOpenSslError();
-    UniquePtr<EVP_PKEY, EVP_PKEY_Delete> pkey_deleter(pkey);
+    UniquePtr<EVP_PKEY, EVP_PKEY_Delete> pkey;
+    if (IsCompactPrivateKey(key_material)) {
+        // Imported keys, stored ready to load without DER parsing.
+        error = DecodeCompactPrivateKey(key_material, evp_key_type(), &pkey);
+        if (error != KM_ERROR_OK)
+            return error;
+    } else {
+        const uint8_t* tmp = key_material.key_material;
+        pkey.reset(
+            d2i_PrivateKey(evp_key_type(), NULL /* pkey */, &tmp, key_material.key_material_size));
+        if (!pkey.get())
+            return TranslateLastOpenSslError();
+    }
 
-    if (!asymmetric_key->EvpToInternal(pkey))
+    if (!asymmetric_key->EvpToInternal(pkey.get()))
         error = TranslateLastOpenSslError();
     else
         key->reset(asymmetric_key.release());
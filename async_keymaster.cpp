@@ -0,0 +1,112 @@
+/*
+ * Copyright 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "async_keymaster.h"
+
+#include <utility>
+
+namespace keymaster {
+
+AsyncKeymaster::AsyncKeymaster(AndroidKeymaster* keymaster, RequestScheduler* scheduler)
+    : keymaster_(keymaster), scheduler_(scheduler) {}
+
+void AsyncKeymaster::GenerateKey(const GenerateKeyRequest& request, GenerateKeyResponse* response,
+                                 const Callback& done) {
+    scheduler_->Submit(GENERATE_KEY, keymaster_, &AndroidKeymaster::GenerateKey, request, response,
+                       done);
+}
+
+void AsyncKeymaster::AttestKey(const AttestKeyRequest& request, AttestKeyResponse* response,
+                               const Callback& done) {
+    scheduler_->Submit(ATTEST_KEY, keymaster_, &AndroidKeymaster::AttestKey, request, response,
+                       done);
+}
+
+void AsyncKeymaster::BeginOperation(const BeginOperationRequest& request,
+                                    BeginOperationResponse* response, const Callback& done) {
+    scheduler_->Submit(BEGIN_OPERATION, keymaster_, &AndroidKeymaster::BeginOperation, request,
+                       response, done);
+}
+
+void AsyncKeymaster::UpdateOperation(const UpdateOperationRequest& request,
+                                     UpdateOperationResponse* response, const Callback& done) {
+    AndroidKeymaster* keymaster = keymaster_;
+    SubmitForOperation(request.op_handle, ClassifyRequest(UPDATE_OPERATION, request),
+                       [=, &request] {
+                           keymaster->UpdateOperation(request, response);
+                           if (done)
+                               done();
+                       });
+}
+
+void AsyncKeymaster::FinishOperation(const FinishOperationRequest& request,
+                                     FinishOperationResponse* response, const Callback& done) {
+    AndroidKeymaster* keymaster = keymaster_;
+    SubmitForOperation(request.op_handle, ClassifyRequest(FINISH_OPERATION, request),
+                       [=, &request] {
+                           keymaster->FinishOperation(request, response);
+                           if (done)
+                               done();
+                       });
+}
+
+void AsyncKeymaster::AbortOperation(const AbortOperationRequest& request,
+                                    AbortOperationResponse* response, const Callback& done) {
+    AndroidKeymaster* keymaster = keymaster_;
+    SubmitForOperation(request.op_handle, ClassifyRequest(ABORT_OPERATION, request),
+                       [=, &request] {
+                           keymaster->AbortOperation(request, response);
+                           if (done)
+                               done();
+                       });
+}
+
+void AsyncKeymaster::SubmitForOperation(keymaster_operation_handle_t op_handle,
+                                        RequestClass request_class, const Task& task) {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        OperationQueue& queue = operations_[op_handle];
+        if (queue.running) {
+            queue.pending.push_back(std::make_pair(request_class, task));
+            return;
+        }
+        queue.running = true;
+    }
+    Schedule(op_handle, request_class, task);
+}
+
+void AsyncKeymaster::Schedule(keymaster_operation_handle_t op_handle, RequestClass request_class,
+                              const Task& task) {
+    scheduler_->Schedule(request_class, [this, op_handle, task] {
+        task();
+
+        // Start the operation's next request, if any, now that this one is done.
+        std::pair<RequestClass, Task> next;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            auto queue = operations_.find(op_handle);
+            if (queue->second.pending.empty()) {
+                operations_.erase(queue);
+                return;
+            }
+            next = std::move(queue->second.pending.front());
+            queue->second.pending.pop_front();
+        }
+        Schedule(op_handle, next.first, next.second);
+    });
+}
+
+}  // namespace keymaster
@@ -0,0 +1,99 @@
+/*
+ * Copyright 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SYSTEM_KEYMASTER_ASYNC_KEYMASTER_H_
+#define SYSTEM_KEYMASTER_ASYNC_KEYMASTER_H_
+
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <unordered_map>
+
+#include <keymaster/android_keymaster.h>
+#include <keymaster/android_keymaster_messages.h>
+
+#include "request_scheduler.h"
+
+namespace keymaster {
+
+/**
+ * AsyncKeymaster is a non-blocking front end to an AndroidKeymaster.  Each method queues its
+ * request on a RequestScheduler and returns at once; done is called on the worker that ran the
+ * request, once the response is filled in.  The request and response must remain valid until then.
+ *
+ * Requests for the same operation run one at a time, in the order they were submitted, so a
+ * caller can queue several updates and the finish of an operation without waiting for each in
+ * turn.  Requests for different operations, and key requests, run concurrently on the scheduler's
+ * workers.  A request that waits on hardware still occupies a worker while it does, since the
+ * keymaster HALs are synchronous; the scheduler's thread count bounds how many such requests are
+ * in flight.
+ */
+class AsyncKeymaster {
+  public:
+    typedef std::function<void()> Callback;
+
+    /**
+     * Doesn't take ownership of keymaster or scheduler, which must outlive the AsyncKeymaster.
+     * The scheduler must be destroyed, which runs any requests still queued, before the
+     * AsyncKeymaster is.
+     */
+    AsyncKeymaster(AndroidKeymaster* keymaster, RequestScheduler* scheduler);
+
+    void GenerateKey(const GenerateKeyRequest& request, GenerateKeyResponse* response,
+                     const Callback& done);
+    void AttestKey(const AttestKeyRequest& request, AttestKeyResponse* response,
+                   const Callback& done);
+    void BeginOperation(const BeginOperationRequest& request, BeginOperationResponse* response,
+                        const Callback& done);
+    void UpdateOperation(const UpdateOperationRequest& request, UpdateOperationResponse* response,
+                         const Callback& done);
+    void FinishOperation(const FinishOperationRequest& request, FinishOperationResponse* response,
+                         const Callback& done);
+    void AbortOperation(const AbortOperationRequest& request, AbortOperationResponse* response,
+                        const Callback& done);
+
+  private:
+    typedef RequestScheduler::Task Task;
+
+    struct OperationQueue {
+        OperationQueue() : running(false) {}
+
+        bool running;
+        // Tasks waiting for the running one to finish, each with its request class.
+        std::deque<std::pair<RequestClass, Task>> pending;
+    };
+
+    // Runs task after any earlier tasks for op_handle.
+    void SubmitForOperation(keymaster_operation_handle_t op_handle, RequestClass request_class,
+                            const Task& task);
+    void Schedule(keymaster_operation_handle_t op_handle, RequestClass request_class,
+                  const Task& task);
+
+    AndroidKeymaster* const keymaster_;
+    RequestScheduler* const scheduler_;
+
+    std::mutex mutex_;
+    // Operations with a request running or queued.
+    std::unordered_map<keymaster_operation_handle_t, OperationQueue> operations_;
+
+    // Disallow copying and assignment.
+    AsyncKeymaster(const AsyncKeymaster&);
+    void operator=(const AsyncKeymaster&);
+};
+
+}  // namespace keymaster
+
+#endif  // SYSTEM_KEYMASTER_ASYNC_KEYMASTER_H_
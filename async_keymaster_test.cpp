@@ -0,0 +1,190 @@
+/*
+ * Copyright 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "async_keymaster.h"
+
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include <keymaster/soft_keymaster_context.h>
+
+namespace keymaster {
+namespace test {
+
+// Counts callbacks, and waits for a given number of them.
+class Completions {
+  public:
+    Completions() : count_(0) {}
+
+    AsyncKeymaster::Callback Callback() {
+        return [this] {
+            std::lock_guard<std::mutex> lock(mutex_);
+            ++count_;
+            done_.notify_all();
+        };
+    }
+
+    void WaitFor(size_t count) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        done_.wait(lock, [&] { return count_ >= count; });
+    }
+
+  private:
+    std::mutex mutex_;
+    std::condition_variable done_;
+    size_t count_;
+};
+
+class AsyncKeymasterTest : public testing::Test {
+  protected:
+    AsyncKeymasterTest()
+        : keymaster_(new SoftKeymasterContext, 16), scheduler_(4, 1),
+          async_(&keymaster_, &scheduler_) {}
+
+    void GenerateHmacKey(GenerateKeyResponse* key) {
+        GenerateKeyRequest request;
+        request.key_description = AuthorizationSetBuilder()
+                                      .HmacKey(128)
+                                      .Digest(KM_DIGEST_SHA_2_256)
+                                      .Authorization(TAG_MIN_MAC_LENGTH, 128)
+                                      .Authorization(TAG_NO_AUTH_REQUIRED)
+                                      .build();
+        Completions completions;
+        async_.GenerateKey(request, key, completions.Callback());
+        completions.WaitFor(1);
+    }
+
+    void BeginMac(const GenerateKeyResponse& key, BeginOperationResponse* begin) {
+        BeginOperationRequest request;
+        request.purpose = KM_PURPOSE_SIGN;
+        request.SetKeyMaterial(key.key_blob);
+        request.additional_params.push_back(TAG_DIGEST, KM_DIGEST_SHA_2_256);
+        request.additional_params.push_back(TAG_MAC_LENGTH, 256);
+        Completions completions;
+        async_.BeginOperation(request, begin, completions.Callback());
+        completions.WaitFor(1);
+    }
+
+    AndroidKeymaster keymaster_;
+    RequestScheduler scheduler_;
+    AsyncKeymaster async_;
+};
+
+TEST_F(AsyncKeymasterTest, OperationRequestsRunInOrder) {
+    GenerateKeyResponse key;
+    GenerateHmacKey(&key);
+    ASSERT_EQ(KM_ERROR_OK, key.error);
+
+    const size_t kUpdates = 16;
+    std::string message;
+    BeginOperationResponse begins[2];
+    for (BeginOperationResponse& begin : begins) {
+        BeginMac(key, &begin);
+        ASSERT_EQ(KM_ERROR_OK, begin.error);
+    }
+
+    // Queue every update and the finish of both operations without waiting.  Each operation's
+    // requests must run in order for the MACs to match.
+    UpdateOperationRequest updates[2][kUpdates];
+    UpdateOperationResponse update_responses[2][kUpdates];
+    FinishOperationRequest finishes[2];
+    FinishOperationResponse finish_responses[2];
+    std::mutex order_mutex;
+    std::vector<size_t> order[2];
+    Completions completions;
+    for (size_t i = 0; i < kUpdates; ++i) {
+        std::string chunk = "chunk " + std::to_string(i) + ";";
+        message += chunk;
+        for (size_t op = 0; op < 2; ++op) {
+            updates[op][i].op_handle = begins[op].op_handle;
+            updates[op][i].input.Reinitialize(chunk.data(), chunk.size());
+            AsyncKeymaster::Callback done = completions.Callback();
+            async_.UpdateOperation(updates[op][i], &update_responses[op][i], [&, op, i, done] {
+                {
+                    std::lock_guard<std::mutex> lock(order_mutex);
+                    order[op].push_back(i);
+                }
+                done();
+            });
+        }
+    }
+    for (size_t op = 0; op < 2; ++op) {
+        finishes[op].op_handle = begins[op].op_handle;
+        async_.FinishOperation(finishes[op], &finish_responses[op], completions.Callback());
+    }
+    completions.WaitFor(2 * kUpdates + 2);
+
+    for (size_t op = 0; op < 2; ++op) {
+        ASSERT_EQ(kUpdates, order[op].size());
+        for (size_t i = 0; i < kUpdates; ++i) {
+            EXPECT_EQ(i, order[op][i]);
+            EXPECT_EQ(KM_ERROR_OK, update_responses[op][i].error);
+        }
+        ASSERT_EQ(KM_ERROR_OK, finish_responses[op].error);
+    }
+    EXPECT_EQ(32U, finish_responses[0].output.available_read());
+    EXPECT_EQ(0, memcmp(finish_responses[0].output.peek_read(),
+                        finish_responses[1].output.peek_read(), 32));
+
+    // The MAC is the one a single update of the whole message gives.
+    BeginOperationResponse begin;
+    BeginMac(key, &begin);
+    ASSERT_EQ(KM_ERROR_OK, begin.error);
+    FinishOperationRequest finish;
+    finish.op_handle = begin.op_handle;
+    finish.input.Reinitialize(message.data(), message.size());
+    FinishOperationResponse finish_response;
+    keymaster_.FinishOperation(finish, &finish_response);
+    ASSERT_EQ(KM_ERROR_OK, finish_response.error);
+    EXPECT_EQ(0, memcmp(finish_response.output.peek_read(),
+                        finish_responses[0].output.peek_read(), 32));
+}
+
+TEST_F(AsyncKeymasterTest, AbortAfterQueuedUpdate) {
+    GenerateKeyResponse key;
+    GenerateHmacKey(&key);
+    ASSERT_EQ(KM_ERROR_OK, key.error);
+    BeginOperationResponse begin;
+    BeginMac(key, &begin);
+    ASSERT_EQ(KM_ERROR_OK, begin.error);
+
+    UpdateOperationRequest update;
+    update.op_handle = begin.op_handle;
+    update.input.Reinitialize("hello", 5);
+    UpdateOperationResponse update_response;
+    AbortOperationRequest abort;
+    abort.op_handle = begin.op_handle;
+    AbortOperationResponse abort_response;
+    FinishOperationRequest finish;
+    finish.op_handle = begin.op_handle;
+    FinishOperationResponse finish_response;
+    Completions completions;
+    async_.UpdateOperation(update, &update_response, completions.Callback());
+    async_.AbortOperation(abort, &abort_response, completions.Callback());
+    async_.FinishOperation(finish, &finish_response, completions.Callback());
+    completions.WaitFor(3);
+
+    EXPECT_EQ(KM_ERROR_OK, update_response.error);
+    EXPECT_EQ(KM_ERROR_OK, abort_response.error);
+    EXPECT_EQ(KM_ERROR_INVALID_OPERATION_HANDLE, finish_response.error);
+}
+
+}  // namespace test
+}  // namespace keymaster
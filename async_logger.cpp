@@ -0,0 +1,128 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <keymaster/async_logger.h>
+
+#include <stdio.h>
+
+#include <chrono>
+#include <new>
+
+namespace keymaster {
+
+namespace {
+
+// How long the drain thread, and Flush, sleep when there is nothing to pass on.
+const std::chrono::milliseconds kIdleWait(1);
+
+size_t RoundUpToPowerOfTwo(size_t value) {
+    size_t rounded = 1;
+    while (rounded < value)
+        rounded <<= 1;
+    return rounded;
+}
+
+int Forward(const Logger* sink, Logger::LogLevel level, const char* fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    int result = sink->log_msg(level, fmt, args);
+    va_end(args);
+    return result;
+}
+
+}  // anonymous namespace
+
+const size_t AsyncLogger::kMaxMessageLength;
+
+AsyncLogger::AsyncLogger(Logger* sink, size_t capacity)
+    : sink_(sink), capacity_(RoundUpToPowerOfTwo(capacity)),
+      slots_(new (std::nothrow) Slot[capacity_]), write_position_(0), read_position_(0),
+      dropped_(0), stopping_(false) {
+    // Without a buffer, messages are passed to the sink directly.
+    if (slots_.get()) {
+        for (size_t i = 0; i < capacity_; ++i)
+            slots_[i].sequence.store(i, std::memory_order_relaxed);
+        drain_thread_ = std::thread(&AsyncLogger::Run, this);
+    }
+    set_instance(this);
+}
+
+AsyncLogger::~AsyncLogger() {
+    set_instance(sink_);
+    stopping_.store(true, std::memory_order_release);
+    if (drain_thread_.joinable())
+        drain_thread_.join();
+    if (slots_.get())
+        Drain();
+}
+
+int AsyncLogger::log_msg(LogLevel level, const char* fmt, va_list args) const {
+    if (!slots_.get())
+        return sink_->log_msg(level, fmt, args);
+
+    // Claim the next position, unless its slot hasn't been passed on since the last time round.
+    uint64_t position = write_position_.load(std::memory_order_relaxed);
+    Slot* slot;
+    for (;;) {
+        slot = &slots_[position & (capacity_ - 1)];
+        uint64_t sequence = slot->sequence.load(std::memory_order_acquire);
+        if (sequence == position) {
+            if (write_position_.compare_exchange_weak(position, position + 1,
+                                                      std::memory_order_relaxed))
+                break;
+        } else if (sequence < position) {
+            dropped_.fetch_add(1, std::memory_order_relaxed);
+            return 0;
+        } else {
+            position = write_position_.load(std::memory_order_relaxed);
+        }
+    }
+
+    slot->level = level;
+    int result = vsnprintf(slot->message, kMaxMessageLength, fmt, args);
+    slot->sequence.store(position + 1, std::memory_order_release);
+    return result;
+}
+
+void AsyncLogger::Flush() const {
+    if (!slots_.get())
+        return;
+    uint64_t target = write_position_.load(std::memory_order_acquire);
+    while (read_position_.load(std::memory_order_acquire) < target)
+        std::this_thread::sleep_for(kIdleWait);
+}
+
+bool AsyncLogger::Drain() const {
+    bool drained = false;
+    for (;;) {
+        uint64_t position = read_position_.load(std::memory_order_relaxed);
+        Slot* slot = &slots_[position & (capacity_ - 1)];
+        if (slot->sequence.load(std::memory_order_acquire) != position + 1)
+            return drained;
+        Forward(sink_, slot->level, "%s", slot->message);
+        slot->sequence.store(position + capacity_, std::memory_order_release);
+        read_position_.store(position + 1, std::memory_order_release);
+        drained = true;
+    }
+}
+
+void AsyncLogger::Run() {
+    while (!stopping_.load(std::memory_order_acquire))
+        if (!Drain())
+            std::this_thread::sleep_for(kIdleWait);
+}
+
+}  // namespace keymaster
@@ -0,0 +1,155 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Drop debug messages from this file, to test compile-time filtering.
+#define KEYMASTER_MIN_LOG_LEVEL 1
+
+#include <keymaster/async_logger.h>
+
+#include <stdio.h>
+
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+namespace keymaster {
+namespace test {
+
+class RecordingLogger : public Logger {
+  public:
+    RecordingLogger() { set_instance(this); }
+    ~RecordingLogger() { set_instance(nullptr); }
+
+    int log_msg(LogLevel level, const char* fmt, va_list args) const override {
+        char message[1024];
+        int result = vsnprintf(message, sizeof(message), fmt, args);
+        std::lock_guard<std::mutex> lock(mutex_);
+        levels_.push_back(level);
+        messages_.push_back(message);
+        return result;
+    }
+
+    std::vector<std::string> messages() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return messages_;
+    }
+
+    std::vector<LogLevel> levels() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return levels_;
+    }
+
+  private:
+    mutable std::mutex mutex_;
+    mutable std::vector<LogLevel> levels_;
+    mutable std::vector<std::string> messages_;
+};
+
+TEST(AsyncLoggerTest, PassesMessagesOnInOrder) {
+    RecordingLogger sink;
+    AsyncLogger logger(&sink, 16);
+    for (int i = 0; i < 10; ++i)
+        Logger::Log(i % 2 ? Logger::ERROR_LVL : Logger::INFO_LVL, "message %d", i);
+    logger.Flush();
+
+    std::vector<std::string> messages = sink.messages();
+    ASSERT_EQ(10U, messages.size());
+    for (int i = 0; i < 10; ++i) {
+        EXPECT_EQ("message " + std::to_string(i), messages[i]);
+        EXPECT_EQ(i % 2 ? Logger::ERROR_LVL : Logger::INFO_LVL, sink.levels()[i]);
+    }
+    EXPECT_EQ(0U, logger.dropped_count());
+}
+
+TEST(AsyncLoggerTest, TruncatesLongMessages) {
+    RecordingLogger sink;
+    AsyncLogger logger(&sink, 4);
+    std::string long_message(2 * AsyncLogger::kMaxMessageLength, 'x');
+    Logger::Info("%s", long_message.c_str());
+    logger.Flush();
+
+    ASSERT_EQ(1U, sink.messages().size());
+    EXPECT_EQ(long_message.substr(0, AsyncLogger::kMaxMessageLength - 1), sink.messages()[0]);
+}
+
+TEST(AsyncLoggerTest, ConcurrentLoggers) {
+    const int kThreads = 4;
+    const int kMessagesPerThread = 1000;
+    RecordingLogger sink;
+    AsyncLogger logger(&sink, 64);
+
+    std::vector<std::thread> threads;
+    for (int t = 0; t < kThreads; ++t)
+        threads.push_back(std::thread([t] {
+            for (int i = 0; i < kMessagesPerThread; ++i)
+                Logger::Info("thread %d message %d", t, i);
+        }));
+    for (auto& thread : threads)
+        thread.join();
+    logger.Flush();
+
+    // A small buffer may fill, but every message is either passed on or counted as dropped, and
+    // each thread's messages stay in order.
+    std::vector<std::string> messages = sink.messages();
+    EXPECT_EQ(static_cast<uint64_t>(kThreads * kMessagesPerThread),
+              messages.size() + logger.dropped_count());
+    int last[kThreads] = {-1, -1, -1, -1};
+    for (const std::string& message : messages) {
+        int t, i;
+        ASSERT_EQ(2, sscanf(message.c_str(), "thread %d message %d", &t, &i));
+        EXPECT_GT(i, last[t]);
+        last[t] = i;
+    }
+}
+
+TEST(AsyncLoggerTest, DestructionDrainsAndRestoresSink) {
+    RecordingLogger sink;
+    {
+        AsyncLogger logger(&sink, 16);
+        Logger::Info("buffered");
+    }
+    Logger::Info("direct");
+
+    std::vector<std::string> messages = sink.messages();
+    ASSERT_EQ(2U, messages.size());
+    EXPECT_EQ("buffered", messages[0]);
+    EXPECT_EQ("direct", messages[1]);
+}
+
+static int evaluations = 0;
+static int Evaluate() {
+    return ++evaluations;
+}
+
+TEST(LoggerTest, MinimumLevelCompilesOutLowerLevels) {
+    RecordingLogger sink;
+    LOG_D("debug %d", Evaluate());
+    LOG_I("info %d", Evaluate());
+    LOG_E("error %d", Evaluate());
+
+    // The debug message's argument wasn't even evaluated.
+    EXPECT_EQ(2, evaluations);
+    std::vector<Logger::LogLevel> levels = sink.levels();
+    ASSERT_EQ(2U, levels.size());
+    EXPECT_EQ(Logger::INFO_LVL, levels[0]);
+    EXPECT_EQ(Logger::ERROR_LVL, levels[1]);
+}
+
+}  // namespace test
+}  // namespace keymaster
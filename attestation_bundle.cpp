@@ -0,0 +1,204 @@
+/*
+ * Copyright 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "attestation_bundle.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <string>
+
+#include <keymaster/logger.h>
+
+namespace keymaster {
+
+static const uint32_t kAttestationBundleMagic = 0x4b4d4142;  // "KMAB"
+static const uint32_t kAttestationBundleVersion = 1;
+
+const size_t AttestationBundle::kMaxChainLength;
+const size_t AttestationBundle::kAlgorithmSlots;
+
+struct AttestationBundle::Header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t entry_count;
+};
+
+struct AttestationBundle::Descriptor {
+    uint32_t algorithm;
+    uint32_t type;
+    uint32_t offset;
+    uint32_t length;
+};
+
+AttestationBundle::AttestationBundle(const char* path) : mapping_(nullptr), mapping_size_(0) {
+    memset(index_, 0, sizeof(index_));
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        LOG_E("Can't open attestation bundle %s", path);
+        return;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(Header)) {
+        LOG_E("Attestation bundle %s is too short", path);
+        close(fd);
+        return;
+    }
+    // The mapping keeps the file's pages; the descriptor isn't needed once it's made.
+    void* mapping = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        LOG_E("Can't map attestation bundle %s", path);
+        return;
+    }
+    mapping_ = static_cast<const uint8_t*>(mapping);
+    mapping_size_ = st.st_size;
+}
+
+AttestationBundle::~AttestationBundle() {
+    if (mapping_)
+        munmap(const_cast<uint8_t*>(mapping_), mapping_size_);
+}
+
+/* static */
+int AttestationBundle::Slot(keymaster_algorithm_t algorithm) {
+    switch (algorithm) {
+    case KM_ALGORITHM_RSA:
+        return 0;
+    case KM_ALGORITHM_EC:
+        return 1;
+    default:
+        return -1;
+    }
+}
+
+void AttestationBundle::BuildIndex() const {
+    if (!mapping_)
+        return;
+
+    Header header;
+    memcpy(&header, mapping_, sizeof(header));
+    if (header.magic != kAttestationBundleMagic || header.version != kAttestationBundleVersion ||
+        header.entry_count > (mapping_size_ - sizeof(Header)) / sizeof(Descriptor)) {
+        LOG_E("%s", "Attestation bundle header is invalid; using built-in attestation keys");
+        return;
+    }
+
+    const uint8_t* descriptors = mapping_ + sizeof(Header);
+    for (uint32_t i = 0; i < header.entry_count; ++i) {
+        Descriptor descriptor;
+        memcpy(&descriptor, descriptors + i * sizeof(Descriptor), sizeof(descriptor));
+        int slot = Slot(static_cast<keymaster_algorithm_t>(descriptor.algorithm));
+        bool valid = descriptor.length > 0 && descriptor.offset <= mapping_size_ &&
+                     descriptor.length <= mapping_size_ - descriptor.offset;
+        if (valid && slot >= 0) {
+            AlgorithmData* data = &index_[slot];
+            keymaster_blob_t blob = {mapping_ + descriptor.offset, descriptor.length};
+            if (descriptor.type == kKey && !data->key.data)
+                data->key = blob;
+            else if (descriptor.type == kCertificate && data->chain_length < kMaxChainLength)
+                data->chain[data->chain_length++] = blob;
+            else if (descriptor.type == kKey || descriptor.type == kCertificate)
+                valid = false;
+        }
+        // Entries for other algorithms or of other types are for later versions, and skipped.
+        if (!valid) {
+            LOG_E("Attestation bundle entry %u is invalid; using built-in attestation keys", i);
+            memset(index_, 0, sizeof(index_));
+            return;
+        }
+    }
+}
+
+bool AttestationBundle::covers(keymaster_algorithm_t algorithm) const {
+    int slot = Slot(algorithm);
+    if (slot < 0)
+        return false;
+    std::call_once(index_once_, [this] { BuildIndex(); });
+    return index_[slot].key.data && index_[slot].chain_length > 0;
+}
+
+bool AttestationBundle::Get(keymaster_algorithm_t algorithm, keymaster_blob_t* key,
+                            keymaster_blob_t* chain, size_t* chain_length) const {
+    if (!covers(algorithm))
+        return false;
+    const AlgorithmData& data = index_[Slot(algorithm)];
+    *key = data.key;
+    for (size_t i = 0; i < data.chain_length; ++i)
+        chain[i] = data.chain[i];
+    *chain_length = data.chain_length;
+    return true;
+}
+
+/* static */
+keymaster_error_t AttestationBundle::Write(const char* path, const Entry* entries, size_t count) {
+    std::string contents(sizeof(Header) + count * sizeof(Descriptor), '\0');
+    Header header = {kAttestationBundleMagic, kAttestationBundleVersion,
+                     static_cast<uint32_t>(count)};
+    memcpy(&contents[0], &header, sizeof(header));
+    for (size_t i = 0; i < count; ++i) {
+        Descriptor descriptor = {static_cast<uint32_t>(entries[i].algorithm), entries[i].type,
+                                 static_cast<uint32_t>(contents.size()),
+                                 static_cast<uint32_t>(entries[i].data.data_length)};
+        memcpy(&contents[sizeof(Header) + i * sizeof(Descriptor)], &descriptor,
+               sizeof(descriptor));
+        contents.append(reinterpret_cast<const char*>(entries[i].data.data),
+                        entries[i].data.data_length);
+    }
+
+    // Write a new file and rename it over the old one, since processes may have the old one
+    // mapped, and truncating it under them would fault their reads.  The new file gets a unique
+    // name in the same directory, so concurrent writers don't clobber each other's and the rename
+    // stays on one file system, and reaches the disk before the rename does, so a crash leaves
+    // either the old bundle or the new one.
+    std::string temp_path = std::string(path) + ".XXXXXX";
+    int fd = mkstemp(&temp_path[0]);
+    if (fd < 0) {
+        LOG_E("Can't create a temporary file for attestation bundle %s", path);
+        return KM_ERROR_UNKNOWN_ERROR;
+    }
+    size_t written = 0;
+    while (written < contents.size()) {
+        ssize_t n = write(fd, contents.data() + written, contents.size() - written);
+        if (n <= 0)
+            break;
+        written += n;
+    }
+    bool synced = written == contents.size() && fchmod(fd, 0644) == 0 && fsync(fd) == 0;
+    if (close(fd) != 0 || !synced || rename(temp_path.c_str(), path) != 0) {
+        LOG_E("Can't write attestation bundle %s", path);
+        unlink(temp_path.c_str());
+        return KM_ERROR_UNKNOWN_ERROR;
+    }
+
+    // Make the rename itself durable.
+    const char* slash = strrchr(path, '/');
+    std::string directory = slash ? std::string(path, slash == path ? 1 : slash - path) : ".";
+    int directory_fd = open(directory.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (directory_fd < 0 || fsync(directory_fd) != 0)
+        LOG_W("Can't sync directory %s after writing attestation bundle", directory.c_str());
+    if (directory_fd >= 0)
+        close(directory_fd);
+    return KM_ERROR_OK;
+}
+
+}  // namespace keymaster
@@ -0,0 +1,114 @@
+/*
+ * Copyright 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SYSTEM_KEYMASTER_ATTESTATION_BUNDLE_H_
+#define SYSTEM_KEYMASTER_ATTESTATION_BUNDLE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <mutex>
+
+#include <hardware/keymaster_defs.h>
+
+namespace keymaster {
+
+/**
+ * A provisioned file of attestation keys and certificate chains, so that devices can be given
+ * their attestation identity without rebuilding keymaster.
+ *
+ * The file is mapped read-only and MAP_SHARED, so every keymaster process that opens it shares one
+ * copy in the page cache, and lookups return pointers into the mapping rather than copies.  It is a
+ * header (magic, version, entry count) followed by entry count entry descriptors (algorithm, type,
+ * offset, length), all uint32_t in host byte order, and then the entry data.  Each algorithm has at
+ * most one kKey entry, its DER private key, and its kCertificate entries are its DER certificate
+ * chain in file order, leaf first.  The descriptors are checked and indexed on the first lookup,
+ * not when the file is opened; a bundle that fails the checks covers no algorithms.
+ *
+ * Lookups are thread-safe.  The bundle must outlive the blobs it returns.
+ */
+class AttestationBundle {
+  public:
+    enum EntryType : uint32_t {
+        kKey = 0,
+        kCertificate = 1,
+    };
+
+    struct Entry {
+        keymaster_algorithm_t algorithm;
+        EntryType type;
+        keymaster_blob_t data;
+    };
+
+    static const size_t kMaxChainLength = 4;
+
+    /**
+     * Maps the bundle at path.  Check initialized() before use.
+     */
+    explicit AttestationBundle(const char* path);
+    ~AttestationBundle();
+
+    bool initialized() const { return mapping_ != nullptr; }
+
+    /**
+     * Returns true if the bundle has a key and at least one certificate for algorithm.
+     */
+    bool covers(keymaster_algorithm_t algorithm) const;
+
+    /**
+     * Points key at the algorithm's private key and chain at its certificates, leaf first, setting
+     * chain_length to their number.  chain must have room for kMaxChainLength blobs.  Returns false
+     * if the bundle doesn't cover the algorithm.
+     */
+    bool Get(keymaster_algorithm_t algorithm, keymaster_blob_t* key, keymaster_blob_t* chain,
+             size_t* chain_length) const;
+
+    /**
+     * Writes a bundle of the count entries to path, atomically replacing any file there, and
+     * syncs it to disk.  For provisioning tools and tests.
+     */
+    static keymaster_error_t Write(const char* path, const Entry* entries, size_t count);
+
+  private:
+    struct Header;
+    struct Descriptor;
+
+    // The algorithms a bundle can hold attestation data for.
+    static const size_t kAlgorithmSlots = 2;
+    static int Slot(keymaster_algorithm_t algorithm);
+
+    struct AlgorithmData {
+        keymaster_blob_t key;
+        keymaster_blob_t chain[kMaxChainLength];
+        size_t chain_length;
+    };
+
+    // Checks the descriptors and fills index_.  Called once, on the first lookup.
+    void BuildIndex() const;
+
+    const uint8_t* mapping_;
+    size_t mapping_size_;
+    mutable std::once_flag index_once_;
+    mutable AlgorithmData index_[kAlgorithmSlots];
+
+    // Disallow copying and assignment.
+    AttestationBundle(const AttestationBundle&);
+    void operator=(const AttestationBundle&);
+};
+
+}  // namespace keymaster
+
+#endif  // SYSTEM_KEYMASTER_ATTESTATION_BUNDLE_H_
@@ -0,0 +1,145 @@
+/*
+ * Copyright 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "attestation_bundle.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include <gtest/gtest.h>
+
+#include "android_keymaster_test_utils.h"
+
+namespace keymaster {
+namespace test {
+
+static const uint8_t kRsaKey[] = {1, 2, 3};
+static const uint8_t kRsaCert[] = {4, 5};
+static const uint8_t kRsaRootCert[] = {6, 7, 8, 9};
+static const uint8_t kEcKey[] = {10};
+
+class AttestationBundleTest : public testing::Test {
+  protected:
+    AttestationBundleTest() : file_("attestation_bundle_test") {}
+
+    static AttestationBundle::Entry MakeEntry(keymaster_algorithm_t algorithm,
+                                              AttestationBundle::EntryType type,
+                                              const uint8_t* data, size_t length) {
+        AttestationBundle::Entry entry = {algorithm, type, {data, length}};
+        return entry;
+    }
+
+    static bool BlobIs(const keymaster_blob_t& blob, const uint8_t* data, size_t length) {
+        return blob.data_length == length && memcmp(blob.data, data, length) == 0;
+    }
+
+    void WriteFile(const void* data, size_t length) {
+        FILE* file = fopen(file_.path(), "wb");
+        ASSERT_TRUE(file != nullptr);
+        EXPECT_EQ(length, fwrite(data, 1, length, file));
+        fclose(file);
+    }
+
+    TempFile file_;
+};
+
+TEST_F(AttestationBundleTest, ReadsBackEntries) {
+    AttestationBundle::Entry entries[] = {
+        MakeEntry(KM_ALGORITHM_RSA, AttestationBundle::kCertificate, kRsaCert, sizeof(kRsaCert)),
+        MakeEntry(KM_ALGORITHM_RSA, AttestationBundle::kKey, kRsaKey, sizeof(kRsaKey)),
+        MakeEntry(KM_ALGORITHM_RSA, AttestationBundle::kCertificate, kRsaRootCert,
+                  sizeof(kRsaRootCert)),
+        // An EC key without certificates doesn't cover EC.
+        MakeEntry(KM_ALGORITHM_EC, AttestationBundle::kKey, kEcKey, sizeof(kEcKey)),
+    };
+    ASSERT_EQ(KM_ERROR_OK, AttestationBundle::Write(file_.path(), entries, 4));
+
+    AttestationBundle bundle(file_.path());
+    ASSERT_TRUE(bundle.initialized());
+    EXPECT_TRUE(bundle.covers(KM_ALGORITHM_RSA));
+    EXPECT_FALSE(bundle.covers(KM_ALGORITHM_EC));
+    EXPECT_FALSE(bundle.covers(KM_ALGORITHM_AES));
+
+    keymaster_blob_t key;
+    keymaster_blob_t chain[AttestationBundle::kMaxChainLength];
+    size_t chain_length;
+    ASSERT_TRUE(bundle.Get(KM_ALGORITHM_RSA, &key, chain, &chain_length));
+    EXPECT_TRUE(BlobIs(key, kRsaKey, sizeof(kRsaKey)));
+    ASSERT_EQ(2U, chain_length);
+    EXPECT_TRUE(BlobIs(chain[0], kRsaCert, sizeof(kRsaCert)));
+    EXPECT_TRUE(BlobIs(chain[1], kRsaRootCert, sizeof(kRsaRootCert)));
+    EXPECT_FALSE(bundle.Get(KM_ALGORITHM_EC, &key, chain, &chain_length));
+}
+
+TEST_F(AttestationBundleTest, MissingFile) {
+    unlink(file_.path());
+    AttestationBundle bundle(file_.path());
+    EXPECT_FALSE(bundle.initialized());
+    EXPECT_FALSE(bundle.covers(KM_ALGORITHM_RSA));
+}
+
+TEST_F(AttestationBundleTest, RejectsBadHeader) {
+    static const uint32_t kHeader[] = {0x12345678, 1, 0};
+    WriteFile(kHeader, sizeof(kHeader));
+    AttestationBundle bundle(file_.path());
+    ASSERT_TRUE(bundle.initialized());
+    EXPECT_FALSE(bundle.covers(KM_ALGORITHM_RSA));
+}
+
+TEST_F(AttestationBundleTest, RejectsOutOfRangeEntry) {
+    // The certificate's length runs past the end of the file.
+    static const uint32_t kBundle[] = {
+        0x4b4d4142, 1, 2, KM_ALGORITHM_RSA, 0, 44, 4, KM_ALGORITHM_RSA, 1, 44, 100, 0,
+    };
+    WriteFile(kBundle, sizeof(kBundle));
+    AttestationBundle bundle(file_.path());
+    ASSERT_TRUE(bundle.initialized());
+    EXPECT_FALSE(bundle.covers(KM_ALGORITHM_RSA));
+}
+
+TEST_F(AttestationBundleTest, RejectsDuplicateKey) {
+    AttestationBundle::Entry entries[] = {
+        MakeEntry(KM_ALGORITHM_RSA, AttestationBundle::kKey, kRsaKey, sizeof(kRsaKey)),
+        MakeEntry(KM_ALGORITHM_RSA, AttestationBundle::kCertificate, kRsaCert, sizeof(kRsaCert)),
+        MakeEntry(KM_ALGORITHM_RSA, AttestationBundle::kKey, kRsaKey, sizeof(kRsaKey)),
+    };
+    ASSERT_EQ(KM_ERROR_OK, AttestationBundle::Write(file_.path(), entries, 3));
+    AttestationBundle bundle(file_.path());
+    ASSERT_TRUE(bundle.initialized());
+    EXPECT_FALSE(bundle.covers(KM_ALGORITHM_RSA));
+}
+
+TEST_F(AttestationBundleTest, RewriteLeavesMappedBundleIntact) {
+    AttestationBundle::Entry entries[] = {
+        MakeEntry(KM_ALGORITHM_RSA, AttestationBundle::kKey, kRsaKey, sizeof(kRsaKey)),
+        MakeEntry(KM_ALGORITHM_RSA, AttestationBundle::kCertificate, kRsaCert, sizeof(kRsaCert)),
+    };
+    ASSERT_EQ(KM_ERROR_OK, AttestationBundle::Write(file_.path(), entries, 2));
+    AttestationBundle bundle(file_.path());
+    ASSERT_TRUE(bundle.initialized());
+
+    // A process reprovisioning the bundle replaces the file rather than writing into it.
+    ASSERT_EQ(KM_ERROR_OK, AttestationBundle::Write(file_.path(), entries, 1));
+    keymaster_blob_t key;
+    keymaster_blob_t chain[AttestationBundle::kMaxChainLength];
+    size_t chain_length;
+    ASSERT_TRUE(bundle.Get(KM_ALGORITHM_RSA, &key, chain, &chain_length));
+    EXPECT_TRUE(BlobIs(chain[0], kRsaCert, sizeof(kRsaCert)));
+    EXPECT_FALSE(AttestationBundle(file_.path()).covers(KM_ALGORITHM_RSA));
+}
+
+}  // namespace test
+}  // namespace keymaster
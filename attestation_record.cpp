@@ -17,156 +17,128 @@
 #include "attestation_record.h"
 
 #include <assert.h>
+#include <string.h>
 
-#include <openssl/asn1t.h>
-
-#include "openssl_err.h"
-#include "openssl_utils.h"
+#include <algorithm>
+#include <vector>
 
 #include <keymaster/android_keymaster_utils.h>
 #include <keymaster/keymaster_context.h>
+#include <keymaster/logger.h>
 
 namespace keymaster {
 
-namespace {
-
-bool Uint64ToBignum(uint64_t value, BIGNUM* bn) {
-    static_assert(sizeof(unsigned long) == sizeof(uint64_t) ||
-                      sizeof(unsigned long) == sizeof(uint32_t),
-                  "Only 32 and 64-bit platforms supported");
-
-    if (sizeof(unsigned long) == sizeof(uint64_t)) {
-        return BN_set_word(bn, value);
-    } else if (sizeof(unsigned long) == sizeof(uint32_t)) {
-        uint32_t low_order = value & 0xFFFFFFFF;
-        uint32_t high_order = value >> 32;
-        return BN_set_word(bn, high_order) &&  //
-               BN_lshift(bn, bn, 32) &&        //
-               BN_add_word(bn, low_order);
-    } else {
-        return false;
-    }
+// DER identifier octets of the explicit, context-specific tag for a keymaster tag.  Tag numbers
+// above 30 take the high-tag-number form; all of the authorization list's fit in two base-128
+// octets after the leading one.
+constexpr uint32_t explicit_tag_number(keymaster_tag_t tag) {
+    return tag_number(tag);
 }
 
-}  // anonymous namespace
+constexpr uint8_t explicit_tag_length(keymaster_tag_t tag) {
+    return explicit_tag_number(tag) < 31 ? 1 : (explicit_tag_number(tag) < 0x80 ? 2 : 3);
+}
 
-struct stack_st_ASN1_TYPE_Delete {
-    void operator()(stack_st_ASN1_TYPE* p) { sk_ASN1_TYPE_free(p); }
-};
+constexpr uint8_t explicit_tag_octet(keymaster_tag_t tag, size_t index) {
+    return index == 0 ? (explicit_tag_number(tag) < 31 ? 0xA0 | explicit_tag_number(tag) : 0xBF)
+                      : index == 1 && explicit_tag_length(tag) == 3
+                            ? 0x80 | (explicit_tag_number(tag) >> 7)
+                            : explicit_tag_number(tag) & 0x7F;
+}
 
-struct ASN1_STRING_Delete {
-    void operator()(ASN1_STRING* p) { ASN1_STRING_free(p); }
+struct AuthListField {
+    keymaster_tag_t tag;
+    uint8_t header_length;
+    uint8_t header[3];
 };
 
-struct ASN1_TYPE_Delete {
-    void operator()(ASN1_TYPE* p) { ASN1_TYPE_free(p); }
-};
+#define AUTH_LIST_FIELD(tag)                                                                       \
+    {                                                                                              \
+        tag, explicit_tag_length(tag), {                                                           \
+            explicit_tag_octet(tag, 0), explicit_tag_octet(tag, 1), explicit_tag_octet(tag, 2)     \
+        }                                                                                          \
+    }
 
-#define ASN1_INTEGER_SET STACK_OF(ASN1_INTEGER)
-
-typedef struct km_root_of_trust {
-    ASN1_OCTET_STRING* verified_boot_key;
-    ASN1_BOOLEAN* device_locked;
-    ASN1_ENUMERATED* verified_boot_state;
-} KM_ROOT_OF_TRUST;
-
-ASN1_SEQUENCE(KM_ROOT_OF_TRUST) = {
-    ASN1_SIMPLE(KM_ROOT_OF_TRUST, verified_boot_key, ASN1_OCTET_STRING),
-    ASN1_SIMPLE(KM_ROOT_OF_TRUST, device_locked, ASN1_BOOLEAN),
-    ASN1_SIMPLE(KM_ROOT_OF_TRUST, verified_boot_state, ASN1_ENUMERATED),
-} ASN1_SEQUENCE_END(KM_ROOT_OF_TRUST);
-IMPLEMENT_ASN1_FUNCTIONS(KM_ROOT_OF_TRUST);
-
-typedef struct km_auth_list {
-    ASN1_INTEGER_SET* purpose;
-    ASN1_INTEGER* algorithm;
-    ASN1_INTEGER* key_size;
-    ASN1_INTEGER_SET* digest;
-    ASN1_INTEGER_SET* padding;
-    ASN1_INTEGER_SET* kdf;
-    ASN1_INTEGER* ec_curve;
-    ASN1_INTEGER* rsa_public_exponent;
-    ASN1_INTEGER* active_date_time;
-    ASN1_INTEGER* origination_expire_date_time;
-    ASN1_INTEGER* usage_expire_date_time;
-    ASN1_NULL* no_auth_required;
-    ASN1_INTEGER* user_auth_type;
-    ASN1_INTEGER* auth_timeout;
-    ASN1_NULL* allow_while_on_body;
-    ASN1_NULL* all_applications;
-    ASN1_OCTET_STRING* application_id;
-    ASN1_INTEGER* creation_date_time;
-    ASN1_INTEGER* origin;
-    ASN1_NULL* rollback_resistant;
-    KM_ROOT_OF_TRUST* root_of_trust;
-    ASN1_INTEGER* os_version;
-    ASN1_INTEGER* os_patchlevel;
-} KM_AUTH_LIST;
-
-ASN1_SEQUENCE(KM_AUTH_LIST) = {
-    ASN1_EXP_SET_OF_OPT(KM_AUTH_LIST, purpose, ASN1_INTEGER, TAG_PURPOSE.masked_tag()),
-    ASN1_EXP_OPT(KM_AUTH_LIST, algorithm, ASN1_INTEGER, TAG_ALGORITHM.masked_tag()),
-    ASN1_EXP_OPT(KM_AUTH_LIST, key_size, ASN1_INTEGER, TAG_KEY_SIZE.masked_tag()),
-    ASN1_EXP_SET_OF_OPT(KM_AUTH_LIST, digest, ASN1_INTEGER, TAG_DIGEST.masked_tag()),
-    ASN1_EXP_SET_OF_OPT(KM_AUTH_LIST, padding, ASN1_INTEGER, TAG_PADDING.masked_tag()),
-    ASN1_EXP_SET_OF_OPT(KM_AUTH_LIST, kdf, ASN1_INTEGER, TAG_KDF.masked_tag()),
-    ASN1_EXP_OPT(KM_AUTH_LIST, ec_curve, ASN1_INTEGER, TAG_EC_CURVE.masked_tag()),
-    ASN1_EXP_OPT(KM_AUTH_LIST, rsa_public_exponent, ASN1_INTEGER,
-                 TAG_RSA_PUBLIC_EXPONENT.masked_tag()),
-    ASN1_EXP_OPT(KM_AUTH_LIST, active_date_time, ASN1_INTEGER, TAG_ACTIVE_DATETIME.masked_tag()),
-    ASN1_EXP_OPT(KM_AUTH_LIST, origination_expire_date_time, ASN1_INTEGER,
-                 TAG_ORIGINATION_EXPIRE_DATETIME.masked_tag()),
-    ASN1_EXP_OPT(KM_AUTH_LIST, usage_expire_date_time, ASN1_INTEGER,
-                 TAG_USAGE_EXPIRE_DATETIME.masked_tag()),
-    ASN1_EXP_OPT(KM_AUTH_LIST, no_auth_required, ASN1_NULL, TAG_NO_AUTH_REQUIRED.masked_tag()),
-    ASN1_EXP_OPT(KM_AUTH_LIST, user_auth_type, ASN1_INTEGER, TAG_USER_AUTH_TYPE.masked_tag()),
-    ASN1_EXP_OPT(KM_AUTH_LIST, auth_timeout, ASN1_INTEGER, TAG_AUTH_TIMEOUT.masked_tag()),
-    ASN1_EXP_OPT(KM_AUTH_LIST, allow_while_on_body, ASN1_NULL,
-                 TAG_ALLOW_WHILE_ON_BODY.masked_tag()),
-    ASN1_EXP_OPT(KM_AUTH_LIST, all_applications, ASN1_NULL, TAG_ALL_APPLICATIONS.masked_tag()),
-    ASN1_EXP_OPT(KM_AUTH_LIST, application_id, ASN1_OCTET_STRING, TAG_APPLICATION_ID.masked_tag()),
-    ASN1_EXP_OPT(KM_AUTH_LIST, creation_date_time, ASN1_INTEGER,
-                 TAG_CREATION_DATETIME.masked_tag()),
-    ASN1_EXP_OPT(KM_AUTH_LIST, origin, ASN1_INTEGER, TAG_ORIGIN.masked_tag()),
-    ASN1_EXP_OPT(KM_AUTH_LIST, rollback_resistant, ASN1_NULL, TAG_ROLLBACK_RESISTANT.masked_tag()),
-    ASN1_EXP_OPT(KM_AUTH_LIST, root_of_trust, KM_ROOT_OF_TRUST, TAG_ROOT_OF_TRUST.masked_tag()),
-    ASN1_EXP_OPT(KM_AUTH_LIST, os_version, ASN1_INTEGER, TAG_OS_VERSION.masked_tag()),
-    ASN1_EXP_OPT(KM_AUTH_LIST, os_patchlevel, ASN1_INTEGER, TAG_OS_PATCHLEVEL.masked_tag()),
-} ASN1_SEQUENCE_END(KM_AUTH_LIST);
-IMPLEMENT_ASN1_FUNCTIONS(KM_AUTH_LIST);
-
-typedef struct km_key_description {
-    ASN1_INTEGER* attestation_version;
-    ASN1_ENUMERATED* attestation_security_level;
-    ASN1_INTEGER* keymaster_version;
-    ASN1_ENUMERATED* keymaster_security_level;
-    ASN1_OCTET_STRING* attestation_challenge;
-    KM_AUTH_LIST* software_enforced;
-    KM_AUTH_LIST* tee_enforced;
-    ASN1_INTEGER* unique_id;
-} KM_KEY_DESCRIPTION;
-
-ASN1_SEQUENCE(KM_KEY_DESCRIPTION) = {
-    ASN1_SIMPLE(KM_KEY_DESCRIPTION, attestation_version, ASN1_INTEGER),
-    ASN1_SIMPLE(KM_KEY_DESCRIPTION, attestation_security_level, ASN1_ENUMERATED),
-    ASN1_SIMPLE(KM_KEY_DESCRIPTION, keymaster_version, ASN1_INTEGER),
-    ASN1_SIMPLE(KM_KEY_DESCRIPTION, keymaster_security_level, ASN1_ENUMERATED),
-    ASN1_SIMPLE(KM_KEY_DESCRIPTION, attestation_challenge, ASN1_OCTET_STRING),
-    ASN1_SIMPLE(KM_KEY_DESCRIPTION, unique_id, ASN1_OCTET_STRING),
-    ASN1_SIMPLE(KM_KEY_DESCRIPTION, software_enforced, KM_AUTH_LIST),
-    ASN1_SIMPLE(KM_KEY_DESCRIPTION, tee_enforced, KM_AUTH_LIST),
-} ASN1_SEQUENCE_END(KM_KEY_DESCRIPTION);
-IMPLEMENT_ASN1_FUNCTIONS(KM_KEY_DESCRIPTION);
-
-struct KM_AUTH_LIST_Delete {
-    void operator()(KM_AUTH_LIST* p) { KM_AUTH_LIST_free(p); }
+// The fields of the AuthorizationList, in schema order:
+//
+// KeyDescription ::= SEQUENCE {
+//     attestationVersion         INTEGER,
+//     attestationSecurityLevel   ENUMERATED,
+//     keymasterVersion           INTEGER,
+//     keymasterSecurityLevel     ENUMERATED,
+//     attestationChallenge       OCTET STRING,
+//     uniqueId                   OCTET STRING,
+//     softwareEnforced           AuthorizationList,
+//     teeEnforced                AuthorizationList,
+// }
+//
+// AuthorizationList ::= SEQUENCE {
+//     purpose  [1] EXPLICIT SET OF INTEGER OPTIONAL,
+//     ...
+// }
+//
+// in which each field is explicitly tagged with its keymaster tag, less the type.  Repeatable
+// enums are SETs OF INTEGER; other enums, integers and dates INTEGERs; booleans NULLs; and byte
+// strings OCTET STRINGs.  rootOfTrust [704] is left out here; it never comes from an
+// AuthorizationSet and isn't mapped to one.
+static const AuthListField kAuthListFields[] = {
+    AUTH_LIST_FIELD(KM_TAG_PURPOSE),
+    AUTH_LIST_FIELD(KM_TAG_ALGORITHM),
+    AUTH_LIST_FIELD(KM_TAG_KEY_SIZE),
+    AUTH_LIST_FIELD(KM_TAG_DIGEST),
+    AUTH_LIST_FIELD(KM_TAG_PADDING),
+    AUTH_LIST_FIELD(KM_TAG_KDF),
+    AUTH_LIST_FIELD(KM_TAG_EC_CURVE),
+    AUTH_LIST_FIELD(KM_TAG_RSA_PUBLIC_EXPONENT),
+    AUTH_LIST_FIELD(KM_TAG_ACTIVE_DATETIME),
+    AUTH_LIST_FIELD(KM_TAG_ORIGINATION_EXPIRE_DATETIME),
+    AUTH_LIST_FIELD(KM_TAG_USAGE_EXPIRE_DATETIME),
+    AUTH_LIST_FIELD(KM_TAG_NO_AUTH_REQUIRED),
+    AUTH_LIST_FIELD(KM_TAG_USER_AUTH_TYPE),
+    AUTH_LIST_FIELD(KM_TAG_AUTH_TIMEOUT),
+    AUTH_LIST_FIELD(KM_TAG_ALLOW_WHILE_ON_BODY),
+    AUTH_LIST_FIELD(KM_TAG_ALL_APPLICATIONS),
+    AUTH_LIST_FIELD(KM_TAG_APPLICATION_ID),
+    AUTH_LIST_FIELD(KM_TAG_CREATION_DATETIME),
+    AUTH_LIST_FIELD(KM_TAG_ORIGIN),
+    AUTH_LIST_FIELD(KM_TAG_ROLLBACK_RESISTANT),
+    AUTH_LIST_FIELD(KM_TAG_OS_VERSION),
+    AUTH_LIST_FIELD(KM_TAG_OS_PATCHLEVEL),
 };
 
-struct KM_KEY_DESCRIPTION_Delete {
-    void operator()(KM_KEY_DESCRIPTION* p) { KM_KEY_DESCRIPTION_free(p); }
-};
+#undef AUTH_LIST_FIELD
+
+static const size_t kAuthListFieldCount = sizeof(kAuthListFields) / sizeof(kAuthListFields[0]);
+
+static const uint8_t kDerBoolean = 0x01;
+static const uint8_t kDerInteger = 0x02;
+static const uint8_t kDerOctetString = 0x04;
+static const uint8_t kDerNull = 0x05;
+static const uint8_t kDerEnumerated = 0x0A;
+static const uint8_t kDerSequence = 0x30;
+static const uint8_t kDerSet = 0x31;
 
-static uint32_t get_uint32_value(const keymaster_key_param_t& param) {
+static size_t der_length_size(size_t length) {
+    size_t size = 1;
+    if (length >= 0x80)
+        for (; length; length >>= 8)
+            ++size;
+    return size;
+}
+
+static size_t der_size(size_t identifier_length, size_t content_length) {
+    return identifier_length + der_length_size(content_length) + content_length;
+}
+
+// Size of the minimal two's complement encoding of a non-negative integer.
+static size_t der_integer_content_size(uint64_t value) {
+    size_t size = 1;
+    for (; value >= 0x80; value >>= 8)
+        ++size;
+    return size;
+}
+
+static uint64_t get_integer_value(const keymaster_key_param_t& param) {
     switch (keymaster_tag_get_type(param.tag)) {
     case KM_ENUM:
     case KM_ENUM_REP:
@@ -174,231 +146,118 @@ static uint32_t get_uint32_value(const keymaster_key_param_t& param) {
     case KM_UINT:
     case KM_UINT_REP:
         return param.integer;
+    case KM_ULONG:
+    case KM_ULONG_REP:
+        return param.long_integer;
+    case KM_DATE:
+        return param.date_time;
     default:
         assert(false);
-        return 0xFFFFFFFF;
+        return 0;
     }
 }
 
-// Insert value in either the dest_integer or the dest_integer_set, whichever is provided.
-static keymaster_error_t insert_integer(ASN1_INTEGER* value, ASN1_INTEGER** dest_integer,
-                                        ASN1_INTEGER_SET** dest_integer_set) {
-    assert((dest_integer == nullptr) ^ (dest_integer_set == nullptr));
-    assert(value);
-
-    if (dest_integer_set) {
-        if (!*dest_integer_set)
-            *dest_integer_set = sk_ASN1_INTEGER_new_null();
-        if (!*dest_integer_set)
-            return KM_ERROR_MEMORY_ALLOCATION_FAILED;
-        if (!sk_ASN1_INTEGER_push(*dest_integer_set, value))
-            return KM_ERROR_MEMORY_ALLOCATION_FAILED;
-        return KM_ERROR_OK;
-
-    } else if (dest_integer) {
-        if (*dest_integer)
-            ASN1_INTEGER_free(*dest_integer);
-        *dest_integer = value;
-        return KM_ERROR_OK;
-    }
-
-    assert(false);  // Should never get here.
-    return KM_ERROR_OK;
-}
-
-// Put the contents of the keymaster AuthorizationSet auth_list in to the ASN.1 record structure,
-// record.
-static keymaster_error_t build_auth_list(const AuthorizationSet& auth_list, KM_AUTH_LIST* record) {
-    assert(record);
-
-    if (auth_list.empty())
-        return KM_ERROR_OK;
-
-    for (auto entry : auth_list) {
-
-        ASN1_INTEGER_SET** integer_set = nullptr;
-        ASN1_INTEGER** integer_ptr = nullptr;
-        ASN1_OCTET_STRING** string_ptr = nullptr;
-        ASN1_NULL** bool_ptr = nullptr;
-
-        switch (entry.tag) {
-
-        /* Ignored tags */
-        case KM_TAG_INVALID:
-        case KM_TAG_ASSOCIATED_DATA:
-        case KM_TAG_NONCE:
-        case KM_TAG_AUTH_TOKEN:
-        case KM_TAG_MAC_LENGTH:
-        case KM_TAG_ALL_USERS:
-        case KM_TAG_USER_ID:
-        case KM_TAG_USER_SECURE_ID:
-        case KM_TAG_EXPORTABLE:
-        case KM_TAG_RESET_SINCE_ID_ROTATION:
-        case KM_TAG_ATTESTATION_CHALLENGE:
-        case KM_TAG_BLOCK_MODE:
-        case KM_TAG_CALLER_NONCE:
-        case KM_TAG_MIN_MAC_LENGTH:
-        case KM_TAG_ECIES_SINGLE_HASH_MODE:
-        case KM_TAG_INCLUDE_UNIQUE_ID:
-        case KM_TAG_BLOB_USAGE_REQUIREMENTS:
-        case KM_TAG_BOOTLOADER_ONLY:
-        case KM_TAG_MIN_SECONDS_BETWEEN_OPS:
-        case KM_TAG_MAX_USES_PER_BOOT:
-        case KM_TAG_APPLICATION_DATA:
-        case KM_TAG_UNIQUE_ID:
-        case KM_TAG_ROOT_OF_TRUST:
-            continue;
-
-        /* Non-repeating enumerations */
-        case KM_TAG_ALGORITHM:
-            integer_ptr = &record->algorithm;
-            break;
-        case KM_TAG_EC_CURVE:
-            integer_ptr = &record->ec_curve;
-            break;
-        case KM_TAG_USER_AUTH_TYPE:
-            integer_ptr = &record->user_auth_type;
-            break;
-        case KM_TAG_ORIGIN:
-            integer_ptr = &record->origin;
-            break;
-
-        /* Repeating enumerations */
-        case KM_TAG_PURPOSE:
-            integer_set = &record->purpose;
-            break;
-        case KM_TAG_PADDING:
-            integer_set = &record->padding;
-            break;
-        case KM_TAG_DIGEST:
-            integer_set = &record->digest;
-            break;
-        case KM_TAG_KDF:
-            integer_set = &record->kdf;
-            break;
-
-        /* Non-repeating unsigned integers */
-        case KM_TAG_KEY_SIZE:
-            integer_ptr = &record->key_size;
-            break;
-        case KM_TAG_AUTH_TIMEOUT:
-            integer_ptr = &record->auth_timeout;
-            break;
-        case KM_TAG_OS_VERSION:
-            integer_ptr = &record->os_version;
-            break;
-        case KM_TAG_OS_PATCHLEVEL:
-            integer_ptr = &record->os_patchlevel;
-            break;
-
-        /* Non-repeating long unsigned integers */
-        case KM_TAG_RSA_PUBLIC_EXPONENT:
-            integer_ptr = &record->rsa_public_exponent;
-            break;
-
-        /* Dates */
-        case KM_TAG_ACTIVE_DATETIME:
-            integer_ptr = &record->active_date_time;
-            break;
-        case KM_TAG_ORIGINATION_EXPIRE_DATETIME:
-            integer_ptr = &record->origination_expire_date_time;
-            break;
-        case KM_TAG_USAGE_EXPIRE_DATETIME:
-            integer_ptr = &record->usage_expire_date_time;
-            break;
-        case KM_TAG_CREATION_DATETIME:
-            integer_ptr = &record->creation_date_time;
-            break;
-
-        /* Booleans */
-        case KM_TAG_NO_AUTH_REQUIRED:
-            bool_ptr = &record->no_auth_required;
-            break;
-        case KM_TAG_ALL_APPLICATIONS:
-            bool_ptr = &record->all_applications;
-            break;
-        case KM_TAG_ROLLBACK_RESISTANT:
-            bool_ptr = &record->rollback_resistant;
-            break;
-        case KM_TAG_ALLOW_WHILE_ON_BODY:
-            bool_ptr = &record->allow_while_on_body;
-            break;
-
-        /* Byte arrays*/
-        case KM_TAG_APPLICATION_ID:
-            string_ptr = &record->application_id;
-            break;
+// Writes DER elements forward into a buffer the caller has already sized.
+class DerWriter {
+  public:
+    explicit DerWriter(uint8_t* output) : pos_(output) {}
+
+    void WriteHeader(const uint8_t* identifier, size_t identifier_length, size_t content_length) {
+        memcpy(pos_, identifier, identifier_length);
+        pos_ += identifier_length;
+        if (content_length < 0x80) {
+            *pos_++ = static_cast<uint8_t>(content_length);
+            return;
         }
+        size_t length_octets = der_length_size(content_length) - 1;
+        *pos_++ = static_cast<uint8_t>(0x80 | length_octets);
+        for (size_t i = length_octets; i > 0; --i)
+            *pos_++ = static_cast<uint8_t>(content_length >> (8 * (i - 1)));
+    }
 
-        keymaster_tag_type_t type = keymaster_tag_get_type(entry.tag);
-        switch (type) {
-        case KM_ENUM:
-        case KM_ENUM_REP:
-        case KM_UINT:
-        case KM_UINT_REP: {
-            assert((keymaster_tag_repeatable(entry.tag) && integer_set) ||
-                   (!keymaster_tag_repeatable(entry.tag) && integer_ptr));
+    void WriteHeader(uint8_t identifier, size_t content_length) {
+        WriteHeader(&identifier, 1, content_length);
+    }
 
-            UniquePtr<ASN1_INTEGER, ASN1_INTEGER_Delete> value(ASN1_INTEGER_new());
-            if (!value.get())
-                return KM_ERROR_MEMORY_ALLOCATION_FAILED;
-            if (!ASN1_INTEGER_set(value.get(), get_uint32_value(entry)))
-                return TranslateLastOpenSslError();
+    void WriteInteger(uint8_t identifier, uint64_t value) {
+        size_t content_size = der_integer_content_size(value);
+        WriteHeader(identifier, content_size);
+        // A leading zero octet, if needed to keep the value positive, falls out of the shift.
+        for (size_t i = content_size; i > 0; --i)
+            *pos_++ = (i > 8) ? 0 : static_cast<uint8_t>(value >> (8 * (i - 1)));
+    }
 
-            insert_integer(value.release(), integer_ptr, integer_set);
-            break;
-        }
+    void WriteOctetString(const uint8_t* data, size_t data_length) {
+        WriteHeader(kDerOctetString, data_length);
+        memcpy(pos_, data, data_length);
+        pos_ += data_length;
+    }
 
-        case KM_ULONG:
-        case KM_ULONG_REP:
-        case KM_DATE: {
-            assert((keymaster_tag_repeatable(entry.tag) && integer_set) ||
-                   (!keymaster_tag_repeatable(entry.tag) && integer_ptr));
+    const uint8_t* pos() const { return pos_; }
 
-            UniquePtr<BIGNUM, BIGNUM_Delete> bn_value(BN_new());
-            if (!bn_value.get())
-                return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+  private:
+    uint8_t* pos_;
+};
 
-            if (type == KM_DATE) {
-                if (!Uint64ToBignum(entry.date_time, bn_value.get())) {
-                    return TranslateLastOpenSslError();
-                }
-            } else {
-                if (!Uint64ToBignum(entry.long_integer, bn_value.get())) {
-                    return TranslateLastOpenSslError();
-                }
-            }
+// The contents of one AuthorizationList, gathered from an AuthorizationSet, along with the encoded
+// size of each field so that lengths are known before anything is written.
+struct AuthListValues {
+    // The value of each single-valued field; the last one in the AuthorizationSet wins.
+    const keymaster_key_param_t* value[kAuthListFieldCount];
+    // The values of each SET OF field, sorted as DER requires.  For non-negative integers in
+    // minimal encoding, sorting encodings is the same as sorting values.
+    std::vector<uint32_t> set_values[kAuthListFieldCount];
+    // Size of each field's content, inside its explicit tag, or zero if the field is absent.
+    size_t content_size[kAuthListFieldCount];
+    size_t total_size;
+    keymaster_key_param_t inserted_ec_curve;
+};
 
-            UniquePtr<ASN1_INTEGER, ASN1_INTEGER_Delete> value(
-                BN_to_ASN1_INTEGER(bn_value.get(), nullptr));
-            if (!value.get())
-                return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+static size_t set_content_size(const AuthListValues& values, size_t field) {
+    size_t size = 0;
+    for (uint32_t value : values.set_values[field])
+        size += der_size(1, der_integer_content_size(value));
+    return size;
+}
 
-            insert_integer(value.release(), integer_ptr, integer_set);
-            break;
-        }
+static size_t field_content_size(const AuthListValues& values, size_t field) {
+    keymaster_tag_t tag = kAuthListFields[field].tag;
+    if (keymaster_tag_repeatable(tag))
+        return values.set_values[field].empty() ? 0 : der_size(1, set_content_size(values, field));
+
+    const keymaster_key_param_t* param = values.value[field];
+    if (!param)
+        return 0;
+    switch (keymaster_tag_get_type(tag)) {
+    case KM_BOOL:
+        return der_size(1, 0);
+    case KM_BYTES:
+        return der_size(1, param->blob.data_length);
+    default:
+        return der_size(1, der_integer_content_size(get_integer_value(*param)));
+    }
+}
 
-        case KM_BOOL:
-            assert(bool_ptr);
-            if (!*bool_ptr)
-                *bool_ptr = ASN1_NULL_new();
-            if (!*bool_ptr)
-                return KM_ERROR_MEMORY_ALLOCATION_FAILED;
-            break;
+// Gather the contents of the keymaster AuthorizationSet auth_list for encoding as an
+// AuthorizationList.  Tags that have no field in the record are skipped.
+static keymaster_error_t collect_auth_list(const AuthorizationSet& auth_list,
+                                           AuthListValues* values) {
+    size_t ec_curve_field = kAuthListFieldCount;
+    for (size_t field = 0; field < kAuthListFieldCount; ++field) {
+        values->value[field] = nullptr;
+        if (kAuthListFields[field].tag == KM_TAG_EC_CURVE)
+            ec_curve_field = field;
+    }
 
-        /* Byte arrays*/
-        case KM_BYTES:
-            assert(string_ptr);
-            if (!*string_ptr)
-                *string_ptr = ASN1_OCTET_STRING_new();
-            if (!*string_ptr)
-                return KM_ERROR_MEMORY_ALLOCATION_FAILED;
-            if (!ASN1_OCTET_STRING_set(*string_ptr, entry.blob.data, entry.blob.data_length))
-                return TranslateLastOpenSslError();
+    for (const keymaster_key_param_t& entry : auth_list) {
+        for (size_t field = 0; field < kAuthListFieldCount; ++field) {
+            if (kAuthListFields[field].tag != entry.tag)
+                continue;
+            if (keymaster_tag_repeatable(entry.tag))
+                values->set_values[field].push_back(entry.enumerated);
+            else
+                values->value[field] = &entry;
             break;
-
-        default:
-            return KM_ERROR_UNIMPLEMENTED;
         }
     }
 
@@ -413,19 +272,50 @@ static keymaster_error_t build_auth_list(const AuthorizationSet& auth_list, KM_A
         if (error != KM_ERROR_OK)
             return error;
 
-        UniquePtr<ASN1_INTEGER, ASN1_INTEGER_Delete> value(ASN1_INTEGER_new());
-        if (!value.get())
-            return KM_ERROR_MEMORY_ALLOCATION_FAILED;
-
-        if (!ASN1_INTEGER_set(value.get(), ec_curve))
-            return TranslateLastOpenSslError();
-
-        insert_integer(value.release(), &record->ec_curve, nullptr);
+        values->inserted_ec_curve = keymaster_param_enum(KM_TAG_EC_CURVE, ec_curve);
+        values->value[ec_curve_field] = &values->inserted_ec_curve;
     }
 
+    values->total_size = 0;
+    for (size_t field = 0; field < kAuthListFieldCount; ++field) {
+        std::sort(values->set_values[field].begin(), values->set_values[field].end());
+        values->content_size[field] = field_content_size(*values, field);
+        if (values->content_size[field])
+            values->total_size +=
+                der_size(kAuthListFields[field].header_length, values->content_size[field]);
+    }
     return KM_ERROR_OK;
 }
 
+static void write_auth_list(const AuthListValues& values, DerWriter* writer) {
+    writer->WriteHeader(kDerSequence, values.total_size);
+    for (size_t field = 0; field < kAuthListFieldCount; ++field) {
+        if (!values.content_size[field])
+            continue;
+
+        const AuthListField& field_info = kAuthListFields[field];
+        writer->WriteHeader(field_info.header, field_info.header_length,
+                            values.content_size[field]);
+        const keymaster_key_param_t* param = values.value[field];
+        switch (keymaster_tag_get_type(field_info.tag)) {
+        case KM_ENUM_REP:
+            writer->WriteHeader(kDerSet, set_content_size(values, field));
+            for (uint32_t value : values.set_values[field])
+                writer->WriteInteger(kDerInteger, value);
+            break;
+        case KM_BOOL:
+            writer->WriteHeader(kDerNull, 0);
+            break;
+        case KM_BYTES:
+            writer->WriteOctetString(param->blob.data, param->blob.data_length);
+            break;
+        default:
+            writer->WriteInteger(kDerInteger, get_integer_value(*param));
+            break;
+        }
+    }
+}
+
 // Construct an ASN1.1 DER-encoded attestation record containing the values from sw_enforced and
 // tee_enforced.
 keymaster_error_t build_attestation_record(const AuthorizationSet& attestation_params,
@@ -436,10 +326,6 @@ keymaster_error_t build_attestation_record(const AuthorizationSet& attestation_p
                                            size_t* asn1_key_desc_len) {
     assert(asn1_key_desc && asn1_key_desc_len);
 
-    UniquePtr<KM_KEY_DESCRIPTION, KM_KEY_DESCRIPTION_Delete> key_desc(KM_KEY_DESCRIPTION_new());
-    if (!key_desc.get())
-        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
-
     keymaster_security_level_t keymaster_security_level;
     uint32_t keymaster_version = UINT32_MAX;
     if (tee_enforced.empty()) {
@@ -468,29 +354,26 @@ keymaster_error_t build_attestation_record(const AuthorizationSet& attestation_p
             return KM_ERROR_UNKNOWN_ERROR;
     }
 
-    if (!ASN1_INTEGER_set(key_desc->attestation_version, 1) ||
-        !ASN1_ENUMERATED_set(key_desc->attestation_security_level, context.GetSecurityLevel()) ||
-        !ASN1_INTEGER_set(key_desc->keymaster_version, keymaster_version) ||
-        !ASN1_ENUMERATED_set(key_desc->keymaster_security_level, keymaster_security_level))
-        return TranslateLastOpenSslError();
-
     keymaster_blob_t attestation_challenge = {nullptr, 0};
     if (!attestation_params.GetTagValue(TAG_ATTESTATION_CHALLENGE, &attestation_challenge))
         return KM_ERROR_ATTESTATION_CHALLENGE_MISSING;
-    if (!ASN1_OCTET_STRING_set(key_desc->attestation_challenge, attestation_challenge.data,
-                               attestation_challenge.data_length))
-        return TranslateLastOpenSslError();
 
-    keymaster_error_t error = build_auth_list(sw_enforced, key_desc->software_enforced);
+    UniquePtr<AuthListValues> sw_values(new (std::nothrow) AuthListValues);
+    UniquePtr<AuthListValues> tee_values(new (std::nothrow) AuthListValues);
+    if (!sw_values.get() || !tee_values.get())
+        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+
+    keymaster_error_t error = collect_auth_list(sw_enforced, sw_values.get());
     if (error != KM_ERROR_OK)
         return error;
 
-    error = build_auth_list(tee_enforced, key_desc->tee_enforced);
+    error = collect_auth_list(tee_enforced, tee_values.get());
     if (error != KM_ERROR_OK)
         return error;
 
     // Only check tee_enforced for TAG_INCLUDE_UNIQUE_ID.  If we don't have hardware we can't
     // generate unique IDs.
+    Buffer unique_id;
     if (tee_enforced.GetTagValue(TAG_INCLUDE_UNIQUE_ID)) {
         uint64_t creation_datetime;
         // Only check sw_enforced for TAG_CREATION_DATETIME, since it shouldn't be in tee_enforced,
@@ -503,174 +386,265 @@ keymaster_error_t build_attestation_record(const AuthorizationSet& attestation_p
         keymaster_blob_t application_id = {nullptr, 0};
         sw_enforced.GetTagValue(TAG_APPLICATION_ID, &application_id);
 
-        Buffer unique_id;
         error = context.GenerateUniqueId(
             creation_datetime, application_id,
             attestation_params.GetTagValue(TAG_RESET_SINCE_ID_ROTATION), &unique_id);
         if (error != KM_ERROR_OK)
             return error;
-
-        key_desc->unique_id = ASN1_OCTET_STRING_new();
-        if (!key_desc->unique_id ||
-            !ASN1_OCTET_STRING_set(key_desc->unique_id, unique_id.peek_read(),
-                                   unique_id.available_read()))
-            return TranslateLastOpenSslError();
     }
 
-    int len = i2d_KM_KEY_DESCRIPTION(key_desc.get(), nullptr);
-    if (len < 0)
-        return TranslateLastOpenSslError();
-    *asn1_key_desc_len = len;
-    asn1_key_desc->reset(new uint8_t[*asn1_key_desc_len]);
+    const uint32_t attestation_version = 1;
+    const keymaster_security_level_t attestation_security_level = context.GetSecurityLevel();
+    size_t content_size = der_size(1, der_integer_content_size(attestation_version)) +
+                          der_size(1, der_integer_content_size(attestation_security_level)) +
+                          der_size(1, der_integer_content_size(keymaster_version)) +
+                          der_size(1, der_integer_content_size(keymaster_security_level)) +
+                          der_size(1, attestation_challenge.data_length) +
+                          der_size(1, unique_id.available_read()) +
+                          der_size(1, sw_values->total_size) + der_size(1, tee_values->total_size);
+
+    *asn1_key_desc_len = der_size(1, content_size);
+    asn1_key_desc->reset(new (std::nothrow) uint8_t[*asn1_key_desc_len]);
     if (!asn1_key_desc->get())
         return KM_ERROR_MEMORY_ALLOCATION_FAILED;
-    uint8_t* p = asn1_key_desc->get();
-    len = i2d_KM_KEY_DESCRIPTION(key_desc.get(), &p);
-    if (len < 0)
-        return TranslateLastOpenSslError();
+
+    DerWriter writer(asn1_key_desc->get());
+    writer.WriteHeader(kDerSequence, content_size);
+    writer.WriteInteger(kDerInteger, attestation_version);
+    writer.WriteInteger(kDerEnumerated, attestation_security_level);
+    writer.WriteInteger(kDerInteger, keymaster_version);
+    writer.WriteInteger(kDerEnumerated, keymaster_security_level);
+    writer.WriteOctetString(attestation_challenge.data, attestation_challenge.data_length);
+    writer.WriteOctetString(unique_id.peek_read(), unique_id.available_read());
+    write_auth_list(*sw_values, &writer);
+    write_auth_list(*tee_values, &writer);
+    assert(writer.pos() == asn1_key_desc->get() + *asn1_key_desc_len);
 
     return KM_ERROR_OK;
 }
 
-// Copy all enumerated values with the specified tag from stack to auth_list.
-static bool get_repeated_enums(const stack_st_ASN1_INTEGER* stack, keymaster_tag_t tag,
-                               AuthorizationSet* auth_list) {
-    assert(keymaster_tag_get_type(tag) == KM_ENUM_REP);
-    for (size_t i = 0; i < sk_ASN1_INTEGER_num(stack); ++i) {
-        if (!auth_list->push_back(
-                keymaster_param_enum(tag, ASN1_INTEGER_get(sk_ASN1_INTEGER_value(stack, i)))))
+// Reads DER elements in place, without copying or allocating.
+class DerReader {
+  public:
+    DerReader(const uint8_t* data, size_t data_length) : pos_(data), end_(data + data_length) {}
+
+    /**
+     * Reads the next element's identifier and length, returning its identifier octet (0xBF for
+     * any high tag number, which is then returned in tag_number) and its contents.  Returns false
+     * if the element is malformed or runs past the end of the input.
+     */
+    bool Next(uint8_t* identifier, uint32_t* tag_number, const uint8_t** content,
+              size_t* content_length) {
+        if (pos_ == end_)
             return false;
-    }
-    return true;
-}
+        *identifier = *pos_++;
+        *tag_number = *identifier & 0x1F;
+        if (*tag_number == 0x1F) {
+            *tag_number = 0;
+            do {
+                // Tag numbers that don't fit in 28 bits aren't used by anything we understand.
+                if (pos_ == end_ || *tag_number >= (1 << 21))
+                    return false;
+                *tag_number = (*tag_number << 7) | (*pos_ & 0x7F);
+            } while (*pos_++ & 0x80);
+        }
 
-// Add the specified integer tag/value pair to auth_list.
-template <keymaster_tag_type_t Type, keymaster_tag_t Tag, typename KeymasterEnum>
-static bool get_enum(const ASN1_INTEGER* asn1_int, TypedEnumTag<Type, Tag, KeymasterEnum> tag,
-                     AuthorizationSet* auth_list) {
-    if (!asn1_int)
-        return true;
-    return auth_list->push_back(tag, static_cast<KeymasterEnum>(ASN1_INTEGER_get(asn1_int)));
-}
+        if (pos_ == end_)
+            return false;
+        size_t length = *pos_++;
+        if (length & 0x80) {
+            size_t length_octets = length & 0x7F;
+            if (length_octets == 0 || length_octets > sizeof(size_t))
+                return false;
+            length = 0;
+            for (size_t i = 0; i < length_octets; ++i) {
+                if (pos_ == end_)
+                    return false;
+                length = (length << 8) | *pos_++;
+            }
+        }
+        if (length > static_cast<size_t>(end_ - pos_))
+            return false;
 
-// Add the specified ulong tag/value pair to auth_list.
-static bool get_ulong(const ASN1_INTEGER* asn1_int, keymaster_tag_t tag,
-                      AuthorizationSet* auth_list) {
-    if (!asn1_int)
+        *content = pos_;
+        *content_length = length;
+        pos_ += length;
         return true;
-    UniquePtr<BIGNUM, BIGNUM_Delete> bn(ASN1_INTEGER_to_BN(asn1_int, nullptr));
-    if (!bn.get())
-        return false;
-    uint64_t ulong = BN_get_word(bn.get());
-    return auth_list->push_back(keymaster_param_long(tag, ulong));
-}
-
-// Extract the values from the specified ASN.1 record and place them in auth_list.
-static keymaster_error_t extract_auth_list(const KM_AUTH_LIST* record,
-                                           AuthorizationSet* auth_list) {
-    if (!record)
-        return KM_ERROR_OK;
-
-    // Purpose
-    if (!get_repeated_enums(record->purpose, TAG_PURPOSE, auth_list))
-        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
-
-    // Algorithm
-    if (!get_enum(record->algorithm, TAG_ALGORITHM, auth_list))
-        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
-
-    // Key size
-    if (record->key_size && !auth_list->push_back(TAG_KEY_SIZE, ASN1_INTEGER_get(record->key_size)))
-        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
-
-    // Digest
-    if (!get_repeated_enums(record->digest, TAG_DIGEST, auth_list))
-        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
-
-    // Padding
-    if (!get_repeated_enums(record->padding, TAG_PADDING, auth_list))
-        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
-
-    // EC curve
-    if (!get_enum(record->ec_curve, TAG_EC_CURVE, auth_list))
-        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
-
-    // RSA public exponent
-    if (!get_ulong(record->rsa_public_exponent, TAG_RSA_PUBLIC_EXPONENT, auth_list))
-        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
-
-    // Active date time
-    if (!get_ulong(record->active_date_time, TAG_ACTIVE_DATETIME, auth_list))
-        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
-
-    // Origination expire date time
-    if (!get_ulong(record->origination_expire_date_time, TAG_ORIGINATION_EXPIRE_DATETIME,
-                   auth_list))
-        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
-
-    // Usage Expire date time
-    if (!get_ulong(record->usage_expire_date_time, TAG_USAGE_EXPIRE_DATETIME, auth_list))
-        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    }
 
-    // No auth required
-    if (record->no_auth_required && !auth_list->push_back(TAG_NO_AUTH_REQUIRED))
-        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    /**
+     * Reads the next element, which must have the specified single-octet identifier.
+     */
+    bool Next(uint8_t expected_identifier, const uint8_t** content, size_t* content_length) {
+        uint8_t identifier;
+        uint32_t tag_number;
+        return Next(&identifier, &tag_number, content, content_length) &&
+               identifier == expected_identifier;
+    }
 
-    // User auth type
-    if (!get_enum(record->user_auth_type, TAG_USER_AUTH_TYPE, auth_list))
-        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    bool ReadInteger(uint8_t identifier, uint64_t* value) {
+        const uint8_t* content;
+        size_t content_length;
+        return Next(identifier, &content, &content_length) &&
+               decode_integer(content, content_length, value);
+    }
 
-    // Auth timeout
-    if (record->auth_timeout &&
-        !auth_list->push_back(TAG_AUTH_TIMEOUT, ASN1_INTEGER_get(record->auth_timeout)))
-        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    bool ReadOctetString(keymaster_blob_t* blob) {
+        return Next(kDerOctetString, &blob->data, &blob->data_length);
+    }
 
-    // All applications
-    if (record->all_applications && !auth_list->push_back(TAG_ALL_APPLICATIONS))
-        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    bool empty() const { return pos_ == end_; }
 
-    // Application ID
-    if (record->application_id &&
-        !auth_list->push_back(TAG_APPLICATION_ID, record->application_id->data,
-                              record->application_id->length))
-        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+  private:
+    // Decodes a two's complement integer of up to 64 bits, or a 64-bit unsigned one with its
+    // leading zero octet.  Negative values are returned sign-extended, so that a 32-bit value
+    // written as a signed long comes back out of the low 32 bits unchanged.
+    static bool decode_integer(const uint8_t* content, size_t content_length, uint64_t* value) {
+        if (content_length == 0 || content_length > 9 || (content_length == 9 && content[0]))
+            return false;
+        *value = (content[0] & 0x80) ? UINT64_MAX : 0;
+        for (size_t i = 0; i < content_length; ++i)
+            *value = (*value << 8) | content[i];
+        return true;
+    }
 
-    // Creation date time
-    if (!get_ulong(record->creation_date_time, TAG_CREATION_DATETIME, auth_list))
-        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    const uint8_t* pos_;
+    const uint8_t* end_;
+};
 
-    // Origin
-    if (!get_enum(record->origin, TAG_ORIGIN, auth_list))
-        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+// The root of trust isn't built from or mapped to an AuthorizationSet, only checked for
+// well-formedness.
+static bool check_root_of_trust(const uint8_t* content, size_t content_length) {
+    DerReader outer(content, content_length);
+    const uint8_t* sequence;
+    size_t sequence_length;
+    if (!outer.Next(kDerSequence, &sequence, &sequence_length) || !outer.empty())
+        return false;
 
-    // Rollback resistant
-    if (record->rollback_resistant && !auth_list->push_back(TAG_ROLLBACK_RESISTANT))
-        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    DerReader reader(sequence, sequence_length);
+    keymaster_blob_t verified_boot_key;
+    const uint8_t* device_locked;
+    size_t device_locked_length;
+    uint64_t verified_boot_state;
+    return reader.ReadOctetString(&verified_boot_key) &&
+           reader.Next(kDerBoolean, &device_locked, &device_locked_length) &&
+           device_locked_length == 1 && reader.ReadInteger(kDerEnumerated, &verified_boot_state) &&
+           reader.empty();
+}
 
-    // Root of trust
-    if (record->root_of_trust) {
-        KM_ROOT_OF_TRUST* rot = record->root_of_trust;
-        if (!rot->verified_boot_key)
-            return KM_ERROR_INVALID_KEY_BLOB;
+// Add the value of one explicitly-tagged authorization list field to auth_list.
+static keymaster_error_t extract_auth_list_field(keymaster_tag_t tag, const uint8_t* content,
+                                                 size_t content_length,
+                                                 AuthorizationSet* auth_list) {
+    DerReader reader(content, content_length);
+    keymaster_key_param_t param;
+    uint64_t value;
+    switch (keymaster_tag_get_type(tag)) {
+    case KM_ENUM_REP: {
+        const uint8_t* set;
+        size_t set_length;
+        if (!reader.Next(kDerSet, &set, &set_length) || !reader.empty())
+            return KM_ERROR_INVALID_ARGUMENT;
+        DerReader set_reader(set, set_length);
+        while (!set_reader.empty()) {
+            if (!set_reader.ReadInteger(kDerInteger, &value))
+                return KM_ERROR_INVALID_ARGUMENT;
+            if (!auth_list->push_back(keymaster_param_enum(tag, static_cast<uint32_t>(value))))
+                return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+        }
+        return KM_ERROR_OK;
+    }
 
-        // Other root of trust fields are not mapped to auth set entries.
+    case KM_ENUM:
+        if (!reader.ReadInteger(kDerInteger, &value))
+            return KM_ERROR_INVALID_ARGUMENT;
+        param = keymaster_param_enum(tag, static_cast<uint32_t>(value));
+        break;
+    case KM_UINT:
+        if (!reader.ReadInteger(kDerInteger, &value))
+            return KM_ERROR_INVALID_ARGUMENT;
+        param = keymaster_param_int(tag, static_cast<uint32_t>(value));
+        break;
+    case KM_ULONG:
+        if (!reader.ReadInteger(kDerInteger, &value))
+            return KM_ERROR_INVALID_ARGUMENT;
+        param = keymaster_param_long(tag, value);
+        break;
+    case KM_DATE:
+        if (!reader.ReadInteger(kDerInteger, &value))
+            return KM_ERROR_INVALID_ARGUMENT;
+        param = keymaster_param_date(tag, value);
+        break;
+    case KM_BOOL: {
+        const uint8_t* null;
+        size_t null_length;
+        if (!reader.Next(kDerNull, &null, &null_length) || null_length != 0)
+            return KM_ERROR_INVALID_ARGUMENT;
+        param = keymaster_param_bool(tag);
+        break;
+    }
+    case KM_BYTES: {
+        keymaster_blob_t blob;
+        if (!reader.ReadOctetString(&blob))
+            return KM_ERROR_INVALID_ARGUMENT;
+        param = keymaster_param_blob(tag, blob.data, blob.data_length);
+        break;
+    }
+    default:
+        assert(false);
+        return KM_ERROR_UNKNOWN_ERROR;
     }
 
-    // OS Version
-    if (record->os_version &&
-        !auth_list->push_back(TAG_OS_VERSION, ASN1_INTEGER_get(record->os_version)))
+    if (!reader.empty())
+        return KM_ERROR_INVALID_ARGUMENT;
+    if (!auth_list->push_back(param))
         return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    return KM_ERROR_OK;
+}
 
-    // OS Patch level
-    if (record->os_patchlevel &&
-        !auth_list->push_back(TAG_OS_PATCHLEVEL, ASN1_INTEGER_get(record->os_patchlevel)))
-        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+// Extract the values from the DER-encoded AuthorizationList SEQUENCE at the front of reader and
+// place them in auth_list.  Fields this implementation doesn't know about are skipped.
+static keymaster_error_t extract_auth_list(DerReader* record_reader, AuthorizationSet* auth_list) {
+    const uint8_t* sequence;
+    size_t sequence_length;
+    if (!record_reader->Next(kDerSequence, &sequence, &sequence_length))
+        return KM_ERROR_INVALID_ARGUMENT;
+
+    DerReader reader(sequence, sequence_length);
+    uint32_t previous_tag_number = 0;
+    while (!reader.empty()) {
+        uint8_t identifier;
+        uint32_t tag_number;
+        const uint8_t* content;
+        size_t content_length;
+        // Every field is explicitly context-tagged, and DER puts them in increasing tag order.
+        if (!reader.Next(&identifier, &tag_number, &content, &content_length) ||
+            (identifier & 0xE0) != 0xA0 || tag_number <= previous_tag_number)
+            return KM_ERROR_INVALID_ARGUMENT;
+        previous_tag_number = tag_number;
+
+        if (tag_number == explicit_tag_number(KM_TAG_ROOT_OF_TRUST)) {
+            if (!check_root_of_trust(content, content_length))
+                return KM_ERROR_INVALID_KEY_BLOB;
+            continue;
+        }
 
+        for (const AuthListField& field : kAuthListFields) {
+            if (explicit_tag_number(field.tag) != tag_number)
+                continue;
+            keymaster_error_t error =
+                extract_auth_list_field(field.tag, content, content_length, auth_list);
+            if (error != KM_ERROR_OK)
+                return error;
+            break;
+        }
+    }
     return KM_ERROR_OK;
 }
 
 // Parse the DER-encoded attestation record, placing the results in keymaster_version,
-// attestation_challenge, software_enforced, tee_enforced and unique_id.
+// attestation_challenge, software_enforced, tee_enforced and unique_id.  The record is walked in
+// place; no ASN.1 objects are built.
 keymaster_error_t parse_attestation_record(const uint8_t* asn1_key_desc, size_t asn1_key_desc_len,
                                            uint32_t* attestation_version,  //
                                            keymaster_security_level_t* attestation_security_level,
@@ -680,31 +654,43 @@ keymaster_error_t parse_attestation_record(const uint8_t* asn1_key_desc, size_t
                                            AuthorizationSet* software_enforced,
                                            AuthorizationSet* tee_enforced,
                                            keymaster_blob_t* unique_id) {
-    const uint8_t* p = asn1_key_desc;
-    UniquePtr<KM_KEY_DESCRIPTION, KM_KEY_DESCRIPTION_Delete> record(
-        d2i_KM_KEY_DESCRIPTION(nullptr, &p, asn1_key_desc_len));
-    if (!record.get())
-        return TranslateLastOpenSslError();
-
-    *attestation_version = ASN1_INTEGER_get(record->attestation_version);
-    *attestation_security_level = static_cast<keymaster_security_level_t>(
-        ASN1_ENUMERATED_get(record->attestation_security_level));
-    *keymaster_version = ASN1_INTEGER_get(record->keymaster_version);
-    *keymaster_security_level = static_cast<keymaster_security_level_t>(
-        ASN1_ENUMERATED_get(record->keymaster_security_level));
-
-    attestation_challenge->data =
-        dup_buffer(record->attestation_challenge->data, record->attestation_challenge->length);
-    attestation_challenge->data_length = record->attestation_challenge->length;
-
-    unique_id->data = dup_buffer(record->unique_id->data, record->unique_id->length);
-    unique_id->data_length = record->unique_id->length;
-
-    keymaster_error_t error = extract_auth_list(record->software_enforced, software_enforced);
+    DerReader outer(asn1_key_desc, asn1_key_desc_len);
+    const uint8_t* sequence;
+    size_t sequence_length;
+    if (!outer.Next(kDerSequence, &sequence, &sequence_length))
+        return KM_ERROR_INVALID_ARGUMENT;
+
+    DerReader reader(sequence, sequence_length);
+    uint64_t values[4];
+    keymaster_blob_t challenge, id;
+    if (!reader.ReadInteger(kDerInteger, &values[0]) ||
+        !reader.ReadInteger(kDerEnumerated, &values[1]) ||
+        !reader.ReadInteger(kDerInteger, &values[2]) ||
+        !reader.ReadInteger(kDerEnumerated, &values[3]) || !reader.ReadOctetString(&challenge) ||
+        !reader.ReadOctetString(&id))
+        return KM_ERROR_INVALID_ARGUMENT;
+
+    keymaster_error_t error = extract_auth_list(&reader, software_enforced);
     if (error != KM_ERROR_OK)
         return error;
+    error = extract_auth_list(&reader, tee_enforced);
+    if (error != KM_ERROR_OK)
+        return error;
+    if (!reader.empty())
+        return KM_ERROR_INVALID_ARGUMENT;
+
+    *attestation_version = static_cast<uint32_t>(values[0]);
+    *attestation_security_level = static_cast<keymaster_security_level_t>(values[1]);
+    *keymaster_version = static_cast<uint32_t>(values[2]);
+    *keymaster_security_level = static_cast<keymaster_security_level_t>(values[3]);
+
+    attestation_challenge->data = dup_buffer(challenge.data, challenge.data_length);
+    attestation_challenge->data_length = challenge.data_length;
 
-    return extract_auth_list(record->tee_enforced, tee_enforced);
+    unique_id->data = dup_buffer(id.data, id.data_length);
+    unique_id->data_length = id.data_length;
+
+    return KM_ERROR_OK;
 }
 
 }  // namepace keymaster
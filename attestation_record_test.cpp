@@ -141,5 +141,188 @@ TEST(AttestTest, Simple) {
     EXPECT_EQ(sw_set, parsed_sw_set);
 }
 
+static const uint8_t kFullRecordEncoding[] = {
+    0x30, 0x82, 0x01, 0x46, 0x02, 0x01, 0x01, 0x0a, 0x01, 0x00, 0x02, 0x01,
+    0x01, 0x0a, 0x01, 0x01, 0x04, 0x05, 0x68, 0x65, 0x6c, 0x6c, 0x6f, 0x04,
+    0x03, 0x66, 0x6f, 0x6f, 0x30, 0x81, 0xc0, 0xbf, 0x83, 0x10, 0x0b, 0x02,
+    0x09, 0x00, 0x80, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xbf, 0x83,
+    0x11, 0x03, 0x02, 0x01, 0x00, 0xbf, 0x83, 0x12, 0x04, 0x02, 0x02, 0x00,
+    0x80, 0xbf, 0x83, 0x7a, 0x02, 0x05, 0x00, 0xbf, 0x84, 0x58, 0x02, 0x05,
+    0x00, 0xbf, 0x84, 0x59, 0x81, 0x85, 0x04, 0x81, 0x82, 0x61, 0x61, 0x61,
+    0x61, 0x61, 0x61, 0x61, 0x61, 0x61, 0x61, 0x61, 0x61, 0x61, 0x61, 0x61,
+    0x61, 0x61, 0x61, 0x61, 0x61, 0x61, 0x61, 0x61, 0x61, 0x61, 0x61, 0x61,
+    0x61, 0x61, 0x61, 0x61, 0x61, 0x61, 0x61, 0x61, 0x61, 0x61, 0x61, 0x61,
+    0x61, 0x61, 0x61, 0x61, 0x61, 0x61, 0x61, 0x61, 0x61, 0x61, 0x61, 0x61,
+    0x61, 0x61, 0x61, 0x61, 0x61, 0x61, 0x61, 0x61, 0x61, 0x61, 0x61, 0x61,
+    0x61, 0x61, 0x61, 0x61, 0x61, 0x61, 0x61, 0x61, 0x61, 0x61, 0x61, 0x61,
+    0x61, 0x61, 0x61, 0x61, 0x61, 0x61, 0x61, 0x61, 0x61, 0x61, 0x61, 0x61,
+    0x61, 0x61, 0x61, 0x61, 0x61, 0x61, 0x61, 0x61, 0x61, 0x61, 0x61, 0x61,
+    0x61, 0x61, 0x61, 0x61, 0x61, 0x61, 0x61, 0x61, 0x61, 0x61, 0x61, 0x61,
+    0x61, 0x61, 0x61, 0x61, 0x61, 0x61, 0x61, 0x61, 0x61, 0x61, 0x61, 0x61,
+    0x61, 0x61, 0x61, 0x61, 0x61, 0x61, 0x61, 0xbf, 0x85, 0x3d, 0x08, 0x02,
+    0x06, 0x01, 0x57, 0xc0, 0x4c, 0x2c, 0x00, 0x30, 0x69, 0xa1, 0x08, 0x31,
+    0x06, 0x02, 0x01, 0x02, 0x02, 0x01, 0x03, 0xa2, 0x03, 0x02, 0x01, 0x01,
+    0xa3, 0x04, 0x02, 0x02, 0x08, 0x00, 0xa5, 0x0b, 0x31, 0x09, 0x02, 0x01,
+    0x00, 0x02, 0x01, 0x04, 0x02, 0x01, 0x06, 0xa6, 0x08, 0x31, 0x06, 0x02,
+    0x01, 0x03, 0x02, 0x01, 0x05, 0xbf, 0x81, 0x48, 0x05, 0x02, 0x03, 0x01,
+    0x00, 0x01, 0xbf, 0x83, 0x77, 0x02, 0x05, 0x00, 0xbf, 0x83, 0x78, 0x03,
+    0x02, 0x01, 0x01, 0xbf, 0x83, 0x79, 0x04, 0x02, 0x02, 0x01, 0x2c, 0xbf,
+    0x85, 0x3e, 0x03, 0x02, 0x01, 0x00, 0xbf, 0x85, 0x3f, 0x02, 0x05, 0x00,
+    0xbf, 0x85, 0x41, 0x05, 0x02, 0x03, 0x01, 0x11, 0x70, 0xbf, 0x85, 0x42,
+    0x05, 0x02, 0x03, 0x03, 0x13, 0x8a,
+};
+
+static const uint8_t kKeymaster1EcRecordEncoding[] = {
+    0x30, 0x37, 0x02, 0x01, 0x01, 0x0a, 0x01, 0x00, 0x02, 0x01, 0x01, 0x0a,
+    0x01, 0x01, 0x04, 0x05, 0x68, 0x65, 0x6c, 0x6c, 0x6f, 0x04, 0x00, 0x30,
+    0x00, 0x30, 0x1e, 0xa1, 0x05, 0x31, 0x03, 0x02, 0x01, 0x02, 0xa2, 0x03,
+    0x02, 0x01, 0x03, 0xa3, 0x04, 0x02, 0x02, 0x01, 0x00, 0xa5, 0x05, 0x31,
+    0x03, 0x02, 0x01, 0x04, 0xaa, 0x03, 0x02, 0x01, 0x01,
+};
+
+static const uint8_t kEmptyRecordEncoding[] = {
+    0x30, 0x19, 0x02, 0x01, 0x01, 0x0a, 0x01, 0x00, 0x02, 0x01, 0x02, 0x0a,
+    0x01, 0x00, 0x04, 0x05, 0x68, 0x65, 0x6c, 0x6c, 0x6f, 0x04, 0x00, 0x30,
+    0x00, 0x30, 0x00,
+};
+
+// Builds an attestation record and checks that its encoding is exactly expected, which was
+// produced by the OpenSSL ASN.1 template encoder that build_attestation_record used to call.
+static void CheckEncoding(const AuthorizationSet& sw_set, const AuthorizationSet& hw_set,
+                          const uint8_t* expected, size_t expected_len) {
+    UniquePtr<uint8_t[]> asn1;
+    size_t asn1_len;
+    AuthorizationSet attest_params(
+        AuthorizationSetBuilder().Authorization(TAG_ATTESTATION_CHALLENGE, "hello", 5));
+    ASSERT_EQ(KM_ERROR_OK, build_attestation_record(attest_params, sw_set, hw_set, TestContext(),
+                                                    &asn1, &asn1_len));
+    ASSERT_EQ(expected_len, asn1_len);
+    EXPECT_EQ(0, memcmp(expected, asn1.get(), asn1_len));
+}
+
+TEST(AttestTest, EncodingMatchesTemplateEncoder) {
+    std::string application_id(130, 'a');
+    AuthorizationSet hw_set(AuthorizationSetBuilder()
+                                .Authorization(TAG_PURPOSE, KM_PURPOSE_VERIFY)
+                                .Authorization(TAG_PURPOSE, KM_PURPOSE_SIGN)
+                                .Authorization(TAG_ALGORITHM, KM_ALGORITHM_RSA)
+                                .Authorization(TAG_KEY_SIZE, 2048)
+                                .Authorization(TAG_RSA_PUBLIC_EXPONENT, 65537)
+                                .Digest(KM_DIGEST_SHA_2_512)
+                                .Digest(KM_DIGEST_NONE)
+                                .Digest(KM_DIGEST_SHA_2_256)
+                                .Padding(KM_PAD_RSA_PSS)
+                                .Padding(KM_PAD_RSA_PKCS1_1_5_SIGN)
+                                .Authorization(TAG_BLOCK_MODE, KM_MODE_ECB)
+                                .Authorization(TAG_USER_SECURE_ID, 7)
+                                .Authorization(TAG_USER_AUTH_TYPE, HW_AUTH_PASSWORD)
+                                .Authorization(TAG_AUTH_TIMEOUT, 300)
+                                .Authorization(TAG_NO_AUTH_REQUIRED)
+                                .Authorization(TAG_ROLLBACK_RESISTANT)
+                                .Authorization(TAG_INCLUDE_UNIQUE_ID)
+                                .Authorization(TAG_ORIGIN, KM_ORIGIN_GENERATED)
+                                .Authorization(TAG_OS_VERSION, 70000)
+                                .Authorization(TAG_OS_PATCHLEVEL, 201610));
+    AuthorizationSet sw_set(AuthorizationSetBuilder()
+                                .Authorization(TAG_ACTIVE_DATETIME, 0x8000000000000000ULL)
+                                .Authorization(TAG_ORIGINATION_EXPIRE_DATETIME, 0)
+                                .Authorization(TAG_USAGE_EXPIRE_DATETIME, 0x80)
+                                .Authorization(TAG_CREATION_DATETIME, 1476400000000ULL)
+                                .Authorization(TAG_ALLOW_WHILE_ON_BODY)
+                                .Authorization(TAG_ALL_APPLICATIONS)
+                                .Authorization(TAG_APPLICATION_ID, application_id.data(),
+                                               application_id.size()));
+    CheckEncoding(sw_set, hw_set, kFullRecordEncoding, sizeof(kFullRecordEncoding));
+}
+
+TEST(AttestTest, EncodingOfKeymaster1EcKey) {
+    // An EC key with no curve gets one inserted, derived from its size.
+    AuthorizationSet hw_set(AuthorizationSetBuilder()
+                                .Authorization(TAG_ALGORITHM, KM_ALGORITHM_EC)
+                                .Authorization(TAG_KEY_SIZE, 256)
+                                .Authorization(TAG_PURPOSE, KM_PURPOSE_SIGN)
+                                .Digest(KM_DIGEST_SHA_2_256));
+    CheckEncoding(AuthorizationSet(), hw_set, kKeymaster1EcRecordEncoding,
+                  sizeof(kKeymaster1EcRecordEncoding));
+}
+
+TEST(AttestTest, EncodingOfEmptyAuthLists) {
+    CheckEncoding(AuthorizationSet(), AuthorizationSet(), kEmptyRecordEncoding,
+                  sizeof(kEmptyRecordEncoding));
+}
+
+// Parses an attestation record, returning the authorization lists and freeing everything else.
+static keymaster_error_t Parse(const uint8_t* asn1, size_t asn1_len, AuthorizationSet* sw_set,
+                               AuthorizationSet* hw_set, uint32_t* keymaster_version = nullptr) {
+    uint32_t attestation_version;
+    uint32_t parsed_keymaster_version;
+    keymaster_security_level_t attestation_security_level;
+    keymaster_security_level_t keymaster_security_level;
+    keymaster_blob_t attestation_challenge = {};
+    keymaster_blob_t unique_id = {};
+    keymaster_error_t error = parse_attestation_record(
+        asn1, asn1_len, &attestation_version, &attestation_security_level,
+        &parsed_keymaster_version, &keymaster_security_level, &attestation_challenge, sw_set,
+        hw_set, &unique_id);
+    delete[] attestation_challenge.data;
+    delete[] unique_id.data;
+    if (keymaster_version)
+        *keymaster_version = parsed_keymaster_version;
+    return error;
+}
+
+TEST(AttestTest, ParseFullRecord) {
+    AuthorizationSet sw_set;
+    AuthorizationSet hw_set;
+    uint32_t keymaster_version;
+    ASSERT_EQ(KM_ERROR_OK, Parse(kFullRecordEncoding, sizeof(kFullRecordEncoding), &sw_set,
+                                 &hw_set, &keymaster_version));
+    EXPECT_EQ(1U, keymaster_version);
+
+    EXPECT_EQ(17U, hw_set.size());
+    EXPECT_TRUE(hw_set.Contains(TAG_PURPOSE, KM_PURPOSE_SIGN));
+    EXPECT_TRUE(hw_set.Contains(TAG_DIGEST, KM_DIGEST_NONE));
+    EXPECT_TRUE(hw_set.Contains(TAG_USER_AUTH_TYPE, HW_AUTH_PASSWORD));
+    uint64_t public_exponent;
+    EXPECT_TRUE(hw_set.GetTagValue(TAG_RSA_PUBLIC_EXPONENT, &public_exponent));
+    EXPECT_EQ(65537U, public_exponent);
+    EXPECT_TRUE(hw_set.Contains(TAG_ROLLBACK_RESISTANT));
+    EXPECT_TRUE(hw_set.Contains(TAG_OS_PATCHLEVEL, 201610));
+    EXPECT_FALSE(hw_set.Contains(TAG_BLOCK_MODE));
+
+    EXPECT_EQ(7U, sw_set.size());
+    uint64_t active_datetime;
+    EXPECT_TRUE(sw_set.GetTagValue(TAG_ACTIVE_DATETIME, &active_datetime));
+    EXPECT_EQ(0x8000000000000000ULL, active_datetime);
+    EXPECT_TRUE(sw_set.Contains(TAG_ALLOW_WHILE_ON_BODY));
+    keymaster_blob_t application_id;
+    EXPECT_TRUE(sw_set.GetTagValue(TAG_APPLICATION_ID, &application_id));
+    EXPECT_EQ(130U, application_id.data_length);
+}
+
+TEST(AttestTest, ParseNegativelyEncodedEnum) {
+    // Some encoders write 32-bit values such as HW_AUTH_ANY as signed integers.
+    static const uint8_t kRecord[] = {
+        0x30, 0x1b, 0x02, 0x01, 0x01, 0x0a, 0x01, 0x00, 0x02, 0x01, 0x02, 0x0a,
+        0x01, 0x00, 0x04, 0x00, 0x04, 0x00, 0x30, 0x00, 0x30, 0x07, 0xbf, 0x83,
+        0x78, 0x03, 0x02, 0x01, 0xff,
+    };
+    AuthorizationSet sw_set;
+    AuthorizationSet hw_set;
+    ASSERT_EQ(KM_ERROR_OK, Parse(kRecord, sizeof(kRecord), &sw_set, &hw_set));
+    EXPECT_EQ(0U, sw_set.size());
+    EXPECT_EQ(1U, hw_set.size());
+    EXPECT_TRUE(hw_set.Contains(TAG_USER_AUTH_TYPE, HW_AUTH_ANY));
+}
+
+TEST(AttestTest, ParseRejectsTruncatedRecords) {
+    for (size_t len = 0; len < sizeof(kFullRecordEncoding); ++len) {
+        AuthorizationSet sw_set;
+        AuthorizationSet hw_set;
+        EXPECT_EQ(KM_ERROR_INVALID_ARGUMENT, Parse(kFullRecordEncoding, len, &sw_set, &hw_set))
+            << "Length " << len;
+    }
+}
+
 }  // namespace test
 }  // namespace keymaster
@@ -0,0 +1,210 @@
+/*
+ * Copyright 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "attestation_signer.h"
+
+#include <mutex>
+#include <new>
+#include <string>
+#include <vector>
+
+#include <openssl/x509v3.h>
+
+#include "openssl_err.h"
+
+namespace keymaster {
+
+// The parts of an attestation certificate that depend only on the certificate of the key that
+// signs it.  They're built once per signing certificate and copied into each attestation.
+struct AttestationCertTemplate {
+    std::string signing_cert;  // DER encoding, identifying the template.
+    X509_NAME_Ptr issuer_name;
+    X509_NAME_Ptr subject_name;
+    X509_EXTENSION_Ptr auth_key_id;
+};
+
+const size_t kMaxAttestationCertTemplates = 4;
+
+static std::mutex attestation_cert_templates_mutex;
+static std::vector<std::shared_ptr<const AttestationCertTemplate>> attestation_cert_templates;
+
+static keymaster_error_t build_attestation_cert_template(const KeymasterContext& context,
+                                                         keymaster_algorithm_t sign_algorithm,
+                                                         const keymaster_blob_t& signing_cert_blob,
+                                                         AttestationCertTemplate* cert_template) {
+    keymaster_error_t error;
+    X509_Ptr signing_cert(context.AttestationSigningCertificate(sign_algorithm, &error));
+    if (!signing_cert.get()) {
+        if (error != KM_ERROR_UNIMPLEMENTED)
+            return error;
+        const uint8_t* p = signing_cert_blob.data;
+        signing_cert.reset(d2i_X509(nullptr, &p, signing_cert_blob.data_length));
+        if (!signing_cert.get())
+            return TranslateLastOpenSslError();
+    }
+
+    // TODO(swillden): Find useful values (if possible) for issuerName and subjectName.
+    cert_template->issuer_name.reset(X509_NAME_new());
+    if (!cert_template->issuer_name.get() ||
+        !X509_NAME_add_entry_by_txt(cert_template->issuer_name.get(), "CN", MBSTRING_ASC,
+                                    reinterpret_cast<const uint8_t*>("Android Keymaster"),
+                                    -1 /* len */, -1 /* loc */, 0 /* set */))
+        return TranslateLastOpenSslError();
+
+    cert_template->subject_name.reset(X509_NAME_new());
+    if (!cert_template->subject_name.get() ||
+        !X509_NAME_add_entry_by_txt(cert_template->subject_name.get(), "CN", MBSTRING_ASC,
+                                    reinterpret_cast<const uint8_t*>("A Keymaster Key"),
+                                    -1 /* len */, -1 /* loc */, 0 /* set */))
+        return TranslateLastOpenSslError();
+
+    // The authority key ID only depends on the issuer certificate.
+    UniquePtr<X509V3_CTX> x509v3_ctx(new X509V3_CTX);
+    *x509v3_ctx = {};
+    X509V3_set_ctx(x509v3_ctx.get(), signing_cert.get(), nullptr /* subject */, nullptr /* req */,
+                   nullptr /* crl */, 0 /* flags */);
+    cert_template->auth_key_id.reset(X509V3_EXT_nconf_nid(nullptr /* conf */, x509v3_ctx.get(),
+                                                          NID_authority_key_identifier,
+                                                          const_cast<char*>("keyid:always")));
+    if (!cert_template->auth_key_id.get())
+        return TranslateLastOpenSslError();
+
+    cert_template->signing_cert.assign(reinterpret_cast<const char*>(signing_cert_blob.data),
+                                       signing_cert_blob.data_length);
+    return KM_ERROR_OK;
+}
+
+static keymaster_error_t
+get_attestation_cert_template(const KeymasterContext& context, keymaster_algorithm_t sign_algorithm,
+                              const keymaster_blob_t& signing_cert_blob,
+                              std::shared_ptr<const AttestationCertTemplate>* cert_template) {
+    std::string signing_cert(reinterpret_cast<const char*>(signing_cert_blob.data),
+                             signing_cert_blob.data_length);
+    {
+        std::lock_guard<std::mutex> lock(attestation_cert_templates_mutex);
+        for (const auto& candidate : attestation_cert_templates) {
+            if (candidate->signing_cert == signing_cert) {
+                *cert_template = candidate;
+                return KM_ERROR_OK;
+            }
+        }
+    }
+
+    std::shared_ptr<AttestationCertTemplate> new_template(new (std::nothrow)
+                                                              AttestationCertTemplate);
+    if (!new_template)
+        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    keymaster_error_t error = build_attestation_cert_template(
+        context, sign_algorithm, signing_cert_blob, new_template.get());
+    if (error != KM_ERROR_OK)
+        return error;
+
+    std::lock_guard<std::mutex> lock(attestation_cert_templates_mutex);
+    if (attestation_cert_templates.size() >= kMaxAttestationCertTemplates)
+        attestation_cert_templates.erase(attestation_cert_templates.begin());
+    attestation_cert_templates.push_back(new_template);
+    *cert_template = new_template;
+    return KM_ERROR_OK;
+}
+
+AttestationSigner::AttestationSigner() : sign_algorithm_(KM_ALGORITHM_RSA) {}
+
+AttestationSigner::~AttestationSigner() {}
+
+keymaster_error_t AttestationSigner::SignAlgorithm(const AuthorizationSet& tee_enforced,
+                                                   const AuthorizationSet& sw_enforced,
+                                                   keymaster_algorithm_t* sign_algorithm) {
+    if ((!sw_enforced.GetTagValue(TAG_ALGORITHM, sign_algorithm) &&
+         !tee_enforced.GetTagValue(TAG_ALGORITHM, sign_algorithm)))
+        return KM_ERROR_UNKNOWN_ERROR;
+
+    if ((*sign_algorithm != KM_ALGORITHM_RSA && *sign_algorithm != KM_ALGORITHM_EC))
+        return KM_ERROR_INCOMPATIBLE_ALGORITHM;
+    return KM_ERROR_OK;
+}
+
+keymaster_error_t AttestationSigner::Init(const KeymasterContext& context,
+                                          keymaster_algorithm_t sign_algorithm) {
+    sign_algorithm_ = sign_algorithm;
+
+    keymaster_error_t error;
+    issuer_chain_.reset(context.AttestationChain(sign_algorithm, &error));
+    if (!issuer_chain_.get())
+        return error;
+
+    // The chain must hold at least the certificate of the key that signs attestations.
+    if (issuer_chain_->entry_count < 1)
+        return KM_ERROR_UNKNOWN_ERROR;
+
+    error = get_attestation_cert_template(context, sign_algorithm, issuer_chain_->entries[0],
+                                          &cert_template_);
+    if (error != KM_ERROR_OK)
+        return error;
+
+    sign_key_.reset(context.AttestationKey(sign_algorithm, &error));
+    if (!sign_key_.get())
+        return error;
+    return KM_ERROR_OK;
+}
+
+keymaster_error_t AttestationSigner::SetNames(X509* certificate) const {
+    if (!X509_set_issuer_name(certificate, cert_template_->issuer_name.get() /* copied */) ||
+        !X509_set_subject_name(certificate, cert_template_->subject_name.get() /* copied */))
+        return TranslateLastOpenSslError();
+    return KM_ERROR_OK;
+}
+
+keymaster_error_t AttestationSigner::Sign(X509* certificate) const {
+    if (!X509_add_ext(certificate, cert_template_->auth_key_id.get() /* copied */,
+                      -1 /* insert at end */))
+        return TranslateLastOpenSslError();
+
+    if (!X509_sign(certificate, sign_key_.get(), EVP_sha256()))
+        return TranslateLastOpenSslError();
+    return KM_ERROR_OK;
+}
+
+keymaster_error_t AttestationSigner::BuildCertificateChain(keymaster_blob_t* leaf,
+                                                           keymaster_cert_chain_t* chain) const {
+    UniquePtr<const uint8_t[]> leaf_data(leaf->data);
+    leaf->data = nullptr;
+
+    if (chain->entries) {
+        for (size_t i = 0; i < chain->entry_count; ++i)
+            delete[] chain->entries[i].data;
+        delete[] chain->entries;
+    }
+
+    chain->entry_count = 0;
+    chain->entries = new (std::nothrow) keymaster_blob_t[issuer_chain_->entry_count + 1];
+    if (!chain->entries)
+        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+
+    chain->entries[0].data = leaf_data.release();
+    chain->entries[0].data_length = leaf->data_length;
+    chain->entry_count = 1;
+    for (size_t i = 0; i < issuer_chain_->entry_count; ++i) {
+        const keymaster_blob_t& issuer = issuer_chain_->entries[i];
+        chain->entries[i + 1].data = dup_buffer(issuer.data, issuer.data_length);
+        if (!chain->entries[i + 1].data)
+            return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+        chain->entries[i + 1].data_length = issuer.data_length;
+        chain->entry_count = i + 2;
+    }
+    return KM_ERROR_OK;
+}
+
+}  // namespace keymaster
@@ -0,0 +1,94 @@
+/*
+ * Copyright 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SYSTEM_KEYMASTER_ATTESTATION_SIGNER_H_
+#define SYSTEM_KEYMASTER_ATTESTATION_SIGNER_H_
+
+#include <memory>
+
+#include <openssl/x509.h>
+
+#include <keymaster/android_keymaster_utils.h>
+#include <keymaster/authorization_set.h>
+#include <keymaster/keymaster_context.h>
+
+#include "openssl_utils.h"
+
+namespace keymaster {
+
+struct AttestationCertTemplate;
+
+/**
+ * Everything needed to sign attestation certificates with one of the context's attestation keys:
+ * the key itself, its certificate chain, and the issuer-dependent parts of the certificates it
+ * signs.  Loading these once and signing several certificates with them saves reloading the key
+ * and copying the chain for each.  Once initialized, a signer may be used from several threads at
+ * once.
+ */
+class AttestationSigner {
+  public:
+    AttestationSigner();
+    ~AttestationSigner();
+
+    /**
+     * Finds the algorithm of the attestation key that attests a key with the given
+     * authorizations, which is the key's own algorithm.  Only RSA and EC keys can be attested.
+     */
+    static keymaster_error_t SignAlgorithm(const AuthorizationSet& tee_enforced,
+                                           const AuthorizationSet& sw_enforced,
+                                           keymaster_algorithm_t* sign_algorithm);
+
+    keymaster_error_t Init(const KeymasterContext& context, keymaster_algorithm_t sign_algorithm);
+
+    keymaster_algorithm_t sign_algorithm() const { return sign_algorithm_; }
+
+    /**
+     * The attestation key's certificate chain, from the attestation key's own certificate to the
+     * root.
+     */
+    const keymaster_cert_chain_t& issuer_chain() const { return *issuer_chain_; }
+
+    /**
+     * Sets the issuer and subject names of a new attestation certificate.
+     */
+    keymaster_error_t SetNames(X509* certificate) const;
+
+    /**
+     * Adds the authority key identifier to a completed attestation certificate and signs it.
+     */
+    keymaster_error_t Sign(X509* certificate) const;
+
+    /**
+     * Replaces chain with leaf followed by a copy of the issuer chain.  Takes ownership of leaf's
+     * data, even on failure.
+     */
+    keymaster_error_t BuildCertificateChain(keymaster_blob_t* leaf,
+                                            keymaster_cert_chain_t* chain) const;
+
+  private:
+    keymaster_algorithm_t sign_algorithm_;
+    EVP_PKEY_Ptr sign_key_;
+    UniquePtr<keymaster_cert_chain_t, CertificateChainDelete> issuer_chain_;
+    std::shared_ptr<const AttestationCertTemplate> cert_template_;
+
+    // Disallow copying and assignment.
+    AttestationSigner(const AttestationSigner&);
+    void operator=(const AttestationSigner&);
+};
+
+}  // namespace keymaster
+
+#endif  // SYSTEM_KEYMASTER_ATTESTATION_SIGNER_H_
@@ -134,4 +134,41 @@ keymaster_error_t DeserializeAuthEncryptedBlob(const KeymasterKeyBlob& key_blob,
     return KM_ERROR_OK;
 }
 
+static bool SkipFixedSizeBuffer(const uint8_t** buf_ptr, const uint8_t* end, size_t expected_size) {
+    size_t size;
+    return skip_size_and_data_in_buf(buf_ptr, end, &size) && size == expected_size;
+}
+
+static bool SkipRaw(const uint8_t** buf_ptr, const uint8_t* end, size_t size) {
+    if (end - *buf_ptr < static_cast<ptrdiff_t>(size))
+        return false;
+    *buf_ptr += size;
+    return true;
+}
+
+bool MayBeAuthEncryptedBlob(const KeymasterKeyBlob& key_blob) {
+    if (!key_blob.key_material || key_blob.key_material_size == 0)
+        return false;
+
+    const uint8_t* begin = key_blob.key_material;
+    const uint8_t* end = begin + key_blob.key_material_size;
+
+    const uint8_t* p = begin;
+    if (*p++ == CURRENT_BLOB_VERSION &&                     //
+        SkipFixedSizeBuffer(&p, end, OCB_NONCE_LENGTH) &&  //
+        skip_size_and_data_in_buf(&p, end) &&               //
+        SkipFixedSizeBuffer(&p, end, OCB_TAG_LENGTH) &&    //
+        AuthorizationSet::SkipSerialized(&p, end) &&        //
+        AuthorizationSet::SkipSerialized(&p, end))
+        return true;
+
+    // See DeserializeUnversionedBlob.
+    p = begin;
+    return SkipRaw(&p, end, OCB_NONCE_LENGTH) &&  //
+           skip_size_and_data_in_buf(&p, end) &&  //
+           SkipRaw(&p, end, OCB_TAG_LENGTH) &&    //
+           AuthorizationSet::SkipSerialized(&p, end) &&
+           AuthorizationSet::SkipSerialized(&p, end);
+}
+
 }  // namespace keymaster
@@ -37,6 +37,13 @@ keymaster_error_t DeserializeAuthEncryptedBlob(const KeymasterKeyBlob& key_blob,
                                                AuthorizationSet* sw_enforced, Buffer* nonce,
                                                Buffer* tag);
 
+/**
+ * Cheaply checks whether key_blob has the layout of a versioned or unversioned auth-encrypted blob,
+ * without deserializing the auth sets.  A false return means DeserializeAuthEncryptedBlob can't
+ * succeed.
+ */
+bool MayBeAuthEncryptedBlob(const KeymasterKeyBlob& key_blob);
+
 }  // namespace keymaster
 
 #endif  // SYSTEM_KEYMASTER_AUTH_ENCRYPTED_KEY_BLOB_H_
@@ -21,40 +21,32 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include <algorithm>
 #include <new>
 
+#include <keymaster/allocation_counter.h>
 #include <keymaster/android_keymaster_utils.h>
 #include <keymaster/logger.h>
 
 namespace keymaster {
 
 static inline bool is_blob_tag(keymaster_tag_t tag) {
-    return (keymaster_tag_get_type(tag) == KM_BYTES || keymaster_tag_get_type(tag) == KM_BIGNUM);
+    return tag_type_info(tag).blob;
 }
 
-const size_t STARTING_ELEMS_CAPACITY = 8;
-
-AuthorizationSet::AuthorizationSet(AuthorizationSetBuilder& builder) {
-    elems_ = builder.set.elems_;
-    builder.set.elems_ = NULL;
-
-    elems_size_ = builder.set.elems_size_;
-    builder.set.elems_size_ = 0;
-
-    elems_capacity_ = builder.set.elems_capacity_;
-    builder.set.elems_capacity_ = 0;
-
-    indirect_data_ = builder.set.indirect_data_;
-    builder.set.indirect_data_ = NULL;
+static inline size_t serialized_size(const keymaster_key_param_t& param) {
+    return tag_type_info(param.tag).serialized_size;
+}
 
-    indirect_data_capacity_ = builder.set.indirect_data_capacity_;
-    builder.set.indirect_data_capacity_ = 0;
+const size_t STARTING_ELEMS_CAPACITY = 8;
 
-    indirect_data_size_ = builder.set.indirect_data_size_;
-    builder.set.indirect_data_size_ = 0;
+// Returns the capacity to grow to when \p required exceeds \p capacity: at least double.
+static inline size_t grown_capacity(size_t capacity, size_t required) {
+    return required > 2 * capacity ? required : 2 * capacity;
+}
 
-    error_ = builder.set.error_;
-    builder.set.error_ = OK;
+AuthorizationSet::AuthorizationSet(AuthorizationSetBuilder& builder) {
+    MoveFrom(builder.set);
 }
 
 AuthorizationSet::~AuthorizationSet() {
@@ -66,13 +58,23 @@ bool AuthorizationSet::reserve_elems(size_t count) {
         return false;
 
     if (count >= elems_capacity_) {
+        if (elems_capacity_ == 0 && count < INLINE_ELEMS_CAPACITY) {
+            elems_ = inline_elems_;
+            elems_capacity_ = INLINE_ELEMS_CAPACITY;
+            return true;
+        }
+
         keymaster_key_param_t* new_elems = new (std::nothrow) keymaster_key_param_t[count];
         if (new_elems == NULL) {
             set_invalid(ALLOCATION_FAILURE);
             return false;
         }
+        AllocationCounter::Count(sizeof(*new_elems) * count);
         memcpy(new_elems, elems_, sizeof(*elems_) * elems_size_);
-        delete[] elems_;
+        if (elems_ == inline_elems_)
+            memset_s(inline_elems_, 0, sizeof(inline_elems_));
+        else
+            delete[] elems_;
         elems_ = new_elems;
         elems_capacity_ = count;
     }
@@ -84,11 +86,19 @@ bool AuthorizationSet::reserve_indirect(size_t length) {
         return false;
 
     if (length > indirect_data_capacity_) {
+        if (indirect_data_capacity_ == 0 && length <= INLINE_INDIRECT_DATA_CAPACITY) {
+            // Nothing to copy or fix up, since the set has no indirect data yet.
+            indirect_data_ = inline_indirect_data_;
+            indirect_data_capacity_ = INLINE_INDIRECT_DATA_CAPACITY;
+            return true;
+        }
+
         uint8_t* new_data = new (std::nothrow) uint8_t[length];
         if (new_data == NULL) {
             set_invalid(ALLOCATION_FAILURE);
             return false;
         }
+        AllocationCounter::Count(length);
         memcpy(new_data, indirect_data_, indirect_data_size_);
 
         // Fix up the data pointers to point into the new region.
@@ -96,28 +106,67 @@ bool AuthorizationSet::reserve_indirect(size_t length) {
             if (is_blob_tag(elems_[i].tag))
                 elems_[i].blob.data = new_data + (elems_[i].blob.data - indirect_data_);
         }
-        delete[] indirect_data_;
+        if (indirect_data_ == inline_indirect_data_)
+            memset_s(inline_indirect_data_, 0, sizeof(inline_indirect_data_));
+        else
+            delete[] indirect_data_;
         indirect_data_ = new_data;
         indirect_data_capacity_ = length;
     }
     return true;
 }
 
+bool AuthorizationSet::Reserve(size_t elems, size_t indirect_bytes) {
+    if (is_valid() != OK)
+        return false;
+
+    if (elems_size_ + elems > elems_capacity_ && !reserve_elems(elems_size_ + elems))
+        return false;
+    if (indirect_data_size_ + indirect_bytes > indirect_data_capacity_ &&
+        !reserve_indirect(indirect_data_size_ + indirect_bytes))
+        return false;
+    return true;
+}
+
 void AuthorizationSet::MoveFrom(AuthorizationSet& set) {
-    elems_ = set.elems_;
     elems_size_ = set.elems_size_;
     elems_capacity_ = set.elems_capacity_;
-    indirect_data_ = set.indirect_data_;
     indirect_data_size_ = set.indirect_data_size_;
     indirect_data_capacity_ = set.indirect_data_capacity_;
+    elems_serialized_size_ = set.elems_serialized_size_;
     error_ = set.error_;
+    sorted_by_tag_ = set.sorted_by_tag_;
+
+    // Heap storage changes hands, but inline storage has to be copied.
+    if (set.elems_ == set.inline_elems_) {
+        memcpy(inline_elems_, set.inline_elems_, sizeof(*elems_) * elems_size_);
+        elems_ = inline_elems_;
+        memset_s(set.inline_elems_, 0, sizeof(set.inline_elems_));
+    } else {
+        elems_ = set.elems_;
+    }
+    if (set.indirect_data_ == set.inline_indirect_data_) {
+        memcpy(inline_indirect_data_, set.inline_indirect_data_, indirect_data_size_);
+        indirect_data_ = inline_indirect_data_;
+        for (size_t i = 0; i < elems_size_; ++i) {
+            if (is_blob_tag(elems_[i].tag))
+                elems_[i].blob.data =
+                    inline_indirect_data_ + (elems_[i].blob.data - set.inline_indirect_data_);
+        }
+        memset_s(set.inline_indirect_data_, 0, sizeof(set.inline_indirect_data_));
+    } else {
+        indirect_data_ = set.indirect_data_;
+    }
+
     set.elems_ = nullptr;
     set.elems_size_ = 0;
     set.elems_capacity_ = 0;
     set.indirect_data_ = nullptr;
     set.indirect_data_size_ = 0;
     set.indirect_data_capacity_ = 0;
+    set.elems_serialized_size_ = 0;
     set.error_ = OK;
+    set.sorted_by_tag_ = true;
 }
 
 bool AuthorizationSet::Reinitialize(const keymaster_key_param_t* elems, const size_t count) {
@@ -136,6 +185,7 @@ bool AuthorizationSet::Reinitialize(const keymaster_key_param_t* elems, const si
 
     memcpy(elems_, elems, sizeof(keymaster_key_param_t) * count);
     elems_size_ = count;
+    sorted_by_tag_ = IsSortedByTag(elems_, elems_size_);
     CopyIndirectData();
     error_ = OK;
     return true;
@@ -146,37 +196,92 @@ void AuthorizationSet::set_invalid(Error error) {
     error_ = error;
 }
 
+static inline bool param_less(const keymaster_key_param_t& a, const keymaster_key_param_t& b) {
+    return keymaster_param_compare(&a, &b) < 0;
+}
+
+// Sets up to this size, which covers nearly every key description, are insertion sorted.
+const size_t INSERTION_SORT_THRESHOLD = 16;
+
 void AuthorizationSet::Sort() {
-    qsort(elems_, elems_size_, sizeof(*elems_),
-          reinterpret_cast<int (*)(const void*, const void*)>(keymaster_param_compare));
+    if (elems_size_ <= INSERTION_SORT_THRESHOLD) {
+        for (size_t i = 1; i < elems_size_; ++i) {
+            keymaster_key_param_t elem = elems_[i];
+            size_t j = i;
+            for (; j > 0 && param_less(elem, elems_[j - 1]); --j)
+                elems_[j] = elems_[j - 1];
+            elems_[j] = elem;
+        }
+    } else {
+        std::sort(elems_, elems_ + elems_size_, param_less);
+    }
+    sorted_by_tag_ = true;
 }
 
 void AuthorizationSet::Deduplicate() {
     Sort();
 
-    size_t invalid_count = 0;
-    for (size_t i = 1; i < size(); ++i) {
-        if (elems_[i - 1].tag == KM_TAG_INVALID)
-            ++invalid_count;
-        else if (keymaster_param_compare(elems_ + i - 1, elems_ + i) == 0) {
-            // Mark dups as invalid.  Note that this "leaks" the data referenced by KM_BYTES and
-            // KM_BIGNUM entries, but those are just pointers into indirect_data_, so it will all
-            // get cleaned up.
-            elems_[i - 1].tag = KM_TAG_INVALID;
-            ++invalid_count;
-        }
+    // Keep the first of each run of equal entries, dropping KM_TAG_INVALID entries too.
+    size_t kept = 0;
+    for (size_t i = 0; i < elems_size_; ++i) {
+        if (elems_[i].tag == KM_TAG_INVALID ||
+            (kept > 0 && keymaster_param_compare(elems_ + kept - 1, elems_ + i) == 0))
+            continue;
+        if (kept != i)
+            elems_[kept] = elems_[i];
+        ++kept;
     }
-    if (size() > 0 && elems_[size() - 1].tag == KM_TAG_INVALID)
-        ++invalid_count;
+    FinishCompaction(kept);
+}
 
-    if (invalid_count == 0)
+void AuthorizationSet::FinishCompaction(size_t kept) {
+    if (kept == elems_size_)
         return;
+    memset_s(elems_ + kept, 0, (elems_size_ - kept) * sizeof(*elems_));
+    elems_size_ = kept;
 
-    Sort();
+    size_t blob_bytes = 0;
+    elems_serialized_size_ = 0;
+    for (size_t i = 0; i < elems_size_; ++i) {
+        elems_serialized_size_ += serialized_size(elems_[i]);
+        if (is_blob_tag(elems_[i].tag))
+            blob_bytes += elems_[i].blob.data_length;
+    }
+    // Serialization writes all of indirect_data_, so dropped blobs' data has to go too.
+    if (blob_bytes != indirect_data_size_)
+        CompactIndirectData();
+}
 
-    // Since KM_TAG_INVALID == 0, all of the invalid entries are first.
-    elems_size_ -= invalid_count;
-    memmove(elems_, elems_ + invalid_count, size() * sizeof(*elems_));
+void AuthorizationSet::CompactIndirectData() {
+    // Sorting separated the entries from the order their data was added in, so move each blob in
+    // order of its (address, index).  Every move is then downwards, onto data that has either been
+    // moved already or belongs to a dropped entry, and a moved blob sorts before any still to move.
+    uint8_t* pos = indirect_data_;
+    const uint8_t* last = nullptr;
+    size_t last_index = 0;
+    for (;;) {
+        size_t next = elems_size_;
+        for (size_t i = 0; i < elems_size_; ++i) {
+            if (!is_blob_tag(elems_[i].tag))
+                continue;
+            const uint8_t* data = elems_[i].blob.data;
+            if (last && (data < last || (data == last && i <= last_index)))
+                continue;
+            if (next == elems_size_ || data < elems_[next].blob.data)
+                next = i;
+        }
+        if (next == elems_size_)
+            break;
+
+        keymaster_blob_t& blob = elems_[next].blob;
+        last = blob.data;
+        last_index = next;
+        memmove(pos, blob.data, blob.data_length);
+        blob.data = pos;
+        pos += blob.data_length;
+    }
+    memset_s(pos, 0, indirect_data_size_ - (pos - indirect_data_));
+    indirect_data_size_ = pos - indirect_data_;
 }
 
 void AuthorizationSet::CopyToParamSet(keymaster_key_param_set_t* set) const {
@@ -185,26 +290,76 @@ void AuthorizationSet::CopyToParamSet(keymaster_key_param_set_t* set) const {
     set->length = size();
     set->params =
         reinterpret_cast<keymaster_key_param_t*>(malloc(sizeof(keymaster_key_param_t) * size()));
+    AllocationCounter::Count(sizeof(keymaster_key_param_t) * size());
 
     for (size_t i = 0; i < size(); ++i) {
         const keymaster_key_param_t src = (*this)[i];
         keymaster_key_param_t& dst(set->params[i]);
 
         dst = src;
-        keymaster_tag_type_t type = keymaster_tag_get_type(src.tag);
-        if (type == KM_BIGNUM || type == KM_BYTES) {
+        if (is_blob_tag(src.tag)) {
             void* tmp = malloc(src.blob.data_length);
+            AllocationCounter::Count(src.blob.data_length);
             memcpy(tmp, src.blob.data, src.blob.data_length);
             dst.blob.data = reinterpret_cast<uint8_t*>(tmp);
         }
     }
 }
 
+void AuthorizationSet::CopyToPackedParamSet(keymaster_key_param_set_t* set) const {
+    assert(set);
+
+    size_t array_size = sizeof(keymaster_key_param_t) * size();
+    size_t total_size = array_size;
+    for (size_t i = 0; i < size(); ++i)
+        if (is_blob_tag((*this)[i].tag))
+            total_size += (*this)[i].blob.data_length;
+
+    uint8_t* storage = reinterpret_cast<uint8_t*>(malloc(total_size));
+    if (!storage) {
+        set->params = nullptr;
+        set->length = 0;
+        return;
+    }
+    AllocationCounter::Count(total_size);
+
+    set->length = size();
+    set->params = reinterpret_cast<keymaster_key_param_t*>(storage);
+    uint8_t* blob_data = storage + array_size;
+    for (size_t i = 0; i < size(); ++i) {
+        const keymaster_key_param_t src = (*this)[i];
+        keymaster_key_param_t& dst(set->params[i]);
+
+        dst = src;
+        if (is_blob_tag(src.tag)) {
+            memcpy(blob_data, src.blob.data, src.blob.data_length);
+            dst.blob.data = blob_data;
+            blob_data += src.blob.data_length;
+        }
+    }
+}
+
 int AuthorizationSet::find(keymaster_tag_t tag, int begin) const {
     if (is_valid() != OK)
         return -1;
 
     int i = ++begin;
+    if (sorted_by_tag_) {
+        // Entries with the same tag are adjacent, so the next match, if any, is the first entry
+        // from i on whose tag isn't less than tag.
+        int end = elems_size_;
+        while (i < end) {
+            int mid = i + (end - i) / 2;
+            if (static_cast<uint32_t>(elems_[mid].tag) < static_cast<uint32_t>(tag))
+                i = mid + 1;
+            else
+                end = mid;
+        }
+        if (i < (int)elems_size_ && elems_[i].tag == tag)
+            return i;
+        return -1;
+    }
+
     while (i < (int)elems_size_ && elems_[i].tag != tag)
         ++i;
     if (i == (int)elems_size_)
@@ -217,6 +372,7 @@ bool AuthorizationSet::erase(int index) {
     if (index < 0 || index >= static_cast<int>(size()))
         return false;
 
+    elems_serialized_size_ -= serialized_size(elems_[index]);
     --elems_size_;
     for (size_t i = index; i < elems_size_; ++i)
         elems_[i] = elems_[i + 1];
@@ -226,6 +382,7 @@ bool AuthorizationSet::erase(int index) {
 keymaster_key_param_t empty_param = {KM_TAG_INVALID, {}};
 keymaster_key_param_t& AuthorizationSet::operator[](int at) {
     if (is_valid() == OK && at < (int)elems_size_) {
+        sorted_by_tag_ = false;
         return elems_[at];
     }
     empty_param = {KM_TAG_INVALID, {}};
@@ -244,10 +401,16 @@ bool AuthorizationSet::push_back(const keymaster_key_param_set_t& set) {
     if (is_valid() != OK)
         return false;
 
-    if (!reserve_elems(elems_size_ + set.length))
+    // Grow geometrically, so that appending many small sets stays linear.
+    size_t elems_needed = elems_size_ + set.length;
+    if (elems_needed > elems_capacity_ &&
+        !reserve_elems(grown_capacity(elems_capacity_, elems_needed)))
         return false;
 
-    if (!reserve_indirect(indirect_data_size_ + ComputeIndirectDataSize(set.params, set.length)))
+    size_t indirect_needed =
+        indirect_data_size_ + ComputeIndirectDataSize(set.params, set.length);
+    if (indirect_needed > indirect_data_capacity_ &&
+        !reserve_indirect(grown_capacity(indirect_data_capacity_, indirect_needed)))
         return false;
 
     for (size_t i = 0; i < set.length; ++i)
@@ -275,33 +438,14 @@ bool AuthorizationSet::push_back(keymaster_key_param_t elem) {
         indirect_data_size_ += elem.blob.data_length;
     }
 
+    if (elems_size_ > 0 &&
+        static_cast<uint32_t>(elems_[elems_size_ - 1].tag) > static_cast<uint32_t>(elem.tag))
+        sorted_by_tag_ = false;
     elems_[elems_size_++] = elem;
+    elems_serialized_size_ += serialized_size(elem);
     return true;
 }
 
-static size_t serialized_size(const keymaster_key_param_t& param) {
-    switch (keymaster_tag_get_type(param.tag)) {
-    case KM_INVALID:
-        return sizeof(uint32_t);
-    case KM_ENUM:
-    case KM_ENUM_REP:
-    case KM_UINT:
-    case KM_UINT_REP:
-        return sizeof(uint32_t) * 2;
-    case KM_ULONG:
-    case KM_ULONG_REP:
-    case KM_DATE:
-        return sizeof(uint32_t) + sizeof(uint64_t);
-    case KM_BOOL:
-        return sizeof(uint32_t) + 1;
-    case KM_BIGNUM:
-    case KM_BYTES:
-        return sizeof(uint32_t) * 3;
-    }
-
-    return sizeof(uint32_t);
-}
-
 static uint8_t* serialize(const keymaster_key_param_t& param, uint8_t* buf, const uint8_t* end,
                           const uint8_t* indirect_base) {
     buf = append_uint32_to_buf(buf, end, param.tag);
@@ -383,14 +527,6 @@ static bool deserialize(keymaster_key_param_t* param, const uint8_t** buf_ptr, c
     return false;
 }
 
-size_t AuthorizationSet::SerializedSizeOfElements() const {
-    size_t size = 0;
-    for (size_t i = 0; i < elems_size_; ++i) {
-        size += serialized_size(elems_[i]);
-    }
-    return size;
-}
-
 size_t AuthorizationSet::SerializedSize() const {
     return sizeof(uint32_t) +           // Size of indirect_data_
            indirect_data_size_ +        // indirect_data_
@@ -409,14 +545,45 @@ uint8_t* AuthorizationSet::Serialize(uint8_t* buf, const uint8_t* end) const {
     return buf;
 }
 
+bool AuthorizationSet::SerializeTo(SerializationSink* sink) const {
+    uint8_t header[sizeof(uint32_t) * 2];
+    uint8_t* header_end = header + sizeof(header);
+    append_uint32_to_buf(header, header_end, indirect_data_size_);
+    if (!sink->Write(header, sizeof(uint32_t)) || !sink->Write(indirect_data_, indirect_data_size_))
+        return false;
+
+    uint8_t* p = append_uint32_to_buf(header, header_end, elems_size_);
+    append_uint32_to_buf(p, header_end, SerializedSizeOfElements());
+    if (!sink->Write(header, sizeof(header)))
+        return false;
+
+    // The largest serialized element is a tag plus a 64-bit value, or a tag plus blob length and
+    // offset.
+    uint8_t elem_buf[sizeof(uint32_t) * 3];
+    for (size_t i = 0; i < elems_size_; ++i) {
+        uint8_t* elem_end =
+            serialize(elems_[i], elem_buf, elem_buf + sizeof(elem_buf), indirect_data_);
+        if (!sink->Write(elem_buf, elem_end - elem_buf))
+            return false;
+    }
+    return true;
+}
+
 bool AuthorizationSet::DeserializeIndirectData(const uint8_t** buf_ptr, const uint8_t* end) {
-    UniquePtr<uint8_t[]> indirect_buf;
-    if (!copy_size_and_data_from_buf(buf_ptr, end, &indirect_data_size_, &indirect_buf)) {
+    uint32_t indirect_size;
+    if (!copy_uint32_from_buf(buf_ptr, end, &indirect_size) ||
+        static_cast<ptrdiff_t>(indirect_size) > end - *buf_ptr) {
         LOG_E("Malformed data found in AuthorizationSet deserialization", 0);
         set_invalid(MALFORMED_DATA);
         return false;
     }
-    indirect_data_ = indirect_buf.release();
+
+    if (!reserve_indirect(indirect_size))
+        return false;
+    if (indirect_size)
+        memcpy(indirect_data_, *buf_ptr, indirect_size);
+    *buf_ptr += indirect_size;
+    indirect_data_size_ = indirect_size;
     return true;
 }
 
@@ -444,6 +611,7 @@ bool AuthorizationSet::DeserializeElementsData(const uint8_t** buf_ptr, const ui
         return false;
 
     uint8_t* indirect_end = indirect_data_ + indirect_data_size_;
+    const uint8_t* elements_begin = *buf_ptr;
     const uint8_t* elements_end = *buf_ptr + elements_size;
     for (size_t i = 0; i < elements_count; ++i) {
         if (!deserialize(elems_ + i, buf_ptr, elements_end, indirect_data_, indirect_end)) {
@@ -453,9 +621,23 @@ bool AuthorizationSet::DeserializeElementsData(const uint8_t** buf_ptr, const ui
         }
     }
     elems_size_ = elements_count;
+    // Each element's serialized form is exactly what deserialize() consumed.
+    elems_serialized_size_ = *buf_ptr - elements_begin;
+    sorted_by_tag_ = IsSortedByTag(elems_, elems_size_);
     return true;
 }
 
+/* static */
+bool AuthorizationSet::SkipSerialized(const uint8_t** buf_ptr, const uint8_t* end) {
+    uint32_t elements_count;
+    size_t elements_size;
+    // Mirrors the checks in DeserializeIndirectData and DeserializeElementsData.
+    return skip_size_and_data_in_buf(buf_ptr, end) &&
+           copy_uint32_from_buf(buf_ptr, end, &elements_count) &&
+           skip_size_and_data_in_buf(buf_ptr, end, &elements_size) &&
+           elements_count * sizeof(uint32_t) <= elements_size;
+}
+
 bool AuthorizationSet::Deserialize(const uint8_t** buf_ptr, const uint8_t* end) {
     FreeData();
 
@@ -470,18 +652,194 @@ bool AuthorizationSet::Deserialize(const uint8_t** buf_ptr, const uint8_t* end)
     return true;
 }
 
+// In the compact format tags are rotated so that the type, in the top four bits, moves to the
+// bottom, which keeps the varints of the usual small tag numbers to two bytes.
+static inline uint32_t compact_tag(keymaster_tag_t tag) {
+    uint32_t value = static_cast<uint32_t>(tag);
+    return (value << 4) | (value >> 28);
+}
+
+static inline keymaster_tag_t tag_from_compact(uint32_t value) {
+    return static_cast<keymaster_tag_t>((value >> 4) | (value << 28));
+}
+
+static size_t compact_serialized_size(const keymaster_key_param_t& param) {
+    size_t size = varint_size(compact_tag(param.tag));
+    switch (keymaster_tag_get_type(param.tag)) {
+    case KM_INVALID:
+        break;
+    case KM_ENUM:
+    case KM_ENUM_REP:
+        size += varint_size(param.enumerated);
+        break;
+    case KM_UINT:
+    case KM_UINT_REP:
+        size += varint_size(param.integer);
+        break;
+    case KM_ULONG:
+    case KM_ULONG_REP:
+        size += varint_size(param.long_integer);
+        break;
+    case KM_DATE:
+        size += varint_size(param.date_time);
+        break;
+    case KM_BOOL:
+        size += 1;
+        break;
+    case KM_BIGNUM:
+    case KM_BYTES:
+        size += size_and_data_serialized_size(param.blob.data_length, COMPACT_FORMAT);
+        break;
+    }
+    return size;
+}
+
+static uint8_t* serialize_compact(const keymaster_key_param_t& param, uint8_t* buf,
+                                  const uint8_t* end) {
+    buf = append_varint_to_buf(buf, end, compact_tag(param.tag));
+    switch (keymaster_tag_get_type(param.tag)) {
+    case KM_INVALID:
+        break;
+    case KM_ENUM:
+    case KM_ENUM_REP:
+        buf = append_varint_to_buf(buf, end, param.enumerated);
+        break;
+    case KM_UINT:
+    case KM_UINT_REP:
+        buf = append_varint_to_buf(buf, end, param.integer);
+        break;
+    case KM_ULONG:
+    case KM_ULONG_REP:
+        buf = append_varint_to_buf(buf, end, param.long_integer);
+        break;
+    case KM_DATE:
+        buf = append_varint_to_buf(buf, end, param.date_time);
+        break;
+    case KM_BOOL:
+        if (buf < end)
+            *buf = static_cast<uint8_t>(param.boolean);
+        buf++;
+        break;
+    case KM_BIGNUM:
+    case KM_BYTES:
+        buf = append_size_and_data_to_buf(buf, end, param.blob.data, param.blob.data_length,
+                                          COMPACT_FORMAT);
+        break;
+    }
+    return buf;
+}
+
+// Blob values are left pointing into the serialized data.
+static bool deserialize_compact(keymaster_key_param_t* param, const uint8_t** buf_ptr,
+                                const uint8_t* end) {
+    uint32_t tag;
+    if (!copy_uint32_from_buf(buf_ptr, end, &tag, COMPACT_FORMAT))
+        return false;
+    param->tag = tag_from_compact(tag);
+
+    switch (keymaster_tag_get_type(param->tag)) {
+    case KM_INVALID:
+        return false;
+    case KM_ENUM:
+    case KM_ENUM_REP:
+        return copy_uint32_from_buf(buf_ptr, end, &param->enumerated, COMPACT_FORMAT);
+    case KM_UINT:
+    case KM_UINT_REP:
+        return copy_uint32_from_buf(buf_ptr, end, &param->integer, COMPACT_FORMAT);
+    case KM_ULONG:
+    case KM_ULONG_REP:
+        return copy_varint_from_buf(buf_ptr, end, &param->long_integer);
+    case KM_DATE:
+        return copy_varint_from_buf(buf_ptr, end, &param->date_time);
+    case KM_BOOL:
+        if (*buf_ptr < end) {
+            param->boolean = static_cast<bool>(**buf_ptr);
+            (*buf_ptr)++;
+            return true;
+        }
+        return false;
+
+    case KM_BIGNUM:
+    case KM_BYTES: {
+        uint32_t length;
+        if (!copy_uint32_from_buf(buf_ptr, end, &length, COMPACT_FORMAT) ||
+            static_cast<ptrdiff_t>(length) > end - *buf_ptr)
+            return false;
+        param->blob.data = *buf_ptr;
+        param->blob.data_length = length;
+        *buf_ptr += length;
+        return true;
+    }
+    }
+
+    return false;
+}
+
+size_t AuthorizationSet::SerializedSize(SerializationFormat format) const {
+    if (format != COMPACT_FORMAT)
+        return SerializedSize();
+    size_t size = varint_size(elems_size_);
+    for (size_t i = 0; i < elems_size_; ++i)
+        size += compact_serialized_size(elems_[i]);
+    return size;
+}
+
+uint8_t* AuthorizationSet::Serialize(uint8_t* buf, const uint8_t* end,
+                                     SerializationFormat format) const {
+    if (format != COMPACT_FORMAT)
+        return Serialize(buf, end);
+    buf = append_varint_to_buf(buf, end, elems_size_);
+    for (size_t i = 0; i < elems_size_; ++i)
+        buf = serialize_compact(elems_[i], buf, end);
+    return buf;
+}
+
+bool AuthorizationSet::Deserialize(const uint8_t** buf_ptr, const uint8_t* end,
+                                   SerializationFormat format) {
+    if (format != COMPACT_FORMAT)
+        return Deserialize(buf_ptr, end);
+    FreeData();
+
+    // Every element takes at least two bytes, which bounds the count before anything is allocated.
+    uint32_t elements_count;
+    if (!copy_uint32_from_buf(buf_ptr, end, &elements_count, COMPACT_FORMAT) ||
+        elements_count > static_cast<size_t>(end - *buf_ptr) / 2) {
+        LOG_E("Malformed data found in AuthorizationSet deserialization", 0);
+        set_invalid(MALFORMED_DATA);
+        return false;
+    }
+
+    if (!reserve_elems(elements_count))
+        return false;
+    for (size_t i = 0; i < elements_count; ++i) {
+        keymaster_key_param_t param;
+        if (!deserialize_compact(&param, buf_ptr, end)) {
+            LOG_E("Malformed data found in AuthorizationSet deserialization", 0);
+            set_invalid(MALFORMED_DATA);
+            return false;
+        }
+        if (!push_back(param))
+            return false;
+    }
+    return true;
+}
+
 void AuthorizationSet::Clear() {
     memset_s(elems_, 0, elems_size_ * sizeof(keymaster_key_param_t));
     memset_s(indirect_data_, 0, indirect_data_size_);
     elems_size_ = 0;
     indirect_data_size_ = 0;
+    elems_serialized_size_ = 0;
+    sorted_by_tag_ = true;
 }
 
 void AuthorizationSet::FreeData() {
     Clear();
 
-    delete[] elems_;
-    delete[] indirect_data_;
+    if (elems_ != inline_elems_)
+        delete[] elems_;
+    if (indirect_data_ != inline_indirect_data_)
+        delete[] indirect_data_;
 
     elems_ = NULL;
     indirect_data_ = NULL;
@@ -501,24 +859,43 @@ size_t AuthorizationSet::ComputeIndirectDataSize(const keymaster_key_param_t* el
     return size;
 }
 
+/* static */
+bool AuthorizationSet::IsSortedByTag(const keymaster_key_param_t* elems, size_t count) {
+    for (size_t i = 1; i < count; ++i)
+        if (static_cast<uint32_t>(elems[i - 1].tag) > static_cast<uint32_t>(elems[i].tag))
+            return false;
+    return true;
+}
+
 void AuthorizationSet::CopyIndirectData() {
     memset_s(indirect_data_, 0, indirect_data_capacity_);
 
     uint8_t* indirect_data_pos = indirect_data_;
+    elems_serialized_size_ = 0;
     for (size_t i = 0; i < elems_size_; ++i) {
         assert(indirect_data_pos <= indirect_data_ + indirect_data_capacity_);
+        elems_serialized_size_ += serialized_size(elems_[i]);
         if (is_blob_tag(elems_[i].tag)) {
             memcpy(indirect_data_pos, elems_[i].blob.data, elems_[i].blob.data_length);
             elems_[i].blob.data = indirect_data_pos;
             indirect_data_pos += elems_[i].blob.data_length;
         }
     }
-    assert(indirect_data_pos == indirect_data_ + indirect_data_capacity_);
+    // Inline storage may be larger than the data.
+    assert(indirect_data_pos <= indirect_data_ + indirect_data_capacity_);
     indirect_data_size_ = indirect_data_pos - indirect_data_;
 }
 
 size_t AuthorizationSet::GetTagCount(keymaster_tag_t tag) const {
     size_t count = 0;
+    if (sorted_by_tag_) {
+        int pos = find(tag);
+        if (pos != -1)
+            while (pos + count < elems_size_ && elems_[pos + count].tag == tag)
+                ++count;
+        return count;
+    }
+
     for (int pos = -1; (pos = find(tag, pos)) != -1;)
         ++count;
     return count;
@@ -637,4 +1014,99 @@ bool AuthorizationSet::ContainsIntValue(keymaster_tag_t tag, uint32_t value) con
     return false;
 }
 
+bool AuthorizationSetView::Init(const uint8_t** buf_ptr, const uint8_t* end) {
+    // Mirrors the checks in AuthorizationSet::Deserialize and the functions it calls.
+    uint32_t indirect_size;
+    if (!copy_uint32_from_buf(buf_ptr, end, &indirect_size) ||
+        static_cast<ptrdiff_t>(indirect_size) > end - *buf_ptr)
+        return false;
+    const uint8_t* indirect_data = *buf_ptr;
+    *buf_ptr += indirect_size;
+
+    uint32_t elements_count;
+    uint32_t elements_size;
+    if (!copy_uint32_from_buf(buf_ptr, end, &elements_count) ||
+        !copy_uint32_from_buf(buf_ptr, end, &elements_size))
+        return false;
+
+    if (static_cast<ptrdiff_t>(elements_size) > end - *buf_ptr ||
+        elements_count * sizeof(uint32_t) > elements_size ||
+        *buf_ptr + (elements_count * sizeof(keymaster_key_param_t)) < *buf_ptr)
+        return false;
+
+    const uint8_t* elems = *buf_ptr;
+    const uint8_t* elems_end = *buf_ptr + elements_size;
+    size_t blob_data_size = 0;
+    for (size_t i = 0; i < elements_count; ++i) {
+        keymaster_key_param_t param;
+        if (!deserialize(&param, buf_ptr, elems_end, indirect_data, indirect_data + indirect_size))
+            return false;
+        if (is_blob_tag(param.tag))
+            blob_data_size += param.blob.data_length;
+    }
+    if (blob_data_size != indirect_size)
+        return false;
+
+    indirect_data_ = indirect_data;
+    indirect_data_size_ = indirect_size;
+    elems_ = elems;
+    elems_end_ = elems_end;
+    elems_count_ = elements_count;
+    return true;
+}
+
+bool AuthorizationSetView::CopyTo(AuthorizationSet* set) const {
+    set->Clear();
+    if (!set->reserve_elems(elems_count_) || !set->reserve_indirect(indirect_data_size_))
+        return false;
+
+    const uint8_t* p = elems_;
+    for (size_t i = 0; i < elems_count_; ++i) {
+        keymaster_key_param_t param;
+        deserialize(&param, &p, elems_end_, indirect_data_, indirect_data_ + indirect_data_size_);
+        if (!set->push_back(param))
+            return false;
+    }
+    return true;
+}
+
+size_t AuthorizationSetView::GetTagCount(keymaster_tag_t tag) const {
+    size_t count = 0;
+    const uint8_t* p = elems_;
+    for (size_t i = 0; i < elems_count_; ++i) {
+        keymaster_key_param_t param;
+        deserialize(&param, &p, elems_end_, indirect_data_, indirect_data_ + indirect_data_size_);
+        if (param.tag == tag)
+            ++count;
+    }
+    return count;
+}
+
+bool AuthorizationSetView::GetParam(keymaster_tag_t tag, size_t instance,
+                                    keymaster_key_param_t* param) const {
+    // Init validated every element, so decoding can't fail.
+    const uint8_t* p = elems_;
+    for (size_t i = 0; i < elems_count_; ++i) {
+        keymaster_key_param_t entry;
+        deserialize(&entry, &p, elems_end_, indirect_data_, indirect_data_ + indirect_data_size_);
+        if (entry.tag == tag && instance-- == 0) {
+            if (param)
+                *param = entry;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool AuthorizationSetView::ContainsValue(keymaster_tag_t tag, uint32_t value) const {
+    const uint8_t* p = elems_;
+    for (size_t i = 0; i < elems_count_; ++i) {
+        keymaster_key_param_t entry;
+        deserialize(&entry, &p, elems_end_, indirect_data_, indirect_data_ + indirect_data_size_);
+        if (entry.tag == tag && entry.integer == value)
+            return true;
+    }
+    return false;
+}
+
 }  // namespace keymaster
@@ -16,6 +16,7 @@
 
 #include <gtest/gtest.h>
 
+#include <keymaster/allocation_counter.h>
 #include <keymaster/authorization_set.h>
 #include <keymaster/android_keymaster_utils.h>
 
@@ -144,6 +145,59 @@ TEST(Lookup, Indexed) {
     EXPECT_EQ(KM_TAG_INVALID, set[10].tag);
 }
 
+TEST(Lookup, Sorted) {
+    AuthorizationSet set(AuthorizationSetBuilder()
+                             .Authorization(TAG_USER_SECURE_ID, 47727)
+                             .Authorization(TAG_PURPOSE, KM_PURPOSE_SIGN)
+                             .Authorization(TAG_ALGORITHM, KM_ALGORITHM_RSA)
+                             .Authorization(TAG_PURPOSE, KM_PURPOSE_VERIFY)
+                             .Authorization(TAG_USER_SECURE_ID, 47728)
+                             .Authorization(TAG_APPLICATION_ID, "my_app", 6)
+                             .Authorization(TAG_KEY_SIZE, 256)
+                             .Authorization(TAG_PURPOSE, KM_PURPOSE_ENCRYPT));
+    EXPECT_FALSE(set.is_sorted_by_tag());
+    AuthorizationSet unsorted(set);
+    EXPECT_FALSE(unsorted.is_sorted_by_tag());
+
+    set.Sort();
+    EXPECT_TRUE(set.is_sorted_by_tag());
+
+    // Binary search finds the same entries as a linear scan.
+    const AuthorizationSet& sorted = set;
+    keymaster_tag_t tags[] = {KM_TAG_PURPOSE,        KM_TAG_ALGORITHM,      KM_TAG_KEY_SIZE,
+                              KM_TAG_USER_ID,        KM_TAG_USER_SECURE_ID, KM_TAG_APPLICATION_ID,
+                              KM_TAG_NONCE,          KM_TAG_INVALID};
+    for (keymaster_tag_t tag : tags) {
+        EXPECT_EQ(unsorted.GetTagCount(tag), sorted.GetTagCount(tag));
+        EXPECT_EQ(unsorted.Contains(tag), sorted.Contains(tag));
+        size_t found = 0;
+        for (int pos = -1; (pos = sorted.find(tag, pos)) != -1; ++found)
+            EXPECT_EQ(tag, sorted[pos].tag);
+        EXPECT_EQ(unsorted.GetTagCount(tag), found);
+    }
+    EXPECT_TRUE(sorted.Contains(TAG_PURPOSE, KM_PURPOSE_VERIFY));
+    EXPECT_FALSE(sorted.Contains(TAG_PURPOSE, KM_PURPOSE_DECRYPT));
+    uint32_t key_size;
+    EXPECT_TRUE(sorted.GetTagValue(TAG_KEY_SIZE, &key_size));
+    EXPECT_EQ(256U, key_size);
+
+    // Copies and serialized round trips stay sorted.
+    AuthorizationSet copy(set);
+    EXPECT_TRUE(copy.is_sorted_by_tag());
+    UniquePtr<uint8_t[]> buf(new uint8_t[set.SerializedSize()]);
+    set.Serialize(buf.get(), buf.get() + set.SerializedSize());
+    AuthorizationSet deserialized(buf.get(), set.SerializedSize());
+    EXPECT_TRUE(deserialized.is_sorted_by_tag());
+
+    // Appending in order keeps the set sorted, appending out of order doesn't.
+    set.push_back(*(sorted.end() - 1));
+    EXPECT_TRUE(set.is_sorted_by_tag());
+    set.push_back(TAG_PURPOSE, KM_PURPOSE_DECRYPT);
+    EXPECT_FALSE(set.is_sorted_by_tag());
+    EXPECT_EQ(4U, set.GetTagCount(TAG_PURPOSE));
+    EXPECT_TRUE(set.Contains(TAG_PURPOSE, KM_PURPOSE_DECRYPT));
+}
+
 TEST(Serialization, RoundTrip) {
     AuthorizationSet set(AuthorizationSetBuilder()
                              .Authorization(TAG_PURPOSE, KM_PURPOSE_SIGN)
@@ -176,6 +230,142 @@ TEST(Serialization, RoundTrip) {
     EXPECT_EQ(0, memcmp(deserialized[pos].blob.data, "my_app", 6));
 }
 
+class StringSink : public SerializationSink {
+  public:
+    bool Write(const void* data, size_t data_len) override {
+        bytes.append(static_cast<const char*>(data), data_len);
+        return true;
+    }
+    std::string bytes;
+};
+
+TEST(Serialization, SerializeToMatchesSerialize) {
+    AuthorizationSet set(AuthorizationSetBuilder()
+                             .Authorization(TAG_PURPOSE, KM_PURPOSE_SIGN)
+                             .Authorization(TAG_USER_ID, 7)
+                             .Authorization(TAG_APPLICATION_ID, "my_app", 6)
+                             .Authorization(TAG_APPLICATION_DATA, "data", 4)
+                             .Authorization(TAG_ALL_USERS)
+                             .Authorization(TAG_RSA_PUBLIC_EXPONENT, 3)
+                             .Authorization(TAG_ACTIVE_DATETIME, 10));
+
+    size_t size = set.SerializedSize();
+    UniquePtr<uint8_t[]> buf(new uint8_t[size]);
+    set.Serialize(buf.get(), buf.get() + size);
+
+    StringSink sink;
+    EXPECT_TRUE(set.SerializeTo(&sink));
+    EXPECT_EQ(std::string(reinterpret_cast<char*>(buf.get()), size), sink.bytes);
+
+    StringSink empty_sink;
+    EXPECT_TRUE(AuthorizationSet().SerializeTo(&empty_sink));
+    EXPECT_EQ(AuthorizationSet().SerializedSize(), empty_sink.bytes.size());
+}
+
+TEST(Serialization, CompactRoundTrip) {
+    AuthorizationSet set(AuthorizationSetBuilder()
+                             .Authorization(TAG_PURPOSE, KM_PURPOSE_SIGN)
+                             .Authorization(TAG_ALGORITHM, KM_ALGORITHM_RSA)
+                             .Authorization(TAG_USER_ID, 7)
+                             .Authorization(TAG_APPLICATION_ID, "my_app", 6)
+                             .Authorization(TAG_USER_SECURE_ID, 0xFFFFFFFFFFFFFFFFULL)
+                             .Authorization(TAG_ALL_USERS)
+                             .Authorization(TAG_ACTIVE_DATETIME, 10));
+
+    size_t size = set.SerializedSize(COMPACT_FORMAT);
+    EXPECT_LT(size, set.SerializedSize());
+
+    UniquePtr<uint8_t[]> buf(new uint8_t[size]);
+    EXPECT_EQ(buf.get() + size, set.Serialize(buf.get(), buf.get() + size, COMPACT_FORMAT));
+
+    AuthorizationSet deserialized;
+    const uint8_t* p = buf.get();
+    EXPECT_TRUE(deserialized.Deserialize(&p, buf.get() + size, COMPACT_FORMAT));
+    EXPECT_EQ(buf.get() + size, p);
+    EXPECT_EQ(AuthorizationSet::OK, deserialized.is_valid());
+    EXPECT_EQ(set, deserialized);
+
+    // Every truncation is rejected.
+    for (size_t i = 0; i < size; ++i) {
+        p = buf.get();
+        EXPECT_FALSE(deserialized.Deserialize(&p, buf.get() + i, COMPACT_FORMAT));
+        EXPECT_EQ(AuthorizationSet::MALFORMED_DATA, deserialized.is_valid());
+    }
+}
+
+TEST(Serialization, TagInfo) {
+    static_assert(decltype(TAG_ALL_USERS)::serialized_size() == 5, "bool elements are 5 bytes");
+    static_assert(decltype(TAG_PURPOSE)::repeatable(), "purpose is repeatable");
+    static_assert(decltype(TAG_OS_VERSION)::attestation_tag_number() == 705, "osVersion is [705]");
+
+    size_t empty_size = AuthorizationSet().SerializedSize();
+    for (size_t i = 0; i < kTagInfoCount; ++i) {
+        const TagInfo& info = kTagInfo[i];
+        EXPECT_EQ(info.type, keymaster_tag_get_type(info.tag)) << info.tag;
+        EXPECT_EQ(info.repeatable,
+                  keymaster_tag_repeatable(info.tag) || info.type == KM_ULONG_REP)
+            << info.tag;
+        EXPECT_EQ(static_cast<uint32_t>(keymaster_tag_mask_type(info.tag)),
+                  info.attestation_tag_number);
+
+        keymaster_key_param_t param;
+        memset(&param, 0, sizeof(param));
+        param.tag = info.tag;
+        AuthorizationSet set;
+        ASSERT_TRUE(set.push_back(param));
+        size_t size = set.SerializedSize();
+        EXPECT_EQ(empty_size + info.serialized_size, size) << info.tag;
+
+        UniquePtr<uint8_t[]> buf(new uint8_t[size]);
+        EXPECT_EQ(buf.get() + size, set.Serialize(buf.get(), buf.get() + size)) << info.tag;
+    }
+}
+
+// Computes what SerializedSize() should return by walking the set.
+static size_t WalkSerializedSize(const AuthorizationSet& set) {
+    size_t size = sizeof(uint32_t) * 3;
+    for (auto& param : set) {
+        size += tag_type_info(param.tag).serialized_size;
+        if (tag_type_info(param.tag).blob)
+            size += param.blob.data_length;
+    }
+    return size;
+}
+
+TEST(Serialization, SerializedSizeTracksChanges) {
+    AuthorizationSet set;
+    EXPECT_EQ(WalkSerializedSize(set), set.SerializedSize());
+    set.push_back(TAG_PURPOSE, KM_PURPOSE_SIGN);
+    set.push_back(TAG_APPLICATION_ID, "my_app", 6);
+    set.push_back(TAG_RSA_PUBLIC_EXPONENT, 3);
+    set.push_back(TAG_ALL_USERS);
+    set.push_back(TAG_PURPOSE, KM_PURPOSE_SIGN);
+    set.push_back(TAG_ACTIVE_DATETIME, 10);
+    EXPECT_EQ(WalkSerializedSize(set), set.SerializedSize());
+
+    EXPECT_TRUE(set.erase(set.find(TAG_RSA_PUBLIC_EXPONENT)));
+    EXPECT_EQ(WalkSerializedSize(set), set.SerializedSize());
+
+    set.Deduplicate();
+    EXPECT_EQ(4U, set.size());
+    EXPECT_EQ(WalkSerializedSize(set), set.SerializedSize());
+
+    size_t size = set.SerializedSize();
+    UniquePtr<uint8_t[]> buf(new uint8_t[size]);
+    EXPECT_EQ(buf.get() + size, set.Serialize(buf.get(), buf.get() + size));
+    AuthorizationSet deserialized(buf.get(), size);
+    EXPECT_EQ(size, deserialized.SerializedSize());
+
+    AuthorizationSet copy(set);
+    EXPECT_EQ(size, copy.SerializedSize());
+    AuthorizationSet moved(std::move(copy));
+    EXPECT_EQ(size, moved.SerializedSize());
+    EXPECT_EQ(WalkSerializedSize(copy), copy.SerializedSize());
+
+    set.Clear();
+    EXPECT_EQ(WalkSerializedSize(set), set.SerializedSize());
+}
+
 TEST(Deserialization, Deserialize) {
     AuthorizationSet set(AuthorizationSetBuilder()
                              .Authorization(TAG_PURPOSE, KM_PURPOSE_SIGN)
@@ -211,6 +401,94 @@ TEST(Deserialization, Deserialize) {
     EXPECT_EQ(0, memcmp(deserialized[pos].blob.data, "my_app", 6));
 }
 
+TEST(Deserialization, View) {
+    AuthorizationSet set(AuthorizationSetBuilder()
+                             .Authorization(TAG_PURPOSE, KM_PURPOSE_SIGN)
+                             .Authorization(TAG_PURPOSE, KM_PURPOSE_VERIFY)
+                             .Authorization(TAG_ALGORITHM, KM_ALGORITHM_RSA)
+                             .Authorization(TAG_USER_SECURE_ID, 47727)
+                             .Authorization(TAG_APPLICATION_ID, "my_app", 6)
+                             .Authorization(TAG_KEY_SIZE, 256)
+                             .Authorization(TAG_ACTIVE_DATETIME, 10)
+                             .Authorization(TAG_CALLER_NONCE));
+
+    size_t size = set.SerializedSize();
+    UniquePtr<uint8_t[]> buf(new uint8_t[size]);
+    EXPECT_EQ(buf.get() + size, set.Serialize(buf.get(), buf.get() + size));
+
+    AuthorizationSetView view;
+    const uint8_t* p = buf.get();
+    ASSERT_TRUE(view.Init(&p, p + size));
+    EXPECT_EQ(p, buf.get() + size);
+    EXPECT_EQ(set.size(), view.size());
+
+    EXPECT_EQ(2U, view.GetTagCount(TAG_PURPOSE));
+    EXPECT_TRUE(view.Contains(TAG_PURPOSE, KM_PURPOSE_VERIFY));
+    EXPECT_FALSE(view.Contains(TAG_PURPOSE, KM_PURPOSE_ENCRYPT));
+    EXPECT_TRUE(view.Contains(TAG_KEY_SIZE, 256));
+    EXPECT_FALSE(view.Contains(TAG_USER_ID));
+    EXPECT_TRUE(view.GetTagValue(TAG_CALLER_NONCE));
+    EXPECT_FALSE(view.GetTagValue(TAG_NO_AUTH_REQUIRED));
+
+    keymaster_algorithm_t algorithm;
+    EXPECT_TRUE(view.GetTagValue(TAG_ALGORITHM, &algorithm));
+    EXPECT_EQ(KM_ALGORITHM_RSA, algorithm);
+    keymaster_purpose_t purpose;
+    EXPECT_FALSE(view.GetTagValue(TAG_PURPOSE, &purpose));
+    EXPECT_TRUE(view.GetTagValue(TAG_PURPOSE, 1, &purpose));
+    EXPECT_EQ(KM_PURPOSE_VERIFY, purpose);
+    uint64_t sid;
+    EXPECT_TRUE(view.GetTagValue(TAG_USER_SECURE_ID, 0, &sid));
+    EXPECT_EQ(47727U, sid);
+    EXPECT_FALSE(view.GetTagValue(TAG_USER_SECURE_ID, 1, &sid));
+    uint64_t date;
+    EXPECT_TRUE(view.GetTagValue(TAG_ACTIVE_DATETIME, &date));
+    EXPECT_EQ(10U, date);
+
+    // Blobs refer to the serialized data rather than to a copy.
+    keymaster_blob_t blob;
+    ASSERT_TRUE(view.GetTagValue(TAG_APPLICATION_ID, &blob));
+    EXPECT_EQ(6U, blob.data_length);
+    EXPECT_EQ(0, memcmp("my_app", blob.data, 6));
+    EXPECT_TRUE(blob.data >= buf.get() && blob.data < buf.get() + size);
+
+    AuthorizationSet copy;
+    ASSERT_TRUE(view.CopyTo(&copy));
+    EXPECT_EQ(set, copy);
+}
+
+TEST(Deserialization, ViewValidatesLikeDeserialize) {
+    AuthorizationSet set(AuthorizationSetBuilder()
+                             .Authorization(TAG_PURPOSE, KM_PURPOSE_SIGN)
+                             .Authorization(TAG_APPLICATION_ID, "my_app", 6)
+                             .Authorization(TAG_KEY_SIZE, 256)
+                             .Authorization(TAG_APPLICATION_DATA, "my_data", 7));
+
+    size_t size = set.SerializedSize();
+    UniquePtr<uint8_t[]> buf(new uint8_t[size]);
+    set.Serialize(buf.get(), buf.get() + size);
+
+    for (size_t i = 0; i < size; ++i) {
+        for (uint8_t bit = 0; bit < 8; ++bit) {
+            buf[i] ^= 1 << bit;
+            const uint8_t* set_p = buf.get();
+            const uint8_t* view_p = buf.get();
+            AuthorizationSet deserialized;
+            AuthorizationSetView view;
+            bool deserialized_ok = deserialized.Deserialize(&set_p, buf.get() + size);
+            EXPECT_EQ(deserialized_ok, view.Init(&view_p, buf.get() + size)) << i << " " << bit;
+            if (deserialized_ok)
+                EXPECT_EQ(set_p, view_p);
+            buf[i] ^= 1 << bit;
+        }
+
+        // Truncated data.
+        const uint8_t* p = buf.get();
+        AuthorizationSetView view;
+        EXPECT_FALSE(view.Init(&p, buf.get() + i));
+    }
+}
+
 TEST(Deserialization, TooShortBuffer) {
     uint8_t buf[] = {0, 0, 0};
     AuthorizationSet deserialized(buf, array_length(buf));
@@ -416,6 +694,196 @@ TEST(Growable, PushBackSets) {
     EXPECT_EQ(12U, combined.indirect_size());
 }
 
+TEST(Growable, SpillsFromInlineStorage) {
+    AuthorizationSet set;
+    std::string blob(20, 'x');
+    for (size_t i = 0; i < 40; ++i) {
+        blob[0] = 'a' + i % 26;
+        ASSERT_TRUE(set.push_back(TAG_APPLICATION_ID, blob.data(), blob.size()));
+        ASSERT_TRUE(set.push_back(TAG_KEY_SIZE, i));
+
+        // Every blob survives each move to larger storage.
+        for (size_t j = 0; j <= i; ++j) {
+            keymaster_key_param_t param = set[2 * j];
+            ASSERT_EQ(blob.size(), param.blob.data_length);
+            EXPECT_EQ('a' + j % 26, param.blob.data[0]);
+            EXPECT_EQ(j, set[2 * j + 1].integer);
+        }
+    }
+    EXPECT_EQ(80U, set.size());
+    EXPECT_EQ(40 * blob.size(), set.indirect_size());
+}
+
+TEST(Growable, Reserve) {
+    AuthorizationSet set(AuthorizationSetBuilder()
+                             .Reserve(40, 200)
+                             .Authorization(TAG_APPLICATION_ID, "my_app", 6)
+                             .Authorization(TAG_KEY_SIZE, 256));
+    EXPECT_EQ(2U, set.size());
+
+    // Reserving keeps the existing contents, including blob data moved out of inline storage.
+    ASSERT_TRUE(set.Reserve(100, 1000));
+    EXPECT_EQ(2U, set.size());
+    keymaster_blob_t blob;
+    ASSERT_TRUE(set.GetTagValue(TAG_APPLICATION_ID, &blob));
+    ASSERT_EQ(6U, blob.data_length);
+    EXPECT_EQ(0, memcmp("my_app", blob.data, blob.data_length));
+    EXPECT_TRUE(set.Contains(TAG_KEY_SIZE, 256));
+    EXPECT_TRUE(set.Reserve(0, 0));
+}
+
+TEST(Growable, MoveInlineSet) {
+    AuthorizationSet set(AuthorizationSetBuilder()
+                             .Authorization(TAG_APPLICATION_ID, "my_app", 6)
+                             .Authorization(TAG_KEY_SIZE, 256)
+                             .Authorization(TAG_APPLICATION_DATA, "my_data", 7));
+    AuthorizationSet copy(set);
+
+    AuthorizationSet moved(std::move(set));
+    EXPECT_EQ(0U, set.size());
+    EXPECT_EQ(copy, moved);
+
+    keymaster_blob_t blob;
+    ASSERT_TRUE(moved.GetTagValue(TAG_APPLICATION_DATA, &blob));
+    EXPECT_EQ(0, memcmp("my_data", blob.data, blob.data_length));
+    EXPECT_TRUE(blob.data >= reinterpret_cast<const uint8_t*>(&moved) &&
+                blob.data < reinterpret_cast<const uint8_t*>(&moved + 1));
+
+    AuthorizationSet assigned;
+    assigned = std::move(moved);
+    EXPECT_EQ(copy, assigned);
+    EXPECT_TRUE(moved.empty());
+}
+
+#ifdef KEYMASTER_ALLOCATION_COUNTING
+TEST(Growable, AllocationsAreCounted) {
+    AllocationCounter outer;
+    uint64_t inner_allocations;
+    uint64_t inner_bytes;
+    {
+        AllocationCounter inner;
+        AuthorizationSet set;
+        ASSERT_TRUE(set.push_back(TAG_KEY_SIZE, 256));
+        // The inline storage needs no allocation.
+        EXPECT_EQ(0U, inner.allocations());
+
+        for (size_t i = 0; i < 20; ++i)
+            ASSERT_TRUE(set.push_back(TAG_KEY_SIZE, i));
+        inner_allocations = inner.allocations();
+        inner_bytes = inner.bytes();
+        EXPECT_GT(inner_allocations, 0U);
+        EXPECT_GE(inner_bytes, set.size() * sizeof(keymaster_key_param_t));
+    }
+    // Only the inner counter saw the allocations, and it passed them on to the outer one.
+    EXPECT_EQ(inner_allocations, outer.allocations());
+    EXPECT_EQ(inner_bytes, outer.bytes());
+}
+
+TEST(Growable, ReserveAvoidsReallocation) {
+    std::string blob(200, 'x');
+    AuthorizationSet set;
+    AllocationCounter counter;
+    ASSERT_TRUE(set.Reserve(40, 20 * blob.size()));
+    uint64_t reserved_allocations = counter.allocations();
+    EXPECT_EQ(2U, reserved_allocations);
+
+    for (size_t i = 0; i < 20; ++i) {
+        ASSERT_TRUE(set.push_back(TAG_APPLICATION_ID, blob.data(), blob.size()));
+        ASSERT_TRUE(set.push_back(TAG_KEY_SIZE, i));
+    }
+    EXPECT_EQ(reserved_allocations, counter.allocations());
+}
+
+TEST(Growable, PushBackSetsGrowsGeometrically) {
+    AuthorizationSet small(AuthorizationSetBuilder()
+                               .Authorization(TAG_KEY_SIZE, 256)
+                               .Authorization(TAG_APPLICATION_ID, "my_app", 6));
+    AuthorizationSet combined;
+    AllocationCounter counter;
+    for (size_t i = 0; i < 256; ++i)
+        ASSERT_TRUE(combined.push_back(small));
+    EXPECT_EQ(512U, combined.size());
+    // Each array doubles from its inline storage, so a few allocations cover all 256 appends.
+    EXPECT_LE(counter.allocations(), 12U);
+}
+#endif  // KEYMASTER_ALLOCATION_COUNTING
+
+static bool IsBlobEntry(const keymaster_key_param_t& param) {
+    return keymaster_tag_get_type(param.tag) == KM_BYTES;
+}
+
+static AuthorizationSet RoundTrip(const AuthorizationSet& set) {
+    size_t size = set.SerializedSize();
+    UniquePtr<uint8_t[]> buf(new uint8_t[size]);
+    EXPECT_EQ(buf.get() + size, set.Serialize(buf.get(), buf.get() + size));
+    return AuthorizationSet(buf.get(), size);
+}
+
+TEST(Filtering, RemoveIf) {
+    AuthorizationSet set(AuthorizationSetBuilder()
+                             .Authorization(TAG_APPLICATION_ID, "my_app", 6)
+                             .Authorization(TAG_PURPOSE, KM_PURPOSE_SIGN)
+                             .Authorization(TAG_APPLICATION_DATA, "my_data", 7)
+                             .Authorization(TAG_KEY_SIZE, 256)
+                             .Authorization(TAG_APPLICATION_ID, "other", 5));
+    EXPECT_EQ(0U, set.RemoveIf([](const keymaster_key_param_t&) { return false; }));
+    EXPECT_EQ(5U, set.size());
+
+    EXPECT_EQ(3U, set.RemoveIf(IsBlobEntry));
+    AuthorizationSet expected(AuthorizationSetBuilder()
+                                  .Authorization(TAG_PURPOSE, KM_PURPOSE_SIGN)
+                                  .Authorization(TAG_KEY_SIZE, 256));
+    EXPECT_EQ(expected, set);
+    EXPECT_EQ(0U, set.indirect_size());
+    EXPECT_EQ(expected, RoundTrip(set));
+}
+
+TEST(Filtering, RemoveIfKeepsRemainingBlobs) {
+    AuthorizationSet set(AuthorizationSetBuilder()
+                             .Authorization(TAG_APPLICATION_ID, "my_app", 6)
+                             .Authorization(TAG_APPLICATION_DATA, "my_data", 7)
+                             .Authorization(TAG_PURPOSE, KM_PURPOSE_SIGN)
+                             .Authorization(TAG_APPLICATION_ID, "other", 5));
+    EXPECT_EQ(1U, set.RemoveIf(
+                      [](const keymaster_key_param_t& param) {
+                          return param.tag == KM_TAG_APPLICATION_DATA;
+                      }));
+    AuthorizationSet expected(AuthorizationSetBuilder()
+                                  .Authorization(TAG_APPLICATION_ID, "my_app", 6)
+                                  .Authorization(TAG_PURPOSE, KM_PURPOSE_SIGN)
+                                  .Authorization(TAG_APPLICATION_ID, "other", 5));
+    EXPECT_EQ(expected, set);
+    EXPECT_EQ(11U, set.indirect_size());
+    EXPECT_EQ(expected, RoundTrip(set));
+}
+
+TEST(Filtering, Partition) {
+    AuthorizationSet set(AuthorizationSetBuilder()
+                             .Authorization(TAG_PURPOSE, KM_PURPOSE_SIGN)
+                             .Authorization(TAG_APPLICATION_ID, "my_app", 6)
+                             .Authorization(TAG_KEY_SIZE, 256)
+                             .Authorization(TAG_APPLICATION_DATA, "my_data", 7)
+                             .Authorization(TAG_USER_ID, 7));
+    AuthorizationSet blobs(AuthorizationSetBuilder().Authorization(TAG_USER_ID, 8));
+    EXPECT_TRUE(set.Partition(IsBlobEntry, &blobs));
+
+    AuthorizationSet expected_rest(AuthorizationSetBuilder()
+                                       .Authorization(TAG_PURPOSE, KM_PURPOSE_SIGN)
+                                       .Authorization(TAG_KEY_SIZE, 256)
+                                       .Authorization(TAG_USER_ID, 7));
+    AuthorizationSet expected_blobs(AuthorizationSetBuilder()
+                                        .Authorization(TAG_USER_ID, 8)
+                                        .Authorization(TAG_APPLICATION_ID, "my_app", 6)
+                                        .Authorization(TAG_APPLICATION_DATA, "my_data", 7));
+    EXPECT_EQ(expected_rest, set);
+    EXPECT_EQ(expected_blobs, blobs);
+    EXPECT_EQ(expected_rest, RoundTrip(set));
+    EXPECT_EQ(expected_blobs, RoundTrip(blobs));
+
+    EXPECT_FALSE(set.Partition(IsBlobEntry, nullptr));
+    EXPECT_FALSE(set.Partition(IsBlobEntry, &set));
+}
+
 TEST(GetValue, GetInt) {
     AuthorizationSet set(AuthorizationSetBuilder()
                              .Authorization(TAG_PURPOSE, KM_PURPOSE_SIGN)
@@ -555,6 +1023,37 @@ TEST(GetValue, GetBlob) {
     EXPECT_FALSE(set.GetTagValue(TAG_APPLICATION_DATA, &val));
 }
 
+TEST(CopyToParamSet, Packed) {
+    AuthorizationSet set(AuthorizationSetBuilder()
+                             .Authorization(TAG_PURPOSE, KM_PURPOSE_SIGN)
+                             .Authorization(TAG_APPLICATION_ID, "my_app", 6)
+                             .Authorization(TAG_ALGORITHM, KM_ALGORITHM_RSA)
+                             .Authorization(TAG_APPLICATION_DATA, "data", 4));
+
+    keymaster_key_param_set_t packed;
+    set.CopyToPackedParamSet(&packed);
+    ASSERT_EQ(set.size(), packed.length);
+    EXPECT_EQ(set, AuthorizationSet(packed));
+
+    // Blob data follows the params array.
+    const uint8_t* tail = reinterpret_cast<const uint8_t*>(packed.params + packed.length);
+    const uint8_t* next = tail;
+    for (size_t i = 0; i < packed.length; ++i)
+        if (keymaster_tag_get_type(packed.params[i].tag) == KM_BYTES) {
+            EXPECT_EQ(next, packed.params[i].blob.data);
+            next += packed.params[i].blob.data_length;
+        }
+    EXPECT_EQ(tail + 10, next);
+
+    // A single free releases everything.
+    free(packed.params);
+
+    AuthorizationSet empty;
+    empty.CopyToPackedParamSet(&packed);
+    EXPECT_EQ(0U, packed.length);
+    free(packed.params);
+}
+
 TEST(Deduplication, NoDuplicates) {
     AuthorizationSet set(AuthorizationSetBuilder()
                              .Authorization(TAG_ACTIVE_DATETIME, 10)
@@ -626,5 +1125,36 @@ TEST(Deduplication, DuplicateBlob) {
     // The real test here is that valgrind reports no leak.
 }
 
+TEST(Deduplication, LargeSet) {
+    // Big enough to take the general sort rather than insertion sort.
+    AuthorizationSet set;
+    AuthorizationSet expected;
+    for (uint32_t i = 0; i < 30; ++i) {
+        set.push_back(TAG_USER_ID, (i * 7) % 10);
+        set.push_back(TAG_APPLICATION_DATA, "data", 1 + i % 4);
+        set.push_back(TAG_PURPOSE, static_cast<keymaster_purpose_t>(i % 3));
+    }
+    for (uint32_t i = 0; i < 3; ++i)
+        expected.push_back(TAG_PURPOSE, static_cast<keymaster_purpose_t>(i));
+    for (uint32_t i = 0; i < 10; ++i)
+        expected.push_back(TAG_USER_ID, i);
+    for (size_t i = 0; i < 4; ++i)
+        expected.push_back(TAG_APPLICATION_DATA, "data", 1 + i);
+    expected.Sort();
+
+    set.Deduplicate();
+    EXPECT_EQ(expected, set);
+    EXPECT_TRUE(set.is_sorted_by_tag());
+    for (size_t i = 1; i < set.size(); ++i)
+        EXPECT_LT(keymaster_param_compare(&set[i - 1], &set[i]), 0);
+
+    // The cached serialized size still matches the entries kept.
+    size_t size = set.SerializedSize();
+    UniquePtr<uint8_t[]> buf(new uint8_t[size]);
+    EXPECT_EQ(buf.get() + size, set.Serialize(buf.get(), buf.get() + size));
+    AuthorizationSet deserialized(buf.get(), size);
+    EXPECT_EQ(expected, deserialized);
+}
+
 }  // namespace test
 }  // namespace keymaster
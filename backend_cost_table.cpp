@@ -0,0 +1,101 @@
+/*
+ * Copyright 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "backend_cost_table.h"
+
+namespace keymaster {
+
+const uint32_t BackendCostTable::kMinSamples;
+const uint32_t BackendCostTable::kResampleInterval;
+const size_t BackendCostTable::kMaxTimings;
+
+bool BackendCostTable::Key::operator<(const Key& other) const {
+    if (algorithm != other.algorithm)
+        return algorithm < other.algorithm;
+    if (purpose != other.purpose)
+        return purpose < other.purpose;
+    return key_size < other.key_size;
+}
+
+BackendCostTable::Backend BackendCostTable::Choose(const Key& key) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    Costs& costs = costs_[key];
+    ++costs.choices;
+
+    // Until both backends have enough samples, try whichever has fewer.
+    if (costs.samples[HARDWARE] < kMinSamples || costs.samples[SOFTWARE] < kMinSamples)
+        return costs.samples[SOFTWARE] < costs.samples[HARDWARE] ? SOFTWARE : HARDWARE;
+
+    Backend cheaper = costs.average[SOFTWARE] < costs.average[HARDWARE] ? SOFTWARE : HARDWARE;
+    if (costs.choices % kResampleInterval == 0)
+        return cheaper == SOFTWARE ? HARDWARE : SOFTWARE;
+    return cheaper;
+}
+
+void BackendCostTable::Begin(keymaster_operation_handle_t op_handle, const Key& key,
+                             Backend backend, uint64_t microseconds) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (timings_.size() >= kMaxTimings)
+        timings_.clear();
+    Timing& timing = timings_[op_handle];
+    timing.key = key;
+    timing.backend = backend;
+    timing.microseconds = microseconds;
+}
+
+void BackendCostTable::Update(keymaster_operation_handle_t op_handle, uint64_t microseconds) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto found = timings_.find(op_handle);
+    if (found != timings_.end())
+        found->second.microseconds += microseconds;
+}
+
+void BackendCostTable::Finish(keymaster_operation_handle_t op_handle, uint64_t microseconds) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto found = timings_.find(op_handle);
+    if (found == timings_.end())
+        return;
+    const Timing& timing = found->second;
+    uint64_t cost = timing.microseconds + microseconds;
+
+    Costs& costs = costs_[timing.key];
+    uint64_t& average = costs.average[timing.backend];
+    uint32_t& samples = costs.samples[timing.backend];
+    // Each new sample is weighted by 1/8.
+    if (samples == 0)
+        average = cost;
+    else
+        average = average - average / 8 + cost / 8;
+    if (samples < UINT32_MAX)
+        ++samples;
+    timings_.erase(found);
+}
+
+void BackendCostTable::Abandon(keymaster_operation_handle_t op_handle) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    timings_.erase(op_handle);
+}
+
+bool BackendCostTable::GetCost(const Key& key, Backend backend, uint64_t* microseconds) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto found = costs_.find(key);
+    if (found == costs_.end() || found->second.samples[backend] == 0)
+        return false;
+    *microseconds = found->second.average[backend];
+    return true;
+}
+
+}  // namespace keymaster
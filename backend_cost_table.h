@@ -0,0 +1,133 @@
+/*
+ * Copyright 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SYSTEM_KEYMASTER_BACKEND_COST_TABLE_H_
+#define SYSTEM_KEYMASTER_BACKEND_COST_TABLE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <map>
+#include <mutex>
+
+#include <hardware/keymaster_defs.h>
+
+namespace keymaster {
+
+/**
+ * BackendCostTable records how long operations take on the hardware and software backends, per
+ * algorithm, purpose and key size, and picks the cheaper backend for operations either could run.
+ *
+ * Costs are the time spent in a device's begin, update and finish calls for an operation, so time
+ * the caller spends between calls doesn't count.  Each backend is tried kMinSamples times before
+ * costs are compared, and the more expensive one is still tried once every kResampleInterval
+ * choices, so the table notices when the relative costs change.  All methods are internally
+ * locked.
+ */
+class BackendCostTable {
+  public:
+    enum Backend {
+        HARDWARE = 0,
+        SOFTWARE = 1,
+    };
+
+    struct Key {
+        Key() : algorithm(KM_ALGORITHM_RSA), purpose(KM_PURPOSE_VERIFY), key_size(0) {}
+        Key(keymaster_algorithm_t alg, keymaster_purpose_t purp, uint32_t size)
+            : algorithm(alg), purpose(purp), key_size(size) {}
+
+        bool operator<(const Key& other) const;
+
+        keymaster_algorithm_t algorithm;
+        keymaster_purpose_t purpose;
+        uint32_t key_size;
+    };
+
+    static const uint32_t kMinSamples = 4;
+    static const uint32_t kResampleInterval = 32;
+    // Operations that are never finished or aborted would otherwise be timed forever, so rather
+    // than track them the table forgets all timings when this many are outstanding.
+    static const size_t kMaxTimings = 64;
+
+    BackendCostTable() {}
+
+    /**
+     * Returns the backend to run the next operation for key on.
+     */
+    Backend Choose(const Key& key);
+
+    /**
+     * Starts timing operation op_handle, begun on backend by a begin call that took microseconds.
+     */
+    void Begin(keymaster_operation_handle_t op_handle, const Key& key, Backend backend,
+               uint64_t microseconds);
+
+    /**
+     * Adds the time spent in an update call to the operation's cost.  Does nothing for operations
+     * not being timed.
+     */
+    void Update(keymaster_operation_handle_t op_handle, uint64_t microseconds);
+
+    /**
+     * Adds the time spent in the finish call and records the operation's total cost.
+     */
+    void Finish(keymaster_operation_handle_t op_handle, uint64_t microseconds);
+
+    /**
+     * Stops timing an operation without recording its cost, for operations that were aborted or
+     * failed.
+     */
+    void Abandon(keymaster_operation_handle_t op_handle);
+
+    /**
+     * Sets *microseconds to the average recorded cost of operations for key on backend and returns
+     * true, or returns false if none have been recorded.
+     */
+    bool GetCost(const Key& key, Backend backend, uint64_t* microseconds) const;
+
+  private:
+    struct Costs {
+        Costs() : choices(0) {
+            for (size_t i = 0; i < 2; ++i) {
+                average[i] = 0;
+                samples[i] = 0;
+            }
+        }
+
+        // Exponentially weighted moving average of each backend's cost, so old samples fade.
+        uint64_t average[2];
+        uint32_t samples[2];
+        uint32_t choices;
+    };
+
+    struct Timing {
+        Key key;
+        Backend backend;
+        uint64_t microseconds;
+    };
+
+    mutable std::mutex mutex_;
+    std::map<Key, Costs> costs_;
+    std::map<keymaster_operation_handle_t, Timing> timings_;
+
+    // Disallow copying and assignment.
+    BackendCostTable(const BackendCostTable&);
+    void operator=(const BackendCostTable&);
+};
+
+}  // namespace keymaster
+
+#endif  // SYSTEM_KEYMASTER_BACKEND_COST_TABLE_H_
@@ -0,0 +1,107 @@
+/*
+ * Copyright 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <gtest/gtest.h>
+
+#include "backend_cost_table.h"
+
+namespace keymaster {
+namespace test {
+
+static const BackendCostTable::Key kRsaVerify(KM_ALGORITHM_RSA, KM_PURPOSE_VERIFY, 2048);
+
+// Runs one sampled operation for key, costing hardware_cost or software_cost microseconds
+// depending on the backend chosen, and returns the backend.
+static BackendCostTable::Backend RunOperation(BackendCostTable* table,
+                                              const BackendCostTable::Key& key,
+                                              uint64_t hardware_cost, uint64_t software_cost) {
+    static keymaster_operation_handle_t next_handle = 1;
+    keymaster_operation_handle_t handle = next_handle++;
+    BackendCostTable::Backend backend = table->Choose(key);
+    uint64_t cost = backend == BackendCostTable::HARDWARE ? hardware_cost : software_cost;
+    table->Begin(handle, key, backend, cost / 2);
+    table->Finish(handle, cost - cost / 2);
+    return backend;
+}
+
+TEST(BackendCostTableTest, TriesBothBackendsFirst) {
+    BackendCostTable table;
+    size_t hardware = 0;
+    for (size_t i = 0; i < 2 * BackendCostTable::kMinSamples; ++i)
+        if (RunOperation(&table, kRsaVerify, 1000, 100) == BackendCostTable::HARDWARE)
+            ++hardware;
+    EXPECT_EQ(BackendCostTable::kMinSamples, hardware);
+
+    uint64_t cost;
+    ASSERT_TRUE(table.GetCost(kRsaVerify, BackendCostTable::HARDWARE, &cost));
+    EXPECT_EQ(1000U, cost);
+    ASSERT_TRUE(table.GetCost(kRsaVerify, BackendCostTable::SOFTWARE, &cost));
+    EXPECT_EQ(100U, cost);
+}
+
+TEST(BackendCostTableTest, PrefersCheaperBackend) {
+    BackendCostTable table;
+    for (size_t i = 0; i < 2 * BackendCostTable::kMinSamples; ++i)
+        RunOperation(&table, kRsaVerify, 1000, 100);
+
+    // Apart from occasional resampling, the cheaper backend is chosen.
+    size_t hardware = 0;
+    for (size_t i = 0; i < BackendCostTable::kResampleInterval; ++i)
+        if (RunOperation(&table, kRsaVerify, 1000, 100) == BackendCostTable::HARDWARE)
+            ++hardware;
+    EXPECT_EQ(1U, hardware);
+
+    // Costs are kept per key, so other key sizes start over.
+    BackendCostTable::Key rsa_4096(KM_ALGORITHM_RSA, KM_PURPOSE_VERIFY, 4096);
+    uint64_t cost;
+    EXPECT_FALSE(table.GetCost(rsa_4096, BackendCostTable::HARDWARE, &cost));
+}
+
+TEST(BackendCostTableTest, AdaptsWhenCostsChange) {
+    BackendCostTable table;
+    for (size_t i = 0; i < 2 * BackendCostTable::kMinSamples; ++i)
+        RunOperation(&table, kRsaVerify, 1000, 100);
+
+    // Software gets slower; resampling eventually moves operations to the hardware.
+    BackendCostTable::Backend backend = BackendCostTable::SOFTWARE;
+    for (size_t i = 0; i < 10 * BackendCostTable::kResampleInterval; ++i)
+        backend = RunOperation(&table, kRsaVerify, 1000, 5000);
+    EXPECT_EQ(BackendCostTable::HARDWARE, backend);
+}
+
+TEST(BackendCostTableTest, UpdatesAddAndAbandonedOperationsDontCount) {
+    BackendCostTable table;
+    table.Begin(1, kRsaVerify, BackendCostTable::SOFTWARE, 10);
+    table.Update(1, 20);
+    table.Update(1, 30);
+    table.Finish(1, 40);
+    uint64_t cost;
+    ASSERT_TRUE(table.GetCost(kRsaVerify, BackendCostTable::SOFTWARE, &cost));
+    EXPECT_EQ(100U, cost);
+
+    table.Begin(2, kRsaVerify, BackendCostTable::HARDWARE, 10);
+    table.Abandon(2);
+    table.Finish(2, 40);
+    EXPECT_FALSE(table.GetCost(kRsaVerify, BackendCostTable::HARDWARE, &cost));
+
+    // Operations that weren't begun through the table are ignored.
+    table.Update(3, 20);
+    table.Finish(3, 20);
+    EXPECT_FALSE(table.GetCost(kRsaVerify, BackendCostTable::HARDWARE, &cost));
+}
+
+}  // namespace test
+}  // namespace keymaster
@@ -0,0 +1,95 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "buffered_random.h"
+
+#include <pthread.h>
+#include <string.h>
+
+#include <atomic>
+#include <mutex>
+
+#include <openssl/rand.h>
+
+#include <keymaster/android_keymaster_utils.h>
+
+#include "openssl_err.h"
+
+namespace keymaster {
+
+namespace {
+
+const size_t kRandomBufferSize = 4096;
+
+// Bumped to make every thread discard its buffer before the next draw.
+std::atomic<uint32_t> buffer_generation(0);
+
+std::once_flag fork_handler_once;
+
+struct RandomBuffer {
+    RandomBuffer() : available(0), generation(0) {}
+    ~RandomBuffer() { memset_s(bytes, 0, sizeof(bytes)); }
+
+    uint8_t bytes[kRandomBufferSize];
+    size_t available;  // Unused bytes, at the end of bytes.
+    uint32_t generation;
+};
+
+thread_local RandomBuffer random_buffer;
+
+}  // anonymous namespace
+
+void DiscardBufferedRandomBytes() {
+    buffer_generation.fetch_add(1, std::memory_order_release);
+}
+
+static void register_fork_handler() {
+    // A child must not hand out the same bytes as its parent.
+    pthread_atfork(nullptr /* prepare */, nullptr /* parent */, DiscardBufferedRandomBytes);
+}
+
+keymaster_error_t BufferedRandomBytes(uint8_t* buf, size_t length) {
+    if (length > kMaxBufferedRandomDraw) {
+        if (RAND_bytes(buf, length) != 1)
+            return TranslateLastOpenSslError();
+        return KM_ERROR_OK;
+    }
+
+    RandomBuffer& buffer = random_buffer;
+    uint32_t generation = buffer_generation.load(std::memory_order_acquire);
+    if (buffer.generation != generation) {
+        memset_s(buffer.bytes, 0, sizeof(buffer.bytes));
+        buffer.available = 0;
+        buffer.generation = generation;
+    }
+
+    if (buffer.available < length) {
+        std::call_once(fork_handler_once, register_fork_handler);
+        if (RAND_bytes(buffer.bytes, sizeof(buffer.bytes)) != 1) {
+            buffer.available = 0;
+            return TranslateLastOpenSslError();
+        }
+        buffer.available = sizeof(buffer.bytes);
+    }
+
+    uint8_t* draw = buffer.bytes + sizeof(buffer.bytes) - buffer.available;
+    memcpy(buf, draw, length);
+    memset_s(draw, 0, length);
+    buffer.available -= length;
+    return KM_ERROR_OK;
+}
+
+}  // namespace keymaster
@@ -0,0 +1,49 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SYSTEM_KEYMASTER_BUFFERED_RANDOM_H_
+#define SYSTEM_KEYMASTER_BUFFERED_RANDOM_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <hardware/keymaster_defs.h>
+
+namespace keymaster {
+
+/**
+ * The longest draw BufferedRandomBytes() serves from its buffer.  Longer ones go straight to
+ * RAND_bytes, since the call overhead no longer dominates.
+ */
+const size_t kMaxBufferedRandomDraw = 64;
+
+/**
+ * Fills buf with length bytes from the OpenSSL CSPRNG.  Short draws, such as IVs and handles, are
+ * copied out of a per-thread buffer that's refilled from RAND_bytes in large chunks, so that most
+ * of them don't take the RNG lock.  Each buffered byte is handed out once and then wiped.
+ */
+keymaster_error_t BufferedRandomBytes(uint8_t* buf, size_t length);
+
+/**
+ * Discards the bytes buffered by every thread, so that subsequent draws come from RAND_bytes
+ * output generated after this call.  Called after entropy is added to the OpenSSL RNG.  Forked
+ * children discard their inherited buffers automatically.
+ */
+void DiscardBufferedRandomBytes();
+
+}  // namespace keymaster
+
+#endif  // SYSTEM_KEYMASTER_BUFFERED_RANDOM_H_
@@ -0,0 +1,79 @@
+/*
+ * Copyright 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "buffered_random.h"
+
+#include <algorithm>
+#include <set>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "android_keymaster_test_utils.h"
+
+namespace keymaster {
+namespace test {
+
+static uint64_t Draw() {
+    uint64_t value = 0;
+    EXPECT_EQ(KM_ERROR_OK, BufferedRandomBytes(reinterpret_cast<uint8_t*>(&value), sizeof(value)));
+    return value;
+}
+
+TEST(BufferedRandomTest, DrawsDontRepeat) {
+    // Enough draws to run through several refills.
+    std::set<uint64_t> values;
+    for (int i = 0; i < 2000; ++i)
+        values.insert(Draw());
+    EXPECT_EQ(2000U, values.size());
+}
+
+TEST(BufferedRandomTest, LongDraw) {
+    uint8_t buf[kMaxBufferedRandomDraw * 4] = {};
+    EXPECT_EQ(KM_ERROR_OK, BufferedRandomBytes(buf, sizeof(buf)));
+    EXPECT_FALSE(std::all_of(buf, buf + sizeof(buf), [](uint8_t b) { return b == 0; }));
+}
+
+TEST(BufferedRandomTest, DrawsAfterDiscard) {
+    uint64_t before = Draw();
+    DiscardBufferedRandomBytes();
+    uint64_t after = Draw();
+    EXPECT_NE(before, after);
+}
+
+TEST(BufferedRandomTest, ThreadsDrawDistinctBytes) {
+    const size_t kThreads = 4;
+    const size_t kDraws = 1000;
+    std::vector<std::vector<uint64_t>> values(kThreads);
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < kThreads; ++i) {
+        threads.emplace_back([&values, i] {
+            for (size_t j = 0; j < kDraws; ++j)
+                values[i].push_back(Draw());
+        });
+    }
+    for (auto& thread : threads)
+        thread.join();
+
+    std::set<uint64_t> all;
+    for (auto& thread_values : values)
+        all.insert(thread_values.begin(), thread_values.end());
+    EXPECT_EQ(kThreads * kDraws, all.size());
+}
+
+}  // namespace test
+}  // namespace keymaster
@@ -0,0 +1,75 @@
+/*
+ * Copyright 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "chacha20_poly1305_key.h"
+
+#include <new>
+
+#include <keymaster/logger.h>
+
+#include "chacha20_poly1305_operation.h"
+
+namespace keymaster {
+
+static ChaCha20Poly1305EncryptionOperationFactory encrypt_factory;
+static ChaCha20Poly1305DecryptionOperationFactory decrypt_factory;
+
+OperationFactory* ChaCha20Poly1305KeyFactory::GetOperationFactory(
+    keymaster_purpose_t purpose) const {
+    switch (purpose) {
+    case KM_PURPOSE_ENCRYPT:
+        return &encrypt_factory;
+    case KM_PURPOSE_DECRYPT:
+        return &decrypt_factory;
+    default:
+        return nullptr;
+    }
+}
+
+keymaster_error_t ChaCha20Poly1305KeyFactory::LoadKey(const KeymasterKeyBlob& key_material,
+                                                      const AuthorizationSet& /* additional */,
+                                                      const AuthorizationSet& hw_enforced,
+                                                      const AuthorizationSet& sw_enforced,
+                                                      UniquePtr<Key>* key) const {
+    if (!key)
+        return KM_ERROR_OUTPUT_PARAMETER_NULL;
+    if (key_material.key_material_size != kChaCha20Poly1305KeySize)
+        return KM_ERROR_INVALID_KEY_BLOB;
+
+    keymaster_error_t error = KM_ERROR_OK;
+    key->reset(new (std::nothrow)
+                   ChaCha20Poly1305Key(key_material, hw_enforced, sw_enforced, &error));
+    if (!key->get())
+        error = KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    return error;
+}
+
+keymaster_error_t ChaCha20Poly1305KeyFactory::validate_algorithm_specific_new_key_params(
+    const AuthorizationSet& key_description) const {
+    // Block modes and padding don't apply.  A minimum tag length may be given, for symmetry with
+    // AES-GCM keys, but the tag is always 128 bits.
+    if (key_description.find(TAG_BLOCK_MODE) != -1 || key_description.find(TAG_PADDING) != -1) {
+        LOG_W("Block mode or padding specified for ChaCha20-Poly1305 key", 0);
+        return KM_ERROR_INVALID_TAG;
+    }
+    uint32_t min_tag_length;
+    if (key_description.GetTagValue(TAG_MIN_MAC_LENGTH, &min_tag_length) &&
+        min_tag_length != kChaCha20Poly1305TagLength)
+        return KM_ERROR_UNSUPPORTED_MIN_MAC_LENGTH;
+    return KM_ERROR_OK;
+}
+
+}  // namespace keymaster
@@ -0,0 +1,68 @@
+/*
+ * Copyright 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SYSTEM_KEYMASTER_CHACHA20_POLY1305_KEY_H_
+#define SYSTEM_KEYMASTER_CHACHA20_POLY1305_KEY_H_
+
+#include <keymaster/keymaster_tags.h>
+
+#include "symmetric_key.h"
+
+namespace keymaster {
+
+// ChaCha20-Poly1305 has one key size and one tag size.
+const size_t kChaCha20Poly1305KeySize = 32;
+const size_t kChaCha20Poly1305TagLength = 16 * 8;
+
+/**
+ * Factory for KM_ALGORITHM_CHACHA20_POLY1305 keys, an AEAD with the same streaming, associated
+ * data and tag handling as AES-GCM that is much faster on CPUs without AES instructions.
+ */
+class ChaCha20Poly1305KeyFactory : public SymmetricKeyFactory {
+  public:
+    ChaCha20Poly1305KeyFactory(const KeymasterContext* context) : SymmetricKeyFactory(context) {}
+
+    keymaster_algorithm_t registry_key() const { return KM_ALGORITHM_CHACHA20_POLY1305; }
+
+    keymaster_error_t LoadKey(const KeymasterKeyBlob& key_material,
+                              const AuthorizationSet& additional_params,
+                              const AuthorizationSet& hw_enforced,
+                              const AuthorizationSet& sw_enforced,
+                              UniquePtr<Key>* key) const override;
+
+    OperationFactory* GetOperationFactory(keymaster_purpose_t purpose) const override;
+
+  private:
+    bool key_size_supported(size_t key_size_bits) const override {
+        return key_size_bits == kChaCha20Poly1305KeySize * 8;
+    }
+    keymaster_error_t validate_algorithm_specific_new_key_params(
+        const AuthorizationSet& key_description) const override;
+};
+
+class ChaCha20Poly1305Key : public SymmetricKey {
+  public:
+    ChaCha20Poly1305Key(const KeymasterKeyBlob& key_material, const AuthorizationSet& hw_enforced,
+                        const AuthorizationSet& sw_enforced, keymaster_error_t* error)
+        : SymmetricKey(key_material, hw_enforced, sw_enforced, error) {}
+
+  protected:
+    size_t object_size() const override { return sizeof(*this); }
+};
+
+}  // namespace keymaster
+
+#endif  // SYSTEM_KEYMASTER_CHACHA20_POLY1305_KEY_H_
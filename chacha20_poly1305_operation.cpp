@@ -0,0 +1,288 @@
+/*
+ * Copyright 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "chacha20_poly1305_operation.h"
+
+#include <string.h>
+
+#include <algorithm>
+#include <new>
+
+#include <openssl/chacha.h>
+#include <openssl/crypto.h>
+
+#include <keymaster/logger.h>
+
+#include "buffered_random.h"
+#include "chacha20_poly1305_key.h"
+
+namespace keymaster {
+
+const size_t ChaCha20Poly1305Operation::kNonceSize;
+const size_t ChaCha20Poly1305Operation::kTagSize;
+const size_t ChaCha20Poly1305Operation::kKeySize;
+const size_t ChaCha20Poly1305Operation::kBlockSize;
+
+Operation* ChaCha20Poly1305OperationFactory::CreateOperation(const Key& key,
+                                                             const AuthorizationSet& begin_params,
+                                                             keymaster_error_t* error) {
+    *error = KM_ERROR_OK;
+    const ChaCha20Poly1305Key* chacha_key = static_cast<const ChaCha20Poly1305Key*>(&key);
+    if (chacha_key->key_data_size() != kChaCha20Poly1305KeySize) {
+        *error = KM_ERROR_UNSUPPORTED_KEY_SIZE;
+        return nullptr;
+    }
+
+    // The tag length needn't be given, but if it is it must be the only one there is.
+    uint32_t tag_length_bits;
+    if (begin_params.GetTagValue(TAG_MAC_LENGTH, &tag_length_bits) &&
+        tag_length_bits != kChaCha20Poly1305TagLength) {
+        *error = KM_ERROR_UNSUPPORTED_MAC_LENGTH;
+        return nullptr;
+    }
+
+    bool caller_nonce = key.authorizations().GetTagValue(TAG_CALLER_NONCE);
+    Operation* op = new (std::nothrow)
+        ChaCha20Poly1305Operation(purpose(), chacha_key->key_data(), caller_nonce);
+    if (!op)
+        *error = KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    return op;
+}
+
+ChaCha20Poly1305Operation::ChaCha20Poly1305Operation(keymaster_purpose_t purpose,
+                                                     const uint8_t* key, bool caller_nonce)
+    : Operation(purpose), caller_nonce_(caller_nonce), counter_(1), keystream_used_(kBlockSize),
+      aad_length_(0), data_length_(0), data_started_(false), tag_buf_length_(0) {
+    memcpy(key_, key, kKeySize);
+}
+
+ChaCha20Poly1305Operation::~ChaCha20Poly1305Operation() {
+    memset_s(key_, 0, sizeof(key_));
+    memset_s(poly1305_, 0, sizeof(poly1305_));
+    memset_s(keystream_, 0, sizeof(keystream_));
+}
+
+keymaster_error_t ChaCha20Poly1305Operation::GetNonce(const AuthorizationSet& input_params) {
+    keymaster_blob_t nonce_blob;
+    if (!input_params.GetTagValue(TAG_NONCE, &nonce_blob)) {
+        LOG_E("No nonce provided", 0);
+        return KM_ERROR_INVALID_ARGUMENT;
+    }
+    if (nonce_blob.data_length != kNonceSize) {
+        LOG_E("Expected %d-byte nonce for ChaCha20-Poly1305 operation, but got %d bytes",
+              kNonceSize, nonce_blob.data_length);
+        return KM_ERROR_INVALID_NONCE;
+    }
+    memcpy(nonce_, nonce_blob.data, kNonceSize);
+    return KM_ERROR_OK;
+}
+
+keymaster_error_t ChaCha20Poly1305Operation::Begin(const AuthorizationSet& input_params,
+                                                   AuthorizationSet* output_params) {
+    if (!output_params)
+        return KM_ERROR_OUTPUT_PARAMETER_NULL;
+
+    keymaster_error_t error = KM_ERROR_OK;
+    if (purpose() == KM_PURPOSE_DECRYPT)
+        error = GetNonce(input_params);
+    else if (input_params.find(TAG_NONCE) == -1)
+        error = BufferedRandomBytes(nonce_, kNonceSize);
+    else if (caller_nonce_)
+        error = GetNonce(input_params);
+    else
+        error = KM_ERROR_CALLER_NONCE_PROHIBITED;
+    if (error != KM_ERROR_OK)
+        return error;
+    if (purpose() == KM_PURPOSE_ENCRYPT)
+        output_params->push_back(TAG_NONCE, nonce_, kNonceSize);
+
+    // The one-time Poly1305 key is the start of keystream block 0; data starts at block 1.
+    uint8_t block[kBlockSize] = {};
+    CRYPTO_chacha_20(block, block, sizeof(block), key_, nonce_, 0 /* counter */);
+    CRYPTO_poly1305_init(&poly1305_, block);
+    memset_s(block, 0, sizeof(block));
+    return KM_ERROR_OK;
+}
+
+keymaster_error_t ChaCha20Poly1305Operation::ProcessAad(const uint8_t* aad, size_t aad_length) {
+    if (data_started_)
+        return KM_ERROR_INVALID_TAG;
+    CRYPTO_poly1305_update(&poly1305_, aad, aad_length);
+    aad_length_ += aad_length;
+    return KM_ERROR_OK;
+}
+
+keymaster_error_t ChaCha20Poly1305Operation::UpdateAad(const uint8_t* aad, size_t aad_length) {
+    return ProcessAad(aad, aad_length);
+}
+
+static void Poly1305Pad16(poly1305_state* state, uint64_t length) {
+    static const uint8_t zeros[16] = {};
+    if (length % 16)
+        CRYPTO_poly1305_update(state, zeros, 16 - length % 16);
+}
+
+void ChaCha20Poly1305Operation::StartData() {
+    if (data_started_)
+        return;
+    data_started_ = true;
+    Poly1305Pad16(&poly1305_, aad_length_);
+}
+
+void ChaCha20Poly1305Operation::Crypt(const uint8_t* input, size_t input_length,
+                                      uint8_t* output) {
+    data_length_ += input_length;
+    while (keystream_used_ < kBlockSize && input_length > 0) {
+        *output++ = *input++ ^ keystream_[keystream_used_++];
+        --input_length;
+    }
+
+    size_t whole_blocks = input_length / kBlockSize;
+    if (whole_blocks) {
+        CRYPTO_chacha_20(output, input, whole_blocks * kBlockSize, key_, nonce_, counter_);
+        counter_ += whole_blocks;
+        input += whole_blocks * kBlockSize;
+        output += whole_blocks * kBlockSize;
+        input_length -= whole_blocks * kBlockSize;
+    }
+
+    if (input_length) {
+        memset(keystream_, 0, sizeof(keystream_));
+        CRYPTO_chacha_20(keystream_, keystream_, sizeof(keystream_), key_, nonce_, counter_++);
+        for (keystream_used_ = 0; keystream_used_ < input_length; ++keystream_used_)
+            output[keystream_used_] = input[keystream_used_] ^ keystream_[keystream_used_];
+    }
+}
+
+keymaster_error_t ChaCha20Poly1305Operation::Encrypt(const uint8_t* input, size_t input_length,
+                                                     Buffer* output) {
+    if (!output->reserve(input_length))
+        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    uint8_t* ciphertext = output->peek_write();
+    Crypt(input, input_length, ciphertext);
+    CRYPTO_poly1305_update(&poly1305_, ciphertext, input_length);
+    if (!output->advance_write(input_length))
+        return KM_ERROR_UNKNOWN_ERROR;
+    return KM_ERROR_OK;
+}
+
+keymaster_error_t ChaCha20Poly1305Operation::Decrypt(const uint8_t* input, size_t input_length,
+                                                     Buffer* output) {
+    if (tag_buf_length_ + input_length <= kTagSize) {
+        memcpy(tag_buf_ + tag_buf_length_, input, input_length);
+        tag_buf_length_ += input_length;
+        return KM_ERROR_OK;
+    }
+
+    const size_t to_process = tag_buf_length_ + input_length - kTagSize;
+    const size_t to_process_from_tag_buf = std::min(to_process, tag_buf_length_);
+    const size_t to_process_from_input = to_process - to_process_from_tag_buf;
+    if (!output->reserve(to_process))
+        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+
+    // As for AES-GCM, the held-back bytes are lined up with the input and decrypted in place.
+    uint8_t* data = output->peek_write();
+    memcpy(data, tag_buf_, to_process_from_tag_buf);
+    memcpy(data + to_process_from_tag_buf, input, to_process_from_input);
+    CRYPTO_poly1305_update(&poly1305_, data, to_process);
+    Crypt(data, to_process, data);
+    if (!output->advance_write(to_process))
+        return KM_ERROR_UNKNOWN_ERROR;
+
+    memmove(tag_buf_, tag_buf_ + to_process_from_tag_buf,
+            tag_buf_length_ - to_process_from_tag_buf);
+    tag_buf_length_ -= to_process_from_tag_buf;
+    memcpy(tag_buf_ + tag_buf_length_, input + to_process_from_input,
+           input_length - to_process_from_input);
+    tag_buf_length_ += input_length - to_process_from_input;
+    assert(tag_buf_length_ == kTagSize);
+    return KM_ERROR_OK;
+}
+
+keymaster_error_t ChaCha20Poly1305Operation::Update(const AuthorizationSet& additional_params,
+                                                    const Buffer& input,
+                                                    AuthorizationSet* /* output_params */,
+                                                    Buffer* output, size_t* input_consumed) {
+    if (!output || !input_consumed)
+        return KM_ERROR_OUTPUT_PARAMETER_NULL;
+
+    keymaster_error_t error;
+    keymaster_blob_t aad;
+    if (additional_params.GetTagValue(TAG_ASSOCIATED_DATA, &aad)) {
+        error = ProcessAad(aad.data, aad.data_length);
+        if (error != KM_ERROR_OK)
+            return error;
+    }
+
+    *input_consumed = input.available_read();
+    if (!input.available_read())
+        return KM_ERROR_OK;
+
+    StartData();
+    if (purpose() == KM_PURPOSE_ENCRYPT)
+        return Encrypt(input.peek_read(), input.available_read(), output);
+    return Decrypt(input.peek_read(), input.available_read(), output);
+}
+
+static void EncodeLittleEndian64(uint64_t value, uint8_t* out) {
+    for (size_t i = 0; i < 8; ++i)
+        out[i] = static_cast<uint8_t>(value >> (8 * i));
+}
+
+void ChaCha20Poly1305Operation::ComputeTag(uint8_t* tag) {
+    StartData();
+    Poly1305Pad16(&poly1305_, data_length_);
+    uint8_t lengths[16];
+    EncodeLittleEndian64(aad_length_, lengths);
+    EncodeLittleEndian64(data_length_, lengths + 8);
+    CRYPTO_poly1305_update(&poly1305_, lengths, sizeof(lengths));
+    CRYPTO_poly1305_finish(&poly1305_, tag);
+}
+
+keymaster_error_t ChaCha20Poly1305Operation::Finish(const AuthorizationSet& additional_params,
+                                                    const Buffer& input,
+                                                    const Buffer& /* signature */,
+                                                    AuthorizationSet* output_params,
+                                                    Buffer* output) {
+    if (!output)
+        return KM_ERROR_OUTPUT_PARAMETER_NULL;
+
+    if (input.available_read() || !additional_params.empty()) {
+        size_t input_consumed;
+        keymaster_error_t error =
+            Update(additional_params, input, output_params, output, &input_consumed);
+        if (error != KM_ERROR_OK)
+            return error;
+    }
+
+    if (purpose() == KM_PURPOSE_DECRYPT && tag_buf_length_ < kTagSize)
+        return KM_ERROR_INVALID_INPUT_LENGTH;
+
+    uint8_t tag[kTagSize];
+    ComputeTag(tag);
+    if (purpose() == KM_PURPOSE_DECRYPT)
+        return CRYPTO_memcmp(tag, tag_buf_, kTagSize) == 0 ? KM_ERROR_OK
+                                                            : KM_ERROR_VERIFICATION_FAILED;
+
+    if (!output->reserve(kTagSize))
+        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    memcpy(output->peek_write(), tag, kTagSize);
+    if (!output->advance_write(kTagSize))
+        return KM_ERROR_UNKNOWN_ERROR;
+    return KM_ERROR_OK;
+}
+
+}  // namespace keymaster
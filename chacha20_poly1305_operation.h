@@ -0,0 +1,116 @@
+/*
+ * Copyright 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SYSTEM_KEYMASTER_CHACHA20_POLY1305_OPERATION_H_
+#define SYSTEM_KEYMASTER_CHACHA20_POLY1305_OPERATION_H_
+
+#include <openssl/poly1305.h>
+
+#include <keymaster/keymaster_tags.h>
+
+#include "operation.h"
+
+namespace keymaster {
+
+/**
+ * Abstract base for ChaCha20-Poly1305 operation factories.
+ */
+class ChaCha20Poly1305OperationFactory : public OperationFactory {
+  public:
+    KeyType registry_key() const override {
+        return KeyType(KM_ALGORITHM_CHACHA20_POLY1305, purpose());
+    }
+
+    Operation* CreateOperation(const Key& key, const AuthorizationSet& begin_params,
+                               keymaster_error_t* error) override;
+
+    virtual keymaster_purpose_t purpose() const = 0;
+};
+
+class ChaCha20Poly1305EncryptionOperationFactory : public ChaCha20Poly1305OperationFactory {
+    keymaster_purpose_t purpose() const override { return KM_PURPOSE_ENCRYPT; }
+};
+
+class ChaCha20Poly1305DecryptionOperationFactory : public ChaCha20Poly1305OperationFactory {
+    keymaster_purpose_t purpose() const override { return KM_PURPOSE_DECRYPT; }
+};
+
+/**
+ * ChaCha20-Poly1305 (RFC 7539) encryption or decryption, streamed the way AES-GCM operations are:
+ * a 12-byte nonce in TAG_NONCE, associated data in TAG_ASSOCIATED_DATA or UpdateAad before any
+ * data, and a 16-byte tag appended to the ciphertext, which decryption holds back from its output
+ * and checks in Finish.
+ */
+class ChaCha20Poly1305Operation : public Operation {
+  public:
+    static const size_t kNonceSize = 12;
+    static const size_t kTagSize = 16;
+
+    ChaCha20Poly1305Operation(keymaster_purpose_t purpose, const uint8_t* key, bool caller_nonce);
+    ~ChaCha20Poly1305Operation();
+
+    keymaster_error_t Begin(const AuthorizationSet& input_params,
+                            AuthorizationSet* output_params) override;
+    keymaster_error_t Update(const AuthorizationSet& additional_params, const Buffer& input,
+                             AuthorizationSet* output_params, Buffer* output,
+                             size_t* input_consumed) override;
+    keymaster_error_t Finish(const AuthorizationSet& additional_params, const Buffer& input,
+                             const Buffer& signature, AuthorizationSet* output_params,
+                             Buffer* output) override;
+    keymaster_error_t Abort() override { return KM_ERROR_OK; }
+    keymaster_error_t UpdateAad(const uint8_t* aad, size_t aad_length) override;
+
+  private:
+    size_t object_size() const override { return sizeof(*this); }
+
+    static const size_t kKeySize = 32;
+    static const size_t kBlockSize = 64;
+
+    keymaster_error_t GetNonce(const AuthorizationSet& input_params);
+    keymaster_error_t ProcessAad(const uint8_t* aad, size_t aad_length);
+    // Pads the associated data out for the MAC, the first time data arrives.
+    void StartData();
+    // XORs input_length bytes of input with the keystream into output, which may be input.
+    void Crypt(const uint8_t* input, size_t input_length, uint8_t* output);
+    keymaster_error_t Encrypt(const uint8_t* input, size_t input_length, Buffer* output);
+    // Decrypts all but the last kTagSize bytes of the data seen so far, holding those back in
+    // tag_buf_ as the candidate tag.
+    keymaster_error_t Decrypt(const uint8_t* input, size_t input_length, Buffer* output);
+    void ComputeTag(uint8_t* tag);
+
+    uint8_t key_[kKeySize];
+    uint8_t nonce_[kNonceSize];
+    const bool caller_nonce_;
+    poly1305_state poly1305_;
+    // ChaCha20 block counter for the next keystream block.  Block 0 keys Poly1305.
+    uint32_t counter_;
+    // Keystream left over from a block that an update only partly used.
+    uint8_t keystream_[kBlockSize];
+    size_t keystream_used_;
+    uint64_t aad_length_;
+    uint64_t data_length_;
+    bool data_started_;
+    uint8_t tag_buf_[kTagSize];
+    size_t tag_buf_length_;
+
+    // Disallow copying and assignment.
+    ChaCha20Poly1305Operation(const ChaCha20Poly1305Operation&);
+    void operator=(const ChaCha20Poly1305Operation&);
+};
+
+}  // namespace keymaster
+
+#endif  // SYSTEM_KEYMASTER_CHACHA20_POLY1305_OPERATION_H_
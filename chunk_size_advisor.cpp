@@ -0,0 +1,101 @@
+/*
+ * Copyright 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "chunk_size_advisor.h"
+
+#include <time.h>
+
+namespace keymaster {
+
+const uint32_t ChunkSizeAdvisor::kMinSamples;
+const uint32_t ChunkSizeAdvisor::kWindow;
+const uint32_t ChunkSizeAdvisor::kOverheadPercent;
+const size_t ChunkSizeAdvisor::kMinChunkSize;
+const size_t ChunkSizeAdvisor::kMaxChunkSize;
+
+bool ChunkSizeAdvisor::Key::operator<(const Key& other) const {
+    if (algorithm != other.algorithm)
+        return algorithm < other.algorithm;
+    return purpose < other.purpose;
+}
+
+void ChunkSizeAdvisor::Record(const Key& key, size_t bytes, uint64_t nanoseconds) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    Fit& fit = fits_[key];
+    double x = static_cast<double>(bytes);
+    double y = static_cast<double>(nanoseconds);
+    fit.samples += 1;
+    fit.sum_x += x;
+    fit.sum_y += y;
+    fit.sum_xx += x * x;
+    fit.sum_xy += x * y;
+    if (++fit.count >= kMinSamples)
+        UpdateAdvice(&fit);
+
+    if (fit.count % kWindow == 0) {
+        fit.samples /= 2;
+        fit.sum_x /= 2;
+        fit.sum_y /= 2;
+        fit.sum_xx /= 2;
+        fit.sum_xy /= 2;
+    }
+}
+
+size_t ChunkSizeAdvisor::Advise(const Key& key, size_t preferred, size_t max_chunk_size) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto found = fits_.find(key);
+    if (found == fits_.end() || found->second.advice == 0)
+        return preferred;
+    size_t advice = found->second.advice;
+    if (max_chunk_size != 0 && advice > max_chunk_size)
+        return max_chunk_size;
+    return advice;
+}
+
+/* static */
+void ChunkSizeAdvisor::UpdateAdvice(Fit* fit) {
+    // Least squares fit of time = overhead + per_byte * bytes.
+    double denominator = fit->samples * fit->sum_xx - fit->sum_x * fit->sum_x;
+    // When the sizes are all nearly the same the fit is meaningless, and rounding may even make
+    // the denominator negative.
+    if (denominator <= 1e-9 * fit->samples * fit->sum_xx)
+        return;
+    double per_byte = (fit->samples * fit->sum_xy - fit->sum_x * fit->sum_y) / denominator;
+    double overhead = (fit->sum_y - per_byte * fit->sum_x) / fit->samples;
+    // Noisy times can fit a line that no real costs would, so keep the last advice.
+    if (per_byte <= 0 || overhead <= 0)
+        return;
+
+    // overhead / (overhead + per_byte * n) <= kOverheadPercent / 100, solved for n.
+    double target = overhead * (100 - kOverheadPercent) / (kOverheadPercent * per_byte);
+    if (target >= kMaxChunkSize) {
+        fit->advice = kMaxChunkSize;
+        return;
+    }
+    size_t advice = kMinChunkSize;
+    while (advice < target)
+        advice *= 2;
+    fit->advice = advice;
+}
+
+/* static */
+uint64_t ChunkSizeAdvisor::NowNanoseconds() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return static_cast<uint64_t>(now.tv_sec) * 1000000000 + now.tv_nsec;
+}
+
+}  // namespace keymaster
@@ -0,0 +1,110 @@
+/*
+ * Copyright 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SYSTEM_KEYMASTER_CHUNK_SIZE_ADVISOR_H_
+#define SYSTEM_KEYMASTER_CHUNK_SIZE_ADVISOR_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <map>
+#include <mutex>
+
+#include <hardware/keymaster_defs.h>
+
+namespace keymaster {
+
+/**
+ * ChunkSizeAdvisor suggests how much input each update of an operation should be given, per
+ * algorithm and purpose, from the times updates have taken.
+ *
+ * Each update costs roughly a fixed overhead plus a per-byte cost, so the advisor fits a line to
+ * the recorded (bytes, time) pairs and advises the smallest power of two for which the overhead is
+ * at most kOverheadPercent of an update's time.  Only the time recorded is seen, so costs outside
+ * it, such as serializing the messages and crossing into secure hardware, make the advice a lower
+ * bound.  Older samples are given half the weight each time kWindow more are recorded, so the
+ * advice follows changes in the costs.  All methods are internally locked.
+ */
+class ChunkSizeAdvisor {
+  public:
+    struct Key {
+        Key() : algorithm(KM_ALGORITHM_RSA), purpose(KM_PURPOSE_ENCRYPT) {}
+        Key(keymaster_algorithm_t alg, keymaster_purpose_t purp) : algorithm(alg), purpose(purp) {}
+
+        bool operator<(const Key& other) const;
+
+        keymaster_algorithm_t algorithm;
+        keymaster_purpose_t purpose;
+    };
+
+    static const uint32_t kMinSamples = 16;
+    static const uint32_t kWindow = 1024;
+    static const uint32_t kOverheadPercent = 5;
+    static const size_t kMinChunkSize = 1024;
+    // The most advised for operations that set no maximum of their own.
+    static const size_t kMaxChunkSize = 1024 * 1024;
+
+    ChunkSizeAdvisor() {}
+
+    /**
+     * Records that an update of bytes of input took nanoseconds.
+     */
+    void Record(const Key& key, size_t bytes, uint64_t nanoseconds);
+
+    /**
+     * Returns the chunk size to advise for an operation for key, whose own preference is
+     * preferred and whose limit is max_chunk_size, or 0 for none.  The operation's preference is
+     * returned until kMinSamples updates have been recorded and the times fit a line; after that
+     * the last advice that could be computed is kept whenever the recent times don't fit one, as
+     * when they were all for the same size.
+     */
+    size_t Advise(const Key& key, size_t preferred, size_t max_chunk_size) const;
+
+    /**
+     * Returns the time, in nanoseconds since an arbitrary point, from a monotonic clock.
+     */
+    static uint64_t NowNanoseconds();
+
+  private:
+    struct Fit {
+        Fit() : count(0), samples(0), sum_x(0), sum_y(0), sum_xx(0), sum_xy(0), advice(0) {}
+
+        // Updates recorded, and their weight, which is less once the sums have been halved.
+        uint32_t count;
+        double samples;
+        double sum_x;
+        double sum_y;
+        double sum_xx;
+        double sum_xy;
+        // The last advice computed, or 0.  It's computed on recording, and is not yet clamped to
+        // any operation's maximum.
+        size_t advice;
+    };
+
+    // Fits the line to fit's sums and stores the advice, unless they don't fit one.
+    static void UpdateAdvice(Fit* fit);
+
+    mutable std::mutex mutex_;
+    std::map<Key, Fit> fits_;
+
+    // Disallow copying and assignment.
+    ChunkSizeAdvisor(const ChunkSizeAdvisor&);
+    void operator=(const ChunkSizeAdvisor&);
+};
+
+}  // namespace keymaster
+
+#endif  // SYSTEM_KEYMASTER_CHUNK_SIZE_ADVISOR_H_
@@ -0,0 +1,86 @@
+/*
+ * Copyright 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <gtest/gtest.h>
+
+#include "chunk_size_advisor.h"
+
+namespace keymaster {
+namespace test {
+
+static const ChunkSizeAdvisor::Key kAesEncrypt(KM_ALGORITHM_AES, KM_PURPOSE_ENCRYPT);
+static const ChunkSizeAdvisor::Key kAesDecrypt(KM_ALGORITHM_AES, KM_PURPOSE_DECRYPT);
+
+// Records count updates for key of 1, 2, 3 and 4 KiB in turn, each costing overhead nanoseconds
+// plus per_byte for every byte.
+static void RecordUpdates(ChunkSizeAdvisor* advisor, const ChunkSizeAdvisor::Key& key,
+                          size_t count, uint64_t overhead, uint64_t per_byte) {
+    for (size_t i = 0; i < count; ++i) {
+        size_t bytes = 1024 * (i % 4 + 1);
+        advisor->Record(key, bytes, overhead + per_byte * bytes);
+    }
+}
+
+TEST(ChunkSizeAdvisorTest, ReturnsPreferenceUntilSampled) {
+    ChunkSizeAdvisor advisor;
+    EXPECT_EQ(4096U, advisor.Advise(kAesEncrypt, 4096, 0));
+    RecordUpdates(&advisor, kAesEncrypt, ChunkSizeAdvisor::kMinSamples - 1, 10000, 1);
+    EXPECT_EQ(4096U, advisor.Advise(kAesEncrypt, 4096, 0));
+    RecordUpdates(&advisor, kAesEncrypt, 1, 10000, 1);
+    EXPECT_NE(4096U, advisor.Advise(kAesEncrypt, 4096, 0));
+}
+
+TEST(ChunkSizeAdvisorTest, KeepsOverheadSmall) {
+    ChunkSizeAdvisor advisor;
+    // The overhead is 5% of an update of 190000 bytes.
+    RecordUpdates(&advisor, kAesEncrypt, 64, 10000, 1);
+    EXPECT_EQ(256U * 1024, advisor.Advise(kAesEncrypt, 4096, 0));
+    // Other keys are advised separately.
+    EXPECT_EQ(4096U, advisor.Advise(kAesDecrypt, 4096, 0));
+}
+
+TEST(ChunkSizeAdvisorTest, Clamps) {
+    ChunkSizeAdvisor advisor;
+    RecordUpdates(&advisor, kAesEncrypt, 64, 10000, 1);
+    EXPECT_EQ(256U, advisor.Advise(kAesEncrypt, 256, 256));
+
+    RecordUpdates(&advisor, kAesDecrypt, 64, 100000000, 1);
+    EXPECT_EQ(ChunkSizeAdvisor::kMaxChunkSize, advisor.Advise(kAesDecrypt, 4096, 0));
+
+    ChunkSizeAdvisor cheap_calls;
+    RecordUpdates(&cheap_calls, kAesEncrypt, 64, 1, 100);
+    EXPECT_EQ(ChunkSizeAdvisor::kMinChunkSize, cheap_calls.Advise(kAesEncrypt, 4096, 0));
+}
+
+TEST(ChunkSizeAdvisorTest, IgnoresUpdatesOfOneSize) {
+    ChunkSizeAdvisor advisor;
+    for (size_t i = 0; i < 64; ++i)
+        advisor.Record(kAesEncrypt, 4096, 10000 + i % 7);
+    EXPECT_EQ(8192U, advisor.Advise(kAesEncrypt, 8192, 0));
+}
+
+TEST(ChunkSizeAdvisorTest, FollowsChangingCosts) {
+    ChunkSizeAdvisor advisor;
+    RecordUpdates(&advisor, kAesEncrypt, ChunkSizeAdvisor::kWindow, 10000, 1);
+    EXPECT_EQ(256U * 1024, advisor.Advise(kAesEncrypt, 4096, 0));
+
+    // The overhead is now 5% of an update of 19000 bytes.
+    RecordUpdates(&advisor, kAesEncrypt, 8 * ChunkSizeAdvisor::kWindow, 1000, 1);
+    EXPECT_EQ(32U * 1024, advisor.Advise(kAesEncrypt, 4096, 0));
+}
+
+}  // namespace test
+}  // namespace keymaster
@@ -0,0 +1,235 @@
+/*
+ * Copyright 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "compact_private_key.h"
+
+#include <string.h>
+
+#include <openssl/bn.h>
+#include <openssl/ec.h>
+#include <openssl/err.h>
+#include <openssl/rsa.h>
+
+#include <keymaster/android_keymaster_utils.h>
+#include <keymaster/logger.h>
+
+#include "openssl_err.h"
+
+namespace keymaster {
+
+namespace {
+
+// Format and version.
+const size_t kHeaderSize = 2;
+// Modulus length and public exponent.
+const size_t kRsaParamsSize = 2 + 8;
+const size_t kPublicExponentSize = 8;
+const size_t kMaxModulusSize = 0xFFFF;
+// Curve.
+const size_t kEcParamsSize = 1;
+
+size_t RsaKeyMaterialSize(size_t modulus_size) {
+    return kHeaderSize + kRsaParamsSize + 2 * modulus_size + 5 * ((modulus_size + 1) / 2);
+}
+
+size_t EcKeyMaterialSize(size_t field_size) {
+    // The scalar, then the point's format byte and two coordinates.
+    return kHeaderSize + kEcParamsSize + field_size + 1 + 2 * field_size;
+}
+
+// Writes bn into the size bytes at *out, big-endian and zero-padded, and advances *out past them.
+// Returns false if bn doesn't fit.
+bool WritePadded(const BIGNUM* bn, size_t size, uint8_t** out) {
+    size_t bn_size = BN_num_bytes(bn);
+    if (bn_size > size)
+        return false;
+    memset(*out, 0, size - bn_size);
+    BN_bn2bin(bn, *out + size - bn_size);
+    *out += size;
+    return true;
+}
+
+BIGNUM* ReadPadded(size_t size, const uint8_t** in) {
+    BIGNUM* bn = BN_bin2bn(*in, size, nullptr /* ret */);
+    *in += size;
+    return bn;
+}
+
+keymaster_error_t EncodeRsaKey(RSA* rsa, KeymasterKeyBlob* key_material) {
+    if (!rsa->p || !rsa->q || !rsa->dmp1 || !rsa->dmq1 || !rsa->iqmp)
+        return KM_ERROR_UNSUPPORTED_KEY_FORMAT;
+    if (RSA_check_key(rsa) != 1) {
+        ERR_clear_error();
+        LOG_W("Imported RSA key is inconsistent; storing it as imported", 0);
+        return KM_ERROR_UNSUPPORTED_KEY_FORMAT;
+    }
+    if (rsa_prime_count(rsa) != 2)
+        return KM_ERROR_UNSUPPORTED_KEY_FORMAT;
+
+    size_t modulus_size = BN_num_bytes(rsa->n);
+    size_t prime_size = (modulus_size + 1) / 2;
+    if (modulus_size > kMaxModulusSize)
+        return KM_ERROR_UNSUPPORTED_KEY_FORMAT;
+    if (!key_material->Reset(RsaKeyMaterialSize(modulus_size)))
+        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+
+    uint8_t* out = key_material->writable_data();
+    *out++ = kCompactRsaKey;
+    *out++ = kCompactKeyVersion;
+    *out++ = static_cast<uint8_t>(modulus_size >> 8);
+    *out++ = static_cast<uint8_t>(modulus_size);
+    if (!WritePadded(rsa->e, kPublicExponentSize, &out) ||
+        !WritePadded(rsa->n, modulus_size, &out) || !WritePadded(rsa->d, modulus_size, &out) ||
+        !WritePadded(rsa->p, prime_size, &out) || !WritePadded(rsa->q, prime_size, &out) ||
+        !WritePadded(rsa->dmp1, prime_size, &out) || !WritePadded(rsa->dmq1, prime_size, &out) ||
+        !WritePadded(rsa->iqmp, prime_size, &out))
+        return KM_ERROR_UNSUPPORTED_KEY_FORMAT;
+    return KM_ERROR_OK;
+}
+
+keymaster_error_t EncodeEcKey(EC_KEY* ec_key, KeymasterKeyBlob* key_material) {
+    if (EC_KEY_check_key(ec_key) != 1) {
+        ERR_clear_error();
+        LOG_W("Imported EC key is inconsistent; storing it as imported", 0);
+        return KM_ERROR_UNSUPPORTED_KEY_FORMAT;
+    }
+
+    const EC_GROUP* group = EC_KEY_get0_group(ec_key);
+    size_t key_size_bits;
+    keymaster_ec_curve_t curve;
+    if (ec_get_group_size(group, &key_size_bits) != KM_ERROR_OK ||
+        EcKeySizeToCurve(key_size_bits, &curve) != KM_ERROR_OK)
+        return KM_ERROR_UNSUPPORTED_KEY_FORMAT;
+
+    size_t field_size = (key_size_bits + 7) / 8;
+    size_t point_size = 1 + 2 * field_size;
+    if (!key_material->Reset(EcKeyMaterialSize(field_size)))
+        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+
+    uint8_t* out = key_material->writable_data();
+    *out++ = kCompactEcKey;
+    *out++ = kCompactKeyVersion;
+    *out++ = static_cast<uint8_t>(curve);
+    if (!WritePadded(EC_KEY_get0_private_key(ec_key), field_size, &out))
+        return KM_ERROR_UNSUPPORTED_KEY_FORMAT;
+    if (EC_POINT_point2oct(group, EC_KEY_get0_public_key(ec_key), POINT_CONVERSION_UNCOMPRESSED,
+                           out, point_size, nullptr /* ctx */) != point_size)
+        return TranslateLastOpenSslError();
+    return KM_ERROR_OK;
+}
+
+keymaster_error_t DecodeRsaKey(const KeymasterKeyBlob& key_material, EVP_PKEY* pkey) {
+    const uint8_t* in = key_material.key_material;
+    if (key_material.key_material_size < kHeaderSize + kRsaParamsSize)
+        return KM_ERROR_INVALID_KEY_BLOB;
+    size_t modulus_size = (static_cast<size_t>(in[2]) << 8) | in[3];
+    size_t prime_size = (modulus_size + 1) / 2;
+    if (key_material.key_material_size != RsaKeyMaterialSize(modulus_size))
+        return KM_ERROR_INVALID_KEY_BLOB;
+    in += kHeaderSize + 2;
+
+    UniquePtr<RSA, RSA_Delete> rsa(RSA_new());
+    if (!rsa.get())
+        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    rsa->e = ReadPadded(kPublicExponentSize, &in);
+    rsa->n = ReadPadded(modulus_size, &in);
+    rsa->d = ReadPadded(modulus_size, &in);
+    rsa->p = ReadPadded(prime_size, &in);
+    rsa->q = ReadPadded(prime_size, &in);
+    rsa->dmp1 = ReadPadded(prime_size, &in);
+    rsa->dmq1 = ReadPadded(prime_size, &in);
+    rsa->iqmp = ReadPadded(prime_size, &in);
+    if (!rsa->e || !rsa->n || !rsa->d || !rsa->p || !rsa->q || !rsa->dmp1 || !rsa->dmq1 ||
+        !rsa->iqmp)
+        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+
+    if (EVP_PKEY_set1_RSA(pkey, rsa.get()) != 1)
+        return TranslateLastOpenSslError();
+    return KM_ERROR_OK;
+}
+
+keymaster_error_t DecodeEcKey(const KeymasterKeyBlob& key_material, EVP_PKEY* pkey) {
+    const uint8_t* in = key_material.key_material;
+    if (key_material.key_material_size < kHeaderSize + kEcParamsSize)
+        return KM_ERROR_INVALID_KEY_BLOB;
+    const EC_GROUP* group =
+        ec_get_precomputed_group(static_cast<keymaster_ec_curve_t>(in[kHeaderSize]));
+    size_t key_size_bits;
+    if (!group || ec_get_group_size(group, &key_size_bits) != KM_ERROR_OK)
+        return KM_ERROR_INVALID_KEY_BLOB;
+    size_t field_size = (key_size_bits + 7) / 8;
+    if (key_material.key_material_size != EcKeyMaterialSize(field_size))
+        return KM_ERROR_INVALID_KEY_BLOB;
+    in += kHeaderSize + kEcParamsSize;
+
+    UniquePtr<EC_KEY, EC_KEY_Delete> ec_key(EC_KEY_new());
+    UniquePtr<EC_POINT, EC_POINT_Delete> public_point(EC_POINT_new(group));
+    BIGNUM_Ptr private_key(ReadPadded(field_size, &in));
+    if (!ec_key.get() || !public_point.get() || !private_key.get())
+        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    // Copying the precomputed group carries its generator tables over to the key for signing.
+    if (EC_KEY_set_group(ec_key.get(), group) != 1 ||
+        EC_KEY_set_private_key(ec_key.get(), private_key.get()) != 1 ||
+        EC_POINT_oct2point(group, public_point.get(), in, 1 + 2 * field_size, nullptr /* ctx */) !=
+            1 ||
+        EC_KEY_set_public_key(ec_key.get(), public_point.get()) != 1)
+        return TranslateLastOpenSslError();
+
+    if (EVP_PKEY_set1_EC_KEY(pkey, ec_key.get()) != 1)
+        return TranslateLastOpenSslError();
+    return KM_ERROR_OK;
+}
+
+}  // anonymous namespace
+
+keymaster_error_t EncodeCompactPrivateKey(const EVP_PKEY* pkey, KeymasterKeyBlob* key_material) {
+    EVP_PKEY* mutable_pkey = const_cast<EVP_PKEY*>(pkey);
+    switch (EVP_PKEY_type(pkey->type)) {
+    case EVP_PKEY_RSA: {
+        UniquePtr<RSA, RSA_Delete> rsa(EVP_PKEY_get1_RSA(mutable_pkey));
+        if (!rsa.get())
+            return TranslateLastOpenSslError();
+        return EncodeRsaKey(rsa.get(), key_material);
+    }
+    case EVP_PKEY_EC: {
+        UniquePtr<EC_KEY, EC_KEY_Delete> ec_key(EVP_PKEY_get1_EC_KEY(mutable_pkey));
+        if (!ec_key.get())
+            return TranslateLastOpenSslError();
+        return EncodeEcKey(ec_key.get(), key_material);
+    }
+    default:
+        return KM_ERROR_UNSUPPORTED_KEY_FORMAT;
+    }
+}
+
+keymaster_error_t DecodeCompactPrivateKey(const KeymasterKeyBlob& key_material, int evp_key_type,
+                                          UniquePtr<EVP_PKEY, EVP_PKEY_Delete>* pkey) {
+    if (!IsCompactPrivateKey(key_material))
+        return KM_ERROR_INVALID_KEY_BLOB;
+
+    pkey->reset(EVP_PKEY_new());
+    if (!pkey->get())
+        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+
+    uint8_t format = key_material.key_material[0];
+    if (format == kCompactRsaKey && evp_key_type == EVP_PKEY_RSA)
+        return DecodeRsaKey(key_material, pkey->get());
+    if (format == kCompactEcKey && evp_key_type == EVP_PKEY_EC)
+        return DecodeEcKey(key_material, pkey->get());
+    return KM_ERROR_INVALID_KEY_BLOB;
+}
+
+}  // namespace keymaster
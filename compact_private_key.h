@@ -0,0 +1,77 @@
+/*
+ * Copyright 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SYSTEM_KEYMASTER_COMPACT_PRIVATE_KEY_H_
+#define SYSTEM_KEYMASTER_COMPACT_PRIVATE_KEY_H_
+
+#include <openssl/evp.h>
+
+#include <hardware/keymaster_defs.h>
+#include <keymaster/android_keymaster_utils.h>
+
+#include "openssl_utils.h"
+
+namespace keymaster {
+
+/**
+ * The key material format imported RSA and EC keys are stored in, in place of the PKCS#8 they
+ * arrive in, so that loading them is a matter of copying fixed-size fields rather than parsing DER.
+ *
+ * RSA keys are stored as the modulus length L and the public exponent, followed by n and d in L
+ * bytes each and p, q, d mod (p-1), d mod (q-1) and q^-1 mod p in (L + 1) / 2 bytes each, all
+ * big-endian and zero-padded.  EC keys are stored as the curve, the private scalar and the
+ * uncompressed public point, so that loading needn't recompute the point from the scalar.  The
+ * first byte of either can't start a DER SEQUENCE, so key material in either form is unambiguous.
+ * Readers that predate the format can't load it, so key blobs holding it are marked with a blob
+ * format version they reject; see integrity_assured_key_blob.cpp.
+ */
+
+// The key material's first byte, which says which kind of key it holds, and its second, the format
+// version.  PKCS#8 starts with a DER SEQUENCE tag, 0x30.
+static const uint8_t kCompactRsaKey = 0xA1;
+static const uint8_t kCompactEcKey = 0xA2;
+static const uint8_t kCompactKeyVersion = 1;
+
+/**
+ * Checks that pkey is a consistent RSA or EC private key and encodes it into *key_material.
+ * Returns KM_ERROR_UNSUPPORTED_KEY_FORMAT for keys the format can't hold (multi-prime or
+ * unbalanced RSA keys, and EC keys on curves keymaster doesn't support) and for keys that fail the
+ * check, which the decoder doesn't repeat; these should be stored as PKCS#8 instead, as they were
+ * imported.
+ */
+keymaster_error_t EncodeCompactPrivateKey(const EVP_PKEY* pkey, KeymasterKeyBlob* key_material);
+
+/**
+ * Returns true if key_material is in the compact format rather than PKCS#8.
+ */
+inline bool IsCompactPrivateKey(const KeymasterKeyBlob& key_material) {
+    if (key_material.key_material_size < 2 /* kind and version */)
+        return false;
+    uint8_t format = key_material.key_material[0];
+    return (format == kCompactRsaKey || format == kCompactEcKey) &&
+           key_material.key_material[1] == kCompactKeyVersion;
+}
+
+/**
+ * Decodes key material written by EncodeCompactPrivateKey, which must be of evp_key_type.  The
+ * key was checked when it was encoded, so isn't checked again.
+ */
+keymaster_error_t DecodeCompactPrivateKey(const KeymasterKeyBlob& key_material, int evp_key_type,
+                                          UniquePtr<EVP_PKEY, EVP_PKEY_Delete>* pkey);
+
+}  // namespace keymaster
+
+#endif  // SYSTEM_KEYMASTER_COMPACT_PRIVATE_KEY_H_
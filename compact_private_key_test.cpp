@@ -0,0 +1,174 @@
+/*
+ * Copyright 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "compact_private_key.h"
+
+#include <gtest/gtest.h>
+#include <openssl/bn.h>
+#include <openssl/ec.h>
+#include <openssl/rsa.h>
+
+#include <keymaster/android_keymaster_utils.h>
+
+#include "android_keymaster_test_utils.h"
+#include "openssl_utils.h"
+
+namespace keymaster {
+namespace test {
+
+StdoutLogger logger;
+
+static const keymaster_ec_curve_t kEcCurves[] = {KM_EC_CURVE_P_224, KM_EC_CURVE_P_256,
+                                                 KM_EC_CURVE_P_384, KM_EC_CURVE_P_521};
+
+static EVP_PKEY* GenerateRsaKey(uint32_t key_size) {
+    UniquePtr<RSA, RSA_Delete> rsa(RSA_new());
+    UniquePtr<BIGNUM, BIGNUM_Delete> exponent(BN_new());
+    UniquePtr<EVP_PKEY, EVP_PKEY_Delete> pkey(EVP_PKEY_new());
+    if (!rsa.get() || !exponent.get() || !pkey.get() || !BN_set_word(exponent.get(), 65537) ||
+        !RSA_generate_key_ex(rsa.get(), key_size, exponent.get(), nullptr /* callback */) ||
+        !EVP_PKEY_set1_RSA(pkey.get(), rsa.get()))
+        return nullptr;
+    return pkey.release();
+}
+
+static EVP_PKEY* GenerateEcKey(keymaster_ec_curve_t curve) {
+    UniquePtr<EC_GROUP, EC_GROUP_Delete> group(ec_get_group(curve));
+    UniquePtr<EC_KEY, EC_KEY_Delete> ec_key(EC_KEY_new());
+    UniquePtr<EVP_PKEY, EVP_PKEY_Delete> pkey(EVP_PKEY_new());
+    if (!group.get() || !ec_key.get() || !pkey.get() ||
+        !EC_KEY_set_group(ec_key.get(), group.get()) || !EC_KEY_generate_key(ec_key.get()) ||
+        !EVP_PKEY_set1_EC_KEY(pkey.get(), ec_key.get()))
+        return nullptr;
+    return pkey.release();
+}
+
+static KeymasterKeyBlob Pkcs8(EVP_PKEY* pkey) {
+    KeymasterKeyBlob key_material;
+    EXPECT_EQ(KM_ERROR_OK, EvpKeyToKeyMaterial(pkey, &key_material));
+    return key_material;
+}
+
+TEST(CompactPrivateKeyTest, RsaRoundTrip) {
+    UniquePtr<EVP_PKEY, EVP_PKEY_Delete> pkey(GenerateRsaKey(2048));
+    ASSERT_TRUE(pkey.get() != nullptr);
+
+    KeymasterKeyBlob key_material;
+    ASSERT_EQ(KM_ERROR_OK, EncodeCompactPrivateKey(pkey.get(), &key_material));
+    EXPECT_TRUE(IsCompactPrivateKey(key_material));
+
+    UniquePtr<EVP_PKEY, EVP_PKEY_Delete> decoded;
+    ASSERT_EQ(KM_ERROR_OK, DecodeCompactPrivateKey(key_material, EVP_PKEY_RSA, &decoded));
+    UniquePtr<RSA, RSA_Delete> rsa(EVP_PKEY_get1_RSA(pkey.get()));
+    UniquePtr<RSA, RSA_Delete> decoded_rsa(EVP_PKEY_get1_RSA(decoded.get()));
+    ASSERT_TRUE(decoded_rsa.get() != nullptr);
+    EXPECT_EQ(0, BN_cmp(rsa->n, decoded_rsa->n));
+    EXPECT_EQ(0, BN_cmp(rsa->e, decoded_rsa->e));
+    EXPECT_EQ(0, BN_cmp(rsa->d, decoded_rsa->d));
+    EXPECT_EQ(0, BN_cmp(rsa->p, decoded_rsa->p));
+    EXPECT_EQ(0, BN_cmp(rsa->q, decoded_rsa->q));
+    EXPECT_EQ(0, BN_cmp(rsa->dmp1, decoded_rsa->dmp1));
+    EXPECT_EQ(0, BN_cmp(rsa->dmq1, decoded_rsa->dmq1));
+    EXPECT_EQ(0, BN_cmp(rsa->iqmp, decoded_rsa->iqmp));
+
+    // The decoded key re-encodes to the same PKCS#8 as the original.
+    KeymasterKeyBlob pkcs8 = Pkcs8(pkey.get());
+    KeymasterKeyBlob decoded_pkcs8 = Pkcs8(decoded.get());
+    ASSERT_EQ(pkcs8.key_material_size, decoded_pkcs8.key_material_size);
+    EXPECT_EQ(0, memcmp(pkcs8.key_material, decoded_pkcs8.key_material,
+                        pkcs8.key_material_size));
+}
+
+TEST(CompactPrivateKeyTest, EcRoundTrip) {
+    for (auto curve : kEcCurves) {
+        UniquePtr<EVP_PKEY, EVP_PKEY_Delete> pkey(GenerateEcKey(curve));
+        ASSERT_TRUE(pkey.get() != nullptr);
+
+        KeymasterKeyBlob key_material;
+        ASSERT_EQ(KM_ERROR_OK, EncodeCompactPrivateKey(pkey.get(), &key_material));
+        EXPECT_TRUE(IsCompactPrivateKey(key_material));
+
+        UniquePtr<EVP_PKEY, EVP_PKEY_Delete> decoded;
+        ASSERT_EQ(KM_ERROR_OK, DecodeCompactPrivateKey(key_material, EVP_PKEY_EC, &decoded));
+        UniquePtr<EC_KEY, EC_KEY_Delete> ec_key(EVP_PKEY_get1_EC_KEY(pkey.get()));
+        UniquePtr<EC_KEY, EC_KEY_Delete> decoded_ec_key(EVP_PKEY_get1_EC_KEY(decoded.get()));
+        ASSERT_TRUE(decoded_ec_key.get() != nullptr);
+        const EC_GROUP* group = EC_KEY_get0_group(decoded_ec_key.get());
+        EXPECT_EQ(EC_GROUP_get_curve_name(EC_KEY_get0_group(ec_key.get())),
+                  EC_GROUP_get_curve_name(group));
+        EXPECT_EQ(0, BN_cmp(EC_KEY_get0_private_key(ec_key.get()),
+                            EC_KEY_get0_private_key(decoded_ec_key.get())));
+        EXPECT_EQ(0, EC_POINT_cmp(group, EC_KEY_get0_public_key(ec_key.get()),
+                                  EC_KEY_get0_public_key(decoded_ec_key.get()), nullptr /* ctx */));
+        EXPECT_EQ(1, EC_KEY_check_key(decoded_ec_key.get()));
+    }
+}
+
+TEST(CompactPrivateKeyTest, Pkcs8IsNotCompact) {
+    UniquePtr<EVP_PKEY, EVP_PKEY_Delete> rsa_pkey(GenerateRsaKey(1024));
+    UniquePtr<EVP_PKEY, EVP_PKEY_Delete> ec_pkey(GenerateEcKey(KM_EC_CURVE_P_256));
+    ASSERT_TRUE(rsa_pkey.get() != nullptr);
+    ASSERT_TRUE(ec_pkey.get() != nullptr);
+
+    EXPECT_FALSE(IsCompactPrivateKey(Pkcs8(rsa_pkey.get())));
+    EXPECT_FALSE(IsCompactPrivateKey(Pkcs8(ec_pkey.get())));
+    EXPECT_FALSE(IsCompactPrivateKey(KeymasterKeyBlob()));
+}
+
+TEST(CompactPrivateKeyTest, MalformedMaterial) {
+    UniquePtr<EVP_PKEY, EVP_PKEY_Delete> rsa_pkey(GenerateRsaKey(1024));
+    UniquePtr<EVP_PKEY, EVP_PKEY_Delete> ec_pkey(GenerateEcKey(KM_EC_CURVE_P_256));
+    ASSERT_TRUE(rsa_pkey.get() != nullptr);
+    ASSERT_TRUE(ec_pkey.get() != nullptr);
+    KeymasterKeyBlob rsa_material, ec_material;
+    ASSERT_EQ(KM_ERROR_OK, EncodeCompactPrivateKey(rsa_pkey.get(), &rsa_material));
+    ASSERT_EQ(KM_ERROR_OK, EncodeCompactPrivateKey(ec_pkey.get(), &ec_material));
+
+    UniquePtr<EVP_PKEY, EVP_PKEY_Delete> decoded;
+    EXPECT_EQ(KM_ERROR_INVALID_KEY_BLOB,
+              DecodeCompactPrivateKey(rsa_material, EVP_PKEY_EC, &decoded));
+    EXPECT_EQ(KM_ERROR_INVALID_KEY_BLOB,
+              DecodeCompactPrivateKey(ec_material, EVP_PKEY_RSA, &decoded));
+
+    KeymasterKeyBlob truncated(rsa_material.key_material, rsa_material.key_material_size - 1);
+    EXPECT_EQ(KM_ERROR_INVALID_KEY_BLOB,
+              DecodeCompactPrivateKey(truncated, EVP_PKEY_RSA, &decoded));
+    truncated = KeymasterKeyBlob(ec_material.key_material, ec_material.key_material_size - 1);
+    EXPECT_EQ(KM_ERROR_INVALID_KEY_BLOB, DecodeCompactPrivateKey(truncated, EVP_PKEY_EC, &decoded));
+
+    // An unknown curve.
+    ec_material.writable_data()[2] = 0xFF;
+    EXPECT_EQ(KM_ERROR_INVALID_KEY_BLOB,
+              DecodeCompactPrivateKey(ec_material, EVP_PKEY_EC, &decoded));
+}
+
+TEST(CompactPrivateKeyTest, InconsistentKeysNotEncoded) {
+    UniquePtr<EVP_PKEY, EVP_PKEY_Delete> pkey(GenerateRsaKey(1024));
+    ASSERT_TRUE(pkey.get() != nullptr);
+    UniquePtr<RSA, RSA_Delete> rsa(EVP_PKEY_get1_RSA(pkey.get()));
+    ASSERT_TRUE(BN_add_word(rsa->d, 2));
+    UniquePtr<EVP_PKEY, EVP_PKEY_Delete> bad_pkey(EVP_PKEY_new());
+    ASSERT_TRUE(EVP_PKEY_set1_RSA(bad_pkey.get(), rsa.get()));
+
+    // Such keys are stored as imported, so that importing them behaves as it did before the
+    // compact format.
+    KeymasterKeyBlob key_material;
+    EXPECT_EQ(KM_ERROR_UNSUPPORTED_KEY_FORMAT,
+              EncodeCompactPrivateKey(bad_pkey.get(), &key_material));
+}
+
+}  // namespace test
+}  // namespace keymaster
@@ -0,0 +1,68 @@
+/*
+ * Copyright 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "digest_context_cache.h"
+
+#include <openssl/err.h>
+
+namespace keymaster {
+
+const DigestContextCache::Template* DigestContextCache::Find(keymaster_purpose_t purpose,
+                                                             keymaster_digest_t digest,
+                                                             keymaster_padding_t padding) const {
+    for (auto& entry : templates_)
+        if (entry.purpose == purpose && entry.digest == digest && entry.padding == padding)
+            return &entry;
+    return nullptr;
+}
+
+bool DigestContextCache::CopyTo(keymaster_purpose_t purpose, keymaster_digest_t digest,
+                                keymaster_padding_t padding, EVP_MD_CTX* ctx) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    const Template* entry = Find(purpose, digest, padding);
+    if (!entry)
+        return false;
+    if (EVP_MD_CTX_copy_ex(ctx, entry->ctx.get()) != 1) {
+        ERR_clear_error();
+        return false;
+    }
+    return true;
+}
+
+void DigestContextCache::Store(keymaster_purpose_t purpose, keymaster_digest_t digest,
+                               keymaster_padding_t padding, const EVP_MD_CTX* ctx) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (Find(purpose, digest, padding))
+        return;
+    Template entry;
+    entry.purpose = purpose;
+    entry.digest = digest;
+    entry.padding = padding;
+    entry.ctx.reset(EVP_MD_CTX_create());
+    if (!entry.ctx || EVP_MD_CTX_copy_ex(entry.ctx.get(), ctx) != 1) {
+        // Operations just keep initializing their own contexts.
+        ERR_clear_error();
+        return;
+    }
+    templates_.push_back(std::move(entry));
+}
+
+size_t DigestContextCache::template_count() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return templates_.size();
+}
+
+}  // namespace keymaster
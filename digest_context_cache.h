@@ -0,0 +1,76 @@
+/*
+ * Copyright 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SYSTEM_KEYMASTER_DIGEST_CONTEXT_CACHE_H_
+#define SYSTEM_KEYMASTER_DIGEST_CONTEXT_CACHE_H_
+
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include <openssl/evp.h>
+
+#include <hardware/keymaster_defs.h>
+
+namespace keymaster {
+
+/**
+ * DigestContextCache keeps, for one asymmetric key, an EVP_MD_CTX template per signing or
+ * verification purpose, digest and padding, set up by EVP_DigestSignInit or EVP_DigestVerifyInit
+ * and configured with the padding, so that each digesting operation's Begin copies a template
+ * with EVP_MD_CTX_copy_ex rather than building the digest and EVP_PKEY_CTX state again.  It's
+ * shared by the key and the operations created from it.  All methods are internally locked.
+ */
+class DigestContextCache {
+  public:
+    /**
+     * Copies the template for the configuration into ctx and returns true, or returns false,
+     * leaving ctx as it was, if there's none yet or it can't be copied.
+     */
+    bool CopyTo(keymaster_purpose_t purpose, keymaster_digest_t digest,
+                keymaster_padding_t padding, EVP_MD_CTX* ctx) const;
+
+    /**
+     * Keeps a copy of ctx, which must have been initialized for purpose, digest and padding and
+     * not yet updated, as the template for them, unless there is one already.
+     */
+    void Store(keymaster_purpose_t purpose, keymaster_digest_t digest, keymaster_padding_t padding,
+               const EVP_MD_CTX* ctx);
+
+    size_t template_count() const;
+
+  private:
+    struct EVP_MD_CTX_Delete {
+        void operator()(EVP_MD_CTX* p) { EVP_MD_CTX_destroy(p); }
+    };
+
+    struct Template {
+        keymaster_purpose_t purpose;
+        keymaster_digest_t digest;
+        keymaster_padding_t padding;
+        std::unique_ptr<EVP_MD_CTX, EVP_MD_CTX_Delete> ctx;
+    };
+
+    const Template* Find(keymaster_purpose_t purpose, keymaster_digest_t digest,
+                         keymaster_padding_t padding) const;
+
+    mutable std::mutex mutex_;
+    std::vector<Template> templates_;
+};
+
+}  // namespace keymaster
+
+#endif  // SYSTEM_KEYMASTER_DIGEST_CONTEXT_CACHE_H_
@@ -16,6 +16,17 @@
 
 #include "ec_key.h"
 
+#include <new>
+
+#include <openssl/err.h>
+#include <openssl/x509.h>
+
+#include <keymaster/android_keymaster_utils.h>
+
+#include "ecdsa_operation.h"
+#include "openssl_err.h"
+#include "precomputed_pair_queue.h"
+
 #if defined(OPENSSL_IS_BORINGSSL)
 typedef size_t openssl_size_t;
 #else
@@ -33,4 +44,121 @@ bool EcKey::InternalToEvp(EVP_PKEY* pkey) const {
     return EVP_PKEY_set1_EC_KEY(pkey, ec_key_.get()) == 1;
 }
 
+EC_KEY* EcKey::verification_key() const {
+    std::call_once(verification_key_once_, [this] {
+        if (!ec_key_.get())
+            return;
+        size_t key_size_bits;
+        keymaster_ec_curve_t curve;
+        if (ec_get_group_size(EC_KEY_get0_group(ec_key_.get()), &key_size_bits) != KM_ERROR_OK ||
+            EcKeySizeToCurve(key_size_bits, &curve) != KM_ERROR_OK)
+            return;
+
+        const EC_GROUP* group = ec_get_precomputed_group(curve);
+        if (!group)
+            return;
+        UniquePtr<EC_KEY, EC_KEY_Delete> key(EC_KEY_new());
+        UniquePtr<EC_POINT, EC_POINT_Delete> public_point(
+            EC_POINT_dup(EC_KEY_get0_public_key(ec_key_.get()), group));
+        if (!key.get() || !public_point.get() || !EC_KEY_set_group(key.get(), group) ||
+            !EC_POINT_make_affine(group, public_point.get(), nullptr /* ctx */) ||
+            !EC_KEY_set_public_key(key.get(), public_point.get())) {
+            // Verification falls back to the key itself.
+            ERR_clear_error();
+            return;
+        }
+        verification_key_.reset(key.release());
+    });
+    return verification_key_.get();
+}
+
+keymaster_error_t EcKey::Warmup() const {
+    keymaster_error_t error = AsymmetricKey::Warmup();
+    if (error == KM_ERROR_OK)
+        // Verification falls back to the key itself if the copy can't be built.
+        verification_key();
+    return error;
+}
+
+keymaster_error_t EcKey::formatted_key_material(keymaster_key_format_t format,
+                                                UniquePtr<uint8_t[]>* material,
+                                                size_t* size) const {
+    if (format != KM_KEY_FORMAT_X509_COMPRESSED)
+        return AsymmetricKey::formatted_key_material(format, material, size);
+
+    if (material == NULL || size == NULL)
+        return KM_ERROR_OUTPUT_PARAMETER_NULL;
+
+    std::lock_guard<std::mutex> lock(compressed_public_key_mutex_);
+    if (!compressed_public_key_der_.get()) {
+        if (!ec_key_.get())
+            return KM_ERROR_UNKNOWN_ERROR;
+
+        // Encode a public-only copy, so that the conversion form of the key itself is untouched.
+        UniquePtr<EC_KEY, EC_KEY_Delete> public_key(EC_KEY_new());
+        if (!public_key.get())
+            return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+        if (!EC_KEY_set_group(public_key.get(), EC_KEY_get0_group(ec_key_.get())) ||
+            !EC_KEY_set_public_key(public_key.get(), EC_KEY_get0_public_key(ec_key_.get())))
+            return TranslateLastOpenSslError();
+        EC_KEY_set_conv_form(public_key.get(), POINT_CONVERSION_COMPRESSED);
+
+        int key_data_length = i2d_EC_PUBKEY(public_key.get(), NULL);
+        if (key_data_length <= 0)
+            return TranslateLastOpenSslError();
+
+        UniquePtr<uint8_t[]> der(new (std::nothrow) uint8_t[key_data_length]);
+        if (der.get() == NULL)
+            return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+
+        uint8_t* tmp = der.get();
+        if (i2d_EC_PUBKEY(public_key.get(), &tmp) != key_data_length)
+            return TranslateLastOpenSslError();
+
+        compressed_public_key_der_.reset(der.release());
+        compressed_public_key_der_length_ = key_data_length;
+    }
+
+    material->reset(new (std::nothrow) uint8_t[compressed_public_key_der_length_]);
+    if (material->get() == NULL)
+        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    memcpy(material->get(), compressed_public_key_der_.get(), compressed_public_key_der_length_);
+    *size = compressed_public_key_der_length_;
+    return KM_ERROR_OK;
+}
+
+// The private scalar and the public point in projective coordinates, and the verification key's
+// copy of the point in affine ones.
+static const size_t kEcKeyFieldElements = 6;
+
+size_t EcKey::material_bytes() const {
+    size_t bytes = AsymmetricKey::material_bytes();
+    {
+        std::lock_guard<std::mutex> lock(compressed_public_key_mutex_);
+        bytes += compressed_public_key_der_length_;
+    }
+    size_t key_size_bits;
+    if (!ec_key_.get() ||
+        ec_get_group_size(EC_KEY_get0_group(ec_key_.get()), &key_size_bits) != KM_ERROR_OK)
+        return bytes;
+    size_t field_size = (key_size_bits + 7) / 8;
+    bytes += kEcKeyFieldElements * field_size;
+    // Each setup is k^-1 and r mod the group order, which is about the field's size.
+    if (sign_setup_queue_)
+        bytes += sign_setup_queue_->capacity() * 2 * field_size;
+    return bytes;
+}
+
+keymaster_error_t EcKey::EnableSignSetupQueue(size_t capacity,
+                                              const std::shared_ptr<PrecomputationFiller>& filler) {
+    if (!ec_key_.get() || !filler)
+        return KM_ERROR_UNKNOWN_ERROR;
+    sign_setup_queue_.reset(new (std::nothrow) PrecomputedPairQueue(
+        EcdsaSignSetupGenerator(ec_key_.get()), capacity, filler));
+    if (!sign_setup_queue_)
+        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    filler->Schedule(sign_setup_queue_);
+    return KM_ERROR_OK;
+}
+
 }  // namespace keymaster
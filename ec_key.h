@@ -17,6 +17,9 @@
 #ifndef SYSTEM_KEYMASTER_EC_KEY_H_
 #define SYSTEM_KEYMASTER_EC_KEY_H_
 
+#include <memory>
+#include <mutex>
+
 #include <openssl/ec.h>
 
 #include "asymmetric_key.h"
@@ -25,25 +28,69 @@
 namespace keymaster {
 
 class EcdsaOperationFactory;
+class PrecomputationFiller;
+class PrecomputedPairQueue;
 
 class EcKey : public AsymmetricKey {
   public:
     EcKey(const AuthorizationSet& hw_enforced, const AuthorizationSet& sw_enforced,
           keymaster_error_t* error)
-        : AsymmetricKey(hw_enforced, sw_enforced, error) {}
+        : AsymmetricKey(hw_enforced, sw_enforced, error), compressed_public_key_der_length_(0) {}
+
+    // Also exports KM_KEY_FORMAT_X509_COMPRESSED.
+    keymaster_error_t formatted_key_material(keymaster_key_format_t format,
+                                             UniquePtr<uint8_t[]>* material,
+                                             size_t* size) const override;
 
     bool InternalToEvp(EVP_PKEY* pkey) const override;
     bool EvpToInternal(const EVP_PKEY* pkey) override;
 
     EC_KEY* key() const { return ec_key_.get(); }
 
+    /**
+     * Gives the key a queue of up to capacity precomputed ECDSA signing setups, filled by filler.
+     * Must be called after the key material is loaded.
+     */
+    keymaster_error_t EnableSignSetupQueue(size_t capacity,
+                                           const std::shared_ptr<PrecomputationFiller>& filler);
+
+    /**
+     * Returns a public-only copy of the key for ECDSA verification, built on first use.  It is set
+     * on the curve's shared group, whose generator multiples are precomputed (see
+     * ec_get_precomputed_group), and its public point is stored in affine form, so each verify
+     * skips that setup.  Returns null if the copy can't be built.  The key retains ownership; take
+     * a reference with EC_KEY_up_ref to use the copy beyond the key's lifetime.
+     */
+    EC_KEY* verification_key() const;
+
+    // Also builds the verification key.
+    keymaster_error_t Warmup() const override;
+
+    // Null unless EnableSignSetupQueue has been called.
+    const std::shared_ptr<PrecomputedPairQueue>& sign_setup_queue() const {
+        return sign_setup_queue_;
+    }
+
   protected:
     EcKey(EC_KEY* ec_key, const AuthorizationSet& hw_enforced, const AuthorizationSet& sw_enforced,
           keymaster_error_t* error)
-        : AsymmetricKey(hw_enforced, sw_enforced, error), ec_key_(ec_key) {}
+        : AsymmetricKey(hw_enforced, sw_enforced, error), ec_key_(ec_key),
+          compressed_public_key_der_length_(0) {}
+
+    size_t object_size() const override { return sizeof(*this); }
+    // The EC_KEYs and a full signing setup queue, estimated from the field size.
+    size_t material_bytes() const override;
 
   private:
     UniquePtr<EC_KEY, EC_KEY_Delete> ec_key_;
+    std::shared_ptr<PrecomputedPairQueue> sign_setup_queue_;
+    mutable std::once_flag verification_key_once_;
+    mutable UniquePtr<EC_KEY, EC_KEY_Delete> verification_key_;
+
+    // The KM_KEY_FORMAT_X509_COMPRESSED encoding, built on the first export of that format.
+    mutable std::mutex compressed_public_key_mutex_;
+    mutable UniquePtr<uint8_t[]> compressed_public_key_der_;
+    mutable size_t compressed_public_key_der_length_;
 };
 
 }  // namespace keymaster
@@ -16,19 +16,85 @@
 
 #include <keymaster/ec_key_factory.h>
 
+#include <new>
+
 #include <openssl/evp.h>
 
 #include <keymaster/keymaster_context.h>
+#include <keymaster/keymaster_tags.h>
 
+#include "compact_private_key.h"
 #include "ec_key.h"
 #include "ecdsa_operation.h"
 #include "openssl_err.h"
+#include "pregenerated_key_pool.h"
 
 namespace keymaster {
 
 static EcdsaSignOperationFactory sign_factory;
 static EcdsaVerifyOperationFactory verify_factory;
 
+EcKeyFactory::EcKeyFactory(const KeymasterContext* context)
+    : AsymmetricKeyFactory(context), sign_setup_queue_size_(0) {}
+
+EcKeyFactory::~EcKeyFactory() {}
+
+keymaster_error_t EcKeyFactory::EnableKeyPregeneration(const keymaster_ec_curve_t* curves,
+                                                       size_t curve_count, size_t pool_size,
+                                                       size_t low_water_mark) {
+    if (key_pool_.get())
+        return KM_ERROR_UNKNOWN_ERROR;
+
+    auto generator = [](uint32_t /* key_size */, uint64_t curve) {
+        keymaster_error_t error;
+        return GenerateEcKey(static_cast<keymaster_ec_curve_t>(curve), &error);
+    };
+    UniquePtr<PregeneratedKeyPool> key_pool(
+        new (std::nothrow) PregeneratedKeyPool(generator, pool_size, low_water_mark));
+    if (!key_pool.get())
+        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    for (size_t i = 0; i < curve_count; ++i) {
+        uint32_t key_size;
+        keymaster_error_t error = EcCurveToKeySize(curves[i], &key_size);
+        if (error != KM_ERROR_OK)
+            return error;
+        key_pool->AddKeySpec(key_size, curves[i]);
+    }
+    key_pool->Start();
+    key_pool_.reset(key_pool.release());
+    return KM_ERROR_OK;
+}
+
+keymaster_error_t EcKeyFactory::EnableSignSetupPrecomputation(size_t queue_size) {
+    if (sign_setup_filler_ || queue_size == 0)
+        return KM_ERROR_UNKNOWN_ERROR;
+    sign_setup_filler_.reset(new (std::nothrow) PrecomputationFiller);
+    if (!sign_setup_filler_)
+        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    sign_setup_queue_size_ = queue_size;
+    return KM_ERROR_OK;
+}
+
+keymaster_error_t EcKeyFactory::LoadKey(const KeymasterKeyBlob& key_material,
+                                        const AuthorizationSet& additional_params,
+                                        const AuthorizationSet& hw_enforced,
+                                        const AuthorizationSet& sw_enforced,
+                                        UniquePtr<Key>* key) const {
+    keymaster_error_t error = AsymmetricKeyFactory::LoadKey(key_material, additional_params,
+                                                            hw_enforced, sw_enforced, key);
+    if (error != KM_ERROR_OK)
+        return error;
+    EcKey* ec_key = static_cast<EcKey*>(key->get());
+    if (verification_cache_) {
+        error = ec_key->EnableVerificationCache(verification_cache_);
+        if (error != KM_ERROR_OK)
+            return error;
+    }
+    if (!sign_setup_filler_)
+        return KM_ERROR_OK;
+    return ec_key->EnableSignSetupQueue(sign_setup_queue_size_, sign_setup_filler_);
+}
+
 OperationFactory* EcKeyFactory::GetOperationFactory(keymaster_purpose_t purpose) const {
     switch (purpose) {
     case KM_PURPOSE_SIGN:
@@ -40,6 +106,13 @@ OperationFactory* EcKeyFactory::GetOperationFactory(keymaster_purpose_t purpose)
     }
 }
 
+static const keymaster_key_format_t supported_export_formats[] = {KM_KEY_FORMAT_X509,
+                                                                   KM_KEY_FORMAT_X509_COMPRESSED};
+const keymaster_key_format_t* EcKeyFactory::SupportedExportFormats(size_t* format_count) const {
+    *format_count = array_length(supported_export_formats);
+    return supported_export_formats;
+}
+
 /* static */
 keymaster_error_t EcKeyFactory::GetCurveAndSize(const AuthorizationSet& key_description,
                                                 keymaster_ec_curve_t* curve,
@@ -91,15 +164,38 @@ keymaster_error_t EcKeyFactory::GenerateKey(const AuthorizationSet& key_descript
         authorizations.push_back(TAG_EC_CURVE, ec_curve);
     }
 
+    UniquePtr<EVP_PKEY, EVP_PKEY_Delete> pkey;
+    if (key_pool_.get())
+        pkey.reset(key_pool_->Take(key_size, ec_curve));
+    if (!pkey.get()) {
+        pkey.reset(GenerateEcKey(ec_curve, &error));
+        if (!pkey.get())
+            return error;
+    }
+
+    KeymasterKeyBlob key_material;
+    error = EvpKeyToKeyMaterial(pkey.get(), &key_material);
+    if (error != KM_ERROR_OK)
+        return error;
+
+    return context_->CreateKeyBlob(authorizations, KM_ORIGIN_GENERATED, key_material, key_blob,
+                                   hw_enforced, sw_enforced);
+}
+
+/* static */
+EVP_PKEY* EcKeyFactory::GenerateEcKey(keymaster_ec_curve_t ec_curve, keymaster_error_t* error) {
     UniquePtr<EC_KEY, EC_KEY_Delete> ec_key(EC_KEY_new());
     UniquePtr<EVP_PKEY, EVP_PKEY_Delete> pkey(EVP_PKEY_new());
-    if (ec_key.get() == NULL || pkey.get() == NULL)
-        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    if (ec_key.get() == NULL || pkey.get() == NULL) {
+        *error = KM_ERROR_MEMORY_ALLOCATION_FAILED;
+        return nullptr;
+    }
 
     UniquePtr<EC_GROUP, EC_GROUP_Delete> group(ChooseGroup(ec_curve));
     if (group.get() == NULL) {
         LOG_E("Unable to get EC group for curve %d", ec_curve);
-        return KM_ERROR_UNSUPPORTED_KEY_SIZE;
+        *error = KM_ERROR_UNSUPPORTED_KEY_SIZE;
+        return nullptr;
     }
 
 #if !defined(OPENSSL_IS_BORINGSSL)
@@ -109,19 +205,17 @@ keymaster_error_t EcKeyFactory::GenerateKey(const AuthorizationSet& key_descript
 
     if (EC_KEY_set_group(ec_key.get(), group.get()) != 1 ||
         EC_KEY_generate_key(ec_key.get()) != 1 || EC_KEY_check_key(ec_key.get()) < 0) {
-        return TranslateLastOpenSslError();
+        *error = TranslateLastOpenSslError();
+        return nullptr;
     }
 
-    if (EVP_PKEY_set1_EC_KEY(pkey.get(), ec_key.get()) != 1)
-        return TranslateLastOpenSslError();
-
-    KeymasterKeyBlob key_material;
-    error = EvpKeyToKeyMaterial(pkey.get(), &key_material);
-    if (error != KM_ERROR_OK)
-        return error;
+    if (EVP_PKEY_set1_EC_KEY(pkey.get(), ec_key.get()) != 1) {
+        *error = TranslateLastOpenSslError();
+        return nullptr;
+    }
 
-    return context_->CreateKeyBlob(authorizations, KM_ORIGIN_GENERATED, key_material, key_blob,
-                                   hw_enforced, sw_enforced);
+    *error = KM_ERROR_OK;
+    return pkey.release();
 }
 
 keymaster_error_t EcKeyFactory::ImportKey(const AuthorizationSet& key_description,
@@ -135,20 +229,23 @@ keymaster_error_t EcKeyFactory::ImportKey(const AuthorizationSet& key_descriptio
 
     AuthorizationSet authorizations;
     uint32_t key_size;
-    keymaster_error_t error = UpdateImportKeyDescription(
-        key_description, input_key_material_format, input_key_material, &authorizations, &key_size);
+    KeymasterKeyBlob normalized_key_material;
+    keymaster_error_t error =
+        UpdateImportKeyDescription(key_description, input_key_material_format, input_key_material,
+                                   &authorizations, &key_size, &normalized_key_material);
     if (error != KM_ERROR_OK)
         return error;
 
-    return context_->CreateKeyBlob(authorizations, KM_ORIGIN_IMPORTED, input_key_material,
+    return context_->CreateKeyBlob(authorizations, KM_ORIGIN_IMPORTED,
+                                   normalized_key_material.key_material ? normalized_key_material
+                                                                        : input_key_material,
                                    output_key_blob, hw_enforced, sw_enforced);
 }
 
-keymaster_error_t EcKeyFactory::UpdateImportKeyDescription(const AuthorizationSet& key_description,
-                                                           keymaster_key_format_t key_format,
-                                                           const KeymasterKeyBlob& key_material,
-                                                           AuthorizationSet* updated_description,
-                                                           uint32_t* key_size_bits) const {
+keymaster_error_t EcKeyFactory::UpdateImportKeyDescription(
+    const AuthorizationSet& key_description, keymaster_key_format_t key_format,
+    const KeymasterKeyBlob& key_material, AuthorizationSet* updated_description,
+    uint32_t* key_size_bits, KeymasterKeyBlob* normalized_key_material) const {
     if (!updated_description || !key_size_bits)
         return KM_ERROR_OUTPUT_PARAMETER_NULL;
 
@@ -163,6 +260,8 @@ keymaster_error_t EcKeyFactory::UpdateImportKeyDescription(const AuthorizationSe
         return TranslateLastOpenSslError();
 
     updated_description->Reinitialize(key_description);
+    // Room for the two tags filled in below if the description omits them.
+    updated_description->Reserve(2, 0);
 
     size_t extracted_key_size_bits;
     error = ec_get_group_size(EC_KEY_get0_group(ec_key.get()), &extracted_key_size_bits);
@@ -181,6 +280,14 @@ keymaster_error_t EcKeyFactory::UpdateImportKeyDescription(const AuthorizationSe
     if (algorithm != KM_ALGORITHM_EC)
         return KM_ERROR_IMPORT_PARAMETER_MISMATCH;
 
+    if (normalized_key_material) {
+        error = EncodeCompactPrivateKey(pkey.get(), normalized_key_material);
+        if (error == KM_ERROR_UNSUPPORTED_KEY_FORMAT)
+            normalized_key_material->Clear();
+        else if (error != KM_ERROR_OK)
+            return error;
+    }
+
     return KM_ERROR_OK;
 }
 
@@ -42,6 +42,8 @@ static void UpdateToWorkAroundUnsupportedDigests(const AuthorizationSet& key_des
                                                  AuthorizationSet* new_description) {
     bool have_unsupported_digests = false;
     bool have_digest_none = false;
+    // Room for the description plus the entry that may be added below.
+    new_description->Reserve(key_description.size() + 1, key_description.indirect_size());
     for (const keymaster_key_param_t& entry : key_description) {
         new_description->push_back(entry);
 
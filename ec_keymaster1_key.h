@@ -72,6 +72,9 @@ class EcdsaKeymaster1Key : public EcKey {
     EcdsaKeymaster1Key(EC_KEY* ecdsa_key, const AuthorizationSet& hw_enforced,
                        const AuthorizationSet& sw_enforced, keymaster_error_t* error)
         : EcKey(ecdsa_key, hw_enforced, sw_enforced, error) {}
+
+    // Operations record their keymaster1 handle in the engine data attached to the key.
+    bool shareable() const override { return false; }
 };
 
 }  // namespace keymaster
@@ -65,8 +65,9 @@ EcdsaKeymaster1WrappedOperation::PrepareFinish(EVP_PKEY* ecdsa_key,
         LOG_E("Could not get extended key data... not a Keymaster1Engine key?", 0);
         return KM_ERROR_UNKNOWN_ERROR;
     }
-    key_data->op_handle = operation_handle_;
-    key_data->finish_params.Reinitialize(input_params);
+    finish_context_.op_handle = operation_handle_;
+    finish_context_.finish_params.Reinitialize(input_params);
+    finish_context_.error = KM_ERROR_OK;
 
     return KM_ERROR_OK;
 }
@@ -75,13 +76,6 @@ keymaster_error_t EcdsaKeymaster1WrappedOperation::Abort() {
     return engine_->device()->abort(engine_->device(), operation_handle_);
 }
 
-keymaster_error_t EcdsaKeymaster1WrappedOperation::GetError(EVP_PKEY* ecdsa_key) {
-    Keymaster1Engine::KeyData* key_data = engine_->GetData(ecdsa_key);
-    if (!key_data)
-        return KM_ERROR_UNKNOWN_ERROR;
-    return key_data->error;
-}
-
 static EVP_PKEY* GetEvpKey(const EcdsaKeymaster1Key& key, keymaster_error_t* error) {
     if (!key.key()) {
         *error = KM_ERROR_UNKNOWN_ERROR;
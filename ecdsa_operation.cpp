@@ -17,6 +17,7 @@
 #include "ecdsa_operation.h"
 
 #include <openssl/ecdsa.h>
+#include <openssl/err.h>
 
 #include "ec_key.h"
 #include "openssl_err.h"
@@ -37,8 +38,8 @@ Operation* EcdsaOperationFactory::CreateOperation(const Key& key,
         return nullptr;
     }
 
-    UniquePtr<EVP_PKEY, EVP_PKEY_Delete> pkey(EVP_PKEY_new());
-    if (!ecdsa_key->InternalToEvp(pkey.get())) {
+    UniquePtr<EVP_PKEY, EVP_PKEY_Delete> pkey(ecdsa_key->GetEvpKey());
+    if (!pkey.get()) {
         *error = KM_ERROR_UNKNOWN_ERROR;
         return nullptr;
     }
@@ -48,7 +49,7 @@ Operation* EcdsaOperationFactory::CreateOperation(const Key& key,
         return nullptr;
 
     *error = KM_ERROR_OK;
-    Operation* op = InstantiateOperation(digest, pkey.release());
+    Operation* op = InstantiateOperation(digest, pkey.release(), *ecdsa_key);
     if (!op)
         *error = KM_ERROR_MEMORY_ALLOCATION_FAILED;
     return op;
@@ -59,6 +60,34 @@ const keymaster_digest_t* EcdsaOperationFactory::SupportedDigests(size_t* digest
     return supported_digests;
 }
 
+Operation* EcdsaSignOperationFactory::InstantiateOperation(keymaster_digest_t digest, EVP_PKEY* key,
+                                                           const EcKey& ec_key) {
+    EcdsaSignOperation* op =
+        new (std::nothrow) EcdsaSignOperation(digest, key, ec_key.sign_setup_queue());
+    if (op)
+        op->set_digest_context_cache(ec_key.digest_context_cache());
+    return op;
+}
+
+PrecomputedPairQueue::Generator EcdsaSignSetupGenerator(EC_KEY* key) {
+    EC_KEY_up_ref(key);
+    std::shared_ptr<EC_KEY> shared_key(key, EC_KEY_free);
+    return [shared_key](BIGNUM** kinv, BIGNUM** r) {
+        return ECDSA_sign_setup(shared_key.get(), nullptr /* ctx */, kinv, r) == 1;
+    };
+}
+
+Operation* EcdsaVerifyOperationFactory::InstantiateOperation(keymaster_digest_t digest,
+                                                             EVP_PKEY* key, const EcKey& ec_key) {
+    EcdsaVerifyOperation* op =
+        new (std::nothrow) EcdsaVerifyOperation(digest, key, ec_key.verification_key());
+    if (op && ec_key.verification_cache())
+        op->EnableVerificationCache(ec_key.verification_cache(), ec_key.public_key_digest());
+    if (op)
+        op->set_digest_context_cache(ec_key.digest_context_cache());
+    return op;
+}
+
 EcdsaOperation::~EcdsaOperation() {
     if (ecdsa_key_ != NULL)
         EVP_PKEY_free(ecdsa_key_);
@@ -91,10 +120,38 @@ keymaster_error_t EcdsaOperation::InitDigest() {
     }
 }
 
+keymaster_error_t EcdsaOperation::InitDigestContext() {
+    if (digest_context_cache_ &&
+        digest_context_cache_->CopyTo(purpose(), digest_, KM_PAD_NONE, &digest_ctx_))
+        return KM_ERROR_OK;
+
+    EVP_PKEY_CTX* pkey_ctx;
+    int init_result =
+        purpose() == KM_PURPOSE_SIGN
+            ? EVP_DigestSignInit(&digest_ctx_, &pkey_ctx, digest_algorithm_, nullptr /* engine */,
+                                 ecdsa_key_)
+            : EVP_DigestVerifyInit(&digest_ctx_, &pkey_ctx, digest_algorithm_,
+                                   nullptr /* engine */, ecdsa_key_);
+    if (init_result != 1)
+        return TranslateLastOpenSslError();
+
+    if (digest_context_cache_)
+        digest_context_cache_->Store(purpose(), digest_, KM_PAD_NONE, &digest_ctx_);
+    return KM_ERROR_OK;
+}
+
 inline size_t min(size_t a, size_t b) {
     return (a < b) ? a : b;
 }
 
+size_t EcdsaOperation::preferred_chunk_size() const {
+    return digest_ == KM_DIGEST_NONE ? max_chunk_size() : Operation::preferred_chunk_size();
+}
+
+size_t EcdsaOperation::max_chunk_size() const {
+    return digest_ == KM_DIGEST_NONE ? (EVP_PKEY_bits(ecdsa_key_) + 7) / 8 : 0;
+}
+
 keymaster_error_t EcdsaOperation::StoreData(const Buffer& input, size_t* input_consumed) {
     if (!data_.reserve((EVP_PKEY_bits(ecdsa_key_) + 7) / 8))
         return KM_ERROR_MEMORY_ALLOCATION_FAILED;
@@ -115,11 +172,13 @@ keymaster_error_t EcdsaSignOperation::Begin(const AuthorizationSet& /* input_par
     if (digest_ == KM_DIGEST_NONE)
         return KM_ERROR_OK;
 
-    EVP_PKEY_CTX* pkey_ctx;
-    if (EVP_DigestSignInit(&digest_ctx_, &pkey_ctx, digest_algorithm_, nullptr /* engine */,
-                           ecdsa_key_) != 1)
-        return TranslateLastOpenSslError();
-    return KM_ERROR_OK;
+    if (sign_setup_queue_) {
+        if (EVP_DigestInit_ex(&digest_ctx_, digest_algorithm_, nullptr /* engine */) != 1)
+            return TranslateLastOpenSslError();
+        return KM_ERROR_OK;
+    }
+
+    return InitDigestContext();
 }
 
 keymaster_error_t EcdsaSignOperation::Update(const AuthorizationSet& /* additional_params */,
@@ -129,8 +188,12 @@ keymaster_error_t EcdsaSignOperation::Update(const AuthorizationSet& /* addition
     if (digest_ == KM_DIGEST_NONE)
         return StoreData(input, input_consumed);
 
-    if (EVP_DigestSignUpdate(&digest_ctx_, input.peek_read(), input.available_read()) != 1)
+    if (sign_setup_queue_) {
+        if (EVP_DigestUpdate(&digest_ctx_, input.peek_read(), input.available_read()) != 1)
+            return TranslateLastOpenSslError();
+    } else if (EVP_DigestSignUpdate(&digest_ctx_, input.peek_read(), input.available_read()) != 1) {
         return TranslateLastOpenSslError();
+    }
     *input_consumed = input.available_read();
     return KM_ERROR_OK;
 }
@@ -146,45 +209,81 @@ keymaster_error_t EcdsaSignOperation::Finish(const AuthorizationSet& additional_
     if (error != KM_ERROR_OK)
         return error;
 
-    size_t siglen;
-    if (digest_ == KM_DIGEST_NONE) {
-        UniquePtr<EC_KEY, EC_KEY_Delete> ecdsa(EVP_PKEY_get1_EC_KEY(ecdsa_key_));
-        if (!ecdsa.get())
-            return TranslateLastOpenSslError();
+    if (digest_ == KM_DIGEST_NONE)
+        return SignDigest(data_.peek_read(), data_.available_read(), output);
 
-        output->Reinitialize(ECDSA_size(ecdsa.get()));
-        unsigned int siglen_tmp;
-        if (!ECDSA_sign(0 /* type -- ignored */, data_.peek_read(), data_.available_read(),
-                        output->peek_write(), &siglen_tmp, ecdsa.get()))
-            return TranslateLastOpenSslError();
-        siglen = siglen_tmp;
-    } else {
-        if (EVP_DigestSignFinal(&digest_ctx_, nullptr /* signature */, &siglen) != 1)
-            return TranslateLastOpenSslError();
-        if (!output->Reinitialize(siglen))
-            return KM_ERROR_MEMORY_ALLOCATION_FAILED;
-        if (EVP_DigestSignFinal(&digest_ctx_, output->peek_write(), &siglen) <= 0)
+    if (sign_setup_queue_) {
+        uint8_t digest[EVP_MAX_MD_SIZE];
+        unsigned int digest_len;
+        if (EVP_DigestFinal_ex(&digest_ctx_, digest, &digest_len) != 1)
             return TranslateLastOpenSslError();
+        return SignDigest(digest, digest_len, output);
+    }
+
+    size_t siglen;
+    if (EVP_DigestSignFinal(&digest_ctx_, nullptr /* signature */, &siglen) != 1)
+        return TranslateLastOpenSslError();
+    if (!output->Reinitialize(siglen))
+        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    if (EVP_DigestSignFinal(&digest_ctx_, output->peek_write(), &siglen) <= 0)
+        return TranslateLastOpenSslError();
+    if (!output->advance_write(siglen))
+        return KM_ERROR_UNKNOWN_ERROR;
+    return KM_ERROR_OK;
+}
+
+keymaster_error_t EcdsaSignOperation::SignDigest(const uint8_t* digest, size_t digest_len,
+                                                 Buffer* output) {
+    UniquePtr<EC_KEY, EC_KEY_Delete> ecdsa(EVP_PKEY_get1_EC_KEY(ecdsa_key_));
+    if (!ecdsa.get())
+        return TranslateLastOpenSslError();
+
+    output->Reinitialize(ECDSA_size(ecdsa.get()));
+    unsigned int siglen;
+    BIGNUM_ClearPtr kinv, r;
+    if (sign_setup_queue_ && sign_setup_queue_->Take(&kinv, &r)) {
+        if (ECDSA_sign_ex(0 /* type -- ignored */, digest, digest_len, output->peek_write(),
+                          &siglen, kinv.get(), r.get(), ecdsa.get())) {
+            if (!output->advance_write(siglen))
+                return KM_ERROR_UNKNOWN_ERROR;
+            return KM_ERROR_OK;
+        }
+        // The pair can't sign this digest (s came out zero); fall back to a fresh nonce.
+        ERR_clear_error();
     }
+
+    if (!ECDSA_sign(0 /* type -- ignored */, digest, digest_len, output->peek_write(), &siglen,
+                    ecdsa.get()))
+        return TranslateLastOpenSslError();
     if (!output->advance_write(siglen))
         return KM_ERROR_UNKNOWN_ERROR;
     return KM_ERROR_OK;
 }
 
+EcdsaVerifyOperation::EcdsaVerifyOperation(keymaster_digest_t digest, EVP_PKEY* key,
+                                           EC_KEY* verification_key)
+    : EcdsaOperation(KM_PURPOSE_VERIFY, digest, key) {
+    if (verification_key && EC_KEY_up_ref(verification_key))
+        verification_key_.reset(verification_key);
+}
+
 keymaster_error_t EcdsaVerifyOperation::Begin(const AuthorizationSet& /* input_params */,
                                               AuthorizationSet* /* output_params */) {
     keymaster_error_t error = InitDigest();
     if (error != KM_ERROR_OK)
         return error;
 
+    cached_verification_.Start();
     if (digest_ == KM_DIGEST_NONE)
         return KM_ERROR_OK;
 
-    EVP_PKEY_CTX* pkey_ctx;
-    if (EVP_DigestVerifyInit(&digest_ctx_, &pkey_ctx, digest_algorithm_, nullptr /* engine */,
-                             ecdsa_key_) != 1)
-        return TranslateLastOpenSslError();
-    return KM_ERROR_OK;
+    if (verification_key_.get()) {
+        if (EVP_DigestInit_ex(&digest_ctx_, digest_algorithm_, nullptr /* engine */) != 1)
+            return TranslateLastOpenSslError();
+        return KM_ERROR_OK;
+    }
+
+    return InitDigestContext();
 }
 
 keymaster_error_t EcdsaVerifyOperation::Update(const AuthorizationSet& /* additional_params */,
@@ -194,8 +293,14 @@ keymaster_error_t EcdsaVerifyOperation::Update(const AuthorizationSet& /* additi
     if (digest_ == KM_DIGEST_NONE)
         return StoreData(input, input_consumed);
 
-    if (EVP_DigestVerifyUpdate(&digest_ctx_, input.peek_read(), input.available_read()) != 1)
+    if (verification_key_.get()) {
+        if (EVP_DigestUpdate(&digest_ctx_, input.peek_read(), input.available_read()) != 1)
+            return TranslateLastOpenSslError();
+    } else if (EVP_DigestVerifyUpdate(&digest_ctx_, input.peek_read(), input.available_read()) !=
+               1) {
         return TranslateLastOpenSslError();
+    }
+    cached_verification_.AddMessage(input.peek_read(), input.available_read());
     *input_consumed = input.available_read();
     return KM_ERROR_OK;
 }
@@ -208,22 +313,53 @@ keymaster_error_t EcdsaVerifyOperation::Finish(const AuthorizationSet& additiona
     if (error != KM_ERROR_OK)
         return error;
 
-    if (digest_ == KM_DIGEST_NONE) {
-        UniquePtr<EC_KEY, EC_KEY_Delete> ecdsa(EVP_PKEY_get1_EC_KEY(ecdsa_key_));
-        if (!ecdsa.get())
-            return TranslateLastOpenSslError();
+    if (!cached_verification_.enabled())
+        return Verify(signature);
+
+    if (digest_ == KM_DIGEST_NONE)
+        cached_verification_.AddMessage(data_.peek_read(), data_.available_read());
+    if (cached_verification_.Lookup(signature))
+        return KM_ERROR_OK;
+    error = Verify(signature);
+    if (error == KM_ERROR_OK)
+        cached_verification_.Record();
+    return error;
+}
+
+keymaster_error_t EcdsaVerifyOperation::Verify(const Buffer& signature) {
+    if (digest_ == KM_DIGEST_NONE)
+        return VerifyDigest(data_.peek_read(), data_.available_read(), signature);
 
-        int result =
-            ECDSA_verify(0 /* type -- ignored */, data_.peek_read(), data_.available_read(),
-                         signature.peek_read(), signature.available_read(), ecdsa.get());
-        if (result < 0)
+    if (verification_key_.get()) {
+        uint8_t digest[EVP_MAX_MD_SIZE];
+        unsigned int digest_len;
+        if (EVP_DigestFinal_ex(&digest_ctx_, digest, &digest_len) != 1)
             return TranslateLastOpenSslError();
-        else if (result == 0)
-            return KM_ERROR_VERIFICATION_FAILED;
-    } else if (!EVP_DigestVerifyFinal(&digest_ctx_, signature.peek_read(),
-                                      signature.available_read()))
+        return VerifyDigest(digest, digest_len, signature);
+    }
+
+    if (!EVP_DigestVerifyFinal(&digest_ctx_, signature.peek_read(), signature.available_read()))
         return KM_ERROR_VERIFICATION_FAILED;
+    return KM_ERROR_OK;
+}
 
+keymaster_error_t EcdsaVerifyOperation::VerifyDigest(const uint8_t* digest, size_t digest_len,
+                                                     const Buffer& signature) {
+    UniquePtr<EC_KEY, EC_KEY_Delete> owned_key;
+    EC_KEY* ecdsa = verification_key_.get();
+    if (!ecdsa) {
+        owned_key.reset(EVP_PKEY_get1_EC_KEY(ecdsa_key_));
+        ecdsa = owned_key.get();
+        if (!ecdsa)
+            return TranslateLastOpenSslError();
+    }
+
+    int result = ECDSA_verify(0 /* type -- ignored */, digest, digest_len, signature.peek_read(),
+                              signature.available_read(), ecdsa);
+    if (result < 0)
+        return TranslateLastOpenSslError();
+    else if (result == 0)
+        return KM_ERROR_VERIFICATION_FAILED;
     return KM_ERROR_OK;
 }
 
@@ -17,15 +17,29 @@
 #ifndef SYSTEM_KEYMASTER_ECDSA_OPERATION_H_
 #define SYSTEM_KEYMASTER_ECDSA_OPERATION_H_
 
+#include <memory>
+
 #include <openssl/ec.h>
 #include <openssl/evp.h>
 
 #include <UniquePtr.h>
 
+#include "digest_context_cache.h"
+#include "openssl_utils.h"
 #include "operation.h"
+#include "precomputed_pair_queue.h"
+#include "verification_cache.h"
 
 namespace keymaster {
 
+class EcKey;
+
+/**
+ * Returns a generator of ECDSA signing setups (k^-1, r) for key, for a PrecomputedPairQueue.  The
+ * generator holds a reference to key.
+ */
+PrecomputedPairQueue::Generator EcdsaSignSetupGenerator(EC_KEY* key);
+
 class EcdsaOperation : public Operation {
   public:
     EcdsaOperation(keymaster_purpose_t purpose, keymaster_digest_t digest, EVP_PKEY* key)
@@ -36,21 +50,39 @@ class EcdsaOperation : public Operation {
 
     keymaster_error_t Abort() override { return KM_ERROR_OK; }
 
+    // Without a digest, input beyond the key size is ignored.
+    size_t preferred_chunk_size() const override;
+    size_t max_chunk_size() const override;
+
+    /**
+     * Takes the operation's initialized digest contexts from, and adds them to, context_cache.
+     */
+    void set_digest_context_cache(const std::shared_ptr<DigestContextCache>& context_cache) {
+        digest_context_cache_ = context_cache;
+    }
+
   protected:
+    size_t buffer_bytes() const override { return data_.buffer_size(); }
+
     keymaster_error_t StoreData(const Buffer& input, size_t* input_consumed);
     keymaster_error_t InitDigest();
+    // Initializes digest_ctx_ to sign or verify, per the purpose, with the key and digest, by
+    // copying the template in digest_context_cache_ when there is one.
+    keymaster_error_t InitDigestContext();
 
     keymaster_digest_t digest_;
     const EVP_MD* digest_algorithm_;
     EVP_PKEY* ecdsa_key_;
     EVP_MD_CTX digest_ctx_;
     Buffer data_;
+    std::shared_ptr<DigestContextCache> digest_context_cache_;
 };
 
 class EcdsaSignOperation : public EcdsaOperation {
   public:
-    EcdsaSignOperation(keymaster_digest_t digest, EVP_PKEY* key)
-        : EcdsaOperation(KM_PURPOSE_SIGN, digest, key) {}
+    EcdsaSignOperation(keymaster_digest_t digest, EVP_PKEY* key,
+                       const std::shared_ptr<PrecomputedPairQueue>& sign_setup_queue = nullptr)
+        : EcdsaOperation(KM_PURPOSE_SIGN, digest, key), sign_setup_queue_(sign_setup_queue) {}
     keymaster_error_t Begin(const AuthorizationSet& input_params,
                             AuthorizationSet* output_params) override;
     keymaster_error_t Update(const AuthorizationSet& additional_params, const Buffer& input,
@@ -59,12 +91,24 @@ class EcdsaSignOperation : public EcdsaOperation {
     keymaster_error_t Finish(const AuthorizationSet& additional_params, const Buffer& input,
                              const Buffer& signature, AuthorizationSet* output_params,
                              Buffer* output) override;
+
+  private:
+    size_t object_size() const override { return sizeof(*this); }
+
+    keymaster_error_t SignDigest(const uint8_t* digest, size_t digest_len, Buffer* output);
+
+    // If set, the message is digested separately so the signature can use a precomputed pair.
+    const std::shared_ptr<PrecomputedPairQueue> sign_setup_queue_;
 };
 
 class EcdsaVerifyOperation : public EcdsaOperation {
   public:
-    EcdsaVerifyOperation(keymaster_digest_t digest, EVP_PKEY* key)
-        : EcdsaOperation(KM_PURPOSE_VERIFY, digest, key) {}
+    /**
+     * If verification_key is non-null the operation takes a reference to it and verifies with it
+     * rather than with key; see EcKey::verification_key.
+     */
+    EcdsaVerifyOperation(keymaster_digest_t digest, EVP_PKEY* key,
+                         EC_KEY* verification_key = nullptr);
     keymaster_error_t Begin(const AuthorizationSet& input_params,
                             AuthorizationSet* output_params) override;
     keymaster_error_t Update(const AuthorizationSet& additional_params, const Buffer& input,
@@ -73,6 +117,28 @@ class EcdsaVerifyOperation : public EcdsaOperation {
     keymaster_error_t Finish(const AuthorizationSet& additional_params, const Buffer& input,
                              const Buffer& signature, AuthorizationSet* output_params,
                              Buffer* output) override;
+
+    /**
+     * Makes Finish skip verifying signatures that cache holds for the key whose public key digest
+     * is key_digest, and add those that verify.
+     */
+    void EnableVerificationCache(const std::shared_ptr<VerificationCache>& cache,
+                                 const VerificationCache::Digest& key_digest) {
+        cached_verification_.Enable(cache, key_digest, digest_, KM_PAD_NONE);
+    }
+
+  private:
+    size_t object_size() const override { return sizeof(*this); }
+
+    // Verifies signature over the message passed to Update and Finish.
+    keymaster_error_t Verify(const Buffer& signature);
+    keymaster_error_t VerifyDigest(const uint8_t* digest, size_t digest_len,
+                                   const Buffer& signature);
+
+    // If set, the message is digested separately and verified against this key.
+    UniquePtr<EC_KEY, EC_KEY_Delete> verification_key_;
+
+    CachedVerification cached_verification_;
 };
 
 class EcdsaOperationFactory : public OperationFactory {
@@ -83,23 +149,22 @@ class EcdsaOperationFactory : public OperationFactory {
     const keymaster_digest_t* SupportedDigests(size_t* digest_count) const override;
 
     virtual keymaster_purpose_t purpose() const = 0;
-    virtual Operation* InstantiateOperation(keymaster_digest_t digest, EVP_PKEY* key) = 0;
+    virtual Operation* InstantiateOperation(keymaster_digest_t digest, EVP_PKEY* key,
+                                            const EcKey& ec_key) = 0;
 };
 
 class EcdsaSignOperationFactory : public EcdsaOperationFactory {
   private:
     keymaster_purpose_t purpose() const override { return KM_PURPOSE_SIGN; }
-    Operation* InstantiateOperation(keymaster_digest_t digest, EVP_PKEY* key) {
-        return new (std::nothrow) EcdsaSignOperation(digest, key);
-    }
+    Operation* InstantiateOperation(keymaster_digest_t digest, EVP_PKEY* key,
+                                    const EcKey& ec_key) override;
 };
 
 class EcdsaVerifyOperationFactory : public EcdsaOperationFactory {
   public:
     keymaster_purpose_t purpose() const override { return KM_PURPOSE_VERIFY; }
-    Operation* InstantiateOperation(keymaster_digest_t digest, EVP_PKEY* key) {
-        return new (std::nothrow) EcdsaVerifyOperation(digest, key);
-    }
+    Operation* InstantiateOperation(keymaster_digest_t digest, EVP_PKEY* key,
+                                    const EcKey& ec_key) override;
 };
 
 }  // namespace keymaster
@@ -16,12 +16,18 @@
 
 #include "ecies_kem.h"
 
+#include "ephemeral_key_exchange_pool.h"
 #include "nist_curve_key_exchange.h"
 #include "openssl_err.h"
 
 namespace keymaster {
 
-EciesKem::EciesKem(const AuthorizationSet& kem_description, keymaster_error_t* error) {
+EciesKem::EciesKem(const AuthorizationSet& kem_description, keymaster_error_t* error)
+    : EciesKem(kem_description, nullptr /* key_pool */, error) {}
+
+EciesKem::EciesKem(const AuthorizationSet& kem_description, EphemeralKeyExchangePool* key_pool,
+                   keymaster_error_t* error)
+    : key_pool_(key_pool) {
     AuthorizationSet authorizations(kem_description);
 
     if (!authorizations.GetTagValue(TAG_EC_CURVE, &curve_)) {
@@ -69,6 +75,7 @@ EciesKem::EciesKem(const AuthorizationSet& kem_description, keymaster_error_t* e
     }
 
     single_hash_mode_ = authorizations.GetTagValue(TAG_ECIES_SINGLE_HASH_MODE);
+    point_compression_ = authorizations.GetTagValue(TAG_EC_POINT_COMPRESSION);
     *error = KM_ERROR_OK;
 }
 
@@ -82,18 +89,27 @@ bool EciesKem::Encrypt(const Buffer& peer_public_value, Buffer* output_clear_key
 bool EciesKem::Encrypt(const uint8_t* peer_public_value, size_t peer_public_value_len,
                        Buffer* output_clear_key, Buffer* output_encrypted_key) {
 
-    key_exchange_.reset(NistCurveKeyExchange::GenerateKeyExchange(curve_));
-    if (!key_exchange_.get()) {
+    // The ephemeral key is used for this encapsulation only, and destroyed when it returns.
+    UniquePtr<NistCurveKeyExchange> key_exchange;
+    if (key_pool_)
+        key_exchange.reset(key_pool_->Take(curve_));
+    if (!key_exchange.get())
+        key_exchange.reset(NistCurveKeyExchange::GenerateKeyExchange(curve_));
+    if (!key_exchange.get()) {
+        return false;
+    }
+    if (point_compression_ && key_exchange->SetPointCompression(true) != KM_ERROR_OK) {
+        LOG_E("EciesKem: Can't compress public value", 0);
         return false;
     }
 
     Buffer shared_secret;
-    if (!key_exchange_->CalculateSharedKey(peer_public_value, peer_public_value_len,
-                                           &shared_secret)) {
+    if (!key_exchange->CalculateSharedKey(peer_public_value, peer_public_value_len,
+                                          &shared_secret)) {
         LOG_E("EciesKem: ECDH failed, can't obtain shared secret", 0);
         return false;
     }
-    if (!key_exchange_->public_value(output_encrypted_key)) {
+    if (!key_exchange->public_value(output_encrypted_key)) {
         LOG_E("EciesKem: Can't obtain public value", 0);
         return false;
     }
@@ -134,46 +150,82 @@ bool EciesKem::Decrypt(EC_KEY* private_key, const Buffer& encrypted_key, Buffer*
 // http://www.shoup.net/iso/std6.pdf, section 10.2.4.
 bool EciesKem::Decrypt(EC_KEY* private_key, const uint8_t* encrypted_key, size_t encrypted_key_len,
                        Buffer* output_key) {
-
     keymaster_error_t error;
-    key_exchange_.reset(new NistCurveKeyExchange(private_key, &error));
-    if (!key_exchange_.get() || error != KM_ERROR_OK) {
+    EciesKemDecapsulator decapsulator(private_key, single_hash_mode_, key_bytes_to_generate_,
+                                      &error);
+    if (error != KM_ERROR_OK)
         return false;
-    }
+    return decapsulator.Decrypt(encrypted_key, encrypted_key_len, output_key);
+}
 
-    Buffer shared_secret;
-    if (!key_exchange_->CalculateSharedKey(encrypted_key, encrypted_key_len, &shared_secret)) {
-        LOG_E("EciesKem: ECDH failed, can't obtain shared secret", 0);
-        return false;
+EciesKemDecapsulator* EciesKem::NewDecapsulator(EC_KEY* private_key,
+                                                keymaster_error_t* error) const {
+    UniquePtr<EciesKemDecapsulator> decapsulator(new (std::nothrow) EciesKemDecapsulator(
+        private_key, single_hash_mode_, key_bytes_to_generate_, error));
+    if (!decapsulator.get()) {
+        EC_KEY_free(private_key);
+        *error = KM_ERROR_MEMORY_ALLOCATION_FAILED;
+        return nullptr;
     }
+    if (*error != KM_ERROR_OK)
+        return nullptr;
+    return decapsulator.release();
+}
+
+EciesKemDecapsulator::EciesKemDecapsulator(EC_KEY* private_key, bool single_hash_mode,
+                                           uint32_t key_bytes_to_generate,
+                                           keymaster_error_t* error)
+    : key_exchange_(private_key, error), z_len_(0),
+      key_bytes_to_generate_(key_bytes_to_generate) {
+    if (*error != KM_ERROR_OK)
+        return;
 
     Buffer public_value;
-    if (!key_exchange_->public_value(&public_value)) {
+    if (!key_exchange_.public_value(&public_value)) {
         LOG_E("%s", "EciesKem: Can't obtain public value");
-        return false;
+        *error = KM_ERROR_UNKNOWN_ERROR;
+        return;
     }
 
-    Buffer z;
-    if (single_hash_mode_) {
+    if (single_hash_mode) {
         // z is empty.
     } else {
         // z = C0
-        z.Reinitialize(public_value.peek_read(), public_value.available_read());
+        z_len_ = public_value.available_read();
     }
 
-    Buffer actual_secret(z.available_read() + shared_secret.available_read());
-    actual_secret.write(z.peek_read(), z.available_read());
-    actual_secret.write(shared_secret.peek_read(), shared_secret.available_read());
+    secret_.reset(new (std::nothrow) uint8_t[z_len_ + key_exchange_.shared_secret_size()]);
+    if (!secret_.get()) {
+        *error = KM_ERROR_MEMORY_ALLOCATION_FAILED;
+        return;
+    }
+    memcpy(secret_.get(), public_value.peek_read(), z_len_);
+}
 
-    if (!kdf_->Init(actual_secret.peek_read(), actual_secret.available_read(), nullptr /* salt */,
-                    0 /* salt_len */)) {
+bool EciesKemDecapsulator::Decrypt(const Buffer& encrypted_key, Buffer* output_key) {
+    return Decrypt(encrypted_key.peek_read(), encrypted_key.available_read(), output_key);
+}
+
+bool EciesKemDecapsulator::Decrypt(const uint8_t* encrypted_key, size_t encrypted_key_len,
+                                   Buffer* output_key) {
+    uint8_t* shared_secret = secret_.get() + z_len_;
+    size_t shared_secret_len = key_exchange_.shared_secret_size();
+    if (!key_exchange_.ComputeSharedSecret(encrypted_key, encrypted_key_len, shared_secret)) {
+        LOG_E("EciesKem: ECDH failed, can't obtain shared secret", 0);
+        return false;
+    }
+
+    bool initialized = kdf_.Init(secret_.get(), z_len_ + shared_secret_len, nullptr /* salt */,
+                                 0 /* salt_len */);
+    memset_s(shared_secret, 0, shared_secret_len);
+    if (!initialized) {
         LOG_E("%s", "EciesKem: KDF failed, can't derived keys");
         return false;
     }
 
     output_key->Reinitialize(key_bytes_to_generate_);
-    if (!kdf_->GenerateKey(nullptr /* info */, 0 /* info_len */, output_key->peek_write(),
-                           key_bytes_to_generate_)) {
+    if (!kdf_.GenerateKey(nullptr /* info */, 0 /* info_len */, output_key->peek_write(),
+                          key_bytes_to_generate_)) {
         LOG_E("%s", "EciesKem: KDF failed, can't derived keys");
         return false;
     }
@@ -26,6 +26,7 @@
 
 #include "hkdf.h"
 #include "key_exchange.h"
+#include "nist_curve_key_exchange.h"
 
 namespace keymaster {
 
@@ -33,11 +34,22 @@ namespace keymaster {
  * EciesKem is an implementation of the key encapsulation mechanism ECIES-KEM described in
  * ISO 18033-2 (http://www.shoup.net/iso/std6.pdf, http://www.shoup.net/papers/iso-2_1.pdf).
  */
+class EphemeralKeyExchangePool;
+class EciesKemDecapsulator;
+
 class EciesKem : public Kem {
   public:
     virtual ~EciesKem() override {}
     EciesKem(const AuthorizationSet& kem_description, keymaster_error_t* error);
 
+    /**
+     * Creates an EciesKem whose encapsulations take their ephemeral keys from key_pool when it has
+     * one ready for the curve, falling back to inline generation otherwise.  key_pool is not owned
+     * and must outlive the EciesKem.
+     */
+    EciesKem(const AuthorizationSet& kem_description, EphemeralKeyExchangePool* key_pool,
+             keymaster_error_t* error);
+
     /* Kem interface. */
     bool Encrypt(const Buffer& peer_public_value, Buffer* output_clear_key,
                  Buffer* output_encrypted_key) override;
@@ -48,14 +60,53 @@ class EciesKem : public Kem {
     bool Decrypt(EC_KEY* private_key, const uint8_t* encrypted_key, size_t encrypted_key_len,
                  Buffer* output_key) override;
 
+    /**
+     * Returns a decapsulator that decrypts this EciesKem's encapsulations with private_key, of
+     * which it takes ownership, or nullptr with *error set if the key is unusable.  The caller
+     * owns the decapsulator, which doesn't refer back to the EciesKem.
+     */
+    EciesKemDecapsulator* NewDecapsulator(EC_KEY* private_key, keymaster_error_t* error) const;
+
   private:
-    UniquePtr<KeyExchange> key_exchange_;
+    EphemeralKeyExchangePool* key_pool_;
     UniquePtr<Rfc5869Sha256Kdf> kdf_;
     bool single_hash_mode_;
+    // Whether encapsulations send the ephemeral public value compressed, per
+    // TAG_EC_POINT_COMPRESSION.  Decapsulation accepts either form.
+    bool point_compression_;
     uint32_t key_bytes_to_generate_;
     keymaster_ec_curve_t curve_;
 };
 
+/**
+ * EciesKemDecapsulator decrypts EciesKem encapsulations with one long-lived private key.  The key
+ * is checked, and the KDF secret's prefix worked out, once when it's created, so each Decrypt only
+ * decodes the peer point, runs ECDH and derives the key.  Decrypt gives the same keys as
+ * EciesKem::Decrypt with the same key and KEM description.  Not thread-safe; use one per thread.
+ */
+class EciesKemDecapsulator {
+  public:
+    bool Decrypt(const Buffer& encrypted_key, Buffer* output_key);
+    bool Decrypt(const uint8_t* encrypted_key, size_t encrypted_key_len, Buffer* output_key);
+
+  private:
+    friend class EciesKem;
+    EciesKemDecapsulator(EC_KEY* private_key, bool single_hash_mode,
+                         uint32_t key_bytes_to_generate, keymaster_error_t* error);
+
+    NistCurveKeyExchange key_exchange_;
+    Rfc5869Sha256Kdf kdf_;
+    // The KDF secret, z || shared secret, with z filled in.  The shared secret is wiped after
+    // each Decrypt.
+    UniquePtr<uint8_t[]> secret_;
+    size_t z_len_;
+    const uint32_t key_bytes_to_generate_;
+
+    // Disallow copying and assignment.
+    EciesKemDecapsulator(const EciesKemDecapsulator&);
+    void operator=(const EciesKemDecapsulator&);
+};
+
 }  // namespace keymaster
 
 #endif  // SYSTEM_KEYMASTER_ECIES_KEM_H_
@@ -16,6 +16,9 @@
 
 #include "ecies_kem.h"
 
+#include <chrono>
+#include <thread>
+
 #include <gtest/gtest.h>
 #include <openssl/evp.h>
 
@@ -23,6 +26,7 @@
 #include <keymaster/android_keymaster_utils.h>
 
 #include "android_keymaster_test_utils.h"
+#include "ephemeral_key_exchange_pool.h"
 #include "nist_curve_key_exchange.h"
 
 using std::string;
@@ -69,5 +73,185 @@ TEST(EciesKem, TestConsistency) {
     }
 }
 
+/**
+ * With TAG_EC_POINT_COMPRESSION the encapsulated key is the compressed ephemeral point, and still
+ * decrypts to the same key.
+ */
+TEST(EciesKem, CompressedEncryptedKey) {
+    static const uint32_t kKeyLen = 32;
+    for (auto& curve : kEcCurves) {
+        AuthorizationSet kem_description(AuthorizationSetBuilder()
+                                             .Authorization(TAG_EC_CURVE, curve)
+                                             .Authorization(TAG_KDF, KM_KDF_RFC5869_SHA256)
+                                             .Authorization(TAG_ECIES_SINGLE_HASH_MODE)
+                                             .Authorization(TAG_EC_POINT_COMPRESSION)
+                                             .Authorization(TAG_KEY_SIZE, kKeyLen));
+        keymaster_error_t error;
+        EciesKem kem(kem_description, &error);
+        ASSERT_EQ(KM_ERROR_OK, error);
+
+        UniquePtr<NistCurveKeyExchange> key_exchange(
+            NistCurveKeyExchange::GenerateKeyExchange(curve));
+        Buffer peer_public_value;
+        ASSERT_TRUE(key_exchange->public_value(&peer_public_value));
+
+        Buffer output_clear_key;
+        Buffer output_encrypted_key;
+        ASSERT_TRUE(kem.Encrypt(peer_public_value, &output_clear_key, &output_encrypted_key));
+        ASSERT_EQ(1 + key_exchange->shared_secret_size(), output_encrypted_key.available_read());
+        uint8_t prefix = output_encrypted_key.peek_read()[0];
+        EXPECT_TRUE(prefix == 2 || prefix == 3);
+
+        Buffer decrypted_clear_key;
+        ASSERT_TRUE(
+            kem.Decrypt(key_exchange->private_key(), output_encrypted_key, &decrypted_clear_key));
+        ASSERT_EQ(kKeyLen, decrypted_clear_key.available_read());
+        EXPECT_EQ(0, memcmp(output_clear_key.peek_read(), decrypted_clear_key.peek_read(),
+                            output_clear_key.available_read()));
+    }
+}
+
+// Waits for the background thread to bring the curve up to expected key exchanges.
+static bool WaitForAvailable(const EphemeralKeyExchangePool& pool, keymaster_ec_curve_t curve,
+                             size_t expected) {
+    for (int i = 0; i < 500; ++i) {
+        if (pool.available(curve) == expected)
+            return true;
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    return false;
+}
+
+TEST(EciesKem, PooledEphemeralKeys) {
+    static const uint32_t kKeyLen = 32;
+    EphemeralKeyExchangePool pool(2 /* pool_size */, 1 /* low_water_mark */);
+    for (auto& curve : kEcCurves)
+        pool.AddCurve(curve);
+    pool.Start();
+
+    for (auto& curve : kEcCurves) {
+        ASSERT_TRUE(WaitForAvailable(pool, curve, 2));
+        AuthorizationSet kem_description(AuthorizationSetBuilder()
+                                             .Authorization(TAG_EC_CURVE, curve)
+                                             .Authorization(TAG_KDF, KM_KDF_RFC5869_SHA256)
+                                             .Authorization(TAG_ECIES_SINGLE_HASH_MODE)
+                                             .Authorization(TAG_KEY_SIZE, kKeyLen));
+        keymaster_error_t error;
+        EciesKem kem(kem_description, &pool, &error);
+        ASSERT_EQ(KM_ERROR_OK, error);
+
+        UniquePtr<NistCurveKeyExchange> key_exchange(
+            NistCurveKeyExchange::GenerateKeyExchange(curve));
+        Buffer peer_public_value;
+        ASSERT_TRUE(key_exchange->public_value(&peer_public_value));
+
+        // Each encapsulation consumes its own pooled key, so the encapsulated keys differ.
+        Buffer first_clear_key, first_encrypted_key;
+        ASSERT_TRUE(kem.Encrypt(peer_public_value, &first_clear_key, &first_encrypted_key));
+        EXPECT_EQ(1U, pool.available(curve));
+        Buffer second_clear_key, second_encrypted_key;
+        ASSERT_TRUE(kem.Encrypt(peer_public_value, &second_clear_key, &second_encrypted_key));
+        ASSERT_EQ(first_encrypted_key.available_read(), second_encrypted_key.available_read());
+        EXPECT_NE(0, memcmp(first_encrypted_key.peek_read(), second_encrypted_key.peek_read(),
+                            first_encrypted_key.available_read()));
+
+        Buffer decrypted_clear_key;
+        ASSERT_TRUE(
+            kem.Decrypt(key_exchange->private_key(), second_encrypted_key, &decrypted_clear_key));
+        ASSERT_EQ(kKeyLen, decrypted_clear_key.available_read());
+        EXPECT_EQ(0, memcmp(second_clear_key.peek_read(), decrypted_clear_key.peek_read(),
+                            second_clear_key.available_read()));
+    }
+}
+
+TEST(EciesKem, Decapsulator) {
+    static const uint32_t kKeyLen = 32;
+    for (auto& curve : kEcCurves) {
+        AuthorizationSet kem_description(AuthorizationSetBuilder()
+                                             .Authorization(TAG_EC_CURVE, curve)
+                                             .Authorization(TAG_KDF, KM_KDF_RFC5869_SHA256)
+                                             .Authorization(TAG_ECIES_SINGLE_HASH_MODE)
+                                             .Authorization(TAG_KEY_SIZE, kKeyLen));
+        keymaster_error_t error;
+        EciesKem kem(kem_description, &error);
+        ASSERT_EQ(KM_ERROR_OK, error);
+
+        UniquePtr<NistCurveKeyExchange> key_exchange(
+            NistCurveKeyExchange::GenerateKeyExchange(curve));
+        Buffer peer_public_value;
+        ASSERT_TRUE(key_exchange->public_value(&peer_public_value));
+        UniquePtr<EciesKemDecapsulator> decapsulator(
+            kem.NewDecapsulator(key_exchange->private_key(), &error));
+        ASSERT_EQ(KM_ERROR_OK, error);
+        ASSERT_TRUE(decapsulator.get() != nullptr);
+
+        // One decapsulator recovers each of several encapsulated keys.
+        for (int i = 0; i < 3; ++i) {
+            Buffer clear_key, encrypted_key;
+            ASSERT_TRUE(kem.Encrypt(peer_public_value, &clear_key, &encrypted_key));
+            Buffer decrypted_clear_key;
+            ASSERT_TRUE(decapsulator->Decrypt(encrypted_key, &decrypted_clear_key));
+            ASSERT_EQ(kKeyLen, decrypted_clear_key.available_read());
+            EXPECT_EQ(0, memcmp(clear_key.peek_read(), decrypted_clear_key.peek_read(), kKeyLen));
+        }
+
+        // A point that isn't on the curve is rejected, and leaves the decapsulator usable.
+        Buffer clear_key, encrypted_key;
+        ASSERT_TRUE(kem.Encrypt(peer_public_value, &clear_key, &encrypted_key));
+        Buffer bad_encrypted_key(encrypted_key.peek_read(), encrypted_key.available_read());
+        bad_encrypted_key.peek_write()[-1] ^= 1;
+        Buffer decrypted_clear_key;
+        EXPECT_FALSE(decapsulator->Decrypt(bad_encrypted_key, &decrypted_clear_key));
+        ASSERT_TRUE(decapsulator->Decrypt(encrypted_key, &decrypted_clear_key));
+        EXPECT_EQ(0, memcmp(clear_key.peek_read(), decrypted_clear_key.peek_read(), kKeyLen));
+    }
+}
+
+TEST(EciesKem, DecapsulatorMatchesDecrypt) {
+    static const uint32_t kKeyLen = 32;
+    for (auto& curve : kEcCurves) {
+        AuthorizationSet kem_description(AuthorizationSetBuilder()
+                                             .Authorization(TAG_EC_CURVE, curve)
+                                             .Authorization(TAG_KDF, KM_KDF_RFC5869_SHA256)
+                                             .Authorization(TAG_KEY_SIZE, kKeyLen));
+        keymaster_error_t error;
+        EciesKem kem(kem_description, &error);
+        ASSERT_EQ(KM_ERROR_OK, error);
+
+        UniquePtr<NistCurveKeyExchange> key_exchange(
+            NistCurveKeyExchange::GenerateKeyExchange(curve));
+        Buffer peer_public_value;
+        ASSERT_TRUE(key_exchange->public_value(&peer_public_value));
+        Buffer clear_key, encrypted_key;
+        ASSERT_TRUE(kem.Encrypt(peer_public_value, &clear_key, &encrypted_key));
+
+        EC_KEY* private_key = key_exchange->private_key();
+        UniquePtr<EciesKemDecapsulator> decapsulator(
+            kem.NewDecapsulator(EC_KEY_dup(private_key), &error));
+        ASSERT_EQ(KM_ERROR_OK, error);
+        Buffer decapsulated_key;
+        ASSERT_TRUE(decapsulator->Decrypt(encrypted_key, &decapsulated_key));
+        Buffer decrypted_key;
+        ASSERT_TRUE(kem.Decrypt(private_key, encrypted_key, &decrypted_key));
+        ASSERT_EQ(kKeyLen, decapsulated_key.available_read());
+        ASSERT_EQ(kKeyLen, decrypted_key.available_read());
+        EXPECT_EQ(0, memcmp(decrypted_key.peek_read(), decapsulated_key.peek_read(), kKeyLen));
+    }
+}
+
+TEST(EciesKem, DecapsulatorRejectsInvalidKey) {
+    AuthorizationSet kem_description(AuthorizationSetBuilder()
+                                         .Authorization(TAG_EC_CURVE, KM_EC_CURVE_P_256)
+                                         .Authorization(TAG_KDF, KM_KDF_RFC5869_SHA256)
+                                         .Authorization(TAG_KEY_SIZE, 32));
+    keymaster_error_t error;
+    EciesKem kem(kem_description, &error);
+    ASSERT_EQ(KM_ERROR_OK, error);
+
+    UniquePtr<EciesKemDecapsulator> decapsulator(kem.NewDecapsulator(EC_KEY_new(), &error));
+    EXPECT_EQ(KM_ERROR_INVALID_ARGUMENT, error);
+    EXPECT_TRUE(decapsulator.get() == nullptr);
+}
+
 }  // namespace test
 }  // namespace keymaster
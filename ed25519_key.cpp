@@ -0,0 +1,181 @@
+/*
+ * Copyright 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "ed25519_key.h"
+
+#include <new>
+
+#include <openssl/curve25519.h>
+
+#include <keymaster/keymaster_context.h>
+#include <keymaster/logger.h>
+
+#include "ed25519_operation.h"
+
+namespace keymaster {
+
+static Ed25519SignOperationFactory sign_factory;
+static Ed25519VerifyOperationFactory verify_factory;
+
+// The DER SubjectPublicKeyInfo for an Ed25519 key (RFC 8410) is this prefix, naming the
+// id-Ed25519 algorithm, followed by the 32-byte public key.
+static const uint8_t kSubjectPublicKeyInfoPrefix[] = {0x30, 0x2a, 0x30, 0x05, 0x06, 0x03,
+                                                      0x2b, 0x65, 0x70, 0x03, 0x21, 0x00};
+
+OperationFactory* Ed25519KeyFactory::GetOperationFactory(keymaster_purpose_t purpose) const {
+    switch (purpose) {
+    case KM_PURPOSE_SIGN:
+        return &sign_factory;
+    case KM_PURPOSE_VERIFY:
+        return &verify_factory;
+    default:
+        return nullptr;
+    }
+}
+
+keymaster_error_t
+Ed25519KeyFactory::CompleteDescription(const AuthorizationSet& key_description,
+                                       AuthorizationSet* authorizations) const {
+    authorizations->Reinitialize(key_description);
+    uint32_t key_size;
+    if (!authorizations->GetTagValue(TAG_KEY_SIZE, &key_size))
+        authorizations->push_back(TAG_KEY_SIZE, kEd25519PublicKeySize * 8);
+    else if (key_size != kEd25519PublicKeySize * 8)
+        return KM_ERROR_UNSUPPORTED_KEY_SIZE;
+    if (authorizations->is_valid() != AuthorizationSet::OK)
+        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    return KM_ERROR_OK;
+}
+
+keymaster_error_t Ed25519KeyFactory::GenerateKey(const AuthorizationSet& key_description,
+                                                 KeymasterKeyBlob* key_blob,
+                                                 AuthorizationSet* hw_enforced,
+                                                 AuthorizationSet* sw_enforced) const {
+    if (!key_blob || !hw_enforced || !sw_enforced)
+        return KM_ERROR_OUTPUT_PARAMETER_NULL;
+
+    AuthorizationSet authorizations;
+    keymaster_error_t error = CompleteDescription(key_description, &authorizations);
+    if (error != KM_ERROR_OK)
+        return error;
+
+    KeymasterKeyBlob key_material(kEd25519PrivateKeySize);
+    if (!key_material.key_material)
+        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    uint8_t public_key[kEd25519PublicKeySize];
+    ED25519_keypair(public_key, key_material.writable_data());
+
+    return context_->CreateKeyBlob(authorizations, KM_ORIGIN_GENERATED, key_material, key_blob,
+                                   hw_enforced, sw_enforced);
+}
+
+keymaster_error_t Ed25519KeyFactory::ImportKey(const AuthorizationSet& key_description,
+                                               keymaster_key_format_t input_key_material_format,
+                                               const KeymasterKeyBlob& input_key_material,
+                                               KeymasterKeyBlob* output_key_blob,
+                                               AuthorizationSet* hw_enforced,
+                                               AuthorizationSet* sw_enforced) const {
+    if (!output_key_blob || !hw_enforced || !sw_enforced)
+        return KM_ERROR_OUTPUT_PARAMETER_NULL;
+
+    AuthorizationSet authorizations;
+    keymaster_error_t error = CompleteDescription(key_description, &authorizations);
+    if (error != KM_ERROR_OK)
+        return error;
+
+    if (input_key_material_format != KM_KEY_FORMAT_RAW)
+        return KM_ERROR_UNSUPPORTED_KEY_FORMAT;
+    if (input_key_material.key_material_size != kEd25519PrivateKeySize) {
+        LOG_E("Expected %d-byte Ed25519 private key but got %d bytes", kEd25519PrivateKeySize,
+              input_key_material.key_material_size);
+        return KM_ERROR_INVALID_KEY_BLOB;
+    }
+
+    // The public half can't be derived from the seed here, so check that the two halves belong
+    // together by signing with one and verifying with the other.
+    uint8_t signature[kEd25519SignatureSize];
+    const uint8_t* private_key = input_key_material.key_material;
+    if (ED25519_sign(signature, nullptr /* message */, 0, private_key) != 1 ||
+        ED25519_verify(nullptr /* message */, 0, signature,
+                       private_key + kEd25519PrivateKeySize / 2) != 1) {
+        LOG_E("Imported Ed25519 private key doesn't match its public key", 0);
+        return KM_ERROR_INVALID_KEY_BLOB;
+    }
+
+    return context_->CreateKeyBlob(authorizations, KM_ORIGIN_IMPORTED, input_key_material,
+                                   output_key_blob, hw_enforced, sw_enforced);
+}
+
+keymaster_error_t Ed25519KeyFactory::LoadKey(const KeymasterKeyBlob& key_material,
+                                             const AuthorizationSet& /* additional_params */,
+                                             const AuthorizationSet& hw_enforced,
+                                             const AuthorizationSet& sw_enforced,
+                                             UniquePtr<Key>* key) const {
+    if (!key)
+        return KM_ERROR_OUTPUT_PARAMETER_NULL;
+    if (key_material.key_material_size != kEd25519PrivateKeySize)
+        return KM_ERROR_INVALID_KEY_BLOB;
+
+    keymaster_error_t error = KM_ERROR_OK;
+    key->reset(new (std::nothrow) Ed25519Key(key_material, hw_enforced, sw_enforced, &error));
+    if (!key->get())
+        error = KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    return error;
+}
+
+static const keymaster_key_format_t supported_import_formats[] = {KM_KEY_FORMAT_RAW};
+const keymaster_key_format_t*
+Ed25519KeyFactory::SupportedImportFormats(size_t* format_count) const {
+    *format_count = array_length(supported_import_formats);
+    return supported_import_formats;
+}
+
+static const keymaster_key_format_t supported_export_formats[] = {KM_KEY_FORMAT_X509};
+const keymaster_key_format_t*
+Ed25519KeyFactory::SupportedExportFormats(size_t* format_count) const {
+    *format_count = array_length(supported_export_formats);
+    return supported_export_formats;
+}
+
+Ed25519Key::Ed25519Key(const KeymasterKeyBlob& key_material, const AuthorizationSet& hw_enforced,
+                       const AuthorizationSet& sw_enforced, keymaster_error_t* error)
+    : Key(hw_enforced, sw_enforced, error) {
+    memcpy(private_key_, key_material.key_material, sizeof(private_key_));
+}
+
+Ed25519Key::~Ed25519Key() {
+    memset_s(private_key_, 0, sizeof(private_key_));
+}
+
+keymaster_error_t Ed25519Key::formatted_key_material(keymaster_key_format_t format,
+                                                     UniquePtr<uint8_t[]>* material,
+                                                     size_t* size) const {
+    if (format != KM_KEY_FORMAT_X509)
+        return KM_ERROR_UNSUPPORTED_KEY_FORMAT;
+    if (!material || !size)
+        return KM_ERROR_OUTPUT_PARAMETER_NULL;
+
+    *size = sizeof(kSubjectPublicKeyInfoPrefix) + kEd25519PublicKeySize;
+    material->reset(new (std::nothrow) uint8_t[*size]);
+    if (!material->get())
+        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    memcpy(material->get(), kSubjectPublicKeyInfoPrefix, sizeof(kSubjectPublicKeyInfoPrefix));
+    memcpy(material->get() + sizeof(kSubjectPublicKeyInfoPrefix), public_key(),
+           kEd25519PublicKeySize);
+    return KM_ERROR_OK;
+}
+
+}  // namespace keymaster
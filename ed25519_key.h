@@ -0,0 +1,88 @@
+/*
+ * Copyright 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SYSTEM_KEYMASTER_ED25519_KEY_H_
+#define SYSTEM_KEYMASTER_ED25519_KEY_H_
+
+#include <keymaster/key_factory.h>
+#include <keymaster/keymaster_tags.h>
+
+#include "key.h"
+
+namespace keymaster {
+
+// BoringSSL's Ed25519 private keys are the 32-byte seed followed by the public key.
+const size_t kEd25519PrivateKeySize = 64;
+const size_t kEd25519PublicKeySize = 32;
+const size_t kEd25519SignatureSize = 64;
+
+/**
+ * Factory for KM_ALGORITHM_ED25519 keys.  Key blobs hold the 64-byte private key, which is also
+ * the only import format (KM_KEY_FORMAT_RAW); the public key exports as an RFC 8410
+ * SubjectPublicKeyInfo (KM_KEY_FORMAT_X509).
+ */
+class Ed25519KeyFactory : public KeyFactory {
+  public:
+    Ed25519KeyFactory(const KeymasterContext* context) : KeyFactory(context) {}
+
+    keymaster_error_t GenerateKey(const AuthorizationSet& key_description,
+                                  KeymasterKeyBlob* key_blob, AuthorizationSet* hw_enforced,
+                                  AuthorizationSet* sw_enforced) const override;
+    keymaster_error_t ImportKey(const AuthorizationSet& key_description,
+                                keymaster_key_format_t input_key_material_format,
+                                const KeymasterKeyBlob& input_key_material,
+                                KeymasterKeyBlob* output_key_blob, AuthorizationSet* hw_enforced,
+                                AuthorizationSet* sw_enforced) const override;
+    keymaster_error_t LoadKey(const KeymasterKeyBlob& key_material,
+                              const AuthorizationSet& additional_params,
+                              const AuthorizationSet& hw_enforced,
+                              const AuthorizationSet& sw_enforced,
+                              UniquePtr<Key>* key) const override;
+
+    OperationFactory* GetOperationFactory(keymaster_purpose_t purpose) const override;
+
+    const keymaster_key_format_t* SupportedImportFormats(size_t* format_count) const override;
+    const keymaster_key_format_t* SupportedExportFormats(size_t* format_count) const override;
+
+  private:
+    // Adds the key size if it's missing, and rejects any other.
+    keymaster_error_t CompleteDescription(const AuthorizationSet& key_description,
+                                          AuthorizationSet* authorizations) const;
+};
+
+class Ed25519Key : public Key {
+  public:
+    Ed25519Key(const KeymasterKeyBlob& key_material, const AuthorizationSet& hw_enforced,
+               const AuthorizationSet& sw_enforced, keymaster_error_t* error);
+    ~Ed25519Key();
+
+    keymaster_error_t formatted_key_material(keymaster_key_format_t format,
+                                             UniquePtr<uint8_t[]>* material,
+                                             size_t* size) const override;
+
+    const uint8_t* private_key() const { return private_key_; }
+    const uint8_t* public_key() const { return private_key_ + kEd25519PrivateKeySize / 2; }
+
+  protected:
+    size_t object_size() const override { return sizeof(*this); }
+
+  private:
+    uint8_t private_key_[kEd25519PrivateKeySize];
+};
+
+}  // namespace keymaster
+
+#endif  // SYSTEM_KEYMASTER_ED25519_KEY_H_
@@ -0,0 +1,123 @@
+/*
+ * Copyright 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "ed25519_operation.h"
+
+#include <new>
+
+#include <openssl/curve25519.h>
+
+#include <keymaster/logger.h>
+
+namespace keymaster {
+
+// Ed25519 digests the message itself, with SHA-512.
+static const keymaster_digest_t supported_digests[] = {KM_DIGEST_NONE};
+
+Operation* Ed25519OperationFactory::CreateOperation(const Key& key,
+                                                    const AuthorizationSet& begin_params,
+                                                    keymaster_error_t* error) {
+    // A digest needn't be given, but if it is it must be KM_DIGEST_NONE.
+    keymaster_digest_t digest;
+    if (begin_params.GetTagValue(TAG_DIGEST, &digest) && digest != KM_DIGEST_NONE) {
+        LOG_E("Digest %d not supported for Ed25519", digest);
+        *error = KM_ERROR_UNSUPPORTED_DIGEST;
+        return nullptr;
+    }
+
+    const Ed25519Key& ed25519_key = static_cast<const Ed25519Key&>(key);
+    Operation* op = nullptr;
+    switch (purpose()) {
+    case KM_PURPOSE_SIGN:
+        op = new (std::nothrow) Ed25519SignOperation(ed25519_key.private_key());
+        break;
+    case KM_PURPOSE_VERIFY:
+        op = new (std::nothrow) Ed25519VerifyOperation(ed25519_key.private_key());
+        break;
+    default:
+        *error = KM_ERROR_UNSUPPORTED_PURPOSE;
+        return nullptr;
+    }
+
+    *error = op ? KM_ERROR_OK : KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    return op;
+}
+
+const keymaster_digest_t* Ed25519OperationFactory::SupportedDigests(size_t* digest_count) const {
+    *digest_count = array_length(supported_digests);
+    return supported_digests;
+}
+
+Ed25519Operation::Ed25519Operation(keymaster_purpose_t purpose, const uint8_t* private_key)
+    : Operation(purpose) {
+    memcpy(private_key_, private_key, sizeof(private_key_));
+}
+
+Ed25519Operation::~Ed25519Operation() {
+    memset_s(private_key_, 0, sizeof(private_key_));
+}
+
+keymaster_error_t Ed25519Operation::Update(const AuthorizationSet& /* additional_params */,
+                                           const Buffer& input,
+                                           AuthorizationSet* /* output_params */,
+                                           Buffer* /* output */, size_t* input_consumed) {
+    if (!input_consumed)
+        return KM_ERROR_OUTPUT_PARAMETER_NULL;
+    if (!data_.reserve(input.available_read()) ||
+        !data_.write(input.peek_read(), input.available_read()))
+        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    *input_consumed = input.available_read();
+    return KM_ERROR_OK;
+}
+
+keymaster_error_t Ed25519SignOperation::Finish(const AuthorizationSet& additional_params,
+                                               const Buffer& input, const Buffer& /* signature */,
+                                               AuthorizationSet* /* output_params */,
+                                               Buffer* output) {
+    if (!output)
+        return KM_ERROR_OUTPUT_PARAMETER_NULL;
+
+    keymaster_error_t error = UpdateForFinish(additional_params, input);
+    if (error != KM_ERROR_OK)
+        return error;
+
+    if (!output->reserve(kEd25519SignatureSize))
+        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    if (ED25519_sign(output->peek_write(), data_.peek_read(), data_.available_read(),
+                     private_key_) != 1)
+        return KM_ERROR_UNKNOWN_ERROR;
+    if (!output->advance_write(kEd25519SignatureSize))
+        return KM_ERROR_UNKNOWN_ERROR;
+    return KM_ERROR_OK;
+}
+
+keymaster_error_t Ed25519VerifyOperation::Finish(const AuthorizationSet& additional_params,
+                                                 const Buffer& input, const Buffer& signature,
+                                                 AuthorizationSet* /* output_params */,
+                                                 Buffer* /* output */) {
+    keymaster_error_t error = UpdateForFinish(additional_params, input);
+    if (error != KM_ERROR_OK)
+        return error;
+
+    if (signature.available_read() != kEd25519SignatureSize)
+        return KM_ERROR_VERIFICATION_FAILED;
+    if (ED25519_verify(data_.peek_read(), data_.available_read(), signature.peek_read(),
+                       private_key_ + kEd25519PrivateKeySize / 2) != 1)
+        return KM_ERROR_VERIFICATION_FAILED;
+    return KM_ERROR_OK;
+}
+
+}  // namespace keymaster
@@ -0,0 +1,98 @@
+/*
+ * Copyright 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SYSTEM_KEYMASTER_ED25519_OPERATION_H_
+#define SYSTEM_KEYMASTER_ED25519_OPERATION_H_
+
+#include <keymaster/keymaster_tags.h>
+
+#include "ed25519_key.h"
+#include "operation.h"
+
+namespace keymaster {
+
+/**
+ * Abstract base for Ed25519 operations.  Ed25519 hashes the whole message twice, so it can't be
+ * streamed; Update buffers the message and Finish signs or verifies it.
+ */
+class Ed25519Operation : public Operation {
+  public:
+    Ed25519Operation(keymaster_purpose_t purpose, const uint8_t* private_key);
+    ~Ed25519Operation();
+
+    keymaster_error_t Begin(const AuthorizationSet& /* input_params */,
+                            AuthorizationSet* /* output_params */) override {
+        return KM_ERROR_OK;
+    }
+    keymaster_error_t Update(const AuthorizationSet& additional_params, const Buffer& input,
+                             AuthorizationSet* output_params, Buffer* output,
+                             size_t* input_consumed) override;
+    keymaster_error_t Abort() override { return KM_ERROR_OK; }
+
+  protected:
+    size_t buffer_bytes() const override { return data_.buffer_size(); }
+
+    uint8_t private_key_[kEd25519PrivateKeySize];
+    Buffer data_;
+};
+
+class Ed25519SignOperation : public Ed25519Operation {
+  public:
+    explicit Ed25519SignOperation(const uint8_t* private_key)
+        : Ed25519Operation(KM_PURPOSE_SIGN, private_key) {}
+
+    keymaster_error_t Finish(const AuthorizationSet& additional_params, const Buffer& input,
+                             const Buffer& signature, AuthorizationSet* output_params,
+                             Buffer* output) override;
+
+  private:
+    size_t object_size() const override { return sizeof(*this); }
+};
+
+class Ed25519VerifyOperation : public Ed25519Operation {
+  public:
+    explicit Ed25519VerifyOperation(const uint8_t* private_key)
+        : Ed25519Operation(KM_PURPOSE_VERIFY, private_key) {}
+
+    keymaster_error_t Finish(const AuthorizationSet& additional_params, const Buffer& input,
+                             const Buffer& signature, AuthorizationSet* output_params,
+                             Buffer* output) override;
+
+  private:
+    size_t object_size() const override { return sizeof(*this); }
+};
+
+class Ed25519OperationFactory : public OperationFactory {
+  public:
+    KeyType registry_key() const override { return KeyType(KM_ALGORITHM_ED25519, purpose()); }
+    Operation* CreateOperation(const Key& key, const AuthorizationSet& begin_params,
+                               keymaster_error_t* error) override;
+    const keymaster_digest_t* SupportedDigests(size_t* digest_count) const override;
+
+    virtual keymaster_purpose_t purpose() const = 0;
+};
+
+class Ed25519SignOperationFactory : public Ed25519OperationFactory {
+    keymaster_purpose_t purpose() const override { return KM_PURPOSE_SIGN; }
+};
+
+class Ed25519VerifyOperationFactory : public Ed25519OperationFactory {
+    keymaster_purpose_t purpose() const override { return KM_PURPOSE_VERIFY; }
+};
+
+}  // namespace keymaster
+
+#endif  // SYSTEM_KEYMASTER_ED25519_OPERATION_H_
@@ -0,0 +1,123 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "ephemeral_key_exchange_pool.h"
+
+#include <keymaster/logger.h>
+
+namespace keymaster {
+
+EphemeralKeyExchangePool::EphemeralKeyExchangePool(size_t pool_size, size_t low_water_mark)
+    : pool_size_(pool_size),
+      low_water_mark_(low_water_mark < pool_size ? low_water_mark : pool_size), stopping_(false) {}
+
+EphemeralKeyExchangePool::~EphemeralKeyExchangePool() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+    }
+    refill_needed_.notify_all();
+    if (thread_.joinable())
+        thread_.join();
+}
+
+void EphemeralKeyExchangePool::AddCurve(keymaster_ec_curve_t curve) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (thread_.joinable() || FindReserve(curve))
+        return;
+    reserves_.push_back(Reserve());
+    reserves_.back().curve = curve;
+    reserves_.back().refilling = true;
+}
+
+void EphemeralKeyExchangePool::Start() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!thread_.joinable())
+        thread_ = std::thread(&EphemeralKeyExchangePool::Run, this);
+}
+
+NistCurveKeyExchange* EphemeralKeyExchangePool::Take(keymaster_ec_curve_t curve) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    Reserve* reserve = FindReserve(curve);
+    if (!reserve)
+        return nullptr;
+
+    NistCurveKeyExchange* key_exchange = nullptr;
+    if (!reserve->key_exchanges.empty()) {
+        key_exchange = reserve->key_exchanges.back().release();
+        reserve->key_exchanges.pop_back();
+    }
+    if (reserve->key_exchanges.size() < low_water_mark_ && !reserve->refilling) {
+        reserve->refilling = true;
+        refill_needed_.notify_one();
+    }
+    return key_exchange;
+}
+
+size_t EphemeralKeyExchangePool::available(keymaster_ec_curve_t curve) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    const Reserve* reserve = FindReserve(curve);
+    return reserve ? reserve->key_exchanges.size() : 0;
+}
+
+EphemeralKeyExchangePool::Reserve*
+EphemeralKeyExchangePool::FindReserve(keymaster_ec_curve_t curve) {
+    for (auto& reserve : reserves_)
+        if (reserve.curve == curve)
+            return &reserve;
+    return nullptr;
+}
+
+const EphemeralKeyExchangePool::Reserve*
+EphemeralKeyExchangePool::FindReserve(keymaster_ec_curve_t curve) const {
+    return const_cast<EphemeralKeyExchangePool*>(this)->FindReserve(curve);
+}
+
+void EphemeralKeyExchangePool::Run() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (!stopping_) {
+        Reserve* reserve = nullptr;
+        for (auto& candidate : reserves_) {
+            if (candidate.refilling) {
+                reserve = &candidate;
+                break;
+            }
+        }
+        if (!reserve) {
+            refill_needed_.wait(lock);
+            continue;
+        }
+
+        // Generating the key and serializing its public point is the work being moved off the
+        // encapsulation path; don't hold the lock while Take() is waiting on it.
+        lock.unlock();
+        std::unique_ptr<NistCurveKeyExchange> key_exchange(
+            NistCurveKeyExchange::GenerateKeyExchange(reserve->curve));
+        lock.lock();
+
+        if (!key_exchange) {
+            // Don't spin on a failing curve; try again when the next key exchange is taken.
+            LOG_E("Failed to pre-generate ephemeral key on curve %d", reserve->curve);
+            reserve->refilling = false;
+            continue;
+        }
+        reserve->key_exchanges.push_back(std::move(key_exchange));
+        if (reserve->key_exchanges.size() >= pool_size_)
+            reserve->refilling = false;
+    }
+}
+
+}  // namespace keymaster
@@ -0,0 +1,94 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SYSTEM_KEYMASTER_EPHEMERAL_KEY_EXCHANGE_POOL_H_
+#define SYSTEM_KEYMASTER_EPHEMERAL_KEY_EXCHANGE_POOL_H_
+
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <hardware/keymaster_defs.h>
+
+#include "nist_curve_key_exchange.h"
+
+namespace keymaster {
+
+/**
+ * EphemeralKeyExchangePool keeps a stock of freshly-generated NIST curve key exchanges, refilled by
+ * a background thread, so that ECIES encapsulation needn't generate its ephemeral key or serialize
+ * the public point inline.
+ *
+ * Each key exchange is handed out at most once; the caller destroys it after use.
+ */
+class EphemeralKeyExchangePool {
+  public:
+    /**
+     * Creates a pool that keeps up to pool_size key exchanges per curve, and starts refilling a
+     * curve once fewer than low_water_mark of its key exchanges remain.
+     */
+    EphemeralKeyExchangePool(size_t pool_size, size_t low_water_mark);
+
+    /**
+     * Stops the background thread, waiting for any generation in progress to complete.
+     */
+    ~EphemeralKeyExchangePool();
+
+    /**
+     * Adds a curve to keep key exchanges for.  Must be called before Start().
+     */
+    void AddCurve(keymaster_ec_curve_t curve);
+
+    /**
+     * Starts the background thread, which begins by filling every curve.
+     */
+    void Start();
+
+    /**
+     * Removes a pre-generated key exchange on curve and returns it, or returns null if the curve
+     * isn't pooled or its key exchanges have run out.  The caller owns the returned object.
+     */
+    NistCurveKeyExchange* Take(keymaster_ec_curve_t curve);
+
+    size_t available(keymaster_ec_curve_t curve) const;
+
+  private:
+    struct Reserve {
+        keymaster_ec_curve_t curve;
+        std::vector<std::unique_ptr<NistCurveKeyExchange>> key_exchanges;
+        bool refilling;
+    };
+
+    Reserve* FindReserve(keymaster_ec_curve_t curve);
+    const Reserve* FindReserve(keymaster_ec_curve_t curve) const;
+    void Run();
+
+    const size_t pool_size_;
+    const size_t low_water_mark_;
+
+    mutable std::mutex mutex_;
+    std::condition_variable refill_needed_;
+    // Only added to before the thread starts, so Reserve pointers stay valid.
+    std::vector<Reserve> reserves_;
+    bool stopping_;
+    std::thread thread_;
+};
+
+}  // namespace keymaster
+
+#endif  // SYSTEM_KEYMASTER_EPHEMERAL_KEY_EXCHANGE_POOL_H_
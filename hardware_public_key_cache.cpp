@@ -0,0 +1,82 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "hardware_public_key_cache.h"
+
+#include <iterator>
+#include <utility>
+
+namespace keymaster {
+
+EVP_PKEY* HardwarePublicKeyCache::Find(const Lookup& lookup) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto found = index_.find(lookup.digest);
+    if (found == index_.end())
+        return nullptr;
+
+    EntryList::iterator entry = found->second;
+    entries_.splice(entries_.begin(), entries_, entry);
+    if (EVP_PKEY_up_ref(entry->public_key.get()) != 1)
+        return nullptr;
+    return entry->public_key.get();
+}
+
+void HardwarePublicKeyCache::Insert(const Lookup& lookup, EVP_PKEY* public_key) {
+    if (max_entries_ == 0 || !public_key || EVP_PKEY_up_ref(public_key) != 1)
+        return;
+    std::unique_ptr<EVP_PKEY, EVP_PKEY_Delete> reference(public_key);
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto found = index_.find(lookup.digest);
+    if (found != index_.end())
+        Evict(found->second);
+
+    while (entries_.size() >= max_entries_)
+        Evict(std::prev(entries_.end()));
+
+    entries_.push_front(Entry());
+    entries_.front().lookup = lookup;
+    entries_.front().public_key = std::move(reference);
+    index_[lookup.digest] = entries_.begin();
+}
+
+void HardwarePublicKeyCache::Invalidate(const LoadedKeyCache::Digest& blob_digest) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto entry = entries_.begin(); entry != entries_.end();) {
+        auto next = std::next(entry);
+        if (entry->lookup.blob_digest == blob_digest)
+            Evict(entry);
+        entry = next;
+    }
+}
+
+void HardwarePublicKeyCache::Clear() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    index_.clear();
+    entries_.clear();
+}
+
+size_t HardwarePublicKeyCache::entry_count() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return entries_.size();
+}
+
+void HardwarePublicKeyCache::Evict(EntryList::iterator entry) {
+    index_.erase(entry->lookup.digest);
+    entries_.erase(entry);
+}
+
+}  // namespace keymaster
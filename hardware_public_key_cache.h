@@ -0,0 +1,85 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SYSTEM_KEYMASTER_HARDWARE_PUBLIC_KEY_CACHE_H_
+#define SYSTEM_KEYMASTER_HARDWARE_PUBLIC_KEY_CACHE_H_
+
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+
+#include <openssl/evp.h>
+
+#include "loaded_key_cache.h"
+#include "openssl_utils.h"
+
+namespace keymaster {
+
+/**
+ * HardwarePublicKeyCache holds the decoded public halves of hardware-backed keys, so that loading a
+ * hardware key again needn't ask the device to export its public key.
+ *
+ * Entries are indexed like LoadedKeyCache's, by a digest of the hardware blob and the
+ * APPLICATION_ID and APPLICATION_DATA values the device required to export it.  The least recently
+ * used entries are discarded beyond max_entries.  All methods are internally locked.
+ */
+class HardwarePublicKeyCache {
+  public:
+    typedef LoadedKeyCache::Lookup Lookup;
+
+    explicit HardwarePublicKeyCache(size_t max_entries) : max_entries_(max_entries) {}
+
+    /**
+     * Returns a new reference to the cached public key for lookup, or null if there is none.  The
+     * caller owns the reference, and must not modify the key.
+     */
+    EVP_PKEY* Find(const Lookup& lookup);
+
+    /**
+     * Caches public_key for lookup, taking a new reference to it.
+     */
+    void Insert(const Lookup& lookup, EVP_PKEY* public_key);
+
+    /**
+     * Discards all entries for the hardware blob with the specified digest.
+     */
+    void Invalidate(const LoadedKeyCache::Digest& blob_digest);
+
+    void Clear();
+
+    size_t entry_count() const;
+
+  private:
+    struct Entry {
+        Lookup lookup;
+        std::unique_ptr<EVP_PKEY, EVP_PKEY_Delete> public_key;
+    };
+    typedef std::list<Entry> EntryList;
+
+    void Evict(EntryList::iterator entry);
+
+    const size_t max_entries_;
+
+    mutable std::mutex mutex_;
+    // Most recently used first.
+    EntryList entries_;
+    std::map<LoadedKeyCache::Digest, EntryList::iterator> index_;
+};
+
+}  // namespace keymaster
+
+#endif  // SYSTEM_KEYMASTER_HARDWARE_PUBLIC_KEY_CACHE_H_
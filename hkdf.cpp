@@ -18,16 +18,16 @@
 
 #include <new>
 
+#include <openssl/evp.h>
+#include <openssl/sha.h>
+
 #include <keymaster/android_keymaster_utils.h>
 
 #include "hmac.h"
 
 namespace keymaster {
 
-bool Rfc5869Sha256Kdf::GenerateKey(const uint8_t* info, size_t info_len, uint8_t* output,
-                                   size_t output_len) {
-    if (!is_initialized_ || output == nullptr)
-        return false;
+bool Rfc5869Sha256Kdf::Extract() {
     /**
      * Step 1. Extract: PRK = HMAC-SHA256(actual_salt, secret)
      * https://tools.ietf.org/html/rfc5869#section-2.2
@@ -47,12 +47,22 @@ bool Rfc5869Sha256Kdf::GenerateKey(const uint8_t* info, size_t info_len, uint8_t
     if (!result)
         return false;
 
-    UniquePtr<uint8_t[]> pseudo_random_key(new uint8_t[digest_size_]);
-    if (pseudo_random_key.get() == nullptr || digest_size_ != prk_hmac.DigestLength())
+    uint8_t pseudo_random_key[SHA256_DIGEST_LENGTH];
+    if (digest_size_ != prk_hmac.DigestLength() || digest_size_ != sizeof(pseudo_random_key))
         return false;
-    result =
-        prk_hmac.Sign(secret_key_.get(), secret_key_len_, pseudo_random_key.get(), digest_size_);
-    if (!result)
+    result = prk_hmac.Sign(secret_key_.get(), secret_key_len_, pseudo_random_key, digest_size_) &&
+             HMAC_Init_ex(&prk_ctx_, pseudo_random_key, digest_size_, EVP_sha256(),
+                          nullptr /* engine */);
+    memset_s(pseudo_random_key, 0, sizeof(pseudo_random_key));
+    prk_extracted_ = result;
+    return result;
+}
+
+bool Rfc5869Sha256Kdf::GenerateKey(const uint8_t* info, size_t info_len, uint8_t* output,
+                                   size_t output_len) {
+    if (!is_initialized_ || output == nullptr)
+        return false;
+    if (!prk_extracted_ && !Extract())
         return false;
 
     /**
@@ -63,34 +73,29 @@ bool Rfc5869Sha256Kdf::GenerateKey(const uint8_t* info, size_t info_len, uint8_t
     if (num_blocks >= 256u)
         return false;
 
-    UniquePtr<uint8_t[]> buf(new uint8_t[digest_size_ + info_len + 1]);
-    UniquePtr<uint8_t[]> digest(new uint8_t[digest_size_]);
-    if (buf.get() == nullptr || digest.get() == nullptr)
-        return false;
-    HmacSha256 hmac;
-    result = hmac.Init(pseudo_random_key.get(), digest_size_);
-    if (!result)
-        return false;
-
-    for (size_t i = 0; i < num_blocks; i++) {
-        size_t block_input_len = 0;
-        if (i != 0) {
-            memcpy(buf.get(), digest.get(), digest_size_);
-            block_input_len = digest_size_;
-        }
-        if (info != nullptr && info_len > 0)
-            memcpy(buf.get() + block_input_len, info, info_len);
-        block_input_len += info_len;
-        *(buf.get() + block_input_len++) = static_cast<uint8_t>(i + 1);
-        result = hmac.Sign(buf.get(), block_input_len, digest.get(), digest_size_);
+    uint8_t digest[SHA256_DIGEST_LENGTH];
+    HMAC_CTX ctx;
+    HMAC_CTX_init(&ctx);
+    bool result = true;
+    for (size_t i = 0; result && i < num_blocks; i++) {
+        // T(i + 1) = HMAC-SHA256(PRK, T(i) | info | i + 1), where T(0) is empty.
+        uint8_t counter = static_cast<uint8_t>(i + 1);
+        unsigned digest_len;
+        result = HMAC_CTX_copy_ex(&ctx, &prk_ctx_) &&
+                 (i == 0 || HMAC_Update(&ctx, digest, digest_size_)) &&
+                 (info == nullptr || info_len == 0 || HMAC_Update(&ctx, info, info_len)) &&
+                 HMAC_Update(&ctx, &counter, 1) &&  //
+                 HMAC_Final(&ctx, digest, &digest_len) && digest_len == digest_size_;
         if (!result)
-            return false;
+            break;
         size_t block_output_len = digest_size_ < output_len - i * digest_size_
                                       ? digest_size_
                                       : output_len - i * digest_size_;
-        memcpy(output + i * digest_size_, digest.get(), block_output_len);
+        memcpy(output + i * digest_size_, digest, block_output_len);
     }
-    return true;
+    HMAC_CTX_cleanup(&ctx);
+    memset_s(digest, 0, sizeof(digest));
+    return result;
 }
 
 }  // namespace keymaster
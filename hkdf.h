@@ -19,6 +19,8 @@
 
 #include "kdf.h"
 
+#include <openssl/hmac.h>
+
 #include <keymaster/serializable.h>
 
 #include <UniquePtr.h>
@@ -28,21 +30,33 @@ namespace keymaster {
 /**
  * Rfc5869Sha256Kdf implements the key derivation function specified in RFC 5869 (using SHA256) and
  * outputs key material, as needed by ECIES. See https://tools.ietf.org/html/rfc5869 for details.
+ *
+ * The extract step depends only on the secret and salt, so it's run by the first GenerateKey after
+ * Init, and further calls (e.g. for several subkeys with different info) only run expand.
  */
 class Rfc5869Sha256Kdf : public Kdf {
   public:
-    ~Rfc5869Sha256Kdf() {}
+    Rfc5869Sha256Kdf() : prk_extracted_(false) { HMAC_CTX_init(&prk_ctx_); }
+    ~Rfc5869Sha256Kdf() { HMAC_CTX_cleanup(&prk_ctx_); }
     bool Init(Buffer& secret, Buffer& salt) {
         return Init(secret.peek_read(), secret.available_read(), salt.peek_read(),
                     salt.available_read());
     }
 
     bool Init(const uint8_t* secret, size_t secret_len, const uint8_t* salt, size_t salt_len) {
+        prk_extracted_ = false;
         return Kdf::Init(KM_DIGEST_SHA_2_256, secret, secret_len, salt, salt_len);
     }
 
     bool GenerateKey(const uint8_t* info, size_t info_len, uint8_t* output,
                      size_t output_len) override;
+
+  private:
+    bool Extract();
+
+    // Once prk_extracted_, keyed with the pseudo-random key, ready to copy for each expand block.
+    HMAC_CTX prk_ctx_;
+    bool prk_extracted_;
 };
 
 }  // namespace keymaster
@@ -74,5 +74,25 @@ TEST(HkdfTest, Hkdf) {
     }
 }
 
+TEST(HkdfTest, RepeatedGenerateKey) {
+    // Later calls reuse the extracted PRK; each must match a freshly-initialized KDF's output.
+    Rfc5869Sha256Kdf hkdf;
+    for (auto& test : kHkdfTests) {
+        const string key = hex2str(test.key_hex);
+        const string salt = hex2str(test.salt_hex);
+        const string info = hex2str(test.info_hex);
+        const string expected = hex2str(test.output_hex);
+        ASSERT_TRUE(hkdf.Init(reinterpret_cast<const uint8_t*>(key.data()), key.size(),
+                              reinterpret_cast<const uint8_t*>(salt.data()), salt.size()));
+        for (int i = 0; i < 3; ++i) {
+            uint8_t output[128];
+            ASSERT_LE(expected.size(), sizeof(output));
+            ASSERT_TRUE(hkdf.GenerateKey(reinterpret_cast<const uint8_t*>(info.data()),
+                                         info.size(), output, expected.size()));
+            EXPECT_EQ(0, memcmp(output, expected.data(), expected.size()));
+        }
+    }
+}
+
 }  // namespace test
 }  // namespace keymaster
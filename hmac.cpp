@@ -17,6 +17,7 @@
 #include "hmac.h"
 
 #include <assert.h>
+#include <string.h>
 
 #include <openssl/evp.h>
 #include <openssl/hmac.h>
@@ -25,8 +26,52 @@
 
 #include <keymaster/android_keymaster_utils.h>
 
+#include "sha256_multibuffer.h"
+
 namespace keymaster {
 
+void ComputeHmacSha256KeySchedule(const uint8_t* key, size_t key_len,
+                                  HmacSha256KeySchedule* schedule) {
+    uint8_t block[kSha256BlockSize] = {};
+    if (key_len > kSha256BlockSize)
+        SHA256(key, key_len, block);
+    else
+        memcpy(block, key, key_len);
+
+    uint8_t pad[kSha256BlockSize];
+    for (size_t i = 0; i < kSha256BlockSize; ++i)
+        pad[i] = block[i] ^ 0x36;
+    memcpy(schedule->inner, kSha256InitialChainingValue, sizeof(schedule->inner));
+    Sha256Compress(schedule->inner, pad);
+    for (size_t i = 0; i < kSha256BlockSize; ++i)
+        pad[i] = block[i] ^ 0x5c;
+    memcpy(schedule->outer, kSha256InitialChainingValue, sizeof(schedule->outer));
+    Sha256Compress(schedule->outer, pad);
+
+    memset_s(block, 0, sizeof(block));
+    memset_s(pad, 0, sizeof(pad));
+}
+
+void HmacSha256Batch(const HmacSha256KeySchedule& schedule, size_t count,
+                     const uint8_t* const* data, const size_t* data_len, uint8_t* macs) {
+    for (size_t first = 0; first < count; first += kSha256Lanes) {
+        size_t lanes = count - first < kSha256Lanes ? count - first : kSha256Lanes;
+        uint8_t inner[kSha256Lanes * SHA256_DIGEST_LENGTH];
+        Sha256FinishMultiBuffer(schedule.inner, 1 /* ipad block */, lanes, data + first,
+                                data_len + first, inner);
+
+        const uint8_t* inner_data[kSha256Lanes];
+        size_t inner_len[kSha256Lanes];
+        for (size_t lane = 0; lane < lanes; ++lane) {
+            inner_data[lane] = inner + SHA256_DIGEST_LENGTH * lane;
+            inner_len[lane] = SHA256_DIGEST_LENGTH;
+        }
+        Sha256FinishMultiBuffer(schedule.outer, 1 /* opad block */, lanes, inner_data,
+                                inner_len, macs + SHA256_DIGEST_LENGTH * first);
+        memset_s(inner, 0, sizeof(inner));
+    }
+}
+
 size_t HmacSha256::DigestLength() const {
     return SHA256_DIGEST_LENGTH;
 }
@@ -44,6 +89,7 @@ bool HmacSha256::Init(const uint8_t* key, size_t key_len) {
     if (!key_.get()) {
         return false;
     }
+    ComputeHmacSha256KeySchedule(key, key_len, &key_schedule_);
     return true;
 }
 
@@ -69,6 +115,14 @@ bool HmacSha256::Sign(const uint8_t* data, size_t data_len, uint8_t* out_digest,
     return true;
 }
 
+bool HmacSha256::SignBatch(size_t count, const uint8_t* const* data, const size_t* data_len,
+                           uint8_t* digests) const {
+    if (!key_.get())
+        return false;
+    HmacSha256Batch(key_schedule_, count, data, data_len, digests);
+    return true;
+}
+
 bool HmacSha256::Verify(const Buffer& data, const Buffer& digest) const {
     return Verify(data.peek_read(), data.available_read(), digest.peek_read(),
                   digest.available_read());
@@ -21,6 +21,26 @@
 
 namespace keymaster {
 
+// HmacSha256KeySchedule holds the SHA-256 chaining values after an HMAC key's
+// inner (ipad) and outer (opad) blocks, which is all HMAC-SHA256 needs of the
+// key. It's plain data, so it can be copied cheaply.
+struct HmacSha256KeySchedule {
+    uint32_t inner[8];
+    uint32_t outer[8];
+};
+
+void ComputeHmacSha256KeySchedule(const uint8_t* key, size_t key_len,
+                                  HmacSha256KeySchedule* schedule);
+
+// HmacSha256Batch calculates the HMACs of |count| messages with the key
+// |schedule| was computed from, hashing several messages at once across SIMD
+// lanes where the platform has them (SSE2 or NEON), or one lane at a time
+// otherwise. The 32-byte HMAC of message |i| is written to |macs| + 32 * |i|.
+// Messages of similar lengths batch best; lanes whose messages run out early
+// sit idle until the longest message in their group is done.
+void HmacSha256Batch(const HmacSha256KeySchedule& schedule, size_t count,
+                     const uint8_t* const* data, const size_t* data_len, uint8_t* macs);
+
 // Only HMAC-SHA256 is supported.
 class HmacSha256 {
   public:
@@ -40,6 +60,12 @@ class HmacSha256 {
     bool Sign(const Buffer& data, uint8_t* digest, size_t digest_len) const;
     bool Sign(const uint8_t* data, size_t data_len, uint8_t* digest, size_t digest_len) const;
 
+    // SignBatch calculates the HMACs of |count| messages at once, as
+    // HmacSha256Batch does. |digests| must have room for |count| full
+    // digests.
+    bool SignBatch(size_t count, const uint8_t* const* data, const size_t* data_len,
+                   uint8_t* digests) const;
+
     // Verify returns true if |digest| is a valid HMAC of |data| using the key
     // supplied to Init. |digest| must be exactly |DigestLength()| bytes long.
     // Use of this method is strongly recommended over using Sign() with a manual
@@ -53,6 +79,7 @@ class HmacSha256 {
   private:
     UniquePtr<uint8_t[]> key_;
     size_t key_len_;
+    HmacSha256KeySchedule key_schedule_;
 };
 
 }  // namespace keymaster
@@ -22,6 +22,7 @@
 #include <openssl/rand.h>
 
 #include "hmac_operation.h"
+#include "openssl_err.h"
 
 namespace keymaster {
 
@@ -61,6 +62,41 @@ keymaster_error_t HmacKeyFactory::LoadKey(const KeymasterKeyBlob& key_material,
     return error;
 }
 
+HmacKey::HmacKey(const KeymasterKeyBlob& key_material, const AuthorizationSet& hw_enforced,
+                 const AuthorizationSet& sw_enforced, keymaster_error_t* error)
+    : SymmetricKey(key_material, hw_enforced, sw_enforced, error), key_schedule_md_(nullptr),
+      has_sha256_key_schedule_(false) {
+    HMAC_CTX_init(&key_schedule_);
+    if (*error != KM_ERROR_OK)
+        return;
+
+    keymaster_digest_t digest;
+    if (!authorizations().GetTagValue(TAG_DIGEST, &digest))
+        return;
+    const EVP_MD* md = HmacDigest(digest);
+    // If precomputation fails, operations just do it themselves.
+    if (md && HMAC_Init_ex(&key_schedule_, key_data(), key_data_size(), md, NULL /* engine */))
+        key_schedule_md_ = md;
+
+    if (digest == KM_DIGEST_SHA_2_256) {
+        ComputeHmacSha256KeySchedule(key_data(), key_data_size(), &sha256_key_schedule_);
+        has_sha256_key_schedule_ = true;
+    }
+}
+
+HmacKey::~HmacKey() {
+    HMAC_CTX_cleanup(&key_schedule_);
+    memset_s(&sha256_key_schedule_, 0, sizeof(sha256_key_schedule_));
+}
+
+keymaster_error_t HmacKey::InitializeContext(const EVP_MD* md, HMAC_CTX* ctx) const {
+    if (md == key_schedule_md_ && HMAC_CTX_copy_ex(ctx, &key_schedule_))
+        return KM_ERROR_OK;
+    if (!HMAC_Init_ex(ctx, key_data(), key_data_size(), md, NULL /* engine */))
+        return TranslateLastOpenSslError();
+    return KM_ERROR_OK;
+}
+
 keymaster_error_t HmacKeyFactory::validate_algorithm_specific_new_key_params(
     const AuthorizationSet& key_description) const {
     uint32_t min_mac_length_bits;
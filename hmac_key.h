@@ -17,6 +17,9 @@
 #ifndef SYSTEM_KEYMASTER_HMAC_KEY_H_
 #define SYSTEM_KEYMASTER_HMAC_KEY_H_
 
+#include <openssl/hmac.h>
+
+#include "hmac.h"
 #include "symmetric_key.h"
 
 namespace keymaster {
@@ -47,8 +50,32 @@ class HmacKeyFactory : public SymmetricKeyFactory {
 class HmacKey : public SymmetricKey {
   public:
     HmacKey(const KeymasterKeyBlob& key_material, const AuthorizationSet& hw_enforced,
-            const AuthorizationSet& sw_enforced, keymaster_error_t* error)
-        : SymmetricKey(key_material, hw_enforced, sw_enforced, error) {}
+            const AuthorizationSet& sw_enforced, keymaster_error_t* error);
+    ~HmacKey();
+
+    /**
+     * Initializes ctx, which must have been HMAC_CTX_init'd, ready to HMAC data with this key and
+     * md.  For the key's own digest this copies a key schedule (the ipad and opad compressions)
+     * computed when the key was loaded.
+     */
+    keymaster_error_t InitializeContext(const EVP_MD* md, HMAC_CTX* ctx) const;
+
+    /**
+     * The schedule for HmacSha256Batch, or null if the key's digest isn't SHA-256.
+     */
+    const HmacSha256KeySchedule* sha256_key_schedule() const {
+        return has_sha256_key_schedule_ ? &sha256_key_schedule_ : nullptr;
+    }
+
+  protected:
+    size_t object_size() const override { return sizeof(*this); }
+
+  private:
+    HMAC_CTX key_schedule_;
+    // Null if no schedule was precomputed.
+    const EVP_MD* key_schedule_md_;
+    HmacSha256KeySchedule sha256_key_schedule_;
+    bool has_sha256_key_schedule_;
 };
 
 }  // namespace keymaster
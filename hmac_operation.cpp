@@ -20,6 +20,7 @@
 
 #include <openssl/evp.h>
 #include <openssl/hmac.h>
+#include <openssl/sha.h>
 
 #include "hmac_key.h"
 #include "openssl_err.h"
@@ -65,10 +66,9 @@ Operation* HmacOperationFactory::CreateOperation(const Key& key,
         return nullptr;
     }
 
-    const SymmetricKey* symmetric_key = static_cast<const SymmetricKey*>(&key);
+    const HmacKey& hmac_key = static_cast<const HmacKey&>(key);
     UniquePtr<HmacOperation> op(new (std::nothrow) HmacOperation(
-        purpose(), symmetric_key->key_data(), symmetric_key->key_data_size(), digest,
-        mac_length_bits / 8, min_mac_length_bits / 8));
+        purpose(), hmac_key, digest, mac_length_bits / 8, min_mac_length_bits / 8));
     if (!op.get())
         *error = KM_ERROR_MEMORY_ALLOCATION_FAILED;
     else
@@ -88,37 +88,33 @@ const keymaster_digest_t* HmacOperationFactory::SupportedDigests(size_t* digest_
     return supported_digests;
 }
 
-HmacOperation::HmacOperation(keymaster_purpose_t purpose, const uint8_t* key_data,
-                             size_t key_data_size, keymaster_digest_t digest, size_t mac_length,
-                             size_t min_mac_length)
-    : Operation(purpose), error_(KM_ERROR_OK), mac_length_(mac_length),
-      min_mac_length_(min_mac_length) {
-    // Initialize CTX first, so dtor won't crash even if we error out later.
-    HMAC_CTX_init(&ctx_);
-
-    const EVP_MD* md = nullptr;
+const EVP_MD* HmacDigest(keymaster_digest_t digest) {
     switch (digest) {
     case KM_DIGEST_NONE:
     case KM_DIGEST_MD5:
-        error_ = KM_ERROR_UNSUPPORTED_DIGEST;
-        break;
+        return nullptr;
     case KM_DIGEST_SHA1:
-        md = EVP_sha1();
-        break;
+        return EVP_sha1();
     case KM_DIGEST_SHA_2_224:
-        md = EVP_sha224();
-        break;
+        return EVP_sha224();
     case KM_DIGEST_SHA_2_256:
-        md = EVP_sha256();
-        break;
+        return EVP_sha256();
     case KM_DIGEST_SHA_2_384:
-        md = EVP_sha384();
-        break;
+        return EVP_sha384();
     case KM_DIGEST_SHA_2_512:
-        md = EVP_sha512();
-        break;
+        return EVP_sha512();
     }
+    return nullptr;
+}
+
+HmacOperation::HmacOperation(keymaster_purpose_t purpose, const HmacKey& key,
+                             keymaster_digest_t digest, size_t mac_length, size_t min_mac_length)
+    : Operation(purpose), error_(KM_ERROR_OK), mac_length_(mac_length),
+      min_mac_length_(min_mac_length), batchable_(false), updated_(false) {
+    // Initialize CTX first, so dtor won't crash even if we error out later.
+    HMAC_CTX_init(&ctx_);
 
+    const EVP_MD* md = HmacDigest(digest);
     if (md == nullptr) {
         error_ = KM_ERROR_UNSUPPORTED_DIGEST;
         return;
@@ -135,11 +131,17 @@ HmacOperation::HmacOperation(keymaster_purpose_t purpose, const uint8_t* key_dat
         }
     }
 
-    HMAC_Init_ex(&ctx_, key_data, key_data_size, md, NULL /* engine */);
+    error_ = key.InitializeContext(md, &ctx_);
+
+    if (md == EVP_sha256() && key.sha256_key_schedule()) {
+        sha256_key_schedule_ = *key.sha256_key_schedule();
+        batchable_ = true;
+    }
 }
 
 HmacOperation::~HmacOperation() {
     HMAC_CTX_cleanup(&ctx_);
+    memset_s(&sha256_key_schedule_, 0, sizeof(sha256_key_schedule_));
 }
 
 keymaster_error_t HmacOperation::Begin(const AuthorizationSet& /* input_params */,
@@ -152,6 +154,7 @@ keymaster_error_t HmacOperation::Update(const AuthorizationSet& /* additional_pa
                                         Buffer* /* output */, size_t* input_consumed) {
     if (!HMAC_Update(&ctx_, input.peek_read(), input.available_read()))
         return TranslateLastOpenSslError();
+    updated_ = true;
     *input_consumed = input.available_read();
     return KM_ERROR_OK;
 }
@@ -171,7 +174,45 @@ keymaster_error_t HmacOperation::Finish(const AuthorizationSet& additional_param
     unsigned int digest_len;
     if (!HMAC_Final(&ctx_, digest, &digest_len))
         return TranslateLastOpenSslError();
+    return FinishWithDigest(digest, digest_len, signature, output);
+}
+
+void HmacOperation::FinishBatch(const AuthorizationSet& input_params, OperationBatchItem* items,
+                                size_t count) {
+    // Anything already fed to an HMAC_CTX has to be finished there.
+    bool batchable = batchable_;
+    for (size_t i = 0; batchable && i < count; ++i)
+        batchable = !static_cast<HmacOperation*>(items[i].operation)->updated_;
+    if (!batchable) {
+        Operation::FinishBatch(input_params, items, count);
+        return;
+    }
+
+    UniquePtr<const uint8_t*[]> data(new (std::nothrow) const uint8_t*[count]);
+    UniquePtr<size_t[]> data_len(new (std::nothrow) size_t[count]);
+    UniquePtr<uint8_t[]> macs(new (std::nothrow) uint8_t[count * SHA256_DIGEST_LENGTH]);
+    if (!data.get() || !data_len.get() || !macs.get()) {
+        for (size_t i = 0; i < count; ++i)
+            items[i].error = KM_ERROR_MEMORY_ALLOCATION_FAILED;
+        return;
+    }
+    for (size_t i = 0; i < count; ++i) {
+        data[i] = items[i].input->peek_read();
+        data_len[i] = items[i].input->available_read();
+    }
+
+    HmacSha256Batch(sha256_key_schedule_, count, data.get(), data_len.get(), macs.get());
+    for (size_t i = 0; i < count; ++i) {
+        HmacOperation* operation = static_cast<HmacOperation*>(items[i].operation);
+        items[i].error =
+            operation->FinishWithDigest(macs.get() + i * SHA256_DIGEST_LENGTH,
+                                        SHA256_DIGEST_LENGTH, *items[i].signature, items[i].output);
+    }
+    memset_s(macs.get(), 0, count * SHA256_DIGEST_LENGTH);
+}
 
+keymaster_error_t HmacOperation::FinishWithDigest(const uint8_t* digest, size_t digest_len,
+                                                  const Buffer& signature, Buffer* output) {
     switch (purpose()) {
     case KM_PURPOSE_SIGN:
         if (mac_length_ > digest_len)
@@ -21,12 +21,21 @@
 
 #include <openssl/hmac.h>
 
+#include "hmac.h"
+
 namespace keymaster {
 
+class HmacKey;
+
+/**
+ * Returns the OpenSSL digest to use for HMAC with digest, or null if it isn't supported.
+ */
+const EVP_MD* HmacDigest(keymaster_digest_t digest);
+
 class HmacOperation : public Operation {
   public:
-    HmacOperation(keymaster_purpose_t purpose, const uint8_t* key_data, size_t key_data_size,
-                  keymaster_digest_t digest, size_t mac_length, size_t min_mac_length);
+    HmacOperation(keymaster_purpose_t purpose, const HmacKey& key, keymaster_digest_t digest,
+                  size_t mac_length, size_t min_mac_length);
     ~HmacOperation();
 
     virtual keymaster_error_t Begin(const AuthorizationSet& input_params,
@@ -39,13 +48,29 @@ class HmacOperation : public Operation {
                                      const Buffer& signature, AuthorizationSet* output_params,
                                      Buffer* output);
 
+    /**
+     * Computes HMAC-SHA256 MACs for operations that haven't been updated with HmacSha256Batch,
+     * finishing any others one at a time.
+     */
+    void FinishBatch(const AuthorizationSet& input_params, OperationBatchItem* items,
+                     size_t count) override;
+
     keymaster_error_t error() { return error_; }
 
   private:
+    size_t object_size() const override { return sizeof(*this); }
+
+    keymaster_error_t FinishWithDigest(const uint8_t* digest, size_t digest_len,
+                                       const Buffer& signature, Buffer* output);
+
     HMAC_CTX ctx_;
     keymaster_error_t error_;
     const size_t mac_length_;
     const size_t min_mac_length_;
+    HmacSha256KeySchedule sha256_key_schedule_;
+    // True if sha256_key_schedule_ is set and FinishBatch can use it.
+    bool batchable_;
+    bool updated_;
 };
 
 /**
@@ -80,5 +80,69 @@ TEST(HmacTest, SHA256) {
     }
 }
 
+TEST(HmacTest, SignBatchMatchesSign) {
+    // Short and longer-than-block keys, and enough messages of mixed lengths (including ones whose
+    // padding spills into an extra block) to fill some lanes and leave others idle.
+    const string keys[] = {"short key", string(100, 'k')};
+    for (const string& key : keys) {
+        HmacSha256 hmac;
+        ASSERT_TRUE(hmac.Init(reinterpret_cast<const uint8_t*>(key.data()), key.size()));
+
+        for (size_t count = 1; count <= 9; ++count) {
+            string messages[9];
+            const uint8_t* data[9];
+            size_t data_len[9];
+            for (size_t i = 0; i < count; ++i) {
+                messages[i] = string(i * 23 + count, static_cast<char>('a' + i));
+                data[i] = reinterpret_cast<const uint8_t*>(messages[i].data());
+                data_len[i] = messages[i].size();
+            }
+            uint8_t digests[9 * 32];
+            ASSERT_TRUE(hmac.SignBatch(count, data, data_len, digests));
+
+            for (size_t i = 0; i < count; ++i) {
+                uint8_t digest[32];
+                ASSERT_TRUE(hmac.Sign(data[i], data_len[i], digest, sizeof(digest)));
+                EXPECT_EQ(0, memcmp(digest, digests + 32 * i, sizeof(digest)))
+                    << count << " messages, message " << i;
+            }
+        }
+    }
+}
+
+TEST(HmacTest, SignBatchAllLengths) {
+    HmacSha256 hmac;
+    const string key = hex2str(kHmacTests[1].key);
+    ASSERT_TRUE(hmac.Init(reinterpret_cast<const uint8_t*>(key.data()), key.size()));
+
+    string message(200, 'x');
+    for (size_t len = 0; len <= message.size(); ++len) {
+        const uint8_t* data = reinterpret_cast<const uint8_t*>(message.data());
+        uint8_t batch_digest[32];
+        uint8_t digest[32];
+        ASSERT_TRUE(hmac.SignBatch(1, &data, &len, batch_digest));
+        ASSERT_TRUE(hmac.Sign(data, len, digest, sizeof(digest)));
+        EXPECT_EQ(0, memcmp(digest, batch_digest, sizeof(digest))) << "length " << len;
+    }
+}
+
+TEST(HmacTest, SignBatchVectors) {
+    const uint8_t* data[2];
+    size_t data_len[2];
+    for (size_t i = 0; i < 2; i++) {
+        data[i] = reinterpret_cast<const uint8_t*>(kHmacTests[i].data);
+        data_len[i] = strlen(kHmacTests[i].data);
+    }
+    for (size_t i = 0; i < 2; i++) {
+        const string key = hex2str(kHmacTests[i].key);
+        HmacSha256KeySchedule schedule;
+        ComputeHmacSha256KeySchedule(reinterpret_cast<const uint8_t*>(key.data()), key.size(),
+                                     &schedule);
+        uint8_t macs[2 * 32];
+        HmacSha256Batch(schedule, 2, data, data_len, macs);
+        EXPECT_EQ(0, memcmp(kHmacTests[i].digest, macs + 32 * i, 32));
+    }
+}
+
 }  // namespace test
 }  // namespace keymaster
@@ -0,0 +1,47 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "imported_token_set.h"
+
+namespace keymaster {
+
+keymaster_error_t ImportedTokenSet::Insert(const TokenId& id, uint64_t now, uint32_t lifetime) {
+    std::lock_guard<CountingMutex> lock(mutex_);
+    Expire(now);
+    if (expiries_.count(id))
+        return KM_ERROR_INVALID_ARGUMENT;
+    if (expiries_.size() >= max_tokens_)
+        return KM_ERROR_TOO_MANY_OPERATIONS;
+
+    uint64_t expiry = now + lifetime;
+    expiries_[id] = expiry;
+    by_expiry_.insert(std::make_pair(expiry, id));
+    return KM_ERROR_OK;
+}
+
+size_t ImportedTokenSet::size() const {
+    std::lock_guard<CountingMutex> lock(mutex_);
+    return expiries_.size();
+}
+
+void ImportedTokenSet::Expire(uint64_t now) {
+    while (!by_expiry_.empty() && by_expiry_.begin()->first < now) {
+        expiries_.erase(by_expiry_.begin()->second);
+        by_expiry_.erase(by_expiry_.begin());
+    }
+}
+
+}  // namespace keymaster
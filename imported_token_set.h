@@ -0,0 +1,72 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SYSTEM_KEYMASTER_IMPORTED_TOKEN_SET_H_
+#define SYSTEM_KEYMASTER_IMPORTED_TOKEN_SET_H_
+
+#include <stdint.h>
+
+#include <array>
+#include <map>
+#include <mutex>
+#include <set>
+#include <utility>
+
+#include <hardware/keymaster_defs.h>
+
+#include <keymaster/lock_statistics.h>
+
+namespace keymaster {
+
+/**
+ * ImportedTokenSet records the operation state tokens ImportOperation has accepted, by the random
+ * ID sealed into each, so that each token is imported at most once by the keymasters sharing the
+ * set.  A token is remembered for as long as the importer would otherwise still accept it, and
+ * then forgotten.  The set holds at most max_tokens at a time; it never forgets a token early to
+ * make room, but refuses new ones until some expire.  All methods are internally locked.
+ */
+class ImportedTokenSet {
+  public:
+    typedef std::array<uint8_t, 16> TokenId;
+
+    explicit ImportedTokenSet(size_t max_tokens) : max_tokens_(max_tokens) {}
+
+    /**
+     * Records the token with the specified ID, received at now, for lifetime seconds.  Returns
+     * KM_ERROR_INVALID_ARGUMENT if the token is already recorded, and KM_ERROR_TOO_MANY_OPERATIONS
+     * if max_tokens unexpired tokens are.  Times are in seconds on the importer's monotonic clock.
+     */
+    keymaster_error_t Insert(const TokenId& id, uint64_t now, uint32_t lifetime);
+
+    size_t size() const;
+
+    LockStatistics lock_statistics() const { return mutex_.statistics(); }
+
+  private:
+    // Forgets the tokens whose lifetimes have passed by now.
+    void Expire(uint64_t now);
+
+    const size_t max_tokens_;
+
+    mutable CountingMutex mutex_;
+    std::map<TokenId, uint64_t> expiries_;
+    // The same tokens ordered by expiry, so that Expire stops at the first it keeps.
+    std::set<std::pair<uint64_t, TokenId>> by_expiry_;
+};
+
+}  // namespace keymaster
+
+#endif  // SYSTEM_KEYMASTER_IMPORTED_TOKEN_SET_H_
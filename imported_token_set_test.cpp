@@ -0,0 +1,62 @@
+/*
+ * Copyright 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "imported_token_set.h"
+
+#include <gtest/gtest.h>
+
+namespace keymaster {
+namespace test {
+
+static ImportedTokenSet::TokenId MakeTokenId(uint8_t byte) {
+    ImportedTokenSet::TokenId id;
+    id.fill(byte);
+    return id;
+}
+
+TEST(ImportedTokenSetTest, AcceptsEachTokenOnce) {
+    ImportedTokenSet tokens(4);
+    EXPECT_EQ(KM_ERROR_OK, tokens.Insert(MakeTokenId(1), 10, 60));
+    EXPECT_EQ(KM_ERROR_INVALID_ARGUMENT, tokens.Insert(MakeTokenId(1), 10, 60));
+    EXPECT_EQ(KM_ERROR_INVALID_ARGUMENT, tokens.Insert(MakeTokenId(1), 20, 60));
+    EXPECT_EQ(KM_ERROR_OK, tokens.Insert(MakeTokenId(2), 10, 60));
+    EXPECT_EQ(2U, tokens.size());
+}
+
+TEST(ImportedTokenSetTest, ForgetsTokensWhenTheirLifetimesPass) {
+    ImportedTokenSet tokens(4);
+    EXPECT_EQ(KM_ERROR_OK, tokens.Insert(MakeTokenId(1), 10, 5));
+    EXPECT_EQ(KM_ERROR_OK, tokens.Insert(MakeTokenId(2), 10, 50));
+    EXPECT_EQ(KM_ERROR_INVALID_ARGUMENT, tokens.Insert(MakeTokenId(1), 15, 5));
+    EXPECT_EQ(KM_ERROR_OK, tokens.Insert(MakeTokenId(1), 16, 5));
+    EXPECT_EQ(KM_ERROR_INVALID_ARGUMENT, tokens.Insert(MakeTokenId(2), 16, 50));
+    EXPECT_EQ(2U, tokens.size());
+}
+
+TEST(ImportedTokenSetTest, RefusesNewTokensWhenFull) {
+    ImportedTokenSet tokens(2);
+    EXPECT_EQ(KM_ERROR_OK, tokens.Insert(MakeTokenId(1), 10, 5));
+    EXPECT_EQ(KM_ERROR_OK, tokens.Insert(MakeTokenId(2), 10, 50));
+
+    // Nothing is forgotten early to make room, so no earlier token can come back.
+    EXPECT_EQ(KM_ERROR_TOO_MANY_OPERATIONS, tokens.Insert(MakeTokenId(3), 12, 60));
+    EXPECT_EQ(KM_ERROR_INVALID_ARGUMENT, tokens.Insert(MakeTokenId(1), 12, 5));
+    EXPECT_EQ(KM_ERROR_OK, tokens.Insert(MakeTokenId(3), 16, 60));
+    EXPECT_EQ(KM_ERROR_INVALID_ARGUMENT, tokens.Insert(MakeTokenId(2), 16, 50));
+}
+
+}  // namespace test
+}  // namespace keymaster
@@ -0,0 +1,93 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SYSTEM_KEYMASTER_ALLOCATION_COUNTER_H_
+#define SYSTEM_KEYMASTER_ALLOCATION_COUNTER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace keymaster {
+
+/**
+ * AllocationCounter counts the heap allocations made on the calling thread by keymaster's own
+ * containers (AuthorizationSet, Buffer, KeymasterKeyBlob, dup_buffer, dup_array and the message
+ * item arrays) from its construction until its destruction.  Allocations made by BoringSSL or the
+ * standard library aren't seen.
+ *
+ * Counters nest: an allocation is counted by the innermost counter, which adds its counts to the
+ * enclosing one when it is destroyed.
+ *
+ * Counting is compiled in only if KEYMASTER_ALLOCATION_COUNTING is defined; otherwise the counts
+ * stay zero and Count costs nothing.
+ */
+class AllocationCounter {
+  public:
+    AllocationCounter() : enclosing_(nullptr), allocations_(0), bytes_(0) {
+#ifdef KEYMASTER_ALLOCATION_COUNTING
+        enclosing_ = current();
+        current() = this;
+#endif
+    }
+
+    ~AllocationCounter() {
+#ifdef KEYMASTER_ALLOCATION_COUNTING
+        current() = enclosing_;
+        if (enclosing_) {
+            enclosing_->allocations_ += allocations_;
+            enclosing_->bytes_ += bytes_;
+        }
+#endif
+    }
+
+    uint64_t allocations() const { return allocations_; }
+    uint64_t bytes() const { return bytes_; }
+
+    /**
+     * Counts an allocation of the specified size, if a counter is active on the calling thread.
+     */
+    static void Count(size_t bytes) {
+#ifdef KEYMASTER_ALLOCATION_COUNTING
+        AllocationCounter* counter = current();
+        if (counter) {
+            ++counter->allocations_;
+            counter->bytes_ += bytes;
+        }
+#else
+        (void)bytes;
+#endif
+    }
+
+  private:
+#ifdef KEYMASTER_ALLOCATION_COUNTING
+    static AllocationCounter*& current() {
+        static thread_local AllocationCounter* counter = nullptr;
+        return counter;
+    }
+#endif
+
+    // Disallow copying and assignment.
+    AllocationCounter(const AllocationCounter&);
+    void operator=(const AllocationCounter&);
+
+    AllocationCounter* enclosing_;
+    uint64_t allocations_;
+    uint64_t bytes_;
+};
+
+}  // namespace keymaster
+
+#endif  // SYSTEM_KEYMASTER_ALLOCATION_COUNTER_H_
@@ -17,15 +17,30 @@
 #ifndef SYSTEM_KEYMASTER_ANDROID_KEYMASTER_H_
 #define SYSTEM_KEYMASTER_ANDROID_KEYMASTER_H_
 
+#include <array>
+#include <memory>
+
 #include <keymaster/android_keymaster_messages.h>
 #include <keymaster/authorization_set.h>
+#include <keymaster/keymaster_enforcement.h>
+#include <keymaster/lock_statistics.h>
 
 namespace keymaster {
 
+class ChunkSizeAdvisor;
+class ImportedTokenSet;
 class Key;
 class KeyFactory;
+struct KeyBlobFingerprint;
 class KeymasterContext;
-class OperationTable;
+class KeyWarmer;
+class LatencyStatistics;
+class LoadedKeyCache;
+struct LoadedKey;
+class Operation;
+class PinnedKeyTable;
+class RequestRecorder;
+class ShardedOperationTable;
 
 /**
  * This is the reference implementation of Keymaster.  In addition to acting as a reference for
@@ -48,6 +63,8 @@ class OperationTable;
 class AndroidKeymaster {
   public:
     AndroidKeymaster(KeymasterContext* context, size_t operation_table_size);
+    // Takes ownership of operation_table, which allows the caller to choose its full policy.
+    AndroidKeymaster(KeymasterContext* context, ShardedOperationTable* operation_table);
     virtual ~AndroidKeymaster();
 
     void GetVersion(const GetVersionRequest& request, GetVersionResponse* response);
@@ -66,29 +83,258 @@ class AndroidKeymaster {
 
     void AddRngEntropy(const AddEntropyRequest& request, AddEntropyResponse* response);
     void GenerateKey(const GenerateKeyRequest& request, GenerateKeyResponse* response);
+    // Generates a key for each description of the request, as GenerateKey would, spreading them
+    // over up to generation_thread_count() threads.  Per-key failures are reported in the response
+    // items.
+    void GenerateKeys(const GenerateKeysRequest& request, GenerateKeysResponse* response);
     void GetKeyCharacteristics(const GetKeyCharacteristicsRequest& request,
                                GetKeyCharacteristicsResponse* response);
+    // Returns the characteristics of each blob of the request, as GetKeyCharacteristics would,
+    // parsing the blobs that aren't cached in one call to the context.  Per-blob failures are
+    // reported in the response items.
+    void BatchGetKeyCharacteristics(const BatchGetKeyCharacteristicsRequest& request,
+                                    BatchGetKeyCharacteristicsResponse* response);
     void ImportKey(const ImportKeyRequest& request, ImportKeyResponse* response);
     void ExportKey(const ExportKeyRequest& request, ExportKeyResponse* response);
     void AttestKey(const AttestKeyRequest& request, AttestKeyResponse* response);
+    // Attests each blob of the request, as AttestKey would, loading each attestation key and its
+    // chain once for the whole batch and signing the certificates on up to
+    // attestation_thread_count() threads.  Per-blob failures are reported in the response items.
+    void BatchAttestKey(const BatchAttestKeyRequest& request, BatchAttestKeyResponse* response);
     void UpgradeKey(const UpgradeKeyRequest& request, UpgradeKeyResponse* response);
+    // Upgrades each blob of the request, as UpgradeKey would, spreading them over up to
+    // upgrade_thread_count() threads.  Per-blob failures are reported in the response items.
+    void BatchUpgradeKey(const BatchUpgradeKeyRequest& request, BatchUpgradeKeyResponse* response);
+    // Re-wraps a blob in a legacy format into the current one, so that keystore can replace it
+    // once, in the background, rather than paying for the legacy parse on every use.  Blobs
+    // already current get an empty migrated_key.
+    void MigrateKey(const MigrateKeyRequest& request, MigrateKeyResponse* response);
     void DeleteKey(const DeleteKeyRequest& request, DeleteKeyResponse* response);
+    // Deletes each blob of the request, as DeleteKey would, handing them all to the context at
+    // once.  Per-blob failures are reported in the response items.
+    void BatchDeleteKey(const BatchDeleteKeyRequest& request, BatchDeleteKeyResponse* response);
     void DeleteAllKeys(const DeleteAllKeysRequest& request, DeleteAllKeysResponse* response);
+    // Loads a key once and returns a handle that BeginOperationRequest::key_handle can use in place
+    // of the blob, until the key is unpinned or deleted.
+    void PinKey(const PinKeyRequest& request, PinKeyResponse* response);
+    void UnpinKey(const UnpinKeyRequest& request, UnpinKeyResponse* response);
+    // Queues each blob of the request to be loaded into the key cache with its parameters, and its
+    // library key objects built, on a low-priority background thread, and returns without waiting,
+    // so that a keymaster that has just started can warm its cache with the keys it expects to be
+    // used.  Failures to load are logged and otherwise ignored.
+    void WarmupKeys(const WarmupKeysRequest& request, WarmupKeysResponse* response);
     void BeginOperation(const BeginOperationRequest& request, BeginOperationResponse* response);
     void UpdateOperation(const UpdateOperationRequest& request, UpdateOperationResponse* response);
+    // Feeds associated data to an AEAD operation.  Keys that need an auth token for each update
+    // must send it with UpdateOperation instead.
+    void UpdateAad(const UpdateAadRequest& request, UpdateAadResponse* response);
     void FinishOperation(const FinishOperationRequest& request, FinishOperationResponse* response);
     void AbortOperation(const AbortOperationRequest& request, AbortOperationResponse* response);
+    // Begins and finishes an operation in one call, without entering it in the operation table.
+    // Keys that require per-operation authentication can't be used, since there is no operation
+    // handle for the auth token to be bound to.
+    void OneShotOperation(const OneShotOperationRequest& request,
+                          OneShotOperationResponse* response);
+    // Runs a one-shot operation on each item of the request, loading and authorizing the key once
+    // for the whole batch.  Per-item failures are reported in the response items.
+    void BatchOperation(const BatchOperationRequest& request, BatchOperationResponse* response);
+    // Removes an operation from the operation table and returns its state in a sealed token, with
+    // which ImportOperation, on this or another keymaster whose context can unseal it, carries on
+    // where the operation left off.  Only some operations can be exported, and only at some points;
+    // those that can't be are left as they were.  Requires operation migration to be enabled.
+    void ExportOperation(const ExportOperationRequest& request, ExportOperationResponse* response);
+    // Enters an exported operation under a new handle, authorizing it as BeginOperation would.
+    // The key blob must be the one the operation was begun with.  Since every import of a token
+    // would carry on from the same point, each is accepted once per sealing domain: the keymasters
+    // that share a record of imported tokens through ShareImportedTokens.  Importing it again in
+    // the domain fails with KM_ERROR_INVALID_ARGUMENT, as does importing it once its maximum age
+    // (see set_operation_token_max_age) has passed.  Keymasters that can unseal each other's tokens
+    // but don't share the record each accept a token once.
+    void ImportOperation(const ImportOperationRequest& request, ImportOperationResponse* response);
+    // Returns the latency histograms of the key and operation commands recorded so far, if built
+    // with KEYMASTER_LATENCY_STATISTICS.
+    void GetStatistics(const GetStatisticsRequest& request, GetStatisticsResponse* response);
+
+    // Returns the statistics of the operation table's, key cache's and pinned key table's locks,
+    // if built with KEYMASTER_LOCK_STATISTICS.  Any of the pointers may be null.
+    void GetLockStatistics(LockStatistics* operation_table, LockStatistics* key_cache,
+                           LockStatistics* pinned_keys) const;
 
     bool has_operation(keymaster_operation_handle_t op_handle) const;
 
+    // Waits until the keys queued by WarmupKeys have all been loaded.
+    void WaitForKeyWarmup();
+
+    // Shows each key and operation request, and its response, to recorder, or stops recording if
+    // recorder is null.  Doesn't take ownership.  Must not be called while requests are handled.
+    void set_recorder(RequestRecorder* recorder) { recorder_ = recorder; }
+
+    // Sets the number of threads, including the calling thread, BatchUpgradeKey may use.  The
+    // default is 1, which upgrades all blobs on the calling thread; 0 is treated as 1.  Must not be
+    // called while requests are handled.
+    void set_upgrade_thread_count(size_t thread_count) { upgrade_thread_count_ = thread_count; }
+    size_t upgrade_thread_count() const { return upgrade_thread_count_; }
+
+    // Likewise for GenerateKeys.  The key factories must be safe to call concurrently; the
+    // software ones are.
+    void set_generation_thread_count(size_t thread_count) {
+        generation_thread_count_ = thread_count;
+    }
+    size_t generation_thread_count() const { return generation_thread_count_; }
+
+    // Likewise for BatchAttestKey.
+    void set_attestation_thread_count(size_t thread_count) {
+        attestation_thread_count_ = thread_count;
+    }
+    size_t attestation_thread_count() const { return attestation_thread_count_; }
+
+    // If enabled, BeginOperation and OneShotOperation don't fail with
+    // KM_ERROR_KEY_REQUIRES_UPGRADE; they upgrade the blob, carry on with the upgraded key and
+    // return the new blob in the response's output_params as TAG_UPGRADED_KEY_BLOB, which the
+    // caller should store in place of the old one.  Other commands, and keys used through a key
+    // handle, still report the error.  Disabled by default.  Must not be called while requests
+    // are handled.
+    void set_upgrade_keys_on_use(bool enabled) { upgrade_keys_on_use_ = enabled; }
+    bool upgrade_keys_on_use() const { return upgrade_keys_on_use_; }
+
+    // Limits the memory held by in-progress operations, as counted by
+    // Operation::memory_footprint(), to bytes.  A BeginOperation whose operation would take the
+    // total over the budget fails with KM_ERROR_TOO_MANY_OPERATIONS, unless evict_to_fit is set,
+    // in which case the least-recently-used idle operations are discarded to make room.  Operations
+    // are checked against the budget only as they begin, and concurrent begins may together
+    // overshoot it slightly.  Zero, the default, sets no limit.  Must not be called while requests
+    // are handled.
+    void set_operation_memory_budget(size_t bytes, bool evict_to_fit) {
+        operation_memory_budget_ = bytes;
+        evict_to_fit_budget_ = evict_to_fit;
+    }
+    size_t operation_memory_budget() const { return operation_memory_budget_; }
+    // The memory currently held by in-progress operations.
+    size_t operation_memory() const;
+
+    // Discards operations that go unused for more than seconds, as measured by the context's
+    // GetMonotonicSeconds(), so that callers that never finish or abort them don't fill the
+    // operation table.  Operations are reaped as later commands arrive.  Zero, the default, keeps
+    // them until they're evicted.  Must be called before the first BeginOperation.
+    void set_operation_idle_timeout(uint32_t seconds);
+
+    // If enabled, BeginOperation enters each operation in the operation table shard for the
+    // calling thread's CPU, where there's room, rather than in a random one, so that threads
+    // pinned to different CPUs rarely contend for a shard's lock.  Disabled by default.  Must be
+    // called before the first BeginOperation.
+    void set_operation_cpu_affinity(bool enabled);
+
+    // Enables ExportOperation and ImportOperation, which otherwise fail with
+    // KM_ERROR_UNIMPLEMENTED.  Keymasters that import each other's operations must share the
+    // context's key-encryption key.  Disabled by default.  Must not be called while requests are
+    // handled.
+    void set_operation_migration(bool enabled) { operation_migration_ = enabled; }
+    bool operation_migration() const { return operation_migration_; }
+
+    // The longest after its export, as measured by the context's GetWallClockSeconds(), that a
+    // token ExportOperation returns may be imported.  The age is sealed into the token, and the
+    // importer refuses it once that much time has passed on its own clock, or if it appears to
+    // come from that far in the future, so keymasters exchanging tokens need clocks that agree to
+    // well within it.  Defaults to five minutes.  Must not be called while requests are handled.
+    void set_operation_token_max_age(uint32_t seconds) { operation_token_max_age_ = seconds; }
+    uint32_t operation_token_max_age() const { return operation_token_max_age_; }
+
+    // Makes this keymaster and other one sealing domain, in which each operation token is imported
+    // at most once, by sharing other's record of imported tokens.  Must be called before the first
+    // ImportOperation.
+    void ShareImportedTokens(const AndroidKeymaster& other);
+
+    // If enabled, BeginOperation returns in the response's output_params the input length each
+    // UpdateOperation should be given, as TAG_PREFERRED_CHUNK_SIZE, and the most any one call can
+    // usefully take, as TAG_MAX_CHUNK_SIZE, if the operation has a limit.  The preferred size
+    // starts from the operation's own and is refined from the times updates of operations with
+    // the same algorithm and purpose have taken, so that the per-call overhead is a small part of
+    // each update.  Disabled by default.  Must not be called while requests are handled.
+    void set_chunk_size_hints(bool enabled) { chunk_size_hints_ = enabled; }
+    bool chunk_size_hints() const { return chunk_size_hints_; }
+
   private:
+    // Parses and loads key_blob, or returns the cached result of an earlier load of the same blob
+    // with the same application ID and data.  fingerprint must have been computed from key_blob
+    // and additional_params.
     keymaster_error_t LoadKey(const keymaster_key_blob_t& key_blob,
+                              const KeyBlobFingerprint& fingerprint,
                               const AuthorizationSet& additional_params,
-                              AuthorizationSet* hw_enforced, AuthorizationSet* sw_enforced,
-                              const KeyFactory** factory, UniquePtr<Key>* key);
+                              std::shared_ptr<const LoadedKey>* loaded_key);
+    // Loads key_blob into the key cache and warms up the key.  Called on the key warmer's thread.
+    void WarmupKey(const KeymasterKeyBlob& key_blob, const AuthorizationSet& additional_params);
+    // Loads the key for a new operation from key_blob, or finds it pinned under key_handle if that
+    // is nonzero, and returns its enforcement key ID and the SHA-256 digest of the blob it was
+    // loaded from.  If upgraded_key is non-null and keys are upgraded on use, a blob that requires
+    // upgrading is upgraded into *upgraded_key and the upgraded key is loaded instead.
+    keymaster_error_t LoadOperationKey(uint64_t key_handle, const keymaster_key_blob_t& key_blob,
+                                       const AuthorizationSet& additional_params,
+                                       std::shared_ptr<const LoadedKey>* loaded_key,
+                                       km_id_t* key_id, std::array<uint8_t, 32>* blob_digest,
+                                       KeymasterKeyBlob* upgraded_key);
+    // Adds upgraded_key to output_params as TAG_UPGRADED_KEY_BLOB, if it's set.
+    keymaster_error_t AddUpgradedKey(const KeymasterKeyBlob& upgraded_key,
+                                     AuthorizationSet* output_params) const;
+    // Creates an operation with loaded_key, authorizing it if authorize is true, without beginning
+    // it.
+    keymaster_error_t NewOperation(keymaster_purpose_t purpose, const LoadedKey& loaded_key,
+                                   km_id_t key_id, const AuthorizationSet& additional_params,
+                                   bool authorize, UniquePtr<Operation>* operation);
+    // Creates and begins an operation with loaded_key, authorizing it first if authorize is true.
+    keymaster_error_t CreateOperation(keymaster_purpose_t purpose, const LoadedKey& loaded_key,
+                                      km_id_t key_id, const AuthorizationSet& additional_params,
+                                      bool authorize, AuthorizationSet* output_params,
+                                      UniquePtr<Operation>* operation);
+    // Adds TAG_PREFERRED_CHUNK_SIZE, and TAG_MAX_CHUNK_SIZE if it has a limit, for operation,
+    // whose authorizations must have been set, to output_params.
+    keymaster_error_t AddChunkSizeHints(const Operation& operation,
+                                        AuthorizationSet* output_params) const;
+    // Checks that an authorized operation can run without an operation handle.
+    keymaster_error_t CheckOneShotAuthorization(const Operation& operation) const;
+    // Finishes a one-shot operation, adding any output parameters to those from Begin.
+    keymaster_error_t FinishOneShotOperation(Operation* operation,
+                                             const AuthorizationSet& additional_params,
+                                             const Buffer& input, const Buffer& signature,
+                                             AuthorizationSet* output_params, Buffer* output);
+    // Checkpoints operation and seals its state, with what's needed to recreate it, into token.
+    keymaster_error_t SealOperation(const Operation& operation, KeymasterKeyBlob* token) const;
+    keymaster_error_t GenerateKeyBlob(const AuthorizationSet& key_description,
+                                      KeymasterKeyBlob* key_blob, AuthorizationSet* enforced,
+                                      AuthorizationSet* unenforced) const;
+    // Discards operations that have exceeded the operation table's idle timeout, if one is set.
+    void ReapIdleOperations();
+    // Acquires the operation for the calling thread, setting *error to
+    // KM_ERROR_CONCURRENT_ACCESS_CONFLICT if another thread holds it, or to
+    // KM_ERROR_INVALID_OPERATION_HANDLE if there's no such operation.
+    Operation* AcquireOperation(keymaster_operation_handle_t op_handle, keymaster_error_t* error);
+    // Makes room for operation within the operation memory budget, if one is set.
+    keymaster_error_t FitOperationInBudget(const Operation& operation);
 
     UniquePtr<KeymasterContext> context_;
-    UniquePtr<OperationTable> operation_table_;
+    // Declared after context_, since cached keys may refer to engines the context owns.
+    UniquePtr<LoadedKeyCache> key_cache_;
+    UniquePtr<PinnedKeyTable> pinned_keys_;
+    // The operation table is internally locked, so UpdateOperation, FinishOperation and
+    // AbortOperation may be called concurrently for different operations.  A call for an operation
+    // that another thread is using fails with KM_ERROR_CONCURRENT_ACCESS_CONFLICT.
+    UniquePtr<ShardedOperationTable> operation_table_;
+    // Null unless built with KEYMASTER_LATENCY_STATISTICS.
+    UniquePtr<LatencyStatistics> statistics_;
+    UniquePtr<ChunkSizeAdvisor> chunk_size_advisor_;
+    // The tokens ImportOperation has accepted, shared by the keymasters of a sealing domain.
+    std::shared_ptr<ImportedTokenSet> imported_tokens_;
+    RequestRecorder* recorder_;
+    size_t upgrade_thread_count_;
+    size_t generation_thread_count_;
+    size_t attestation_thread_count_;
+    bool upgrade_keys_on_use_;
+    size_t operation_memory_budget_;
+    bool evict_to_fit_budget_;
+    bool operation_migration_;
+    uint32_t operation_token_max_age_;
+    bool chunk_size_hints_;
+    // Declared last, so that its thread stops before anything the thread uses is destroyed.
+    UniquePtr<KeyWarmer> key_warmer_;
 };
 
 }  // namespace keymaster
@@ -46,6 +46,23 @@ enum AndroidKeymasterCommand {
     GET_KEY_CHARACTERISTICS = 15,
     ATTEST_KEY = 16,
     UPGRADE_KEY = 17,
+    PIN_KEY = 18,
+    UNPIN_KEY = 19,
+    ONE_SHOT_OPERATION = 20,
+    BATCH_OPERATION = 21,
+    GET_STATISTICS = 22,
+    BATCH_UPGRADE_KEY = 23,
+    UPDATE_AAD = 24,
+    GENERATE_KEYS = 25,
+    BATCH_GET_KEY_CHARACTERISTICS = 26,
+    BATCH_DELETE_KEY = 27,
+    BATCH_ATTEST_KEY = 28,
+    EXPORT_OPERATION = 29,
+    IMPORT_OPERATION = 30,
+    MIGRATE_KEY = 31,
+    WARMUP_KEYS = 32,
+    DELETE_KEY = 33,
+    DELETE_ALL_KEYS = 34,
 };
 
 /**
@@ -65,8 +82,18 @@ enum AndroidKeymasterCommand {
  *
  * Note that this approach implies that GetVersionRequest and GetVersionResponse cannot be
  * versioned.
+ *
+ * Message version 4 adds key pinning (PIN_KEY, UNPIN_KEY and the key_handle field of
+ * BeginOperationRequest), which is an AndroidKeymaster extension rather than part of any HAL.
+ * GET_STATISTICS, UPDATE_AAD, EXPORT_OPERATION, IMPORT_OPERATION, MIGRATE_KEY and WARMUP_KEYS,
+ * also extensions, need no particular version.  DELETE_KEY and DELETE_ALL_KEYS name the HAL's
+ * delete calls in statistics and request traces.
+ *
+ * Message version 5 changes no fields, but serializes messages in COMPACT_FORMAT, with varints in
+ * place of fixed-width 32-bit values (see SerializationFormat).  The contents of key blobs, and
+ * 64-bit handles, are written as before.
  */
-const int32_t MAX_MESSAGE_VERSION = 3;
+const int32_t MAX_MESSAGE_VERSION = 5;
 inline int32_t MessageVersion(uint8_t major_ver, uint8_t minor_ver, uint8_t /* subminor_ver */) {
     int32_t message_version = -1;
     switch (major_ver) {
@@ -86,7 +113,17 @@ inline int32_t MessageVersion(uint8_t major_ver, uint8_t minor_ver, uint8_t /* s
         }
         break;
     case 2:
-        message_version = 3;
+        switch (minor_ver) {
+        case 0:
+            message_version = 3;
+            break;
+        case 1:
+            message_version = 4;
+            break;
+        case 2:
+            message_version = 5;
+            break;
+        }
         break;
     };
     return message_version;
@@ -94,9 +131,31 @@ inline int32_t MessageVersion(uint8_t major_ver, uint8_t minor_ver, uint8_t /* s
 
 struct KeymasterMessage : public Serializable {
     KeymasterMessage(int32_t ver) : message_version(ver) { assert(ver >= 0); }
+
+    /**
+     * Returns the format in which this message's version serializes integers.
+     */
+    SerializationFormat format() const {
+        return message_version > 4 ? COMPACT_FORMAT : FIXED_WIDTH_FORMAT;
+    }
+
     uint32_t message_version;
 };
 
+/**
+ * Whether a request's key_blob holds key material of its own or refers to someone else's.  By
+ * default requests own their key blobs, and Deserialize() copies the blob out of the serialized
+ * buffer.  Setting the key_blob_ownership of an empty request to BORROWED_KEY_BLOB before calling
+ * Deserialize() makes key_blob point into the buffer instead, which saves copying large (e.g. RSA)
+ * blobs on every call; the buffer must then outlive the request, and key_blob must not be
+ * modified through the request.  SetKeyMaterial() always copies, and leaves the request owning its
+ * key blob.
+ */
+enum KeyBlobOwnership {
+    OWNED_KEY_BLOB,
+    BORROWED_KEY_BLOB,
+};
+
 /**
  * All responses include an error value, and if the error is not KM_ERROR_OK, return no additional
  * data.  This abstract class factors out the common serialization functionality for all of the
@@ -110,10 +169,13 @@ struct KeymasterResponse : public KeymasterMessage {
     size_t SerializedSize() const override;
     uint8_t* Serialize(uint8_t* buf, const uint8_t* end) const override;
     bool Deserialize(const uint8_t** buf_ptr, const uint8_t* end) override;
+    bool SerializeToSegments(SerializationSegments* segments) const override;
 
     virtual size_t NonErrorSerializedSize() const = 0;
     virtual uint8_t* NonErrorSerialize(uint8_t* buf, const uint8_t* end) const = 0;
     virtual bool NonErrorDeserialize(const uint8_t** buf_ptr, const uint8_t* end) = 0;
+    // The default copies NonErrorSerialize()'s output.
+    virtual bool NonErrorSerializeToSegments(SerializationSegments* segments) const;
 
     keymaster_error_t error;
 };
@@ -132,12 +194,12 @@ struct SupportedAlgorithmsRequest : public KeymasterMessage {
 struct SupportedByAlgorithmRequest : public KeymasterMessage {
     explicit SupportedByAlgorithmRequest(int32_t ver) : KeymasterMessage(ver) {}
 
-    size_t SerializedSize() const override { return sizeof(uint32_t); };
+    size_t SerializedSize() const override { return uint32_serialized_size(algorithm, format()); };
     uint8_t* Serialize(uint8_t* buf, const uint8_t* end) const override {
-        return append_uint32_to_buf(buf, end, algorithm);
+        return append_uint32_to_buf(buf, end, algorithm, format());
     }
     bool Deserialize(const uint8_t** buf_ptr, const uint8_t* end) override {
-        return copy_uint32_from_buf(buf_ptr, end, &algorithm);
+        return copy_uint32_from_buf(buf_ptr, end, &algorithm, format());
     }
 
     keymaster_algorithm_t algorithm;
@@ -157,14 +219,17 @@ struct SupportedByAlgorithmAndPurposeRequest : public KeymasterMessage {
     explicit SupportedByAlgorithmAndPurposeRequest(int32_t ver = MAX_MESSAGE_VERSION)
         : KeymasterMessage(ver) {}
 
-    size_t SerializedSize() const override { return sizeof(uint32_t) * 2; };
+    size_t SerializedSize() const override {
+        return uint32_serialized_size(algorithm, format()) +
+               uint32_serialized_size(purpose, format());
+    };
     uint8_t* Serialize(uint8_t* buf, const uint8_t* end) const override {
-        buf = append_uint32_to_buf(buf, end, algorithm);
-        return append_uint32_to_buf(buf, end, purpose);
+        buf = append_uint32_to_buf(buf, end, algorithm, format());
+        return append_uint32_to_buf(buf, end, purpose, format());
     }
     bool Deserialize(const uint8_t** buf_ptr, const uint8_t* end) override {
-        return copy_uint32_from_buf(buf_ptr, end, &algorithm) &&
-               copy_uint32_from_buf(buf_ptr, end, &purpose);
+        return copy_uint32_from_buf(buf_ptr, end, &algorithm, format()) &&
+               copy_uint32_from_buf(buf_ptr, end, &purpose, format());
     }
 
     keymaster_algorithm_t algorithm;
@@ -206,16 +271,19 @@ template <typename T> struct SupportedResponse : public KeymasterResponse {
     }
 
     size_t NonErrorSerializedSize() const override {
-        return sizeof(uint32_t) + results_length * sizeof(uint32_t);
+        size_t size = uint32_serialized_size(results_length, format());
+        for (size_t i = 0; i < results_length; ++i)
+            size += uint32_serialized_size(results[i], format());
+        return size;
     }
     uint8_t* NonErrorSerialize(uint8_t* buf, const uint8_t* end) const override {
-        return append_uint32_array_to_buf(buf, end, results, results_length);
+        return append_uint32_array_to_buf(buf, end, results, results_length, format());
     }
     bool NonErrorDeserialize(const uint8_t** buf_ptr, const uint8_t* end) override {
         delete[] results;
         results = nullptr;
         UniquePtr<T[]> tmp;
-        if (!copy_uint32_array_from_buf(buf_ptr, end, &tmp, &results_length))
+        if (!copy_uint32_array_from_buf(buf_ptr, end, &tmp, &results_length, format()))
             return false;
         results = tmp.release();
         return true;
@@ -258,12 +326,12 @@ struct SupportedExportFormatsResponse : public SupportedResponse<keymaster_key_f
 struct GenerateKeyRequest : public KeymasterMessage {
     explicit GenerateKeyRequest(int32_t ver = MAX_MESSAGE_VERSION) : KeymasterMessage(ver) {}
 
-    size_t SerializedSize() const override { return key_description.SerializedSize(); }
+    size_t SerializedSize() const override { return key_description.SerializedSize(format()); }
     uint8_t* Serialize(uint8_t* buf, const uint8_t* end) const override {
-        return key_description.Serialize(buf, end);
+        return key_description.Serialize(buf, end, format());
     }
     bool Deserialize(const uint8_t** buf_ptr, const uint8_t* end) override {
-        return key_description.Deserialize(buf_ptr, end);
+        return key_description.Deserialize(buf_ptr, end, format());
     }
 
     AuthorizationSet key_description;
@@ -279,6 +347,7 @@ struct GenerateKeyResponse : public KeymasterResponse {
     size_t NonErrorSerializedSize() const override;
     uint8_t* NonErrorSerialize(uint8_t* buf, const uint8_t* end) const override;
     bool NonErrorDeserialize(const uint8_t** buf_ptr, const uint8_t* end) override;
+    bool NonErrorSerializeToSegments(SerializationSegments* segments) const override;
 
     keymaster_key_blob_t key_blob;
     AuthorizationSet enforced;
@@ -287,7 +356,7 @@ struct GenerateKeyResponse : public KeymasterResponse {
 
 struct GetKeyCharacteristicsRequest : public KeymasterMessage {
     explicit GetKeyCharacteristicsRequest(int32_t ver = MAX_MESSAGE_VERSION)
-        : KeymasterMessage(ver) {
+        : KeymasterMessage(ver), key_blob_ownership(OWNED_KEY_BLOB) {
         key_blob.key_material = nullptr;
         key_blob.key_material_size = 0;
     }
@@ -301,9 +370,12 @@ struct GetKeyCharacteristicsRequest : public KeymasterMessage {
     size_t SerializedSize() const override;
     uint8_t* Serialize(uint8_t* buf, const uint8_t* end) const override;
     bool Deserialize(const uint8_t** buf_ptr, const uint8_t* end) override;
+    bool SerializeToSegments(SerializationSegments* segments) const override;
 
     keymaster_key_blob_t key_blob;
     AuthorizationSet additional_params;
+    // See KeyBlobOwnership.
+    KeyBlobOwnership key_blob_ownership;
 };
 
 struct GetKeyCharacteristicsResponse : public KeymasterResponse {
@@ -318,11 +390,12 @@ struct GetKeyCharacteristicsResponse : public KeymasterResponse {
 };
 
 struct BeginOperationRequest : public KeymasterMessage {
-    explicit BeginOperationRequest(int32_t ver = MAX_MESSAGE_VERSION) : KeymasterMessage(ver) {
+    explicit BeginOperationRequest(int32_t ver = MAX_MESSAGE_VERSION)
+        : KeymasterMessage(ver), key_handle(0), key_blob_ownership(OWNED_KEY_BLOB) {
         key_blob.key_material = nullptr;
         key_blob.key_material_size = 0;
     }
-    ~BeginOperationRequest() { delete[] key_blob.key_material; }
+    ~BeginOperationRequest();
 
     void SetKeyMaterial(const void* key_material, size_t length);
     void SetKeyMaterial(const keymaster_key_blob_t& blob) {
@@ -332,10 +405,16 @@ struct BeginOperationRequest : public KeymasterMessage {
     size_t SerializedSize() const;
     uint8_t* Serialize(uint8_t* buf, const uint8_t* end) const override;
     bool Deserialize(const uint8_t** buf_ptr, const uint8_t* end) override;
+    bool SerializeToSegments(SerializationSegments* segments) const override;
 
     keymaster_purpose_t purpose;
     keymaster_key_blob_t key_blob;
     AuthorizationSet additional_params;
+    // If nonzero, the handle of a key pinned with PinKey, which is used instead of key_blob.
+    // Requires message version 4.
+    uint64_t key_handle;
+    // See KeyBlobOwnership.
+    KeyBlobOwnership key_blob_ownership;
 };
 
 struct BeginOperationResponse : public KeymasterResponse {
@@ -350,15 +429,31 @@ struct BeginOperationResponse : public KeymasterResponse {
 };
 
 struct UpdateOperationRequest : public KeymasterMessage {
-    explicit UpdateOperationRequest(int32_t ver = MAX_MESSAGE_VERSION) : KeymasterMessage(ver) {}
+    explicit UpdateOperationRequest(int32_t ver = MAX_MESSAGE_VERSION)
+        : KeymasterMessage(ver), borrow_buffers_(false) {}
 
     size_t SerializedSize() const override;
     uint8_t* Serialize(uint8_t* buf, const uint8_t* end) const override;
     bool Deserialize(const uint8_t** buf_ptr, const uint8_t* end) override;
+    bool SerializeToSegments(SerializationSegments* segments) const override;
+
+    /**
+     * Makes the message's Buffers allocate from \p arena.  See Buffer::set_arena().
+     */
+    void set_arena(SerializationArena* arena) { input.set_arena(arena); }
+
+    /**
+     * Makes Deserialize() point input at the serialized message rather than copying it, so the
+     * serialized message must outlive the request.  See Buffer::DeserializeBorrowed().
+     */
+    void set_borrow_buffers(bool borrow) { borrow_buffers_ = borrow; }
 
     keymaster_operation_handle_t op_handle;
     Buffer input;
     AuthorizationSet additional_params;
+
+  private:
+    bool borrow_buffers_;
 };
 
 struct UpdateOperationResponse : public KeymasterResponse {
@@ -368,23 +463,102 @@ struct UpdateOperationResponse : public KeymasterResponse {
     size_t NonErrorSerializedSize() const override;
     uint8_t* NonErrorSerialize(uint8_t* buf, const uint8_t* end) const override;
     bool NonErrorDeserialize(const uint8_t** buf_ptr, const uint8_t* end) override;
+    bool NonErrorSerializeToSegments(SerializationSegments* segments) const override;
+
+    /**
+     * Makes the message's Buffers allocate from \p arena.  See Buffer::set_arena().
+     */
+    void set_arena(SerializationArena* arena) { output.set_arena(arena); }
+
+    /**
+     * Readies a response that has been read to be passed to another call, keeping the output's
+     * storage as Buffer::Recycle() does, so that callers that reuse one response for a stream of
+     * updates don't allocate for each.
+     */
+    bool Recycle() {
+        error = KM_ERROR_UNKNOWN_ERROR;
+        input_consumed = 0;
+        output_params.Clear();
+        return output.Recycle();
+    }
 
     Buffer output;
     size_t input_consumed;
     AuthorizationSet output_params;
 };
 
+/**
+ * Passes associated data to an AEAD operation, as an UpdateOperationRequest with it in
+ * TAG_ASSOCIATED_DATA would, but without wrapping it in a parameter set, so large AAD sent in
+ * many pieces isn't copied into and searched for in an AuthorizationSet each time.  Like the
+ * associated data of UPDATE_OPERATION, it must all come before any input.
+ */
+struct UpdateAadRequest : public KeymasterMessage {
+    explicit UpdateAadRequest(int32_t ver = MAX_MESSAGE_VERSION)
+        : KeymasterMessage(ver), op_handle(0), borrow_buffers_(false) {}
+
+    size_t SerializedSize() const override;
+    uint8_t* Serialize(uint8_t* buf, const uint8_t* end) const override;
+    bool Deserialize(const uint8_t** buf_ptr, const uint8_t* end) override;
+    bool SerializeToSegments(SerializationSegments* segments) const override;
+
+    /**
+     * Makes the message's Buffers allocate from \p arena.  See Buffer::set_arena().
+     */
+    void set_arena(SerializationArena* arena) { aad.set_arena(arena); }
+
+    /**
+     * Makes Deserialize() point aad at the serialized message rather than copying it, so the
+     * serialized message must outlive the request.  See Buffer::DeserializeBorrowed().
+     */
+    void set_borrow_buffers(bool borrow) { borrow_buffers_ = borrow; }
+
+    keymaster_operation_handle_t op_handle;
+    Buffer aad;
+
+  private:
+    bool borrow_buffers_;
+};
+
+struct UpdateAadResponse : public KeymasterResponse {
+    explicit UpdateAadResponse(int32_t ver = MAX_MESSAGE_VERSION) : KeymasterResponse(ver) {}
+
+    size_t NonErrorSerializedSize() const override { return 0; }
+    uint8_t* NonErrorSerialize(uint8_t* buf, const uint8_t*) const override { return buf; }
+    bool NonErrorDeserialize(const uint8_t**, const uint8_t*) override { return true; }
+};
+
 struct FinishOperationRequest : public KeymasterMessage {
-    explicit FinishOperationRequest(int32_t ver = MAX_MESSAGE_VERSION) : KeymasterMessage(ver) {}
+    explicit FinishOperationRequest(int32_t ver = MAX_MESSAGE_VERSION)
+        : KeymasterMessage(ver), borrow_buffers_(false) {}
 
     size_t SerializedSize() const override;
     uint8_t* Serialize(uint8_t* buf, const uint8_t* end) const override;
     bool Deserialize(const uint8_t** buf_ptr, const uint8_t* end) override;
+    bool SerializeToSegments(SerializationSegments* segments) const override;
+
+    /**
+     * Makes the message's Buffers allocate from \p arena.  See Buffer::set_arena().
+     */
+    void set_arena(SerializationArena* arena) {
+        input.set_arena(arena);
+        signature.set_arena(arena);
+    }
+
+    /**
+     * Makes Deserialize() point input and signature at the serialized message rather than
+     * copying them, so the serialized message must outlive the request.  See
+     * Buffer::DeserializeBorrowed().
+     */
+    void set_borrow_buffers(bool borrow) { borrow_buffers_ = borrow; }
 
     keymaster_operation_handle_t op_handle;
     Buffer input;
     Buffer signature;
     AuthorizationSet additional_params;
+
+  private:
+    bool borrow_buffers_;
 };
 
 struct FinishOperationResponse : public KeymasterResponse {
@@ -393,6 +567,19 @@ struct FinishOperationResponse : public KeymasterResponse {
     size_t NonErrorSerializedSize() const override;
     uint8_t* NonErrorSerialize(uint8_t* buf, const uint8_t* end) const override;
     bool NonErrorDeserialize(const uint8_t** buf_ptr, const uint8_t* end) override;
+    bool NonErrorSerializeToSegments(SerializationSegments* segments) const override;
+
+    /**
+     * Makes the message's Buffers allocate from \p arena.  See Buffer::set_arena().
+     */
+    void set_arena(SerializationArena* arena) { output.set_arena(arena); }
+
+    // See UpdateOperationResponse::Recycle().
+    bool Recycle() {
+        error = KM_ERROR_UNKNOWN_ERROR;
+        output_params.Clear();
+        return output.Recycle();
+    }
 
     Buffer output;
     AuthorizationSet output_params;
@@ -477,6 +664,7 @@ struct ImportKeyResponse : public KeymasterResponse {
     size_t NonErrorSerializedSize() const override;
     uint8_t* NonErrorSerialize(uint8_t* buf, const uint8_t* end) const override;
     bool NonErrorDeserialize(const uint8_t** buf_ptr, const uint8_t* end) override;
+    bool NonErrorSerializeToSegments(SerializationSegments* segments) const override;
 
     keymaster_key_blob_t key_blob;
     AuthorizationSet enforced;
@@ -484,11 +672,12 @@ struct ImportKeyResponse : public KeymasterResponse {
 };
 
 struct ExportKeyRequest : public KeymasterMessage {
-    explicit ExportKeyRequest(int32_t ver = MAX_MESSAGE_VERSION) : KeymasterMessage(ver) {
+    explicit ExportKeyRequest(int32_t ver = MAX_MESSAGE_VERSION)
+        : KeymasterMessage(ver), key_blob_ownership(OWNED_KEY_BLOB) {
         key_blob.key_material = nullptr;
         key_blob.key_material_size = 0;
     }
-    ~ExportKeyRequest() { delete[] key_blob.key_material; }
+    ~ExportKeyRequest();
 
     void SetKeyMaterial(const void* key_material, size_t length);
     void SetKeyMaterial(const keymaster_key_blob_t& blob) {
@@ -498,10 +687,13 @@ struct ExportKeyRequest : public KeymasterMessage {
     size_t SerializedSize() const override;
     uint8_t* Serialize(uint8_t* buf, const uint8_t* end) const override;
     bool Deserialize(const uint8_t** buf_ptr, const uint8_t* end) override;
+    bool SerializeToSegments(SerializationSegments* segments) const override;
 
     AuthorizationSet additional_params;
     keymaster_key_format_t key_format;
     keymaster_key_blob_t key_blob;
+    // See KeyBlobOwnership.
+    KeyBlobOwnership key_blob_ownership;
 };
 
 struct ExportKeyResponse : public KeymasterResponse {
@@ -517,6 +709,7 @@ struct ExportKeyResponse : public KeymasterResponse {
     size_t NonErrorSerializedSize() const override;
     uint8_t* NonErrorSerialize(uint8_t* buf, const uint8_t* end) const override;
     bool NonErrorDeserialize(const uint8_t** buf_ptr, const uint8_t* end) override;
+    bool NonErrorSerializeToSegments(SerializationSegments* segments) const override;
 
     uint8_t* key_data;
     size_t key_data_length;
@@ -587,7 +780,8 @@ struct GetVersionResponse : public KeymasterResponse {
 };
 
 struct AttestKeyRequest : public KeymasterMessage {
-    explicit AttestKeyRequest(int32_t ver = MAX_MESSAGE_VERSION) : KeymasterMessage(ver) {
+    explicit AttestKeyRequest(int32_t ver = MAX_MESSAGE_VERSION)
+        : KeymasterMessage(ver), key_blob_ownership(OWNED_KEY_BLOB) {
         key_blob.key_material = nullptr;
         key_blob.key_material_size = 0;
     }
@@ -604,6 +798,8 @@ struct AttestKeyRequest : public KeymasterMessage {
 
     keymaster_key_blob_t key_blob;
     AuthorizationSet attest_params;
+    // See KeyBlobOwnership.
+    KeyBlobOwnership key_blob_ownership;
 };
 
 struct AttestKeyResponse : public KeymasterResponse {
@@ -654,6 +850,605 @@ struct UpgradeKeyResponse : public KeymasterResponse {
     keymaster_key_blob_t upgraded_key;
 };
 
+/**
+ * Re-wraps a key blob in a legacy format into the current one; see
+ * KeymasterContext::MigrateKeyBlob.  additional_params are those the key is used with.
+ */
+struct MigrateKeyRequest : public KeymasterMessage {
+    explicit MigrateKeyRequest(int32_t ver = MAX_MESSAGE_VERSION) : KeymasterMessage(ver) {
+        key_blob = {nullptr, 0};
+    }
+    ~MigrateKeyRequest();
+
+    void SetKeyMaterial(const void* key_material, size_t length);
+    void SetKeyMaterial(const keymaster_key_blob_t& blob) {
+        SetKeyMaterial(blob.key_material, blob.key_material_size);
+    }
+
+    size_t SerializedSize() const override;
+    uint8_t* Serialize(uint8_t* buf, const uint8_t* end) const override;
+    bool Deserialize(const uint8_t** buf_ptr, const uint8_t* end) override;
+
+    keymaster_key_blob_t key_blob;
+    AuthorizationSet additional_params;
+};
+
+struct MigrateKeyResponse : public KeymasterResponse {
+    explicit MigrateKeyResponse(int32_t ver = MAX_MESSAGE_VERSION) : KeymasterResponse(ver) {
+        migrated_key = {nullptr, 0};
+    }
+    ~MigrateKeyResponse();
+
+    size_t NonErrorSerializedSize() const override;
+    uint8_t* NonErrorSerialize(uint8_t* buf, const uint8_t* end) const override;
+    bool NonErrorDeserialize(const uint8_t** buf_ptr, const uint8_t* end) override;
+
+    // Empty if the blob was already in the current format.
+    keymaster_key_blob_t migrated_key;
+};
+
+struct PinKeyRequest : public KeymasterMessage {
+    explicit PinKeyRequest(int32_t ver = MAX_MESSAGE_VERSION) : KeymasterMessage(ver) {
+        key_blob = {nullptr, 0};
+    }
+    ~PinKeyRequest();
+
+    void SetKeyMaterial(const void* key_material, size_t length);
+    void SetKeyMaterial(const keymaster_key_blob_t& blob) {
+        SetKeyMaterial(blob.key_material, blob.key_material_size);
+    }
+
+    size_t SerializedSize() const override;
+    uint8_t* Serialize(uint8_t* buf, const uint8_t* end) const override;
+    bool Deserialize(const uint8_t** buf_ptr, const uint8_t* end) override;
+
+    keymaster_key_blob_t key_blob;
+    AuthorizationSet additional_params;
+};
+
+struct PinKeyResponse : public KeymasterResponse {
+    explicit PinKeyResponse(int32_t ver = MAX_MESSAGE_VERSION)
+        : KeymasterResponse(ver), key_handle(0) {}
+
+    size_t NonErrorSerializedSize() const override { return sizeof(uint64_t); }
+    uint8_t* NonErrorSerialize(uint8_t* buf, const uint8_t* end) const override {
+        return append_uint64_to_buf(buf, end, key_handle);
+    }
+    bool NonErrorDeserialize(const uint8_t** buf_ptr, const uint8_t* end) override {
+        return copy_uint64_from_buf(buf_ptr, end, &key_handle);
+    }
+
+    uint64_t key_handle;
+};
+
+struct UnpinKeyRequest : public KeymasterMessage {
+    explicit UnpinKeyRequest(int32_t ver = MAX_MESSAGE_VERSION)
+        : KeymasterMessage(ver), key_handle(0) {}
+
+    size_t SerializedSize() const override { return sizeof(uint64_t); }
+    uint8_t* Serialize(uint8_t* buf, const uint8_t* end) const override {
+        return append_uint64_to_buf(buf, end, key_handle);
+    }
+    bool Deserialize(const uint8_t** buf_ptr, const uint8_t* end) override {
+        return copy_uint64_from_buf(buf_ptr, end, &key_handle);
+    }
+
+    uint64_t key_handle;
+};
+
+struct UnpinKeyResponse : public KeymasterResponse {
+    explicit UnpinKeyResponse(int32_t ver = MAX_MESSAGE_VERSION) : KeymasterResponse(ver) {}
+
+    size_t NonErrorSerializedSize() const override { return 0; }
+    uint8_t* NonErrorSerialize(uint8_t* buf, const uint8_t*) const override { return buf; }
+    bool NonErrorDeserialize(const uint8_t**, const uint8_t*) override { return true; }
+};
+
+/**
+ * Loads each of a list of key blobs, each with its own parameters, into the key cache in the
+ * background.
+ */
+struct WarmupKeysRequest : public KeymasterMessage {
+    struct Item {
+        KeymasterKeyBlob key_blob;
+        AuthorizationSet additional_params;
+    };
+
+    explicit WarmupKeysRequest(int32_t ver = MAX_MESSAGE_VERSION)
+        : KeymasterMessage(ver), item_count(0) {}
+
+    // Replaces the items with \p count empty ones.
+    bool SetItemCount(size_t count);
+
+    size_t SerializedSize() const override;
+    uint8_t* Serialize(uint8_t* buf, const uint8_t* end) const override;
+    bool Deserialize(const uint8_t** buf_ptr, const uint8_t* end) override;
+
+    UniquePtr<Item[]> items;
+    size_t item_count;
+};
+
+struct WarmupKeysResponse : public KeymasterResponse {
+    explicit WarmupKeysResponse(int32_t ver = MAX_MESSAGE_VERSION) : KeymasterResponse(ver) {}
+
+    size_t NonErrorSerializedSize() const override { return 0; }
+    uint8_t* NonErrorSerialize(uint8_t* buf, const uint8_t*) const override { return buf; }
+    bool NonErrorDeserialize(const uint8_t**, const uint8_t*) override { return true; }
+};
+
+/**
+ * Runs a complete operation, from begin to finish, in one call.  Requires message version 4.
+ */
+struct OneShotOperationRequest : public KeymasterMessage {
+    explicit OneShotOperationRequest(int32_t ver = MAX_MESSAGE_VERSION)
+        : KeymasterMessage(ver), key_handle(0) {
+        key_blob = {nullptr, 0};
+    }
+    ~OneShotOperationRequest();
+
+    void SetKeyMaterial(const void* key_material, size_t length);
+    void SetKeyMaterial(const keymaster_key_blob_t& blob) {
+        SetKeyMaterial(blob.key_material, blob.key_material_size);
+    }
+
+    size_t SerializedSize() const override;
+    uint8_t* Serialize(uint8_t* buf, const uint8_t* end) const override;
+    bool Deserialize(const uint8_t** buf_ptr, const uint8_t* end) override;
+    bool SerializeToSegments(SerializationSegments* segments) const override;
+
+    keymaster_purpose_t purpose;
+    keymaster_key_blob_t key_blob;
+    // Used for both begin and finish.
+    AuthorizationSet additional_params;
+    Buffer input;
+    Buffer signature;
+    // If nonzero, the handle of a key pinned with PinKey, which is used instead of key_blob.
+    uint64_t key_handle;
+};
+
+struct OneShotOperationResponse : public KeymasterResponse {
+    explicit OneShotOperationResponse(int32_t ver = MAX_MESSAGE_VERSION) : KeymasterResponse(ver) {}
+
+    size_t NonErrorSerializedSize() const override;
+    uint8_t* NonErrorSerialize(uint8_t* buf, const uint8_t* end) const override;
+    bool NonErrorDeserialize(const uint8_t** buf_ptr, const uint8_t* end) override;
+    bool NonErrorSerializeToSegments(SerializationSegments* segments) const override;
+
+    // See UpdateOperationResponse::Recycle().
+    bool Recycle() {
+        error = KM_ERROR_UNKNOWN_ERROR;
+        output_params.Clear();
+        return output.Recycle();
+    }
+
+    // The output parameters of both begin and finish.
+    AuthorizationSet output_params;
+    Buffer output;
+};
+
+/**
+ * Runs a one-shot operation on each of a list of inputs, all with the same key, purpose and
+ * parameters.  Requires message version 4.
+ */
+struct BatchOperationRequest : public KeymasterMessage {
+    struct Item {
+        Buffer input;
+        Buffer signature;
+    };
+
+    explicit BatchOperationRequest(int32_t ver = MAX_MESSAGE_VERSION)
+        : KeymasterMessage(ver), key_handle(0), item_count(0) {
+        key_blob = {nullptr, 0};
+    }
+    ~BatchOperationRequest();
+
+    void SetKeyMaterial(const void* key_material, size_t length);
+    void SetKeyMaterial(const keymaster_key_blob_t& blob) {
+        SetKeyMaterial(blob.key_material, blob.key_material_size);
+    }
+    // Replaces the items with \p count empty ones.
+    bool SetItemCount(size_t count);
+
+    size_t SerializedSize() const override;
+    uint8_t* Serialize(uint8_t* buf, const uint8_t* end) const override;
+    bool Deserialize(const uint8_t** buf_ptr, const uint8_t* end) override;
+
+    keymaster_purpose_t purpose;
+    keymaster_key_blob_t key_blob;
+    AuthorizationSet additional_params;
+    // If nonzero, the handle of a key pinned with PinKey, which is used instead of key_blob.
+    uint64_t key_handle;
+    UniquePtr<Item[]> items;
+    size_t item_count;
+};
+
+struct BatchOperationResponse : public KeymasterResponse {
+    struct Item {
+        Item() : error(KM_ERROR_UNKNOWN_ERROR) {}
+
+        keymaster_error_t error;
+        // The output parameters and output of the item's operation, if error is KM_ERROR_OK.
+        AuthorizationSet output_params;
+        Buffer output;
+    };
+
+    explicit BatchOperationResponse(int32_t ver = MAX_MESSAGE_VERSION)
+        : KeymasterResponse(ver), item_count(0) {}
+
+    bool SetItemCount(size_t count);
+
+    size_t NonErrorSerializedSize() const override;
+    uint8_t* NonErrorSerialize(uint8_t* buf, const uint8_t* end) const override;
+    bool NonErrorDeserialize(const uint8_t** buf_ptr, const uint8_t* end) override;
+
+    UniquePtr<Item[]> items;
+    size_t item_count;
+};
+
+/**
+ * Upgrades each of a list of key blobs, all with the same parameters, as UpgradeKey would.
+ * Requires message version 4.
+ */
+struct BatchUpgradeKeyRequest : public KeymasterMessage {
+    struct Item {
+        KeymasterKeyBlob key_blob;
+    };
+
+    explicit BatchUpgradeKeyRequest(int32_t ver = MAX_MESSAGE_VERSION)
+        : KeymasterMessage(ver), item_count(0) {}
+
+    // Replaces the items with \p count empty ones.
+    bool SetItemCount(size_t count);
+
+    size_t SerializedSize() const override;
+    uint8_t* Serialize(uint8_t* buf, const uint8_t* end) const override;
+    bool Deserialize(const uint8_t** buf_ptr, const uint8_t* end) override;
+
+    AuthorizationSet upgrade_params;
+    UniquePtr<Item[]> items;
+    size_t item_count;
+};
+
+struct BatchUpgradeKeyResponse : public KeymasterResponse {
+    struct Item {
+        Item() : error(KM_ERROR_UNKNOWN_ERROR) {}
+
+        keymaster_error_t error;
+        // The upgraded blob, if error is KM_ERROR_OK.
+        KeymasterKeyBlob upgraded_key;
+    };
+
+    explicit BatchUpgradeKeyResponse(int32_t ver = MAX_MESSAGE_VERSION)
+        : KeymasterResponse(ver), item_count(0) {}
+
+    bool SetItemCount(size_t count);
+
+    size_t NonErrorSerializedSize() const override;
+    uint8_t* NonErrorSerialize(uint8_t* buf, const uint8_t* end) const override;
+    bool NonErrorDeserialize(const uint8_t** buf_ptr, const uint8_t* end) override;
+
+    UniquePtr<Item[]> items;
+    size_t item_count;
+};
+
+/**
+ * Generates a key for each of a list of key descriptions, as GenerateKey would.  Requires message
+ * version 4.
+ */
+struct GenerateKeysRequest : public KeymasterMessage {
+    struct Item {
+        AuthorizationSet key_description;
+    };
+
+    explicit GenerateKeysRequest(int32_t ver = MAX_MESSAGE_VERSION)
+        : KeymasterMessage(ver), item_count(0) {}
+
+    // Replaces the items with \p count empty ones.
+    bool SetItemCount(size_t count);
+
+    size_t SerializedSize() const override;
+    uint8_t* Serialize(uint8_t* buf, const uint8_t* end) const override;
+    bool Deserialize(const uint8_t** buf_ptr, const uint8_t* end) override;
+
+    UniquePtr<Item[]> items;
+    size_t item_count;
+};
+
+struct GenerateKeysResponse : public KeymasterResponse {
+    struct Item {
+        Item() : error(KM_ERROR_UNKNOWN_ERROR) {}
+
+        keymaster_error_t error;
+        // The new key's blob and characteristics, if error is KM_ERROR_OK.
+        KeymasterKeyBlob key_blob;
+        AuthorizationSet enforced;
+        AuthorizationSet unenforced;
+    };
+
+    explicit GenerateKeysResponse(int32_t ver = MAX_MESSAGE_VERSION)
+        : KeymasterResponse(ver), item_count(0) {}
+
+    bool SetItemCount(size_t count);
+
+    size_t NonErrorSerializedSize() const override;
+    uint8_t* NonErrorSerialize(uint8_t* buf, const uint8_t* end) const override;
+    bool NonErrorDeserialize(const uint8_t** buf_ptr, const uint8_t* end) override;
+
+    UniquePtr<Item[]> items;
+    size_t item_count;
+};
+
+/**
+ * Returns the characteristics of each of a list of key blobs, all with the same parameters, as
+ * GetKeyCharacteristics would.  Requires message version 4.
+ */
+struct BatchGetKeyCharacteristicsRequest : public KeymasterMessage {
+    struct Item {
+        KeymasterKeyBlob key_blob;
+    };
+
+    explicit BatchGetKeyCharacteristicsRequest(int32_t ver = MAX_MESSAGE_VERSION)
+        : KeymasterMessage(ver), item_count(0) {}
+
+    // Replaces the items with \p count empty ones.
+    bool SetItemCount(size_t count);
+
+    size_t SerializedSize() const override;
+    uint8_t* Serialize(uint8_t* buf, const uint8_t* end) const override;
+    bool Deserialize(const uint8_t** buf_ptr, const uint8_t* end) override;
+
+    AuthorizationSet additional_params;
+    UniquePtr<Item[]> items;
+    size_t item_count;
+};
+
+struct BatchGetKeyCharacteristicsResponse : public KeymasterResponse {
+    struct Item {
+        Item() : error(KM_ERROR_UNKNOWN_ERROR) {}
+
+        keymaster_error_t error;
+        // The key's characteristics, if error is KM_ERROR_OK.
+        AuthorizationSet enforced;
+        AuthorizationSet unenforced;
+    };
+
+    explicit BatchGetKeyCharacteristicsResponse(int32_t ver = MAX_MESSAGE_VERSION)
+        : KeymasterResponse(ver), item_count(0) {}
+
+    bool SetItemCount(size_t count);
+
+    size_t NonErrorSerializedSize() const override;
+    uint8_t* NonErrorSerialize(uint8_t* buf, const uint8_t* end) const override;
+    bool NonErrorDeserialize(const uint8_t** buf_ptr, const uint8_t* end) override;
+
+    UniquePtr<Item[]> items;
+    size_t item_count;
+};
+
+/**
+ * Deletes each of a list of key blobs, as DeleteKey would.  Requires message version 4.
+ */
+struct BatchDeleteKeyRequest : public KeymasterMessage {
+    struct Item {
+        KeymasterKeyBlob key_blob;
+    };
+
+    explicit BatchDeleteKeyRequest(int32_t ver = MAX_MESSAGE_VERSION)
+        : KeymasterMessage(ver), item_count(0) {}
+
+    // Replaces the items with \p count empty ones.
+    bool SetItemCount(size_t count);
+
+    size_t SerializedSize() const override;
+    uint8_t* Serialize(uint8_t* buf, const uint8_t* end) const override;
+    bool Deserialize(const uint8_t** buf_ptr, const uint8_t* end) override;
+
+    UniquePtr<Item[]> items;
+    size_t item_count;
+};
+
+struct BatchDeleteKeyResponse : public KeymasterResponse {
+    struct Item {
+        Item() : error(KM_ERROR_UNKNOWN_ERROR) {}
+
+        keymaster_error_t error;
+    };
+
+    explicit BatchDeleteKeyResponse(int32_t ver = MAX_MESSAGE_VERSION)
+        : KeymasterResponse(ver), item_count(0) {}
+
+    bool SetItemCount(size_t count);
+
+    size_t NonErrorSerializedSize() const override;
+    uint8_t* NonErrorSerialize(uint8_t* buf, const uint8_t* end) const override;
+    bool NonErrorDeserialize(const uint8_t** buf_ptr, const uint8_t* end) override;
+
+    UniquePtr<Item[]> items;
+    size_t item_count;
+};
+
+/**
+ * Attests each of a list of key blobs, all with the same parameters, as AttestKey would.  Requires
+ * message version 4.
+ */
+struct BatchAttestKeyRequest : public KeymasterMessage {
+    struct Item {
+        KeymasterKeyBlob key_blob;
+    };
+
+    explicit BatchAttestKeyRequest(int32_t ver = MAX_MESSAGE_VERSION)
+        : KeymasterMessage(ver), item_count(0) {}
+
+    // Replaces the items with \p count empty ones.
+    bool SetItemCount(size_t count);
+
+    size_t SerializedSize() const override;
+    uint8_t* Serialize(uint8_t* buf, const uint8_t* end) const override;
+    bool Deserialize(const uint8_t** buf_ptr, const uint8_t* end) override;
+
+    AuthorizationSet attest_params;
+    UniquePtr<Item[]> items;
+    size_t item_count;
+};
+
+/**
+ * Each item holds only its key's attestation certificate.  The rest of each chain, which is the
+ * same for every key attested with the same attestation key, is sent once in issuer_chains and
+ * referred to by index.
+ */
+struct BatchAttestKeyResponse : public KeymasterResponse {
+    struct Item {
+        Item() : error(KM_ERROR_UNKNOWN_ERROR), issuer_chain(0) { certificate = {nullptr, 0}; }
+        ~Item() { delete[] certificate.data; }
+
+        keymaster_error_t error;
+        // The key's attestation certificate and the index in issuer_chains of the chain that
+        // follows it, if error is KM_ERROR_OK.
+        keymaster_blob_t certificate;
+        uint32_t issuer_chain;
+    };
+
+    explicit BatchAttestKeyResponse(int32_t ver = MAX_MESSAGE_VERSION)
+        : KeymasterResponse(ver), item_count(0), issuer_chain_count(0) {}
+    ~BatchAttestKeyResponse();
+
+    bool SetItemCount(size_t count);
+    // Replaces the issuer chains with \p count empty ones.
+    bool SetIssuerChainCount(size_t count);
+    // Replaces issuer chain \p index with a copy of \p chain.
+    bool SetIssuerChain(size_t index, const keymaster_cert_chain_t& chain);
+
+    /**
+     * Builds the full chain of item \p index, as AttestKey would have returned it, into \p chain,
+     * which the caller must free with keymaster_free_cert_chain().
+     */
+    bool CopyCertificateChain(size_t index, keymaster_cert_chain_t* chain) const;
+
+    size_t NonErrorSerializedSize() const override;
+    uint8_t* NonErrorSerialize(uint8_t* buf, const uint8_t* end) const override;
+    bool NonErrorDeserialize(const uint8_t** buf_ptr, const uint8_t* end) override;
+
+    UniquePtr<Item[]> items;
+    size_t item_count;
+    UniquePtr<keymaster_cert_chain_t[]> issuer_chains;
+    size_t issuer_chain_count;
+};
+
+/**
+ * Removes an in-progress operation from the operation table and returns its state, sealed so that
+ * only a keymaster sharing this one's master key can read it, for ImportOperation to carry on with.
+ */
+struct ExportOperationRequest : public KeymasterMessage {
+    explicit ExportOperationRequest(int32_t ver = MAX_MESSAGE_VERSION) : KeymasterMessage(ver) {}
+
+    size_t SerializedSize() const override { return sizeof(uint64_t); }
+    uint8_t* Serialize(uint8_t* buf, const uint8_t* end) const override {
+        return append_uint64_to_buf(buf, end, op_handle);
+    }
+    bool Deserialize(const uint8_t** buf_ptr, const uint8_t* end) override {
+        return copy_uint64_from_buf(buf_ptr, end, &op_handle);
+    }
+
+    keymaster_operation_handle_t op_handle;
+};
+
+struct ExportOperationResponse : public KeymasterResponse {
+    explicit ExportOperationResponse(int32_t ver = MAX_MESSAGE_VERSION) : KeymasterResponse(ver) {}
+
+    size_t NonErrorSerializedSize() const override;
+    uint8_t* NonErrorSerialize(uint8_t* buf, const uint8_t* end) const override;
+    bool NonErrorDeserialize(const uint8_t** buf_ptr, const uint8_t* end) override;
+
+    Buffer token;
+};
+
+/**
+ * Enters an operation exported with ExportOperation in the operation table under a new handle.
+ * key_blob and additional_params must load the operation's key, as for BeginOperation.
+ */
+struct ImportOperationRequest : public KeymasterMessage {
+    explicit ImportOperationRequest(int32_t ver = MAX_MESSAGE_VERSION) : KeymasterMessage(ver) {}
+
+    size_t SerializedSize() const override;
+    uint8_t* Serialize(uint8_t* buf, const uint8_t* end) const override;
+    bool Deserialize(const uint8_t** buf_ptr, const uint8_t* end) override;
+
+    KeymasterKeyBlob key_blob;
+    AuthorizationSet additional_params;
+    Buffer token;
+};
+
+struct ImportOperationResponse : public KeymasterResponse {
+    explicit ImportOperationResponse(int32_t ver = MAX_MESSAGE_VERSION)
+        : KeymasterResponse(ver), op_handle(0) {}
+
+    size_t NonErrorSerializedSize() const override { return sizeof(uint64_t); }
+    uint8_t* NonErrorSerialize(uint8_t* buf, const uint8_t* end) const override {
+        return append_uint64_to_buf(buf, end, op_handle);
+    }
+    bool NonErrorDeserialize(const uint8_t** buf_ptr, const uint8_t* end) override {
+        return copy_uint64_from_buf(buf_ptr, end, &op_handle);
+    }
+
+    keymaster_operation_handle_t op_handle;
+};
+
+struct GetStatisticsRequest : public KeymasterMessage {
+    explicit GetStatisticsRequest(int32_t ver = MAX_MESSAGE_VERSION) : KeymasterMessage(ver) {}
+
+    size_t SerializedSize() const override { return 0; }
+    uint8_t* Serialize(uint8_t* buf, const uint8_t*) const override { return buf; }
+    bool Deserialize(const uint8_t**, const uint8_t*) override { return true; }
+};
+
+/**
+ * The latency histograms AndroidKeymaster has recorded, one for each combination of command, key
+ * algorithm and operation purpose that has been used.  Only available if AndroidKeymaster is built
+ * with KEYMASTER_LATENCY_STATISTICS; otherwise the error is KM_ERROR_UNIMPLEMENTED.
+ *
+ * Latencies are counted in log-linear buckets of microseconds.  Buckets 0 to 3 count latencies of 0
+ * to 3 microseconds, and each power-of-two range above that is split into four equal buckets, so
+ * bucket b counts latencies from BucketLowerBound(b) up to, but not including,
+ * BucketLowerBound(b + 1).  Latencies beyond the last bucket are counted in it.
+ */
+struct GetStatisticsResponse : public KeymasterResponse {
+    // Used for commands that don't involve a key, or an operation.
+    static const uint32_t kNoAlgorithm = 0;
+    static const uint32_t kNoPurpose = 0xFFFFFFFF;
+    static const size_t kBucketCount = 124;
+
+    static size_t BucketIndex(uint64_t microseconds);
+    static uint64_t BucketLowerBound(size_t bucket);
+
+    struct Histogram {
+        Histogram();
+
+        uint32_t command;  // An AndroidKeymasterCommand.
+        uint32_t algorithm;
+        uint32_t purpose;
+        uint64_t count;
+        uint64_t total_microseconds;
+        // Totals over all count calls of the allocations counted by AllocationCounter, if built
+        // with KEYMASTER_ALLOCATION_COUNTING; otherwise zero.
+        uint64_t allocations;
+        uint64_t allocated_bytes;
+        uint64_t buckets[kBucketCount];
+    };
+
+    explicit GetStatisticsResponse(int32_t ver = MAX_MESSAGE_VERSION)
+        : KeymasterResponse(ver), histogram_count(0) {}
+
+    // Replaces the histograms with \p count empty ones.
+    bool SetHistogramCount(size_t count);
+
+    size_t NonErrorSerializedSize() const override;
+    uint8_t* NonErrorSerialize(uint8_t* buf, const uint8_t* end) const override;
+    bool NonErrorDeserialize(const uint8_t** buf_ptr, const uint8_t* end) override;
+
+    UniquePtr<Histogram[]> histograms;
+    size_t histogram_count;
+};
+
 }  // namespace keymaster
 
 #endif  // SYSTEM_KEYMASTER_ANDROID_KEYMASTER_MESSAGES_H_
@@ -24,6 +24,7 @@
 #include <UniquePtr.h>
 
 #include <hardware/keymaster_defs.h>
+#include <keymaster/allocation_counter.h>
 #include <keymaster/serializable.h>
 
 namespace keymaster {
@@ -67,9 +68,11 @@ template <typename T, size_t N> inline size_t array_length(const T (&)[N]) {
  */
 template <typename T> inline T* dup_array(const T* a, size_t n) {
     T* dup = new (std::nothrow) T[n];
-    if (dup)
+    if (dup) {
+        AllocationCounter::Count(sizeof(T) * n);
         for (size_t i = 0; i < n; ++i)
             dup[i] = a[i];
+    }
     return dup;
 }
 
@@ -111,26 +114,27 @@ template <typename T, size_t N> inline bool array_contains(const T (&a)[N], T va
 }
 
 /**
- * Variant of memset() that uses GCC-specific pragmas to disable optimizations, so effect is not
- * optimized away.  This is important because we often need to wipe blocks of sensitive data from
- * memory.  As an additional convenience, this implementation avoids writing to NULL pointers.
+ * Variant of memset() whose effect is not optimized away, even when the memory is never read
+ * again.  This is important because we often need to wipe blocks of sensitive data from memory.
+ * The clearing is done by memset() itself, which runs at the full width of the platform's vector
+ * stores, and then an empty asm statement that claims to read the memory keeps the compiler from
+ * treating the stores as dead.  As an additional convenience, this implementation avoids writing
+ * to NULL pointers.
  */
-#ifdef __clang__
-#define OPTNONE __attribute__((optnone))
-#else  // not __clang__
-#define OPTNONE __attribute__((optimize("O0")))
-#endif  // not __clang__
-inline OPTNONE void* memset_s(void* s, int c, size_t n) {
+inline void* memset_s(void* s, int c, size_t n) {
     if (!s)
         return s;
-    return memset(s, c, n);
+    memset(s, c, n);
+    __asm__ __volatile__("" : : "r"(s) : "memory");
+    return s;
 }
-#undef OPTNONE
 
 /**
  * Variant of memcmp that has the same runtime regardless of whether the data matches (i.e. doesn't
  * short-circuit).  Not an exact equivalent to memcmp because it doesn't return <0 if p1 < p2, just
- * 0 for match and non-zero for non-match.
+ * 0 for match and non-zero for non-match.  It compares a machine word at a time, which compilers
+ * vectorize.  Its timing rests on the compiler keeping the loop branch-free, so MAC and tag checks
+ * use the crypto library's CRYPTO_memcmp instead.
  */
 int memcmp_s(const void* p1, const void* p2, size_t length);
 
@@ -212,35 +216,54 @@ template <typename T> T hton(T t) {
 /**
  * KeymasterKeyBlob is a very simple extension of the C struct keymaster_key_blob_t.  It manages its
  * own memory, which makes avoiding memory leaks much easier.
+ *
+ * A KeymasterKeyBlob may instead borrow the key material of a keymaster_key_blob_t that someone
+ * else owns, so that a caller's blob can be passed wherever a KeymasterKeyBlob is expected without
+ * copying it.  See the BORROW constructor.
  */
 struct KeymasterKeyBlob : public keymaster_key_blob_t {
-    KeymasterKeyBlob() {
+    enum BorrowTag { BORROW };
+
+    KeymasterKeyBlob() : owned_(true) {
         key_material = nullptr;
         key_material_size = 0;
     }
 
-    KeymasterKeyBlob(const uint8_t* data, size_t size) {
+    KeymasterKeyBlob(const uint8_t* data, size_t size) : owned_(true) {
         key_material_size = 0;
         key_material = dup_buffer(data, size);
         if (key_material)
             key_material_size = size;
     }
 
-    explicit KeymasterKeyBlob(size_t size) {
+    explicit KeymasterKeyBlob(size_t size) : owned_(true) {
         key_material_size = 0;
         key_material = new (std::nothrow) uint8_t[size];
-        if (key_material)
+        if (key_material) {
+            AllocationCounter::Count(size);
             key_material_size = size;
+        }
     }
 
-    explicit KeymasterKeyBlob(const keymaster_key_blob_t& blob) {
+    explicit KeymasterKeyBlob(const keymaster_key_blob_t& blob) : owned_(true) {
         key_material_size = 0;
         key_material = dup_buffer(blob.key_material, blob.key_material_size);
         if (key_material)
             key_material_size = blob.key_material_size;
     }
 
-    KeymasterKeyBlob(const KeymasterKeyBlob& blob) {
+    /**
+     * Refers to blob's key material rather than copying it.  The key material must outlive this
+     * object, which never modifies, zeroes or frees it.  Copies of a borrowing blob own copies of
+     * the key material, and Reset() and Deserialize() replace the borrowed reference with key
+     * material of the blob's own.
+     */
+    KeymasterKeyBlob(const keymaster_key_blob_t& blob, BorrowTag) : owned_(false) {
+        key_material = blob.key_material;
+        key_material_size = blob.key_material_size;
+    }
+
+    KeymasterKeyBlob(const KeymasterKeyBlob& blob) : owned_(true) {
         key_material_size = 0;
         key_material = dup_buffer(blob.key_material, blob.key_material_size);
         if (key_material)
@@ -258,9 +281,14 @@ struct KeymasterKeyBlob : public keymaster_key_blob_t {
     const uint8_t* begin() const { return key_material; }
     const uint8_t* end() const { return key_material + key_material_size; }
 
+    bool borrowed() const { return !owned_; }
+
     void Clear() {
-        memset_s(const_cast<uint8_t*>(key_material), 0, key_material_size);
-        delete[] key_material;
+        if (owned_) {
+            memset_s(const_cast<uint8_t*>(key_material), 0, key_material_size);
+            delete[] key_material;
+        }
+        owned_ = true;
         key_material = nullptr;
         key_material_size = 0;
     }
@@ -268,17 +296,27 @@ struct KeymasterKeyBlob : public keymaster_key_blob_t {
     const uint8_t* Reset(size_t new_size) {
         Clear();
         key_material = new (std::nothrow) uint8_t[new_size];
-        if (key_material)
+        if (key_material) {
+            AllocationCounter::Count(new_size);
             key_material_size = new_size;
+        }
         return key_material;
     }
 
     // The key_material in keymaster_key_blob_t is const, which is the right thing in most
     // circumstances, but occasionally we do need to write into it.  This method exposes a non-const
-    // version of the pointer.  Use sparingly.
+    // version of the pointer.  Use sparingly, and never on a borrowing blob.
     uint8_t* writable_data() { return const_cast<uint8_t*>(key_material); }
 
+    // Returns the key material for the caller to delete[], copying it first if it's borrowed.
     keymaster_key_blob_t release() {
+        if (!owned_) {
+            keymaster_key_blob_t tmp = {dup_buffer(key_material, key_material_size), 0};
+            if (tmp.key_material)
+                tmp.key_material_size = key_material_size;
+            Clear();
+            return tmp;
+        }
         keymaster_key_blob_t tmp = {key_material, key_material_size};
         key_material = nullptr;
         key_material_size = 0;
@@ -301,6 +339,9 @@ struct KeymasterKeyBlob : public keymaster_key_blob_t {
         key_material = tmp.release();
         return true;
     }
+
+  private:
+    bool owned_;
 };
 
 struct Characteristics_Delete {
@@ -0,0 +1,86 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SYSTEM_KEYMASTER_ASYNC_LOGGER_H_
+#define SYSTEM_KEYMASTER_ASYNC_LOGGER_H_
+
+#include <stdint.h>
+
+#include <atomic>
+#include <thread>
+
+#include <UniquePtr.h>
+
+#include <keymaster/logger.h>
+
+namespace keymaster {
+
+/**
+ * AsyncLogger formats each message on the logging thread into a slot of a lock-free ring buffer,
+ * and passes it to another Logger, the sink, from a background thread.  Logging thus costs a
+ * format and a few atomic operations, however slow the sink is.
+ *
+ * The sink usually installs itself as the Logger instance when constructed, so it should be
+ * constructed first; AsyncLogger then takes its place, and restores it when destroyed, after
+ * passing on any remaining messages.  Messages longer than kMaxMessageLength are truncated, and
+ * messages logged while the buffer is full are dropped and counted.
+ */
+class AsyncLogger : public Logger {
+  public:
+    static const size_t kMaxMessageLength = 256;
+
+    /**
+     * Creates a logger buffering up to capacity messages, which is rounded up to a power of two.
+     * Doesn't take ownership of sink.
+     */
+    AsyncLogger(Logger* sink, size_t capacity);
+    ~AsyncLogger();
+
+    int log_msg(LogLevel level, const char* fmt, va_list args) const override;
+
+    /**
+     * Blocks until every message logged before the call has been passed to the sink.
+     */
+    void Flush() const;
+
+    uint64_t dropped_count() const { return dropped_.load(std::memory_order_relaxed); }
+
+  private:
+    struct Slot {
+        // The ring position this slot is ready for: equal to it when free to be written, and one
+        // more than it once written and ready to be passed on.
+        std::atomic<uint64_t> sequence;
+        LogLevel level;
+        char message[kMaxMessageLength];
+    };
+
+    // Passes on ready messages; returns false if there were none.
+    bool Drain() const;
+    void Run();
+
+    Logger* sink_;
+    const size_t capacity_;
+    UniquePtr<Slot[]> slots_;
+    mutable std::atomic<uint64_t> write_position_;
+    mutable std::atomic<uint64_t> read_position_;
+    mutable std::atomic<uint64_t> dropped_;
+    std::atomic<bool> stopping_;
+    std::thread drain_thread_;
+};
+
+}  // namespace keymaster
+
+#endif  // SYSTEM_KEYMASTER_ASYNC_LOGGER_H_
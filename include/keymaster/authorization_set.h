@@ -34,14 +34,15 @@ class AuthorizationSetBuilder;
 class AuthorizationSet : public Serializable, public keymaster_key_param_set_t {
   public:
     /**
-     * Construct an empty, dynamically-allocated, growable AuthorizationSet.  Does not actually
-     * allocate any storage until elements are added, so there is no cost to creating an
-     * AuthorizationSet with this constructor and then reinitializing it to point at pre-allocated
-     * buffers, with \p Reinitialize.
+     * Construct an empty, growable AuthorizationSet.  Small sets are held in storage inside the
+     * object, and heap storage isn't allocated until the set outgrows it, so there is no cost to
+     * creating an AuthorizationSet with this constructor and then reinitializing it with \p
+     * Reinitialize.
      */
     AuthorizationSet()
         : elems_capacity_(0), indirect_data_(NULL), indirect_data_size_(0),
-          indirect_data_capacity_(0), error_(OK) {
+          indirect_data_capacity_(0), elems_serialized_size_(0), error_(OK),
+          sorted_by_tag_(true) {
         elems_ = nullptr;
         elems_size_ = 0;
     }
@@ -153,10 +154,18 @@ class AuthorizationSet : public Serializable, public keymaster_key_param_set_t {
     const keymaster_key_param_t* data() const { return elems_; }
 
     /**
-     * Sorts the set
+     * Sorts the set.  Until the set is next modified out of order, tag lookups (\p find, \p
+     * Contains, \p GetTagValue, etc.) use binary search rather than a linear scan.
      */
     void Sort();
 
+    /**
+     * Returns true if the elements are in ascending tag order, so that lookups can binary search.
+     * This holds after \p Sort or \p Deduplicate, and also for any set that was built, copied or
+     * deserialized in tag order.
+     */
+    bool is_sorted_by_tag() const { return sorted_by_tag_; }
+
     /**
      * Sorts the set and removes duplicates (inadvertently duplicating tags is easy to do with the
      * AuthorizationSetBuilder).
@@ -170,6 +179,23 @@ class AuthorizationSet : public Serializable, public keymaster_key_param_set_t {
      */
     void CopyToParamSet(keymaster_key_param_set_t* set) const;
 
+    /**
+     * Like CopyToParamSet, but makes a single allocation holding both the params array and all
+     * blob data, with the blob pointers pointing past the end of the array.  The result must be
+     * freed with free(set->params) alone; keymaster_free_param_set would free the blob pointers
+     * too.  On allocation failure set is left empty.
+     */
+    void CopyToPackedParamSet(keymaster_key_param_set_t* set) const;
+
+    /**
+     * Returns the bytes of heap storage the set holds, which is zero while it fits in its inline
+     * storage.
+     */
+    size_t heap_bytes() const {
+        return (elems_ != inline_elems_ ? elems_capacity_ * sizeof(*elems_) : 0) +
+               (indirect_data_ != inline_indirect_data_ ? indirect_data_capacity_ : 0);
+    }
+
     /**
      * Returns the offset of the next entry that matches \p tag, starting from the element after \p
      * begin.  If not found, returns -1.
@@ -182,6 +208,27 @@ class AuthorizationSet : public Serializable, public keymaster_key_param_set_t {
      */
     bool erase(int index);
 
+    /**
+     * Removes every entry for which \p pred returns true, in one pass that keeps the order of the
+     * rest.  Returns the number of entries removed.
+     */
+    template <typename Predicate> size_t RemoveIf(Predicate pred) {
+        size_t original_size = elems_size_;
+        Extract(pred, nullptr);
+        return original_size - elems_size_;
+    }
+
+    /**
+     * Moves every entry for which \p pred returns true to the end of \p matching, in one pass that
+     * keeps the order of both.  Returns false if \p matching couldn't take them all, in which case
+     * the entries from the failed one on stay in this set.
+     */
+    template <typename Predicate> bool Partition(Predicate pred, AuthorizationSet* matching) {
+        if (!matching || matching == this)
+            return false;
+        return Extract(pred, matching);
+    }
+
     /**
      * Returns iterator (pointer) to beginning of elems array, to enable STL-style iteration
      */
@@ -193,7 +240,10 @@ class AuthorizationSet : public Serializable, public keymaster_key_param_set_t {
     const keymaster_key_param_t* end() const { return elems_ + elems_size_; }
 
     /**
-     * Returns the nth element of the set.
+     * Returns the nth element of the set.  Since the caller may change the element's tag, this
+     * forgets whether the set is sorted.  It must not be changed to a tag of another type, since
+     * the set keeps the size of its serialized elements up to date as the set changes, and that
+     * depends on their types.
      */
     keymaster_key_param_t& operator[](int n);
 
@@ -365,6 +415,12 @@ class AuthorizationSet : public Serializable, public keymaster_key_param_set_t {
      */
     bool reserve_indirect(size_t length);
 
+    /**
+     * Make room for \p elems more entries and \p indirect_bytes more bytes of blob data, so that
+     * a caller that knows how much it will add can do it without repeated reallocation.
+     */
+    bool Reserve(size_t elems, size_t indirect_bytes);
+
     bool push_back(const keymaster_key_param_set_t& set);
 
     /**
@@ -423,8 +479,28 @@ class AuthorizationSet : public Serializable, public keymaster_key_param_set_t {
     size_t SerializedSize() const;
     uint8_t* Serialize(uint8_t* serialized_set, const uint8_t* end) const;
     bool Deserialize(const uint8_t** buf_ptr, const uint8_t* end);
+    bool SerializeTo(SerializationSink* sink) const;
+
+    /**
+     * As above, in \p format.  In COMPACT_FORMAT the set is an element count followed by the
+     * elements, each a varint of the tag, with its type in the low four bits, and a value of the
+     * width its type needs: a varint for enumerated and integer values, one byte for booleans, and
+     * the varint length and the bytes themselves for blobs.  Compact sets are never used in key
+     * blobs, so SerializeTo(), which feeds them to digests and MACs, has no compact form.
+     */
+    size_t SerializedSize(SerializationFormat format) const;
+    uint8_t* Serialize(uint8_t* serialized_set, const uint8_t* end,
+                       SerializationFormat format) const;
+    bool Deserialize(const uint8_t** buf_ptr, const uint8_t* end, SerializationFormat format);
 
-    size_t SerializedSizeOfElements() const;
+    /**
+     * Advances \p *buf_ptr past a serialized AuthorizationSet without deserializing it.  Only the
+     * length fields are checked, so a false return means Deserialize() would certainly fail, but a
+     * true return doesn't mean it would succeed.
+     */
+    static bool SkipSerialized(const uint8_t** buf_ptr, const uint8_t* end);
+
+    size_t SerializedSizeOfElements() const { return elems_serialized_size_; }
 
   private:
     void FreeData();
@@ -433,7 +509,31 @@ class AuthorizationSet : public Serializable, public keymaster_key_param_set_t {
     void set_invalid(Error err);
 
     static size_t ComputeIndirectDataSize(const keymaster_key_param_t* elems, size_t count);
+    static bool IsSortedByTag(const keymaster_key_param_t* elems, size_t count);
+    // Copies the elements' blob data into indirect_data_, and sums their serialized sizes.
     void CopyIndirectData();
+    // Shrinks the set to the first \p kept entries, once the entries to keep have been moved
+    // there, and brings the serialized size and indirect data into line.
+    void FinishCompaction(size_t kept);
+    // Slides the elements' blob data down over any no longer referenced, in place.
+    void CompactIndirectData();
+
+    template <typename Predicate> bool Extract(Predicate pred, AuthorizationSet* matching) {
+        if (is_valid() != OK)
+            return false;
+        bool ok = true;
+        size_t kept = 0;
+        for (size_t i = 0; i < elems_size_; ++i) {
+            // After a failed push_back everything else stays put.
+            if (ok && pred(elems_[i]) && (!matching || (ok = matching->push_back(elems_[i]))))
+                continue;
+            if (kept != i)
+                elems_[kept] = elems_[i];
+            ++kept;
+        }
+        FinishCompaction(kept);
+        return ok;
+    }
     bool CheckIndirectData();
 
     bool DeserializeIndirectData(const uint8_t** buf_ptr, const uint8_t* end);
@@ -461,7 +561,18 @@ class AuthorizationSet : public Serializable, public keymaster_key_param_set_t {
     uint8_t* indirect_data_;
     size_t indirect_data_size_;
     size_t indirect_data_capacity_;
+    // The sum of the serialized sizes of the elements, kept up to date by every method that adds
+    // or removes elements, so that SerializedSize() doesn't have to walk the set.
+    size_t elems_serialized_size_;
     Error error_;
+    bool sorted_by_tag_;
+
+    // Most sets are small, so they are stored inline in these buffers, avoiding heap allocations.
+    // Larger sets spill to the heap.
+    static const size_t INLINE_ELEMS_CAPACITY = 16;
+    static const size_t INLINE_INDIRECT_DATA_CAPACITY = 128;
+    keymaster_key_param_t inline_elems_[INLINE_ELEMS_CAPACITY];
+    uint8_t inline_indirect_data_[INLINE_INDIRECT_DATA_CAPACITY];
 };
 
 class AuthorizationSetBuilder {
@@ -499,10 +610,17 @@ class AuthorizationSetBuilder {
         return Authorization(tag, reinterpret_cast<const uint8_t*>(data), data_length);
     }
 
+    AuthorizationSetBuilder& Reserve(size_t elems, size_t indirect_bytes) {
+        set.Reserve(elems, indirect_bytes);
+        return *this;
+    }
+
     AuthorizationSetBuilder& RsaKey(uint32_t key_size, uint64_t public_exponent);
     AuthorizationSetBuilder& EcdsaKey(uint32_t key_size);
     AuthorizationSetBuilder& AesKey(uint32_t key_size);
     AuthorizationSetBuilder& HmacKey(uint32_t key_size);
+    AuthorizationSetBuilder& ChaCha20Poly1305Key();
+    AuthorizationSetBuilder& Ed25519SigningKey();
 
     AuthorizationSetBuilder& RsaSigningKey(uint32_t key_size, uint64_t public_exponent);
     AuthorizationSetBuilder& RsaEncryptionKey(uint32_t key_size, uint64_t public_exponent);
@@ -559,6 +677,18 @@ inline AuthorizationSetBuilder& AuthorizationSetBuilder::HmacKey(uint32_t key_si
     return SigningKey();
 }
 
+inline AuthorizationSetBuilder& AuthorizationSetBuilder::ChaCha20Poly1305Key() {
+    Authorization(TAG_ALGORITHM, KM_ALGORITHM_CHACHA20_POLY1305);
+    Authorization(TAG_KEY_SIZE, 256);
+    return EncryptionKey();
+}
+
+inline AuthorizationSetBuilder& AuthorizationSetBuilder::Ed25519SigningKey() {
+    Authorization(TAG_ALGORITHM, KM_ALGORITHM_ED25519);
+    Authorization(TAG_KEY_SIZE, 256);
+    return SigningKey();
+}
+
 inline AuthorizationSetBuilder& AuthorizationSetBuilder::RsaSigningKey(uint32_t key_size,
                                                                        uint64_t public_exponent) {
     RsaKey(key_size, public_exponent);
@@ -600,6 +730,200 @@ inline AuthorizationSetBuilder& AuthorizationSetBuilder::EcbMode() {
     return Authorization(TAG_BLOCK_MODE, KM_MODE_ECB);
 }
 
+/**
+ * A read-only view of a serialized AuthorizationSet.  Unlike AuthorizationSet::Deserialize, which
+ * copies the elements and their indirect data into freshly-allocated arrays, the view looks tags
+ * up in place, decoding elements as it walks them.  It refers to the buffer it was initialized
+ * from, which must outlive it, and blobs it returns point into that buffer.
+ *
+ * Each lookup is a linear walk over the serialized elements, so views suit sets that are checked a
+ * few times and then discarded.  Use CopyTo() to get an AuthorizationSet when one is needed.
+ */
+class AuthorizationSetView {
+  public:
+    AuthorizationSetView()
+        : indirect_data_(nullptr), indirect_data_size_(0), elems_(nullptr), elems_end_(nullptr),
+          elems_count_(0) {}
+
+    /**
+     * Points the view at the serialized AuthorizationSet at \p *buf_ptr and advances \p *buf_ptr
+     * past it, exactly as AuthorizationSet::Deserialize would.  The serialized data is validated
+     * as thoroughly as Deserialize validates it, so this returns false if and only if Deserialize
+     * would fail.
+     */
+    bool Init(const uint8_t** buf_ptr, const uint8_t* end);
+
+    /**
+     * Returns the number of elements in the set.
+     */
+    size_t size() const { return elems_count_; }
+
+    bool empty() const { return size() == 0; }
+
+    /**
+     * Copies the set's elements and indirect data into \p set, replacing its previous contents.
+     */
+    bool CopyTo(AuthorizationSet* set) const;
+
+    /**
+     * Returns true if the set contains at least one instance of \p tag
+     */
+    bool Contains(keymaster_tag_t tag) const { return GetParam(tag, 0, nullptr); }
+
+    /**
+     * Returns the number of \p tag entries.
+     */
+    size_t GetTagCount(keymaster_tag_t tag) const;
+
+    /**
+     * Returns true if the set contains the specified tag and value.
+     */
+    template <keymaster_tag_t Tag, typename T>
+    bool Contains(TypedEnumTag<KM_ENUM_REP, Tag, T> tag, T val) const {
+        return ContainsValue(tag, val);
+    }
+
+    /**
+     * Returns true if the set contains the specified tag and value.
+     */
+    template <keymaster_tag_t Tag, typename T>
+    bool Contains(TypedEnumTag<KM_ENUM, Tag, T> tag, T val) const {
+        return ContainsValue(tag, val);
+    }
+
+    /**
+     * Returns true if the set contains the specified tag and value.
+     */
+    template <keymaster_tag_t Tag>
+    bool Contains(TypedTag<KM_UINT, Tag> tag, uint32_t val) const {
+        return ContainsValue(tag, val);
+    }
+
+    /*
+     * The GetTagValue overloads below behave like their AuthorizationSet counterparts: if the
+     * (specified instance of the) tag exists they place its value in \p val and return true,
+     * otherwise they leave \p val unmodified and return false.
+     */
+
+    template <keymaster_tag_t Tag>
+    bool GetTagValue(TypedTag<KM_UINT, Tag> tag, uint32_t* val) const {
+        keymaster_key_param_t param;
+        if (!GetParam(tag, 0, &param))
+            return false;
+        *val = param.integer;
+        return true;
+    }
+
+    template <keymaster_tag_t Tag>
+    bool GetTagValue(TypedTag<KM_UINT_REP, Tag> tag, size_t instance, uint32_t* val) const {
+        keymaster_key_param_t param;
+        if (!GetParam(tag, instance, &param))
+            return false;
+        *val = param.integer;
+        return true;
+    }
+
+    template <keymaster_tag_t Tag>
+    bool GetTagValue(TypedTag<KM_ULONG, Tag> tag, uint64_t* val) const {
+        keymaster_key_param_t param;
+        if (!GetParam(tag, 0, &param))
+            return false;
+        *val = param.long_integer;
+        return true;
+    }
+
+    template <keymaster_tag_t Tag>
+    bool GetTagValue(TypedTag<KM_ULONG_REP, Tag> tag, size_t instance, uint64_t* val) const {
+        keymaster_key_param_t param;
+        if (!GetParam(tag, instance, &param))
+            return false;
+        *val = param.long_integer;
+        return true;
+    }
+
+    template <keymaster_tag_t Tag>
+    bool GetTagValue(TypedTag<KM_DATE, Tag> tag, uint64_t* val) const {
+        keymaster_key_param_t param;
+        if (!GetParam(tag, 0, &param))
+            return false;
+        *val = param.date_time;
+        return true;
+    }
+
+    template <keymaster_tag_t Tag, typename T>
+    bool GetTagValue(TypedEnumTag<KM_ENUM, Tag, T> tag, T* val) const {
+        keymaster_key_param_t param;
+        if (!GetParam(tag, 0, &param))
+            return false;
+        *val = static_cast<T>(param.enumerated);
+        return true;
+    }
+
+    template <keymaster_tag_t Tag, typename T>
+    bool GetTagValue(TypedEnumTag<KM_ENUM_REP, Tag, T> tag, size_t instance, T* val) const {
+        keymaster_key_param_t param;
+        if (!GetParam(tag, instance, &param))
+            return false;
+        *val = static_cast<T>(param.enumerated);
+        return true;
+    }
+
+    /**
+     * If exactly one instance of the specified enumeration-typed \p tag exists, places its value in
+     * \p val and returns true.  Otherwise leaves \p val unmodified and returns false.
+     */
+    template <keymaster_tag_t Tag, typename T>
+    bool GetTagValue(TypedEnumTag<KM_ENUM_REP, Tag, T> tag, T* val) const {
+        return GetTagCount(tag) == 1 && GetTagValue(tag, 0, val);
+    }
+
+    /**
+     * The returned blob points into the serialized data the view was initialized from.
+     */
+    template <keymaster_tag_t Tag>
+    bool GetTagValue(TypedTag<KM_BYTES, Tag> tag, keymaster_blob_t* val) const {
+        keymaster_key_param_t param;
+        if (!GetParam(tag, 0, &param))
+            return false;
+        *val = param.blob;
+        return true;
+    }
+
+    /**
+     * The returned blob points into the serialized data the view was initialized from.
+     */
+    template <keymaster_tag_t Tag>
+    bool GetTagValue(TypedTag<KM_BIGNUM, Tag> tag, keymaster_blob_t* val) const {
+        keymaster_key_param_t param;
+        if (!GetParam(tag, 0, &param))
+            return false;
+        *val = param.blob;
+        return true;
+    }
+
+    /**
+     * Returns true if the specified tag is present, and therefore has the value 'true'.
+     */
+    template <keymaster_tag_t Tag> bool GetTagValue(TypedTag<KM_BOOL, Tag> tag) const {
+        keymaster_key_param_t param;
+        return GetParam(tag, 0, &param) && param.boolean;
+    }
+
+  private:
+    /**
+     * Decodes the specified instance of \p tag into \p param, if \p param is non-null.  Returns
+     * false if there are no more than \p instance instances.
+     */
+    bool GetParam(keymaster_tag_t tag, size_t instance, keymaster_key_param_t* param) const;
+    bool ContainsValue(keymaster_tag_t tag, uint32_t val) const;
+
+    const uint8_t* indirect_data_;
+    size_t indirect_data_size_;
+    const uint8_t* elems_;
+    const uint8_t* elems_end_;
+    size_t elems_count_;
+};
+
 }  // namespace keymaster
 
 #endif  // SYSTEM_KEYMASTER_KEY_AUTHORIZATION_SET_H_
@@ -17,6 +17,8 @@
 #ifndef SYSTEM_KEYMASTER_EC_KEY_FACTORY_H_
 #define SYSTEM_KEYMASTER_EC_KEY_FACTORY_H_
 
+#include <memory>
+
 #include <openssl/ec.h>
 #include <openssl/evp.h>
 
@@ -24,9 +26,14 @@
 
 namespace keymaster {
 
+class PrecomputationFiller;
+class PregeneratedKeyPool;
+class VerificationCache;
+
 class EcKeyFactory : public AsymmetricKeyFactory {
   public:
-    EcKeyFactory(const KeymasterContext* context) : AsymmetricKeyFactory(context) {}
+    EcKeyFactory(const KeymasterContext* context);
+    ~EcKeyFactory() override;
 
     keymaster_algorithm_t keymaster_key_type() const override { return KM_ALGORITHM_EC; }
     int evp_key_type() const override { return EVP_PKEY_EC; }
@@ -40,24 +47,71 @@ class EcKeyFactory : public AsymmetricKeyFactory {
                                 KeymasterKeyBlob* output_key_blob, AuthorizationSet* hw_enforced,
                                 AuthorizationSet* sw_enforced) const override;
 
+    keymaster_error_t LoadKey(const KeymasterKeyBlob& key_material,
+                              const AuthorizationSet& additional_params,
+                              const AuthorizationSet& hw_enforced,
+                              const AuthorizationSet& sw_enforced,
+                              UniquePtr<Key>* key) const override;
+
     keymaster_error_t CreateEmptyKey(const AuthorizationSet& hw_enforced,
                                      const AuthorizationSet& sw_enforced,
                                      UniquePtr<AsymmetricKey>* key) const override;
 
-    keymaster_error_t UpdateImportKeyDescription(const AuthorizationSet& key_description,
-                                                 keymaster_key_format_t key_format,
-                                                 const KeymasterKeyBlob& key_material,
-                                                 AuthorizationSet* updated_description,
-                                                 uint32_t* key_size) const;
+    // If normalized_key_material is non-null, the key is also encoded into it in the form LoadKey
+    // reads fastest, if it's consistent; see compact_private_key.h.  It's left empty for keys that
+    // should be stored as imported.
+    keymaster_error_t
+    UpdateImportKeyDescription(const AuthorizationSet& key_description,
+                               keymaster_key_format_t key_format,
+                               const KeymasterKeyBlob& key_material,
+                               AuthorizationSet* updated_description, uint32_t* key_size,
+                               KeymasterKeyBlob* normalized_key_material = nullptr) const;
 
     OperationFactory* GetOperationFactory(keymaster_purpose_t purpose) const override;
 
+    // KM_KEY_FORMAT_X509, and KM_KEY_FORMAT_X509_COMPRESSED.
+    const keymaster_key_format_t* SupportedExportFormats(size_t* format_count) const override;
+
+    /**
+     * Keeps up to pool_size keys pre-generated on a background thread for each of the curve_count
+     * curves, refilling a curve once fewer than low_water_mark of its keys remain.  GenerateKey
+     * requests for a pooled curve use a pre-generated key when one is ready, and otherwise generate
+     * the key inline as usual.  May only be called once.
+     */
+    keymaster_error_t EnableKeyPregeneration(const keymaster_ec_curve_t* curves, size_t curve_count,
+                                             size_t pool_size, size_t low_water_mark);
+
+    /**
+     * Gives each key this factory loads a queue of up to queue_size ECDSA nonce setups (k^-1 and
+     * r), precomputed on a background thread, so signing needn't compute r inline.  Each setup is
+     * used for one signature.  The queues live as long as the loaded keys, so this pays off when
+     * loaded keys are cached across operations.  May only be called once.
+     */
+    keymaster_error_t EnableSignSetupPrecomputation(size_t queue_size);
+
+    /**
+     * Makes verify operations with the keys this factory loads skip the public-key arithmetic for
+     * signatures already in cache, and add those that verify; see VerificationCache.  The cache
+     * may be shared with other factories.
+     */
+    void EnableVerificationCache(const std::shared_ptr<VerificationCache>& cache) {
+        verification_cache_ = cache;
+    }
+
   protected:
     static EC_GROUP* ChooseGroup(size_t key_size_bits);
     static EC_GROUP* ChooseGroup(keymaster_ec_curve_t ec_curve);
 
     static keymaster_error_t GetCurveAndSize(const AuthorizationSet& key_description,
                                              keymaster_ec_curve_t* curve, uint32_t* key_size_bits);
+
+  private:
+    static EVP_PKEY* GenerateEcKey(keymaster_ec_curve_t ec_curve, keymaster_error_t* error);
+
+    UniquePtr<PregeneratedKeyPool> key_pool_;
+    std::shared_ptr<PrecomputationFiller> sign_setup_filler_;
+    size_t sign_setup_queue_size_;
+    std::shared_ptr<VerificationCache> verification_cache_;
 };
 
 }  // namespace keymaster
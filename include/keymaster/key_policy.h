@@ -0,0 +1,94 @@
+/*
+ * Copyright 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SYSTEM_KEYMASTER_KEY_POLICY_H_
+#define SYSTEM_KEYMASTER_KEY_POLICY_H_
+
+#include <UniquePtr.h>
+
+#include <hardware/keymaster_defs.h>
+#include <keymaster/authorization_set.h>
+#include <keymaster/serializable.h>
+
+namespace keymaster {
+
+/**
+ * The parts of a key's authorizations that KeymasterEnforcement checks when an operation begins,
+ * compiled into fixed fields so that authorizing a Begin doesn't walk the key's tag list.
+ * SoftKeymasterContext compiles one when it creates a key blob and stores it in the blob, where
+ * it's covered by the blob's integrity check; for other blobs it's compiled when the key is loaded.
+ */
+struct KeyPolicy : public Serializable {
+    enum Flags : uint32_t {
+        // The key has a tag that never belongs in key authorizations, such as TAG_AUTH_TOKEN or
+        // TAG_BOOTLOADER_ONLY, so it can't be used.
+        INVALID_TAG = 1 << 0,
+        // The key's (first) TAG_ALGORITHM is RSA or EC.
+        PUBLIC_KEY_ALGORITHM = 1 << 1,
+        CALLER_NONCE = 1 << 2,
+        NO_AUTH_REQUIRED = 1 << 3,
+        // Each of the following is set if the key has the tag, and the corresponding field below
+        // holds its value.
+        HAS_ACTIVE_DATETIME = 1 << 4,
+        HAS_ORIGINATION_EXPIRE_DATETIME = 1 << 5,
+        HAS_USAGE_EXPIRE_DATETIME = 1 << 6,
+        HAS_MIN_SECONDS_BETWEEN_OPS = 1 << 7,
+        HAS_MAX_USES_PER_BOOT = 1 << 8,
+        HAS_USER_AUTH_TYPE = 1 << 9,
+        HAS_AUTH_TIMEOUT = 1 << 10,
+    };
+
+    KeyPolicy() { Clear(); }
+
+    void Clear();
+
+    /**
+     * Compiles the policy of a key with the specified authorizations.  Where a key has a limiting
+     * tag more than once, the most restrictive value is kept, so that checking it is equivalent to
+     * checking each of them.
+     */
+    keymaster_error_t Compile(const AuthorizationSet& hw_enforced,
+                              const AuthorizationSet& sw_enforced);
+    keymaster_error_t Compile(const AuthorizationSet& authorizations);
+
+    bool has_purpose(keymaster_purpose_t purpose) const {
+        return purpose < 32 && (purposes & (1U << purpose));
+    }
+
+    size_t SerializedSize() const override;
+    uint8_t* Serialize(uint8_t* buf, const uint8_t* end) const override;
+    bool Deserialize(const uint8_t** buf_ptr, const uint8_t* end) override;
+
+    uint32_t flags;
+    // Bit (1 << purpose) is set for each of the key's TAG_PURPOSEs.
+    uint32_t purposes;
+    // The latest TAG_ACTIVE_DATETIME and the earliest expiry dates.
+    uint64_t active_datetime;
+    uint64_t origination_expire_datetime;
+    uint64_t usage_expire_datetime;
+    // The largest TAG_MIN_SECONDS_BETWEEN_OPS and the smallest TAG_MAX_USES_PER_BOOT.
+    uint32_t min_seconds_between_ops;
+    uint32_t max_uses_per_boot;
+    // The last TAG_USER_AUTH_TYPE and TAG_AUTH_TIMEOUT, which are the ones enforcement checks.
+    uint32_t user_auth_type;
+    uint32_t auth_timeout;
+    size_t secure_id_count;
+    UniquePtr<uint64_t[]> secure_ids;
+};
+
+}  // namespace keymaster
+
+#endif  // SYSTEM_KEYMASTER_KEY_POLICY_H_
@@ -18,10 +18,13 @@
 #define SYSTEM_KEYMASTER_KEYMASTER_CONTEXT_H_
 
 #include <assert.h>
+#include <time.h>
 
 #include <openssl/evp.h>
+#include <openssl/x509.h>
 
 #include <hardware/keymaster_defs.h>
+#include <keymaster/android_keymaster_utils.h>
 #include <keymaster/keymaster_enforcement.h>
 
 namespace keymaster {
@@ -29,7 +32,16 @@ namespace keymaster {
 class AuthorizationSet;
 class KeyFactory;
 class OperationFactory;
-struct KeymasterKeyBlob;
+
+/**
+ * One of the key blobs of a ParseKeyCharacteristicsBatch call, with places for its results.
+ */
+struct KeyCharacteristicsQuery {
+    const KeymasterKeyBlob* blob;
+    AuthorizationSet* hw_enforced;
+    AuthorizationSet* sw_enforced;
+    keymaster_error_t error;
+};
 
 /**
  * KeymasterContext provides a singleton abstract interface that encapsulates various
@@ -127,6 +139,95 @@ class KeymasterContext {
                                            AuthorizationSet* hw_enforced,
                                            AuthorizationSet* sw_enforced) const = 0;
 
+    /**
+     * ParseKeyCharacteristics is ParseKeyBlob for callers that need only the authorization sets.
+     * It performs the same integrity checks, but contexts should avoid extracting or copying the
+     * key material where their blob formats allow it.  The default implementation calls
+     * ParseKeyBlob and discards the key material.
+     *
+     * This method is called by AndroidKeymaster.
+     */
+    virtual keymaster_error_t ParseKeyCharacteristics(const KeymasterKeyBlob& blob,
+                                                      const AuthorizationSet& additional_params,
+                                                      AuthorizationSet* hw_enforced,
+                                                      AuthorizationSet* sw_enforced) const {
+        KeymasterKeyBlob key_material;
+        return ParseKeyBlob(blob, additional_params, &key_material, hw_enforced, sw_enforced);
+    }
+
+    /**
+     * ParseKeyCharacteristicsBatch is ParseKeyCharacteristics for each of \p count queries, all
+     * with the same \p additional_params, placing each result in the query's error.  Contexts
+     * with per-call setup that depends only on the parameters should override it to do that setup
+     * once.  The default implementation calls ParseKeyCharacteristics for each query.
+     *
+     * This method is called by AndroidKeymaster.
+     */
+    virtual void ParseKeyCharacteristicsBatch(const AuthorizationSet& additional_params,
+                                              KeyCharacteristicsQuery* queries,
+                                              size_t count) const {
+        for (size_t i = 0; i < count; ++i)
+            queries[i].error = ParseKeyCharacteristics(*queries[i].blob, additional_params,
+                                                       queries[i].hw_enforced,
+                                                       queries[i].sw_enforced);
+    }
+
+    /**
+     * ParseKeyBlobWithPolicy is ParseKeyBlob for callers that also need the key's enforcement
+     * policy.  Contexts whose blobs store a policy compiled when the blob was created should return
+     * that one, taken from the same integrity-checked blob.  The default implementation calls
+     * ParseKeyBlob and compiles the policy from the authorization sets.
+     *
+     * This method is called by AndroidKeymaster.
+     */
+    virtual keymaster_error_t ParseKeyBlobWithPolicy(const KeymasterKeyBlob& blob,
+                                                     const AuthorizationSet& additional_params,
+                                                     KeymasterKeyBlob* key_material,
+                                                     AuthorizationSet* hw_enforced,
+                                                     AuthorizationSet* sw_enforced,
+                                                     KeyPolicy* policy) const {
+        keymaster_error_t error =
+            ParseKeyBlob(blob, additional_params, key_material, hw_enforced, sw_enforced);
+        if (error != KM_ERROR_OK)
+            return error;
+        return policy->Compile(*hw_enforced, *sw_enforced);
+    }
+
+    /**
+     * ParseKeyBlobWithLegacyStatus is ParseKeyBlob for callers that also want to know whether the
+     * blob is in a format the context reads only so that old keys keep working.  Such blobs cost
+     * more to parse than current ones, and MigrateKeyBlob can re-wrap them.  The default
+     * implementation calls ParseKeyBlob and reports every blob as current.
+     *
+     * This method is called by AndroidKeymaster.
+     */
+    virtual keymaster_error_t
+    ParseKeyBlobWithLegacyStatus(const KeymasterKeyBlob& blob,
+                                 const AuthorizationSet& additional_params,
+                                 KeymasterKeyBlob* key_material, AuthorizationSet* hw_enforced,
+                                 AuthorizationSet* sw_enforced, bool* legacy) const {
+        *legacy = false;
+        return ParseKeyBlob(blob, additional_params, key_material, hw_enforced, sw_enforced);
+    }
+
+    /**
+     * MigrateKeyBlob re-wraps a blob in a legacy format (see ParseKeyBlobWithLegacyStatus) into
+     * the current one, with the same key material and authorizations.  \p additional_params must
+     * be those the key is used with, which the new blob is bound to as the old one was.  Blobs
+     * already in the current format are checked but not re-wrapped, leaving \p migrated_key empty.
+     * Version info is left as it was; UpgradeKeyBlob updates it.  The default implementation has
+     * no legacy formats.
+     *
+     * This method is called by AndroidKeymaster.
+     */
+    virtual keymaster_error_t MigrateKeyBlob(const KeymasterKeyBlob& blob,
+                                             const AuthorizationSet& additional_params,
+                                             KeymasterKeyBlob* /* migrated_key */) const {
+        AuthorizationSet hw_enforced;
+        AuthorizationSet sw_enforced;
+        return ParseKeyCharacteristics(blob, additional_params, &hw_enforced, &sw_enforced);
+    }
+
     /**
      * Take whatever environment-specific action is appropriate (if any) to delete the specified
      * key.
@@ -135,6 +236,17 @@ class KeymasterContext {
         return KM_ERROR_OK;
     }
 
+    /**
+     * DeleteKey for each of \p count blobs, placing each result in \p errors.  Contexts backed
+     * by hardware that can delete several keys in one call should override it.  The default
+     * implementation calls DeleteKey for each blob.
+     */
+    virtual void DeleteKeys(const KeymasterKeyBlob* const* blobs, size_t count,
+                            keymaster_error_t* errors) const {
+        for (size_t i = 0; i < count; ++i)
+            errors[i] = DeleteKey(*blobs[i]);
+    }
+
     /**
      * Take whatever environment-specific action is appropriate to delete all keys.
      */
@@ -154,14 +266,61 @@ class KeymasterContext {
      */
     virtual keymaster_error_t GenerateRandom(uint8_t* buf, size_t length) const = 0;
 
+    /**
+     * Encrypts and authenticates the state of an exported operation into \p token, which
+     * UnsealOperationState on this or any context sharing its key-encryption key can open.
+     * Contexts that can't protect operation state leave this unimplemented, and their operations
+     * can't be exported.
+     */
+    virtual keymaster_error_t SealOperationState(const KeymasterKeyBlob& /* state */,
+                                                 KeymasterKeyBlob* /* token */) const {
+        return KM_ERROR_UNIMPLEMENTED;
+    }
+
+    /**
+     * Verifies and decrypts a token made by SealOperationState into \p state.
+     */
+    virtual keymaster_error_t UnsealOperationState(const KeymasterKeyBlob& /* token */,
+                                                   KeymasterKeyBlob* /* state */) const {
+        return KM_ERROR_UNIMPLEMENTED;
+    }
+
     /**
      * Return the enforcement policy for this context, or null if no enforcement should be done.
+     * AndroidKeymaster calls the policy from several threads at once; KeymasterEnforcement locks
+     * the tables it keeps, but a subclass's own methods must be safe to call concurrently.
      */
     virtual KeymasterEnforcement* enforcement_policy() = 0;
 
     /**
-     * Return the attestation signing key of the specified algorithm (KM_ALGORITHM_RSA or
-     * KM_ALGORITHM_EC).  Caller does not acquire ownership and should not delete.
+     * Return the current time in seconds from a monotonic clock, by which AndroidKeymaster times
+     * out idle operations.  The default uses the enforcement policy's clock if there is one, and
+     * CLOCK_MONOTONIC otherwise.  Contexts on platforms without CLOCK_MONOTONIC must override it.
+     */
+    virtual uint32_t GetMonotonicSeconds() {
+        if (enforcement_policy())
+            return enforcement_policy()->get_current_time();
+        struct timespec now;
+        if (clock_gettime(CLOCK_MONOTONIC, &now) != 0)
+            return 0;
+        return static_cast<uint32_t>(now.tv_sec);
+    }
+
+    /**
+     * Return the current time in seconds since the epoch, by which AndroidKeymaster ages the
+     * operation state tokens that keymasters sharing a sealing key exchange.  The default uses
+     * CLOCK_REALTIME.  Contexts on platforms without it must override it.
+     */
+    virtual uint64_t GetWallClockSeconds() {
+        struct timespec now;
+        if (clock_gettime(CLOCK_REALTIME, &now) != 0)
+            return 0;
+        return static_cast<uint64_t>(now.tv_sec);
+    }
+
+    /**
+     * Return a new reference to the attestation signing key of the specified algorithm
+     * (KM_ALGORITHM_RSA or KM_ALGORITHM_EC), which the caller must free.
      */
     virtual EVP_PKEY* AttestationKey(keymaster_algorithm_t algorithm,
                                      keymaster_error_t* error) const = 0;
@@ -174,6 +333,18 @@ class KeymasterContext {
     virtual keymaster_cert_chain_t* AttestationChain(keymaster_algorithm_t algorithm,
                                                      keymaster_error_t* error) const = 0;
 
+    /**
+     * Return a new reference to the parsed certificate of the attestation signing key of the
+     * specified algorithm, i.e. the first entry of AttestationChain(), which the caller must free.
+     * Contexts that don't keep a parsed copy may leave this unimplemented, in which case callers
+     * parse the certificate from AttestationChain() instead.
+     */
+    virtual X509* AttestationSigningCertificate(keymaster_algorithm_t /* algorithm */,
+                                                keymaster_error_t* error) const {
+        *error = KM_ERROR_UNIMPLEMENTED;
+        return nullptr;
+    }
+
     /**
      * Generate the current unique ID.
      */
@@ -20,6 +20,8 @@
 #include <stdio.h>
 
 #include <keymaster/authorization_set.h>
+#include <keymaster/key_policy.h>
+#include <keymaster/lock_statistics.h>
 
 namespace keymaster {
 
@@ -34,8 +36,48 @@ class KeymasterEnforcementContext {
 };
 
 class AccessTimeMap;
+class AccessCountLog;
 class AccessCountMap;
+class ValidatedTokenCache;
 
+/**
+ * The parts of a key's authorizations that Update and Finish authorization depend on, compiled
+ * once at Begin so that authorizing each chunk of an operation is a few branches rather than a
+ * rescan of the key's AuthorizationSet.  See KeymasterEnforcement::CompileAuthorizations.
+ */
+struct CompiledAuthorizations {
+    enum Flags : uint32_t {
+        // Update and Finish need no auth token: the operation is a public key operation, the key is
+        // NO_AUTH_REQUIRED, or its authentication is timeout-based and was checked at Begin.
+        UPDATE_AND_FINISH_AUTHORIZED = 1 << 0,
+        // The key has USER_AUTH_TYPE or USER_SECURE_ID, so it requires authentication.
+        AUTH_REQUIRED = 1 << 1,
+        // The key has USER_AUTH_TYPE; auth_type holds its value.
+        HAS_AUTH_TYPE = 1 << 2,
+        // The key has AUTH_TIMEOUT; auth_timeout holds its value.
+        HAS_AUTH_TIMEOUT = 1 << 3,
+    };
+
+    CompiledAuthorizations() : flags(0), auth_type(0), auth_timeout(0), secure_id_count(0) {}
+
+    uint32_t flags;
+    uint32_t auth_type;
+    uint32_t auth_timeout;
+    size_t secure_id_count;
+    UniquePtr<uint64_t[]> secure_ids;
+
+  private:
+    // Disallow copying and assignment.
+    CompiledAuthorizations(const CompiledAuthorizations&);
+    void operator=(const CompiledAuthorizations&);
+};
+
+/**
+ * KeymasterEnforcement may be called from several threads at once, as AndroidKeymaster's
+ * operations are.  The rate-limit and use-count tables are locked together, so that a Begin's check
+ * and update of a key's entries can't interleave with another's; the validated auth token cache has
+ * a lock of its own.  Subclasses' methods must be safe to call concurrently.
+ */
 class KeymasterEnforcement {
   public:
     /**
@@ -44,6 +86,14 @@ class KeymasterEnforcement {
     KeymasterEnforcement(uint32_t max_access_time_map_size, uint32_t max_access_count_map_size);
     virtual ~KeymasterEnforcement();
 
+    /**
+     * Keeps MAX_USES_PER_BOOT counts for up to max_keys keys in a memory-mapped log at path,
+     * instead of in memory, so that a restarted keymaster still enforces the uses made earlier in
+     * the same boot.  Counts the log already holds from this boot are picked up; any counted in
+     * memory so far are dropped, so call this before authorizing any operations.
+     */
+    keymaster_error_t EnablePersistentAccessCounts(const char* path, uint32_t max_keys);
+
     /**
      * Iterates through the authorization set and returns the corresponding keymaster error. Will
      * return KM_ERROR_OK if all criteria is met for the given purpose in the authorization set with
@@ -64,6 +114,22 @@ class KeymasterEnforcement {
                                      const AuthorizationSet& auth_set,
                                      const AuthorizationSet& operation_params);
 
+    /**
+     * Like AuthorizeOperation() above for a Begin, but checks the key's policy, compiled by
+     * KeyPolicy::Compile() or read from its key blob, rather than walking its authorizations.
+     */
+    keymaster_error_t AuthorizeOperation(const keymaster_purpose_t purpose, const km_id_t keyid,
+                                         const KeyPolicy& policy,
+                                         const AuthorizationSet& operation_params);
+
+    /**
+     * Like AuthorizeBegin() above, but checks the key's policy rather than walking its
+     * authorizations.
+     */
+    keymaster_error_t AuthorizeBegin(const keymaster_purpose_t purpose, const km_id_t keyid,
+                                     const KeyPolicy& policy,
+                                     const AuthorizationSet& operation_params);
+
     /**
      * Iterates through the authorization set and returns the corresponding keymaster error. Will
      * return KM_ERROR_OK if all criteria is met for the given purpose in the authorization set with
@@ -75,6 +141,16 @@ class KeymasterEnforcement {
         return AuthorizeUpdateOrFinish(auth_set, operation_params, op_handle);
     }
 
+    /**
+     * Like AuthorizeUpdate() above, but uses authorizations compiled at Begin by
+     * CompileAuthorizations().
+     */
+    keymaster_error_t AuthorizeUpdate(const CompiledAuthorizations& compiled,
+                                      const AuthorizationSet& operation_params,
+                                      keymaster_operation_handle_t op_handle) const {
+        return AuthorizeUpdateOrFinish(compiled, operation_params, op_handle);
+    }
+
     /**
      * Iterates through the authorization set and returns the corresponding keymaster error. Will
      * return KM_ERROR_OK if all criteria is met for the given purpose in the authorization set with
@@ -86,6 +162,31 @@ class KeymasterEnforcement {
         return AuthorizeUpdateOrFinish(auth_set, operation_params, op_handle);
     }
 
+    /**
+     * Like AuthorizeFinish() above, but uses authorizations compiled at Begin by
+     * CompileAuthorizations().
+     */
+    keymaster_error_t AuthorizeFinish(const CompiledAuthorizations& compiled,
+                                      const AuthorizationSet& operation_params,
+                                      keymaster_operation_handle_t op_handle) const {
+        return AuthorizeUpdateOrFinish(compiled, operation_params, op_handle);
+    }
+
+    /**
+     * Extracts from the key authorizations \p auth_set everything that authorizing Update and
+     * Finish calls of an operation with the specified purpose will need.
+     */
+    static keymaster_error_t CompileAuthorizations(keymaster_purpose_t purpose,
+                                                   const AuthorizationSet& auth_set,
+                                                   CompiledAuthorizations* compiled);
+
+    /**
+     * Like CompileAuthorizations() above, but extracts them from the key's policy.
+     */
+    static keymaster_error_t CompileAuthorizations(keymaster_purpose_t purpose,
+                                                   const KeyPolicy& policy,
+                                                   CompiledAuthorizations* compiled);
+
     /**
      * Creates a key ID for use in subsequent calls to AuthorizeOperation.  Clients needn't use this
      * method of creating key IDs, as long as they use something consistent and unique.  This method
@@ -95,6 +196,12 @@ class KeymasterEnforcement {
      */
     static bool CreateKeyId(const keymaster_key_blob_t& key_blob, km_id_t* keyid);
 
+    /**
+     * Creates the same key ID as the method above from the SHA-256 digest of the key blob, for
+     * callers that have already hashed the blob.
+     */
+    static void CreateKeyId(const uint8_t blob_sha256_digest[32], km_id_t* keyid);
+
     //
     // Methods that must be implemented by subclasses
     //
@@ -147,17 +254,30 @@ class KeymasterEnforcement {
     keymaster_error_t AuthorizeUpdateOrFinish(const AuthorizationSet& auth_set,
                                               const AuthorizationSet& operation_params,
                                               keymaster_operation_handle_t op_handle);
+    keymaster_error_t AuthorizeUpdateOrFinish(const CompiledAuthorizations& compiled,
+                                              const AuthorizationSet& operation_params,
+                                              keymaster_operation_handle_t op_handle) const;
+    /*
+     * Extracts the auth token from operation_params and checks it.  A token whose signature was
+     * validated recently is not validated again, for at most max_cache_lifetime seconds.
+     */
+    bool GetValidAuthToken(const AuthorizationSet& operation_params, uint32_t max_cache_lifetime,
+                           hw_auth_token_t* auth_token) const;
+    static keymaster_error_t CompileAuthTags(const KeyPolicy& policy,
+                                             CompiledAuthorizations* compiled);
 
+    // Called with access_mutex_ held.
     bool MinTimeBetweenOpsPassed(uint32_t min_time_between, const km_id_t keyid);
     bool MaxUsesPerBootNotExceeded(const km_id_t keyid, uint32_t max_uses);
-    bool AuthTokenMatches(const AuthorizationSet& auth_set,
-                          const AuthorizationSet& operation_params, const uint64_t user_secure_id,
-                          const int auth_type_index, const int auth_timeout_index,
-                          const keymaster_operation_handle_t op_handle,
-                          bool is_begin_operation) const;
+    // Checks the auth token in operation_params against a key with timeout-based authentication.
+    bool AuthTokenMatches(const KeyPolicy& policy, const AuthorizationSet& operation_params) const;
 
+    // Guards the access maps and log, which AuthorizeBegin checks and then updates.
+    CountingMutex access_mutex_;
     AccessTimeMap* access_time_map_;
     AccessCountMap* access_count_map_;
+    AccessCountLog* access_count_log_;
+    ValidatedTokenCache* validated_tokens_;
 };
 
 }; /* namespace keymaster */
@@ -60,6 +60,38 @@ namespace keymaster {
 static const keymaster_tag_t KM_TAG_DIGEST_OLD = static_cast<keymaster_tag_t>(KM_ENUM | 5);
 static const keymaster_tag_t KM_TAG_PADDING_OLD = static_cast<keymaster_tag_t>(KM_ENUM | 7);
 
+// An output parameter, not in the HAL, carrying the blob a key was upgraded to when
+// AndroidKeymaster upgrades keys on use.  Its number is well outside the range the HAL assigns.
+static const keymaster_tag_t KM_TAG_UPGRADED_KEY_BLOB =
+    static_cast<keymaster_tag_t>(KM_BYTES | 20001);
+
+// Output parameters, not in the HAL, with which BeginOperation suggests how much input each
+// UpdateOperation should be given, and the most any one call can usefully take, when
+// AndroidKeymaster's chunk size hints are enabled.
+static const keymaster_tag_t KM_TAG_PREFERRED_CHUNK_SIZE =
+    static_cast<keymaster_tag_t>(KM_UINT | 20002);
+static const keymaster_tag_t KM_TAG_MAX_CHUNK_SIZE = static_cast<keymaster_tag_t>(KM_UINT | 20003);
+
+// An ECIES parameter, not in the HAL, asking for the ephemeral public value to be sent as a
+// compressed point (SEC 1 section 2.3.3), which roughly halves it.
+static const keymaster_tag_t KM_TAG_EC_POINT_COMPRESSION =
+    static_cast<keymaster_tag_t>(KM_BOOL | 20004);
+
+// An export format, not in the HAL, for EC public keys: the X.509 SubjectPublicKeyInfo with the
+// public point compressed (SEC 1 section 2.3.3) rather than uncompressed.
+static const keymaster_key_format_t KM_KEY_FORMAT_X509_COMPRESSED =
+    static_cast<keymaster_key_format_t>(20001);
+
+// An algorithm, not in the HAL, for ChaCha20-Poly1305 (RFC 7539) keys, which AndroidKeymaster
+// supports for devices without AES instructions.  Its number is well outside the range the HAL
+// assigns.
+static const keymaster_algorithm_t KM_ALGORITHM_CHACHA20_POLY1305 =
+    static_cast<keymaster_algorithm_t>(20001);
+
+// An algorithm, not in the HAL, for Ed25519 (RFC 8032) signing keys.
+static const keymaster_algorithm_t KM_ALGORITHM_ED25519 =
+    static_cast<keymaster_algorithm_t>(20002);
+
 // Until we have C++11, fake std::static_assert.
 template <bool b> struct StaticAssert {};
 template <> struct StaticAssert<true> {
@@ -88,6 +120,62 @@ template <> struct TagValueType<KM_BOOL> { typedef bool value_type; };
 template <> struct TagValueType<KM_BYTES> { typedef keymaster_blob_t value_type; };
 template <> struct TagValueType<KM_BIGNUM> { typedef keymaster_blob_t value_type; };
 
+/**
+ * TagTypeInfo describes how values of a tag type are stored, so that code handling tags of any
+ * type can look that up rather than switch on the type.  kTagTypeInfo has an entry for each of the
+ * sixteen values the type bits of a tag can take, indexed by tag_type_index(); those that aren't
+ * tag types are treated as KM_INVALID.
+ */
+struct TagTypeInfo {
+    // The size of an AuthorizationSet element of the type, serialized: the tag followed by the
+    // value, or for byte strings by the length and offset of the data.
+    uint8_t serialized_size;
+    // Unlike keymaster_tag_repeatable(), this includes KM_ULONG_REP.
+    bool repeatable;
+    // Values are byte strings, held in an AuthorizationSet's indirect data.
+    bool blob;
+};
+
+const size_t kTagTypeShift = 28;
+const size_t kTagTypeCount = 16;
+
+constexpr TagTypeInfo kTagTypeInfo[kTagTypeCount] = {
+    {4, false, false},   // KM_INVALID
+    {8, false, false},   // KM_ENUM
+    {8, true, false},    // KM_ENUM_REP
+    {8, false, false},   // KM_UINT
+    {8, true, false},    // KM_UINT_REP
+    {12, false, false},  // KM_ULONG
+    {12, false, false},  // KM_DATE
+    {5, false, false},   // KM_BOOL
+    {12, false, true},   // KM_BIGNUM
+    {12, false, true},   // KM_BYTES
+    {12, true, false},   // KM_ULONG_REP
+    {4, false, false},   {4, false, false}, {4, false, false}, {4, false, false}, {4, false, false},
+};
+
+constexpr size_t tag_type_index(uint32_t tag_or_type) {
+    return tag_or_type >> kTagTypeShift;
+}
+
+constexpr TagTypeInfo tag_type_info(uint32_t tag_or_type) {
+    return kTagTypeInfo[tag_type_index(tag_or_type)];
+}
+
+// The tag with its type removed.  This is also the number of the explicit, context-specific tag
+// that its values have in an attestation record's AuthorizationList.
+constexpr uint32_t tag_number(uint32_t tag) {
+    return tag & ((1U << kTagTypeShift) - 1);
+}
+
+static_assert(tag_type_info(KM_BOOL).serialized_size == sizeof(uint32_t) + sizeof(uint8_t),
+              "kTagTypeInfo doesn't match keymaster_tag_type_t");
+static_assert(tag_type_info(KM_ULONG_REP).repeatable && tag_type_info(KM_UINT_REP).repeatable &&
+                  tag_type_info(KM_ENUM_REP).repeatable,
+              "kTagTypeInfo doesn't match keymaster_tag_type_t");
+static_assert(tag_type_info(KM_BYTES).blob && tag_type_info(KM_BIGNUM).blob,
+              "kTagTypeInfo doesn't match keymaster_tag_type_t");
+
 /**
  * TypedTag is a templatized version of keymaster_tag_t, which provides compile-time checking of
  * keymaster tag types. Instances are convertible to keymaster_tag_t, so they can be used wherever
@@ -107,6 +195,10 @@ template <keymaster_tag_type_t tag_type, keymaster_tag_t tag> class TypedTag {
     }
     inline operator keymaster_tag_t() { return tag; }
     inline long masked_tag() { return static_cast<long>(keymaster_tag_mask_type(tag)); }
+
+    static constexpr bool repeatable() { return tag_type_info(tag_type).repeatable; }
+    static constexpr size_t serialized_size() { return tag_type_info(tag_type).serialized_size; }
+    static constexpr uint32_t attestation_tag_number() { return tag_number(tag); }
 };
 
 template <keymaster_tag_type_t tag_type, keymaster_tag_t tag, typename KeymasterEnum>
@@ -123,67 +215,107 @@ class TypedEnumTag {
     }
     inline operator keymaster_tag_t() { return tag; }
     inline long masked_tag() { return static_cast<long>(keymaster_tag_mask_type(tag)); }
+
+    static constexpr bool repeatable() { return tag_type_info(tag_type).repeatable; }
+    static constexpr size_t serialized_size() { return tag_type_info(tag_type).serialized_size; }
+    static constexpr uint32_t attestation_tag_number() { return tag_number(tag); }
 };
 
 #ifdef KEYMASTER_NAME_TAGS
 const char* StringifyTag(keymaster_tag_t tag);
 #endif
 
+/**
+ * KEYMASTER_TAGS and KEYMASTER_ENUM_TAGS list the non-enum and enum keymaster tags that have
+ * TypedTag and TypedEnumTag instances, with their types (and enumeration types).  They expand TAG
+ * for each tag, and are used to generate the declarations below, the definitions in
+ * keymaster_tags.cpp and the kTagInfo table.
+ */
+#define KEYMASTER_TAGS(TAG)                                                                        \
+    TAG(KM_INVALID, TAG_INVALID)                                                                   \
+    TAG(KM_UINT, TAG_KEY_SIZE)                                                                     \
+    TAG(KM_UINT, TAG_MAC_LENGTH)                                                                   \
+    TAG(KM_BOOL, TAG_CALLER_NONCE)                                                                 \
+    TAG(KM_UINT, TAG_MIN_MAC_LENGTH)                                                               \
+    TAG(KM_ULONG, TAG_RSA_PUBLIC_EXPONENT)                                                         \
+    TAG(KM_BOOL, TAG_ECIES_SINGLE_HASH_MODE)                                                       \
+    TAG(KM_BOOL, TAG_INCLUDE_UNIQUE_ID)                                                            \
+    TAG(KM_DATE, TAG_ACTIVE_DATETIME)                                                              \
+    TAG(KM_DATE, TAG_ORIGINATION_EXPIRE_DATETIME)                                                  \
+    TAG(KM_DATE, TAG_USAGE_EXPIRE_DATETIME)                                                        \
+    TAG(KM_UINT, TAG_MIN_SECONDS_BETWEEN_OPS)                                                      \
+    TAG(KM_UINT, TAG_MAX_USES_PER_BOOT)                                                            \
+    TAG(KM_BOOL, TAG_ALL_USERS)                                                                    \
+    TAG(KM_UINT, TAG_USER_ID)                                                                      \
+    TAG(KM_ULONG_REP, TAG_USER_SECURE_ID)                                                          \
+    TAG(KM_BOOL, TAG_NO_AUTH_REQUIRED)                                                             \
+    TAG(KM_UINT, TAG_AUTH_TIMEOUT)                                                                 \
+    TAG(KM_BOOL, TAG_ALLOW_WHILE_ON_BODY)                                                          \
+    TAG(KM_BOOL, TAG_ALL_APPLICATIONS)                                                             \
+    TAG(KM_BYTES, TAG_APPLICATION_ID)                                                              \
+    TAG(KM_BYTES, TAG_APPLICATION_DATA)                                                            \
+    TAG(KM_DATE, TAG_CREATION_DATETIME)                                                            \
+    TAG(KM_BOOL, TAG_ROLLBACK_RESISTANT)                                                           \
+    TAG(KM_BYTES, TAG_ROOT_OF_TRUST)                                                               \
+    TAG(KM_BYTES, TAG_ASSOCIATED_DATA)                                                             \
+    TAG(KM_BYTES, TAG_NONCE)                                                                       \
+    TAG(KM_BYTES, TAG_AUTH_TOKEN)                                                                  \
+    TAG(KM_BOOL, TAG_BOOTLOADER_ONLY)                                                              \
+    TAG(KM_UINT, TAG_OS_VERSION)                                                                   \
+    TAG(KM_UINT, TAG_OS_PATCHLEVEL)                                                                \
+    TAG(KM_BYTES, TAG_UNIQUE_ID)                                                                   \
+    TAG(KM_BYTES, TAG_ATTESTATION_CHALLENGE)                                                       \
+    TAG(KM_BYTES, TAG_UPGRADED_KEY_BLOB)                                                           \
+    TAG(KM_UINT, TAG_PREFERRED_CHUNK_SIZE)                                                         \
+    TAG(KM_UINT, TAG_MAX_CHUNK_SIZE)                                                               \
+    TAG(KM_BOOL, TAG_EC_POINT_COMPRESSION)                                                         \
+    TAG(KM_BOOL, TAG_RESET_SINCE_ID_ROTATION)
+
+#define KEYMASTER_ENUM_TAGS(TAG)                                                                   \
+    TAG(KM_ENUM_REP, TAG_PURPOSE, keymaster_purpose_t)                                             \
+    TAG(KM_ENUM, TAG_ALGORITHM, keymaster_algorithm_t)                                             \
+    TAG(KM_ENUM_REP, TAG_BLOCK_MODE, keymaster_block_mode_t)                                       \
+    TAG(KM_ENUM_REP, TAG_DIGEST, keymaster_digest_t)                                               \
+    TAG(KM_ENUM, TAG_DIGEST_OLD, keymaster_digest_t)                                               \
+    TAG(KM_ENUM_REP, TAG_PADDING, keymaster_padding_t)                                             \
+    TAG(KM_ENUM, TAG_PADDING_OLD, keymaster_padding_t)                                             \
+    TAG(KM_ENUM, TAG_BLOB_USAGE_REQUIREMENTS, keymaster_key_blob_usage_requirements_t)             \
+    TAG(KM_ENUM, TAG_ORIGIN, keymaster_key_origin_t)                                               \
+    TAG(KM_ENUM, TAG_USER_AUTH_TYPE, hw_authenticator_type_t)                                      \
+    TAG(KM_ENUM_REP, TAG_KDF, keymaster_kdf_t)                                                     \
+    TAG(KM_ENUM, TAG_EC_CURVE, keymaster_ec_curve_t)
+
 // DECLARE_KEYMASTER_TAG is used to declare TypedTag instances for each non-enum keymaster tag.
-#define DECLARE_KEYMASTER_TAG(type, name) extern TypedTag<type, KM_##name> name
-
-DECLARE_KEYMASTER_TAG(KM_INVALID, TAG_INVALID);
-DECLARE_KEYMASTER_TAG(KM_UINT, TAG_KEY_SIZE);
-DECLARE_KEYMASTER_TAG(KM_UINT, TAG_MAC_LENGTH);
-DECLARE_KEYMASTER_TAG(KM_BOOL, TAG_CALLER_NONCE);
-DECLARE_KEYMASTER_TAG(KM_UINT, TAG_MIN_MAC_LENGTH);
-DECLARE_KEYMASTER_TAG(KM_ULONG, TAG_RSA_PUBLIC_EXPONENT);
-DECLARE_KEYMASTER_TAG(KM_BOOL, TAG_ECIES_SINGLE_HASH_MODE);
-DECLARE_KEYMASTER_TAG(KM_BOOL, TAG_INCLUDE_UNIQUE_ID);
-DECLARE_KEYMASTER_TAG(KM_DATE, TAG_ACTIVE_DATETIME);
-DECLARE_KEYMASTER_TAG(KM_DATE, TAG_ORIGINATION_EXPIRE_DATETIME);
-DECLARE_KEYMASTER_TAG(KM_DATE, TAG_USAGE_EXPIRE_DATETIME);
-DECLARE_KEYMASTER_TAG(KM_UINT, TAG_MIN_SECONDS_BETWEEN_OPS);
-DECLARE_KEYMASTER_TAG(KM_UINT, TAG_MAX_USES_PER_BOOT);
-DECLARE_KEYMASTER_TAG(KM_BOOL, TAG_ALL_USERS);
-DECLARE_KEYMASTER_TAG(KM_UINT, TAG_USER_ID);
-DECLARE_KEYMASTER_TAG(KM_ULONG_REP, TAG_USER_SECURE_ID);
-DECLARE_KEYMASTER_TAG(KM_BOOL, TAG_NO_AUTH_REQUIRED);
-DECLARE_KEYMASTER_TAG(KM_UINT, TAG_AUTH_TIMEOUT);
-DECLARE_KEYMASTER_TAG(KM_BOOL, TAG_ALLOW_WHILE_ON_BODY);
-DECLARE_KEYMASTER_TAG(KM_BOOL, TAG_ALL_APPLICATIONS);
-DECLARE_KEYMASTER_TAG(KM_BYTES, TAG_APPLICATION_ID);
-DECLARE_KEYMASTER_TAG(KM_BYTES, TAG_APPLICATION_DATA);
-DECLARE_KEYMASTER_TAG(KM_DATE, TAG_CREATION_DATETIME);
-DECLARE_KEYMASTER_TAG(KM_BOOL, TAG_ROLLBACK_RESISTANT);
-DECLARE_KEYMASTER_TAG(KM_BYTES, TAG_ROOT_OF_TRUST);
-DECLARE_KEYMASTER_TAG(KM_BYTES, TAG_ASSOCIATED_DATA);
-DECLARE_KEYMASTER_TAG(KM_BYTES, TAG_NONCE);
-DECLARE_KEYMASTER_TAG(KM_BYTES, TAG_AUTH_TOKEN);
-DECLARE_KEYMASTER_TAG(KM_BOOL, TAG_BOOTLOADER_ONLY);
-DECLARE_KEYMASTER_TAG(KM_UINT, TAG_OS_VERSION);
-DECLARE_KEYMASTER_TAG(KM_UINT, TAG_OS_PATCHLEVEL);
-DECLARE_KEYMASTER_TAG(KM_BYTES, TAG_UNIQUE_ID);
-DECLARE_KEYMASTER_TAG(KM_BYTES, TAG_ATTESTATION_CHALLENGE);
-DECLARE_KEYMASTER_TAG(KM_BOOL, TAG_RESET_SINCE_ID_ROTATION);
+#define DECLARE_KEYMASTER_TAG(type, name) extern TypedTag<type, KM_##name> name;
+KEYMASTER_TAGS(DECLARE_KEYMASTER_TAG)
+#undef DECLARE_KEYMASTER_TAG
 
 // DECLARE_KEYMASTER_ENUM_TAG is used to declare TypedEnumTag instances for each enum keymaster tag.
 #define DECLARE_KEYMASTER_ENUM_TAG(type, name, enumtype)                                           \
-    extern TypedEnumTag<type, KM_##name, enumtype> name
-
-DECLARE_KEYMASTER_ENUM_TAG(KM_ENUM_REP, TAG_PURPOSE, keymaster_purpose_t);
-DECLARE_KEYMASTER_ENUM_TAG(KM_ENUM, TAG_ALGORITHM, keymaster_algorithm_t);
-DECLARE_KEYMASTER_ENUM_TAG(KM_ENUM_REP, TAG_BLOCK_MODE, keymaster_block_mode_t);
-DECLARE_KEYMASTER_ENUM_TAG(KM_ENUM_REP, TAG_DIGEST, keymaster_digest_t);
-DECLARE_KEYMASTER_ENUM_TAG(KM_ENUM, TAG_DIGEST_OLD, keymaster_digest_t);
-DECLARE_KEYMASTER_ENUM_TAG(KM_ENUM_REP, TAG_PADDING, keymaster_padding_t);
-DECLARE_KEYMASTER_ENUM_TAG(KM_ENUM, TAG_PADDING_OLD, keymaster_padding_t);
-DECLARE_KEYMASTER_ENUM_TAG(KM_ENUM, TAG_BLOB_USAGE_REQUIREMENTS,
-                           keymaster_key_blob_usage_requirements_t);
-DECLARE_KEYMASTER_ENUM_TAG(KM_ENUM, TAG_ORIGIN, keymaster_key_origin_t);
-DECLARE_KEYMASTER_ENUM_TAG(KM_ENUM, TAG_USER_AUTH_TYPE, hw_authenticator_type_t);
-DECLARE_KEYMASTER_ENUM_TAG(KM_ENUM_REP, TAG_KDF, keymaster_kdf_t);
-DECLARE_KEYMASTER_ENUM_TAG(KM_ENUM, TAG_EC_CURVE, keymaster_ec_curve_t);
+    extern TypedEnumTag<type, KM_##name, enumtype> name;
+KEYMASTER_ENUM_TAGS(DECLARE_KEYMASTER_ENUM_TAG)
+#undef DECLARE_KEYMASTER_ENUM_TAG
+
+/**
+ * TagInfo is the metadata of a tag, as TagTypeInfo gives it for the tag's type.  kTagInfo has an
+ * entry for each tag in KEYMASTER_TAGS and KEYMASTER_ENUM_TAGS, in that order.
+ */
+struct TagInfo {
+    keymaster_tag_t tag;
+    keymaster_tag_type_t type;
+    bool repeatable;
+    uint8_t serialized_size;
+    uint32_t attestation_tag_number;
+};
+
+#define KEYMASTER_TAG_INFO(type, name, ...)                                                        \
+    {KM_##name, type, tag_type_info(type).repeatable, tag_type_info(type).serialized_size,         \
+     tag_number(KM_##name)},
+constexpr TagInfo kTagInfo[] = {
+    KEYMASTER_TAGS(KEYMASTER_TAG_INFO) KEYMASTER_ENUM_TAGS(KEYMASTER_TAG_INFO)};
+#undef KEYMASTER_TAG_INFO
+
+const size_t kTagInfoCount = sizeof(kTagInfo) / sizeof(kTagInfo[0]);
 
 //
 // Overloaded function "Authorization" to create keymaster_key_param_t objects for all of tags.
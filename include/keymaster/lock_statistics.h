@@ -0,0 +1,118 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SYSTEM_KEYMASTER_LOCK_STATISTICS_H_
+#define SYSTEM_KEYMASTER_LOCK_STATISTICS_H_
+
+#include <stdint.h>
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+
+namespace keymaster {
+
+/**
+ * Counts of how often a lock, or a set of locks, was taken, and how often and for how long callers
+ * had to wait for it because another thread held it.
+ */
+struct LockStatistics {
+    LockStatistics() : acquisitions(0), contentions(0), wait_microseconds(0) {}
+
+    void Add(const LockStatistics& other) {
+        acquisitions += other.acquisitions;
+        contentions += other.contentions;
+        wait_microseconds += other.wait_microseconds;
+    }
+
+    uint64_t acquisitions;
+    uint64_t contentions;
+    uint64_t wait_microseconds;
+};
+
+/**
+ * CountingMutex is a std::mutex which keeps LockStatistics.  An acquisition is contended if
+ * try_lock fails; the time spent in the lock() that follows is the wait.  The counters are only
+ * written with the mutex held, so they add no cache traffic beyond the mutex's own.
+ *
+ * Counting is compiled in only if KEYMASTER_LOCK_STATISTICS is defined; otherwise CountingMutex is
+ * a plain std::mutex and its statistics stay zero.
+ */
+class CountingMutex {
+  public:
+    CountingMutex() : acquisitions_(0), contentions_(0), wait_microseconds_(0) {}
+
+    void lock() {
+#ifdef KEYMASTER_LOCK_STATISTICS
+        if (mutex_.try_lock()) {
+            Increment(&acquisitions_, 1);
+            return;
+        }
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        mutex_.lock();
+        Increment(&acquisitions_, 1);
+        Increment(&contentions_, 1);
+        Increment(&wait_microseconds_, std::chrono::duration_cast<std::chrono::microseconds>(
+                                           std::chrono::steady_clock::now() - start)
+                                           .count());
+#else
+        mutex_.lock();
+#endif
+    }
+
+    bool try_lock() {
+        if (!mutex_.try_lock())
+            return false;
+#ifdef KEYMASTER_LOCK_STATISTICS
+        Increment(&acquisitions_, 1);
+#endif
+        return true;
+    }
+
+    void unlock() { mutex_.unlock(); }
+
+    /**
+     * Returns the counts so far.  May be called without holding the mutex, in which case counts
+     * from acquisitions in progress may be missed.
+     */
+    LockStatistics statistics() const {
+        LockStatistics statistics;
+        statistics.acquisitions = acquisitions_.load(std::memory_order_relaxed);
+        statistics.contentions = contentions_.load(std::memory_order_relaxed);
+        statistics.wait_microseconds = wait_microseconds_.load(std::memory_order_relaxed);
+        return statistics;
+    }
+
+  private:
+    // Only called with mutex_ held, so a relaxed load and store can't lose an update.
+    static void Increment(std::atomic<uint64_t>* counter, uint64_t amount) {
+        counter->store(counter->load(std::memory_order_relaxed) + amount,
+                       std::memory_order_relaxed);
+    }
+
+    // Disallow copying and assignment.
+    CountingMutex(const CountingMutex&);
+    void operator=(const CountingMutex&);
+
+    std::mutex mutex_;
+    std::atomic<uint64_t> acquisitions_;
+    std::atomic<uint64_t> contentions_;
+    std::atomic<uint64_t> wait_microseconds_;
+};
+
+}  // namespace keymaster
+
+#endif  // SYSTEM_KEYMASTER_LOCK_STATISTICS_H_
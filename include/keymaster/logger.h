@@ -59,11 +59,31 @@ class Logger {
 #define STRINGIFY(x) STR(x)
 #define FILE_LINE __FILE__ ", Line " STRINGIFY(__LINE__) ": "
 
-#define LOG_D(fmt, ...) Logger::Debug(FILE_LINE fmt, __VA_ARGS__)
-#define LOG_I(fmt, ...) Logger::Info(FILE_LINE fmt, __VA_ARGS__)
-#define LOG_W(fmt, ...) Logger::Warning(FILE_LINE fmt, __VA_ARGS__)
-#define LOG_E(fmt, ...) Logger::Error(FILE_LINE fmt, __VA_ARGS__)
-#define LOG_S(fmt, ...) Logger::Severe(FILE_LINE fmt, __VA_ARGS__)
+/*
+ * Messages logged with the LOG_* macros below KEYMASTER_MIN_LOG_LEVEL, a Logger::LogLevel value,
+ * are compiled out.  Their arguments are still type-checked, but never evaluated.  By default
+ * everything is logged; define KEYMASTER_MIN_LOG_LEVEL=1, for example, to drop debug messages.
+ */
+#ifndef KEYMASTER_MIN_LOG_LEVEL
+#define KEYMASTER_MIN_LOG_LEVEL 0
+#endif
+
+#define KEYMASTER_LOG_IF_ENABLED(level, call)                                                      \
+    do {                                                                                           \
+        if (static_cast<int>(Logger::level) >= KEYMASTER_MIN_LOG_LEVEL)                            \
+            call;                                                                                  \
+    } while (0)
+
+#define LOG_D(fmt, ...)                                                                            \
+    KEYMASTER_LOG_IF_ENABLED(DEBUG_LVL, Logger::Debug(FILE_LINE fmt, __VA_ARGS__))
+#define LOG_I(fmt, ...)                                                                            \
+    KEYMASTER_LOG_IF_ENABLED(INFO_LVL, Logger::Info(FILE_LINE fmt, __VA_ARGS__))
+#define LOG_W(fmt, ...)                                                                            \
+    KEYMASTER_LOG_IF_ENABLED(WARNING_LVL, Logger::Warning(FILE_LINE fmt, __VA_ARGS__))
+#define LOG_E(fmt, ...)                                                                            \
+    KEYMASTER_LOG_IF_ENABLED(ERROR_LVL, Logger::Error(FILE_LINE fmt, __VA_ARGS__))
+#define LOG_S(fmt, ...)                                                                            \
+    KEYMASTER_LOG_IF_ENABLED(SEVERE_LVL, Logger::Severe(FILE_LINE fmt, __VA_ARGS__))
 
 }  // namespace keymaster
 
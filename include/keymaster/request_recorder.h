@@ -0,0 +1,52 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SYSTEM_KEYMASTER_REQUEST_RECORDER_H_
+#define SYSTEM_KEYMASTER_REQUEST_RECORDER_H_
+
+#include <stdint.h>
+
+#include <keymaster/android_keymaster_messages.h>
+
+namespace keymaster {
+
+/**
+ * A RequestRecorder installed with AndroidKeymaster::set_recorder is shown each key and operation
+ * request AndroidKeymaster handles, along with its response; these are the commands that latency
+ * statistics are kept for.
+ */
+class RequestRecorder {
+  public:
+    RequestRecorder() {}
+    virtual ~RequestRecorder() {}
+
+    /**
+     * Called once response is complete.  The times are in microseconds from a monotonic clock.
+     * Record may be called concurrently, for requests handled concurrently.
+     */
+    virtual void Record(AndroidKeymasterCommand command, const KeymasterMessage& request,
+                        const KeymasterResponse& response, uint64_t start_microseconds,
+                        uint64_t end_microseconds) = 0;
+
+  private:
+    // Disallow copying and assignment.
+    RequestRecorder(const RequestRecorder&);
+    void operator=(const RequestRecorder&);
+};
+
+}  // namespace keymaster
+
+#endif  // SYSTEM_KEYMASTER_REQUEST_RECORDER_H_
@@ -17,6 +17,9 @@
 #ifndef SYSTEM_KEYMASTER_RSA_KEY_FACTORY_H_
 #define SYSTEM_KEYMASTER_RSA_KEY_FACTORY_H_
 
+#include <atomic>
+#include <memory>
+
 #include <openssl/evp.h>
 #include <openssl/rsa.h>
 
@@ -24,9 +27,20 @@
 
 namespace keymaster {
 
+class PrecomputationFiller;
+class PregeneratedKeyPool;
+class VerificationCache;
+class WorkerPool;
+
 class RsaKeyFactory : public AsymmetricKeyFactory {
   public:
-    RsaKeyFactory(const KeymasterContext* context) : AsymmetricKeyFactory(context) {}
+    struct PregeneratedKeySpec {
+        uint32_t key_size;
+        uint64_t public_exponent;
+    };
+
+    RsaKeyFactory(const KeymasterContext* context);
+    ~RsaKeyFactory() override;
 
     keymaster_error_t GenerateKey(const AuthorizationSet& key_description,
                                   KeymasterKeyBlob* key_blob, AuthorizationSet* hw_enforced,
@@ -37,6 +51,12 @@ class RsaKeyFactory : public AsymmetricKeyFactory {
                                 KeymasterKeyBlob* output_key_blob, AuthorizationSet* hw_enforced,
                                 AuthorizationSet* sw_enforced) const override;
 
+    keymaster_error_t LoadKey(const KeymasterKeyBlob& key_material,
+                              const AuthorizationSet& additional_params,
+                              const AuthorizationSet& hw_enforced,
+                              const AuthorizationSet& sw_enforced,
+                              UniquePtr<Key>* key) const override;
+
     keymaster_error_t CreateEmptyKey(const AuthorizationSet& hw_enforced,
                                      const AuthorizationSet& sw_enforced,
                                      UniquePtr<AsymmetricKey>* key) const override;
@@ -46,13 +66,81 @@ class RsaKeyFactory : public AsymmetricKeyFactory {
     keymaster_algorithm_t keymaster_key_type() const override { return KM_ALGORITHM_RSA; }
     int evp_key_type() const override { return EVP_PKEY_RSA; }
 
+    /**
+     * Keeps up to pool_size keys pre-generated on a background thread for each of the spec_count
+     * specs, refilling a spec once fewer than low_water_mark of its keys remain.  GenerateKey
+     * requests matching a spec use a pre-generated key when one is ready, and otherwise generate
+     * the key inline as usual.  May only be called once.
+     */
+    keymaster_error_t EnableKeyPregeneration(const PregeneratedKeySpec* specs, size_t spec_count,
+                                             size_t pool_size, size_t low_water_mark);
+
+    /**
+     * Gives each key this factory loads a queue of up to queue_size blinding pairs (r^e and r^-1
+     * mod n), precomputed on a background thread, so that raw private-key operations needn't
+     * derive and invert a blinding factor inline.  Each pair blinds one operation.  The queues live
+     * as long as the loaded keys, so this pays off when loaded keys are cached across operations.
+     * May only be called once.
+     */
+    keymaster_error_t EnableBlindingPrecomputation(size_t queue_size);
+
+    /**
+     * Generates keys of at least min_key_size bits from prime_count primes rather than two, and
+     * accepts imported keys of any size with up to prime_count primes; otherwise imported
+     * multi-prime keys are rejected.  Private-key operations work modulo each prime with the CRT,
+     * so with three primes they cost roughly half as much as with two, and generation is faster
+     * too.  No key may have more primes than its size safely allows (three below 4096 bits, four
+     * below 8192), whatever prime_count says.  Keys already in blobs load regardless of this
+     * setting.  Must be called before EnableKeyPregeneration, and only once.
+     */
+    keymaster_error_t EnableMultiPrimeKeys(uint32_t min_key_size, uint32_t prime_count);
+
+    /**
+     * Searches for the two primes of keys of at least min_key_size bits that GenerateKey has to
+     * generate inline at once, one on a worker thread and one on the calling thread, which roughly
+     * halves the time a request that misses the pre-generated keys waits.  The primes are checked
+     * and assembled into a key as RSA_generate_key_ex would, which is used instead if that fails.
+     * Keys with more primes are generated as before.  May only be called once.
+     */
+    keymaster_error_t EnableParallelPrimeSearch(uint32_t min_key_size);
+    // The number of keys GenerateKey has generated from primes found in parallel.
+    uint64_t parallel_prime_search_count() const {
+        return parallel_prime_search_count_.load(std::memory_order_relaxed);
+    }
+
+    /**
+     * Makes verify operations with the keys this factory loads skip the public-key arithmetic for
+     * signatures already in cache, and add those that verify; see VerificationCache.  The cache
+     * may be shared with other factories.
+     */
+    void EnableVerificationCache(const std::shared_ptr<VerificationCache>& cache) {
+        verification_cache_ = cache;
+    }
+
   protected:
-    keymaster_error_t UpdateImportKeyDescription(const AuthorizationSet& key_description,
-                                                 keymaster_key_format_t import_key_format,
-                                                 const KeymasterKeyBlob& import_key_material,
-                                                 AuthorizationSet* updated_description,
-                                                 uint64_t* public_exponent,
-                                                 uint32_t* key_size) const;
+    // If normalized_key_material is non-null, the key is also encoded into it in the form LoadKey
+    // reads fastest, if it's consistent; see compact_private_key.h.  It's left empty for keys that
+    // should be stored as imported.
+    keymaster_error_t
+    UpdateImportKeyDescription(const AuthorizationSet& key_description,
+                               keymaster_key_format_t import_key_format,
+                               const KeymasterKeyBlob& import_key_material,
+                               AuthorizationSet* updated_description, uint64_t* public_exponent,
+                               uint32_t* key_size,
+                               KeymasterKeyBlob* normalized_key_material = nullptr) const;
+
+  private:
+    uint32_t GenerationPrimeCount(uint32_t key_size) const;
+
+    UniquePtr<PregeneratedKeyPool> key_pool_;
+    std::shared_ptr<PrecomputationFiller> blinding_filler_;
+    size_t blinding_queue_size_;
+    uint32_t multi_prime_min_key_size_;
+    uint32_t multi_prime_count_;
+    UniquePtr<WorkerPool> prime_search_pool_;
+    uint32_t parallel_prime_search_min_key_size_;
+    mutable std::atomic<uint64_t> parallel_prime_search_count_;
+    std::shared_ptr<VerificationCache> verification_cache_;
 };
 
 }  // namespace keymaster
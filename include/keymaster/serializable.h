@@ -22,12 +22,32 @@
 #include <string.h>
 
 #include <cstddef>
+#include <mutex>
 #include <new>
 
 #include <UniquePtr.h>
 
+#include <keymaster/allocation_counter.h>
+
 namespace keymaster {
 
+/**
+ * Receives a serialized representation incrementally, so it can be fed into a digest or MAC
+ * without first being copied into a temporary buffer.
+ */
+class SerializationSink {
+  public:
+    virtual ~SerializationSink() {}
+
+    /**
+     * Consumes the next \p data_len bytes of the serialized representation.  Returns false on
+     * failure, which aborts the serialization.
+     */
+    virtual bool Write(const void* data, size_t data_len) = 0;
+};
+
+class SerializationSegments;
+
 class Serializable {
   public:
     Serializable() {}
@@ -51,6 +71,21 @@ class Serializable {
      */
     virtual bool Deserialize(const uint8_t** buf_ptr, const uint8_t* end) = 0;
 
+    /**
+     * Writes the same bytes Serialize() would produce to \p sink.  Returns false if the sink
+     * fails or memory can't be allocated.  The default implementation serializes into a temporary
+     * buffer; subclasses that are serialized into digests should override it to stream directly.
+     */
+    virtual bool SerializeTo(SerializationSink* sink) const;
+
+    /**
+     * Appends the bytes Serialize() would produce to \p segments, referring to large payloads held
+     * by this object rather than copying them, so a transport can send them with a gather write.
+     * The segments stay valid until this object is modified or destroyed.  Returns false if memory
+     * can't be allocated.  The default implementation copies the whole serialization.
+     */
+    virtual bool SerializeToSegments(SerializationSegments* segments) const;
+
   private:
     // Disallow copying and assignment.
     Serializable(const Serializable&);
@@ -128,6 +163,95 @@ inline uint8_t* append_uint32_array_to_buf(uint8_t* buf, const uint8_t* end, con
     return buf;
 }
 
+/**
+ * How lengths, counts, tags and enumerated or small integer values are encoded.
+ *
+ * FIXED_WIDTH_FORMAT, the original format, writes each one as a 32-bit value.  Key blobs always
+ * use it, as do messages of versions 0 through 4.
+ *
+ * COMPACT_FORMAT, which messages of version 5 and later use, writes them as unsigned LEB128
+ * varints: seven bits per byte, least significant group first, with the top bit set on every byte
+ * but the last.  Values below 128 take one byte.
+ */
+enum SerializationFormat {
+    FIXED_WIDTH_FORMAT = 0,
+    COMPACT_FORMAT = 1,
+};
+
+/**
+ * The largest number of bytes a varint of a uint64_t takes.
+ */
+const size_t MAX_VARINT_SIZE = 10;
+
+/**
+ * Returns the number of bytes append_varint_to_buf() writes for \p value.
+ */
+inline size_t varint_size(uint64_t value) {
+    size_t size = 1;
+    while (value >= 0x80) {
+        value >>= 7;
+        ++size;
+    }
+    return size;
+}
+
+/**
+ * Appends \p value to a buffer as a LEB128 varint.  Returns a pointer to the first byte after the
+ * data written.
+ */
+uint8_t* append_varint_to_buf(uint8_t* buf, const uint8_t* end, uint64_t value);
+
+/**
+ * Returns the number of bytes a value convertible to uint32_t takes in \p format.
+ */
+inline size_t uint32_serialized_size(uint32_t value, SerializationFormat format) {
+    return format == COMPACT_FORMAT ? varint_size(value) : sizeof(uint32_t);
+}
+
+/**
+ * Appends a value convertible to uint32_t to a buffer in \p format.
+ */
+template <typename T>
+inline uint8_t* append_uint32_to_buf(uint8_t* buf, const uint8_t* end, T value,
+                                     SerializationFormat format) {
+    if (format == COMPACT_FORMAT)
+        return append_varint_to_buf(buf, end, static_cast<uint32_t>(value));
+    return append_uint32_to_buf(buf, end, value);
+}
+
+/**
+ * Returns the number of bytes append_size_and_data_to_buf() writes for \p data_len bytes in \p
+ * format.
+ */
+inline size_t size_and_data_serialized_size(size_t data_len, SerializationFormat format) {
+    return uint32_serialized_size(data_len, format) + data_len;
+}
+
+/**
+ * Appends a byte array to a buffer, prefixed with its size in \p format.
+ */
+inline uint8_t* append_size_and_data_to_buf(uint8_t* buf, const uint8_t* end, const void* data,
+                                            size_t data_len, SerializationFormat format) {
+    buf = append_uint32_to_buf(buf, end, data_len, format);
+    return append_to_buf(buf, end, data, data_len);
+}
+
+/**
+ * Appends an array of values convertible to uint32_t, prefixed with their count, in \p format.
+ */
+template <typename T>
+inline uint8_t* append_uint32_array_to_buf(uint8_t* buf, const uint8_t* end, const T* data,
+                                           size_t count, SerializationFormat format) {
+    if (format != COMPACT_FORMAT)
+        return append_uint32_array_to_buf(buf, end, data, count);
+    if (count >= UINT32_MAX)
+        return buf;
+    buf = append_varint_to_buf(buf, end, count);
+    for (size_t i = 0; i < count; ++i)
+        buf = append_varint_to_buf(buf, end, static_cast<uint32_t>(data[i]));
+    return buf;
+}
+
 /*
  * Utility functions for writing Deserialize() methods.
  */
@@ -148,6 +272,24 @@ bool copy_from_buf(const uint8_t** buf_ptr, const uint8_t* end, void* dest, size
 bool copy_size_and_data_from_buf(const uint8_t** buf_ptr, const uint8_t* end, size_t* size,
                                  UniquePtr<uint8_t[]>* dest);
 
+/**
+ * Like copy_size_and_data_from_buf(), but with the size in \p format.
+ */
+bool copy_size_and_data_from_buf(const uint8_t** buf_ptr, const uint8_t* end, size_t* size,
+                                 UniquePtr<uint8_t[]>* dest, SerializationFormat format);
+
+/**
+ * Like copy_size_and_data_from_buf(), but skips over the data rather than copying it.  If \p size
+ * is non-NULL the size read is placed in \p *size.
+ */
+bool skip_size_and_data_in_buf(const uint8_t** buf_ptr, const uint8_t* end, size_t* size = NULL);
+
+/**
+ * Like skip_size_and_data_in_buf(), but with the size in \p format.
+ */
+bool skip_size_and_data_in_buf(const uint8_t** buf_ptr, const uint8_t* end, size_t* size,
+                               SerializationFormat format);
+
 /**
  * Copies a value convertible from uint32_t from \p *buf_ptr.  Returns false if there are less than
  * four bytes remaining in \p *buf_ptr.  Advances \p *buf_ptr to the next byte to be read.
@@ -161,6 +303,29 @@ inline bool copy_uint32_from_buf(const uint8_t** buf_ptr, const uint8_t* end, T*
     return true;
 }
 
+/**
+ * Reads a LEB128 varint from \p *buf_ptr into \p *value.  Returns false if the data ends before the
+ * varint does, or if it encodes more than 64 bits.  Advances \p *buf_ptr to the next byte to be
+ * read.
+ */
+bool copy_varint_from_buf(const uint8_t** buf_ptr, const uint8_t* end, uint64_t* value);
+
+/**
+ * Copies a value convertible from uint32_t from \p *buf_ptr, in \p format.  In COMPACT_FORMAT,
+ * values that don't fit in 32 bits are rejected.
+ */
+template <typename T>
+inline bool copy_uint32_from_buf(const uint8_t** buf_ptr, const uint8_t* end, T* value,
+                                 SerializationFormat format) {
+    if (format != COMPACT_FORMAT)
+        return copy_uint32_from_buf(buf_ptr, end, value);
+    uint64_t val;
+    if (!copy_varint_from_buf(buf_ptr, end, &val) || val > UINT32_MAX)
+        return false;
+    *value = static_cast<T>(val);
+    return true;
+}
+
 /**
  * Copies a uint64_t from \p *buf_ptr.  Returns false if there are less than eight bytes remaining
  * in \p *buf_ptr.  Advances \p *buf_ptr to the next byte to be read.
@@ -189,6 +354,7 @@ inline bool copy_uint32_array_from_buf(const uint8_t** buf_ptr, const uint8_t* e
     data->reset(new (std::nothrow) T[*count]);
     if (!data->get())
         return false;
+    AllocationCounter::Count(sizeof(T) * *count);
     for (size_t i = 0; i < *count; ++i)
         if (!copy_uint32_from_buf(buf_ptr, end, &(*data)[i]))
             return false;
@@ -196,13 +362,282 @@ inline bool copy_uint32_array_from_buf(const uint8_t** buf_ptr, const uint8_t* e
 }
 
 /**
- * A simple buffer that supports reading and writing.  Manages its own memory.
+ * Like copy_uint32_array_from_buf(), but with the count and values in \p format.
+ */
+template <typename T>
+inline bool copy_uint32_array_from_buf(const uint8_t** buf_ptr, const uint8_t* end,
+                                       UniquePtr<T[]>* data, size_t* count,
+                                       SerializationFormat format) {
+    if (format != COMPACT_FORMAT)
+        return copy_uint32_array_from_buf(buf_ptr, end, data, count);
+    // Each value takes at least a byte.
+    if (!copy_uint32_from_buf(buf_ptr, end, count, format) ||
+        *count > static_cast<size_t>(end - *buf_ptr))
+        return false;
+
+    data->reset(new (std::nothrow) T[*count]);
+    if (!data->get())
+        return false;
+    AllocationCounter::Count(sizeof(T) * *count);
+    for (size_t i = 0; i < *count; ++i)
+        if (!copy_uint32_from_buf(buf_ptr, end, &(*data)[i], format))
+            return false;
+    return true;
+}
+
+/**
+ * A bump-pointer allocator for the storage of objects that live and die together, such as the
+ * Buffers of a request and its response.  Allocation is a pointer increment, nothing is freed
+ * individually, and Reset() securely wipes and releases everything at once.  The largest block is
+ * kept across Reset(), so an arena reused for successive requests stops allocating once it has
+ * grown to fit them.
+ *
+ * Objects that allocate from an arena must be cleared or destroyed before it is reset or
+ * destroyed.
+ */
+class SerializationArena {
+  public:
+    static const size_t DEFAULT_BLOCK_SIZE = 4096;
+
+    explicit SerializationArena(size_t block_size = DEFAULT_BLOCK_SIZE)
+        : block_size_(block_size), blocks_(nullptr) {}
+    ~SerializationArena();
+
+    /**
+     * Returns \p size bytes of storage, valid until the next Reset(), or NULL if allocation fails.
+     */
+    uint8_t* Allocate(size_t size);
+
+    /**
+     * Wipes and releases all storage returned by Allocate().
+     */
+    void Reset();
+
+    /**
+     * Returns the number of bytes handed out since the last Reset(), including alignment padding.
+     */
+    size_t bytes_used() const;
+
+  private:
+    struct Block {
+        Block* next;
+        size_t capacity;
+        size_t used;
+
+        uint8_t* data() { return reinterpret_cast<uint8_t*>(this + 1); }
+    };
+
+    static void FreeBlock(Block* block);
+
+    // Disallow copy construction and assignment.
+    SerializationArena(const SerializationArena&);
+    void operator=(const SerializationArena&);
+
+    const size_t block_size_;
+    Block* blocks_;  // The block currently being allocated from is first.
+};
+
+/**
+ * One contiguous piece of a serialization.  Laid out like struct iovec, apart from constness.
+ */
+struct SerializedSegment {
+    const uint8_t* data;
+    size_t length;
+};
+
+/**
+ * A serialization held as a list of segments, some referring to the storage of the objects
+ * serialized and others to small pieces, like lengths and counts, copied into storage of its own.
+ * Consecutive copied pieces share a segment.  Payloads shorter than MIN_REFERENCED_LENGTH are
+ * copied too, since a segment costs a gather write more than copying a few bytes does.
+ */
+class SerializationSegments : public SerializationSink {
+  public:
+    static const size_t MIN_REFERENCED_LENGTH = 64;
+
+    SerializationSegments();
+    ~SerializationSegments();
+
+    /**
+     * Appends a copy of \p data_len bytes of \p data.
+     */
+    bool Write(const void* data, size_t data_len) override;
+
+    /**
+     * Appends \p length bytes of storage of its own, to be filled by the caller, and returns them,
+     * or NULL if allocation fails.
+     */
+    uint8_t* Reserve(size_t length);
+
+    /**
+     * Appends a reference to \p length bytes of \p data, which must stay valid and unchanged for
+     * as long as the segments are used.
+     */
+    bool Reference(const void* data, size_t length);
+
+    const SerializedSegment* segments() const { return segments_; }
+    size_t segment_count() const { return segment_count_; }
+    size_t total_length() const { return total_length_; }
+
+    /**
+     * Removes all segments, and wipes and releases the copied pieces.
+     */
+    void Clear();
+
+  private:
+    bool AddSegment(const uint8_t* data, size_t length);
+
+    // Disallow copying and assignment.
+    SerializationSegments(const SerializationSegments&);
+    void operator=(const SerializationSegments&);
+
+    SerializationArena copies_;
+    SerializedSegment* segments_;
+    size_t segment_count_;
+    size_t segment_capacity_;
+    size_t total_length_;
+    // The unused remainder of the storage the last copied piece came from.
+    uint8_t* copy_position_;
+    const uint8_t* copy_limit_;
+};
+
+/*
+ * Utility functions for writing SerializeToSegments() methods.  Each returns false if memory can't
+ * be allocated.
+ */
+
+/**
+ * Appends a copy of \p value, in \p format.
+ */
+inline bool append_uint32_to_segments(SerializationSegments* segments, uint32_t value,
+                                      SerializationFormat format) {
+    size_t size = uint32_serialized_size(value, format);
+    uint8_t* buf = segments->Reserve(size);
+    return buf && append_uint32_to_buf(buf, buf + size, value, format);
+}
+
+/**
+ * Appends a copy of \p value.
+ */
+inline bool append_uint64_to_segments(SerializationSegments* segments, uint64_t value) {
+    uint8_t* buf = segments->Reserve(sizeof(value));
+    return buf && append_uint64_to_buf(buf, buf + sizeof(value), value);
+}
+
+/**
+ * Appends \p data_len bytes of \p data, prefixed with a copy of their size in \p format, as
+ * append_size_and_data_to_buf() would.  The data itself is referenced, not copied.
+ */
+inline bool append_size_and_data_to_segments(SerializationSegments* segments, const void* data,
+                                             size_t data_len, SerializationFormat format) {
+    return append_uint32_to_segments(segments, data_len, format) &&
+           segments->Reference(data, data_len);
+}
+
+/**
+ * A cache of freed Buffer storage in a few size classes, so that buffers which are reallocated over
+ * and over, like the output buffers of streaming operations, stop going to the heap once the pool
+ * is warm.  Blocks are wiped when they are returned, and at most MAX_FREE_BLOCKS_PER_CLASS are
+ * kept per class; any others go back to the heap.  Thread-safe.
+ */
+class BufferPool {
+  public:
+    static const size_t SIZE_CLASS_COUNT = 5;
+    static const size_t MAX_FREE_BLOCKS_PER_CLASS = 8;
+
+    BufferPool();
+    ~BufferPool();
+
+    /**
+     * Returns true if storage of \p size bytes fits in a size class and can come from the pool.
+     */
+    static bool Pools(size_t size) { return size <= SizeClass(SIZE_CLASS_COUNT - 1); }
+
+    /**
+     * Returns storage for at least \p size bytes, which must satisfy Pools(), or NULL if
+     * allocation fails.
+     */
+    uint8_t* Allocate(size_t size);
+
+    /**
+     * Wipes and returns storage obtained from Allocate(size) to the pool.
+     */
+    void Free(uint8_t* block, size_t size);
+
+    /**
+     * Returns the number of free blocks held for the size class that \p size falls in.
+     */
+    size_t free_block_count(size_t size) const;
+
+  private:
+    // 64, 256, 1024, 4096 and 16384 bytes.
+    static size_t SizeClass(size_t index) { return 64 << (2 * index); }
+    static size_t SizeClassIndex(size_t size);
+
+    struct FreeBlock {
+        FreeBlock* next;
+    };
+
+    // Disallow copy construction and assignment.
+    BufferPool(const BufferPool&);
+    void operator=(const BufferPool&);
+
+    mutable std::mutex mutex_;
+    FreeBlock* free_blocks_[SIZE_CLASS_COUNT];
+    size_t free_block_counts_[SIZE_CLASS_COUNT];
+};
+
+/**
+ * A simple buffer that supports reading and writing.  Manages its own memory, which comes from the
+ * heap, or the default BufferPool if one is set, unless the buffer is attached to a
+ * SerializationArena.
  */
 class Buffer : public Serializable {
   public:
-    Buffer() : buffer_(NULL), buffer_size_(0), read_position_(0), write_position_(0) {}
-    Buffer(size_t size) : buffer_(NULL) { Reinitialize(size); }
-    Buffer(const void* buf, size_t size) : buffer_(NULL) { Reinitialize(buf, size); }
+    Buffer()
+        : buffer_(NULL), buffer_size_(0), read_position_(0), write_position_(0), arena_(NULL),
+          pool_(NULL), borrowed_(false), small_uses_(0), small_use_peak_(0) {}
+    Buffer(size_t size)
+        : buffer_(NULL), buffer_size_(0), arena_(NULL), pool_(NULL), borrowed_(false),
+          small_uses_(0), small_use_peak_(0) {
+        Reinitialize(size);
+    }
+    Buffer(const void* buf, size_t size)
+        : buffer_(NULL), buffer_size_(0), arena_(NULL), pool_(NULL), borrowed_(false),
+          small_uses_(0), small_use_peak_(0) {
+        Reinitialize(buf, size);
+    }
+    ~Buffer() {
+        if (!borrowed_)
+            FreeStorage(buffer_, buffer_size_, pool_);
+    }
+
+    /**
+     * Makes Buffers not attached to an arena take their storage from \p pool, or from the heap if
+     * \p pool is NULL.  This is global, so it should be set up before Buffers are in use, and \p
+     * pool must outlive every Buffer allocated from it.  Buffers remember where their current
+     * storage came from, so changing the default pool doesn't affect storage already allocated.
+     */
+    static void set_default_pool(BufferPool* pool) { default_pool_ = pool; }
+
+    /**
+     * Makes Recycle() shrink storage after \p small_uses uses in a row that each needed no more
+     * than a quarter of it.  Uses are measured in the size classes of BufferPool, continued in
+     * steps of four above the largest, and the storage is cut down to the class that holds the
+     * largest of the small uses.  Zero, the default, never shrinks storage.  Like
+     * set_default_pool() this is global.
+     */
+    static void set_trim_policy(uint32_t small_uses) { trim_after_small_uses_ = small_uses; }
+    static uint32_t trim_policy() { return trim_after_small_uses_; }
+
+    /**
+     * Clears the buffer and makes it allocate its storage from \p arena from now on, or from the
+     * heap if \p arena is NULL.  The buffer must be cleared or destroyed before \p arena is reset.
+     */
+    void set_arena(SerializationArena* arena) {
+        Clear();
+        arena_ = arena;
+    }
 
     // Grow the buffer so that at least \p size bytes can be written.
     bool reserve(size_t size);
@@ -215,18 +650,52 @@ class Buffer : public Serializable {
         return Reinitialize(buffer.peek_read(), buffer.available_read());
     }
 
+    /**
+     * Makes the \p size bytes at \p buf the buffer's readable data without copying them.  The
+     * buffer never writes to, wipes or frees memory borrowed this way, which must stay valid and
+     * unchanged until the buffer is cleared, reinitialized or destroyed.  Borrowed buffers have no room to
+     * write; reserve() moves the readable data into storage the buffer owns.
+     */
+    bool Borrow(const void* buf, size_t size);
+
+    /**
+     * Makes the \p capacity bytes at \p buf the buffer's (empty) storage, so that writes go
+     * straight to caller memory.  As with Borrow(), the memory is never wiped or freed by the
+     * buffer, and if it needs to grow beyond \p capacity, or is reinitialized, the buffer moves to
+     * storage of its own; is_borrowed() tells whether the data is still in \p buf.
+     */
+    bool BorrowForWriting(void* buf, size_t capacity);
+
+    /**
+     * Like Deserialize(), but borrows the data from the serialized form rather than copying it,
+     * so the serialized data must outlive the buffer.  See Borrow().
+     */
+    bool DeserializeBorrowed(const uint8_t** buf_ptr, const uint8_t* end,
+                             SerializationFormat format = FIXED_WIDTH_FORMAT);
+
+    bool is_borrowed() const { return borrowed_; }
+
     const uint8_t* begin() const { return peek_read(); }
     const uint8_t* end() const { return peek_read() + available_read(); }
 
     void Clear();
 
+    /**
+     * Empties the buffer for another use, wiping what was written but, unlike Clear(), keeping
+     * the storage so that the next use can write up to buffer_size() bytes without allocating.
+     * Storage is shrunk as the trim policy says (see set_trim_policy()), and borrowed memory is
+     * let go of, as Clear() would.  Returns false only if shrinking fails to allocate, in which
+     * case the buffer is empty and has no storage.
+     */
+    bool Recycle();
+
     size_t available_write() const;
     size_t available_read() const;
     size_t buffer_size() const { return buffer_size_; }
 
     bool write(const uint8_t* src, size_t write_length);
     bool read(uint8_t* dest, size_t read_length);
-    const uint8_t* peek_read() const { return buffer_.get() + read_position_; }
+    const uint8_t* peek_read() const { return buffer_ + read_position_; }
     bool advance_read(int distance) {
         if (static_cast<size_t>(read_position_ + distance) <= write_position_) {
             read_position_ += distance;
@@ -234,7 +703,7 @@ class Buffer : public Serializable {
         }
         return false;
     }
-    uint8_t* peek_write() { return buffer_.get() + write_position_; }
+    uint8_t* peek_write() { return buffer_ + write_position_; }
     bool advance_write(int distance) {
         if (static_cast<size_t>(write_position_ + distance) <= buffer_size_) {
             write_position_ += distance;
@@ -247,15 +716,40 @@ class Buffer : public Serializable {
     uint8_t* Serialize(uint8_t* buf, const uint8_t* end) const;
     bool Deserialize(const uint8_t** buf_ptr, const uint8_t* end);
 
+    // As above, with the length in \p format.
+    size_t SerializedSize(SerializationFormat format) const;
+    uint8_t* Serialize(uint8_t* buf, const uint8_t* end, SerializationFormat format) const;
+    bool Deserialize(const uint8_t** buf_ptr, const uint8_t* end, SerializationFormat format);
+
+    // The readable data is referenced rather than copied.
+    bool SerializeToSegments(SerializationSegments* segments) const;
+    bool SerializeToSegments(SerializationSegments* segments, SerializationFormat format) const;
+
   private:
     // Disallow copy construction and assignment.
     void operator=(const Buffer& other);
     Buffer(const Buffer&);
 
-    UniquePtr<uint8_t[]> buffer_;
+    uint8_t* AllocateStorage(size_t size, BufferPool** pool);
+    void FreeStorage(uint8_t* storage, size_t size, BufferPool* pool);
+    // Wipes and frees the current storage, unless it's borrowed.
+    void ReleaseStorage();
+    // The smallest size class that holds size bytes; see set_trim_policy().
+    static size_t TrimmedSize(size_t size);
+
+    static BufferPool* default_pool_;
+    static uint32_t trim_after_small_uses_;
+
+    uint8_t* buffer_;
     size_t buffer_size_;
     size_t read_position_;
     size_t write_position_;
+    SerializationArena* arena_;
+    BufferPool* pool_;  // The pool buffer_ came from, if any.
+    bool borrowed_;     // buffer_ points at caller memory.
+    // Uses in a row that Recycle() has found small, and the most written in any of them.
+    uint32_t small_uses_;
+    size_t small_use_peak_;
 };
 
 }  // namespace keymaster
@@ -17,6 +17,7 @@
 #ifndef SYSTEM_KEYMASTER_SOFT_KEYMASTER_CONTEXT_H_
 #define SYSTEM_KEYMASTER_SOFT_KEYMASTER_CONTEXT_H_
 
+#include <atomic>
 #include <memory>
 #include <string>
 
@@ -25,15 +26,22 @@
 #include <hardware/keymaster0.h>
 #include <hardware/keymaster1.h>
 #include <keymaster/keymaster_context.h>
+#include <keymaster/rsa_key_factory.h>
 
 namespace keymaster {
 
 class SoftKeymasterKeyRegistrations;
 class Keymaster0Engine;
 class Keymaster1Engine;
+class VerificationCache;
 
 /**
  * SoftKeymasterContext provides the context for a non-secure implementation of AndroidKeymaster.
+ *
+ * Built with -DKEYMASTER_SYMMETRIC_ONLY (KEYMASTER_SYMMETRIC_ONLY := true in Android.mk), it
+ * supports only AES, HMAC and ChaCha20-Poly1305 keys.  RSA, EC and Ed25519 keys, attestation and
+ * hardware device wrapping are left out, and the methods that configure them fail with
+ * KM_ERROR_UNIMPLEMENTED.  Everything that includes this header must agree on the macro.
  */
 class SoftKeymasterContext : public KeymasterContext {
   public:
@@ -53,6 +61,76 @@ class SoftKeymasterContext : public KeymasterContext {
      */
     keymaster_error_t SetHardwareDevice(keymaster1_device_t* keymaster1_device);
 
+    /**
+     * Keep software RSA keys for the specified sizes and public exponents pre-generated in the
+     * background; see RsaKeyFactory::EnableKeyPregeneration.  Fails with KM_ERROR_UNIMPLEMENTED if
+     * a hardware device generates the RSA keys.
+     */
+    keymaster_error_t EnableRsaKeyPregeneration(const RsaKeyFactory::PregeneratedKeySpec* specs,
+                                                size_t spec_count, size_t pool_size,
+                                                size_t low_water_mark);
+
+    /**
+     * Keep software EC keys for the specified curves pre-generated in the background; see
+     * EcKeyFactory::EnableKeyPregeneration.  Fails with KM_ERROR_UNIMPLEMENTED if a hardware device
+     * generates the EC keys.
+     */
+    keymaster_error_t EnableEcKeyPregeneration(const keymaster_ec_curve_t* curves,
+                                               size_t curve_count, size_t pool_size,
+                                               size_t low_water_mark);
+
+    /**
+     * Precompute ECDSA signing setups for loaded software EC keys in the background; see
+     * EcKeyFactory::EnableSignSetupPrecomputation.  Fails with KM_ERROR_UNIMPLEMENTED if a hardware
+     * device handles the EC keys.
+     */
+    keymaster_error_t EnableEcdsaSignSetupPrecomputation(size_t queue_size);
+
+    /**
+     * Precompute RSA blinding pairs for loaded software RSA keys in the background; see
+     * RsaKeyFactory::EnableBlindingPrecomputation.  Fails with KM_ERROR_UNIMPLEMENTED if a hardware
+     * device handles the RSA keys.
+     */
+    keymaster_error_t EnableRsaBlindingPrecomputation(size_t queue_size);
+
+    /**
+     * Generate and accept multi-prime software RSA keys; see RsaKeyFactory::EnableMultiPrimeKeys.
+     * Fails with KM_ERROR_UNIMPLEMENTED if a hardware device handles the RSA keys.
+     */
+    keymaster_error_t EnableMultiPrimeRsaKeys(uint32_t min_key_size, uint32_t prime_count);
+
+    /**
+     * Search for the primes of software RSA keys that have to be generated on request in parallel;
+     * see RsaKeyFactory::EnableParallelPrimeSearch.  Fails with KM_ERROR_UNIMPLEMENTED if a
+     * hardware device handles the RSA keys.
+     */
+    keymaster_error_t EnableParallelRsaPrimeSearch(uint32_t min_key_size);
+
+    /**
+     * Remember up to max_entries RSA and ECDSA signatures that have verified with software keys,
+     * so that verifying one again skips the public-key arithmetic; see VerificationCache.  Fails
+     * with KM_ERROR_UNIMPLEMENTED if a hardware device handles the RSA and EC keys.
+     */
+    keymaster_error_t EnableVerificationCache(size_t max_entries);
+    // The cache set by EnableVerificationCache, or null.
+    const VerificationCache* verification_cache() const { return verification_cache_.get(); }
+
+    /**
+     * Complete hardware-backed RSA and EC operations through a request queue; see
+     * Keymaster1Engine::EnableRequestQueue.  Fails with KM_ERROR_UNIMPLEMENTED unless a keymaster1
+     * device has been set.
+     */
+    keymaster_error_t EnableKeymaster1RequestQueue();
+
+    /**
+     * Attest with the keys and certificate chains provisioned in the bundle file at path, in place
+     * of the compiled-in ones, for the algorithms the bundle covers; see AttestationBundle.  The
+     * file is mapped read-only and shared with any other process that maps it, and is checked on
+     * first use; if it turns out to be malformed, attestation falls back to the compiled-in keys.
+     * Fails with KM_ERROR_UNKNOWN_ERROR if the file can't be mapped.
+     */
+    keymaster_error_t SetAttestationBundle(const char* path);
+
     keymaster_security_level_t GetSecurityLevel() const override {
         return KM_SECURITY_LEVEL_SOFTWARE;
     }
@@ -75,15 +153,43 @@ class SoftKeymasterContext : public KeymasterContext {
                                    const AuthorizationSet& additional_params,
                                    KeymasterKeyBlob* key_material, AuthorizationSet* hw_enforced,
                                    AuthorizationSet* sw_enforced) const override;
+    keymaster_error_t ParseKeyBlobWithPolicy(const KeymasterKeyBlob& blob,
+                                             const AuthorizationSet& additional_params,
+                                             KeymasterKeyBlob* key_material,
+                                             AuthorizationSet* hw_enforced,
+                                             AuthorizationSet* sw_enforced,
+                                             KeyPolicy* policy) const override;
+    keymaster_error_t ParseKeyBlobWithLegacyStatus(const KeymasterKeyBlob& blob,
+                                                   const AuthorizationSet& additional_params,
+                                                   KeymasterKeyBlob* key_material,
+                                                   AuthorizationSet* hw_enforced,
+                                                   AuthorizationSet* sw_enforced,
+                                                   bool* legacy) const override;
+    keymaster_error_t MigrateKeyBlob(const KeymasterKeyBlob& blob,
+                                     const AuthorizationSet& additional_params,
+                                     KeymasterKeyBlob* migrated_key) const override;
+    keymaster_error_t ParseKeyCharacteristics(const KeymasterKeyBlob& blob,
+                                              const AuthorizationSet& additional_params,
+                                              AuthorizationSet* hw_enforced,
+                                              AuthorizationSet* sw_enforced) const override;
+    void ParseKeyCharacteristicsBatch(const AuthorizationSet& additional_params,
+                                      KeyCharacteristicsQuery* queries,
+                                      size_t count) const override;
     keymaster_error_t DeleteKey(const KeymasterKeyBlob& blob) const override;
     keymaster_error_t DeleteAllKeys() const override;
     keymaster_error_t AddRngEntropy(const uint8_t* buf, size_t length) const override;
     keymaster_error_t GenerateRandom(uint8_t* buf, size_t length) const override;
+    keymaster_error_t SealOperationState(const KeymasterKeyBlob& state,
+                                         KeymasterKeyBlob* token) const override;
+    keymaster_error_t UnsealOperationState(const KeymasterKeyBlob& token,
+                                           KeymasterKeyBlob* state) const override;
 
     EVP_PKEY* AttestationKey(keymaster_algorithm_t algorithm,
                              keymaster_error_t* error) const override;
     keymaster_cert_chain_t* AttestationChain(keymaster_algorithm_t algorithm,
                                              keymaster_error_t* error) const override;
+    X509* AttestationSigningCertificate(keymaster_algorithm_t algorithm,
+                                        keymaster_error_t* error) const override;
     keymaster_error_t GenerateUniqueId(uint64_t creation_date_time,
                                        const keymaster_blob_t& application_id,
                                        bool reset_since_rotation, Buffer* unique_id) const override;
@@ -96,6 +202,35 @@ class SoftKeymasterContext : public KeymasterContext {
     void AddSystemVersionToSet(AuthorizationSet* auth_set) const;
 
   private:
+    struct AttestationCache;
+
+    enum SoftwareBlobFormat {
+        INTEGRITY_ASSURED_BLOB,
+        OCB_ENCRYPTED_BLOB,
+        OLD_SOFTKEYMASTER_BLOB,
+    };
+
+    // ParseKeyBlob, and ParseKeyBlobWithPolicy if policy isn't null.  If legacy isn't null, it's
+    // set to whether the blob is an OCB-encrypted keymaster1 software blob, an old softkeymaster
+    // blob or an old keymaster0 hardware blob.
+    keymaster_error_t ParseAnyKeyBlob(const KeymasterKeyBlob& blob,
+                                      const AuthorizationSet& additional_params,
+                                      KeymasterKeyBlob* key_material, AuthorizationSet* hw_enforced,
+                                      AuthorizationSet* sw_enforced, KeyPolicy* policy,
+                                      bool* legacy) const;
+    // ParseAnyKeyBlob, with the hidden authorizations already built from additional_params.
+    keymaster_error_t ParseAnyKeyBlobWithHidden(const KeymasterKeyBlob& blob,
+                                                const AuthorizationSet& additional_params,
+                                                const AuthorizationSet& hidden,
+                                                KeymasterKeyBlob* key_material,
+                                                AuthorizationSet* hw_enforced,
+                                                AuthorizationSet* sw_enforced, KeyPolicy* policy,
+                                                bool* legacy) const;
+    keymaster_error_t ParseSoftwareBlob(SoftwareBlobFormat format, const KeymasterKeyBlob& blob,
+                                        const AuthorizationSet& hidden,
+                                        KeymasterKeyBlob* key_material,
+                                        AuthorizationSet* hw_enforced,
+                                        AuthorizationSet* sw_enforced, KeyPolicy* policy) const;
     keymaster_error_t ParseOldSoftkeymasterBlob(const KeymasterKeyBlob& blob,
                                                 KeymasterKeyBlob* key_material,
                                                 AuthorizationSet* hw_enforced,
@@ -113,17 +248,34 @@ class SoftKeymasterContext : public KeymasterContext {
                                             AuthorizationSet* sw_enforced) const;
     keymaster_error_t BuildHiddenAuthorizations(const AuthorizationSet& input_set,
                                                 AuthorizationSet* hidden) const;
+    // Fills operation_factories_ from the key factories.  Called whenever they change.
+    void BuildOperationFactoryTable();
+
+    static const size_t kOperationTableAlgorithms = 6;
+    static const size_t kOperationTablePurposes = KM_PURPOSE_DERIVE_KEY + 1;
 
+#ifndef KEYMASTER_SYMMETRIC_ONLY
     std::unique_ptr<Keymaster0Engine> km0_engine_;
     std::unique_ptr<Keymaster1Engine> km1_engine_;
+#endif
     std::unique_ptr<KeyFactory> rsa_factory_;
     std::unique_ptr<KeyFactory> ec_factory_;
     std::unique_ptr<KeyFactory> aes_factory_;
     std::unique_ptr<KeyFactory> hmac_factory_;
+    std::unique_ptr<KeyFactory> chacha20_poly1305_factory_;
+    std::unique_ptr<KeyFactory> ed25519_factory_;
+    std::unique_ptr<AttestationCache> attestation_cache_;
+    std::shared_ptr<VerificationCache> verification_cache_;
     keymaster1_device* km1_dev_;
     const std::string root_of_trust_;
-    uint32_t os_version_;
-    uint32_t os_patchlevel_;
+    // TAG_ROOT_OF_TRUST entry for hidden authorizations, referencing root_of_trust_.
+    const keymaster_key_param_t root_of_trust_param_;
+    // Set by SoftKeymasterDevice::configure, which may run while other threads generate keys.
+    std::atomic<uint32_t> os_version_;
+    std::atomic<uint32_t> os_patchlevel_;
+    // Operation factories by algorithm slot and purpose, so that GetOperationFactory is a single
+    // lookup rather than a key factory switch plus a virtual call.
+    OperationFactory* operation_factories_[kOperationTableAlgorithms][kOperationTablePurposes];
 };
 
 }  // namespace keymaster
@@ -17,6 +17,7 @@
 #ifndef SYSTEM_KEYMASTER_SOFT_KEYMASTER_DEVICE_H_
 #define SYSTEM_KEYMASTER_SOFT_KEYMASTER_DEVICE_H_
 
+#include <atomic>
 #include <cstdlib>
 #include <map>
 #include <vector>
@@ -33,6 +34,7 @@
 namespace keymaster {
 
 class AuthorizationSet;
+class BackendCostTable;
 
 /**
  * Keymaster1 device implementation.
@@ -44,6 +46,15 @@ class AuthorizationSet;
  * and keymaster_device. This means it must remain a standard layout class (no virtual functions and
  * no data members which aren't standard layout), and device_ must be the first data member.
  * Assertions in the constructor validate compliance with those constraints.
+ *
+ * The device entry points may be called from several threads at once.  The caches below are
+ * internally locked, configure publishes the system version atomically, and begin, update, finish
+ * and abort lock only the operation table shard holding the operation, so calls on different
+ * operations don't serialize.  configure is the only writer of the context's own state, but not
+ * the only writer of shared state: a context with an enforcement policy has it record key accesses
+ * and validated auth tokens from every begin, update and finish, and KeymasterEnforcement locks
+ * those tables itself.  A wrapped hardware device is called from the same threads and must
+ * tolerate that itself.
  */
 class SoftKeymasterDevice {
   public:
@@ -51,6 +62,7 @@ class SoftKeymasterDevice {
 
     // Public only for testing.
     SoftKeymasterDevice(SoftKeymasterContext* context);
+    ~SoftKeymasterDevice();
 
     /**
      * Set SoftKeymasterDevice to wrap the speicified HW keymaster0 device.  Takes ownership of the
@@ -79,19 +91,117 @@ class SoftKeymasterDevice {
         impl_->GetVersion(req, rsp);
     }
 
-    bool configured() const { return configured_; }
+    // Public only for testing
+    void GetLockStatistics(LockStatistics* operation_table, LockStatistics* key_cache,
+                           LockStatistics* pinned_keys) const {
+        impl_->GetLockStatistics(operation_table, key_cache, pinned_keys);
+    }
+
+    bool configured() const { return configured_.load(std::memory_order_acquire); }
+
+    /**
+     * If enabled, VERIFY and ENCRYPT operations with wrapped keymaster1 RSA and EC keys run in
+     * software, using the public key Keymaster1Engine caches, so that only private-key operations
+     * are sent to the hardware module.  Public-key operations aren't subject to authorization, so
+     * nothing is lost by taking them out of the secure world.  Must be set before the device is
+     * used.
+     */
+    void set_software_public_key_operations(bool enabled) {
+        software_public_key_operations_ = enabled;
+    }
+
+    /**
+     * If enabled, VERIFY and ENCRYPT operations with wrapped keymaster1 RSA and EC keys, which
+     * either the hardware module or software can run, go to whichever has been faster for the key's
+     * algorithm and size.  Costs are sampled from the operations themselves.
+     * set_software_public_key_operations takes precedence.  Must be set before the device is used.
+     */
+    void set_adaptive_routing(bool enabled);
+
+    /**
+     * If enabled, out_params and key characteristics are returned as packed param sets, each a
+     * single allocation (see AuthorizationSet::CopyToPackedParamSet).  Only for clients that free
+     * them with free(set->params) alone, never keymaster_free_param_set.  Must be set before the
+     * device is used.
+     */
+    void set_packed_param_sets(bool enabled) { packed_param_sets_ = enabled; }
+
+    // Public only for testing.  Null unless adaptive routing is enabled.
+    const BackendCostTable* backend_costs() const { return backend_costs_.get(); }
+
+    /**
+     * Extensions of the keymaster2 update() and finish() calls which write output into the
+     * caller's \p output buffer of \p output_capacity bytes, rather than returning it in memory
+     * the caller must free, and return its length in \p *output_length.  Software operations
+     * write straight into \p output where they can.  If the output doesn't fit,
+     * KM_ERROR_INSUFFICIENT_BUFFER_SPACE is returned and the operation is aborted, so callers
+     * should allow for at least the input length plus a block and any tag.
+     */
+    keymaster_error_t UpdateInto(keymaster_operation_handle_t operation_handle,
+                                 const keymaster_key_param_set_t* in_params,
+                                 const keymaster_blob_t* input, size_t* input_consumed,
+                                 keymaster_key_param_set_t* out_params, uint8_t* output,
+                                 size_t output_capacity, size_t* output_length);
+    keymaster_error_t FinishInto(keymaster_operation_handle_t operation_handle,
+                                 const keymaster_key_param_set_t* params,
+                                 const keymaster_blob_t* signature,
+                                 keymaster_key_param_set_t* out_params, uint8_t* output,
+                                 size_t output_capacity, size_t* output_length);
 
     typedef std::pair<keymaster_algorithm_t, keymaster_purpose_t> AlgPurposePair;
     typedef std::map<AlgPurposePair, std::vector<keymaster_digest_t>> DigestMap;
 
   private:
+    struct AlgorithmCache;
+    struct CapabilityCache;
+    struct DigestProbe;
+
     void initialize_device_struct(uint32_t flags);
     bool FindUnsupportedDigest(keymaster_algorithm_t algorithm, keymaster_purpose_t purpose,
                                const AuthorizationSet& params,
                                keymaster_digest_t* unsupported) const;
+    // The digests the wrapped keymaster1 device supports, or null if they couldn't be determined.
+    const DigestMap* km1_device_digests() const;
     bool RequiresSoftwareDigesting(keymaster_algorithm_t algorithm, keymaster_purpose_t purpose,
                                    const AuthorizationSet& params) const;
     bool KeyRequiresSoftwareDigesting(const AuthorizationSet& key_description) const;
+    // True if set_software_public_key_operations routes the operation away from the hardware.
+    bool IsSoftwarePublicKeyOperation(keymaster_algorithm_t algorithm,
+                                      keymaster_purpose_t purpose) const;
+
+    // update() and finish() without adaptive routing's cost sampling.
+    static keymaster_error_t update_untimed(const keymaster1_device_t* dev,
+                                            keymaster_operation_handle_t operation_handle,
+                                            const keymaster_key_param_set_t* in_params,
+                                            const keymaster_blob_t* input, size_t* input_consumed,
+                                            keymaster_key_param_set_t* out_params,
+                                            keymaster_blob_t* output);
+    static keymaster_error_t finish_untimed(const keymaster1_device_t* dev,
+                                            keymaster_operation_handle_t operation_handle,
+                                            const keymaster_key_param_set_t* in_params,
+                                            const keymaster_blob_t* signature,
+                                            keymaster_key_param_set_t* out_params,
+                                            keymaster_blob_t* output);
+
+    // Run update and finish on impl_, leaving the output in response->output.
+    keymaster_error_t UpdateSoftwareOperation(keymaster_operation_handle_t operation_handle,
+                                              const keymaster_key_param_set_t* in_params,
+                                              const keymaster_blob_t& input,
+                                              size_t* input_consumed,
+                                              keymaster_key_param_set_t* out_params,
+                                              UpdateOperationResponse* response);
+    keymaster_error_t FinishSoftwareOperation(keymaster_operation_handle_t operation_handle,
+                                              const keymaster_key_param_set_t* params,
+                                              const keymaster_blob_t* input,
+                                              const keymaster_blob_t* signature,
+                                              keymaster_key_param_set_t* out_params,
+                                              FinishOperationResponse* response);
+    // Begin an operation on impl_.
+    keymaster_error_t BeginSoftwareOperation(keymaster_purpose_t purpose,
+                                             const keymaster_key_blob_t& key,
+                                             const keymaster_key_param_set_t* in_params,
+                                             keymaster_key_param_set_t* out_params,
+                                             keymaster_operation_handle_t* operation_handle);
 
     static void StoreDefaultNewKeyParams(keymaster_algorithm_t algorithm,
                                          AuthorizationSet* auth_set);
@@ -241,12 +351,24 @@ class SoftKeymasterDevice {
 
     keymaster0_device_t* wrapped_km0_device_;
     keymaster1_device_t* wrapped_km1_device_;
-    DigestMap km1_device_digests_;
+    // Asks the wrapped keymaster1 device for its supported digests on first use, so that clients
+    // that never use RSA or EC keys don't wait for it.
+    UniquePtr<DigestProbe> km1_digest_probe_;
+    // Algorithms and sizes of wrapped keymaster1 keys, so begin() needn't ask the device every
+    // time.
+    UniquePtr<AlgorithmCache> algorithm_cache_;
+    // Answers to get_supported_* queries, which are fixed once the hardware device is set.
+    UniquePtr<CapabilityCache> capability_cache_;
     SoftKeymasterContext* context_;
     UniquePtr<AndroidKeymaster> impl_;
     std::string module_name_;
     hw_module_t updated_module_;
-    bool configured_;
+    // Set, with release ordering, once configure has stored the system version in the context.
+    std::atomic<bool> configured_;
+    bool software_public_key_operations_;
+    bool packed_param_sets_;
+    // Null unless set_adaptive_routing is enabled.
+    UniquePtr<BackendCostTable> backend_costs_;
 };
 
 }  // namespace keymaster
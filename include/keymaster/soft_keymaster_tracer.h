@@ -0,0 +1,38 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SYSTEM_KEYMASTER_SOFT_KEYMASTER_TRACER_H_
+#define SYSTEM_KEYMASTER_SOFT_KEYMASTER_TRACER_H_
+
+#include <keymaster/tracer.h>
+
+namespace keymaster {
+
+/**
+ * Emits keymaster's trace spans to systrace, under the HAL tag.
+ */
+class SoftKeymasterTracer : public Tracer {
+  public:
+    SoftKeymasterTracer() { set_instance(this); }
+    ~SoftKeymasterTracer() { set_instance(nullptr); }
+
+    void begin_span(const char* name) const override;
+    void end_span() const override;
+};
+
+}  // namespace keymaster
+
+#endif  // SYSTEM_KEYMASTER_SOFT_KEYMASTER_TRACER_H_
@@ -0,0 +1,85 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SYSTEM_KEYMASTER_TRACER_H_
+#define SYSTEM_KEYMASTER_TRACER_H_
+
+namespace keymaster {
+
+/**
+ * Tracer receives the begin and end of each traced span, for example to emit them to systrace.
+ * Like Logger, a subclass installs itself with set_instance, and there is at most one at a time.
+ * It should be installed before keymaster is used, and stay installed while keymaster may run.
+ *
+ * Spans nest properly on each thread, but may be begun and ended on several threads at once.
+ */
+class Tracer {
+  public:
+    Tracer() {}
+    virtual ~Tracer() {}
+
+    /**
+     * Begins a span.  name is a string literal.
+     */
+    virtual void begin_span(const char* name) const = 0;
+
+    /**
+     * Ends the span most recently begun on the calling thread.
+     */
+    virtual void end_span() const = 0;
+
+    static const Tracer* instance() { return instance_; }
+
+  protected:
+    static void set_instance(Tracer* tracer) { instance_ = tracer; }
+
+  private:
+    // Disallow copying.
+    Tracer(const Tracer&);
+    void operator=(const Tracer&);
+
+    static Tracer* instance_;
+};
+
+/**
+ * TraceSpan traces a span from its construction until End is called or it is destroyed, whichever
+ * comes first.  With no tracer installed it costs a load and a branch.
+ */
+class TraceSpan {
+  public:
+    explicit TraceSpan(const char* name) : tracer_(Tracer::instance()) {
+        if (tracer_)
+            tracer_->begin_span(name);
+    }
+    ~TraceSpan() { End(); }
+
+    void End() {
+        if (tracer_)
+            tracer_->end_span();
+        tracer_ = nullptr;
+    }
+
+  private:
+    // Disallow copying and assignment.
+    TraceSpan(const TraceSpan&);
+    void operator=(const TraceSpan&);
+
+    const Tracer* tracer_;
+};
+
+}  // namespace keymaster
+
+#endif  // SYSTEM_KEYMASTER_TRACER_H_
@@ -25,13 +25,49 @@
 
 #include <keymaster/android_keymaster_utils.h>
 #include <keymaster/authorization_set.h>
+#include <keymaster/key_policy.h>
 
+#include "compact_private_key.h"
 #include "openssl_err.h"
 
 namespace keymaster {
 
-static const uint8_t BLOB_VERSION = 0;
+// Version 1 blobs are the version byte, then the serialized key material, hw_enforced and
+// sw_enforced, then the HMAC.  They're still parsed, but no longer written.
+static const uint8_t BLOB_VERSION_1 = 0;
+// Version 2 blobs are the version byte, then the header fields (algorithm, purposes, flags and
+// section count, each a uint32), then an (offset, length) pair of uint32s for each section, then
+// the sections, then the HMAC.  Offsets are from the start of the blob and sections are in order.
+// The key material section holds the raw key material, the next two serialized auth sets and the
+// optional policy section the serialized KeyPolicy compiled from them.  Sections beyond those this
+// code knows of are ignored, so that later versions of it can add them.
+static const uint8_t BLOB_VERSION_2 = 1;
+// Version 3 blobs have the version 2 layout, but their key material is in the compact encoding of
+// compact_private_key.h, which readers that only know versions 1 and 2 can't load.  Blobs are
+// written as version 3 only when their key material is compact, so those readers still load
+// every other blob, and reject compact ones as invalid rather than misreading them.
+static const uint8_t BLOB_VERSION_3 = 2;
 static const size_t HMAC_SIZE = 8;
+
+enum BlobSection {
+    KEY_MATERIAL_SECTION,
+    HW_ENFORCED_SECTION,
+    SW_ENFORCED_SECTION,
+    REQUIRED_SECTION_COUNT,
+    POLICY_SECTION = REQUIRED_SECTION_COUNT,
+    KNOWN_SECTION_COUNT,
+};
+
+static bool HasV2Layout(uint8_t version) {
+    return version == BLOB_VERSION_2 || version == BLOB_VERSION_3;
+}
+
+static const size_t V2_FIXED_HEADER_SIZE = 1 /* version */ + 4 * sizeof(uint32_t);
+static const size_t V2_SECTION_ENTRY_SIZE = 2 * sizeof(uint32_t);
+
+const uint32_t IntegrityAssuredBlobHeader::NO_AUTH_REQUIRED;
+const uint32_t IntegrityAssuredBlobHeader::USER_AUTH_REQUIRED;
+const uint32_t IntegrityAssuredBlobHeader::AUTH_PER_OPERATION;
 static const char HMAC_KEY[] = "IntegrityAssuredBlob0";
 
 inline size_t min(size_t a, size_t b) {
@@ -49,25 +85,67 @@ class HmacCleanup {
     HMAC_CTX* ctx_;
 };
 
+/**
+ * HMAC_KEY never changes, so the HMAC key schedule (the ipad and opad compressions) is computed
+ * once and copied into a fresh context for each blob.
+ */
+class HmacKeySchedule {
+  public:
+    HmacKeySchedule() {
+        HMAC_CTX_init(&ctx_);
+        initialized_ = HMAC_Init_ex(&ctx_, HMAC_KEY, sizeof(HMAC_KEY), EVP_sha256(),
+                                    NULL /* engine */) == 1;
+    }
+    ~HmacKeySchedule() { HMAC_CTX_cleanup(&ctx_); }
+
+    /**
+     * Initializes ctx, which must have been HMAC_CTX_init'd, ready to HMAC data with HMAC_KEY.
+     */
+    keymaster_error_t Initialize(HMAC_CTX* ctx) const {
+        if (initialized_ && HMAC_CTX_copy_ex(ctx, &ctx_))
+            return KM_ERROR_OK;
+        // Precomputation failed (or the copy did), so do it the slow way.
+        if (!HMAC_Init_ex(ctx, HMAC_KEY, sizeof(HMAC_KEY), EVP_sha256(), NULL /* engine */))
+            return TranslateLastOpenSslError();
+        return KM_ERROR_OK;
+    }
+
+  private:
+    HMAC_CTX ctx_;
+    bool initialized_;
+};
+
+static const HmacKeySchedule& GetHmacKeySchedule() {
+    static const HmacKeySchedule key_schedule;
+    return key_schedule;
+}
+
+class HmacSink : public SerializationSink {
+  public:
+    explicit HmacSink(HMAC_CTX* ctx) : ctx_(ctx) {}
+    bool Write(const void* data, size_t data_len) override {
+        return HMAC_Update(ctx_, static_cast<const uint8_t*>(data), data_len);
+    }
+
+  private:
+    HMAC_CTX* ctx_;
+};
+
 static keymaster_error_t ComputeHmac(const uint8_t* serialized_data, size_t serialized_data_size,
                                      const AuthorizationSet& hidden, uint8_t hmac[HMAC_SIZE]) {
-    size_t hidden_bytes_size = hidden.SerializedSize();
-    UniquePtr<uint8_t[]> hidden_bytes(new (std::nothrow) uint8_t[hidden_bytes_size]);
-    if (!hidden_bytes.get())
-        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
-    hidden.Serialize(hidden_bytes.get(), hidden_bytes.get() + hidden_bytes_size);
-
     HMAC_CTX ctx;
     HMAC_CTX_init(&ctx);
-    const EVP_MD* md = EVP_sha256();
-    if (!HMAC_Init_ex(&ctx, HMAC_KEY, sizeof(HMAC_KEY), md, NULL /* engine */))
-        return TranslateLastOpenSslError();
     HmacCleanup cleanup(&ctx);
+    keymaster_error_t error = GetHmacKeySchedule().Initialize(&ctx);
+    if (error != KM_ERROR_OK)
+        return error;
 
+    // hidden is streamed into the HMAC rather than serialized into a temporary buffer.
+    HmacSink sink(&ctx);
     uint8_t tmp[EVP_MAX_MD_SIZE];
     unsigned tmp_len;
     if (!HMAC_Update(&ctx, serialized_data, serialized_data_size) ||
-        !HMAC_Update(&ctx, hidden_bytes.get(), hidden_bytes_size) ||  //
+        !hidden.SerializeTo(&sink) ||  //
         !HMAC_Final(&ctx, tmp, &tmp_len))
         return TranslateLastOpenSslError();
 
@@ -77,29 +155,95 @@ static keymaster_error_t ComputeHmac(const uint8_t* serialized_data, size_t seri
     return KM_ERROR_OK;
 }
 
-keymaster_error_t SerializeIntegrityAssuredBlob(const KeymasterKeyBlob& key_material,
-                                                const AuthorizationSet& hidden,
-                                                const AuthorizationSet& hw_enforced,
-                                                const AuthorizationSet& sw_enforced,
-                                                KeymasterKeyBlob* key_blob) {
-    size_t size = 1 /* version */ +                //
-                  key_material.SerializedSize() +  //
-                  hw_enforced.SerializedSize() +   //
-                  sw_enforced.SerializedSize() +   //
-                  HMAC_SIZE;
+static void SummarizeAuthorizations(const AuthorizationSet& authorizations,
+                                    IntegrityAssuredBlobHeader* header) {
+    for (const keymaster_key_param_t& param : authorizations) {
+        switch (param.tag) {
+        case KM_TAG_ALGORITHM:
+            header->algorithm = static_cast<keymaster_algorithm_t>(param.enumerated);
+            break;
+        case KM_TAG_PURPOSE:
+            if (param.enumerated < 32)
+                header->purposes |= 1U << param.enumerated;
+            break;
+        case KM_TAG_NO_AUTH_REQUIRED:
+            header->flags |= IntegrityAssuredBlobHeader::NO_AUTH_REQUIRED;
+            break;
+        case KM_TAG_USER_SECURE_ID:
+            header->flags |= IntegrityAssuredBlobHeader::USER_AUTH_REQUIRED;
+            break;
+        default:
+            break;
+        }
+    }
+}
+
+// Writes a version 2 blob, or a version 3 one if the key material is compact, with a policy section
+// if policy isn't null.
+static keymaster_error_t SerializeV2Blob(const KeymasterKeyBlob& key_material,
+                                         const AuthorizationSet& hidden,
+                                         const AuthorizationSet& hw_enforced,
+                                         const AuthorizationSet& sw_enforced,
+                                         const KeyPolicy* policy, KeymasterKeyBlob* key_blob) {
+    IntegrityAssuredBlobHeader header;
+    SummarizeAuthorizations(hw_enforced, &header);
+    SummarizeAuthorizations(sw_enforced, &header);
+    if ((header.flags & IntegrityAssuredBlobHeader::USER_AUTH_REQUIRED) &&
+        hw_enforced.find(TAG_AUTH_TIMEOUT) == -1 && sw_enforced.find(TAG_AUTH_TIMEOUT) == -1)
+        header.flags |= IntegrityAssuredBlobHeader::AUTH_PER_OPERATION;
+
+    const size_t section_count = policy ? KNOWN_SECTION_COUNT : REQUIRED_SECTION_COUNT;
+    const size_t section_sizes[KNOWN_SECTION_COUNT] = {
+        key_material.key_material_size, hw_enforced.SerializedSize(), sw_enforced.SerializedSize(),
+        policy ? policy->SerializedSize() : 0,
+    };
+    size_t size = V2_FIXED_HEADER_SIZE + section_count * V2_SECTION_ENTRY_SIZE + HMAC_SIZE;
+    for (size_t i = 0; i < section_count; ++i)
+        size += section_sizes[i];
 
     if (!key_blob->Reset(size))
         return KM_ERROR_MEMORY_ALLOCATION_FAILED;
 
     uint8_t* p = key_blob->writable_data();
-    *p++ = BLOB_VERSION;
-    p = key_material.Serialize(p, key_blob->end());
-    p = hw_enforced.Serialize(p, key_blob->end());
-    p = sw_enforced.Serialize(p, key_blob->end());
+    const uint8_t* end = key_blob->end();
+    *p++ = IsCompactPrivateKey(key_material) ? BLOB_VERSION_3 : BLOB_VERSION_2;
+    p = append_uint32_to_buf(p, end, header.algorithm);
+    p = append_uint32_to_buf(p, end, header.purposes);
+    p = append_uint32_to_buf(p, end, header.flags);
+    p = append_uint32_to_buf(p, end, section_count);
+    size_t offset = V2_FIXED_HEADER_SIZE + section_count * V2_SECTION_ENTRY_SIZE;
+    for (size_t i = 0; i < section_count; ++i) {
+        p = append_uint32_to_buf(p, end, offset);
+        p = append_uint32_to_buf(p, end, section_sizes[i]);
+        offset += section_sizes[i];
+    }
+    p = append_to_buf(p, end, key_material.key_material, key_material.key_material_size);
+    p = hw_enforced.Serialize(p, end);
+    p = sw_enforced.Serialize(p, end);
+    if (policy)
+        p = policy->Serialize(p, end);
 
     return ComputeHmac(key_blob->key_material, p - key_blob->key_material, hidden, p);
 }
 
+keymaster_error_t SerializeIntegrityAssuredBlob(const KeymasterKeyBlob& key_material,
+                                                const AuthorizationSet& hidden,
+                                                const AuthorizationSet& hw_enforced,
+                                                const AuthorizationSet& sw_enforced,
+                                                KeymasterKeyBlob* key_blob) {
+    return SerializeV2Blob(key_material, hidden, hw_enforced, sw_enforced, nullptr /* policy */,
+                           key_blob);
+}
+
+keymaster_error_t SerializeIntegrityAssuredBlob(const KeymasterKeyBlob& key_material,
+                                                const AuthorizationSet& hidden,
+                                                const AuthorizationSet& hw_enforced,
+                                                const AuthorizationSet& sw_enforced,
+                                                const KeyPolicy& policy,
+                                                KeymasterKeyBlob* key_blob) {
+    return SerializeV2Blob(key_material, hidden, hw_enforced, sw_enforced, &policy, key_blob);
+}
+
 keymaster_error_t DeserializeIntegrityAssuredBlob(const KeymasterKeyBlob& key_blob,
                                                   const AuthorizationSet& hidden,
                                                   KeymasterKeyBlob* key_material,
@@ -124,26 +268,182 @@ keymaster_error_t DeserializeIntegrityAssuredBlob(const KeymasterKeyBlob& key_bl
                                                        sw_enforced);
 }
 
-keymaster_error_t DeserializeIntegrityAssuredBlob_NoHmacCheck(const KeymasterKeyBlob& key_blob,
-                                                              KeymasterKeyBlob* key_material,
-                                                              AuthorizationSet* hw_enforced,
-                                                              AuthorizationSet* sw_enforced) {
+struct SectionBounds {
+    const uint8_t* begin;
+    const uint8_t* end;
+};
+
+/**
+ * Reads the header of a version 2 blob, checking that the sections lie in order between the header
+ * and the HMAC, and fill that space.  sections, which may be null, receives the bounds of the
+ * KNOWN_SECTION_COUNT sections this code knows of.
+ */
+static bool ParseV2Header(const KeymasterKeyBlob& key_blob, IntegrityAssuredBlobHeader* header,
+                          SectionBounds* sections) {
+    if (!key_blob.key_material || key_blob.key_material_size < V2_FIXED_HEADER_SIZE + HMAC_SIZE)
+        return false;
+
+    const uint8_t* p = key_blob.begin();
+    const uint8_t* end = key_blob.end() - HMAC_SIZE;
+    if (!HasV2Layout(*p++))
+        return false;
+
+    uint32_t algorithm, section_count;
+    if (!copy_uint32_from_buf(&p, end, &algorithm) ||
+        !copy_uint32_from_buf(&p, end, &header->purposes) ||
+        !copy_uint32_from_buf(&p, end, &header->flags) ||
+        !copy_uint32_from_buf(&p, end, &section_count) ||  //
+        section_count < REQUIRED_SECTION_COUNT ||
+        section_count > static_cast<size_t>(end - p) / V2_SECTION_ENTRY_SIZE)
+        return false;
+    header->algorithm = static_cast<keymaster_algorithm_t>(algorithm);
+
+    // Known sections the blob doesn't have are left empty, with null bounds.
+    for (size_t i = 0; sections && i < KNOWN_SECTION_COUNT; ++i)
+        sections[i].begin = sections[i].end = nullptr;
+
+    size_t data_start = V2_FIXED_HEADER_SIZE + section_count * V2_SECTION_ENTRY_SIZE;
+    size_t data_end = end - key_blob.begin();
+    size_t previous_end = data_start;
+    for (size_t i = 0; i < section_count; ++i) {
+        uint32_t offset, length;
+        if (!copy_uint32_from_buf(&p, end, &offset) || !copy_uint32_from_buf(&p, end, &length) ||
+            offset < previous_end || offset > data_end || length > data_end - offset)
+            return false;
+        previous_end = offset + length;
+        if (sections && i < KNOWN_SECTION_COUNT) {
+            sections[i].begin = key_blob.begin() + offset;
+            sections[i].end = sections[i].begin + length;
+        }
+    }
+    // The sections fill the blob between the header and the HMAC.
+    return previous_end == data_end;
+}
+
+keymaster_error_t ReadIntegrityAssuredBlobHeader(const KeymasterKeyBlob& key_blob,
+                                                 IntegrityAssuredBlobHeader* header) {
+    if (!ParseV2Header(key_blob, header, nullptr /* sections */))
+        return KM_ERROR_INVALID_KEY_BLOB;
+    return KM_ERROR_OK;
+}
+
+keymaster_error_t DeserializeIntegrityAssuredBlob(const KeymasterKeyBlob& key_blob,
+                                                  const AuthorizationSet& hidden,
+                                                  KeymasterKeyBlob* key_material,
+                                                  AuthorizationSet* hw_enforced,
+                                                  AuthorizationSet* sw_enforced,
+                                                  KeyPolicy* policy) {
+    keymaster_error_t error =
+        DeserializeIntegrityAssuredBlob(key_blob, hidden, key_material, hw_enforced, sw_enforced);
+    if (error != KM_ERROR_OK)
+        return error;
+
+    // The HMAC covered the policy section too, so it's as trustworthy as the auth sets.
+    IntegrityAssuredBlobHeader header;
+    SectionBounds sections[KNOWN_SECTION_COUNT];
+    if (!ParseV2Header(key_blob, &header, sections) || !sections[POLICY_SECTION].begin)
+        return policy->Compile(*hw_enforced, *sw_enforced);
+
+    const uint8_t* p = sections[POLICY_SECTION].begin;
+    if (!policy->Deserialize(&p, sections[POLICY_SECTION].end) ||
+        p != sections[POLICY_SECTION].end)
+        return KM_ERROR_INVALID_KEY_BLOB;
+    return KM_ERROR_OK;
+}
+
+static bool DeserializeAuthSet(AuthorizationSet* set, const uint8_t** buf_ptr,
+                               const uint8_t* end) {
+    return set->Deserialize(buf_ptr, end);
+}
+
+static bool DeserializeAuthSet(AuthorizationSetView* view, const uint8_t** buf_ptr,
+                               const uint8_t* end) {
+    return view->Init(buf_ptr, end);
+}
+
+// Deserializes an auth set that must fill its section exactly.
+template <typename AuthSet>
+static bool DeserializeAuthSection(AuthSet* set, const SectionBounds& section) {
+    const uint8_t* p = section.begin;
+    return DeserializeAuthSet(set, &p, section.end) && p == section.end;
+}
+
+template <typename AuthSet>
+static keymaster_error_t DeserializeV2NoHmacCheck(const KeymasterKeyBlob& key_blob,
+                                                  KeymasterKeyBlob* key_material,
+                                                  AuthSet* hw_enforced, AuthSet* sw_enforced) {
+    IntegrityAssuredBlobHeader header;
+    SectionBounds sections[KNOWN_SECTION_COUNT];
+    if (!ParseV2Header(key_blob, &header, sections) ||
+        !DeserializeAuthSection(hw_enforced, sections[HW_ENFORCED_SECTION]) ||
+        !DeserializeAuthSection(sw_enforced, sections[SW_ENFORCED_SECTION]))
+        return KM_ERROR_INVALID_KEY_BLOB;
+
+    if (key_material) {
+        const SectionBounds& section = sections[KEY_MATERIAL_SECTION];
+        if (!key_material->Reset(section.end - section.begin))
+            return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+        memcpy(key_material->writable_data(), section.begin, section.end - section.begin);
+    }
+    return KM_ERROR_OK;
+}
+
+template <typename AuthSet>
+static keymaster_error_t DeserializeNoHmacCheck(const KeymasterKeyBlob& key_blob,
+                                                KeymasterKeyBlob* key_material,
+                                                AuthSet* hw_enforced, AuthSet* sw_enforced) {
     const uint8_t* p = key_blob.begin();
     const uint8_t* end = key_blob.end() - HMAC_SIZE;
 
     if (p > end)
         return KM_ERROR_INVALID_KEY_BLOB;
 
-    if (*p != BLOB_VERSION)
+    if (HasV2Layout(*p))
+        return DeserializeV2NoHmacCheck(key_blob, key_material, hw_enforced, sw_enforced);
+    if (*p != BLOB_VERSION_1)
         return KM_ERROR_INVALID_KEY_BLOB;
     ++p;
 
-    if (!key_material->Deserialize(&p, end) ||  //
-        !hw_enforced->Deserialize(&p, end) ||   //
-        !sw_enforced->Deserialize(&p, end))
+    bool key_material_ok = key_material ? key_material->Deserialize(&p, end)
+                                        : skip_size_and_data_in_buf(&p, end);
+    if (!key_material_ok ||                           //
+        !DeserializeAuthSet(hw_enforced, &p, end) ||  //
+        !DeserializeAuthSet(sw_enforced, &p, end))
         return KM_ERROR_INVALID_KEY_BLOB;
 
     return KM_ERROR_OK;
 }
 
+keymaster_error_t DeserializeIntegrityAssuredBlob_NoHmacCheck(const KeymasterKeyBlob& key_blob,
+                                                              KeymasterKeyBlob* key_material,
+                                                              AuthorizationSet* hw_enforced,
+                                                              AuthorizationSet* sw_enforced) {
+    return DeserializeNoHmacCheck(key_blob, key_material, hw_enforced, sw_enforced);
+}
+
+keymaster_error_t DeserializeIntegrityAssuredBlob_NoHmacCheck(const KeymasterKeyBlob& key_blob,
+                                                              KeymasterKeyBlob* key_material,
+                                                              AuthorizationSetView* hw_enforced,
+                                                              AuthorizationSetView* sw_enforced) {
+    return DeserializeNoHmacCheck(key_blob, key_material, hw_enforced, sw_enforced);
+}
+
+bool MayBeIntegrityAssuredBlob(const KeymasterKeyBlob& key_blob) {
+    if (!key_blob.key_material || key_blob.key_material_size < 1 + HMAC_SIZE)
+        return false;
+
+    const uint8_t* p = key_blob.begin();
+    const uint8_t* end = key_blob.end() - HMAC_SIZE;
+    if (HasV2Layout(*p)) {
+        IntegrityAssuredBlobHeader header;
+        return ParseV2Header(key_blob, &header, nullptr /* sections */);
+    }
+    if (*p++ != BLOB_VERSION_1)
+        return false;
+
+    return skip_size_and_data_in_buf(&p, end) &&  //
+           AuthorizationSet::SkipSerialized(&p, end) &&
+           AuthorizationSet::SkipSerialized(&p, end);
+}
+
 }  // namespace keymaster;
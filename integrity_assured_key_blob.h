@@ -17,31 +17,116 @@
 #ifndef SYSTEM_KEYMASTER_INTEGRITY_ASSURED_KEY_BLOB_
 #define SYSTEM_KEYMASTER_INTEGRITY_ASSURED_KEY_BLOB_
 
+#include <stdint.h>
+
 #include <hardware/keymaster_defs.h>
 
 namespace keymaster {
 
 class AuthorizationSet;
+class AuthorizationSetView;
 class Buffer;
 struct KeymasterKeyBlob;
+struct KeyPolicy;
+
+keymaster_error_t SerializeIntegrityAssuredBlob(const KeymasterKeyBlob& key_material,
+                                                const AuthorizationSet& hidden,
+                                                const AuthorizationSet& hw_enforced,
+                                                const AuthorizationSet& sw_enforced,
+                                                KeymasterKeyBlob* key_blob);
 
+/**
+ * Like the overload above, but also stores policy, which should have been compiled from
+ * hw_enforced and sw_enforced, in the blob.
+ */
 keymaster_error_t SerializeIntegrityAssuredBlob(const KeymasterKeyBlob& key_material,
                                                 const AuthorizationSet& hidden,
                                                 const AuthorizationSet& hw_enforced,
                                                 const AuthorizationSet& sw_enforced,
+                                                const KeyPolicy& policy,
                                                 KeymasterKeyBlob* key_blob);
 
+/**
+ * Checks key_blob's HMAC and extracts its contents.  The version 2 layout that
+ * SerializeIntegrityAssuredBlob writes, its version 3 variant for compact key material, and the
+ * older version 1 layout are accepted.  key_material may be null, to extract only the
+ * authorizations; the same applies to the _NoHmacCheck variants below.
+ */
 keymaster_error_t DeserializeIntegrityAssuredBlob(const KeymasterKeyBlob& key_blob,
                                                   const AuthorizationSet& hidden,
                                                   KeymasterKeyBlob* key_material,
                                                   AuthorizationSet* hw_enforced,
                                                   AuthorizationSet* sw_enforced);
 
+/**
+ * Like the overload above, but also returns the key's policy: the one stored in the blob if it has
+ * one, or else one compiled from the authorizations.
+ */
+keymaster_error_t DeserializeIntegrityAssuredBlob(const KeymasterKeyBlob& key_blob,
+                                                  const AuthorizationSet& hidden,
+                                                  KeymasterKeyBlob* key_material,
+                                                  AuthorizationSet* hw_enforced,
+                                                  AuthorizationSet* sw_enforced,
+                                                  KeyPolicy* policy);
+
 keymaster_error_t DeserializeIntegrityAssuredBlob_NoHmacCheck(const KeymasterKeyBlob& key_blob,
                                                               KeymasterKeyBlob* key_material,
                                                               AuthorizationSet* hw_enforced,
                                                               AuthorizationSet* sw_enforced);
 
+/**
+ * Like the overload above, but returns views of the authorizations in key_blob rather than copies
+ * of them, for callers that only read them.  The views are only valid as long as key_blob is.
+ */
+keymaster_error_t DeserializeIntegrityAssuredBlob_NoHmacCheck(const KeymasterKeyBlob& key_blob,
+                                                              KeymasterKeyBlob* key_material,
+                                                              AuthorizationSetView* hw_enforced,
+                                                              AuthorizationSetView* sw_enforced);
+
+/**
+ * Cheaply checks whether key_blob has the layout of an integrity-assured blob, without computing
+ * the HMAC or deserializing the auth sets.  A false return means DeserializeIntegrityAssuredBlob
+ * can't succeed.
+ */
+bool MayBeIntegrityAssuredBlob(const KeymasterKeyBlob& key_blob);
+
+/**
+ * The plain fields at the start of a version 2 integrity-assured blob, which summarize its
+ * authorizations so that callers such as operation routing and characteristics queries can read
+ * them without parsing the auth sets.  They come from the union of hw_enforced and sw_enforced.
+ */
+struct IntegrityAssuredBlobHeader {
+    // Set if the key has TAG_NO_AUTH_REQUIRED.
+    static const uint32_t NO_AUTH_REQUIRED = 1 << 0;
+    // Set if the key has at least one TAG_USER_SECURE_ID.
+    static const uint32_t USER_AUTH_REQUIRED = 1 << 1;
+    // Set if user authentication is required and there's no TAG_AUTH_TIMEOUT, so each operation
+    // needs its own auth token.
+    static const uint32_t AUTH_PER_OPERATION = 1 << 2;
+
+    // The algorithm is zero, which is no algorithm, if the key has no TAG_ALGORITHM.
+    IntegrityAssuredBlobHeader()
+        : algorithm(static_cast<keymaster_algorithm_t>(0)), purposes(0), flags(0) {}
+
+    bool has_purpose(keymaster_purpose_t purpose) const {
+        return purpose < 32 && (purposes & (1U << purpose));
+    }
+
+    keymaster_algorithm_t algorithm;
+    // Bit (1 << purpose) is set for each of the key's TAG_PURPOSEs.
+    uint32_t purposes;
+    uint32_t flags;
+};
+
+/**
+ * Reads the header of a version 2 integrity-assured blob, checking that its sections are in
+ * bounds.  Returns KM_ERROR_INVALID_KEY_BLOB for version 1 blobs, which have no header, and for
+ * anything else that isn't a version 2 blob.  The HMAC isn't checked, so the header must not be
+ * relied on for enforcement until the blob has been fully parsed.
+ */
+keymaster_error_t ReadIntegrityAssuredBlobHeader(const KeymasterKeyBlob& key_blob,
+                                                 IntegrityAssuredBlobHeader* header);
+
 }  // namespace keymaster;
 
 #endif  // SYSTEM_KEYMASTER_INTEGRITY_ASSURED_KEY_BLOB_
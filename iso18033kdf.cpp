@@ -18,8 +18,12 @@
 #include "openssl_utils.h"
 
 #include <algorithm>
+#include <new>
 
 #include <openssl/evp.h>
+#include <openssl/sha.h>
+
+#include "sha256_multibuffer.h"
 
 namespace keymaster {
 
@@ -27,6 +31,101 @@ inline size_t min(size_t a, size_t b) {
     return (a < b) ? a : b;
 }
 
+static void WriteCounter(uint32_t counter, uint8_t* output) {
+    output[0] = (counter >> 24) & 0xff;
+    output[1] = (counter >> 16) & 0xff;
+    output[2] = (counter >> 8) & 0xff;
+    output[3] = counter & 0xff;
+}
+
+/*
+ * Generates the output one digest block at a time.  The secret is hashed once, and each block
+ * continues from a copy of that state.
+ */
+static bool GenerateSerially(const EVP_MD* md, const uint8_t* secret, size_t secret_len,
+                             uint32_t counter, const uint8_t* info, size_t info_len,
+                             uint8_t* output, size_t output_len) {
+    EVP_MD_CTX prefix_ctx;
+    EvpMdCtxCleaner prefixCtxCleaner(&prefix_ctx);
+    EVP_MD_CTX_init(&prefix_ctx);
+    EVP_MD_CTX ctx;
+    EvpMdCtxCleaner ctxCleaner(&ctx);
+    EVP_MD_CTX_init(&ctx);
+
+    if (!EVP_DigestInit_ex(&prefix_ctx, md, nullptr /* default digest */) ||
+        !EVP_DigestUpdate(&prefix_ctx, secret, secret_len))
+        return false;
+
+    size_t digest_size = EVP_MD_size(md);
+    uint8_t digest_result[EVP_MAX_MD_SIZE];
+    bool result = true;
+    for (size_t block_start = 0; result && block_start < output_len; block_start += digest_size) {
+        uint8_t counter_bytes[4];
+        WriteCounter(counter++, counter_bytes);
+        /* OpenSSL does not accept size_t parameter. */
+        unsigned int uint32_digest_size = 0;
+        result = EVP_MD_CTX_copy_ex(&ctx, &prefix_ctx) &&
+                 EVP_DigestUpdate(&ctx, counter_bytes, sizeof(counter_bytes)) &&
+                 (info_len == 0 || EVP_DigestUpdate(&ctx, info, info_len)) &&
+                 EVP_DigestFinal_ex(&ctx, digest_result, &uint32_digest_size) &&
+                 uint32_digest_size == digest_size;
+        if (result)
+            memcpy(output + block_start, digest_result,
+                   min(digest_size, output_len - block_start));
+    }
+    memset_s(digest_result, 0, sizeof(digest_result));
+    return result;
+}
+
+/*
+ * Generates SHA-256 output kSha256Lanes counter blocks at a time with the multi-buffer SHA-256.
+ * The secret's whole blocks are compressed once; every counter block's remaining input is the same
+ * length (the rest of the secret, the counter and the info), so all lanes stay busy.
+ */
+static bool GenerateSha256MultiBuffer(const uint8_t* secret, size_t secret_len, uint32_t counter,
+                                      const uint8_t* info, size_t info_len, uint8_t* output,
+                                      size_t output_len) {
+    uint32_t prefix[8];
+    memcpy(prefix, kSha256InitialChainingValue, sizeof(prefix));
+    size_t prefix_blocks = secret_len / kSha256BlockSize;
+    for (size_t i = 0; i < prefix_blocks; ++i)
+        Sha256Compress(prefix, secret + i * kSha256BlockSize);
+
+    const uint8_t* secret_tail = secret + prefix_blocks * kSha256BlockSize;
+    size_t secret_tail_len = secret_len % kSha256BlockSize;
+    size_t message_len = secret_tail_len + 4 + info_len;
+    UniquePtr<uint8_t[]> messages(new (std::nothrow) uint8_t[kSha256Lanes * message_len]);
+    if (!messages.get())
+        return false;
+    const uint8_t* data[kSha256Lanes];
+    size_t data_len[kSha256Lanes];
+    for (size_t lane = 0; lane < kSha256Lanes; ++lane) {
+        uint8_t* message = messages.get() + lane * message_len;
+        memcpy(message, secret_tail, secret_tail_len);
+        if (info_len > 0)
+            memcpy(message + secret_tail_len + 4, info, info_len);
+        data[lane] = message;
+        data_len[lane] = message_len;
+    }
+
+    uint8_t digests[kSha256Lanes * SHA256_DIGEST_LENGTH];
+    for (size_t block_start = 0; block_start < output_len;) {
+        size_t lanes = 0;
+        for (; lanes < kSha256Lanes && block_start + lanes * SHA256_DIGEST_LENGTH < output_len;
+             ++lanes)
+            WriteCounter(counter++, messages.get() + lanes * message_len + secret_tail_len);
+        Sha256FinishMultiBuffer(prefix, prefix_blocks, lanes, data, data_len, digests);
+
+        size_t length = min(lanes * SHA256_DIGEST_LENGTH, output_len - block_start);
+        memcpy(output + block_start, digests, length);
+        block_start += length;
+    }
+    memset_s(prefix, 0, sizeof(prefix));
+    memset_s(messages.get(), 0, kSha256Lanes * message_len);
+    memset_s(digests, 0, sizeof(digests));
+    return true;
+}
+
 bool Iso18033Kdf::GenerateKey(const uint8_t* info, size_t info_len, uint8_t* output,
                               size_t output_len) {
     if (!is_initialized_ || output == nullptr)
@@ -36,50 +135,18 @@ bool Iso18033Kdf::GenerateKey(const uint8_t* info, size_t info_len, uint8_t* out
     if ((0xFFFFFFFFULL + start_counter_) * digest_size_ < (uint64_t)output_len)
         return false;
 
-    EVP_MD_CTX ctx;
-    EvpMdCtxCleaner ctxCleaner(&ctx);
-    EVP_MD_CTX_init(&ctx);
-
-    size_t num_blocks = (output_len + digest_size_ - 1) / digest_size_;
-    UniquePtr<uint8_t[]> counter(new uint8_t[4]);
-    UniquePtr<uint8_t[]> digest_result(new uint8_t[digest_size_]);
-    if (counter.get() == nullptr || digest_result.get() == nullptr)
+    if (info == nullptr)
+        info_len = 0;
+    switch (digest_type_) {
+    case KM_DIGEST_SHA1:
+        return GenerateSerially(EVP_sha1(), secret_key_.get(), secret_key_len_, start_counter_,
+                                info, info_len, output, output_len);
+    case KM_DIGEST_SHA_2_256:
+        return GenerateSha256MultiBuffer(secret_key_.get(), secret_key_len_, start_counter_, info,
+                                         info_len, output, output_len);
+    default:
         return false;
-    for (size_t block = 0; block < num_blocks; block++) {
-        switch (digest_type_) {
-        case KM_DIGEST_SHA1:
-            if (!EVP_DigestInit_ex(&ctx, EVP_sha1(), nullptr /* default digest */))
-                return false;
-            break;
-        case KM_DIGEST_SHA_2_256:
-            if (!EVP_DigestInit_ex(&ctx, EVP_sha256(), nullptr /* default digest */))
-                return false;
-            break;
-        default:
-            return false;
-        }
-
-        if (!EVP_DigestUpdate(&ctx, secret_key_.get(), secret_key_len_) ||
-            !Uint32ToBigEndianByteArray(block + start_counter_, counter.get()) ||
-            !EVP_DigestUpdate(&ctx, counter.get(), 4))
-            return false;
-
-        if (info != nullptr && info_len > 0) {
-            if (!EVP_DigestUpdate(&ctx, info, info_len))
-                return false;
-        }
-
-        /* OpenSSL does not accept size_t parameter. */
-        uint32_t uint32_digest_size_ = digest_size_;
-        if (!EVP_DigestFinal_ex(&ctx, digest_result.get(), &uint32_digest_size_) ||
-            uint32_digest_size_ != digest_size_)
-            return false;
-
-        size_t block_start = digest_size_ * block;
-        size_t block_length = min(digest_size_, output_len - block_start);
-        memcpy(output + block_start, digest_result.get(), block_length);
     }
-    return true;
 }
 
 }  // namespace keymaster
@@ -18,6 +18,8 @@
 #include <gtest/gtest.h>
 #include <string.h>
 
+#include <openssl/sha.h>
+
 #include "android_keymaster_test_utils.h"
 
 using std::string;
@@ -55,6 +57,41 @@ TEST(Kdf1Test, Kdf1) {
     }
 }
 
+TEST(Kdf1Test, Sha256MatchesDefinition) {
+    // Secrets shorter and longer than a SHA-256 block, with and without info, and output lengths
+    // that fill or part-fill the last group of counter blocks hashed together.
+    for (size_t secret_len : {20, 64, 100}) {
+        for (size_t info_len : {0, 11}) {
+            for (size_t output_len : {1, 32, 100, 128, 300}) {
+                const string secret(secret_len, 's');
+                const string info(info_len, 'i');
+                string expected;
+                for (uint32_t counter = 0; expected.size() < output_len; ++counter) {
+                    string input = secret;
+                    input += static_cast<char>(counter >> 24);
+                    input += static_cast<char>(counter >> 16);
+                    input += static_cast<char>(counter >> 8);
+                    input += static_cast<char>(counter);
+                    input += info;
+                    uint8_t digest[SHA256_DIGEST_LENGTH];
+                    SHA256(reinterpret_cast<const uint8_t*>(input.data()), input.size(), digest);
+                    expected.append(reinterpret_cast<const char*>(digest), sizeof(digest));
+                }
+
+                Kdf1 kdf1;
+                ASSERT_TRUE(kdf1.Init(KM_DIGEST_SHA_2_256,
+                                      reinterpret_cast<const uint8_t*>(secret.data()), secret_len));
+                uint8_t output[300];
+                ASSERT_TRUE(kdf1.GenerateKey(reinterpret_cast<const uint8_t*>(info.data()),
+                                             info_len, output, output_len));
+                EXPECT_EQ(0, memcmp(output, expected.data(), output_len))
+                    << secret_len << "-byte secret, " << info_len << "-byte info, "
+                    << output_len << "-byte output";
+            }
+        }
+    }
+}
+
 }  // namespace test
 
 }  // namespace keymaster
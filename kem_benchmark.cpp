@@ -0,0 +1,120 @@
+/*
+ * Copyright 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * Benchmarks the KeyExchange and Kem implementations against each other: ECDH and ECIES-KEM on
+ * the NIST curves, and their X25519 counterparts.
+ *
+ * A KeyExchange benchmark times one shared-secret calculation against a fixed peer, which is the
+ * recipient's cost in a key encapsulation.  A Kem benchmark times one encapsulation, the sender's
+ * cost, which also includes generating the ephemeral key.
+ */
+
+#include <benchmark/benchmark.h>
+
+#include <keymaster/authorization_set.h>
+
+#include "ecies_kem.h"
+#include "nist_curve_key_exchange.h"
+#include "x25519_kem.h"
+#include "x25519_key_exchange.h"
+
+namespace keymaster {
+namespace {
+
+const uint32_t kKemKeyBytes = 32;
+
+void CalculateSharedKey(benchmark::State& state, KeyExchange* own, KeyExchange* peer) {
+    UniquePtr<KeyExchange> own_deleter(own), peer_deleter(peer);
+    Buffer peer_public_value;
+    if (!own || !peer || !peer->public_value(&peer_public_value)) {
+        state.SkipWithError("Can't generate key exchanges");
+        return;
+    }
+    while (state.KeepRunning()) {
+        Buffer shared_key;
+        if (!own->CalculateSharedKey(peer_public_value, &shared_key)) {
+            state.SkipWithError("CalculateSharedKey failed");
+            break;
+        }
+    }
+}
+
+void NistCurveSharedKey(benchmark::State& state, keymaster_ec_curve_t curve) {
+    CalculateSharedKey(state, NistCurveKeyExchange::GenerateKeyExchange(curve),
+                       NistCurveKeyExchange::GenerateKeyExchange(curve));
+}
+
+void X25519SharedKey(benchmark::State& state) {
+    CalculateSharedKey(state, X25519KeyExchange::GenerateKeyExchange(),
+                       X25519KeyExchange::GenerateKeyExchange());
+}
+
+void Encapsulate(benchmark::State& state, Kem* kem, KeyExchange* recipient) {
+    UniquePtr<Kem> kem_deleter(kem);
+    UniquePtr<KeyExchange> recipient_deleter(recipient);
+    Buffer recipient_public_value;
+    if (!recipient || !recipient->public_value(&recipient_public_value)) {
+        state.SkipWithError("Can't generate recipient key");
+        return;
+    }
+    while (state.KeepRunning()) {
+        Buffer clear_key, encrypted_key;
+        if (!kem->Encrypt(recipient_public_value, &clear_key, &encrypted_key)) {
+            state.SkipWithError("Encrypt failed");
+            break;
+        }
+    }
+}
+
+void EciesEncapsulate(benchmark::State& state, keymaster_ec_curve_t curve) {
+    AuthorizationSet description(AuthorizationSetBuilder()
+                                     .Authorization(TAG_EC_CURVE, curve)
+                                     .Authorization(TAG_KDF, KM_KDF_RFC5869_SHA256)
+                                     .Authorization(TAG_KEY_SIZE, kKemKeyBytes));
+    keymaster_error_t error;
+    Kem* kem = new EciesKem(description, &error);
+    if (error != KM_ERROR_OK) {
+        delete kem;
+        state.SkipWithError("Can't create EciesKem");
+        return;
+    }
+    Encapsulate(state, kem, NistCurveKeyExchange::GenerateKeyExchange(curve));
+}
+
+void X25519Encapsulate(benchmark::State& state) {
+    AuthorizationSet description(AuthorizationSetBuilder()
+                                     .Authorization(TAG_KDF, KM_KDF_RFC5869_SHA256)
+                                     .Authorization(TAG_KEY_SIZE, kKemKeyBytes));
+    keymaster_error_t error;
+    Kem* kem = new X25519Kem(description, &error);
+    if (error != KM_ERROR_OK) {
+        delete kem;
+        state.SkipWithError("Can't create X25519Kem");
+        return;
+    }
+    Encapsulate(state, kem, X25519KeyExchange::GenerateKeyExchange());
+}
+
+BENCHMARK_CAPTURE(NistCurveSharedKey, P256, KM_EC_CURVE_P_256);
+BENCHMARK_CAPTURE(NistCurveSharedKey, P384, KM_EC_CURVE_P_384);
+BENCHMARK(X25519SharedKey);
+BENCHMARK_CAPTURE(EciesEncapsulate, P256, KM_EC_CURVE_P_256);
+BENCHMARK_CAPTURE(EciesEncapsulate, P384, KM_EC_CURVE_P_384);
+BENCHMARK(X25519Encapsulate);
+
+}  // namespace
+}  // namespace keymaster
@@ -27,6 +27,8 @@
 
 namespace keymaster {
 
+class AttestationSigner;
+
 class Key {
   public:
     virtual ~Key() {}
@@ -48,12 +50,52 @@ class Key {
         return KM_ERROR_INCOMPATIBLE_ALGORITHM;
     }
 
+    /**
+     * Generate just the attestation certificate, signed by a signer for this key's algorithm that
+     * the caller has already initialized, leaving the caller to add the signer's issuer chain.
+     */
+    virtual keymaster_error_t GenerateAttestationCertificate(
+        const KeymasterContext& /* context */, const AttestationSigner& /* signer */,
+        const AuthorizationSet& /* attest_params */, const AuthorizationSet& /* tee_enforced */,
+        const AuthorizationSet& /* sw_enforced */, keymaster_blob_t* /* certificate */) const {
+        return KM_ERROR_INCOMPATIBLE_ALGORITHM;
+    }
+
+    /**
+     * Return true if several operations may safely run against this one Key object at once.  Keys
+     * whose operations keep per-operation state in the key itself must return false; such keys are
+     * never cached and are loaded afresh for each use.
+     */
+    virtual bool shareable() const { return true; }
+
+    /**
+     * Does now the setup the key would otherwise do during its first operations, such as building
+     * library key objects and their cached contexts, so that a key warmed in the background is as
+     * quick to use as one that has been used already.
+     */
+    virtual keymaster_error_t Warmup() const { return KM_ERROR_OK; }
+
     const AuthorizationSet& authorizations() const { return authorizations_; }
 
+    /**
+     * Returns the bytes the loaded key holds: the object itself, the heap storage its
+     * authorizations own, and its key material and library key objects, with precomputation queues
+     * counted at capacity.  Caches and pools that fill as the key is used are counted at their
+     * current size.
+     */
+    size_t memory_footprint() const {
+        return object_size() + authorizations_.heap_bytes() + material_bytes();
+    }
+
   protected:
     Key(const AuthorizationSet& hw_enforced, const AuthorizationSet& sw_enforced,
         keymaster_error_t* error);
 
+    // The size of the most-derived object.  Concrete keys override this.
+    virtual size_t object_size() const { return sizeof(Key); }
+    // Heap bytes held by the key material and library objects the derived class owns.
+    virtual size_t material_bytes() const { return 0; }
+
   private:
     AuthorizationSet authorizations_;
 };
@@ -0,0 +1,268 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * Benchmarks SoftKeymasterContext::ParseKeyBlob on each of the six blob formats it accepts, and on
+ * blobs that look like one format but turn out to be another, which cost a trip through the whole
+ * detection chain.
+ *
+ * Hardware blobs are handled by mock keymaster0 and keymaster1 devices, which accept any blob
+ * without a round trip to a TEE, so the hardware numbers are the context's own overhead.  The old
+ * software formats are read from the checked-in *.blob fixtures, so run keymaster_benchmark from
+ * the source directory, as "make bench" does.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <string>
+
+#include <benchmark/benchmark.h>
+
+#include <openssl/ec.h>
+#include <openssl/evp.h>
+#include <openssl/x509.h>
+
+#include <hardware/keymaster0.h>
+#include <hardware/keymaster1.h>
+
+#include <keymaster/android_keymaster_utils.h>
+#include <keymaster/authorization_set.h>
+#include <keymaster/soft_keymaster_context.h>
+
+#include "openssl_utils.h"
+
+namespace keymaster {
+namespace {
+
+// Opaque "hardware" blobs.  Neither looks like any of the software formats.
+const std::string kKeymaster0HwBlob(64, '\x5a');
+const std::string kKeymaster1HwBlob(64, '\xa5');
+
+std::string mock_public_key;
+
+int MockClose(hw_device_t* /* dev */) {
+    return 0;
+}
+
+int MockGetKeypairPublic(const keymaster0_device_t* /* dev */, const uint8_t* /* key_blob */,
+                         const size_t /* key_blob_length */, uint8_t** x509_data,
+                         size_t* x509_data_length) {
+    *x509_data = reinterpret_cast<uint8_t*>(malloc(mock_public_key.size()));
+    if (!*x509_data)
+        return -1;
+    memcpy(*x509_data, mock_public_key.data(), mock_public_key.size());
+    *x509_data_length = mock_public_key.size();
+    return 0;
+}
+
+keymaster_error_t MockGetKeyCharacteristics(const keymaster1_device_t* /* dev */,
+                                            const keymaster_key_blob_t* /* key_blob */,
+                                            const keymaster_blob_t* /* client_id */,
+                                            const keymaster_blob_t* /* app_data */,
+                                            keymaster_key_characteristics_t** characteristics) {
+    AuthorizationSet hw_enforced(AuthorizationSetBuilder()
+                                     .Authorization(TAG_ALGORITHM, KM_ALGORITHM_EC)
+                                     .Authorization(TAG_KEY_SIZE, 256)
+                                     .Authorization(TAG_PURPOSE, KM_PURPOSE_SIGN)
+                                     .Digest(KM_DIGEST_NONE));
+    *characteristics = reinterpret_cast<keymaster_key_characteristics_t*>(
+        malloc(sizeof(keymaster_key_characteristics_t)));
+    if (!*characteristics)
+        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    hw_enforced.CopyToParamSet(&(*characteristics)->hw_enforced);
+    (*characteristics)->sw_enforced.params = nullptr;
+    (*characteristics)->sw_enforced.length = 0;
+    return KM_ERROR_OK;
+}
+
+hw_module_t mock_module = {};
+
+keymaster0_device_t* NewMockKeymaster0() {
+    keymaster0_device_t* device = new keymaster0_device_t;
+    memset(device, 0, sizeof(*device));
+    device->common.module = &mock_module;
+    device->common.close = MockClose;
+    device->flags = KEYMASTER_SUPPORTS_EC;
+    device->get_keypair_public = MockGetKeypairPublic;
+    return device;
+}
+
+keymaster1_device_t* NewMockKeymaster1() {
+    keymaster1_device_t* device = new keymaster1_device_t;
+    memset(device, 0, sizeof(*device));
+    device->common.module = &mock_module;
+    device->common.close = MockClose;
+    device->get_key_characteristics = MockGetKeyCharacteristics;
+    return device;
+}
+
+std::string ReadFile(const char* file_name) {
+    std::ifstream file_stream(file_name, std::ios::binary);
+    return std::string(std::istreambuf_iterator<char>(file_stream),
+                       std::istreambuf_iterator<char>());
+}
+
+std::string BlobString(const KeymasterKeyBlob& blob) {
+    return std::string(reinterpret_cast<const char*>(blob.key_material), blob.key_material_size);
+}
+
+enum BlobKind {
+    kIntegrityAssured,
+    kOcbEncrypted,
+    kOldSoftkeymaster,
+    kKeymaster0Backed,
+    kKeymaster1Hw,
+    kKeymaster0Hw,
+    // An integrity-assured blob with a bad HMAC.  Every software format is tried, and with no
+    // hardware to fall back on, parsing fails.
+    kCorruptIntegrityAssured,
+    // A keymaster1 hardware blob that passes the integrity-assured peek.
+    kKeymaster1HwLikeIntegrityAssured,
+    // A keymaster0 hardware blob that starts with the old softkeymaster magic.
+    kKeymaster0HwLikeOldSoftkeymaster,
+    kBlobKindCount,
+};
+
+/**
+ * The contexts and blobs for each BlobKind, built on first use.
+ */
+struct ParseFixtures {
+    ParseFixtures();
+
+    SoftKeymasterContext software_context;
+    SoftKeymasterContext keymaster0_context;
+    SoftKeymasterContext keymaster1_context;
+    const SoftKeymasterContext* context[kBlobKindCount];
+    std::string blob[kBlobKindCount];
+    keymaster_error_t expected_error[kBlobKindCount];
+    AuthorizationSet additional_params;
+};
+
+ParseFixtures::ParseFixtures() {
+    for (int kind = 0; kind < kBlobKindCount; ++kind) {
+        context[kind] = &software_context;
+        expected_error[kind] = KM_ERROR_OK;
+    }
+
+    mock_module.name = "Mock keymaster";
+    std::unique_ptr<EC_KEY, EC_KEY_Delete> ec_key(
+        EC_KEY_new_by_curve_name(NID_X9_62_prime256v1));
+    std::unique_ptr<EVP_PKEY, EVP_PKEY_Delete> pkey(EVP_PKEY_new());
+    if (!ec_key || !EC_KEY_generate_key(ec_key.get()) || !pkey ||
+        !EVP_PKEY_set1_EC_KEY(pkey.get(), ec_key.get()))
+        return;
+    int public_key_length = i2d_PUBKEY(pkey.get(), nullptr);
+    int private_key_length = i2d_PrivateKey(pkey.get(), nullptr);
+    if (public_key_length <= 0 || private_key_length <= 0)
+        return;
+    mock_public_key.resize(public_key_length);
+    uint8_t* p = reinterpret_cast<uint8_t*>(&mock_public_key[0]);
+    i2d_PUBKEY(pkey.get(), &p);
+    KeymasterKeyBlob private_key(private_key_length);
+    p = private_key.writable_data();
+    i2d_PrivateKey(pkey.get(), &p);
+
+    keymaster0_context.SetHardwareDevice(NewMockKeymaster0());
+    keymaster1_context.SetHardwareDevice(NewMockKeymaster1());
+
+    // The fixture blobs were created with this APPLICATION_ID, which is bound into them.
+    additional_params.push_back(TAG_APPLICATION_ID, "app_id", 6);
+    AuthorizationSet description(AuthorizationSetBuilder()
+                                     .EcdsaSigningKey(256)
+                                     .Digest(KM_DIGEST_NONE)
+                                     .Authorization(TAG_NO_AUTH_REQUIRED));
+    description.push_back(additional_params);
+    KeymasterKeyBlob key_blob;
+    AuthorizationSet hw_enforced, sw_enforced;
+    if (software_context.CreateKeyBlob(description, KM_ORIGIN_GENERATED, private_key, &key_blob,
+                                       &hw_enforced, &sw_enforced) == KM_ERROR_OK)
+        blob[kIntegrityAssured] = BlobString(key_blob);
+
+    blob[kOcbEncrypted] = ReadFile("km1_sw_ecdsa_256.blob");
+    blob[kOldSoftkeymaster] = ReadFile("km0_sw_rsa_512.blob");
+
+    KeymasterKeyBlob keymaster0_blob(reinterpret_cast<const uint8_t*>(kKeymaster0HwBlob.data()),
+                                     kKeymaster0HwBlob.size());
+    if (keymaster0_context.CreateKeyBlob(description, KM_ORIGIN_GENERATED, keymaster0_blob,
+                                         &key_blob, &hw_enforced, &sw_enforced) == KM_ERROR_OK)
+        blob[kKeymaster0Backed] = BlobString(key_blob);
+    context[kKeymaster0Backed] = &keymaster0_context;
+
+    blob[kKeymaster1Hw] = kKeymaster1HwBlob;
+    context[kKeymaster1Hw] = &keymaster1_context;
+    blob[kKeymaster0Hw] = kKeymaster0HwBlob;
+    context[kKeymaster0Hw] = &keymaster0_context;
+
+    blob[kCorruptIntegrityAssured] = blob[kIntegrityAssured];
+    if (!blob[kCorruptIntegrityAssured].empty())
+        blob[kCorruptIntegrityAssured].back() ^= 1;
+    expected_error[kCorruptIntegrityAssured] = KM_ERROR_INVALID_KEY_BLOB;
+
+    // A blob integrity-assured under another root of trust is indistinguishable from one of ours
+    // until its HMAC is checked.
+    SoftKeymasterContext other_context("other");
+    if (other_context.CreateKeyBlob(description, KM_ORIGIN_GENERATED, private_key, &key_blob,
+                                    &hw_enforced, &sw_enforced) == KM_ERROR_OK)
+        blob[kKeymaster1HwLikeIntegrityAssured] = BlobString(key_blob);
+    context[kKeymaster1HwLikeIntegrityAssured] = &keymaster1_context;
+
+    blob[kKeymaster0HwLikeOldSoftkeymaster] = "PK#8" + kKeymaster0HwBlob;
+    context[kKeymaster0HwLikeOldSoftkeymaster] = &keymaster0_context;
+}
+
+ParseFixtures* Fixtures() {
+    static ParseFixtures* fixtures = new ParseFixtures;
+    return fixtures;
+}
+
+void ParseKeyBlob(benchmark::State& state, BlobKind kind) {
+    const ParseFixtures& fixtures = *Fixtures();
+    if (fixtures.blob[kind].empty()) {
+        state.SkipWithError("No blob; fixture files must be in the current directory");
+        return;
+    }
+    KeymasterKeyBlob blob(reinterpret_cast<const uint8_t*>(fixtures.blob[kind].data()),
+                          fixtures.blob[kind].size());
+    while (state.KeepRunning()) {
+        KeymasterKeyBlob key_material;
+        AuthorizationSet hw_enforced, sw_enforced;
+        if (fixtures.context[kind]->ParseKeyBlob(blob, fixtures.additional_params, &key_material,
+                                                 &hw_enforced, &sw_enforced) !=
+            fixtures.expected_error[kind]) {
+            state.SkipWithError("ParseKeyBlob returned an unexpected result");
+            break;
+        }
+    }
+}
+
+BENCHMARK_CAPTURE(ParseKeyBlob, IntegrityAssured, kIntegrityAssured);
+BENCHMARK_CAPTURE(ParseKeyBlob, OcbEncrypted, kOcbEncrypted);
+BENCHMARK_CAPTURE(ParseKeyBlob, OldSoftkeymaster, kOldSoftkeymaster);
+BENCHMARK_CAPTURE(ParseKeyBlob, Keymaster0Backed, kKeymaster0Backed);
+BENCHMARK_CAPTURE(ParseKeyBlob, Keymaster1Hw, kKeymaster1Hw);
+BENCHMARK_CAPTURE(ParseKeyBlob, Keymaster0Hw, kKeymaster0Hw);
+BENCHMARK_CAPTURE(ParseKeyBlob, Misdetected/CorruptIntegrityAssured, kCorruptIntegrityAssured);
+BENCHMARK_CAPTURE(ParseKeyBlob, Misdetected/Keymaster1HwLikeIntegrityAssured,
+                  kKeymaster1HwLikeIntegrityAssured);
+BENCHMARK_CAPTURE(ParseKeyBlob, Misdetected/Keymaster0HwLikeOldSoftkeymaster,
+                  kKeymaster0HwLikeOldSoftkeymaster);
+
+}  // namespace
+}  // namespace keymaster
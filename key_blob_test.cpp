@@ -15,18 +15,23 @@
  */
 
 #include <algorithm>
+#include <string>
 
 #include <gtest/gtest.h>
 
 #include <openssl/engine.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
 #include <openssl/rand.h>
 
 #include <keymaster/authorization_set.h>
 #include <keymaster/android_keymaster_utils.h>
+#include <keymaster/key_policy.h>
 #include <keymaster/keymaster_tags.h>
 
 #include "android_keymaster_test_utils.h"
 #include "auth_encrypted_key_blob.h"
+#include "compact_private_key.h"
 #include "integrity_assured_key_blob.h"
 #include "ocb_utils.h"
 
@@ -199,6 +204,26 @@ TEST_F(KeyBlobTest, WrongMasterKey) {
                             tag_, &decrypted_plaintext_));
 }
 
+TEST_F(KeyBlobTest, RepeatedDecrypt) {
+    ASSERT_EQ(KM_ERROR_OK, Encrypt());
+
+    // The second and later decryptions use a cached key wrapping context; they must still work,
+    // and must not be fooled by a different master key with the same auth sets.
+    for (size_t i = 0; i < 3; ++i) {
+        ASSERT_EQ(KM_ERROR_OK, Decrypt());
+        ASSERT_EQ(key_material_.key_material_size, decrypted_plaintext_.key_material_size);
+        EXPECT_EQ(0, memcmp(key_material_.begin(), decrypted_plaintext_.begin(),
+                            decrypted_plaintext_.key_material_size));
+    }
+
+    uint8_t wrong_master_data[] = {1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0};
+    KeymasterKeyBlob wrong_master(wrong_master_data, array_length(wrong_master_data));
+    EXPECT_EQ(KM_ERROR_INVALID_KEY_BLOB,
+              OcbDecryptKey(hw_enforced_, sw_enforced_, hidden_, wrong_master, ciphertext_, nonce_,
+                            tag_, &decrypted_plaintext_));
+    EXPECT_EQ(KM_ERROR_OK, Decrypt());
+}
+
 TEST_F(KeyBlobTest, WrongHwEnforced) {
     ASSERT_EQ(KM_ERROR_OK, Encrypt());
     ASSERT_EQ(KM_ERROR_OK, Serialize());
@@ -317,6 +342,7 @@ TEST_F(KeyBlobTest, FuzzTest) {
         if (error == KM_ERROR_OK) {
             // It's possible to deserialize successfully.  Decryption should always fail.
             ++deserialize_auth_encrypted_success;
+            EXPECT_TRUE(MayBeAuthEncryptedBlob(key_blob));
             error = OcbDecryptKey(hw_enforced_, sw_enforced_, hidden_, master_key_, ciphertext_,
                                   nonce_, tag_, &decrypted_plaintext_);
         }
@@ -325,6 +351,215 @@ TEST_F(KeyBlobTest, FuzzTest) {
     }
 }
 
+TEST_F(KeyBlobTest, IntegrityAssuredRoundTrip) {
+    KeymasterKeyBlob blob;
+    ASSERT_EQ(KM_ERROR_OK, SerializeIntegrityAssuredBlob(key_material_, hidden_, hw_enforced_,
+                                                         sw_enforced_, &blob));
+
+    // Repeat to make sure the shared HMAC key schedule isn't disturbed by use.
+    for (size_t i = 0; i < 3; ++i) {
+        KeymasterKeyBlob key_material;
+        AuthorizationSet hw_enforced, sw_enforced;
+        ASSERT_EQ(KM_ERROR_OK, DeserializeIntegrityAssuredBlob(blob, hidden_, &key_material,
+                                                               &hw_enforced, &sw_enforced));
+        EXPECT_EQ(hw_enforced_, hw_enforced);
+        EXPECT_EQ(sw_enforced_, sw_enforced);
+        ASSERT_EQ(key_material_.key_material_size, key_material.key_material_size);
+        EXPECT_EQ(0, memcmp(key_material_.begin(), key_material.begin(),
+                            key_material.key_material_size));
+    }
+
+    AuthorizationSet wrong_hidden(hidden_);
+    wrong_hidden.push_back(TAG_APPLICATION_DATA, "data", 4);
+    KeymasterKeyBlob key_material;
+    AuthorizationSet hw_enforced, sw_enforced;
+    EXPECT_EQ(KM_ERROR_INVALID_KEY_BLOB, DeserializeIntegrityAssuredBlob(
+                                             blob, wrong_hidden, &key_material, &hw_enforced,
+                                             &sw_enforced));
+}
+
+TEST_F(KeyBlobTest, IntegrityAssuredCompactKeyMaterialVersion) {
+    // PKCS#8 and other material keeps version 2, which every reader of the layout can load.
+    KeymasterKeyBlob blob;
+    ASSERT_EQ(KM_ERROR_OK, SerializeIntegrityAssuredBlob(key_material_, hidden_, hw_enforced_,
+                                                         sw_enforced_, &blob));
+    EXPECT_EQ(1, blob.key_material[0]);
+
+    // Compact key material gets version 3, which readers that can't decode it reject.
+    const uint8_t compact_data[] = {kCompactEcKey, kCompactKeyVersion, 1, 2, 3};
+    KeymasterKeyBlob compact_material(compact_data, array_length(compact_data));
+    ASSERT_TRUE(IsCompactPrivateKey(compact_material));
+    ASSERT_EQ(KM_ERROR_OK, SerializeIntegrityAssuredBlob(compact_material, hidden_, hw_enforced_,
+                                                         sw_enforced_, &blob));
+    EXPECT_EQ(2, blob.key_material[0]);
+    EXPECT_TRUE(MayBeIntegrityAssuredBlob(blob));
+
+    KeymasterKeyBlob key_material;
+    AuthorizationSet hw_enforced, sw_enforced;
+    ASSERT_EQ(KM_ERROR_OK, DeserializeIntegrityAssuredBlob(blob, hidden_, &key_material,
+                                                           &hw_enforced, &sw_enforced));
+    EXPECT_EQ(hw_enforced_, hw_enforced);
+    EXPECT_EQ(sw_enforced_, sw_enforced);
+    ASSERT_EQ(compact_material.key_material_size, key_material.key_material_size);
+    EXPECT_EQ(0, memcmp(compact_data, key_material.begin(), key_material.key_material_size));
+    IntegrityAssuredBlobHeader header;
+    EXPECT_EQ(KM_ERROR_OK, ReadIntegrityAssuredBlobHeader(blob, &header));
+    EXPECT_EQ(KM_ALGORITHM_RSA, header.algorithm);
+}
+
+// Builds a blob in the version 1 layout, which is no longer written but must still be read.
+static void SerializeVersion1Blob(const KeymasterKeyBlob& key_material,
+                                  const AuthorizationSet& hidden,
+                                  const AuthorizationSet& hw_enforced,
+                                  const AuthorizationSet& sw_enforced, KeymasterKeyBlob* blob) {
+    const size_t kHmacSize = 8;
+    const char kHmacKey[] = "IntegrityAssuredBlob0";
+    size_t size = 1 + key_material.SerializedSize() + hw_enforced.SerializedSize() +
+                  sw_enforced.SerializedSize();
+    ASSERT_TRUE(blob->Reset(size + kHmacSize) != nullptr);
+    uint8_t* p = blob->writable_data();
+    *p++ = 0;
+    p = key_material.Serialize(p, blob->end());
+    p = hw_enforced.Serialize(p, blob->end());
+    p = sw_enforced.Serialize(p, blob->end());
+
+    std::string hmac_data(reinterpret_cast<const char*>(blob->begin()), size);
+    UniquePtr<uint8_t[]> serialized_hidden(new uint8_t[hidden.SerializedSize()]);
+    hidden.Serialize(serialized_hidden.get(), serialized_hidden.get() + hidden.SerializedSize());
+    hmac_data.append(reinterpret_cast<const char*>(serialized_hidden.get()),
+                     hidden.SerializedSize());
+    uint8_t hmac[EVP_MAX_MD_SIZE];
+    unsigned hmac_length;
+    ASSERT_TRUE(HMAC(EVP_sha256(), kHmacKey, sizeof(kHmacKey),
+                     reinterpret_cast<const uint8_t*>(hmac_data.data()), hmac_data.size(), hmac,
+                     &hmac_length) != nullptr);
+    memcpy(p, hmac, kHmacSize);
+}
+
+TEST_F(KeyBlobTest, IntegrityAssuredVersion1StillAccepted) {
+    KeymasterKeyBlob blob;
+    SerializeVersion1Blob(key_material_, hidden_, hw_enforced_, sw_enforced_, &blob);
+    EXPECT_TRUE(MayBeIntegrityAssuredBlob(blob));
+
+    KeymasterKeyBlob key_material;
+    AuthorizationSet hw_enforced, sw_enforced;
+    ASSERT_EQ(KM_ERROR_OK, DeserializeIntegrityAssuredBlob(blob, hidden_, &key_material,
+                                                           &hw_enforced, &sw_enforced));
+    EXPECT_EQ(hw_enforced_, hw_enforced);
+    EXPECT_EQ(sw_enforced_, sw_enforced);
+    ASSERT_EQ(key_material_.key_material_size, key_material.key_material_size);
+    EXPECT_EQ(0, memcmp(key_material_.begin(), key_material.begin(),
+                        key_material.key_material_size));
+
+    // Version 1 blobs have no header.
+    IntegrityAssuredBlobHeader header;
+    EXPECT_EQ(KM_ERROR_INVALID_KEY_BLOB, ReadIntegrityAssuredBlobHeader(blob, &header));
+}
+
+TEST_F(KeyBlobTest, IntegrityAssuredHeader) {
+    sw_enforced_.push_back(TAG_PURPOSE, KM_PURPOSE_SIGN);
+    sw_enforced_.push_back(TAG_PURPOSE, KM_PURPOSE_VERIFY);
+    KeymasterKeyBlob blob;
+    ASSERT_EQ(KM_ERROR_OK, SerializeIntegrityAssuredBlob(key_material_, hidden_, hw_enforced_,
+                                                         sw_enforced_, &blob));
+
+    IntegrityAssuredBlobHeader header;
+    ASSERT_EQ(KM_ERROR_OK, ReadIntegrityAssuredBlobHeader(blob, &header));
+    EXPECT_EQ(KM_ALGORITHM_RSA, header.algorithm);
+    EXPECT_TRUE(header.has_purpose(KM_PURPOSE_SIGN));
+    EXPECT_TRUE(header.has_purpose(KM_PURPOSE_VERIFY));
+    EXPECT_FALSE(header.has_purpose(KM_PURPOSE_ENCRYPT));
+    EXPECT_EQ(IntegrityAssuredBlobHeader::NO_AUTH_REQUIRED, header.flags);
+
+    // A key that needs an auth token for each operation.
+    AuthorizationSet hw_enforced(AuthorizationSetBuilder()
+                                     .Authorization(TAG_ALGORITHM, KM_ALGORITHM_AES)
+                                     .Authorization(TAG_USER_SECURE_ID, 7)
+                                     .Authorization(TAG_USER_AUTH_TYPE, HW_AUTH_PASSWORD));
+    ASSERT_EQ(KM_ERROR_OK, SerializeIntegrityAssuredBlob(key_material_, hidden_, hw_enforced,
+                                                         sw_enforced_, &blob));
+    ASSERT_EQ(KM_ERROR_OK, ReadIntegrityAssuredBlobHeader(blob, &header));
+    EXPECT_EQ(KM_ALGORITHM_AES, header.algorithm);
+    EXPECT_EQ(IntegrityAssuredBlobHeader::USER_AUTH_REQUIRED |
+                  IntegrityAssuredBlobHeader::AUTH_PER_OPERATION,
+              header.flags);
+
+    // The header is covered by the HMAC.
+    blob.writable_data()[1] ^= 1;
+    KeymasterKeyBlob key_material;
+    AuthorizationSet parsed_hw_enforced, parsed_sw_enforced;
+    EXPECT_EQ(KM_ERROR_INVALID_KEY_BLOB,
+              DeserializeIntegrityAssuredBlob(blob, hidden_, &key_material, &parsed_hw_enforced,
+                                              &parsed_sw_enforced));
+}
+
+TEST_F(KeyBlobTest, IntegrityAssuredPolicy) {
+    KeyPolicy policy;
+    ASSERT_EQ(KM_ERROR_OK, policy.Compile(hw_enforced_, sw_enforced_));
+    KeymasterKeyBlob blob;
+    ASSERT_EQ(KM_ERROR_OK, SerializeIntegrityAssuredBlob(key_material_, hidden_, hw_enforced_,
+                                                         sw_enforced_, policy, &blob));
+    EXPECT_TRUE(MayBeIntegrityAssuredBlob(blob));
+
+    KeymasterKeyBlob key_material;
+    AuthorizationSet hw_enforced, sw_enforced;
+    KeyPolicy parsed;
+    ASSERT_EQ(KM_ERROR_OK, DeserializeIntegrityAssuredBlob(blob, hidden_, &key_material,
+                                                           &hw_enforced, &sw_enforced, &parsed));
+    EXPECT_EQ(hw_enforced_, hw_enforced);
+    EXPECT_EQ(sw_enforced_, sw_enforced);
+    EXPECT_EQ(policy.flags, parsed.flags);
+    EXPECT_EQ(10U, parsed.min_seconds_between_ops);
+    EXPECT_EQ(10U, parsed.active_datetime);
+    EXPECT_EQ(100U, parsed.origination_expire_datetime);
+
+    // The stored policy is what's returned, not one compiled from the auth sets.
+    policy.max_uses_per_boot = 1;
+    policy.flags |= KeyPolicy::HAS_MAX_USES_PER_BOOT;
+    ASSERT_EQ(KM_ERROR_OK, SerializeIntegrityAssuredBlob(key_material_, hidden_, hw_enforced_,
+                                                         sw_enforced_, policy, &blob));
+    ASSERT_EQ(KM_ERROR_OK, DeserializeIntegrityAssuredBlob(blob, hidden_, &key_material,
+                                                           &hw_enforced, &sw_enforced, &parsed));
+    EXPECT_EQ(1U, parsed.max_uses_per_boot);
+
+    // The policy is covered by the HMAC.  It's the last section, just before the HMAC.
+    blob.writable_data()[blob.key_material_size - 9] ^= 1;
+    EXPECT_EQ(KM_ERROR_INVALID_KEY_BLOB,
+              DeserializeIntegrityAssuredBlob(blob, hidden_, &key_material, &hw_enforced,
+                                              &sw_enforced, &parsed));
+
+    // Blobs without a policy have one compiled from their auth sets.
+    ASSERT_EQ(KM_ERROR_OK, SerializeIntegrityAssuredBlob(key_material_, hidden_, hw_enforced_,
+                                                         sw_enforced_, &blob));
+    ASSERT_EQ(KM_ERROR_OK, DeserializeIntegrityAssuredBlob(blob, hidden_, &key_material,
+                                                           &hw_enforced, &sw_enforced, &parsed));
+    EXPECT_FALSE(parsed.flags & KeyPolicy::HAS_MAX_USES_PER_BOOT);
+    EXPECT_EQ(10U, parsed.min_seconds_between_ops);
+}
+
+TEST_F(KeyBlobTest, StructuralChecks) {
+    ASSERT_EQ(KM_ERROR_OK, Encrypt());
+    ASSERT_EQ(KM_ERROR_OK, Serialize());
+    EXPECT_TRUE(MayBeAuthEncryptedBlob(serialized_blob_));
+    EXPECT_FALSE(MayBeIntegrityAssuredBlob(serialized_blob_));
+
+    KeymasterKeyBlob integrity_assured_blob;
+    ASSERT_EQ(KM_ERROR_OK, SerializeIntegrityAssuredBlob(key_material_, hidden_, hw_enforced_,
+                                                         sw_enforced_, &integrity_assured_blob));
+    EXPECT_TRUE(MayBeIntegrityAssuredBlob(integrity_assured_blob));
+    EXPECT_FALSE(MayBeAuthEncryptedBlob(integrity_assured_blob));
+
+    // Truncating either blob anywhere makes it implausible.
+    for (size_t size = 0; size < serialized_blob_.key_material_size; ++size) {
+        KeymasterKeyBlob truncated(serialized_blob_.key_material, size);
+        EXPECT_FALSE(MayBeAuthEncryptedBlob(truncated)) << "Truncated to " << size;
+    }
+    for (size_t size = 0; size < integrity_assured_blob.key_material_size; ++size) {
+        KeymasterKeyBlob truncated(integrity_assured_blob.key_material, size);
+        EXPECT_FALSE(MayBeIntegrityAssuredBlob(truncated)) << "Truncated to " << size;
+    }
+}
+
 TEST_F(KeyBlobTest, UnderflowTest) {
     uint8_t buf[0];
     keymaster_key_blob_t blob = {buf, 0};
@@ -332,6 +567,8 @@ TEST_F(KeyBlobTest, UnderflowTest) {
     EXPECT_NE(nullptr, key_blob.key_material);
     EXPECT_EQ(0U, key_blob.key_material_size);
 
+    EXPECT_FALSE(MayBeIntegrityAssuredBlob(key_blob));
+    EXPECT_FALSE(MayBeAuthEncryptedBlob(key_blob));
     EXPECT_EQ(KM_ERROR_INVALID_KEY_BLOB,
               DeserializeIntegrityAssuredBlob(key_blob, hidden_, &key_material_, &hw_enforced_,
                                               &sw_enforced_));
@@ -341,6 +578,54 @@ TEST_F(KeyBlobTest, UnderflowTest) {
                                            &nonce_, &tag_));
 }
 
+TEST_F(KeyBlobTest, BorrowedKeyBlob) {
+    KeymasterKeyBlob blob;
+    ASSERT_EQ(KM_ERROR_OK, SerializeIntegrityAssuredBlob(key_material_, hidden_, hw_enforced_,
+                                                         sw_enforced_, &blob));
+
+    {
+        KeymasterKeyBlob borrowed(blob, KeymasterKeyBlob::BORROW);
+        EXPECT_TRUE(borrowed.borrowed());
+        EXPECT_EQ(blob.key_material, borrowed.key_material);
+        EXPECT_EQ(blob.key_material_size, borrowed.key_material_size);
+
+        KeymasterKeyBlob key_material;
+        AuthorizationSet hw_enforced, sw_enforced;
+        ASSERT_EQ(KM_ERROR_OK, DeserializeIntegrityAssuredBlob(borrowed, hidden_, &key_material,
+                                                               &hw_enforced, &sw_enforced));
+        EXPECT_EQ(hw_enforced_, hw_enforced);
+
+        // Copies own their key material.
+        KeymasterKeyBlob copy(borrowed);
+        EXPECT_FALSE(copy.borrowed());
+        EXPECT_NE(blob.key_material, copy.key_material);
+        ASSERT_EQ(blob.key_material_size, copy.key_material_size);
+        EXPECT_EQ(0, memcmp(blob.key_material, copy.key_material, copy.key_material_size));
+    }
+
+    // Destroying the borrowing blob left the original intact.
+    KeymasterKeyBlob key_material;
+    AuthorizationSet hw_enforced, sw_enforced;
+    EXPECT_EQ(KM_ERROR_OK, DeserializeIntegrityAssuredBlob(blob, hidden_, &key_material,
+                                                           &hw_enforced, &sw_enforced));
+
+    // Releasing a borrowing blob hands back a copy.
+    KeymasterKeyBlob borrowed(blob, KeymasterKeyBlob::BORROW);
+    keymaster_key_blob_t released = borrowed.release();
+    EXPECT_FALSE(borrowed.borrowed());
+    EXPECT_EQ(nullptr, borrowed.key_material);
+    EXPECT_NE(blob.key_material, released.key_material);
+    ASSERT_EQ(blob.key_material_size, released.key_material_size);
+    EXPECT_EQ(0, memcmp(blob.key_material, released.key_material, released.key_material_size));
+    delete[] released.key_material;
+
+    // Reset replaces the borrowed reference with a buffer of the blob's own.
+    KeymasterKeyBlob reset(blob, KeymasterKeyBlob::BORROW);
+    ASSERT_TRUE(reset.Reset(4));
+    EXPECT_FALSE(reset.borrowed());
+    EXPECT_NE(blob.key_material, reset.key_material);
+}
+
 TEST_F(KeyBlobTest, DupBufferToolarge) {
     uint8_t buf[0];
     keymaster_key_blob_t blob = {buf, 0};
@@ -23,6 +23,8 @@
 
 namespace keymaster {
 
+class WorkerPool;
+
 /**
  * KeyExchange is an abstract class that provides an interface to a
  * key-exchange primitive.
@@ -40,6 +42,23 @@ class KeyExchange {
     virtual bool CalculateSharedKey(const uint8_t* peer_public_value, size_t peer_public_value_len,
                                     Buffer* shared_key) const = 0;
 
+    /**
+     * CalculateSharedKeys computes the shared key with each of the count peer public values into
+     * the matching entry of shared_keys, sets the matching entry of succeeded to whether it could,
+     * and returns true if every one succeeded.  If pool isn't null, implementations may spread
+     * large batches across its threads.  The default calls CalculateSharedKey for each peer.
+     */
+    virtual bool CalculateSharedKeys(const Buffer* peer_public_values, size_t count,
+                                     Buffer* shared_keys, bool* succeeded,
+                                     WorkerPool* /* pool */) const {
+        bool all_succeeded = true;
+        for (size_t i = 0; i < count; ++i) {
+            succeeded[i] = CalculateSharedKey(peer_public_values[i], &shared_keys[i]);
+            all_succeeded &= succeeded[i];
+        }
+        return all_succeeded;
+    }
+
     /**
      * public_value writes to |public_value| the local public key which can be
      * sent to a peer in order to complete a key exchange.
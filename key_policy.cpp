@@ -0,0 +1,208 @@
+/*
+ * Copyright 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <keymaster/key_policy.h>
+
+#include <new>
+
+namespace keymaster {
+
+void KeyPolicy::Clear() {
+    flags = 0;
+    purposes = 0;
+    active_datetime = 0;
+    origination_expire_datetime = 0;
+    usage_expire_datetime = 0;
+    min_seconds_between_ops = 0;
+    max_uses_per_boot = 0;
+    user_auth_type = 0;
+    auth_timeout = 0;
+    secure_id_count = 0;
+    secure_ids.reset();
+}
+
+// Sets *field to value if flag isn't yet set in *flags or keep(value, *field) says value is more
+// restrictive, and sets flag.
+template <typename T, typename Keep>
+static void SetLimit(uint32_t flag, T value, uint32_t* flags, T* field, Keep keep) {
+    if (!(*flags & flag) || keep(value, *field))
+        *field = value;
+    *flags |= flag;
+}
+
+template <typename T> static bool smaller(T a, T b) {
+    return a < b;
+}
+
+template <typename T> static bool larger(T a, T b) {
+    return a > b;
+}
+
+keymaster_error_t KeyPolicy::Compile(const AuthorizationSet& authorizations) {
+    AuthorizationSet none;
+    return Compile(authorizations, none);
+}
+
+keymaster_error_t KeyPolicy::Compile(const AuthorizationSet& hw_enforced,
+                                     const AuthorizationSet& sw_enforced) {
+    Clear();
+
+    const AuthorizationSet* sets[] = {&hw_enforced, &sw_enforced};
+    bool have_algorithm = false;
+    size_t id_count = 0;
+    for (const AuthorizationSet* set : sets) {
+        for (const keymaster_key_param_t& param : *set) {
+            switch (param.tag) {
+            case KM_TAG_PURPOSE:
+                if (param.enumerated < 32)
+                    purposes |= 1U << param.enumerated;
+                break;
+
+            case KM_TAG_ALGORITHM:
+                if (!have_algorithm &&
+                    (param.enumerated == KM_ALGORITHM_RSA || param.enumerated == KM_ALGORITHM_EC))
+                    flags |= PUBLIC_KEY_ALGORITHM;
+                have_algorithm = true;
+                break;
+
+            case KM_TAG_ACTIVE_DATETIME:
+                SetLimit(HAS_ACTIVE_DATETIME, param.date_time, &flags, &active_datetime,
+                         larger<uint64_t>);
+                break;
+
+            case KM_TAG_ORIGINATION_EXPIRE_DATETIME:
+                SetLimit(HAS_ORIGINATION_EXPIRE_DATETIME, param.date_time, &flags,
+                         &origination_expire_datetime, smaller<uint64_t>);
+                break;
+
+            case KM_TAG_USAGE_EXPIRE_DATETIME:
+                SetLimit(HAS_USAGE_EXPIRE_DATETIME, param.date_time, &flags,
+                         &usage_expire_datetime, smaller<uint64_t>);
+                break;
+
+            case KM_TAG_MIN_SECONDS_BETWEEN_OPS:
+                SetLimit(HAS_MIN_SECONDS_BETWEEN_OPS, param.integer, &flags,
+                         &min_seconds_between_ops, larger<uint32_t>);
+                break;
+
+            case KM_TAG_MAX_USES_PER_BOOT:
+                SetLimit(HAS_MAX_USES_PER_BOOT, param.integer, &flags, &max_uses_per_boot,
+                         smaller<uint32_t>);
+                break;
+
+            case KM_TAG_USER_SECURE_ID:
+                ++id_count;
+                break;
+
+            case KM_TAG_USER_AUTH_TYPE:
+                flags |= HAS_USER_AUTH_TYPE;
+                user_auth_type = param.integer;
+                break;
+
+            case KM_TAG_AUTH_TIMEOUT:
+                flags |= HAS_AUTH_TIMEOUT;
+                auth_timeout = param.integer;
+                break;
+
+            case KM_TAG_NO_AUTH_REQUIRED:
+                flags |= NO_AUTH_REQUIRED;
+                break;
+
+            case KM_TAG_CALLER_NONCE:
+                flags |= CALLER_NONCE;
+                break;
+
+            /* Tags should never be in key auths. */
+            case KM_TAG_INVALID:
+            case KM_TAG_AUTH_TOKEN:
+            case KM_TAG_ROOT_OF_TRUST:
+            case KM_TAG_APPLICATION_DATA:
+            case KM_TAG_ATTESTATION_CHALLENGE:
+            case KM_TAG_BOOTLOADER_ONLY:
+                flags |= INVALID_TAG;
+                break;
+
+            default:
+                break;
+            }
+        }
+    }
+
+    if (id_count == 0)
+        return KM_ERROR_OK;
+
+    secure_ids.reset(new (std::nothrow) uint64_t[id_count]);
+    if (!secure_ids.get())
+        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    for (const AuthorizationSet* set : sets)
+        for (const keymaster_key_param_t& param : *set)
+            if (param.tag == KM_TAG_USER_SECURE_ID)
+                secure_ids[secure_id_count++] = param.long_integer;
+    return KM_ERROR_OK;
+}
+
+size_t KeyPolicy::SerializedSize() const {
+    return 6 * sizeof(uint32_t) + 3 * sizeof(uint64_t) + sizeof(uint32_t) /* secure ID count */ +
+           secure_id_count * sizeof(uint64_t);
+}
+
+uint8_t* KeyPolicy::Serialize(uint8_t* buf, const uint8_t* end) const {
+    buf = append_uint32_to_buf(buf, end, flags);
+    buf = append_uint32_to_buf(buf, end, purposes);
+    buf = append_uint64_to_buf(buf, end, active_datetime);
+    buf = append_uint64_to_buf(buf, end, origination_expire_datetime);
+    buf = append_uint64_to_buf(buf, end, usage_expire_datetime);
+    buf = append_uint32_to_buf(buf, end, min_seconds_between_ops);
+    buf = append_uint32_to_buf(buf, end, max_uses_per_boot);
+    buf = append_uint32_to_buf(buf, end, user_auth_type);
+    buf = append_uint32_to_buf(buf, end, auth_timeout);
+    buf = append_uint32_to_buf(buf, end, secure_id_count);
+    for (size_t i = 0; i < secure_id_count; ++i)
+        buf = append_uint64_to_buf(buf, end, secure_ids[i]);
+    return buf;
+}
+
+bool KeyPolicy::Deserialize(const uint8_t** buf_ptr, const uint8_t* end) {
+    Clear();
+    uint32_t id_count;
+    if (!copy_uint32_from_buf(buf_ptr, end, &flags) ||
+        !copy_uint32_from_buf(buf_ptr, end, &purposes) ||
+        !copy_uint64_from_buf(buf_ptr, end, &active_datetime) ||
+        !copy_uint64_from_buf(buf_ptr, end, &origination_expire_datetime) ||
+        !copy_uint64_from_buf(buf_ptr, end, &usage_expire_datetime) ||
+        !copy_uint32_from_buf(buf_ptr, end, &min_seconds_between_ops) ||
+        !copy_uint32_from_buf(buf_ptr, end, &max_uses_per_boot) ||
+        !copy_uint32_from_buf(buf_ptr, end, &user_auth_type) ||
+        !copy_uint32_from_buf(buf_ptr, end, &auth_timeout) ||
+        !copy_uint32_from_buf(buf_ptr, end, &id_count) ||
+        id_count > static_cast<size_t>(end - *buf_ptr) / sizeof(uint64_t)) {
+        Clear();
+        return false;
+    }
+
+    if (id_count == 0)
+        return true;
+    secure_ids.reset(new (std::nothrow) uint64_t[id_count]);
+    if (!secure_ids.get()) {
+        Clear();
+        return false;
+    }
+    for (secure_id_count = 0; secure_id_count < id_count; ++secure_id_count)
+        copy_uint64_from_buf(buf_ptr, end, &secure_ids[secure_id_count]);
+    return true;
+}
+
+}  // namespace keymaster
@@ -0,0 +1,152 @@
+/*
+ * Copyright 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "key_warmer.h"
+
+#include <string.h>
+
+#ifdef __linux__
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include <new>
+
+#include <keymaster/logger.h>
+
+namespace keymaster {
+
+namespace {
+
+// The nice value of the warmer's thread; Android's background priority.
+const int kWarmupNiceness = 10;
+
+bool SameBlob(const keymaster_key_blob_t& a, const keymaster_key_blob_t& b) {
+    return a.key_material_size == b.key_material_size &&
+           memcmp(a.key_material, b.key_material, a.key_material_size) == 0;
+}
+
+}  // anonymous namespace
+
+KeyWarmer::KeyWarmer(const Loader& loader, size_t max_pending)
+    : loader_(loader), max_pending_(max_pending), stopping_(false) {}
+
+KeyWarmer::~KeyWarmer() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+        pending_.clear();
+    }
+    key_queued_.notify_all();
+    if (thread_.joinable())
+        thread_.join();
+}
+
+keymaster_error_t KeyWarmer::Schedule(const WarmupKeysRequest& request) {
+    std::deque<std::unique_ptr<PendingKey>> keys;
+    for (size_t i = 0; i < request.item_count && i < max_pending_; ++i) {
+        std::unique_ptr<PendingKey> key(new (std::nothrow) PendingKey);
+        if (!key)
+            return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+        const keymaster_key_blob_t& key_blob = request.items[i].key_blob;
+        if (!key->key_blob.Reset(key_blob.key_material_size))
+            return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+        memcpy(key->key_blob.writable_data(), key_blob.key_material, key_blob.key_material_size);
+        if (!key->additional_params.Reinitialize(request.items[i].additional_params))
+            return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+        keys.push_back(std::move(key));
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    size_t dropped = request.item_count - keys.size();
+    while (!keys.empty() && pending_.size() < max_pending_) {
+        pending_.push_back(std::move(keys.front()));
+        keys.pop_front();
+    }
+    dropped += keys.size();
+    if (dropped)
+        LOG_W("Warmup queue full; dropped %d keys", dropped);
+    if (!thread_.joinable())
+        thread_ = std::thread(&KeyWarmer::Run, this);
+    key_queued_.notify_one();
+    return KM_ERROR_OK;
+}
+
+void KeyWarmer::Cancel(const keymaster_key_blob_t& key_blob) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    for (auto key = pending_.begin(); key != pending_.end();) {
+        if (SameBlob((*key)->key_blob, key_blob))
+            key = pending_.erase(key);
+        else
+            ++key;
+    }
+    while (loading_ && SameBlob(loading_->key_blob, key_blob))
+        load_finished_.wait(lock);
+}
+
+void KeyWarmer::Clear() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    pending_.clear();
+    WaitForLoad(&lock);
+}
+
+void KeyWarmer::WaitUntilIdle() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (!pending_.empty() || loading_)
+        load_finished_.wait(lock);
+}
+
+size_t KeyWarmer::pending() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return pending_.size() + (loading_ ? 1 : 0);
+}
+
+void KeyWarmer::WaitForLoad(std::unique_lock<std::mutex>* lock) {
+    while (loading_)
+        load_finished_.wait(*lock);
+}
+
+/* static */
+void KeyWarmer::LowerThreadPriority() {
+#ifdef __linux__
+    // Linux nice values are per-thread, so this leaves the rest of the process as it was.
+    if (setpriority(PRIO_PROCESS, syscall(SYS_gettid), kWarmupNiceness) != 0)
+        LOG_W("Couldn't lower the key warmup thread's priority", 0);
+#endif
+}
+
+void KeyWarmer::Run() {
+    LowerThreadPriority();
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (!stopping_) {
+        if (pending_.empty()) {
+            key_queued_.wait(lock);
+            continue;
+        }
+        loading_ = std::move(pending_.front());
+        pending_.pop_front();
+
+        lock.unlock();
+        loader_(loading_->key_blob, loading_->additional_params);
+        lock.lock();
+
+        loading_.reset();
+        load_finished_.notify_all();
+    }
+}
+
+}  // namespace keymaster
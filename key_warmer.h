@@ -0,0 +1,118 @@
+/*
+ * Copyright 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SYSTEM_KEYMASTER_KEY_WARMER_H_
+#define SYSTEM_KEYMASTER_KEY_WARMER_H_
+
+#include <stddef.h>
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+#include <hardware/keymaster_defs.h>
+
+#include <keymaster/android_keymaster_messages.h>
+#include <keymaster/android_keymaster_utils.h>
+#include <keymaster/authorization_set.h>
+
+namespace keymaster {
+
+/**
+ * KeyWarmer loads queued keys, one at a time, on a background thread that runs at low priority,
+ * so that a keymaster that has just started can fill its key cache without holding up the
+ * requests it serves.  The thread is started by the first Schedule().
+ */
+class KeyWarmer {
+  public:
+    /**
+     * Loads and warms up one key.  Called on the warmer's thread, without the warmer's lock held.
+     */
+    typedef std::function<void(const KeymasterKeyBlob& key_blob,
+                               const AuthorizationSet& additional_params)>
+        Loader;
+
+    /**
+     * Creates a warmer that holds up to max_pending queued keys.
+     */
+    KeyWarmer(const Loader& loader, size_t max_pending);
+
+    /**
+     * Discards the queued keys and stops the thread, waiting for the key being loaded, if any.
+     */
+    ~KeyWarmer();
+
+    /**
+     * Copies the blobs and parameters of request to the end of the queue and returns without
+     * waiting for them to load.  Keys that don't fit in the queue are dropped, since warming more
+     * keys than the cache holds would only evict the first ones.
+     */
+    keymaster_error_t Schedule(const WarmupKeysRequest& request);
+
+    /**
+     * Discards the queued keys with key_blob's bytes and, if one of them is being loaded, waits for
+     * it to finish, so that the caller can then drop any cached copy knowing none will follow.
+     */
+    void Cancel(const keymaster_key_blob_t& key_blob);
+
+    /**
+     * Discards all queued keys and waits for the key being loaded, if any.
+     */
+    void Clear();
+
+    /**
+     * Waits until every queued key has been loaded.
+     */
+    void WaitUntilIdle();
+
+    size_t pending() const;
+
+  private:
+    struct PendingKey {
+        KeymasterKeyBlob key_blob;
+        AuthorizationSet additional_params;
+    };
+
+    void Run();
+    // Waits, with lock held on mutex_, until the key being loaded, if any, is finished.
+    void WaitForLoad(std::unique_lock<std::mutex>* lock);
+
+    // Lowers the calling thread's scheduling priority, where the platform allows it.
+    static void LowerThreadPriority();
+
+    const Loader loader_;
+    const size_t max_pending_;
+
+    mutable std::mutex mutex_;
+    std::condition_variable key_queued_;
+    std::condition_variable load_finished_;
+    std::deque<std::unique_ptr<PendingKey>> pending_;
+    // The key the thread is loading, or null.
+    std::unique_ptr<PendingKey> loading_;
+    bool stopping_;
+    std::thread thread_;
+
+    // Disallow copying and assignment.
+    KeyWarmer(const KeyWarmer&);
+    void operator=(const KeyWarmer&);
+};
+
+}  // namespace keymaster
+
+#endif  // SYSTEM_KEYMASTER_KEY_WARMER_H_
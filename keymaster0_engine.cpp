@@ -36,18 +36,12 @@ using std::unique_ptr;
 
 namespace keymaster {
 
-Keymaster0Engine* Keymaster0Engine::instance_ = nullptr;
+// Number of hardware public keys kept decoded, to spare key loads the export round trip.
+static const size_t kPublicKeyCacheEntries = 32;
 
 Keymaster0Engine::Keymaster0Engine(const keymaster0_device_t* keymaster0_device)
-    : keymaster0_device_(keymaster0_device), engine_(ENGINE_new()), supports_ec_(false) {
-    assert(!instance_);
-    instance_ = this;
-
-    rsa_index_ = RSA_get_ex_new_index(0 /* argl */, NULL /* argp */, NULL /* new_func */,
-                                      keyblob_dup, keyblob_free);
-    ec_key_index_ = EC_KEY_get_ex_new_index(0 /* argl */, NULL /* argp */, NULL /* new_func */,
-                                            keyblob_dup, keyblob_free);
-
+    : keymaster0_device_(keymaster0_device), engine_(ENGINE_new()), supports_ec_(false),
+      public_key_cache_(kPublicKeyCacheEntries) {
     rsa_method_.common.references = 0;
     rsa_method_.common.is_static = 1;
     rsa_method_.app_data = nullptr;
@@ -91,7 +85,6 @@ Keymaster0Engine::~Keymaster0Engine() {
         keymaster0_device_->common.close(
             reinterpret_cast<hw_device_t*>(const_cast<keymaster0_device_t*>(keymaster0_device_)));
     ENGINE_free(engine_);
-    instance_ = nullptr;
 }
 
 bool Keymaster0Engine::GenerateRsaKey(uint64_t public_exponent, uint32_t public_modulus,
@@ -102,6 +95,7 @@ bool Keymaster0Engine::GenerateRsaKey(uint64_t public_exponent, uint32_t public_
     params.modulus_size = public_modulus;
 
     uint8_t* key_blob = 0;
+    std::lock_guard<std::mutex> lock(device_mutex_);
     if (keymaster0_device_->generate_keypair(keymaster0_device_, TYPE_RSA, &params, &key_blob,
                                              &key_material->key_material_size) < 0) {
         ALOGE("Error generating RSA key pair with keymaster0 device");
@@ -118,6 +112,7 @@ bool Keymaster0Engine::GenerateEcKey(uint32_t key_size, KeymasterKeyBlob* key_ma
     params.field_size = key_size;
 
     uint8_t* key_blob = 0;
+    std::lock_guard<std::mutex> lock(device_mutex_);
     if (keymaster0_device_->generate_keypair(keymaster0_device_, TYPE_EC, &params, &key_blob,
                                              &key_material->key_material_size) < 0) {
         ALOGE("Error generating EC key pair with keymaster0 device");
@@ -136,6 +131,7 @@ bool Keymaster0Engine::ImportKey(keymaster_key_format_t key_format,
         return false;
 
     uint8_t* key_blob = 0;
+    std::lock_guard<std::mutex> lock(device_mutex_);
     if (keymaster0_device_->import_keypair(keymaster0_device_, to_import.key_material,
                                            to_import.key_material_size, &key_blob,
                                            &imported_key->key_material_size) < 0) {
@@ -148,15 +144,21 @@ bool Keymaster0Engine::ImportKey(keymaster_key_format_t key_format,
 }
 
 bool Keymaster0Engine::DeleteKey(const KeymasterKeyBlob& blob) const {
+    HardwarePublicKeyCache::Lookup lookup;
+    LoadedKeyCache::ComputeLookup(blob, AuthorizationSet(), &lookup);
+    public_key_cache_.Invalidate(lookup.blob_digest);
     if (!keymaster0_device_->delete_keypair)
         return true;
+    std::lock_guard<std::mutex> lock(device_mutex_);
     return (keymaster0_device_->delete_keypair(keymaster0_device_, blob.key_material,
                                                blob.key_material_size) == 0);
 }
 
 bool Keymaster0Engine::DeleteAllKeys() const {
+    public_key_cache_.Clear();
     if (!keymaster0_device_->delete_all)
         return true;
+    std::lock_guard<std::mutex> lock(device_mutex_);
     return (keymaster0_device_->delete_all(keymaster0_device_) == 0);
 }
 
@@ -177,15 +179,60 @@ inline keymaster_key_blob_t* duplicate_blob(const keymaster_key_blob_t& blob) {
     return duplicate_blob(blob.key_material, blob.key_material_size);
 }
 
+static void free_blob(keymaster_key_blob_t* blob) {
+    if (blob) {
+        delete[] blob->key_material;
+        delete blob;
+    }
+}
+
+/* static */
+Keymaster0Engine::KeyData* Keymaster0Engine::NewKeyData(const Keymaster0Engine* engine,
+                                                        const keymaster_key_blob_t& blob) {
+    unique_ptr<KeyData> key_data(new (std::nothrow) KeyData);
+    if (!key_data)
+        return nullptr;
+    key_data->engine = engine;
+    key_data->blob = duplicate_blob(blob);
+    if (!key_data->blob)
+        return nullptr;
+    return key_data.release();
+}
+
+/* static */
+void Keymaster0Engine::FreeKeyData(KeyData* key_data) {
+    if (key_data) {
+        free_blob(key_data->blob);
+        delete key_data;
+    }
+}
+
+/* static */
+int Keymaster0Engine::rsa_index() {
+    static const int index = RSA_get_ex_new_index(0 /* argl */, NULL /* argp */,
+                                                  NULL /* new_func */, keyblob_dup, keyblob_free);
+    return index;
+}
+
+/* static */
+int Keymaster0Engine::ec_key_index() {
+    static const int index = EC_KEY_get_ex_new_index(
+        0 /* argl */, NULL /* argp */, NULL /* new_func */, keyblob_dup, keyblob_free);
+    return index;
+}
+
 RSA* Keymaster0Engine::BlobToRsaKey(const KeymasterKeyBlob& blob) const {
     // Create new RSA key (with engine methods) and insert blob
     unique_ptr<RSA, RSA_Delete> rsa(RSA_new_method(engine_));
     if (!rsa)
         return nullptr;
 
-    keymaster_key_blob_t* blob_copy = duplicate_blob(blob);
-    if (!blob_copy->key_material || !RSA_set_ex_data(rsa.get(), rsa_index_, blob_copy))
+    // The copy is attached to the key for its lifetime, so operations needn't copy it again.
+    KeyData* key_data = NewKeyData(this, blob);
+    if (!key_data || !RSA_set_ex_data(rsa.get(), rsa_index(), key_data)) {
+        FreeKeyData(key_data);
         return nullptr;
+    }
 
     // Copy public key into new RSA key
     unique_ptr<EVP_PKEY, EVP_PKEY_Delete> pkey(GetKeymaster0PublicKey(blob));
@@ -208,9 +255,12 @@ EC_KEY* Keymaster0Engine::BlobToEcKey(const KeymasterKeyBlob& blob) const {
     if (!ec_key)
         return nullptr;
 
-    keymaster_key_blob_t* blob_copy = duplicate_blob(blob);
-    if (!blob_copy->key_material || !EC_KEY_set_ex_data(ec_key.get(), ec_key_index_, blob_copy))
+    // The copy is attached to the key for its lifetime, so operations needn't copy it again.
+    KeyData* key_data = NewKeyData(this, blob);
+    if (!key_data || !EC_KEY_set_ex_data(ec_key.get(), ec_key_index(), key_data)) {
+        FreeKeyData(key_data);
         return nullptr;
+    }
 
     // Copy public key into new EC key
     unique_ptr<EVP_PKEY, EVP_PKEY_Delete> pkey(GetKeymaster0PublicKey(blob));
@@ -229,21 +279,28 @@ EC_KEY* Keymaster0Engine::BlobToEcKey(const KeymasterKeyBlob& blob) const {
 }
 
 const keymaster_key_blob_t* Keymaster0Engine::RsaKeyToBlob(const RSA* rsa) const {
-    return reinterpret_cast<keymaster_key_blob_t*>(RSA_get_ex_data(rsa, rsa_index_));
+    const KeyData* key_data = reinterpret_cast<KeyData*>(RSA_get_ex_data(rsa, rsa_index()));
+    if (!key_data || key_data->engine != this)
+        return nullptr;
+    return key_data->blob;
 }
 
 const keymaster_key_blob_t* Keymaster0Engine::EcKeyToBlob(const EC_KEY* ec_key) const {
-    return reinterpret_cast<keymaster_key_blob_t*>(EC_KEY_get_ex_data(ec_key, ec_key_index_));
+    const KeyData* key_data =
+        reinterpret_cast<KeyData*>(EC_KEY_get_ex_data(ec_key, ec_key_index()));
+    if (!key_data || key_data->engine != this)
+        return nullptr;
+    return key_data->blob;
 }
 
 /* static */
 int Keymaster0Engine::keyblob_dup(CRYPTO_EX_DATA* /* to */, const CRYPTO_EX_DATA* /* from */,
                                   void** from_d, int /* index */, long /* argl */,
                                   void* /* argp */) {
-    keymaster_key_blob_t* blob = reinterpret_cast<keymaster_key_blob_t*>(*from_d);
-    if (!blob)
+    KeyData* key_data = reinterpret_cast<KeyData*>(*from_d);
+    if (!key_data)
         return 1;
-    *from_d = duplicate_blob(*blob);
+    *from_d = NewKeyData(key_data->engine, *key_data->blob);
     if (*from_d)
         return 1;
     return 0;
@@ -252,27 +309,32 @@ int Keymaster0Engine::keyblob_dup(CRYPTO_EX_DATA* /* to */, const CRYPTO_EX_DATA
 /* static */
 void Keymaster0Engine::keyblob_free(void* /* parent */, void* ptr, CRYPTO_EX_DATA* /* data */,
                                     int /* index*/, long /* argl */, void* /* argp */) {
-    keymaster_key_blob_t* blob = reinterpret_cast<keymaster_key_blob_t*>(ptr);
-    if (blob) {
-        delete[] blob->key_material;
-        delete blob;
-    }
+    FreeKeyData(reinterpret_cast<KeyData*>(ptr));
 }
 
 /* static */
 int Keymaster0Engine::rsa_private_transform(RSA* rsa, uint8_t* out, const uint8_t* in, size_t len) {
     ALOGV("rsa_private_transform(%p, %p, %p, %u)", rsa, out, in, (unsigned)len);
 
-    assert(instance_);
-    return instance_->RsaPrivateTransform(rsa, out, in, len);
+    const KeyData* key_data = reinterpret_cast<KeyData*>(RSA_get_ex_data(rsa, rsa_index()));
+    if (!key_data) {
+        ALOGE("key had no key_blob!");
+        return 0;
+    }
+    return key_data->engine->RsaPrivateTransform(rsa, out, in, len);
 }
 
 /* static */
 int Keymaster0Engine::ecdsa_sign(const uint8_t* digest, size_t digest_len, uint8_t* sig,
                                  unsigned int* sig_len, EC_KEY* ec_key) {
     ALOGV("ecdsa_sign(%p, %u, %p)", digest, (unsigned)digest_len, ec_key);
-    assert(instance_);
-    return instance_->EcdsaSign(digest, digest_len, sig, sig_len, ec_key);
+    const KeyData* key_data =
+        reinterpret_cast<KeyData*>(EC_KEY_get_ex_data(ec_key, ec_key_index()));
+    if (!key_data) {
+        ALOGE("key had no key_blob!");
+        return 0;
+    }
+    return key_data->engine->EcdsaSign(digest, digest_len, sig, sig_len, ec_key);
 }
 
 bool Keymaster0Engine::Keymaster0Sign(const void* signing_params, const keymaster_key_blob_t& blob,
@@ -280,9 +342,11 @@ bool Keymaster0Engine::Keymaster0Sign(const void* signing_params, const keymaste
                                       unique_ptr<uint8_t[], Malloc_Delete>* signature,
                                       size_t* signature_length) const {
     uint8_t* signed_data;
+    std::unique_lock<std::mutex> lock(device_mutex_);
     int err = keymaster0_device_->sign_data(keymaster0_device_, signing_params, blob.key_material,
                                             blob.key_material_size, data, data_length, &signed_data,
                                             signature_length);
+    lock.unlock();
     if (err < 0) {
         ALOGE("Keymaster0 signing failed with error %d", err);
         return false;
@@ -293,11 +357,20 @@ bool Keymaster0Engine::Keymaster0Sign(const void* signing_params, const keymaste
 }
 
 EVP_PKEY* Keymaster0Engine::GetKeymaster0PublicKey(const KeymasterKeyBlob& blob) const {
+    // keymaster0 devices take no application parameters, so the blob alone identifies the key.
+    HardwarePublicKeyCache::Lookup lookup;
+    LoadedKeyCache::ComputeLookup(blob, AuthorizationSet(), &lookup);
+    EVP_PKEY* cached = public_key_cache_.Find(lookup);
+    if (cached)
+        return cached;
+
     uint8_t* pub_key_data;
     size_t pub_key_data_length;
+    std::unique_lock<std::mutex> lock(device_mutex_);
     int err = keymaster0_device_->get_keypair_public(keymaster0_device_, blob.key_material,
                                                      blob.key_material_size, &pub_key_data,
                                                      &pub_key_data_length);
+    lock.unlock();
     if (err < 0) {
         ALOGE("Error %d extracting public key", err);
         return nullptr;
@@ -305,7 +378,9 @@ EVP_PKEY* Keymaster0Engine::GetKeymaster0PublicKey(const KeymasterKeyBlob& blob)
     unique_ptr<uint8_t, Malloc_Delete> pub_key(pub_key_data);
 
     const uint8_t* p = pub_key_data;
-    return d2i_PUBKEY(nullptr /* allocate new struct */, &p, pub_key_data_length);
+    EVP_PKEY* public_key = d2i_PUBKEY(nullptr /* allocate new struct */, &p, pub_key_data_length);
+    public_key_cache_.Insert(lookup, public_key);
+    return public_key;
 }
 
 static bool data_too_large_for_public_modulus(const uint8_t* data, size_t len, const RSA* rsa) {
@@ -348,7 +423,7 @@ int Keymaster0Engine::RsaPrivateTransform(RSA* rsa, uint8_t* out, const uint8_t*
          * it's because it removed leading zeros from the left side. This is
          * bad because it provides attackers with an oracle but we cannot do
          * anything about a broken keymaster0 implementation here. */
-        memset(out, 0, len);
+        memset(out, 0, len - signature_length);
         memcpy(out + len - signature_length, signature.get(), signature_length);
     } else {
         memcpy(out, signature.get(), len);
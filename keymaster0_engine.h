@@ -18,6 +18,7 @@
 #define SYSTEM_KEYMASTER_KEYMASTER0_ENGINE_H_
 
 #include <memory>
+#include <mutex>
 
 #include <openssl/ec.h>
 #include <openssl/engine.h>
@@ -27,12 +28,16 @@
 #include <hardware/keymaster0.h>
 #include <hardware/keymaster_defs.h>
 
+#include "hardware_public_key_cache.h"
+
 namespace keymaster {
 
 struct KeymasterKeyBlob;
 
 /* Keymaster0Engine is a BoringSSL ENGINE that implements RSA & EC by forwarding the requested
- * operations to a keymaster0 module. */
+ * operations to a keymaster0 module.  Any number of engines may exist at once, each with its own
+ * module; keys record the engine that made them, and each engine makes one call at a time to its
+ * module, so keys from different engines may be used concurrently. */
 class Keymaster0Engine {
   public:
     /**
@@ -67,6 +72,19 @@ class Keymaster0Engine {
     Keymaster0Engine(const Keymaster0Engine&);  // Uncopyable
     void operator=(const Keymaster0Engine&);    // Unassignable
 
+    // What an engine attaches to each RSA and EC key it makes.
+    struct KeyData {
+        const Keymaster0Engine* engine;
+        keymaster_key_blob_t* blob;
+    };
+    static KeyData* NewKeyData(const Keymaster0Engine* engine, const keymaster_key_blob_t& blob);
+    static void FreeKeyData(KeyData* key_data);
+
+    // The ex_data indices for KeyData, shared by all engines so that the method callbacks can find
+    // a key's engine from the key.
+    static int rsa_index();
+    static int ec_key_index();
+
     static int keyblob_dup(CRYPTO_EX_DATA* to, const CRYPTO_EX_DATA* from, void** from_d, int index,
                            long argl, void* argp);
     static void keyblob_free(void* parent, void* ptr, CRYPTO_EX_DATA* data, int index, long argl,
@@ -90,12 +108,12 @@ class Keymaster0Engine {
 
     const keymaster0_device_t* keymaster0_device_;
     ENGINE* const engine_;
-    int rsa_index_, ec_key_index_;
     bool supports_ec_;
     RSA_METHOD rsa_method_;
     ECDSA_METHOD ecdsa_method_;
-
-    static Keymaster0Engine* instance_;
+    mutable HardwarePublicKeyCache public_key_cache_;
+    // keymaster0 modules make no promises about concurrent calls, so they're made one at a time.
+    mutable std::mutex device_mutex_;
 };
 
 }  // namespace keymaster
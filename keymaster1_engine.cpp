@@ -20,6 +20,7 @@
 
 #include <algorithm>
 #include <memory>
+#include <new>
 
 #define LOG_TAG "Keymaster1Engine"
 #include <cutils/log.h>
@@ -38,32 +39,28 @@ using std::unique_ptr;
 
 namespace keymaster {
 
-Keymaster1Engine* Keymaster1Engine::instance_ = nullptr;
+thread_local Keymaster1Engine::FinishContext* Keymaster1Engine::current_finish_ = nullptr;
+
+// Number of hardware public keys kept decoded, to spare key loads the export round trip.
+static const size_t kPublicKeyCacheEntries = 32;
 
 Keymaster1Engine::Keymaster1Engine(const keymaster1_device_t* keymaster1_device)
     : keymaster1_device_(keymaster1_device), engine_(ENGINE_new()),
-      rsa_index_(RSA_get_ex_new_index(0 /* argl */, NULL /* argp */, NULL /* new_func */,
-                                      Keymaster1Engine::duplicate_key_data,
-                                      Keymaster1Engine::free_key_data)),
-      ec_key_index_(EC_KEY_get_ex_new_index(0 /* argl */, NULL /* argp */, NULL /* new_func */,
-                                            Keymaster1Engine::duplicate_key_data,
-                                            Keymaster1Engine::free_key_data)),
-      rsa_method_(BuildRsaMethod()), ecdsa_method_(BuildEcdsaMethod()) {
-    assert(rsa_index_ != -1);
-    assert(ec_key_index_ != -1);
+      rsa_method_(BuildRsaMethod()), ecdsa_method_(BuildEcdsaMethod()),
+      public_key_cache_(kPublicKeyCacheEntries) {
+    assert(rsa_index() != -1);
+    assert(ec_key_index() != -1);
     assert(keymaster1_device);
-    assert(!instance_);
-
-    instance_ = this;
 
     ENGINE_set_RSA_method(engine_.get(), &rsa_method_, sizeof(rsa_method_));
     ENGINE_set_ECDSA_method(engine_.get(), &ecdsa_method_, sizeof(ecdsa_method_));
 }
 
 Keymaster1Engine::~Keymaster1Engine() {
+    // Complete any queued requests while the device is still open.
+    request_queue_.reset();
     keymaster1_device_->common.close(
         reinterpret_cast<hw_device_t*>(const_cast<keymaster1_device_t*>(keymaster1_device_)));
-    instance_ = nullptr;
 }
 
 static void ConvertCharacteristics(keymaster_key_characteristics_t* characteristics,
@@ -122,12 +119,16 @@ keymaster_error_t Keymaster1Engine::ImportKey(const AuthorizationSet& key_descri
 }
 
 keymaster_error_t Keymaster1Engine::DeleteKey(const KeymasterKeyBlob& blob) const {
+    HardwarePublicKeyCache::Lookup lookup;
+    LoadedKeyCache::ComputeLookup(blob, AuthorizationSet(), &lookup);
+    public_key_cache_.Invalidate(lookup.blob_digest);
     if (!keymaster1_device_->delete_key)
         return KM_ERROR_OK;
     return keymaster1_device_->delete_key(keymaster1_device_, &blob);
 }
 
 keymaster_error_t Keymaster1Engine::DeleteAllKeys() const {
+    public_key_cache_.Clear();
     if (!keymaster1_device_->delete_all_keys)
         return KM_ERROR_OK;
     return keymaster1_device_->delete_all_keys(keymaster1_device_);
@@ -143,8 +144,8 @@ RSA* Keymaster1Engine::BuildRsaKey(const KeymasterKeyBlob& blob,
         return nullptr;
     }
 
-    KeyData* key_data = new KeyData(blob, additional_params);
-    if (!RSA_set_ex_data(rsa.get(), rsa_index_, key_data)) {
+    KeyData* key_data = new KeyData(this, blob, additional_params);
+    if (!RSA_set_ex_data(rsa.get(), rsa_index(), key_data)) {
         *error = TranslateLastOpenSslError();
         delete key_data;
         return nullptr;
@@ -185,8 +186,8 @@ EC_KEY* Keymaster1Engine::BuildEcKey(const KeymasterKeyBlob& blob,
         return nullptr;
     }
 
-    KeyData* key_data = new KeyData(blob, additional_params);
-    if (!EC_KEY_set_ex_data(ec_key.get(), ec_key_index_, key_data)) {
+    KeyData* key_data = new KeyData(this, blob, additional_params);
+    if (!EC_KEY_set_ex_data(ec_key.get(), ec_key_index(), key_data)) {
         *error = TranslateLastOpenSslError();
         delete key_data;
         return nullptr;
@@ -236,13 +237,36 @@ Keymaster1Engine::KeyData* Keymaster1Engine::GetData(EVP_PKEY* key) const {
 Keymaster1Engine::KeyData* Keymaster1Engine::GetData(const RSA* rsa) const {
     if (!rsa)
         return nullptr;
-    return reinterpret_cast<KeyData*>(RSA_get_ex_data(rsa, rsa_index_));
+    KeyData* key_data = reinterpret_cast<KeyData*>(RSA_get_ex_data(rsa, rsa_index()));
+    if (!key_data || key_data->engine != this)
+        return nullptr;
+    return key_data;
 }
 
 Keymaster1Engine::KeyData* Keymaster1Engine::GetData(const EC_KEY* ec_key) const {
     if (!ec_key)
         return nullptr;
-    return reinterpret_cast<KeyData*>(EC_KEY_get_ex_data(ec_key, ec_key_index_));
+    KeyData* key_data = reinterpret_cast<KeyData*>(EC_KEY_get_ex_data(ec_key, ec_key_index()));
+    if (!key_data || key_data->engine != this)
+        return nullptr;
+    return key_data;
+}
+
+/* static */
+int Keymaster1Engine::rsa_index() {
+    static const int index =
+        RSA_get_ex_new_index(0 /* argl */, NULL /* argp */, NULL /* new_func */,
+                             Keymaster1Engine::duplicate_key_data, Keymaster1Engine::free_key_data);
+    return index;
+}
+
+/* static */
+int Keymaster1Engine::ec_key_index() {
+    static const int index =
+        EC_KEY_get_ex_new_index(0 /* argl */, NULL /* argp */, NULL /* new_func */,
+                                Keymaster1Engine::duplicate_key_data,
+                                Keymaster1Engine::free_key_data);
+    return index;
 }
 
 /* static */
@@ -266,42 +290,38 @@ void Keymaster1Engine::free_key_data(void* /* parent */, void* ptr, CRYPTO_EX_DA
     delete reinterpret_cast<KeyData*>(ptr);
 }
 
-keymaster_error_t Keymaster1Engine::Keymaster1Finish(const KeyData* key_data,
-                                                     const keymaster_blob_t& input,
-                                                     keymaster_blob_t* output) {
-    if (key_data->op_handle == 0)
-        return KM_ERROR_UNKNOWN_ERROR;
-
-    size_t input_consumed;
-    // Note: devices are required to consume all input in a single update call for undigested
-    // signing operations and encryption operations.  No need to loop here.
-    keymaster_error_t error =
-        device()->update(device(), key_data->op_handle, &key_data->finish_params, &input,
-                         &input_consumed, nullptr /* out_params */, nullptr /* output */);
-    if (error != KM_ERROR_OK)
-        return error;
+void Keymaster1Engine::EnableRequestQueue() {
+    if (!request_queue_)
+        request_queue_.reset(new (std::nothrow) Keymaster1RequestQueue(keymaster1_device_));
+}
 
-    return device()->finish(device(), key_data->op_handle, &key_data->finish_params,
-                            nullptr /* signature */, nullptr /* out_params */, output);
+keymaster_error_t Keymaster1Engine::Keymaster1Finish(const FinishContext& context,
+                                                     const keymaster_blob_t& input,
+                                                     keymaster_blob_t* output) const {
+    if (request_queue_)
+        return request_queue_->Finish(context.op_handle, &context.finish_params, input, output);
+    return Keymaster1UpdateAndFinish(device(), context.op_handle, &context.finish_params, input,
+                                     output);
 }
 
 /* static */
 int Keymaster1Engine::rsa_sign_raw(RSA* rsa, size_t* out_len, uint8_t* out, size_t max_out,
                                    const uint8_t* in, size_t in_len, int padding) {
-    KeyData* key_data = instance_->GetData(rsa);
-    if (!key_data)
+    const KeyData* key_data = reinterpret_cast<KeyData*>(RSA_get_ex_data(rsa, rsa_index()));
+    FinishContext* context = current_finish_;
+    if (!key_data || !context)
         return 0;
 
-    if (padding != key_data->expected_openssl_padding) {
+    if (padding != context->expected_openssl_padding) {
         LOG_E("Expected sign_raw with padding %d but got padding %d",
-              key_data->expected_openssl_padding, padding);
+              context->expected_openssl_padding, padding);
         return KM_ERROR_UNKNOWN_ERROR;
     }
 
     keymaster_blob_t input = {in, in_len};
     keymaster_blob_t output;
-    key_data->error = instance_->Keymaster1Finish(key_data, input, &output);
-    if (key_data->error != KM_ERROR_OK)
+    context->error = key_data->engine->Keymaster1Finish(*context, input, &output);
+    if (context->error != KM_ERROR_OK)
         return 0;
     unique_ptr<uint8_t, Malloc_Delete> output_deleter(const_cast<uint8_t*>(output.data));
 
@@ -313,20 +333,21 @@ int Keymaster1Engine::rsa_sign_raw(RSA* rsa, size_t* out_len, uint8_t* out, size
 /* static */
 int Keymaster1Engine::rsa_decrypt(RSA* rsa, size_t* out_len, uint8_t* out, size_t max_out,
                                   const uint8_t* in, size_t in_len, int padding) {
-    KeyData* key_data = instance_->GetData(rsa);
-    if (!key_data)
+    const KeyData* key_data = reinterpret_cast<KeyData*>(RSA_get_ex_data(rsa, rsa_index()));
+    FinishContext* context = current_finish_;
+    if (!key_data || !context)
         return 0;
 
-    if (padding != key_data->expected_openssl_padding) {
+    if (padding != context->expected_openssl_padding) {
         LOG_E("Expected sign_raw with padding %d but got padding %d",
-              key_data->expected_openssl_padding, padding);
+              context->expected_openssl_padding, padding);
         return KM_ERROR_UNKNOWN_ERROR;
     }
 
     keymaster_blob_t input = {in, in_len};
     keymaster_blob_t output;
-    key_data->error = instance_->Keymaster1Finish(key_data, input, &output);
-    if (key_data->error != KM_ERROR_OK)
+    context->error = key_data->engine->Keymaster1Finish(*context, input, &output);
+    if (context->error != KM_ERROR_OK)
         return 0;
     unique_ptr<uint8_t, Malloc_Delete> output_deleter(const_cast<uint8_t*>(output.data));
 
@@ -338,8 +359,10 @@ int Keymaster1Engine::rsa_decrypt(RSA* rsa, size_t* out_len, uint8_t* out, size_
 /* static */
 int Keymaster1Engine::ecdsa_sign(const uint8_t* digest, size_t digest_len, uint8_t* sig,
                                  unsigned int* sig_len, EC_KEY* ec_key) {
-    KeyData* key_data = instance_->GetData(ec_key);
-    if (!key_data)
+    const KeyData* key_data =
+        reinterpret_cast<KeyData*>(EC_KEY_get_ex_data(ec_key, ec_key_index()));
+    FinishContext* context = current_finish_;
+    if (!key_data || !context)
         return 0;
 
     // Truncate digest if it's too long
@@ -349,8 +372,8 @@ int Keymaster1Engine::ecdsa_sign(const uint8_t* digest, size_t digest_len, uint8
 
     keymaster_blob_t input = {digest, digest_len};
     keymaster_blob_t output;
-    key_data->error = instance_->Keymaster1Finish(key_data, input, &output);
-    if (key_data->error != KM_ERROR_OK)
+    context->error = key_data->engine->Keymaster1Finish(*context, input, &output);
+    if (context->error != KM_ERROR_OK)
         return 0;
     unique_ptr<uint8_t, Malloc_Delete> output_deleter(const_cast<uint8_t*>(output.data));
 
@@ -362,6 +385,14 @@ int Keymaster1Engine::ecdsa_sign(const uint8_t* digest, size_t digest_len, uint8
 EVP_PKEY* Keymaster1Engine::GetKeymaster1PublicKey(const KeymasterKeyBlob& blob,
                                                    const AuthorizationSet& additional_params,
                                                    keymaster_error_t* error) const {
+    HardwarePublicKeyCache::Lookup lookup;
+    LoadedKeyCache::ComputeLookup(blob, additional_params, &lookup);
+    EVP_PKEY* cached = public_key_cache_.Find(lookup);
+    if (cached) {
+        *error = KM_ERROR_OK;
+        return cached;
+    }
+
     keymaster_blob_t client_id = {nullptr, 0};
     keymaster_blob_t app_data = {nullptr, 0};
     keymaster_blob_t* client_id_ptr = nullptr;
@@ -380,7 +411,10 @@ EVP_PKEY* Keymaster1Engine::GetKeymaster1PublicKey(const KeymasterKeyBlob& blob,
     unique_ptr<uint8_t, Malloc_Delete> pub_key(const_cast<uint8_t*>(export_data.data));
 
     const uint8_t* p = export_data.data;
-    return d2i_PUBKEY(nullptr /* allocate new struct */, &p, export_data.data_length);
+    EVP_PKEY* public_key = d2i_PUBKEY(nullptr /* allocate new struct */, &p,
+                                      export_data.data_length);
+    public_key_cache_.Insert(lookup, public_key);
+    return public_key;
 }
 
 RSA_METHOD Keymaster1Engine::BuildRsaMethod() {
@@ -30,10 +30,18 @@
 #include <keymaster/android_keymaster_utils.h>
 #include <keymaster/authorization_set.h>
 
+#include "hardware_public_key_cache.h"
+#include "keymaster1_request_queue.h"
 #include "openssl_utils.h"
 
 namespace keymaster {
 
+/**
+ * Keymaster1Engine is a BoringSSL ENGINE that implements RSA & EC private key operations by
+ * finishing keymaster1 operations.  Any number of engines may exist at once, each with its own
+ * module; keys record the engine that made them, and each operation's state is its own, so
+ * operations may run concurrently with keys from one engine or several.
+ */
 class Keymaster1Engine {
   public:
     /**
@@ -56,18 +64,47 @@ class Keymaster1Engine {
     keymaster_error_t DeleteAllKeys() const;
 
     struct KeyData {
-        KeyData(const KeymasterKeyBlob& blob, const AuthorizationSet& params)
-            : op_handle(0), begin_params(params), key_material(blob), error(KM_ERROR_OK),
-              expected_openssl_padding(-1) {}
+        KeyData(const Keymaster1Engine* key_engine, const KeymasterKeyBlob& blob,
+                const AuthorizationSet& params)
+            : engine(key_engine), begin_params(params), key_material(blob) {}
 
-        keymaster_operation_handle_t op_handle;
+        const Keymaster1Engine* engine;
         AuthorizationSet begin_params;
-        AuthorizationSet finish_params;
         KeymasterKeyBlob key_material;
+    };
+
+    /**
+     * The state of one operation whose raw RSA or ECDSA step the engine's OpenSSL callbacks
+     * complete with the keymaster1 module.  Each operation keeps its own and makes it current with
+     * a FinishScope while OpenSSL runs, so operations sharing a key don't share it.
+     */
+    struct FinishContext {
+        FinishContext() : op_handle(0), error(KM_ERROR_OK), expected_openssl_padding(-1) {}
+
+        keymaster_operation_handle_t op_handle;
+        AuthorizationSet finish_params;
         keymaster_error_t error;
         int expected_openssl_padding;
     };
 
+    /**
+     * Makes context the one the calling thread's OpenSSL callbacks use, for the scope's lifetime.
+     */
+    class FinishScope {
+      public:
+        explicit FinishScope(FinishContext* context) : previous_(current_finish_) {
+            current_finish_ = context;
+        }
+        ~FinishScope() { current_finish_ = previous_; }
+
+      private:
+        FinishContext* const previous_;
+
+        // Disallow copying and assignment.
+        FinishScope(const FinishScope&);
+        void operator=(const FinishScope&);
+    };
+
     RSA* BuildRsaKey(const KeymasterKeyBlob& blob, const AuthorizationSet& additional_params,
                      keymaster_error_t* error) const;
     EC_KEY* BuildEcKey(const KeymasterKeyBlob& blob, const AuthorizationSet& additional_params,
@@ -79,6 +116,15 @@ class Keymaster1Engine {
 
     const keymaster1_device_t* device() const { return keymaster1_device_; }
 
+    /**
+     * Route the update and finish calls that complete raw RSA and ECDSA operations through a
+     * Keymaster1RequestQueue, so they're made on its thread one at a time.  The OpenSSL method
+     * callbacks still wait for their own result; other callers of the device may use
+     * request_queue() to submit without waiting.
+     */
+    void EnableRequestQueue();
+    Keymaster1RequestQueue* request_queue() const { return request_queue_.get(); }
+
     EVP_PKEY* GetKeymaster1PublicKey(const KeymasterKeyBlob& blob,
                                      const AuthorizationSet& additional_params,
                                      keymaster_error_t* error) const;
@@ -92,8 +138,13 @@ class Keymaster1Engine {
     void ConfigureEngineForRsa();
     void ConfigureEngineForEcdsa();
 
-    keymaster_error_t Keymaster1Finish(const KeyData* key_data, const keymaster_blob_t& input,
-                                       keymaster_blob_t* output);
+    keymaster_error_t Keymaster1Finish(const FinishContext& context, const keymaster_blob_t& input,
+                                       keymaster_blob_t* output) const;
+
+    // The ex_data indices for KeyData, shared by all engines so that the method callbacks can find
+    // a key's engine from the key.
+    static int rsa_index();
+    static int ec_key_index();
 
     static int duplicate_key_data(CRYPTO_EX_DATA* to, const CRYPTO_EX_DATA* from, void** from_d,
                                   int index, long argl, void* argp);
@@ -109,13 +160,14 @@ class Keymaster1Engine {
 
     const keymaster1_device_t* const keymaster1_device_;
     const std::unique_ptr<ENGINE, ENGINE_Delete> engine_;
-    const int rsa_index_;
-    const int ec_key_index_;
 
     const RSA_METHOD rsa_method_;
     const ECDSA_METHOD ecdsa_method_;
 
-    static Keymaster1Engine* instance_;
+    std::unique_ptr<Keymaster1RequestQueue> request_queue_;
+    mutable HardwarePublicKeyCache public_key_cache_;
+
+    static thread_local FinishContext* current_finish_;
 };
 
 }  // namespace keymaster
@@ -0,0 +1,118 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "keymaster1_request_queue.h"
+
+namespace keymaster {
+
+keymaster_error_t Keymaster1UpdateAndFinish(const keymaster1_device_t* device,
+                                            keymaster_operation_handle_t op_handle,
+                                            const keymaster_key_param_set_t* finish_params,
+                                            const keymaster_blob_t& input,
+                                            keymaster_blob_t* output) {
+    if (op_handle == 0)
+        return KM_ERROR_UNKNOWN_ERROR;
+
+    size_t input_consumed;
+    // Note: devices are required to consume all input in a single update call for undigested
+    // signing operations and encryption operations.  No need to loop here.  The keymaster1 finish
+    // entry point takes no input (unlike keymaster2's), so the update call can't be folded into it.
+    keymaster_error_t error =
+        device->update(device, op_handle, finish_params, &input, &input_consumed,
+                       nullptr /* out_params */, nullptr /* output */);
+    if (error != KM_ERROR_OK)
+        return error;
+
+    return device->finish(device, op_handle, finish_params, nullptr /* signature */,
+                          nullptr /* out_params */, output);
+}
+
+Keymaster1RequestQueue::~Keymaster1RequestQueue() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+    }
+    request_submitted_.notify_all();
+    if (thread_.joinable())
+        thread_.join();
+}
+
+void Keymaster1RequestQueue::Submit(keymaster_operation_handle_t op_handle,
+                                    const keymaster_key_param_set_t* finish_params,
+                                    const keymaster_blob_t& input, const Completion& completion) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    requests_.push_back(Request());
+    requests_.back().op_handle = op_handle;
+    requests_.back().finish_params = finish_params;
+    requests_.back().input = input;
+    requests_.back().completion = completion;
+    if (!thread_.joinable())
+        thread_ = std::thread(&Keymaster1RequestQueue::Run, this);
+    request_submitted_.notify_one();
+}
+
+keymaster_error_t Keymaster1RequestQueue::Finish(keymaster_operation_handle_t op_handle,
+                                                 const keymaster_key_param_set_t* finish_params,
+                                                 const keymaster_blob_t& input,
+                                                 keymaster_blob_t* output) {
+    std::mutex done_mutex;
+    std::condition_variable done_cv;
+    bool done = false;
+    keymaster_error_t result = KM_ERROR_UNKNOWN_ERROR;
+    Submit(op_handle, finish_params, input,
+           [&](keymaster_error_t error, const keymaster_blob_t& request_output) {
+               // Notify while holding the lock, so the waiter can't return and destroy done_cv
+               // first.
+               std::lock_guard<std::mutex> lock(done_mutex);
+               result = error;
+               *output = request_output;
+               done = true;
+               done_cv.notify_one();
+           });
+
+    std::unique_lock<std::mutex> lock(done_mutex);
+    done_cv.wait(lock, [&] { return done; });
+    return result;
+}
+
+size_t Keymaster1RequestQueue::pending() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return requests_.size();
+}
+
+void Keymaster1RequestQueue::Run() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+        if (requests_.empty()) {
+            if (stopping_)
+                return;
+            request_submitted_.wait(lock);
+            continue;
+        }
+        Request request = requests_.front();
+        requests_.pop_front();
+
+        // Don't hold the lock across the TEE round trip, so submitters needn't wait for it.
+        lock.unlock();
+        keymaster_blob_t output = {nullptr, 0};
+        keymaster_error_t error = Keymaster1UpdateAndFinish(
+            device_, request.op_handle, request.finish_params, request.input, &output);
+        request.completion(error, output);
+        lock.lock();
+    }
+}
+
+}  // namespace keymaster
@@ -0,0 +1,100 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SYSTEM_KEYMASTER_KEYMASTER1_REQUEST_QUEUE_H_
+#define SYSTEM_KEYMASTER_KEYMASTER1_REQUEST_QUEUE_H_
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+#include <hardware/keymaster1.h>
+
+namespace keymaster {
+
+/**
+ * Completes a keymaster1 device operation by passing it all of its input in one update call and
+ * then calling finish.  On success the caller owns output->data, which the device malloc'd.
+ */
+keymaster_error_t Keymaster1UpdateAndFinish(const keymaster1_device_t* device,
+                                            keymaster_operation_handle_t op_handle,
+                                            const keymaster_key_param_set_t* finish_params,
+                                            const keymaster_blob_t& input,
+                                            keymaster_blob_t* output);
+
+/**
+ * Keymaster1RequestQueue makes the update and finish calls that complete keymaster1 device
+ * operations on a background thread, one request at a time in submission order.  Submitters don't
+ * wait for the TEE round trip, so they can prepare further requests while earlier ones are on the
+ * device, and the device never sees two completions at once.
+ */
+class Keymaster1RequestQueue {
+  public:
+    /**
+     * Called on the queue's thread when a request completes.  If error is KM_ERROR_OK the
+     * completion owns output.data, which the device malloc'd.
+     */
+    typedef std::function<void(keymaster_error_t error, const keymaster_blob_t& output)> Completion;
+
+    explicit Keymaster1RequestQueue(const keymaster1_device_t* device)
+        : device_(device), stopping_(false) {}
+
+    /**
+     * Completes every request already submitted, then stops the background thread.
+     */
+    ~Keymaster1RequestQueue();
+
+    /**
+     * Queues completion of op_handle with input, starting the background thread if necessary.
+     * finish_params and the data input points to must remain valid until completion runs.
+     */
+    void Submit(keymaster_operation_handle_t op_handle,
+                const keymaster_key_param_set_t* finish_params, const keymaster_blob_t& input,
+                const Completion& completion);
+
+    /**
+     * Submits a request and waits for it, for callers that can't proceed without the result.
+     */
+    keymaster_error_t Finish(keymaster_operation_handle_t op_handle,
+                             const keymaster_key_param_set_t* finish_params,
+                             const keymaster_blob_t& input, keymaster_blob_t* output);
+
+    size_t pending() const;
+
+  private:
+    struct Request {
+        keymaster_operation_handle_t op_handle;
+        const keymaster_key_param_set_t* finish_params;
+        keymaster_blob_t input;
+        Completion completion;
+    };
+
+    void Run();
+
+    const keymaster1_device_t* const device_;
+
+    mutable std::mutex mutex_;
+    std::condition_variable request_submitted_;
+    std::deque<Request> requests_;
+    bool stopping_;
+    std::thread thread_;
+};
+
+}  // namespace keymaster
+
+#endif  // SYSTEM_KEYMASTER_KEYMASTER1_REQUEST_QUEUE_H_
@@ -0,0 +1,635 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * Microbenchmarks for the AndroidKeymaster entry points, run against a SoftKeymasterContext.
+ *
+ * A benchmark is registered for every algorithm, key size, purpose, digest, padding and block mode
+ * combination the implementation reports as supported, and which succeeds in a trial run at
+ * startup.  Combinations that the supported-* queries report but that can't work together (e.g.
+ * OAEP with SHA-512 on a 1024-bit key) are thereby skipped rather than reported as failures.
+ *
+ * Run "make bench" to produce keymaster_benchmark.json, or run keymaster_benchmark directly with
+ * the usual --benchmark_* flags.
+ *
+ * If built with KEYMASTER_ALLOCATION_COUNTING, each benchmark also reports the average number of
+ * keymaster allocations, and bytes allocated, per iteration of its timed work.
+ */
+
+#include <string>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+
+#include <keymaster/allocation_counter.h>
+#include <keymaster/android_keymaster.h>
+#include <keymaster/android_keymaster_messages.h>
+#include <keymaster/authorization_set.h>
+#include <keymaster/soft_keymaster_context.h>
+
+namespace keymaster {
+namespace {
+
+const int kOperationTableSize = 16;
+const size_t kChunkSize = 1024;
+const size_t kSmallInputSize = 32;
+const uint32_t kMacLengthBits = 128;
+
+AndroidKeymaster* device;
+
+const char* AlgorithmName(keymaster_algorithm_t algorithm) {
+    switch (algorithm) {
+    case KM_ALGORITHM_RSA:
+        return "RSA";
+    case KM_ALGORITHM_EC:
+        return "EC";
+    case KM_ALGORITHM_AES:
+        return "AES";
+    case KM_ALGORITHM_HMAC:
+        return "HMAC";
+    }
+    return "UNKNOWN";
+}
+
+const char* PurposeName(keymaster_purpose_t purpose) {
+    switch (purpose) {
+    case KM_PURPOSE_ENCRYPT:
+        return "ENCRYPT";
+    case KM_PURPOSE_DECRYPT:
+        return "DECRYPT";
+    case KM_PURPOSE_SIGN:
+        return "SIGN";
+    case KM_PURPOSE_VERIFY:
+        return "VERIFY";
+    case KM_PURPOSE_DERIVE_KEY:
+        return "DERIVE_KEY";
+    }
+    return "UNKNOWN";
+}
+
+const char* DigestName(keymaster_digest_t digest) {
+    switch (digest) {
+    case KM_DIGEST_NONE:
+        return "NONE";
+    case KM_DIGEST_MD5:
+        return "MD5";
+    case KM_DIGEST_SHA1:
+        return "SHA1";
+    case KM_DIGEST_SHA_2_224:
+        return "SHA224";
+    case KM_DIGEST_SHA_2_256:
+        return "SHA256";
+    case KM_DIGEST_SHA_2_384:
+        return "SHA384";
+    case KM_DIGEST_SHA_2_512:
+        return "SHA512";
+    }
+    return "UNKNOWN";
+}
+
+const char* PaddingName(keymaster_padding_t padding) {
+    switch (padding) {
+    case KM_PAD_NONE:
+        return "NOPAD";
+    case KM_PAD_RSA_OAEP:
+        return "OAEP";
+    case KM_PAD_RSA_PSS:
+        return "PSS";
+    case KM_PAD_RSA_PKCS1_1_5_ENCRYPT:
+        return "PKCS1_ENCRYPT";
+    case KM_PAD_RSA_PKCS1_1_5_SIGN:
+        return "PKCS1_SIGN";
+    case KM_PAD_PKCS7:
+        return "PKCS7";
+    }
+    return "UNKNOWN";
+}
+
+const char* BlockModeName(keymaster_block_mode_t block_mode) {
+    switch (block_mode) {
+    case KM_MODE_ECB:
+        return "ECB";
+    case KM_MODE_CBC:
+        return "CBC";
+    case KM_MODE_CTR:
+        return "CTR";
+    case KM_MODE_GCM:
+        return "GCM";
+    }
+    return "UNKNOWN";
+}
+
+struct KeySpec {
+    keymaster_algorithm_t algorithm;
+    uint32_t key_size;
+};
+
+const KeySpec kKeySpecs[] = {
+    {KM_ALGORITHM_RSA, 1024}, {KM_ALGORITHM_RSA, 2048}, {KM_ALGORITHM_RSA, 3072},
+    {KM_ALGORITHM_RSA, 4096}, {KM_ALGORITHM_EC, 224},   {KM_ALGORITHM_EC, 256},
+    {KM_ALGORITHM_EC, 384},   {KM_ALGORITHM_EC, 521},   {KM_ALGORITHM_AES, 128},
+    {KM_ALGORITHM_AES, 192},  {KM_ALGORITHM_AES, 256},  {KM_ALGORITHM_HMAC, 128},
+    {KM_ALGORITHM_HMAC, 256}, {KM_ALGORITHM_HMAC, 512},
+};
+
+std::vector<keymaster_purpose_t> Purposes(keymaster_algorithm_t algorithm) {
+    switch (algorithm) {
+    case KM_ALGORITHM_RSA:
+        return {KM_PURPOSE_SIGN, KM_PURPOSE_VERIFY, KM_PURPOSE_ENCRYPT, KM_PURPOSE_DECRYPT};
+    case KM_ALGORITHM_EC:
+    case KM_ALGORITHM_HMAC:
+        return {KM_PURPOSE_SIGN, KM_PURPOSE_VERIFY};
+    case KM_ALGORITHM_AES:
+        return {KM_PURPOSE_ENCRYPT, KM_PURPOSE_DECRYPT};
+    }
+    return {};
+}
+
+template <typename Request, typename Response, typename T>
+std::vector<T> Supported(void (AndroidKeymaster::*query)(const Request&, Response*),
+                         keymaster_algorithm_t algorithm, keymaster_purpose_t purpose) {
+    Request request;
+    request.algorithm = algorithm;
+    request.purpose = purpose;
+    Response response;
+    (device->*query)(request, &response);
+    if (response.error != KM_ERROR_OK)
+        return {};
+    return std::vector<T>(response.results, response.results + response.results_length);
+}
+
+std::vector<keymaster_digest_t> SupportedDigests(keymaster_algorithm_t algorithm,
+                                                 keymaster_purpose_t purpose) {
+    return Supported<SupportedDigestsRequest, SupportedDigestsResponse, keymaster_digest_t>(
+        &AndroidKeymaster::SupportedDigests, algorithm, purpose);
+}
+
+std::vector<keymaster_padding_t> SupportedPaddings(keymaster_algorithm_t algorithm,
+                                                   keymaster_purpose_t purpose) {
+    return Supported<SupportedPaddingModesRequest, SupportedPaddingModesResponse,
+                     keymaster_padding_t>(&AndroidKeymaster::SupportedPaddingModes, algorithm,
+                                          purpose);
+}
+
+std::vector<keymaster_block_mode_t> SupportedBlockModes(keymaster_algorithm_t algorithm,
+                                                        keymaster_purpose_t purpose) {
+    return Supported<SupportedBlockModesRequest, SupportedBlockModesResponse,
+                     keymaster_block_mode_t>(&AndroidKeymaster::SupportedBlockModes, algorithm,
+                                             purpose);
+}
+
+/**
+ * Describes a key usable for every purpose, digest, padding and block mode supported for its
+ * algorithm.  HMAC keys may have only one digest, so for HMAC the digest is specified.
+ */
+AuthorizationSet KeyDescription(const KeySpec& spec, keymaster_digest_t hmac_digest) {
+    AuthorizationSetBuilder builder;
+    builder.Authorization(TAG_ALGORITHM, spec.algorithm)
+        .Authorization(TAG_KEY_SIZE, spec.key_size)
+        .Authorization(TAG_NO_AUTH_REQUIRED);
+    if (spec.algorithm == KM_ALGORITHM_RSA)
+        builder.Authorization(TAG_RSA_PUBLIC_EXPONENT, 65537);
+    if (spec.algorithm == KM_ALGORITHM_AES || spec.algorithm == KM_ALGORITHM_HMAC)
+        builder.Authorization(TAG_MIN_MAC_LENGTH, kMacLengthBits);
+    if (spec.algorithm == KM_ALGORITHM_HMAC)
+        builder.Digest(hmac_digest);
+
+    AuthorizationSet description(builder.build());
+    for (keymaster_purpose_t purpose : Purposes(spec.algorithm)) {
+        description.push_back(TAG_PURPOSE, purpose);
+        if (spec.algorithm != KM_ALGORITHM_HMAC)
+            for (keymaster_digest_t digest : SupportedDigests(spec.algorithm, purpose))
+                description.push_back(TAG_DIGEST, digest);
+        for (keymaster_padding_t padding : SupportedPaddings(spec.algorithm, purpose))
+            description.push_back(TAG_PADDING, padding);
+        for (keymaster_block_mode_t mode : SupportedBlockModes(spec.algorithm, purpose))
+            description.push_back(TAG_BLOCK_MODE, mode);
+    }
+    description.Deduplicate();
+    return description;
+}
+
+struct BenchmarkKey {
+    std::string name;
+    KeySpec spec;
+    AuthorizationSet description;
+    std::string blob;
+};
+
+keymaster_error_t GenerateKey(const AuthorizationSet& description, std::string* blob) {
+    GenerateKeyRequest request;
+    request.key_description.Reinitialize(description);
+    GenerateKeyResponse response;
+    device->GenerateKey(request, &response);
+    if (response.error == KM_ERROR_OK && blob)
+        blob->assign(reinterpret_cast<const char*>(response.key_blob.key_material),
+                     response.key_blob.key_material_size);
+    return response.error;
+}
+
+/**
+ * One operation to benchmark: a key, a purpose and the begin parameters selecting a digest,
+ * padding and block mode, together with suitable input.  For VERIFY and DECRYPT operations,
+ * signature and input hold the result of the matching SIGN or ENCRYPT operation.
+ */
+struct Combination {
+    std::string name;
+    const BenchmarkKey* key;
+    keymaster_purpose_t purpose;
+    AuthorizationSet begin_params;
+    std::string input;
+    std::string signature;
+    bool streamable;
+};
+
+keymaster_error_t Begin(const Combination& combination, keymaster_operation_handle_t* op_handle,
+                        AuthorizationSet* output_params = nullptr) {
+    BeginOperationRequest request;
+    request.purpose = combination.purpose;
+    request.SetKeyMaterial(combination.key->blob.data(), combination.key->blob.size());
+    request.additional_params.Reinitialize(combination.begin_params);
+    BeginOperationResponse response;
+    device->BeginOperation(request, &response);
+    if (response.error == KM_ERROR_OK) {
+        *op_handle = response.op_handle;
+        if (output_params)
+            output_params->Reinitialize(response.output_params);
+    }
+    return response.error;
+}
+
+keymaster_error_t Update(keymaster_operation_handle_t op_handle, const std::string& input,
+                         std::string* output) {
+    size_t consumed = 0;
+    while (consumed < input.size()) {
+        UpdateOperationRequest request;
+        request.op_handle = op_handle;
+        request.input.Reinitialize(input.data() + consumed, input.size() - consumed);
+        UpdateOperationResponse response;
+        device->UpdateOperation(request, &response);
+        if (response.error != KM_ERROR_OK)
+            return response.error;
+        if (response.input_consumed == 0)
+            return KM_ERROR_UNKNOWN_ERROR;
+        consumed += response.input_consumed;
+        if (output)
+            output->append(reinterpret_cast<const char*>(response.output.peek_read()),
+                           response.output.available_read());
+    }
+    return KM_ERROR_OK;
+}
+
+keymaster_error_t Finish(keymaster_operation_handle_t op_handle, const std::string& signature,
+                         std::string* output) {
+    FinishOperationRequest request;
+    request.op_handle = op_handle;
+    request.signature.Reinitialize(signature.data(), signature.size());
+    FinishOperationResponse response;
+    device->FinishOperation(request, &response);
+    if (response.error == KM_ERROR_OK && output)
+        output->append(reinterpret_cast<const char*>(response.output.peek_read()),
+                       response.output.available_read());
+    return response.error;
+}
+
+void Abort(keymaster_operation_handle_t op_handle) {
+    AbortOperationRequest request;
+    request.op_handle = op_handle;
+    AbortOperationResponse response;
+    device->AbortOperation(request, &response);
+}
+
+keymaster_error_t Run(const Combination& combination, std::string* output,
+                      AuthorizationSet* output_params = nullptr) {
+    keymaster_operation_handle_t op_handle;
+    keymaster_error_t error = Begin(combination, &op_handle, output_params);
+    if (error != KM_ERROR_OK)
+        return error;
+    error = Update(op_handle, combination.input, output);
+    if (error != KM_ERROR_OK) {
+        Abort(op_handle);
+        return error;
+    }
+    return Finish(op_handle, combination.signature, output);
+}
+
+/**
+ * Picks input the combination accepts: raw RSA takes exactly one modulus-sized block, which must
+ * be numerically smaller than the modulus, and undigested RSA and EC signing and RSA encryption
+ * take only short messages.  Everything else gets a full chunk.
+ */
+std::string InputFor(const BenchmarkKey& key, keymaster_purpose_t purpose,
+                     keymaster_digest_t digest, keymaster_padding_t padding) {
+    if (key.spec.algorithm == KM_ALGORITHM_RSA && padding == KM_PAD_NONE) {
+        std::string input(key.spec.key_size / 8, 'a');
+        input[0] = 0;
+        return input;
+    }
+    bool asymmetric =
+        key.spec.algorithm == KM_ALGORITHM_RSA || key.spec.algorithm == KM_ALGORITHM_EC;
+    bool signing = purpose == KM_PURPOSE_SIGN || purpose == KM_PURPOSE_VERIFY;
+    if (asymmetric && (!signing || digest == KM_DIGEST_NONE))
+        return std::string(kSmallInputSize, 'a');
+    return std::string(kChunkSize, 'a');
+}
+
+/**
+ * Fills in the begin parameters and input of a combination for purpose, by running the signing
+ * or encrypting counterpart of VERIFY and DECRYPT operations.  Returns false if the combination
+ * doesn't work.
+ */
+bool Prepare(Combination* combination, keymaster_digest_t digest, keymaster_padding_t padding,
+             keymaster_block_mode_t block_mode) {
+    const BenchmarkKey& key = *combination->key;
+    keymaster_algorithm_t algorithm = key.spec.algorithm;
+    if (algorithm != KM_ALGORITHM_AES && algorithm != KM_ALGORITHM_HMAC)
+        combination->begin_params.push_back(TAG_DIGEST, digest);
+    if (algorithm == KM_ALGORITHM_RSA || algorithm == KM_ALGORITHM_AES)
+        combination->begin_params.push_back(TAG_PADDING, padding);
+    if (algorithm == KM_ALGORITHM_AES)
+        combination->begin_params.push_back(TAG_BLOCK_MODE, block_mode);
+    if (block_mode == KM_MODE_GCM)
+        combination->begin_params.push_back(TAG_MAC_LENGTH, kMacLengthBits);
+
+    combination->input = InputFor(key, combination->purpose, digest, padding);
+    combination->streamable = (algorithm == KM_ALGORITHM_AES || algorithm == KM_ALGORITHM_HMAC ||
+                               (combination->purpose == KM_PURPOSE_SIGN ||
+                                combination->purpose == KM_PURPOSE_VERIFY)) &&
+                              combination->input.size() == kChunkSize;
+
+    if (combination->purpose == KM_PURPOSE_VERIFY || combination->purpose == KM_PURPOSE_DECRYPT) {
+        Combination counterpart(*combination);
+        counterpart.purpose =
+            combination->purpose == KM_PURPOSE_VERIFY ? KM_PURPOSE_SIGN : KM_PURPOSE_ENCRYPT;
+        if (algorithm == KM_ALGORITHM_HMAC)
+            counterpart.begin_params.push_back(TAG_MAC_LENGTH, kMacLengthBits);
+
+        std::string output;
+        AuthorizationSet output_params;
+        if (Run(counterpart, &output, &output_params) != KM_ERROR_OK)
+            return false;
+        if (combination->purpose == KM_PURPOSE_VERIFY) {
+            combination->signature = output;
+        } else {
+            combination->input = output;
+            combination->begin_params.push_back(output_params);
+        }
+    } else if (algorithm == KM_ALGORITHM_HMAC) {
+        combination->begin_params.push_back(TAG_MAC_LENGTH, kMacLengthBits);
+    }
+
+    std::string output;
+    return Run(*combination, &output) == KM_ERROR_OK;
+}
+
+std::string OperationName(const BenchmarkKey& key, keymaster_purpose_t purpose,
+                          keymaster_digest_t digest, keymaster_padding_t padding,
+                          keymaster_block_mode_t block_mode) {
+    std::string name = key.name + "/" + PurposeName(purpose);
+    switch (key.spec.algorithm) {
+    case KM_ALGORITHM_RSA:
+        return name + "/" + PaddingName(padding) + "/" + DigestName(digest);
+    case KM_ALGORITHM_EC:
+        return name + "/" + DigestName(digest);
+    case KM_ALGORITHM_AES:
+        return name + "/" + BlockModeName(block_mode) + "/" + PaddingName(padding);
+    case KM_ALGORITHM_HMAC:
+        return name;
+    }
+    return name;
+}
+
+void AddCombinations(const BenchmarkKey& key, keymaster_purpose_t purpose,
+                     std::vector<Combination>* combinations) {
+    keymaster_algorithm_t algorithm = key.spec.algorithm;
+    std::vector<keymaster_digest_t> digests = {KM_DIGEST_NONE};
+    std::vector<keymaster_padding_t> paddings = {KM_PAD_NONE};
+    std::vector<keymaster_block_mode_t> block_modes = {KM_MODE_ECB};
+    if (algorithm == KM_ALGORITHM_RSA || algorithm == KM_ALGORITHM_EC)
+        digests = SupportedDigests(algorithm, purpose);
+    if (algorithm == KM_ALGORITHM_RSA || algorithm == KM_ALGORITHM_AES)
+        paddings = SupportedPaddings(algorithm, purpose);
+    if (algorithm == KM_ALGORITHM_AES)
+        block_modes = SupportedBlockModes(algorithm, purpose);
+
+    for (keymaster_digest_t digest : digests)
+        for (keymaster_padding_t padding : paddings)
+            for (keymaster_block_mode_t block_mode : block_modes) {
+                // Only OAEP uses a digest for encryption; the rest would just repeat themselves.
+                bool encrypting = purpose == KM_PURPOSE_ENCRYPT || purpose == KM_PURPOSE_DECRYPT;
+                if (algorithm == KM_ALGORITHM_RSA && encrypting && padding != KM_PAD_RSA_OAEP &&
+                    digest != KM_DIGEST_NONE)
+                    continue;
+                Combination combination;
+                combination.name = OperationName(key, purpose, digest, padding, block_mode);
+                combination.key = &key;
+                combination.purpose = purpose;
+                if (Prepare(&combination, digest, padding, block_mode))
+                    combinations->push_back(combination);
+            }
+}
+
+// Reports allocation totals as averages per iteration.
+void ReportAllocations(benchmark::State& state, uint64_t allocations, uint64_t bytes) {
+#ifdef KEYMASTER_ALLOCATION_COUNTING
+    state.counters["allocations"] =
+        benchmark::Counter(allocations, benchmark::Counter::kAvgIterations);
+    state.counters["allocated_bytes"] =
+        benchmark::Counter(bytes, benchmark::Counter::kAvgIterations);
+#else
+    (void)state;
+    (void)allocations;
+    (void)bytes;
+#endif
+}
+
+void ReportAllocations(benchmark::State& state, const AllocationCounter& counter) {
+    ReportAllocations(state, counter.allocations(), counter.bytes());
+}
+
+void BenchmarkGenerateKey(benchmark::State& state, const BenchmarkKey* key) {
+    AllocationCounter allocations;
+    while (state.KeepRunning())
+        if (GenerateKey(key->description, nullptr) != KM_ERROR_OK)
+            state.SkipWithError("GenerateKey failed");
+    ReportAllocations(state, allocations);
+}
+
+void BenchmarkExportKey(benchmark::State& state, const BenchmarkKey* key) {
+    ExportKeyRequest request;
+    request.key_format = KM_KEY_FORMAT_X509;
+    request.SetKeyMaterial(key->blob.data(), key->blob.size());
+    AllocationCounter allocations;
+    while (state.KeepRunning()) {
+        ExportKeyResponse response;
+        device->ExportKey(request, &response);
+        if (response.error != KM_ERROR_OK)
+            state.SkipWithError("ExportKey failed");
+    }
+    ReportAllocations(state, allocations);
+}
+
+void BenchmarkAttestKey(benchmark::State& state, const BenchmarkKey* key) {
+    static const char kChallenge[] = "challenge";
+    AttestKeyRequest request;
+    request.SetKeyMaterial(key->blob.data(), key->blob.size());
+    request.attest_params.push_back(TAG_ATTESTATION_CHALLENGE, kChallenge, sizeof(kChallenge) - 1);
+    AllocationCounter allocations;
+    while (state.KeepRunning()) {
+        AttestKeyResponse response;
+        device->AttestKey(request, &response);
+        if (response.error != KM_ERROR_OK)
+            state.SkipWithError("AttestKey failed");
+    }
+    ReportAllocations(state, allocations);
+}
+
+void BenchmarkBegin(benchmark::State& state, const Combination* combination) {
+    AllocationCounter allocations;
+    while (state.KeepRunning()) {
+        keymaster_operation_handle_t op_handle;
+        if (Begin(*combination, &op_handle) != KM_ERROR_OK) {
+            state.SkipWithError("BeginOperation failed");
+            break;
+        }
+        Abort(op_handle);
+    }
+    ReportAllocations(state, allocations);
+}
+
+/**
+ * Measures one kChunkSize update of a single long-running operation.
+ */
+void BenchmarkUpdate(benchmark::State& state, const Combination* combination) {
+    keymaster_operation_handle_t op_handle;
+    if (Begin(*combination, &op_handle) != KM_ERROR_OK) {
+        state.SkipWithError("BeginOperation failed");
+        return;
+    }
+    UpdateOperationRequest request;
+    request.op_handle = op_handle;
+    {
+        AllocationCounter allocations;
+        while (state.KeepRunning()) {
+            request.input.Reinitialize(combination->input.data(), kChunkSize);
+            UpdateOperationResponse response;
+            device->UpdateOperation(request, &response);
+            if (response.error != KM_ERROR_OK) {
+                state.SkipWithError("UpdateOperation failed");
+                break;
+            }
+        }
+        ReportAllocations(state, allocations);
+    }
+    state.SetBytesProcessed(state.iterations() * kChunkSize);
+    Abort(op_handle);
+}
+
+/**
+ * Measures FinishOperation only; beginning and feeding each operation isn't timed.
+ */
+void BenchmarkFinish(benchmark::State& state, const Combination* combination) {
+    uint64_t allocations = 0;
+    uint64_t bytes = 0;
+    while (state.KeepRunning()) {
+        state.PauseTiming();
+        keymaster_operation_handle_t op_handle;
+        if (Begin(*combination, &op_handle) != KM_ERROR_OK ||
+            Update(op_handle, combination->input, nullptr) != KM_ERROR_OK) {
+            state.SkipWithError("Operation setup failed");
+            break;
+        }
+        state.ResumeTiming();
+        AllocationCounter counter;
+        keymaster_error_t error = Finish(op_handle, combination->signature, nullptr);
+        allocations += counter.allocations();
+        bytes += counter.bytes();
+        if (error != KM_ERROR_OK) {
+            state.SkipWithError("FinishOperation failed");
+            break;
+        }
+    }
+    ReportAllocations(state, allocations, bytes);
+}
+
+std::vector<BenchmarkKey> GenerateKeys() {
+    std::vector<BenchmarkKey> keys;
+    for (const KeySpec& spec : kKeySpecs) {
+        std::vector<keymaster_digest_t> digests = {KM_DIGEST_NONE};
+        if (spec.algorithm == KM_ALGORITHM_HMAC)
+            digests = SupportedDigests(spec.algorithm, KM_PURPOSE_SIGN);
+        for (keymaster_digest_t digest : digests) {
+            if (spec.algorithm == KM_ALGORITHM_HMAC && digest == KM_DIGEST_NONE)
+                continue;
+            BenchmarkKey key;
+            key.name = std::string(AlgorithmName(spec.algorithm)) + "-" +
+                       std::to_string(spec.key_size);
+            if (spec.algorithm == KM_ALGORITHM_HMAC)
+                key.name += std::string("-") + DigestName(digest);
+            key.spec = spec;
+            key.description.Reinitialize(KeyDescription(spec, digest));
+            if (GenerateKey(key.description, &key.blob) == KM_ERROR_OK)
+                keys.push_back(key);
+        }
+    }
+    return keys;
+}
+
+// Registered benchmarks keep pointers into these, so they must not be resized once filled.
+std::vector<BenchmarkKey> keys;
+std::vector<Combination> combinations;
+
+void RegisterBenchmarks() {
+    keys = GenerateKeys();
+    for (const BenchmarkKey& key : keys)
+        for (keymaster_purpose_t purpose : Purposes(key.spec.algorithm))
+            AddCombinations(key, purpose, &combinations);
+
+    for (const BenchmarkKey& key : keys) {
+        benchmark::RegisterBenchmark(("GenerateKey/" + key.name).c_str(), BenchmarkGenerateKey,
+                                     &key);
+        if (key.spec.algorithm != KM_ALGORITHM_RSA && key.spec.algorithm != KM_ALGORITHM_EC)
+            continue;
+        benchmark::RegisterBenchmark(("ExportKey/" + key.name).c_str(), BenchmarkExportKey, &key);
+        benchmark::RegisterBenchmark(("AttestKey/" + key.name).c_str(), BenchmarkAttestKey, &key);
+    }
+    for (const Combination& combination : combinations) {
+        benchmark::RegisterBenchmark(("Begin/" + combination.name).c_str(), BenchmarkBegin,
+                                     &combination);
+        if (combination.streamable)
+            benchmark::RegisterBenchmark(("Update/" + combination.name).c_str(), BenchmarkUpdate,
+                                         &combination);
+        benchmark::RegisterBenchmark(("Finish/" + combination.name).c_str(), BenchmarkFinish,
+                                     &combination);
+    }
+}
+
+}  // namespace
+
+void RunBenchmarks() {
+    device = new AndroidKeymaster(new SoftKeymasterContext, kOperationTableSize);
+    RegisterBenchmarks();
+    benchmark::RunSpecifiedBenchmarks();
+    delete device;
+}
+
+}  // namespace keymaster
+
+int main(int argc, char** argv) {
+    benchmark::Initialize(&argc, argv);
+    keymaster::RunBenchmarks();
+    return 0;
+}
@@ -20,21 +20,121 @@
 #include <limits.h>
 #include <string.h>
 
+#include <mutex>
+#include <new>
+
 #include <openssl/evp.h>
 
 #include <hardware/hw_auth_token.h>
 #include <keymaster/android_keymaster_utils.h>
 #include <keymaster/logger.h>
 
-#include "List.h"
-
-using android::List;
+#include "access_count_log.h"
 
 namespace keymaster {
 
+/**
+ * A fixed-capacity open-addressed hash table of per-key entries, keyed by km_id_t.  At most
+ * max_size entries are held, in a power-of-two array at least twice that size so probe sequences
+ * stay short.  Collisions are resolved by linear probing, and removal shifts displaced entries
+ * back rather than leaving tombstones, so lookups never degrade.
+ */
+template <typename Value> class KeyIdTable {
+  public:
+    explicit KeyIdTable(uint32_t max_size) : max_size_(max_size), mask_(0), size_(0) {
+        size_t capacity = 1;
+        while (capacity < 2 * static_cast<size_t>(max_size_))
+            capacity <<= 1;
+        slots_ = new (std::nothrow) Slot[capacity];
+        if (slots_)
+            mask_ = capacity - 1;
+        else
+            max_size_ = 0;
+    }
+    ~KeyIdTable() { delete[] slots_; }
+
+    Value* Find(km_id_t keyid) { return const_cast<Value*>(FindConst(keyid)); }
+    const Value* Find(km_id_t keyid) const { return FindConst(keyid); }
+
+    /**
+     * Adds an entry for keyid, which must not already be present, and returns it.  Returns NULL if
+     * the table is full.
+     */
+    Value* Insert(km_id_t keyid) {
+        if (full())
+            return nullptr;
+        size_t i = Home(keyid);
+        while (slots_[i].used)
+            i = (i + 1) & mask_;
+        slots_[i].used = true;
+        slots_[i].keyid = keyid;
+        slots_[i].value = Value();
+        ++size_;
+        return &slots_[i].value;
+    }
+
+    /**
+     * Removes every entry for which expired(value) returns true.
+     */
+    template <typename Predicate> void RemoveIf(Predicate expired) {
+        if (!slots_)
+            return;
+        for (size_t i = 0; i <= mask_;) {
+            if (slots_[i].used && expired(slots_[i].value))
+                Remove(i);  // May shift another entry into slot i, so look at it again.
+            else
+                ++i;
+        }
+    }
+
+    bool full() const { return size_ >= max_size_; }
+
+  private:
+    struct Slot {
+        Slot() : keyid(0), used(false) {}
+        km_id_t keyid;
+        bool used;
+        Value value;
+    };
+
+    size_t Home(km_id_t keyid) const {
+        // Key IDs are already hashes, but mix anyway so that structured IDs (e.g. in tests) don't
+        // cluster.
+        return static_cast<size_t>((keyid * 0x9E3779B97F4A7C15ULL) >> 32) & mask_;
+    }
+
+    const Value* FindConst(km_id_t keyid) const {
+        if (!slots_)
+            return nullptr;
+        for (size_t i = Home(keyid); slots_[i].used; i = (i + 1) & mask_)
+            if (slots_[i].keyid == keyid)
+                return &slots_[i].value;
+        return nullptr;
+    }
+
+    void Remove(size_t hole) {
+        // Backward-shift deletion: move later members of the probe run into the hole whenever
+        // their home slot doesn't lie strictly between the hole and their current position.
+        for (size_t i = (hole + 1) & mask_; slots_[i].used; i = (i + 1) & mask_) {
+            size_t home = Home(slots_[i].keyid);
+            if (((i - home) & mask_) >= ((i - hole) & mask_)) {
+                slots_[hole] = slots_[i];
+                hole = i;
+            }
+        }
+        slots_[hole] = Slot();
+        --size_;
+    }
+
+    uint32_t max_size_;
+    size_t mask_;
+    size_t size_;
+    Slot* slots_;
+};
+
 class AccessTimeMap {
   public:
-    AccessTimeMap(uint32_t max_size) : max_size_(max_size) {}
+    AccessTimeMap(uint32_t max_size) : table_(max_size), next_expiry_(0) {}
 
     /* If the key is found, returns true and fills \p last_access_time.  If not found returns
      * false. */
@@ -46,17 +146,26 @@ class AccessTimeMap {
 
   private:
     struct AccessTime {
-        km_id_t keyid;
         uint32_t access_time;
         uint32_t timeout;
     };
-    android::List<AccessTime> last_access_list_;
-    const uint32_t max_size_;
+
+    static uint64_t expiry(const AccessTime& entry) {
+        return static_cast<uint64_t>(entry.access_time) + entry.timeout;
+    }
+
+    KeyIdTable<AccessTime> table_;
+    // No entry expires before this time, so there's no point in scanning for expired entries
+    // earlier.
+    uint64_t next_expiry_;
 };
 
 class AccessCountMap {
   public:
-    AccessCountMap(uint32_t max_size) : max_size_(max_size) {}
+    AccessCountMap(uint32_t max_size) : table_(max_size), log_(nullptr) {}
+
+    /* Keeps counts in log, which must outlive the map, starting from the counts already there. */
+    explicit AccessCountMap(AccessCountLog* log);
 
     /* If the key is found, returns true and fills \p count.  If not found returns
      * false. */
@@ -68,13 +177,73 @@ class AccessCountMap {
 
   private:
     struct AccessCount {
-        km_id_t keyid;
         uint64_t access_count;
+        // The key's record in log_, if there is one, kept in step with access_count.
+        AccessCountLog::Record* record;
     };
-    android::List<AccessCount> access_count_list_;
-    const uint32_t max_size_;
+    KeyIdTable<AccessCount> table_;
+    AccessCountLog* log_;
+};
+
+/**
+ * Remembers the last few auth tokens whose signatures were validated, so that the Update and
+ * Finish calls of a long operation don't re-verify the same token's MAC on every call.  Entries
+ * match on the entire token rather than just its MAC, since a token that reuses a valid MAC with
+ * any other field changed must still fail validation.  Each entry is only trusted for a bounded
+ * time after validation.
+ */
+class ValidatedTokenCache {
+  public:
+    explicit ValidatedTokenCache(size_t max_size)
+        : entries_(new (std::nothrow) Entry[max_size]), max_size_(entries_.get() ? max_size : 0),
+          next_(0) {
+        for (size_t i = 0; i < max_size_; ++i)
+            entries_[i].expiry = 0;
+    }
+
+    /**
+     * Returns true if token was validated no more than its lifetime before current_time.
+     */
+    bool Contains(const hw_auth_token_t& token, uint32_t current_time) const {
+        std::lock_guard<CountingMutex> lock(mutex_);
+        for (size_t i = 0; i < max_size_; ++i)
+            if (entries_[i].expiry > current_time &&
+                memcmp(&entries_[i].token, &token, sizeof(token)) == 0)
+                return true;
+        return false;
+    }
+
+    /**
+     * Records that token was validated at current_time, replacing the oldest entry.
+     */
+    void Insert(const hw_auth_token_t& token, uint32_t current_time, uint32_t lifetime) {
+        if (max_size_ == 0)
+            return;
+        std::lock_guard<CountingMutex> lock(mutex_);
+        Entry& entry = entries_[next_];
+        next_ = (next_ + 1) % max_size_;
+        entry.token = token;
+        entry.expiry = static_cast<uint64_t>(current_time) + lifetime;
+    }
+
+  private:
+    struct Entry {
+        hw_auth_token_t token;
+        uint64_t expiry;
+    };
+
+    // Insert overwrites whole entries, which Contains mustn't see half-written.
+    mutable CountingMutex mutex_;
+    UniquePtr<Entry[]> entries_;
+    const size_t max_size_;
+    size_t next_;
 };
 
+// The number of validated tokens remembered, and the longest any of them is trusted without being
+// validated again, in seconds.
+static const size_t kValidatedTokenCacheSize = 8;
+static const uint32_t kMaxValidatedTokenLifetime = 60;
+
 bool is_public_key_algorithm(const AuthorizationSet& auth_set) {
     keymaster_algorithm_t algorithm;
     return auth_set.GetTagValue(TAG_ALGORITHM, &algorithm) &&
@@ -82,13 +251,13 @@ bool is_public_key_algorithm(const AuthorizationSet& auth_set) {
 }
 
 static keymaster_error_t authorized_purpose(const keymaster_purpose_t purpose,
-                                            const AuthorizationSet& auth_set) {
+                                            const KeyPolicy& policy) {
     switch (purpose) {
     case KM_PURPOSE_VERIFY:
     case KM_PURPOSE_ENCRYPT:
     case KM_PURPOSE_SIGN:
     case KM_PURPOSE_DECRYPT:
-        if (auth_set.Contains(TAG_PURPOSE, purpose))
+        if (policy.has_purpose(purpose))
             return KM_ERROR_OK;
         return KM_ERROR_INCOMPATIBLE_PURPOSE;
 
@@ -108,11 +277,40 @@ inline bool is_usage_purpose(keymaster_purpose_t purpose) {
 KeymasterEnforcement::KeymasterEnforcement(uint32_t max_access_time_map_size,
                                            uint32_t max_access_count_map_size)
     : access_time_map_(new (std::nothrow) AccessTimeMap(max_access_time_map_size)),
-      access_count_map_(new (std::nothrow) AccessCountMap(max_access_count_map_size)) {}
+      access_count_map_(new (std::nothrow) AccessCountMap(max_access_count_map_size)),
+      access_count_log_(nullptr),
+      validated_tokens_(new (std::nothrow) ValidatedTokenCache(kValidatedTokenCacheSize)) {}
 
 KeymasterEnforcement::~KeymasterEnforcement() {
     delete access_time_map_;
     delete access_count_map_;
+    delete access_count_log_;
+    delete validated_tokens_;
+}
+
+keymaster_error_t KeymasterEnforcement::EnablePersistentAccessCounts(const char* path,
+                                                                     uint32_t max_keys) {
+    char boot_id[AccessCountLog::kBootIdSize];
+    if (!AccessCountLog::CurrentBootId(boot_id)) {
+        LOG_E("Can't read boot ID; access counts won't persist", 0);
+        return KM_ERROR_UNIMPLEMENTED;
+    }
+
+    UniquePtr<AccessCountLog> log(new (std::nothrow) AccessCountLog(path, max_keys, boot_id));
+    if (!log.get())
+        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    if (!log->initialized())
+        return KM_ERROR_UNKNOWN_ERROR;
+    UniquePtr<AccessCountMap> map(new (std::nothrow) AccessCountMap(log.get()));
+    if (!map.get())
+        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+
+    std::lock_guard<CountingMutex> lock(access_mutex_);
+    delete access_count_map_;
+    delete access_count_log_;
+    access_count_map_ = map.release();
+    access_count_log_ = log.release();
+    return KM_ERROR_OK;
 }
 
 keymaster_error_t KeymasterEnforcement::AuthorizeOperation(const keymaster_purpose_t purpose,
@@ -141,225 +339,213 @@ keymaster_error_t KeymasterEnforcement::AuthorizeOperation(const keymaster_purpo
         return AuthorizeUpdateOrFinish(auth_set, operation_params, op_handle);
 }
 
+keymaster_error_t
+KeymasterEnforcement::AuthorizeOperation(const keymaster_purpose_t purpose, const km_id_t keyid,
+                                         const KeyPolicy& policy,
+                                         const AuthorizationSet& operation_params) {
+    /* Public key operations are always authorized. */
+    if ((policy.flags & KeyPolicy::PUBLIC_KEY_ALGORITHM) &&
+        (purpose == KM_PURPOSE_ENCRYPT || purpose == KM_PURPOSE_VERIFY))
+        return KM_ERROR_OK;
+
+    return AuthorizeBegin(purpose, keyid, policy, operation_params);
+}
+
 // For update and finish the only thing to check is user authentication, and then only if it's not
 // timeout-based.
 keymaster_error_t
 KeymasterEnforcement::AuthorizeUpdateOrFinish(const AuthorizationSet& auth_set,
                                               const AuthorizationSet& operation_params,
                                               keymaster_operation_handle_t op_handle) {
-    int auth_type_index = -1;
-    for (size_t pos = 0; pos < auth_set.size(); ++pos) {
-        switch (auth_set[pos].tag) {
-        case KM_TAG_NO_AUTH_REQUIRED:
-        case KM_TAG_AUTH_TIMEOUT:
-            // If no auth is required or if auth is timeout-based, we have nothing to check.
-            return KM_ERROR_OK;
-
-        case KM_TAG_USER_AUTH_TYPE:
-            auth_type_index = pos;
-            break;
+    KeyPolicy policy;
+    CompiledAuthorizations compiled;
+    keymaster_error_t error = policy.Compile(auth_set);
+    if (error == KM_ERROR_OK)
+        error = CompileAuthTags(policy, &compiled);
+    if (error != KM_ERROR_OK)
+        return error;
+    return AuthorizeUpdateOrFinish(compiled, operation_params, op_handle);
+}
 
-        default:
-            break;
-        }
-    }
+keymaster_error_t
+KeymasterEnforcement::AuthorizeUpdateOrFinish(const CompiledAuthorizations& compiled,
+                                              const AuthorizationSet& operation_params,
+                                              keymaster_operation_handle_t op_handle) const {
+    if (compiled.flags & CompiledAuthorizations::UPDATE_AND_FINISH_AUTHORIZED)
+        return KM_ERROR_OK;
 
     // Note that at this point we should be able to assume that authentication is required, because
     // authentication is required if KM_TAG_NO_AUTH_REQUIRED is absent.  However, there are legacy
     // keys which have no authentication-related tags, so we assume that absence is equivalent to
     // presence of KM_TAG_NO_AUTH_REQUIRED.
     //
-    // So, if we found KM_TAG_USER_AUTH_TYPE or if we find KM_TAG_USER_SECURE_ID then authentication
-    // is required.  If we find neither, then we assume authentication is not required and return
+    // So, if the key has KM_TAG_USER_AUTH_TYPE or KM_TAG_USER_SECURE_ID then authentication is
+    // required.  If it has neither, then we assume authentication is not required and return
     // success.
-    bool authentication_required = (auth_type_index != -1);
-    for (auto& param : auth_set) {
-        if (param.tag == KM_TAG_USER_SECURE_ID) {
-            authentication_required = true;
-            int auth_timeout_index = -1;
-            if (AuthTokenMatches(auth_set, operation_params, param.long_integer, auth_type_index,
-                                 auth_timeout_index, op_handle, false /* is_begin_operation */))
-                return KM_ERROR_OK;
-        }
-    }
+    if (!(compiled.flags & CompiledAuthorizations::AUTH_REQUIRED))
+        return KM_ERROR_OK;
 
-    if (authentication_required)
+    hw_auth_token_t auth_token;
+    if (compiled.secure_id_count == 0 ||
+        !GetValidAuthToken(operation_params, kMaxValidatedTokenLifetime, &auth_token))
         return KM_ERROR_KEY_USER_NOT_AUTHENTICATED;
 
-    return KM_ERROR_OK;
-}
-
-keymaster_error_t KeymasterEnforcement::AuthorizeBegin(const keymaster_purpose_t purpose,
-                                                       const km_id_t keyid,
-                                                       const AuthorizationSet& auth_set,
-                                                       const AuthorizationSet& operation_params) {
-    // Find some entries that may be needed to handle KM_TAG_USER_SECURE_ID
-    int auth_timeout_index = -1;
-    int auth_type_index = -1;
-    int no_auth_required_index = -1;
-    for (size_t pos = 0; pos < auth_set.size(); ++pos) {
-        switch (auth_set[pos].tag) {
-        case KM_TAG_AUTH_TIMEOUT:
-            auth_timeout_index = pos;
-            break;
-        case KM_TAG_USER_AUTH_TYPE:
-            auth_type_index = pos;
-            break;
-        case KM_TAG_NO_AUTH_REQUIRED:
-            no_auth_required_index = pos;
-            break;
-        default:
-            break;
-        }
+    if (op_handle && op_handle != auth_token.challenge) {
+        LOG_E("Auth token has the challenge %llu, need %llu", auth_token.challenge, op_handle);
+        return KM_ERROR_KEY_USER_NOT_AUTHENTICATED;
     }
 
-    keymaster_error_t error = authorized_purpose(purpose, auth_set);
-    if (error != KM_ERROR_OK)
-        return error;
-
-    // If successful, and if key has a min time between ops, this will be set to the time limit
-    uint32_t min_ops_timeout = UINT32_MAX;
-
-    bool update_access_count = false;
-    bool caller_nonce_authorized_by_key = false;
-    bool authentication_required = false;
-    bool auth_token_matched = false;
-
-    for (auto& param : auth_set) {
-
-        // KM_TAG_PADDING_OLD and KM_TAG_DIGEST_OLD aren't actually members of the enum, so we can't
-        // switch on them.  There's nothing to validate for them, though, so just ignore them.
-        if (param.tag == KM_TAG_PADDING_OLD || param.tag == KM_TAG_DIGEST_OLD)
-            continue;
-
-        switch (param.tag) {
-
-        case KM_TAG_ACTIVE_DATETIME:
-            if (!activation_date_valid(param.date_time))
-                return KM_ERROR_KEY_NOT_YET_VALID;
-            break;
+    if (!(compiled.flags & CompiledAuthorizations::HAS_AUTH_TYPE)) {
+        LOG_E("Auth required but no auth type found", 0);
+        return KM_ERROR_KEY_USER_NOT_AUTHENTICATED;
+    }
 
-        case KM_TAG_ORIGINATION_EXPIRE_DATETIME:
-            if (is_origination_purpose(purpose) && expiration_date_passed(param.date_time))
-                return KM_ERROR_KEY_EXPIRED;
-            break;
+    uint32_t token_auth_type = ntoh(auth_token.authenticator_type);
+    if ((compiled.auth_type & token_auth_type) == 0) {
+        LOG_E("Key requires match of auth type mask 0%uo, but token contained 0%uo",
+              compiled.auth_type, token_auth_type);
+        return KM_ERROR_KEY_USER_NOT_AUTHENTICATED;
+    }
 
-        case KM_TAG_USAGE_EXPIRE_DATETIME:
-            if (is_usage_purpose(purpose) && expiration_date_passed(param.date_time))
-                return KM_ERROR_KEY_EXPIRED;
-            break;
+    for (size_t i = 0; i < compiled.secure_id_count; ++i) {
+        uint64_t user_secure_id = compiled.secure_ids[i];
+        if (user_secure_id == auth_token.user_id || user_secure_id == auth_token.authenticator_id)
+            return KM_ERROR_OK;
+    }
 
-        case KM_TAG_MIN_SECONDS_BETWEEN_OPS:
-            min_ops_timeout = param.integer;
-            if (!MinTimeBetweenOpsPassed(min_ops_timeout, keyid))
-                return KM_ERROR_KEY_RATE_LIMIT_EXCEEDED;
-            break;
+    LOG_I("Auth token SIDs %llu and %llu do not match any key SID", auth_token.user_id,
+          auth_token.authenticator_id);
+    return KM_ERROR_KEY_USER_NOT_AUTHENTICATED;
+}
 
-        case KM_TAG_MAX_USES_PER_BOOT:
-            update_access_count = true;
-            if (!MaxUsesPerBootNotExceeded(keyid, param.integer))
-                return KM_ERROR_KEY_MAX_OPS_EXCEEDED;
-            break;
+/* static */
+keymaster_error_t KeymasterEnforcement::CompileAuthorizations(keymaster_purpose_t purpose,
+                                                              const AuthorizationSet& auth_set,
+                                                              CompiledAuthorizations* compiled) {
+    KeyPolicy policy;
+    keymaster_error_t error = policy.Compile(auth_set);
+    if (error != KM_ERROR_OK)
+        return error;
+    return CompileAuthorizations(purpose, policy, compiled);
+}
 
-        case KM_TAG_USER_SECURE_ID:
-            if (no_auth_required_index != -1) {
-                // Key has both KM_TAG_USER_SECURE_ID and KM_TAG_NO_AUTH_REQUIRED
-                return KM_ERROR_INVALID_KEY_BLOB;
-            }
+/* static */
+keymaster_error_t KeymasterEnforcement::CompileAuthorizations(keymaster_purpose_t purpose,
+                                                              const KeyPolicy& policy,
+                                                              CompiledAuthorizations* compiled) {
+    keymaster_error_t error = CompileAuthTags(policy, compiled);
+    if (error != KM_ERROR_OK)
+        return error;
 
-            if (auth_timeout_index != -1) {
-                authentication_required = true;
-                if (AuthTokenMatches(auth_set, operation_params, param.long_integer,
-                                     auth_type_index, auth_timeout_index, 0 /* op_handle */,
-                                     true /* is_begin_operation */))
-                    auth_token_matched = true;
-            }
-            break;
+    // Mirrors the public key check in AuthorizeOperation.
+    if ((policy.flags & KeyPolicy::PUBLIC_KEY_ALGORITHM) &&
+        (purpose == KM_PURPOSE_ENCRYPT || purpose == KM_PURPOSE_VERIFY))
+        compiled->flags |= CompiledAuthorizations::UPDATE_AND_FINISH_AUTHORIZED;
+    return KM_ERROR_OK;
+}
 
-        case KM_TAG_CALLER_NONCE:
-            caller_nonce_authorized_by_key = true;
-            break;
+/* static */
+keymaster_error_t KeymasterEnforcement::CompileAuthTags(const KeyPolicy& policy,
+                                                        CompiledAuthorizations* compiled) {
+    compiled->flags = 0;
+    compiled->auth_type = policy.user_auth_type;
+    compiled->auth_timeout = policy.auth_timeout;
+    compiled->secure_id_count = 0;
+    compiled->secure_ids.reset();
+
+    if (policy.flags & KeyPolicy::NO_AUTH_REQUIRED)
+        compiled->flags |= CompiledAuthorizations::UPDATE_AND_FINISH_AUTHORIZED;
+    // Timeout-based authentication is entirely checked at Begin.
+    if (policy.flags & KeyPolicy::HAS_AUTH_TIMEOUT)
+        compiled->flags |= CompiledAuthorizations::UPDATE_AND_FINISH_AUTHORIZED |
+                           CompiledAuthorizations::HAS_AUTH_TIMEOUT;
+    if (policy.flags & KeyPolicy::HAS_USER_AUTH_TYPE)
+        compiled->flags |=
+            CompiledAuthorizations::AUTH_REQUIRED | CompiledAuthorizations::HAS_AUTH_TYPE;
+    if (policy.secure_id_count == 0)
+        return KM_ERROR_OK;
+
+    compiled->flags |= CompiledAuthorizations::AUTH_REQUIRED;
+    compiled->secure_ids.reset(new (std::nothrow) uint64_t[policy.secure_id_count]);
+    if (!compiled->secure_ids.get())
+        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    memcpy(compiled->secure_ids.get(), policy.secure_ids.get(),
+           policy.secure_id_count * sizeof(uint64_t));
+    compiled->secure_id_count = policy.secure_id_count;
+    return KM_ERROR_OK;
+}
 
-        /* Tags should never be in key auths. */
-        case KM_TAG_INVALID:
-        case KM_TAG_AUTH_TOKEN:
-        case KM_TAG_ROOT_OF_TRUST:
-        case KM_TAG_APPLICATION_DATA:
-        case KM_TAG_ATTESTATION_CHALLENGE:
-            return KM_ERROR_INVALID_KEY_BLOB;
-
-        /* Tags used for cryptographic parameters in keygen.  Nothing to enforce. */
-        case KM_TAG_PURPOSE:
-        case KM_TAG_ALGORITHM:
-        case KM_TAG_KEY_SIZE:
-        case KM_TAG_BLOCK_MODE:
-        case KM_TAG_DIGEST:
-        case KM_TAG_MAC_LENGTH:
-        case KM_TAG_PADDING:
-        case KM_TAG_NONCE:
-        case KM_TAG_MIN_MAC_LENGTH:
-        case KM_TAG_KDF:
-        case KM_TAG_EC_CURVE:
-
-        /* Tags not used for operations. */
-        case KM_TAG_BLOB_USAGE_REQUIREMENTS:
-        case KM_TAG_EXPORTABLE:
-
-        /* Algorithm specific parameters not used for access control. */
-        case KM_TAG_RSA_PUBLIC_EXPONENT:
-        case KM_TAG_ECIES_SINGLE_HASH_MODE:
-
-        /* Informational tags. */
-        case KM_TAG_CREATION_DATETIME:
-        case KM_TAG_ORIGIN:
-        case KM_TAG_ROLLBACK_RESISTANT:
-
-        /* Tags handled when KM_TAG_USER_SECURE_ID is handled */
-        case KM_TAG_NO_AUTH_REQUIRED:
-        case KM_TAG_USER_AUTH_TYPE:
-        case KM_TAG_AUTH_TIMEOUT:
-
-        /* Tag to provide data to operations. */
-        case KM_TAG_ASSOCIATED_DATA:
-
-        /* Tags that are implicitly verified by secure side */
-        case KM_TAG_ALL_APPLICATIONS:
-        case KM_TAG_APPLICATION_ID:
-        case KM_TAG_OS_VERSION:
-        case KM_TAG_OS_PATCHLEVEL:
-
-        /* Ignored pending removal */
-        case KM_TAG_USER_ID:
-        case KM_TAG_ALL_USERS:
-
-        /* TODO(swillden): Handle these */
-        case KM_TAG_INCLUDE_UNIQUE_ID:
-        case KM_TAG_UNIQUE_ID:
-        case KM_TAG_RESET_SINCE_ID_ROTATION:
-        case KM_TAG_ALLOW_WHILE_ON_BODY:
-            break;
+keymaster_error_t KeymasterEnforcement::AuthorizeBegin(const keymaster_purpose_t purpose,
+                                                       const km_id_t keyid,
+                                                       const AuthorizationSet& auth_set,
+                                                       const AuthorizationSet& operation_params) {
+    KeyPolicy policy;
+    keymaster_error_t error = policy.Compile(auth_set);
+    if (error != KM_ERROR_OK)
+        return error;
+    return AuthorizeBegin(purpose, keyid, policy, operation_params);
+}
 
-        case KM_TAG_BOOTLOADER_ONLY:
-            return KM_ERROR_INVALID_KEY_BLOB;
-        }
-    }
+keymaster_error_t KeymasterEnforcement::AuthorizeBegin(const keymaster_purpose_t purpose,
+                                                       const km_id_t keyid,
+                                                       const KeyPolicy& policy,
+                                                       const AuthorizationSet& operation_params) {
+    keymaster_error_t error = authorized_purpose(purpose, policy);
+    if (error != KM_ERROR_OK)
+        return error;
 
-    if (authentication_required && !auth_token_matched) {
+    if (policy.flags & KeyPolicy::INVALID_TAG)
+        return KM_ERROR_INVALID_KEY_BLOB;
+
+    if (policy.secure_id_count > 0 && (policy.flags & KeyPolicy::NO_AUTH_REQUIRED))
+        // Key has both KM_TAG_USER_SECURE_ID and KM_TAG_NO_AUTH_REQUIRED
+        return KM_ERROR_INVALID_KEY_BLOB;
+
+    if ((policy.flags & KeyPolicy::HAS_ACTIVE_DATETIME) &&
+        !activation_date_valid(policy.active_datetime))
+        return KM_ERROR_KEY_NOT_YET_VALID;
+
+    if ((policy.flags & KeyPolicy::HAS_ORIGINATION_EXPIRE_DATETIME) &&
+        is_origination_purpose(purpose) &&
+        expiration_date_passed(policy.origination_expire_datetime))
+        return KM_ERROR_KEY_EXPIRED;
+
+    if ((policy.flags & KeyPolicy::HAS_USAGE_EXPIRE_DATETIME) && is_usage_purpose(purpose) &&
+        expiration_date_passed(policy.usage_expire_datetime))
+        return KM_ERROR_KEY_EXPIRED;
+
+    bool rate_limited = policy.flags & KeyPolicy::HAS_MIN_SECONDS_BETWEEN_OPS;
+    bool update_access_count = policy.flags & KeyPolicy::HAS_MAX_USES_PER_BOOT;
+    // Held from the checks of the key's access entries until they're updated, so that concurrent
+    // Begins can't both pass a check that only one of them should.
+    std::unique_lock<CountingMutex> access_lock(access_mutex_, std::defer_lock);
+    if (rate_limited || update_access_count)
+        access_lock.lock();
+    if (rate_limited && !MinTimeBetweenOpsPassed(policy.min_seconds_between_ops, keyid))
+        return KM_ERROR_KEY_RATE_LIMIT_EXCEEDED;
+
+    if (update_access_count && !MaxUsesPerBootNotExceeded(keyid, policy.max_uses_per_boot))
+        return KM_ERROR_KEY_MAX_OPS_EXCEEDED;
+
+    // Per-operation authentication is checked at Update and Finish, against the operation handle.
+    if (policy.secure_id_count > 0 && (policy.flags & KeyPolicy::HAS_AUTH_TIMEOUT) &&
+        !AuthTokenMatches(policy, operation_params)) {
         LOG_E("Auth required but no matching auth token found", 0);
         return KM_ERROR_KEY_USER_NOT_AUTHENTICATED;
     }
 
-    if (!caller_nonce_authorized_by_key && is_origination_purpose(purpose) &&
+    if (!(policy.flags & KeyPolicy::CALLER_NONCE) && is_origination_purpose(purpose) &&
         operation_params.find(KM_TAG_NONCE) != -1)
         return KM_ERROR_CALLER_NONCE_PROHIBITED;
 
-    if (min_ops_timeout != UINT32_MAX) {
+    if (rate_limited) {
         if (!access_time_map_) {
             LOG_S("Rate-limited keys table not allocated.  Rate-limited keys disabled", 0);
             return KM_ERROR_MEMORY_ALLOCATION_FAILED;
         }
 
-        if (!access_time_map_->UpdateKeyAccessTime(keyid, get_current_time(), min_ops_timeout)) {
+        if (!access_time_map_->UpdateKeyAccessTime(keyid, get_current_time(),
+                                                   policy.min_seconds_between_ops)) {
             LOG_E("Rate-limited keys table full.  Entries will time out.", 0);
             return KM_ERROR_TOO_MANY_OPERATIONS;
         }
@@ -400,14 +586,20 @@ bool KeymasterEnforcement::CreateKeyId(const keymaster_key_blob_t& key_blob, km_
     if (EVP_DigestInit_ex(ctx.get(), EVP_sha256(), nullptr /* ENGINE */) &&
         EVP_DigestUpdate(ctx.get(), key_blob.key_material, key_blob.key_material_size) &&
         EVP_DigestFinal_ex(ctx.get(), hash, &hash_len)) {
-        assert(hash_len >= sizeof(*keyid));
-        memcpy(keyid, hash, sizeof(*keyid));
+        assert(hash_len == 32);
+        CreateKeyId(hash, keyid);
         return true;
     }
 
     return false;
 }
 
+/* static */
+void KeymasterEnforcement::CreateKeyId(const uint8_t blob_sha256_digest[32], km_id_t* keyid) {
+    static_assert(sizeof(*keyid) <= 32, "Key IDs must fit in a SHA-256 digest");
+    memcpy(keyid, blob_sha256_digest, sizeof(*keyid));
+}
+
 bool KeymasterEnforcement::MinTimeBetweenOpsPassed(uint32_t min_time_between, const km_id_t keyid) {
     if (!access_time_map_)
         return false;
@@ -428,15 +620,9 @@ bool KeymasterEnforcement::MaxUsesPerBootNotExceeded(const km_id_t keyid, uint32
     return key_access_count < max_uses;
 }
 
-bool KeymasterEnforcement::AuthTokenMatches(const AuthorizationSet& auth_set,
-                                            const AuthorizationSet& operation_params,
-                                            const uint64_t user_secure_id,
-                                            const int auth_type_index, const int auth_timeout_index,
-                                            const keymaster_operation_handle_t op_handle,
-                                            bool is_begin_operation) const {
-    assert(auth_type_index < static_cast<int>(auth_set.size()));
-    assert(auth_timeout_index < static_cast<int>(auth_set.size()));
-
+bool KeymasterEnforcement::GetValidAuthToken(const AuthorizationSet& operation_params,
+                                             uint32_t max_cache_lifetime,
+                                             hw_auth_token_t* auth_token) const {
     keymaster_blob_t auth_token_blob;
     if (!operation_params.GetTagValue(TAG_AUTH_TOKEN, &auth_token_blob)) {
         LOG_E("Authentication required, but auth token not provided", 0);
@@ -449,56 +635,62 @@ bool KeymasterEnforcement::AuthTokenMatches(const AuthorizationSet& auth_set,
         return false;
     }
 
-    hw_auth_token_t auth_token;
-    memcpy(&auth_token, auth_token_blob.data, sizeof(hw_auth_token_t));
-    if (auth_token.version != HW_AUTH_TOKEN_VERSION) {
+    memcpy(auth_token, auth_token_blob.data, sizeof(hw_auth_token_t));
+    if (auth_token->version != HW_AUTH_TOKEN_VERSION) {
         LOG_E("Bug: Auth token is the version %d (or is not an auth token). Expected %d",
-              auth_token.version, HW_AUTH_TOKEN_VERSION);
+              auth_token->version, HW_AUTH_TOKEN_VERSION);
         return false;
     }
 
-    if (!ValidateTokenSignature(auth_token)) {
+    uint32_t current_time = get_current_time();
+    if (validated_tokens_ && validated_tokens_->Contains(*auth_token, current_time))
+        return true;
+
+    if (!ValidateTokenSignature(*auth_token)) {
         LOG_E("Auth token signature invalid", 0);
         return false;
     }
 
-    if (auth_timeout_index == -1 && op_handle && op_handle != auth_token.challenge) {
-        LOG_E("Auth token has the challenge %llu, need %llu", auth_token.challenge, op_handle);
-        return false;
+    if (validated_tokens_) {
+        if (max_cache_lifetime > kMaxValidatedTokenLifetime)
+            max_cache_lifetime = kMaxValidatedTokenLifetime;
+        validated_tokens_->Insert(*auth_token, current_time, max_cache_lifetime);
     }
+    return true;
+}
 
-    if (user_secure_id != auth_token.user_id && user_secure_id != auth_token.authenticator_id) {
-        LOG_I("Auth token SIDs %llu and %llu do not match key SID %llu", auth_token.user_id,
-              auth_token.authenticator_id, user_secure_id);
+bool KeymasterEnforcement::AuthTokenMatches(const KeyPolicy& policy,
+                                            const AuthorizationSet& operation_params) const {
+    // A validated timeout-based token is never trusted for longer than its keys allow.
+    hw_auth_token_t auth_token;
+    if (!GetValidAuthToken(operation_params, policy.auth_timeout, &auth_token))
         return false;
-    }
 
-    if (auth_type_index < 0 || auth_type_index > static_cast<int>(auth_set.size())) {
-        LOG_E("Auth required but no auth type found", 0);
+    bool secure_id_matched = false;
+    for (size_t i = 0; i < policy.secure_id_count && !secure_id_matched; ++i)
+        secure_id_matched = policy.secure_ids[i] == auth_token.user_id ||
+                            policy.secure_ids[i] == auth_token.authenticator_id;
+    if (!secure_id_matched) {
+        LOG_I("Auth token SIDs %llu and %llu do not match any key SID", auth_token.user_id,
+              auth_token.authenticator_id);
         return false;
     }
 
-    assert(auth_set[auth_type_index].tag == KM_TAG_USER_AUTH_TYPE);
-    if (auth_set[auth_type_index].tag != KM_TAG_USER_AUTH_TYPE)
+    if (!(policy.flags & KeyPolicy::HAS_USER_AUTH_TYPE)) {
+        LOG_E("Auth required but no auth type found", 0);
         return false;
+    }
 
-    uint32_t key_auth_type_mask = auth_set[auth_type_index].integer;
     uint32_t token_auth_type = ntoh(auth_token.authenticator_type);
-    if ((key_auth_type_mask & token_auth_type) == 0) {
+    if ((policy.user_auth_type & token_auth_type) == 0) {
         LOG_E("Key requires match of auth type mask 0%uo, but token contained 0%uo",
-              key_auth_type_mask, token_auth_type);
+              policy.user_auth_type, token_auth_type);
         return false;
     }
 
-    if (auth_timeout_index != -1 && is_begin_operation) {
-        assert(auth_set[auth_timeout_index].tag == KM_TAG_AUTH_TIMEOUT);
-        if (auth_set[auth_timeout_index].tag != KM_TAG_AUTH_TIMEOUT)
-            return false;
-
-        if (auth_token_timed_out(auth_token, auth_set[auth_timeout_index].integer)) {
-            LOG_E("Auth token has timed out", 0);
-            return false;
-        }
+    if (auth_token_timed_out(auth_token, policy.auth_timeout)) {
+        LOG_E("Auth token has timed out", 0);
+        return false;
     }
 
     // Survived the whole gauntlet.  We have authentage!
@@ -506,70 +698,93 @@ bool KeymasterEnforcement::AuthTokenMatches(const AuthorizationSet& auth_set,
 }
 
 bool AccessTimeMap::LastKeyAccessTime(km_id_t keyid, uint32_t* last_access_time) const {
-    for (auto& entry : last_access_list_)
-        if (entry.keyid == keyid) {
-            *last_access_time = entry.access_time;
-            return true;
-        }
-    return false;
+    const AccessTime* entry = table_.Find(keyid);
+    if (!entry)
+        return false;
+    *last_access_time = entry->access_time;
+    return true;
 }
 
 bool AccessTimeMap::UpdateKeyAccessTime(km_id_t keyid, uint32_t current_time, uint32_t timeout) {
-    List<AccessTime>::iterator iter;
-    for (iter = last_access_list_.begin(); iter != last_access_list_.end();) {
-        if (iter->keyid == keyid) {
-            iter->access_time = current_time;
-            return true;
-        }
+    AccessTime* entry = table_.Find(keyid);
+    if (entry) {
+        entry->access_time = current_time;
+        return true;
+    }
 
-        // Expire entry if possible.
-        assert(current_time >= iter->access_time);
-        if (current_time - iter->access_time >= iter->timeout)
-            iter = last_access_list_.erase(iter);
-        else
-            ++iter;
+    // Expired entries are left in place until space is needed, then removed in one pass.  An
+    // expired entry that lingers is harmless, since by definition its key may be used again.
+    if (table_.full() && current_time >= next_expiry_) {
+        uint64_t next_expiry = UINT64_MAX;
+        table_.RemoveIf([&](const AccessTime& entry) {
+            assert(current_time >= entry.access_time);
+            if (current_time >= expiry(entry))
+                return true;
+            if (expiry(entry) < next_expiry)
+                next_expiry = expiry(entry);
+            return false;
+        });
+        next_expiry_ = next_expiry;
     }
 
-    if (last_access_list_.size() >= max_size_)
+    entry = table_.Insert(keyid);
+    if (!entry)
         return false;
-
-    AccessTime new_entry;
-    new_entry.keyid = keyid;
-    new_entry.access_time = current_time;
-    new_entry.timeout = timeout;
-    last_access_list_.push_front(new_entry);
+    entry->access_time = current_time;
+    entry->timeout = timeout;
+    if (expiry(*entry) < next_expiry_)
+        next_expiry_ = expiry(*entry);
     return true;
 }
 
+AccessCountMap::AccessCountMap(AccessCountLog* log) : table_(log->capacity()), log_(log) {
+    uint32_t records = log->size();
+    for (uint32_t i = 0; i < records; ++i) {
+        AccessCountLog::Record* record = log->record(i);
+        AccessCount* entry = table_.Find(record->keyid);
+        if (!entry)
+            entry = table_.Insert(record->keyid);
+        if (!entry)
+            break;
+        entry->access_count = record->count;
+        entry->record = record;
+    }
+}
+
 bool AccessCountMap::KeyAccessCount(km_id_t keyid, uint32_t* count) const {
-    for (auto& entry : access_count_list_)
-        if (entry.keyid == keyid) {
-            *count = entry.access_count;
-            return true;
-        }
-    return false;
+    const AccessCount* entry = table_.Find(keyid);
+    if (!entry)
+        return false;
+    *count = entry->access_count;
+    return true;
 }
 
 bool AccessCountMap::IncrementKeyAccessCount(km_id_t keyid) {
-    for (auto& entry : access_count_list_)
-        if (entry.keyid == keyid) {
-            // Note that the 'if' below will always be true because KM_TAG_MAX_USES_PER_BOOT is a
-            // uint32_t, and as soon as entry.access_count reaches the specified maximum value
-            // operation requests will be rejected and access_count won't be incremented any more.
-            // And, besides, UINT64_MAX is huge.  But we ensure that it doesn't wrap anyway, out of
-            // an abundance of caution.
-            if (entry.access_count < UINT64_MAX)
-                ++entry.access_count;
-            return true;
-        }
+    AccessCount* entry = table_.Find(keyid);
+    if (entry) {
+        // Note that the 'if' below will always be true because KM_TAG_MAX_USES_PER_BOOT is a
+        // uint32_t, and as soon as entry.access_count reaches the specified maximum value
+        // operation requests will be rejected and access_count won't be incremented any more.
+        // And, besides, UINT64_MAX is huge.  But we ensure that it doesn't wrap anyway, out of
+        // an abundance of caution.
+        if (entry->access_count < UINT64_MAX)
+            ++entry->access_count;
+        if (entry->record)
+            entry->record->count = entry->access_count;
+        return true;
+    }
 
-    if (access_count_list_.size() >= max_size_)
+    if (table_.full())
         return false;
-
-    AccessCount new_entry;
-    new_entry.keyid = keyid;
-    new_entry.access_count = 1;
-    access_count_list_.push_front(new_entry);
+    AccessCountLog::Record* record = nullptr;
+    if (log_) {
+        record = log_->Append(keyid, 1);
+        if (!record)
+            return false;
+    }
+    entry = table_.Insert(keyid);
+    entry->access_count = 1;
+    entry->record = record;
     return true;
 }
 }; /* namespace keymaster */
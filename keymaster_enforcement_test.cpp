@@ -18,6 +18,11 @@
 #include <stdio.h>
 #include <time.h>
 
+#include <atomic>
+#include <thread>
+
+#include <openssl/sha.h>
+
 #include <keymaster/android_keymaster.h>
 #include <keymaster/authorization_set.h>
 #include <keymaster/keymaster_enforcement.h>
@@ -30,7 +35,8 @@ namespace test {
 class TestKeymasterEnforcement : public KeymasterEnforcement {
   public:
     TestKeymasterEnforcement()
-        : KeymasterEnforcement(3, 3), current_time_(10000), report_token_valid_(true) {}
+        : KeymasterEnforcement(3, 3), current_time_(10000), report_token_valid_(true),
+          signature_checks_(0) {}
 
     keymaster_error_t AuthorizeOperation(const keymaster_purpose_t purpose, const km_id_t keyid,
                                          const AuthorizationSet& auth_set) {
@@ -55,6 +61,7 @@ class TestKeymasterEnforcement : public KeymasterEnforcement {
         return current_time_ > ntoh(token.timestamp) + timeout;
     }
     bool ValidateTokenSignature(const hw_auth_token_t&) const override {
+        ++signature_checks_;
         return report_token_valid_;
     }
 
@@ -63,10 +70,12 @@ class TestKeymasterEnforcement : public KeymasterEnforcement {
     void set_report_token_valid(bool report_token_valid) {
         report_token_valid_ = report_token_valid;
     }
+    size_t signature_checks() const { return signature_checks_; }
 
   private:
     uint32_t current_time_;
     bool report_token_valid_;
+    mutable size_t signature_checks_;
 };
 
 class KeymasterBaseTest : public ::testing::Test {
@@ -256,6 +265,26 @@ TEST_F(KeymasterBaseTest, TestInvalidMaxOps) {
     ASSERT_EQ(KM_ERROR_OK, kmen.AuthorizeOperation(KM_PURPOSE_VERIFY, key_id, auth_set));
 }
 
+TEST_F(KeymasterBaseTest, TestMaxOpsConcurrentBegins) {
+    AuthorizationSet auth_set(AuthorizationSetBuilder()
+                                  .Authorization(TAG_PURPOSE, KM_PURPOSE_SIGN)
+                                  .Authorization(TAG_ALGORITHM, KM_ALGORITHM_RSA)
+                                  .Authorization(TAG_MAX_USES_PER_BOOT, 100));
+
+    // However the Begins interleave, exactly the allowed number succeed.
+    std::atomic<int> authorized(0);
+    std::thread threads[8];
+    for (auto& thread : threads)
+        thread = std::thread([&] {
+            for (int i = 0; i < 50; ++i)
+                if (kmen.AuthorizeOperation(KM_PURPOSE_SIGN, key_id, auth_set) == KM_ERROR_OK)
+                    ++authorized;
+        });
+    for (auto& thread : threads)
+        thread.join();
+    EXPECT_EQ(100, authorized.load());
+}
+
 TEST_F(KeymasterBaseTest, TestOverFlowMaxOpsTable) {
     keymaster_key_param_t params[] = {
         Authorization(TAG_ALGORITHM, KM_ALGORITHM_RSA), Authorization(TAG_PURPOSE, KM_PURPOSE_SIGN),
@@ -290,6 +319,34 @@ TEST_F(KeymasterBaseTest, TestOverFlowMaxOpsTable) {
     EXPECT_EQ(KM_ERROR_OK, kmen.AuthorizeOperation(KM_PURPOSE_VERIFY, 4 /* key_id */, auth_set));
 }
 
+TEST_F(KeymasterBaseTest, TestPersistentMaxOpsSurviveRestart) {
+    keymaster_key_param_t params[] = {
+        Authorization(TAG_PURPOSE, KM_PURPOSE_SIGN), Authorization(TAG_ALGORITHM, KM_ALGORITHM_RSA),
+        Authorization(TAG_MAX_USES_PER_BOOT, 4),
+    };
+    AuthorizationSet auth_set(params, array_length(params));
+
+    TempFile file("keymaster_enforcement_test");
+    ASSERT_TRUE(file.created());
+
+    {
+        TestKeymasterEnforcement first;
+        keymaster_error_t error = first.EnablePersistentAccessCounts(file.path(), 16);
+        if (error == KM_ERROR_UNIMPLEMENTED)
+            return;  // No boot ID available.
+        ASSERT_EQ(KM_ERROR_OK, error);
+        for (int i = 0; i < 3; ++i)
+            ASSERT_EQ(KM_ERROR_OK, first.AuthorizeOperation(KM_PURPOSE_SIGN, key_id, auth_set));
+    }
+
+    // A new instance, as after a keymaster restart, remembers the three uses.
+    TestKeymasterEnforcement second;
+    ASSERT_EQ(KM_ERROR_OK, second.EnablePersistentAccessCounts(file.path(), 16));
+    EXPECT_EQ(KM_ERROR_OK, second.AuthorizeOperation(KM_PURPOSE_SIGN, key_id, auth_set));
+    EXPECT_EQ(KM_ERROR_KEY_MAX_OPS_EXCEEDED,
+              second.AuthorizeOperation(KM_PURPOSE_SIGN, key_id, auth_set));
+}
+
 TEST_F(KeymasterBaseTest, TestInvalidTimeBetweenOps) {
     keymaster_key_param_t params[] = {
         Authorization(TAG_ALGORITHM, KM_ALGORITHM_RSA), Authorization(TAG_PURPOSE, KM_PURPOSE_SIGN),
@@ -407,6 +464,32 @@ TEST_F(KeymasterBaseTest, TestOptTimeoutTableOverflow) {
     EXPECT_EQ(KM_ERROR_OK, kmen.AuthorizeOperation(KM_PURPOSE_VERIFY, 3 /* key_id */, auth_set));
 }
 
+TEST_F(KeymasterBaseTest, TestOptTimeoutTableChurn) {
+    keymaster_key_param_t params[] = {
+        Authorization(TAG_ALGORITHM, KM_ALGORITHM_AES),
+        Authorization(TAG_MIN_SECONDS_BETWEEN_OPS, 2),
+        Authorization(TAG_PURPOSE, KM_PURPOSE_VERIFY),
+    };
+
+    AuthorizationSet auth_set(params, array_length(params));
+
+    // Cycle many keys through the table, so entries are repeatedly expired and replaced.
+    for (uint64_t round = 0; round < 100; ++round) {
+        km_id_t base = round << 32;
+        for (km_id_t key_id = base; key_id < base + 3; ++key_id)
+            EXPECT_EQ(KM_ERROR_OK, kmen.AuthorizeOperation(KM_PURPOSE_VERIFY, key_id, auth_set))
+                << "round " << round;
+        for (km_id_t key_id = base; key_id < base + 3; ++key_id)
+            EXPECT_EQ(KM_ERROR_KEY_RATE_LIMIT_EXCEEDED,
+                      kmen.AuthorizeOperation(KM_PURPOSE_VERIFY, key_id, auth_set))
+                << "round " << round;
+        EXPECT_EQ(KM_ERROR_TOO_MANY_OPERATIONS,
+                  kmen.AuthorizeOperation(KM_PURPOSE_VERIFY, base + 3, auth_set))
+            << "round " << round;
+        kmen.tick(2);
+    }
+}
+
 TEST_F(KeymasterBaseTest, TestPubkeyOptTimeoutTableOverflow) {
     keymaster_key_param_t params[] = {
         Authorization(TAG_ALGORITHM, KM_ALGORITHM_RSA),
@@ -742,6 +825,101 @@ TEST_F(KeymasterBaseTest, TestAuthPerOpMissingToken) {
                                       token.challenge, false /* is_begin_operation */));
 }
 
+TEST_F(KeymasterBaseTest, TestAuthPerOpCompiled) {
+    hw_auth_token_t token;
+    memset(&token, 0, sizeof(token));
+    token.version = HW_AUTH_TOKEN_VERSION;
+    token.challenge = 99;
+    token.user_id = 9;
+    token.authenticator_id = 10;
+    token.authenticator_type = hton(static_cast<uint32_t>(HW_AUTH_PASSWORD));
+    token.timestamp = 0;
+
+    AuthorizationSet auth_set(AuthorizationSetBuilder()
+                                  .Authorization(TAG_ALGORITHM, KM_ALGORITHM_EC)
+                                  .Authorization(TAG_USER_SECURE_ID, 1)
+                                  .Authorization(TAG_USER_SECURE_ID, token.authenticator_id)
+                                  .Authorization(TAG_USER_AUTH_TYPE, HW_AUTH_PASSWORD)
+                                  .Authorization(TAG_PURPOSE, KM_PURPOSE_SIGN)
+                                  .Authorization(TAG_PURPOSE, KM_PURPOSE_VERIFY));
+
+    CompiledAuthorizations compiled;
+    ASSERT_EQ(KM_ERROR_OK,
+              KeymasterEnforcement::CompileAuthorizations(KM_PURPOSE_SIGN, auth_set, &compiled));
+    EXPECT_EQ(2U, compiled.secure_id_count);
+
+    AuthorizationSet op_params;
+    op_params.push_back(Authorization(TAG_AUTH_TOKEN, &token, sizeof(token)));
+    EXPECT_EQ(KM_ERROR_OK, kmen.AuthorizeUpdate(compiled, op_params, token.challenge));
+    EXPECT_EQ(KM_ERROR_OK, kmen.AuthorizeFinish(compiled, op_params, token.challenge));
+    EXPECT_EQ(KM_ERROR_KEY_USER_NOT_AUTHENTICATED,
+              kmen.AuthorizeUpdate(compiled, op_params, token.challenge + 1));
+    EXPECT_EQ(KM_ERROR_KEY_USER_NOT_AUTHENTICATED,
+              kmen.AuthorizeFinish(compiled, AuthorizationSet(), token.challenge));
+
+    // Public key verification needs no token.
+    CompiledAuthorizations verify;
+    ASSERT_EQ(KM_ERROR_OK,
+              KeymasterEnforcement::CompileAuthorizations(KM_PURPOSE_VERIFY, auth_set, &verify));
+    EXPECT_EQ(KM_ERROR_OK, kmen.AuthorizeUpdate(verify, AuthorizationSet(), token.challenge));
+
+    token.authenticator_id = 11;
+    op_params.Clear();
+    op_params.push_back(Authorization(TAG_AUTH_TOKEN, &token, sizeof(token)));
+    EXPECT_EQ(KM_ERROR_KEY_USER_NOT_AUTHENTICATED,
+              kmen.AuthorizeUpdate(compiled, op_params, token.challenge));
+
+    // The compiled and uncompiled paths agree.
+    EXPECT_EQ(KM_ERROR_KEY_USER_NOT_AUTHENTICATED,
+              kmen.AuthorizeOperation(KM_PURPOSE_SIGN, key_id, auth_set, op_params, token.challenge,
+                                      false /* is_begin_operation */));
+}
+
+TEST_F(KeymasterBaseTest, TestAuthPerOpTokenValidatedOnce) {
+    hw_auth_token_t token;
+    memset(&token, 0, sizeof(token));
+    token.version = HW_AUTH_TOKEN_VERSION;
+    token.challenge = 99;
+    token.user_id = 9;
+    token.authenticator_id = 0;
+    token.authenticator_type = hton(static_cast<uint32_t>(HW_AUTH_PASSWORD));
+    token.timestamp = 0;
+
+    AuthorizationSet auth_set(AuthorizationSetBuilder()
+                                  .Authorization(TAG_USER_SECURE_ID, token.user_id)
+                                  .Authorization(TAG_USER_AUTH_TYPE, HW_AUTH_ANY)
+                                  .Authorization(TAG_PURPOSE, KM_PURPOSE_SIGN));
+
+    AuthorizationSet op_params;
+    op_params.push_back(Authorization(TAG_AUTH_TOKEN, &token, sizeof(token)));
+
+    for (int i = 0; i < 10; ++i)
+        EXPECT_EQ(KM_ERROR_OK, kmen.AuthorizeOperation(KM_PURPOSE_SIGN, key_id, auth_set, op_params,
+                                                       token.challenge,
+                                                       false /* is_begin_operation */));
+    EXPECT_EQ(1U, kmen.signature_checks());
+
+    // A token differing in any field is validated separately.
+    token.hmac[0] ^= 1;
+    op_params.Clear();
+    op_params.push_back(Authorization(TAG_AUTH_TOKEN, &token, sizeof(token)));
+    kmen.set_report_token_valid(false);
+    EXPECT_EQ(KM_ERROR_KEY_USER_NOT_AUTHENTICATED,
+              kmen.AuthorizeOperation(KM_PURPOSE_SIGN, key_id, auth_set, op_params, token.challenge,
+                                      false /* is_begin_operation */));
+    EXPECT_EQ(2U, kmen.signature_checks());
+
+    // Cached validations expire.
+    token.hmac[0] ^= 1;
+    op_params.Clear();
+    op_params.push_back(Authorization(TAG_AUTH_TOKEN, &token, sizeof(token)));
+    kmen.tick(3600);
+    EXPECT_EQ(KM_ERROR_KEY_USER_NOT_AUTHENTICATED,
+              kmen.AuthorizeOperation(KM_PURPOSE_SIGN, key_id, auth_set, op_params, token.challenge,
+                                      false /* is_begin_operation */));
+    EXPECT_EQ(3U, kmen.signature_checks());
+}
+
 TEST_F(KeymasterBaseTest, TestAuthAndNoAuth) {
     AuthorizationSet auth_set(AuthorizationSetBuilder()
                                   .Authorization(TAG_USER_SECURE_ID, 1)
@@ -860,6 +1038,117 @@ TEST_F(KeymasterBaseTest, TestTimedAuthMissingToken) {
                                                    token.challenge, true /* is_begin_operation */));
 }
 
+TEST_F(KeymasterBaseTest, TestKeyPolicy) {
+    AuthorizationSet hw_enforced(AuthorizationSetBuilder()
+                                     .Authorization(TAG_ALGORITHM, KM_ALGORITHM_RSA)
+                                     .Authorization(TAG_PURPOSE, KM_PURPOSE_SIGN)
+                                     .Authorization(TAG_PURPOSE, KM_PURPOSE_VERIFY)
+                                     .Authorization(TAG_USER_SECURE_ID, 7)
+                                     .Authorization(TAG_MAX_USES_PER_BOOT, 5)
+                                     .Authorization(TAG_MIN_SECONDS_BETWEEN_OPS, 10));
+    AuthorizationSet sw_enforced(AuthorizationSetBuilder()
+                                     .Authorization(TAG_USER_SECURE_ID, 8)
+                                     .Authorization(TAG_USER_AUTH_TYPE, HW_AUTH_PASSWORD)
+                                     .Authorization(TAG_AUTH_TIMEOUT, 30)
+                                     .Authorization(TAG_MAX_USES_PER_BOOT, 3)
+                                     .Authorization(TAG_MIN_SECONDS_BETWEEN_OPS, 20)
+                                     .Authorization(TAG_ACTIVE_DATETIME, past_time)
+                                     .Authorization(TAG_USAGE_EXPIRE_DATETIME, future_time)
+                                     .Authorization(TAG_CALLER_NONCE));
+
+    KeyPolicy policy;
+    ASSERT_EQ(KM_ERROR_OK, policy.Compile(hw_enforced, sw_enforced));
+    EXPECT_TRUE(policy.has_purpose(KM_PURPOSE_SIGN));
+    EXPECT_TRUE(policy.has_purpose(KM_PURPOSE_VERIFY));
+    EXPECT_FALSE(policy.has_purpose(KM_PURPOSE_ENCRYPT));
+    EXPECT_EQ(KeyPolicy::PUBLIC_KEY_ALGORITHM | KeyPolicy::CALLER_NONCE |
+                  KeyPolicy::HAS_ACTIVE_DATETIME | KeyPolicy::HAS_USAGE_EXPIRE_DATETIME |
+                  KeyPolicy::HAS_MIN_SECONDS_BETWEEN_OPS | KeyPolicy::HAS_MAX_USES_PER_BOOT |
+                  KeyPolicy::HAS_USER_AUTH_TYPE | KeyPolicy::HAS_AUTH_TIMEOUT,
+              policy.flags);
+    // The most restrictive of repeated limits is kept.
+    EXPECT_EQ(20U, policy.min_seconds_between_ops);
+    EXPECT_EQ(3U, policy.max_uses_per_boot);
+    EXPECT_EQ(future_time, policy.usage_expire_datetime);
+    ASSERT_EQ(2U, policy.secure_id_count);
+    EXPECT_EQ(7U, policy.secure_ids[0]);
+    EXPECT_EQ(8U, policy.secure_ids[1]);
+
+    UniquePtr<uint8_t[]> serialized(new uint8_t[policy.SerializedSize()]);
+    const uint8_t* end = serialized.get() + policy.SerializedSize();
+    EXPECT_EQ(end, policy.Serialize(serialized.get(), end));
+
+    KeyPolicy deserialized;
+    const uint8_t* p = serialized.get();
+    ASSERT_TRUE(deserialized.Deserialize(&p, end));
+    EXPECT_EQ(end, p);
+    EXPECT_EQ(policy.flags, deserialized.flags);
+    EXPECT_EQ(policy.purposes, deserialized.purposes);
+    EXPECT_EQ(policy.active_datetime, deserialized.active_datetime);
+    EXPECT_EQ(policy.usage_expire_datetime, deserialized.usage_expire_datetime);
+    EXPECT_EQ(policy.min_seconds_between_ops, deserialized.min_seconds_between_ops);
+    EXPECT_EQ(policy.max_uses_per_boot, deserialized.max_uses_per_boot);
+    EXPECT_EQ(policy.user_auth_type, deserialized.user_auth_type);
+    EXPECT_EQ(policy.auth_timeout, deserialized.auth_timeout);
+    ASSERT_EQ(2U, deserialized.secure_id_count);
+    EXPECT_EQ(8U, deserialized.secure_ids[1]);
+
+    // Every truncation fails.
+    for (const uint8_t* short_end = serialized.get(); short_end < end; ++short_end) {
+        p = serialized.get();
+        EXPECT_FALSE(deserialized.Deserialize(&p, short_end));
+    }
+}
+
+TEST_F(KeymasterBaseTest, TestAuthorizeBeginWithPolicy) {
+    hw_auth_token_t token;
+    memset(&token, 0, sizeof(token));
+    token.version = HW_AUTH_TOKEN_VERSION;
+    token.user_id = 9;
+    token.authenticator_type = hton(static_cast<uint32_t>(HW_AUTH_PASSWORD));
+    token.timestamp = hton(static_cast<uint64_t>(kmen.current_time()));
+
+    AuthorizationSet auth_set(AuthorizationSetBuilder()
+                                  .Authorization(TAG_ALGORITHM, KM_ALGORITHM_RSA)
+                                  .Authorization(TAG_USER_SECURE_ID, 1)
+                                  .Authorization(TAG_USER_SECURE_ID, token.user_id)
+                                  .Authorization(TAG_AUTH_TIMEOUT, 1)
+                                  .Authorization(TAG_USER_AUTH_TYPE, HW_AUTH_ANY)
+                                  .Authorization(TAG_MAX_USES_PER_BOOT, 2)
+                                  .Authorization(TAG_PURPOSE, KM_PURPOSE_SIGN)
+                                  .Authorization(TAG_PURPOSE, KM_PURPOSE_VERIFY));
+    KeyPolicy policy;
+    ASSERT_EQ(KM_ERROR_OK, policy.Compile(auth_set));
+
+    AuthorizationSet op_params;
+    op_params.push_back(Authorization(TAG_AUTH_TOKEN, &token, sizeof(token)));
+    EXPECT_EQ(KM_ERROR_INCOMPATIBLE_PURPOSE,
+              kmen.AuthorizeOperation(KM_PURPOSE_DECRYPT, key_id, policy, op_params));
+    EXPECT_EQ(KM_ERROR_KEY_USER_NOT_AUTHENTICATED,
+              kmen.AuthorizeOperation(KM_PURPOSE_SIGN, key_id, policy, AuthorizationSet()));
+    // Public key operations are always authorized, and don't count as uses.
+    EXPECT_EQ(KM_ERROR_OK,
+              kmen.AuthorizeOperation(KM_PURPOSE_VERIFY, key_id, policy, AuthorizationSet()));
+    EXPECT_EQ(KM_ERROR_OK, kmen.AuthorizeOperation(KM_PURPOSE_SIGN, key_id, policy, op_params));
+
+    // The policy and auth set paths count the same uses.
+    EXPECT_EQ(KM_ERROR_OK,
+              kmen.AuthorizeOperation(KM_PURPOSE_SIGN, key_id, auth_set, op_params,
+                                      0 /* op_handle */, true /* is_begin_operation */));
+    EXPECT_EQ(KM_ERROR_KEY_MAX_OPS_EXCEEDED,
+              kmen.AuthorizeOperation(KM_PURPOSE_SIGN, key_id, policy, op_params));
+
+    kmen.tick(2);
+    EXPECT_EQ(KM_ERROR_KEY_USER_NOT_AUTHENTICATED,
+              kmen.AuthorizeOperation(KM_PURPOSE_SIGN, key_id + 1, policy, op_params));
+
+    // Tags that never belong in key authorizations make the key unusable.
+    auth_set.push_back(TAG_BOOTLOADER_ONLY);
+    ASSERT_EQ(KM_ERROR_OK, policy.Compile(auth_set));
+    EXPECT_EQ(KM_ERROR_INVALID_KEY_BLOB,
+              kmen.AuthorizeOperation(KM_PURPOSE_SIGN, key_id + 2, policy, op_params));
+}
+
 TEST_F(KeymasterBaseTest, TestCreateKeyId) {
     keymaster_key_blob_t blob = {reinterpret_cast<const uint8_t*>("foobar"), 6};
 
@@ -868,5 +1157,17 @@ TEST_F(KeymasterBaseTest, TestCreateKeyId) {
     EXPECT_NE(0U, key_id);
 }
 
+TEST_F(KeymasterBaseTest, TestCreateKeyIdFromDigest) {
+    keymaster_key_blob_t blob = {reinterpret_cast<const uint8_t*>("foobar"), 6};
+    uint8_t digest[SHA256_DIGEST_LENGTH];
+    SHA256(blob.key_material, blob.key_material_size, digest);
+
+    km_id_t key_id = 0;
+    ASSERT_TRUE(KeymasterEnforcement::CreateKeyId(blob, &key_id));
+    km_id_t digest_key_id = 0;
+    KeymasterEnforcement::CreateKeyId(digest, &digest_key_id);
+    EXPECT_EQ(key_id, digest_key_id);
+}
+
 }; /* namespace test */
 }; /* namespace keymaster */
@@ -0,0 +1,468 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * keymaster_footprint measures the memory a software AndroidKeymaster holds for each open
+ * operation, for every algorithm, purpose and mode SoftKeymasterContext supports, and optionally
+ * checks the numbers against a baseline.
+ *
+ *   keymaster_footprint [--operations=N] [--input=BYTES] [--baseline=FILE] [--tolerance=PERCENT]
+ *                       [--write-baseline=FILE]
+ *
+ * For each mode a key is generated and --operations operations are begun with it and given one
+ * update of --input bytes, so that each reaches the state it is in for most of a long operation.
+ * While they are all open the tool reports, per operation:
+ *
+ *   bytes   the footprint the operations report through Operation::memory_footprint(), which is
+ *           what the operation memory budget is charged;
+ *   allocs  keymaster container allocations made by the begin and update, if built with
+ *           KEYMASTER_ALLOCATION_COUNTING;
+ *   slab    growth of the OperationSlab the operation objects come from;
+ *   rss     growth of the process's resident set, which includes BoringSSL's state.
+ *
+ * The operations are then aborted, and the peak RSS of the whole run is reported at the end.
+ *
+ * --write-baseline writes each mode's bytes per operation to FILE.  --baseline reads such a file
+ * and fails, with exit status 1, if any mode's bytes per operation has grown by more than
+ * --tolerance percent, 10 by default.  Only the reported footprint is compared, because the other
+ * columns depend on the allocator and the timing of the run.  The footprint depends on the sizes
+ * of the operation classes, so a baseline holds only for the ABI it was written on.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include <keymaster/allocation_counter.h>
+#include <keymaster/android_keymaster.h>
+#include <keymaster/authorization_set.h>
+#include <keymaster/soft_keymaster_context.h>
+
+#include "operation_slab.h"
+
+namespace keymaster {
+
+namespace {
+
+const size_t kAesBlockSize = 16;
+const size_t kShortNonceSize = 12;
+
+struct FootprintOptions {
+    FootprintOptions() : operations(32), input_size(64), tolerance_percent(10) {}
+
+    size_t operations;
+    size_t input_size;
+    unsigned long tolerance_percent;
+    std::string baseline;
+    std::string write_baseline;
+};
+
+struct FootprintMode {
+    std::string name;
+    AuthorizationSet key_description;
+    keymaster_purpose_t purpose;
+    AuthorizationSet begin_params;
+};
+
+struct FootprintResult {
+    FootprintResult() : bytes(0), allocations(0), slab_bytes(0), rss_bytes(0) {}
+
+    size_t bytes;
+    size_t allocations;
+    size_t slab_bytes;
+    long rss_bytes;
+};
+
+void AddMode(const char* name, AuthorizationSetBuilder key_description,
+             keymaster_purpose_t purpose, AuthorizationSetBuilder begin_params,
+             std::vector<FootprintMode>* modes) {
+    FootprintMode mode;
+    mode.name = name;
+    mode.key_description.Reinitialize(
+        AuthorizationSet(key_description.Authorization(TAG_NO_AUTH_REQUIRED)));
+    mode.purpose = purpose;
+    mode.begin_params.Reinitialize(AuthorizationSet(begin_params));
+    modes->push_back(mode);
+}
+
+void AddAesModes(std::vector<FootprintMode>* modes) {
+    const struct {
+        const char* name;
+        keymaster_block_mode_t block_mode;
+        size_t nonce_size;
+    } kAesModes[] = {
+        {"aes-ecb", KM_MODE_ECB, 0},
+        {"aes-cbc", KM_MODE_CBC, kAesBlockSize},
+        {"aes-ctr", KM_MODE_CTR, kAesBlockSize},
+        {"aes-gcm", KM_MODE_GCM, kShortNonceSize},
+    };
+    const uint8_t nonce[kAesBlockSize] = {};
+    for (auto& aes_mode : kAesModes) {
+        AuthorizationSetBuilder key;
+        key.AesEncryptionKey(128)
+            .Authorization(TAG_BLOCK_MODE, aes_mode.block_mode)
+            .Padding(KM_PAD_NONE);
+        AuthorizationSetBuilder params;
+        params.Authorization(TAG_BLOCK_MODE, aes_mode.block_mode).Padding(KM_PAD_NONE);
+        if (aes_mode.block_mode == KM_MODE_GCM) {
+            key.Authorization(TAG_MIN_MAC_LENGTH, 128);
+            params.Authorization(TAG_MAC_LENGTH, 128);
+        }
+        AddMode((std::string(aes_mode.name) + "-encrypt").c_str(), key, KM_PURPOSE_ENCRYPT,
+                params, modes);
+        if (aes_mode.nonce_size)
+            params.Authorization(TAG_NONCE, nonce, aes_mode.nonce_size);
+        AddMode((std::string(aes_mode.name) + "-decrypt").c_str(), key, KM_PURPOSE_DECRYPT,
+                params, modes);
+    }
+}
+
+void AddRsaModes(std::vector<FootprintMode>* modes) {
+    AuthorizationSetBuilder signing_key;
+    signing_key.RsaSigningKey(2048, 65537)
+        .Digest(KM_DIGEST_NONE)
+        .Digest(KM_DIGEST_SHA_2_256)
+        .Padding(KM_PAD_NONE)
+        .Padding(KM_PAD_RSA_PKCS1_1_5_SIGN)
+        .Padding(KM_PAD_RSA_PSS);
+    const struct {
+        const char* name;
+        keymaster_digest_t digest;
+        keymaster_padding_t padding;
+    } kSigningModes[] = {
+        {"rsa-pkcs1-sha256", KM_DIGEST_SHA_2_256, KM_PAD_RSA_PKCS1_1_5_SIGN},
+        {"rsa-pss-sha256", KM_DIGEST_SHA_2_256, KM_PAD_RSA_PSS},
+        {"rsa-raw", KM_DIGEST_NONE, KM_PAD_NONE},
+    };
+    for (auto& signing_mode : kSigningModes) {
+        AuthorizationSetBuilder params;
+        params.Digest(signing_mode.digest).Padding(signing_mode.padding);
+        AddMode((std::string(signing_mode.name) + "-sign").c_str(), signing_key, KM_PURPOSE_SIGN,
+                params, modes);
+        AddMode((std::string(signing_mode.name) + "-verify").c_str(), signing_key,
+                KM_PURPOSE_VERIFY, params, modes);
+    }
+
+    AuthorizationSetBuilder encryption_key;
+    encryption_key.RsaEncryptionKey(2048, 65537)
+        .Digest(KM_DIGEST_SHA_2_256)
+        .Padding(KM_PAD_RSA_OAEP)
+        .Padding(KM_PAD_RSA_PKCS1_1_5_ENCRYPT);
+    const struct {
+        const char* name;
+        keymaster_padding_t padding;
+    } kEncryptionModes[] = {
+        {"rsa-oaep-sha256", KM_PAD_RSA_OAEP},
+        {"rsa-pkcs1", KM_PAD_RSA_PKCS1_1_5_ENCRYPT},
+    };
+    for (auto& encryption_mode : kEncryptionModes) {
+        AuthorizationSetBuilder params;
+        params.Padding(encryption_mode.padding);
+        if (encryption_mode.padding == KM_PAD_RSA_OAEP)
+            params.Digest(KM_DIGEST_SHA_2_256);
+        AddMode((std::string(encryption_mode.name) + "-encrypt").c_str(), encryption_key,
+                KM_PURPOSE_ENCRYPT, params, modes);
+        AddMode((std::string(encryption_mode.name) + "-decrypt").c_str(), encryption_key,
+                KM_PURPOSE_DECRYPT, params, modes);
+    }
+}
+
+std::vector<FootprintMode> Modes() {
+    std::vector<FootprintMode> modes;
+    AddAesModes(&modes);
+
+    AuthorizationSetBuilder hmac_key;
+    hmac_key.HmacKey(256).Digest(KM_DIGEST_SHA_2_256).Authorization(TAG_MIN_MAC_LENGTH, 256);
+    AddMode("hmac-sha256-sign", hmac_key, KM_PURPOSE_SIGN,
+            AuthorizationSetBuilder().Digest(KM_DIGEST_SHA_2_256).Authorization(TAG_MAC_LENGTH,
+                                                                                256),
+            &modes);
+    AddMode("hmac-sha256-verify", hmac_key, KM_PURPOSE_VERIFY,
+            AuthorizationSetBuilder().Digest(KM_DIGEST_SHA_2_256), &modes);
+
+    AddRsaModes(&modes);
+
+    AuthorizationSetBuilder ec_key;
+    ec_key.EcdsaSigningKey(256).Digest(KM_DIGEST_NONE).Digest(KM_DIGEST_SHA_2_256);
+    AddMode("ecdsa-sha256-sign", ec_key, KM_PURPOSE_SIGN,
+            AuthorizationSetBuilder().Digest(KM_DIGEST_SHA_2_256), &modes);
+    AddMode("ecdsa-sha256-verify", ec_key, KM_PURPOSE_VERIFY,
+            AuthorizationSetBuilder().Digest(KM_DIGEST_SHA_2_256), &modes);
+    AddMode("ecdsa-raw-sign", ec_key, KM_PURPOSE_SIGN,
+            AuthorizationSetBuilder().Digest(KM_DIGEST_NONE), &modes);
+    AddMode("ecdsa-raw-verify", ec_key, KM_PURPOSE_VERIFY,
+            AuthorizationSetBuilder().Digest(KM_DIGEST_NONE), &modes);
+
+    const uint8_t nonce[kShortNonceSize] = {};
+    AuthorizationSetBuilder chacha_key;
+    chacha_key.ChaCha20Poly1305Key();
+    AddMode("chacha20-poly1305-encrypt", chacha_key, KM_PURPOSE_ENCRYPT,
+            AuthorizationSetBuilder().Authorization(TAG_MAC_LENGTH, 128), &modes);
+    AddMode("chacha20-poly1305-decrypt", chacha_key, KM_PURPOSE_DECRYPT,
+            AuthorizationSetBuilder()
+                .Authorization(TAG_MAC_LENGTH, 128)
+                .Authorization(TAG_NONCE, nonce, sizeof(nonce)),
+            &modes);
+
+    AuthorizationSetBuilder ed25519_key;
+    ed25519_key.Ed25519SigningKey();
+    AddMode("ed25519-sign", ed25519_key, KM_PURPOSE_SIGN, AuthorizationSetBuilder(), &modes);
+    AddMode("ed25519-verify", ed25519_key, KM_PURPOSE_VERIFY, AuthorizationSetBuilder(), &modes);
+    return modes;
+}
+
+long ResidentBytes() {
+    FILE* statm = fopen("/proc/self/statm", "r");
+    if (!statm)
+        return 0;
+    unsigned long size, resident;
+    int fields = fscanf(statm, "%lu %lu", &size, &resident);
+    fclose(statm);
+    return fields == 2 ? resident * sysconf(_SC_PAGESIZE) : 0;
+}
+
+long PeakResidentKiB() {
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0)
+        return 0;
+    return usage.ru_maxrss;
+}
+
+keymaster_error_t BeginAndUpdate(AndroidKeymaster* keymaster, const FootprintMode& mode,
+                                 const keymaster_key_blob_t& key_blob, const Buffer& input,
+                                 keymaster_operation_handle_t* op_handle) {
+    BeginOperationRequest begin_request;
+    begin_request.purpose = mode.purpose;
+    begin_request.SetKeyMaterial(key_blob);
+    begin_request.additional_params.Reinitialize(mode.begin_params);
+    BeginOperationResponse begin_response;
+    keymaster->BeginOperation(begin_request, &begin_response);
+    if (begin_response.error != KM_ERROR_OK)
+        return begin_response.error;
+    *op_handle = begin_response.op_handle;
+
+    UpdateOperationRequest update_request;
+    update_request.op_handle = *op_handle;
+    update_request.input.Reinitialize(input.peek_read(), input.available_read());
+    UpdateOperationResponse update_response;
+    keymaster->UpdateOperation(update_request, &update_response);
+    return update_response.error;
+}
+
+void Abort(AndroidKeymaster* keymaster, keymaster_operation_handle_t op_handle) {
+    AbortOperationRequest request;
+    request.op_handle = op_handle;
+    AbortOperationResponse response;
+    keymaster->AbortOperation(request, &response);
+}
+
+keymaster_error_t Measure(AndroidKeymaster* keymaster, const FootprintMode& mode,
+                          const FootprintOptions& options, FootprintResult* result) {
+    GenerateKeyRequest generate_request;
+    generate_request.key_description.Reinitialize(mode.key_description);
+    GenerateKeyResponse generate_response;
+    keymaster->GenerateKey(generate_request, &generate_response);
+    if (generate_response.error != KM_ERROR_OK)
+        return generate_response.error;
+    keymaster_key_blob_t key_blob = {generate_response.key_blob.key_material,
+                                     generate_response.key_blob.key_material_size};
+
+    std::string input_data(options.input_size, 'a');
+    Buffer input(input_data.data(), input_data.size());
+
+    // One operation first, so that the key is loaded and cached before anything is counted.
+    keymaster_operation_handle_t op_handle;
+    keymaster_error_t error = BeginAndUpdate(keymaster, mode, key_blob, input, &op_handle);
+    if (error != KM_ERROR_OK)
+        return error;
+    Abort(keymaster, op_handle);
+
+    std::vector<keymaster_operation_handle_t> op_handles;
+    size_t bytes_before = keymaster->operation_memory();
+    size_t slab_before = OperationSlab::instance()->slab_bytes();
+    long rss_before = ResidentBytes();
+    AllocationCounter counter;
+    for (size_t i = 0; i < options.operations && error == KM_ERROR_OK; ++i) {
+        error = BeginAndUpdate(keymaster, mode, key_blob, input, &op_handle);
+        if (error == KM_ERROR_OK)
+            op_handles.push_back(op_handle);
+    }
+    if (error == KM_ERROR_OK) {
+        size_t count = op_handles.size();
+        result->bytes = (keymaster->operation_memory() - bytes_before + count / 2) / count;
+        result->allocations = (counter.allocations() + count / 2) / count;
+        result->slab_bytes =
+            (OperationSlab::instance()->slab_bytes() - slab_before + count / 2) / count;
+        result->rss_bytes = (ResidentBytes() - rss_before) / static_cast<long>(count);
+    }
+    for (keymaster_operation_handle_t handle : op_handles)
+        Abort(keymaster, handle);
+    return error;
+}
+
+bool ReadBaseline(const std::string& path, std::map<std::string, size_t>* baseline) {
+    FILE* file = fopen(path.c_str(), "r");
+    if (!file)
+        return false;
+    char line[256];
+    bool ok = true;
+    while (ok && fgets(line, sizeof(line), file)) {
+        if (line[0] == '#' || line[0] == '\n')
+            continue;
+        char name[128];
+        unsigned long bytes;
+        if (sscanf(line, "%127s %lu", name, &bytes) == 2)
+            (*baseline)[name] = bytes;
+        else
+            ok = false;
+    }
+    fclose(file);
+    return ok;
+}
+
+bool WriteBaseline(const std::string& path, const std::vector<FootprintMode>& modes,
+                   const std::vector<FootprintResult>& results, const FootprintOptions& options) {
+    FILE* file = fopen(path.c_str(), "w");
+    if (!file)
+        return false;
+    fprintf(file, "# Operation::memory_footprint() bytes per open operation, from\n"
+                  "# keymaster_footprint --operations=%zu --input=%zu on a %zu-bit host.  Rewrite\n"
+                  "# it with \"make footprint-baseline\" after a deliberate change.\n",
+            options.operations, options.input_size, sizeof(void*) * 8);
+    for (size_t i = 0; i < modes.size(); ++i)
+        fprintf(file, "%s %zu\n", modes[i].name.c_str(), results[i].bytes);
+    return fclose(file) == 0;
+}
+
+int Footprint(const FootprintOptions& options) {
+    std::map<std::string, size_t> baseline;
+    if (!options.baseline.empty() && !ReadBaseline(options.baseline, &baseline)) {
+        fprintf(stderr, "Failed to read baseline %s\n", options.baseline.c_str());
+        return 1;
+    }
+
+    std::vector<FootprintMode> modes = Modes();
+    std::vector<FootprintResult> results(modes.size());
+    // The table has room for every operation of a mode, so none are evicted while counting.
+    AndroidKeymaster keymaster(new SoftKeymasterContext, options.operations + 1);
+
+    printf("%zu operation(s) per mode, one update of %zu bytes each\n\n", options.operations,
+           options.input_size);
+    printf("%-26s %10s %8s %10s %10s", "mode", "bytes", "allocs", "slab", "rss");
+    if (!baseline.empty())
+        printf(" %10s %8s", "baseline", "change");
+    printf("\n");
+
+    int status = 0;
+    bool failed = false;
+    for (size_t i = 0; i < modes.size(); ++i) {
+        const FootprintMode& mode = modes[i];
+        FootprintResult& result = results[i];
+        keymaster_error_t error = Measure(&keymaster, mode, options, &result);
+        if (error != KM_ERROR_OK) {
+            fprintf(stderr, "%s failed: %d\n", mode.name.c_str(), error);
+            failed = true;
+            status = 1;
+            continue;
+        }
+        printf("%-26s %10zu %8zu %10zu %10ld", mode.name.c_str(), result.bytes,
+               result.allocations, result.slab_bytes, result.rss_bytes);
+        if (!baseline.empty()) {
+            auto entry = baseline.find(mode.name);
+            if (entry == baseline.end()) {
+                printf(" %10s", "none");
+            } else {
+                double change = entry->second
+                                    ? 100.0 * (static_cast<double>(result.bytes) - entry->second) /
+                                          entry->second
+                                    : (result.bytes ? 100.0 : 0);
+                printf(" %10zu %+7.1f%%", entry->second, change);
+                if (change > options.tolerance_percent) {
+                    printf("  REGRESSION");
+                    status = 1;
+                }
+            }
+        }
+        printf("\n");
+        fflush(stdout);
+    }
+    printf("\npeak RSS %ld KiB\n", PeakResidentKiB());
+
+    if (!options.write_baseline.empty()) {
+        if (failed) {
+            fprintf(stderr, "Not writing a baseline from a run with failures\n");
+        } else if (!WriteBaseline(options.write_baseline, modes, results, options)) {
+            fprintf(stderr, "Failed to write baseline %s\n", options.write_baseline.c_str());
+            status = 1;
+        }
+    }
+    return status;
+}
+
+bool ParseUnsigned(const char* text, unsigned long* value) {
+    char* end;
+    *value = strtoul(text, &end, 10);
+    return end != text && *end == '\0';
+}
+
+bool ParseOptions(int argc, char** argv, FootprintOptions* options) {
+    for (int i = 1; i < argc; ++i) {
+        const char* arg = argv[i];
+        const char* value = strchr(arg, '=');
+        if (!value)
+            return false;
+        std::string name(arg, value++ - arg);
+        unsigned long number;
+        if (name == "--baseline" && *value) {
+            options->baseline = value;
+        } else if (name == "--write-baseline" && *value) {
+            options->write_baseline = value;
+        } else if (ParseUnsigned(value, &number)) {
+            if (name == "--operations" && number > 0)
+                options->operations = number;
+            else if (name == "--input")
+                options->input_size = number;
+            else if (name == "--tolerance")
+                options->tolerance_percent = number;
+            else
+                return false;
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+}  // anonymous namespace
+
+}  // namespace keymaster
+
+int main(int argc, char** argv) {
+    keymaster::FootprintOptions options;
+    if (!keymaster::ParseOptions(argc, argv, &options)) {
+        fprintf(stderr, "usage: %s [--operations=N] [--input=BYTES] [--baseline=FILE] "
+                        "[--tolerance=PERCENT] [--write-baseline=FILE]\n",
+                argv[0]);
+        return 2;
+    }
+    return keymaster::Footprint(options);
+}
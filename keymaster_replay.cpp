@@ -0,0 +1,164 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * keymaster_replay replays a request trace, written by RequestTraceWriter, into a new software
+ * AndroidKeymaster, and reports the throughput and the latency percentiles of each command,
+ * alongside those recorded.
+ *
+ *   keymaster_replay [--max-speed] TRACE
+ *
+ * By default each request is sent at its recorded time, relative to the first; with --max-speed,
+ * as soon as the one before it completes.  Requests are replayed one at a time, in the order they
+ * were recorded.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <map>
+#include <vector>
+
+#include <keymaster/android_keymaster.h>
+#include <keymaster/soft_keymaster_context.h>
+
+#include "latency_statistics.h"
+#include "request_trace.h"
+
+namespace keymaster {
+
+namespace {
+
+const size_t kOperationTableSize = 64;
+
+struct CommandLatencies {
+    std::vector<uint64_t> replayed;
+    std::vector<uint64_t> recorded;
+};
+
+// Returns the nearest-rank percentile of sorted latencies.
+uint64_t Percentile(const std::vector<uint64_t>& sorted, double percentile) {
+    if (sorted.empty())
+        return 0;
+    size_t rank = static_cast<size_t>(percentile / 100 * sorted.size() + 0.5);
+    return sorted[rank > 0 ? std::min(rank, sorted.size()) - 1 : 0];
+}
+
+void Report(const std::map<AndroidKeymasterCommand, CommandLatencies>& latencies,
+            size_t request_count, size_t mismatch_count, uint64_t elapsed_microseconds) {
+    double seconds = elapsed_microseconds / 1e6;
+    printf("Replayed %zu requests in %.3f s, %.1f requests/s; %zu had a different result than "
+           "when recorded\n\n",
+           request_count, seconds, seconds > 0 ? request_count / seconds : 0, mismatch_count);
+    printf("%-24s %8s %10s %10s %10s %10s %14s %14s\n", "command", "count", "p50 us", "p90 us",
+           "p99 us", "max us", "recorded p50", "recorded p99");
+    for (auto& entry : latencies) {
+        std::vector<uint64_t> replayed = entry.second.replayed;
+        std::vector<uint64_t> recorded = entry.second.recorded;
+        std::sort(replayed.begin(), replayed.end());
+        std::sort(recorded.begin(), recorded.end());
+        printf("%-24s %8zu %10llu %10llu %10llu %10llu %14llu %14llu\n",
+               TraceCommandName(entry.first), replayed.size(),
+               static_cast<unsigned long long>(Percentile(replayed, 50)),
+               static_cast<unsigned long long>(Percentile(replayed, 90)),
+               static_cast<unsigned long long>(Percentile(replayed, 99)),
+               static_cast<unsigned long long>(replayed.back()),
+               static_cast<unsigned long long>(Percentile(recorded, 50)),
+               static_cast<unsigned long long>(Percentile(recorded, 99)));
+    }
+}
+
+int Replay(FILE* trace, bool max_speed) {
+    AndroidKeymaster keymaster(new SoftKeymasterContext, kOperationTableSize);
+    RequestTraceReader reader(trace);
+    RequestTraceReplayer replayer(&keymaster);
+
+    std::map<AndroidKeymasterCommand, CommandLatencies> latencies;
+    size_t request_count = 0;
+    size_t mismatch_count = 0;
+    uint64_t first_recorded_start = 0;
+    uint64_t replay_start = LatencyStatistics::NowMicroseconds();
+    for (;;) {
+        TraceRecord record;
+        bool end;
+        keymaster_error_t error = reader.Next(&record, &end);
+        if (error != KM_ERROR_OK) {
+            fprintf(stderr, "Failed to read record %zu of the trace: %d\n", request_count, error);
+            return 1;
+        }
+        if (end)
+            break;
+
+        if (request_count == 0)
+            first_recorded_start = record.start_microseconds;
+        if (!max_speed && record.start_microseconds > first_recorded_start) {
+            uint64_t due = replay_start + (record.start_microseconds - first_recorded_start);
+            uint64_t now = LatencyStatistics::NowMicroseconds();
+            if (due > now)
+                usleep(due - now);
+        }
+
+        UniquePtr<KeymasterResponse> response;
+        uint64_t start = LatencyStatistics::NowMicroseconds();
+        error = replayer.Replay(record, &response);
+        uint64_t latency = LatencyStatistics::NowMicroseconds() - start;
+        if (error != KM_ERROR_OK) {
+            fprintf(stderr, "Failed to replay record %zu (%s): %d\n", request_count,
+                    TraceCommandName(record.command), error);
+            return 1;
+        }
+
+        ++request_count;
+        if (response->error != record.response->error)
+            ++mismatch_count;
+        CommandLatencies& command_latencies = latencies[record.command];
+        command_latencies.replayed.push_back(latency);
+        command_latencies.recorded.push_back(record.duration_microseconds);
+    }
+
+    Report(latencies, request_count, mismatch_count,
+           LatencyStatistics::NowMicroseconds() - replay_start);
+    return 0;
+}
+
+}  // anonymous namespace
+
+}  // namespace keymaster
+
+int main(int argc, char** argv) {
+    bool max_speed = false;
+    int arg = 1;
+    if (arg < argc && strcmp(argv[arg], "--max-speed") == 0) {
+        max_speed = true;
+        ++arg;
+    }
+    if (arg + 1 != argc) {
+        fprintf(stderr, "usage: %s [--max-speed] TRACE\n", argv[0]);
+        return 2;
+    }
+
+    FILE* trace = fopen(argv[arg], "rb");
+    if (!trace) {
+        fprintf(stderr, "Can't open %s: %s\n", argv[arg], strerror(errno));
+        return 1;
+    }
+    int result = keymaster::Replay(trace, max_speed);
+    fclose(trace);
+    return result;
+}
@@ -0,0 +1,475 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * keymaster_stress drives a single SoftKeymasterDevice from many threads at once, through the
+ * keymaster2 begin(), update() and finish() entry points, and reports how throughput scales with
+ * the number of threads and how much the operation table, key cache and pinned key table locks
+ * were contended.
+ *
+ *   keymaster_stress [--threads=N,N,...] [--seconds=N] [--updates=N] [--chunk=BYTES]
+ *                    [--keys=N] [--mix=aes:W,hmac:W,rsa:W,ec:W]
+ *
+ * Each thread repeatedly picks an algorithm at random, in proportion to the weights given by
+ * --mix, and runs one operation with it: a begin, --updates updates of --chunk bytes each, and a
+ * finish.  AES operations are CTR-mode encryptions, HMAC operations SHA-256 MACs, and RSA and EC
+ * operations SHA-256 signatures.  The threads share --keys keys of each algorithm, so with the
+ * default of one they all hit the same key cache entries.
+ *
+ * By default the run is repeated with 1, 2, 4, ... threads, up to twice the number of cores.
+ * Lock contention is counted only if the keymaster libraries are built with
+ * KEYMASTER_LOCK_STATISTICS; otherwise those columns are zero.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <keymaster/authorization_set.h>
+#include <keymaster/lock_statistics.h>
+#include <keymaster/soft_keymaster_device.h>
+
+#include "latency_statistics.h"
+
+namespace keymaster {
+
+namespace {
+
+const uint32_t kOsVersion = 70000;
+const uint32_t kOsPatchLevel = 201609;
+const size_t kMaxDefaultThreads = 64;
+
+enum StressAlgorithm { STRESS_AES, STRESS_HMAC, STRESS_RSA, STRESS_EC, STRESS_ALGORITHM_COUNT };
+
+const char* const kAlgorithmNames[STRESS_ALGORITHM_COUNT] = {"aes", "hmac", "rsa", "ec"};
+
+struct StressOptions {
+    StressOptions() : seconds(2), updates(4), chunk_size(1024), keys_per_algorithm(1) {
+        weights[STRESS_AES] = 4;
+        weights[STRESS_HMAC] = 4;
+        weights[STRESS_RSA] = 1;
+        weights[STRESS_EC] = 1;
+    }
+
+    std::vector<size_t> thread_counts;
+    unsigned seconds;
+    unsigned updates;
+    size_t chunk_size;
+    size_t keys_per_algorithm;
+    unsigned weights[STRESS_ALGORITHM_COUNT];
+};
+
+AuthorizationSet KeyDescription(StressAlgorithm algorithm) {
+    AuthorizationSetBuilder builder;
+    switch (algorithm) {
+    case STRESS_AES:
+        builder.AesEncryptionKey(128).Authorization(TAG_BLOCK_MODE, KM_MODE_CTR).Padding(
+            KM_PAD_NONE);
+        break;
+    case STRESS_HMAC:
+        builder.HmacKey(256)
+            .Digest(KM_DIGEST_SHA_2_256)
+            .Authorization(TAG_MIN_MAC_LENGTH, 256);
+        break;
+    case STRESS_RSA:
+        builder.RsaSigningKey(2048, 65537)
+            .Digest(KM_DIGEST_SHA_2_256)
+            .Padding(KM_PAD_RSA_PKCS1_1_5_SIGN);
+        break;
+    case STRESS_EC:
+        builder.EcdsaSigningKey(256).Digest(KM_DIGEST_SHA_2_256);
+        break;
+    case STRESS_ALGORITHM_COUNT:
+        break;
+    }
+    return builder.Authorization(TAG_NO_AUTH_REQUIRED).build();
+}
+
+AuthorizationSet BeginParams(StressAlgorithm algorithm, keymaster_purpose_t* purpose) {
+    AuthorizationSetBuilder builder;
+    *purpose = KM_PURPOSE_SIGN;
+    switch (algorithm) {
+    case STRESS_AES:
+        *purpose = KM_PURPOSE_ENCRYPT;
+        builder.Authorization(TAG_BLOCK_MODE, KM_MODE_CTR).Padding(KM_PAD_NONE);
+        break;
+    case STRESS_HMAC:
+        builder.Digest(KM_DIGEST_SHA_2_256).Authorization(TAG_MAC_LENGTH, 256);
+        break;
+    case STRESS_RSA:
+        builder.Digest(KM_DIGEST_SHA_2_256).Padding(KM_PAD_RSA_PKCS1_1_5_SIGN);
+        break;
+    case STRESS_EC:
+        builder.Digest(KM_DIGEST_SHA_2_256);
+        break;
+    case STRESS_ALGORITHM_COUNT:
+        break;
+    }
+    return builder.build();
+}
+
+struct StressKey {
+    StressAlgorithm algorithm;
+    keymaster_key_blob_t blob;
+    keymaster_purpose_t purpose;
+    AuthorizationSet begin_params;
+};
+
+struct ThreadResult {
+    ThreadResult() : operations(0), calls(0), errors(0), first_error(KM_ERROR_OK) {
+        for (size_t i = 0; i < STRESS_ALGORITHM_COUNT; ++i)
+            algorithm_operations[i] = 0;
+    }
+
+    uint64_t operations;
+    uint64_t calls;
+    uint64_t errors;
+    keymaster_error_t first_error;
+    uint64_t algorithm_operations[STRESS_ALGORITHM_COUNT];
+};
+
+class StressRunner {
+  public:
+    StressRunner(const StressOptions& options, keymaster2_device_t* device)
+        : options_(options), device_(device), chunk_(options.chunk_size, 0x5a) {}
+
+    ~StressRunner() {
+        for (StressKey& key : keys_)
+            free(const_cast<uint8_t*>(key.blob.key_material));
+    }
+
+    keymaster_error_t GenerateKeys() {
+        for (size_t i = 0; i < STRESS_ALGORITHM_COUNT; ++i) {
+            StressAlgorithm algorithm = static_cast<StressAlgorithm>(i);
+            if (options_.weights[algorithm] == 0)
+                continue;
+            AuthorizationSet description = KeyDescription(algorithm);
+            for (size_t j = 0; j < options_.keys_per_algorithm; ++j) {
+                StressKey key;
+                key.algorithm = algorithm;
+                key.begin_params = BeginParams(algorithm, &key.purpose);
+                keymaster_error_t error =
+                    device_->generate_key(device_, &description, &key.blob, nullptr);
+                if (error != KM_ERROR_OK) {
+                    fprintf(stderr, "Generating a %s key failed: %d\n", kAlgorithmNames[i], error);
+                    return error;
+                }
+                keys_.push_back(key);
+            }
+        }
+        return KM_ERROR_OK;
+    }
+
+    // Runs thread_count threads for the configured time.  Returns the elapsed microseconds.
+    uint64_t Run(size_t thread_count, std::vector<ThreadResult>* results) {
+        results->assign(thread_count, ThreadResult());
+        std::atomic<bool> start(false);
+        std::atomic<bool> stop(false);
+        std::vector<std::thread> threads;
+        for (size_t i = 0; i < thread_count; ++i)
+            threads.push_back(std::thread(&StressRunner::Worker, this, i, &start, &stop,
+                                          &(*results)[i]));
+
+        uint64_t start_time = LatencyStatistics::NowMicroseconds();
+        start.store(true);
+        std::this_thread::sleep_for(std::chrono::seconds(options_.seconds));
+        stop.store(true);
+        for (std::thread& thread : threads)
+            thread.join();
+        return LatencyStatistics::NowMicroseconds() - start_time;
+    }
+
+  private:
+    void Worker(size_t index, const std::atomic<bool>* start, const std::atomic<bool>* stop,
+                ThreadResult* result) {
+        std::minstd_rand random(static_cast<std::minstd_rand::result_type>(index + 1));
+        unsigned total_weight = 0;
+        for (size_t i = 0; i < STRESS_ALGORITHM_COUNT; ++i)
+            total_weight += options_.weights[i];
+
+        // Counted locally, so the threads' counters don't share cache lines.
+        ThreadResult local;
+        while (!start->load())
+            std::this_thread::yield();
+        while (!stop->load()) {
+            const StressKey& key = PickKey(random() % total_weight, random());
+            keymaster_error_t error = RunOperation(key, &local);
+            if (error != KM_ERROR_OK) {
+                if (local.errors++ == 0)
+                    local.first_error = error;
+                continue;
+            }
+            ++local.operations;
+            ++local.algorithm_operations[key.algorithm];
+        }
+        *result = local;
+    }
+
+    const StressKey& PickKey(unsigned weight, size_t key_index) const {
+        size_t algorithm = 0;
+        while (weight >= options_.weights[algorithm])
+            weight -= options_.weights[algorithm++];
+
+        size_t first = 0;
+        while (static_cast<size_t>(keys_[first].algorithm) != algorithm)
+            ++first;
+        return keys_[first + key_index % options_.keys_per_algorithm];
+    }
+
+    keymaster_error_t RunOperation(const StressKey& key, ThreadResult* result) {
+        keymaster_key_param_set_t out_params;
+        keymaster_operation_handle_t handle;
+        ++result->calls;
+        keymaster_error_t error = device_->begin(device_, key.purpose, &key.blob,
+                                                 &key.begin_params, &out_params, &handle);
+        if (error != KM_ERROR_OK)
+            return error;
+        keymaster_free_param_set(&out_params);
+
+        const keymaster_key_param_set_t no_params = {nullptr, 0};
+        keymaster_blob_t input = {chunk_.data(), chunk_.size()};
+        for (unsigned i = 0; i < options_.updates; ++i) {
+            size_t input_consumed;
+            keymaster_blob_t output = {nullptr, 0};
+            ++result->calls;
+            error = device_->update(device_, handle, &no_params, &input, &input_consumed,
+                                    &out_params, &output);
+            keymaster_free_param_set(&out_params);
+            free(const_cast<uint8_t*>(output.data));
+            if (error != KM_ERROR_OK) {
+                device_->abort(device_, handle);
+                return error;
+            }
+        }
+
+        keymaster_blob_t output = {nullptr, 0};
+        ++result->calls;
+        error = device_->finish(device_, handle, &no_params, nullptr /* input */,
+                                nullptr /* signature */, &out_params, &output);
+        keymaster_free_param_set(&out_params);
+        free(const_cast<uint8_t*>(output.data));
+        return error;
+    }
+
+    const StressOptions& options_;
+    keymaster2_device_t* device_;
+    std::vector<uint8_t> chunk_;
+    std::vector<StressKey> keys_;
+};
+
+LockStatistics Difference(const LockStatistics& after, const LockStatistics& before) {
+    LockStatistics difference;
+    difference.acquisitions = after.acquisitions - before.acquisitions;
+    difference.contentions = after.contentions - before.contentions;
+    difference.wait_microseconds = after.wait_microseconds - before.wait_microseconds;
+    return difference;
+}
+
+void PrintLockColumns(const LockStatistics& statistics) {
+    printf(" %12llu %10llu %5.1f %9.1f", static_cast<unsigned long long>(statistics.acquisitions),
+           static_cast<unsigned long long>(statistics.contentions),
+           statistics.acquisitions ? 100.0 * statistics.contentions / statistics.acquisitions : 0,
+           statistics.wait_microseconds / 1000.0);
+}
+
+int Stress(const StressOptions& options) {
+    SoftKeymasterDevice* device = new SoftKeymasterDevice(new SoftKeymasterContext);
+    keymaster2_device_t* km2_device = device->keymaster2_device();
+    AuthorizationSet version_info(AuthorizationSetBuilder()
+                                      .Authorization(TAG_OS_VERSION, kOsVersion)
+                                      .Authorization(TAG_OS_PATCHLEVEL, kOsPatchLevel));
+    keymaster_error_t error = km2_device->configure(km2_device, &version_info);
+    if (error != KM_ERROR_OK) {
+        fprintf(stderr, "Configuring the device failed: %d\n", error);
+        km2_device->common.close(&km2_device->common);
+        return 1;
+    }
+
+    int status = 0;
+    {
+        StressRunner runner(options, km2_device);
+        if (runner.GenerateKeys() != KM_ERROR_OK) {
+            status = 1;
+        } else {
+            printf("%u update(s) of %zu bytes per operation, %zu key(s) per algorithm, %u s per "
+                   "run\n\n",
+                   options.updates, options.chunk_size, options.keys_per_algorithm,
+                   options.seconds);
+            printf("%7s %10s %10s %7s %7s", "threads", "ops/s", "calls/s", "scaling", "errors");
+            for (size_t i = 0; i < STRESS_ALGORITHM_COUNT; ++i)
+                if (options.weights[i])
+                    printf(" %8s/s", kAlgorithmNames[i]);
+            const char* const kLocks[] = {"op table", "key cache", "pinned keys"};
+            for (const char* lock : kLocks)
+                printf(" | %12s %10s %5s %9s", lock, "contended", "%", "wait ms");
+            printf("\n");
+
+            double single_thread_rate = 0;
+            for (size_t thread_count : options.thread_counts) {
+                LockStatistics before[3], after[3];
+                device->GetLockStatistics(&before[0], &before[1], &before[2]);
+                std::vector<ThreadResult> results;
+                uint64_t elapsed = runner.Run(thread_count, &results);
+                device->GetLockStatistics(&after[0], &after[1], &after[2]);
+
+                ThreadResult total;
+                for (const ThreadResult& result : results) {
+                    total.operations += result.operations;
+                    total.calls += result.calls;
+                    total.errors += result.errors;
+                    if (total.first_error == KM_ERROR_OK)
+                        total.first_error = result.first_error;
+                    for (size_t i = 0; i < STRESS_ALGORITHM_COUNT; ++i)
+                        total.algorithm_operations[i] += result.algorithm_operations[i];
+                }
+
+                double seconds = elapsed / 1e6;
+                double rate = total.operations / seconds;
+                if (single_thread_rate == 0)
+                    single_thread_rate = rate / thread_count;
+                printf("%7zu %10.1f %10.1f %6.2fx %7llu", thread_count, rate,
+                       total.calls / seconds,
+                       single_thread_rate ? rate / single_thread_rate : 0,
+                       static_cast<unsigned long long>(total.errors));
+                for (size_t i = 0; i < STRESS_ALGORITHM_COUNT; ++i)
+                    if (options.weights[i])
+                        printf(" %10.1f", total.algorithm_operations[i] / seconds);
+                for (size_t i = 0; i < 3; ++i) {
+                    printf(" |");
+                    PrintLockColumns(Difference(after[i], before[i]));
+                }
+                printf("\n");
+                if (total.errors)
+                    fprintf(stderr, "%llu operations failed with %d first\n",
+                            static_cast<unsigned long long>(total.errors), total.first_error);
+                fflush(stdout);
+            }
+        }
+    }
+    km2_device->common.close(&km2_device->common);
+    return status;
+}
+
+bool ParseUnsigned(const char* text, unsigned long* value) {
+    char* end;
+    *value = strtoul(text, &end, 10);
+    return end != text && *end == '\0';
+}
+
+bool ParseThreadCounts(const char* text, std::vector<size_t>* thread_counts) {
+    std::string list(text);
+    size_t begin = 0;
+    while (begin <= list.size()) {
+        size_t end = list.find(',', begin);
+        if (end == std::string::npos)
+            end = list.size();
+        unsigned long count;
+        if (!ParseUnsigned(list.substr(begin, end - begin).c_str(), &count) || count == 0)
+            return false;
+        thread_counts->push_back(count);
+        begin = end + 1;
+    }
+    return true;
+}
+
+bool ParseMix(const char* text, unsigned* weights) {
+    for (size_t i = 0; i < STRESS_ALGORITHM_COUNT; ++i)
+        weights[i] = 0;
+    std::string list(text);
+    size_t begin = 0;
+    unsigned total = 0;
+    while (begin <= list.size()) {
+        size_t end = list.find(',', begin);
+        if (end == std::string::npos)
+            end = list.size();
+        std::string item = list.substr(begin, end - begin);
+        size_t colon = item.find(':');
+        std::string name = item.substr(0, colon);
+        unsigned long weight = 1;
+        if (colon != std::string::npos && !ParseUnsigned(item.c_str() + colon + 1, &weight))
+            return false;
+        size_t algorithm = 0;
+        while (algorithm < STRESS_ALGORITHM_COUNT && name != kAlgorithmNames[algorithm])
+            ++algorithm;
+        if (algorithm == STRESS_ALGORITHM_COUNT)
+            return false;
+        weights[algorithm] = weight;
+        total += weight;
+        begin = end + 1;
+    }
+    return total > 0;
+}
+
+bool ParseOptions(int argc, char** argv, StressOptions* options) {
+    for (int i = 1; i < argc; ++i) {
+        const char* arg = argv[i];
+        const char* value = strchr(arg, '=');
+        if (!value)
+            return false;
+        std::string name(arg, value++ - arg);
+        unsigned long number;
+        if (name == "--threads") {
+            if (!ParseThreadCounts(value, &options->thread_counts))
+                return false;
+        } else if (name == "--mix") {
+            if (!ParseMix(value, options->weights))
+                return false;
+        } else if (ParseUnsigned(value, &number)) {
+            if (name == "--seconds" && number > 0)
+                options->seconds = number;
+            else if (name == "--updates")
+                options->updates = number;
+            else if (name == "--chunk" && number > 0)
+                options->chunk_size = number;
+            else if (name == "--keys" && number > 0)
+                options->keys_per_algorithm = number;
+            else
+                return false;
+        } else {
+            return false;
+        }
+    }
+
+    if (options->thread_counts.empty()) {
+        size_t max_threads = 2 * std::max(std::thread::hardware_concurrency(), 1U);
+        for (size_t count = 1; count <= std::min(max_threads, kMaxDefaultThreads); count *= 2)
+            options->thread_counts.push_back(count);
+    }
+    return true;
+}
+
+}  // anonymous namespace
+
+}  // namespace keymaster
+
+int main(int argc, char** argv) {
+    keymaster::StressOptions options;
+    if (!keymaster::ParseOptions(argc, argv, &options)) {
+        fprintf(stderr, "usage: %s [--threads=N,N,...] [--seconds=N] [--updates=N] "
+                        "[--chunk=BYTES] [--keys=N] [--mix=aes:W,hmac:W,rsa:W,ec:W]\n",
+                argv[0]);
+        return 2;
+    }
+    return keymaster::Stress(options);
+}
@@ -0,0 +1,160 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "latency_statistics.h"
+
+#include <time.h>
+
+#include <new>
+
+#include <UniquePtr.h>
+
+#include <keymaster/android_keymaster_utils.h>
+
+namespace keymaster {
+
+namespace {
+
+const keymaster_algorithm_t kAlgorithms[] = {KM_ALGORITHM_RSA, KM_ALGORITHM_EC, KM_ALGORITHM_AES,
+                                             KM_ALGORITHM_HMAC, KM_ALGORITHM_CHACHA20_POLY1305,
+                                             KM_ALGORITHM_ED25519};
+
+// Slot 0 is kNoAlgorithm; returns false for algorithms without a slot.
+bool AlgorithmSlot(uint32_t algorithm, size_t* slot) {
+    if (algorithm == GetStatisticsResponse::kNoAlgorithm) {
+        *slot = 0;
+        return true;
+    }
+    for (size_t i = 0; i < array_length(kAlgorithms); ++i) {
+        if (algorithm == static_cast<uint32_t>(kAlgorithms[i])) {
+            *slot = i + 1;
+            return true;
+        }
+    }
+    return false;
+}
+
+uint32_t SlotAlgorithm(size_t slot) {
+    return slot == 0 ? GetStatisticsResponse::kNoAlgorithm : kAlgorithms[slot - 1];
+}
+
+}  // anonymous namespace
+
+LatencyHistogram::LatencyHistogram()
+    : count_(0), total_microseconds_(0), allocations_(0), allocated_bytes_(0) {
+    for (auto& bucket : buckets_)
+        bucket.store(0, std::memory_order_relaxed);
+}
+
+void LatencyHistogram::Record(uint64_t microseconds, uint64_t allocations,
+                              uint64_t allocated_bytes) {
+    buckets_[GetStatisticsResponse::BucketIndex(microseconds)].fetch_add(
+        1, std::memory_order_relaxed);
+    total_microseconds_.fetch_add(microseconds, std::memory_order_relaxed);
+    allocations_.fetch_add(allocations, std::memory_order_relaxed);
+    allocated_bytes_.fetch_add(allocated_bytes, std::memory_order_relaxed);
+    count_.fetch_add(1, std::memory_order_relaxed);
+}
+
+void LatencyHistogram::Snapshot(GetStatisticsResponse::Histogram* histogram) const {
+    histogram->count = count_.load(std::memory_order_relaxed);
+    histogram->total_microseconds = total_microseconds_.load(std::memory_order_relaxed);
+    histogram->allocations = allocations_.load(std::memory_order_relaxed);
+    histogram->allocated_bytes = allocated_bytes_.load(std::memory_order_relaxed);
+    for (size_t i = 0; i < GetStatisticsResponse::kBucketCount; ++i)
+        histogram->buckets[i] = buckets_[i].load(std::memory_order_relaxed);
+}
+
+LatencyStatistics::LatencyStatistics() {
+    for (auto& command : histograms_)
+        for (auto& algorithm : command)
+            for (auto& histogram : algorithm)
+                histogram.store(nullptr, std::memory_order_relaxed);
+}
+
+LatencyStatistics::~LatencyStatistics() {
+    for (auto& command : histograms_)
+        for (auto& algorithm : command)
+            for (auto& histogram : algorithm)
+                delete histogram.load(std::memory_order_relaxed);
+}
+
+void LatencyStatistics::Record(AndroidKeymasterCommand command, uint32_t algorithm,
+                               uint32_t purpose, uint64_t microseconds, uint64_t allocations,
+                               uint64_t allocated_bytes) {
+    size_t algorithm_slot;
+    if (static_cast<size_t>(command) >= kCommandCount || !AlgorithmSlot(algorithm, &algorithm_slot))
+        return;
+    size_t purpose_slot = kPurposeCount - 1;
+    if (purpose != GetStatisticsResponse::kNoPurpose) {
+        if (purpose >= kPurposeCount - 1)
+            return;
+        purpose_slot = purpose;
+    }
+
+    std::atomic<LatencyHistogram*>& slot = histograms_[command][algorithm_slot][purpose_slot];
+    LatencyHistogram* histogram = slot.load(std::memory_order_acquire);
+    if (!histogram) {
+        UniquePtr<LatencyHistogram> allocated(new (std::nothrow) LatencyHistogram);
+        if (!allocated.get())
+            return;
+        // If another thread got there first, use its histogram and discard ours.
+        if (slot.compare_exchange_strong(histogram, allocated.get(), std::memory_order_acq_rel))
+            histogram = allocated.release();
+    }
+    histogram->Record(microseconds, allocations, allocated_bytes);
+}
+
+void LatencyStatistics::Snapshot(GetStatisticsResponse* response) const {
+    size_t recorded = 0;
+    for (const auto& command : histograms_)
+        for (const auto& algorithm : command)
+            for (const auto& histogram : algorithm)
+                if (histogram.load(std::memory_order_acquire))
+                    ++recorded;
+
+    if (!response->SetHistogramCount(recorded)) {
+        response->error = KM_ERROR_MEMORY_ALLOCATION_FAILED;
+        return;
+    }
+
+    // If histograms are allocated after counting, some may be left for the next snapshot.
+    size_t next = 0;
+    for (size_t c = 0; c < kCommandCount; ++c) {
+        for (size_t a = 0; a < kAlgorithmCount; ++a) {
+            for (size_t p = 0; p < kPurposeCount; ++p) {
+                const LatencyHistogram* histogram = histograms_[c][a][p].load(
+                    std::memory_order_acquire);
+                if (!histogram || next == recorded)
+                    continue;
+                GetStatisticsResponse::Histogram* out = &response->histograms[next++];
+                out->command = c;
+                out->algorithm = SlotAlgorithm(a);
+                out->purpose = p == kPurposeCount - 1 ? GetStatisticsResponse::kNoPurpose : p;
+                histogram->Snapshot(out);
+            }
+        }
+    }
+    response->error = KM_ERROR_OK;
+}
+
+uint64_t LatencyStatistics::NowMicroseconds() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return static_cast<uint64_t>(now.tv_sec) * 1000000 + now.tv_nsec / 1000;
+}
+
+}  // namespace keymaster
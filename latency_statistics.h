@@ -0,0 +1,176 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SYSTEM_KEYMASTER_LATENCY_STATISTICS_H_
+#define SYSTEM_KEYMASTER_LATENCY_STATISTICS_H_
+
+#include <stdint.h>
+
+#include <atomic>
+
+#include <keymaster/allocation_counter.h>
+#include <keymaster/android_keymaster_messages.h>
+#include <keymaster/authorization_set.h>
+#include <keymaster/request_recorder.h>
+
+namespace keymaster {
+
+/**
+ * LatencyHistogram counts latencies in the log-linear buckets described at GetStatisticsResponse.
+ * Record is lock-free and may be called concurrently with Record and Snapshot.
+ */
+class LatencyHistogram {
+  public:
+    LatencyHistogram();
+
+    void Record(uint64_t microseconds, uint64_t allocations, uint64_t allocated_bytes);
+
+    /**
+     * Copies the counts into the count, total, allocation and bucket fields of histogram.
+     * Latencies recorded concurrently may be only partly included.
+     */
+    void Snapshot(GetStatisticsResponse::Histogram* histogram) const;
+
+  private:
+    std::atomic<uint64_t> count_;
+    std::atomic<uint64_t> total_microseconds_;
+    std::atomic<uint64_t> allocations_;
+    std::atomic<uint64_t> allocated_bytes_;
+    std::atomic<uint64_t> buckets_[GetStatisticsResponse::kBucketCount];
+};
+
+/**
+ * LatencyStatistics holds a LatencyHistogram for each combination of command, algorithm and
+ * purpose, allocated when the combination is first recorded.  Record is lock-free.
+ */
+class LatencyStatistics {
+  public:
+    LatencyStatistics();
+    ~LatencyStatistics();
+
+    /**
+     * Records a latency, and the allocations made in that time.  algorithm may be
+     * GetStatisticsResponse::kNoAlgorithm and purpose may be GetStatisticsResponse::kNoPurpose.
+     * Unknown commands, algorithms and purposes are ignored, as are latencies that can't be
+     * recorded because a histogram couldn't be allocated.
+     */
+    void Record(AndroidKeymasterCommand command, uint32_t algorithm, uint32_t purpose,
+                uint64_t microseconds, uint64_t allocations, uint64_t allocated_bytes);
+
+    /**
+     * Fills response with a histogram for each combination that has been recorded.
+     */
+    void Snapshot(GetStatisticsResponse* response) const;
+
+    /**
+     * Returns the time, in microseconds since an arbitrary point, from a monotonic clock.
+     */
+    static uint64_t NowMicroseconds();
+
+  private:
+    static const size_t kCommandCount = DELETE_ALL_KEYS + 1;
+    // No algorithm, RSA, EC, AES, HMAC, ChaCha20-Poly1305 and Ed25519.
+    static const size_t kAlgorithmCount = 7;
+    // The five purposes, then no purpose.
+    static const size_t kPurposeCount = KM_PURPOSE_DERIVE_KEY + 2;
+
+    std::atomic<LatencyHistogram*> histograms_[kCommandCount][kAlgorithmCount][kPurposeCount];
+};
+
+/**
+ * ScopedLatencyTimer records the time from its construction to its destruction in statistics,
+ * under its command and the algorithm and purpose it has been told, along with the allocations
+ * counted in that time if KEYMASTER_ALLOCATION_COUNTING is defined.  statistics may be null, in
+ * which case nothing is recorded.  Unless KEYMASTER_LATENCY_STATISTICS is defined, the timer does
+ * nothing at all.
+ */
+class ScopedLatencyTimer {
+  public:
+#ifdef KEYMASTER_LATENCY_STATISTICS
+    ScopedLatencyTimer(LatencyStatistics* statistics, AndroidKeymasterCommand command)
+        : statistics_(statistics), command_(command),
+          algorithm_(GetStatisticsResponse::kNoAlgorithm),
+          purpose_(GetStatisticsResponse::kNoPurpose),
+          start_(statistics ? LatencyStatistics::NowMicroseconds() : 0) {}
+    ~ScopedLatencyTimer() {
+        if (statistics_)
+            statistics_->Record(command_, algorithm_, purpose_,
+                                LatencyStatistics::NowMicroseconds() - start_,
+                                allocations_.allocations(), allocations_.bytes());
+    }
+
+    void set_algorithm(keymaster_algorithm_t algorithm) { algorithm_ = algorithm; }
+    void set_purpose(keymaster_purpose_t purpose) { purpose_ = purpose; }
+    // Takes the algorithm from a key's or a key description's authorizations.
+    void set_key(const AuthorizationSet& authorizations) {
+        keymaster_algorithm_t algorithm;
+        if (authorizations.GetTagValue(TAG_ALGORITHM, &algorithm))
+            algorithm_ = algorithm;
+    }
+
+  private:
+    LatencyStatistics* statistics_;
+    AndroidKeymasterCommand command_;
+    uint32_t algorithm_;
+    uint32_t purpose_;
+    uint64_t start_;
+    AllocationCounter allocations_;
+#else
+    ScopedLatencyTimer(LatencyStatistics*, AndroidKeymasterCommand) {}
+
+    void set_algorithm(keymaster_algorithm_t) {}
+    void set_purpose(keymaster_purpose_t) {}
+    void set_key(const AuthorizationSet&) {}
+#endif
+
+  private:
+    // Disallow copying and assignment.
+    ScopedLatencyTimer(const ScopedLatencyTimer&);
+    void operator=(const ScopedLatencyTimer&);
+};
+
+/**
+ * ScopedRequestRecord passes request and response to recorder when it is destroyed, with the times
+ * of its construction and destruction, so it should be destroyed once response is complete.
+ * recorder may be null, in which case nothing is recorded.
+ */
+class ScopedRequestRecord {
+  public:
+    ScopedRequestRecord(RequestRecorder* recorder, AndroidKeymasterCommand command,
+                        const KeymasterMessage& request, const KeymasterResponse& response)
+        : recorder_(recorder), command_(command), request_(request), response_(response),
+          start_(recorder ? LatencyStatistics::NowMicroseconds() : 0) {}
+    ~ScopedRequestRecord() {
+        if (recorder_)
+            recorder_->Record(command_, request_, response_, start_,
+                              LatencyStatistics::NowMicroseconds());
+    }
+
+  private:
+    // Disallow copying and assignment.
+    ScopedRequestRecord(const ScopedRequestRecord&);
+    void operator=(const ScopedRequestRecord&);
+
+    RequestRecorder* recorder_;
+    AndroidKeymasterCommand command_;
+    const KeymasterMessage& request_;
+    const KeymasterResponse& response_;
+    uint64_t start_;
+};
+
+}  // namespace keymaster
+
+#endif  // SYSTEM_KEYMASTER_LATENCY_STATISTICS_H_
@@ -0,0 +1,133 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "loaded_key_cache.h"
+
+#include <openssl/sha.h>
+
+namespace keymaster {
+
+static_assert(sizeof(LoadedKeyCache::Digest) == SHA256_DIGEST_LENGTH,
+              "LoadedKeyCache::Digest must hold a SHA-256 digest");
+
+// Rough allowance for the bookkeeping around an entry, beyond the blob and authorization sizes and
+// the key's own memory footprint.
+static const size_t kEntryOverhead = 256;
+
+template <keymaster_tag_t Tag>
+static void HashParam(SHA256_CTX* ctx, const AuthorizationSet& params,
+                      TypedTag<KM_BYTES, Tag> tag) {
+    // Absent and empty values must hash differently, so each value is prefixed with a presence
+    // marker and its length.
+    keymaster_blob_t value = {nullptr, 0};
+    uint8_t present = params.GetTagValue(tag, &value) ? 1 : 0;
+    uint64_t length = value.data_length;
+    SHA256_Update(ctx, &present, sizeof(present));
+    SHA256_Update(ctx, &length, sizeof(length));
+    if (value.data_length)
+        SHA256_Update(ctx, value.data, value.data_length);
+}
+
+/* static */
+void LoadedKeyCache::ComputeLookup(const keymaster_key_blob_t& key_blob,
+                                   const AuthorizationSet& additional_params, Lookup* lookup) {
+    SHA256_CTX ctx;
+    SHA256_Init(&ctx);
+    SHA256_Update(&ctx, key_blob.key_material, key_blob.key_material_size);
+    SHA256_Final(lookup->blob_digest.data(), &ctx);
+
+    SHA256_Init(&ctx);
+    SHA256_Update(&ctx, lookup->blob_digest.data(), lookup->blob_digest.size());
+    HashParam(&ctx, additional_params, TAG_APPLICATION_ID);
+    HashParam(&ctx, additional_params, TAG_APPLICATION_DATA);
+    SHA256_Final(lookup->digest.data(), &ctx);
+}
+
+std::shared_ptr<const LoadedKey> LoadedKeyCache::Find(const Lookup& lookup) {
+    std::lock_guard<CountingMutex> lock(mutex_);
+    auto found = index_.find(lookup.digest);
+    if (found == index_.end())
+        return std::shared_ptr<const LoadedKey>();
+
+    EntryList::iterator entry = found->second;
+    entries_.splice(entries_.begin(), entries_, entry);
+    return entry->loaded_key;
+}
+
+void LoadedKeyCache::Insert(const Lookup& lookup, size_t blob_size,
+                            const std::shared_ptr<const LoadedKey>& loaded_key) {
+    if (!loaded_key || !loaded_key->key.get() || !loaded_key->key->shareable())
+        return;
+
+    size_t cost = blob_size + loaded_key->hw_enforced.SerializedSize() +
+                  loaded_key->sw_enforced.SerializedSize() + loaded_key->key->memory_footprint() +
+                  kEntryOverhead;
+    if (max_entries_ == 0 || cost > max_bytes_)
+        return;
+
+    std::lock_guard<CountingMutex> lock(mutex_);
+    auto found = index_.find(lookup.digest);
+    if (found != index_.end())
+        Evict(found->second);
+
+    while (!entries_.empty() &&
+           (entries_.size() >= max_entries_ || bytes_used_ + cost > max_bytes_))
+        Evict(std::prev(entries_.end()));
+
+    Entry entry;
+    entry.digest = lookup.digest;
+    entry.blob_digest = lookup.blob_digest;
+    entry.cost = cost;
+    entry.loaded_key = loaded_key;
+    entries_.push_front(entry);
+    index_[lookup.digest] = entries_.begin();
+    bytes_used_ += cost;
+}
+
+void LoadedKeyCache::Invalidate(const Digest& blob_digest) {
+    std::lock_guard<CountingMutex> lock(mutex_);
+    for (auto entry = entries_.begin(); entry != entries_.end();) {
+        auto next = std::next(entry);
+        if (entry->blob_digest == blob_digest)
+            Evict(entry);
+        entry = next;
+    }
+}
+
+void LoadedKeyCache::Clear() {
+    std::lock_guard<CountingMutex> lock(mutex_);
+    index_.clear();
+    entries_.clear();
+    bytes_used_ = 0;
+}
+
+size_t LoadedKeyCache::entry_count() const {
+    std::lock_guard<CountingMutex> lock(mutex_);
+    return entries_.size();
+}
+
+size_t LoadedKeyCache::bytes_used() const {
+    std::lock_guard<CountingMutex> lock(mutex_);
+    return bytes_used_;
+}
+
+void LoadedKeyCache::Evict(EntryList::iterator entry) {
+    bytes_used_ -= entry->cost;
+    index_.erase(entry->digest);
+    entries_.erase(entry);
+}
+
+}  // namespace keymaster
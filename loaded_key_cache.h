@@ -0,0 +1,142 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SYSTEM_KEYMASTER_LOADED_KEY_CACHE_H_
+#define SYSTEM_KEYMASTER_LOADED_KEY_CACHE_H_
+
+#include <array>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+
+#include <UniquePtr.h>
+
+#include <hardware/keymaster_defs.h>
+
+#include <keymaster/authorization_set.h>
+#include <keymaster/key_policy.h>
+#include <keymaster/lock_statistics.h>
+
+#include "key.h"
+
+namespace keymaster {
+
+class KeyFactory;
+
+/**
+ * A key blob that has been parsed and loaded, together with its authorizations, its policy and the
+ * factory that loaded it.  LoadedKeys are immutable once built, so one instance may back any number of
+ * concurrent operations.
+ */
+struct LoadedKey {
+    LoadedKey() : factory(nullptr) {}
+
+    UniquePtr<Key> key;
+    AuthorizationSet hw_enforced;
+    AuthorizationSet sw_enforced;
+    // What enforcement checks at Begin.  Only filled in if the context enforces authorizations.
+    KeyPolicy policy;
+    const KeyFactory* factory;
+};
+
+/**
+ * The digests that identify a key blob within a request: blob_digest is the SHA-256 digest of the
+ * blob bytes, and identifies the blob to the key cache, the pinned key table and enforcement (see
+ * KeymasterEnforcement::CreateKeyId); digest also covers the APPLICATION_ID and APPLICATION_DATA
+ * supplied with it, and identifies one load of the blob.  AndroidKeymaster computes a fingerprint
+ * once per request and passes it to each of those, so the blob bytes are hashed only once.
+ */
+struct KeyBlobFingerprint {
+    std::array<uint8_t, 32> blob_digest;
+    std::array<uint8_t, 32> digest;
+};
+
+/**
+ * LoadedKeyCache holds recently-loaded keys so that repeated use of the same blob skips blob
+ * parsing (and its integrity check) as well as key reconstruction.
+ *
+ * Entries are indexed by a SHA-256 digest of the blob bytes and the APPLICATION_ID and
+ * APPLICATION_DATA values supplied with it, so a hit is only possible for a blob that has already
+ * been successfully parsed with exactly those parameters.  The cache is bounded both by entry count
+ * and by an estimate of the memory the entries use; when either limit is exceeded the least
+ * recently used entries are discarded.  All methods are internally locked.
+ */
+class LoadedKeyCache {
+  public:
+    typedef std::array<uint8_t, 32> Digest;
+    typedef KeyBlobFingerprint Lookup;
+
+    LoadedKeyCache(size_t max_entries, size_t max_bytes)
+        : max_entries_(max_entries), max_bytes_(max_bytes), bytes_used_(0) {}
+
+    /**
+     * Computes the lookup digests for the specified blob and parameters.
+     */
+    static void ComputeLookup(const keymaster_key_blob_t& key_blob,
+                              const AuthorizationSet& additional_params, Lookup* lookup);
+
+    /**
+     * Returns the cached key for lookup, or an empty pointer if there is none.
+     */
+    std::shared_ptr<const LoadedKey> Find(const Lookup& lookup);
+
+    /**
+     * Adds loaded_key to the cache, evicting older entries as needed.  blob_size is the size of the
+     * blob the key was loaded from, and is used with Key::memory_footprint() in estimating the
+     * entry's memory cost.  Keys that are not shareable, or that are too large to ever fit, are
+     * silently not cached.
+     */
+    void Insert(const Lookup& lookup, size_t blob_size,
+                const std::shared_ptr<const LoadedKey>& loaded_key);
+
+    /**
+     * Discards all entries loaded from the blob with the specified digest, regardless of the
+     * parameters they were loaded with.
+     */
+    void Invalidate(const Digest& blob_digest);
+
+    void Clear();
+
+    size_t entry_count() const;
+    size_t bytes_used() const;
+
+    LockStatistics lock_statistics() const { return mutex_.statistics(); }
+
+  private:
+    struct Entry {
+        Digest digest;
+        Digest blob_digest;
+        size_t cost;
+        std::shared_ptr<const LoadedKey> loaded_key;
+    };
+    typedef std::list<Entry> EntryList;
+
+    void Evict(EntryList::iterator entry);
+
+    const size_t max_entries_;
+    const size_t max_bytes_;
+
+    mutable CountingMutex mutex_;
+    // Most recently used first.
+    EntryList entries_;
+    std::map<Digest, EntryList::iterator> index_;
+    size_t bytes_used_;
+};
+
+}  // namespace keymaster
+
+#endif  // SYSTEM_KEYMASTER_LOADED_KEY_CACHE_H_
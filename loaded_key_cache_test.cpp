@@ -0,0 +1,175 @@
+/*
+ * Copyright 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "loaded_key_cache.h"
+
+#include <gtest/gtest.h>
+
+#include "android_keymaster_test_utils.h"
+
+namespace keymaster {
+namespace test {
+
+class TestKey : public Key {
+  public:
+    TestKey(bool shareable, size_t material_bytes, keymaster_error_t* error)
+        : Key(AuthorizationSet(), AuthorizationSet(), error), shareable_(shareable),
+          material_bytes_(material_bytes) {}
+
+    keymaster_error_t formatted_key_material(keymaster_key_format_t, UniquePtr<uint8_t[]>*,
+                                             size_t*) const override {
+        return KM_ERROR_UNSUPPORTED_KEY_FORMAT;
+    }
+    bool shareable() const override { return shareable_; }
+
+  protected:
+    size_t object_size() const override { return sizeof(*this); }
+    size_t material_bytes() const override { return material_bytes_; }
+
+  private:
+    bool shareable_;
+    size_t material_bytes_;
+};
+
+static std::shared_ptr<const LoadedKey> MakeLoadedKey(bool shareable = true,
+                                                      size_t material_bytes = 0) {
+    std::shared_ptr<LoadedKey> loaded_key(new LoadedKey);
+    keymaster_error_t error;
+    loaded_key->key.reset(new TestKey(shareable, material_bytes, &error));
+    EXPECT_EQ(KM_ERROR_OK, error);
+    loaded_key->hw_enforced.push_back(TAG_ALGORITHM, KM_ALGORITHM_HMAC);
+    return loaded_key;
+}
+
+static LoadedKeyCache::Lookup MakeLookup(const std::string& blob,
+                                         const AuthorizationSet& params = AuthorizationSet()) {
+    keymaster_key_blob_t key_blob = {reinterpret_cast<const uint8_t*>(blob.data()), blob.size()};
+    LoadedKeyCache::Lookup lookup;
+    LoadedKeyCache::ComputeLookup(key_blob, params, &lookup);
+    return lookup;
+}
+
+TEST(LoadedKeyCacheTest, InsertFind) {
+    LoadedKeyCache cache(4, 64 * 1024);
+    LoadedKeyCache::Lookup lookup = MakeLookup("blob");
+    EXPECT_FALSE(cache.Find(lookup));
+
+    std::shared_ptr<const LoadedKey> key = MakeLoadedKey();
+    cache.Insert(lookup, 4, key);
+    EXPECT_EQ(1U, cache.entry_count());
+    EXPECT_EQ(key, cache.Find(lookup));
+    EXPECT_FALSE(cache.Find(MakeLookup("other blob")));
+}
+
+TEST(LoadedKeyCacheTest, ApplicationParamsAreKeyed) {
+    LoadedKeyCache cache(4, 64 * 1024);
+    AuthorizationSet empty_id(AuthorizationSetBuilder().Authorization(TAG_APPLICATION_ID, "", 0));
+    AuthorizationSet id(AuthorizationSetBuilder().Authorization(TAG_APPLICATION_ID, "id", 2));
+    AuthorizationSet data(AuthorizationSetBuilder().Authorization(TAG_APPLICATION_DATA, "id", 2));
+
+    cache.Insert(MakeLookup("blob", id), 4, MakeLoadedKey());
+    EXPECT_TRUE(cache.Find(MakeLookup("blob", id)));
+    EXPECT_FALSE(cache.Find(MakeLookup("blob")));
+    EXPECT_FALSE(cache.Find(MakeLookup("blob", empty_id)));
+    EXPECT_FALSE(cache.Find(MakeLookup("blob", data)));
+
+    // Other parameters don't affect the lookup.
+    AuthorizationSet id_and_purpose(AuthorizationSetBuilder()
+                                        .Authorization(TAG_APPLICATION_ID, "id", 2)
+                                        .Authorization(TAG_PURPOSE, KM_PURPOSE_SIGN));
+    EXPECT_TRUE(cache.Find(MakeLookup("blob", id_and_purpose)));
+}
+
+TEST(LoadedKeyCacheTest, EntryLimitEvictsLeastRecentlyUsed) {
+    LoadedKeyCache cache(2, 64 * 1024);
+    cache.Insert(MakeLookup("a"), 1, MakeLoadedKey());
+    cache.Insert(MakeLookup("b"), 1, MakeLoadedKey());
+    EXPECT_TRUE(cache.Find(MakeLookup("a")));
+
+    cache.Insert(MakeLookup("c"), 1, MakeLoadedKey());
+    EXPECT_EQ(2U, cache.entry_count());
+    EXPECT_TRUE(cache.Find(MakeLookup("a")));
+    EXPECT_FALSE(cache.Find(MakeLookup("b")));
+    EXPECT_TRUE(cache.Find(MakeLookup("c")));
+}
+
+TEST(LoadedKeyCacheTest, ByteLimit) {
+    LoadedKeyCache cache(100, 6144);
+    cache.Insert(MakeLookup("a"), 1500, MakeLoadedKey());
+    cache.Insert(MakeLookup("b"), 1500, MakeLoadedKey());
+    EXPECT_EQ(2U, cache.entry_count());
+    EXPECT_GE(6144U, cache.bytes_used());
+
+    cache.Insert(MakeLookup("c"), 1500, MakeLoadedKey());
+    EXPECT_EQ(2U, cache.entry_count());
+    EXPECT_GE(6144U, cache.bytes_used());
+    EXPECT_FALSE(cache.Find(MakeLookup("a")));
+
+    // Too large to ever fit.
+    cache.Insert(MakeLookup("d"), 8192, MakeLoadedKey());
+    EXPECT_FALSE(cache.Find(MakeLookup("d")));
+    EXPECT_EQ(2U, cache.entry_count());
+}
+
+TEST(LoadedKeyCacheTest, ByteLimitCountsKeyObjects) {
+    LoadedKeyCache cache(100, 8192);
+    std::shared_ptr<const LoadedKey> key = MakeLoadedKey(true /* shareable */, 3000);
+    cache.Insert(MakeLookup("a"), 1, key);
+    EXPECT_LT(key->key->memory_footprint(), cache.bytes_used());
+
+    // Small blobs, but the keys loaded from them are large.
+    cache.Insert(MakeLookup("b"), 1, MakeLoadedKey(true /* shareable */, 3000));
+    cache.Insert(MakeLookup("c"), 1, MakeLoadedKey(true /* shareable */, 3000));
+    EXPECT_EQ(2U, cache.entry_count());
+    EXPECT_GE(8192U, cache.bytes_used());
+    EXPECT_FALSE(cache.Find(MakeLookup("a")));
+
+    cache.Insert(MakeLookup("d"), 1, MakeLoadedKey(true /* shareable */, 8192));
+    EXPECT_FALSE(cache.Find(MakeLookup("d")));
+}
+
+TEST(LoadedKeyCacheTest, UnshareableKeysNotCached) {
+    LoadedKeyCache cache(4, 64 * 1024);
+    cache.Insert(MakeLookup("blob"), 4, MakeLoadedKey(false /* shareable */));
+    EXPECT_EQ(0U, cache.entry_count());
+    EXPECT_FALSE(cache.Find(MakeLookup("blob")));
+}
+
+TEST(LoadedKeyCacheTest, Invalidate) {
+    LoadedKeyCache cache(4, 64 * 1024);
+    AuthorizationSet id(AuthorizationSetBuilder().Authorization(TAG_APPLICATION_ID, "id", 2));
+    cache.Insert(MakeLookup("blob"), 4, MakeLoadedKey());
+    cache.Insert(MakeLookup("blob", id), 4, MakeLoadedKey());
+    cache.Insert(MakeLookup("other"), 5, MakeLoadedKey());
+
+    std::shared_ptr<const LoadedKey> in_use = cache.Find(MakeLookup("blob"));
+    cache.Invalidate(MakeLookup("blob").blob_digest);
+    EXPECT_EQ(1U, cache.entry_count());
+    EXPECT_FALSE(cache.Find(MakeLookup("blob")));
+    EXPECT_FALSE(cache.Find(MakeLookup("blob", id)));
+    EXPECT_TRUE(cache.Find(MakeLookup("other")));
+
+    // Holders of an invalidated key keep it alive.
+    ASSERT_TRUE(in_use);
+    EXPECT_TRUE(in_use->key.get() != nullptr);
+
+    cache.Clear();
+    EXPECT_EQ(0U, cache.entry_count());
+    EXPECT_EQ(0U, cache.bytes_used());
+}
+
+}  // namespace test
+}  // namespace keymaster
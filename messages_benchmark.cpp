@@ -0,0 +1,715 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * Benchmarks Serialize and Deserialize of every request and response in
+ * android_keymaster_messages.h, in both the fixed-width format of message version 4 and earlier
+ * and the compact format of later versions.
+ *
+ * The payloads are the sizes the messages carry in practice: RSA-2048 key blobs and signatures,
+ * 32-byte digests for small signs, 64 KiB updates, four-certificate attestation chains and batches
+ * of 16.  The contents are filler, which costs the same to serialize.  Each benchmark reports the
+ * serialized size of its message as message_bytes, and, if built with
+ * KEYMASTER_ALLOCATION_COUNTING, the keymaster allocations made per iteration.  A Serialize
+ * iteration sizes and writes the message into a preallocated buffer; a Deserialize iteration
+ * constructs an empty message, reads it back and destroys it, as a server does for each request.
+ */
+
+#include <string.h>
+
+#include <new>
+#include <string>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+
+#include <keymaster/allocation_counter.h>
+#include <keymaster/android_keymaster_messages.h>
+#include <keymaster/android_keymaster_utils.h>
+#include <keymaster/authorization_set.h>
+
+namespace keymaster {
+namespace {
+
+const int32_t kFixedWidthVersion = 4;
+const size_t kKeyBlobSize = 1350;      // An integrity-assured RSA-2048 blob.
+const size_t kPkcs8KeySize = 1218;     // An RSA-2048 PKCS#8 private key.
+const size_t kPublicKeySize = 294;     // An RSA-2048 SubjectPublicKeyInfo.
+const size_t kSignatureSize = 256;     // An RSA-2048 signature.
+const size_t kDigestSize = 32;         // The input of a small sign.
+const size_t kSmallUpdateSize = 1024;
+const size_t kLargeUpdateSize = 64 * 1024;
+const size_t kEntropySize = 64;
+const size_t kOperationTokenSize = 512;
+const size_t kBatchSize = 16;
+const size_t kHistogramCount = 40;
+const size_t kNonemptyBucketsPerHistogram = 8;
+const size_t kChainCertificateSizes[] = {1200, 1500, 1500, 1400};
+const uint64_t kHandle = 0x1234567890abcdefULL;
+
+std::string Filler(size_t size) {
+    std::string filler(size, '\0');
+    for (size_t i = 0; i < size; ++i)
+        filler[i] = static_cast<char>(i * 31 + 7);
+    return filler;
+}
+
+// Returns size bytes of filler, for any size up to kLargeUpdateSize.
+const uint8_t* FillerBytes(size_t size) {
+    static const std::string filler = Filler(kLargeUpdateSize);
+    return reinterpret_cast<const uint8_t*>(filler.data()) + kLargeUpdateSize - size;
+}
+
+AuthorizationSetBuilder KeyDescription() {
+    return AuthorizationSetBuilder()
+        .RsaSigningKey(2048, 65537)
+        .Digest(KM_DIGEST_SHA_2_256)
+        .Digest(KM_DIGEST_SHA_2_512)
+        .Padding(KM_PAD_RSA_PKCS1_1_5_SIGN)
+        .Padding(KM_PAD_RSA_PSS)
+        .Authorization(TAG_NO_AUTH_REQUIRED);
+}
+
+// The hardware-enforced and software-enforced characteristics of a typical key.
+AuthorizationSet Enforced() {
+    return KeyDescription()
+        .Authorization(TAG_ORIGIN, KM_ORIGIN_GENERATED)
+        .Authorization(TAG_OS_VERSION, 70000)
+        .Authorization(TAG_OS_PATCHLEVEL, 201609)
+        .build();
+}
+
+AuthorizationSet Unenforced() {
+    return AuthorizationSetBuilder().Authorization(TAG_CREATION_DATETIME, 1475000000000).build();
+}
+
+AuthorizationSetBuilder ClientParams() {
+    return AuthorizationSetBuilder()
+        .Authorization(TAG_APPLICATION_ID, "com.example.app", 15)
+        .Authorization(TAG_APPLICATION_DATA, "app_data", 8);
+}
+
+AuthorizationSet BeginParams() {
+    return ClientParams()
+        .Digest(KM_DIGEST_SHA_2_256)
+        .Padding(KM_PAD_RSA_PKCS1_1_5_SIGN)
+        .build();
+}
+
+AuthorizationSet NonceParams() {
+    return AuthorizationSetBuilder().Authorization(TAG_NONCE, FillerBytes(12), 12).build();
+}
+
+void SetBuffer(Buffer* buffer, size_t size) {
+    buffer->Reinitialize(FillerBytes(size), size);
+}
+
+void SetBlob(KeymasterKeyBlob* blob, size_t size) {
+    *blob = KeymasterKeyBlob(FillerBytes(size), size);
+}
+
+bool SetChain(keymaster_cert_chain_t* chain) {
+    size_t count = array_length(kChainCertificateSizes);
+    chain->entries = new (std::nothrow) keymaster_blob_t[count];
+    if (!chain->entries)
+        return false;
+    chain->entry_count = count;
+    for (size_t i = 0; i < count; ++i) {
+        chain->entries[i].data = dup_buffer(FillerBytes(kChainCertificateSizes[i]),
+                                            kChainCertificateSizes[i]);
+        chain->entries[i].data_length = kChainCertificateSizes[i];
+    }
+    return true;
+}
+
+// Fill functions, one for each message and payload benchmarked.  Responses are filled as
+// successes, since failed ones carry nothing but the error.
+
+void FillNothing(KeymasterMessage*) {}
+
+void FillOk(KeymasterResponse* response) {
+    response->error = KM_ERROR_OK;
+}
+
+void FillSupportedByAlgorithm(SupportedByAlgorithmRequest* request) {
+    request->algorithm = KM_ALGORITHM_RSA;
+}
+
+void FillSupportedByAlgorithmAndPurpose(SupportedByAlgorithmAndPurposeRequest* request) {
+    request->algorithm = KM_ALGORITHM_RSA;
+    request->purpose = KM_PURPOSE_SIGN;
+}
+
+void FillSupportedAlgorithms(SupportedAlgorithmsResponse* response) {
+    const keymaster_algorithm_t algorithms[] = {KM_ALGORITHM_RSA, KM_ALGORITHM_EC,
+                                                KM_ALGORITHM_AES, KM_ALGORITHM_HMAC};
+    response->SetResults(algorithms);
+}
+
+void FillSupportedBlockModes(SupportedBlockModesResponse* response) {
+    const keymaster_block_mode_t modes[] = {KM_MODE_ECB, KM_MODE_CBC, KM_MODE_CTR, KM_MODE_GCM};
+    response->SetResults(modes);
+}
+
+void FillSupportedPaddingModes(SupportedPaddingModesResponse* response) {
+    const keymaster_padding_t paddings[] = {KM_PAD_NONE, KM_PAD_RSA_OAEP, KM_PAD_RSA_PSS,
+                                            KM_PAD_RSA_PKCS1_1_5_ENCRYPT,
+                                            KM_PAD_RSA_PKCS1_1_5_SIGN};
+    response->SetResults(paddings);
+}
+
+void FillSupportedDigests(SupportedDigestsResponse* response) {
+    const keymaster_digest_t digests[] = {KM_DIGEST_NONE,      KM_DIGEST_MD5,
+                                          KM_DIGEST_SHA1,      KM_DIGEST_SHA_2_224,
+                                          KM_DIGEST_SHA_2_256, KM_DIGEST_SHA_2_384,
+                                          KM_DIGEST_SHA_2_512};
+    response->SetResults(digests);
+}
+
+template <typename Response> void FillSupportedFormats(Response* response) {
+    const keymaster_key_format_t formats[] = {KM_KEY_FORMAT_X509, KM_KEY_FORMAT_PKCS8,
+                                              KM_KEY_FORMAT_RAW};
+    response->SetResults(formats);
+}
+
+void FillGenerateKeyRequest(GenerateKeyRequest* request) {
+    request->key_description.Reinitialize(KeyDescription().build());
+}
+
+void FillGenerateKeyResponse(GenerateKeyResponse* response) {
+    FillOk(response);
+    response->key_blob.key_material = dup_buffer(FillerBytes(kKeyBlobSize), kKeyBlobSize);
+    response->key_blob.key_material_size = kKeyBlobSize;
+    response->enforced.Reinitialize(Enforced());
+    response->unenforced.Reinitialize(Unenforced());
+}
+
+void FillGetKeyCharacteristicsRequest(GetKeyCharacteristicsRequest* request) {
+    request->SetKeyMaterial(FillerBytes(kKeyBlobSize), kKeyBlobSize);
+    request->additional_params.Reinitialize(ClientParams().build());
+}
+
+void FillGetKeyCharacteristicsResponse(GetKeyCharacteristicsResponse* response) {
+    FillOk(response);
+    response->enforced.Reinitialize(Enforced());
+    response->unenforced.Reinitialize(Unenforced());
+}
+
+void FillBeginOperationRequest(BeginOperationRequest* request) {
+    request->purpose = KM_PURPOSE_SIGN;
+    request->SetKeyMaterial(FillerBytes(kKeyBlobSize), kKeyBlobSize);
+    request->additional_params.Reinitialize(BeginParams());
+}
+
+void FillBeginOperationResponse(BeginOperationResponse* response) {
+    FillOk(response);
+    response->op_handle = kHandle;
+    response->output_params.Reinitialize(NonceParams());
+}
+
+template <size_t Size> void FillUpdateOperationRequest(UpdateOperationRequest* request) {
+    request->op_handle = kHandle;
+    SetBuffer(&request->input, Size);
+}
+
+template <size_t Size> void FillUpdateOperationResponse(UpdateOperationResponse* response) {
+    FillOk(response);
+    SetBuffer(&response->output, Size);
+    response->input_consumed = Size;
+}
+
+void FillUpdateAadRequest(UpdateAadRequest* request) {
+    request->op_handle = kHandle;
+    SetBuffer(&request->aad, kSmallUpdateSize);
+}
+
+void FillFinishSignRequest(FinishOperationRequest* request) {
+    request->op_handle = kHandle;
+    SetBuffer(&request->input, kDigestSize);
+}
+
+void FillFinishVerifyRequest(FinishOperationRequest* request) {
+    FillFinishSignRequest(request);
+    SetBuffer(&request->signature, kSignatureSize);
+}
+
+void FillFinishLargeRequest(FinishOperationRequest* request) {
+    request->op_handle = kHandle;
+    SetBuffer(&request->input, kLargeUpdateSize);
+}
+
+template <size_t Size> void FillFinishOperationResponse(FinishOperationResponse* response) {
+    FillOk(response);
+    SetBuffer(&response->output, Size);
+}
+
+void FillAbortOperationRequest(AbortOperationRequest* request) {
+    request->op_handle = kHandle;
+}
+
+void FillAddEntropyRequest(AddEntropyRequest* request) {
+    SetBuffer(&request->random_data, kEntropySize);
+}
+
+void FillImportKeyRequest(ImportKeyRequest* request) {
+    request->key_description.Reinitialize(KeyDescription().build());
+    request->key_format = KM_KEY_FORMAT_PKCS8;
+    request->SetKeyMaterial(FillerBytes(kPkcs8KeySize), kPkcs8KeySize);
+}
+
+void FillImportKeyResponse(ImportKeyResponse* response) {
+    FillOk(response);
+    response->SetKeyMaterial(FillerBytes(kKeyBlobSize), kKeyBlobSize);
+    response->enforced.Reinitialize(Enforced());
+    response->unenforced.Reinitialize(Unenforced());
+}
+
+void FillExportKeyRequest(ExportKeyRequest* request) {
+    request->key_format = KM_KEY_FORMAT_X509;
+    request->SetKeyMaterial(FillerBytes(kKeyBlobSize), kKeyBlobSize);
+    request->additional_params.Reinitialize(ClientParams().build());
+}
+
+void FillExportKeyResponse(ExportKeyResponse* response) {
+    FillOk(response);
+    response->SetKeyMaterial(FillerBytes(kPublicKeySize), kPublicKeySize);
+}
+
+void FillDeleteKeyRequest(DeleteKeyRequest* request) {
+    request->SetKeyMaterial(FillerBytes(kKeyBlobSize), kKeyBlobSize);
+}
+
+void FillGetVersionResponse(GetVersionResponse* response) {
+    FillOk(response);
+    response->major_ver = 2;
+    response->minor_ver = 0;
+    response->subminor_ver = 0;
+}
+
+void FillAttestKeyRequest(AttestKeyRequest* request) {
+    request->SetKeyMaterial(FillerBytes(kKeyBlobSize), kKeyBlobSize);
+    request->attest_params.Reinitialize(
+        ClientParams()
+            .Authorization(TAG_ATTESTATION_CHALLENGE, FillerBytes(kDigestSize), kDigestSize)
+            .build());
+}
+
+void FillAttestKeyResponse(AttestKeyResponse* response) {
+    FillOk(response);
+    SetChain(&response->certificate_chain);
+}
+
+void FillUpgradeKeyRequest(UpgradeKeyRequest* request) {
+    request->SetKeyMaterial(FillerBytes(kKeyBlobSize), kKeyBlobSize);
+    request->upgrade_params.Reinitialize(ClientParams().build());
+}
+
+void FillUpgradeKeyResponse(UpgradeKeyResponse* response) {
+    FillOk(response);
+    response->upgraded_key.key_material = dup_buffer(FillerBytes(kKeyBlobSize), kKeyBlobSize);
+    response->upgraded_key.key_material_size = kKeyBlobSize;
+}
+
+void FillMigrateKeyRequest(MigrateKeyRequest* request) {
+    request->SetKeyMaterial(FillerBytes(kKeyBlobSize), kKeyBlobSize);
+    request->additional_params.Reinitialize(ClientParams().build());
+}
+
+void FillMigrateKeyResponse(MigrateKeyResponse* response) {
+    FillOk(response);
+    response->migrated_key.key_material = dup_buffer(FillerBytes(kKeyBlobSize), kKeyBlobSize);
+    response->migrated_key.key_material_size = kKeyBlobSize;
+}
+
+void FillPinKeyRequest(PinKeyRequest* request) {
+    request->SetKeyMaterial(FillerBytes(kKeyBlobSize), kKeyBlobSize);
+    request->additional_params.Reinitialize(ClientParams().build());
+}
+
+void FillPinKeyResponse(PinKeyResponse* response) {
+    FillOk(response);
+    response->key_handle = kHandle;
+}
+
+void FillUnpinKeyRequest(UnpinKeyRequest* request) {
+    request->key_handle = kHandle;
+}
+
+void FillWarmupKeysRequest(WarmupKeysRequest* request) {
+    if (request->SetItemCount(kBatchSize))
+        for (size_t i = 0; i < kBatchSize; ++i) {
+            SetBlob(&request->items[i].key_blob, kKeyBlobSize);
+            request->items[i].additional_params.Reinitialize(ClientParams().build());
+        }
+}
+
+void FillOneShotSignRequest(OneShotOperationRequest* request) {
+    request->purpose = KM_PURPOSE_SIGN;
+    request->SetKeyMaterial(FillerBytes(kKeyBlobSize), kKeyBlobSize);
+    request->additional_params.Reinitialize(BeginParams());
+    SetBuffer(&request->input, kDigestSize);
+}
+
+void FillOneShotSignResponse(OneShotOperationResponse* response) {
+    FillOk(response);
+    SetBuffer(&response->output, kSignatureSize);
+}
+
+void FillBatchOperationRequest(BatchOperationRequest* request) {
+    request->purpose = KM_PURPOSE_SIGN;
+    request->SetKeyMaterial(FillerBytes(kKeyBlobSize), kKeyBlobSize);
+    request->additional_params.Reinitialize(BeginParams());
+    if (request->SetItemCount(kBatchSize))
+        for (size_t i = 0; i < kBatchSize; ++i)
+            SetBuffer(&request->items[i].input, kDigestSize);
+}
+
+void FillBatchOperationResponse(BatchOperationResponse* response) {
+    FillOk(response);
+    if (response->SetItemCount(kBatchSize))
+        for (size_t i = 0; i < kBatchSize; ++i) {
+            response->items[i].error = KM_ERROR_OK;
+            SetBuffer(&response->items[i].output, kSignatureSize);
+        }
+}
+
+void FillBatchUpgradeKeyRequest(BatchUpgradeKeyRequest* request) {
+    request->upgrade_params.Reinitialize(ClientParams().build());
+    if (request->SetItemCount(kBatchSize))
+        for (size_t i = 0; i < kBatchSize; ++i)
+            SetBlob(&request->items[i].key_blob, kKeyBlobSize);
+}
+
+void FillBatchUpgradeKeyResponse(BatchUpgradeKeyResponse* response) {
+    FillOk(response);
+    if (response->SetItemCount(kBatchSize))
+        for (size_t i = 0; i < kBatchSize; ++i) {
+            response->items[i].error = KM_ERROR_OK;
+            SetBlob(&response->items[i].upgraded_key, kKeyBlobSize);
+        }
+}
+
+void FillGenerateKeysRequest(GenerateKeysRequest* request) {
+    if (request->SetItemCount(kBatchSize))
+        for (size_t i = 0; i < kBatchSize; ++i)
+            request->items[i].key_description.Reinitialize(KeyDescription().build());
+}
+
+void FillGenerateKeysResponse(GenerateKeysResponse* response) {
+    FillOk(response);
+    AuthorizationSet enforced(Enforced()), unenforced(Unenforced());
+    if (response->SetItemCount(kBatchSize))
+        for (size_t i = 0; i < kBatchSize; ++i) {
+            response->items[i].error = KM_ERROR_OK;
+            SetBlob(&response->items[i].key_blob, kKeyBlobSize);
+            response->items[i].enforced.Reinitialize(enforced);
+            response->items[i].unenforced.Reinitialize(unenforced);
+        }
+}
+
+void FillBatchGetKeyCharacteristicsRequest(BatchGetKeyCharacteristicsRequest* request) {
+    request->additional_params.Reinitialize(ClientParams().build());
+    if (request->SetItemCount(kBatchSize))
+        for (size_t i = 0; i < kBatchSize; ++i)
+            SetBlob(&request->items[i].key_blob, kKeyBlobSize);
+}
+
+void FillBatchGetKeyCharacteristicsResponse(BatchGetKeyCharacteristicsResponse* response) {
+    FillOk(response);
+    AuthorizationSet enforced(Enforced()), unenforced(Unenforced());
+    if (response->SetItemCount(kBatchSize))
+        for (size_t i = 0; i < kBatchSize; ++i) {
+            response->items[i].error = KM_ERROR_OK;
+            response->items[i].enforced.Reinitialize(enforced);
+            response->items[i].unenforced.Reinitialize(unenforced);
+        }
+}
+
+void FillBatchDeleteKeyRequest(BatchDeleteKeyRequest* request) {
+    if (request->SetItemCount(kBatchSize))
+        for (size_t i = 0; i < kBatchSize; ++i)
+            SetBlob(&request->items[i].key_blob, kKeyBlobSize);
+}
+
+void FillBatchDeleteKeyResponse(BatchDeleteKeyResponse* response) {
+    FillOk(response);
+    if (response->SetItemCount(kBatchSize))
+        for (size_t i = 0; i < kBatchSize; ++i)
+            response->items[i].error = KM_ERROR_OK;
+}
+
+void FillBatchAttestKeyRequest(BatchAttestKeyRequest* request) {
+    request->attest_params.Reinitialize(
+        ClientParams()
+            .Authorization(TAG_ATTESTATION_CHALLENGE, FillerBytes(kDigestSize), kDigestSize)
+            .build());
+    if (request->SetItemCount(kBatchSize))
+        for (size_t i = 0; i < kBatchSize; ++i)
+            SetBlob(&request->items[i].key_blob, kKeyBlobSize);
+}
+
+// The keys share the issuers of a four-certificate chain, so each item carries just its leaf.
+void FillBatchAttestKeyResponse(BatchAttestKeyResponse* response) {
+    FillOk(response);
+    keymaster_cert_chain_t chain = {nullptr, 0};
+    if (!SetChain(&chain))
+        return;
+    keymaster_cert_chain_t issuers = {chain.entries + 1, chain.entry_count - 1};
+    if (response->SetIssuerChainCount(1) && response->SetIssuerChain(0, issuers) &&
+        response->SetItemCount(kBatchSize))
+        for (size_t i = 0; i < kBatchSize; ++i) {
+            response->items[i].error = KM_ERROR_OK;
+            response->items[i].certificate.data =
+                dup_buffer(chain.entries[0].data, chain.entries[0].data_length);
+            response->items[i].certificate.data_length = chain.entries[0].data_length;
+            response->items[i].issuer_chain = 0;
+        }
+    keymaster_free_cert_chain(&chain);
+}
+
+void FillExportOperationRequest(ExportOperationRequest* request) {
+    request->op_handle = kHandle;
+}
+
+void FillExportOperationResponse(ExportOperationResponse* response) {
+    FillOk(response);
+    SetBuffer(&response->token, kOperationTokenSize);
+}
+
+void FillImportOperationRequest(ImportOperationRequest* request) {
+    SetBlob(&request->key_blob, kKeyBlobSize);
+    request->additional_params.Reinitialize(ClientParams().build());
+    SetBuffer(&request->token, kOperationTokenSize);
+}
+
+void FillImportOperationResponse(ImportOperationResponse* response) {
+    FillOk(response);
+    response->op_handle = kHandle;
+}
+
+void FillGetStatisticsResponse(GetStatisticsResponse* response) {
+    FillOk(response);
+    if (!response->SetHistogramCount(kHistogramCount))
+        return;
+    for (size_t i = 0; i < kHistogramCount; ++i) {
+        GetStatisticsResponse::Histogram& histogram = response->histograms[i];
+        histogram.command = i;
+        histogram.count = 1000 * (i + 1);
+        histogram.total_microseconds = 250 * histogram.count;
+        for (size_t j = 0; j < kNonemptyBucketsPerHistogram; ++j)
+            histogram.buckets[20 + j] = histogram.count / kNonemptyBucketsPerHistogram;
+    }
+}
+
+struct MessageCase {
+    const char* name;
+    KeymasterMessage* (*new_empty)(int32_t version);
+    KeymasterMessage* (*new_filled)(int32_t version);
+};
+
+// Messages that aren't versioned keep their version of zero.
+template <typename Message> KeymasterMessage* NewEmpty(int32_t version) {
+    Message* message = new (std::nothrow) Message;
+    if (message && message->message_version != 0)
+        message->message_version = version;
+    return message;
+}
+
+template <typename Message, typename Base, void (*Fill)(Base*)>
+KeymasterMessage* NewFilled(int32_t version) {
+    Message* message = static_cast<Message*>(NewEmpty<Message>(version));
+    if (message)
+        Fill(message);
+    return message;
+}
+
+#define MESSAGE_CASE(Message, payload, Base, Fill)                                                 \
+    { #Message payload, NewEmpty<Message>, NewFilled<Message, Base, Fill> }
+#define EMPTY_REQUEST_CASE(Message) MESSAGE_CASE(Message, "", KeymasterMessage, FillNothing)
+#define EMPTY_RESPONSE_CASE(Message) MESSAGE_CASE(Message, "", KeymasterResponse, FillOk)
+#define FILLED_CASE(Message, payload, Fill) MESSAGE_CASE(Message, payload, Message, Fill)
+
+const MessageCase kMessageCases[] = {
+    EMPTY_REQUEST_CASE(SupportedAlgorithmsRequest),
+    MESSAGE_CASE(SupportedImportFormatsRequest, "", SupportedByAlgorithmRequest,
+                 FillSupportedByAlgorithm),
+    MESSAGE_CASE(SupportedExportFormatsRequest, "", SupportedByAlgorithmRequest,
+                 FillSupportedByAlgorithm),
+    MESSAGE_CASE(SupportedBlockModesRequest, "", SupportedByAlgorithmAndPurposeRequest,
+                 FillSupportedByAlgorithmAndPurpose),
+    MESSAGE_CASE(SupportedPaddingModesRequest, "", SupportedByAlgorithmAndPurposeRequest,
+                 FillSupportedByAlgorithmAndPurpose),
+    MESSAGE_CASE(SupportedDigestsRequest, "", SupportedByAlgorithmAndPurposeRequest,
+                 FillSupportedByAlgorithmAndPurpose),
+    FILLED_CASE(SupportedAlgorithmsResponse, "", FillSupportedAlgorithms),
+    FILLED_CASE(SupportedBlockModesResponse, "", FillSupportedBlockModes),
+    FILLED_CASE(SupportedPaddingModesResponse, "", FillSupportedPaddingModes),
+    FILLED_CASE(SupportedDigestsResponse, "", FillSupportedDigests),
+    FILLED_CASE(SupportedImportFormatsResponse, "",
+                FillSupportedFormats<SupportedImportFormatsResponse>),
+    FILLED_CASE(SupportedExportFormatsResponse, "",
+                FillSupportedFormats<SupportedExportFormatsResponse>),
+    FILLED_CASE(GenerateKeyRequest, "", FillGenerateKeyRequest),
+    FILLED_CASE(GenerateKeyResponse, "", FillGenerateKeyResponse),
+    FILLED_CASE(GetKeyCharacteristicsRequest, "", FillGetKeyCharacteristicsRequest),
+    FILLED_CASE(GetKeyCharacteristicsResponse, "", FillGetKeyCharacteristicsResponse),
+    FILLED_CASE(BeginOperationRequest, "", FillBeginOperationRequest),
+    FILLED_CASE(BeginOperationResponse, "", FillBeginOperationResponse),
+    FILLED_CASE(UpdateOperationRequest, "/1KiB", FillUpdateOperationRequest<kSmallUpdateSize>),
+    FILLED_CASE(UpdateOperationRequest, "/64KiB", FillUpdateOperationRequest<kLargeUpdateSize>),
+    FILLED_CASE(UpdateOperationResponse, "/1KiB", FillUpdateOperationResponse<kSmallUpdateSize>),
+    FILLED_CASE(UpdateOperationResponse, "/64KiB",
+                FillUpdateOperationResponse<kLargeUpdateSize>),
+    FILLED_CASE(UpdateAadRequest, "/1KiB", FillUpdateAadRequest),
+    EMPTY_RESPONSE_CASE(UpdateAadResponse),
+    FILLED_CASE(FinishOperationRequest, "/Sign", FillFinishSignRequest),
+    FILLED_CASE(FinishOperationRequest, "/Verify", FillFinishVerifyRequest),
+    FILLED_CASE(FinishOperationRequest, "/64KiB", FillFinishLargeRequest),
+    FILLED_CASE(FinishOperationResponse, "/Signature",
+                FillFinishOperationResponse<kSignatureSize>),
+    FILLED_CASE(FinishOperationResponse, "/64KiB", FillFinishOperationResponse<kLargeUpdateSize>),
+    FILLED_CASE(AbortOperationRequest, "", FillAbortOperationRequest),
+    EMPTY_RESPONSE_CASE(AbortOperationResponse),
+    FILLED_CASE(AddEntropyRequest, "", FillAddEntropyRequest),
+    EMPTY_RESPONSE_CASE(AddEntropyResponse),
+    FILLED_CASE(ImportKeyRequest, "", FillImportKeyRequest),
+    FILLED_CASE(ImportKeyResponse, "", FillImportKeyResponse),
+    FILLED_CASE(ExportKeyRequest, "", FillExportKeyRequest),
+    FILLED_CASE(ExportKeyResponse, "", FillExportKeyResponse),
+    FILLED_CASE(DeleteKeyRequest, "", FillDeleteKeyRequest),
+    EMPTY_RESPONSE_CASE(DeleteKeyResponse),
+    EMPTY_REQUEST_CASE(DeleteAllKeysRequest),
+    EMPTY_RESPONSE_CASE(DeleteAllKeysResponse),
+    EMPTY_REQUEST_CASE(GetVersionRequest),
+    FILLED_CASE(GetVersionResponse, "", FillGetVersionResponse),
+    FILLED_CASE(AttestKeyRequest, "", FillAttestKeyRequest),
+    FILLED_CASE(AttestKeyResponse, "", FillAttestKeyResponse),
+    FILLED_CASE(UpgradeKeyRequest, "", FillUpgradeKeyRequest),
+    FILLED_CASE(UpgradeKeyResponse, "", FillUpgradeKeyResponse),
+    FILLED_CASE(MigrateKeyRequest, "", FillMigrateKeyRequest),
+    FILLED_CASE(MigrateKeyResponse, "", FillMigrateKeyResponse),
+    FILLED_CASE(PinKeyRequest, "", FillPinKeyRequest),
+    FILLED_CASE(PinKeyResponse, "", FillPinKeyResponse),
+    FILLED_CASE(UnpinKeyRequest, "", FillUnpinKeyRequest),
+    EMPTY_RESPONSE_CASE(UnpinKeyResponse),
+    FILLED_CASE(WarmupKeysRequest, "/16Keys", FillWarmupKeysRequest),
+    EMPTY_RESPONSE_CASE(WarmupKeysResponse),
+    FILLED_CASE(OneShotOperationRequest, "/Sign", FillOneShotSignRequest),
+    FILLED_CASE(OneShotOperationResponse, "/Signature", FillOneShotSignResponse),
+    FILLED_CASE(BatchOperationRequest, "/16Signs", FillBatchOperationRequest),
+    FILLED_CASE(BatchOperationResponse, "/16Signatures", FillBatchOperationResponse),
+    FILLED_CASE(BatchUpgradeKeyRequest, "/16Keys", FillBatchUpgradeKeyRequest),
+    FILLED_CASE(BatchUpgradeKeyResponse, "/16Keys", FillBatchUpgradeKeyResponse),
+    FILLED_CASE(GenerateKeysRequest, "/16Keys", FillGenerateKeysRequest),
+    FILLED_CASE(GenerateKeysResponse, "/16Keys", FillGenerateKeysResponse),
+    FILLED_CASE(BatchGetKeyCharacteristicsRequest, "/16Keys",
+                FillBatchGetKeyCharacteristicsRequest),
+    FILLED_CASE(BatchGetKeyCharacteristicsResponse, "/16Keys",
+                FillBatchGetKeyCharacteristicsResponse),
+    FILLED_CASE(BatchDeleteKeyRequest, "/16Keys", FillBatchDeleteKeyRequest),
+    FILLED_CASE(BatchDeleteKeyResponse, "/16Keys", FillBatchDeleteKeyResponse),
+    FILLED_CASE(BatchAttestKeyRequest, "/16Keys", FillBatchAttestKeyRequest),
+    FILLED_CASE(BatchAttestKeyResponse, "/16Keys", FillBatchAttestKeyResponse),
+    FILLED_CASE(ExportOperationRequest, "", FillExportOperationRequest),
+    FILLED_CASE(ExportOperationResponse, "", FillExportOperationResponse),
+    FILLED_CASE(ImportOperationRequest, "", FillImportOperationRequest),
+    FILLED_CASE(ImportOperationResponse, "", FillImportOperationResponse),
+    EMPTY_REQUEST_CASE(GetStatisticsRequest),
+    FILLED_CASE(GetStatisticsResponse, "", FillGetStatisticsResponse),
+};
+
+void ReportMessage(benchmark::State& state, size_t message_bytes,
+                   const AllocationCounter& allocations) {
+    state.SetBytesProcessed(state.iterations() * message_bytes);
+    state.counters["message_bytes"] = message_bytes;
+#ifdef KEYMASTER_ALLOCATION_COUNTING
+    state.counters["allocations"] =
+        benchmark::Counter(allocations.allocations(), benchmark::Counter::kAvgIterations);
+#else
+    (void)allocations;
+#endif
+}
+
+void SerializeMessage(benchmark::State& state, const MessageCase* message_case, int32_t version) {
+    UniquePtr<KeymasterMessage> message(message_case->new_filled(version));
+    size_t size = message.get() ? message->SerializedSize() : 0;
+    UniquePtr<uint8_t[]> buf(new (std::nothrow) uint8_t[size]);
+    if (!message.get() || !buf.get()) {
+        state.SkipWithError("Can't build the message");
+        return;
+    }
+    AllocationCounter allocations;
+    while (state.KeepRunning()) {
+        size_t serialized_size = message->SerializedSize();
+        if (message->Serialize(buf.get(), buf.get() + serialized_size) !=
+            buf.get() + serialized_size) {
+            state.SkipWithError("Serialize failed");
+            break;
+        }
+    }
+    ReportMessage(state, size, allocations);
+}
+
+void DeserializeMessage(benchmark::State& state, const MessageCase* message_case,
+                        int32_t version) {
+    UniquePtr<KeymasterMessage> message(message_case->new_filled(version));
+    size_t size = message.get() ? message->SerializedSize() : 0;
+    UniquePtr<uint8_t[]> buf(new (std::nothrow) uint8_t[size]);
+    if (!message.get() || !buf.get() ||
+        message->Serialize(buf.get(), buf.get() + size) != buf.get() + size) {
+        state.SkipWithError("Can't build the message");
+        return;
+    }
+    const uint8_t* end = buf.get() + size;
+    AllocationCounter allocations;
+    while (state.KeepRunning()) {
+        UniquePtr<KeymasterMessage> copy(message_case->new_empty(version));
+        const uint8_t* p = buf.get();
+        if (!copy.get() || !copy->Deserialize(&p, end) || p != end) {
+            state.SkipWithError("Deserialize failed");
+            break;
+        }
+    }
+    ReportMessage(state, size, allocations);
+}
+
+void RegisterMessageBenchmarks() {
+    for (const MessageCase& message_case : kMessageCases) {
+        UniquePtr<KeymasterMessage> probe(message_case.new_empty(MAX_MESSAGE_VERSION));
+        std::vector<std::pair<std::string, int32_t>> formats;
+        if (probe.get() && probe->message_version == 0) {
+            formats.push_back(std::make_pair("", 0));
+        } else {
+            formats.push_back(std::make_pair("/FixedWidth", kFixedWidthVersion));
+            formats.push_back(std::make_pair("/Compact", MAX_MESSAGE_VERSION));
+        }
+        for (auto& format : formats) {
+            std::string suffix = message_case.name + format.first;
+            benchmark::RegisterBenchmark(("Serialize/" + suffix).c_str(), SerializeMessage,
+                                         &message_case, format.second);
+            benchmark::RegisterBenchmark(("Deserialize/" + suffix).c_str(), DeserializeMessage,
+                                         &message_case, format.second);
+        }
+    }
+}
+
+// The benchmarks are registered during static initialization, as the BENCHMARK macros do.
+struct MessageBenchmarkRegistration {
+    MessageBenchmarkRegistration() { RegisterMessageBenchmarks(); }
+} message_benchmark_registration;
+
+}  // namespace
+}  // namespace keymaster
@@ -16,17 +16,26 @@
 
 #include "nist_curve_key_exchange.h"
 
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <vector>
+
+#include <openssl/bn.h>
 #include <openssl/ec.h>
 #include <openssl/ecdh.h>
 #include <openssl/err.h>
 #include <openssl/evp.h>
 
 #include "openssl_err.h"
+#include "worker_pool.h"
 
 namespace keymaster {
 
+const size_t NistCurveKeyExchange::kMinParallelSharedKeys;
+
 NistCurveKeyExchange::NistCurveKeyExchange(EC_KEY* private_key, keymaster_error_t* error)
-    : private_key_(private_key) {
+    : private_key_(private_key), point_form_(POINT_CONVERSION_UNCOMPRESSED) {
     if (!private_key_.get() || !EC_KEY_check_key(private_key_.get())) {
         *error = KM_ERROR_INVALID_ARGUMENT;
         return;
@@ -36,27 +45,15 @@ NistCurveKeyExchange::NistCurveKeyExchange(EC_KEY* private_key, keymaster_error_
 
 /* static */
 NistCurveKeyExchange* NistCurveKeyExchange::GenerateKeyExchange(keymaster_ec_curve_t curve) {
-    int curve_name;
-    switch (curve) {
-    case KM_EC_CURVE_P_224:
-        curve_name = NID_secp224r1;
-        break;
-    case KM_EC_CURVE_P_256:
-        curve_name = NID_X9_62_prime256v1;
-        break;
-    case KM_EC_CURVE_P_384:
-        curve_name = NID_secp384r1;
-        break;
-    case KM_EC_CURVE_P_521:
-        curve_name = NID_secp521r1;
-        break;
-    default:
+    // Share one group per curve so ephemeral keys reuse its precomputed generator multiples.
+    const EC_GROUP* group = ec_get_precomputed_group(curve);
+    if (!group) {
         LOG_E("Not a NIST curve: %d", curve);
         return nullptr;
     }
 
-    UniquePtr<EC_KEY, EC_KEY_Delete> key(EC_KEY_new_by_curve_name(curve_name));
-    if (!key.get() || !EC_KEY_generate_key(key.get())) {
+    UniquePtr<EC_KEY, EC_KEY_Delete> key(EC_KEY_new());
+    if (!key.get() || !EC_KEY_set_group(key.get(), group) || !EC_KEY_generate_key(key.get())) {
         return nullptr;
     }
     keymaster_error_t error;
@@ -67,6 +64,11 @@ NistCurveKeyExchange* NistCurveKeyExchange::GenerateKeyExchange(keymaster_ec_cur
     return key_exchange;
 }
 
+keymaster_error_t NistCurveKeyExchange::SetPointCompression(bool compressed) {
+    point_form_ = compressed ? POINT_CONVERSION_COMPRESSED : POINT_CONVERSION_UNCOMPRESSED;
+    return ExtractPublicKey();
+}
+
 keymaster_error_t NistCurveKeyExchange::ExtractPublicKey() {
     const EC_GROUP* group = EC_KEY_get0_group(private_key_.get());
     size_t field_len_bits;
@@ -75,10 +77,10 @@ keymaster_error_t NistCurveKeyExchange::ExtractPublicKey() {
         return error;
 
     shared_secret_len_ = (field_len_bits + 7) / 8;
-    public_key_len_ = 1 + 2 * shared_secret_len_;
+    public_key_len_ = 1 + (point_form_ == POINT_CONVERSION_COMPRESSED ? 1 : 2) * shared_secret_len_;
     public_key_.reset(new uint8_t[public_key_len_]);
-    if (EC_POINT_point2oct(group, EC_KEY_get0_public_key(private_key_.get()),
-                           POINT_CONVERSION_UNCOMPRESSED, public_key_.get(), public_key_len_,
+    if (EC_POINT_point2oct(group, EC_KEY_get0_public_key(private_key_.get()), point_form_,
+                           public_key_.get(), public_key_len_,
                            nullptr /* ctx */) != public_key_len_) {
         return TranslateLastOpenSslError();
     }
@@ -95,6 +97,18 @@ bool NistCurveKeyExchange::CalculateSharedKey(const Buffer& peer_public_value,
 bool NistCurveKeyExchange::CalculateSharedKey(const uint8_t* peer_public_value,
                                               size_t peer_public_value_len,
                                               Buffer* out_result) const {
+    UniquePtr<uint8_t[]> result(new uint8_t[shared_secret_len_]);
+    if (!result.get() ||
+        !ComputeSharedSecret(peer_public_value, peer_public_value_len, result.get()))
+        return false;
+
+    out_result->Reinitialize(result.get(), shared_secret_len_);
+    return true;
+}
+
+bool NistCurveKeyExchange::ComputeSharedSecret(const uint8_t* peer_public_value,
+                                               size_t peer_public_value_len,
+                                               uint8_t* shared_secret) const {
     const EC_GROUP* group = EC_KEY_get0_group(private_key_.get());
     UniquePtr<EC_POINT, EC_POINT_Delete> point(EC_POINT_new(group));
     if (!point.get() ||
@@ -106,14 +120,107 @@ bool NistCurveKeyExchange::CalculateSharedKey(const uint8_t* peer_public_value,
         return false;
     }
 
-    UniquePtr<uint8_t[]> result(new uint8_t[shared_secret_len_]);
-    if (ECDH_compute_key(result.get(), shared_secret_len_, point.get(), private_key_.get(),
+    if (ECDH_compute_key(shared_secret, shared_secret_len_, point.get(), private_key_.get(),
                          nullptr /* kdf */) != static_cast<int>(shared_secret_len_)) {
         LOG_E("Can't compute ECDH shared key: %d", TranslateLastOpenSslError());
         return false;
     }
+    return true;
+}
 
-    out_result->Reinitialize(result.get(), shared_secret_len_);
+bool NistCurveKeyExchange::CalculateSharedKeys(const Buffer* peer_public_values, size_t count,
+                                               Buffer* shared_keys, bool* succeeded,
+                                               WorkerPool* pool) const {
+    size_t slices = 1;
+    if (pool && count >= 2 * kMinParallelSharedKeys)
+        slices = std::min(pool->thread_count() + 1, count / kMinParallelSharedKeys);
+    if (slices <= 1)
+        return CalculateSharedKeysInSlice(peer_public_values, count, shared_keys, succeeded);
+
+    size_t slice_length = (count + slices - 1) / slices;
+    std::atomic<bool> all_succeeded(true);
+    pool->ParallelFor(slices, [&](size_t slice) {
+        size_t begin = slice * slice_length;
+        size_t end = std::min(count, begin + slice_length);
+        if (begin < end && !CalculateSharedKeysInSlice(peer_public_values + begin, end - begin,
+                                                       shared_keys + begin, succeeded + begin))
+            all_succeeded = false;
+    });
+    return all_succeeded;
+}
+
+bool NistCurveKeyExchange::CalculateSharedKeysInSlice(const Buffer* peer_public_values,
+                                                      size_t count, Buffer* shared_keys,
+                                                      bool* succeeded) const {
+    for (size_t i = 0; i < count; ++i)
+        succeeded[i] = false;
+
+    const EC_GROUP* group = EC_KEY_get0_group(private_key_.get());
+    const BIGNUM* private_value = EC_KEY_get0_private_key(private_key_.get());
+    BN_CTX_Ptr ctx(BN_CTX_new());
+    BIGNUM_Ptr x(BN_new());
+    UniquePtr<EC_POINT, EC_POINT_Delete> peer_point(EC_POINT_new(group));
+    if (!ctx.get() || !x.get() || !peer_point.get())
+        return false;
+
+    // The products, left projective until they're all made affine together, and the index of the
+    // peer each belongs to.
+    std::vector<std::unique_ptr<EC_POINT, EC_POINT_Delete>> products;
+    std::vector<EC_POINT*> product_points;
+    std::vector<size_t> peer_indices;
+    products.reserve(count);
+    product_points.reserve(count);
+    peer_indices.reserve(count);
+    for (size_t i = 0; i < count; ++i) {
+        if (!EC_POINT_oct2point(/* also test if point is on curve */
+                                group, peer_point.get(), peer_public_values[i].peek_read(),
+                                peer_public_values[i].available_read(), ctx.get()) ||
+            !EC_POINT_is_on_curve(group, peer_point.get(), ctx.get())) {
+            LOG_E("Can't convert peer public value %zu to point: %d", i,
+                  TranslateLastOpenSslError());
+            continue;
+        }
+        std::unique_ptr<EC_POINT, EC_POINT_Delete> product(EC_POINT_new(group));
+        if (!product.get() ||
+            !EC_POINT_mul(group, product.get(), nullptr /* generator scalar */, peer_point.get(),
+                          private_value, ctx.get()) ||
+            EC_POINT_is_at_infinity(group, product.get())) {
+            LOG_E("Can't compute ECDH shared key %zu: %d", i, TranslateLastOpenSslError());
+            continue;
+        }
+        product_points.push_back(product.get());
+        products.push_back(std::move(product));
+        peer_indices.push_back(i);
+    }
+
+    if (!product_points.empty() &&
+        !EC_POINTs_make_affine(group, product_points.size(), product_points.data(), ctx.get())) {
+        LOG_E("Can't convert ECDH shared keys to affine: %d", TranslateLastOpenSslError());
+        return false;
+    }
+
+    // As ECDH_compute_key does, the shared key is the x coordinate, padded to the field length.
+    for (size_t j = 0; j < product_points.size(); ++j) {
+        size_t i = peer_indices[j];
+        if (!EC_POINT_get_affine_coordinates_GFp(group, product_points[j], x.get(),
+                                                 nullptr /* y */, ctx.get()) ||
+            !shared_keys[i].Reinitialize(shared_secret_len_))
+            continue;
+        size_t x_len = BN_num_bytes(x.get());
+        if (x_len > shared_secret_len_)
+            continue;
+        uint8_t* shared_key = shared_keys[i].peek_write();
+        memset(shared_key, 0, shared_secret_len_ - x_len);
+        BN_bn2bin(x.get(), shared_key + shared_secret_len_ - x_len);
+        shared_keys[i].advance_write(shared_secret_len_);
+        succeeded[i] = true;
+    }
+    BN_clear(x.get());
+
+    for (size_t i = 0; i < count; ++i) {
+        if (!succeeded[i])
+            return false;
+    }
     return true;
 }
 
@@ -55,16 +55,44 @@ class NistCurveKeyExchange : public KeyExchange {
     bool CalculateSharedKey(const Buffer& peer_public_value, Buffer* shared_key) const override;
     bool public_value(Buffer* public_value) const override;
 
+    /**
+     * Decodes and checks the peer points of a batch, computes every product with the private key,
+     * and converts them all to affine coordinates with one shared field inversion (Montgomery's
+     * trick) instead of one per peer.  Batches of at least 2 * kMinParallelSharedKeys are split
+     * across pool's threads, each taking a slice.
+     */
+    bool CalculateSharedKeys(const Buffer* peer_public_values, size_t count, Buffer* shared_keys,
+                             bool* succeeded, WorkerPool* pool) const override;
+    static const size_t kMinParallelSharedKeys = 64;
+
+    /**
+     * Computes the shared secret with \p peer_public_value into \p shared_secret, which must
+     * have room for shared_secret_size() bytes.
+     */
+    bool ComputeSharedSecret(const uint8_t* peer_public_value, size_t peer_public_value_len,
+                             uint8_t* shared_secret) const;
+    size_t shared_secret_size() const { return shared_secret_len_; }
+
+    /**
+     * Makes public_value() give the point compressed (SEC 1 section 2.3.3) if \p compressed, and
+     * uncompressed, the default, otherwise.  Peer public values are accepted in either form.
+     */
+    keymaster_error_t SetPointCompression(bool compressed);
+
     /* Caller takes ownership of \p private_key. */
     EC_KEY* private_key() { return private_key_.release(); }
 
   private:
     keymaster_error_t ExtractPublicKey();
+    // CalculateSharedKeys for one slice of a batch, on the calling thread.
+    bool CalculateSharedKeysInSlice(const Buffer* peer_public_values, size_t count,
+                                    Buffer* shared_keys, bool* succeeded) const;
 
     UniquePtr<EC_KEY, EC_KEY_Delete> private_key_;
     UniquePtr<uint8_t[]> public_key_;
     size_t public_key_len_;
     size_t shared_secret_len_;
+    point_conversion_form_t point_form_;
 };
 
 }  // namespace keymaster
@@ -23,6 +23,7 @@
 #include <keymaster/android_keymaster_utils.h>
 
 #include "android_keymaster_test_utils.h"
+#include "worker_pool.h"
 
 using std::string;
 
@@ -64,6 +65,45 @@ TEST(NistCurveKeyExchange, SharedKey) {
     }
 }
 
+/**
+ * A compressed public value is half the size, and gives the peer the same shared key.
+ */
+TEST(NistCurveKeyExchange, CompressedPublicValue) {
+    for (auto& curve : kEcCurves) {
+        UniquePtr<NistCurveKeyExchange> alice_keyex(
+            NistCurveKeyExchange::GenerateKeyExchange(curve));
+        UniquePtr<NistCurveKeyExchange> bob_keyex(
+            NistCurveKeyExchange::GenerateKeyExchange(curve));
+        ASSERT_TRUE(alice_keyex.get() != nullptr);
+        ASSERT_TRUE(bob_keyex.get() != nullptr);
+
+        Buffer uncompressed_public_value;
+        ASSERT_TRUE(alice_keyex->public_value(&uncompressed_public_value));
+        ASSERT_EQ(KM_ERROR_OK, alice_keyex->SetPointCompression(true));
+        Buffer alice_public_value;
+        ASSERT_TRUE(alice_keyex->public_value(&alice_public_value));
+        EXPECT_EQ(1 + alice_keyex->shared_secret_size(), alice_public_value.available_read());
+        EXPECT_EQ(uncompressed_public_value.available_read() - alice_keyex->shared_secret_size(),
+                  alice_public_value.available_read());
+        uint8_t prefix = alice_public_value.peek_read()[0];
+        EXPECT_TRUE(prefix == 2 || prefix == 3);
+
+        Buffer bob_public_value;
+        ASSERT_TRUE(bob_keyex->public_value(&bob_public_value));
+        Buffer alice_shared, bob_shared, bob_uncompressed_shared;
+        ASSERT_TRUE(alice_keyex->CalculateSharedKey(bob_public_value, &alice_shared));
+        ASSERT_TRUE(bob_keyex->CalculateSharedKey(alice_public_value, &bob_shared));
+        ASSERT_TRUE(
+            bob_keyex->CalculateSharedKey(uncompressed_public_value, &bob_uncompressed_shared));
+        ASSERT_EQ(alice_shared.available_read(), bob_shared.available_read());
+        EXPECT_EQ(0, memcmp(alice_shared.peek_read(), bob_shared.peek_read(),
+                            alice_shared.available_read()));
+        ASSERT_EQ(bob_shared.available_read(), bob_uncompressed_shared.available_read());
+        EXPECT_EQ(0, memcmp(bob_shared.peek_read(), bob_uncompressed_shared.peek_read(),
+                            bob_shared.available_read()));
+    }
+}
+
 /*
  * This test tries a key agreement with a false public key (i.e. with
  * a point not on the curve.)
@@ -76,6 +116,30 @@ static const char* kInvalidPublicKeys[] = {
     "db71e509e3fd9b060ddb20ba5c51dcc5948d46fbf640dfe0441782cab85fa4ac",
 };
 
+/**
+ * Ephemeral keys all come from the one precomputed group per curve, but must still be distinct.
+ */
+TEST(NistCurveKeyExchange, SharedGroupDistinctKeys) {
+    for (auto& curve : kEcCurves) {
+        const EC_GROUP* group = ec_get_precomputed_group(curve);
+        ASSERT_TRUE(group != nullptr);
+        EXPECT_EQ(group, ec_get_precomputed_group(curve));
+
+        UniquePtr<NistCurveKeyExchange> first(NistCurveKeyExchange::GenerateKeyExchange(curve));
+        UniquePtr<NistCurveKeyExchange> second(NistCurveKeyExchange::GenerateKeyExchange(curve));
+        ASSERT_TRUE(first.get() != nullptr);
+        ASSERT_TRUE(second.get() != nullptr);
+
+        Buffer first_public, second_public;
+        ASSERT_TRUE(first->public_value(&first_public));
+        ASSERT_TRUE(second->public_value(&second_public));
+        ASSERT_EQ(first_public.available_read(), second_public.available_read());
+        EXPECT_NE(0, memcmp(first_public.peek_read(), second_public.peek_read(),
+                            first_public.available_read()));
+    }
+    EXPECT_TRUE(ec_get_precomputed_group(static_cast<keymaster_ec_curve_t>(-1)) == nullptr);
+}
+
 TEST(NistCurveKeyExchange, InvalidPublicKey) {
     for (auto& curve : kEcCurves) {
         AuthorizationSet kex_description(
@@ -215,5 +279,75 @@ TEST(NistCurveKeyExchange, NistTestVectors) {
     }
 }
 
+// Fills peers with count peer public values on curve, every seventh of them invalid.
+static void MakeBatchPeers(keymaster_ec_curve_t curve, size_t count, Buffer* peers) {
+    string invalid_public_key = hex2str(kInvalidPublicKeys[0]);
+    for (size_t i = 0; i < count; ++i) {
+        if (i % 7 == 3) {
+            peers[i].Reinitialize(invalid_public_key.data(), invalid_public_key.size());
+            continue;
+        }
+        UniquePtr<NistCurveKeyExchange> peer(NistCurveKeyExchange::GenerateKeyExchange(curve));
+        ASSERT_TRUE(peer.get() != nullptr);
+        ASSERT_TRUE(peer->public_value(&peers[i]));
+    }
+}
+
+TEST(NistCurveKeyExchange, BatchMatchesSingleSharedKeys) {
+    static const size_t kCount = 20;
+    for (auto& curve : kEcCurves) {
+        UniquePtr<NistCurveKeyExchange> key_exchange(
+            NistCurveKeyExchange::GenerateKeyExchange(curve));
+        ASSERT_TRUE(key_exchange.get() != nullptr);
+        Buffer peers[kCount];
+        MakeBatchPeers(curve, kCount, peers);
+
+        Buffer shared_keys[kCount];
+        bool succeeded[kCount];
+        EXPECT_FALSE(key_exchange->CalculateSharedKeys(peers, kCount, shared_keys, succeeded,
+                                                       nullptr /* pool */));
+        for (size_t i = 0; i < kCount; ++i) {
+            Buffer expected;
+            EXPECT_EQ(key_exchange->CalculateSharedKey(peers[i], &expected), succeeded[i]);
+            if (!succeeded[i])
+                continue;
+            ASSERT_EQ(expected.available_read(), shared_keys[i].available_read());
+            EXPECT_EQ(0, memcmp(expected.peek_read(), shared_keys[i].peek_read(),
+                                expected.available_read()));
+        }
+
+        // A batch of valid peers succeeds as a whole.
+        Buffer* valid_peers = peers + 4;
+        EXPECT_TRUE(key_exchange->CalculateSharedKeys(valid_peers, 3, shared_keys, succeeded,
+                                                      nullptr /* pool */));
+        EXPECT_TRUE(key_exchange->CalculateSharedKeys(valid_peers, 0, shared_keys, succeeded,
+                                                      nullptr /* pool */));
+    }
+}
+
+TEST(NistCurveKeyExchange, ParallelBatch) {
+    static const size_t kCount = 4 * NistCurveKeyExchange::kMinParallelSharedKeys + 5;
+    WorkerPool pool(3);
+    UniquePtr<NistCurveKeyExchange> key_exchange(
+        NistCurveKeyExchange::GenerateKeyExchange(KM_EC_CURVE_P_256));
+    ASSERT_TRUE(key_exchange.get() != nullptr);
+    UniquePtr<Buffer[]> peers(new Buffer[kCount]);
+    MakeBatchPeers(KM_EC_CURVE_P_256, kCount, peers.get());
+
+    UniquePtr<Buffer[]> shared_keys(new Buffer[kCount]);
+    UniquePtr<bool[]> succeeded(new bool[kCount]);
+    EXPECT_FALSE(key_exchange->CalculateSharedKeys(peers.get(), kCount, shared_keys.get(),
+                                                   succeeded.get(), &pool));
+    for (size_t i = 0; i < kCount; ++i) {
+        EXPECT_EQ(i % 7 != 3, succeeded[i]);
+        Buffer expected;
+        if (!key_exchange->CalculateSharedKey(peers[i], &expected))
+            continue;
+        ASSERT_EQ(expected.available_read(), shared_keys[i].available_read());
+        EXPECT_EQ(0, memcmp(expected.peek_read(), shared_keys[i].peek_read(),
+                            expected.available_read()));
+    }
+}
+
 }  // namespace test
 }  // namespace keymaster
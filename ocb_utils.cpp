@@ -18,9 +18,11 @@
 
 #include <assert.h>
 
+#include <mutex>
 #include <new>
 
 #include <openssl/aes.h>
+#include <openssl/mem.h>
 #include <openssl/sha.h>
 
 #include <hardware/keymaster_defs.h>
@@ -45,39 +47,131 @@ class AeCtx {
     ae_ctx* ctx_;
 };
 
-static keymaster_error_t BuildDerivationData(const AuthorizationSet& hw_enforced,
-                                             const AuthorizationSet& sw_enforced,
-                                             const AuthorizationSet& hidden,
-                                             UniquePtr<uint8_t[]>* derivation_data,
-                                             size_t* derivation_data_length) {
-    *derivation_data_length =
-        hidden.SerializedSize() + hw_enforced.SerializedSize() + sw_enforced.SerializedSize();
-    derivation_data->reset(new (std::nothrow) uint8_t[*derivation_data_length]);
-    if (!derivation_data->get())
-        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+class Sha256Sink : public SerializationSink {
+  public:
+    explicit Sha256Sink(SHA256_CTX* ctx) : ctx_(ctx) {}
+    bool Write(const void* data, size_t data_len) override {
+        return SHA256_Update(ctx_, data, data_len);
+    }
 
-    uint8_t* buf = derivation_data->get();
-    uint8_t* end = derivation_data->get() + *derivation_data_length;
-    buf = hidden.Serialize(buf, end);
-    buf = hw_enforced.Serialize(buf, end);
-    buf = sw_enforced.Serialize(buf, end);
+  private:
+    SHA256_CTX* ctx_;
+};
 
+/**
+ * Hashes the derivation data, the serializations of hidden, hw_enforced and sw_enforced, streaming
+ * them into the hash rather than building the derivation data in a temporary buffer.
+ */
+static keymaster_error_t HashDerivationData(const AuthorizationSet& hw_enforced,
+                                            const AuthorizationSet& sw_enforced,
+                                            const AuthorizationSet& hidden, uint8_t* hash) {
+    SHA256_CTX sha256_ctx;
+    Eraser sha256_ctx_eraser(sha256_ctx);
+    SHA256_Init(&sha256_ctx);
+    Sha256Sink sink(&sha256_ctx);
+    if (!hidden.SerializeTo(&sink) || !hw_enforced.SerializeTo(&sink) ||
+        !sw_enforced.SerializeTo(&sink))
+        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    SHA256_Final(hash, &sha256_ctx);
     return KM_ERROR_OK;
 }
 
+/**
+ * A small cache of initialized OCB contexts, keyed on the derivation data hash and the master key,
+ * so that repeated use of the same legacy blob skips the key derivation and ae_init.  The cached
+ * contexts contain the derived key schedules, so they're wiped when evicted.
+ */
+class OcbContextCache {
+  public:
+    OcbContextCache() : clock_(0) { memset(entries_, 0, sizeof(entries_)); }
+    ~OcbContextCache() {
+        for (size_t i = 0; i < array_length(entries_); ++i)
+            Evict(&entries_[i]);
+    }
+
+    /**
+     * Copies the cached context for hash and master_key into ctx.  Returns false if there is none.
+     */
+    bool Find(const uint8_t hash[SHA256_DIGEST_LENGTH], const KeymasterKeyBlob& master_key,
+              ae_ctx* ctx) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        Entry* entry = FindEntry(hash, master_key);
+        if (!entry)
+            return false;
+        entry->last_used = ++clock_;
+        memcpy(ctx, entry->ctx, ae_ctx_sizeof());
+        return true;
+    }
+
+    void Insert(const uint8_t hash[SHA256_DIGEST_LENGTH], const KeymasterKeyBlob& master_key,
+                const ae_ctx* ctx) {
+        if (master_key.key_material_size > sizeof(Entry::master_key))
+            return;
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (FindEntry(hash, master_key))
+            return;
+
+        Entry* victim = &entries_[0];
+        for (size_t i = 0; i < array_length(entries_) && victim->ctx; ++i)
+            if (!entries_[i].ctx || entries_[i].last_used < victim->last_used)
+                victim = &entries_[i];
+        Evict(victim);
+
+        victim->ctx = ae_allocate(NULL);
+        if (!victim->ctx)
+            return;
+        memcpy(victim->ctx, ctx, ae_ctx_sizeof());
+        memcpy(victim->hash, hash, SHA256_DIGEST_LENGTH);
+        memcpy(victim->master_key, master_key.key_material, master_key.key_material_size);
+        victim->master_key_size = master_key.key_material_size;
+        victim->last_used = ++clock_;
+    }
+
+  private:
+    struct Entry {
+        uint8_t hash[SHA256_DIGEST_LENGTH];
+        uint8_t master_key[32];
+        size_t master_key_size;
+        ae_ctx* ctx;  // NULL if the entry is unused.
+        uint64_t last_used;
+    };
+
+    Entry* FindEntry(const uint8_t hash[SHA256_DIGEST_LENGTH], const KeymasterKeyBlob& master_key) {
+        for (size_t i = 0; i < array_length(entries_); ++i) {
+            Entry* entry = &entries_[i];
+            if (entry->ctx && entry->master_key_size == master_key.key_material_size &&
+                CRYPTO_memcmp(entry->hash, hash, SHA256_DIGEST_LENGTH) == 0 &&
+                CRYPTO_memcmp(entry->master_key, master_key.key_material,
+                              master_key.key_material_size) == 0)
+                return entry;
+        }
+        return nullptr;
+    }
+
+    static void Evict(Entry* entry) {
+        if (entry->ctx) {
+            ae_clear(entry->ctx);
+            ae_free(entry->ctx);
+        }
+        memset_s(entry, 0, sizeof(*entry));
+    }
+
+    std::mutex mutex_;
+    Entry entries_[8];
+    uint64_t clock_;
+};
+
+static OcbContextCache* GetOcbContextCache() {
+    static OcbContextCache cache;
+    return &cache;
+}
+
 static keymaster_error_t InitializeKeyWrappingContext(const AuthorizationSet& hw_enforced,
                                                       const AuthorizationSet& sw_enforced,
                                                       const AuthorizationSet& hidden,
                                                       const KeymasterKeyBlob& master_key,
                                                       AeCtx* ctx) {
-    size_t derivation_data_length;
-    UniquePtr<uint8_t[]> derivation_data;
-    keymaster_error_t error = BuildDerivationData(hw_enforced, sw_enforced, hidden,
-                                                  &derivation_data, &derivation_data_length);
-    if (error != KM_ERROR_OK)
-        return error;
-
-    SHA256_CTX sha256_ctx;
     UniquePtr<uint8_t[]> hash_buf(new (std::nothrow) uint8_t[SHA256_DIGEST_LENGTH]);
     if (!hash_buf.get())
         return KM_ERROR_MEMORY_ALLOCATION_FAILED;
@@ -91,10 +185,12 @@ static keymaster_error_t InitializeKeyWrappingContext(const AuthorizationSet& hw
         return KM_ERROR_MEMORY_ALLOCATION_FAILED;
 
     // Hash derivation data.
-    Eraser sha256_ctx_eraser(sha256_ctx);
-    SHA256_Init(&sha256_ctx);
-    SHA256_Update(&sha256_ctx, derivation_data.get(), derivation_data_length);
-    SHA256_Final(hash_buf.get(), &sha256_ctx);
+    keymaster_error_t error = HashDerivationData(hw_enforced, sw_enforced, hidden, hash_buf.get());
+    if (error != KM_ERROR_OK)
+        return error;
+
+    if (GetOcbContextCache()->Find(hash_buf.get(), master_key, ctx->get()))
+        return KM_ERROR_OK;
 
     // Encrypt hash with master key to build derived key.
     AES_KEY aes_key;
@@ -112,6 +208,7 @@ static keymaster_error_t InitializeKeyWrappingContext(const AuthorizationSet& hw
         return KM_ERROR_UNKNOWN_ERROR;
     }
 
+    GetOcbContextCache()->Insert(hash_buf.get(), master_key, ctx->get());
     return KM_ERROR_OK;
 }
 
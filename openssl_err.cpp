@@ -16,6 +16,8 @@
 
 #include "openssl_err.h"
 
+#include <atomic>
+
 #include <openssl/err.h>
 #include <openssl/evp.h>
 
@@ -40,8 +42,28 @@ static keymaster_error_t TranslateX509v3Error(int reason);
 static keymaster_error_t TranslateRsaError(int reason);
 #endif
 
+static std::atomic<uint64_t> translated_error_count(0);
+static std::atomic<uint64_t> discarded_error_count(0);
+
+void GetOpenSslErrorCounts(OpenSslErrorCounts* counts) {
+    counts->translated = translated_error_count.load(std::memory_order_relaxed);
+    counts->discarded = discarded_error_count.load(std::memory_order_relaxed);
+}
+
+ScopedOpenSslErrorQueue::~ScopedOpenSslErrorQueue() {
+    // Peeking is cheap, and most requests leave nothing to clear.
+    if (ERR_peek_error() == 0)
+        return;
+    discarded_error_count.fetch_add(1, std::memory_order_relaxed);
+    ERR_clear_error();
+}
+
 keymaster_error_t TranslateLastOpenSslError(bool log_message) {
-    unsigned long error = ERR_peek_last_error();
+    return TranslateOpenSslError(ERR_peek_last_error(), log_message);
+}
+
+keymaster_error_t TranslateOpenSslError(unsigned long error, bool log_message) {
+    translated_error_count.fetch_add(1, std::memory_order_relaxed);
 
     if (log_message) {
         LOG_D("%s", ERR_error_string(error, NULL));
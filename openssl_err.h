@@ -17,6 +17,8 @@
 #ifndef SYSTEM_KEYMASTER_OPENSSL_ERR_H_
 #define SYSTEM_KEYMASTER_OPENSSL_ERR_H_
 
+#include <stdint.h>
+
 #include <hardware/keymaster_defs.h>
 #include <keymaster/logger.h>
 
@@ -27,6 +29,40 @@ namespace keymaster {
  */
 keymaster_error_t TranslateLastOpenSslError(bool log_message = true);
 
+/**
+ * Translate error, an OpenSSL packed error code, to a keymaster error.  For errors taken from
+ * another thread's queue, such as a worker's.
+ */
+keymaster_error_t TranslateOpenSslError(unsigned long error, bool log_message = true);
+
+/**
+ * Process-wide counts of OpenSSL failures, for spotting error paths that are taken often.
+ * translated counts the errors translated to keymaster errors, and discarded counts the requests
+ * that finished with errors still on their thread's error queue.
+ */
+struct OpenSslErrorCounts {
+    uint64_t translated;
+    uint64_t discarded;
+};
+
+void GetOpenSslErrorCounts(OpenSslErrorCounts* counts);
+
+/**
+ * Empties the calling thread's OpenSSL error queue when destroyed.  Each request holds one, so the
+ * errors a failing request leaves behind, translated or not, don't pile up on the thread and slow
+ * down the requests after it.
+ */
+class ScopedOpenSslErrorQueue {
+  public:
+    ScopedOpenSslErrorQueue() {}
+    ~ScopedOpenSslErrorQueue();
+
+  private:
+    // Disallow copying and assignment.
+    ScopedOpenSslErrorQueue(const ScopedOpenSslErrorQueue&);
+    void operator=(const ScopedOpenSslErrorQueue&);
+};
+
 }  // namespace keymaster
 
 #endif  // SYSTEM_KEYMASTER_OPENSSL_ERR_H_
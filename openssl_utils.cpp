@@ -16,7 +16,10 @@
 
 #include "openssl_utils.h"
 
+#include <mutex>
+
 #include <keymaster/android_keymaster_utils.h>
+#include <keymaster/logger.h>
 
 #include "openssl_err.h"
 
@@ -62,6 +65,31 @@ EC_GROUP* ec_get_group(keymaster_ec_curve_t curve) {
     }
 }
 
+const EC_GROUP* ec_get_precomputed_group(keymaster_ec_curve_t curve) {
+    static const keymaster_ec_curve_t kCurves[] = {KM_EC_CURVE_P_224, KM_EC_CURVE_P_256,
+                                                   KM_EC_CURVE_P_384, KM_EC_CURVE_P_521};
+    static const size_t kCurveCount = sizeof(kCurves) / sizeof(kCurves[0]);
+    static std::once_flag once[kCurveCount];
+    static EC_GROUP* groups[kCurveCount];
+
+    size_t index = 0;
+    while (index < kCurveCount && kCurves[index] != curve)
+        ++index;
+    if (index == kCurveCount)
+        return nullptr;
+
+    std::call_once(once[index], [index, curve] {
+        EC_GROUP* group = ec_get_group(curve);
+#if !defined(OPENSSL_IS_BORINGSSL)
+        // BoringSSL's NIST curve implementations carry static generator tables instead.
+        if (group && !EC_GROUP_precompute_mult(group, nullptr /* ctx */))
+            LOG_W("Failed to precompute generator multiples for curve %d", curve);
+#endif
+        groups[index] = group;
+    });
+    return groups[index];
+}
+
 void convert_bn_to_blob(BIGNUM* bn, keymaster_blob_t* blob) {
     blob->data_length = BN_num_bytes(bn);
     blob->data = new uint8_t[blob->data_length];
@@ -139,4 +167,12 @@ size_t ec_group_size_bits(EC_KEY* ec_key) {
     return BN_num_bits(order.get());
 }
 
+size_t rsa_prime_count(const RSA* rsa) {
+#if defined(OPENSSL_IS_BORINGSSL)
+    return 2 + sk_RSA_additional_prime_num(rsa->additional_primes);
+#else
+    return 2 + RSA_get_multi_prime_extra_count(rsa);
+#endif
+}
+
 }  // namespace keymaster
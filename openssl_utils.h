@@ -60,6 +60,7 @@ DEFINE_OPENSSL_OBJECT_POINTER(EC_KEY)
 DEFINE_OPENSSL_OBJECT_POINTER(EC_POINT)
 DEFINE_OPENSSL_OBJECT_POINTER(ENGINE)
 DEFINE_OPENSSL_OBJECT_POINTER(EVP_PKEY)
+DEFINE_OPENSSL_OBJECT_POINTER(EVP_PKEY_CTX)
 DEFINE_OPENSSL_OBJECT_POINTER(PKCS8_PRIV_KEY_INFO)
 DEFINE_OPENSSL_OBJECT_POINTER(RSA)
 DEFINE_OPENSSL_OBJECT_POINTER(X509)
@@ -72,6 +73,14 @@ typedef UniquePtr<BIGNUM, BIGNUM_Delete> BIGNUM_Ptr;
 keymaster_error_t ec_get_group_size(const EC_GROUP* group, size_t* key_size_bits);
 EC_GROUP* ec_get_group(keymaster_ec_curve_t curve);
 
+/**
+ * Returns a process-wide group for curve with the multiples of its generator precomputed, so that
+ * generating keys on it doesn't rebuild the fixed-base tables each time.  Returns null if curve
+ * isn't supported or the group couldn't be created.  The group is owned by the library and must
+ * not be modified or freed; EC_KEY_set_group() copies it (including the precomputation).
+ */
+const EC_GROUP* ec_get_precomputed_group(keymaster_ec_curve_t curve);
+
 /**
  * Many OpenSSL APIs take ownership of an argument on success but don't free the argument on
  * failure. This means we need to tell our scoped pointers when we've transferred ownership, without
@@ -95,6 +104,12 @@ keymaster_error_t EvpKeyToKeyMaterial(const EVP_PKEY* evp_pkey, KeymasterKeyBlob
 
 size_t ec_group_size_bits(EC_KEY* ec_key);
 
+/**
+ * Returns the number of primes whose product is rsa's modulus: two, plus any additional primes of
+ * a multi-prime key.
+ */
+size_t rsa_prime_count(const RSA* rsa);
+
 }  // namespace keymaster
 
 #endif  // SYSTEM_KEYMASTER_OPENSSL_UTILS_H_
@@ -19,9 +19,12 @@
 #include <keymaster/authorization_set.h>
 
 #include "key.h"
+#include "operation_slab.h"
 
 namespace keymaster {
 
+const size_t Operation::kDefaultChunkSize;
+
 bool OperationFactory::supported(keymaster_padding_t padding) const {
     size_t padding_count;
     const keymaster_padding_t* supported_paddings = SupportedPaddingModes(&padding_count);
@@ -50,6 +53,10 @@ bool OperationFactory::supported(keymaster_digest_t digest) const {
 }
 
 inline bool is_public_key_algorithm(keymaster_algorithm_t algorithm) {
+    if (algorithm == KM_ALGORITHM_CHACHA20_POLY1305)
+        return false;
+    if (algorithm == KM_ALGORITHM_ED25519)
+        return true;
     switch (algorithm) {
     case KM_ALGORITHM_HMAC:
     case KM_ALGORITHM_AES:
@@ -134,6 +141,26 @@ bool OperationFactory::GetAndValidateDigest(const AuthorizationSet& begin_params
     return true;
 }
 
+/* static */
+void* Operation::operator new(size_t size) noexcept {
+    OperationSlab* slab = OperationSlab::instance();
+    return slab ? slab->Allocate(size) : malloc(size);
+}
+
+/* static */
+void* Operation::operator new(size_t size, const std::nothrow_t&) noexcept {
+    return operator new(size);
+}
+
+/* static */
+void Operation::operator delete(void* object, size_t size) {
+    OperationSlab* slab = OperationSlab::instance();
+    if (slab)
+        slab->Free(object, size);
+    else
+        free(object);
+}
+
 keymaster_error_t Operation::UpdateForFinish(const AuthorizationSet& input_params,
                                              const Buffer& input) {
     if (!input_params.empty() || input.available_read()) {
@@ -152,4 +179,13 @@ keymaster_error_t Operation::UpdateForFinish(const AuthorizationSet& input_param
     return KM_ERROR_OK;
 }
 
+void Operation::FinishBatch(const AuthorizationSet& input_params, OperationBatchItem* items,
+                            size_t count) {
+    for (size_t i = 0; i < count; ++i) {
+        OperationBatchItem* item = &items[i];
+        item->error = item->operation->Finish(input_params, *item->input, *item->signature,
+                                              &item->output_params, item->output);
+    }
+}
+
 }  // namespace keymaster
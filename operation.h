@@ -21,9 +21,13 @@
 #include <stdint.h>
 #include <stdlib.h>
 
+#include <array>
+#include <new>
+
 #include <hardware/keymaster_defs.h>
 #include <keymaster/android_keymaster_utils.h>
 #include <keymaster/authorization_set.h>
+#include <keymaster/keymaster_enforcement.h>
 #include <keymaster/logger.h>
 
 namespace keymaster {
@@ -82,23 +86,62 @@ class OperationFactory {
                               keymaster_digest_t* digest, keymaster_error_t* error) const;
 };
 
+/**
+ * One of the operations finished together by Operation::FinishBatch, with its own input, signature
+ * and results.
+ */
+struct OperationBatchItem {
+    Operation* operation;
+    const Buffer* input;
+    const Buffer* signature;
+    AuthorizationSet output_params;
+    Buffer* output;
+    keymaster_error_t error;
+};
+
 /**
  * Abstract base for all cryptographic operations.
  */
 class Operation {
   public:
-    Operation(keymaster_purpose_t purpose) : purpose_(purpose) {}
+    Operation(keymaster_purpose_t purpose) : purpose_(purpose), key_blob_digest_() {}
     virtual ~Operation() {}
 
+    /**
+     * Operations are allocated from OperationSlab::instance() rather than the general heap.
+     */
+    static void* operator new(size_t size) noexcept;
+    static void* operator new(size_t size, const std::nothrow_t&) noexcept;
+    static void operator delete(void* object, size_t size);
+
     keymaster_purpose_t purpose() const { return purpose_; }
 
     void set_key_id(uint64_t key_id) { key_id_ = key_id; }
     uint64_t key_id() const { return key_id_; }
 
+    // The SHA-256 digest of the blob the operation's key was loaded from, which ExportOperation
+    // binds the operation's state to.
+    void set_key_blob_digest(const std::array<uint8_t, 32>& digest) { key_blob_digest_ = digest; }
+    const std::array<uint8_t, 32>& key_blob_digest() const { return key_blob_digest_; }
+
     void SetAuthorizations(const AuthorizationSet& auths) {
         key_auths_.Reinitialize(auths.data(), auths.size());
     }
-    const AuthorizationSet authorizations() { return key_auths_; }
+    const AuthorizationSet& authorizations() const { return key_auths_; }
+
+    /**
+     * Returns the bytes the operation holds: the object itself, and the heap storage it and its
+     * authorizations own.  Buffers that grow as data arrives are counted at their current size.
+     */
+    size_t memory_footprint() const {
+        return object_size() + key_auths_.heap_bytes() + buffer_bytes();
+    }
+
+    /**
+     * The key authorizations Update and Finish are checked against, compiled once at Begin.
+     */
+    const CompiledAuthorizations& compiled_authorizations() const { return compiled_auths_; }
+    CompiledAuthorizations* mutable_compiled_authorizations() { return &compiled_auths_; }
 
     virtual keymaster_error_t Begin(const AuthorizationSet& input_params,
                                     AuthorizationSet* output_params) = 0;
@@ -110,15 +153,62 @@ class Operation {
                                      Buffer* output) = 0;
     virtual keymaster_error_t Abort() = 0;
 
+    /**
+     * Processes aad_length bytes of associated data, as Update would if given them in
+     * TAG_ASSOCIATED_DATA with no input.  Operations that don't take associated data return
+     * KM_ERROR_INVALID_TAG.
+     */
+    virtual keymaster_error_t UpdateAad(const uint8_t* /* aad */, size_t /* aad_length */) {
+        return KM_ERROR_INVALID_TAG;
+    }
+
+    /**
+     * Finishes each of the count operations in items, which must all have been created by the
+     * same factory from the same key and begin parameters as this one, as Finish would with its
+     * item's input and signature, setting the item's error.  Operations that can process several
+     * inputs together more cheaply than one at a time override this.
+     */
+    virtual void FinishBatch(const AuthorizationSet& input_params, OperationBatchItem* items,
+                             size_t count);
+
+    /**
+     * Captures the operation's progress so that another operation, created by the same factory
+     * from the same key with *begin_params, can carry on from here after Restore(state) in place
+     * of Begin.  The state is secret and must be protected as key material would be.  Operations
+     * that can't capture their state, and those not at a point where they can, return an error
+     * and are left unchanged.
+     */
+    virtual keymaster_error_t Checkpoint(AuthorizationSet* /* begin_params */,
+                                         Buffer* /* state */) const {
+        return KM_ERROR_UNIMPLEMENTED;
+    }
+    virtual keymaster_error_t Restore(const Buffer& /* state */) { return KM_ERROR_UNIMPLEMENTED; }
+
+    /**
+     * The Update input length the operation works best with before any per-call costs have been
+     * measured, and the most input one Update can usefully take, or 0 if there's no limit.
+     */
+    virtual size_t preferred_chunk_size() const { return kDefaultChunkSize; }
+    virtual size_t max_chunk_size() const { return 0; }
+
 protected:
+    static const size_t kDefaultChunkSize = 4096;
+
     // Helper function for implementing Finish() methods that need to call Update() to process
     // input, but don't expect any output.
     keymaster_error_t UpdateForFinish(const AuthorizationSet& input_params, const Buffer& input);
 
+    // The size of the most-derived object.  Concrete operations override this.
+    virtual size_t object_size() const { return sizeof(Operation); }
+    // Heap bytes held by buffers the derived class owns.
+    virtual size_t buffer_bytes() const { return 0; }
+
   private:
     const keymaster_purpose_t purpose_;
     AuthorizationSet key_auths_;
+    CompiledAuthorizations compiled_auths_;
     uint64_t key_id_;
+    std::array<uint8_t, 32> key_blob_digest_;
 };
 
 }  // namespace keymaster
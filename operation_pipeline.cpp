@@ -0,0 +1,186 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "operation_pipeline.h"
+
+#include <new>
+
+#include <UniquePtr.h>
+
+namespace keymaster {
+
+OperationPipeline::OperationPipeline(AndroidKeymaster* keymaster,
+                                     keymaster_operation_handle_t op_handle,
+                                     size_t max_queued_chunks, const OutputCallback& output)
+    : keymaster_(keymaster), op_handle_(op_handle),
+      max_queued_chunks_(max_queued_chunks > 0 ? max_queued_chunks : 1), output_(output),
+      updating_(false), stopping_(false), ended_(false), error_(KM_ERROR_OK), next_chunk_(0),
+      thread_(&OperationPipeline::Run, this) {}
+
+OperationPipeline::~OperationPipeline() {
+    Abort();
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+    }
+    chunk_queued_.notify_all();
+    thread_.join();
+}
+
+keymaster_error_t OperationPipeline::Queue(const uint8_t* input, size_t length) {
+    UniquePtr<UpdateOperationRequest> request(new (std::nothrow) UpdateOperationRequest);
+    if (!request.get() || !request->input.Reinitialize(input, length))
+        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    request->op_handle = op_handle_;
+
+    std::unique_lock<std::mutex> lock(mutex_);
+    chunk_done_.wait(lock, [&] { return ended_ || chunks_.size() < max_queued_chunks_; });
+    if (ended_)
+        return error_;
+    chunks_.push_back(request.release());
+    chunk_queued_.notify_one();
+    return KM_ERROR_OK;
+}
+
+keymaster_error_t OperationPipeline::Finish(const AuthorizationSet& additional_params,
+                                            const Buffer& signature,
+                                            FinishOperationResponse* response) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    WaitIdle(&lock);
+    if (ended_)
+        return error_;
+    ended_ = true;
+    error_ = KM_ERROR_INVALID_OPERATION_HANDLE;
+
+    FinishOperationRequest request;
+    request.op_handle = op_handle_;
+    if (!request.input.Reinitialize(unconsumed_) || !request.signature.Reinitialize(signature) ||
+        !request.additional_params.Reinitialize(additional_params)) {
+        AbortOperationRequest abort_request;
+        abort_request.op_handle = op_handle_;
+        AbortOperationResponse abort_response;
+        keymaster_->AbortOperation(abort_request, &abort_response);
+        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    }
+    unconsumed_.Clear();
+    keymaster_->FinishOperation(request, response);
+    return response->error;
+}
+
+keymaster_error_t OperationPipeline::Abort() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    for (UpdateOperationRequest* request : chunks_)
+        delete request;
+    chunks_.clear();
+    chunk_done_.notify_all();
+    WaitIdle(&lock);
+    if (ended_)
+        return error_;
+    ended_ = true;
+    error_ = KM_ERROR_INVALID_OPERATION_HANDLE;
+    unconsumed_.Clear();
+
+    AbortOperationRequest request;
+    request.op_handle = op_handle_;
+    AbortOperationResponse response;
+    keymaster_->AbortOperation(request, &response);
+    return response.error;
+}
+
+size_t OperationPipeline::pending() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return chunks_.size() + (updating_ ? 1 : 0);
+}
+
+void OperationPipeline::WaitIdle(std::unique_lock<std::mutex>* lock) {
+    chunk_done_.wait(*lock, [&] { return chunks_.empty() && !updating_; });
+}
+
+keymaster_error_t OperationPipeline::Update(UpdateOperationRequest* request,
+                                            UpdateOperationResponse* response) {
+    if (unconsumed_.available_read() > 0) {
+        if (!unconsumed_.reserve(request->input.available_read()) ||
+            !unconsumed_.write(request->input.peek_read(), request->input.available_read()) ||
+            !request->input.Reinitialize(unconsumed_))
+            return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+        unconsumed_.Clear();
+    }
+
+    // Operations generally consume all their input, but may not; update until they stop taking
+    // any, appending the output of each call to the first's.
+    UpdateOperationResponse* current = response;
+    UpdateOperationResponse more;
+    while (request->input.available_read() > 0) {
+        keymaster_->UpdateOperation(*request, current);
+        if (current->error != KM_ERROR_OK)
+            return current->error;
+        if (current != response) {
+            if (!response->output.reserve(current->output.available_read()) ||
+                !response->output.write(current->output.peek_read(),
+                                        current->output.available_read()))
+                return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+            current->Recycle();
+        }
+        if (current->input_consumed == 0)
+            break;
+        request->input.advance_read(current->input_consumed);
+        current = &more;
+    }
+
+    if (request->input.available_read() > 0 && !unconsumed_.Reinitialize(request->input))
+        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    return KM_ERROR_OK;
+}
+
+void OperationPipeline::Run() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+        if (chunks_.empty()) {
+            if (stopping_)
+                return;
+            chunk_queued_.wait(lock);
+            continue;
+        }
+        UniquePtr<UpdateOperationRequest> request(chunks_.front());
+        chunks_.pop_front();
+        updating_ = true;
+        size_t chunk = next_chunk_++;
+        // Make room for a waiting Queue().
+        chunk_done_.notify_all();
+
+        // Don't hold the lock across the update, so the caller can queue more chunks meanwhile.
+        lock.unlock();
+        UpdateOperationResponse response;
+        keymaster_error_t error = Update(request.get(), &response);
+        if (error == KM_ERROR_OK)
+            output_(chunk, response.output);
+        lock.lock();
+
+        updating_ = false;
+        if (error != KM_ERROR_OK) {
+            // The keymaster deleted the operation; later chunks have nowhere to go.
+            ended_ = true;
+            error_ = error;
+            for (UpdateOperationRequest* dropped : chunks_)
+                delete dropped;
+            chunks_.clear();
+            unconsumed_.Clear();
+        }
+        chunk_done_.notify_all();
+    }
+}
+
+}  // namespace keymaster
@@ -0,0 +1,123 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SYSTEM_KEYMASTER_OPERATION_PIPELINE_H_
+#define SYSTEM_KEYMASTER_OPERATION_PIPELINE_H_
+
+#include <stdint.h>
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+#include <keymaster/android_keymaster.h>
+#include <keymaster/android_keymaster_messages.h>
+
+namespace keymaster {
+
+/**
+ * OperationPipeline streams input into an operation that has begun, making the update calls on a
+ * background thread.  The caller queues chunks of input without waiting for their output, which is
+ * passed to a callback as each update completes, in the order the chunks were queued.  The
+ * keymaster thus stays busy with one chunk while the caller reads the next, or writes out the
+ * output of the last.
+ *
+ * Input an update doesn't consume is carried over to the next chunk, or to the finish call, so the
+ * output is the same as if the caller had made the update calls itself.  Any error ends the
+ * operation, as it does for UpdateOperation: later chunks are dropped and the calls that follow
+ * return the error.
+ */
+class OperationPipeline {
+  public:
+    /**
+     * Called on the pipeline's thread with the output of each chunk, numbered from zero.  Chunks
+     * whose output is empty, as with operations that produce output only when finished, are
+     * passed too.
+     */
+    typedef std::function<void(size_t chunk, const Buffer& output)> OutputCallback;
+
+    /**
+     * Streams into the operation op_handle of keymaster, which mustn't be updated otherwise until
+     * the pipeline finishes or aborts it.  Queue() waits while max_queued_chunks chunks are queued
+     * and not yet updated.  Doesn't take ownership of keymaster.
+     */
+    OperationPipeline(AndroidKeymaster* keymaster, keymaster_operation_handle_t op_handle,
+                      size_t max_queued_chunks, const OutputCallback& output);
+
+    /**
+     * Drops any queued chunks and aborts the operation, unless it was finished.
+     */
+    ~OperationPipeline();
+
+    /**
+     * Copies length bytes of input into the queue.  Returns the error that ended the operation if
+     * an earlier chunk failed, or KM_ERROR_INVALID_OPERATION_HANDLE if it was finished or aborted.
+     */
+    keymaster_error_t Queue(const uint8_t* input, size_t length);
+
+    /**
+     * Waits for the queued chunks to be updated, then finishes the operation with any unconsumed
+     * input, additional_params and signature.  Returns the error of a failed chunk or of the
+     * finish call; the finish call's output is in *response.
+     */
+    keymaster_error_t Finish(const AuthorizationSet& additional_params, const Buffer& signature,
+                             FinishOperationResponse* response);
+
+    /**
+     * Drops any queued chunks, waits for the update in progress, and aborts the operation.
+     */
+    keymaster_error_t Abort();
+
+    /**
+     * Returns the number of chunks queued and not yet passed to the callback.
+     */
+    size_t pending() const;
+
+  private:
+    // Waits until no chunk is queued or in progress.  Called with mutex_ held, through lock.
+    void WaitIdle(std::unique_lock<std::mutex>* lock);
+    // Updates the operation with request's input, preceded by any unconsumed input.
+    keymaster_error_t Update(UpdateOperationRequest* request, UpdateOperationResponse* response);
+    void Run();
+
+    AndroidKeymaster* keymaster_;
+    const keymaster_operation_handle_t op_handle_;
+    const size_t max_queued_chunks_;
+    OutputCallback output_;
+
+    mutable std::mutex mutex_;
+    std::condition_variable chunk_queued_;
+    std::condition_variable chunk_done_;
+    std::deque<UpdateOperationRequest*> chunks_;
+    bool updating_;
+    bool stopping_;
+    bool ended_;
+    keymaster_error_t error_;
+    size_t next_chunk_;
+    // Input an update didn't consume; only touched by the update thread, or when it is idle.
+    Buffer unconsumed_;
+    std::thread thread_;
+
+    // Disallow copying and assignment.
+    OperationPipeline(const OperationPipeline&);
+    void operator=(const OperationPipeline&);
+};
+
+}  // namespace keymaster
+
+#endif  // SYSTEM_KEYMASTER_OPERATION_PIPELINE_H_
@@ -0,0 +1,162 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include <keymaster/android_keymaster.h>
+#include <keymaster/soft_keymaster_context.h>
+
+#include "operation_pipeline.h"
+
+namespace keymaster {
+namespace test {
+
+class OperationPipelineTest : public testing::Test {
+  protected:
+    OperationPipelineTest() : keymaster_(new SoftKeymasterContext, 16) {}
+
+    void SetUp() override {
+        GenerateKeyRequest generate;
+        generate.key_description.Reinitialize(
+            AuthorizationSet(AuthorizationSetBuilder()
+                                 .AesEncryptionKey(128)
+                                 .Authorization(TAG_BLOCK_MODE, KM_MODE_CTR)
+                                 .Padding(KM_PAD_NONE)
+                                 .Authorization(TAG_NO_AUTH_REQUIRED)));
+        GenerateKeyResponse response;
+        keymaster_.GenerateKey(generate, &response);
+        ASSERT_EQ(KM_ERROR_OK, response.error);
+        key_blob_.assign(reinterpret_cast<const char*>(response.key_blob.key_material),
+                         response.key_blob.key_material_size);
+    }
+
+    keymaster_operation_handle_t Begin(keymaster_purpose_t purpose,
+                                       const AuthorizationSet& params,
+                                       AuthorizationSet* output_params) {
+        BeginOperationRequest begin;
+        begin.purpose = purpose;
+        begin.SetKeyMaterial(key_blob_.data(), key_blob_.size());
+        begin.additional_params.Reinitialize(params);
+        BeginOperationResponse response;
+        keymaster_.BeginOperation(begin, &response);
+        EXPECT_EQ(KM_ERROR_OK, response.error);
+        if (output_params)
+            output_params->Reinitialize(response.output_params);
+        return response.op_handle;
+    }
+
+    AndroidKeymaster keymaster_;
+    std::string key_blob_;
+};
+
+static AuthorizationSet CtrParams() {
+    return AuthorizationSet(
+        AuthorizationSetBuilder().Authorization(TAG_BLOCK_MODE, KM_MODE_CTR).Padding(KM_PAD_NONE));
+}
+
+TEST_F(OperationPipelineTest, StreamsInOrder) {
+    std::string plaintext;
+    for (size_t i = 0; i < 4000; ++i)
+        plaintext.push_back(static_cast<char>(i * 7));
+
+    AuthorizationSet nonce;
+    keymaster_operation_handle_t op_handle = Begin(KM_PURPOSE_ENCRYPT, CtrParams(), &nonce);
+
+    std::vector<size_t> chunks;
+    std::string ciphertext;
+    FinishOperationResponse finish;
+    {
+        OperationPipeline pipeline(&keymaster_, op_handle, 4 /* max_queued_chunks */,
+                                   [&](size_t chunk, const Buffer& output) {
+                                       chunks.push_back(chunk);
+                                       ciphertext.append(
+                                           reinterpret_cast<const char*>(output.peek_read()),
+                                           output.available_read());
+                                   });
+        // Uneven chunks, so that they don't fall on block boundaries.
+        for (size_t offset = 0; offset < plaintext.size(); offset += 333) {
+            size_t length = std::min<size_t>(333, plaintext.size() - offset);
+            ASSERT_EQ(KM_ERROR_OK,
+                      pipeline.Queue(reinterpret_cast<const uint8_t*>(plaintext.data()) + offset,
+                                     length));
+        }
+        ASSERT_EQ(KM_ERROR_OK, pipeline.Finish(AuthorizationSet(), Buffer(), &finish));
+        EXPECT_EQ(0U, pipeline.pending());
+        EXPECT_EQ(KM_ERROR_INVALID_OPERATION_HANDLE, pipeline.Queue(nullptr, 0));
+    }
+    ciphertext.append(reinterpret_cast<const char*>(finish.output.peek_read()),
+                      finish.output.available_read());
+    EXPECT_FALSE(keymaster_.has_operation(op_handle));
+
+    ASSERT_EQ(13U, chunks.size());
+    for (size_t i = 0; i < chunks.size(); ++i)
+        EXPECT_EQ(i, chunks[i]);
+    ASSERT_EQ(plaintext.size(), ciphertext.size());
+
+    // Decrypting in one update gives back the plaintext.
+    AuthorizationSet decrypt_params(CtrParams());
+    decrypt_params.push_back(nonce);
+    op_handle = Begin(KM_PURPOSE_DECRYPT, decrypt_params, nullptr);
+    UpdateOperationRequest update;
+    update.op_handle = op_handle;
+    update.input.Reinitialize(ciphertext.data(), ciphertext.size());
+    UpdateOperationResponse update_response;
+    keymaster_.UpdateOperation(update, &update_response);
+    ASSERT_EQ(KM_ERROR_OK, update_response.error);
+    FinishOperationRequest finish_decrypt;
+    finish_decrypt.op_handle = op_handle;
+    FinishOperationResponse finish_decrypt_response;
+    keymaster_.FinishOperation(finish_decrypt, &finish_decrypt_response);
+    ASSERT_EQ(KM_ERROR_OK, finish_decrypt_response.error);
+    std::string decrypted(reinterpret_cast<const char*>(update_response.output.peek_read()),
+                          update_response.output.available_read());
+    decrypted.append(reinterpret_cast<const char*>(finish_decrypt_response.output.peek_read()),
+                     finish_decrypt_response.output.available_read());
+    EXPECT_EQ(plaintext, decrypted);
+}
+
+TEST_F(OperationPipelineTest, AbortsWhenDestroyed) {
+    keymaster_operation_handle_t op_handle = Begin(KM_PURPOSE_ENCRYPT, CtrParams(), nullptr);
+    {
+        OperationPipeline pipeline(&keymaster_, op_handle, 2 /* max_queued_chunks */,
+                                   [](size_t, const Buffer&) {});
+        uint8_t input[64] = {};
+        EXPECT_EQ(KM_ERROR_OK, pipeline.Queue(input, sizeof(input)));
+        EXPECT_TRUE(keymaster_.has_operation(op_handle));
+    }
+    EXPECT_FALSE(keymaster_.has_operation(op_handle));
+}
+
+TEST_F(OperationPipelineTest, FailedChunkEndsOperation) {
+    // No such operation, so the first update fails.
+    size_t delivered = 0;
+    OperationPipeline pipeline(&keymaster_, 12345 /* op_handle */, 2 /* max_queued_chunks */,
+                               [&](size_t, const Buffer&) { ++delivered; });
+    uint8_t input[16] = {};
+    EXPECT_EQ(KM_ERROR_OK, pipeline.Queue(input, sizeof(input)));
+    FinishOperationResponse finish;
+    EXPECT_EQ(KM_ERROR_INVALID_OPERATION_HANDLE,
+              pipeline.Finish(AuthorizationSet(), Buffer(), &finish));
+    EXPECT_EQ(KM_ERROR_INVALID_OPERATION_HANDLE, pipeline.Queue(input, sizeof(input)));
+    EXPECT_EQ(0U, delivered);
+}
+
+}  // namespace test
+}  // namespace keymaster
@@ -0,0 +1,97 @@
+/*
+ * Copyright 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "operation_slab.h"
+
+#include <stdlib.h>
+
+#include <new>
+
+namespace keymaster {
+
+const size_t OperationSlab::kGranularity;
+const size_t OperationSlab::kMaxObjectSize;
+const size_t OperationSlab::kObjectsPerSlab;
+
+OperationSlab::OperationSlab() : slabs_(nullptr), slab_bytes_(0) {
+    for (size_t i = 0; i < kSizeClassCount; ++i)
+        free_[i] = nullptr;
+}
+
+OperationSlab::~OperationSlab() {
+    while (slabs_) {
+        Slab* next = slabs_->next;
+        free(slabs_);
+        slabs_ = next;
+    }
+}
+
+void* OperationSlab::Allocate(size_t size) {
+    if (size == 0 || size > kMaxObjectSize)
+        return malloc(size);
+
+    size_t size_class = (size - 1) / kGranularity;
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!free_[size_class]) {
+        size_t object_size = (size_class + 1) * kGranularity;
+        size_t slab_size = kSlabHeaderSize + kObjectsPerSlab * object_size;
+        Slab* slab = static_cast<Slab*>(malloc(slab_size));
+        if (!slab)
+            return nullptr;
+        slab->next = slabs_;
+        slabs_ = slab;
+        slab_bytes_ += slab_size;
+
+        uint8_t* objects = reinterpret_cast<uint8_t*>(slab) + kSlabHeaderSize;
+        for (size_t i = kObjectsPerSlab; i > 0; --i) {
+            FreeObject* object = reinterpret_cast<FreeObject*>(objects + (i - 1) * object_size);
+            object->next = free_[size_class];
+            free_[size_class] = object;
+        }
+    }
+
+    FreeObject* object = free_[size_class];
+    free_[size_class] = object->next;
+    return object;
+}
+
+void OperationSlab::Free(void* object, size_t size) {
+    if (!object)
+        return;
+    if (size == 0 || size > kMaxObjectSize) {
+        free(object);
+        return;
+    }
+
+    size_t size_class = (size - 1) / kGranularity;
+    FreeObject* free_object = static_cast<FreeObject*>(object);
+    std::lock_guard<std::mutex> lock(mutex_);
+    free_object->next = free_[size_class];
+    free_[size_class] = free_object;
+}
+
+size_t OperationSlab::slab_bytes() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return slab_bytes_;
+}
+
+/* static */
+OperationSlab* OperationSlab::instance() {
+    static OperationSlab* slab = new (std::nothrow) OperationSlab;
+    return slab;
+}
+
+}  // namespace keymaster
@@ -0,0 +1,93 @@
+/*
+ * Copyright 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SYSTEM_KEYMASTER_OPERATION_SLAB_H_
+#define SYSTEM_KEYMASTER_OPERATION_SLAB_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <mutex>
+
+namespace keymaster {
+
+/**
+ * OperationSlab serves the memory for Operation objects, so that beginning and ending an operation
+ * doesn't go to the general heap once the slab has warmed up.  Each concrete operation type has a
+ * fixed size, so each size class, a multiple of kGranularity up to kMaxObjectSize, is in effect a
+ * pool for the one or two types of that size.  A class whose freelist is empty carves
+ * kObjectsPerSlab objects from a new slab at once.  Objects larger than kMaxObjectSize come from
+ * the heap.
+ *
+ * Slabs are never returned to the heap, so a slab's footprint settles at the peak number of live
+ * operations of each size, which the operation table bounds.  All methods are internally locked.
+ */
+class OperationSlab {
+  public:
+    static const size_t kGranularity = 16;
+    static const size_t kMaxObjectSize = 2048;
+    static const size_t kObjectsPerSlab = 8;
+
+    OperationSlab();
+    // Frees every slab, so no object from this slab may outlive it.
+    ~OperationSlab();
+
+    /**
+     * Returns size bytes, or null if they can't be allocated.
+     */
+    void* Allocate(size_t size);
+
+    /**
+     * Frees object, which must have come from Allocate with the same size.
+     */
+    void Free(void* object, size_t size);
+
+    // Bytes taken from the heap for slabs; objects served from the heap aren't included.
+    size_t slab_bytes() const;
+
+    /**
+     * The slab Operation's operator new and delete use.  It is never destroyed, so that operations
+     * freed during static destruction are safe.
+     */
+    static OperationSlab* instance();
+
+  private:
+    static const size_t kSizeClassCount = kMaxObjectSize / kGranularity;
+
+    struct FreeObject {
+        FreeObject* next;
+    };
+    struct Slab {
+        Slab* next;
+    };
+
+    // Slab headers are padded to kGranularity so the objects that follow stay aligned.
+    static const size_t kSlabHeaderSize =
+        (sizeof(Slab) + kGranularity - 1) / kGranularity * kGranularity;
+
+    mutable std::mutex mutex_;
+    FreeObject* free_[kSizeClassCount];
+    Slab* slabs_;
+    size_t slab_bytes_;
+
+    // Disallow copying and assignment.
+    OperationSlab(const OperationSlab&);
+    void operator=(const OperationSlab&);
+};
+
+}  // namespace keymaster
+
+#endif  // SYSTEM_KEYMASTER_OPERATION_SLAB_H_
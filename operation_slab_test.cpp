@@ -0,0 +1,84 @@
+/*
+ * Copyright 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "operation_slab.h"
+
+#include <string.h>
+
+#include <set>
+
+#include <gtest/gtest.h>
+
+namespace keymaster {
+namespace test {
+
+TEST(OperationSlabTest, AllocatesDistinctObjects) {
+    OperationSlab slab;
+    std::set<void*> objects;
+    const size_t sizes[] = {1, 16, 17, 100, 100, 100, 1000, OperationSlab::kMaxObjectSize};
+    void* allocated[sizeof(sizes) / sizeof(sizes[0])];
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i) {
+        allocated[i] = slab.Allocate(sizes[i]);
+        ASSERT_TRUE(allocated[i] != nullptr);
+        EXPECT_EQ(0U, reinterpret_cast<uintptr_t>(allocated[i]) % OperationSlab::kGranularity);
+        memset(allocated[i], 0xa5, sizes[i]);
+        EXPECT_TRUE(objects.insert(allocated[i]).second);
+    }
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i)
+        slab.Free(allocated[i], sizes[i]);
+}
+
+TEST(OperationSlabTest, FreedObjectsAreReused) {
+    OperationSlab slab;
+    void* first = slab.Allocate(200);
+    ASSERT_TRUE(first != nullptr);
+    size_t slab_bytes = slab.slab_bytes();
+    EXPECT_GT(slab_bytes, 0U);
+
+    // Sizes in the same class share a freelist.
+    slab.Free(first, 200);
+    EXPECT_EQ(first, slab.Allocate(193));
+    slab.Free(first, 193);
+
+    // Cycling an object, or filling the rest of its slab, takes nothing more from the heap.
+    void* objects[OperationSlab::kObjectsPerSlab];
+    for (size_t i = 0; i < OperationSlab::kObjectsPerSlab; ++i) {
+        objects[i] = slab.Allocate(200);
+        ASSERT_TRUE(objects[i] != nullptr);
+    }
+    EXPECT_EQ(slab_bytes, slab.slab_bytes());
+
+    // One more needs a new slab.
+    void* extra = slab.Allocate(200);
+    ASSERT_TRUE(extra != nullptr);
+    EXPECT_GT(slab.slab_bytes(), slab_bytes);
+
+    slab.Free(extra, 200);
+    for (size_t i = 0; i < OperationSlab::kObjectsPerSlab; ++i)
+        slab.Free(objects[i], 200);
+}
+
+TEST(OperationSlabTest, LargeObjectsComeFromHeap) {
+    OperationSlab slab;
+    void* object = slab.Allocate(OperationSlab::kMaxObjectSize + 1);
+    ASSERT_TRUE(object != nullptr);
+    memset(object, 0xa5, OperationSlab::kMaxObjectSize + 1);
+    EXPECT_EQ(0U, slab.slab_bytes());
+    slab.Free(object, OperationSlab::kMaxObjectSize + 1);
+}
+
+}  // namespace test
+}  // namespace keymaster
@@ -16,11 +16,13 @@
 
 #include "operation_table.h"
 
+#include <sched.h>
+
 #include <new>
 
-#include <openssl/rand.h>
+#include <keymaster/logger.h>
 
-#include "openssl_err.h"
+#include "buffered_random.h"
 #include "operation.h"
 
 namespace keymaster {
@@ -31,60 +33,544 @@ OperationTable::Entry::~Entry() {
     handle = 0;
 }
 
-keymaster_error_t OperationTable::Add(Operation* operation,
-                                      keymaster_operation_handle_t* op_handle) {
-    if (!table_.get()) {
-        table_.reset(new (std::nothrow) Entry[table_size_]);
-        if (!table_.get())
-            return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+bool OperationTable::Initialize() {
+    size_t index_size = 2;
+    while (index_size < table_size_ * 2)
+        index_size <<= 1;
+
+    table_.reset(new (std::nothrow) Entry[table_size_]);
+    index_.reset(new (std::nothrow) size_t[index_size]);
+    free_slots_.reset(new (std::nothrow) size_t[table_size_]);
+    if (idle_timeout_ && !wheel_.get())
+        wheel_.reset(new (std::nothrow) size_t[kWheelLevels * kWheelSize]);
+    if (!table_.get() || !index_.get() || !free_slots_.get() || (idle_timeout_ && !wheel_.get())) {
+        table_.reset();
+        index_.reset();
+        free_slots_.reset();
+        wheel_.reset();
+        return false;
+    }
+
+    for (size_t i = 0; i < index_size; ++i)
+        index_[i] = kEmptyIndex;
+    if (wheel_.get()) {
+        for (size_t i = 0; i < kWheelLevels * kWheelSize; ++i)
+            wheel_[i] = kNoTimer;
+        wheel_time_ = current_time_;
+    }
+    // Push the slots in reverse order so that they're handed out lowest-first.
+    for (size_t i = 0; i < table_size_; ++i)
+        free_slots_[i] = table_size_ - i - 1;
+    free_count_ = table_size_;
+    index_mask_ = index_size - 1;
+    return true;
+}
+
+bool OperationTable::Grow() {
+    size_t new_size = table_size_ * 2;
+    if (new_size > max_table_size_)
+        new_size = max_table_size_;
+    if (new_size <= table_size_)
+        return false;
+
+    OperationTable grown(new_size, policy_, max_table_size_);
+    grown.idle_timeout_ = idle_timeout_;
+    grown.current_time_ = current_time_;
+    grown.wheel_time_ = wheel_time_;
+    if (!grown.Initialize())
+        return false;
+
+    // Operations are moved by pointer, so any Operation* held by callers remains valid.
+    for (size_t i = 0; i < table_size_; ++i) {
+        Entry& entry = table_[i];
+        if (!entry.operation)
+            continue;
+        size_t slot = grown.free_slots_[--grown.free_count_];
+        grown.InsertIntoSlot(slot, entry.operation, entry.handle, entry.last_touch, entry.bytes);
+        grown.table_[slot].in_use = entry.in_use;
+        grown.table_[slot].last_use_time = entry.last_use_time;
+        if (grown.wheel_.get())
+            grown.TimerInsert(slot, entry.last_use_time + idle_timeout_);
+        entry.operation = NULL;
+        entry.handle = 0;
+    }
+
+    table_.reset(grown.table_.release());
+    index_.reset(grown.index_.release());
+    free_slots_.reset(grown.free_slots_.release());
+    wheel_.reset(grown.wheel_.release());
+    free_count_ = grown.free_count_;
+    index_mask_ = grown.index_mask_;
+    table_size_ = new_size;
+    return true;
+}
+
+bool OperationTable::EvictLeastRecentlyUsed() {
+    // This only runs when the table is full or over its memory budget, so a scan is acceptable.
+    Entry* victim = NULL;
+    for (size_t i = 0; i < table_size_; ++i) {
+        Entry& entry = table_[i];
+        if (entry.operation && !entry.in_use &&
+            (!victim || entry.last_touch < victim->last_touch))
+            victim = &entry;
+    }
+    if (!victim)
+        return false;
+    LOG_I("Evicting least-recently-used operation to make room", 0);
+    return Delete(victim->handle);
+}
+
+void OperationTable::InsertIntoSlot(size_t slot, Operation* operation,
+                                    keymaster_operation_handle_t op_handle, uint64_t last_touch,
+                                    size_t bytes) {
+    table_[slot].operation = operation;
+    table_[slot].bytes = bytes;
+    table_[slot].handle = op_handle;
+    table_[slot].last_touch = last_touch;
+    table_[slot].in_use = false;
+    table_[slot].last_use_time = current_time_;
+
+    size_t bucket = HomeBucket(op_handle);
+    while (index_[bucket] != kEmptyIndex)
+        bucket = (bucket + 1) & index_mask_;
+    index_[bucket] = slot + 1;
+}
+
+size_t OperationTable::HomeBucket(keymaster_operation_handle_t op_handle) const {
+    // Handles are random, so folding the high half into the low half is sufficient mixing.
+    return static_cast<size_t>(op_handle ^ (op_handle >> 32)) & index_mask_;
+}
+
+size_t OperationTable::FindBucket(keymaster_operation_handle_t op_handle) const {
+    for (size_t bucket = HomeBucket(op_handle); index_[bucket] != kEmptyIndex;
+         bucket = (bucket + 1) & index_mask_) {
+        if (table_[index_[bucket] - 1].handle == op_handle)
+            return bucket;
     }
+    return index_mask_ + 1;
+}
+
+OperationTable::Entry* OperationTable::FindEntry(keymaster_operation_handle_t op_handle) {
+    if (op_handle == 0)
+        return NULL;
+
+    if (!table_.get())
+        return NULL;
 
+    size_t bucket = FindBucket(op_handle);
+    if (bucket > index_mask_)
+        return NULL;
+    return &table_[index_[bucket] - 1];
+}
+
+void OperationTable::RemoveBucket(size_t bucket) {
+    // Backward-shift deletion: move later members of the probe run into the hole so that lookups
+    // never need tombstones.
+    size_t hole = bucket;
+    for (size_t next = (hole + 1) & index_mask_; index_[next] != kEmptyIndex;
+         next = (next + 1) & index_mask_) {
+        size_t home = HomeBucket(table_[index_[next] - 1].handle);
+        // Entry at 'next' may fill the hole only if its home bucket is not cyclically within
+        // (hole, next].
+        bool home_after_hole = (next > hole) ? (home > hole && home <= next)
+                                             : (home > hole || home <= next);
+        if (!home_after_hole) {
+            index_[hole] = index_[next];
+            hole = next;
+        }
+    }
+    index_[hole] = kEmptyIndex;
+}
+
+void OperationTable::TimerInsert(size_t slot, uint32_t expiry) {
+    if (expiry < wheel_time_)
+        expiry = wheel_time_;
+    uint32_t delta = expiry - wheel_time_;
+    if (delta >= kWheelSpan) {
+        delta = kWheelSpan - 1;
+        expiry = wheel_time_ + delta;
+    }
+
+    size_t level = 0;
+    while (delta >= (1U << (kWheelBits * (level + 1))))
+        ++level;
+    size_t bucket = level * kWheelSize + ((expiry >> (kWheelBits * level)) & (kWheelSize - 1));
+
+    Entry& entry = table_[slot];
+    entry.timer_bucket = bucket;
+    entry.timer_prev = kNoTimer;
+    entry.timer_next = wheel_[bucket];
+    if (wheel_[bucket] != kNoTimer)
+        table_[wheel_[bucket]].timer_prev = slot;
+    wheel_[bucket] = slot;
+}
+
+void OperationTable::TimerRemove(size_t slot) {
+    Entry& entry = table_[slot];
+    if (entry.timer_bucket == kNoTimer)
+        return;
+    if (entry.timer_prev != kNoTimer)
+        table_[entry.timer_prev].timer_next = entry.timer_next;
+    else
+        wheel_[entry.timer_bucket] = entry.timer_next;
+    if (entry.timer_next != kNoTimer)
+        table_[entry.timer_next].timer_prev = entry.timer_prev;
+    entry.timer_bucket = entry.timer_next = entry.timer_prev = kNoTimer;
+}
+
+size_t OperationTable::TimerDetach(size_t bucket) {
+    size_t head = wheel_[bucket];
+    wheel_[bucket] = kNoTimer;
+    for (size_t slot = head; slot != kNoTimer; slot = table_[slot].timer_next)
+        table_[slot].timer_bucket = kNoTimer;
+    return head;
+}
+
+void OperationTable::TimerCascade(size_t level) {
+    size_t bucket =
+        level * kWheelSize + ((wheel_time_ >> (kWheelBits * level)) & (kWheelSize - 1));
+    size_t slot = TimerDetach(bucket);
+    while (slot != kNoTimer) {
+        size_t next = table_[slot].timer_next;
+        uint32_t expiry = table_[slot].last_use_time + idle_timeout_;
+        TimerInsert(slot, expiry);
+        slot = next;
+    }
+}
+
+size_t OperationTable::TimerFire(size_t slot) {
+    size_t reaped = 0;
+    while (slot != kNoTimer) {
+        Entry& entry = table_[slot];
+        size_t next = entry.timer_next;
+        uint32_t expiry = entry.last_use_time + idle_timeout_;
+        if (entry.in_use) {
+            TimerInsert(slot, wheel_time_ + idle_timeout_);
+        } else if (expiry > wheel_time_) {
+            // Used since the timer was armed; re-arm for the new deadline.
+            TimerInsert(slot, expiry);
+        } else {
+            LOG_I("Discarding operation idle for more than %u seconds", idle_timeout_);
+            Delete(entry.handle);
+            ++reaped;
+        }
+        slot = next;
+    }
+    return reaped;
+}
+
+size_t OperationTable::AdvanceTime(uint32_t now) {
+    if (now < current_time_)
+        return 0;
+    current_time_ = now;
+    if (!wheel_.get())
+        return 0;
+
+    size_t reaped = 0;
+    if (now - wheel_time_ >= kWheelSpan) {
+        // The clock jumped by more than the wheel covers (e.g. after a long suspend).  Rather than
+        // stepping through every tick, pull everything off the wheel and re-examine it directly.
+        size_t slots = kNoTimer;
+        for (size_t bucket = 0; bucket < kWheelLevels * kWheelSize; ++bucket) {
+            size_t slot = TimerDetach(bucket);
+            while (slot != kNoTimer) {
+                size_t next = table_[slot].timer_next;
+                table_[slot].timer_next = slots;
+                slots = slot;
+                slot = next;
+            }
+        }
+        wheel_time_ = now;
+        return TimerFire(slots);
+    }
+
+    while (wheel_time_ < now) {
+        ++wheel_time_;
+        for (size_t level = kWheelLevels - 1; level > 0; --level) {
+            if ((wheel_time_ & ((1U << (kWheelBits * level)) - 1)) == 0)
+                TimerCascade(level);
+        }
+        reaped += TimerFire(TimerDetach(wheel_time_ & (kWheelSize - 1)));
+    }
+    return reaped;
+}
+
+keymaster_error_t OperationTable::Add(Operation* operation,
+                                      keymaster_operation_handle_t* op_handle) {
     UniquePtr<Operation> op(operation);
-    if (RAND_bytes(reinterpret_cast<uint8_t*>(op_handle), sizeof(*op_handle)) != 1)
-        return TranslateLastOpenSslError();
+    keymaster_error_t error =
+        BufferedRandomBytes(reinterpret_cast<uint8_t*>(op_handle), sizeof(*op_handle));
+    if (error != KM_ERROR_OK)
+        return error;
     if (*op_handle == 0) {
         // Statistically this is vanishingly unlikely, which means if it ever happens in practice,
         // it indicates a broken RNG.
         return KM_ERROR_UNKNOWN_ERROR;
     }
 
-    for (size_t i = 0; i < table_size_; ++i) {
-        if (table_[i].operation == NULL) {
-            table_[i].operation = op.release();
-            table_[i].handle = *op_handle;
-            return KM_ERROR_OK;
+    return AddWithHandle(op.release(), *op_handle);
+}
+
+keymaster_error_t OperationTable::AddWithHandle(Operation* operation,
+                                                keymaster_operation_handle_t op_handle) {
+    UniquePtr<Operation> op(operation);
+    if (!table_.get() && !Initialize())
+        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+
+    if (free_count_ == 0) {
+        switch (policy_) {
+        case FAIL_WHEN_FULL:
+            break;
+        case GROW:
+            if (table_size_ < max_table_size_ && !Grow())
+                return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+            break;
+        case EVICT_LRU:
+            EvictLeastRecentlyUsed();
+            break;
         }
+        if (free_count_ == 0)
+            return KM_ERROR_TOO_MANY_OPERATIONS;
     }
-    return KM_ERROR_TOO_MANY_OPERATIONS;
+
+    size_t bytes = op->memory_footprint();
+    size_t slot = free_slots_[--free_count_];
+    InsertIntoSlot(slot, op.release(), op_handle, ++touch_count_, bytes);
+    bytes_ += bytes;
+    if (wheel_.get())
+        TimerInsert(slot, current_time_ + idle_timeout_);
+    return KM_ERROR_OK;
 }
 
 Operation* OperationTable::Find(keymaster_operation_handle_t op_handle) {
-    if (op_handle == 0)
+    Entry* entry = FindEntry(op_handle);
+    if (!entry)
         return NULL;
+    entry->last_touch = ++touch_count_;
+    entry->last_use_time = current_time_;
+    return entry->operation;
+}
 
-    if (!table_.get())
+Operation* OperationTable::Acquire(keymaster_operation_handle_t op_handle) {
+    Entry* entry = FindEntry(op_handle);
+    if (!entry || entry->in_use)
         return NULL;
+    entry->last_touch = ++touch_count_;
+    entry->last_use_time = current_time_;
+    entry->in_use = true;
+    return entry->operation;
+}
 
-    for (size_t i = 0; i < table_size_; ++i) {
-        if (table_[i].handle == op_handle)
-            return table_[i].operation;
+void OperationTable::Release(keymaster_operation_handle_t op_handle) {
+    Entry* entry = FindEntry(op_handle);
+    if (entry) {
+        entry->in_use = false;
+        entry->last_use_time = current_time_;
+        // The caller is done with the operation, so it's safe to look at it.
+        bytes_ -= entry->bytes;
+        entry->bytes = entry->operation->memory_footprint();
+        bytes_ += entry->bytes;
     }
-    return NULL;
 }
 
 bool OperationTable::Delete(keymaster_operation_handle_t op_handle) {
+    if (op_handle == 0)
+        return false;
+
     if (!table_.get())
         return false;
 
-    for (size_t i = 0; i < table_size_; ++i) {
-        if (table_[i].handle == op_handle) {
-            delete table_[i].operation;
-            table_[i].operation = NULL;
-            table_[i].handle = 0;
-            return true;
+    size_t bucket = FindBucket(op_handle);
+    if (bucket > index_mask_)
+        return false;
+
+    size_t slot = index_[bucket] - 1;
+    RemoveBucket(bucket);
+    if (wheel_.get())
+        TimerRemove(slot);
+
+    delete table_[slot].operation;
+    bytes_ -= table_[slot].bytes;
+    table_[slot].bytes = 0;
+    table_[slot].operation = NULL;
+    table_[slot].handle = 0;
+    table_[slot].in_use = false;
+    free_slots_[free_count_++] = slot;
+    return true;
+}
+
+const size_t ShardedOperationTable::kMaxShards;
+const size_t ShardedOperationTable::kMinShardSize;
+
+ShardedOperationTable::ShardedOperationTable(size_t table_size, OperationTable::FullPolicy policy,
+                                             size_t max_table_size)
+    : shard_count_(0), cpu_affinity_(false), last_advance_time_(0) {
+    size_t shard_count = table_size / kMinShardSize;
+    if (shard_count > kMaxShards)
+        shard_count = kMaxShards;
+    if (shard_count == 0)
+        shard_count = 1;
+
+    shards_.reset(new (std::nothrow) Shard[shard_count]);
+    if (!shards_.get())
+        return;
+
+    // Spread any remainder over the first shards so the total capacity is exactly table_size.
+    for (size_t i = 0; i < shard_count; ++i) {
+        size_t shard_size = table_size / shard_count + (i < table_size % shard_count ? 1 : 0);
+        size_t shard_max = max_table_size / shard_count + (i < max_table_size % shard_count ? 1 : 0);
+        shards_[i].table.reset(new (std::nothrow) OperationTable(shard_size, policy, shard_max));
+        if (!shards_[i].table.get()) {
+            shards_.reset();
+            return;
+        }
+    }
+    shard_count_ = shard_count;
+}
+
+ShardedOperationTable::Shard*
+ShardedOperationTable::ShardFor(keymaster_operation_handle_t op_handle) {
+    size_t shard = static_cast<size_t>(op_handle >> kShardShift);
+    if (shard >= shard_count_)
+        return NULL;
+    return &shards_[shard];
+}
+
+keymaster_error_t ShardedOperationTable::Add(Operation* operation,
+                                             keymaster_operation_handle_t* op_handle) {
+    UniquePtr<Operation> op(operation);
+    if (shard_count_ == 0)
+        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+
+    keymaster_operation_handle_t random;
+    keymaster_error_t error =
+        BufferedRandomBytes(reinterpret_cast<uint8_t*>(&random), sizeof(random));
+    if (error != KM_ERROR_OK)
+        return error;
+
+    const keymaster_operation_handle_t kShardMask = ~0ULL << kShardShift;
+    random &= ~kShardMask;
+    if (random == 0) {
+        // Statistically this is vanishingly unlikely, which means if it ever happens in practice,
+        // it indicates a broken RNG.
+        return KM_ERROR_UNKNOWN_ERROR;
+    }
+
+    // Start at this CPU's shard, or a random one to spread load, and move on to the others if it's
+    // full.  If they're all full, the first shard's policy decides the outcome.
+    size_t first = static_cast<size_t>(random % shard_count_);
+    int cpu = cpu_affinity_ ? sched_getcpu() : -1;
+    if (cpu >= 0)
+        first = static_cast<size_t>(cpu) % shard_count_;
+    for (size_t i = 0; i <= shard_count_; ++i) {
+        size_t shard = (first + i) % shard_count_;
+        std::lock_guard<CountingMutex> lock(shards_[shard].mutex);
+        OperationTable* table = shards_[shard].table.get();
+        if (i < shard_count_ && !table->has_room())
+            continue;
+
+        keymaster_operation_handle_t handle =
+            random | (static_cast<keymaster_operation_handle_t>(shard) << kShardShift);
+        error = table->AddWithHandle(op.release(), handle);
+        if (error == KM_ERROR_OK)
+            *op_handle = handle;
+        return error;
+    }
+    return KM_ERROR_TOO_MANY_OPERATIONS;
+}
+
+Operation* ShardedOperationTable::Find(keymaster_operation_handle_t op_handle) {
+    Shard* shard = ShardFor(op_handle);
+    if (!shard)
+        return NULL;
+    std::lock_guard<CountingMutex> lock(shard->mutex);
+    return shard->table->Find(op_handle);
+}
+
+bool ShardedOperationTable::Delete(keymaster_operation_handle_t op_handle) {
+    Shard* shard = ShardFor(op_handle);
+    if (!shard)
+        return false;
+    std::lock_guard<CountingMutex> lock(shard->mutex);
+    return shard->table->Delete(op_handle);
+}
+
+Operation* ShardedOperationTable::Acquire(keymaster_operation_handle_t op_handle) {
+    Shard* shard = ShardFor(op_handle);
+    if (!shard)
+        return NULL;
+    std::lock_guard<CountingMutex> lock(shard->mutex);
+    return shard->table->Acquire(op_handle);
+}
+
+void ShardedOperationTable::set_idle_timeout(uint32_t seconds) {
+    for (size_t i = 0; i < shard_count_; ++i) {
+        std::lock_guard<CountingMutex> lock(shards_[i].mutex);
+        shards_[i].table->set_idle_timeout(seconds);
+    }
+}
+
+size_t ShardedOperationTable::AdvanceTime(uint32_t now) {
+    uint32_t last = last_advance_time_.load();
+    if (now == last || !last_advance_time_.compare_exchange_strong(last, now))
+        return 0;
+
+    size_t reaped = 0;
+    for (size_t i = 0; i < shard_count_; ++i) {
+        std::lock_guard<CountingMutex> lock(shards_[i].mutex);
+        reaped += shards_[i].table->AdvanceTime(now);
+    }
+    return reaped;
+}
+
+size_t ShardedOperationTable::bytes() const {
+    size_t bytes = 0;
+    for (size_t i = 0; i < shard_count_; ++i) {
+        std::lock_guard<CountingMutex> lock(shards_[i].mutex);
+        bytes += shards_[i].table->bytes();
+    }
+    return bytes;
+}
+
+bool ShardedOperationTable::EvictLeastRecentlyUsed() {
+    Shard* largest = NULL;
+    size_t largest_bytes = 0;
+    for (size_t i = 0; i < shard_count_; ++i) {
+        std::lock_guard<CountingMutex> lock(shards_[i].mutex);
+        size_t bytes = shards_[i].table->bytes();
+        if (bytes > largest_bytes) {
+            largest = &shards_[i];
+            largest_bytes = bytes;
         }
     }
+    if (!largest)
+        return false;
+
+    // The largest shard's operations may all be in use, in which case any other will do.
+    for (size_t i = 0; i <= shard_count_; ++i) {
+        Shard* shard = i == 0 ? largest : &shards_[i - 1];
+        if (i > 0 && shard == largest)
+            continue;
+        std::lock_guard<CountingMutex> lock(shard->mutex);
+        if (shard->table->EvictLeastRecentlyUsed())
+            return true;
+    }
     return false;
 }
 
+LockStatistics ShardedOperationTable::lock_statistics() const {
+    LockStatistics statistics;
+    for (size_t i = 0; i < shard_count_; ++i)
+        statistics.Add(shards_[i].mutex.statistics());
+    return statistics;
+}
+
+void ShardedOperationTable::Release(keymaster_operation_handle_t op_handle) {
+    Shard* shard = ShardFor(op_handle);
+    if (!shard)
+        return;
+    std::lock_guard<CountingMutex> lock(shard->mutex);
+    shard->table->Release(op_handle);
+}
+
 }  // namespace keymaster
@@ -17,35 +17,231 @@
 #ifndef SYSTEM_KEYMASTER_OPERATION_TABLE_H
 #define SYSTEM_KEYMASTER_OPERATION_TABLE_H
 
+#include <atomic>
+#include <mutex>
+
 #include <UniquePtr.h>
 
 #include <hardware/keymaster_defs.h>
 
+#include <keymaster/lock_statistics.h>
+
 namespace keymaster {
 
 class Operation;
 
+/**
+ * OperationTable holds the in-progress operations, indexed by their randomly-generated handles.
+ *
+ * Entries live in a slot array.  Unused slots are kept on a free list and occupied slots are
+ * located through an open-addressed (linear probing) hash index keyed on the handle, so Add, Find
+ * and Delete take constant time regardless of the table size.
+ *
+ * What happens when Add finds the table full is determined by the FullPolicy.
+ *
+ * If an idle timeout is set, operations which go unused for that long are discarded.  Expiry is
+ * tracked with a three-level hierarchical timer wheel, advanced by AdvanceTime.  Using an operation
+ * only records the time; the timer is re-armed lazily when it fires, so both touching and reaping
+ * are amortized constant time.
+ */
 class OperationTable {
   public:
-    OperationTable(size_t table_size) : table_size_(table_size) {}
+    enum FullPolicy {
+        // Fail with KM_ERROR_TOO_MANY_OPERATIONS.
+        FAIL_WHEN_FULL,
+        // Double the table size, up to max_table_size, and fail only when that is reached.
+        GROW,
+        // Discard the least-recently-used operation that is not currently acquired.
+        EVICT_LRU,
+    };
+
+    OperationTable(size_t table_size, FullPolicy policy = FAIL_WHEN_FULL,
+                   size_t max_table_size = 0)
+        : free_count_(0), index_mask_(0), table_size_(table_size),
+          max_table_size_(max_table_size < table_size ? table_size : max_table_size),
+          policy_(policy), touch_count_(0), bytes_(0), idle_timeout_(0), current_time_(0),
+          wheel_time_(0) {}
 
     struct Entry {
         Entry() {
             handle = 0;
             operation = NULL;
+            last_touch = 0;
+            in_use = false;
+            last_use_time = 0;
+            bytes = 0;
+            timer_bucket = timer_next = timer_prev = kNoTimer;
         };
         ~Entry();
         keymaster_operation_handle_t handle;
         Operation* operation;
+        // Value of the table's touch counter when the entry was last added, found or acquired.
+        uint64_t last_touch;
+        // Set between Acquire and Release.  Entries in use are never evicted or reaped.
+        bool in_use;
+        // Time, in seconds as passed to AdvanceTime, at which the entry was last used.
+        uint32_t last_use_time;
+        // The operation's memory footprint, as of its Add or last Release.
+        size_t bytes;
+        // Timer wheel linkage: the bucket holding this entry and its neighbours' slots in the
+        // bucket's list, or kNoTimer.
+        size_t timer_bucket;
+        size_t timer_next;
+        size_t timer_prev;
     };
 
     keymaster_error_t Add(Operation* operation, keymaster_operation_handle_t* op_handle);
+    // Adds operation under a handle chosen by the caller, which must be non-zero and not already in
+    // the table.  Takes ownership of operation even on failure.
+    keymaster_error_t AddWithHandle(Operation* operation, keymaster_operation_handle_t op_handle);
     Operation* Find(keymaster_operation_handle_t op_handle);
     bool Delete(keymaster_operation_handle_t);
 
+    // Like Find, but also marks the operation as in use, protecting it from eviction until
+    // Release is called or the operation is deleted.  Returns NULL if the operation is already in
+    // use, so that two threads can't run the same operation at once.
+    Operation* Acquire(keymaster_operation_handle_t op_handle);
+    void Release(keymaster_operation_handle_t op_handle);
+
+    // Sets the number of seconds an operation may go unused before AdvanceTime discards it.  Zero,
+    // the default, disables reaping.  Must be called before the first Add.
+    void set_idle_timeout(uint32_t seconds) { idle_timeout_ = seconds; }
+    // Advances the table's clock to now (in seconds, from a monotonic source such as
+    // KeymasterContext::GetMonotonicSeconds()) and discards operations that have been idle longer
+    // than the idle timeout.  Returns the number of operations discarded.
+    size_t AdvanceTime(uint32_t now);
+
+    // True if Add would not need to apply the full policy.
+    bool has_room() const {
+        return free_slot_count() > 0 || (policy_ == GROW && table_size_ < max_table_size_);
+    }
+
+    size_t table_size() const { return table_size_; }
+    size_t free_slot_count() const { return table_.get() ? free_count_ : table_size_; }
+
+    // The sum of the memory footprints of the operations in the table, each as of its Add or last
+    // Release.
+    size_t bytes() const { return bytes_; }
+
+    // Discards the least-recently-used operation that is not currently acquired.  Returns false if
+    // there's none.
+    bool EvictLeastRecentlyUsed();
+
   private:
+    static const size_t kEmptyIndex = 0;
+    static const size_t kNoTimer = static_cast<size_t>(-1);
+    static const int kWheelBits = 6;
+    static const size_t kWheelSize = 1 << kWheelBits;
+    static const size_t kWheelLevels = 3;
+    // Timers further in the future than this are parked in the top level and re-armed when they
+    // fire.
+    static const uint32_t kWheelSpan = 1U << (kWheelBits * kWheelLevels);
+
+    bool Initialize();
+    bool Grow();
+    void InsertIntoSlot(size_t slot, Operation* operation, keymaster_operation_handle_t op_handle,
+                        uint64_t last_touch, size_t bytes);
+    size_t HomeBucket(keymaster_operation_handle_t op_handle) const;
+    // Returns the index_ bucket which refers to the slot holding op_handle, or index_mask_ + 1 if
+    // op_handle is not in the table.
+    size_t FindBucket(keymaster_operation_handle_t op_handle) const;
+    Entry* FindEntry(keymaster_operation_handle_t op_handle);
+    void RemoveBucket(size_t bucket);
+
+    void TimerInsert(size_t slot, uint32_t expiry);
+    void TimerRemove(size_t slot);
+    // Detaches the list in a wheel bucket and returns its first slot, or kNoTimer.
+    size_t TimerDetach(size_t bucket);
+    void TimerCascade(size_t level);
+    // Discards or re-arms the entries in a detached bucket list.  Returns the number discarded.
+    size_t TimerFire(size_t slot);
+
     UniquePtr<Entry[]> table_;
+    // Hash index.  Each bucket holds one plus the position in table_ of the entry it refers to, or
+    // kEmptyIndex.  The index has at least twice as many buckets as table_ has slots.
+    UniquePtr<size_t[]> index_;
+    // Stack of unused positions in table_.
+    UniquePtr<size_t[]> free_slots_;
+    size_t free_count_;
+    size_t index_mask_;
     size_t table_size_;
+    size_t max_table_size_;
+    FullPolicy policy_;
+    uint64_t touch_count_;
+    size_t bytes_;
+
+    uint32_t idle_timeout_;
+    uint32_t current_time_;
+    // The wheel has processed all ticks up to and including wheel_time_.
+    uint32_t wheel_time_;
+    // kWheelLevels * kWheelSize list heads, allocated only if the idle timeout is set.
+    UniquePtr<size_t[]> wheel_;
+};
+
+/**
+ * ShardedOperationTable splits the operation table into independently-locked OperationTable
+ * shards, so that callers on different threads working on different operations never contend.
+ * The shard holding an operation is encoded in the top byte of its handle.  Optionally, new
+ * operations go to the shard of the CPU that begins them, so that operations begun on one core are
+ * updated and finished from a table that core's cache already holds.
+ *
+ * Locking covers only the table itself.  Acquire hands an operation to one thread at a time, so
+ * callers that go through Acquire need no further locking to use it; callers must not use an
+ * Operation returned by Find after it has been deleted.  An operation that may be evicted by a
+ * concurrent Add must be held with Acquire rather than Find.
+ */
+class ShardedOperationTable {
+  public:
+    static const size_t kMaxShards = 16;
+    // Shards are not made smaller than this, so small tables get a single shard.
+    static const size_t kMinShardSize = 8;
+
+    // The policy is applied per shard; with GROW, max_table_size is divided among the shards.
+    ShardedOperationTable(size_t table_size,
+                          OperationTable::FullPolicy policy = OperationTable::FAIL_WHEN_FULL,
+                          size_t max_table_size = 0);
+
+    keymaster_error_t Add(Operation* operation, keymaster_operation_handle_t* op_handle);
+    Operation* Find(keymaster_operation_handle_t op_handle);
+    bool Delete(keymaster_operation_handle_t op_handle);
+    Operation* Acquire(keymaster_operation_handle_t op_handle);
+    void Release(keymaster_operation_handle_t op_handle);
+
+    // See OperationTable::set_idle_timeout.  Must be called before the first Add.
+    void set_idle_timeout(uint32_t seconds);
+
+    // If enabled, Add starts looking for room at the shard for the calling thread's CPU, rather
+    // than at a random one.  Falls back to a random shard where the CPU can't be queried.
+    // Disabled by default.  Must be called before the first Add.
+    void set_cpu_affinity(bool enabled) { cpu_affinity_ = enabled; }
+    // Advances every shard's clock.  Cheap when now hasn't changed since the last call.
+    size_t AdvanceTime(uint32_t now);
+
+    size_t shard_count() const { return shard_count_; }
+
+    // Returns the memory footprint of all the shards' operations, summed.
+    size_t bytes() const;
+    // Discards the least-recently-used idle operation of the shard whose operations hold the most
+    // memory, or failing that of any other shard.  Returns false if there's none to discard.
+    bool EvictLeastRecentlyUsed();
+
+    // Returns the lock statistics of all the shards, summed.
+    LockStatistics lock_statistics() const;
+
+  private:
+    struct Shard {
+        mutable CountingMutex mutex;
+        UniquePtr<OperationTable> table;
+    };
+
+    static const int kShardShift = 56;
+
+    Shard* ShardFor(keymaster_operation_handle_t op_handle);
+
+    UniquePtr<Shard[]> shards_;
+    size_t shard_count_;
+    bool cpu_affinity_;
+    std::atomic<uint32_t> last_advance_time_;
 };
 
 }  // namespace keymaster
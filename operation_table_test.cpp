@@ -0,0 +1,454 @@
+/*
+ * Copyright 2015 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "operation_table.h"
+
+#include <sched.h>
+
+#include <gtest/gtest.h>
+
+#include <thread>
+#include <vector>
+
+#include "android_keymaster_test_utils.h"
+#include "operation.h"
+#include "operation_slab.h"
+
+namespace keymaster {
+namespace test {
+
+class TestOperation : public Operation {
+  public:
+    TestOperation(size_t* live_count)
+        : Operation(KM_PURPOSE_SIGN), live_count_(live_count), buffer_bytes_(0) {
+        ++*live_count_;
+    }
+    ~TestOperation() { --*live_count_; }
+
+    keymaster_error_t Begin(const AuthorizationSet&, AuthorizationSet*) override {
+        return KM_ERROR_OK;
+    }
+    keymaster_error_t Update(const AuthorizationSet&, const Buffer&, AuthorizationSet*, Buffer*,
+                             size_t*) override {
+        return KM_ERROR_OK;
+    }
+    keymaster_error_t Finish(const AuthorizationSet&, const Buffer&, const Buffer&,
+                             AuthorizationSet*, Buffer*) override {
+        return KM_ERROR_OK;
+    }
+    keymaster_error_t Abort() override { return KM_ERROR_OK; }
+
+    void set_buffer_bytes(size_t bytes) { buffer_bytes_ = bytes; }
+
+  private:
+    size_t object_size() const override { return sizeof(*this); }
+    size_t buffer_bytes() const override { return buffer_bytes_; }
+
+    size_t* live_count_;
+    size_t buffer_bytes_;
+};
+
+TEST(OperationTableTest, AddFindDelete) {
+    size_t live = 0;
+    OperationTable table(4);
+    Operation* op = new TestOperation(&live);
+    keymaster_operation_handle_t handle;
+    ASSERT_EQ(KM_ERROR_OK, table.Add(op, &handle));
+    EXPECT_EQ(op, table.Find(handle));
+    EXPECT_EQ(NULL, table.Find(handle + 1));
+    EXPECT_EQ(NULL, table.Find(0));
+
+    EXPECT_TRUE(table.Delete(handle));
+    EXPECT_EQ(0U, live);
+    EXPECT_EQ(NULL, table.Find(handle));
+    EXPECT_FALSE(table.Delete(handle));
+}
+
+TEST(OperationTableTest, OperationsComeFromSlab) {
+    size_t live = 0;
+    Operation* op = new TestOperation(&live);
+    size_t slab_bytes = OperationSlab::instance()->slab_bytes();
+    delete op;
+    Operation* again = new TestOperation(&live);
+    EXPECT_EQ(op, again);
+    EXPECT_EQ(slab_bytes, OperationSlab::instance()->slab_bytes());
+    delete again;
+    EXPECT_EQ(0U, live);
+}
+
+TEST(OperationTableTest, Full) {
+    size_t live = 0;
+    const size_t kTableSize = 4;
+    OperationTable table(kTableSize);
+    keymaster_operation_handle_t handles[kTableSize];
+    for (size_t i = 0; i < kTableSize; ++i)
+        ASSERT_EQ(KM_ERROR_OK, table.Add(new TestOperation(&live), &handles[i]));
+
+    keymaster_operation_handle_t extra;
+    EXPECT_EQ(KM_ERROR_TOO_MANY_OPERATIONS, table.Add(new TestOperation(&live), &extra));
+    EXPECT_EQ(kTableSize, live);
+
+    // Freeing a slot makes room for another operation.
+    EXPECT_TRUE(table.Delete(handles[1]));
+    EXPECT_EQ(KM_ERROR_OK, table.Add(new TestOperation(&live), &handles[1]));
+    for (size_t i = 0; i < kTableSize; ++i)
+        EXPECT_TRUE(table.Find(handles[i]) != NULL);
+}
+
+TEST(OperationTableTest, ManyAddsAndDeletes) {
+    size_t live = 0;
+    const size_t kTableSize = 64;
+    OperationTable table(kTableSize);
+    std::vector<keymaster_operation_handle_t> handles;
+    std::vector<Operation*> ops;
+
+    for (size_t round = 0; round < 20; ++round) {
+        while (handles.size() < kTableSize) {
+            Operation* op = new TestOperation(&live);
+            keymaster_operation_handle_t handle;
+            ASSERT_EQ(KM_ERROR_OK, table.Add(op, &handle));
+            handles.push_back(handle);
+            ops.push_back(op);
+        }
+        // Delete every other operation, then check that the survivors are all still reachable.
+        for (size_t i = handles.size(); i > 0; i -= 2) {
+            EXPECT_TRUE(table.Delete(handles[i - 1]));
+            handles.erase(handles.begin() + i - 1);
+            ops.erase(ops.begin() + i - 1);
+        }
+        for (size_t i = 0; i < handles.size(); ++i)
+            EXPECT_EQ(ops[i], table.Find(handles[i]));
+        EXPECT_EQ(handles.size(), live);
+    }
+}
+
+TEST(OperationTableTest, GrowPolicy) {
+    size_t live = 0;
+    OperationTable table(2, OperationTable::GROW, 5);
+    std::vector<keymaster_operation_handle_t> handles(5);
+    std::vector<Operation*> ops(5);
+    for (size_t i = 0; i < 5; ++i) {
+        ops[i] = new TestOperation(&live);
+        ASSERT_EQ(KM_ERROR_OK, table.Add(ops[i], &handles[i]));
+    }
+    EXPECT_EQ(5U, table.table_size());
+    EXPECT_FALSE(table.has_room());
+
+    // Growth must not disturb existing operations.
+    for (size_t i = 0; i < 5; ++i)
+        EXPECT_EQ(ops[i], table.Find(handles[i]));
+
+    keymaster_operation_handle_t extra;
+    EXPECT_EQ(KM_ERROR_TOO_MANY_OPERATIONS, table.Add(new TestOperation(&live), &extra));
+    EXPECT_EQ(5U, live);
+}
+
+TEST(OperationTableTest, EvictLruPolicy) {
+    size_t live = 0;
+    OperationTable table(3, OperationTable::EVICT_LRU);
+    keymaster_operation_handle_t handles[3];
+    for (size_t i = 0; i < 3; ++i)
+        ASSERT_EQ(KM_ERROR_OK, table.Add(new TestOperation(&live), &handles[i]));
+
+    // Touch the oldest so that handles[1] becomes least-recently used.
+    EXPECT_TRUE(table.Find(handles[0]) != NULL);
+
+    keymaster_operation_handle_t handle;
+    ASSERT_EQ(KM_ERROR_OK, table.Add(new TestOperation(&live), &handle));
+    EXPECT_EQ(3U, live);
+    EXPECT_EQ(NULL, table.Find(handles[1]));
+    EXPECT_TRUE(table.Find(handles[0]) != NULL);
+    EXPECT_TRUE(table.Find(handles[2]) != NULL);
+    EXPECT_TRUE(table.Find(handle) != NULL);
+}
+
+TEST(OperationTableTest, CountsBytes) {
+    size_t live = 0;
+    OperationTable table(3);
+    EXPECT_EQ(0U, table.bytes());
+
+    TestOperation* ops[2];
+    keymaster_operation_handle_t handles[2];
+    for (size_t i = 0; i < 2; ++i) {
+        ops[i] = new TestOperation(&live);
+        ASSERT_EQ(KM_ERROR_OK, table.Add(ops[i], &handles[i]));
+    }
+    const size_t footprint = ops[0]->memory_footprint();
+    EXPECT_EQ(sizeof(TestOperation), footprint);
+    EXPECT_EQ(2 * footprint, table.bytes());
+
+    // Growth while acquired is counted on release.
+    ASSERT_EQ(ops[0], table.Acquire(handles[0]));
+    ops[0]->set_buffer_bytes(1000);
+    EXPECT_EQ(2 * footprint, table.bytes());
+    table.Release(handles[0]);
+    EXPECT_EQ(2 * footprint + 1000, table.bytes());
+
+    // handles[0] was used last, so handles[1] is evicted first.
+    EXPECT_TRUE(table.EvictLeastRecentlyUsed());
+    EXPECT_EQ(NULL, table.Find(handles[1]));
+    EXPECT_EQ(footprint + 1000, table.bytes());
+    EXPECT_TRUE(table.Delete(handles[0]));
+    EXPECT_EQ(0U, table.bytes());
+    EXPECT_FALSE(table.EvictLeastRecentlyUsed());
+    EXPECT_EQ(0U, live);
+}
+
+TEST(OperationTableTest, EvictLruSkipsAcquired) {
+    size_t live = 0;
+    OperationTable table(2, OperationTable::EVICT_LRU);
+    keymaster_operation_handle_t handles[2];
+    for (size_t i = 0; i < 2; ++i)
+        ASSERT_EQ(KM_ERROR_OK, table.Add(new TestOperation(&live), &handles[i]));
+
+    EXPECT_TRUE(table.Acquire(handles[0]) != NULL);
+    EXPECT_TRUE(table.Acquire(handles[1]) != NULL);
+    keymaster_operation_handle_t handle;
+    EXPECT_EQ(KM_ERROR_TOO_MANY_OPERATIONS, table.Add(new TestOperation(&live), &handle));
+
+    // Once released, the least-recently-used operation can be evicted again.
+    table.Release(handles[0]);
+    ASSERT_EQ(KM_ERROR_OK, table.Add(new TestOperation(&live), &handle));
+    EXPECT_EQ(NULL, table.Find(handles[0]));
+    EXPECT_TRUE(table.Find(handles[1]) != NULL);
+    EXPECT_EQ(2U, live);
+}
+
+TEST(OperationTableTest, AcquireIsExclusive) {
+    size_t live = 0;
+    OperationTable table(2);
+    keymaster_operation_handle_t handle;
+    ASSERT_EQ(KM_ERROR_OK, table.Add(new TestOperation(&live), &handle));
+
+    EXPECT_TRUE(table.Acquire(handle) != NULL);
+    EXPECT_EQ(NULL, table.Acquire(handle));
+    EXPECT_TRUE(table.Find(handle) != NULL);
+    table.Release(handle);
+    EXPECT_TRUE(table.Acquire(handle) != NULL);
+}
+
+TEST(OperationTableTest, IdleReaping) {
+    size_t live = 0;
+    OperationTable table(4);
+    table.set_idle_timeout(10);
+    table.AdvanceTime(100);
+
+    keymaster_operation_handle_t idle, busy, touched;
+    ASSERT_EQ(KM_ERROR_OK, table.Add(new TestOperation(&live), &idle));
+    ASSERT_EQ(KM_ERROR_OK, table.Add(new TestOperation(&live), &busy));
+    ASSERT_EQ(KM_ERROR_OK, table.Add(new TestOperation(&live), &touched));
+    EXPECT_TRUE(table.Acquire(busy) != NULL);
+
+    EXPECT_EQ(0U, table.AdvanceTime(105));
+    EXPECT_TRUE(table.Find(touched) != NULL);
+    EXPECT_EQ(0U, table.AdvanceTime(109));
+    EXPECT_EQ(1U, table.AdvanceTime(110));
+    EXPECT_EQ(NULL, table.Find(idle));
+    EXPECT_EQ(2U, live);
+
+    EXPECT_EQ(1U, table.AdvanceTime(115));
+    EXPECT_EQ(NULL, table.Find(touched));
+    EXPECT_TRUE(table.Find(busy) != NULL);
+
+    table.Release(busy);
+    EXPECT_EQ(0U, table.AdvanceTime(124));
+    EXPECT_EQ(1U, table.AdvanceTime(125));
+    EXPECT_EQ(0U, live);
+}
+
+TEST(OperationTableTest, IdleReapingLongTimeout) {
+    size_t live = 0;
+    const uint32_t kTimeout = 5000;  // Lands in the top wheel level.
+    OperationTable table(2);
+    table.set_idle_timeout(kTimeout);
+    table.AdvanceTime(7);
+
+    keymaster_operation_handle_t handle;
+    ASSERT_EQ(KM_ERROR_OK, table.Add(new TestOperation(&live), &handle));
+    EXPECT_EQ(0U, table.AdvanceTime(7 + kTimeout - 1));
+    EXPECT_EQ(1U, live);
+    EXPECT_EQ(1U, table.AdvanceTime(7 + kTimeout));
+    EXPECT_EQ(0U, live);
+}
+
+TEST(OperationTableTest, IdleReapingClockJump) {
+    size_t live = 0;
+    OperationTable table(2);
+    table.set_idle_timeout(30);
+
+    keymaster_operation_handle_t handle;
+    ASSERT_EQ(KM_ERROR_OK, table.Add(new TestOperation(&live), &handle));
+    EXPECT_EQ(1U, table.AdvanceTime(10000000));
+    EXPECT_EQ(0U, live);
+
+    ASSERT_EQ(KM_ERROR_OK, table.Add(new TestOperation(&live), &handle));
+    EXPECT_EQ(0U, table.AdvanceTime(10000029));
+    EXPECT_EQ(1U, table.AdvanceTime(10000030));
+}
+
+TEST(OperationTableTest, IdleReapingSurvivesGrowth) {
+    size_t live = 0;
+    OperationTable table(1, OperationTable::GROW, 4);
+    table.set_idle_timeout(10);
+
+    keymaster_operation_handle_t handles[4];
+    for (size_t i = 0; i < 4; ++i) {
+        table.AdvanceTime(i);
+        ASSERT_EQ(KM_ERROR_OK, table.Add(new TestOperation(&live), &handles[i]));
+    }
+    EXPECT_EQ(4U, table.table_size());
+    for (size_t i = 0; i < 4; ++i) {
+        EXPECT_EQ(1U, table.AdvanceTime(10 + i));
+        EXPECT_EQ(NULL, table.Find(handles[i]));
+    }
+    EXPECT_EQ(0U, live);
+}
+
+TEST(ShardedOperationTableTest, ShardCount) {
+    EXPECT_EQ(1U, ShardedOperationTable(4).shard_count());
+    EXPECT_EQ(2U, ShardedOperationTable(16).shard_count());
+    EXPECT_EQ(ShardedOperationTable::kMaxShards, ShardedOperationTable(1024).shard_count());
+}
+
+TEST(ShardedOperationTableTest, CapacityIsPreserved) {
+    size_t live = 0;
+    const size_t kTableSize = 19;
+    ShardedOperationTable table(kTableSize);
+    ASSERT_EQ(2U, table.shard_count());
+
+    std::vector<keymaster_operation_handle_t> handles(kTableSize);
+    for (size_t i = 0; i < kTableSize; ++i) {
+        ASSERT_EQ(KM_ERROR_OK, table.Add(new TestOperation(&live), &handles[i]));
+        EXPECT_LT(handles[i] >> 56, table.shard_count());
+    }
+    keymaster_operation_handle_t extra;
+    EXPECT_EQ(KM_ERROR_TOO_MANY_OPERATIONS, table.Add(new TestOperation(&live), &extra));
+    EXPECT_EQ(kTableSize, live);
+
+    for (size_t i = 0; i < kTableSize; ++i)
+        EXPECT_TRUE(table.Delete(handles[i]));
+    EXPECT_EQ(0U, live);
+}
+
+TEST(ShardedOperationTableTest, InvalidShard) {
+    ShardedOperationTable table(16);
+    EXPECT_EQ(NULL, table.Find(0xFF00000000000001ULL));
+    EXPECT_FALSE(table.Delete(0xFF00000000000001ULL));
+}
+
+TEST(ShardedOperationTableTest, EvictsFromLargestShard) {
+    size_t live = 0;
+    ShardedOperationTable table(16);
+    ASSERT_EQ(2U, table.shard_count());
+
+    TestOperation* big = new TestOperation(&live);
+    big->set_buffer_bytes(10000);
+    const size_t big_bytes = big->memory_footprint();
+    keymaster_operation_handle_t big_handle;
+    ASSERT_EQ(KM_ERROR_OK, table.Add(big, &big_handle));
+
+    keymaster_operation_handle_t handles[4];
+    for (size_t i = 0; i < 4; ++i)
+        ASSERT_EQ(KM_ERROR_OK, table.Add(new TestOperation(&live), &handles[i]));
+    const size_t small_bytes = sizeof(TestOperation);
+    EXPECT_EQ(big_bytes + 4 * small_bytes, table.bytes());
+
+    // The big operation is the oldest in the shard with the most memory.
+    EXPECT_TRUE(table.EvictLeastRecentlyUsed());
+    EXPECT_EQ(NULL, table.Find(big_handle));
+    EXPECT_EQ(4 * small_bytes, table.bytes());
+
+    for (size_t i = 0; i < 4; ++i)
+        EXPECT_TRUE(table.EvictLeastRecentlyUsed());
+    EXPECT_FALSE(table.EvictLeastRecentlyUsed());
+    EXPECT_EQ(0U, table.bytes());
+    EXPECT_EQ(0U, live);
+}
+
+TEST(ShardedOperationTableTest, ConcurrentChurn) {
+    const size_t kThreads = 4;
+    const size_t kPerThread = 16;
+    ShardedOperationTable table(kThreads * kPerThread);
+    size_t live[kThreads] = {};
+
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < kThreads; ++t) {
+        threads.push_back(std::thread([&table, &live, t] {
+            for (size_t round = 0; round < 200; ++round) {
+                keymaster_operation_handle_t handles[kPerThread];
+                Operation* ops[kPerThread];
+                for (size_t i = 0; i < kPerThread; ++i) {
+                    ops[i] = new TestOperation(&live[t]);
+                    EXPECT_EQ(KM_ERROR_OK, table.Add(ops[i], &handles[i]));
+                }
+                for (size_t i = 0; i < kPerThread; ++i) {
+                    EXPECT_EQ(ops[i], table.Find(handles[i]));
+                    EXPECT_TRUE(table.Delete(handles[i]));
+                }
+            }
+        }));
+    }
+    for (auto& thread : threads)
+        thread.join();
+    for (size_t t = 0; t < kThreads; ++t)
+        EXPECT_EQ(0U, live[t]);
+}
+
+TEST(ShardedOperationTableTest, CpuAffinity) {
+    // Pin this thread to the CPU it's on, so it can't migrate between Adds.
+    int cpu = sched_getcpu();
+    cpu_set_t old_cpus, cpus;
+    if (cpu < 0 || sched_getaffinity(0, sizeof(old_cpus), &old_cpus) != 0)
+        return;
+    CPU_ZERO(&cpus);
+    CPU_SET(cpu, &cpus);
+    if (sched_setaffinity(0, sizeof(cpus), &cpus) != 0)
+        return;
+
+    size_t live = 0;
+    ShardedOperationTable table(64);
+    table.set_cpu_affinity(true);
+    const size_t kOperations = 3;
+    keymaster_operation_handle_t handles[kOperations];
+    for (size_t i = 0; i < kOperations; ++i) {
+        ASSERT_EQ(KM_ERROR_OK, table.Add(new TestOperation(&live), &handles[i]));
+        EXPECT_EQ(static_cast<size_t>(cpu) % table.shard_count(), handles[i] >> 56);
+    }
+    for (size_t i = 0; i < kOperations; ++i)
+        EXPECT_TRUE(table.Delete(handles[i]));
+    sched_setaffinity(0, sizeof(old_cpus), &old_cpus);
+}
+
+TEST(ShardedOperationTableTest, LockStatistics) {
+    size_t live = 0;
+    ShardedOperationTable table(16);
+    keymaster_operation_handle_t handle;
+    ASSERT_EQ(KM_ERROR_OK, table.Add(new TestOperation(&live), &handle));
+    EXPECT_TRUE(table.Find(handle) != NULL);
+    EXPECT_TRUE(table.Delete(handle));
+
+    LockStatistics statistics = table.lock_statistics();
+#ifdef KEYMASTER_LOCK_STATISTICS
+    EXPECT_EQ(3U, statistics.acquisitions);
+#else
+    EXPECT_EQ(0U, statistics.acquisitions);
+#endif
+    EXPECT_EQ(0U, statistics.contentions);
+    EXPECT_EQ(0U, statistics.wait_microseconds);
+}
+
+}  // namespace test
+}  // namespace keymaster
@@ -0,0 +1,69 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "pinned_key_table.h"
+
+#include "buffered_random.h"
+
+namespace keymaster {
+
+keymaster_error_t PinnedKeyTable::Add(const PinnedKey& pinned_key, uint64_t* handle) {
+    std::lock_guard<CountingMutex> lock(mutex_);
+    if (keys_.size() >= max_keys_)
+        return KM_ERROR_TOO_MANY_OPERATIONS;
+
+    do {
+        keymaster_error_t error =
+            BufferedRandomBytes(reinterpret_cast<uint8_t*>(handle), sizeof(*handle));
+        if (error != KM_ERROR_OK)
+            return error;
+        // Zero means "no pinned key" in BeginOperationRequest.
+    } while (*handle == 0 || keys_.count(*handle));
+
+    keys_[*handle] = pinned_key;
+    return KM_ERROR_OK;
+}
+
+bool PinnedKeyTable::Find(uint64_t handle, PinnedKey* pinned_key) const {
+    std::lock_guard<CountingMutex> lock(mutex_);
+    auto found = keys_.find(handle);
+    if (found == keys_.end())
+        return false;
+    *pinned_key = found->second;
+    return true;
+}
+
+bool PinnedKeyTable::Delete(uint64_t handle) {
+    std::lock_guard<CountingMutex> lock(mutex_);
+    return keys_.erase(handle) != 0;
+}
+
+void PinnedKeyTable::DeleteBlob(const LoadedKeyCache::Digest& blob_digest) {
+    std::lock_guard<CountingMutex> lock(mutex_);
+    for (auto entry = keys_.begin(); entry != keys_.end();) {
+        if (entry->second.blob_digest == blob_digest)
+            entry = keys_.erase(entry);
+        else
+            ++entry;
+    }
+}
+
+void PinnedKeyTable::Clear() {
+    std::lock_guard<CountingMutex> lock(mutex_);
+    keys_.clear();
+}
+
+}  // namespace keymaster
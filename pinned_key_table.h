@@ -0,0 +1,81 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SYSTEM_KEYMASTER_PINNED_KEY_TABLE_H_
+#define SYSTEM_KEYMASTER_PINNED_KEY_TABLE_H_
+
+#include <map>
+#include <memory>
+#include <mutex>
+
+#include <hardware/keymaster_defs.h>
+
+#include <keymaster/keymaster_enforcement.h>
+#include <keymaster/lock_statistics.h>
+
+#include "loaded_key_cache.h"
+
+namespace keymaster {
+
+/**
+ * PinnedKeyTable holds keys that a client has explicitly pinned, indexed by randomly-generated
+ * handles.  Unlike LoadedKeyCache entries, pinned keys are never evicted; they stay loaded until
+ * they are unpinned or the blob they came from is deleted.
+ */
+class PinnedKeyTable {
+  public:
+    struct PinnedKey {
+        std::shared_ptr<const LoadedKey> loaded_key;
+        LoadedKeyCache::Digest blob_digest;
+        // The enforcement key ID of the blob, since BeginOperation won't have the blob to compute
+        // it from.
+        km_id_t key_id;
+    };
+
+    explicit PinnedKeyTable(size_t max_keys) : max_keys_(max_keys) {}
+
+    /**
+     * Adds pinned_key to the table and returns its new handle in *handle.  Fails with
+     * KM_ERROR_TOO_MANY_OPERATIONS if the table is full.
+     */
+    keymaster_error_t Add(const PinnedKey& pinned_key, uint64_t* handle);
+
+    /**
+     * Copies the key pinned under handle into *pinned_key.  Returns false if there is none.
+     */
+    bool Find(uint64_t handle, PinnedKey* pinned_key) const;
+
+    bool Delete(uint64_t handle);
+
+    /**
+     * Unpins all keys loaded from the blob with the specified digest.
+     */
+    void DeleteBlob(const LoadedKeyCache::Digest& blob_digest);
+
+    void Clear();
+
+    LockStatistics lock_statistics() const { return mutex_.statistics(); }
+
+  private:
+    const size_t max_keys_;
+
+    mutable CountingMutex mutex_;
+    std::map<uint64_t, PinnedKey> keys_;
+};
+
+}  // namespace keymaster
+
+#endif  // SYSTEM_KEYMASTER_PINNED_KEY_TABLE_H_
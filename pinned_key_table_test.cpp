@@ -0,0 +1,85 @@
+/*
+ * Copyright 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "pinned_key_table.h"
+
+#include <gtest/gtest.h>
+
+#include "android_keymaster_test_utils.h"
+
+namespace keymaster {
+namespace test {
+
+static PinnedKeyTable::PinnedKey MakePinnedKey(uint8_t blob_byte, km_id_t key_id) {
+    PinnedKeyTable::PinnedKey pinned_key;
+    pinned_key.loaded_key.reset(new LoadedKey);
+    pinned_key.blob_digest.fill(blob_byte);
+    pinned_key.key_id = key_id;
+    return pinned_key;
+}
+
+TEST(PinnedKeyTableTest, AddFindDelete) {
+    PinnedKeyTable table(4);
+    PinnedKeyTable::PinnedKey pinned_key = MakePinnedKey(1, 42);
+    uint64_t handle;
+    ASSERT_EQ(KM_ERROR_OK, table.Add(pinned_key, &handle));
+    EXPECT_NE(0U, handle);
+
+    PinnedKeyTable::PinnedKey found;
+    ASSERT_TRUE(table.Find(handle, &found));
+    EXPECT_EQ(pinned_key.loaded_key, found.loaded_key);
+    EXPECT_EQ(42U, found.key_id);
+    EXPECT_FALSE(table.Find(handle + 1, &found));
+    EXPECT_FALSE(table.Find(0, &found));
+
+    EXPECT_TRUE(table.Delete(handle));
+    EXPECT_FALSE(table.Find(handle, &found));
+    EXPECT_FALSE(table.Delete(handle));
+}
+
+TEST(PinnedKeyTableTest, Full) {
+    PinnedKeyTable table(2);
+    uint64_t handles[3];
+    EXPECT_EQ(KM_ERROR_OK, table.Add(MakePinnedKey(1, 1), &handles[0]));
+    EXPECT_EQ(KM_ERROR_OK, table.Add(MakePinnedKey(2, 2), &handles[1]));
+    EXPECT_EQ(KM_ERROR_TOO_MANY_OPERATIONS, table.Add(MakePinnedKey(3, 3), &handles[2]));
+
+    EXPECT_TRUE(table.Delete(handles[0]));
+    EXPECT_EQ(KM_ERROR_OK, table.Add(MakePinnedKey(3, 3), &handles[2]));
+}
+
+TEST(PinnedKeyTableTest, DeleteBlob) {
+    PinnedKeyTable table(4);
+    uint64_t first, second, other;
+    ASSERT_EQ(KM_ERROR_OK, table.Add(MakePinnedKey(1, 1), &first));
+    ASSERT_EQ(KM_ERROR_OK, table.Add(MakePinnedKey(1, 1), &second));
+    ASSERT_EQ(KM_ERROR_OK, table.Add(MakePinnedKey(2, 2), &other));
+
+    LoadedKeyCache::Digest digest;
+    digest.fill(1);
+    table.DeleteBlob(digest);
+
+    PinnedKeyTable::PinnedKey found;
+    EXPECT_FALSE(table.Find(first, &found));
+    EXPECT_FALSE(table.Find(second, &found));
+    EXPECT_TRUE(table.Find(other, &found));
+
+    table.Clear();
+    EXPECT_FALSE(table.Find(other, &found));
+}
+
+}  // namespace test
+}  // namespace keymaster
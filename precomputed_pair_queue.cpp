@@ -0,0 +1,128 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "precomputed_pair_queue.h"
+
+#include <openssl/err.h>
+
+#include <keymaster/logger.h>
+
+namespace keymaster {
+
+PrecomputedPairQueue::PrecomputedPairQueue(const Generator& generator, size_t capacity,
+                                           const std::shared_ptr<PrecomputationFiller>& filler)
+    : generator_(generator), capacity_(capacity), filler_(filler), fill_scheduled_(false) {}
+
+bool PrecomputedPairQueue::Take(BIGNUM_ClearPtr* first, BIGNUM_ClearPtr* second) {
+    bool schedule_fill = false;
+    bool taken = false;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!pairs_.empty()) {
+            first->reset(pairs_.back().first.release());
+            second->reset(pairs_.back().second.release());
+            pairs_.pop_back();
+            taken = true;
+        }
+        if (pairs_.size() * 2 < capacity_ && !fill_scheduled_) {
+            fill_scheduled_ = true;
+            schedule_fill = true;
+        }
+    }
+
+    if (schedule_fill) {
+        std::shared_ptr<PrecomputationFiller> filler = filler_.lock();
+        if (filler)
+            filler->Schedule(shared_from_this());
+    }
+    return taken;
+}
+
+bool PrecomputedPairQueue::Fill() {
+    while (true) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (pairs_.size() >= capacity_) {
+                fill_scheduled_ = false;
+                return true;
+            }
+        }
+
+        // Generation is the expensive part; don't hold the lock while Take() is waiting on it.
+        BIGNUM* first = nullptr;
+        BIGNUM* second = nullptr;
+        if (!generator_(&first, &second)) {
+            // Don't spin on a failing generator; try again when the next pair is taken.
+            LOG_E("Failed to precompute a pair for a private key operation", 0);
+            BN_clear_free(first);
+            BN_clear_free(second);
+            ERR_clear_error();
+            std::lock_guard<std::mutex> lock(mutex_);
+            fill_scheduled_ = false;
+            return false;
+        }
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        pairs_.push_back(Pair());
+        pairs_.back().first.reset(first);
+        pairs_.back().second.reset(second);
+    }
+}
+
+size_t PrecomputedPairQueue::available() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return pairs_.size();
+}
+
+PrecomputationFiller::~PrecomputationFiller() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+    }
+    fill_needed_.notify_all();
+    if (thread_.joinable())
+        thread_.join();
+}
+
+void PrecomputationFiller::Schedule(const std::shared_ptr<PrecomputedPairQueue>& queue) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    pending_.push_back(queue);
+    if (!thread_.joinable())
+        thread_ = std::thread(&PrecomputationFiller::Run, this);
+    fill_needed_.notify_one();
+}
+
+void PrecomputationFiller::Run() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (!stopping_) {
+        if (pending_.empty()) {
+            fill_needed_.wait(lock);
+            continue;
+        }
+        std::shared_ptr<PrecomputedPairQueue> queue = pending_.front().lock();
+        pending_.pop_front();
+        if (!queue)
+            continue;
+
+        lock.unlock();
+        queue->Fill();
+        // Release the queue before relocking; if its key has been unloaded it's freed here.
+        queue.reset();
+        lock.lock();
+    }
+}
+
+}  // namespace keymaster
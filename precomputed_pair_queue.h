@@ -0,0 +1,124 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SYSTEM_KEYMASTER_PRECOMPUTED_PAIR_QUEUE_H_
+#define SYSTEM_KEYMASTER_PRECOMPUTED_PAIR_QUEUE_H_
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <openssl/bn.h>
+
+#include <UniquePtr.h>
+
+#include "openssl_utils.h"
+
+namespace keymaster {
+
+class PrecomputationFiller;
+
+typedef OpenSslObjectDeleter<BIGNUM, BN_clear_free> BIGNUM_ClearDelete;
+typedef UniquePtr<BIGNUM, BIGNUM_ClearDelete> BIGNUM_ClearPtr;
+
+/**
+ * PrecomputedPairQueue holds secret pairs of BIGNUMs computed ahead of time for one key, such as
+ * ECDSA (k^-1, r) signing setups or RSA blinding factors, so that private-key operations needn't
+ * compute them inline.  The queue is topped up by a PrecomputationFiller thread: once when the
+ * owner schedules it, and again whenever taking a pair leaves it less than half full.
+ *
+ * Each pair is handed out at most once, and is cleared when freed.
+ */
+class PrecomputedPairQueue : public std::enable_shared_from_this<PrecomputedPairQueue> {
+  public:
+    /**
+     * Computes one pair, returning false on failure.  Called on the filler's thread, so anything
+     * it captures must be safe to use from there.
+     */
+    typedef std::function<bool(BIGNUM** first, BIGNUM** second)> Generator;
+
+    /**
+     * Creates an empty queue of up to capacity pairs.
+     */
+    PrecomputedPairQueue(const Generator& generator, size_t capacity,
+                         const std::shared_ptr<PrecomputationFiller>& filler);
+
+    /**
+     * Removes a precomputed pair, returning false if none is ready.  The caller must use the pair
+     * for one operation only.
+     */
+    bool Take(BIGNUM_ClearPtr* first, BIGNUM_ClearPtr* second);
+
+    /**
+     * Precomputes pairs until the queue is full.  Called on the filler's thread.
+     */
+    bool Fill();
+
+    size_t available() const;
+    size_t capacity() const { return capacity_; }
+
+  private:
+    struct Pair {
+        std::unique_ptr<BIGNUM, BIGNUM_ClearDelete> first;
+        std::unique_ptr<BIGNUM, BIGNUM_ClearDelete> second;
+    };
+
+    const Generator generator_;
+    const size_t capacity_;
+    // Weak, so that a queue freed on the filler's thread doesn't try to join it.
+    const std::weak_ptr<PrecomputationFiller> filler_;
+
+    mutable std::mutex mutex_;
+    std::vector<Pair> pairs_;
+    bool fill_scheduled_;
+};
+
+/**
+ * PrecomputationFiller runs a background thread that fills PrecomputedPairQueues on request, so
+ * the precomputation happens while no operation is waiting on it.
+ */
+class PrecomputationFiller {
+  public:
+    PrecomputationFiller() : stopping_(false) {}
+
+    /**
+     * Stops the background thread, waiting for any fill in progress to complete.
+     */
+    ~PrecomputationFiller();
+
+    /**
+     * Queues a fill of queue, starting the background thread if necessary.  Queues freed before
+     * their turn are skipped.
+     */
+    void Schedule(const std::shared_ptr<PrecomputedPairQueue>& queue);
+
+  private:
+    void Run();
+
+    std::mutex mutex_;
+    std::condition_variable fill_needed_;
+    std::deque<std::weak_ptr<PrecomputedPairQueue>> pending_;
+    bool stopping_;
+    std::thread thread_;
+};
+
+}  // namespace keymaster
+
+#endif  // SYSTEM_KEYMASTER_PRECOMPUTED_PAIR_QUEUE_H_
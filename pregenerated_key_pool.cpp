@@ -0,0 +1,124 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "pregenerated_key_pool.h"
+
+#include <keymaster/logger.h>
+
+namespace keymaster {
+
+PregeneratedKeyPool::PregeneratedKeyPool(const Generator& generator, size_t pool_size,
+                                         size_t low_water_mark)
+    : generator_(generator), pool_size_(pool_size),
+      low_water_mark_(low_water_mark < pool_size ? low_water_mark : pool_size), stopping_(false) {}
+
+PregeneratedKeyPool::~PregeneratedKeyPool() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+    }
+    refill_needed_.notify_all();
+    if (thread_.joinable())
+        thread_.join();
+}
+
+void PregeneratedKeyPool::AddKeySpec(uint32_t key_size, uint64_t parameter) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (thread_.joinable() || FindReserve(key_size, parameter))
+        return;
+    reserves_.push_back(Reserve());
+    reserves_.back().key_size = key_size;
+    reserves_.back().parameter = parameter;
+    reserves_.back().refilling = true;
+}
+
+void PregeneratedKeyPool::Start() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!thread_.joinable())
+        thread_ = std::thread(&PregeneratedKeyPool::Run, this);
+}
+
+EVP_PKEY* PregeneratedKeyPool::Take(uint32_t key_size, uint64_t parameter) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    Reserve* reserve = FindReserve(key_size, parameter);
+    if (!reserve)
+        return nullptr;
+
+    EVP_PKEY* key = nullptr;
+    if (!reserve->keys.empty()) {
+        key = reserve->keys.back().release();
+        reserve->keys.pop_back();
+    }
+    if (reserve->keys.size() < low_water_mark_ && !reserve->refilling) {
+        reserve->refilling = true;
+        refill_needed_.notify_one();
+    }
+    return key;
+}
+
+size_t PregeneratedKeyPool::available(uint32_t key_size, uint64_t parameter) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    const Reserve* reserve = FindReserve(key_size, parameter);
+    return reserve ? reserve->keys.size() : 0;
+}
+
+PregeneratedKeyPool::Reserve* PregeneratedKeyPool::FindReserve(uint32_t key_size,
+                                                               uint64_t parameter) {
+    for (auto& reserve : reserves_)
+        if (reserve.key_size == key_size && reserve.parameter == parameter)
+            return &reserve;
+    return nullptr;
+}
+
+const PregeneratedKeyPool::Reserve* PregeneratedKeyPool::FindReserve(uint32_t key_size,
+                                                                     uint64_t parameter) const {
+    return const_cast<PregeneratedKeyPool*>(this)->FindReserve(key_size, parameter);
+}
+
+void PregeneratedKeyPool::Run() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (!stopping_) {
+        Reserve* reserve = nullptr;
+        for (auto& candidate : reserves_) {
+            if (candidate.refilling) {
+                reserve = &candidate;
+                break;
+            }
+        }
+        if (!reserve) {
+            refill_needed_.wait(lock);
+            continue;
+        }
+
+        // Generation can take a long time; don't hold the lock while Take() is waiting on it.
+        lock.unlock();
+        std::unique_ptr<EVP_PKEY, EVP_PKEY_Delete> key(
+            generator_(reserve->key_size, reserve->parameter));
+        lock.lock();
+
+        if (!key) {
+            // Don't spin on a failing generator; try again when the next key is taken.
+            LOG_E("Failed to pre-generate %u-bit key", reserve->key_size);
+            reserve->refilling = false;
+            continue;
+        }
+        reserve->keys.push_back(std::move(key));
+        if (reserve->keys.size() >= pool_size_)
+            reserve->refilling = false;
+    }
+}
+
+}  // namespace keymaster
@@ -0,0 +1,104 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SYSTEM_KEYMASTER_PREGENERATED_KEY_POOL_H_
+#define SYSTEM_KEYMASTER_PREGENERATED_KEY_POOL_H_
+
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <openssl/evp.h>
+
+#include "openssl_utils.h"
+
+namespace keymaster {
+
+/**
+ * PregeneratedKeyPool keeps a stock of freshly-generated asymmetric keys for a fixed set of key
+ * specifications, refilled by a background thread, so that key generation requests matching one of
+ * the specifications needn't wait for the (possibly very slow) generation itself.
+ *
+ * A specification is a key size plus one algorithm-specific parameter, e.g. the public exponent for
+ * RSA.  Each key is handed out at most once.
+ */
+class PregeneratedKeyPool {
+  public:
+    /**
+     * Generates a new key with the specified size and parameter, returning null on failure.  Called
+     * on the pool's background thread.
+     */
+    typedef std::function<EVP_PKEY*(uint32_t key_size, uint64_t parameter)> Generator;
+
+    /**
+     * Creates a pool that keeps up to pool_size keys per specification, and starts refilling a
+     * specification once fewer than low_water_mark of its keys remain.
+     */
+    PregeneratedKeyPool(const Generator& generator, size_t pool_size, size_t low_water_mark);
+
+    /**
+     * Stops the background thread, waiting for any generation in progress to complete.
+     */
+    ~PregeneratedKeyPool();
+
+    /**
+     * Adds a specification to keep keys for.  Must be called before Start().
+     */
+    void AddKeySpec(uint32_t key_size, uint64_t parameter);
+
+    /**
+     * Starts the background thread, which begins by filling every specification.
+     */
+    void Start();
+
+    /**
+     * Removes a pre-generated key matching the specification and returns it, or returns null if
+     * the specification isn't pooled or its keys have run out.  The caller owns the returned key.
+     */
+    EVP_PKEY* Take(uint32_t key_size, uint64_t parameter);
+
+    size_t available(uint32_t key_size, uint64_t parameter) const;
+
+  private:
+    struct Reserve {
+        uint32_t key_size;
+        uint64_t parameter;
+        std::vector<std::unique_ptr<EVP_PKEY, EVP_PKEY_Delete>> keys;
+        bool refilling;
+    };
+
+    Reserve* FindReserve(uint32_t key_size, uint64_t parameter);
+    const Reserve* FindReserve(uint32_t key_size, uint64_t parameter) const;
+    void Run();
+
+    const Generator generator_;
+    const size_t pool_size_;
+    const size_t low_water_mark_;
+
+    mutable std::mutex mutex_;
+    std::condition_variable refill_needed_;
+    // Only added to before the thread starts, so Reserve pointers stay valid.
+    std::vector<Reserve> reserves_;
+    bool stopping_;
+    std::thread thread_;
+};
+
+}  // namespace keymaster
+
+#endif  // SYSTEM_KEYMASTER_PREGENERATED_KEY_POOL_H_
@@ -0,0 +1,102 @@
+/*
+ * Copyright 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "pregenerated_key_pool.h"
+
+#include <atomic>
+#include <chrono>
+
+#include <gtest/gtest.h>
+
+#include "android_keymaster_test_utils.h"
+
+namespace keymaster {
+namespace test {
+
+static std::atomic<int> generated_count;
+
+static EVP_PKEY* FakeGenerator(uint32_t /* key_size */, uint64_t /* parameter */) {
+    ++generated_count;
+    return EVP_PKEY_new();
+}
+
+static EVP_PKEY* FailingGenerator(uint32_t /* key_size */, uint64_t /* parameter */) {
+    ++generated_count;
+    return nullptr;
+}
+
+// Waits for the background thread to bring the specification up to expected keys.
+static bool WaitForAvailable(const PregeneratedKeyPool& pool, uint32_t key_size,
+                             uint64_t parameter, size_t expected) {
+    for (int i = 0; i < 500; ++i) {
+        if (pool.available(key_size, parameter) == expected)
+            return true;
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    return false;
+}
+
+TEST(PregeneratedKeyPoolTest, FillsAndRefills) {
+    generated_count = 0;
+    PregeneratedKeyPool pool(FakeGenerator, 4 /* pool_size */, 2 /* low_water_mark */);
+    pool.AddKeySpec(2048, 65537);
+    pool.AddKeySpec(3072, 65537);
+    pool.Start();
+    ASSERT_TRUE(WaitForAvailable(pool, 2048, 65537, 4));
+    ASSERT_TRUE(WaitForAvailable(pool, 3072, 65537, 4));
+
+    // Above the low-water mark, nothing is regenerated.
+    EVP_PKEY_Ptr key(pool.Take(2048, 65537));
+    EXPECT_TRUE(key.get() != nullptr);
+    key.reset(pool.Take(2048, 65537));
+    EXPECT_TRUE(key.get() != nullptr);
+    EXPECT_EQ(2U, pool.available(2048, 65537));
+    EXPECT_EQ(8, generated_count);
+
+    // Below it, the specification is refilled.
+    key.reset(pool.Take(2048, 65537));
+    EXPECT_TRUE(key.get() != nullptr);
+    EXPECT_TRUE(WaitForAvailable(pool, 2048, 65537, 4));
+    EXPECT_EQ(11, generated_count);
+    EXPECT_EQ(4U, pool.available(3072, 65537));
+}
+
+TEST(PregeneratedKeyPoolTest, UnpooledSpec) {
+    PregeneratedKeyPool pool(FakeGenerator, 2 /* pool_size */, 1 /* low_water_mark */);
+    pool.AddKeySpec(2048, 65537);
+    pool.Start();
+    ASSERT_TRUE(WaitForAvailable(pool, 2048, 65537, 2));
+
+    EXPECT_TRUE(pool.Take(2048, 3) == nullptr);
+    EXPECT_TRUE(pool.Take(1024, 65537) == nullptr);
+    EXPECT_EQ(0U, pool.available(1024, 65537));
+}
+
+TEST(PregeneratedKeyPoolTest, FailingGenerator) {
+    generated_count = 0;
+    PregeneratedKeyPool pool(FailingGenerator, 2 /* pool_size */, 1 /* low_water_mark */);
+    pool.AddKeySpec(2048, 65537);
+    pool.Start();
+    for (int i = 0; i < 100 && generated_count == 0; ++i)
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    EXPECT_TRUE(pool.Take(2048, 65537) == nullptr);
+    EXPECT_EQ(0U, pool.available(2048, 65537));
+    // The pool gives up after a failure rather than retrying continuously.
+    EXPECT_GE(2, generated_count);
+}
+
+}  // namespace test
+}  // namespace keymaster
@@ -0,0 +1,146 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "request_scheduler.h"
+
+namespace keymaster {
+
+static RequestClass ClassifyKeyCreation(const AuthorizationSet& key_description) {
+    // Generating an RSA key means finding two large primes, which takes tens of milliseconds for
+    // 2048-bit keys and can take seconds for 4096-bit ones.  EC and symmetric keys are cheap.
+    keymaster_algorithm_t algorithm;
+    if (key_description.GetTagValue(TAG_ALGORITHM, &algorithm) && algorithm == KM_ALGORITHM_RSA)
+        return BULK_REQUEST;
+    return LATENCY_SENSITIVE_REQUEST;
+}
+
+RequestClass ClassifyRequest(AndroidKeymasterCommand command, const KeymasterMessage& request) {
+    switch (command) {
+    case GENERATE_KEY:
+        return ClassifyKeyCreation(
+            static_cast<const GenerateKeyRequest&>(request).key_description);
+
+    // Attestation builds and signs a certificate, or one per blob; upgrades re-encrypt blobs,
+    // possibly many, and migrations are background work; batch generation and batch operations
+    // create any number of keys or run any number of operations in one request, and the other
+    // batches parse or delete any number of blobs.
+    case GENERATE_KEYS:
+    case ATTEST_KEY:
+    case BATCH_ATTEST_KEY:
+    case UPGRADE_KEY:
+    case BATCH_UPGRADE_KEY:
+    case MIGRATE_KEY:
+    case BATCH_OPERATION:
+    case BATCH_GET_KEY_CHARACTERISTICS:
+    case BATCH_DELETE_KEY:
+        return BULK_REQUEST;
+
+    default:
+        return LATENCY_SENSITIVE_REQUEST;
+    }
+}
+
+const size_t RequestScheduler::kMaxBulkDeferrals;
+
+// Leaves at least one worker for latency-sensitive requests, if there is more than one.
+static size_t BulkThreadLimit(size_t thread_count, size_t max_bulk_threads) {
+    if (thread_count <= 1)
+        return 1;
+    return max_bulk_threads < thread_count ? max_bulk_threads : thread_count - 1;
+}
+
+RequestScheduler::RequestScheduler(size_t thread_count, size_t max_bulk_threads)
+    : max_bulk_threads_(BulkThreadLimit(thread_count, max_bulk_threads)), bulk_running_(0),
+      bulk_deferrals_(0), stopping_(false) {
+    if (thread_count == 0)
+        thread_count = 1;
+    for (size_t i = 0; i < thread_count; ++i)
+        threads_.push_back(std::thread(&RequestScheduler::Run, this));
+}
+
+RequestScheduler::~RequestScheduler() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+    }
+    task_scheduled_.notify_all();
+    for (std::thread& thread : threads_)
+        thread.join();
+}
+
+void RequestScheduler::Schedule(RequestClass request_class, const Task& task) {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (request_class == BULK_REQUEST)
+            bulk_.push_back(task);
+        else
+            latency_sensitive_.push_back(task);
+    }
+    task_scheduled_.notify_one();
+}
+
+size_t RequestScheduler::queued(RequestClass request_class) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return request_class == BULK_REQUEST ? bulk_.size() : latency_sensitive_.size();
+}
+
+std::deque<RequestScheduler::Task>* RequestScheduler::NextQueue() {
+    bool bulk_may_start = !bulk_.empty() && bulk_running_ < max_bulk_threads_;
+    if (bulk_may_start && (latency_sensitive_.empty() || bulk_deferrals_ >= kMaxBulkDeferrals)) {
+        bulk_deferrals_ = 0;
+        return &bulk_;
+    }
+    if (latency_sensitive_.empty())
+        return nullptr;
+    if (!bulk_.empty())
+        ++bulk_deferrals_;
+    return &latency_sensitive_;
+}
+
+void RequestScheduler::Run() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+        std::deque<Task>* queue = NextQueue();
+        if (!queue) {
+            // Bulk requests that can't start yet are left for the worker that frees a slot.
+            if (stopping_ && latency_sensitive_.empty() && bulk_.empty()) {
+                // Workers waiting for a bulk slot can stop too.
+                task_scheduled_.notify_all();
+                return;
+            }
+            task_scheduled_.wait(lock);
+            continue;
+        }
+        Task task = queue->front();
+        queue->pop_front();
+        bool bulk = queue == &bulk_;
+        if (bulk)
+            ++bulk_running_;
+
+        lock.unlock();
+        task();
+        lock.lock();
+
+        if (bulk) {
+            --bulk_running_;
+            // Another worker may be idle only because the bulk slots were full.
+            if (!bulk_.empty())
+                task_scheduled_.notify_one();
+        }
+    }
+}
+
+}  // namespace keymaster
@@ -0,0 +1,144 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SYSTEM_KEYMASTER_REQUEST_SCHEDULER_H_
+#define SYSTEM_KEYMASTER_REQUEST_SCHEDULER_H_
+
+#include <stdint.h>
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <keymaster/android_keymaster.h>
+#include <keymaster/android_keymaster_messages.h>
+
+namespace keymaster {
+
+enum RequestClass {
+    // Requests that take well under a millisecond, like operation updates and symmetric keys.
+    LATENCY_SENSITIVE_REQUEST = 0,
+    // Requests that can take tens or hundreds of milliseconds, like RSA key generation and
+    // attestation.
+    BULK_REQUEST = 1,
+};
+
+/**
+ * Returns the class of a request of command, which must be of the type command's AndroidKeymaster
+ * method takes.
+ */
+RequestClass ClassifyRequest(AndroidKeymasterCommand command, const KeymasterMessage& request);
+
+/**
+ * RequestScheduler runs requests on a pool of worker threads, latency-sensitive requests first.
+ * Bulk requests run on at most max_bulk_threads of the workers, which is less than the number of
+ * workers when there is more than one, so a burst of key generation can't occupy them all; a
+ * latency-sensitive request never waits for more than the requests of its own class ahead of it,
+ * and for a free worker.  So that a steady stream of latency-sensitive requests can't starve bulk
+ * ones either, a waiting bulk request goes first once kMaxBulkDeferrals latency-sensitive
+ * requests have been started ahead of it.
+ */
+class RequestScheduler {
+  public:
+    static const size_t kMaxBulkDeferrals = 64;
+
+    typedef std::function<void()> Task;
+
+    /**
+     * Starts thread_count workers, of which at most max_bulk_threads run bulk requests at once.
+     * max_bulk_threads is reduced to thread_count - 1 if it is larger, unless thread_count is 1.
+     */
+    RequestScheduler(size_t thread_count, size_t max_bulk_threads);
+
+    /**
+     * Runs the requests already scheduled, then stops the workers.
+     */
+    ~RequestScheduler();
+
+    /**
+     * Queues task to run on a worker as a request of request_class.
+     */
+    void Schedule(RequestClass request_class, const Task& task);
+
+    /**
+     * Queues a call of keymaster's method with request and response, classified with
+     * ClassifyRequest, and calls done on the worker once it returns.  The request and response
+     * must remain valid until then.
+     */
+    template <typename Request, typename Response>
+    void Submit(AndroidKeymasterCommand command, AndroidKeymaster* keymaster,
+                void (AndroidKeymaster::*method)(const Request&, Response*), const Request& request,
+                Response* response, const Task& done) {
+        Schedule(ClassifyRequest(command, request), [=, &request] {
+            (keymaster->*method)(request, response);
+            if (done)
+                done();
+        });
+    }
+
+    /**
+     * Submits a request and waits for it to complete.
+     */
+    template <typename Request, typename Response>
+    void Call(AndroidKeymasterCommand command, AndroidKeymaster* keymaster,
+              void (AndroidKeymaster::*method)(const Request&, Response*), const Request& request,
+              Response* response) {
+        std::mutex done_mutex;
+        std::condition_variable done_cv;
+        bool done = false;
+        Submit(command, keymaster, method, request, response, [&] {
+            // Notify while holding the lock, so the waiter can't return and destroy done_cv first.
+            std::lock_guard<std::mutex> lock(done_mutex);
+            done = true;
+            done_cv.notify_one();
+        });
+        std::unique_lock<std::mutex> lock(done_mutex);
+        done_cv.wait(lock, [&] { return done; });
+    }
+
+    /**
+     * Returns the number of requests of request_class waiting for a worker.
+     */
+    size_t queued(RequestClass request_class) const;
+
+  private:
+    // Returns the queue to take the next request from, or null if none may start.  Called with
+    // mutex_ held.
+    std::deque<Task>* NextQueue();
+    void Run();
+
+    const size_t max_bulk_threads_;
+
+    mutable std::mutex mutex_;
+    std::condition_variable task_scheduled_;
+    std::deque<Task> latency_sensitive_;
+    std::deque<Task> bulk_;
+    size_t bulk_running_;
+    size_t bulk_deferrals_;
+    bool stopping_;
+    std::vector<std::thread> threads_;
+
+    // Disallow copying and assignment.
+    RequestScheduler(const RequestScheduler&);
+    void operator=(const RequestScheduler&);
+};
+
+}  // namespace keymaster
+
+#endif  // SYSTEM_KEYMASTER_REQUEST_SCHEDULER_H_
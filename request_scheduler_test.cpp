@@ -0,0 +1,163 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include <keymaster/android_keymaster.h>
+#include <keymaster/soft_keymaster_context.h>
+
+#include "request_scheduler.h"
+
+namespace keymaster {
+namespace test {
+
+// Holds tasks until released.
+class Gate {
+  public:
+    Gate() : open_(false) {}
+
+    void Wait() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        opened_.wait(lock, [&] { return open_; });
+    }
+
+    void Open() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        open_ = true;
+        opened_.notify_all();
+    }
+
+  private:
+    std::mutex mutex_;
+    std::condition_variable opened_;
+    bool open_;
+};
+
+TEST(RequestSchedulerTest, Classify) {
+    GenerateKeyRequest rsa;
+    rsa.key_description.Reinitialize(AuthorizationSet(AuthorizationSetBuilder().RsaSigningKey(
+        4096, 65537)));
+    EXPECT_EQ(BULK_REQUEST, ClassifyRequest(GENERATE_KEY, rsa));
+
+    GenerateKeyRequest hmac;
+    hmac.key_description.Reinitialize(AuthorizationSet(AuthorizationSetBuilder().HmacKey(128)));
+    EXPECT_EQ(LATENCY_SENSITIVE_REQUEST, ClassifyRequest(GENERATE_KEY, hmac));
+
+    EXPECT_EQ(BULK_REQUEST, ClassifyRequest(GENERATE_KEYS, GenerateKeysRequest()));
+    EXPECT_EQ(BULK_REQUEST, ClassifyRequest(ATTEST_KEY, AttestKeyRequest()));
+    EXPECT_EQ(BULK_REQUEST, ClassifyRequest(BATCH_GET_KEY_CHARACTERISTICS,
+                                            BatchGetKeyCharacteristicsRequest()));
+    EXPECT_EQ(BULK_REQUEST, ClassifyRequest(BATCH_DELETE_KEY, BatchDeleteKeyRequest()));
+    EXPECT_EQ(BULK_REQUEST, ClassifyRequest(BATCH_ATTEST_KEY, BatchAttestKeyRequest()));
+    EXPECT_EQ(BULK_REQUEST, ClassifyRequest(MIGRATE_KEY, MigrateKeyRequest()));
+    EXPECT_EQ(LATENCY_SENSITIVE_REQUEST,
+              ClassifyRequest(UPDATE_OPERATION, UpdateOperationRequest()));
+    EXPECT_EQ(LATENCY_SENSITIVE_REQUEST,
+              ClassifyRequest(ONE_SHOT_OPERATION, OneShotOperationRequest()));
+}
+
+TEST(RequestSchedulerTest, BulkCantOccupyEveryWorker) {
+    Gate gate;
+    std::atomic<int> bulk_done(0);
+    std::atomic<int> latency_done(0);
+    {
+        RequestScheduler scheduler(3 /* thread_count */, 3 /* max_bulk_threads */);
+        for (int i = 0; i < 5; ++i)
+            scheduler.Schedule(BULK_REQUEST, [&] {
+                gate.Wait();
+                ++bulk_done;
+            });
+
+        // The bulk requests hold two workers; the third runs latency-sensitive requests.
+        Gate latency_gate;
+        for (int i = 0; i < 10; ++i)
+            scheduler.Schedule(LATENCY_SENSITIVE_REQUEST, [&] {
+                if (++latency_done == 10)
+                    latency_gate.Open();
+            });
+        latency_gate.Wait();
+        EXPECT_EQ(10, latency_done);
+        EXPECT_EQ(0, bulk_done);
+        EXPECT_LE(3U, scheduler.queued(BULK_REQUEST));
+        gate.Open();
+    }
+    EXPECT_EQ(5, bulk_done);
+}
+
+TEST(RequestSchedulerTest, LatencySensitiveFirst) {
+    Gate gate;
+    std::mutex order_mutex;
+    std::vector<RequestClass> order;
+    {
+        RequestScheduler scheduler(1 /* thread_count */, 1 /* max_bulk_threads */);
+        scheduler.Schedule(LATENCY_SENSITIVE_REQUEST, [&] { gate.Wait(); });
+        auto record = [&](RequestClass request_class) {
+            return [&, request_class] {
+                std::lock_guard<std::mutex> lock(order_mutex);
+                order.push_back(request_class);
+            };
+        };
+        scheduler.Schedule(BULK_REQUEST, record(BULK_REQUEST));
+        scheduler.Schedule(LATENCY_SENSITIVE_REQUEST, record(LATENCY_SENSITIVE_REQUEST));
+        scheduler.Schedule(LATENCY_SENSITIVE_REQUEST, record(LATENCY_SENSITIVE_REQUEST));
+        gate.Open();
+    }
+    ASSERT_EQ(3U, order.size());
+    EXPECT_EQ(LATENCY_SENSITIVE_REQUEST, order[0]);
+    EXPECT_EQ(LATENCY_SENSITIVE_REQUEST, order[1]);
+    EXPECT_EQ(BULK_REQUEST, order[2]);
+}
+
+TEST(RequestSchedulerTest, BulkNotStarved) {
+    Gate started, gate;
+    std::atomic<size_t> latency_done(0);
+    size_t latency_done_before_bulk = 0;
+    {
+        RequestScheduler scheduler(1 /* thread_count */, 1 /* max_bulk_threads */);
+        scheduler.Schedule(LATENCY_SENSITIVE_REQUEST, [&] {
+            started.Open();
+            gate.Wait();
+        });
+        started.Wait();
+        scheduler.Schedule(BULK_REQUEST, [&] { latency_done_before_bulk = latency_done; });
+        for (size_t i = 0; i < 2 * RequestScheduler::kMaxBulkDeferrals; ++i)
+            scheduler.Schedule(LATENCY_SENSITIVE_REQUEST, [&] { ++latency_done; });
+        gate.Open();
+    }
+    EXPECT_EQ(RequestScheduler::kMaxBulkDeferrals, latency_done_before_bulk);
+}
+
+TEST(RequestSchedulerTest, CallsKeymaster) {
+    AndroidKeymaster keymaster(new SoftKeymasterContext, 16);
+    RequestScheduler scheduler(2 /* thread_count */, 1 /* max_bulk_threads */);
+
+    GenerateKeyRequest request;
+    request.key_description.Reinitialize(AuthorizationSet(
+        AuthorizationSetBuilder().HmacKey(128).Digest(KM_DIGEST_SHA_2_256).Authorization(
+            TAG_MIN_MAC_LENGTH, 128)));
+    GenerateKeyResponse response;
+    scheduler.Call(GENERATE_KEY, &keymaster, &AndroidKeymaster::GenerateKey, request, &response);
+    EXPECT_EQ(KM_ERROR_OK, response.error);
+    EXPECT_NE(0U, response.key_blob.key_material_size);
+}
+
+}  // namespace test
+}  // namespace keymaster
@@ -0,0 +1,853 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "request_trace.h"
+
+#include <string.h>
+
+#include <new>
+
+#include <openssl/bn.h>
+#include <openssl/ec.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include <openssl/rsa.h>
+#include <openssl/sha.h>
+#include <openssl/x509.h>
+
+#include <keymaster/android_keymaster_utils.h>
+
+#include "openssl_err.h"
+#include "openssl_utils.h"
+
+namespace keymaster {
+
+namespace {
+
+// The commands AndroidKeymaster records, with their message types and the AndroidKeymaster method
+// that handles them.
+#define TRACED_COMMANDS(X)                                                                         \
+    X(ADD_RNG_ENTROPY, AddEntropyRequest, AddEntropyResponse, AddRngEntropy)                       \
+    X(GENERATE_KEY, GenerateKeyRequest, GenerateKeyResponse, GenerateKey)                          \
+    X(GENERATE_KEYS, GenerateKeysRequest, GenerateKeysResponse, GenerateKeys)                      \
+    X(GET_KEY_CHARACTERISTICS, GetKeyCharacteristicsRequest, GetKeyCharacteristicsResponse,        \
+      GetKeyCharacteristics)                                                                       \
+    X(BATCH_GET_KEY_CHARACTERISTICS, BatchGetKeyCharacteristicsRequest,                            \
+      BatchGetKeyCharacteristicsResponse, BatchGetKeyCharacteristics)                              \
+    X(BEGIN_OPERATION, BeginOperationRequest, BeginOperationResponse, BeginOperation)              \
+    X(UPDATE_OPERATION, UpdateOperationRequest, UpdateOperationResponse, UpdateOperation)          \
+    X(UPDATE_AAD, UpdateAadRequest, UpdateAadResponse, UpdateAad)                                  \
+    X(FINISH_OPERATION, FinishOperationRequest, FinishOperationResponse, FinishOperation)          \
+    X(ABORT_OPERATION, AbortOperationRequest, AbortOperationResponse, AbortOperation)              \
+    X(EXPORT_OPERATION, ExportOperationRequest, ExportOperationResponse, ExportOperation)          \
+    X(IMPORT_OPERATION, ImportOperationRequest, ImportOperationResponse, ImportOperation)          \
+    X(ONE_SHOT_OPERATION, OneShotOperationRequest, OneShotOperationResponse, OneShotOperation)     \
+    X(BATCH_OPERATION, BatchOperationRequest, BatchOperationResponse, BatchOperation)              \
+    X(IMPORT_KEY, ImportKeyRequest, ImportKeyResponse, ImportKey)                                  \
+    X(EXPORT_KEY, ExportKeyRequest, ExportKeyResponse, ExportKey)                                  \
+    X(ATTEST_KEY, AttestKeyRequest, AttestKeyResponse, AttestKey)                                  \
+    X(BATCH_ATTEST_KEY, BatchAttestKeyRequest, BatchAttestKeyResponse, BatchAttestKey)             \
+    X(UPGRADE_KEY, UpgradeKeyRequest, UpgradeKeyResponse, UpgradeKey)                              \
+    X(BATCH_UPGRADE_KEY, BatchUpgradeKeyRequest, BatchUpgradeKeyResponse, BatchUpgradeKey)         \
+    X(MIGRATE_KEY, MigrateKeyRequest, MigrateKeyResponse, MigrateKey)                              \
+    X(DELETE_KEY, DeleteKeyRequest, DeleteKeyResponse, DeleteKey)                                  \
+    X(BATCH_DELETE_KEY, BatchDeleteKeyRequest, BatchDeleteKeyResponse, BatchDeleteKey)             \
+    X(DELETE_ALL_KEYS, DeleteAllKeysRequest, DeleteAllKeysResponse, DeleteAllKeys)                 \
+    X(PIN_KEY, PinKeyRequest, PinKeyResponse, PinKey)                                              \
+    X(UNPIN_KEY, UnpinKeyRequest, UnpinKeyResponse, UnpinKey)                                      \
+    X(WARMUP_KEYS, WarmupKeysRequest, WarmupKeysResponse, WarmupKeys)
+
+// Bounds the message lengths RequestTraceReader accepts, so a corrupt length can't cause a huge
+// allocation.
+const uint32_t kMaxTracedMessageLength = 16 * 1024 * 1024;
+
+// Sizes of the header and of the fixed part of each record.
+const size_t kHeaderSize = 2 * sizeof(uint32_t);
+const size_t kRecordPrefixSize = 2 * sizeof(uint32_t) + 2 * sizeof(uint64_t);
+
+void Dispatch(AndroidKeymaster* keymaster, AndroidKeymasterCommand command,
+              const KeymasterMessage& request, KeymasterResponse* response) {
+    switch (command) {
+#define DISPATCH(command, Request, Response, method)                                               \
+    case command:                                                                                  \
+        keymaster->method(static_cast<const Request&>(request), static_cast<Response*>(response)); \
+        break;
+        TRACED_COMMANDS(DISPATCH)
+#undef DISPATCH
+    default:
+        response->error = KM_ERROR_UNIMPLEMENTED;
+        break;
+    }
+}
+
+// Copies a message by serializing and deserializing it.
+keymaster_error_t CopyMessage(const Serializable& source, Serializable* destination) {
+    size_t size = source.SerializedSize();
+    UniquePtr<uint8_t[]> serialized(new (std::nothrow) uint8_t[size]);
+    if (!serialized.get())
+        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    const uint8_t* end = serialized.get() + size;
+    if (source.Serialize(serialized.get(), end) != end)
+        return KM_ERROR_UNKNOWN_ERROR;
+    const uint8_t* p = serialized.get();
+    if (!destination->Deserialize(&p, end))
+        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    return KM_ERROR_OK;
+}
+
+keymaster_error_t SetKeyBlob(keymaster_key_blob_t* key_blob, const void* data, size_t length) {
+    uint8_t* copy = dup_buffer(data, length);
+    if (!copy)
+        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    delete[] key_blob->key_material;
+    key_blob->key_material = copy;
+    key_blob->key_material_size = length;
+    return KM_ERROR_OK;
+}
+
+keymaster_error_t RedactKeyBlob(keymaster_key_blob_t* key_blob) {
+    if (!key_blob->key_material || key_blob->key_material_size == 0)
+        return KM_ERROR_OK;
+    uint8_t digest[SHA256_DIGEST_LENGTH];
+    SHA256(key_blob->key_material, key_blob->key_material_size, digest);
+    return SetKeyBlob(key_blob, digest, kKeyBlobTokenLength);
+}
+
+keymaster_error_t RedactBuffer(Buffer* buffer) {
+    static const uint8_t kZeros[256] = {};
+    size_t length = buffer->available_read();
+    if (!buffer->Reinitialize(length))
+        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    while (length > 0) {
+        size_t chunk = length < sizeof(kZeros) ? length : sizeof(kZeros);
+        buffer->write(kZeros, chunk);
+        length -= chunk;
+    }
+    return KM_ERROR_OK;
+}
+
+keymaster_error_t RedactBuffers(Buffer* first, Buffer* second) {
+    keymaster_error_t error = RedactBuffer(first);
+    if (error == KM_ERROR_OK && second)
+        error = RedactBuffer(second);
+    return error;
+}
+
+// Replaces a key blob returned by a lazy upgrade with its token, as RedactKeyBlob does.
+keymaster_error_t RedactUpgradedKeyBlob(AuthorizationSet* output_params) {
+    int index = output_params->find(TAG_UPGRADED_KEY_BLOB);
+    if (index == -1)
+        return KM_ERROR_OK;
+    const keymaster_blob_t& blob = (*output_params)[index].blob;
+    uint8_t digest[SHA256_DIGEST_LENGTH];
+    SHA256(blob.data, blob.data_length, digest);
+    output_params->erase(index);
+    if (!output_params->push_back(TAG_UPGRADED_KEY_BLOB, digest, kKeyBlobTokenLength))
+        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    return KM_ERROR_OK;
+}
+
+// Finds a characteristic of a successfully imported key.
+template <typename Tag, typename Value>
+bool GetCharacteristic(const ImportKeyResponse& response, Tag tag, Value* value) {
+    return response.error == KM_ERROR_OK &&
+           (response.enforced.GetTagValue(tag, value) ||
+            response.unenforced.GetTagValue(tag, value));
+}
+
+// Generates key material of the format, algorithm and size of a recorded import.
+keymaster_error_t SynthesizeKeyMaterial(const ImportKeyResponse& recorded,
+                                        ImportKeyRequest* request) {
+    if (request->key_format == KM_KEY_FORMAT_RAW) {
+        if (request->key_data_length > 0 &&
+            !RAND_bytes(request->key_data, request->key_data_length))
+            return TranslateLastOpenSslError();
+        return KM_ERROR_OK;
+    }
+
+    keymaster_algorithm_t algorithm;
+    uint32_t key_size;
+    if (request->key_format != KM_KEY_FORMAT_PKCS8 ||
+        !GetCharacteristic(recorded, TAG_ALGORITHM, &algorithm) ||
+        !GetCharacteristic(recorded, TAG_KEY_SIZE, &key_size))
+        // The import failed when recorded, so leave it to fail again.
+        return KM_ERROR_OK;
+
+    EVP_PKEY_Ptr pkey(EVP_PKEY_new());
+    if (!pkey.get())
+        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    if (algorithm == KM_ALGORITHM_RSA) {
+        uint64_t public_exponent = 65537;
+        GetCharacteristic(recorded, TAG_RSA_PUBLIC_EXPONENT, &public_exponent);
+        RSA_Ptr rsa(RSA_new());
+        BIGNUM_Ptr exponent(BN_new());
+        if (!rsa.get() || !exponent.get())
+            return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+        if (!BN_set_word(exponent.get(), public_exponent) ||
+            !RSA_generate_key_ex(rsa.get(), key_size, exponent.get(), nullptr /* callback */) ||
+            !EVP_PKEY_assign_RSA(pkey.get(), rsa.get()))
+            return TranslateLastOpenSslError();
+        release_because_ownership_transferred(rsa);
+    } else if (algorithm == KM_ALGORITHM_EC) {
+        keymaster_ec_curve_t curve;
+        if (!GetCharacteristic(recorded, TAG_EC_CURVE, &curve)) {
+            keymaster_error_t error = EcKeySizeToCurve(key_size, &curve);
+            if (error != KM_ERROR_OK)
+                return error;
+        }
+        EC_KEY_Ptr ec_key(EC_KEY_new());
+        EC_GROUP_Ptr group(ec_get_group(curve));
+        if (!ec_key.get() || !group.get())
+            return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+        if (!EC_KEY_set_group(ec_key.get(), group.get()) || !EC_KEY_generate_key(ec_key.get()) ||
+            !EVP_PKEY_assign_EC_KEY(pkey.get(), ec_key.get()))
+            return TranslateLastOpenSslError();
+        release_because_ownership_transferred(ec_key);
+    } else {
+        return KM_ERROR_OK;
+    }
+
+    PKCS8_PRIV_KEY_INFO_Ptr pkcs8(EVP_PKEY2PKCS8(pkey.get()));
+    if (!pkcs8.get())
+        return TranslateLastOpenSslError();
+    int length = i2d_PKCS8_PRIV_KEY_INFO(pkcs8.get(), nullptr);
+    if (length <= 0)
+        return TranslateLastOpenSslError();
+    UniquePtr<uint8_t[]> key_data(new (std::nothrow) uint8_t[length]);
+    if (!key_data.get())
+        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    uint8_t* p = key_data.get();
+    i2d_PKCS8_PRIV_KEY_INFO(pkcs8.get(), &p);
+    request->SetKeyMaterial(key_data.get(), length);
+    return request->key_data ? KM_ERROR_OK : KM_ERROR_MEMORY_ALLOCATION_FAILED;
+}
+
+template <typename Map> void Substitute(const Map& map, typename Map::key_type* value) {
+    typename Map::const_iterator i = map.find(*value);
+    if (i != map.end())
+        *value = i->second;
+}
+
+bool BothSucceeded(const KeymasterResponse& recorded, const KeymasterResponse& replayed) {
+    return recorded.error == KM_ERROR_OK && replayed.error == KM_ERROR_OK;
+}
+
+std::string BlobString(const keymaster_key_blob_t& key_blob) {
+    return std::string(reinterpret_cast<const char*>(key_blob.key_material),
+                       key_blob.key_material_size);
+}
+
+}  // anonymous namespace
+
+const char* TraceCommandName(AndroidKeymasterCommand command) {
+    switch (command) {
+#define COMMAND_NAME(command, Request, Response, method)                                           \
+    case command:                                                                                  \
+        return #command;
+        TRACED_COMMANDS(COMMAND_NAME)
+#undef COMMAND_NAME
+    default:
+        return "UNKNOWN";
+    }
+}
+
+KeymasterMessage* NewTraceRequest(AndroidKeymasterCommand command, int32_t message_version) {
+    switch (command) {
+#define NEW_REQUEST(command, Request, Response, method)                                            \
+    case command:                                                                                  \
+        return new (std::nothrow) Request(message_version);
+        TRACED_COMMANDS(NEW_REQUEST)
+#undef NEW_REQUEST
+    default:
+        return nullptr;
+    }
+}
+
+KeymasterResponse* NewTraceResponse(AndroidKeymasterCommand command, int32_t message_version) {
+    switch (command) {
+#define NEW_RESPONSE(command, Request, Response, method)                                           \
+    case command:                                                                                  \
+        return new (std::nothrow) Response(message_version);
+        TRACED_COMMANDS(NEW_RESPONSE)
+#undef NEW_RESPONSE
+    default:
+        return nullptr;
+    }
+}
+
+keymaster_error_t RedactTraceRequest(AndroidKeymasterCommand command, KeymasterMessage* request) {
+    switch (command) {
+    case ADD_RNG_ENTROPY:
+        return RedactBuffer(&static_cast<AddEntropyRequest*>(request)->random_data);
+    case GET_KEY_CHARACTERISTICS:
+        return RedactKeyBlob(&static_cast<GetKeyCharacteristicsRequest*>(request)->key_blob);
+    case BATCH_GET_KEY_CHARACTERISTICS: {
+        BatchGetKeyCharacteristicsRequest* batch =
+            static_cast<BatchGetKeyCharacteristicsRequest*>(request);
+        keymaster_error_t error = KM_ERROR_OK;
+        for (size_t i = 0; error == KM_ERROR_OK && i < batch->item_count; ++i)
+            error = RedactKeyBlob(&batch->items[i].key_blob);
+        return error;
+    }
+    case BEGIN_OPERATION:
+        return RedactKeyBlob(&static_cast<BeginOperationRequest*>(request)->key_blob);
+    case UPDATE_OPERATION:
+        return RedactBuffer(&static_cast<UpdateOperationRequest*>(request)->input);
+    case UPDATE_AAD:
+        return RedactBuffer(&static_cast<UpdateAadRequest*>(request)->aad);
+    case FINISH_OPERATION: {
+        FinishOperationRequest* finish = static_cast<FinishOperationRequest*>(request);
+        return RedactBuffers(&finish->input, &finish->signature);
+    }
+    case IMPORT_OPERATION: {
+        // The token holds the operation's secret state, so it can't be replayed.
+        ImportOperationRequest* import = static_cast<ImportOperationRequest*>(request);
+        keymaster_error_t error = RedactKeyBlob(&import->key_blob);
+        if (error == KM_ERROR_OK)
+            error = RedactBuffer(&import->token);
+        return error;
+    }
+    case ONE_SHOT_OPERATION: {
+        OneShotOperationRequest* one_shot = static_cast<OneShotOperationRequest*>(request);
+        keymaster_error_t error = RedactKeyBlob(&one_shot->key_blob);
+        if (error == KM_ERROR_OK)
+            error = RedactBuffers(&one_shot->input, &one_shot->signature);
+        return error;
+    }
+    case BATCH_OPERATION: {
+        BatchOperationRequest* batch = static_cast<BatchOperationRequest*>(request);
+        keymaster_error_t error = RedactKeyBlob(&batch->key_blob);
+        for (size_t i = 0; error == KM_ERROR_OK && i < batch->item_count; ++i)
+            error = RedactBuffers(&batch->items[i].input, &batch->items[i].signature);
+        return error;
+    }
+    case IMPORT_KEY: {
+        ImportKeyRequest* import = static_cast<ImportKeyRequest*>(request);
+        if (import->key_data)
+            memset(import->key_data, 0, import->key_data_length);
+        return KM_ERROR_OK;
+    }
+    case EXPORT_KEY:
+        return RedactKeyBlob(&static_cast<ExportKeyRequest*>(request)->key_blob);
+    case ATTEST_KEY:
+        return RedactKeyBlob(&static_cast<AttestKeyRequest*>(request)->key_blob);
+    case BATCH_ATTEST_KEY: {
+        BatchAttestKeyRequest* batch = static_cast<BatchAttestKeyRequest*>(request);
+        keymaster_error_t error = KM_ERROR_OK;
+        for (size_t i = 0; error == KM_ERROR_OK && i < batch->item_count; ++i)
+            error = RedactKeyBlob(&batch->items[i].key_blob);
+        return error;
+    }
+    case UPGRADE_KEY:
+        return RedactKeyBlob(&static_cast<UpgradeKeyRequest*>(request)->key_blob);
+    case MIGRATE_KEY:
+        return RedactKeyBlob(&static_cast<MigrateKeyRequest*>(request)->key_blob);
+    case BATCH_UPGRADE_KEY: {
+        BatchUpgradeKeyRequest* batch = static_cast<BatchUpgradeKeyRequest*>(request);
+        keymaster_error_t error = KM_ERROR_OK;
+        for (size_t i = 0; error == KM_ERROR_OK && i < batch->item_count; ++i)
+            error = RedactKeyBlob(&batch->items[i].key_blob);
+        return error;
+    }
+    case DELETE_KEY:
+        return RedactKeyBlob(&static_cast<DeleteKeyRequest*>(request)->key_blob);
+    case BATCH_DELETE_KEY: {
+        BatchDeleteKeyRequest* batch = static_cast<BatchDeleteKeyRequest*>(request);
+        keymaster_error_t error = KM_ERROR_OK;
+        for (size_t i = 0; error == KM_ERROR_OK && i < batch->item_count; ++i)
+            error = RedactKeyBlob(&batch->items[i].key_blob);
+        return error;
+    }
+    case PIN_KEY:
+        return RedactKeyBlob(&static_cast<PinKeyRequest*>(request)->key_blob);
+    case WARMUP_KEYS: {
+        WarmupKeysRequest* warmup = static_cast<WarmupKeysRequest*>(request);
+        keymaster_error_t error = KM_ERROR_OK;
+        for (size_t i = 0; error == KM_ERROR_OK && i < warmup->item_count; ++i)
+            error = RedactKeyBlob(&warmup->items[i].key_blob);
+        return error;
+    }
+    default:
+        return KM_ERROR_OK;
+    }
+}
+
+keymaster_error_t RedactTraceResponse(AndroidKeymasterCommand command,
+                                      KeymasterResponse* response) {
+    switch (command) {
+    case GENERATE_KEY:
+        return RedactKeyBlob(&static_cast<GenerateKeyResponse*>(response)->key_blob);
+    case GENERATE_KEYS: {
+        GenerateKeysResponse* batch = static_cast<GenerateKeysResponse*>(response);
+        keymaster_error_t error = KM_ERROR_OK;
+        for (size_t i = 0; error == KM_ERROR_OK && i < batch->item_count; ++i)
+            error = RedactKeyBlob(&batch->items[i].key_blob);
+        return error;
+    }
+    case BEGIN_OPERATION:
+        return RedactUpgradedKeyBlob(
+            &static_cast<BeginOperationResponse*>(response)->output_params);
+    case UPDATE_OPERATION:
+        return RedactBuffer(&static_cast<UpdateOperationResponse*>(response)->output);
+    case FINISH_OPERATION:
+        return RedactBuffer(&static_cast<FinishOperationResponse*>(response)->output);
+    case EXPORT_OPERATION:
+        return RedactBuffer(&static_cast<ExportOperationResponse*>(response)->token);
+    case ONE_SHOT_OPERATION: {
+        OneShotOperationResponse* one_shot = static_cast<OneShotOperationResponse*>(response);
+        keymaster_error_t error = RedactBuffer(&one_shot->output);
+        if (error == KM_ERROR_OK)
+            error = RedactUpgradedKeyBlob(&one_shot->output_params);
+        return error;
+    }
+    case BATCH_OPERATION: {
+        BatchOperationResponse* batch = static_cast<BatchOperationResponse*>(response);
+        keymaster_error_t error = KM_ERROR_OK;
+        for (size_t i = 0; error == KM_ERROR_OK && i < batch->item_count; ++i)
+            error = RedactBuffer(&batch->items[i].output);
+        return error;
+    }
+    case IMPORT_KEY:
+        return RedactKeyBlob(&static_cast<ImportKeyResponse*>(response)->key_blob);
+    case UPGRADE_KEY:
+        return RedactKeyBlob(&static_cast<UpgradeKeyResponse*>(response)->upgraded_key);
+    case MIGRATE_KEY:
+        return RedactKeyBlob(&static_cast<MigrateKeyResponse*>(response)->migrated_key);
+    case BATCH_UPGRADE_KEY: {
+        BatchUpgradeKeyResponse* batch = static_cast<BatchUpgradeKeyResponse*>(response);
+        keymaster_error_t error = KM_ERROR_OK;
+        for (size_t i = 0; error == KM_ERROR_OK && i < batch->item_count; ++i)
+            error = RedactKeyBlob(&batch->items[i].upgraded_key);
+        return error;
+    }
+    default:
+        return KM_ERROR_OK;
+    }
+}
+
+RequestTraceWriter::RequestTraceWriter(FILE* file)
+    : file_(file), header_written_(false), failed_count_(0) {}
+
+void RequestTraceWriter::Record(AndroidKeymasterCommand command, const KeymasterMessage& request,
+                                const KeymasterResponse& response, uint64_t start_microseconds,
+                                uint64_t end_microseconds) {
+    if (Write(command, request, response, start_microseconds, end_microseconds) != KM_ERROR_OK) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        ++failed_count_;
+    }
+}
+
+uint64_t RequestTraceWriter::failed_count() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return failed_count_;
+}
+
+keymaster_error_t RequestTraceWriter::Write(AndroidKeymasterCommand command,
+                                            const KeymasterMessage& request,
+                                            const KeymasterResponse& response,
+                                            uint64_t start_microseconds,
+                                            uint64_t end_microseconds) {
+    UniquePtr<KeymasterMessage> redacted_request(
+        NewTraceRequest(command, request.message_version));
+    UniquePtr<KeymasterResponse> redacted_response(
+        NewTraceResponse(command, response.message_version));
+    if (!redacted_request.get() || !redacted_response.get())
+        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+
+    keymaster_error_t error = CopyMessage(request, redacted_request.get());
+    if (error == KM_ERROR_OK)
+        error = CopyMessage(response, redacted_response.get());
+    if (error == KM_ERROR_OK)
+        error = RedactTraceRequest(command, redacted_request.get());
+    if (error == KM_ERROR_OK)
+        error = RedactTraceResponse(command, redacted_response.get());
+    if (error != KM_ERROR_OK)
+        return error;
+
+    size_t request_size = redacted_request->SerializedSize();
+    size_t response_size = redacted_response->SerializedSize();
+    size_t size = kRecordPrefixSize + 2 * sizeof(uint32_t) + request_size + response_size;
+    UniquePtr<uint8_t[]> record(new (std::nothrow) uint8_t[size]);
+    if (!record.get())
+        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    const uint8_t* end = record.get() + size;
+    uint8_t* p = append_uint32_to_buf(record.get(), end, command);
+    p = append_uint32_to_buf(p, end, request.message_version);
+    p = append_uint64_to_buf(p, end, start_microseconds);
+    p = append_uint64_to_buf(p, end, end_microseconds - start_microseconds);
+    p = append_uint32_to_buf(p, end, request_size);
+    p = redacted_request->Serialize(p, end);
+    p = append_uint32_to_buf(p, end, response_size);
+    p = redacted_response->Serialize(p, end);
+    if (p != end)
+        return KM_ERROR_UNKNOWN_ERROR;
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!header_written_) {
+        uint8_t header[kHeaderSize];
+        append_uint32_to_buf(append_uint32_to_buf(header, header + kHeaderSize,
+                                                  kRequestTraceMagic),
+                             header + kHeaderSize, kRequestTraceVersion);
+        if (fwrite(header, sizeof(header), 1, file_) != 1)
+            return KM_ERROR_UNKNOWN_ERROR;
+        header_written_ = true;
+    }
+    if (fwrite(record.get(), size, 1, file_) != 1)
+        return KM_ERROR_UNKNOWN_ERROR;
+    return KM_ERROR_OK;
+}
+
+RequestTraceReader::RequestTraceReader(FILE* file) : file_(file), header_read_(false) {}
+
+namespace {
+
+// Reads a uint32 length, then a message of that length into message.
+keymaster_error_t ReadMessage(FILE* file, Serializable* message) {
+    uint8_t length_bytes[sizeof(uint32_t)];
+    const uint8_t* p = length_bytes;
+    uint32_t length;
+    if (fread(length_bytes, sizeof(length_bytes), 1, file) != 1 ||
+        !copy_uint32_from_buf(&p, length_bytes + sizeof(length_bytes), &length) ||
+        length > kMaxTracedMessageLength)
+        return KM_ERROR_INVALID_ARGUMENT;
+
+    UniquePtr<uint8_t[]> serialized(new (std::nothrow) uint8_t[length]);
+    if (!serialized.get())
+        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    if (length > 0 && fread(serialized.get(), length, 1, file) != 1)
+        return KM_ERROR_INVALID_ARGUMENT;
+    p = serialized.get();
+    const uint8_t* end = serialized.get() + length;
+    if (!message->Deserialize(&p, end) || p != end)
+        return KM_ERROR_INVALID_ARGUMENT;
+    return KM_ERROR_OK;
+}
+
+}  // anonymous namespace
+
+keymaster_error_t RequestTraceReader::Next(TraceRecord* record, bool* end) {
+    *end = false;
+    if (!header_read_) {
+        uint8_t header[kHeaderSize];
+        const uint8_t* p = header;
+        uint32_t magic, version;
+        size_t read = fread(header, 1, sizeof(header), file_);
+        if (read == 0 && feof(file_)) {
+            // Nothing was recorded.
+            *end = true;
+            return KM_ERROR_OK;
+        }
+        if (read != sizeof(header) || !copy_uint32_from_buf(&p, header + kHeaderSize, &magic) ||
+            !copy_uint32_from_buf(&p, header + kHeaderSize, &version) ||
+            magic != kRequestTraceMagic || version != kRequestTraceVersion)
+            return KM_ERROR_INVALID_ARGUMENT;
+        header_read_ = true;
+    }
+
+    uint8_t prefix[kRecordPrefixSize];
+    size_t read = fread(prefix, 1, sizeof(prefix), file_);
+    if (read == 0 && feof(file_)) {
+        *end = true;
+        return KM_ERROR_OK;
+    }
+    const uint8_t* p = prefix;
+    const uint8_t* prefix_end = prefix + sizeof(prefix);
+    uint32_t command, message_version;
+    if (read != sizeof(prefix) || !copy_uint32_from_buf(&p, prefix_end, &command) ||
+        !copy_uint32_from_buf(&p, prefix_end, &message_version) ||
+        !copy_uint64_from_buf(&p, prefix_end, &record->start_microseconds) ||
+        !copy_uint64_from_buf(&p, prefix_end, &record->duration_microseconds) ||
+        message_version > MAX_MESSAGE_VERSION)
+        return KM_ERROR_INVALID_ARGUMENT;
+
+    record->command = static_cast<AndroidKeymasterCommand>(command);
+    record->request.reset(NewTraceRequest(record->command, message_version));
+    record->response.reset(NewTraceResponse(record->command, message_version));
+    if (!record->request.get() || !record->response.get())
+        // Allocation failure is much less likely than a corrupt command.
+        return KM_ERROR_INVALID_ARGUMENT;
+
+    keymaster_error_t error = ReadMessage(file_, record->request.get());
+    if (error == KM_ERROR_OK)
+        error = ReadMessage(file_, record->response.get());
+    return error;
+}
+
+RequestTraceReplayer::RequestTraceReplayer(AndroidKeymaster* keymaster) : keymaster_(keymaster) {}
+
+keymaster_error_t RequestTraceReplayer::Replay(const TraceRecord& record,
+                                               UniquePtr<KeymasterResponse>* response) {
+    UniquePtr<KeymasterMessage> request(
+        NewTraceRequest(record.command, record.request->message_version));
+    response->reset(NewTraceResponse(record.command, record.response->message_version));
+    if (!request.get() || !response->get())
+        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+
+    keymaster_error_t error = CopyMessage(*record.request, request.get());
+    if (error == KM_ERROR_OK)
+        error = PrepareRequest(record, request.get());
+    if (error != KM_ERROR_OK)
+        return error;
+
+    Dispatch(keymaster_, record.command, *request, response->get());
+    NoteResponse(record, **response);
+    return KM_ERROR_OK;
+}
+
+keymaster_error_t RequestTraceReplayer::PrepareRequest(const TraceRecord& record,
+                                                       KeymasterMessage* request) {
+    switch (record.command) {
+    case GET_KEY_CHARACTERISTICS:
+        return SubstituteKeyBlob(&static_cast<GetKeyCharacteristicsRequest*>(request)->key_blob);
+    case BATCH_GET_KEY_CHARACTERISTICS: {
+        BatchGetKeyCharacteristicsRequest* batch =
+            static_cast<BatchGetKeyCharacteristicsRequest*>(request);
+        keymaster_error_t error = KM_ERROR_OK;
+        for (size_t i = 0; error == KM_ERROR_OK && i < batch->item_count; ++i)
+            error = SubstituteKeyBlob(&batch->items[i].key_blob);
+        return error;
+    }
+    case BEGIN_OPERATION: {
+        BeginOperationRequest* begin = static_cast<BeginOperationRequest*>(request);
+        SubstituteKeyHandle(&begin->key_handle);
+        return SubstituteKeyBlob(&begin->key_blob);
+    }
+    case UPDATE_OPERATION:
+        SubstituteOperationHandle(&static_cast<UpdateOperationRequest*>(request)->op_handle);
+        return KM_ERROR_OK;
+    case UPDATE_AAD:
+        SubstituteOperationHandle(&static_cast<UpdateAadRequest*>(request)->op_handle);
+        return KM_ERROR_OK;
+    case FINISH_OPERATION:
+        SubstituteOperationHandle(&static_cast<FinishOperationRequest*>(request)->op_handle);
+        return KM_ERROR_OK;
+    case ABORT_OPERATION:
+        SubstituteOperationHandle(&static_cast<AbortOperationRequest*>(request)->op_handle);
+        return KM_ERROR_OK;
+    case EXPORT_OPERATION:
+        SubstituteOperationHandle(&static_cast<ExportOperationRequest*>(request)->op_handle);
+        return KM_ERROR_OK;
+    case IMPORT_OPERATION:
+        return SubstituteKeyBlob(&static_cast<ImportOperationRequest*>(request)->key_blob);
+    case ONE_SHOT_OPERATION: {
+        OneShotOperationRequest* one_shot = static_cast<OneShotOperationRequest*>(request);
+        SubstituteKeyHandle(&one_shot->key_handle);
+        return SubstituteKeyBlob(&one_shot->key_blob);
+    }
+    case BATCH_OPERATION: {
+        BatchOperationRequest* batch = static_cast<BatchOperationRequest*>(request);
+        SubstituteKeyHandle(&batch->key_handle);
+        return SubstituteKeyBlob(&batch->key_blob);
+    }
+    case IMPORT_KEY:
+        return SynthesizeKeyMaterial(static_cast<const ImportKeyResponse&>(*record.response),
+                                     static_cast<ImportKeyRequest*>(request));
+    case EXPORT_KEY:
+        return SubstituteKeyBlob(&static_cast<ExportKeyRequest*>(request)->key_blob);
+    case ATTEST_KEY:
+        return SubstituteKeyBlob(&static_cast<AttestKeyRequest*>(request)->key_blob);
+    case BATCH_ATTEST_KEY: {
+        BatchAttestKeyRequest* batch = static_cast<BatchAttestKeyRequest*>(request);
+        keymaster_error_t error = KM_ERROR_OK;
+        for (size_t i = 0; error == KM_ERROR_OK && i < batch->item_count; ++i)
+            error = SubstituteKeyBlob(&batch->items[i].key_blob);
+        return error;
+    }
+    case UPGRADE_KEY:
+        return SubstituteKeyBlob(&static_cast<UpgradeKeyRequest*>(request)->key_blob);
+    case MIGRATE_KEY:
+        return SubstituteKeyBlob(&static_cast<MigrateKeyRequest*>(request)->key_blob);
+    case BATCH_UPGRADE_KEY: {
+        BatchUpgradeKeyRequest* batch = static_cast<BatchUpgradeKeyRequest*>(request);
+        keymaster_error_t error = KM_ERROR_OK;
+        for (size_t i = 0; error == KM_ERROR_OK && i < batch->item_count; ++i)
+            error = SubstituteKeyBlob(&batch->items[i].key_blob);
+        return error;
+    }
+    case DELETE_KEY:
+        return SubstituteKeyBlob(&static_cast<DeleteKeyRequest*>(request)->key_blob);
+    case BATCH_DELETE_KEY: {
+        BatchDeleteKeyRequest* batch = static_cast<BatchDeleteKeyRequest*>(request);
+        keymaster_error_t error = KM_ERROR_OK;
+        for (size_t i = 0; error == KM_ERROR_OK && i < batch->item_count; ++i)
+            error = SubstituteKeyBlob(&batch->items[i].key_blob);
+        return error;
+    }
+    case PIN_KEY:
+        return SubstituteKeyBlob(&static_cast<PinKeyRequest*>(request)->key_blob);
+    case WARMUP_KEYS: {
+        WarmupKeysRequest* warmup = static_cast<WarmupKeysRequest*>(request);
+        keymaster_error_t error = KM_ERROR_OK;
+        for (size_t i = 0; error == KM_ERROR_OK && i < warmup->item_count; ++i)
+            error = SubstituteKeyBlob(&warmup->items[i].key_blob);
+        return error;
+    }
+    case UNPIN_KEY:
+        SubstituteKeyHandle(&static_cast<UnpinKeyRequest*>(request)->key_handle);
+        return KM_ERROR_OK;
+    default:
+        return KM_ERROR_OK;
+    }
+}
+
+void RequestTraceReplayer::NoteUpgradedKey(const keymaster_key_blob_t& recorded_key_blob,
+                                           const AuthorizationSet& recorded_params,
+                                           const AuthorizationSet& replayed_params) {
+    keymaster_blob_t recorded_upgrade;
+    if (!recorded_params.GetTagValue(TAG_UPGRADED_KEY_BLOB, &recorded_upgrade))
+        return;
+    std::string recorded_token(reinterpret_cast<const char*>(recorded_upgrade.data),
+                               recorded_upgrade.data_length);
+
+    // The replayed keymaster may not have needed to upgrade the key, in which case later requests
+    // with the upgraded blob use the one it was given.
+    keymaster_blob_t replayed_upgrade;
+    if (replayed_params.GetTagValue(TAG_UPGRADED_KEY_BLOB, &replayed_upgrade)) {
+        key_blobs_[recorded_token].assign(reinterpret_cast<const char*>(replayed_upgrade.data),
+                                          replayed_upgrade.data_length);
+        return;
+    }
+    auto replayed_blob = key_blobs_.find(BlobString(recorded_key_blob));
+    if (replayed_blob != key_blobs_.end()) {
+        std::string replayed = replayed_blob->second;
+        key_blobs_[recorded_token] = replayed;
+    }
+}
+
+void RequestTraceReplayer::NoteResponse(const TraceRecord& record,
+                                        const KeymasterResponse& response) {
+    const KeymasterResponse& recorded = *record.response;
+    switch (record.command) {
+    case GENERATE_KEY:
+        if (BothSucceeded(recorded, response))
+            key_blobs_[BlobString(static_cast<const GenerateKeyResponse&>(recorded).key_blob)] =
+                BlobString(static_cast<const GenerateKeyResponse&>(response).key_blob);
+        break;
+    case GENERATE_KEYS:
+        if (BothSucceeded(recorded, response)) {
+            const GenerateKeysResponse& recorded_batch =
+                static_cast<const GenerateKeysResponse&>(recorded);
+            const GenerateKeysResponse& batch = static_cast<const GenerateKeysResponse&>(response);
+            for (size_t i = 0; i < recorded_batch.item_count && i < batch.item_count; ++i)
+                if (recorded_batch.items[i].error == KM_ERROR_OK &&
+                    batch.items[i].error == KM_ERROR_OK)
+                    key_blobs_[BlobString(recorded_batch.items[i].key_blob)] =
+                        BlobString(batch.items[i].key_blob);
+        }
+        break;
+    case IMPORT_KEY:
+        if (BothSucceeded(recorded, response))
+            key_blobs_[BlobString(static_cast<const ImportKeyResponse&>(recorded).key_blob)] =
+                BlobString(static_cast<const ImportKeyResponse&>(response).key_blob);
+        break;
+    case UPGRADE_KEY:
+        if (BothSucceeded(recorded, response))
+            key_blobs_[BlobString(static_cast<const UpgradeKeyResponse&>(recorded).upgraded_key)] =
+                BlobString(static_cast<const UpgradeKeyResponse&>(response).upgraded_key);
+        break;
+    case MIGRATE_KEY:
+        if (BothSucceeded(recorded, response))
+            key_blobs_[BlobString(static_cast<const MigrateKeyResponse&>(recorded).migrated_key)] =
+                BlobString(static_cast<const MigrateKeyResponse&>(response).migrated_key);
+        break;
+    case BATCH_UPGRADE_KEY:
+        if (BothSucceeded(recorded, response)) {
+            const BatchUpgradeKeyResponse& recorded_batch =
+                static_cast<const BatchUpgradeKeyResponse&>(recorded);
+            const BatchUpgradeKeyResponse& batch =
+                static_cast<const BatchUpgradeKeyResponse&>(response);
+            for (size_t i = 0; i < recorded_batch.item_count && i < batch.item_count; ++i)
+                if (recorded_batch.items[i].error == KM_ERROR_OK &&
+                    batch.items[i].error == KM_ERROR_OK)
+                    key_blobs_[BlobString(recorded_batch.items[i].upgraded_key)] =
+                        BlobString(batch.items[i].upgraded_key);
+        }
+        break;
+    case BEGIN_OPERATION: {
+        const BeginOperationResponse& recorded_begin =
+            static_cast<const BeginOperationResponse&>(recorded);
+        const BeginOperationResponse& begin = static_cast<const BeginOperationResponse&>(response);
+        if (BothSucceeded(recorded, response))
+            op_handles_[recorded_begin.op_handle] = begin.op_handle;
+        NoteUpgradedKey(static_cast<const BeginOperationRequest&>(*record.request).key_blob,
+                        recorded_begin.output_params, begin.output_params);
+        break;
+    }
+    case ONE_SHOT_OPERATION:
+        NoteUpgradedKey(static_cast<const OneShotOperationRequest&>(*record.request).key_blob,
+                        static_cast<const OneShotOperationResponse&>(recorded).output_params,
+                        static_cast<const OneShotOperationResponse&>(response).output_params);
+        break;
+    case UPDATE_OPERATION:
+        // A failed update ends the operation.
+        if (!BothSucceeded(recorded, response))
+            op_handles_.erase(
+                static_cast<const UpdateOperationRequest&>(*record.request).op_handle);
+        break;
+    case UPDATE_AAD:
+        if (!BothSucceeded(recorded, response))
+            op_handles_.erase(static_cast<const UpdateAadRequest&>(*record.request).op_handle);
+        break;
+    case FINISH_OPERATION:
+        op_handles_.erase(static_cast<const FinishOperationRequest&>(*record.request).op_handle);
+        break;
+    case ABORT_OPERATION:
+        op_handles_.erase(static_cast<const AbortOperationRequest&>(*record.request).op_handle);
+        break;
+    case EXPORT_OPERATION:
+        // An exported operation leaves the table, and a failed export leaves it in place.
+        if (response.error == KM_ERROR_OK)
+            op_handles_.erase(
+                static_cast<const ExportOperationRequest&>(*record.request).op_handle);
+        break;
+    case IMPORT_OPERATION:
+        if (BothSucceeded(recorded, response))
+            op_handles_[static_cast<const ImportOperationResponse&>(recorded).op_handle] =
+                static_cast<const ImportOperationResponse&>(response).op_handle;
+        break;
+    case PIN_KEY:
+        if (BothSucceeded(recorded, response))
+            key_handles_[static_cast<const PinKeyResponse&>(recorded).key_handle] =
+                static_cast<const PinKeyResponse&>(response).key_handle;
+        break;
+    case UNPIN_KEY:
+        key_handles_.erase(static_cast<const UnpinKeyRequest&>(*record.request).key_handle);
+        break;
+    default:
+        break;
+    }
+}
+
+keymaster_error_t RequestTraceReplayer::SubstituteKeyBlob(keymaster_key_blob_t* key_blob) const {
+    if (!key_blob->key_material)
+        return KM_ERROR_OK;
+    auto i = key_blobs_.find(BlobString(*key_blob));
+    // Keys created before recording started are left as tokens, which the keymaster will reject.
+    if (i == key_blobs_.end())
+        return KM_ERROR_OK;
+    return SetKeyBlob(key_blob, i->second.data(), i->second.size());
+}
+
+void RequestTraceReplayer::SubstituteKeyHandle(uint64_t* key_handle) const {
+    Substitute(key_handles_, key_handle);
+}
+
+void RequestTraceReplayer::SubstituteOperationHandle(
+    keymaster_operation_handle_t* op_handle) const {
+    Substitute(op_handles_, op_handle);
+}
+
+}  // namespace keymaster
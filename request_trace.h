@@ -0,0 +1,177 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SYSTEM_KEYMASTER_REQUEST_TRACE_H_
+#define SYSTEM_KEYMASTER_REQUEST_TRACE_H_
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <map>
+#include <mutex>
+#include <string>
+
+#include <UniquePtr.h>
+
+#include <keymaster/android_keymaster.h>
+#include <keymaster/android_keymaster_messages.h>
+#include <keymaster/request_recorder.h>
+
+namespace keymaster {
+
+/*
+ * A request trace holds the key and operation requests an AndroidKeymaster handled, with their
+ * responses, so that a workload can be replayed elsewhere.  It is a header, the uint32s
+ * kRequestTraceMagic and kRequestTraceVersion, followed by a record for each request:
+ *
+ *   uint32 command, uint32 message version, uint64 start time, uint64 duration,
+ *   uint32 request length, serialized request, uint32 response length, serialized response
+ *
+ * in the byte order Serializable uses, with times in microseconds from a monotonic clock.
+ * Requests handled concurrently are recorded in the order they finished.
+ *
+ * Traces don't contain key material.  Key blobs are replaced by the first kKeyBlobTokenLength
+ * bytes of their SHA-256 digest, which is enough for a replay to tell them apart.  Imported key
+ * material, operation input and output, signatures and entropy are replaced by zeros of the same
+ * length.  Key parameters, including application IDs and data, are kept.
+ */
+
+const uint32_t kRequestTraceMagic = 0x4b4d5452;  // "KMTR"
+const uint32_t kRequestTraceVersion = 1;
+const size_t kKeyBlobTokenLength = 16;
+
+/**
+ * Returns the name of command's enumerator, for reports.
+ */
+const char* TraceCommandName(AndroidKeymasterCommand command);
+
+/**
+ * Returns new, empty messages of the types command uses, or null if command isn't recorded in
+ * traces or allocation fails.
+ */
+KeymasterMessage* NewTraceRequest(AndroidKeymasterCommand command, int32_t message_version);
+KeymasterResponse* NewTraceResponse(AndroidKeymasterCommand command, int32_t message_version);
+
+/**
+ * Removes the key material from a request or response of command, in place, as described above.
+ * They must be of the types NewTraceRequest and NewTraceResponse return for command.
+ */
+keymaster_error_t RedactTraceRequest(AndroidKeymasterCommand command, KeymasterMessage* request);
+keymaster_error_t RedactTraceResponse(AndroidKeymasterCommand command,
+                                      KeymasterResponse* response);
+
+struct TraceRecord {
+    AndroidKeymasterCommand command;
+    uint64_t start_microseconds;
+    uint64_t duration_microseconds;
+    UniquePtr<KeymasterMessage> request;
+    UniquePtr<KeymasterResponse> response;
+};
+
+/**
+ * RequestTraceWriter is a RequestRecorder which redacts each request and response and appends them
+ * to a trace file.
+ */
+class RequestTraceWriter : public RequestRecorder {
+  public:
+    /**
+     * Writes the trace to file, which must stay open while the writer is in use.  Doesn't take
+     * ownership.
+     */
+    explicit RequestTraceWriter(FILE* file);
+
+    void Record(AndroidKeymasterCommand command, const KeymasterMessage& request,
+                const KeymasterResponse& response, uint64_t start_microseconds,
+                uint64_t end_microseconds) override;
+
+    /**
+     * Returns the number of requests that couldn't be recorded, for lack of memory or because
+     * writing failed.
+     */
+    uint64_t failed_count() const;
+
+  private:
+    keymaster_error_t Write(AndroidKeymasterCommand command, const KeymasterMessage& request,
+                            const KeymasterResponse& response, uint64_t start_microseconds,
+                            uint64_t end_microseconds);
+
+    FILE* file_;
+    // Guards the members below, and writes to file_.
+    mutable std::mutex mutex_;
+    bool header_written_;
+    uint64_t failed_count_;
+};
+
+class RequestTraceReader {
+  public:
+    /**
+     * Reads a trace from file.  Doesn't take ownership.
+     */
+    explicit RequestTraceReader(FILE* file);
+
+    /**
+     * Reads the next record.  At the end of the trace, sets *end and returns KM_ERROR_OK.  Returns
+     * KM_ERROR_INVALID_ARGUMENT if the file isn't a trace or is truncated.
+     */
+    keymaster_error_t Next(TraceRecord* record, bool* end);
+
+  private:
+    FILE* file_;
+    bool header_read_;
+};
+
+/**
+ * RequestTraceReplayer sends the requests from a trace to an AndroidKeymaster.  Since traces are
+ * redacted, and the keymaster has its own keys, it maps each recorded key blob, key handle and
+ * operation handle to the one the keymaster returned when the request that produced it was
+ * replayed, and substitutes fresh key material of the same algorithm and size for imported keys.
+ * Operation input is zeros, so operations that check their input, such as decryption and
+ * verification, generally fail where they succeeded when recorded.
+ */
+class RequestTraceReplayer {
+  public:
+    // Doesn't take ownership of keymaster.
+    explicit RequestTraceReplayer(AndroidKeymaster* keymaster);
+
+    /**
+     * Sends record's request to the keymaster, and sets *response to the keymaster's response.
+     * Returns an error only if the request couldn't be sent; the keymaster's own result is in
+     * (*response)->error.
+     */
+    keymaster_error_t Replay(const TraceRecord& record, UniquePtr<KeymasterResponse>* response);
+
+  private:
+    keymaster_error_t PrepareRequest(const TraceRecord& record, KeymasterMessage* request);
+    void NoteResponse(const TraceRecord& record, const KeymasterResponse& response);
+    // Maps a blob the recorded keymaster returned as TAG_UPGRADED_KEY_BLOB, when it upgraded
+    // recorded_key_blob on use.
+    void NoteUpgradedKey(const keymaster_key_blob_t& recorded_key_blob,
+                         const AuthorizationSet& recorded_params,
+                         const AuthorizationSet& replayed_params);
+    keymaster_error_t SubstituteKeyBlob(keymaster_key_blob_t* key_blob) const;
+    void SubstituteKeyHandle(uint64_t* key_handle) const;
+    void SubstituteOperationHandle(keymaster_operation_handle_t* op_handle) const;
+
+    AndroidKeymaster* keymaster_;
+    // Recorded key blob tokens, key handles and operation handles, to the replayed values.
+    std::map<std::string, std::string> key_blobs_;
+    std::map<uint64_t, uint64_t> key_handles_;
+    std::map<keymaster_operation_handle_t, keymaster_operation_handle_t> op_handles_;
+};
+
+}  // namespace keymaster
+
+#endif  // SYSTEM_KEYMASTER_REQUEST_TRACE_H_
@@ -0,0 +1,246 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include <keymaster/android_keymaster.h>
+#include <keymaster/soft_keymaster_context.h>
+
+#include "request_trace.h"
+
+namespace keymaster {
+namespace test {
+
+static std::string read_file(const std::string& file_name) {
+    std::ifstream file_stream(file_name, std::ios::binary);
+    std::istreambuf_iterator<char> file_begin(file_stream);
+    std::istreambuf_iterator<char> file_end;
+    return std::string(file_begin, file_end);
+}
+
+static bool Contains(const std::string& haystack, const void* needle, size_t length) {
+    return haystack.find(std::string(reinterpret_cast<const char*>(needle), length)) !=
+           std::string::npos;
+}
+
+class RequestTraceTest : public testing::Test {
+  protected:
+    RequestTraceTest() : trace_(tmpfile()) {}
+    ~RequestTraceTest() { fclose(trace_); }
+
+    std::string TraceContents() {
+        fflush(trace_);
+        rewind(trace_);
+        std::string contents;
+        char chunk[4096];
+        size_t read;
+        while ((read = fread(chunk, 1, sizeof(chunk), trace_)) > 0)
+            contents.append(chunk, read);
+        rewind(trace_);
+        return contents;
+    }
+
+    std::vector<TraceRecord*> ReadTrace() {
+        std::vector<TraceRecord*> records;
+        RequestTraceReader reader(trace_);
+        for (;;) {
+            UniquePtr<TraceRecord> record(new TraceRecord);
+            bool end;
+            EXPECT_EQ(KM_ERROR_OK, reader.Next(record.get(), &end));
+            if (end || HasFailure())
+                break;
+            records.push_back(record.release());
+        }
+        return records;
+    }
+
+    FILE* trace_;
+};
+
+static const uint8_t kAesKey[16] = {0x9e, 0x37, 0x79, 0xb9, 0x7f, 0x4a, 0x7c, 0x15,
+                                    0xf3, 0x9c, 0xc0, 0x60, 0x5c, 0xed, 0xc8, 0x34};
+static const char kMessage[] = "a message that mustn't be traced";
+
+TEST_F(RequestTraceTest, RecordsRedactsAndReplays) {
+    std::string ec_key = read_file("ec_privkey_pk8.der");
+    ASSERT_FALSE(ec_key.empty());
+    std::string hmac_blob;
+
+    AndroidKeymaster recorded(new SoftKeymasterContext, 16);
+    RequestTraceWriter writer(trace_);
+    recorded.set_recorder(&writer);
+    {
+        GenerateKeyRequest generate;
+        generate.key_description.Reinitialize(AuthorizationSet(
+            AuthorizationSetBuilder()
+                .HmacKey(128)
+                .Digest(KM_DIGEST_SHA_2_256)
+                .Authorization(TAG_MIN_MAC_LENGTH, 128)
+                .Authorization(TAG_NO_AUTH_REQUIRED)));
+        GenerateKeyResponse hmac_key;
+        recorded.GenerateKey(generate, &hmac_key);
+        ASSERT_EQ(KM_ERROR_OK, hmac_key.error);
+        hmac_blob.assign(reinterpret_cast<const char*>(hmac_key.key_blob.key_material),
+                         hmac_key.key_blob.key_material_size);
+
+        BeginOperationRequest begin;
+        begin.purpose = KM_PURPOSE_SIGN;
+        begin.SetKeyMaterial(hmac_key.key_blob);
+        begin.additional_params.Reinitialize(AuthorizationSet(
+            AuthorizationSetBuilder().Digest(KM_DIGEST_SHA_2_256).Authorization(TAG_MAC_LENGTH,
+                                                                                256)));
+        BeginOperationResponse begin_response;
+        recorded.BeginOperation(begin, &begin_response);
+        ASSERT_EQ(KM_ERROR_OK, begin_response.error);
+
+        UpdateOperationRequest update;
+        update.op_handle = begin_response.op_handle;
+        update.input.Reinitialize(kMessage, sizeof(kMessage));
+        UpdateOperationResponse update_response;
+        recorded.UpdateOperation(update, &update_response);
+        ASSERT_EQ(KM_ERROR_OK, update_response.error);
+
+        FinishOperationRequest finish;
+        finish.op_handle = begin_response.op_handle;
+        FinishOperationResponse finish_response;
+        recorded.FinishOperation(finish, &finish_response);
+        ASSERT_EQ(KM_ERROR_OK, finish_response.error);
+
+        ImportKeyRequest import_aes;
+        import_aes.key_description.Reinitialize(AuthorizationSet(
+            AuthorizationSetBuilder().AesEncryptionKey(128).EcbMode().Padding(KM_PAD_NONE)
+                .Authorization(TAG_NO_AUTH_REQUIRED)));
+        import_aes.key_format = KM_KEY_FORMAT_RAW;
+        import_aes.SetKeyMaterial(kAesKey, sizeof(kAesKey));
+        ImportKeyResponse aes_key;
+        recorded.ImportKey(import_aes, &aes_key);
+        ASSERT_EQ(KM_ERROR_OK, aes_key.error);
+
+        OneShotOperationRequest encrypt;
+        encrypt.purpose = KM_PURPOSE_ENCRYPT;
+        encrypt.SetKeyMaterial(aes_key.key_blob);
+        encrypt.additional_params.Reinitialize(AuthorizationSet(
+            AuthorizationSetBuilder().Authorization(TAG_BLOCK_MODE, KM_MODE_ECB)
+                .Padding(KM_PAD_NONE)));
+        encrypt.input.Reinitialize(kMessage, 16);
+        OneShotOperationResponse encrypt_response;
+        recorded.OneShotOperation(encrypt, &encrypt_response);
+        ASSERT_EQ(KM_ERROR_OK, encrypt_response.error);
+
+        ImportKeyRequest import_ec;
+        import_ec.key_description.Reinitialize(AuthorizationSet(
+            AuthorizationSetBuilder().EcdsaSigningKey(256).Digest(KM_DIGEST_NONE)
+                .Authorization(TAG_NO_AUTH_REQUIRED)));
+        import_ec.key_format = KM_KEY_FORMAT_PKCS8;
+        import_ec.SetKeyMaterial(ec_key.data(), ec_key.size());
+        ImportKeyResponse ec_key_response;
+        recorded.ImportKey(import_ec, &ec_key_response);
+        ASSERT_EQ(KM_ERROR_OK, ec_key_response.error);
+
+        ExportKeyRequest export_ec;
+        export_ec.key_format = KM_KEY_FORMAT_X509;
+        export_ec.SetKeyMaterial(ec_key_response.key_blob);
+        ExportKeyResponse export_response;
+        recorded.ExportKey(export_ec, &export_response);
+        ASSERT_EQ(KM_ERROR_OK, export_response.error);
+
+        DeleteKeyRequest delete_ec;
+        delete_ec.SetKeyMaterial(ec_key_response.key_blob);
+        DeleteKeyResponse delete_response;
+        recorded.DeleteKey(delete_ec, &delete_response);
+
+        // An operation that fails is recorded too.
+        AbortOperationRequest abort;
+        abort.op_handle = begin_response.op_handle;
+        AbortOperationResponse abort_response;
+        recorded.AbortOperation(abort, &abort_response);
+        ASSERT_EQ(KM_ERROR_INVALID_OPERATION_HANDLE, abort_response.error);
+    }
+    EXPECT_EQ(0U, writer.failed_count());
+
+    std::string contents = TraceContents();
+    EXPECT_FALSE(Contains(contents, kAesKey, sizeof(kAesKey)));
+    EXPECT_FALSE(Contains(contents, ec_key.data(), ec_key.size()));
+    EXPECT_FALSE(Contains(contents, hmac_blob.data(), hmac_blob.size()));
+    EXPECT_FALSE(Contains(contents, kMessage, 16));
+
+    std::vector<TraceRecord*> records = ReadTrace();
+    const AndroidKeymasterCommand kCommands[] = {
+        GENERATE_KEY, BEGIN_OPERATION,    UPDATE_OPERATION, FINISH_OPERATION, IMPORT_KEY,
+        ONE_SHOT_OPERATION, IMPORT_KEY, EXPORT_KEY, DELETE_KEY, ABORT_OPERATION};
+    ASSERT_EQ(sizeof(kCommands) / sizeof(kCommands[0]), records.size());
+    for (size_t i = 0; i < records.size(); ++i)
+        EXPECT_EQ(kCommands[i], records[i]->command) << i;
+
+    // Replaying into another keymaster gives the same results, with synthesized keys.
+    AndroidKeymaster replayed(new SoftKeymasterContext, 16);
+    RequestTraceReplayer replayer(&replayed);
+    for (TraceRecord* record : records) {
+        UniquePtr<KeymasterResponse> response;
+        ASSERT_EQ(KM_ERROR_OK, replayer.Replay(*record, &response));
+        EXPECT_EQ(record->response->error, response->error) << TraceCommandName(record->command);
+        delete record;
+    }
+}
+
+TEST_F(RequestTraceTest, ReaderRejectsCorruptTraces) {
+    TraceRecord record;
+    bool end;
+    EXPECT_EQ(KM_ERROR_OK, RequestTraceReader(trace_).Next(&record, &end));
+    EXPECT_TRUE(end);
+
+    // Not a trace.
+    fputs("not a trace", trace_);
+    rewind(trace_);
+    EXPECT_EQ(KM_ERROR_INVALID_ARGUMENT, RequestTraceReader(trace_).Next(&record, &end));
+
+    // A truncated record.
+    FILE* truncated = tmpfile();
+    {
+        RequestTraceWriter writer(trace_);
+        rewind(trace_);
+        GetKeyCharacteristicsRequest request;
+        request.SetKeyMaterial(kAesKey, sizeof(kAesKey));
+        GetKeyCharacteristicsResponse response;
+        response.error = KM_ERROR_INVALID_KEY_BLOB;
+        writer.Record(GET_KEY_CHARACTERISTICS, request, response, 10, 20);
+        ASSERT_EQ(0U, writer.failed_count());
+    }
+    std::string contents = TraceContents();
+    fwrite(contents.data(), contents.size() - 1, 1, truncated);
+    rewind(truncated);
+    EXPECT_EQ(KM_ERROR_INVALID_ARGUMENT, RequestTraceReader(truncated).Next(&record, &end));
+    fclose(truncated);
+
+    RequestTraceReader reader(trace_);
+    ASSERT_EQ(KM_ERROR_OK, reader.Next(&record, &end));
+    ASSERT_FALSE(end);
+    EXPECT_EQ(GET_KEY_CHARACTERISTICS, record.command);
+    EXPECT_EQ(10U, record.start_microseconds);
+    EXPECT_EQ(10U, record.duration_microseconds);
+    EXPECT_EQ(KM_ERROR_INVALID_KEY_BLOB, record.response->error);
+    EXPECT_EQ(KM_ERROR_OK, reader.Next(&record, &end));
+    EXPECT_TRUE(end);
+}
+
+}  // namespace test
+}  // namespace keymaster
@@ -16,10 +16,15 @@
 
 #include "rsa_key.h"
 
+#include <string.h>
+
+#include <new>
+
 #include <keymaster/keymaster_context.h>
 
 #include "openssl_err.h"
 #include "openssl_utils.h"
+#include "precomputed_pair_queue.h"
 #include "rsa_operation.h"
 
 namespace keymaster {
@@ -33,6 +38,79 @@ bool RsaKey::InternalToEvp(EVP_PKEY* pkey) const {
     return EVP_PKEY_set1_RSA(pkey, rsa_key_.get()) == 1;
 }
 
+RsaKey::RsaKey(const AuthorizationSet& hw_enforced, const AuthorizationSet& sw_enforced,
+               keymaster_error_t* error)
+    : AsymmetricKey(hw_enforced, sw_enforced, error),
+      pkey_context_cache_(new (std::nothrow) RsaPkeyContextCache) {}
+
+RsaKey::RsaKey(RSA* rsa, const AuthorizationSet& hw_enforced, const AuthorizationSet& sw_enforced,
+               keymaster_error_t* error)
+    : AsymmetricKey(hw_enforced, sw_enforced, error), rsa_key_(rsa),
+      pkey_context_cache_(new (std::nothrow) RsaPkeyContextCache) {}
+
+// An RSA private key holds n and d, and five half-size CRT values; on first use the library adds
+// Montgomery contexts for n, p and q and its blinding values.  About eleven moduli in all.
+static const size_t kRsaPrivateKeyModuli = 11;
+
+size_t RsaKey::material_bytes() const {
+    size_t bytes = AsymmetricKey::material_bytes();
+    if (!rsa_key_.get())
+        return bytes;
+    size_t modulus_size = RSA_size(rsa_key_.get());
+    bytes += kRsaPrivateKeyModuli * modulus_size;
+    if (unblinded_key_.get())
+        bytes += kRsaPrivateKeyModuli * modulus_size;
+    // Each pair is r^e and r^-1 mod n.
+    if (blinding_queue_)
+        bytes += blinding_queue_->capacity() * 2 * modulus_size;
+    return bytes;
+}
+
+keymaster_error_t RsaKey::EnableBlindingQueue(size_t capacity,
+                                              const std::shared_ptr<PrecomputationFiller>& filler) {
+    if (!rsa_key_.get() || !filler)
+        return KM_ERROR_UNKNOWN_ERROR;
+
+    unblinded_key_.reset(RSAPrivateKey_dup(rsa_key_.get()));
+    if (!unblinded_key_.get())
+        return TranslateLastOpenSslError();
+    unblinded_key_->flags |= RSA_FLAG_NO_BLINDING;
+
+    PrecomputedPairQueue::Generator generator = RsaBlindingGenerator(rsa_key_.get());
+    if (!generator)
+        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    blinding_queue_.reset(new (std::nothrow) PrecomputedPairQueue(generator, capacity, filler));
+    if (!blinding_queue_)
+        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    filler->Schedule(blinding_queue_);
+    return KM_ERROR_OK;
+}
+
+// Transforms the value 2 with the private key, for the setup the library caches on the key.
+static keymaster_error_t WarmupPrivateKey(RSA* rsa) {
+    size_t key_len = RSA_size(rsa);
+    UniquePtr<uint8_t[]> input(new (std::nothrow) uint8_t[key_len]);
+    UniquePtr<uint8_t[]> output(new (std::nothrow) uint8_t[key_len]);
+    if (!input.get() || !output.get())
+        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    memset(input.get(), 0, key_len);
+    input[key_len - 1] = 2;
+    int result = RSA_private_encrypt(key_len, input.get(), output.get(), rsa, RSA_NO_PADDING);
+    if (result < 0)
+        return TranslateLastOpenSslError();
+    return KM_ERROR_OK;
+}
+
+keymaster_error_t RsaKey::Warmup() const {
+    keymaster_error_t error = AsymmetricKey::Warmup();
+    if (error != KM_ERROR_OK || !rsa_key_.get())
+        return error;
+    error = WarmupPrivateKey(rsa_key_.get());
+    if (error == KM_ERROR_OK && unblinded_key_.get())
+        error = WarmupPrivateKey(unblinded_key_.get());
+    return error;
+}
+
 bool RsaKey::SupportedMode(keymaster_purpose_t purpose, keymaster_padding_t padding) {
     switch (purpose) {
     case KM_PURPOSE_SIGN:
@@ -17,17 +17,22 @@
 #ifndef SYSTEM_KEYMASTER_RSA_KEY_H_
 #define SYSTEM_KEYMASTER_RSA_KEY_H_
 
+#include <memory>
+
 #include <openssl/rsa.h>
 
 #include "asymmetric_key.h"
 
 namespace keymaster {
 
+class PrecomputationFiller;
+class PrecomputedPairQueue;
+class RsaPkeyContextCache;
+
 class RsaKey : public AsymmetricKey {
   public:
     RsaKey(const AuthorizationSet& hw_enforced, const AuthorizationSet& sw_enforced,
-           keymaster_error_t* error)
-        : AsymmetricKey(hw_enforced, sw_enforced, error) {}
+           keymaster_error_t* error);
 
     bool InternalToEvp(EVP_PKEY* pkey) const override;
     bool EvpToInternal(const EVP_PKEY* pkey) override;
@@ -41,13 +46,43 @@ class RsaKey : public AsymmetricKey {
 
     RSA* key() const { return rsa_key_.get(); }
 
+    // Also runs one private-key transform, which sets up the Montgomery contexts for n, p and q
+    // and the library's blinding.
+    keymaster_error_t Warmup() const override;
+
+    /**
+     * Gives the key a queue of up to capacity precomputed blinding pairs (r^e and r^-1 mod n),
+     * filled by filler, for the raw private-key operations in RsaOperation.  Must be called after
+     * the key material is loaded.
+     */
+    keymaster_error_t EnableBlindingQueue(size_t capacity,
+                                          const std::shared_ptr<PrecomputationFiller>& filler);
+
+    // Null unless EnableBlindingQueue has been called.
+    const std::shared_ptr<PrecomputedPairQueue>& blinding_queue() const { return blinding_queue_; }
+
+    // A copy of the key with the library's own blinding disabled, to be used only on inputs blinded
+    // with a pair from blinding_queue().  Null unless EnableBlindingQueue has been called.
+    RSA* unblinded_key() const { return unblinded_key_.get(); }
+
+    // EVP_PKEY_CTX templates for en/decryption with the key.  Null only if allocation failed.
+    const std::shared_ptr<RsaPkeyContextCache>& pkey_context_cache() const {
+        return pkey_context_cache_;
+    }
+
   protected:
     RsaKey(RSA* rsa, const AuthorizationSet& hw_enforced, const AuthorizationSet& sw_enforced,
-           keymaster_error_t* error)
-        : AsymmetricKey(hw_enforced, sw_enforced, error), rsa_key_(rsa) {}
+           keymaster_error_t* error);
+
+    size_t object_size() const override { return sizeof(*this); }
+    // The RSA objects and a full blinding queue, estimated from the modulus size.
+    size_t material_bytes() const override;
 
   private:
     UniquePtr<RSA, RSA_Delete> rsa_key_;
+    UniquePtr<RSA, RSA_Delete> unblinded_key_;
+    std::shared_ptr<PrecomputedPairQueue> blinding_queue_;
+    std::shared_ptr<RsaPkeyContextCache> pkey_context_cache_;
 };
 
 }  // namespace keymaster
@@ -16,14 +16,20 @@
 
 #include <keymaster/rsa_key_factory.h>
 
+#include <algorithm>
 #include <new>
 
+#include <openssl/err.h>
+
 #include <keymaster/keymaster_context.h>
 
+#include "compact_private_key.h"
 #include "openssl_err.h"
 #include "openssl_utils.h"
+#include "pregenerated_key_pool.h"
 #include "rsa_key.h"
 #include "rsa_operation.h"
+#include "worker_pool.h"
 
 namespace keymaster {
 
@@ -34,6 +40,264 @@ static RsaVerificationOperationFactory verify_factory;
 static RsaEncryptionOperationFactory encrypt_factory;
 static RsaDecryptionOperationFactory decrypt_factory;
 
+// The most primes a key_size-bit modulus can have before its primes become small enough for
+// elliptic-curve factoring to threaten.  These are the limits OpenSSL applies.
+static uint32_t MaxPrimeCount(uint32_t key_size) {
+    if (key_size < 1024)
+        return 2;
+    if (key_size < 4096)
+        return 3;
+    if (key_size < 8192)
+        return 4;
+    return 5;
+}
+
+static keymaster_error_t GenerateRsaKey(uint32_t key_size, uint64_t public_exponent,
+                                        uint32_t prime_count,
+                                        UniquePtr<EVP_PKEY, EVP_PKEY_Delete>* pkey) {
+    UniquePtr<BIGNUM, BIGNUM_Delete> exponent(BN_new());
+    UniquePtr<RSA, RsaKey::RSA_Delete> rsa_key(RSA_new());
+    pkey->reset(EVP_PKEY_new());
+    if (exponent.get() == NULL || rsa_key.get() == NULL || pkey->get() == NULL)
+        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+
+    if (!BN_set_word(exponent.get(), public_exponent))
+        return TranslateLastOpenSslError();
+    int generated;
+    if (prime_count > 2)
+        generated = RSA_generate_multi_prime_key(rsa_key.get(), key_size, prime_count,
+                                                 exponent.get(), NULL /* callback */);
+    else
+        generated =
+            RSA_generate_key_ex(rsa_key.get(), key_size, exponent.get(), NULL /* callback */);
+    if (!generated)
+        return TranslateLastOpenSslError();
+
+    if (EVP_PKEY_set1_RSA(pkey->get(), rsa_key.get()) != 1)
+        return TranslateLastOpenSslError();
+    return KM_ERROR_OK;
+}
+
+// Finds a prime of bits bits for a modulus with public exponent e, which must be odd: p - 1 must be
+// coprime to e for the private exponent to exist.  BN_generate_prime_ex sets the top two bits, so
+// the product of two such primes has exactly the sum of their sizes.
+static BIGNUM* GenerateRsaPrime(int bits, const BIGNUM* e) {
+    BIGNUM_Ptr prime(BN_new());
+    BIGNUM_Ptr prime_minus_one(BN_new());
+    BIGNUM_Ptr gcd(BN_new());
+    UniquePtr<BN_CTX, BN_CTX_Delete> ctx(BN_CTX_new());
+    if (!prime.get() || !prime_minus_one.get() || !gcd.get() || !ctx.get())
+        return nullptr;
+    for (;;) {
+        if (!BN_generate_prime_ex(prime.get(), bits, 0 /* safe */, nullptr /* add */,
+                                  nullptr /* rem */, nullptr /* callback */) ||
+            !BN_sub(prime_minus_one.get(), prime.get(), BN_value_one()) ||
+            !BN_gcd(gcd.get(), prime_minus_one.get(), e, ctx.get()))
+            return nullptr;
+        if (BN_is_one(gcd.get()))
+            return prime.release();
+    }
+}
+
+// Builds the key for primes p and q and public exponent e, taking ownership of all three, with
+// d = e^-1 mod lcm(p - 1, q - 1) as RSA_generate_key_ex computes it, and checks it.
+static keymaster_error_t AssembleRsaKey(uint32_t key_size, BIGNUM_Ptr* p, BIGNUM_Ptr* q,
+                                        BIGNUM_Ptr* e, UniquePtr<EVP_PKEY, EVP_PKEY_Delete>* pkey) {
+    // The CRT coefficient is q^-1 mod p, by the usual convention that p > q.
+    if (BN_cmp(p->get(), q->get()) < 0) {
+        BIGNUM* larger = q->release();
+        q->reset(p->release());
+        p->reset(larger);
+    }
+
+    UniquePtr<RSA, RsaKey::RSA_Delete> rsa(RSA_new());
+    UniquePtr<BN_CTX, BN_CTX_Delete> ctx(BN_CTX_new());
+    BIGNUM_Ptr p_minus_one(BN_new());
+    BIGNUM_Ptr q_minus_one(BN_new());
+    BIGNUM_Ptr gcd(BN_new());
+    BIGNUM_Ptr lcm(BN_new());
+    pkey->reset(EVP_PKEY_new());
+    if (!rsa.get() || !ctx.get() || !p_minus_one.get() || !q_minus_one.get() || !gcd.get() ||
+        !lcm.get() || !pkey->get())
+        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    rsa->n = BN_new();
+    rsa->d = BN_new();
+    rsa->dmp1 = BN_new();
+    rsa->dmq1 = BN_new();
+    rsa->iqmp = BN_new();
+    rsa->p = p->release();
+    rsa->q = q->release();
+    rsa->e = e->release();
+    if (!rsa->n || !rsa->d || !rsa->dmp1 || !rsa->dmq1 || !rsa->iqmp)
+        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    BN_set_flags(rsa->p, BN_FLG_CONSTTIME);
+    BN_set_flags(rsa->q, BN_FLG_CONSTTIME);
+    BN_set_flags(p_minus_one.get(), BN_FLG_CONSTTIME);
+    BN_set_flags(q_minus_one.get(), BN_FLG_CONSTTIME);
+    BN_set_flags(lcm.get(), BN_FLG_CONSTTIME);
+
+    if (!BN_mul(rsa->n, rsa->p, rsa->q, ctx.get()) ||
+        !BN_sub(p_minus_one.get(), rsa->p, BN_value_one()) ||
+        !BN_sub(q_minus_one.get(), rsa->q, BN_value_one()) ||
+        !BN_gcd(gcd.get(), p_minus_one.get(), q_minus_one.get(), ctx.get()) ||
+        !BN_mul(lcm.get(), p_minus_one.get(), q_minus_one.get(), ctx.get()) ||
+        !BN_div(lcm.get(), nullptr /* rem */, lcm.get(), gcd.get(), ctx.get()) ||
+        !BN_mod_inverse(rsa->d, rsa->e, lcm.get(), ctx.get()) ||
+        !BN_mod(rsa->dmp1, rsa->d, p_minus_one.get(), ctx.get()) ||
+        !BN_mod(rsa->dmq1, rsa->d, q_minus_one.get(), ctx.get()) ||
+        !BN_mod_inverse(rsa->iqmp, rsa->q, rsa->p, ctx.get()))
+        return TranslateLastOpenSslError();
+
+    if (BN_num_bits(rsa->n) != static_cast<int>(key_size) || RSA_check_key(rsa.get()) != 1) {
+        ERR_clear_error();
+        LOG_E("Assembled %u-bit RSA key is inconsistent", key_size);
+        return KM_ERROR_UNKNOWN_ERROR;
+    }
+
+    if (EVP_PKEY_set1_RSA(pkey->get(), rsa.get()) != 1)
+        return TranslateLastOpenSslError();
+    return KM_ERROR_OK;
+}
+
+// The two-prime case of GenerateRsaKey, with p and q searched for at once on pool's threads and
+// the calling one.  BoringSSL gives each thread its own DRBG, so the searches draw from
+// independent random streams without contending for a lock.  OpenSSL 1.0 has one generator behind
+// the global RAND lock, which they share; but the candidates' primality tests, not the random
+// bytes, are what take the time, so the searches still overlap.
+static keymaster_error_t GenerateRsaKeyInParallel(uint32_t key_size, uint64_t public_exponent,
+                                                  WorkerPool* pool,
+                                                  UniquePtr<EVP_PKEY, EVP_PKEY_Delete>* pkey) {
+    BIGNUM_Ptr e(BN_new());
+    if (!e.get())
+        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    if (!BN_set_word(e.get(), public_exponent))
+        return TranslateLastOpenSslError();
+
+    const int prime_bits[2] = {static_cast<int>((key_size + 1) / 2),
+                               static_cast<int>(key_size / 2)};
+    BIGNUM_Ptr primes[2];
+    // Errors a search raises are on the queue of the thread it ran on, so each takes its error
+    // off that queue and hands it back.
+    unsigned long errors[2] = {0, 0};
+    pool->ParallelFor(2 /* count */, [&](size_t i) {
+        primes[i].reset(GenerateRsaPrime(prime_bits[i], e.get()));
+        if (!primes[i].get()) {
+            errors[i] = ERR_peek_last_error();
+            ERR_clear_error();
+        }
+    });
+    for (size_t i = 0; i < 2; ++i)
+        if (!primes[i].get())
+            return TranslateOpenSslError(errors[i]);
+
+    // Primes too close together make the modulus easy to factor (FIPS 186-4 B.3.3 asks for
+    // |p - q| > 2^(nlen/2 - 100)).  This is vanishingly unlikely; the caller starts over.
+    BIGNUM_Ptr difference(BN_new());
+    if (!difference.get())
+        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    if (!BN_sub(difference.get(), primes[0].get(), primes[1].get()))
+        return TranslateLastOpenSslError();
+    if (BN_num_bits(difference.get()) <= prime_bits[1] - 100)
+        return KM_ERROR_UNKNOWN_ERROR;
+
+    return AssembleRsaKey(key_size, &primes[0], &primes[1], &e, pkey);
+}
+
+static EVP_PKEY* PregenerateRsaKey(uint32_t key_size, uint64_t public_exponent,
+                                   uint32_t prime_count) {
+    UniquePtr<EVP_PKEY, EVP_PKEY_Delete> pkey;
+    if (GenerateRsaKey(key_size, public_exponent, prime_count, &pkey) != KM_ERROR_OK)
+        return nullptr;
+    return pkey.release();
+}
+
+RsaKeyFactory::RsaKeyFactory(const KeymasterContext* context)
+    : AsymmetricKeyFactory(context), blinding_queue_size_(0), multi_prime_min_key_size_(0),
+      multi_prime_count_(2), parallel_prime_search_min_key_size_(0),
+      parallel_prime_search_count_(0) {}
+
+RsaKeyFactory::~RsaKeyFactory() {}
+
+keymaster_error_t RsaKeyFactory::EnableKeyPregeneration(const PregeneratedKeySpec* specs,
+                                                        size_t spec_count, size_t pool_size,
+                                                        size_t low_water_mark) {
+    if (key_pool_.get())
+        return KM_ERROR_UNKNOWN_ERROR;
+
+    // The prime count policy is fixed by now; see EnableMultiPrimeKeys.
+    auto generator = [this](uint32_t key_size, uint64_t public_exponent) {
+        return PregenerateRsaKey(key_size, public_exponent, GenerationPrimeCount(key_size));
+    };
+    UniquePtr<PregeneratedKeyPool> key_pool(
+        new (std::nothrow) PregeneratedKeyPool(generator, pool_size, low_water_mark));
+    if (!key_pool.get())
+        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    for (size_t i = 0; i < spec_count; ++i) {
+        if (specs[i].key_size % 8 != 0 || specs[i].key_size > kMaximumRsaKeySize)
+            return KM_ERROR_UNSUPPORTED_KEY_SIZE;
+        key_pool->AddKeySpec(specs[i].key_size, specs[i].public_exponent);
+    }
+    key_pool->Start();
+    key_pool_.reset(key_pool.release());
+    return KM_ERROR_OK;
+}
+
+keymaster_error_t RsaKeyFactory::EnableBlindingPrecomputation(size_t queue_size) {
+    if (blinding_filler_ || queue_size == 0)
+        return KM_ERROR_UNKNOWN_ERROR;
+    blinding_filler_.reset(new (std::nothrow) PrecomputationFiller);
+    if (!blinding_filler_)
+        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    blinding_queue_size_ = queue_size;
+    return KM_ERROR_OK;
+}
+
+keymaster_error_t RsaKeyFactory::EnableMultiPrimeKeys(uint32_t min_key_size,
+                                                      uint32_t prime_count) {
+    if (multi_prime_count_ > 2 || key_pool_.get() || prime_count < 3)
+        return KM_ERROR_UNKNOWN_ERROR;
+    multi_prime_min_key_size_ = min_key_size;
+    multi_prime_count_ = prime_count;
+    return KM_ERROR_OK;
+}
+
+keymaster_error_t RsaKeyFactory::EnableParallelPrimeSearch(uint32_t min_key_size) {
+    if (prime_search_pool_.get())
+        return KM_ERROR_UNKNOWN_ERROR;
+    // The calling thread searches for one prime, and the worker for the other.
+    prime_search_pool_.reset(new (std::nothrow) WorkerPool(1 /* thread_count */));
+    if (!prime_search_pool_.get())
+        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    parallel_prime_search_min_key_size_ = min_key_size;
+    return KM_ERROR_OK;
+}
+
+uint32_t RsaKeyFactory::GenerationPrimeCount(uint32_t key_size) const {
+    if (key_size < multi_prime_min_key_size_)
+        return 2;
+    return std::min(multi_prime_count_, MaxPrimeCount(key_size));
+}
+
+keymaster_error_t RsaKeyFactory::LoadKey(const KeymasterKeyBlob& key_material,
+                                         const AuthorizationSet& additional_params,
+                                         const AuthorizationSet& hw_enforced,
+                                         const AuthorizationSet& sw_enforced,
+                                         UniquePtr<Key>* key) const {
+    keymaster_error_t error = AsymmetricKeyFactory::LoadKey(key_material, additional_params,
+                                                            hw_enforced, sw_enforced, key);
+    if (error != KM_ERROR_OK)
+        return error;
+    RsaKey* rsa_key = static_cast<RsaKey*>(key->get());
+    if (verification_cache_) {
+        error = rsa_key->EnableVerificationCache(verification_cache_);
+        if (error != KM_ERROR_OK)
+            return error;
+    }
+    if (!blinding_filler_)
+        return KM_ERROR_OK;
+    return rsa_key->EnableBlindingQueue(blinding_queue_size_, blinding_filler_);
+}
+
 OperationFactory* RsaKeyFactory::GetOperationFactory(keymaster_purpose_t purpose) const {
     switch (purpose) {
     case KM_PURPOSE_SIGN:
@@ -74,18 +338,29 @@ keymaster_error_t RsaKeyFactory::GenerateKey(const AuthorizationSet& key_descrip
         return KM_ERROR_UNSUPPORTED_KEY_SIZE;
     }
 
-    UniquePtr<BIGNUM, BIGNUM_Delete> exponent(BN_new());
-    UniquePtr<RSA, RsaKey::RSA_Delete> rsa_key(RSA_new());
-    UniquePtr<EVP_PKEY, EVP_PKEY_Delete> pkey(EVP_PKEY_new());
-    if (exponent.get() == NULL || rsa_key.get() == NULL || pkey.get() == NULL)
-        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
-
-    if (!BN_set_word(exponent.get(), public_exponent) ||
-        !RSA_generate_key_ex(rsa_key.get(), key_size, exponent.get(), NULL /* callback */))
-        return TranslateLastOpenSslError();
-
-    if (EVP_PKEY_set1_RSA(pkey.get(), rsa_key.get()) != 1)
-        return TranslateLastOpenSslError();
+    UniquePtr<EVP_PKEY, EVP_PKEY_Delete> pkey;
+    if (key_pool_.get())
+        pkey.reset(key_pool_->Take(key_size, public_exponent));
+    if (!pkey.get()) {
+        uint32_t prime_count = GenerationPrimeCount(key_size);
+        keymaster_error_t error = KM_ERROR_UNKNOWN_ERROR;
+        // An even exponent has no inverse, which RSA_generate_key_ex reports; the prime search
+        // would never end.
+        if (prime_search_pool_.get() && prime_count == 2 &&
+            key_size >= parallel_prime_search_min_key_size_ && public_exponent % 2 == 1 &&
+            public_exponent > 1) {
+            error = GenerateRsaKeyInParallel(key_size, public_exponent, prime_search_pool_.get(),
+                                             &pkey);
+            if (error == KM_ERROR_OK)
+                parallel_prime_search_count_.fetch_add(1, std::memory_order_relaxed);
+            else
+                LOG_W("Parallel RSA prime search failed (%d); generating serially", error);
+        }
+        if (error != KM_ERROR_OK)
+            error = GenerateRsaKey(key_size, public_exponent, prime_count, &pkey);
+        if (error != KM_ERROR_OK)
+            return error;
+    }
 
     KeymasterKeyBlob key_material;
     keymaster_error_t error = EvpKeyToKeyMaterial(pkey.get(), &key_material);
@@ -108,21 +383,23 @@ keymaster_error_t RsaKeyFactory::ImportKey(const AuthorizationSet& key_descripti
     AuthorizationSet authorizations;
     uint64_t public_exponent;
     uint32_t key_size;
-    keymaster_error_t error =
-        UpdateImportKeyDescription(key_description, input_key_material_format, input_key_material,
-                                   &authorizations, &public_exponent, &key_size);
+    KeymasterKeyBlob normalized_key_material;
+    keymaster_error_t error = UpdateImportKeyDescription(
+        key_description, input_key_material_format, input_key_material, &authorizations,
+        &public_exponent, &key_size, &normalized_key_material);
     if (error != KM_ERROR_OK)
         return error;
-    return context_->CreateKeyBlob(authorizations, KM_ORIGIN_IMPORTED, input_key_material,
+    return context_->CreateKeyBlob(authorizations, KM_ORIGIN_IMPORTED,
+                                   normalized_key_material.key_material ? normalized_key_material
+                                                                        : input_key_material,
                                    output_key_blob, hw_enforced, sw_enforced);
 }
 
-keymaster_error_t RsaKeyFactory::UpdateImportKeyDescription(const AuthorizationSet& key_description,
-                                                            keymaster_key_format_t key_format,
-                                                            const KeymasterKeyBlob& key_material,
-                                                            AuthorizationSet* updated_description,
-                                                            uint64_t* public_exponent,
-                                                            uint32_t* key_size) const {
+keymaster_error_t RsaKeyFactory::UpdateImportKeyDescription(
+    const AuthorizationSet& key_description, keymaster_key_format_t key_format,
+    const KeymasterKeyBlob& key_material, AuthorizationSet* updated_description,
+    uint64_t* public_exponent, uint32_t* key_size,
+    KeymasterKeyBlob* normalized_key_material) const {
     if (!updated_description || !public_exponent || !key_size)
         return KM_ERROR_OUTPUT_PARAMETER_NULL;
 
@@ -137,6 +414,8 @@ keymaster_error_t RsaKeyFactory::UpdateImportKeyDescription(const AuthorizationS
         return TranslateLastOpenSslError();
 
     updated_description->Reinitialize(key_description);
+    // Room for the three tags filled in below if the description omits them.
+    updated_description->Reserve(3, 0);
 
     *public_exponent = BN_get_word(rsa_key->e);
     if (*public_exponent == 0xffffffffL)
@@ -158,12 +437,27 @@ keymaster_error_t RsaKeyFactory::UpdateImportKeyDescription(const AuthorizationS
         return KM_ERROR_IMPORT_PARAMETER_MISMATCH;
     }
 
+    size_t prime_count = rsa_prime_count(rsa_key.get());
+    if (prime_count > 2 &&
+        (prime_count > multi_prime_count_ || prime_count > MaxPrimeCount(*key_size))) {
+        LOG_E("Imported %u-bit key has %u primes, more than are allowed", *key_size, prime_count);
+        return KM_ERROR_UNSUPPORTED_KEY_SIZE;
+    }
+
     keymaster_algorithm_t algorithm = KM_ALGORITHM_RSA;
     if (!updated_description->GetTagValue(TAG_ALGORITHM, &algorithm))
         updated_description->push_back(TAG_ALGORITHM, KM_ALGORITHM_RSA);
     if (algorithm != KM_ALGORITHM_RSA)
         return KM_ERROR_IMPORT_PARAMETER_MISMATCH;
 
+    if (normalized_key_material) {
+        error = EncodeCompactPrivateKey(pkey.get(), normalized_key_material);
+        if (error == KM_ERROR_UNSUPPORTED_KEY_FORMAT)
+            normalized_key_material->Clear();
+        else if (error != KM_ERROR_OK)
+            return error;
+    }
+
     return KM_ERROR_OK;
 }
 
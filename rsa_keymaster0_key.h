@@ -63,6 +63,9 @@ class RsaKeymaster0Key : public RsaKey {
     RsaKeymaster0Key(RSA* rsa_key, const AuthorizationSet& hw_enforced,
                      const AuthorizationSet& sw_enforced, keymaster_error_t* error)
         : RsaKey(rsa_key, hw_enforced, sw_enforced, error) {}
+
+    // The private key is in the keymaster0 device, which does its own setup.
+    keymaster_error_t Warmup() const override { return AsymmetricKey::Warmup(); }
 };
 
 }  // namespace keymaster
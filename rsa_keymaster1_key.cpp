@@ -46,6 +46,8 @@ static void UpdateToWorkAroundUnsupportedDigests(const AuthorizationSet& key_des
     bool have_digest_none = false;
     bool have_pad_none = false;
     bool have_padding_requiring_digest = false;
+    // Room for the description plus the entries that may be added below.
+    new_description->Reserve(key_description.size() + 2, key_description.indirect_size());
     for (const keymaster_key_param_t& entry : key_description) {
         new_description->push_back(entry);
 
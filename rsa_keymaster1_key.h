@@ -74,6 +74,9 @@ class RsaKeymaster1Key : public RsaKey {
     RsaKeymaster1Key(RSA* rsa_key, const AuthorizationSet& hw_enforced,
                      const AuthorizationSet& sw_enforced, keymaster_error_t* error)
         : RsaKey(rsa_key, hw_enforced, sw_enforced, error) {}
+
+    // Operations record their keymaster1 handle in the engine data attached to the key.
+    bool shareable() const override { return false; }
 };
 
 }  // namespace keymaster
@@ -43,9 +43,9 @@ keymaster_error_t RsaKeymaster1WrappedOperation::Begin(EVP_PKEY* rsa_key,
     // KM_PAD_NONE is because the hardware can perform those padding modes, since they don't involve
     // digesting.
     //
-    // We also cache in the key the padding value that we expect to be passed to the engine crypto
-    // operation.  This just allows us to double-check that the correct padding value is reaching
-    // that layer.
+    // We also keep in the finish context the padding value that we expect to be passed to the
+    // engine crypto operation.  This just allows us to double-check that the correct padding value
+    // is reaching that layer.
     AuthorizationSet begin_params(input_params);
     int pos = begin_params.find(TAG_DIGEST);
     if (pos == -1)
@@ -59,13 +59,13 @@ keymaster_error_t RsaKeymaster1WrappedOperation::Begin(EVP_PKEY* rsa_key,
 
     case KM_PAD_RSA_PSS:
     case KM_PAD_RSA_OAEP:
-        key_data->expected_openssl_padding = RSA_NO_PADDING;
+        finish_context_.expected_openssl_padding = RSA_NO_PADDING;
         begin_params[pos].enumerated = KM_PAD_NONE;
         break;
 
     case KM_PAD_RSA_PKCS1_1_5_ENCRYPT:
     case KM_PAD_RSA_PKCS1_1_5_SIGN:
-        key_data->expected_openssl_padding = RSA_PKCS1_PADDING;
+        finish_context_.expected_openssl_padding = RSA_PKCS1_PADDING;
         break;
     }
 
@@ -81,8 +81,9 @@ RsaKeymaster1WrappedOperation::PrepareFinish(EVP_PKEY* rsa_key,
         LOG_E("Could not get extended key data... not a Keymaster1Engine key?", 0);
         return KM_ERROR_UNKNOWN_ERROR;
     }
-    key_data->op_handle = operation_handle_;
-    key_data->finish_params.Reinitialize(input_params);
+    finish_context_.op_handle = operation_handle_;
+    finish_context_.finish_params.Reinitialize(input_params);
+    finish_context_.error = KM_ERROR_OK;
 
     return KM_ERROR_OK;
 }
@@ -91,13 +92,6 @@ keymaster_error_t RsaKeymaster1WrappedOperation::Abort() {
     return engine_->device()->abort(engine_->device(), operation_handle_);
 }
 
-keymaster_error_t RsaKeymaster1WrappedOperation::GetError(EVP_PKEY* rsa_key) {
-    Keymaster1Engine::KeyData* key_data = engine_->GetData(rsa_key);  // key_data is owned by rsa
-    if (!key_data)
-        return KM_ERROR_UNKNOWN_ERROR;
-    return key_data->error;
-}
-
 static EVP_PKEY* GetEvpKey(const RsaKeymaster1Key& key, keymaster_error_t* error) {
     if (!key.key()) {
         *error = KM_ERROR_UNKNOWN_ERROR;
@@ -41,12 +41,14 @@ class RsaKeymaster1WrappedOperation {
     void Finish() { operation_handle_ = 0; }
     keymaster_error_t Abort();
 
-    keymaster_error_t GetError(EVP_PKEY* rsa_key);
+    keymaster_error_t GetError() const { return finish_context_.error; }
+    Keymaster1Engine::FinishContext* finish_context() { return &finish_context_; }
 
   protected:
     keymaster_purpose_t purpose_;
     keymaster_operation_handle_t operation_handle_;
     const Keymaster1Engine* engine_;
+    Keymaster1Engine::FinishContext finish_context_;
 };
 
 template <typename BaseOperation> class RsaKeymaster1Operation : public BaseOperation {
@@ -75,9 +77,12 @@ template <typename BaseOperation> class RsaKeymaster1Operation : public BaseOper
         keymaster_error_t error = wrapped_operation_.PrepareFinish(super::rsa_key_, input_params);
         if (error != KM_ERROR_OK)
             return error;
-        error = super::Finish(input_params, input, signature, output_params, output);
-        if (wrapped_operation_.GetError(super::rsa_key_) != KM_ERROR_OK)
-            error = wrapped_operation_.GetError(super::rsa_key_);
+        {
+            Keymaster1Engine::FinishScope scope(wrapped_operation_.finish_context());
+            error = super::Finish(input_params, input, signature, output_params, output);
+        }
+        if (wrapped_operation_.GetError() != KM_ERROR_OK)
+            error = wrapped_operation_.GetError();
         if (error == KM_ERROR_OK)
             wrapped_operation_.Finish();
         return error;
@@ -91,6 +96,8 @@ template <typename BaseOperation> class RsaKeymaster1Operation : public BaseOper
     }
 
   private:
+    size_t object_size() const override { return sizeof(*this); }
+
     RsaKeymaster1WrappedOperation wrapped_operation_;
 };
 
@@ -19,6 +19,7 @@
 #include <limits.h>
 
 #include <new>
+#include <utility>
 
 #include <openssl/err.h>
 
@@ -45,12 +46,10 @@ EVP_PKEY* RsaOperationFactory::GetRsaKey(const Key& key, keymaster_error_t* erro
         return nullptr;
     }
 
-    UniquePtr<EVP_PKEY, EVP_PKEY_Delete> pkey(EVP_PKEY_new());
-    if (!rsa_key->InternalToEvp(pkey.get())) {
+    EVP_PKEY* pkey = rsa_key->GetEvpKey();
+    if (!pkey)
         *error = KM_ERROR_UNKNOWN_ERROR;
-        return nullptr;
-    }
-    return pkey.release();
+    return pkey;
 }
 
 static const keymaster_digest_t supported_digests[] = {
@@ -81,11 +80,95 @@ RsaOperation* RsaOperationFactory::CreateRsaOperation(const Key& key,
         return nullptr;
 
     RsaOperation* op = InstantiateOperation(digest, padding, rsa.release());
-    if (!op)
+    if (!op) {
         *error = KM_ERROR_MEMORY_ALLOCATION_FAILED;
+        return nullptr;
+    }
+
+    const RsaKey& rsa_key = static_cast<const RsaKey&>(key);
+    if (purpose() == KM_PURPOSE_ENCRYPT || purpose() == KM_PURPOSE_DECRYPT)
+        op->set_pkey_context_cache(rsa_key.pkey_context_cache());
+    else
+        static_cast<RsaDigestingOperation*>(op)->set_digest_context_cache(
+            rsa_key.digest_context_cache());
+    if (rsa_key.blinding_queue() &&
+        (purpose() == KM_PURPOSE_SIGN || purpose() == KM_PURPOSE_DECRYPT))
+        op->EnablePrecomputedBlinding(rsa_key.blinding_queue(), rsa_key.unblinded_key());
+    if (rsa_key.verification_cache() && purpose() == KM_PURPOSE_VERIFY)
+        static_cast<RsaVerifyOperation*>(op)->EnableVerificationCache(
+            rsa_key.verification_cache(), rsa_key.public_key_digest());
     return op;
 }
 
+PrecomputedPairQueue::Generator RsaBlindingGenerator(const RSA* key) {
+    std::shared_ptr<BIGNUM> n(BN_dup(key->n), BN_free);
+    std::shared_ptr<BIGNUM> e(BN_dup(key->e), BN_free);
+    if (!n || !e)
+        return PrecomputedPairQueue::Generator();
+
+    return [n, e](BIGNUM** blind, BIGNUM** unblind) {
+        UniquePtr<BN_CTX, BN_CTX_Delete> ctx(BN_CTX_new());
+        BIGNUM_ClearPtr r(BN_new());
+        if (!ctx.get() || !r.get())
+            return false;
+        BN_set_flags(r.get(), BN_FLG_CONSTTIME);
+        do {
+            if (!BN_rand_range(r.get(), n.get()))
+                return false;
+        } while (BN_is_zero(r.get()));
+
+        // r shares no factor with a valid modulus, except with negligible probability.
+        *unblind = BN_mod_inverse(nullptr /* out */, r.get(), n.get(), ctx.get());
+        *blind = BN_new();
+        return *unblind && *blind && BN_mod_exp(*blind, r.get(), e.get(), n.get(), ctx.get());
+    };
+}
+
+const RsaPkeyContextCache::Template*
+RsaPkeyContextCache::Find(keymaster_purpose_t purpose, keymaster_padding_t padding,
+                          keymaster_digest_t digest) const {
+    for (auto& entry : templates_)
+        if (entry.purpose == purpose && entry.padding == padding && entry.digest == digest)
+            return &entry;
+    return nullptr;
+}
+
+EVP_PKEY_CTX* RsaPkeyContextCache::Duplicate(keymaster_purpose_t purpose,
+                                             keymaster_padding_t padding,
+                                             keymaster_digest_t digest) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    const Template* entry = Find(purpose, padding, digest);
+    if (!entry)
+        return nullptr;
+    EVP_PKEY_CTX* ctx = EVP_PKEY_CTX_dup(entry->ctx.get());
+    if (!ctx)
+        ERR_clear_error();
+    return ctx;
+}
+
+void RsaPkeyContextCache::Store(keymaster_purpose_t purpose, keymaster_padding_t padding,
+                                keymaster_digest_t digest, EVP_PKEY_CTX* ctx) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (Find(purpose, padding, digest))
+        return;
+    Template entry;
+    entry.purpose = purpose;
+    entry.padding = padding;
+    entry.digest = digest;
+    entry.ctx.reset(EVP_PKEY_CTX_dup(ctx));
+    if (!entry.ctx) {
+        // Operations just keep configuring their own contexts.
+        ERR_clear_error();
+        return;
+    }
+    templates_.push_back(std::move(entry));
+}
+
+size_t RsaPkeyContextCache::template_count() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return templates_.size();
+}
+
 static const keymaster_padding_t supported_sig_padding[] = {KM_PAD_NONE, KM_PAD_RSA_PKCS1_1_5_SIGN,
                                                             KM_PAD_RSA_PSS};
 const keymaster_padding_t*
@@ -136,11 +219,78 @@ RsaOperation::~RsaOperation() {
         EVP_PKEY_free(rsa_key_);
 }
 
+void RsaOperation::EnablePrecomputedBlinding(const std::shared_ptr<PrecomputedPairQueue>& queue,
+                                             RSA* unblinded_key) {
+    blinding_queue_ = queue;
+    RSA_up_ref(unblinded_key);
+    unblinded_key_.reset(unblinded_key);
+}
+
+// Writes bn to the len bytes at out, big-endian and left-padded with zeros.
+static bool bn_to_padded_bytes(const BIGNUM* bn, size_t len, uint8_t* out) {
+    size_t bn_len = BN_num_bytes(bn);
+    if (bn_len > len)
+        return false;
+    memset(out, 0, len - bn_len);
+    BN_bn2bin(bn, out + len - bn_len);
+    return true;
+}
+
+bool RsaOperation::TransformWithPrecomputedBlinding(const uint8_t* input, size_t len,
+                                                    uint8_t* output) {
+    if (!blinding_queue_ || len != static_cast<size_t>(RSA_size(unblinded_key_.get())))
+        return false;
+
+    const BIGNUM* n = unblinded_key_->n;
+    UniquePtr<BN_CTX, BN_CTX_Delete> ctx(BN_CTX_new());
+    BIGNUM_ClearPtr value(BN_bin2bn(input, len, nullptr /* ret */));
+    UniquePtr<uint8_t[]> blinded(new (std::nothrow) uint8_t[len]);
+    // Out-of-range input is left to the library, which reports the error.
+    if (!ctx.get() || !value.get() || !blinded.get() || BN_ucmp(value.get(), n) >= 0) {
+        ERR_clear_error();
+        return false;
+    }
+
+    BIGNUM_ClearPtr blind, unblind;
+    if (!blinding_queue_->Take(&blind, &unblind))
+        return false;
+
+    // (input * r^e)^d * r^-1 = input^d mod n.
+    if (!BN_mod_mul(value.get(), value.get(), blind.get(), n, ctx.get()) ||
+        !bn_to_padded_bytes(value.get(), len, blinded.get()) ||
+        RSA_private_encrypt(len, blinded.get(), output, unblinded_key_.get(), RSA_NO_PADDING) !=
+            static_cast<int>(len) ||
+        !BN_bin2bn(output, len, value.get()) ||
+        !BN_mod_mul(value.get(), value.get(), unblind.get(), n, ctx.get()) ||
+        !bn_to_padded_bytes(value.get(), len, output)) {
+        ERR_clear_error();
+        return false;
+    }
+    return true;
+}
+
 keymaster_error_t RsaOperation::Begin(const AuthorizationSet& /* input_params */,
                                       AuthorizationSet* /* output_params */) {
+    // Buffered input is at most one modulus long, and is padded to that length in place, so size
+    // the buffer for it once here.
+    if (buffers_input() && !data_.Reinitialize(EVP_PKEY_size(rsa_key_)))
+        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
     return InitDigest();
 }
 
+bool RsaOperation::buffers_input() const {
+    return purpose() == KM_PURPOSE_ENCRYPT || purpose() == KM_PURPOSE_DECRYPT ||
+           digest_ == KM_DIGEST_NONE;
+}
+
+size_t RsaOperation::preferred_chunk_size() const {
+    return buffers_input() ? EVP_PKEY_size(rsa_key_) : Operation::preferred_chunk_size();
+}
+
+size_t RsaOperation::max_chunk_size() const {
+    return buffers_input() ? EVP_PKEY_size(rsa_key_) : 0;
+}
+
 keymaster_error_t RsaOperation::Update(const AuthorizationSet& /* additional_params */,
                                        const Buffer& input, AuthorizationSet* /* output_params */,
                                        Buffer* /* output */, size_t* input_consumed) {
@@ -159,9 +309,8 @@ keymaster_error_t RsaOperation::Update(const AuthorizationSet& /* additional_par
 keymaster_error_t RsaOperation::StoreData(const Buffer& input, size_t* input_consumed) {
     assert(input_consumed);
 
-    if (!data_.reserve(EVP_PKEY_size(rsa_key_)))
-        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
-    // If the write fails, it's because input length exceeds key size.
+    // The buffer was sized to the key at Begin(), so if the write fails it's because input length
+    // exceeds key size.
     if (!data_.write(input.peek_read(), input.available_read())) {
         LOG_E("Input too long: cannot operate on %u bytes of data with %u-byte RSA key",
               input.available_read() + data_.available_read(), EVP_PKEY_size(rsa_key_));
@@ -234,6 +383,29 @@ RsaDigestingOperation::~RsaDigestingOperation() {
     EVP_MD_CTX_cleanup(&digest_ctx_);
 }
 
+keymaster_error_t RsaDigestingOperation::InitDigestContext() {
+    if (digest_context_cache_ &&
+        digest_context_cache_->CopyTo(purpose(), digest_, padding_, &digest_ctx_))
+        return KM_ERROR_OK;
+
+    bool signing = purpose() == KM_PURPOSE_SIGN;
+    EVP_PKEY_CTX* pkey_ctx;
+    int init_result =
+        signing ? EVP_DigestSignInit(&digest_ctx_, &pkey_ctx, digest_algorithm_,
+                                     nullptr /* engine */, rsa_key_)
+                : EVP_DigestVerifyInit(&digest_ctx_, &pkey_ctx, digest_algorithm_,
+                                       nullptr /* engine */, rsa_key_);
+    if (init_result != 1)
+        return TranslateLastOpenSslError();
+    keymaster_error_t error = SetRsaPaddingInEvpContext(pkey_ctx, signing);
+    if (error != KM_ERROR_OK)
+        return error;
+
+    if (digest_context_cache_)
+        digest_context_cache_->Store(purpose(), digest_, padding_, &digest_ctx_);
+    return KM_ERROR_OK;
+}
+
 int RsaDigestingOperation::GetOpensslPadding(keymaster_error_t* error) {
     *error = KM_ERROR_OK;
     switch (padding_) {
@@ -268,11 +440,7 @@ keymaster_error_t RsaSignOperation::Begin(const AuthorizationSet& input_params,
     if (digest_ == KM_DIGEST_NONE)
         return KM_ERROR_OK;
 
-    EVP_PKEY_CTX* pkey_ctx;
-    if (EVP_DigestSignInit(&digest_ctx_, &pkey_ctx, digest_algorithm_, nullptr /* engine */,
-                           rsa_key_) != 1)
-        return TranslateLastOpenSslError();
-    return SetRsaPaddingInEvpContext(pkey_ctx, true /* signing */);
+    return InitDigestContext();
 }
 
 keymaster_error_t RsaSignOperation::Update(const AuthorizationSet& additional_params,
@@ -304,21 +472,34 @@ keymaster_error_t RsaSignOperation::Finish(const AuthorizationSet& additional_pa
         return SignDigested(output);
 }
 
-static keymaster_error_t zero_pad_left(UniquePtr<uint8_t[]>* dest, size_t padded_len, Buffer& src) {
-    assert(padded_len > src.available_read());
-
-    dest->reset(new uint8_t[padded_len]);
-    if (!dest->get())
-        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+// Left-pads the data in buffer with zeros to padded_len bytes, in place.  The buffer must have room
+// for padded_len bytes, as RsaOperation::Begin() ensures for data_.
+static keymaster_error_t zero_pad_left(size_t padded_len, Buffer* buffer) {
+    assert(padded_len > buffer->available_read());
 
-    size_t padding_len = padded_len - src.available_read();
-    memset(dest->get(), 0, padding_len);
-    if (!src.read(dest->get() + padding_len, src.available_read()))
+    size_t data_len = buffer->available_read();
+    size_t padding_len = padded_len - data_len;
+    if (!buffer->advance_write(padding_len))
         return KM_ERROR_UNKNOWN_ERROR;
 
+    uint8_t* start = buffer->peek_write() - padded_len;
+    memmove(start + padding_len, start, data_len);
+    memset(start, 0, padding_len);
     return KM_ERROR_OK;
 }
 
+// Writes the PKCS#1 v1.5 signature encoding (type 1 block) of the data_len bytes at data to the
+// padded_len bytes at out.  The caller ensures data_len leaves room for the overhead.
+static void pkcs1_type_1_pad(const uint8_t* data, size_t data_len, size_t padded_len,
+                             uint8_t* out) {
+    size_t fill_len = padded_len - data_len - 3;
+    out[0] = 0x00;
+    out[1] = 0x01;
+    memset(out + 2, 0xff, fill_len);
+    out[2 + fill_len] = 0x00;
+    memcpy(out + 3 + fill_len, data, data_len);
+}
+
 keymaster_error_t RsaSignOperation::SignUndigested(Buffer* output) {
     UniquePtr<RSA, RSA_Delete> rsa(EVP_PKEY_get1_RSA(const_cast<EVP_PKEY*>(rsa_key_)));
     if (!rsa.get())
@@ -331,18 +512,19 @@ keymaster_error_t RsaSignOperation::SignUndigested(Buffer* output) {
     int bytes_encrypted;
     switch (padding_) {
     case KM_PAD_NONE: {
-        const uint8_t* to_encrypt = data_.peek_read();
-        UniquePtr<uint8_t[]> zero_padded;
         if (data_.available_read() > key_len) {
             return KM_ERROR_INVALID_INPUT_LENGTH;
         } else if (data_.available_read() < key_len) {
-            keymaster_error_t error = zero_pad_left(&zero_padded, key_len, data_);
+            keymaster_error_t error = zero_pad_left(key_len, &data_);
             if (error != KM_ERROR_OK)
                 return error;
-            to_encrypt = zero_padded.get();
         }
-        bytes_encrypted = RSA_private_encrypt(key_len, to_encrypt, output->peek_write(), rsa.get(),
-                                              RSA_NO_PADDING);
+        const uint8_t* to_encrypt = data_.peek_read();
+        if (TransformWithPrecomputedBlinding(to_encrypt, key_len, output->peek_write()))
+            bytes_encrypted = key_len;
+        else
+            bytes_encrypted = RSA_private_encrypt(key_len, to_encrypt, output->peek_write(),
+                                                  rsa.get(), RSA_NO_PADDING);
         break;
     }
     case KM_PAD_RSA_PKCS1_1_5_SIGN:
@@ -352,6 +534,16 @@ keymaster_error_t RsaSignOperation::SignUndigested(Buffer* output) {
                   data_.available_read(), EVP_PKEY_size(rsa_key_) * 8);
             return KM_ERROR_INVALID_INPUT_LENGTH;
         }
+        if (blinding_queue_) {
+            UniquePtr<uint8_t[]> padded(new (std::nothrow) uint8_t[key_len]);
+            if (!padded.get())
+                return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+            pkcs1_type_1_pad(data_.peek_read(), data_.available_read(), key_len, padded.get());
+            if (TransformWithPrecomputedBlinding(padded.get(), key_len, output->peek_write())) {
+                bytes_encrypted = key_len;
+                break;
+            }
+        }
         bytes_encrypted = RSA_private_encrypt(data_.available_read(), data_.peek_read(),
                                               output->peek_write(), rsa.get(), RSA_PKCS1_PADDING);
         break;
@@ -389,13 +581,11 @@ keymaster_error_t RsaVerifyOperation::Begin(const AuthorizationSet& input_params
     if (error != KM_ERROR_OK)
         return error;
 
+    cached_verification_.Start();
     if (digest_ == KM_DIGEST_NONE)
         return KM_ERROR_OK;
 
-    EVP_PKEY_CTX* pkey_ctx;
-    if (EVP_DigestVerifyInit(&digest_ctx_, &pkey_ctx, digest_algorithm_, NULL, rsa_key_) != 1)
-        return TranslateLastOpenSslError();
-    return SetRsaPaddingInEvpContext(pkey_ctx, false /* signing */);
+    return InitDigestContext();
 }
 
 keymaster_error_t RsaVerifyOperation::Update(const AuthorizationSet& additional_params,
@@ -408,6 +598,7 @@ keymaster_error_t RsaVerifyOperation::Update(const AuthorizationSet& additional_
 
     if (EVP_DigestVerifyUpdate(&digest_ctx_, input.peek_read(), input.available_read()) != 1)
         return TranslateLastOpenSslError();
+    cached_verification_.AddMessage(input.peek_read(), input.available_read());
     *input_consumed = input.available_read();
     return KM_ERROR_OK;
 }
@@ -420,10 +611,24 @@ keymaster_error_t RsaVerifyOperation::Finish(const AuthorizationSet& additional_
     if (error != KM_ERROR_OK)
         return error;
 
+    if (!cached_verification_.enabled()) {
+        if (digest_ == KM_DIGEST_NONE)
+            return VerifyUndigested(signature);
+        else
+            return VerifyDigested(signature);
+    }
+
     if (digest_ == KM_DIGEST_NONE)
-        return VerifyUndigested(signature);
+        cached_verification_.AddMessage(data_.peek_read(), data_.available_read());
+    if (cached_verification_.Lookup(signature))
+        return KM_ERROR_OK;
+    if (digest_ == KM_DIGEST_NONE)
+        error = VerifyUndigested(signature);
     else
-        return VerifyDigested(signature);
+        error = VerifyDigested(signature);
+    if (error == KM_ERROR_OK)
+        cached_verification_.Record();
+    return error;
 }
 
 keymaster_error_t RsaVerifyOperation::VerifyUndigested(const Buffer& signature) {
@@ -513,9 +718,40 @@ int RsaCryptOperation::GetOpensslPadding(keymaster_error_t* error) {
     }
 }
 
-struct EVP_PKEY_CTX_Delete {
-    void operator()(EVP_PKEY_CTX* p) { EVP_PKEY_CTX_free(p); }
-};
+EVP_PKEY_CTX* RsaCryptOperation::NewPkeyContext(keymaster_error_t* error) {
+    if (pkey_context_cache_) {
+        EVP_PKEY_CTX* ctx = pkey_context_cache_->Duplicate(purpose(), padding_, digest_);
+        if (ctx) {
+            *error = KM_ERROR_OK;
+            return ctx;
+        }
+    }
+
+    UniquePtr<EVP_PKEY_CTX, EVP_PKEY_CTX_Delete> ctx(
+        EVP_PKEY_CTX_new(rsa_key_, nullptr /* engine */));
+    if (!ctx.get()) {
+        *error = KM_ERROR_MEMORY_ALLOCATION_FAILED;
+        return nullptr;
+    }
+
+    int init_result = purpose() == KM_PURPOSE_ENCRYPT ? EVP_PKEY_encrypt_init(ctx.get())
+                                                      : EVP_PKEY_decrypt_init(ctx.get());
+    if (init_result <= 0) {
+        *error = TranslateLastOpenSslError();
+        return nullptr;
+    }
+
+    *error = SetRsaPaddingInEvpContext(ctx.get(), false /* signing */);
+    if (*error != KM_ERROR_OK)
+        return nullptr;
+    *error = SetOaepDigestIfRequired(ctx.get());
+    if (*error != KM_ERROR_OK)
+        return nullptr;
+
+    if (pkey_context_cache_)
+        pkey_context_cache_->Store(purpose(), padding_, digest_, ctx.get());
+    return ctx.release();
+}
 
 keymaster_error_t RsaEncryptOperation::Finish(const AuthorizationSet& additional_params,
                                               const Buffer& input, const Buffer& /* signature */,
@@ -528,19 +764,8 @@ keymaster_error_t RsaEncryptOperation::Finish(const AuthorizationSet& additional
     if (error != KM_ERROR_OK)
         return error;
 
-    UniquePtr<EVP_PKEY_CTX, EVP_PKEY_CTX_Delete> ctx(
-        EVP_PKEY_CTX_new(rsa_key_, nullptr /* engine */));
+    UniquePtr<EVP_PKEY_CTX, EVP_PKEY_CTX_Delete> ctx(NewPkeyContext(&error));
     if (!ctx.get())
-        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
-
-    if (EVP_PKEY_encrypt_init(ctx.get()) <= 0)
-        return TranslateLastOpenSslError();
-
-    error = SetRsaPaddingInEvpContext(ctx.get(), false /* signing */);
-    if (error != KM_ERROR_OK)
-        return error;
-    error = SetOaepDigestIfRequired(ctx.get());
-    if (error != KM_ERROR_OK)
         return error;
 
     size_t outlen;
@@ -551,16 +776,13 @@ keymaster_error_t RsaEncryptOperation::Finish(const AuthorizationSet& additional
     if (!output->Reinitialize(outlen))
         return KM_ERROR_MEMORY_ALLOCATION_FAILED;
 
-    const uint8_t* to_encrypt = data_.peek_read();
-    size_t to_encrypt_len = data_.available_read();
-    UniquePtr<uint8_t[]> zero_padded;
-    if (padding_ == KM_PAD_NONE && to_encrypt_len < outlen) {
-        keymaster_error_t error = zero_pad_left(&zero_padded, outlen, data_);
+    if (padding_ == KM_PAD_NONE && data_.available_read() < outlen) {
+        keymaster_error_t error = zero_pad_left(outlen, &data_);
         if (error != KM_ERROR_OK)
             return error;
-        to_encrypt = zero_padded.get();
-        to_encrypt_len = outlen;
     }
+    const uint8_t* to_encrypt = data_.peek_read();
+    size_t to_encrypt_len = data_.available_read();
 
     if (EVP_PKEY_encrypt(ctx.get(), output->peek_write(), &outlen, to_encrypt, to_encrypt_len) <= 0)
         return TranslateLastOpenSslError();
@@ -581,19 +803,8 @@ keymaster_error_t RsaDecryptOperation::Finish(const AuthorizationSet& additional
     if (error != KM_ERROR_OK)
         return error;
 
-    UniquePtr<EVP_PKEY_CTX, EVP_PKEY_CTX_Delete> ctx(
-        EVP_PKEY_CTX_new(rsa_key_, nullptr /* engine */));
+    UniquePtr<EVP_PKEY_CTX, EVP_PKEY_CTX_Delete> ctx(NewPkeyContext(&error));
     if (!ctx.get())
-        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
-
-    if (EVP_PKEY_decrypt_init(ctx.get()) <= 0)
-        return TranslateLastOpenSslError();
-
-    error = SetRsaPaddingInEvpContext(ctx.get(), false /* signing */);
-    if (error != KM_ERROR_OK)
-        return error;
-    error = SetOaepDigestIfRequired(ctx.get());
-    if (error != KM_ERROR_OK)
         return error;
 
     size_t outlen;
@@ -604,18 +815,19 @@ keymaster_error_t RsaDecryptOperation::Finish(const AuthorizationSet& additional
     if (!output->Reinitialize(outlen))
         return KM_ERROR_MEMORY_ALLOCATION_FAILED;
 
-    const uint8_t* to_decrypt = data_.peek_read();
-    size_t to_decrypt_len = data_.available_read();
-    UniquePtr<uint8_t[]> zero_padded;
-    if (padding_ == KM_PAD_NONE && to_decrypt_len < outlen) {
-        keymaster_error_t error = zero_pad_left(&zero_padded, outlen, data_);
+    if (padding_ == KM_PAD_NONE && data_.available_read() < outlen) {
+        keymaster_error_t error = zero_pad_left(outlen, &data_);
         if (error != KM_ERROR_OK)
             return error;
-        to_decrypt = zero_padded.get();
-        to_decrypt_len = outlen;
     }
+    const uint8_t* to_decrypt = data_.peek_read();
+    size_t to_decrypt_len = data_.available_read();
 
-    if (EVP_PKEY_decrypt(ctx.get(), output->peek_write(), &outlen, to_decrypt, to_decrypt_len) <= 0)
+    if (padding_ == KM_PAD_NONE &&
+        TransformWithPrecomputedBlinding(to_decrypt, to_decrypt_len, output->peek_write()))
+        outlen = to_decrypt_len;
+    else if (EVP_PKEY_decrypt(ctx.get(), output->peek_write(), &outlen, to_decrypt,
+                              to_decrypt_len) <= 0)
         return TranslateLastOpenSslError();
     if (!output->advance_write(outlen))
         return KM_ERROR_UNKNOWN_ERROR;
@@ -17,15 +17,62 @@
 #ifndef SYSTEM_KEYMASTER_RSA_OPERATION_H_
 #define SYSTEM_KEYMASTER_RSA_OPERATION_H_
 
+#include <memory>
+#include <mutex>
+#include <vector>
+
 #include <UniquePtr.h>
 
 #include <openssl/evp.h>
 #include <openssl/rsa.h>
 
+#include "digest_context_cache.h"
+#include "openssl_utils.h"
 #include "operation.h"
+#include "precomputed_pair_queue.h"
+#include "verification_cache.h"
 
 namespace keymaster {
 
+/**
+ * RsaPkeyContextCache keeps, for one RSA key, an EVP_PKEY_CTX template per crypting purpose, padding
+ * and digest, already initialized and configured with them, so that each encryption or decryption
+ * duplicates a template rather than repeating the init and ctrl calls.  It's shared by an RsaKey
+ * and the operations created from it.  All methods are internally locked.
+ */
+class RsaPkeyContextCache {
+  public:
+    /**
+     * Returns a duplicate of the template for the configuration, or null if there's none yet or
+     * it can't be duplicated.  The caller owns the result.
+     */
+    EVP_PKEY_CTX* Duplicate(keymaster_purpose_t purpose, keymaster_padding_t padding,
+                            keymaster_digest_t digest) const;
+
+    /**
+     * Keeps a duplicate of ctx, which must be configured for purpose, padding and digest, as the
+     * template for them, unless there is one already.
+     */
+    void Store(keymaster_purpose_t purpose, keymaster_padding_t padding, keymaster_digest_t digest,
+               EVP_PKEY_CTX* ctx);
+
+    size_t template_count() const;
+
+  private:
+    struct Template {
+        keymaster_purpose_t purpose;
+        keymaster_padding_t padding;
+        keymaster_digest_t digest;
+        std::unique_ptr<EVP_PKEY_CTX, EVP_PKEY_CTX_Delete> ctx;
+    };
+
+    const Template* Find(keymaster_purpose_t purpose, keymaster_padding_t padding,
+                         keymaster_digest_t digest) const;
+
+    mutable std::mutex mutex_;
+    std::vector<Template> templates_;
+};
+
 /**
  * Base class for all RSA operations.
  *
@@ -49,19 +96,53 @@ class RsaOperation : public Operation {
     keymaster_padding_t padding() const { return padding_; }
     keymaster_digest_t digest() const { return digest_; }
 
+    // Operations that buffer their input take at most one modulus of it.
+    size_t preferred_chunk_size() const override;
+    size_t max_chunk_size() const override;
+
+    /**
+     * Blinds the operation's raw private-key transforms with pairs taken from queue, applying the
+     * key through unblinded_key, a copy of it with the library's own blinding disabled.  When no
+     * pair is ready the operation uses the library's blinding as usual.
+     */
+    void EnablePrecomputedBlinding(const std::shared_ptr<PrecomputedPairQueue>& queue,
+                                   RSA* unblinded_key);
+
+    /**
+     * Takes the operation's EVP_PKEY_CTX configurations from, and adds them to, context_cache.
+     */
+    void set_pkey_context_cache(const std::shared_ptr<RsaPkeyContextCache>& context_cache) {
+        pkey_context_cache_ = context_cache;
+    }
+
   protected:
+    size_t buffer_bytes() const override { return data_.buffer_size(); }
+
     virtual int GetOpensslPadding(keymaster_error_t* error) = 0;
     virtual bool require_digest() const = 0;
 
+    // Whether the operation buffers its input in data_ rather than digesting it.
+    bool buffers_input() const;
     keymaster_error_t StoreData(const Buffer& input, size_t* input_consumed);
     keymaster_error_t SetRsaPaddingInEvpContext(EVP_PKEY_CTX* pkey_ctx, bool signing);
     keymaster_error_t InitDigest();
 
+    /**
+     * Applies the private key to len bytes of input, which must be the size of the modulus, using
+     * a precomputed blinding pair, and writes len bytes to output.  Returns false if precomputed
+     * blinding isn't enabled, no pair is ready or the transform fails; the caller then falls back
+     * to the library.
+     */
+    bool TransformWithPrecomputedBlinding(const uint8_t* input, size_t len, uint8_t* output);
+
     EVP_PKEY* rsa_key_;
     const keymaster_padding_t padding_;
     Buffer data_;
     const keymaster_digest_t digest_;
     const EVP_MD* digest_algorithm_;
+    std::shared_ptr<PrecomputedPairQueue> blinding_queue_;
+    UniquePtr<RSA, RSA_Delete> unblinded_key_;
+    std::shared_ptr<RsaPkeyContextCache> pkey_context_cache_;
 };
 
 /**
@@ -76,10 +157,23 @@ class RsaDigestingOperation : public RsaOperation {
                           keymaster_padding_t padding, EVP_PKEY* key);
     ~RsaDigestingOperation();
 
+    /**
+     * Takes the operation's initialized digest contexts from, and adds them to, context_cache.
+     */
+    void set_digest_context_cache(const std::shared_ptr<DigestContextCache>& context_cache) {
+        digest_context_cache_ = context_cache;
+    }
+
   protected:
     int GetOpensslPadding(keymaster_error_t* error) override;
     bool require_digest() const override { return padding_ == KM_PAD_RSA_PSS; }
+
+    // Initializes digest_ctx_ to sign or verify, per the purpose, with the key, digest and
+    // padding, by copying the template in digest_context_cache_ when there is one.
+    keymaster_error_t InitDigestContext();
+
     EVP_MD_CTX digest_ctx_;
+    std::shared_ptr<DigestContextCache> digest_context_cache_;
 };
 
 /**
@@ -100,6 +194,8 @@ class RsaSignOperation : public RsaDigestingOperation {
                              Buffer* output) override;
 
   private:
+    size_t object_size() const override { return sizeof(*this); }
+
     keymaster_error_t SignUndigested(Buffer* output);
     keymaster_error_t SignDigested(Buffer* output);
 };
@@ -121,9 +217,22 @@ class RsaVerifyOperation : public RsaDigestingOperation {
                              const Buffer& signature, AuthorizationSet* output_params,
                              Buffer* output) override;
 
+    /**
+     * Makes Finish skip verifying signatures that cache holds for the key whose public key digest
+     * is key_digest, and add those that verify.
+     */
+    void EnableVerificationCache(const std::shared_ptr<VerificationCache>& cache,
+                                 const VerificationCache::Digest& key_digest) {
+        cached_verification_.Enable(cache, key_digest, digest_, padding_);
+    }
+
   private:
+    size_t object_size() const override { return sizeof(*this); }
+
     keymaster_error_t VerifyUndigested(const Buffer& signature);
     keymaster_error_t VerifyDigested(const Buffer& signature);
+
+    CachedVerification cached_verification_;
 };
 
 /**
@@ -138,6 +247,12 @@ class RsaCryptOperation : public RsaOperation {
   protected:
     keymaster_error_t SetOaepDigestIfRequired(EVP_PKEY_CTX* pkey_ctx);
 
+    /**
+     * Returns a context for the key initialized for the operation's purpose and configured with
+     * its padding and digest, or null with *error set.  The caller owns the result.
+     */
+    EVP_PKEY_CTX* NewPkeyContext(keymaster_error_t* error);
+
   private:
     int GetOpensslPadding(keymaster_error_t* error) override;
     bool require_digest() const override { return padding_ == KM_PAD_RSA_OAEP; }
@@ -153,6 +268,9 @@ class RsaEncryptOperation : public RsaCryptOperation {
     keymaster_error_t Finish(const AuthorizationSet& additional_params, const Buffer& input,
                              const Buffer& signature, AuthorizationSet* output_params,
                              Buffer* output) override;
+
+  private:
+    size_t object_size() const override { return sizeof(*this); }
 };
 
 /**
@@ -165,8 +283,17 @@ class RsaDecryptOperation : public RsaCryptOperation {
     keymaster_error_t Finish(const AuthorizationSet& additional_params, const Buffer& input,
                              const Buffer& signature, AuthorizationSet* output_params,
                              Buffer* output) override;
+
+  private:
+    size_t object_size() const override { return sizeof(*this); }
 };
 
+/**
+ * Returns a generator of RSA blinding pairs (r^e mod n, r^-1 mod n) for key's public modulus and
+ * exponent, with r random, or an empty generator if the key's public half can't be copied.
+ */
+PrecomputedPairQueue::Generator RsaBlindingGenerator(const RSA* key);
+
 /**
  * Abstract base for all RSA operation factories.  This class exists mainly to centralize some code
  * common to all RSA operation factories.
@@ -0,0 +1,173 @@
+/*
+ * Copyright 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "secure_arena.h"
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <new>
+
+#include <keymaster/android_keymaster_utils.h>
+#include <keymaster/logger.h>
+
+namespace keymaster {
+
+SecureArena* SecureArena::default_ = nullptr;
+SecureArena* SecureArena::arenas_ = nullptr;
+std::atomic<size_t> SecureArena::arena_count_(0);
+
+static std::mutex arena_list_mutex;
+
+const size_t SecureArena::kMaxAllocation;
+
+SecureArena::SecureArena(size_t capacity)
+    : mapping_(nullptr), mapping_size_(0), base_(nullptr), capacity_(0), locked_(false),
+      next_arena_(nullptr), carved_(0) {
+    for (size_t i = 0; i < kSizeClassCount; ++i)
+        free_[i] = nullptr;
+
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    size_t region_size = (capacity + page_size - 1) / page_size * page_size;
+    if (region_size == 0)
+        return;
+
+    // One guard page either side of the region.
+    size_t mapping_size = region_size + 2 * page_size;
+    void* mapping = mmap(nullptr, mapping_size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mapping == MAP_FAILED) {
+        LOG_E("Can't map %d-byte secure arena", mapping_size);
+        return;
+    }
+    mapping_ = static_cast<uint8_t*>(mapping);
+    mapping_size_ = mapping_size;
+    if (mprotect(mapping_ + page_size, region_size, PROT_READ | PROT_WRITE) != 0) {
+        LOG_E("Can't make secure arena accessible", 0);
+        return;
+    }
+    base_ = mapping_ + page_size;
+    capacity_ = region_size;
+
+    locked_ = mlock(base_, capacity_) == 0;
+    if (!locked_)
+        LOG_W("Can't lock secure arena; secrets in it may be swapped", 0);
+#ifdef MADV_DONTDUMP
+    madvise(base_, capacity_, MADV_DONTDUMP);
+#endif
+
+    std::lock_guard<std::mutex> lock(arena_list_mutex);
+    next_arena_ = arenas_;
+    arenas_ = this;
+    arena_count_.fetch_add(1, std::memory_order_release);
+}
+
+SecureArena::~SecureArena() {
+    if (!mapping_)
+        return;
+    if (base_) {
+        {
+            std::lock_guard<std::mutex> lock(arena_list_mutex);
+            SecureArena** link = &arenas_;
+            while (*link != this)
+                link = &(*link)->next_arena_;
+            *link = next_arena_;
+            arena_count_.fetch_sub(1, std::memory_order_release);
+        }
+        memset_s(base_, 0, capacity_);
+        if (locked_)
+            munlock(base_, capacity_);
+    }
+    munmap(mapping_, mapping_size_);
+}
+
+/* static */
+size_t SecureArena::SizeClass(size_t size) {
+    size_t size_class = 0;
+    for (size_t class_size = kMinAllocation; class_size < size; class_size <<= 1)
+        ++size_class;
+    return size_class;
+}
+
+/* static */
+SecureArena* SecureArena::FindOwner(const void* buf) {
+    // A buffer from an arena can only be freed while that arena is live, and the arena was counted
+    // before it served the buffer, so a zero count means buf is a heap buffer.
+    if (arena_count() == 0)
+        return nullptr;
+    std::lock_guard<std::mutex> lock(arena_list_mutex);
+    for (SecureArena* arena = arenas_; arena; arena = arena->next_arena_)
+        if (arena->Owns(buf))
+            return arena;
+    return nullptr;
+}
+
+uint8_t* SecureArena::Allocate(size_t size) {
+    if (size == 0 || size > kMaxAllocation || !base_)
+        return nullptr;
+    size_t size_class = SizeClass(size);
+    size_t class_size = kMinAllocation << size_class;
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (free_[size_class]) {
+        FreeBuffer* buf = free_[size_class];
+        free_[size_class] = buf->next;
+        buf->next = nullptr;
+        return reinterpret_cast<uint8_t*>(buf);
+    }
+    if (capacity_ - carved_ < class_size)
+        return nullptr;
+    uint8_t* buf = base_ + carved_;
+    carved_ += class_size;
+    return buf;
+}
+
+void SecureArena::Free(uint8_t* buf, size_t size) {
+    if (!buf)
+        return;
+    size_t size_class = SizeClass(size);
+    memset_s(buf, 0, kMinAllocation << size_class);
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    FreeBuffer* free_buf = reinterpret_cast<FreeBuffer*>(buf);
+    free_buf->next = free_[size_class];
+    free_[size_class] = free_buf;
+}
+
+uint8_t* AllocateSecret(size_t size) {
+    SecureArena* arena = SecureArena::get_default();
+    uint8_t* buf = arena ? arena->Allocate(size) : nullptr;
+    if (buf)
+        return buf;
+
+    buf = new (std::nothrow) uint8_t[size];
+    if (buf)
+        AllocationCounter::Count(size);
+    return buf;
+}
+
+void FreeSecret(uint8_t* buf, size_t size) {
+    if (!buf)
+        return;
+    SecureArena* arena = SecureArena::FindOwner(buf);
+    if (arena) {
+        arena->Free(buf, size);
+        return;
+    }
+    memset_s(buf, 0, size);
+    delete[] buf;
+}
+
+}  // namespace keymaster
@@ -0,0 +1,134 @@
+/*
+ * Copyright 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SYSTEM_KEYMASTER_SECURE_ARENA_H_
+#define SYSTEM_KEYMASTER_SECURE_ARENA_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <mutex>
+
+namespace keymaster {
+
+/**
+ * SecureArena is a fixed-size region for secret buffers, such as raw symmetric keys, kept apart
+ * from the general heap.  The region is mlock'd so it never reaches swap, excluded from core dumps
+ * where the platform supports it, and bracketed by inaccessible guard pages so that overruns off
+ * either end fault rather than reading or corrupting neighbouring memory.
+ *
+ * Allocations are rounded up to a power-of-two size class, from 16 bytes to kMaxAllocation, and
+ * served from a per-class freelist, or carved from the unused part of the region when the freelist
+ * is empty.  Freed buffers are wiped before they go back on their freelist.  Memory is never
+ * returned to the region, so a long-lived arena settles into the mix of sizes its callers use.
+ * All methods are internally locked.
+ */
+class SecureArena {
+  public:
+    static const size_t kMaxAllocation = 4096;
+
+    /**
+     * Maps an arena of at least capacity bytes, rounded up to whole pages.  Check initialized()
+     * before use; if the region can't be mapped every Allocate fails.  Failing to lock the region,
+     * e.g. because RLIMIT_MEMLOCK is too low, isn't fatal; locked() reports it.
+     */
+    explicit SecureArena(size_t capacity);
+    ~SecureArena();
+
+    bool initialized() const { return base_ != nullptr; }
+    bool locked() const { return locked_; }
+    size_t capacity() const { return capacity_; }
+
+    /**
+     * Returns a buffer of at least size bytes, or null if size is 0 or more than kMaxAllocation,
+     * or the arena is full.
+     */
+    uint8_t* Allocate(size_t size);
+
+    /**
+     * Wipes and frees buf, which must have come from Allocate with the same size.
+     */
+    void Free(uint8_t* buf, size_t size);
+
+    bool Owns(const void* buf) const {
+        const uint8_t* p = static_cast<const uint8_t*>(buf);
+        return p >= base_ && p < base_ + capacity_;
+    }
+
+    /**
+     * Returns the live arena whose region holds buf, or null if it's in none of them.
+     */
+    static SecureArena* FindOwner(const void* buf);
+
+    /**
+     * Returns the number of live arenas.  While it's zero FindOwner() answers without locking, so
+     * freeing heap secrets costs nothing extra on devices that never create an arena.
+     */
+    static size_t arena_count() { return arena_count_.load(std::memory_order_acquire); }
+
+    /**
+     * Makes AllocateSecret() use arena, or the heap if arena is null.  Like
+     * Buffer::set_default_pool() this is global.  FreeSecret() returns each buffer to the arena
+     * whose region holds it, whichever is the default by then, so the default may change while
+     * buffers are live; but each arena must outlive the buffers it served.
+     */
+    static void set_default(SecureArena* arena) { default_ = arena; }
+    static SecureArena* get_default() { return default_; }
+
+  private:
+    static const size_t kMinAllocation = 16;
+    static const size_t kSizeClassCount = 9;  // 16 to 4096 bytes.
+
+    struct FreeBuffer {
+        FreeBuffer* next;
+    };
+
+    static size_t SizeClass(size_t size);
+
+    static SecureArena* default_;
+    // Every initialized arena, linked through next_arena_ under arena_list_mutex.
+    static SecureArena* arenas_;
+    // The length of arenas_, changed under arena_list_mutex but read without it.
+    static std::atomic<size_t> arena_count_;
+
+    uint8_t* mapping_;
+    size_t mapping_size_;
+    uint8_t* base_;
+    size_t capacity_;
+    bool locked_;
+    SecureArena* next_arena_;
+
+    std::mutex mutex_;
+    // Bytes at the start of the region that have been carved into buffers.
+    size_t carved_;
+    FreeBuffer* free_[kSizeClassCount];
+
+    // Disallow copying and assignment.
+    SecureArena(const SecureArena&);
+    void operator=(const SecureArena&);
+};
+
+/**
+ * Returns size bytes for secret data from the default SecureArena, or from the heap if there's
+ * none or it can't serve the request.  Free the buffer with FreeSecret(), which wipes it.
+ */
+uint8_t* AllocateSecret(size_t size);
+void FreeSecret(uint8_t* buf, size_t size);
+
+}  // namespace keymaster
+
+#endif  // SYSTEM_KEYMASTER_SECURE_ARENA_H_
@@ -0,0 +1,158 @@
+/*
+ * Copyright 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "secure_arena.h"
+
+#include <set>
+
+#include <gtest/gtest.h>
+
+namespace keymaster {
+namespace test {
+
+const size_t kArenaSize = 16 * 1024;
+
+TEST(SecureArenaTest, AllocatesDistinctBuffers) {
+    SecureArena arena(kArenaSize);
+    ASSERT_TRUE(arena.initialized());
+    EXPECT_GE(arena.capacity(), kArenaSize);
+
+    std::set<uint8_t*> buffers;
+    for (size_t size : {1, 16, 17, 32, 100, 1000, 4096}) {
+        uint8_t* buf = arena.Allocate(size);
+        ASSERT_TRUE(buf != nullptr);
+        EXPECT_TRUE(arena.Owns(buf));
+        EXPECT_TRUE(arena.Owns(buf + size - 1));
+        memset(buf, 0xa5, size);
+        EXPECT_TRUE(buffers.insert(buf).second);
+    }
+    EXPECT_TRUE(arena.Allocate(0) == nullptr);
+    EXPECT_TRUE(arena.Allocate(SecureArena::kMaxAllocation + 1) == nullptr);
+
+    uint8_t heap_buf[16];
+    EXPECT_FALSE(arena.Owns(heap_buf));
+}
+
+TEST(SecureArenaTest, FreedBuffersAreWipedAndReused) {
+    SecureArena arena(kArenaSize);
+    ASSERT_TRUE(arena.initialized());
+
+    uint8_t* buf = arena.Allocate(32);
+    ASSERT_TRUE(buf != nullptr);
+    memset(buf, 0xa5, 32);
+    arena.Free(buf, 32);
+    for (size_t i = 0; i < 32; ++i)
+        EXPECT_EQ(0, buf[i]);
+
+    // Any size in the same class gets the freed buffer back.
+    EXPECT_EQ(buf, arena.Allocate(20));
+    EXPECT_NE(buf, arena.Allocate(20));
+}
+
+TEST(SecureArenaTest, Full) {
+    SecureArena arena(kArenaSize);
+    ASSERT_TRUE(arena.initialized());
+
+    size_t count = arena.capacity() / SecureArena::kMaxAllocation;
+    uint8_t* last = nullptr;
+    for (size_t i = 0; i < count; ++i) {
+        last = arena.Allocate(SecureArena::kMaxAllocation);
+        ASSERT_TRUE(last != nullptr);
+    }
+    EXPECT_TRUE(arena.Allocate(1) == nullptr);
+
+    arena.Free(last, SecureArena::kMaxAllocation);
+    EXPECT_EQ(last, arena.Allocate(SecureArena::kMaxAllocation));
+}
+
+TEST(SecureArenaTest, GuardPages) {
+    SecureArena arena(kArenaSize);
+    ASSERT_TRUE(arena.initialized());
+
+    uint8_t* first = arena.Allocate(16);
+    ASSERT_TRUE(first != nullptr);
+    EXPECT_DEATH(*(static_cast<volatile uint8_t*>(first) - 1) = 0, "");
+}
+
+TEST(SecureArenaTest, AllocateSecret) {
+    // Without a default arena, secrets come from the heap.
+    uint8_t* heap_secret = AllocateSecret(32);
+    ASSERT_TRUE(heap_secret != nullptr);
+
+    SecureArena arena(kArenaSize);
+    ASSERT_TRUE(arena.initialized());
+    SecureArena::set_default(&arena);
+    uint8_t* secret = AllocateSecret(32);
+    EXPECT_TRUE(arena.Owns(secret));
+    // Too large for the arena, so it falls back to the heap.
+    uint8_t* large_secret = AllocateSecret(SecureArena::kMaxAllocation + 1);
+    ASSERT_TRUE(large_secret != nullptr);
+    EXPECT_FALSE(arena.Owns(large_secret));
+
+    FreeSecret(secret, 32);
+    FreeSecret(large_secret, SecureArena::kMaxAllocation + 1);
+    EXPECT_EQ(secret, arena.Allocate(32));
+    SecureArena::set_default(nullptr);
+
+    FreeSecret(heap_secret, 32);
+}
+
+TEST(SecureArenaTest, ArenaCount) {
+    size_t before = SecureArena::arena_count();
+    uint8_t heap_buf[16];
+    EXPECT_TRUE(SecureArena::FindOwner(heap_buf) == nullptr);
+    {
+        SecureArena arena(kArenaSize);
+        ASSERT_TRUE(arena.initialized());
+        EXPECT_EQ(before + 1, SecureArena::arena_count());
+        EXPECT_EQ(&arena, SecureArena::FindOwner(arena.Allocate(16)));
+        EXPECT_TRUE(SecureArena::FindOwner(heap_buf) == nullptr);
+    }
+    EXPECT_EQ(before, SecureArena::arena_count());
+
+    // With no arenas left, heap secrets are still wiped and freed.
+    uint8_t* heap_secret = AllocateSecret(32);
+    ASSERT_TRUE(heap_secret != nullptr);
+    FreeSecret(heap_secret, 32);
+}
+
+TEST(SecureArenaTest, FreeSecretAfterDefaultChanges) {
+    SecureArena first(kArenaSize);
+    SecureArena second(kArenaSize);
+    ASSERT_TRUE(first.initialized() && second.initialized());
+    EXPECT_EQ(&first, SecureArena::FindOwner(first.Allocate(16)));
+    EXPECT_EQ(&second, SecureArena::FindOwner(second.Allocate(16)));
+    uint8_t heap_buf[16];
+    EXPECT_TRUE(SecureArena::FindOwner(heap_buf) == nullptr);
+
+    SecureArena::set_default(&first);
+    uint8_t* secret = AllocateSecret(32);
+    ASSERT_TRUE(first.Owns(secret));
+    SecureArena::set_default(nullptr);
+    uint8_t* heap_secret = AllocateSecret(32);
+    ASSERT_TRUE(heap_secret != nullptr);
+    SecureArena::set_default(&second);
+
+    // Each buffer goes back where it came from, not to whichever arena is now the default.
+    FreeSecret(secret, 32);
+    FreeSecret(heap_secret, 32);
+    EXPECT_EQ(secret, first.Allocate(32));
+    EXPECT_NE(heap_secret, second.Allocate(32));
+    SecureArena::set_default(nullptr);
+}
+
+}  // namespace test
+}  // namespace keymaster
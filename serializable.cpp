@@ -20,10 +20,29 @@
 
 #include <new>
 
+#include <keymaster/allocation_counter.h>
 #include <keymaster/android_keymaster_utils.h>
 
 namespace keymaster {
 
+bool Serializable::SerializeTo(SerializationSink* sink) const {
+    size_t size = SerializedSize();
+    UniquePtr<uint8_t[]> buf(new (std::nothrow) uint8_t[size]);
+    if (!buf.get())
+        return false;
+    Serialize(buf.get(), buf.get() + size);
+    return sink->Write(buf.get(), size);
+}
+
+bool Serializable::SerializeToSegments(SerializationSegments* segments) const {
+    size_t size = SerializedSize();
+    uint8_t* buf = segments->Reserve(size);
+    if (!buf)
+        return false;
+    Serialize(buf, buf + size);
+    return true;
+}
+
 uint8_t* append_to_buf(uint8_t* buf, const uint8_t* end, const void* data, size_t data_len) {
     if (__pval(buf) + data_len < __pval(buf))  // Pointer wrap check
         return buf;
@@ -46,9 +65,45 @@ bool copy_from_buf(const uint8_t** buf_ptr, const uint8_t* end, void* dest, size
     return true;
 }
 
+uint8_t* append_varint_to_buf(uint8_t* buf, const uint8_t* end, uint64_t value) {
+    uint8_t varint[MAX_VARINT_SIZE];
+    size_t size = 0;
+    while (value >= 0x80) {
+        varint[size++] = static_cast<uint8_t>(value) | 0x80;
+        value >>= 7;
+    }
+    varint[size++] = static_cast<uint8_t>(value);
+    return append_to_buf(buf, end, varint, size);
+}
+
+bool copy_varint_from_buf(const uint8_t** buf_ptr, const uint8_t* end, uint64_t* value) {
+    uint64_t result = 0;
+    const uint8_t* p = *buf_ptr;
+    for (size_t shift = 0; shift < 64; shift += 7) {
+        if (p >= end)
+            return false;
+        uint8_t byte = *p++;
+        // The tenth byte holds only the top bit.
+        if (shift == 63 && byte > 1)
+            return false;
+        result |= static_cast<uint64_t>(byte & 0x7F) << shift;
+        if (!(byte & 0x80)) {
+            *buf_ptr = p;
+            *value = result;
+            return true;
+        }
+    }
+    return false;
+}
+
 bool copy_size_and_data_from_buf(const uint8_t** buf_ptr, const uint8_t* end, size_t* size,
                                  UniquePtr<uint8_t[]>* dest) {
-    if (!copy_uint32_from_buf(buf_ptr, end, size))
+    return copy_size_and_data_from_buf(buf_ptr, end, size, dest, FIXED_WIDTH_FORMAT);
+}
+
+bool copy_size_and_data_from_buf(const uint8_t** buf_ptr, const uint8_t* end, size_t* size,
+                                 UniquePtr<uint8_t[]>* dest, SerializationFormat format) {
+    if (!copy_uint32_from_buf(buf_ptr, end, size, format))
         return false;
 
     if (__pval(*buf_ptr) + *size < __pval(*buf_ptr))  // Pointer wrap check
@@ -64,18 +119,43 @@ bool copy_size_and_data_from_buf(const uint8_t** buf_ptr, const uint8_t* end, si
     dest->reset(new (std::nothrow) uint8_t[*size]);
     if (!dest->get())
         return false;
+    AllocationCounter::Count(*size);
     return copy_from_buf(buf_ptr, end, dest->get(), *size);
 }
 
+bool skip_size_and_data_in_buf(const uint8_t** buf_ptr, const uint8_t* end, size_t* size) {
+    return skip_size_and_data_in_buf(buf_ptr, end, size, FIXED_WIDTH_FORMAT);
+}
+
+bool skip_size_and_data_in_buf(const uint8_t** buf_ptr, const uint8_t* end, size_t* size,
+                               SerializationFormat format) {
+    size_t data_size;
+    if (!copy_uint32_from_buf(buf_ptr, end, &data_size, format))
+        return false;
+
+    if (__pval(*buf_ptr) + data_size < __pval(*buf_ptr))  // Pointer wrap check
+        return false;
+
+    if (*buf_ptr + data_size > end)
+        return false;
+
+    *buf_ptr += data_size;
+    if (size)
+        *size = data_size;
+    return true;
+}
+
 bool Buffer::reserve(size_t size) {
     if (available_write() < size) {
         size_t new_size = buffer_size_ + size - available_write();
-        uint8_t* new_buffer = new (std::nothrow) uint8_t[new_size];
+        BufferPool* new_pool;
+        uint8_t* new_buffer = AllocateStorage(new_size, &new_pool);
         if (!new_buffer)
             return false;
-        memcpy(new_buffer, buffer_.get() + read_position_, available_read());
-        memset_s(buffer_.get(), 0, buffer_size_);
-        buffer_.reset(new_buffer);
+        memcpy(new_buffer, buffer_ + read_position_, available_read());
+        ReleaseStorage();
+        buffer_ = new_buffer;
+        pool_ = new_pool;
         buffer_size_ = new_size;
         write_position_ -= read_position_;
         read_position_ = 0;
@@ -85,8 +165,8 @@ bool Buffer::reserve(size_t size) {
 
 bool Buffer::Reinitialize(size_t size) {
     Clear();
-    buffer_.reset(new (std::nothrow) uint8_t[size]);
-    if (!buffer_.get())
+    buffer_ = AllocateStorage(size, &pool_);
+    if (!buffer_)
         return false;
     buffer_size_ = size;
     read_position_ = 0;
@@ -98,11 +178,11 @@ bool Buffer::Reinitialize(const void* data, size_t data_len) {
     Clear();
     if (__pval(data) + data_len < __pval(data))  // Pointer wrap check
         return false;
-    buffer_.reset(new (std::nothrow) uint8_t[data_len]);
-    if (!buffer_.get())
+    buffer_ = AllocateStorage(data_len, &pool_);
+    if (!buffer_)
         return false;
     buffer_size_ = data_len;
-    memcpy(buffer_.get(), data, data_len);
+    memcpy(buffer_, data, data_len);
     read_position_ = 0;
     write_position_ = buffer_size_;
     return true;
@@ -122,7 +202,7 @@ size_t Buffer::available_read() const {
 bool Buffer::write(const uint8_t* src, size_t write_length) {
     if (available_write() < write_length)
         return false;
-    memcpy(buffer_.get() + write_position_, src, write_length);
+    memcpy(buffer_ + write_position_, src, write_length);
     write_position_ += write_length;
     return true;
 }
@@ -130,36 +210,400 @@ bool Buffer::write(const uint8_t* src, size_t write_length) {
 bool Buffer::read(uint8_t* dest, size_t read_length) {
     if (available_read() < read_length)
         return false;
-    memcpy(dest, buffer_.get() + read_position_, read_length);
+    memcpy(dest, buffer_ + read_position_, read_length);
     read_position_ += read_length;
     return true;
 }
 
 size_t Buffer::SerializedSize() const {
-    return sizeof(uint32_t) + available_read();
+    return SerializedSize(FIXED_WIDTH_FORMAT);
 }
 
 uint8_t* Buffer::Serialize(uint8_t* buf, const uint8_t* end) const {
-    return append_size_and_data_to_buf(buf, end, peek_read(), available_read());
+    return Serialize(buf, end, FIXED_WIDTH_FORMAT);
 }
 
 bool Buffer::Deserialize(const uint8_t** buf_ptr, const uint8_t* end) {
+    return Deserialize(buf_ptr, end, FIXED_WIDTH_FORMAT);
+}
+
+size_t Buffer::SerializedSize(SerializationFormat format) const {
+    return size_and_data_serialized_size(available_read(), format);
+}
+
+uint8_t* Buffer::Serialize(uint8_t* buf, const uint8_t* end, SerializationFormat format) const {
+    return append_size_and_data_to_buf(buf, end, peek_read(), available_read(), format);
+}
+
+bool Buffer::SerializeToSegments(SerializationSegments* segments) const {
+    return SerializeToSegments(segments, FIXED_WIDTH_FORMAT);
+}
+
+bool Buffer::SerializeToSegments(SerializationSegments* segments,
+                                 SerializationFormat format) const {
+    return append_size_and_data_to_segments(segments, peek_read(), available_read(), format);
+}
+
+bool Buffer::Deserialize(const uint8_t** buf_ptr, const uint8_t* end, SerializationFormat format) {
     Clear();
-    if (!copy_size_and_data_from_buf(buf_ptr, end, &buffer_size_, &buffer_)) {
-        buffer_.reset();
-        buffer_size_ = 0;
+    uint32_t size;
+    if (!copy_uint32_from_buf(buf_ptr, end, &size, format) ||
+        __pval(*buf_ptr) + size < __pval(*buf_ptr) ||  // Pointer wrap check
+        *buf_ptr + size > end)
         return false;
+
+    if (size) {
+        buffer_ = AllocateStorage(size, &pool_);
+        if (!buffer_)
+            return false;
+        memcpy(buffer_, *buf_ptr, size);
+        *buf_ptr += size;
     }
+    buffer_size_ = size;
     write_position_ = buffer_size_;
     return true;
 }
 
+bool Buffer::Borrow(const void* buf, size_t size) {
+    Clear();
+    if (__pval(buf) + size < __pval(buf))  // Pointer wrap check
+        return false;
+    if (size) {
+        buffer_ = const_cast<uint8_t*>(reinterpret_cast<const uint8_t*>(buf));
+        borrowed_ = true;
+    }
+    buffer_size_ = size;
+    write_position_ = buffer_size_;
+    return true;
+}
+
+bool Buffer::BorrowForWriting(void* buf, size_t capacity) {
+    Clear();
+    if (__pval(buf) + capacity < __pval(buf))  // Pointer wrap check
+        return false;
+    if (capacity) {
+        buffer_ = reinterpret_cast<uint8_t*>(buf);
+        borrowed_ = true;
+    }
+    buffer_size_ = capacity;
+    return true;
+}
+
+bool Buffer::DeserializeBorrowed(const uint8_t** buf_ptr, const uint8_t* end,
+                                 SerializationFormat format) {
+    Clear();
+    uint32_t size;
+    if (!copy_uint32_from_buf(buf_ptr, end, &size, format) ||
+        __pval(*buf_ptr) + size < __pval(*buf_ptr) ||  // Pointer wrap check
+        *buf_ptr + size > end)
+        return false;
+
+    if (!Borrow(*buf_ptr, size))
+        return false;
+    *buf_ptr += size;
+    return true;
+}
+
 void Buffer::Clear() {
-    memset_s(buffer_.get(), 0, buffer_size_);
-    buffer_.reset();
+    ReleaseStorage();
+    buffer_ = NULL;
+    pool_ = NULL;
     read_position_ = 0;
     write_position_ = 0;
     buffer_size_ = 0;
+    small_uses_ = 0;
+    small_use_peak_ = 0;
+}
+
+bool Buffer::Recycle() {
+    if (borrowed_) {
+        Clear();
+        return true;
+    }
+    size_t used = write_position_;
+    memset_s(buffer_, 0, used);
+    read_position_ = 0;
+    write_position_ = 0;
+
+    // Arena storage can't be given back on its own, so there's nothing to gain by trimming it.
+    uint32_t trim_after = trim_after_small_uses_;
+    if (trim_after == 0 || arena_ || !buffer_)
+        return true;
+    if (TrimmedSize(used) > buffer_size_ / 4) {
+        small_uses_ = 0;
+        small_use_peak_ = 0;
+        return true;
+    }
+    if (used > small_use_peak_)
+        small_use_peak_ = used;
+    if (++small_uses_ < trim_after)
+        return true;
+
+    size_t new_size = small_use_peak_ ? TrimmedSize(small_use_peak_) : 0;
+    Clear();
+    return new_size == 0 || Reinitialize(new_size);
+}
+
+/* static */
+size_t Buffer::TrimmedSize(size_t size) {
+    // BufferPool's size classes start at 64 bytes and grow by four.
+    size_t trimmed = 64;
+    while (trimmed < size && trimmed <= SIZE_MAX / 4)
+        trimmed *= 4;
+    return trimmed < size ? size : trimmed;
+}
+
+void Buffer::ReleaseStorage() {
+    if (borrowed_) {
+        borrowed_ = false;
+        return;
+    }
+    memset_s(buffer_, 0, buffer_size_);
+    FreeStorage(buffer_, buffer_size_, pool_);
+}
+
+BufferPool* Buffer::default_pool_ = NULL;
+uint32_t Buffer::trim_after_small_uses_ = 0;
+
+uint8_t* Buffer::AllocateStorage(size_t size, BufferPool** pool) {
+    *pool = NULL;
+    if (arena_)
+        return arena_->Allocate(size);
+
+    BufferPool* default_pool = default_pool_;
+    if (default_pool && BufferPool::Pools(size)) {
+        *pool = default_pool;
+        return default_pool->Allocate(size);
+    }
+    uint8_t* storage = new (std::nothrow) uint8_t[size];
+    if (storage)
+        AllocationCounter::Count(size);
+    return storage;
+}
+
+void Buffer::FreeStorage(uint8_t* storage, size_t size, BufferPool* pool) {
+    // Arena storage is released, and wiped, all at once by SerializationArena::Reset().
+    if (arena_ || !storage)
+        return;
+    if (pool)
+        pool->Free(storage, size);
+    else
+        delete[] storage;
+}
+
+const size_t BufferPool::SIZE_CLASS_COUNT;
+const size_t BufferPool::MAX_FREE_BLOCKS_PER_CLASS;
+
+BufferPool::BufferPool() {
+    for (size_t i = 0; i < SIZE_CLASS_COUNT; ++i) {
+        free_blocks_[i] = NULL;
+        free_block_counts_[i] = 0;
+    }
+}
+
+BufferPool::~BufferPool() {
+    for (size_t i = 0; i < SIZE_CLASS_COUNT; ++i) {
+        while (free_blocks_[i]) {
+            FreeBlock* block = free_blocks_[i];
+            free_blocks_[i] = block->next;
+            delete[] reinterpret_cast<uint8_t*>(block);
+        }
+    }
+}
+
+/* static */
+size_t BufferPool::SizeClassIndex(size_t size) {
+    size_t index = 0;
+    while (SizeClass(index) < size)
+        ++index;
+    return index;
+}
+
+uint8_t* BufferPool::Allocate(size_t size) {
+    assert(Pools(size));
+    size_t index = SizeClassIndex(size);
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        FreeBlock* block = free_blocks_[index];
+        if (block) {
+            free_blocks_[index] = block->next;
+            --free_block_counts_[index];
+            block->next = NULL;
+            return reinterpret_cast<uint8_t*>(block);
+        }
+    }
+    uint8_t* block = new (std::nothrow) uint8_t[SizeClass(index)];
+    if (block)
+        AllocationCounter::Count(SizeClass(index));
+    return block;
+}
+
+void BufferPool::Free(uint8_t* block, size_t size) {
+    size_t index = SizeClassIndex(size);
+    memset_s(block, 0, SizeClass(index));
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (free_block_counts_[index] < MAX_FREE_BLOCKS_PER_CLASS) {
+            FreeBlock* free_block = reinterpret_cast<FreeBlock*>(block);
+            free_block->next = free_blocks_[index];
+            free_blocks_[index] = free_block;
+            ++free_block_counts_[index];
+            return;
+        }
+    }
+    delete[] block;
+}
+
+size_t BufferPool::free_block_count(size_t size) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return free_block_counts_[SizeClassIndex(size)];
+}
+
+// Allocations are rounded up to keep storage suitably aligned for any scalar type.
+static const size_t ARENA_ALIGNMENT = 8;
+
+SerializationArena::~SerializationArena() {
+    Reset();
+    FreeBlock(blocks_);
+}
+
+uint8_t* SerializationArena::Allocate(size_t size) {
+    size_t aligned_size = (size + ARENA_ALIGNMENT - 1) & ~(ARENA_ALIGNMENT - 1);
+    if (aligned_size < size)
+        return NULL;
+    if (aligned_size == 0)
+        aligned_size = ARENA_ALIGNMENT;
+
+    if (!blocks_ || blocks_->capacity - blocks_->used < aligned_size) {
+        size_t capacity = aligned_size > block_size_ ? aligned_size : block_size_;
+        if (capacity + sizeof(Block) < capacity)
+            return NULL;
+        uint8_t* storage = new (std::nothrow) uint8_t[sizeof(Block) + capacity];
+        if (!storage)
+            return NULL;
+        AllocationCounter::Count(sizeof(Block) + capacity);
+        Block* block = reinterpret_cast<Block*>(storage);
+        block->next = blocks_;
+        block->capacity = capacity;
+        block->used = 0;
+        blocks_ = block;
+    }
+
+    uint8_t* allocation = blocks_->data() + blocks_->used;
+    blocks_->used += aligned_size;
+    return allocation;
+}
+
+void SerializationArena::Reset() {
+    Block* largest = blocks_;
+    for (Block* block = blocks_; block; block = block->next) {
+        memset_s(block->data(), 0, block->used);
+        block->used = 0;
+        if (block->capacity > largest->capacity)
+            largest = block;
+    }
+
+    for (Block* block = blocks_; block;) {
+        Block* next = block->next;
+        if (block != largest)
+            FreeBlock(block);
+        block = next;
+    }
+    if (largest)
+        largest->next = NULL;
+    blocks_ = largest;
+}
+
+size_t SerializationArena::bytes_used() const {
+    size_t used = 0;
+    for (Block* block = blocks_; block; block = block->next)
+        used += block->used;
+    return used;
+}
+
+/* static */
+void SerializationArena::FreeBlock(Block* block) {
+    delete[] reinterpret_cast<uint8_t*>(block);
+}
+
+// Copied pieces are small, so a modest arena block holds those of several messages.
+static const size_t SEGMENTS_ARENA_BLOCK_SIZE = 1024;
+static const size_t SEGMENTS_COPY_CHUNK_SIZE = 128;
+static const size_t MIN_SEGMENT_CAPACITY = 8;
+
+SerializationSegments::SerializationSegments()
+    : copies_(SEGMENTS_ARENA_BLOCK_SIZE), segments_(NULL), segment_count_(0), segment_capacity_(0),
+      total_length_(0), copy_position_(NULL), copy_limit_(NULL) {}
+
+SerializationSegments::~SerializationSegments() {
+    delete[] segments_;
+}
+
+bool SerializationSegments::Write(const void* data, size_t data_len) {
+    uint8_t* buf = Reserve(data_len);
+    if (!buf)
+        return false;
+    if (data_len)
+        memcpy(buf, data, data_len);
+    return true;
+}
+
+uint8_t* SerializationSegments::Reserve(size_t length) {
+    if (!copy_position_ || static_cast<size_t>(copy_limit_ - copy_position_) < length) {
+        size_t chunk_size = length > SEGMENTS_COPY_CHUNK_SIZE ? length : SEGMENTS_COPY_CHUNK_SIZE;
+        uint8_t* chunk = copies_.Allocate(chunk_size);
+        if (!chunk)
+            return NULL;
+        copy_position_ = chunk;
+        copy_limit_ = chunk + chunk_size;
+    }
+
+    uint8_t* buf = copy_position_;
+    if (length == 0)
+        return buf;
+    SerializedSegment* last = segment_count_ ? &segments_[segment_count_ - 1] : NULL;
+    if (last && last->data + last->length == buf) {
+        last->length += length;
+        total_length_ += length;
+    } else if (!AddSegment(buf, length)) {
+        return NULL;
+    }
+    copy_position_ += length;
+    return buf;
+}
+
+bool SerializationSegments::Reference(const void* data, size_t length) {
+    if (length < MIN_REFERENCED_LENGTH)
+        return Write(data, length);
+    return AddSegment(reinterpret_cast<const uint8_t*>(data), length);
+}
+
+void SerializationSegments::Clear() {
+    segment_count_ = 0;
+    total_length_ = 0;
+    copies_.Reset();
+    copy_position_ = NULL;
+    copy_limit_ = NULL;
+}
+
+bool SerializationSegments::AddSegment(const uint8_t* data, size_t length) {
+    if (segment_count_ == segment_capacity_) {
+        size_t capacity = segment_capacity_ ? segment_capacity_ * 2 : MIN_SEGMENT_CAPACITY;
+        SerializedSegment* segments = new (std::nothrow) SerializedSegment[capacity];
+        if (!segments)
+            return false;
+        AllocationCounter::Count(capacity * sizeof(SerializedSegment));
+        if (segment_count_)
+            memcpy(segments, segments_, segment_count_ * sizeof(SerializedSegment));
+        delete[] segments_;
+        segments_ = segments;
+        segment_capacity_ = capacity;
+    }
+    segments_[segment_count_].data = data;
+    segments_[segment_count_].length = length;
+    ++segment_count_;
+    total_length_ += length;
+    return true;
 }
 
 }  // namespace keymaster
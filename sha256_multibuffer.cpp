@@ -0,0 +1,319 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "sha256_multibuffer.h"
+
+#include <assert.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON__) || defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include <openssl/sha.h>
+
+#include <keymaster/android_keymaster_utils.h>
+
+namespace keymaster {
+
+const uint32_t kSha256InitialChainingValue[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+};
+
+namespace {
+
+// Lanes holds one 32-bit word from each of kSha256Lanes independent hashes, so each SIMD
+// instruction advances all of them.
+const size_t kLanes = kSha256Lanes;
+const size_t kBlockSize = kSha256BlockSize;
+
+#if defined(__SSE2__)
+
+typedef __m128i Lanes;
+
+inline Lanes Load(const uint32_t* words) {
+    return _mm_loadu_si128(reinterpret_cast<const __m128i*>(words));
+}
+inline void Store(uint32_t* words, Lanes x) {
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(words), x);
+}
+inline Lanes Splat(uint32_t word) {
+    return _mm_set1_epi32(word);
+}
+inline Lanes Add(Lanes x, Lanes y) {
+    return _mm_add_epi32(x, y);
+}
+inline Lanes Xor(Lanes x, Lanes y) {
+    return _mm_xor_si128(x, y);
+}
+inline Lanes And(Lanes x, Lanes y) {
+    return _mm_and_si128(x, y);
+}
+inline Lanes Or(Lanes x, Lanes y) {
+    return _mm_or_si128(x, y);
+}
+// Returns ~x & y.
+inline Lanes AndNot(Lanes x, Lanes y) {
+    return _mm_andnot_si128(x, y);
+}
+template <int N> inline Lanes Shr(Lanes x) {
+    return _mm_srli_epi32(x, N);
+}
+template <int N> inline Lanes Shl(Lanes x) {
+    return _mm_slli_epi32(x, N);
+}
+
+#elif defined(__ARM_NEON__) || defined(__ARM_NEON)
+
+typedef uint32x4_t Lanes;
+
+inline Lanes Load(const uint32_t* words) {
+    return vld1q_u32(words);
+}
+inline void Store(uint32_t* words, Lanes x) {
+    vst1q_u32(words, x);
+}
+inline Lanes Splat(uint32_t word) {
+    return vdupq_n_u32(word);
+}
+inline Lanes Add(Lanes x, Lanes y) {
+    return vaddq_u32(x, y);
+}
+inline Lanes Xor(Lanes x, Lanes y) {
+    return veorq_u32(x, y);
+}
+inline Lanes And(Lanes x, Lanes y) {
+    return vandq_u32(x, y);
+}
+inline Lanes Or(Lanes x, Lanes y) {
+    return vorrq_u32(x, y);
+}
+// Returns ~x & y.
+inline Lanes AndNot(Lanes x, Lanes y) {
+    return vbicq_u32(y, x);
+}
+template <int N> inline Lanes Shr(Lanes x) {
+    return vshrq_n_u32(x, N);
+}
+template <int N> inline Lanes Shl(Lanes x) {
+    return vshlq_n_u32(x, N);
+}
+
+#else  // No SIMD; the compiler may still vectorize these loops.
+
+struct Lanes {
+    uint32_t word[kLanes];
+};
+
+inline Lanes Load(const uint32_t* words) {
+    Lanes x;
+    memcpy(x.word, words, sizeof(x.word));
+    return x;
+}
+inline void Store(uint32_t* words, Lanes x) {
+    memcpy(words, x.word, sizeof(x.word));
+}
+inline Lanes Splat(uint32_t word) {
+    Lanes x;
+    for (size_t i = 0; i < kLanes; ++i)
+        x.word[i] = word;
+    return x;
+}
+#define LANEWISE(name, expr)                                                                       \
+    inline Lanes name(Lanes x, Lanes y) {                                                          \
+        for (size_t i = 0; i < kLanes; ++i)                                                        \
+            x.word[i] = (expr);                                                                    \
+        return x;                                                                                  \
+    }
+LANEWISE(Add, x.word[i] + y.word[i])
+LANEWISE(Xor, x.word[i] ^ y.word[i])
+LANEWISE(And, x.word[i] & y.word[i])
+LANEWISE(Or, x.word[i] | y.word[i])
+// Returns ~x & y.
+LANEWISE(AndNot, ~x.word[i] & y.word[i])
+#undef LANEWISE
+template <int N> inline Lanes Shr(Lanes x) {
+    for (size_t i = 0; i < kLanes; ++i)
+        x.word[i] >>= N;
+    return x;
+}
+template <int N> inline Lanes Shl(Lanes x) {
+    for (size_t i = 0; i < kLanes; ++i)
+        x.word[i] <<= N;
+    return x;
+}
+
+#endif
+
+template <int N> inline Lanes Rotr(Lanes x) {
+    return Or(Shr<N>(x), Shl<32 - N>(x));
+}
+
+const uint32_t kSha256RoundConstants[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+inline uint32_t LoadBigEndian32(const uint8_t* p) {
+    return static_cast<uint32_t>(p[0]) << 24 | static_cast<uint32_t>(p[1]) << 16 |
+           static_cast<uint32_t>(p[2]) << 8 | p[3];
+}
+
+inline void StoreBigEndian32(uint32_t word, uint8_t* p) {
+    p[0] = word >> 24;
+    p[1] = word >> 16;
+    p[2] = word >> 8;
+    p[3] = word;
+}
+
+// Runs the SHA-256 compression function over one block for each lane.
+void CompressLanes(Lanes state[8], const uint8_t* const blocks[kLanes]) {
+    Lanes w[64];
+    for (size_t t = 0; t < 16; ++t) {
+        uint32_t words[kLanes];
+        for (size_t lane = 0; lane < kLanes; ++lane)
+            words[lane] = LoadBigEndian32(blocks[lane] + 4 * t);
+        w[t] = Load(words);
+    }
+    for (size_t t = 16; t < 64; ++t) {
+        Lanes s0 = Xor(Xor(Rotr<7>(w[t - 15]), Rotr<18>(w[t - 15])), Shr<3>(w[t - 15]));
+        Lanes s1 = Xor(Xor(Rotr<17>(w[t - 2]), Rotr<19>(w[t - 2])), Shr<10>(w[t - 2]));
+        w[t] = Add(Add(w[t - 16], s0), Add(w[t - 7], s1));
+    }
+
+    Lanes a = state[0], b = state[1], c = state[2], d = state[3];
+    Lanes e = state[4], f = state[5], g = state[6], h = state[7];
+    for (size_t t = 0; t < 64; ++t) {
+        Lanes s1 = Xor(Xor(Rotr<6>(e), Rotr<11>(e)), Rotr<25>(e));
+        Lanes ch = Xor(And(e, f), AndNot(e, g));
+        Lanes t1 = Add(Add(Add(h, s1), Add(ch, Splat(kSha256RoundConstants[t]))), w[t]);
+        Lanes s0 = Xor(Xor(Rotr<2>(a), Rotr<13>(a)), Rotr<22>(a));
+        Lanes maj = Or(And(a, b), And(c, Or(a, b)));
+        Lanes t2 = Add(s0, maj);
+        h = g;
+        g = f;
+        f = e;
+        e = Add(d, t1);
+        d = c;
+        c = b;
+        b = a;
+        a = Add(t1, t2);
+    }
+    state[0] = Add(state[0], a);
+    state[1] = Add(state[1], b);
+    state[2] = Add(state[2], c);
+    state[3] = Add(state[3], d);
+    state[4] = Add(state[4], e);
+    state[5] = Add(state[5], f);
+    state[6] = Add(state[6], g);
+    state[7] = Add(state[7], h);
+}
+
+void ExtractLane(const Lanes state[8], size_t lane, uint32_t out[8]) {
+    for (size_t i = 0; i < 8; ++i) {
+        uint32_t words[kLanes];
+        Store(words, state[i]);
+        out[i] = words[lane];
+    }
+}
+
+// Finishes up to kLanes hashes at once.
+void FinishLanes(const uint32_t chaining_value[8], size_t prefix_blocks, size_t count,
+                 const uint8_t* const* data, const size_t* data_len, uint8_t* digests) {
+    assert(count <= kLanes);
+    static const uint8_t kIdleBlock[kBlockSize] = {};
+
+    // The tail of each message, padded, takes one or two blocks.
+    uint8_t tails[kLanes][2 * kBlockSize];
+    size_t full_blocks[kLanes];
+    size_t total_blocks[kLanes];
+    size_t max_blocks = 0;
+    for (size_t lane = 0; lane < count; ++lane) {
+        full_blocks[lane] = data_len[lane] / kBlockSize;
+        size_t remainder = data_len[lane] % kBlockSize;
+        size_t tail_blocks = remainder + 1 + 8 > kBlockSize ? 2 : 1;
+        uint8_t* tail = tails[lane];
+        memcpy(tail, data[lane] + full_blocks[lane] * kBlockSize, remainder);
+        tail[remainder] = 0x80;
+        memset(tail + remainder + 1, 0, tail_blocks * kBlockSize - remainder - 1);
+        uint64_t bit_length = (prefix_blocks * kBlockSize + data_len[lane]) * 8;
+        StoreBigEndian32(bit_length >> 32, tail + tail_blocks * kBlockSize - 8);
+        StoreBigEndian32(bit_length, tail + tail_blocks * kBlockSize - 4);
+
+        total_blocks[lane] = full_blocks[lane] + tail_blocks;
+        if (total_blocks[lane] > max_blocks)
+            max_blocks = total_blocks[lane];
+    }
+
+    Lanes state[8];
+    for (size_t i = 0; i < 8; ++i)
+        state[i] = Splat(chaining_value[i]);
+    for (size_t block = 0; block < max_blocks; ++block) {
+        const uint8_t* blocks[kLanes];
+        for (size_t lane = 0; lane < kLanes; ++lane) {
+            if (lane >= count || block >= total_blocks[lane])
+                blocks[lane] = kIdleBlock;
+            else if (block < full_blocks[lane])
+                blocks[lane] = data[lane] + block * kBlockSize;
+            else
+                blocks[lane] = tails[lane] + (block - full_blocks[lane]) * kBlockSize;
+        }
+        CompressLanes(state, blocks);
+
+        for (size_t lane = 0; lane < count; ++lane) {
+            if (block + 1 != total_blocks[lane])
+                continue;
+            uint32_t digest[8];
+            ExtractLane(state, lane, digest);
+            for (size_t i = 0; i < 8; ++i)
+                StoreBigEndian32(digest[i], digests + SHA256_DIGEST_LENGTH * lane + 4 * i);
+        }
+    }
+    memset_s(state, 0, sizeof(state));
+    memset_s(tails, 0, sizeof(tails));
+}
+
+}  // anonymous namespace
+
+void Sha256Compress(uint32_t chaining_value[8], const uint8_t* block) {
+    Lanes state[8];
+    for (size_t i = 0; i < 8; ++i)
+        state[i] = Splat(chaining_value[i]);
+    const uint8_t* blocks[kLanes] = {block, block, block, block};
+    CompressLanes(state, blocks);
+    ExtractLane(state, 0, chaining_value);
+    memset_s(state, 0, sizeof(state));
+}
+
+void Sha256FinishMultiBuffer(const uint32_t chaining_value[8], size_t prefix_blocks, size_t count,
+                             const uint8_t* const* data, const size_t* data_len,
+                             uint8_t* digests) {
+    for (size_t first = 0; first < count; first += kLanes) {
+        size_t lanes = count - first < kLanes ? count - first : kLanes;
+        FinishLanes(chaining_value, prefix_blocks, lanes, data + first, data_len + first,
+                    digests + SHA256_DIGEST_LENGTH * first);
+    }
+}
+
+}  // namespace keymaster
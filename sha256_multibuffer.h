@@ -0,0 +1,54 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SYSTEM_KEYMASTER_SHA256_MULTIBUFFER_H_
+#define SYSTEM_KEYMASTER_SHA256_MULTIBUFFER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace keymaster {
+
+/**
+ * A SHA-256 implementation that hashes several independent messages at once, one per 32-bit SIMD
+ * lane, for callers that have a batch of similar-length messages (e.g. HMACs of many short inputs,
+ * or a KDF's counter blocks).  It uses SSE2 on x86 and NEON on ARM, and a plain per-lane loop
+ * elsewhere.
+ */
+
+const size_t kSha256BlockSize = 64;
+const size_t kSha256Lanes = 4;
+
+extern const uint32_t kSha256InitialChainingValue[8];
+
+/**
+ * Runs the SHA-256 compression function over one block, updating chaining_value.  Used to absorb
+ * prefixes shared by several messages.
+ */
+void Sha256Compress(uint32_t chaining_value[8], const uint8_t* block);
+
+/**
+ * Finishes SHA-256 of count messages, each continuing from chaining_value after prefix_blocks
+ * blocks (absorbed with Sha256Compress), writing the 32-byte digest of message i to digests + 32 *
+ * i.  Messages are taken kSha256Lanes at a time; lanes whose messages run out early sit idle until
+ * the longest message in their group is done.
+ */
+void Sha256FinishMultiBuffer(const uint32_t chaining_value[8], size_t prefix_blocks, size_t count,
+                             const uint8_t* const* data, const size_t* data_len, uint8_t* digests);
+
+}  // namespace keymaster
+
+#endif  // SYSTEM_KEYMASTER_SHA256_MULTIBUFFER_H_
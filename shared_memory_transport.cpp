@@ -0,0 +1,461 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "shared_memory_transport.h"
+
+#include <limits.h>
+#include <linux/futex.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <new>
+
+#include <keymaster/android_keymaster_utils.h>
+
+namespace keymaster {
+
+namespace {
+
+// The commands the server handles, with their message types and the AndroidKeymaster method that
+// handles them.  GET_VERSION, whose messages aren't versioned, is handled separately.
+#define SERVED_COMMANDS(X)                                                                         \
+    X(GET_SUPPORTED_ALGORITHMS, SupportedAlgorithmsRequest, SupportedAlgorithmsResponse,           \
+      SupportedAlgorithms)                                                                         \
+    X(GET_SUPPORTED_BLOCK_MODES, SupportedBlockModesRequest, SupportedBlockModesResponse,          \
+      SupportedBlockModes)                                                                         \
+    X(GET_SUPPORTED_PADDING_MODES, SupportedPaddingModesRequest, SupportedPaddingModesResponse,    \
+      SupportedPaddingModes)                                                                       \
+    X(GET_SUPPORTED_DIGESTS, SupportedDigestsRequest, SupportedDigestsResponse, SupportedDigests)  \
+    X(GET_SUPPORTED_IMPORT_FORMATS, SupportedImportFormatsRequest, SupportedImportFormatsResponse, \
+      SupportedImportFormats)                                                                      \
+    X(GET_SUPPORTED_EXPORT_FORMATS, SupportedExportFormatsRequest, SupportedExportFormatsResponse, \
+      SupportedExportFormats)                                                                      \
+    X(ADD_RNG_ENTROPY, AddEntropyRequest, AddEntropyResponse, AddRngEntropy)                       \
+    X(GENERATE_KEY, GenerateKeyRequest, GenerateKeyResponse, GenerateKey)                          \
+    X(GENERATE_KEYS, GenerateKeysRequest, GenerateKeysResponse, GenerateKeys)                      \
+    X(GET_KEY_CHARACTERISTICS, GetKeyCharacteristicsRequest, GetKeyCharacteristicsResponse,        \
+      GetKeyCharacteristics)                                                                       \
+    X(BATCH_GET_KEY_CHARACTERISTICS, BatchGetKeyCharacteristicsRequest,                            \
+      BatchGetKeyCharacteristicsResponse, BatchGetKeyCharacteristics)                              \
+    X(BEGIN_OPERATION, BeginOperationRequest, BeginOperationResponse, BeginOperation)              \
+    X(UPDATE_OPERATION, UpdateOperationRequest, UpdateOperationResponse, UpdateOperation)          \
+    X(UPDATE_AAD, UpdateAadRequest, UpdateAadResponse, UpdateAad)                                  \
+    X(FINISH_OPERATION, FinishOperationRequest, FinishOperationResponse, FinishOperation)          \
+    X(ABORT_OPERATION, AbortOperationRequest, AbortOperationResponse, AbortOperation)              \
+    X(EXPORT_OPERATION, ExportOperationRequest, ExportOperationResponse, ExportOperation)          \
+    X(IMPORT_OPERATION, ImportOperationRequest, ImportOperationResponse, ImportOperation)          \
+    X(ONE_SHOT_OPERATION, OneShotOperationRequest, OneShotOperationResponse, OneShotOperation)     \
+    X(BATCH_OPERATION, BatchOperationRequest, BatchOperationResponse, BatchOperation)              \
+    X(IMPORT_KEY, ImportKeyRequest, ImportKeyResponse, ImportKey)                                  \
+    X(EXPORT_KEY, ExportKeyRequest, ExportKeyResponse, ExportKey)                                  \
+    X(ATTEST_KEY, AttestKeyRequest, AttestKeyResponse, AttestKey)                                  \
+    X(BATCH_ATTEST_KEY, BatchAttestKeyRequest, BatchAttestKeyResponse, BatchAttestKey)             \
+    X(UPGRADE_KEY, UpgradeKeyRequest, UpgradeKeyResponse, UpgradeKey)                              \
+    X(BATCH_UPGRADE_KEY, BatchUpgradeKeyRequest, BatchUpgradeKeyResponse, BatchUpgradeKey)         \
+    X(MIGRATE_KEY, MigrateKeyRequest, MigrateKeyResponse, MigrateKey)                              \
+    X(BATCH_DELETE_KEY, BatchDeleteKeyRequest, BatchDeleteKeyResponse, BatchDeleteKey)             \
+    X(PIN_KEY, PinKeyRequest, PinKeyResponse, PinKey)                                              \
+    X(UNPIN_KEY, UnpinKeyRequest, UnpinKeyResponse, UnpinKey)                                      \
+    X(WARMUP_KEYS, WarmupKeysRequest, WarmupKeysResponse, WarmupKeys)                              \
+    X(GET_STATISTICS, GetStatisticsRequest, GetStatisticsResponse, GetStatistics)
+
+const uint32_t kRingMagic = 0x4b4d5247;  // "KMRG"
+
+// Keeps the indices each side writes on cache lines of their own.
+const size_t kCacheLineSize = 64;
+
+// How many times a side polls an empty or full ring before it sleeps.  A few microseconds of
+// polling catches the common case of a reply that is already being written.
+const int kSpinCount = 2000;
+
+// The response to requests the server can't hand to the keymaster.
+struct ErrorResponse : public KeymasterResponse {
+    ErrorResponse(int32_t ver, keymaster_error_t error_code) : KeymasterResponse(ver) {
+        error = error_code;
+    }
+
+    size_t NonErrorSerializedSize() const override { return 0; }
+    uint8_t* NonErrorSerialize(uint8_t* buf, const uint8_t*) const override { return buf; }
+    bool NonErrorDeserialize(const uint8_t**, const uint8_t*) override { return true; }
+};
+
+// The futex word is the atomic's value; lock-free std::atomic<uint32_t> is a bare uint32_t.  The
+// operations aren't FUTEX_PRIVATE_FLAG ones, so that they work across processes.
+void FutexWait(std::atomic<uint32_t>* word, uint32_t value) {
+    syscall(SYS_futex, reinterpret_cast<uint32_t*>(word), FUTEX_WAIT, value, nullptr, nullptr, 0);
+}
+
+void FutexWake(std::atomic<uint32_t>* word) {
+    syscall(SYS_futex, reinterpret_cast<uint32_t*>(word), FUTEX_WAKE, INT_MAX, nullptr, nullptr,
+            0);
+}
+
+}  // anonymous namespace
+
+/*
+ * The indices are free-running byte counts, reduced modulo the capacity to address the data, so
+ * head - tail is the number of bytes in the ring.  A side that sleeps sets its waiting flag and
+ * then waits on its wake sequence, which the other side bumps before waking it; the flag lets that
+ * other side skip the system call when nobody sleeps.
+ */
+struct MessageRing::Control {
+    uint32_t magic;
+    uint32_t capacity;
+    std::atomic<uint32_t> closed;
+    uint8_t padding0[kCacheLineSize];
+
+    // Written by the writer, and by the reader going to sleep.
+    std::atomic<uint32_t> head;
+    std::atomic<uint32_t> readable_sequence;
+    std::atomic<uint32_t> reader_waiting;
+    uint8_t padding1[kCacheLineSize];
+
+    // Written by the reader, and by the writer going to sleep.
+    std::atomic<uint32_t> tail;
+    std::atomic<uint32_t> writable_sequence;
+    std::atomic<uint32_t> writer_waiting;
+    uint8_t padding2[kCacheLineSize];
+};
+
+/* static */
+size_t MessageRing::DataOffset() {
+    return (sizeof(Control) + 7) & ~7;
+}
+
+/* static */
+size_t MessageRing::RegionSize(size_t capacity) {
+    if (capacity < MIN_CAPACITY || capacity > MAX_CAPACITY || (capacity & (capacity - 1)) != 0)
+        return 0;
+    return DataOffset() + capacity;
+}
+
+keymaster_error_t MessageRing::Initialize(void* region, size_t capacity) {
+    if (RegionSize(capacity) == 0)
+        return KM_ERROR_INVALID_ARGUMENT;
+    Control* control = new (region) Control;
+    control->capacity = capacity;
+    control->closed.store(0);
+    control->head.store(0);
+    control->readable_sequence.store(0);
+    control->reader_waiting.store(0);
+    control->tail.store(0);
+    control->writable_sequence.store(0);
+    control->writer_waiting.store(0);
+    control->magic = kRingMagic;
+    return Attach(region, RegionSize(capacity));
+}
+
+keymaster_error_t MessageRing::Attach(void* region, size_t region_size) {
+    Control* control = reinterpret_cast<Control*>(region);
+    if (region_size < DataOffset() || control->magic != kRingMagic ||
+        RegionSize(control->capacity) != region_size)
+        return KM_ERROR_INVALID_ARGUMENT;
+    control_ = control;
+    data_ = reinterpret_cast<uint8_t*>(region) + DataOffset();
+    capacity_ = control->capacity;
+    return KM_ERROR_OK;
+}
+
+keymaster_error_t MessageRing::Write(uint32_t command, uint32_t message_version,
+                                     uint32_t sequence, const Serializable& message) {
+    segments_.Clear();
+    if (!message.SerializeToSegments(&segments_))
+        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    size_t record_length = sizeof(MessageRecordHeader) + segments_.total_length();
+    if (record_length > capacity_) {
+        segments_.Clear();
+        return KM_ERROR_INVALID_INPUT_LENGTH;
+    }
+
+    uint32_t head = control_->head.load(std::memory_order_relaxed);
+    for (;;) {
+        if (closed()) {
+            segments_.Clear();
+            return KM_ERROR_SECURE_HW_COMMUNICATION_FAILED;
+        }
+        uint32_t tail = control_->tail.load(std::memory_order_acquire);
+        if (capacity_ - (head - tail) >= record_length)
+            break;
+        WaitForChange(control_->tail, tail, &control_->writer_waiting,
+                      &control_->writable_sequence);
+    }
+
+    MessageRecordHeader header;
+    header.length = segments_.total_length();
+    header.command = command;
+    header.message_version = message_version;
+    header.sequence = sequence;
+    CopyIn(head, &header, sizeof(header));
+    uint32_t position = head + sizeof(header);
+    for (size_t i = 0; i < segments_.segment_count(); ++i) {
+        const SerializedSegment& segment = segments_.segments()[i];
+        CopyIn(position, segment.data, segment.length);
+        position += segment.length;
+    }
+    segments_.Clear();
+
+    control_->head.store(position);
+    Wake(&control_->reader_waiting, &control_->readable_sequence);
+    return KM_ERROR_OK;
+}
+
+keymaster_error_t MessageRing::Peek(MessageRecordHeader* header) {
+    uint32_t tail = control_->tail.load(std::memory_order_relaxed);
+    for (;;) {
+        uint32_t head = control_->head.load(std::memory_order_acquire);
+        if (head != tail) {
+            uint32_t available = head - tail;
+            if (available < sizeof(peeked_) || available > capacity_)
+                return KM_ERROR_INVALID_ARGUMENT;
+            CopyOut(tail, &peeked_, sizeof(peeked_));
+            if (peeked_.length > available - sizeof(peeked_))
+                return KM_ERROR_INVALID_ARGUMENT;
+            *header = peeked_;
+            return KM_ERROR_OK;
+        }
+        if (closed())
+            return KM_ERROR_SECURE_HW_COMMUNICATION_FAILED;
+        WaitForChange(control_->head, head, &control_->reader_waiting,
+                      &control_->readable_sequence);
+    }
+}
+
+keymaster_error_t MessageRing::Consume(Serializable* message) {
+    uint32_t tail = control_->tail.load(std::memory_order_relaxed);
+    uint32_t position = tail + sizeof(peeked_);
+    size_t offset = position & (capacity_ - 1);
+
+    keymaster_error_t error = KM_ERROR_OK;
+    if (message) {
+        const uint8_t* payload = data_ + offset;
+        if (offset + peeked_.length > capacity_) {
+            if (scratch_size_ < peeked_.length) {
+                scratch_.reset(new (std::nothrow) uint8_t[peeked_.length]);
+                scratch_size_ = scratch_.get() ? peeked_.length : 0;
+            }
+            if (!scratch_.get()) {
+                error = KM_ERROR_MEMORY_ALLOCATION_FAILED;
+                payload = nullptr;
+            } else {
+                CopyOut(position, scratch_.get(), peeked_.length);
+                payload = scratch_.get();
+            }
+        }
+
+        if (payload) {
+            const uint8_t* p = payload;
+            const uint8_t* end = payload + peeked_.length;
+            if (!message->Deserialize(&p, end) || p != end)
+                error = KM_ERROR_INVALID_ARGUMENT;
+            if (payload == scratch_.get())
+                memset_s(scratch_.get(), 0, peeked_.length);
+        }
+    }
+
+    Wipe(tail, sizeof(peeked_) + peeked_.length);
+    control_->tail.store(position + peeked_.length);
+    Wake(&control_->writer_waiting, &control_->writable_sequence);
+    return error;
+}
+
+void MessageRing::Close() {
+    control_->closed.store(1);
+    control_->readable_sequence.fetch_add(1);
+    FutexWake(&control_->readable_sequence);
+    control_->writable_sequence.fetch_add(1);
+    FutexWake(&control_->writable_sequence);
+}
+
+bool MessageRing::closed() const {
+    return control_->closed.load() != 0;
+}
+
+void MessageRing::CopyIn(uint32_t position, const void* data, size_t length) {
+    size_t offset = position & (capacity_ - 1);
+    size_t first = length < capacity_ - offset ? length : capacity_ - offset;
+    memcpy(data_ + offset, data, first);
+    memcpy(data_, reinterpret_cast<const uint8_t*>(data) + first, length - first);
+}
+
+void MessageRing::CopyOut(uint32_t position, void* data, size_t length) const {
+    size_t offset = position & (capacity_ - 1);
+    size_t first = length < capacity_ - offset ? length : capacity_ - offset;
+    memcpy(data, data_ + offset, first);
+    memcpy(reinterpret_cast<uint8_t*>(data) + first, data_, length - first);
+}
+
+void MessageRing::Wipe(uint32_t position, size_t length) {
+    size_t offset = position & (capacity_ - 1);
+    size_t first = length < capacity_ - offset ? length : capacity_ - offset;
+    memset_s(data_ + offset, 0, first);
+    memset_s(data_, 0, length - first);
+}
+
+void MessageRing::WaitForChange(const std::atomic<uint32_t>& index, uint32_t value,
+                                std::atomic<uint32_t>* waiting,
+                                std::atomic<uint32_t>* wake_sequence) {
+    for (int i = 0; i < kSpinCount; ++i) {
+        if (index.load(std::memory_order_acquire) != value || closed())
+            return;
+    }
+
+    // The other side stores the index and then checks the flag; this side sets the flag and then
+    // checks the index.  Both are sequentially consistent, so one of them sees the other's store.
+    uint32_t sequence = wake_sequence->load();
+    waiting->store(1);
+    if (index.load() == value && !closed()) {
+        ++sleep_count_;
+        FutexWait(wake_sequence, sequence);
+    }
+    waiting->store(0);
+}
+
+void MessageRing::Wake(std::atomic<uint32_t>* waiting, std::atomic<uint32_t>* wake_sequence) {
+    if (!waiting->load())
+        return;
+    wake_sequence->fetch_add(1);
+    FutexWake(wake_sequence);
+}
+
+/* static */
+size_t SharedMemoryChannel::RegionSize(size_t ring_capacity) {
+    return 2 * MessageRing::RegionSize(ring_capacity);
+}
+
+keymaster_error_t SharedMemoryChannel::Initialize(void* region, size_t ring_capacity) {
+    size_t ring_size = MessageRing::RegionSize(ring_capacity);
+    if (ring_size == 0)
+        return KM_ERROR_INVALID_ARGUMENT;
+    keymaster_error_t error = requests_.Initialize(region, ring_capacity);
+    if (error == KM_ERROR_OK)
+        error = responses_.Initialize(reinterpret_cast<uint8_t*>(region) + ring_size,
+                                      ring_capacity);
+    return error;
+}
+
+keymaster_error_t SharedMemoryChannel::Attach(void* region, size_t region_size) {
+    size_t ring_size = region_size / 2;
+    if (region_size % 2 != 0)
+        return KM_ERROR_INVALID_ARGUMENT;
+    keymaster_error_t error = requests_.Attach(region, ring_size);
+    if (error == KM_ERROR_OK)
+        error = responses_.Attach(reinterpret_cast<uint8_t*>(region) + ring_size, ring_size);
+    return error;
+}
+
+void SharedMemoryChannel::Close() {
+    requests_.Close();
+    responses_.Close();
+}
+
+keymaster_error_t SharedMemoryKeymasterClient::Send(AndroidKeymasterCommand command,
+                                                    const KeymasterMessage& request) {
+    keymaster_error_t error =
+        channel_->requests()->Write(command, request.message_version, next_sequence_, request);
+    if (error == KM_ERROR_OK)
+        ++next_sequence_;
+    return error;
+}
+
+keymaster_error_t SharedMemoryKeymasterClient::Receive(KeymasterResponse* response) {
+    if (outstanding_count() == 0)
+        return KM_ERROR_INVALID_ARGUMENT;
+
+    MessageRecordHeader header;
+    keymaster_error_t error = channel_->responses()->Peek(&header);
+    if (error != KM_ERROR_OK)
+        return error;
+    bool expected = header.sequence == next_response_sequence_ &&
+                    header.message_version == response->message_version;
+    ++next_response_sequence_;
+    if (!expected) {
+        channel_->responses()->Consume(nullptr);
+        return KM_ERROR_SECURE_HW_COMMUNICATION_FAILED;
+    }
+    return channel_->responses()->Consume(response);
+}
+
+keymaster_error_t SharedMemoryKeymasterClient::Call(AndroidKeymasterCommand command,
+                                                    const KeymasterMessage& request,
+                                                    KeymasterResponse* response) {
+    keymaster_error_t error = Send(command, request);
+    if (error == KM_ERROR_OK)
+        error = Receive(response);
+    return error;
+}
+
+template <typename Request, typename Response>
+static keymaster_error_t Handle(SharedMemoryChannel* channel, AndroidKeymaster* keymaster,
+                                void (AndroidKeymaster::*method)(const Request&, Response*),
+                                const MessageRecordHeader& header, Request* request,
+                                Response* response) {
+    keymaster_error_t error = channel->requests()->Consume(request);
+    if (error == KM_ERROR_OK)
+        (keymaster->*method)(*request, response);
+    else if (error == KM_ERROR_INVALID_ARGUMENT || error == KM_ERROR_MEMORY_ALLOCATION_FAILED)
+        response->error = error;
+    else
+        return error;
+    return channel->responses()->Write(header.command, header.message_version, header.sequence,
+                                       *response);
+}
+
+keymaster_error_t SharedMemoryKeymasterServer::ServeOne() {
+    MessageRecordHeader header;
+    keymaster_error_t error = channel_->requests()->Peek(&header);
+    if (error != KM_ERROR_OK)
+        return error;
+
+    int32_t version = header.message_version;
+    if (version < 0 || version > MAX_MESSAGE_VERSION) {
+        channel_->requests()->Consume(nullptr);
+        ErrorResponse response(version < 0 ? 0 : version, KM_ERROR_VERSION_MISMATCH);
+        return channel_->responses()->Write(header.command, header.message_version,
+                                            header.sequence, response);
+    }
+
+    switch (header.command) {
+    case GET_VERSION: {
+        GetVersionRequest request;
+        GetVersionResponse response;
+        return Handle(channel_, keymaster_, &AndroidKeymaster::GetVersion, header, &request,
+                      &response);
+    }
+#define SERVE(command, Request, Response, method)                                                  \
+    case command: {                                                                                \
+        Request request(version);                                                                  \
+        Response response(version);                                                                \
+        return Handle(channel_, keymaster_, &AndroidKeymaster::method, header, &request,           \
+                      &response);                                                                  \
+    }
+        SERVED_COMMANDS(SERVE)
+#undef SERVE
+    default: {
+        channel_->requests()->Consume(nullptr);
+        ErrorResponse response(version, KM_ERROR_UNIMPLEMENTED);
+        return channel_->responses()->Write(header.command, header.message_version,
+                                            header.sequence, response);
+    }
+    }
+}
+
+void SharedMemoryKeymasterServer::Serve() {
+    while (ServeOne() == KM_ERROR_OK) {
+    }
+}
+
+}  // namespace keymaster
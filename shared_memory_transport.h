@@ -0,0 +1,255 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SYSTEM_KEYMASTER_SHARED_MEMORY_TRANSPORT_H_
+#define SYSTEM_KEYMASTER_SHARED_MEMORY_TRANSPORT_H_
+
+#include <stdint.h>
+
+#include <atomic>
+
+#include <UniquePtr.h>
+
+#include <keymaster/android_keymaster.h>
+#include <keymaster/android_keymaster_messages.h>
+#include <keymaster/serializable.h>
+
+/*
+ * A reference transport for running AndroidKeymaster in another process.  The client and the server
+ * map a shared region holding two single-producer, single-consumer rings, one carrying requests and
+ * the other responses.  Each message is a record of a MessageRecordHeader followed by the message,
+ * serialized with the version the client chose; the server answers requests in the order they
+ * arrive, so a client may send a batch of them before reading any responses.
+ *
+ * The rings are lock-free.  A reader that finds its ring empty spins briefly, then sleeps on a
+ * futex; a writer only makes the wake-up system call if the reader is asleep, so a busy server
+ * takes no system calls at all.  A writer that finds its ring full waits for room the same way.
+ *
+ * Futexes in shared mappings work across processes, but the region could as well be ordinary
+ * memory shared by threads, which is how the tests use it.
+ */
+
+namespace keymaster {
+
+static_assert(ATOMIC_INT_LOCK_FREE == 2, "ring indices must be lock-free to be shared");
+
+struct MessageRecordHeader {
+    uint32_t length;  // Of the serialized message that follows.
+    uint32_t command;
+    uint32_t message_version;
+    uint32_t sequence;  // Responses repeat the sequence number of their request.
+};
+
+/**
+ * A ring of message records in memory MessageRing doesn't own.  One thread may write to a ring
+ * while one other thread, perhaps in another process, reads from it; each uses its own MessageRing
+ * over the region.  Records are wiped from the ring once consumed, since messages carry key
+ * material and operation data.
+ */
+class MessageRing {
+  public:
+    /**
+     * Returns the bytes of memory a ring of \p capacity bytes of records takes, or 0 if \p capacity
+     * isn't a power of two between MIN_CAPACITY and MAX_CAPACITY.
+     */
+    static size_t RegionSize(size_t capacity);
+
+    static const size_t MIN_CAPACITY = 256;
+    static const size_t MAX_CAPACITY = 1U << 30;
+
+    MessageRing()
+        : control_(nullptr), data_(nullptr), capacity_(0), scratch_size_(0), sleep_count_(0) {}
+
+    /**
+     * Lays out an empty ring in \p region, which must be RegionSize(capacity) bytes, suitably
+     * aligned for uint64_t, and not yet in use by the other side.
+     */
+    keymaster_error_t Initialize(void* region, size_t capacity);
+
+    /**
+     * Uses the ring another party initialized in \p region, which is \p region_size bytes.
+     */
+    keymaster_error_t Attach(void* region, size_t region_size);
+
+    /**
+     * Appends a record of \p message, waiting for room if the ring is full.  Returns
+     * KM_ERROR_SECURE_HW_COMMUNICATION_FAILED if the ring is closed, and
+     * KM_ERROR_INVALID_INPUT_LENGTH if the record could never fit.
+     */
+    keymaster_error_t Write(uint32_t command, uint32_t message_version, uint32_t sequence,
+                            const Serializable& message);
+
+    /**
+     * Waits for the next record and sets \p *header to its header, leaving the record in the ring.
+     * Returns KM_ERROR_SECURE_HW_COMMUNICATION_FAILED if the ring is closed and empty, and
+     * KM_ERROR_INVALID_ARGUMENT if the record is malformed.
+     */
+    keymaster_error_t Peek(MessageRecordHeader* header);
+
+    /**
+     * Deserializes the message of the record the last Peek() returned into \p message, unless it is
+     * NULL, and removes the record.  The record is removed even if the message is malformed, in
+     * which case KM_ERROR_INVALID_ARGUMENT is returned.
+     */
+    keymaster_error_t Consume(Serializable* message);
+
+    /**
+     * Marks the ring closed and wakes any waiting reader or writer.  Writes then fail; reads fail
+     * once the records already written are consumed.
+     */
+    void Close();
+    bool closed() const;
+
+    /**
+     * Returns the number of times this side slept waiting for the other, which is the number of
+     * futex waits and bounds the number of wake-ups the other side needed.
+     */
+    uint64_t sleep_count() const { return sleep_count_; }
+
+  private:
+    struct Control;
+
+    // The offset of the records from the start of the region.
+    static size_t DataOffset();
+    void CopyIn(uint32_t position, const void* data, size_t length);
+    void CopyOut(uint32_t position, void* data, size_t length) const;
+    void Wipe(uint32_t position, size_t length);
+    // Waits until *index differs from value or the ring is closed.
+    void WaitForChange(const std::atomic<uint32_t>& index, uint32_t value,
+                       std::atomic<uint32_t>* waiting, std::atomic<uint32_t>* wake_sequence);
+    void Wake(std::atomic<uint32_t>* waiting, std::atomic<uint32_t>* wake_sequence);
+
+    // Disallow copying and assignment.
+    MessageRing(const MessageRing&);
+    void operator=(const MessageRing&);
+
+    Control* control_;
+    uint8_t* data_;
+    uint32_t capacity_;
+    MessageRecordHeader peeked_;
+    UniquePtr<uint8_t[]> scratch_;  // Holds records that wrap around the end, to deserialize.
+    size_t scratch_size_;
+    SerializationSegments segments_;
+    uint64_t sleep_count_;
+};
+
+/**
+ * The request and response rings of a shared region.
+ */
+class SharedMemoryChannel {
+  public:
+    /**
+     * Returns the size of a region holding two rings of \p ring_capacity bytes each, or 0 if
+     * \p ring_capacity isn't valid for MessageRing.
+     */
+    static size_t RegionSize(size_t ring_capacity);
+
+    SharedMemoryChannel() {}
+
+    keymaster_error_t Initialize(void* region, size_t ring_capacity);
+    keymaster_error_t Attach(void* region, size_t region_size);
+
+    MessageRing* requests() { return &requests_; }
+    MessageRing* responses() { return &responses_; }
+
+    /**
+     * Closes both rings, which stops the server and fails the client's waits.
+     */
+    void Close();
+
+  private:
+    // Disallow copying and assignment.
+    SharedMemoryChannel(const SharedMemoryChannel&);
+    void operator=(const SharedMemoryChannel&);
+
+    MessageRing requests_;
+    MessageRing responses_;
+};
+
+/**
+ * Sends requests over a channel.  Not thread-safe: a channel has one client thread.
+ */
+class SharedMemoryKeymasterClient {
+  public:
+    // Doesn't take ownership of channel.
+    explicit SharedMemoryKeymasterClient(SharedMemoryChannel* channel)
+        : channel_(channel), next_sequence_(0), next_response_sequence_(0) {}
+
+    /**
+     * Queues a request without waiting for its response.  Its response is the one Receive()
+     * returns after those of all the requests sent before it.
+     */
+    keymaster_error_t Send(AndroidKeymasterCommand command, const KeymasterMessage& request);
+
+    /**
+     * Waits for the response to the oldest request sent and not yet received, and deserializes it
+     * into \p response, which must be of the type that request's command returns.  The result of
+     * the request itself is in response->error.
+     */
+    keymaster_error_t Receive(KeymasterResponse* response);
+
+    /**
+     * Sends a request and waits for its response.  Returns an error only if the transport failed.
+     */
+    keymaster_error_t Call(AndroidKeymasterCommand command, const KeymasterMessage& request,
+                           KeymasterResponse* response);
+
+    size_t outstanding_count() const { return next_sequence_ - next_response_sequence_; }
+
+  private:
+    // Disallow copying and assignment.
+    SharedMemoryKeymasterClient(const SharedMemoryKeymasterClient&);
+    void operator=(const SharedMemoryKeymasterClient&);
+
+    SharedMemoryChannel* channel_;
+    uint32_t next_sequence_;
+    uint32_t next_response_sequence_;
+};
+
+/**
+ * Answers the requests on a channel with an AndroidKeymaster.  Not thread-safe: a channel has one
+ * server thread.
+ */
+class SharedMemoryKeymasterServer {
+  public:
+    // Doesn't take ownership of channel or keymaster.
+    SharedMemoryKeymasterServer(SharedMemoryChannel* channel, AndroidKeymaster* keymaster)
+        : channel_(channel), keymaster_(keymaster) {}
+
+    /**
+     * Waits for a request, handles it and sends the response.  Requests for unknown commands or
+     * that don't deserialize are answered with KM_ERROR_UNIMPLEMENTED and KM_ERROR_INVALID_ARGUMENT
+     * responses that carry only the error.  Returns an error only if the transport failed.
+     */
+    keymaster_error_t ServeOne();
+
+    /**
+     * Serves requests until the channel is closed.
+     */
+    void Serve();
+
+  private:
+    // Disallow copying and assignment.
+    SharedMemoryKeymasterServer(const SharedMemoryKeymasterServer&);
+    void operator=(const SharedMemoryKeymasterServer&);
+
+    SharedMemoryChannel* channel_;
+    AndroidKeymaster* keymaster_;
+};
+
+}  // namespace keymaster
+
+#endif  // SYSTEM_KEYMASTER_SHARED_MEMORY_TRANSPORT_H_
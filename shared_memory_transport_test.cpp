@@ -0,0 +1,239 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <thread>
+
+#include <gtest/gtest.h>
+
+#include <keymaster/android_keymaster.h>
+#include <keymaster/soft_keymaster_context.h>
+
+#include "shared_memory_transport.h"
+
+namespace keymaster {
+namespace test {
+
+// A region of memory standing in for a shared mapping.  The two sides of the transport each use
+// their own channel over it, as separate processes would.
+class SharedRegion {
+  public:
+    explicit SharedRegion(size_t ring_capacity)
+        : size_(SharedMemoryChannel::RegionSize(ring_capacity)),
+          region_(new uint64_t[size_ / sizeof(uint64_t)]) {
+        EXPECT_EQ(KM_ERROR_OK, server_side_.Initialize(region_.get(), ring_capacity));
+        EXPECT_EQ(KM_ERROR_OK, client_side_.Attach(region_.get(), size_));
+    }
+
+    SharedMemoryChannel* server_side() { return &server_side_; }
+    SharedMemoryChannel* client_side() { return &client_side_; }
+
+  private:
+    size_t size_;
+    UniquePtr<uint64_t[]> region_;
+    SharedMemoryChannel server_side_;
+    SharedMemoryChannel client_side_;
+};
+
+class SharedMemoryTransportTest : public testing::Test {
+  protected:
+    SharedMemoryTransportTest()
+        : region_(4096), keymaster_(new SoftKeymasterContext, 16),
+          server_(region_.server_side(), &keymaster_), client_(region_.client_side()),
+          server_thread_(&SharedMemoryKeymasterServer::Serve, &server_) {}
+
+    ~SharedMemoryTransportTest() {
+        region_.client_side()->Close();
+        server_thread_.join();
+    }
+
+    SharedRegion region_;
+    AndroidKeymaster keymaster_;
+    SharedMemoryKeymasterServer server_;
+    SharedMemoryKeymasterClient client_;
+    std::thread server_thread_;
+};
+
+static const char kMessage[] = "a message that is signed";
+
+TEST_F(SharedMemoryTransportTest, PipelinedRequests) {
+    GetVersionRequest version_request;
+    GetVersionResponse version_response;
+    ASSERT_EQ(KM_ERROR_OK, client_.Call(GET_VERSION, version_request, &version_response));
+    EXPECT_EQ(KM_ERROR_OK, version_response.error);
+    EXPECT_EQ(1U, version_response.major_ver);
+
+    GenerateKeyRequest generate;
+    generate.key_description.Reinitialize(AuthorizationSet(AuthorizationSetBuilder()
+                                                               .HmacKey(128)
+                                                               .Digest(KM_DIGEST_SHA_2_256)
+                                                               .Authorization(TAG_MIN_MAC_LENGTH,
+                                                                              128)
+                                                               .Authorization(
+                                                                   TAG_NO_AUTH_REQUIRED)));
+    GenerateKeyResponse key;
+    ASSERT_EQ(KM_ERROR_OK, client_.Call(GENERATE_KEY, generate, &key));
+    ASSERT_EQ(KM_ERROR_OK, key.error);
+
+    // Send a batch of one-shot MACs before reading any of the responses.
+    const size_t kBatchSize = 8;
+    OneShotOperationRequest sign;
+    sign.purpose = KM_PURPOSE_SIGN;
+    sign.SetKeyMaterial(key.key_blob);
+    sign.additional_params.Reinitialize(AuthorizationSet(
+        AuthorizationSetBuilder().Digest(KM_DIGEST_SHA_2_256).Authorization(TAG_MAC_LENGTH, 256)));
+    sign.input.Reinitialize(kMessage, sizeof(kMessage));
+    for (size_t i = 0; i < kBatchSize; ++i)
+        ASSERT_EQ(KM_ERROR_OK, client_.Send(ONE_SHOT_OPERATION, sign));
+    EXPECT_EQ(kBatchSize, client_.outstanding_count());
+
+    OneShotOperationResponse first;
+    ASSERT_EQ(KM_ERROR_OK, client_.Receive(&first));
+    ASSERT_EQ(KM_ERROR_OK, first.error);
+    EXPECT_EQ(32U, first.output.available_read());
+    for (size_t i = 1; i < kBatchSize; ++i) {
+        OneShotOperationResponse response;
+        ASSERT_EQ(KM_ERROR_OK, client_.Receive(&response));
+        ASSERT_EQ(KM_ERROR_OK, response.error);
+        ASSERT_EQ(first.output.available_read(), response.output.available_read());
+        EXPECT_EQ(0, memcmp(first.output.peek_read(), response.output.peek_read(),
+                            first.output.available_read()));
+    }
+    EXPECT_EQ(0U, client_.outstanding_count());
+}
+
+TEST_F(SharedMemoryTransportTest, Operation) {
+    GenerateKeyRequest generate;
+    generate.key_description.Reinitialize(AuthorizationSet(AuthorizationSetBuilder()
+                                                               .HmacKey(128)
+                                                               .Digest(KM_DIGEST_SHA_2_256)
+                                                               .Authorization(TAG_MIN_MAC_LENGTH,
+                                                                              128)
+                                                               .Authorization(
+                                                                   TAG_NO_AUTH_REQUIRED)));
+    GenerateKeyResponse key;
+    ASSERT_EQ(KM_ERROR_OK, client_.Call(GENERATE_KEY, generate, &key));
+    ASSERT_EQ(KM_ERROR_OK, key.error);
+
+    BeginOperationRequest begin;
+    begin.purpose = KM_PURPOSE_SIGN;
+    begin.SetKeyMaterial(key.key_blob);
+    begin.additional_params.Reinitialize(AuthorizationSet(
+        AuthorizationSetBuilder().Digest(KM_DIGEST_SHA_2_256).Authorization(TAG_MAC_LENGTH, 256)));
+    BeginOperationResponse begin_response;
+    ASSERT_EQ(KM_ERROR_OK, client_.Call(BEGIN_OPERATION, begin, &begin_response));
+    ASSERT_EQ(KM_ERROR_OK, begin_response.error);
+
+    UpdateOperationRequest update;
+    update.op_handle = begin_response.op_handle;
+    update.input.Reinitialize(kMessage, sizeof(kMessage));
+    FinishOperationRequest finish;
+    finish.op_handle = begin_response.op_handle;
+    ASSERT_EQ(KM_ERROR_OK, client_.Send(UPDATE_OPERATION, update));
+    ASSERT_EQ(KM_ERROR_OK, client_.Send(FINISH_OPERATION, finish));
+
+    UpdateOperationResponse update_response;
+    ASSERT_EQ(KM_ERROR_OK, client_.Receive(&update_response));
+    EXPECT_EQ(KM_ERROR_OK, update_response.error);
+    EXPECT_EQ(sizeof(kMessage), update_response.input_consumed);
+    FinishOperationResponse finish_response;
+    ASSERT_EQ(KM_ERROR_OK, client_.Receive(&finish_response));
+    EXPECT_EQ(KM_ERROR_OK, finish_response.error);
+    EXPECT_EQ(32U, finish_response.output.available_read());
+    EXPECT_FALSE(keymaster_.has_operation(begin_response.op_handle));
+}
+
+TEST_F(SharedMemoryTransportTest, UnknownCommand) {
+    AbortOperationRequest request;
+    AbortOperationResponse response;
+    ASSERT_EQ(KM_ERROR_OK,
+              client_.Call(static_cast<AndroidKeymasterCommand>(1000), request, &response));
+    EXPECT_EQ(KM_ERROR_UNIMPLEMENTED, response.error);
+
+    // The channel still works.
+    request.op_handle = 1;
+    ASSERT_EQ(KM_ERROR_OK, client_.Call(ABORT_OPERATION, request, &response));
+    EXPECT_EQ(KM_ERROR_INVALID_OPERATION_HANDLE, response.error);
+}
+
+TEST(MessageRingTest, RejectsBadCapacities) {
+    EXPECT_EQ(0U, MessageRing::RegionSize(0));
+    EXPECT_EQ(0U, MessageRing::RegionSize(MessageRing::MIN_CAPACITY / 2));
+    EXPECT_EQ(0U, MessageRing::RegionSize(MessageRing::MIN_CAPACITY + 1));
+    EXPECT_NE(0U, MessageRing::RegionSize(MessageRing::MIN_CAPACITY));
+}
+
+TEST(MessageRingTest, WrapsAround) {
+    const size_t kCapacity = MessageRing::MIN_CAPACITY;
+    UniquePtr<uint64_t[]> region(new uint64_t[MessageRing::RegionSize(kCapacity) / 8]);
+    MessageRing writer, reader;
+    ASSERT_EQ(KM_ERROR_OK, writer.Initialize(region.get(), kCapacity));
+    ASSERT_EQ(KM_ERROR_OK, reader.Attach(region.get(), MessageRing::RegionSize(kCapacity)));
+
+    // Records of varying sizes, many times the capacity in total, so that they wrap at every
+    // offset into the ring.
+    const uint32_t kCount = 1000;
+    std::thread writer_thread([&] {
+        for (uint32_t i = 0; i < kCount; ++i) {
+            Buffer message(i % 97);
+            for (size_t j = 0; j < i % 97; ++j)
+                message.write(reinterpret_cast<const uint8_t*>(&i), 1);
+            ASSERT_EQ(KM_ERROR_OK, writer.Write(i % 7, MAX_MESSAGE_VERSION, i, message));
+        }
+    });
+    for (uint32_t i = 0; i < kCount; ++i) {
+        MessageRecordHeader header;
+        ASSERT_EQ(KM_ERROR_OK, reader.Peek(&header));
+        EXPECT_EQ(i, header.sequence);
+        EXPECT_EQ(i % 7, header.command);
+        Buffer message;
+        ASSERT_EQ(KM_ERROR_OK, reader.Consume(&message));
+        ASSERT_EQ(i % 97, message.available_read());
+        for (size_t j = 0; j < i % 97; ++j)
+            ASSERT_EQ(static_cast<uint8_t>(i), message.peek_read()[j]);
+    }
+    writer_thread.join();
+}
+
+TEST(MessageRingTest, RejectsOversizeMessages) {
+    const size_t kCapacity = MessageRing::MIN_CAPACITY;
+    UniquePtr<uint64_t[]> region(new uint64_t[MessageRing::RegionSize(kCapacity) / 8]);
+    MessageRing ring;
+    ASSERT_EQ(KM_ERROR_OK, ring.Initialize(region.get(), kCapacity));
+    Buffer message(kCapacity);
+    message.advance_write(kCapacity);
+    EXPECT_EQ(KM_ERROR_INVALID_INPUT_LENGTH, ring.Write(0, MAX_MESSAGE_VERSION, 0, message));
+}
+
+TEST(MessageRingTest, CloseWakesReader) {
+    const size_t kCapacity = MessageRing::MIN_CAPACITY;
+    UniquePtr<uint64_t[]> region(new uint64_t[MessageRing::RegionSize(kCapacity) / 8]);
+    MessageRing writer, reader;
+    ASSERT_EQ(KM_ERROR_OK, writer.Initialize(region.get(), kCapacity));
+    ASSERT_EQ(KM_ERROR_OK, reader.Attach(region.get(), MessageRing::RegionSize(kCapacity)));
+
+    keymaster_error_t error = KM_ERROR_OK;
+    std::thread reader_thread([&] {
+        MessageRecordHeader header;
+        error = reader.Peek(&header);
+    });
+    writer.Close();
+    reader_thread.join();
+    EXPECT_EQ(KM_ERROR_SECURE_HW_COMMUNICATION_FAILED, error);
+    EXPECT_TRUE(reader.closed());
+}
+
+}  // namespace test
+}  // namespace keymaster
@@ -16,28 +16,42 @@
 
 #include <keymaster/soft_keymaster_context.h>
 
+#include <assert.h>
+
 #include <memory>
+#include <mutex>
 #include <time.h>
 
 #include <openssl/aes.h>
+#include <openssl/err.h>
 #include <openssl/hmac.h>
 #include <openssl/rand.h>
 #include <openssl/sha.h>
 
 #include <keymaster/android_keymaster_utils.h>
+#include <keymaster/key_policy.h>
 #include <keymaster/logger.h>
 
 #include "aes_key.h"
 #include "auth_encrypted_key_blob.h"
-#include "ec_keymaster0_key.h"
-#include "ec_keymaster1_key.h"
+#include "buffered_random.h"
+#include "chacha20_poly1305_key.h"
 #include "hmac_key.h"
 #include "integrity_assured_key_blob.h"
-#include "keymaster0_engine.h"
 #include "ocb_utils.h"
 #include "openssl_err.h"
+#include "openssl_utils.h"
+
+#ifndef KEYMASTER_SYMMETRIC_ONLY
+#include "attestation_bundle.h"
+#include "ec_keymaster0_key.h"
+#include "ec_keymaster1_key.h"
+#include "ed25519_key.h"
+#include "keymaster0_engine.h"
 #include "rsa_keymaster0_key.h"
 #include "rsa_keymaster1_key.h"
+#include "verification_cache.h"
+#endif
 
 using std::unique_ptr;
 
@@ -47,6 +61,7 @@ namespace {
 static uint8_t master_key_bytes[AES_BLOCK_SIZE] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0};
 const KeymasterKeyBlob MASTER_KEY(master_key_bytes, array_length(master_key_bytes));
 
+#ifndef KEYMASTER_SYMMETRIC_ONLY
 static uint8_t kRsaAttestKey[] = {
     0x30, 0x82, 0x02, 0x5d, 0x02, 0x01, 0x00, 0x02, 0x81, 0x81, 0x00, 0xc0, 0x83, 0x23, 0xdc, 0x56,
     0x88, 0x1b, 0xb8, 0x30, 0x20, 0x69, 0xf5, 0xb0, 0x85, 0x61, 0xc6, 0xee, 0xbe, 0x7f, 0x05, 0xe2,
@@ -281,6 +296,7 @@ static uint8_t kEcAttestRootCert[] = {
 };
 
 size_t kCertificateChainLength = 2;
+#endif  // KEYMASTER_SYMMETRIC_ONLY
 
 bool UpgradeIntegerTag(keymaster_tag_t tag, uint32_t value, AuthorizationSet* set,
                        bool* set_changed) {
@@ -306,13 +322,54 @@ bool UpgradeIntegerTag(keymaster_tag_t tag, uint32_t value, AuthorizationSet* se
 
 }  // anonymous namespace
 
+// The attestation keys and signing certificates are decoded on first use and shared by every
+// attestation after that.
+struct SoftKeymasterContext::AttestationCache {
+#ifndef KEYMASTER_SYMMETRIC_ONLY
+    // Points key and chain at the attestation key and certificate chain, leaf first, for
+    // algorithm, which must be RSA or EC: from bundle if it covers the algorithm, and from the
+    // compiled-in arrays otherwise.  chain must have room for AttestationBundle::kMaxChainLength
+    // blobs.  Must be called with mutex held.
+    void GetAttestationData(keymaster_algorithm_t algorithm, keymaster_blob_t* key,
+                            keymaster_blob_t* chain, size_t* chain_length) const;
+
+    std::unique_ptr<AttestationBundle> bundle;
+#endif
+    std::mutex mutex;
+    EVP_PKEY_Ptr rsa_key;
+    EVP_PKEY_Ptr ec_key;
+    X509_Ptr rsa_cert;
+    X509_Ptr ec_cert;
+};
+
 SoftKeymasterContext::SoftKeymasterContext(const std::string& root_of_trust)
-    : rsa_factory_(new RsaKeyFactory(this)), ec_factory_(new EcKeyFactory(this)),
-      aes_factory_(new AesKeyFactory(this)), hmac_factory_(new HmacKeyFactory(this)),
-      km1_dev_(nullptr), root_of_trust_(root_of_trust), os_version_(0), os_patchlevel_(0) {}
+    : aes_factory_(new AesKeyFactory(this)), hmac_factory_(new HmacKeyFactory(this)),
+      chacha20_poly1305_factory_(new ChaCha20Poly1305KeyFactory(this)),
+      attestation_cache_(new AttestationCache), km1_dev_(nullptr), root_of_trust_(root_of_trust),
+      root_of_trust_param_(keymaster_param_blob(
+          TAG_ROOT_OF_TRUST, reinterpret_cast<const uint8_t*>(root_of_trust_.data()),
+          root_of_trust_.size())),
+      os_version_(0), os_patchlevel_(0) {
+#ifndef KEYMASTER_SYMMETRIC_ONLY
+    rsa_factory_.reset(new RsaKeyFactory(this));
+    ec_factory_.reset(new EcKeyFactory(this));
+    ed25519_factory_.reset(new Ed25519KeyFactory(this));
+#endif
+    BuildOperationFactoryTable();
+}
 
 SoftKeymasterContext::~SoftKeymasterContext() {}
 
+#ifdef KEYMASTER_SYMMETRIC_ONLY
+// Symmetric-only builds have no RSA or EC keys to hand to hardware.
+keymaster_error_t SoftKeymasterContext::SetHardwareDevice(keymaster0_device_t* /* device */) {
+    return KM_ERROR_UNIMPLEMENTED;
+}
+
+keymaster_error_t SoftKeymasterContext::SetHardwareDevice(keymaster1_device_t* /* device */) {
+    return KM_ERROR_UNIMPLEMENTED;
+}
+#else   // KEYMASTER_SYMMETRIC_ONLY
 keymaster_error_t SoftKeymasterContext::SetHardwareDevice(keymaster0_device_t* keymaster0_device) {
     if (!keymaster0_device)
         return KM_ERROR_UNEXPECTED_NULL_POINTER;
@@ -326,6 +383,7 @@ keymaster_error_t SoftKeymasterContext::SetHardwareDevice(keymaster0_device_t* k
     rsa_factory_.reset(new RsaKeymaster0KeyFactory(this, km0_engine_.get()));
     ec_factory_.reset(new EcdsaKeymaster0KeyFactory(this, km0_engine_.get()));
     // Keep AES and HMAC factories.
+    BuildOperationFactoryTable();
 
     return KM_ERROR_OK;
 }
@@ -345,9 +403,12 @@ keymaster_error_t SoftKeymasterContext::SetHardwareDevice(keymaster1_device_t* k
     // device.
     aes_factory_.reset(nullptr);
     hmac_factory_.reset(nullptr);
+    // The keymaster1 device can't do ChaCha20-Poly1305 or Ed25519, so those keys stay in software.
+    BuildOperationFactoryTable();
 
     return KM_ERROR_OK;
 }
+#endif  // KEYMASTER_SYMMETRIC_ONLY
 
 keymaster_error_t SoftKeymasterContext::SetSystemVersion(uint32_t os_version,
                                                          uint32_t os_patchlevel) {
@@ -361,7 +422,134 @@ void SoftKeymasterContext::GetSystemVersion(uint32_t* os_version, uint32_t* os_p
     *os_patchlevel = os_patchlevel_;
 }
 
+#ifdef KEYMASTER_SYMMETRIC_ONLY
+keymaster_error_t
+SoftKeymasterContext::EnableRsaKeyPregeneration(const RsaKeyFactory::PregeneratedKeySpec*, size_t,
+                                                size_t, size_t) {
+    return KM_ERROR_UNIMPLEMENTED;
+}
+
+keymaster_error_t SoftKeymasterContext::EnableEcKeyPregeneration(const keymaster_ec_curve_t*,
+                                                                 size_t, size_t, size_t) {
+    return KM_ERROR_UNIMPLEMENTED;
+}
+
+keymaster_error_t SoftKeymasterContext::EnableEcdsaSignSetupPrecomputation(size_t) {
+    return KM_ERROR_UNIMPLEMENTED;
+}
+
+keymaster_error_t SoftKeymasterContext::EnableRsaBlindingPrecomputation(size_t) {
+    return KM_ERROR_UNIMPLEMENTED;
+}
+
+keymaster_error_t SoftKeymasterContext::EnableMultiPrimeRsaKeys(uint32_t, uint32_t) {
+    return KM_ERROR_UNIMPLEMENTED;
+}
+
+keymaster_error_t SoftKeymasterContext::EnableParallelRsaPrimeSearch(uint32_t) {
+    return KM_ERROR_UNIMPLEMENTED;
+}
+
+keymaster_error_t SoftKeymasterContext::EnableVerificationCache(size_t) {
+    return KM_ERROR_UNIMPLEMENTED;
+}
+
+keymaster_error_t SoftKeymasterContext::EnableKeymaster1RequestQueue() {
+    return KM_ERROR_UNIMPLEMENTED;
+}
+
+keymaster_error_t SoftKeymasterContext::SetAttestationBundle(const char* /* path */) {
+    return KM_ERROR_UNIMPLEMENTED;
+}
+#else   // KEYMASTER_SYMMETRIC_ONLY
+keymaster_error_t
+SoftKeymasterContext::EnableRsaKeyPregeneration(const RsaKeyFactory::PregeneratedKeySpec* specs,
+                                                size_t spec_count, size_t pool_size,
+                                                size_t low_water_mark) {
+    if (km0_engine_ || km1_engine_)
+        return KM_ERROR_UNIMPLEMENTED;
+    return static_cast<RsaKeyFactory*>(rsa_factory_.get())
+        ->EnableKeyPregeneration(specs, spec_count, pool_size, low_water_mark);
+}
+
+keymaster_error_t SoftKeymasterContext::EnableEcKeyPregeneration(const keymaster_ec_curve_t* curves,
+                                                                 size_t curve_count,
+                                                                 size_t pool_size,
+                                                                 size_t low_water_mark) {
+    if (km0_engine_ || km1_engine_)
+        return KM_ERROR_UNIMPLEMENTED;
+    return static_cast<EcKeyFactory*>(ec_factory_.get())
+        ->EnableKeyPregeneration(curves, curve_count, pool_size, low_water_mark);
+}
+
+keymaster_error_t SoftKeymasterContext::EnableEcdsaSignSetupPrecomputation(size_t queue_size) {
+    if (km0_engine_ || km1_engine_)
+        return KM_ERROR_UNIMPLEMENTED;
+    return static_cast<EcKeyFactory*>(ec_factory_.get())->EnableSignSetupPrecomputation(queue_size);
+}
+
+keymaster_error_t SoftKeymasterContext::EnableRsaBlindingPrecomputation(size_t queue_size) {
+    if (km0_engine_ || km1_engine_)
+        return KM_ERROR_UNIMPLEMENTED;
+    return static_cast<RsaKeyFactory*>(rsa_factory_.get())
+        ->EnableBlindingPrecomputation(queue_size);
+}
+
+keymaster_error_t SoftKeymasterContext::EnableMultiPrimeRsaKeys(uint32_t min_key_size,
+                                                                uint32_t prime_count) {
+    if (km0_engine_ || km1_engine_)
+        return KM_ERROR_UNIMPLEMENTED;
+    return static_cast<RsaKeyFactory*>(rsa_factory_.get())
+        ->EnableMultiPrimeKeys(min_key_size, prime_count);
+}
+
+keymaster_error_t SoftKeymasterContext::EnableParallelRsaPrimeSearch(uint32_t min_key_size) {
+    if (km0_engine_ || km1_engine_)
+        return KM_ERROR_UNIMPLEMENTED;
+    return static_cast<RsaKeyFactory*>(rsa_factory_.get())->EnableParallelPrimeSearch(min_key_size);
+}
+
+keymaster_error_t SoftKeymasterContext::EnableVerificationCache(size_t max_entries) {
+    if (km0_engine_ || km1_engine_)
+        return KM_ERROR_UNIMPLEMENTED;
+    verification_cache_.reset(new (std::nothrow) VerificationCache(max_entries));
+    if (!verification_cache_)
+        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    static_cast<RsaKeyFactory*>(rsa_factory_.get())->EnableVerificationCache(verification_cache_);
+    static_cast<EcKeyFactory*>(ec_factory_.get())->EnableVerificationCache(verification_cache_);
+    return KM_ERROR_OK;
+}
+
+keymaster_error_t SoftKeymasterContext::EnableKeymaster1RequestQueue() {
+    if (!km1_engine_)
+        return KM_ERROR_UNIMPLEMENTED;
+    km1_engine_->EnableRequestQueue();
+    return km1_engine_->request_queue() ? KM_ERROR_OK : KM_ERROR_MEMORY_ALLOCATION_FAILED;
+}
+
+keymaster_error_t SoftKeymasterContext::SetAttestationBundle(const char* path) {
+    std::unique_ptr<AttestationBundle> bundle(new (std::nothrow) AttestationBundle(path));
+    if (!bundle)
+        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    if (!bundle->initialized())
+        return KM_ERROR_UNKNOWN_ERROR;
+
+    std::lock_guard<std::mutex> lock(attestation_cache_->mutex);
+    attestation_cache_->bundle = std::move(bundle);
+    attestation_cache_->rsa_key.reset();
+    attestation_cache_->ec_key.reset();
+    attestation_cache_->rsa_cert.reset();
+    attestation_cache_->ec_cert.reset();
+    return KM_ERROR_OK;
+}
+#endif  // KEYMASTER_SYMMETRIC_ONLY
+
 KeyFactory* SoftKeymasterContext::GetKeyFactory(keymaster_algorithm_t algorithm) const {
+    // Not keymaster_algorithm_t enumerators, so they can't be case labels.
+    if (algorithm == KM_ALGORITHM_CHACHA20_POLY1305)
+        return chacha20_poly1305_factory_.get();
+    if (algorithm == KM_ALGORITHM_ED25519)
+        return ed25519_factory_.get();
     switch (algorithm) {
     case KM_ALGORITHM_RSA:
         return rsa_factory_.get();
@@ -376,6 +564,8 @@ KeyFactory* SoftKeymasterContext::GetKeyFactory(keymaster_algorithm_t algorithm)
     }
 }
 
+// KM_ALGORITHM_CHACHA20_POLY1305 and KM_ALGORITHM_ED25519 aren't listed, because this list reaches
+// HAL clients, which only know the HAL's algorithms.  Callers that know of them can still use them.
 static keymaster_algorithm_t supported_algorithms[] = {KM_ALGORITHM_RSA, KM_ALGORITHM_EC,
                                                        KM_ALGORITHM_AES, KM_ALGORITHM_HMAC};
 
@@ -385,12 +575,49 @@ SoftKeymasterContext::GetSupportedAlgorithms(size_t* algorithms_count) const {
     return supported_algorithms;
 }
 
+// The algorithms in operation_factories_, in slot order.
+static const keymaster_algorithm_t operation_table_algorithms[] = {
+    KM_ALGORITHM_RSA, KM_ALGORITHM_EC, KM_ALGORITHM_AES, KM_ALGORITHM_HMAC,
+    KM_ALGORITHM_CHACHA20_POLY1305, KM_ALGORITHM_ED25519};
+
+static int OperationTableSlot(keymaster_algorithm_t algorithm) {
+    if (algorithm == KM_ALGORITHM_CHACHA20_POLY1305)
+        return 4;
+    if (algorithm == KM_ALGORITHM_ED25519)
+        return 5;
+    switch (algorithm) {
+    case KM_ALGORITHM_RSA:
+        return 0;
+    case KM_ALGORITHM_EC:
+        return 1;
+    case KM_ALGORITHM_AES:
+        return 2;
+    case KM_ALGORITHM_HMAC:
+        return 3;
+    default:
+        return -1;
+    }
+}
+
+void SoftKeymasterContext::BuildOperationFactoryTable() {
+    assert(array_length(operation_table_algorithms) == kOperationTableAlgorithms);
+    for (size_t i = 0; i < kOperationTableAlgorithms; ++i) {
+        assert(OperationTableSlot(operation_table_algorithms[i]) == static_cast<int>(i));
+        KeyFactory* key_factory = GetKeyFactory(operation_table_algorithms[i]);
+        for (size_t purpose = 0; purpose < kOperationTablePurposes; ++purpose)
+            operation_factories_[i][purpose] =
+                key_factory ? key_factory->GetOperationFactory(
+                                  static_cast<keymaster_purpose_t>(purpose))
+                            : nullptr;
+    }
+}
+
 OperationFactory* SoftKeymasterContext::GetOperationFactory(keymaster_algorithm_t algorithm,
                                                             keymaster_purpose_t purpose) const {
-    KeyFactory* key_factory = GetKeyFactory(algorithm);
-    if (!key_factory)
+    int slot = OperationTableSlot(algorithm);
+    if (slot < 0 || static_cast<size_t>(purpose) >= kOperationTablePurposes)
         return nullptr;
-    return key_factory->GetOperationFactory(purpose);
+    return operation_factories_[slot][purpose];
 }
 
 static keymaster_error_t TranslateAuthorizationSetError(AuthorizationSet::Error err) {
@@ -410,6 +637,8 @@ static keymaster_error_t SetAuthorizations(const AuthorizationSet& key_descripti
                                            uint32_t os_patchlevel, AuthorizationSet* hw_enforced,
                                            AuthorizationSet* sw_enforced) {
     sw_enforced->Clear();
+    // Everything in the description, plus the four entries added below, is an upper bound.
+    sw_enforced->Reserve(key_description.size() + 4, key_description.indirect_size());
 
     for (auto& entry : key_description) {
         switch (entry.tag) {
@@ -462,7 +691,14 @@ keymaster_error_t SoftKeymasterContext::CreateKeyBlob(const AuthorizationSet& ke
     if (error != KM_ERROR_OK)
         return error;
 
-    return SerializeIntegrityAssuredBlob(key_material, hidden, *hw_enforced, *sw_enforced, blob);
+    // Enforcement checks the policy rather than the auth sets, so compile it once, here.
+    KeyPolicy policy;
+    error = policy.Compile(*hw_enforced, *sw_enforced);
+    if (error != KM_ERROR_OK)
+        return error;
+
+    return SerializeIntegrityAssuredBlob(key_material, hidden, *hw_enforced, *sw_enforced, policy,
+                                         blob);
 }
 
 keymaster_error_t SoftKeymasterContext::UpgradeKeyBlob(const KeymasterKeyBlob& key_to_upgrade,
@@ -521,7 +757,11 @@ keymaster_error_t SoftKeymasterContext::UpgradeKeyBlob(const KeymasterKeyBlob& k
     error = BuildHiddenAuthorizations(upgrade_params, &hidden);
     if (error != KM_ERROR_OK)
         return error;
-    return SerializeIntegrityAssuredBlob(key_material, hidden, tee_enforced, sw_enforced,
+    KeyPolicy policy;
+    error = policy.Compile(tee_enforced, sw_enforced);
+    if (error != KM_ERROR_OK)
+        return error;
+    return SerializeIntegrityAssuredBlob(key_material, hidden, tee_enforced, sw_enforced, policy,
                                          upgraded_key);
 }
 
@@ -540,14 +780,25 @@ static keymaster_error_t ParseOcbAuthEncryptedBlob(const KeymasterKeyBlob& blob,
     if (nonce.available_read() != OCB_NONCE_LENGTH || tag.available_read() != OCB_TAG_LENGTH)
         return KM_ERROR_INVALID_KEY_BLOB;
 
+    // OCB's tag covers the plaintext, so the blob can't be authenticated without decrypting it,
+    // even if the caller doesn't want the key material.
+    KeymasterKeyBlob discarded_key_material;
     return OcbDecryptKey(*hw_enforced, *sw_enforced, hidden, MASTER_KEY, encrypted_key_material,
-                         nonce, tag, key_material);
+                         nonce, tag, key_material ? key_material : &discarded_key_material);
 }
 
 // Note: This parsing code in below is from system/security/softkeymaster/keymaster_openssl.cpp's
 // unwrap_key function, modified for the preferred function signature and formatting.  It does some
 // odd things, but they have been left unchanged to avoid breaking compatibility.
 static const uint8_t SOFT_KEY_MAGIC[] = {'P', 'K', '#', '8'};
+// The first byte of any DER-encoded private key.
+static const uint8_t kDerSequenceTag = 0x30;
+
+static bool HasOldSoftkeymasterMagic(const KeymasterKeyBlob& blob) {
+    return blob.key_material && blob.key_material_size >= sizeof(SOFT_KEY_MAGIC) &&
+           memcmp(blob.key_material, SOFT_KEY_MAGIC, sizeof(SOFT_KEY_MAGIC)) == 0;
+}
+
 keymaster_error_t SoftKeymasterContext::ParseOldSoftkeymasterBlob(
     const KeymasterKeyBlob& blob, KeymasterKeyBlob* key_material, AuthorizationSet* hw_enforced,
     AuthorizationSet* sw_enforced) const {
@@ -593,6 +844,13 @@ keymaster_error_t SoftKeymasterContext::ParseOldSoftkeymasterBlob(
         return KM_ERROR_INVALID_KEY_BLOB;
     }
 
+    // This is a trial parse, so reject what plainly isn't a DER-encoded private key before
+    // OpenSSL sees it, and don't leave OpenSSL's errors behind when it fails.
+    if (privateLen < 2 || *p != kDerSequenceTag) {
+        LOG_W("Key material is not a DER sequence (if old SW key)", 0);
+        return KM_ERROR_INVALID_KEY_BLOB;
+    }
+
     // Just to be sure, make sure that the ASN.1 structure parses correctly.  We don't actually use
     // the EVP_PKEY here.
     unique_ptr<EVP_PKEY, EVP_PKEY_Delete> pkey(EVP_PKEY_new());
@@ -602,6 +860,7 @@ keymaster_error_t SoftKeymasterContext::ParseOldSoftkeymasterBlob(
     EVP_PKEY* tmp = pkey.get();
     const uint8_t* key_start = p;
     if (d2i_PrivateKey(type, &tmp, &p, privateLen) == NULL) {
+        ERR_clear_error();
         LOG_W("Failed to parse PKCS#8 key material (if old SW key)", 0);
         return KM_ERROR_INVALID_KEY_BLOB;
     }
@@ -613,6 +872,8 @@ keymaster_error_t SoftKeymasterContext::ParseOldSoftkeymasterBlob(
     if (error != KM_ERROR_OK)
         return error;
 
+    if (!key_material)
+        return KM_ERROR_OK;
     if (!key_material->Reset(privateLen))
         return KM_ERROR_MEMORY_ALLOCATION_FAILED;
     memcpy(key_material->writable_data(), key_start, privateLen);
@@ -620,11 +881,95 @@ keymaster_error_t SoftKeymasterContext::ParseOldSoftkeymasterBlob(
     return KM_ERROR_OK;
 }
 
+keymaster_error_t SoftKeymasterContext::ParseSoftwareBlob(SoftwareBlobFormat format,
+                                                          const KeymasterKeyBlob& blob,
+                                                          const AuthorizationSet& hidden,
+                                                          KeymasterKeyBlob* key_material,
+                                                          AuthorizationSet* hw_enforced,
+                                                          AuthorizationSet* sw_enforced,
+                                                          KeyPolicy* policy) const {
+    keymaster_error_t error = KM_ERROR_INVALID_KEY_BLOB;
+    switch (format) {
+    case INTEGRITY_ASSURED_BLOB:
+        // New software-only blob, or new keymaster0-backed blob.  These may store their policy.
+        if (policy)
+            return DeserializeIntegrityAssuredBlob(blob, hidden, key_material, hw_enforced,
+                                                   sw_enforced, policy);
+        error =
+            DeserializeIntegrityAssuredBlob(blob, hidden, key_material, hw_enforced, sw_enforced);
+        break;
+    case OCB_ENCRYPTED_BLOB:
+        error = ParseOcbAuthEncryptedBlob(blob, hidden, key_material, hw_enforced, sw_enforced);
+        if (error == KM_ERROR_OK)
+            LOG_D("Parsed an old keymaster1 software key", 0);
+        break;
+    case OLD_SOFTKEYMASTER_BLOB:
+        error = ParseOldSoftkeymasterBlob(blob, key_material, hw_enforced, sw_enforced);
+        if (error == KM_ERROR_OK)
+            LOG_D("Parsed an old sofkeymaster key", 0);
+        break;
+    }
+    if (error == KM_ERROR_OK && policy)
+        error = policy->Compile(*hw_enforced, *sw_enforced);
+    return error;
+}
+
 keymaster_error_t SoftKeymasterContext::ParseKeyBlob(const KeymasterKeyBlob& blob,
                                                      const AuthorizationSet& additional_params,
                                                      KeymasterKeyBlob* key_material,
                                                      AuthorizationSet* hw_enforced,
                                                      AuthorizationSet* sw_enforced) const {
+    return ParseAnyKeyBlob(blob, additional_params, key_material, hw_enforced, sw_enforced,
+                           nullptr /* policy */, nullptr /* legacy */);
+}
+
+keymaster_error_t SoftKeymasterContext::ParseKeyBlobWithLegacyStatus(
+    const KeymasterKeyBlob& blob, const AuthorizationSet& additional_params,
+    KeymasterKeyBlob* key_material, AuthorizationSet* hw_enforced, AuthorizationSet* sw_enforced,
+    bool* legacy) const {
+    return ParseAnyKeyBlob(blob, additional_params, key_material, hw_enforced, sw_enforced,
+                           nullptr /* policy */, legacy);
+}
+
+keymaster_error_t SoftKeymasterContext::MigrateKeyBlob(const KeymasterKeyBlob& blob,
+                                                       const AuthorizationSet& additional_params,
+                                                       KeymasterKeyBlob* migrated_key) const {
+    AuthorizationSet hidden;
+    keymaster_error_t error = BuildHiddenAuthorizations(additional_params, &hidden);
+    if (error != KM_ERROR_OK)
+        return error;
+
+    KeymasterKeyBlob key_material;
+    AuthorizationSet hw_enforced;
+    AuthorizationSet sw_enforced;
+    KeyPolicy policy;
+    bool legacy;
+    error = ParseAnyKeyBlobWithHidden(blob, additional_params, hidden, &key_material, &hw_enforced,
+                                      &sw_enforced, &policy, &legacy);
+    if (error != KM_ERROR_OK || !legacy)
+        return error;
+
+    // The authorizations legacy parsers fake from the key are stored as they are, so the new blob
+    // reads back as the old one did.  Old keymaster0 hardware blobs become the key material of
+    // new keymaster0-backed blobs.
+    return SerializeIntegrityAssuredBlob(key_material, hidden, hw_enforced, sw_enforced, policy,
+                                         migrated_key);
+}
+
+keymaster_error_t SoftKeymasterContext::ParseKeyBlobWithPolicy(
+    const KeymasterKeyBlob& blob, const AuthorizationSet& additional_params,
+    KeymasterKeyBlob* key_material, AuthorizationSet* hw_enforced, AuthorizationSet* sw_enforced,
+    KeyPolicy* policy) const {
+    return ParseAnyKeyBlob(blob, additional_params, key_material, hw_enforced, sw_enforced, policy,
+                           nullptr /* legacy */);
+}
+
+keymaster_error_t SoftKeymasterContext::ParseAnyKeyBlob(const KeymasterKeyBlob& blob,
+                                                        const AuthorizationSet& additional_params,
+                                                        KeymasterKeyBlob* key_material,
+                                                        AuthorizationSet* hw_enforced,
+                                                        AuthorizationSet* sw_enforced,
+                                                        KeyPolicy* policy, bool* legacy) const {
     // This is a little bit complicated.
     //
     // The SoftKeymasterContext has to handle a lot of different kinds of key blobs.
@@ -657,42 +1002,111 @@ keymaster_error_t SoftKeymasterContext::ParseKeyBlob(const KeymasterKeyBlob& blo
     // integrity-assured nor OCB-encrypted and lacks the old software key header is assumed to be
     // keymaster0 hardware.
 
+    // Trying each software format in turn would cost an HMAC and an OCB decryption on every
+    // hardware blob, so first peek at the version bytes, length fields and magic numbers to see
+    // which formats the blob could possibly be, and try only those.  The peeks are necessary
+    // conditions for their parsers to succeed on any blob this code writes, but they don't look
+    // inside the auth sets, so if a blob passes a peek and then fails to parse, the remaining
+    // formats are tried in the original order before giving up on it as a software blob.
+
     AuthorizationSet hidden;
     keymaster_error_t error = BuildHiddenAuthorizations(additional_params, &hidden);
     if (error != KM_ERROR_OK)
         return error;
+    return ParseAnyKeyBlobWithHidden(blob, additional_params, hidden, key_material, hw_enforced,
+                                     sw_enforced, policy, legacy);
+}
 
-    // Assume it's an integrity-assured blob (new software-only blob, or new keymaster0-backed
-    // blob).
-    error = DeserializeIntegrityAssuredBlob(blob, hidden, key_material, hw_enforced, sw_enforced);
-    if (error != KM_ERROR_INVALID_KEY_BLOB)
-        return error;
+keymaster_error_t SoftKeymasterContext::ParseAnyKeyBlobWithHidden(
+    const KeymasterKeyBlob& blob, const AuthorizationSet& additional_params,
+    const AuthorizationSet& hidden, KeymasterKeyBlob* key_material, AuthorizationSet* hw_enforced,
+    AuthorizationSet* sw_enforced, KeyPolicy* policy, bool* legacy) const {
+    keymaster_error_t error;
+    if (legacy)
+        *legacy = false;
+    static const SoftwareBlobFormat formats[] = {INTEGRITY_ASSURED_BLOB, OCB_ENCRYPTED_BLOB,
+                                                 OLD_SOFTKEYMASTER_BLOB};
+    const bool plausible[] = {MayBeIntegrityAssuredBlob(blob), MayBeAuthEncryptedBlob(blob),
+                              HasOldSoftkeymasterMagic(blob)};
+    bool any_plausible = false;
+    for (size_t i = 0; i < array_length(formats); ++i) {
+        if (!plausible[i])
+            continue;
+        any_plausible = true;
+        error = ParseSoftwareBlob(formats[i], blob, hidden, key_material, hw_enforced, sw_enforced,
+                                  policy);
+        if (error != KM_ERROR_INVALID_KEY_BLOB) {
+            if (legacy)
+                *legacy = formats[i] != INTEGRITY_ASSURED_BLOB;
+            return error;
+        }
+    }
 
-    // Wasn't an integrity-assured blob.  Maybe it's an OCB-encrypted blob.
-    error = ParseOcbAuthEncryptedBlob(blob, hidden, key_material, hw_enforced, sw_enforced);
-    if (error == KM_ERROR_OK)
-        LOG_D("Parsed an old keymaster1 software key", 0);
-    if (error != KM_ERROR_INVALID_KEY_BLOB)
-        return error;
+    if (any_plausible) {
+        for (size_t i = 0; i < array_length(formats); ++i) {
+            if (plausible[i])
+                continue;
+            error = ParseSoftwareBlob(formats[i], blob, hidden, key_material, hw_enforced,
+                                      sw_enforced, policy);
+            if (error != KM_ERROR_INVALID_KEY_BLOB) {
+                if (legacy)
+                    *legacy = formats[i] != INTEGRITY_ASSURED_BLOB;
+                return error;
+            }
+        }
+    }
 
-    // Wasn't an OCB-encrypted blob.  Maybe it's an old softkeymaster blob.
-    error = ParseOldSoftkeymasterBlob(blob, key_material, hw_enforced, sw_enforced);
-    if (error == KM_ERROR_OK)
-        LOG_D("Parsed an old sofkeymaster key", 0);
-    if (error != KM_ERROR_INVALID_KEY_BLOB)
+#ifndef KEYMASTER_SYMMETRIC_ONLY
+    if (km1_dev_ || km0_engine_) {
+        if (km1_dev_)
+            error = ParseKeymaster1HwBlob(blob, additional_params, key_material, hw_enforced,
+                                          sw_enforced);
+        else
+            error = ParseKeymaster0HwBlob(blob, key_material, hw_enforced, sw_enforced);
+        // New keymaster0-backed blobs are integrity-assured, so a raw one is old.
+        if (legacy && !km1_dev_)
+            *legacy = true;
+        if (error == KM_ERROR_OK && policy)
+            error = policy->Compile(*hw_enforced, *sw_enforced);
         return error;
-
-    if (km1_dev_)
-        return ParseKeymaster1HwBlob(blob, additional_params, key_material, hw_enforced,
-                                     sw_enforced);
-    else if (km0_engine_)
-        return ParseKeymaster0HwBlob(blob, key_material, hw_enforced, sw_enforced);
+    }
+#endif
 
     LOG_E("Failed to parse key; not a valid software blob, no hardware module configured", 0);
     return KM_ERROR_INVALID_KEY_BLOB;
 }
 
+keymaster_error_t
+SoftKeymasterContext::ParseKeyCharacteristics(const KeymasterKeyBlob& blob,
+                                              const AuthorizationSet& additional_params,
+                                              AuthorizationSet* hw_enforced,
+                                              AuthorizationSet* sw_enforced) const {
+    // ParseKeyBlob and the parsers it uses accept a null key_material, and then check the blob as
+    // usual but don't extract the key material from it.
+    return ParseKeyBlob(blob, additional_params, nullptr /* key_material */, hw_enforced,
+                        sw_enforced);
+}
+
+void SoftKeymasterContext::ParseKeyCharacteristicsBatch(const AuthorizationSet& additional_params,
+                                                        KeyCharacteristicsQuery* queries,
+                                                        size_t count) const {
+    AuthorizationSet hidden;
+    keymaster_error_t error = BuildHiddenAuthorizations(additional_params, &hidden);
+    for (size_t i = 0; i < count; ++i) {
+        if (error != KM_ERROR_OK)
+            queries[i].error = error;
+        else
+            queries[i].error = ParseAnyKeyBlobWithHidden(
+                *queries[i].blob, additional_params, hidden, nullptr /* key_material */,
+                queries[i].hw_enforced, queries[i].sw_enforced, nullptr /* policy */,
+                nullptr /* legacy */);
+    }
+}
+
 keymaster_error_t SoftKeymasterContext::DeleteKey(const KeymasterKeyBlob& blob) const {
+#ifdef KEYMASTER_SYMMETRIC_ONLY
+    (void)blob;
+#else
     if (km1_engine_) {
         keymaster_error_t error = km1_engine_->DeleteKey(blob);
         if (error == KM_ERROR_INVALID_KEY_BLOB) {
@@ -714,7 +1128,7 @@ keymaster_error_t SoftKeymasterContext::DeleteKey(const KeymasterKeyBlob& blob)
         // Thus, we first try to parse it as integrity-assured.  If that works, we pass the result
         // to the underlying hardware.  If not, we pass blob unmodified to the underlying hardware.
         KeymasterKeyBlob key_material;
-        AuthorizationSet hw_enforced, sw_enforced;
+        AuthorizationSetView hw_enforced, sw_enforced;
         keymaster_error_t error = DeserializeIntegrityAssuredBlob_NoHmacCheck(
             blob, &key_material, &hw_enforced, &sw_enforced);
         if (error == KM_ERROR_OK && km0_engine_->DeleteKey(key_material))
@@ -730,23 +1144,28 @@ keymaster_error_t SoftKeymasterContext::DeleteKey(const KeymasterKeyBlob& blob)
         // it's the least-bad alternative.
         return KM_ERROR_OK;
     }
+#endif  // KEYMASTER_SYMMETRIC_ONLY
 
     // Nothing to do for software-only contexts.
     return KM_ERROR_OK;
 }
 
 keymaster_error_t SoftKeymasterContext::DeleteAllKeys() const {
+#ifndef KEYMASTER_SYMMETRIC_ONLY
     if (km1_engine_)
         return km1_engine_->DeleteAllKeys();
 
     if (km0_engine_ && !km0_engine_->DeleteAllKeys())
         return KM_ERROR_UNKNOWN_ERROR;
+#endif
 
     return KM_ERROR_OK;
 }
 
 keymaster_error_t SoftKeymasterContext::AddRngEntropy(const uint8_t* buf, size_t length) const {
     RAND_add(buf, length, 0 /* Don't assume any entropy is added to the pool. */);
+    // Make sure IVs and handles drawn from here on reflect the new input.
+    DiscardBufferedRandomBytes();
     return KM_ERROR_OK;
 }
 
@@ -756,6 +1175,68 @@ keymaster_error_t SoftKeymasterContext::GenerateRandom(uint8_t* buf, size_t leng
     return KM_ERROR_OK;
 }
 
+// Bound into operation state tokens, so that they can't be passed off as key blobs or vice versa.
+static const char kOperationStateLabel[] = "operation state";
+
+static keymaster_error_t BuildOperationStateHidden(AuthorizationSet* hidden) {
+    if (!hidden->push_back(TAG_APPLICATION_DATA, kOperationStateLabel,
+                           sizeof(kOperationStateLabel) - 1))
+        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    return KM_ERROR_OK;
+}
+
+keymaster_error_t SoftKeymasterContext::SealOperationState(const KeymasterKeyBlob& state,
+                                                           KeymasterKeyBlob* token) const {
+    AuthorizationSet hidden, no_auths;
+    keymaster_error_t error = BuildOperationStateHidden(&hidden);
+    if (error != KM_ERROR_OK)
+        return error;
+
+    Buffer nonce(OCB_NONCE_LENGTH), tag(OCB_TAG_LENGTH);
+    error = BufferedRandomBytes(nonce.peek_write(), OCB_NONCE_LENGTH);
+    if (error != KM_ERROR_OK)
+        return error;
+    nonce.advance_write(OCB_NONCE_LENGTH);
+
+    KeymasterKeyBlob ciphertext;
+    error = OcbEncryptKey(no_auths, no_auths, hidden, MASTER_KEY, state, nonce, &ciphertext, &tag);
+    if (error != KM_ERROR_OK)
+        return error;
+
+    // The token is the nonce, the tag and the ciphertext.
+    if (!token->Reset(OCB_NONCE_LENGTH + OCB_TAG_LENGTH + ciphertext.key_material_size))
+        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    uint8_t* buf = token->writable_data();
+    const uint8_t* end = token->end();
+    buf = append_to_buf(buf, end, nonce.peek_read(), OCB_NONCE_LENGTH);
+    buf = append_to_buf(buf, end, tag.peek_read(), OCB_TAG_LENGTH);
+    append_to_buf(buf, end, ciphertext.key_material, ciphertext.key_material_size);
+    return KM_ERROR_OK;
+}
+
+keymaster_error_t SoftKeymasterContext::UnsealOperationState(const KeymasterKeyBlob& token,
+                                                             KeymasterKeyBlob* state) const {
+    if (token.key_material_size < OCB_NONCE_LENGTH + OCB_TAG_LENGTH)
+        return KM_ERROR_INVALID_ARGUMENT;
+
+    AuthorizationSet hidden, no_auths;
+    keymaster_error_t error = BuildOperationStateHidden(&hidden);
+    if (error != KM_ERROR_OK)
+        return error;
+
+    Buffer nonce(token.key_material, OCB_NONCE_LENGTH);
+    Buffer tag(token.key_material + OCB_NONCE_LENGTH, OCB_TAG_LENGTH);
+    const size_t header_size = OCB_NONCE_LENGTH + OCB_TAG_LENGTH;
+    KeymasterKeyBlob ciphertext(token.key_material + header_size,
+                                token.key_material_size - header_size);
+    if (!nonce.available_read() || !tag.available_read() ||
+        (token.key_material_size > header_size && !ciphertext.key_material))
+        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    error = OcbDecryptKey(no_auths, no_auths, hidden, MASTER_KEY, ciphertext, nonce, tag, state);
+    // A token that fails to authenticate wasn't sealed by us, or has been tampered with.
+    return error == KM_ERROR_INVALID_KEY_BLOB ? KM_ERROR_INVALID_ARGUMENT : error;
+}
+
 void SoftKeymasterContext::AddSystemVersionToSet(AuthorizationSet* auth_set) const {
     if (!auth_set->Contains(TAG_OS_VERSION))
         auth_set->push_back(TAG_OS_VERSION, os_version_);
@@ -763,24 +1244,61 @@ void SoftKeymasterContext::AddSystemVersionToSet(AuthorizationSet* auth_set) con
         auth_set->push_back(TAG_OS_PATCHLEVEL, os_patchlevel_);
 }
 
-EVP_PKEY* SoftKeymasterContext::AttestationKey(keymaster_algorithm_t algorithm,
+#ifdef KEYMASTER_SYMMETRIC_ONLY
+// Symmetric-only builds carry no attestation keys or certificates.
+EVP_PKEY* SoftKeymasterContext::AttestationKey(keymaster_algorithm_t /* algorithm */,
                                                keymaster_error_t* error) const {
+    *error = KM_ERROR_UNSUPPORTED_ALGORITHM;
+    return nullptr;
+}
+
+X509* SoftKeymasterContext::AttestationSigningCertificate(keymaster_algorithm_t /* algorithm */,
+                                                          keymaster_error_t* error) const {
+    *error = KM_ERROR_UNSUPPORTED_ALGORITHM;
+    return nullptr;
+}
+
+keymaster_cert_chain_t*
+SoftKeymasterContext::AttestationChain(keymaster_algorithm_t /* algorithm */,
+                                       keymaster_error_t* error) const {
+    *error = KM_ERROR_UNSUPPORTED_ALGORITHM;
+    return nullptr;
+}
+#else   // KEYMASTER_SYMMETRIC_ONLY
+void SoftKeymasterContext::AttestationCache::GetAttestationData(keymaster_algorithm_t algorithm,
+                                                               keymaster_blob_t* key,
+                                                               keymaster_blob_t* chain,
+                                                               size_t* chain_length) const {
+    if (bundle && bundle->Get(algorithm, key, chain, chain_length))
+        return;
+
+    assert(kCertificateChainLength <= AttestationBundle::kMaxChainLength);
+    *chain_length = kCertificateChainLength;
+    if (algorithm == KM_ALGORITHM_RSA) {
+        *key = {kRsaAttestKey, array_length(kRsaAttestKey)};
+        chain[0] = {kRsaAttestCert, array_length(kRsaAttestCert)};
+        chain[1] = {kRsaAttestRootCert, array_length(kRsaAttestRootCert)};
+    } else {
+        *key = {kEcAttestKey, array_length(kEcAttestKey)};
+        chain[0] = {kEcAttestCert, array_length(kEcAttestCert)};
+        chain[1] = {kEcAttestRootCert, array_length(kEcAttestRootCert)};
+    }
+}
 
-    const uint8_t* key;
-    size_t key_length;
+EVP_PKEY* SoftKeymasterContext::AttestationKey(keymaster_algorithm_t algorithm,
+                                               keymaster_error_t* error) const {
     int evp_key_type;
+    EVP_PKEY_Ptr* cached_key;
 
     switch (algorithm) {
     case KM_ALGORITHM_RSA:
-        key = kRsaAttestKey;
-        key_length = array_length(kRsaAttestKey);
         evp_key_type = EVP_PKEY_RSA;
+        cached_key = &attestation_cache_->rsa_key;
         break;
 
     case KM_ALGORITHM_EC:
-        key = kEcAttestKey;
-        key_length = array_length(kEcAttestKey);
         evp_key_type = EVP_PKEY_EC;
+        cached_key = &attestation_cache_->ec_key;
         break;
 
     default:
@@ -788,15 +1306,75 @@ EVP_PKEY* SoftKeymasterContext::AttestationKey(keymaster_algorithm_t algorithm,
         return nullptr;
     }
 
-    EVP_PKEY* pkey = d2i_PrivateKey(evp_key_type, nullptr /* pkey */, &key, key_length);
-    if (!pkey)
+    std::lock_guard<std::mutex> lock(attestation_cache_->mutex);
+    if (!cached_key->get()) {
+        keymaster_blob_t key;
+        keymaster_blob_t chain[AttestationBundle::kMaxChainLength];
+        size_t chain_length;
+        attestation_cache_->GetAttestationData(algorithm, &key, chain, &chain_length);
+        const uint8_t* key_data = key.data;
+        cached_key->reset(
+            d2i_PrivateKey(evp_key_type, nullptr /* pkey */, &key_data, key.data_length));
+        if (!cached_key->get()) {
+            *error = TranslateLastOpenSslError();
+            return nullptr;
+        }
+    }
+
+    if (EVP_PKEY_up_ref(cached_key->get()) != 1) {
         *error = TranslateLastOpenSslError();
+        return nullptr;
+    }
+    return cached_key->get();
+}
+
+X509* SoftKeymasterContext::AttestationSigningCertificate(keymaster_algorithm_t algorithm,
+                                                          keymaster_error_t* error) const {
+    X509_Ptr* cached_cert;
+
+    switch (algorithm) {
+    case KM_ALGORITHM_RSA:
+        cached_cert = &attestation_cache_->rsa_cert;
+        break;
 
-    return pkey;
+    case KM_ALGORITHM_EC:
+        cached_cert = &attestation_cache_->ec_cert;
+        break;
+
+    default:
+        *error = KM_ERROR_UNSUPPORTED_ALGORITHM;
+        return nullptr;
+    }
+
+    std::lock_guard<std::mutex> lock(attestation_cache_->mutex);
+    if (!cached_cert->get()) {
+        keymaster_blob_t key;
+        keymaster_blob_t chain[AttestationBundle::kMaxChainLength];
+        size_t chain_length;
+        attestation_cache_->GetAttestationData(algorithm, &key, chain, &chain_length);
+        const uint8_t* cert = chain[0].data;
+        cached_cert->reset(d2i_X509(nullptr /* x509 */, &cert, chain[0].data_length));
+        if (!cached_cert->get()) {
+            *error = TranslateLastOpenSslError();
+            return nullptr;
+        }
+    }
+
+    if (X509_up_ref(cached_cert->get()) != 1) {
+        *error = TranslateLastOpenSslError();
+        return nullptr;
+    }
+    *error = KM_ERROR_OK;
+    return cached_cert->get();
 }
 
 keymaster_cert_chain_t* SoftKeymasterContext::AttestationChain(keymaster_algorithm_t algorithm,
                                                                keymaster_error_t* error) const {
+    if (algorithm != KM_ALGORITHM_RSA && algorithm != KM_ALGORITHM_EC) {
+        *error = KM_ERROR_UNSUPPORTED_ALGORITHM;
+        return nullptr;
+    }
+
     // If we have to bail it will be because of an allocation failure.
     *error = KM_ERROR_MEMORY_ALLOCATION_FAILED;
 
@@ -805,52 +1383,31 @@ keymaster_cert_chain_t* SoftKeymasterContext::AttestationChain(keymaster_algorit
         return nullptr;
     memset(chain.get(), 0, sizeof(keymaster_cert_chain_t));
 
-    chain->entries = new keymaster_blob_t[kCertificateChainLength];
+    // The caller owns the chain, so the certificates are copied out of the bundle or arrays.
+    std::lock_guard<std::mutex> lock(attestation_cache_->mutex);
+    keymaster_blob_t key;
+    keymaster_blob_t certs[AttestationBundle::kMaxChainLength];
+    size_t cert_count;
+    attestation_cache_->GetAttestationData(algorithm, &key, certs, &cert_count);
+
+    chain->entries = new keymaster_blob_t[cert_count];
     if (!chain->entries)
         return nullptr;
 
-    memset(chain->entries, 0, sizeof(chain->entries[0]) * kCertificateChainLength);
-    chain->entry_count = kCertificateChainLength;
-
-    size_t entry = 0;
-
-    switch (algorithm) {
-    case KM_ALGORITHM_RSA:
-        chain->entries[entry].data = dup_array(kRsaAttestCert);
-        if (!chain->entries[entry].data)
-            return nullptr;
-        chain->entries[entry].data_length = array_length(kRsaAttestCert);
-        entry++;
-        chain->entries[entry].data = dup_array(kRsaAttestRootCert);
-        if (!chain->entries[entry].data)
-            return nullptr;
-        chain->entries[entry].data_length = array_length(kRsaAttestRootCert);
-        entry++;
-        break;
+    memset(chain->entries, 0, sizeof(chain->entries[0]) * cert_count);
+    chain->entry_count = cert_count;
 
-    case KM_ALGORITHM_EC:
-        chain->entries[entry].data = dup_array(kEcAttestCert);
+    for (size_t entry = 0; entry < cert_count; ++entry) {
+        chain->entries[entry].data = dup_buffer(certs[entry].data, certs[entry].data_length);
         if (!chain->entries[entry].data)
             return nullptr;
-        chain->entries[entry].data_length = array_length(kEcAttestCert);
-        entry++;
-        chain->entries[entry].data = dup_array(kEcAttestRootCert);
-        if (!chain->entries[entry].data)
-            return nullptr;
-        chain->entries[entry].data_length = array_length(kEcAttestRootCert);
-        entry++;
-        break;
-
-    default:
-        *error = KM_ERROR_UNSUPPORTED_ALGORITHM;
-        return nullptr;
-    };
-
-    assert(entry == kCertificateChainLength);
+        chain->entries[entry].data_length = certs[entry].data_length;
+    }
 
     *error = KM_ERROR_OK;
     return chain.release();
 }
+#endif  // KEYMASTER_SYMMETRIC_ONLY
 
 keymaster_error_t SoftKeymasterContext::GenerateUniqueId(
     uint64_t /* creation_date_time */, const keymaster_blob_t& /* application_id */,
@@ -887,10 +1444,12 @@ keymaster_error_t SoftKeymasterContext::ParseKeymaster1HwBlob(
 
     hw_enforced->Reinitialize(characteristics->hw_enforced);
     sw_enforced->Reinitialize(characteristics->sw_enforced);
-    *key_material = blob;
+    if (key_material)
+        *key_material = blob;
     return KM_ERROR_OK;
 }
 
+#ifndef KEYMASTER_SYMMETRIC_ONLY
 keymaster_error_t SoftKeymasterContext::ParseKeymaster0HwBlob(const KeymasterKeyBlob& blob,
                                                               KeymasterKeyBlob* key_material,
                                                               AuthorizationSet* hw_enforced,
@@ -904,17 +1463,21 @@ keymaster_error_t SoftKeymasterContext::ParseKeymaster0HwBlob(const KeymasterKey
 
     LOG_D("Module \"%s\" accepted key", km0_engine_->device()->common.module->name);
     keymaster_error_t error = FakeKeyAuthorizations(tmp_key.get(), hw_enforced, sw_enforced);
-    if (error == KM_ERROR_OK)
+    if (error == KM_ERROR_OK && key_material)
         *key_material = blob;
 
     return error;
 }
+#endif  // KEYMASTER_SYMMETRIC_ONLY
 
 keymaster_error_t SoftKeymasterContext::FakeKeyAuthorizations(EVP_PKEY* pubkey,
                                                               AuthorizationSet* hw_enforced,
                                                               AuthorizationSet* sw_enforced) const {
     hw_enforced->Clear();
     sw_enforced->Clear();
+    // Enough for the RSA case, the larger of the two.
+    hw_enforced->Reserve(15, 0);
+    sw_enforced->Reserve(6, 0);
 
     switch (EVP_PKEY_type(pubkey->type)) {
     case EVP_PKEY_RSA: {
@@ -985,15 +1548,21 @@ keymaster_error_t SoftKeymasterContext::FakeKeyAuthorizations(EVP_PKEY* pubkey,
 
 keymaster_error_t SoftKeymasterContext::BuildHiddenAuthorizations(const AuthorizationSet& input_set,
                                                                   AuthorizationSet* hidden) const {
+    // Only the application params vary per call; the root of trust entry is built once, in the
+    // constructor.  Everything is pushed in one go so hidden is sized exactly, rather than regrown
+    // element by element.
+    keymaster_key_param_t params[3];
+    keymaster_key_param_set_t set = {params, 0};
     keymaster_blob_t entry;
     if (input_set.GetTagValue(TAG_APPLICATION_ID, &entry))
-        hidden->push_back(TAG_APPLICATION_ID, entry.data, entry.data_length);
+        params[set.length++] = keymaster_param_blob(TAG_APPLICATION_ID, entry.data,
+                                                    entry.data_length);
     if (input_set.GetTagValue(TAG_APPLICATION_DATA, &entry))
-        hidden->push_back(TAG_APPLICATION_DATA, entry.data, entry.data_length);
-
-    hidden->push_back(TAG_ROOT_OF_TRUST, reinterpret_cast<const uint8_t*>(root_of_trust_.data()),
-                      root_of_trust_.size());
+        params[set.length++] = keymaster_param_blob(TAG_APPLICATION_DATA, entry.data,
+                                                    entry.data_length);
+    params[set.length++] = root_of_trust_param_;
 
+    hidden->push_back(set);
     return TranslateAuthorizationSetError(hidden->is_valid());
 }
 
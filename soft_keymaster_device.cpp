@@ -24,6 +24,11 @@
 #include <time.h>
 
 #include <algorithm>
+#include <map>
+#include <mutex>
+#include <tuple>
+#include <utility>
+#include <vector>
 
 #include <type_traits>
 
@@ -39,6 +44,9 @@
 #include <keymaster/soft_keymaster_context.h>
 #include <keymaster/soft_keymaster_logger.h>
 
+#include "backend_cost_table.h"
+#include "latency_statistics.h"
+#include "loaded_key_cache.h"
 #include "openssl_utils.h"
 
 struct keystore_module soft_keymaster1_device_module = {
@@ -124,10 +132,159 @@ static keymaster_error_t map_digests(keymaster1_device_t* dev,
     return KM_ERROR_OK;
 }
 
+/**
+ * Remembers the algorithm of each wrapped keymaster1 key blob, indexed like LoadedKeyCache by a
+ * digest of the blob and the APPLICATION_ID and APPLICATION_DATA it was characterized with.
+ */
+struct SoftKeymasterDevice::AlgorithmCache {
+    // Entries are only a few dozen bytes, so rather than track recency the cache simply starts
+    // over when it fills.
+    static const size_t kMaxEntries = 256;
+
+    struct Entry {
+        LoadedKeyCache::Digest blob_digest;
+        keymaster_algorithm_t algorithm;
+        uint32_t key_size;
+    };
+
+    bool Find(const LoadedKeyCache::Lookup& lookup, keymaster_algorithm_t* algorithm,
+              uint32_t* key_size) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto found = entries.find(lookup.digest);
+        if (found == entries.end())
+            return false;
+        *algorithm = found->second.algorithm;
+        *key_size = found->second.key_size;
+        return true;
+    }
+
+    void Insert(const LoadedKeyCache::Lookup& lookup, keymaster_algorithm_t algorithm,
+                uint32_t key_size) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (entries.size() >= kMaxEntries)
+            entries.clear();
+        Entry& entry = entries[lookup.digest];
+        entry.blob_digest = lookup.blob_digest;
+        entry.algorithm = algorithm;
+        entry.key_size = key_size;
+    }
+
+    void Invalidate(const keymaster_key_blob_t& key) {
+        LoadedKeyCache::Lookup lookup;
+        LoadedKeyCache::ComputeLookup(key, AuthorizationSet(), &lookup);
+        std::lock_guard<std::mutex> lock(mutex);
+        for (auto entry = entries.begin(); entry != entries.end();) {
+            if (entry->second.blob_digest == lookup.blob_digest)
+                entry = entries.erase(entry);
+            else
+                ++entry;
+        }
+    }
+
+    void Clear() {
+        std::lock_guard<std::mutex> lock(mutex);
+        entries.clear();
+    }
+
+    std::mutex mutex;
+    std::map<LoadedKeyCache::Digest, Entry> entries;
+};
+
+namespace {
+
+enum CapabilityKind {
+    kSupportedAlgorithms,
+    kSupportedBlockModes,
+    kSupportedPaddingModes,
+    kSupportedDigests,
+    kSupportedImportFormats,
+    kSupportedExportFormats,
+};
+
+// Copies the results of a get_supported_* response into a malloc'd array for the HAL caller.
+template <typename T>
+keymaster_error_t CopyResults(const SupportedResponse<T>& response, T** results,
+                              size_t* results_length) {
+    *results_length = response.results_length;
+    *results = reinterpret_cast<T*>(malloc(*results_length * sizeof(**results)));
+    if (!*results)
+        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    std::copy(response.results, response.results + response.results_length, *results);
+    return KM_ERROR_OK;
+}
+
+}  // anonymous namespace
+
+/**
+ * Holds the answers to get_supported_* queries.  The supported algorithms, modes, digests and
+ * formats are fixed once the hardware device (if any) is set, so each query is answered by the
+ * factories or the wrapped device only once, and after that by a single copy.
+ */
+struct SoftKeymasterDevice::CapabilityCache {
+    // Kind, algorithm and purpose, with zero for the parameters a kind doesn't take.
+    typedef std::tuple<int, int, int> Query;
+
+    /**
+     * Serves query from the cache, or else by calling fetch(results, results_length) and caching
+     * its answer.  Either way *results is malloc'd and owned by the caller.
+     */
+    template <typename T, typename Fetch>
+    keymaster_error_t Get(const Query& query, const Fetch& fetch, T** results,
+                          size_t* results_length) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto found = tables.find(query);
+            if (found != tables.end()) {
+                *results_length = found->second.size() / sizeof(T);
+                *results = reinterpret_cast<T*>(malloc(found->second.size()));
+                if (!*results)
+                    return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+                memcpy(*results, found->second.data(), found->second.size());
+                return KM_ERROR_OK;
+            }
+        }
+
+        keymaster_error_t error = fetch(results, results_length);
+        if (error != KM_ERROR_OK)
+            return error;
+        const uint8_t* bytes = reinterpret_cast<const uint8_t*>(*results);
+        std::lock_guard<std::mutex> lock(mutex);
+        tables[query].assign(bytes, bytes + *results_length * sizeof(T));
+        return KM_ERROR_OK;
+    }
+
+    void Clear() {
+        std::lock_guard<std::mutex> lock(mutex);
+        tables.clear();
+    }
+
+    std::mutex mutex;
+    std::map<Query, std::vector<uint8_t>> tables;
+};
+
+/**
+ * Probes a wrapped keymaster1 device's supported digests, once, the first time they're needed.
+ */
+struct SoftKeymasterDevice::DigestProbe {
+    explicit DigestProbe(keymaster1_device_t* device) : device(device), error(KM_ERROR_OK) {}
+
+    const DigestMap* Get() {
+        std::call_once(probed, [this] { error = map_digests(device, &digests); });
+        return error == KM_ERROR_OK ? &digests : nullptr;
+    }
+
+    keymaster1_device_t* device;
+    std::once_flag probed;
+    keymaster_error_t error;
+    DigestMap digests;
+};
+
 SoftKeymasterDevice::SoftKeymasterDevice()
     : wrapped_km0_device_(nullptr), wrapped_km1_device_(nullptr),
+      algorithm_cache_(new AlgorithmCache), capability_cache_(new CapabilityCache),
       context_(new SoftKeymasterContext),
-      impl_(new AndroidKeymaster(context_, kOperationTableSize)), configured_(false) {
+      impl_(new AndroidKeymaster(context_, kOperationTableSize)), configured_(false),
+      software_public_key_operations_(false), packed_param_sets_(false) {
     LOG_I("Creating device", 0);
     LOG_D("Device address: %p", this);
 
@@ -136,8 +293,11 @@ SoftKeymasterDevice::SoftKeymasterDevice()
 }
 
 SoftKeymasterDevice::SoftKeymasterDevice(SoftKeymasterContext* context)
-    : wrapped_km0_device_(nullptr), wrapped_km1_device_(nullptr), context_(context),
-      impl_(new AndroidKeymaster(context_, kOperationTableSize)), configured_(false) {
+    : wrapped_km0_device_(nullptr), wrapped_km1_device_(nullptr),
+      algorithm_cache_(new AlgorithmCache), capability_cache_(new CapabilityCache),
+      context_(context),
+      impl_(new AndroidKeymaster(context_, kOperationTableSize)), configured_(false),
+      software_public_key_operations_(false), packed_param_sets_(false) {
     LOG_I("Creating test device", 0);
     LOG_D("Device address: %p", this);
 
@@ -145,6 +305,8 @@ SoftKeymasterDevice::SoftKeymasterDevice(SoftKeymasterContext* context)
                              KEYMASTER_SUPPORTS_EC);
 }
 
+SoftKeymasterDevice::~SoftKeymasterDevice() {}
+
 keymaster_error_t SoftKeymasterDevice::SetHardwareDevice(keymaster0_device_t* keymaster0_device) {
     assert(keymaster0_device);
     LOG_D("Reinitializing SoftKeymasterDevice to use HW keymaster0", 0);
@@ -170,6 +332,8 @@ keymaster_error_t SoftKeymasterDevice::SetHardwareDevice(keymaster0_device_t* ke
 
     wrapped_km0_device_ = keymaster0_device;
     wrapped_km1_device_ = nullptr;
+    km1_digest_probe_.reset();
+    capability_cache_->Clear();
     return KM_ERROR_OK;
 }
 
@@ -180,11 +344,7 @@ keymaster_error_t SoftKeymasterDevice::SetHardwareDevice(keymaster1_device_t* ke
     if (!context_)
         return KM_ERROR_UNEXPECTED_NULL_POINTER;
 
-    keymaster_error_t error = map_digests(keymaster1_device, &km1_device_digests_);
-    if (error != KM_ERROR_OK)
-        return error;
-
-    error = context_->SetHardwareDevice(keymaster1_device);
+    keymaster_error_t error = context_->SetHardwareDevice(keymaster1_device);
     if (error != KM_ERROR_OK)
         return error;
 
@@ -202,6 +362,8 @@ keymaster_error_t SoftKeymasterDevice::SetHardwareDevice(keymaster1_device_t* ke
 
     wrapped_km0_device_ = nullptr;
     wrapped_km1_device_ = keymaster1_device;
+    km1_digest_probe_.reset(new DigestProbe(keymaster1_device));
+    capability_cache_->Clear();
     return KM_ERROR_OK;
 }
 
@@ -213,7 +375,11 @@ bool SoftKeymasterDevice::Keymaster1DeviceIsGood() {
         KM_DIGEST_NONE,      KM_DIGEST_SHA1,      KM_DIGEST_SHA_2_224,
         KM_DIGEST_SHA_2_256, KM_DIGEST_SHA_2_384, KM_DIGEST_SHA_2_512};
 
-    for (auto& entry : km1_device_digests_) {
+    const DigestMap* digests = km1_device_digests();
+    if (!digests)
+        return false;
+
+    for (auto& entry : *digests) {
         if (entry.first.first == KM_ALGORITHM_RSA)
             if (!std::is_permutation(entry.second.begin(), entry.second.end(),
                                      expected_rsa_digests.begin()))
@@ -306,14 +472,23 @@ keymaster2_device_t* SoftKeymasterDevice::keymaster2_device() {
 
 namespace {
 
+// Copies src to dst, packed if the device was asked for packed param sets.
+void CopyParamSet(const AuthorizationSet& src, bool packed, keymaster_key_param_set_t* dst) {
+    if (packed)
+        src.CopyToPackedParamSet(dst);
+    else
+        src.CopyToParamSet(dst);
+}
+
 keymaster_key_characteristics_t* BuildCharacteristics(const AuthorizationSet& hw_enforced,
-                                                      const AuthorizationSet& sw_enforced) {
+                                                      const AuthorizationSet& sw_enforced,
+                                                      bool packed) {
     keymaster_key_characteristics_t* characteristics =
         reinterpret_cast<keymaster_key_characteristics_t*>(
             malloc(sizeof(keymaster_key_characteristics_t)));
     if (characteristics) {
-        hw_enforced.CopyToParamSet(&characteristics->hw_enforced);
-        sw_enforced.CopyToParamSet(&characteristics->sw_enforced);
+        CopyParamSet(hw_enforced, packed, &characteristics->hw_enforced);
+        CopyParamSet(sw_enforced, packed, &characteristics->sw_enforced);
     }
     return characteristics;
 }
@@ -345,9 +520,19 @@ bool FindAlgorithm(const keymaster_key_param_set_t& params, keymaster_algorithm_
     return false;
 }
 
+bool FindKeySize(const keymaster_key_param_set_t& params, uint32_t* key_size) {
+    for (size_t i = 0; i < params.length; ++i)
+        if (params.params[i].tag == KM_TAG_KEY_SIZE) {
+            *key_size = params.params[i].integer;
+            return true;
+        }
+    return false;
+}
+
+// Also sets *key_size, to 0 if the characteristics don't include one.
 keymaster_error_t GetAlgorithm(const keymaster1_device_t* dev, const keymaster_key_blob_t& key,
-                               const AuthorizationSet& in_params,
-                               keymaster_algorithm_t* algorithm) {
+                               const AuthorizationSet& in_params, keymaster_algorithm_t* algorithm,
+                               uint32_t* key_size) {
     keymaster_blob_t client_id = {nullptr, 0};
     keymaster_blob_t app_data = {nullptr, 0};
     keymaster_blob_t* client_id_ptr = nullptr;
@@ -365,6 +550,10 @@ keymaster_error_t GetAlgorithm(const keymaster1_device_t* dev, const keymaster_k
     std::unique_ptr<keymaster_key_characteristics_t, Characteristics_Delete>
         characteristics_deleter(characteristics);
 
+    if (!FindKeySize(characteristics->hw_enforced, key_size) &&
+        !FindKeySize(characteristics->sw_enforced, key_size))
+        *key_size = 0;
+
     if (FindAlgorithm(characteristics->hw_enforced, algorithm))
         return KM_ERROR_OK;
 
@@ -406,26 +595,24 @@ keymaster_error_t SoftKeymasterDevice::get_supported_algorithms(const keymaster1
     if (!algorithms || !algorithms_length)
         return KM_ERROR_OUTPUT_PARAMETER_NULL;
 
-    const keymaster1_device_t* km1_dev = convert_device(dev)->wrapped_km1_device_;
-    if (km1_dev)
-        return km1_dev->get_supported_algorithms(km1_dev, algorithms, algorithms_length);
-
-    SupportedAlgorithmsRequest request;
-    SupportedAlgorithmsResponse response;
-    convert_device(dev)->impl_->SupportedAlgorithms(request, &response);
-    if (response.error != KM_ERROR_OK) {
-        LOG_E("get_supported_algorithms failed with %d", response.error);
-
-        return response.error;
-    }
-
-    *algorithms_length = response.results_length;
-    *algorithms =
-        reinterpret_cast<keymaster_algorithm_t*>(malloc(*algorithms_length * sizeof(**algorithms)));
-    if (!*algorithms)
-        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
-    std::copy(response.results, response.results + response.results_length, *algorithms);
-    return KM_ERROR_OK;
+    SoftKeymasterDevice* sk_dev = convert_device(dev);
+    auto fetch = [sk_dev](keymaster_algorithm_t** results, size_t* results_length) {
+        const keymaster1_device_t* km1_dev = sk_dev->wrapped_km1_device_;
+        if (km1_dev)
+            return km1_dev->get_supported_algorithms(km1_dev, results, results_length);
+
+        SupportedAlgorithmsRequest request;
+        SupportedAlgorithmsResponse response;
+        sk_dev->impl_->SupportedAlgorithms(request, &response);
+        if (response.error != KM_ERROR_OK) {
+            LOG_E("get_supported_algorithms failed with %d", response.error);
+
+            return response.error;
+        }
+        return CopyResults(response, results, results_length);
+    };
+    return sk_dev->capability_cache_->Get(CapabilityCache::Query(kSupportedAlgorithms, 0, 0), fetch,
+                                          algorithms, algorithms_length);
 }
 
 /* static */
@@ -440,28 +627,29 @@ keymaster_error_t SoftKeymasterDevice::get_supported_block_modes(const keymaster
     if (!modes || !modes_length)
         return KM_ERROR_OUTPUT_PARAMETER_NULL;
 
-    const keymaster1_device_t* km1_dev = convert_device(dev)->wrapped_km1_device_;
-    if (km1_dev)
-        return km1_dev->get_supported_block_modes(km1_dev, algorithm, purpose, modes, modes_length);
-
-    SupportedBlockModesRequest request;
-    request.algorithm = algorithm;
-    request.purpose = purpose;
-    SupportedBlockModesResponse response;
-    convert_device(dev)->impl_->SupportedBlockModes(request, &response);
-
-    if (response.error != KM_ERROR_OK) {
-        LOG_E("get_supported_block_modes failed with %d", response.error);
-
-        return response.error;
-    }
-
-    *modes_length = response.results_length;
-    *modes = reinterpret_cast<keymaster_block_mode_t*>(malloc(*modes_length * sizeof(**modes)));
-    if (!*modes)
-        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
-    std::copy(response.results, response.results + response.results_length, *modes);
-    return KM_ERROR_OK;
+    SoftKeymasterDevice* sk_dev = convert_device(dev);
+    auto fetch = [=](keymaster_block_mode_t** results, size_t* results_length) {
+        const keymaster1_device_t* km1_dev = sk_dev->wrapped_km1_device_;
+        if (km1_dev)
+            return km1_dev->get_supported_block_modes(km1_dev, algorithm, purpose, results,
+                                                      results_length);
+
+        SupportedBlockModesRequest request;
+        request.algorithm = algorithm;
+        request.purpose = purpose;
+        SupportedBlockModesResponse response;
+        sk_dev->impl_->SupportedBlockModes(request, &response);
+
+        if (response.error != KM_ERROR_OK) {
+            LOG_E("get_supported_block_modes failed with %d", response.error);
+
+            return response.error;
+        }
+        return CopyResults(response, results, results_length);
+    };
+    return sk_dev->capability_cache_->Get(
+        CapabilityCache::Query(kSupportedBlockModes, algorithm, purpose), fetch, modes,
+        modes_length);
 }
 
 /* static */
@@ -476,28 +664,28 @@ keymaster_error_t SoftKeymasterDevice::get_supported_padding_modes(const keymast
     if (!modes || !modes_length)
         return KM_ERROR_OUTPUT_PARAMETER_NULL;
 
-    const keymaster1_device_t* km1_dev = convert_device(dev)->wrapped_km1_device_;
-    if (km1_dev)
-        return km1_dev->get_supported_padding_modes(km1_dev, algorithm, purpose, modes,
-                                                    modes_length);
-
-    SupportedPaddingModesRequest request;
-    request.algorithm = algorithm;
-    request.purpose = purpose;
-    SupportedPaddingModesResponse response;
-    convert_device(dev)->impl_->SupportedPaddingModes(request, &response);
-
-    if (response.error != KM_ERROR_OK) {
-        LOG_E("get_supported_padding_modes failed with %d", response.error);
-        return response.error;
-    }
-
-    *modes_length = response.results_length;
-    *modes = reinterpret_cast<keymaster_padding_t*>(malloc(*modes_length * sizeof(**modes)));
-    if (!*modes)
-        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
-    std::copy(response.results, response.results + response.results_length, *modes);
-    return KM_ERROR_OK;
+    SoftKeymasterDevice* sk_dev = convert_device(dev);
+    auto fetch = [=](keymaster_padding_t** results, size_t* results_length) {
+        const keymaster1_device_t* km1_dev = sk_dev->wrapped_km1_device_;
+        if (km1_dev)
+            return km1_dev->get_supported_padding_modes(km1_dev, algorithm, purpose, results,
+                                                        results_length);
+
+        SupportedPaddingModesRequest request;
+        request.algorithm = algorithm;
+        request.purpose = purpose;
+        SupportedPaddingModesResponse response;
+        sk_dev->impl_->SupportedPaddingModes(request, &response);
+
+        if (response.error != KM_ERROR_OK) {
+            LOG_E("get_supported_padding_modes failed with %d", response.error);
+            return response.error;
+        }
+        return CopyResults(response, results, results_length);
+    };
+    return sk_dev->capability_cache_->Get(
+        CapabilityCache::Query(kSupportedPaddingModes, algorithm, purpose), fetch, modes,
+        modes_length);
 }
 
 /* static */
@@ -512,27 +700,28 @@ keymaster_error_t SoftKeymasterDevice::get_supported_digests(const keymaster1_de
     if (!digests || !digests_length)
         return KM_ERROR_OUTPUT_PARAMETER_NULL;
 
-    const keymaster1_device_t* km1_dev = convert_device(dev)->wrapped_km1_device_;
-    if (km1_dev)
-        return km1_dev->get_supported_digests(km1_dev, algorithm, purpose, digests, digests_length);
-
-    SupportedDigestsRequest request;
-    request.algorithm = algorithm;
-    request.purpose = purpose;
-    SupportedDigestsResponse response;
-    convert_device(dev)->impl_->SupportedDigests(request, &response);
-
-    if (response.error != KM_ERROR_OK) {
-        LOG_E("get_supported_digests failed with %d", response.error);
-        return response.error;
-    }
-
-    *digests_length = response.results_length;
-    *digests = reinterpret_cast<keymaster_digest_t*>(malloc(*digests_length * sizeof(**digests)));
-    if (!*digests)
-        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
-    std::copy(response.results, response.results + response.results_length, *digests);
-    return KM_ERROR_OK;
+    SoftKeymasterDevice* sk_dev = convert_device(dev);
+    auto fetch = [=](keymaster_digest_t** results, size_t* results_length) {
+        const keymaster1_device_t* km1_dev = sk_dev->wrapped_km1_device_;
+        if (km1_dev)
+            return km1_dev->get_supported_digests(km1_dev, algorithm, purpose, results,
+                                                  results_length);
+
+        SupportedDigestsRequest request;
+        request.algorithm = algorithm;
+        request.purpose = purpose;
+        SupportedDigestsResponse response;
+        sk_dev->impl_->SupportedDigests(request, &response);
+
+        if (response.error != KM_ERROR_OK) {
+            LOG_E("get_supported_digests failed with %d", response.error);
+            return response.error;
+        }
+        return CopyResults(response, results, results_length);
+    };
+    return sk_dev->capability_cache_->Get(
+        CapabilityCache::Query(kSupportedDigests, algorithm, purpose), fetch, digests,
+        digests_length);
 }
 
 /* static */
@@ -545,27 +734,27 @@ keymaster_error_t SoftKeymasterDevice::get_supported_import_formats(
     if (!formats || !formats_length)
         return KM_ERROR_OUTPUT_PARAMETER_NULL;
 
-    const keymaster1_device_t* km1_dev = convert_device(dev)->wrapped_km1_device_;
-    if (km1_dev)
-        return km1_dev->get_supported_import_formats(km1_dev, algorithm, formats, formats_length);
-
-    SupportedImportFormatsRequest request;
-    request.algorithm = algorithm;
-    SupportedImportFormatsResponse response;
-    convert_device(dev)->impl_->SupportedImportFormats(request, &response);
-
-    if (response.error != KM_ERROR_OK) {
-        LOG_E("get_supported_import_formats failed with %d", response.error);
-        return response.error;
-    }
-
-    *formats_length = response.results_length;
-    *formats =
-        reinterpret_cast<keymaster_key_format_t*>(malloc(*formats_length * sizeof(**formats)));
-    if (!*formats)
-        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
-    std::copy(response.results, response.results + response.results_length, *formats);
-    return KM_ERROR_OK;
+    SoftKeymasterDevice* sk_dev = convert_device(dev);
+    auto fetch = [=](keymaster_key_format_t** results, size_t* results_length) {
+        const keymaster1_device_t* km1_dev = sk_dev->wrapped_km1_device_;
+        if (km1_dev)
+            return km1_dev->get_supported_import_formats(km1_dev, algorithm, results,
+                                                         results_length);
+
+        SupportedImportFormatsRequest request;
+        request.algorithm = algorithm;
+        SupportedImportFormatsResponse response;
+        sk_dev->impl_->SupportedImportFormats(request, &response);
+
+        if (response.error != KM_ERROR_OK) {
+            LOG_E("get_supported_import_formats failed with %d", response.error);
+            return response.error;
+        }
+        return CopyResults(response, results, results_length);
+    };
+    return sk_dev->capability_cache_->Get(
+        CapabilityCache::Query(kSupportedImportFormats, algorithm, 0), fetch, formats,
+        formats_length);
 }
 
 /* static */
@@ -578,27 +767,27 @@ keymaster_error_t SoftKeymasterDevice::get_supported_export_formats(
     if (!formats || !formats_length)
         return KM_ERROR_OUTPUT_PARAMETER_NULL;
 
-    const keymaster1_device_t* km1_dev = convert_device(dev)->wrapped_km1_device_;
-    if (km1_dev)
-        return km1_dev->get_supported_export_formats(km1_dev, algorithm, formats, formats_length);
-
-    SupportedExportFormatsRequest request;
-    request.algorithm = algorithm;
-    SupportedExportFormatsResponse response;
-    convert_device(dev)->impl_->SupportedExportFormats(request, &response);
-
-    if (response.error != KM_ERROR_OK) {
-        LOG_E("get_supported_export_formats failed with %d", response.error);
-        return response.error;
-    }
-
-    *formats_length = response.results_length;
-    *formats =
-        reinterpret_cast<keymaster_key_format_t*>(malloc(*formats_length * sizeof(**formats)));
-    if (!*formats)
-        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
-    std::copy(response.results, response.results + *formats_length, *formats);
-    return KM_ERROR_OK;
+    SoftKeymasterDevice* sk_dev = convert_device(dev);
+    auto fetch = [=](keymaster_key_format_t** results, size_t* results_length) {
+        const keymaster1_device_t* km1_dev = sk_dev->wrapped_km1_device_;
+        if (km1_dev)
+            return km1_dev->get_supported_export_formats(km1_dev, algorithm, results,
+                                                         results_length);
+
+        SupportedExportFormatsRequest request;
+        request.algorithm = algorithm;
+        SupportedExportFormatsResponse response;
+        sk_dev->impl_->SupportedExportFormats(request, &response);
+
+        if (response.error != KM_ERROR_OK) {
+            LOG_E("get_supported_export_formats failed with %d", response.error);
+            return response.error;
+        }
+        return CopyResults(response, results, results_length);
+    };
+    return sk_dev->capability_cache_->Get(
+        CapabilityCache::Query(kSupportedExportFormats, algorithm, 0), fetch, formats,
+        formats_length);
 }
 
 /* static */
@@ -616,7 +805,7 @@ keymaster_error_t SoftKeymasterDevice::configure(const keymaster2_device_t* dev,
     keymaster_error_t error =
         convert_device(dev)->context_->SetSystemVersion(os_version, os_patchlevel);
     if (error == KM_ERROR_OK)
-        convert_device(dev)->configured_ = true;
+        convert_device(dev)->configured_.store(true, std::memory_order_release);
     return error;
 }
 
@@ -652,6 +841,10 @@ keymaster_error_t SoftKeymasterDevice::add_rng_entropy(const keymaster2_device_t
     return add_rng_entropy(&sk_dev->km1_device_, data, data_length);
 }
 
+const SoftKeymasterDevice::DigestMap* SoftKeymasterDevice::km1_device_digests() const {
+    return km1_digest_probe_.get() ? km1_digest_probe_->Get() : nullptr;
+}
+
 template <typename Collection, typename Value> bool contains(const Collection& c, const Value& v) {
     return std::find(c.begin(), c.end(), v) != c.end();
 }
@@ -662,8 +855,19 @@ bool SoftKeymasterDevice::FindUnsupportedDigest(keymaster_algorithm_t algorithm,
                                                 keymaster_digest_t* unsupported) const {
     assert(wrapped_km1_device_);
 
-    auto supported_digests = km1_device_digests_.find(std::make_pair(algorithm, purpose));
-    if (supported_digests == km1_device_digests_.end())
+    const DigestMap* digests = km1_device_digests();
+    if (!digests) {
+        // Without the device's digests, digest everything in software.
+        for (auto& entry : params)
+            if (entry.tag == TAG_DIGEST) {
+                *unsupported = static_cast<keymaster_digest_t>(entry.enumerated);
+                return true;
+            }
+        return false;
+    }
+
+    auto supported_digests = digests->find(std::make_pair(algorithm, purpose));
+    if (supported_digests == digests->end())
         // Invalid algorith/purpose pair (e.g. EC encrypt).  Let the error be handled by HW module.
         return false;
 
@@ -704,6 +908,23 @@ bool SoftKeymasterDevice::RequiresSoftwareDigesting(keymaster_algorithm_t algori
     return true;
 }
 
+// True for operations that need only the public half of an RSA or EC key, which software can run
+// whether or not the key is in hardware.
+static bool IsPublicKeyOperation(keymaster_algorithm_t algorithm, keymaster_purpose_t purpose) {
+    if (algorithm != KM_ALGORITHM_RSA && algorithm != KM_ALGORITHM_EC)
+        return false;
+    return purpose == KM_PURPOSE_VERIFY || purpose == KM_PURPOSE_ENCRYPT;
+}
+
+bool SoftKeymasterDevice::IsSoftwarePublicKeyOperation(keymaster_algorithm_t algorithm,
+                                                       keymaster_purpose_t purpose) const {
+    return software_public_key_operations_ && IsPublicKeyOperation(algorithm, purpose);
+}
+
+void SoftKeymasterDevice::set_adaptive_routing(bool enabled) {
+    backend_costs_.reset(enabled ? new (std::nothrow) BackendCostTable : nullptr);
+}
+
 bool SoftKeymasterDevice::KeyRequiresSoftwareDigesting(
     const AuthorizationSet& key_description) const {
     assert(wrapped_km1_device_);
@@ -726,6 +947,10 @@ bool SoftKeymasterDevice::KeyRequiresSoftwareDigesting(
     return false;
 }
 
+static bool IsVersionTag(const keymaster_key_param_t& param) {
+    return param.tag == KM_TAG_OS_VERSION || param.tag == KM_TAG_OS_PATCHLEVEL;
+}
+
 /* static */
 keymaster_error_t SoftKeymasterDevice::generate_key(
     const keymaster1_device_t* dev, const keymaster_key_param_set_t* params,
@@ -759,12 +984,11 @@ keymaster_error_t SoftKeymasterDevice::generate_key(
 
     if (characteristics) {
         // This is a keymaster1 method, and keymaster1 doesn't include version info, so remove it.
-        response.enforced.erase(response.enforced.find(TAG_OS_VERSION));
-        response.enforced.erase(response.enforced.find(TAG_OS_PATCHLEVEL));
-        response.unenforced.erase(response.unenforced.find(TAG_OS_VERSION));
-        response.unenforced.erase(response.unenforced.find(TAG_OS_PATCHLEVEL));
+        response.enforced.RemoveIf(IsVersionTag);
+        response.unenforced.RemoveIf(IsVersionTag);
 
-        *characteristics = BuildCharacteristics(response.enforced, response.unenforced);
+        *characteristics = BuildCharacteristics(response.enforced, response.unenforced,
+                                                convert_device(dev)->packed_param_sets_);
         if (!*characteristics)
             return KM_ERROR_MEMORY_ALLOCATION_FAILED;
     }
@@ -820,8 +1044,9 @@ SoftKeymasterDevice::generate_key(const keymaster2_device_t* dev,  //
     key_blob->key_material = tmp;
 
     if (characteristics) {
-        response.enforced.CopyToParamSet(&characteristics->hw_enforced);
-        response.unenforced.CopyToParamSet(&characteristics->sw_enforced);
+        bool packed = convert_device(dev)->packed_param_sets_;
+        CopyParamSet(response.enforced, packed, &characteristics->hw_enforced);
+        CopyParamSet(response.unenforced, packed, &characteristics->sw_enforced);
     }
 
     return KM_ERROR_OK;
@@ -854,12 +1079,11 @@ keymaster_error_t SoftKeymasterDevice::get_key_characteristics(
         return response.error;
 
     // This is a keymaster1 method, and keymaster1 doesn't include version info, so remove it.
-    response.enforced.erase(response.enforced.find(TAG_OS_VERSION));
-    response.enforced.erase(response.enforced.find(TAG_OS_PATCHLEVEL));
-    response.unenforced.erase(response.unenforced.find(TAG_OS_VERSION));
-    response.unenforced.erase(response.unenforced.find(TAG_OS_PATCHLEVEL));
+    response.enforced.RemoveIf(IsVersionTag);
+    response.unenforced.RemoveIf(IsVersionTag);
 
-    *characteristics = BuildCharacteristics(response.enforced, response.unenforced);
+    *characteristics = BuildCharacteristics(response.enforced, response.unenforced,
+                                                convert_device(dev)->packed_param_sets_);
     if (!*characteristics)
         return KM_ERROR_MEMORY_ALLOCATION_FAILED;
 
@@ -903,8 +1127,8 @@ keymaster_error_t SoftKeymasterDevice::get_key_characteristics(
     if (response.error != KM_ERROR_OK)
         return response.error;
 
-    response.enforced.CopyToParamSet(&characteristics->hw_enforced);
-    response.unenforced.CopyToParamSet(&characteristics->sw_enforced);
+    CopyParamSet(response.enforced, sk_dev->packed_param_sets_, &characteristics->hw_enforced);
+    CopyParamSet(response.unenforced, sk_dev->packed_param_sets_, &characteristics->sw_enforced);
 
     return KM_ERROR_OK;
 }
@@ -949,7 +1173,8 @@ keymaster_error_t SoftKeymasterDevice::import_key(
            response.key_blob.key_material_size);
 
     if (characteristics) {
-        *characteristics = BuildCharacteristics(response.enforced, response.unenforced);
+        *characteristics = BuildCharacteristics(response.enforced, response.unenforced,
+                                                convert_device(dev)->packed_param_sets_);
         if (!*characteristics)
             return KM_ERROR_MEMORY_ALLOCATION_FAILED;
     }
@@ -1139,7 +1364,8 @@ keymaster_error_t SoftKeymasterDevice::delete_key(const keymaster1_device_t* dev
     if (!dev || !key || !key->key_material)
         return KM_ERROR_UNEXPECTED_NULL_POINTER;
 
-    KeymasterKeyBlob blob(*key);
+    convert_device(dev)->algorithm_cache_->Invalidate(*key);
+    KeymasterKeyBlob blob(*key, KeymasterKeyBlob::BORROW);
     return convert_device(dev)->context_->DeleteKey(blob);
 }
 
@@ -1152,7 +1378,8 @@ keymaster_error_t SoftKeymasterDevice::delete_key(const keymaster2_device_t* dev
     if (!convert_device(dev)->configured())
         return KM_ERROR_KEYMASTER_NOT_CONFIGURED;
 
-    KeymasterKeyBlob blob(*key);
+    convert_device(dev)->algorithm_cache_->Invalidate(*key);
+    KeymasterKeyBlob blob(*key, KeymasterKeyBlob::BORROW);
     return convert_device(dev)->context_->DeleteKey(blob);
 }
 
@@ -1161,6 +1388,7 @@ keymaster_error_t SoftKeymasterDevice::delete_all_keys(const keymaster1_device_t
     if (!dev)
         return KM_ERROR_UNEXPECTED_NULL_POINTER;
 
+    convert_device(dev)->algorithm_cache_->Clear();
     return convert_device(dev)->context_->DeleteAllKeys();
 }
 
@@ -1172,6 +1400,7 @@ keymaster_error_t SoftKeymasterDevice::delete_all_keys(const keymaster2_device_t
     if (!convert_device(dev)->configured())
         return KM_ERROR_KEYMASTER_NOT_CONFIGURED;
 
+    convert_device(dev)->algorithm_cache_->Clear();
     return convert_device(dev)->context_->DeleteAllKeys();
 }
 
@@ -1188,47 +1417,63 @@ keymaster_error_t SoftKeymasterDevice::begin(const keymaster1_device_t* dev,
     if (!operation_handle)
         return KM_ERROR_OUTPUT_PARAMETER_NULL;
 
-    const keymaster1_device_t* km1_dev = convert_device(dev)->wrapped_km1_device_;
+    SoftKeymasterDevice* sk_dev = convert_device(dev);
+    const keymaster1_device_t* km1_dev = sk_dev->wrapped_km1_device_;
+    // Set if the cost table chose the backend, so the operation's cost should be sampled.
+    BackendCostTable* backend_costs = nullptr;
+    BackendCostTable::Key cost_key;
+    uint64_t start = 0;
     if (km1_dev) {
         AuthorizationSet in_params_set(*in_params);
 
         keymaster_algorithm_t algorithm = KM_ALGORITHM_AES;
-        keymaster_error_t error = GetAlgorithm(km1_dev, *key, in_params_set, &algorithm);
-        if (error != KM_ERROR_OK)
-            return error;
+        uint32_t key_size = 0;
+        LoadedKeyCache::Lookup lookup;
+        LoadedKeyCache::ComputeLookup(*key, in_params_set, &lookup);
+        AlgorithmCache* algorithm_cache = sk_dev->algorithm_cache_.get();
+        if (!algorithm_cache->Find(lookup, &algorithm, &key_size)) {
+            keymaster_error_t error =
+                GetAlgorithm(km1_dev, *key, in_params_set, &algorithm, &key_size);
+            if (error != KM_ERROR_OK)
+                return error;
+            algorithm_cache->Insert(lookup, algorithm, key_size);
+        }
 
-        if (!convert_device(dev)->RequiresSoftwareDigesting(algorithm, purpose, in_params_set)) {
-            LOG_D("Operation supported by %s, passing through to keymaster1 module",
+        if (sk_dev->IsSoftwarePublicKeyOperation(algorithm, purpose)) {
+            LOG_D("Doing public key operation in software for keymaster1 module %s",
+                  km1_dev->common.module->name);
+        } else if (!sk_dev->RequiresSoftwareDigesting(algorithm, purpose, in_params_set)) {
+            BackendCostTable::Backend backend = BackendCostTable::HARDWARE;
+            if (sk_dev->backend_costs_.get() && IsPublicKeyOperation(algorithm, purpose)) {
+                backend_costs = sk_dev->backend_costs_.get();
+                cost_key = BackendCostTable::Key(algorithm, purpose, key_size);
+                backend = backend_costs->Choose(cost_key);
+                start = LatencyStatistics::NowMicroseconds();
+            }
+            if (backend == BackendCostTable::HARDWARE) {
+                LOG_D("Operation supported by %s, passing through to keymaster1 module",
+                      km1_dev->common.module->name);
+                keymaster_error_t error = km1_dev->begin(km1_dev, purpose, key, in_params,
+                                                         out_params, operation_handle);
+                if (backend_costs && error == KM_ERROR_OK)
+                    backend_costs->Begin(*operation_handle, cost_key, backend,
+                                         LatencyStatistics::NowMicroseconds() - start);
+                return error;
+            }
+            LOG_D("Cost table chose software over keymaster1 module %s",
+                  km1_dev->common.module->name);
+        } else {
+            LOG_I("Doing software digesting for keymaster1 module %s",
                   km1_dev->common.module->name);
-            return km1_dev->begin(km1_dev, purpose, key, in_params, out_params, operation_handle);
         }
-        LOG_I("Doing software digesting for keymaster1 module %s", km1_dev->common.module->name);
-    }
-
-    if (out_params) {
-        out_params->params = nullptr;
-        out_params->length = 0;
-    }
-
-    BeginOperationRequest request;
-    request.purpose = purpose;
-    request.SetKeyMaterial(*key);
-    request.additional_params.Reinitialize(*in_params);
-
-    BeginOperationResponse response;
-    convert_device(dev)->impl_->BeginOperation(request, &response);
-    if (response.error != KM_ERROR_OK)
-        return response.error;
-
-    if (response.output_params.size() > 0) {
-        if (out_params)
-            response.output_params.CopyToParamSet(out_params);
-        else
-            return KM_ERROR_OUTPUT_PARAMETER_NULL;
     }
 
-    *operation_handle = response.op_handle;
-    return KM_ERROR_OK;
+    keymaster_error_t error =
+        sk_dev->BeginSoftwareOperation(purpose, *key, in_params, out_params, operation_handle);
+    if (backend_costs && error == KM_ERROR_OK)
+        backend_costs->Begin(*operation_handle, cost_key, BackendCostTable::SOFTWARE,
+                             LatencyStatistics::NowMicroseconds() - start);
+    return error;
 }
 
 /* static */
@@ -1241,11 +1486,33 @@ keymaster_error_t SoftKeymasterDevice::begin(const keymaster2_device_t* dev,
     if (!dev)
         return KM_ERROR_UNEXPECTED_NULL_POINTER;
 
-    if (!convert_device(dev)->configured())
+    SoftKeymasterDevice* sk_dev = convert_device(dev);
+    if (!sk_dev->configured())
         return KM_ERROR_KEYMASTER_NOT_CONFIGURED;
 
-    SoftKeymasterDevice* sk_dev = convert_device(dev);
-    return begin(&sk_dev->km1_device_, purpose, key, in_params, out_params, operation_handle);
+    // Only a wrapped keymaster1 device needs the keymaster1 path's routing.
+    if (sk_dev->wrapped_km1_device_)
+        return begin(&sk_dev->km1_device_, purpose, key, in_params, out_params, operation_handle);
+
+    if (!key || !key->key_material)
+        return KM_ERROR_UNEXPECTED_NULL_POINTER;
+    if (!operation_handle)
+        return KM_ERROR_OUTPUT_PARAMETER_NULL;
+    return sk_dev->BeginSoftwareOperation(purpose, *key, in_params, out_params, operation_handle);
+}
+
+// Copies operation output into memory the caller must free.
+static keymaster_error_t ReturnOutput(const Buffer& data, keymaster_blob_t* output) {
+    if (!output)
+        return data.available_read() > 0 ? KM_ERROR_OUTPUT_PARAMETER_NULL : KM_ERROR_OK;
+
+    output->data_length = data.available_read();
+    uint8_t* tmp = reinterpret_cast<uint8_t*>(malloc(output->data_length));
+    if (!tmp)
+        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    memcpy(tmp, data.peek_read(), output->data_length);
+    output->data = tmp;
+    return KM_ERROR_OK;
 }
 
 /* static */
@@ -1255,6 +1522,30 @@ keymaster_error_t SoftKeymasterDevice::update(const keymaster1_device_t* dev,
                                               const keymaster_blob_t* input, size_t* input_consumed,
                                               keymaster_key_param_set_t* out_params,
                                               keymaster_blob_t* output) {
+    BackendCostTable* backend_costs = convert_device(dev)->backend_costs_.get();
+    if (!backend_costs)
+        return update_untimed(dev, operation_handle, in_params, input, input_consumed, out_params,
+                              output);
+
+    uint64_t start = LatencyStatistics::NowMicroseconds();
+    keymaster_error_t error = update_untimed(dev, operation_handle, in_params, input,
+                                             input_consumed, out_params, output);
+    // Any error ends the operation.
+    if (error == KM_ERROR_OK)
+        backend_costs->Update(operation_handle, LatencyStatistics::NowMicroseconds() - start);
+    else
+        backend_costs->Abandon(operation_handle);
+    return error;
+}
+
+/* static */
+keymaster_error_t SoftKeymasterDevice::update_untimed(const keymaster1_device_t* dev,
+                                                      keymaster_operation_handle_t operation_handle,
+                                                      const keymaster_key_param_set_t* in_params,
+                                                      const keymaster_blob_t* input,
+                                                      size_t* input_consumed,
+                                                      keymaster_key_param_set_t* out_params,
+                                                      keymaster_blob_t* output) {
     if (!input)
         return KM_ERROR_UNEXPECTED_NULL_POINTER;
 
@@ -1270,46 +1561,18 @@ keymaster_error_t SoftKeymasterDevice::update(const keymaster1_device_t* dev,
                                out_params, output);
     }
 
-    if (out_params) {
-        out_params->params = nullptr;
-        out_params->length = 0;
-    }
     if (output) {
         output->data = nullptr;
         output->data_length = 0;
     }
 
-    UpdateOperationRequest request;
-    request.op_handle = operation_handle;
-    if (input)
-        request.input.Reinitialize(input->data, input->data_length);
-    if (in_params)
-        request.additional_params.Reinitialize(*in_params);
-
     UpdateOperationResponse response;
-    convert_device(dev)->impl_->UpdateOperation(request, &response);
-    if (response.error != KM_ERROR_OK)
-        return response.error;
-
-    if (response.output_params.size() > 0) {
-        if (out_params)
-            response.output_params.CopyToParamSet(out_params);
-        else
-            return KM_ERROR_OUTPUT_PARAMETER_NULL;
-    }
+    keymaster_error_t error = convert_device(dev)->UpdateSoftwareOperation(
+        operation_handle, in_params, *input, input_consumed, out_params, &response);
+    if (error != KM_ERROR_OK)
+        return error;
 
-    *input_consumed = response.input_consumed;
-    if (output) {
-        output->data_length = response.output.available_read();
-        uint8_t* tmp = reinterpret_cast<uint8_t*>(malloc(output->data_length));
-        if (!tmp)
-            return KM_ERROR_MEMORY_ALLOCATION_FAILED;
-        memcpy(tmp, response.output.peek_read(), output->data_length);
-        output->data = tmp;
-    } else if (response.output.available_read() > 0) {
-        return KM_ERROR_OUTPUT_PARAMETER_NULL;
-    }
-    return KM_ERROR_OK;
+    return ReturnOutput(response.output, output);
 }
 
 /* static */
@@ -1322,12 +1585,29 @@ keymaster_error_t SoftKeymasterDevice::update(const keymaster2_device_t* dev,
     if (!dev)
         return KM_ERROR_UNEXPECTED_NULL_POINTER;
 
-    if (!convert_device(dev)->configured())
+    SoftKeymasterDevice* sk_dev = convert_device(dev);
+    if (!sk_dev->configured())
         return KM_ERROR_KEYMASTER_NOT_CONFIGURED;
 
-    SoftKeymasterDevice* sk_dev = convert_device(dev);
-    return update(&sk_dev->km1_device_, operation_handle, in_params, input, input_consumed,
-                  out_params, output);
+    if (sk_dev->wrapped_km1_device_)
+        return update(&sk_dev->km1_device_, operation_handle, in_params, input, input_consumed,
+                      out_params, output);
+
+    if (!input)
+        return KM_ERROR_UNEXPECTED_NULL_POINTER;
+    if (!input_consumed)
+        return KM_ERROR_OUTPUT_PARAMETER_NULL;
+    if (output) {
+        output->data = nullptr;
+        output->data_length = 0;
+    }
+
+    UpdateOperationResponse response;
+    keymaster_error_t error = sk_dev->UpdateSoftwareOperation(
+        operation_handle, in_params, *input, input_consumed, out_params, &response);
+    if (error != KM_ERROR_OK)
+        return error;
+    return ReturnOutput(response.output, output);
 }
 
 /* static */
@@ -1337,6 +1617,27 @@ keymaster_error_t SoftKeymasterDevice::finish(const keymaster1_device_t* dev,
                                               const keymaster_blob_t* signature,
                                               keymaster_key_param_set_t* out_params,
                                               keymaster_blob_t* output) {
+    BackendCostTable* backend_costs = convert_device(dev)->backend_costs_.get();
+    if (!backend_costs)
+        return finish_untimed(dev, operation_handle, params, signature, out_params, output);
+
+    uint64_t start = LatencyStatistics::NowMicroseconds();
+    keymaster_error_t error =
+        finish_untimed(dev, operation_handle, params, signature, out_params, output);
+    if (error == KM_ERROR_OK)
+        backend_costs->Finish(operation_handle, LatencyStatistics::NowMicroseconds() - start);
+    else
+        backend_costs->Abandon(operation_handle);
+    return error;
+}
+
+/* static */
+keymaster_error_t SoftKeymasterDevice::finish_untimed(const keymaster1_device_t* dev,
+                                                      keymaster_operation_handle_t operation_handle,
+                                                      const keymaster_key_param_set_t* params,
+                                                      const keymaster_blob_t* signature,
+                                                      keymaster_key_param_set_t* out_params,
+                                                      keymaster_blob_t* output) {
     const keymaster1_device_t* km1_dev = convert_device(dev)->wrapped_km1_device_;
     if (km1_dev && !convert_device(dev)->impl_->has_operation(operation_handle)) {
         // This operation is being handled by km1_dev (or doesn't exist).  Pass it through to
@@ -1345,9 +1646,40 @@ keymaster_error_t SoftKeymasterDevice::finish(const keymaster1_device_t* dev,
         return km1_dev->finish(km1_dev, operation_handle, params, signature, out_params, output);
     }
 
-    if (out_params) {
-        out_params->params = nullptr;
-        out_params->length = 0;
+    if (output) {
+        output->data = nullptr;
+        output->data_length = 0;
+    }
+
+    FinishOperationResponse response;
+    keymaster_error_t error = convert_device(dev)->FinishSoftwareOperation(
+        operation_handle, params, nullptr /* input */, signature, out_params, &response);
+    if (error != KM_ERROR_OK)
+        return error;
+
+    return ReturnOutput(response.output, output);
+}
+
+/* static */
+keymaster_error_t SoftKeymasterDevice::finish(const keymaster2_device_t* dev,
+                                              keymaster_operation_handle_t operation_handle,
+                                              const keymaster_key_param_set_t* params,
+                                              const keymaster_blob_t* input,
+                                              const keymaster_blob_t* signature,
+                                              keymaster_key_param_set_t* out_params,
+                                              keymaster_blob_t* output) {
+    if (!dev)
+        return KM_ERROR_UNEXPECTED_NULL_POINTER;
+
+    SoftKeymasterDevice* sk_dev = convert_device(dev);
+    if (!sk_dev->configured())
+        return KM_ERROR_KEYMASTER_NOT_CONFIGURED;
+
+    if (sk_dev->wrapped_km1_device_) {
+        if (input && input->data)
+            return KM_ERROR_UNIMPLEMENTED;  // TODO(swillden): Implement this
+        return finish(&sk_dev->km1_device_, operation_handle, params, signature, out_params,
+                      output);
     }
 
     if (output) {
@@ -1355,61 +1687,214 @@ keymaster_error_t SoftKeymasterDevice::finish(const keymaster1_device_t* dev,
         output->data_length = 0;
     }
 
-    FinishOperationRequest request;
-    request.op_handle = operation_handle;
-    if (signature && signature->data_length > 0)
-        request.signature.Reinitialize(signature->data, signature->data_length);
-    request.additional_params.Reinitialize(*params);
+    FinishOperationResponse response;
+    keymaster_error_t error = sk_dev->FinishSoftwareOperation(operation_handle, params, input,
+                                                              signature, out_params, &response);
+    if (error != KM_ERROR_OK)
+        return error;
+    return ReturnOutput(response.output, output);
+}
+
+// Moves operation output that didn't get written in place into the caller's buffer, if it fits.
+static keymaster_error_t PlaceOutput(const uint8_t* data, size_t data_length, uint8_t* output,
+                                     size_t output_capacity, size_t* output_length) {
+    if (data_length > output_capacity)
+        return KM_ERROR_INSUFFICIENT_BUFFER_SPACE;
+    if (data != output && data_length > 0)
+        memmove(output, data, data_length);
+    *output_length = data_length;
+    return KM_ERROR_OK;
+}
+
+keymaster_error_t SoftKeymasterDevice::UpdateInto(keymaster_operation_handle_t operation_handle,
+                                                  const keymaster_key_param_set_t* in_params,
+                                                  const keymaster_blob_t* input,
+                                                  size_t* input_consumed,
+                                                  keymaster_key_param_set_t* out_params,
+                                                  uint8_t* output, size_t output_capacity,
+                                                  size_t* output_length) {
+    if (!configured())
+        return KM_ERROR_KEYMASTER_NOT_CONFIGURED;
+
+    if (!input || (!output && output_capacity > 0))
+        return KM_ERROR_UNEXPECTED_NULL_POINTER;
+
+    if (!input_consumed || !output_length)
+        return KM_ERROR_OUTPUT_PARAMETER_NULL;
+    *output_length = 0;
+
+    const keymaster1_device_t* km1_dev = wrapped_km1_device_;
+    if (km1_dev && !impl_->has_operation(operation_handle)) {
+        // Handled by km1_dev, which can only return output in memory of its own.
+        keymaster_blob_t km1_output = {nullptr, 0};
+        keymaster_error_t error = km1_dev->update(km1_dev, operation_handle, in_params, input,
+                                                  input_consumed, out_params, &km1_output);
+        if (error == KM_ERROR_OK)
+            error = PlaceOutput(km1_output.data, km1_output.data_length, output, output_capacity,
+                                output_length);
+        free(const_cast<uint8_t*>(km1_output.data));
+        if (error == KM_ERROR_INSUFFICIENT_BUFFER_SPACE)
+            km1_dev->abort(km1_dev, operation_handle);
+        return error;
+    }
+
+    UpdateOperationResponse response;
+    response.output.BorrowForWriting(output, output_capacity);
+    keymaster_error_t error = UpdateSoftwareOperation(operation_handle, in_params, *input,
+                                                      input_consumed, out_params, &response);
+    if (error != KM_ERROR_OK)
+        return error;
+
+    error = PlaceOutput(response.output.peek_read(), response.output.available_read(), output,
+                        output_capacity, output_length);
+    if (error != KM_ERROR_OK) {
+        // The output is lost, so the operation can't continue.
+        AbortOperationRequest request;
+        request.op_handle = operation_handle;
+        AbortOperationResponse abort_response;
+        impl_->AbortOperation(request, &abort_response);
+    }
+    return error;
+}
+
+keymaster_error_t SoftKeymasterDevice::FinishInto(keymaster_operation_handle_t operation_handle,
+                                                  const keymaster_key_param_set_t* params,
+                                                  const keymaster_blob_t* signature,
+                                                  keymaster_key_param_set_t* out_params,
+                                                  uint8_t* output, size_t output_capacity,
+                                                  size_t* output_length) {
+    if (!configured())
+        return KM_ERROR_KEYMASTER_NOT_CONFIGURED;
+
+    if (!params || (!output && output_capacity > 0))
+        return KM_ERROR_UNEXPECTED_NULL_POINTER;
+
+    if (!output_length)
+        return KM_ERROR_OUTPUT_PARAMETER_NULL;
+    *output_length = 0;
+
+    const keymaster1_device_t* km1_dev = wrapped_km1_device_;
+    if (km1_dev && !impl_->has_operation(operation_handle)) {
+        keymaster_blob_t km1_output = {nullptr, 0};
+        keymaster_error_t error =
+            km1_dev->finish(km1_dev, operation_handle, params, signature, out_params, &km1_output);
+        if (error == KM_ERROR_OK)
+            error = PlaceOutput(km1_output.data, km1_output.data_length, output, output_capacity,
+                                output_length);
+        free(const_cast<uint8_t*>(km1_output.data));
+        return error;
+    }
 
     FinishOperationResponse response;
-    convert_device(dev)->impl_->FinishOperation(request, &response);
+    response.output.BorrowForWriting(output, output_capacity);
+    keymaster_error_t error =
+        FinishSoftwareOperation(operation_handle, params, nullptr /* input */, signature,
+                                out_params, &response);
+    if (error != KM_ERROR_OK)
+        return error;
+
+    return PlaceOutput(response.output.peek_read(), response.output.available_read(), output,
+                       output_capacity, output_length);
+}
+
+keymaster_error_t SoftKeymasterDevice::BeginSoftwareOperation(
+    keymaster_purpose_t purpose, const keymaster_key_blob_t& key,
+    const keymaster_key_param_set_t* in_params, keymaster_key_param_set_t* out_params,
+    keymaster_operation_handle_t* operation_handle) {
+    if (out_params) {
+        out_params->params = nullptr;
+        out_params->length = 0;
+    }
+
+    BeginOperationRequest request;
+    request.purpose = purpose;
+    request.SetKeyMaterial(key);
+    if (in_params)
+        request.additional_params.Reinitialize(*in_params);
+
+    BeginOperationResponse response;
+    impl_->BeginOperation(request, &response);
     if (response.error != KM_ERROR_OK)
         return response.error;
 
     if (response.output_params.size() > 0) {
         if (out_params)
-            response.output_params.CopyToParamSet(out_params);
+            CopyParamSet(response.output_params, packed_param_sets_, out_params);
         else
             return KM_ERROR_OUTPUT_PARAMETER_NULL;
     }
-    if (output) {
-        output->data_length = response.output.available_read();
-        uint8_t* tmp = reinterpret_cast<uint8_t*>(malloc(output->data_length));
-        if (!tmp)
-            return KM_ERROR_MEMORY_ALLOCATION_FAILED;
-        memcpy(tmp, response.output.peek_read(), output->data_length);
-        output->data = tmp;
-    } else if (response.output.available_read() > 0) {
-        return KM_ERROR_OUTPUT_PARAMETER_NULL;
+
+    *operation_handle = response.op_handle;
+    return KM_ERROR_OK;
+}
+
+keymaster_error_t SoftKeymasterDevice::UpdateSoftwareOperation(
+    keymaster_operation_handle_t operation_handle, const keymaster_key_param_set_t* in_params,
+    const keymaster_blob_t& input, size_t* input_consumed, keymaster_key_param_set_t* out_params,
+    UpdateOperationResponse* response) {
+    if (out_params) {
+        out_params->params = nullptr;
+        out_params->length = 0;
+    }
+
+    UpdateOperationRequest request;
+    request.op_handle = operation_handle;
+    request.input.Borrow(input.data, input.data_length);
+    if (in_params)
+        request.additional_params.Reinitialize(*in_params);
+
+    impl_->UpdateOperation(request, response);
+    if (response->error != KM_ERROR_OK)
+        return response->error;
+
+    if (response->output_params.size() > 0) {
+        if (out_params)
+            CopyParamSet(response->output_params, packed_param_sets_, out_params);
+        else
+            return KM_ERROR_OUTPUT_PARAMETER_NULL;
     }
 
+    *input_consumed = response->input_consumed;
     return KM_ERROR_OK;
 }
 
-/* static */
-keymaster_error_t SoftKeymasterDevice::finish(const keymaster2_device_t* dev,
-                                              keymaster_operation_handle_t operation_handle,
-                                              const keymaster_key_param_set_t* params,
-                                              const keymaster_blob_t* input,
-                                              const keymaster_blob_t* signature,
-                                              keymaster_key_param_set_t* out_params,
-                                              keymaster_blob_t* output) {
-    if (!dev)
-        return KM_ERROR_UNEXPECTED_NULL_POINTER;
+keymaster_error_t SoftKeymasterDevice::FinishSoftwareOperation(
+    keymaster_operation_handle_t operation_handle, const keymaster_key_param_set_t* params,
+    const keymaster_blob_t* input, const keymaster_blob_t* signature,
+    keymaster_key_param_set_t* out_params, FinishOperationResponse* response) {
+    if (out_params) {
+        out_params->params = nullptr;
+        out_params->length = 0;
+    }
 
-    if (!convert_device(dev)->configured())
-        return KM_ERROR_KEYMASTER_NOT_CONFIGURED;
+    FinishOperationRequest request;
+    request.op_handle = operation_handle;
+    if (input && input->data_length > 0)
+        request.input.Borrow(input->data, input->data_length);
+    if (signature && signature->data_length > 0)
+        request.signature.Borrow(signature->data, signature->data_length);
+    if (params)
+        request.additional_params.Reinitialize(*params);
 
-    if (input && input->data)
-        return KM_ERROR_UNIMPLEMENTED;  // TODO(swillden): Implement this
+    impl_->FinishOperation(request, response);
+    if (response->error != KM_ERROR_OK)
+        return response->error;
 
-    SoftKeymasterDevice* sk_dev = convert_device(dev);
-    return finish(&sk_dev->km1_device_, operation_handle, params, signature, out_params, output);
+    if (response->output_params.size() > 0) {
+        if (out_params)
+            CopyParamSet(response->output_params, packed_param_sets_, out_params);
+        else
+            return KM_ERROR_OUTPUT_PARAMETER_NULL;
+    }
+    return KM_ERROR_OK;
 }
 
 /* static */
 keymaster_error_t SoftKeymasterDevice::abort(const keymaster1_device_t* dev,
                                              keymaster_operation_handle_t operation_handle) {
+    if (convert_device(dev)->backend_costs_.get())
+        convert_device(dev)->backend_costs_->Abandon(operation_handle);
+
     const keymaster1_device_t* km1_dev = convert_device(dev)->wrapped_km1_device_;
     if (km1_dev && !convert_device(dev)->impl_->has_operation(operation_handle)) {
         // This operation is being handled by km1_dev (or doesn't exist).  Pass it through to
@@ -1431,11 +1916,18 @@ keymaster_error_t SoftKeymasterDevice::abort(const keymaster2_device_t* dev,
     if (!dev)
         return KM_ERROR_UNEXPECTED_NULL_POINTER;
 
-    if (!convert_device(dev)->configured())
+    SoftKeymasterDevice* sk_dev = convert_device(dev);
+    if (!sk_dev->configured())
         return KM_ERROR_KEYMASTER_NOT_CONFIGURED;
 
-    SoftKeymasterDevice* sk_dev = convert_device(dev);
-    return abort(&sk_dev->km1_device_, operation_handle);
+    if (sk_dev->wrapped_km1_device_)
+        return abort(&sk_dev->km1_device_, operation_handle);
+
+    AbortOperationRequest request;
+    request.op_handle = operation_handle;
+    AbortOperationResponse response;
+    sk_dev->impl_->AbortOperation(request, &response);
+    return response.error;
 }
 
 /* static */
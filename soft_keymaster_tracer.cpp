@@ -0,0 +1,32 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <keymaster/soft_keymaster_tracer.h>
+
+#define ATRACE_TAG ATRACE_TAG_HAL
+#include <cutils/trace.h>
+
+namespace keymaster {
+
+void SoftKeymasterTracer::begin_span(const char* name) const {
+    ATRACE_BEGIN(name);
+}
+
+void SoftKeymasterTracer::end_span() const {
+    ATRACE_END();
+}
+
+}  // namespace keymaster
@@ -28,6 +28,7 @@
 #include "aes_key.h"
 #include "hmac_key.h"
 #include "openssl_err.h"
+#include "secure_arena.h"
 
 namespace keymaster {
 
@@ -110,13 +111,13 @@ SymmetricKeyFactory::SupportedImportFormats(size_t* format_count) const {
 SymmetricKey::SymmetricKey(const KeymasterKeyBlob& key_material,
                            const AuthorizationSet& hw_enforced, const AuthorizationSet& sw_enforced,
                            keymaster_error_t* error)
-    : Key(hw_enforced, sw_enforced, error) {
+    : Key(hw_enforced, sw_enforced, error), key_data_size_(0), key_data_(nullptr) {
     if (*error != KM_ERROR_OK)
         return;
 
-    uint8_t* tmp = dup_buffer(key_material.key_material, key_material.key_material_size);
-    if (tmp) {
-        key_data_.reset(tmp);
+    key_data_ = AllocateSecret(key_material.key_material_size);
+    if (key_data_) {
+        memcpy(key_data_, key_material.key_material, key_material.key_material_size);
         key_data_size_ = key_material.key_material_size;
         *error = KM_ERROR_OK;
     } else {
@@ -125,7 +126,7 @@ SymmetricKey::SymmetricKey(const KeymasterKeyBlob& key_material,
 }
 
 SymmetricKey::~SymmetricKey() {
-    memset_s(key_data_.get(), 0, key_data_size_);
+    FreeSecret(key_data_, key_data_size_);
 }
 
 keymaster_error_t SymmetricKey::key_material(UniquePtr<uint8_t[]>* key_material,
@@ -134,7 +135,7 @@ keymaster_error_t SymmetricKey::key_material(UniquePtr<uint8_t[]>* key_material,
     key_material->reset(new (std::nothrow) uint8_t[*size]);
     if (!key_material->get())
         return KM_ERROR_MEMORY_ALLOCATION_FAILED;
-    memcpy(key_material->get(), key_data_.get(), *size);
+    memcpy(key_material->get(), key_data_, *size);
     return KM_ERROR_OK;
 }
 
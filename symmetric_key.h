@@ -64,16 +64,23 @@ class SymmetricKey : public Key {
         return KM_ERROR_UNSUPPORTED_KEY_FORMAT;
     }
 
-    const uint8_t* key_data() const { return key_data_.get(); }
+    const uint8_t* key_data() const { return key_data_; }
     size_t key_data_size() const { return key_data_size_; }
 
   protected:
     SymmetricKey(const KeymasterKeyBlob& key_material, const AuthorizationSet& hw_enforced,
                  const AuthorizationSet& sw_enforced, keymaster_error_t* error);
 
+    size_t material_bytes() const override { return key_data_size_; }
+
   private:
     size_t key_data_size_;
-    UniquePtr<uint8_t[]> key_data_;
+    // From AllocateSecret().
+    uint8_t* key_data_;
+
+    // Disallow copying and assignment.
+    SymmetricKey(const SymmetricKey&);
+    void operator=(const SymmetricKey&);
 };
 
 }  // namespace keymaster
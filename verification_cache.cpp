@@ -0,0 +1,113 @@
+/*
+ * Copyright 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "verification_cache.h"
+
+#include <keymaster/serializable.h>
+
+namespace keymaster {
+
+/* static */
+void VerificationCache::ComputeEntry(const Digest& key_digest, keymaster_digest_t digest,
+                                     keymaster_padding_t padding, const Digest& message_digest,
+                                     const uint8_t* signature, size_t signature_length,
+                                     Digest* entry) {
+    uint32_t params[] = {static_cast<uint32_t>(digest), static_cast<uint32_t>(padding)};
+    uint64_t length = signature_length;
+    SHA256_CTX ctx;
+    SHA256_Init(&ctx);
+    SHA256_Update(&ctx, key_digest.data(), key_digest.size());
+    SHA256_Update(&ctx, params, sizeof(params));
+    SHA256_Update(&ctx, message_digest.data(), message_digest.size());
+    SHA256_Update(&ctx, &length, sizeof(length));
+    SHA256_Update(&ctx, signature, signature_length);
+    SHA256_Final(entry->data(), &ctx);
+}
+
+bool VerificationCache::Contains(const Digest& entry) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto found = index_.find(entry);
+    if (found == index_.end())
+        return false;
+    entries_.splice(entries_.begin(), entries_, found->second);
+    ++hits_;
+    return true;
+}
+
+void VerificationCache::Insert(const Digest& entry) {
+    if (max_entries_ == 0)
+        return;
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto found = index_.find(entry);
+    if (found != index_.end()) {
+        entries_.splice(entries_.begin(), entries_, found->second);
+        return;
+    }
+    if (entries_.size() >= max_entries_) {
+        index_.erase(entries_.back());
+        entries_.pop_back();
+    }
+    entries_.push_front(entry);
+    index_[entry] = entries_.begin();
+}
+
+size_t VerificationCache::entry_count() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return entries_.size();
+}
+
+uint64_t VerificationCache::hits() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return hits_;
+}
+
+void CachedVerification::Enable(const std::shared_ptr<VerificationCache>& cache,
+                                const VerificationCache::Digest& key_digest,
+                                keymaster_digest_t digest, keymaster_padding_t padding) {
+    cache_ = cache;
+    key_digest_ = key_digest;
+    digest_ = digest;
+    padding_ = padding;
+    Start();
+}
+
+void CachedVerification::Start() {
+    if (cache_)
+        SHA256_Init(&message_ctx_);
+}
+
+void CachedVerification::AddMessage(const uint8_t* data, size_t data_length) {
+    if (cache_)
+        SHA256_Update(&message_ctx_, data, data_length);
+}
+
+bool CachedVerification::Lookup(const Buffer& signature) {
+    if (!cache_)
+        return false;
+    VerificationCache::Digest message_digest;
+    SHA256_Final(message_digest.data(), &message_ctx_);
+    VerificationCache::ComputeEntry(key_digest_, digest_, padding_, message_digest,
+                                    signature.peek_read(), signature.available_read(), &entry_);
+    return cache_->Contains(entry_);
+}
+
+void CachedVerification::Record() {
+    if (cache_)
+        cache_->Insert(entry_);
+}
+
+}  // namespace keymaster
@@ -0,0 +1,137 @@
+/*
+ * Copyright 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SYSTEM_KEYMASTER_VERIFICATION_CACHE_H_
+#define SYSTEM_KEYMASTER_VERIFICATION_CACHE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <array>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+
+#include <openssl/sha.h>
+
+#include <hardware/keymaster_defs.h>
+
+namespace keymaster {
+
+class Buffer;
+
+/**
+ * VerificationCache remembers signatures that have verified, so that verifying the same signature
+ * over the same message with the same key again can skip the public-key arithmetic.
+ *
+ * Entries are SHA-256 digests of the public key, the verification parameters, a SHA-256 digest of
+ * the message and the signature, so a hit is only possible for a signature that has already
+ * verified over exactly that message, with that key and those parameters.  Only signatures that
+ * verify are added; everything else is verified in full every time.  At most max_entries are kept,
+ * and the least recently used are discarded first.  All methods are internally locked.
+ */
+class VerificationCache {
+  public:
+    typedef std::array<uint8_t, SHA256_DIGEST_LENGTH> Digest;
+
+    explicit VerificationCache(size_t max_entries) : max_entries_(max_entries), hits_(0) {}
+
+    /**
+     * Computes the entry for signature, of signature_length bytes, over a message whose SHA-256
+     * digest is message_digest, by the key whose X.509 SubjectPublicKeyInfo has SHA-256 digest
+     * key_digest, verified with digest and padding.
+     */
+    static void ComputeEntry(const Digest& key_digest, keymaster_digest_t digest,
+                             keymaster_padding_t padding, const Digest& message_digest,
+                             const uint8_t* signature, size_t signature_length, Digest* entry);
+
+    /**
+     * Returns true, and marks the entry recently used, if entry has been inserted and not yet
+     * discarded.
+     */
+    bool Contains(const Digest& entry);
+
+    /**
+     * Adds entry, for a signature that has verified, discarding the least recently used entry if
+     * the cache is full.
+     */
+    void Insert(const Digest& entry);
+
+    size_t entry_count() const;
+    // The number of times Contains() has returned true.
+    uint64_t hits() const;
+
+  private:
+    typedef std::list<Digest> EntryList;
+
+    const size_t max_entries_;
+
+    mutable std::mutex mutex_;
+    // Most recently used first.
+    EntryList entries_;
+    std::map<Digest, EntryList::iterator> index_;
+    uint64_t hits_;
+
+    // Disallow copying and assignment.
+    VerificationCache(const VerificationCache&);
+    void operator=(const VerificationCache&);
+};
+
+/**
+ * CachedVerification connects one verify operation to a VerificationCache.  The operation passes
+ * the message to AddMessage() as it arrives, calls Lookup() before verifying and, if the signature
+ * verifies, Record().  Until Enable() is called, it does nothing and Lookup() returns false.
+ */
+class CachedVerification {
+  public:
+    CachedVerification() {}
+
+    void Enable(const std::shared_ptr<VerificationCache>& cache,
+                const VerificationCache::Digest& key_digest, keymaster_digest_t digest,
+                keymaster_padding_t padding);
+    bool enabled() const { return cache_.get() != nullptr; }
+
+    // Starts a new message.
+    void Start();
+    void AddMessage(const uint8_t* data, size_t data_length);
+
+    /**
+     * Finishes the message and returns true if signature is known to verify over it.
+     */
+    bool Lookup(const Buffer& signature);
+
+    /**
+     * Adds the signature given to the last Lookup() to the cache.
+     */
+    void Record();
+
+  private:
+    std::shared_ptr<VerificationCache> cache_;
+    VerificationCache::Digest key_digest_;
+    keymaster_digest_t digest_;
+    keymaster_padding_t padding_;
+    SHA256_CTX message_ctx_;
+    VerificationCache::Digest entry_;
+
+    // Disallow copying and assignment.
+    CachedVerification(const CachedVerification&);
+    void operator=(const CachedVerification&);
+};
+
+}  // namespace keymaster
+
+#endif  // SYSTEM_KEYMASTER_VERIFICATION_CACHE_H_
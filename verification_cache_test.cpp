@@ -0,0 +1,162 @@
+/*
+ * Copyright 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <gtest/gtest.h>
+
+#include <keymaster/serializable.h>
+
+#include "verification_cache.h"
+
+namespace keymaster {
+namespace test {
+
+// Returns an entry for a distinct signature of length bytes, all set to fill.
+static VerificationCache::Digest Entry(uint8_t fill, size_t length = 64) {
+    VerificationCache::Digest key_digest;
+    VerificationCache::Digest message_digest;
+    key_digest.fill(1);
+    message_digest.fill(2);
+    uint8_t signature[256];
+    memset(signature, fill, sizeof(signature));
+    VerificationCache::Digest entry;
+    VerificationCache::ComputeEntry(key_digest, KM_DIGEST_SHA_2_256, KM_PAD_NONE, message_digest,
+                                    signature, length, &entry);
+    return entry;
+}
+
+TEST(VerificationCache, ContainsOnlyInserted) {
+    VerificationCache cache(4);
+    EXPECT_FALSE(cache.Contains(Entry(1)));
+    cache.Insert(Entry(1));
+    EXPECT_TRUE(cache.Contains(Entry(1)));
+    EXPECT_FALSE(cache.Contains(Entry(2)));
+    EXPECT_EQ(1U, cache.entry_count());
+    EXPECT_EQ(1U, cache.hits());
+}
+
+TEST(VerificationCache, EntriesDependOnEveryInput) {
+    VerificationCache::Digest key_digest;
+    VerificationCache::Digest message_digest;
+    key_digest.fill(1);
+    message_digest.fill(2);
+    uint8_t signature[64] = {};
+
+    VerificationCache::Digest base;
+    VerificationCache::ComputeEntry(key_digest, KM_DIGEST_SHA_2_256, KM_PAD_NONE, message_digest,
+                                    signature, sizeof(signature), &base);
+
+    VerificationCache::Digest entry;
+    VerificationCache::ComputeEntry(key_digest, KM_DIGEST_SHA_2_256, KM_PAD_NONE, message_digest,
+                                    signature, sizeof(signature), &entry);
+    EXPECT_TRUE(base == entry);
+
+    VerificationCache::Digest other_key = key_digest;
+    other_key[0] ^= 1;
+    VerificationCache::ComputeEntry(other_key, KM_DIGEST_SHA_2_256, KM_PAD_NONE, message_digest,
+                                    signature, sizeof(signature), &entry);
+    EXPECT_FALSE(base == entry);
+
+    VerificationCache::ComputeEntry(key_digest, KM_DIGEST_SHA_2_512, KM_PAD_NONE, message_digest,
+                                    signature, sizeof(signature), &entry);
+    EXPECT_FALSE(base == entry);
+
+    VerificationCache::ComputeEntry(key_digest, KM_DIGEST_SHA_2_256, KM_PAD_RSA_PSS,
+                                    message_digest, signature, sizeof(signature), &entry);
+    EXPECT_FALSE(base == entry);
+
+    VerificationCache::Digest other_message = message_digest;
+    other_message[31] ^= 1;
+    VerificationCache::ComputeEntry(key_digest, KM_DIGEST_SHA_2_256, KM_PAD_NONE, other_message,
+                                    signature, sizeof(signature), &entry);
+    EXPECT_FALSE(base == entry);
+
+    VerificationCache::ComputeEntry(key_digest, KM_DIGEST_SHA_2_256, KM_PAD_NONE, message_digest,
+                                    signature, sizeof(signature) - 1, &entry);
+    EXPECT_FALSE(base == entry);
+
+    signature[10] = 1;
+    VerificationCache::ComputeEntry(key_digest, KM_DIGEST_SHA_2_256, KM_PAD_NONE, message_digest,
+                                    signature, sizeof(signature), &entry);
+    EXPECT_FALSE(base == entry);
+}
+
+TEST(VerificationCache, DiscardsLeastRecentlyUsed) {
+    VerificationCache cache(2);
+    cache.Insert(Entry(1));
+    cache.Insert(Entry(2));
+    EXPECT_TRUE(cache.Contains(Entry(1)));
+    cache.Insert(Entry(3));
+
+    EXPECT_EQ(2U, cache.entry_count());
+    EXPECT_TRUE(cache.Contains(Entry(1)));
+    EXPECT_FALSE(cache.Contains(Entry(2)));
+    EXPECT_TRUE(cache.Contains(Entry(3)));
+}
+
+TEST(VerificationCache, ReinsertDoesNotDuplicate) {
+    VerificationCache cache(2);
+    cache.Insert(Entry(1));
+    cache.Insert(Entry(1));
+    EXPECT_EQ(1U, cache.entry_count());
+}
+
+TEST(VerificationCache, ZeroEntriesCachesNothing) {
+    VerificationCache cache(0);
+    cache.Insert(Entry(1));
+    EXPECT_EQ(0U, cache.entry_count());
+    EXPECT_FALSE(cache.Contains(Entry(1)));
+}
+
+TEST(CachedVerification, HitsOnlyForRecordedSignature) {
+    std::shared_ptr<VerificationCache> cache(new VerificationCache(4));
+    VerificationCache::Digest key_digest;
+    key_digest.fill(7);
+    const uint8_t message[] = "message";
+    Buffer signature(reinterpret_cast<const uint8_t*>("signature"), 9);
+    Buffer tampered(reinterpret_cast<const uint8_t*>("signaturE"), 9);
+
+    CachedVerification first;
+    first.Enable(cache, key_digest, KM_DIGEST_SHA_2_256, KM_PAD_NONE);
+    first.AddMessage(message, 3);
+    first.AddMessage(message + 3, sizeof(message) - 3);
+    EXPECT_FALSE(first.Lookup(signature));
+    first.Record();
+
+    CachedVerification second;
+    second.Enable(cache, key_digest, KM_DIGEST_SHA_2_256, KM_PAD_NONE);
+    second.AddMessage(message, sizeof(message));
+    EXPECT_TRUE(second.Lookup(signature));
+
+    second.Start();
+    second.AddMessage(message, sizeof(message));
+    EXPECT_FALSE(second.Lookup(tampered));
+
+    second.Start();
+    second.AddMessage(message, sizeof(message) - 1);
+    EXPECT_FALSE(second.Lookup(signature));
+    EXPECT_EQ(1U, cache->hits());
+}
+
+TEST(CachedVerification, DisabledNeverHits) {
+    CachedVerification verification;
+    EXPECT_FALSE(verification.enabled());
+    verification.AddMessage(reinterpret_cast<const uint8_t*>("x"), 1);
+    EXPECT_FALSE(verification.Lookup(Buffer()));
+    verification.Record();
+}
+
+}  // namespace test
+}  // namespace keymaster
@@ -0,0 +1,108 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "worker_pool.h"
+
+#include <algorithm>
+
+namespace keymaster {
+
+WorkerPool::WorkerPool(size_t thread_count) : stopping_(false) {
+    for (size_t i = 0; i < thread_count; ++i)
+        threads_.push_back(std::thread(&WorkerPool::Run, this));
+}
+
+WorkerPool::~WorkerPool() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+    }
+    loop_queued_.notify_all();
+    for (std::thread& thread : threads_)
+        thread.join();
+}
+
+void WorkerPool::ParallelFor(size_t count, const std::function<void(size_t)>& body) {
+    if (count == 0)
+        return;
+    if (count == 1 || threads_.empty()) {
+        for (size_t i = 0; i < count; ++i)
+            body(i);
+        return;
+    }
+
+    Loop loop;
+    loop.count = count;
+    loop.body = &body;
+    loop.next.store(0);
+    loop.finished = 0;
+    loop.helpers = 0;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        loops_.push_back(&loop);
+    }
+    // The caller takes one iteration itself, so at most count - 1 workers can help.
+    for (size_t i = 1; i < count && i <= threads_.size(); ++i)
+        loop_queued_.notify_one();
+
+    size_t ran = RunIterations(&loop);
+
+    std::unique_lock<std::mutex> lock(mutex_);
+    // Workers that haven't picked the loop up yet mustn't find it once it's gone.
+    std::deque<Loop*>::iterator queued = std::find(loops_.begin(), loops_.end(), &loop);
+    if (queued != loops_.end())
+        loops_.erase(queued);
+    loop.finished += ran;
+    loop.done.wait(lock, [&] { return loop.finished == count && loop.helpers == 0; });
+}
+
+size_t WorkerPool::RunIterations(Loop* loop) {
+    size_t ran = 0;
+    for (size_t i = loop->next.fetch_add(1); i < loop->count; i = loop->next.fetch_add(1)) {
+        (*loop->body)(i);
+        ++ran;
+    }
+    return ran;
+}
+
+void WorkerPool::Run() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+        if (loops_.empty()) {
+            if (stopping_)
+                return;
+            loop_queued_.wait(lock);
+            continue;
+        }
+        Loop* loop = loops_.front();
+        ++loop->helpers;
+
+        lock.unlock();
+        size_t ran = RunIterations(loop);
+        lock.lock();
+
+        loop->finished += ran;
+        --loop->helpers;
+        // Every iteration is claimed now, so no other worker needs to find the loop.
+        std::deque<Loop*>::iterator queued = std::find(loops_.begin(), loops_.end(), loop);
+        if (queued != loops_.end())
+            loops_.erase(queued);
+        if (loop->finished == loop->count && loop->helpers == 0)
+            loop->done.notify_one();
+    }
+}
+
+}  // namespace keymaster
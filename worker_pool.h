@@ -0,0 +1,81 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SYSTEM_KEYMASTER_WORKER_POOL_H_
+#define SYSTEM_KEYMASTER_WORKER_POOL_H_
+
+#include <stddef.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace keymaster {
+
+/**
+ * WorkerPool is a fixed set of threads that help callers split a loop into independent pieces.
+ * Any number of threads may call ParallelFor at once; their loops share the workers.
+ */
+class WorkerPool {
+  public:
+    /**
+     * Starts thread_count workers.  Each ParallelFor caller works on its own loop too, so a pool
+     * of N - 1 workers keeps N cores busy.
+     */
+    explicit WorkerPool(size_t thread_count);
+    ~WorkerPool();
+
+    size_t thread_count() const { return threads_.size(); }
+
+    /**
+     * Calls body(i) for each i below count, on the calling thread and any idle workers, and
+     * returns once every call has returned.  The calls happen in no particular order.
+     */
+    void ParallelFor(size_t count, const std::function<void(size_t)>& body);
+
+  private:
+    struct Loop {
+        size_t count;
+        const std::function<void(size_t)>* body;
+        std::atomic<size_t> next;
+        // Guarded by the pool's mutex_.
+        size_t finished;
+        size_t helpers;
+        std::condition_variable done;
+    };
+
+    // Runs iterations of loop until none are left unclaimed; returns how many it ran.
+    static size_t RunIterations(Loop* loop);
+    void Run();
+
+    std::mutex mutex_;
+    std::condition_variable loop_queued_;
+    std::deque<Loop*> loops_;
+    bool stopping_;
+    std::vector<std::thread> threads_;
+
+    // Disallow copying and assignment.
+    WorkerPool(const WorkerPool&);
+    void operator=(const WorkerPool&);
+};
+
+}  // namespace keymaster
+
+#endif  // SYSTEM_KEYMASTER_WORKER_POOL_H_
@@ -0,0 +1,146 @@
+/*
+ * Copyright 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "x25519_kem.h"
+
+#include <new>
+
+#include <openssl/ec.h>
+
+#include <keymaster/logger.h>
+
+#include "x25519_key_exchange.h"
+
+namespace keymaster {
+
+X25519Kem::X25519Kem(const AuthorizationSet& kem_description, keymaster_error_t* error)
+    : single_hash_mode_(false), key_bytes_to_generate_(0) {
+    keymaster_kdf_t kdf;
+    if (!kem_description.GetTagValue(TAG_KDF, &kdf)) {
+        LOG_E("X25519Kem: No KDF specified", 0);
+        *error = KM_ERROR_UNSUPPORTED_KDF;
+        return;
+    }
+    switch (kdf) {
+    case KM_KDF_RFC5869_SHA256:
+        kdf_.reset(new (std::nothrow) Rfc5869Sha256Kdf());
+        break;
+    default:
+        LOG_E("Kdf %d is unsupported", kdf);
+        *error = KM_ERROR_UNSUPPORTED_KDF;
+        return;
+    }
+    if (!kdf_.get()) {
+        *error = KM_ERROR_MEMORY_ALLOCATION_FAILED;
+        return;
+    }
+
+    if (!kem_description.GetTagValue(TAG_KEY_SIZE, &key_bytes_to_generate_)) {
+        LOG_E("%s", "X25519Kem: no key length specified");
+        *error = KM_ERROR_UNSUPPORTED_KEY_SIZE;
+        return;
+    }
+
+    single_hash_mode_ = kem_description.GetTagValue(TAG_ECIES_SINGLE_HASH_MODE);
+    *error = KM_ERROR_OK;
+}
+
+bool X25519Kem::Encrypt(const Buffer& peer_public_value, Buffer* output_clear_key,
+                        Buffer* output_encrypted_key) {
+    return Encrypt(peer_public_value.peek_read(), peer_public_value.available_read(),
+                   output_clear_key, output_encrypted_key);
+}
+
+// http://www.shoup.net/iso/std6.pdf, section 10.2.3.
+bool X25519Kem::Encrypt(const uint8_t* peer_public_value, size_t peer_public_value_len,
+                        Buffer* output_clear_key, Buffer* output_encrypted_key) {
+    // The ephemeral key is used for this encapsulation only, and destroyed when it returns.
+    UniquePtr<X25519KeyExchange> key_exchange(X25519KeyExchange::GenerateKeyExchange());
+    if (!key_exchange.get())
+        return false;
+
+    Buffer shared_secret;
+    if (!key_exchange->CalculateSharedKey(peer_public_value, peer_public_value_len,
+                                          &shared_secret)) {
+        LOG_E("X25519Kem: ECDH failed, can't obtain shared secret", 0);
+        return false;
+    }
+    if (!key_exchange->public_value(output_encrypted_key)) {
+        LOG_E("X25519Kem: Can't obtain public value", 0);
+        return false;
+    }
+    return DeriveKey(output_encrypted_key->peek_read(), output_encrypted_key->available_read(),
+                     shared_secret, output_clear_key);
+}
+
+bool X25519Kem::Decrypt(EC_KEY* private_key, const Buffer& /* encrypted_key */,
+                        Buffer* /* output_key */) {
+    EC_KEY_free(private_key);
+    LOG_E("X25519Kem: EC_KEY private keys are not X25519 keys", 0);
+    return false;
+}
+
+bool X25519Kem::Decrypt(EC_KEY* private_key, const uint8_t* /* encrypted_key */,
+                        size_t /* encrypted_key_len */, Buffer* /* output_key */) {
+    EC_KEY_free(private_key);
+    LOG_E("X25519Kem: EC_KEY private keys are not X25519 keys", 0);
+    return false;
+}
+
+bool X25519Kem::Decrypt(const uint8_t* private_key, const Buffer& encrypted_key,
+                        Buffer* output_key) {
+    return Decrypt(private_key, encrypted_key.peek_read(), encrypted_key.available_read(),
+                   output_key);
+}
+
+// http://www.shoup.net/iso/std6.pdf, section 10.2.4.
+bool X25519Kem::Decrypt(const uint8_t* private_key, const uint8_t* encrypted_key,
+                        size_t encrypted_key_len, Buffer* output_key) {
+    X25519KeyExchange key_exchange(private_key);
+
+    Buffer shared_secret;
+    if (!key_exchange.CalculateSharedKey(encrypted_key, encrypted_key_len, &shared_secret)) {
+        LOG_E("X25519Kem: ECDH failed, can't obtain shared secret", 0);
+        return false;
+    }
+    return DeriveKey(encrypted_key, encrypted_key_len, shared_secret, output_key);
+}
+
+bool X25519Kem::DeriveKey(const uint8_t* encrypted_key, size_t encrypted_key_len,
+                          const Buffer& shared_secret, Buffer* output_key) {
+    // z = C0, or is empty in single-hash mode.
+    size_t z_len = single_hash_mode_ ? 0 : encrypted_key_len;
+    Buffer actual_secret(z_len + shared_secret.available_read());
+    actual_secret.write(encrypted_key, z_len);
+    actual_secret.write(shared_secret.peek_read(), shared_secret.available_read());
+
+    if (!kdf_->Init(actual_secret.peek_read(), actual_secret.available_read(), nullptr /* salt */,
+                    0 /* salt_len */)) {
+        LOG_E("%s", "X25519Kem: KDF failed, can't derived keys");
+        return false;
+    }
+
+    output_key->Reinitialize(key_bytes_to_generate_);
+    if (!kdf_->GenerateKey(nullptr /* info */, 0 /* info_len */, output_key->peek_write(),
+                           key_bytes_to_generate_)) {
+        LOG_E("%s", "X25519Kem: KDF failed, can't derived keys");
+        return false;
+    }
+    output_key->advance_write(key_bytes_to_generate_);
+    return true;
+}
+
+}  // namespace keymaster
@@ -0,0 +1,77 @@
+/*
+ * Copyright 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SYSTEM_KEYMASTER_X25519_KEM_H_
+#define SYSTEM_KEYMASTER_X25519_KEM_H_
+
+#include "kem.h"
+
+#include <UniquePtr.h>
+
+#include <keymaster/authorization_set.h>
+
+#include "hkdf.h"
+
+namespace keymaster {
+
+/**
+ * X25519Kem is ECIES-KEM, as EciesKem implements it, over X25519 instead of a NIST curve.  It takes
+ * the same TAG_KDF, TAG_KEY_SIZE and TAG_ECIES_SINGLE_HASH_MODE description, but no TAG_EC_CURVE.
+ * The encrypted key is the 32-byte ephemeral public value.
+ *
+ * Recipient private keys are raw 32-byte X25519 keys rather than EC_KEYs, so decryption goes
+ * through the Decrypt overloads that take one; the EC_KEY overloads of the Kem interface fail.
+ */
+class X25519Kem : public Kem {
+  public:
+    X25519Kem(const AuthorizationSet& kem_description, keymaster_error_t* error);
+    ~X25519Kem() override {}
+
+    /* Kem interface. */
+    bool Encrypt(const Buffer& peer_public_value, Buffer* output_clear_key,
+                 Buffer* output_encrypted_key) override;
+    bool Encrypt(const uint8_t* peer_public_value, size_t peer_public_value_len,
+                 Buffer* output_clear_key, Buffer* output_encrypted_key) override;
+
+    bool Decrypt(EC_KEY* private_key, const Buffer& encrypted_key, Buffer* output_key) override;
+    bool Decrypt(EC_KEY* private_key, const uint8_t* encrypted_key, size_t encrypted_key_len,
+                 Buffer* output_key) override;
+
+    /**
+     * Decrypts with the kX25519KeySize-byte private key at \p private_key, which is not retained.
+     */
+    bool Decrypt(const uint8_t* private_key, const Buffer& encrypted_key, Buffer* output_key);
+    bool Decrypt(const uint8_t* private_key, const uint8_t* encrypted_key,
+                 size_t encrypted_key_len, Buffer* output_key);
+
+  private:
+    // Derives the key from the shared secret, and from the encrypted key unless in single-hash
+    // mode.
+    bool DeriveKey(const uint8_t* encrypted_key, size_t encrypted_key_len,
+                   const Buffer& shared_secret, Buffer* output_key);
+
+    UniquePtr<Rfc5869Sha256Kdf> kdf_;
+    bool single_hash_mode_;
+    uint32_t key_bytes_to_generate_;
+
+    // Disallow copying and assignment.
+    X25519Kem(const X25519Kem&);
+    void operator=(const X25519Kem&);
+};
+
+}  // namespace keymaster
+
+#endif  // SYSTEM_KEYMASTER_X25519_KEM_H_
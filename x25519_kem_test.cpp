@@ -0,0 +1,104 @@
+/*
+ * Copyright 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "x25519_kem.h"
+
+#include <gtest/gtest.h>
+
+#include <keymaster/android_keymaster_utils.h>
+
+#include "android_keymaster_test_utils.h"
+#include "x25519_key_exchange.h"
+
+namespace keymaster {
+namespace test {
+
+StdoutLogger logger;
+
+/**
+ * TestConsistency just tests that the basic key encapsulation holds, with and without single-hash
+ * mode.
+ */
+TEST(X25519Kem, TestConsistency) {
+    static const uint32_t kKeyLen = 32;
+    for (bool single_hash_mode : {true, false}) {
+        AuthorizationSetBuilder builder;
+        builder.Authorization(TAG_KDF, KM_KDF_RFC5869_SHA256).Authorization(TAG_KEY_SIZE, kKeyLen);
+        if (single_hash_mode)
+            builder.Authorization(TAG_ECIES_SINGLE_HASH_MODE);
+        AuthorizationSet kem_description(builder);
+        keymaster_error_t error;
+        X25519Kem kem(kem_description, &error);
+        ASSERT_EQ(KM_ERROR_OK, error);
+
+        UniquePtr<X25519KeyExchange> key_exchange(X25519KeyExchange::GenerateKeyExchange());
+        ASSERT_TRUE(key_exchange.get() != nullptr);
+        Buffer peer_public_value;
+        ASSERT_TRUE(key_exchange->public_value(&peer_public_value));
+
+        Buffer output_clear_key;
+        Buffer output_encrypted_key;
+        ASSERT_TRUE(kem.Encrypt(peer_public_value, &output_clear_key, &output_encrypted_key));
+        ASSERT_EQ(kKeyLen, output_clear_key.available_read());
+        ASSERT_EQ(kX25519KeySize, output_encrypted_key.available_read());
+
+        Buffer decrypted_clear_key;
+        ASSERT_TRUE(kem.Decrypt(key_exchange->private_key(), output_encrypted_key,
+                                &decrypted_clear_key));
+        ASSERT_EQ(kKeyLen, decrypted_clear_key.available_read());
+        EXPECT_EQ(0, memcmp(output_clear_key.peek_read(), decrypted_clear_key.peek_read(),
+                            output_clear_key.available_read()));
+
+        // Each encapsulation uses a fresh ephemeral key.
+        Buffer second_clear_key, second_encrypted_key;
+        ASSERT_TRUE(kem.Encrypt(peer_public_value, &second_clear_key, &second_encrypted_key));
+        EXPECT_NE(0, memcmp(output_encrypted_key.peek_read(), second_encrypted_key.peek_read(),
+                            output_encrypted_key.available_read()));
+    }
+}
+
+TEST(X25519Kem, InvalidDescription) {
+    keymaster_error_t error;
+    X25519Kem no_kdf(AuthorizationSet(AuthorizationSetBuilder().Authorization(TAG_KEY_SIZE, 32)),
+                     &error);
+    EXPECT_EQ(KM_ERROR_UNSUPPORTED_KDF, error);
+
+    X25519Kem no_key_size(
+        AuthorizationSet(AuthorizationSetBuilder().Authorization(TAG_KDF, KM_KDF_RFC5869_SHA256)),
+        &error);
+    EXPECT_EQ(KM_ERROR_UNSUPPORTED_KEY_SIZE, error);
+}
+
+TEST(X25519Kem, InvalidEncryptedKey) {
+    AuthorizationSet kem_description(AuthorizationSetBuilder()
+                                         .Authorization(TAG_KDF, KM_KDF_RFC5869_SHA256)
+                                         .Authorization(TAG_KEY_SIZE, 32));
+    keymaster_error_t error;
+    X25519Kem kem(kem_description, &error);
+    ASSERT_EQ(KM_ERROR_OK, error);
+
+    UniquePtr<X25519KeyExchange> key_exchange(X25519KeyExchange::GenerateKeyExchange());
+    ASSERT_TRUE(key_exchange.get() != nullptr);
+    uint8_t zero[kX25519KeySize] = {};
+    Buffer clear_key;
+    EXPECT_FALSE(kem.Decrypt(key_exchange->private_key(), zero, sizeof(zero), &clear_key));
+    EXPECT_FALSE(kem.Decrypt(key_exchange->private_key(), zero, sizeof(zero) - 1, &clear_key));
+    Buffer encrypted_key;
+    EXPECT_FALSE(kem.Encrypt(zero, sizeof(zero), &clear_key, &encrypted_key));
+}
+
+}  // namespace test
+}  // namespace keymaster
@@ -0,0 +1,80 @@
+/*
+ * Copyright 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "x25519_key_exchange.h"
+
+#include <string.h>
+
+#include <new>
+
+#include <openssl/curve25519.h>
+
+#include <keymaster/android_keymaster_utils.h>
+#include <keymaster/logger.h>
+
+namespace keymaster {
+
+X25519KeyExchange::X25519KeyExchange(const uint8_t* private_key) {
+    memcpy(private_key_, private_key, kX25519KeySize);
+    X25519_public_from_private(public_key_, private_key_);
+}
+
+X25519KeyExchange::~X25519KeyExchange() {
+    memset_s(private_key_, 0, sizeof(private_key_));
+}
+
+/* static */
+X25519KeyExchange* X25519KeyExchange::GenerateKeyExchange() {
+    uint8_t public_key[kX25519KeySize];
+    uint8_t private_key[kX25519KeySize];
+    X25519_keypair(public_key, private_key);
+    X25519KeyExchange* key_exchange = new (std::nothrow) X25519KeyExchange(private_key);
+    memset_s(private_key, 0, sizeof(private_key));
+    return key_exchange;
+}
+
+bool X25519KeyExchange::CalculateSharedKey(const Buffer& peer_public_value,
+                                           Buffer* out_result) const {
+    return CalculateSharedKey(peer_public_value.peek_read(), peer_public_value.available_read(),
+                              out_result);
+}
+
+bool X25519KeyExchange::CalculateSharedKey(const uint8_t* peer_public_value,
+                                           size_t peer_public_value_len,
+                                           Buffer* out_result) const {
+    if (peer_public_value_len != kX25519KeySize) {
+        LOG_E("Expected %d-byte X25519 public value, but got %d bytes", kX25519KeySize,
+              peer_public_value_len);
+        return false;
+    }
+
+    uint8_t result[kX25519KeySize];
+    // X25519 fails when the result is all zeros, i.e. the peer value has small order.
+    if (!X25519(result, private_key_, peer_public_value)) {
+        LOG_E("X25519 peer public value has small order", 0);
+        return false;
+    }
+
+    bool written = out_result->Reinitialize(result, sizeof(result));
+    memset_s(result, 0, sizeof(result));
+    return written;
+}
+
+bool X25519KeyExchange::public_value(Buffer* public_value) const {
+    return public_value->Reinitialize(public_key_, sizeof(public_key_));
+}
+
+}  // namespace keymaster
@@ -0,0 +1,69 @@
+/*
+ * Copyright 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SYSTEM_KEYMASTER_X25519_KEY_EXCHANGE_H_
+#define SYSTEM_KEYMASTER_X25519_KEY_EXCHANGE_H_
+
+#include "key_exchange.h"
+
+#include <hardware/keymaster_defs.h>
+
+namespace keymaster {
+
+const size_t kX25519KeySize = 32;
+
+/**
+ * X25519KeyExchange implements a KeyExchange using Diffie-Hellman on Curve25519 (RFC 7748).
+ * Public values and shared secrets are 32 bytes.  Every 32-byte string is a valid public value, so
+ * unlike NistCurveKeyExchange there is no point to decode or validate; the only check needed is
+ * the all-zero shared secret that small-order peer values produce.
+ */
+class X25519KeyExchange : public KeyExchange {
+  public:
+    /**
+     * Creates a key exchange for a private key, copied from the kX25519KeySize bytes at
+     * \p private_key.
+     */
+    explicit X25519KeyExchange(const uint8_t* private_key);
+    ~X25519KeyExchange() override;
+
+    /**
+     * GenerateKeyExchange generates a new key pair and returns a new key exchange object.
+     */
+    static X25519KeyExchange* GenerateKeyExchange();
+
+    /**
+     * KeyExchange interface.
+     */
+    bool CalculateSharedKey(const uint8_t* peer_public_value, size_t peer_public_value_len,
+                            Buffer* shared_key) const override;
+    bool CalculateSharedKey(const Buffer& peer_public_value, Buffer* shared_key) const override;
+    bool public_value(Buffer* public_value) const override;
+
+    const uint8_t* private_key() const { return private_key_; }
+
+  private:
+    uint8_t private_key_[kX25519KeySize];
+    uint8_t public_key_[kX25519KeySize];
+
+    // Disallow copying and assignment.
+    X25519KeyExchange(const X25519KeyExchange&);
+    void operator=(const X25519KeyExchange&);
+};
+
+}  // namespace keymaster
+
+#endif  // SYSTEM_KEYMASTER_X25519_KEY_EXCHANGE_H_
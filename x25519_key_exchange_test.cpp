@@ -0,0 +1,119 @@
+/*
+ * Copyright 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "x25519_key_exchange.h"
+
+#include <gtest/gtest.h>
+
+#include <keymaster/android_keymaster_utils.h>
+
+#include "android_keymaster_test_utils.h"
+
+using std::string;
+
+namespace keymaster {
+namespace test {
+
+StdoutLogger logger;
+
+/**
+ * SharedKey just tests that the basic key exchange identity holds: that both
+ * parties end up with the same key.
+ */
+TEST(X25519KeyExchange, SharedKey) {
+    for (size_t j = 0; j < 5; j++) {
+        UniquePtr<X25519KeyExchange> alice_keyex(X25519KeyExchange::GenerateKeyExchange());
+        UniquePtr<X25519KeyExchange> bob_keyex(X25519KeyExchange::GenerateKeyExchange());
+        ASSERT_TRUE(alice_keyex.get() != nullptr);
+        ASSERT_TRUE(bob_keyex.get() != nullptr);
+
+        Buffer alice_public_value;
+        ASSERT_TRUE(alice_keyex->public_value(&alice_public_value));
+        Buffer bob_public_value;
+        ASSERT_TRUE(bob_keyex->public_value(&bob_public_value));
+        EXPECT_EQ(kX25519KeySize, alice_public_value.available_read());
+
+        Buffer alice_shared, bob_shared;
+        ASSERT_TRUE(alice_keyex->CalculateSharedKey(bob_public_value, &alice_shared));
+        ASSERT_TRUE(bob_keyex->CalculateSharedKey(alice_public_value, &bob_shared));
+        ASSERT_EQ(kX25519KeySize, alice_shared.available_read());
+        EXPECT_EQ(alice_shared.available_read(), bob_shared.available_read());
+        EXPECT_EQ(0, memcmp(alice_shared.peek_read(), bob_shared.peek_read(),
+                            alice_shared.available_read()));
+    }
+}
+
+/**
+ * Peer values must be 32 bytes, and small-order ones, which give an all-zero shared secret, are
+ * rejected.
+ */
+TEST(X25519KeyExchange, InvalidPublicValue) {
+    UniquePtr<X25519KeyExchange> key_exchange(X25519KeyExchange::GenerateKeyExchange());
+    ASSERT_TRUE(key_exchange.get() != nullptr);
+
+    Buffer public_value;
+    ASSERT_TRUE(key_exchange->public_value(&public_value));
+    Buffer shared_secret;
+    EXPECT_FALSE(key_exchange->CalculateSharedKey(public_value.peek_read(),
+                                                  public_value.available_read() - 1,
+                                                  &shared_secret));
+
+    // Zero, and one, both have small order.
+    uint8_t small_order[kX25519KeySize] = {};
+    EXPECT_FALSE(key_exchange->CalculateSharedKey(small_order, sizeof(small_order),
+                                                  &shared_secret));
+    small_order[0] = 1;
+    EXPECT_FALSE(key_exchange->CalculateSharedKey(small_order, sizeof(small_order),
+                                                  &shared_secret));
+}
+
+/* Test vector from RFC 7748, section 6.1. */
+static const char kAlicePrivateKey[] =
+    "77076d0a7318a57d3c16c17251b26645df4c2f87ebc0992ab177fba51db92c2a";
+static const char kAlicePublicKey[] =
+    "8520f0098930a754748b7ddcb43ef75a0dbf3a0d26381af4eba4a98eaa9b4e6a";
+static const char kBobPrivateKey[] =
+    "5dab087e624a8a4b79e17f8b83800ee66f3bb1292618b6fd1c2f8b27ff88e0eb";
+static const char kBobPublicKey[] =
+    "de9edb7d7b7dc1b4d35b61c2ece435373f8343c85b78674dadfc7e146f882b4f";
+static const char kSharedSecret[] =
+    "4a5d9d5ba4ce2de1728e3bf480350f25e07e21c947d19e3376f09b3c1e161742";
+
+static string BufferString(const Buffer& buffer) {
+    return string(reinterpret_cast<const char*>(buffer.peek_read()), buffer.available_read());
+}
+
+TEST(X25519KeyExchange, Rfc7748TestVector) {
+    string alice_private_key = hex2str(kAlicePrivateKey);
+    string bob_private_key = hex2str(kBobPrivateKey);
+    X25519KeyExchange alice_keyex(reinterpret_cast<const uint8_t*>(alice_private_key.data()));
+    X25519KeyExchange bob_keyex(reinterpret_cast<const uint8_t*>(bob_private_key.data()));
+
+    Buffer alice_public_value, bob_public_value;
+    ASSERT_TRUE(alice_keyex.public_value(&alice_public_value));
+    ASSERT_TRUE(bob_keyex.public_value(&bob_public_value));
+    EXPECT_EQ(hex2str(kAlicePublicKey), BufferString(alice_public_value));
+    EXPECT_EQ(hex2str(kBobPublicKey), BufferString(bob_public_value));
+
+    Buffer alice_shared, bob_shared;
+    ASSERT_TRUE(alice_keyex.CalculateSharedKey(bob_public_value, &alice_shared));
+    ASSERT_TRUE(bob_keyex.CalculateSharedKey(alice_public_value, &bob_shared));
+    EXPECT_EQ(hex2str(kSharedSecret), BufferString(alice_shared));
+    EXPECT_EQ(hex2str(kSharedSecret), BufferString(bob_shared));
+}
+
+}  // namespace test
+}  // namespace keymaster